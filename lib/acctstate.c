@@ -0,0 +1,805 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "defines.h"
+#include "acctstate.h"
+#include "getdef.h"
+
+/*
+ * The store is a hash table of the records, indexed by UID. The file has
+ * a header, followed by the slots of the table; a UID is found from its
+ * hash by linear probing. Only the UIDs with a record use a slot, so that
+ * the file is as large as the number of records, whatever the UIDs.
+ *
+ * Each slot has two copies of its record, with a sequence number and a
+ * checksum. An update writes the older copy: a write interrupted by a
+ * crash leaves a copy with a bad checksum, and the other copy is used.
+ * A record is thus either the old or the new one.
+ *
+ * When the table is three quarters full, it is rebuilt with twice the
+ * slots in file+, which then replaces the file. The processes which have
+ * the old file opened reopen it the next time they lock it.
+ *
+ * The store is read under a read lock, and written under a write lock
+ * of the whole file (OFD locks). The integers are in native byte order.
+ */
+
+#define ACCT_MAGIC	"shacct1"
+#define ACCT_MIN_SLOTS	64
+#define ACCT_BATCH	64	/* slots read at once by acct_state_next() */
+
+#define SLOT_EMPTY	0
+#define SLOT_USED	1
+#define SLOT_DELETED	2
+
+struct acct_header {
+	char magic[8];
+	uint32_t slot_size;	/* detects a change of the records */
+	uint32_t reserved;
+	uint64_t nslots;	/* a power of 2 */
+	uint64_t used;		/* slots used or deleted */
+};
+
+struct acct_copy {
+	uint32_t seq;		/* 0 if the copy was never written */
+	uint32_t sum;
+	struct acct_state st;
+};
+
+struct acct_slot {
+	uint32_t state;
+	uint32_t uid;
+	struct acct_copy copy[2];
+};
+
+static int acct_fd = -1;
+static bool acct_rw = false;
+static short acct_held = F_UNLCK;	/* lock taken by acct_state_lock() */
+/* Header of the store, read when it is locked. nslots is 0 for an
+ * empty store. */
+static struct acct_header header;
+
+bool acct_state_enabled (void)
+{
+	const char *file = acct_state_file ();
+
+	return (NULL != file) && ('\0' != *file);
+}
+
+/*@observer@*/ /*@null@*/const char *acct_state_file (void)
+{
+	return getdef_str ("ACCOUNT_STATE_FILE");
+}
+
+static off_t slot_offset (uint64_t n)
+{
+	return (off_t) (sizeof header + n * sizeof (struct acct_slot));
+}
+
+static uint64_t slot_hash (uid_t uid, uint64_t nslots)
+{
+	uint64_t h = (uint64_t) uid * 0x9E3779B97F4A7C15ULL;
+
+	return (h ^ (h >> 29)) & (nslots - 1);
+}
+
+static uint32_t copy_sum (uid_t uid, const struct acct_copy *copy)
+{
+	const unsigned char *p = (const unsigned char *) &copy->st;
+	uint32_t sum = 2166136261U;
+	size_t i;
+
+	sum = (sum ^ (uint32_t) uid) * 16777619U;
+	sum = (sum ^ copy->seq) * 16777619U;
+	for (i = 0; i < sizeof copy->st; i++) {
+		sum = (sum ^ p[i]) * 16777619U;
+	}
+	return sum;
+}
+
+/*
+ * valid_copy - Return the index of the newest valid copy of the record of
+ *              a used slot, or -1 if it has none.
+ */
+static int valid_copy (const struct acct_slot *slot)
+{
+	bool ok[2];
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		ok[i] =    (0 != slot->copy[i].seq)
+		        && (copy_sum (slot->uid, &slot->copy[i])
+		            == slot->copy[i].sum);
+	}
+	if (ok[0] && ok[1]) {
+		return ((int32_t) (slot->copy[1].seq - slot->copy[0].seq) > 0)
+		       ? 1 : 0;
+	}
+	return ok[0] ? 0 : (ok[1] ? 1 : -1);
+}
+
+static bool empty_state (const struct acct_state *st)
+{
+	static const struct lastlog empty_ll;
+	static const struct faillog empty_fl;
+
+	return    (memcmp (&st->ll, &empty_ll, sizeof empty_ll) == 0)
+	       && (memcmp (&st->fl, &empty_fl, sizeof empty_fl) == 0);
+}
+
+/*
+ * set_copy - Fill a copy of the record of uid.
+ *
+ *	The copy is cleared first, so that the padding of the record is
+ *	part of the checksum as zeros.
+ */
+static void set_copy (struct acct_copy *copy, uid_t uid, uint32_t seq,
+                      const struct acct_state *st)
+{
+	memzero (copy, sizeof *copy);
+	copy->seq = (0 == seq) ? 1 : seq;
+	copy->st.ll = st->ll;
+	copy->st.fl = st->fl;
+	copy->sum = copy_sum (uid, copy);
+}
+
+static int file_lock (int fd, short type, bool wait)
+{
+	struct flock lck;
+
+	memzero (&lck, sizeof lck);
+	lck.l_type = type;
+	lck.l_whence = SEEK_SET;
+	while (fcntl (fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lck) != 0) {
+		if (EINTR != errno) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static int write_header (int fd, const struct acct_header *hdr)
+{
+	if (pwrite (fd, hdr, sizeof *hdr, 0) != (ssize_t) sizeof *hdr) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * init_store - Create the table of an empty store file.
+ */
+static int init_store (void)
+{
+	memzero (&header, sizeof header);
+	memcpy (header.magic, ACCT_MAGIC, sizeof header.magic);
+	header.slot_size = sizeof (struct acct_slot);
+	header.nslots = ACCT_MIN_SLOTS;
+	if (   (ftruncate (acct_fd, slot_offset (header.nslots)) != 0)
+	    || (write_header (acct_fd, &header) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * read_header - Read the header of the store, locked with type.
+ *
+ *	An empty file is initialized under a write lock, and is an empty
+ *	store otherwise.
+ */
+static int read_header (short type)
+{
+	struct stat sb;
+
+	if (fstat (acct_fd, &sb) != 0) {
+		return -1;
+	}
+	if (0 == sb.st_size) {
+		if (acct_rw && (F_WRLCK == type)) {
+			return init_store ();
+		}
+		memzero (&header, sizeof header);
+		return 0;
+	}
+	if (   (pread (acct_fd, &header, sizeof header, 0)
+	        != (ssize_t) sizeof header)
+	    || (memcmp (header.magic, ACCT_MAGIC, sizeof header.magic) != 0)
+	    || (sizeof (struct acct_slot) != header.slot_size)
+	    || (header.nslots < ACCT_MIN_SLOTS)
+	    || (0 != (header.nslots & (header.nslots - 1)))
+	    || (sb.st_size < slot_offset (header.nslots))) {
+		memzero (&header, sizeof header);
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static int open_store (bool rw)
+{
+	const char *file = acct_state_file ();
+	int fd;
+
+	if (NULL == file) {
+		errno = ENOENT;
+		return -1;
+	}
+	fd = open (file, (rw ? (O_RDWR | O_CREAT) : O_RDONLY) | O_CLOEXEC,
+	           0644);
+	if (fd < 0) {
+		return -1;
+	}
+	if (acct_fd >= 0) {
+		(void) close (acct_fd);
+	}
+	acct_fd = fd;
+	acct_rw = rw;
+	return 0;
+}
+
+/*
+ * lock_store - Lock the store, and read its header.
+ *
+ *	If the store was replaced by a larger one since it was opened, the
+ *	new one is opened and locked.
+ */
+static int lock_store (short type)
+{
+	struct stat sb_fd, sb_file;
+
+	if (acct_fd < 0) {
+		return 0;	/* empty store */
+	}
+	if (F_UNLCK == type) {
+		return file_lock (acct_fd, F_UNLCK, false);
+	}
+
+	for (;;) {
+		if (file_lock (acct_fd, type, true) != 0) {
+			return -1;
+		}
+		if (   (fstat (acct_fd, &sb_fd) != 0)
+		    || (stat (acct_state_file (), &sb_file) != 0)) {
+			return -1;
+		}
+		if (   (sb_fd.st_ino == sb_file.st_ino)
+		    && (sb_fd.st_dev == sb_file.st_dev)) {
+			break;
+		}
+		if (open_store (acct_rw) != 0) {
+			return -1;
+		}
+	}
+	if (read_header (type) != 0) {
+		(void) file_lock (acct_fd, F_UNLCK, false);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * begin - Lock the store for an access, unless acct_state_lock() did.
+ *
+ *	Return 1 if the store was locked, 0 if it was already, -1 on
+ *	errors.
+ */
+static int begin (short type)
+{
+	if ((F_WRLCK == acct_held) || ((F_RDLCK == acct_held) && (F_RDLCK == type))) {
+		return 0;
+	}
+	if (lock_store (type) != 0) {
+		return -1;
+	}
+	if (F_UNLCK != acct_held) {
+		/* A read lock was upgraded, keep it until unlocked */
+		acct_held = type;
+		return 0;
+	}
+	return 1;
+}
+
+static void end (int locked)
+{
+	if (1 == locked) {
+		(void) lock_store (F_UNLCK);
+	}
+}
+
+int acct_state_open (bool rw)
+{
+	if ((acct_fd >= 0) && (acct_rw || !rw)) {
+		return 0;
+	}
+	if (open_store (rw) != 0) {
+		if (!rw && (ENOENT == errno)) {
+			memzero (&header, sizeof header);
+			return 0;	/* empty store */
+		}
+		return -1;
+	}
+	return 0;
+}
+
+int acct_state_close (void)
+{
+	int fd = acct_fd;
+
+	acct_fd = -1;
+	acct_rw = false;
+	acct_held = F_UNLCK;
+	if (fd < 0) {
+		return 0;
+	}
+	return close (fd);
+}
+
+int acct_state_sync (void)
+{
+	if (acct_fd < 0) {
+		return 0;
+	}
+	return fsync (acct_fd);
+}
+
+int acct_state_lock (short type)
+{
+	if (lock_store (type) != 0) {
+		return -1;
+	}
+	acct_held = type;
+	return 0;
+}
+
+/*
+ * find_slot - Find the slot of uid in the locked store.
+ *
+ *	Return 1 if uid has a slot, read in slot, with its index in *n.
+ *	Return 0 if it has none: *n is then the slot where it can be
+ *	inserted, and *was_empty tells if this slot is empty (not deleted).
+ *	Return -1 on errors.
+ */
+static int find_slot (int fd, const struct acct_header *hdr, uid_t uid,
+                      /*@out@*/struct acct_slot *slot, /*@out@*/uint64_t *n,
+                      /*@out@*/bool *was_empty)
+{
+	uint64_t i = slot_hash (uid, hdr->nslots);
+	uint64_t probes;
+	bool have_free = false;
+
+	*n = 0;
+	*was_empty = false;
+	for (probes = 0; probes < hdr->nslots; probes++) {
+		ssize_t len;
+
+		len = pread (fd, slot, sizeof *slot, slot_offset (i));
+		if (len < 0) {
+			return -1;
+		}
+		if ((ssize_t) sizeof *slot != len) {
+			memzero (slot, sizeof *slot);
+		}
+		if (SLOT_EMPTY == slot->state) {
+			if (!have_free) {
+				*n = i;
+				*was_empty = true;
+			}
+			return 0;
+		}
+		if ((SLOT_USED == slot->state) && (slot->uid == uid)) {
+			*n = i;
+			return 1;
+		}
+		if ((SLOT_DELETED == slot->state) && !have_free) {
+			*n = i;
+			have_free = true;
+		}
+		i = (i + 1) & (hdr->nslots - 1);
+	}
+	if (!have_free) {
+		errno = ENOSPC;
+		return -1;
+	}
+	return 0;
+}
+
+int acct_state_get (uid_t uid, /*@out@*/struct acct_state *st)
+{
+	struct acct_slot slot;
+	uint64_t n;
+	bool was_empty;
+	int locked, found = 0, c;
+
+	memzero (st, sizeof *st);
+	locked = begin (F_RDLCK);
+	if (-1 == locked) {
+		return -1;
+	}
+	if (0 != header.nslots) {
+		found = find_slot (acct_fd, &header, uid, &slot, &n, &was_empty);
+	}
+	if (1 == found) {
+		c = valid_copy (&slot);
+		if (-1 == c) {
+			found = 0;	/* interrupted insertion */
+		} else {
+			st->ll = slot.copy[c].st.ll;
+			st->fl = slot.copy[c].st.fl;
+		}
+	}
+	end (locked);
+	return found;
+}
+
+/*
+ * grow - Rebuild the locked store with twice the slots.
+ *
+ *	The new table is written to file+, which replaces the file. The
+ *	new file is locked before it replaces the old one.
+ */
+static int grow (void)
+{
+	struct acct_slot buf[ACCT_BATCH];
+	struct acct_header hdr;
+	struct stat sb;
+	char tmp[1024];
+	uint64_t i;
+	int fd;
+
+	if (   ((size_t) snprintf (tmp, sizeof tmp, "%s+", acct_state_file ())
+	        >= sizeof tmp)
+	    || (fstat (acct_fd, &sb) != 0)) {
+		return -1;
+	}
+	fd = open (tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return -1;
+	}
+	(void) fchown (fd, sb.st_uid, sb.st_gid);
+	if (   (fchmod (fd, sb.st_mode & 07777) != 0)
+	    || (file_lock (fd, F_WRLCK, false) != 0)) {
+		goto err;
+	}
+
+	hdr = header;
+	hdr.nslots = 2 * header.nslots;
+	hdr.used = 0;
+	if (ftruncate (fd, slot_offset (hdr.nslots)) != 0) {
+		goto err;
+	}
+
+	for (i = 0; i < header.nslots; i += ACCT_BATCH) {
+		size_t len = ACCT_BATCH * sizeof buf[0];
+		size_t j;
+
+		if (pread (acct_fd, buf, len, slot_offset (i)) != (ssize_t) len) {
+			goto err;
+		}
+		for (j = 0; j < ACCT_BATCH; j++) {
+			struct acct_slot slot;
+			uint64_t n;
+			bool was_empty;
+			int c;
+
+			if (SLOT_USED != buf[j].state) {
+				continue;
+			}
+			c = valid_copy (&buf[j]);
+			if (-1 == c) {
+				continue;
+			}
+			if (find_slot (fd, &hdr, buf[j].uid, &slot, &n,
+			               &was_empty) != 0) {
+				goto err;
+			}
+			memzero (&slot, sizeof slot);
+			slot.state = SLOT_USED;
+			slot.uid = buf[j].uid;
+			slot.copy[0] = buf[j].copy[c];
+			if (pwrite (fd, &slot, sizeof slot, slot_offset (n))
+			    != (ssize_t) sizeof slot) {
+				goto err;
+			}
+			hdr.used++;
+		}
+	}
+
+	if (   (write_header (fd, &hdr) != 0)
+	    || (fsync (fd) != 0)
+	    || (rename (tmp, acct_state_file ()) != 0)) {
+		goto err;
+	}
+	(void) close (acct_fd);
+	acct_fd = fd;
+	header = hdr;
+	return 0;
+
+err:
+	(void) close (fd);
+	(void) unlink (tmp);
+	return -1;
+}
+
+int acct_state_put (uid_t uid, const struct acct_state *st)
+{
+	struct acct_slot slot;
+	uint64_t n;
+	bool was_empty;
+	int locked, found, c;
+	int ret = -1;
+
+	if (!acct_rw) {
+		errno = EBADF;
+		return -1;
+	}
+	locked = begin (F_WRLCK);
+	if (-1 == locked) {
+		return -1;
+	}
+
+	found = find_slot (acct_fd, &header, uid, &slot, &n, &was_empty);
+	if (-1 == found) {
+		goto out;
+	}
+
+	if (empty_state (st)) {
+		/* Remove the record */
+		if (1 == found) {
+			uint32_t state = SLOT_DELETED;
+
+			if (pwrite (acct_fd, &state, sizeof state,
+			            slot_offset (n)) != (ssize_t) sizeof state) {
+				goto out;
+			}
+		}
+		ret = 0;
+		goto out;
+	}
+
+	if (1 == found) {
+		/* Update the older copy */
+		c = valid_copy (&slot);
+		if (-1 == c) {
+			set_copy (&slot.copy[0], uid, 1, st);
+			c = 0;
+		} else {
+			uint32_t seq = slot.copy[c].seq + 1;
+
+			c = 1 - c;
+			set_copy (&slot.copy[c], uid, seq, st);
+		}
+		if (pwrite (acct_fd, &slot.copy[c], sizeof slot.copy[c],
+		            slot_offset (n) + offsetof (struct acct_slot, copy[c]))
+		    != (ssize_t) sizeof slot.copy[c]) {
+			goto out;
+		}
+		ret = 0;
+		goto out;
+	}
+
+	/* Insert the record, in a larger table if needed */
+	if (was_empty && ((header.used + 1) * 4 > header.nslots * 3)) {
+		if (   (grow () != 0)
+		    || (find_slot (acct_fd, &header, uid, &slot, &n,
+		                   &was_empty) != 0)) {
+			goto out;
+		}
+	}
+	if (was_empty) {
+		/* Count the slot first: a crash then only overestimates */
+		header.used++;
+		if (write_header (acct_fd, &header) != 0) {
+			goto out;
+		}
+	}
+	memzero (&slot, sizeof slot);
+	slot.state = SLOT_USED;
+	slot.uid = uid;
+	set_copy (&slot.copy[0], uid, 1, st);
+	if (pwrite (acct_fd, &slot, sizeof slot, slot_offset (n))
+	    != (ssize_t) sizeof slot) {
+		goto out;
+	}
+	ret = 0;
+
+out:
+	end (locked);
+	return ret;
+}
+
+int acct_state_next (uint64_t *pos, /*@out@*/uid_t *uid,
+                     /*@out@*/struct acct_state *st)
+{
+	static struct acct_slot buf[ACCT_BATCH];
+	static uint64_t buf_first = 0;
+	static size_t buf_count = 0;
+	int locked;
+	int ret = 0;
+
+	locked = begin (F_RDLCK);
+	if (-1 == locked) {
+		return -1;
+	}
+	if (0 == *pos) {
+		buf_count = 0;	/* the store may have changed */
+	}
+
+	while (*pos < header.nslots) {
+		const struct acct_slot *slot;
+		int c;
+
+		if ((*pos < buf_first) || (*pos >= buf_first + buf_count)) {
+			size_t n = ACCT_BATCH;
+			ssize_t len;
+
+			if (header.nslots - *pos < n) {
+				n = header.nslots - *pos;
+			}
+			len = pread (acct_fd, buf, n * sizeof buf[0],
+			             slot_offset (*pos));
+			if (len < (ssize_t) sizeof buf[0]) {
+				buf_count = 0;
+				ret = -1;
+				break;
+			}
+			buf_first = *pos;
+			buf_count = len / sizeof buf[0];
+		}
+		slot = &buf[*pos - buf_first];
+		(*pos)++;
+		if (SLOT_USED != slot->state) {
+			continue;
+		}
+		c = valid_copy (slot);
+		if (-1 == c) {
+			continue;
+		}
+		*uid = slot->uid;
+		memzero (st, sizeof *st);
+		st->ll = slot->copy[c].st.ll;
+		st->fl = slot->copy[c].st.fl;
+		ret = 1;
+		break;
+	}
+	end (locked);
+	return ret;
+}
+
+static void *part_of (struct acct_state *st, enum acct_part part,
+                      /*@out@*/size_t *size)
+{
+	if (ACCT_LASTLOG == part) {
+		*size = sizeof st->ll;
+		return &st->ll;
+	}
+	*size = sizeof st->fl;
+	return &st->fl;
+}
+
+static bool is_empty (const void *p, size_t size)
+{
+	const unsigned char *c = p;
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		if (0 != c[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int acct_state_import (int fd, enum acct_part part,
+                       /*@out@*/unsigned long *count)
+{
+	static unsigned char buf[64 * 1024];
+	struct acct_state st;
+	struct stat sb;
+	size_t size;
+	off_t offset = 0;
+	int ret = -1;
+
+	*count = 0;
+	(void) part_of (&st, part, &size);
+	if (   (fstat (fd, &sb) != 0)
+	    || (acct_state_lock (F_WRLCK) != 0)) {
+		return -1;
+	}
+
+	while (offset < sb.st_size) {
+		off_t data;
+		ssize_t len;
+		size_t i;
+
+		/* Skip the holes of the sparse file */
+		data = lseek (fd, offset, SEEK_DATA);
+		if ((-1 == data) && (ENXIO == errno)) {
+			break;
+		}
+		if (data > offset) {
+			offset = data - data % (off_t) size;
+		}
+
+		len = pread (fd, buf, sizeof buf - sizeof buf % size, offset);
+		if (len < 0) {
+			goto out;
+		}
+		if ((size_t) len < size) {
+			break;
+		}
+		for (i = 0; i + size <= (size_t) len; i += size) {
+			uid_t uid = (offset + i) / size;
+			size_t n;
+
+			if (is_empty (&buf[i], size)) {
+				continue;
+			}
+			if (acct_state_get (uid, &st) == -1) {
+				goto out;
+			}
+			memcpy (part_of (&st, part, &n), &buf[i], size);
+			if (acct_state_put (uid, &st) != 0) {
+				goto out;
+			}
+			(*count)++;
+		}
+		offset += i;
+	}
+	ret = acct_state_sync ();
+
+out:
+	(void) acct_state_lock (F_UNLCK);
+	return ret;
+}
+
+int acct_state_export (int fd, enum acct_part part,
+                       /*@out@*/unsigned long *count)
+{
+	struct acct_state st;
+	uint64_t pos = 0;
+	uid_t uid;
+	int ret = -1;
+	int r;
+
+	*count = 0;
+	if (acct_state_lock (F_RDLCK) != 0) {
+		return -1;
+	}
+	if (ftruncate (fd, 0) != 0) {
+		goto out;
+	}
+	while ((r = acct_state_next (&pos, &uid, &st)) == 1) {
+		size_t size;
+		const void *p = part_of (&st, part, &size);
+
+		if (is_empty (p, size)) {
+			continue;
+		}
+		if (pwrite (fd, p, size, (off_t) uid * size) != (ssize_t) size) {
+			goto out;
+		}
+		(*count)++;
+	}
+	if (0 == r) {
+		ret = fsync (fd);
+	}
+
+out:
+	(void) acct_state_lock (F_UNLCK);
+	return ret;
+}
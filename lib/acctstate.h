@@ -0,0 +1,103 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * acctstate.h - store of the lastlog and faillog records of the users
+ *
+ *	When ACCOUNT_STATE_FILE is set in login.defs, the lastlog and
+ *	faillog records are kept in this file, indexed by UID, instead of
+ *	the sparse /var/log/lastlog and /var/log/faillog files.
+ */
+
+#ifndef _ACCTSTATE_H_
+#define _ACCTSTATE_H_
+
+#include <lastlog.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "defines.h"
+#include "faillog.h"
+
+/* The record of a UID. A record with no lastlog and no faillog data is
+ * not stored. */
+struct acct_state {
+	struct lastlog ll;
+	struct faillog fl;
+};
+
+/*
+ * acct_state_enabled - check if ACCOUNT_STATE_FILE is set
+ * acct_state_file - return ACCOUNT_STATE_FILE
+ */
+extern bool acct_state_enabled (void);
+extern /*@observer@*/ /*@null@*/const char *acct_state_file (void);
+
+/*
+ * acct_state_open - open the store once, for writing if rw is set
+ * acct_state_close - close the store
+ * acct_state_sync - write the changes of the store to disk
+ *
+ *	The store is created when it is opened for writing. A missing
+ *	store opened read-only is empty.
+ *	They return 0, or -1 with errno set.
+ */
+extern int acct_state_open (bool rw);
+extern int acct_state_close (void);
+extern int acct_state_sync (void);
+
+/*
+ * acct_state_lock - lock (F_RDLCK, F_WRLCK) or unlock (F_UNLCK) the store
+ *
+ *	Without a lock, each access locks the store on its own.
+ */
+extern int acct_state_lock (short type);
+
+/*
+ * acct_state_get - read the record of uid, empty if there is none
+ *
+ *	Return 1 if uid has a record, 0 if it has none, -1 on errors.
+ */
+extern int acct_state_get (uid_t uid, /*@out@*/struct acct_state *st);
+
+/*
+ * acct_state_put - write the record of uid
+ *
+ *	An empty record removes the record of uid.
+ *	Return 0, or -1 with errno set.
+ */
+extern int acct_state_put (uid_t uid, const struct acct_state *st);
+
+/*
+ * acct_state_next - read the records in the order of the store
+ *
+ *	*pos is 0 for the first record, and is advanced by each call.
+ *	Return 1 if a record was read, 0 after the last record, -1 on
+ *	errors.
+ */
+extern int acct_state_next (uint64_t *pos, /*@out@*/uid_t *uid,
+                            /*@out@*/struct acct_state *st);
+
+/* The parts of the records */
+enum acct_part {
+	ACCT_LASTLOG,
+	ACCT_FAILLOG
+};
+
+/*
+ * acct_state_import - copy the records of a legacy lastlog or faillog file
+ *                     to the store
+ * acct_state_export - write the records of the store to a legacy file
+ *
+ *	fd is the legacy file, indexed by UID. The import replaces the
+ *	part of the records of the UIDs set in the file. The export
+ *	replaces the content of the file.
+ *	*count is set to the number of records copied.
+ *	They return 0, or -1 with errno set.
+ */
+extern int acct_state_import (int fd, enum acct_part part,
+                              /*@out@*/unsigned long *count);
+extern int acct_state_export (int fd, enum acct_part part,
+                              /*@out@*/unsigned long *count);
+
+#endif				/* _ACCTSTATE_H_ */
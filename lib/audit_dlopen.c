@@ -0,0 +1,128 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#if defined(WITH_AUDIT) && defined(AUDIT_DLOPEN)
+
+#ident "$Id$"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <libaudit.h>
+
+/*
+ * With --enable-lazy-audit, the tools are not linked with libaudit: it
+ * is loaded with dlopen() when an audit function is first called, so
+ * that the runs which log no event do not pay for its loading and
+ * relocation. The functions of libaudit used by the tools are defined
+ * here, and call the functions of the loaded library.
+ *
+ * If libaudit cannot be loaded, audit_open() fails with EPROTONOSUPPORT,
+ * as when the kernel has no audit support: no event is logged.
+ */
+
+#define LIBAUDIT_SONAME	"libaudit.so.1"
+
+static bool loaded = false;
+static int (*dl_open) (void);
+static int (*dl_log_acct_message) (int audit_fd, int type,
+                                   const char *pgname, const char *op,
+                                   const char *name, unsigned int id,
+                                   const char *host, const char *addr,
+                                   const char *tty, int result);
+static int (*dl_log_user_message) (int audit_fd, int type,
+                                   const char *message,
+                                   const char *hostname, const char *addr,
+                                   const char *tty, int result);
+static int (*dl_log_user_avc_message) (int audit_fd, int type,
+                                       const char *message,
+                                       const char *hostname,
+                                       const char *addr, const char *tty,
+                                       uid_t uid);
+
+/*
+ * audit_load - Load libaudit, once.
+ *
+ *	Return true if all its functions were found.
+ */
+static bool audit_load (void)
+{
+	void *h;
+
+	if (loaded) {
+		return NULL != dl_open;
+	}
+	loaded = true;
+
+	h = dlopen (LIBAUDIT_SONAME, RTLD_NOW | RTLD_LOCAL);
+	if (NULL == h) {
+		return false;
+	}
+	dl_open = dlsym (h, "audit_open");
+	dl_log_acct_message = dlsym (h, "audit_log_acct_message");
+	dl_log_user_message = dlsym (h, "audit_log_user_message");
+	dl_log_user_avc_message = dlsym (h, "audit_log_user_avc_message");
+	if (   (NULL == dl_open)
+	    || (NULL == dl_log_acct_message)
+	    || (NULL == dl_log_user_message)
+	    || (NULL == dl_log_user_avc_message)) {
+		dl_open = NULL;
+		(void) dlclose (h);
+		return false;
+	}
+	return true;
+}
+
+int audit_open (void)
+{
+	if (!audit_load ()) {
+		errno = EPROTONOSUPPORT;
+		return -1;
+	}
+	return dl_open ();
+}
+
+/* The other functions are only called with the fd of audit_open() */
+
+int audit_log_acct_message (int audit_fd, int type, const char *pgname,
+                            const char *op, const char *name,
+                            unsigned int id, const char *host,
+                            const char *addr, const char *tty, int result)
+{
+	if (!audit_load ()) {
+		return -1;
+	}
+	return dl_log_acct_message (audit_fd, type, pgname, op, name, id,
+	                            host, addr, tty, result);
+}
+
+int audit_log_user_message (int audit_fd, int type, const char *message,
+                            const char *hostname, const char *addr,
+                            const char *tty, int result)
+{
+	if (!audit_load ()) {
+		return -1;
+	}
+	return dl_log_user_message (audit_fd, type, message, hostname, addr,
+	                            tty, result);
+}
+
+int audit_log_user_avc_message (int audit_fd, int type, const char *message,
+                                const char *hostname, const char *addr,
+                                const char *tty, uid_t uid)
+{
+	if (!audit_load ()) {
+		return -1;
+	}
+	return dl_log_user_avc_message (audit_fd, type, message, hostname,
+	                                addr, tty, uid);
+}
+
+#else				/* !WITH_AUDIT || !AUDIT_DLOPEN */
+extern int ISO_C_forbids_an_empty_translation_unit;
+#endif				/* !WITH_AUDIT || !AUDIT_DLOPEN */
@@ -13,14 +13,28 @@
 
 #include "defines.h"
 #include <assert.h>
+#include <dirent.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <limits.h>
 #include <utime.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <stdio.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_LINUX_FS_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
 #include "nscd.h"
 #include "sssd.h"
 #ifdef WITH_TCB
@@ -28,6 +42,9 @@
 #endif				/* WITH_TCB */
 #include "prototypes.h"
 #include "commonio.h"
+#include "getdef.h"
+#include "probes.h"
+#include "shadowlog.h"
 #include "shadowlog_internal.h"
 
 /* local function prototypes */
@@ -36,13 +53,30 @@ static /*@null@*/ /*@dependent@*/FILE *fopen_set_perms (
 	const char *name,
 	const char *mode,
 	const struct stat *sb);
-static int create_backup (const char *, FILE *);
+static int create_backup (const char *file, const char *backup, FILE *);
 static void free_linked_list (struct commonio_db *);
+static void free_line (const struct commonio_db *, /*@only@*/char *line);
+static void free_eptr (const struct commonio_db *, /*@only@*/void *eptr);
+static void arena_free (struct commonio_db *);
+static int load_line (struct commonio_db *, /*@owned@*/char *line);
+static /*@null@*/void *entry_eptr (struct commonio_db *,
+                                   struct commonio_entry *);
+static int parse_all (struct commonio_db *);
+static void load_deferred (struct commonio_db *);
+static int load_mapped (struct commonio_db *);
 static void add_one_entry (
 	struct commonio_db *db,
 	/*@owned@*/struct commonio_entry *p);
 static bool name_is_nis (const char *name);
-static int write_all (const struct commonio_db *);
+static int write_all (const struct commonio_db *, int src);
+static int commit_write (struct commonio_db *);
+static int commit_sync (struct commonio_db *);
+static int commit_synced (struct commonio_db *, int synced,
+                          const struct timespec *start);
+static int commit_publish (struct commonio_db *);
+static void journal_write (const struct commonio_db *);
+static void replication_write (const struct commonio_db *);
+static void commit_abort (struct commonio_db *);
 static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
 	struct commonio_db *,
 	const char *);
@@ -50,9 +84,34 @@ static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
 	struct commonio_db *,
 	/*@null@*/struct commonio_entry *pos,
 	const char *);
+static bool has_duplicate_name (struct commonio_db *,
+                                const struct commonio_entry *,
+                                const char *);
+static size_t name_hash (const char *name);
+static int index_resize (struct commonio_db *, size_t size);
+static int index_build (struct commonio_db *);
+static void index_free (struct commonio_db *);
+static void index_add (struct commonio_db *, struct commonio_entry *);
+static void index_del (struct commonio_db *, const struct commonio_entry *);
+static void unlink_entry (struct commonio_db *, const struct commonio_entry *);
+static void members_build (struct commonio_db *);
+static void members_free (struct commonio_db *);
+static void members_add (struct commonio_db *, struct commonio_entry *);
+static void members_del (struct commonio_db *, const struct commonio_entry *);
 
 static int lock_count = 0;
-static bool nscd_need_reload = false;
+/*
+ * With PER_DATABASE_LOCKING, the shared lock of the lock file of
+ * lckpwdf(), and the greatest name of the databases locked since then.
+ */
+static int shared_lock_fd = -1;
+static char lock_last[sizeof ((struct commonio_db *) NULL)->filename];
+/* Caches of the databases modified since they were last flushed */
+static int cache_dbs = 0;
+/* Number of databases written by this process */
+static unsigned long changes = 0;
+/* Whether a database was written since the databases were locked */
+static bool locked_changes = false;
 
 /*
  * Simple rename(P) alternative that attempts to rename to symlink
@@ -90,6 +149,111 @@ int lrename (const char *old, const char *new)
 }
 
 
+/*
+ * Durability of the commits, from COMMIT_SYNC:
+ *	none: nothing is flushed to disk,
+ *	data: the new files are flushed with fdatasync(),
+ *	full: the new files are flushed with fsync(), and the directories
+ *	      where they were renamed are flushed once per commit (default).
+ */
+enum sync_level {
+	SYNC_NONE,
+	SYNC_DATA,
+	SYNC_FULL
+};
+
+static enum sync_level sync_level (void)
+{
+	const char *level = getdef_str ("COMMIT_SYNC");
+
+	if (NULL == level) {
+		return SYNC_FULL;
+	}
+	if (strcmp (level, "none") == 0) {
+		return SYNC_NONE;
+	}
+	if (strcmp (level, "data") == 0) {
+		return SYNC_DATA;
+	}
+	return SYNC_FULL;
+}
+
+/*
+ * sync_fd - Flush a new file to disk, as required by level.
+ */
+static int sync_fd (int fd, enum sync_level level)
+{
+	switch (level) {
+	case SYNC_NONE:
+		return 0;
+	case SYNC_DATA:
+		return fdatasync (fd);
+	default:
+		return fsync (fd);
+	}
+}
+
+/*
+ * sync_file - Flush a new file to disk, as required by COMMIT_SYNC.
+ */
+static int sync_file (int fd)
+{
+	return sync_fd (fd, sync_level ());
+}
+
+/*
+ * sync_dir - Flush the directory of file to disk, so that the renames
+ *	into it are durable, if COMMIT_SYNC is full.
+ */
+static int sync_dir (const char *file)
+{
+	char dir[1024];
+	const char *cp;
+	struct timespec start;
+	int fd;
+	int ret;
+
+	if (SYNC_FULL != sync_level ()) {
+		return 0;
+	}
+
+	timing_start (&start);
+
+	cp = strrchr (file, '/');
+	if (NULL == cp) {
+		strcpy (dir, ".");
+	} else if (cp == file) {
+		strcpy (dir, "/");
+	} else {
+		snprintf (dir, sizeof dir, "%.*s", (int) (cp - file), file);
+	}
+
+	fd = open (dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ret = fsync (fd);
+	(void) close (fd);
+	timing_db_stop (file, TIMING_DB_SYNC, &start);
+	metrics_observe (METRICS_FSYNC_TIME, file, &start);
+	return ret;
+}
+
+/*
+ * same_dir - Return true if two files are in the same directory.
+ */
+static bool same_dir (const char *file1, const char *file2)
+{
+	const char *cp1 = strrchr (file1, '/');
+	const char *cp2 = strrchr (file2, '/');
+
+	if ((NULL == cp1) || (NULL == cp2)) {
+		return (NULL == cp1) && (NULL == cp2);
+	}
+	return    ((cp1 - file1) == (cp2 - file2))
+	       && (strncmp (file1, file2, (size_t) (cp1 - file1)) == 0);
+}
+
 static /*@null@*/ /*@dependent@*/FILE *fopen_set_perms (
 	const char *name,
 	const char *mode,
@@ -122,12 +286,24 @@ static /*@null@*/ /*@dependent@*/FILE *fopen_set_perms (
 }
 
 
-static int create_backup (const char *backup, FILE * fp)
+/*
+ * create_backup - Save the current version of file (opened as fp) in
+ *	backup.
+ *
+ *	The cheapest method available is used:
+ *	 - a reflink of the file, on filesystems supporting it,
+ *	 - a hard link to the file. This is valid because the file is never
+ *	   modified in place: the new version is written to file+ and
+ *	   renamed over the file,
+ *	 - a copy of the file.
+ */
+static int create_backup (const char *file, const char *backup, FILE * fp)
 {
 	struct stat sb;
 	struct utimbuf ub;
 	FILE *bkfp;
-	int c;
+	char buf[8192];
+	size_t len;
 
 	if (fstat (fileno (fp), &sb) != 0) {
 		return -1;
@@ -138,21 +314,47 @@ static int create_backup (const char *backup, FILE * fp)
 		return -1;
 	}
 
-	/* TODO: faster copy, not one-char-at-a-time.  --marekm */
-	c = 0;
-	if (fseek (fp, 0, SEEK_SET) == 0) {
-		while ((c = getc (fp)) != EOF) {
-			if (putc (c, bkfp) == EOF) {
-				break;
-			}
+#ifdef FICLONE
+	if (ioctl (fileno (bkfp), FICLONE, fileno (fp)) == 0) {
+		if (   (sync_file (fileno (bkfp)) != 0)
+		    || (fclose (bkfp) != 0)) {
+			return -1;
+		}
+		goto done;
+	}
+#endif				/* FICLONE */
+
+	/*
+	 * Replace the (empty) backup by a hard link to the file.
+	 * AT_SYMLINK_FOLLOW, because the backup must not be a link to a
+	 * symbolic link which will point to the new version.
+	 */
+	if (   (unlink (backup) == 0)
+	    && (linkat (AT_FDCWD, file, AT_FDCWD, backup, AT_SYMLINK_FOLLOW) == 0)) {
+		(void) fclose (bkfp);
+		return 0;
+	}
+	(void) fclose (bkfp);
+	bkfp = fopen_set_perms (backup, "w", &sb);
+	if (NULL == bkfp) {
+		return -1;
+	}
+
+	if (fseek (fp, 0, SEEK_SET) != 0) {
+		(void) fclose (bkfp);
+		return -1;
+	}
+	while ((len = fread (buf, 1, sizeof buf, fp)) != 0) {
+		if (fwrite (buf, 1, len, bkfp) != len) {
+			break;
 		}
 	}
-	if ((c != EOF) || (ferror (fp) != 0) || (fflush (bkfp) != 0)) {
+	if ((len != 0) || (ferror (fp) != 0) || (fflush (bkfp) != 0)) {
 		(void) fclose (bkfp);
 		/* FIXME: unlink the backup file? */
 		return -1;
 	}
-	if (fsync (fileno (bkfp)) != 0) {
+	if (sync_file (fileno (bkfp)) != 0) {
 		(void) fclose (bkfp);
 		/* FIXME: unlink the backup file? */
 		return -1;
@@ -162,6 +364,7 @@ static int create_backup (const char *backup, FILE * fp)
 		return -1;
 	}
 
+      done:
 	ub.actime = sb.st_atime;
 	ub.modtime = sb.st_mtime;
 	(void) utime (backup, &ub);
@@ -169,23 +372,172 @@ static int create_backup (const char *backup, FILE * fp)
 }
 
 
+/*
+ * free_line - Free a line, unless it is part of the database mapping.
+ */
+static void free_line (const struct commonio_db *db, /*@only@*/char *line)
+{
+	if (   (NULL != db->map)
+	    && (line >= db->map)
+	    && (line < db->map + db->map_size)) {
+		return;
+	}
+	free (line);
+}
+
+/*
+ * Arena of the entries read from the file.
+ *
+ * Memory is taken from the first chunk, and a twice larger chunk is added
+ * in front when it is full. Everything is released (and cleared, since
+ * the records contain password hashes) by arena_free().
+ */
+struct commonio_arena {
+	/*@owned@*/ /*@null@*/struct commonio_arena *next;
+	size_t size;		/* usable size */
+	size_t used;
+};
+
+#define ARENA_ALIGN		(2 * sizeof (void *))
+#define ARENA_ROUND(n)		(((n) + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1))
+#define ARENA_HDR		ARENA_ROUND (sizeof (struct commonio_arena))
+#define ARENA_CHUNK_MIN		(64 * 1024)
+#define ARENA_CHUNK_MAX		(16 * 1024 * 1024)
+
+/*
+ * commonio_alloc - Allocate memory from the database arena.
+ *
+ *	This memory is released when the database is closed.
+ */
+/*@null@*/ /*@dependent@*/void *commonio_alloc (struct commonio_db *db,
+                                                size_t size)
+{
+	struct commonio_arena *a = db->arena;
+	void *ptr;
+
+	if (size > SIZE_MAX - ARENA_HDR - ARENA_ALIGN) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	size = ARENA_ROUND (size);
+
+	if ((NULL == a) || (a->size - a->used < size)) {
+		size_t chunk = (NULL == a) ? ARENA_CHUNK_MIN : a->size;
+
+		if ((NULL != a) && (chunk < ARENA_CHUNK_MAX)) {
+			chunk *= 2;
+		}
+		if (chunk < size) {
+			chunk = size;
+		}
+		a = malloc (ARENA_HDR + chunk);
+		if (NULL == a) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		a->next = db->arena;
+		a->size = chunk;
+		a->used = 0;
+		db->arena = a;
+	}
+
+	ptr = (char *) a + ARENA_HDR + a->used;
+	a->used += size;
+	return ptr;
+}
+
+/*@null@*/ /*@dependent@*/char *commonio_strdup (struct commonio_db *db,
+                                                 const char *s)
+{
+	size_t len = strlen (s) + 1;
+	char *cp;
+
+	cp = commonio_alloc (db, len);
+	if (NULL != cp) {
+		memcpy (cp, s, len);
+	}
+	return cp;
+}
+
+/*
+ * commonio_in_arena - Check if memory was obtained with commonio_alloc().
+ */
+bool commonio_in_arena (const struct commonio_db *db, const void *ptr)
+{
+	const struct commonio_arena *a;
+
+	for (a = db->arena; NULL != a; a = a->next) {
+		const char *data = (const char *) a + ARENA_HDR;
+
+		if (   ((const char *) ptr >= data)
+		    && ((const char *) ptr < data + a->used)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void arena_free (struct commonio_db *db)
+{
+	struct commonio_arena *a;
+
+	while (NULL != db->arena) {
+		a = db->arena;
+		db->arena = a->next;
+		memzero ((char *) a + ARENA_HDR, a->used);
+		free (a);
+	}
+}
+
+/*
+ * free_eptr - Free a parsed entry, unless it is part of the arena.
+ */
+static void free_eptr (const struct commonio_db *db, /*@only@*/void *eptr)
+{
+	if ((NULL != db->arena) && commonio_in_arena (db, eptr)) {
+		return;
+	}
+	db->ops->free (eptr);
+}
+
 static void free_linked_list (struct commonio_db *db)
 {
 	struct commonio_entry *p;
 
+	index_free (db);
+	members_free (db);
+
 	while (NULL != db->head) {
 		p = db->head;
 		db->head = p->next;
 
-		free (p->line);
+		free_line (db, p->line);
 
 		if (NULL != p->eptr) {
-			db->ops->free (p->eptr);
+			free_eptr (db, p->eptr);
 		}
 
-		free (p);
+		if ((NULL == db->arena) || !commonio_in_arena (db, p)) {
+			free (p);
+		}
 	}
 	db->tail = NULL;
+	db->nis_known = false;
+
+	arena_free (db);
+
+	while (db->nremoved > 0) {
+		db->nremoved--;
+		free (db->removed[db->nremoved]);
+	}
+	free (db->removed);
+	db->removed = NULL;
+
+	if (NULL != db->map) {
+		(void) munmap (db->map, db->map_size);
+		db->map = NULL;
+		db->map_size = 0;
+	}
 }
 
 
@@ -196,889 +548,4285 @@ int commonio_setname (struct commonio_db *db, const char *name)
 	return 1;
 }
 
+/*
+ * Sharded databases
+ *
+ * With SHARDED_DATABASES, the entries of a database can be kept in the
+ * shards FILE.d/NAME besides FILE, for instance one per tenant. Each
+ * shard is a database of its own, with its own lock: the changes of a
+ * shard only lock and rewrite this shard. FILE keeps its own entries,
+ * followed by a copy of all the shards after the SHARDS_MARKER comment
+ * line, so that the readers of FILE (nss-files) see all the entries.
+ * This copy is regenerated whenever FILE or one of its shards is
+ * written, and it is not loaded with the entries of FILE.
+ */
+#define SHARDS_MARKER \
+	"# Copy of the shards in the .d directory of this file, do not edit below"
 
-bool commonio_present (const struct commonio_db *db)
+static bool valid_shard_name (const char *name)
 {
-	return (access (db->filename, F_OK) == 0);
-}
+	size_t len = strlen (name);
 
+	/* Not the backups (NAME-) or other files of the shards (NAME.idx) */
+	if ((0 == len) || ('-' == name[len - 1])) {
+		return false;
+	}
+	return strspn (name, "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	                     "abcdefghijklmnopqrstuvwxyz"
+	                     "0123456789_-") == len;
+}
 
-int do_fcntl_lock (const char *file, bool log, short type)
+/*
+ * commonio_setshard - Use the shard of the database named shard instead
+ *	of the database.
+ *
+ *	The shard is created empty, with the permissions of the database,
+ *	if it does not exist yet.
+ *	Return 1 on success, 0 on failure.
+ */
+int commonio_setshard (struct commonio_db *db, const char *shard)
 {
+	char dir[sizeof db->filename];
+	char path[sizeof db->filename];
+	struct stat sb;
 	int fd;
-	struct flock lck = {
-		.l_type = type,
-		.l_whence = SEEK_SET,
-		.l_start = 0,
-		.l_len = 0,
-	};
 
-	fd = open (file, O_WRONLY, 0600);
-	if (-1 == fd) {
-		if (log) {
-			(void) fprintf (shadow_logfd, "%s: %s: %s\n",
-			                shadow_progname, file, strerror (errno));
+	if (!valid_shard_name (shard)) {
+		errno = EINVAL;
+		return 0;
+	}
+	if (   (snprintf (dir, sizeof dir, "%s.d", db->filename)
+	        >= (int) sizeof dir)
+	    || (snprintf (path, sizeof path, "%s/%s", dir, shard)
+	        >= (int) sizeof path)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+
+	if (stat (db->filename, &sb) != 0) {
+		sb.st_mode = db->st_mode;
+		sb.st_uid = db->st_uid;
+		sb.st_gid = db->st_gid;
+	}
+	if ((mkdir (dir, 0755) != 0) && (EEXIST != errno)) {
+		return 0;
+	}
+	fd = open (path, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC,
+	           sb.st_mode & 07777);
+	if (fd >= 0) {
+		if (   (fchown (fd, sb.st_uid, sb.st_gid) != 0)
+		    || (fchmod (fd, sb.st_mode & 07777) != 0)) {
+			(void) close (fd);
+			(void) unlink (path);
+			return 0;
 		}
+		(void) close (fd);
+	} else if (EEXIST != errno) {
 		return 0;
 	}
 
-	fcntl (fd, F_OFD_SETLKW, &lck);
-	close(fd);
-	return(1);
+	free (db->main_file);
+	db->main_file = strdup (db->filename);
+	if (NULL == db->main_file) {
+		return 0;
+	}
+	return commonio_setname (db, path);
 }
 
-int commonio_lock_nowait (struct commonio_db *db, bool log)
+static bool is_shards_marker (const char *line)
 {
-	char* file = NULL;
-	char* lock = NULL;
-	size_t lock_file_len;
-	size_t file_len;
-	int err = 0;
+	return strcmp (line, SHARDS_MARKER) == 0;
+}
 
-	if (db->locked) {
-		return 1;
+static int shard_name_cmp (const void *a, const void *b)
+{
+	return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+/*
+ * copy_shard - Append the file path to fp, with a final newline.
+ */
+static int copy_shard (FILE *fp, const char *path)
+{
+	char buf[BUFSIZ];
+	size_t n;
+	int last = '\n';
+	FILE *in;
+
+	in = fopen (path, "re");
+	if (NULL == in) {
+		return (ENOENT == errno) ? 0 : -1;	/* removed meanwhile */
 	}
-	file_len = strlen(db->filename) + 11;/* %lu max size */
-	lock_file_len = strlen(db->filename) + 6; /* sizeof ".lock" */
-	file = (char*)malloc(file_len);
-	if (file == NULL) {
-		goto cleanup_ENOMEM;
+	while ((n = fread (buf, 1, sizeof buf, in)) > 0) {
+		if (fwrite (buf, 1, n, fp) != n) {
+			(void) fclose (in);
+			return -1;
+		}
+		last = (unsigned char) buf[n - 1];
 	}
-	lock = (char*)malloc(lock_file_len);
-	if (lock == NULL) {
-		goto cleanup_ENOMEM;
+	if (ferror (in) != 0) {
+		(void) fclose (in);
+		return -1;
 	}
-	snprintf (file, file_len, "%s.%lu",
-	          db->filename, (unsigned long) getpid ());
-
-	if (do_fcntl_lock (db->filename, log, F_WRLCK | F_RDLCK) != 0) {
-		db->locked = true;
-		lock_count++;
-		err = 1;
+	(void) fclose (in);
+	if (('\n' != last) && (putc ('\n', fp) == EOF)) {
+		return -1;
 	}
-cleanup_ENOMEM:
-	free(file);
-	free(lock);
-	return err;
+	return 0;
 }
 
-
-int commonio_lock (struct commonio_db *db)
+/*
+ * write_shards - Append the copy of the shards of db to its new file.
+ *
+ *	The shards are copied in the order of their names. Their backups
+ *	(NAME-) and new versions (NAME+) are skipped.
+ *	Return 1 if the shards were copied, 0 if db has no shards, and -1
+ *	on failure.
+ */
+static int write_shards (const struct commonio_db *db)
 {
-	int i;
+	char dir[sizeof db->filename + 2];
+	char path[sizeof dir + NAME_MAX + 1];
+	char **names = NULL;
+	size_t count = 0, i;
+	struct dirent *ent;
+	int ret = 1;
+	DIR *d;
+
+	if ((NULL != db->main_file) || !getdef_bool ("SHARDED_DATABASES")) {
+		return 0;
+	}
+	(void) snprintf (dir, sizeof dir, "%s.d", db->filename);
+	d = opendir (dir);
+	if (NULL == d) {
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	while (NULL != (ent = readdir (d))) {
+		if (!valid_shard_name (ent->d_name)) {
+			continue;
+		}
+		if (0 == (count % 64)) {
+			char **n = realloc (names, (count + 64) * sizeof *n);
 
-#ifdef HAVE_LCKPWDF
-	/*
-	 * Only if the system libc has a real lckpwdf() - the one from
-	 * lockpw.c calls us and would cause infinite recursion!
-	 * It is also not used with the prefix option.
-	 */
-	if (!db->setname) {
-		/*
-		 * Call lckpwdf() on the first lock.
-		 * If it succeeds, call *_lock() only once
-		 * (no retries, it should always succeed).
-		 */
-		if (0 == lock_count) {
-			if (lckpwdf () == -1) {
-				if (geteuid () != 0) {
-					(void) fprintf (shadow_logfd,
-					                "%s: Permission denied.\n",
-					                shadow_progname);
-				}
-				return 0;	/* failure */
+			if (NULL == n) {
+				ret = -1;
+				break;
 			}
+			names = n;
 		}
-
-		if (commonio_lock_nowait (db, true) != 0) {
-			return 1;	/* success */
+		names[count] = strdup (ent->d_name);
+		if (NULL == names[count]) {
+			ret = -1;
+			break;
 		}
-
-		ulckpwdf ();
-		return 0;		/* failure */
+		count++;
 	}
-#endif				/* !HAVE_LCKPWDF */
-
-	/*
-	 * lckpwdf() not used - do it the old way.
-	 */
-#ifndef LOCK_TRIES
-#define LOCK_TRIES 15
-#endif
+	(void) closedir (d);
 
-#ifndef LOCK_SLEEP
-#define LOCK_SLEEP 1
-#endif
-	for (i = 0; i < LOCK_TRIES; i++) {
-		if (i > 0) {
-			sleep (LOCK_SLEEP);	/* delay between retries */
-		}
-		if (commonio_lock_nowait (db, i==LOCK_TRIES-1) != 0) {
-			return 1;	/* success */
+	if (1 == ret) {
+		qsort (names, count, sizeof *names, shard_name_cmp);
+		if (fprintf (db->fp, "%s\n", SHARDS_MARKER) < 0) {
+			ret = -1;
 		}
-		/* no unnecessary retries on "permission denied" errors */
-		if (geteuid () != 0) {
-			(void) fprintf (shadow_logfd, "%s: Permission denied.\n",
-			                shadow_progname);
-			return 0;
+	}
+	for (i = 0; (1 == ret) && (i < count); i++) {
+		(void) snprintf (path, sizeof path, "%s/%s", dir, names[i]);
+		if (copy_shard (db->fp, path) != 0) {
+			ret = -1;
 		}
 	}
-	return 0;		/* failure */
+
+	for (i = 0; i < count; i++) {
+		free (names[i]);
+	}
+	free (names);
+	return ret;
 }
 
-static void dec_lock_count (void)
+/*
+ * publish_shard - Regenerate the copy of the shards in the main file of
+ *	the shard db, which was just written.
+ *
+ *	The main file is locked for the time of the copy.
+ *	Return 0 on success, -1 on failure.
+ */
+static int publish_shard (const struct commonio_db *db)
 {
-	if (lock_count > 0) {
-		lock_count--;
-		if (lock_count == 0) {
-			/* Tell nscd when lock count goes to zero,
-			   if any of the files were changed.  */
-			if (nscd_need_reload) {
-				nscd_flush_cache ("passwd");
-				nscd_flush_cache ("group");
-				sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
-				nscd_need_reload = false;
-			}
-#ifdef HAVE_LCKPWDF
-			ulckpwdf ();
-#endif				/* HAVE_LCKPWDF */
+	struct commonio_ops ops = *db->ops;
+	struct commonio_db main_db;
+	int ret = -1;
+
+	/* The hooks work on the databases of the tools */
+	ops.open_hook = NULL;
+	ops.close_hook = NULL;
+
+	memzero (&main_db, sizeof main_db);
+	(void) snprintf (main_db.filename, sizeof main_db.filename,
+	                 "%s", db->main_file);
+	main_db.ops = &ops;
+	main_db.st_mode = db->st_mode;
+	main_db.st_uid = db->st_uid;
+	main_db.st_gid = db->st_gid;
+	main_db.setname = true;
+
+	if (commonio_lock (&main_db) == 0) {
+		return -1;
+	}
+	if (commonio_open (&main_db, O_RDWR | O_CREAT) != 0) {
+		main_db.changed = true;
+		if (commonio_close (&main_db) != 0) {
+			ret = 0;
 		}
 	}
+	(void) commonio_unlock (&main_db);
+	return ret;
+}
+
+bool commonio_present (const struct commonio_db *db)
+{
+	return (access (db->filename, F_OK) == 0);
 }
 
 
-int commonio_unlock (struct commonio_db *db)
+/* The lock file of lckpwdf() */
+#ifndef PWD_LOCK_FILE
+#define PWD_LOCK_FILE "/etc/.pwd.lock"
+#endif
+
+/* Default time to wait for a lock, in milliseconds */
+#ifndef LOCK_TIMEOUT
+#define LOCK_TIMEOUT 15000
+#endif
+
+static void lock_alarm (unused int sig)
 {
-	if (db->isopen) {
-		db->readonly = true;
-		if (commonio_close (db) == 0) {
-			if (db->locked) {
-				dec_lock_count ();
-			}
-			return 0;
-		}
-	}
-	if (db->locked) {
-		db->locked = false;
-
-		do_fcntl_lock (db->filename, false, F_UNLCK);
-		dec_lock_count ();
-		return 1;
-	}
-	return 0;
+	/* Only interrupt fcntl() */
 }
 
-
 /*
- * Add an entry at the end.
+ * set_lock - Set the OFD lock lck on fd, waiting at most timeout
+ *	milliseconds for it (0: do not wait).
  *
- * defines p->next, p->prev
- * (unfortunately, owned special are not supported)
+ *	The wait is interrupted by a SIGALRM. Any previous handler and
+ *	timer are restored.
+ *
+ *	Return 0 on success, -1 on failure.
  */
-static void add_one_entry (struct commonio_db *db,
-                           /*@owned@*/struct commonio_entry *p)
+static int set_lock (int fd, struct flock *lck, unsigned long timeout)
 {
-	/*@-mustfreeonly@*/
-	p->next = NULL;
-	p->prev = db->tail;
-	/*@=mustfreeonly@*/
-	if (NULL == db->head) {
-		db->head = p;
+	struct sigaction sa, old_sa;
+	struct itimerval it, old_it;
+	int ret;
+	int err;
+
+	if (0 == timeout) {
+		return fcntl (fd, F_OFD_SETLK, lck);
 	}
-	if (NULL != db->tail) {
-		db->tail->next = p;
+
+	memzero (&sa, sizeof sa);
+	sa.sa_handler = lock_alarm;
+	(void) sigemptyset (&sa.sa_mask);
+	sa.sa_flags = 0;	/* no SA_RESTART */
+	if (sigaction (SIGALRM, &sa, &old_sa) != 0) {
+		return -1;
 	}
-	db->tail = p;
-}
 
+	memzero (&it, sizeof it);
+	it.it_value.tv_sec = timeout / 1000;
+	it.it_value.tv_usec = (timeout % 1000) * 1000;
+	if (setitimer (ITIMER_REAL, &it, &old_it) != 0) {
+		(void) sigaction (SIGALRM, &old_sa, NULL);
+		return -1;
+	}
 
-static bool name_is_nis (const char *name)
-{
-	return (('+' == name[0]) || ('-' == name[0]));
+	ret = fcntl (fd, F_OFD_SETLKW, lck);
+	err = errno;
+
+	memzero (&it, sizeof it);
+	(void) setitimer (ITIMER_REAL, &old_it, NULL);
+	(void) sigaction (SIGALRM, &old_sa, NULL);
+
+	if ((-1 == ret) && (EINTR == err)) {
+		err = ETIMEDOUT;
+	}
+	errno = err;
+	return ret;
 }
 
+static unsigned long elapsed_ms (const struct timespec *start)
+{
+	struct timespec now;
 
-/*
- * New entries are inserted before the first NIS entry.  Order is preserved
- * when db is written out.
- */
-#ifndef KEEP_NIS_AT_END
-#define KEEP_NIS_AT_END 1
-#endif
+	if (clock_gettime (CLOCK_MONOTONIC, &now) != 0) {
+		return 0;
+	}
 
-#if KEEP_NIS_AT_END
-static void add_one_entry_nis (struct commonio_db *db,
-                               /*@owned@*/struct commonio_entry *newp);
+	return (now.tv_sec - start->tv_sec) * 1000UL
+	       + now.tv_nsec / 1000000 - start->tv_nsec / 1000000;
+}
 
 /*
- * Insert an entry between the regular entries, and the NIS entries.
+ * poll_lock - Set the OFD lock lck on fd, trying again for at most
+ *	timeout milliseconds, without blocking on it.
  *
- * defines newp->next, newp->prev
- * (unfortunately, owned special are not supported)
+ *	It is used for the locks taken out of the order of the names of
+ *	the databases, so that two processes taking the same locks in a
+ *	different order cannot block each other. The delay between the
+ *	tries starts at 1 ms, and doubles up to 64 ms.
+ *
+ *	Return 0 on success, -1 on failure.
  */
-static void add_one_entry_nis (struct commonio_db *db,
-                               /*@owned@*/struct commonio_entry *newp)
+static int poll_lock (int fd, struct flock *lck, unsigned long timeout)
 {
-	struct commonio_entry *p;
+	struct timespec start;
+	unsigned long delay = 1;
 
-	for (p = db->head; NULL != p; p = p->next) {
-		if (name_is_nis (p->eptr ? db->ops->getname (p->eptr)
-		                         : p->line)) {
-			/*@-mustfreeonly@*/
-			newp->next = p;
-			newp->prev = p->prev;
-			/*@=mustfreeonly@*/
-			if (NULL != p->prev) {
-				p->prev->next = newp;
-			} else {
-				db->head = newp;
-			}
-			p->prev = newp;
-			return;
+	if (clock_gettime (CLOCK_MONOTONIC, &start) != 0) {
+		memzero (&start, sizeof start);
+	}
+	while (fcntl (fd, F_OFD_SETLK, lck) != 0) {
+		struct timespec ts;
+		unsigned long waited;
+
+		if ((EAGAIN != errno) && (EACCES != errno)) {
+			return -1;
+		}
+		waited = elapsed_ms (&start);
+		if (waited >= timeout) {
+			return -1;
+		}
+		if (delay > timeout - waited) {
+			delay = timeout - waited;
+		}
+		ts.tv_sec = 0;
+		ts.tv_nsec = delay * 1000000L;
+		(void) nanosleep (&ts, NULL);
+		if (delay < 64) {
+			delay *= 2;
 		}
 	}
-	add_one_entry (db, newp);
+	return 0;
 }
-#endif				/* KEEP_NIS_AT_END */
-
-/* Initial buffer size, as well as increment if not sufficient
-   (for reading very long lines in group files).  */
-#define BUFLEN 4096
 
-int commonio_open (struct commonio_db *db, int mode)
+/*
+ * lock_file - Lock the database file.
+ *
+ *	An OFD write lock is taken on the file, waiting at most timeout
+ *	milliseconds for it (0: do not wait). It is held on db->lock_fd
+ *	until the database is unlocked.
+ *
+ *	Return 1 on success, 0 on failure.
+ */
+static int lock_file (struct commonio_db *db, bool log, unsigned long timeout)
 {
-	char *buf;
-	char *cp;
-	char *line;
-	struct commonio_entry *p;
-	void *eptr = NULL;
-	int flags = mode;
-	size_t buflen;
+	struct flock lck = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0,
+	};
+	struct timespec start;
+	struct stat sb_fd, sb_file;
+	unsigned long waited = 0;
+	bool ordered;
 	int fd;
-	int saved_errno;
-
-	mode &= ~O_CREAT;
 
-	if (   db->isopen
-	    || (   (O_RDONLY != mode)
-	        && (O_RDWR != mode))) {
-		errno = EINVAL;
-		return 0;
-	}
-	db->readonly = (mode == O_RDONLY);
-	if (!db->readonly && !db->locked) {
-		errno = EACCES;
-		return 0;
-	}
-
-	db->head = NULL;
-	db->tail = NULL;
-	db->cursor = NULL;
-	db->changed = false;
-
-	fd = open (db->filename,
-	             (db->readonly ? O_RDONLY : O_RDWR)
-	           | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
-	saved_errno = errno;
-	db->fp = NULL;
-	if (fd >= 0) {
-#ifdef WITH_TCB
-		if (tcb_is_suspect (fd) != 0) {
-			(void) close (fd);
-			errno = EINVAL;
-			return 0;
-		}
-#endif				/* WITH_TCB */
-		db->fp = fdopen (fd, db->readonly ? "r" : "r+");
-		saved_errno = errno;
-		if (NULL == db->fp) {
-			(void) close (fd);
-		}
+	if (clock_gettime (CLOCK_MONOTONIC, &start) != 0) {
+		memzero (&start, sizeof start);
 	}
-	errno = saved_errno;
 
 	/*
-	 * If O_CREAT was specified and the file didn't exist, it will be
-	 * created by commonio_close().  We have no entries to read yet.  --marekm
+	 * With per database locks, a process only blocks on the lock of
+	 * a database named after the databases it locked.
 	 */
-	if (NULL == db->fp) {
-		if (((flags & O_CREAT) != 0) && (ENOENT == errno)) {
-			db->isopen = true;
-			return 1;
-		}
-		return 0;
-	}
-
-	/* Do not inherit fd in spawned processes (e.g. nscd) */
-	fcntl (fileno (db->fp), F_SETFD, FD_CLOEXEC);
-
-	buflen = BUFLEN;
-	buf = (char *) malloc (buflen);
-	if (NULL == buf) {
-		goto cleanup_ENOMEM;
-	}
-
-	while (db->ops->fgets (buf, buflen, db->fp) == buf) {
-		while (   ((cp = strrchr (buf, '\n')) == NULL)
-		       && (feof (db->fp) == 0)) {
-			size_t len;
-
-			buflen += BUFLEN;
-			cp = (char *) realloc (buf, buflen);
-			if (NULL == cp) {
-				goto cleanup_buf;
-			}
-			buf = cp;
-			len = strlen (buf);
-			if (db->ops->fgets (buf + len,
-			                    (int) (buflen - len),
-			                    db->fp) == NULL) {
-				goto cleanup_buf;
+	ordered = (-1 == shared_lock_fd)
+	       || (strcmp (db->filename, lock_last) > 0);
+
+	for (;;) {
+		fd = open (db->filename, O_WRONLY | O_CLOEXEC, 0600);
+		if (-1 == fd) {
+			if (log) {
+				(void) fprintf (shadow_logfd, "%s: %s: %s\n",
+				                shadow_progname, db->filename,
+				                strerror (errno));
 			}
-		}
-		cp = strrchr (buf, '\n');
-		if (NULL != cp) {
-			*cp = '\0';
-		}
-
-		line = strdup (buf);
-		if (NULL == line) {
-			goto cleanup_buf;
+			return 0;
 		}
 
-		if (name_is_nis (line)) {
-			eptr = NULL;
-		} else {
-			eptr = db->ops->parse (line);
-			if (NULL != eptr) {
-				eptr = db->ops->dup (eptr);
-				if (NULL == eptr) {
-					goto cleanup_line;
+		if ((ordered ? set_lock (fd, &lck, (timeout > waited) ? timeout - waited : 0)
+		             : poll_lock (fd, &lck, (timeout > waited) ? timeout - waited : 0)) != 0) {
+			if (log) {
+				if (!((ETIMEDOUT == errno) || (EAGAIN == errno) || (EACCES == errno))) {
+					(void) fprintf (shadow_logfd,
+					                "%s: cannot lock %s: %s\n",
+					                shadow_progname, db->filename,
+					                strerror (errno));
+				} else {
+					(void) fprintf (shadow_logfd,
+					                "%s: cannot lock %s: timed out after %lu ms\n",
+					                shadow_progname, db->filename,
+					                elapsed_ms (&start));
 				}
 			}
+			(void) close (fd);
+			return 0;
 		}
 
-		p = (struct commonio_entry *) malloc (sizeof *p);
-		if (NULL == p) {
-			goto cleanup_entry;
+		/*
+		 * The file may have been replaced while we were waiting.
+		 * The lock is only valid on the current file.
+		 */
+		waited = elapsed_ms (&start);
+		if (   (fstat (fd, &sb_fd) == 0)
+		    && (stat (db->filename, &sb_file) == 0)
+		    && (sb_fd.st_dev == sb_file.st_dev)
+		    && (sb_fd.st_ino == sb_file.st_ino)) {
+			break;
 		}
+		(void) close (fd);
+	}
 
-		p->eptr = eptr;
-		p->line = line;
-		p->changed = false;
-
-		add_one_entry (db, p);
+	if (waited > 0) {
+		SYSLOG ((LOG_INFO, "waited %lu ms for the lock of %s",
+		         waited, db->filename));
 	}
 
-	free (buf);
+	db->lock_fd = fd;
+	db->locked = true;
+	if ((-1 != shared_lock_fd) && ordered) {
+		(void) strcpy (lock_last, db->filename);
+	}
+	if (0 == lock_count) {
+		log_hold ();
+	}
+	lock_count++;
+	return 1;
+}
 
-	if (ferror (db->fp) != 0) {
-		goto cleanup_errno;
+static int lock_db (struct commonio_db *db, bool log, unsigned long timeout)
+{
+	struct timespec start;
+	int ret;
+
+	PROBE1 (lock__start, db->filename);
+	timing_start (&start);
+	ret = lock_file (db, log, timeout);
+	timing_db_stop (db->filename, TIMING_DB_LOCK, &start);
+	PROBE2 (lock__done, db->filename, ret);
+	metrics_observe (METRICS_LOCK_WAIT, db->filename, &start);
+	if (0 != ret) {
+		timing_start (&db->locked_at);
 	}
+	return ret;
+}
 
-	if ((NULL != db->ops->open_hook) && (db->ops->open_hook () == 0)) {
-		goto cleanup_errno;
+int commonio_lock_nowait (struct commonio_db *db, bool log)
+{
+	if (db->locked) {
+		return 1;
 	}
 
-	db->isopen = true;
-	return 1;
+	return lock_db (db, log, 0);
+}
 
-      cleanup_entry:
-	if (NULL != eptr) {
-		db->ops->free (eptr);
+
+/*
+ * commonio_lock_wait - Lock the database, waiting at most timeout
+ *	milliseconds for the lock.
+ */
+int commonio_lock_wait (struct commonio_db *db, unsigned long timeout)
+{
+	if (db->locked) {
+		return 1;
 	}
-      cleanup_line:
-	free (line);
-      cleanup_buf:
-	free (buf);
-      cleanup_ENOMEM:
-	errno = ENOMEM;
-      cleanup_errno:
-	saved_errno = errno;
-	free_linked_list (db);
-	fclose (db->fp);
-	db->fp = NULL;
-	errno = saved_errno;
-	return 0;
+
+	return lock_db (db, true, timeout);
 }
 
+
+#ifdef HAVE_LCKPWDF
 /*
- * Sort given db according to cmp function (usually compares uids)
+ * lock_shared - Take a shared lock of the lock file of lckpwdf().
+ *
+ *	With PER_DATABASE_LOCKING, the tools only lock the databases they
+ *	use, and share the lock of lckpwdf(), which is exclusive. They
+ *	still wait for the programs which call lckpwdf(), and these
+ *	programs for them.
+ *
+ *	Return 0 on success, -1 on failure.
  */
-int
-commonio_sort (struct commonio_db *db, int (*cmp) (const void *, const void *))
+static int lock_shared (unsigned long timeout)
 {
-	struct commonio_entry **entries, *ptr;
-	size_t n = 0, i;
-#if KEEP_NIS_AT_END
-	struct commonio_entry *nis = NULL;
-#endif
+	struct flock lck = {
+		.l_type = F_RDLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0,
+	};
+	int fd;
 
-	for (ptr = db->head;
-	        (NULL != ptr)
-#if KEEP_NIS_AT_END
-	     && ((NULL == ptr->line)
-	         || (('+' != ptr->line[0])
-	             && ('-' != ptr->line[0])))
-#endif
-	     ;
-	     ptr = ptr->next) {
-		n++;
+	fd = open (PWD_LOCK_FILE, O_RDONLY | O_CREAT | O_CLOEXEC, 0600);
+	if (-1 == fd) {
+		return -1;
 	}
-#if KEEP_NIS_AT_END
-	if (NULL != ptr) {
-		nis = ptr;
+	if (set_lock (fd, &lck, timeout) != 0) {
+		(void) close (fd);
+		return -1;
 	}
-#endif
+	shared_lock_fd = fd;
+	lock_last[0] = '\0';
+	return 0;
+}
 
-	if (n <= 1) {
-		return 0;
+static void unlock_shared (void)
+{
+	(void) close (shared_lock_fd);
+	shared_lock_fd = -1;
+}
+#endif				/* HAVE_LCKPWDF */
+
+int commonio_lock (struct commonio_db *db)
+{
+	unsigned long timeout;
+
+	if (deadline_check ("lock") != 0) {
+		return 0;	/* failure */
 	}
+	timeout = deadline_remaining (getdef_ulong ("LOCK_TIMEOUT_MS",
+	                                            LOCK_TIMEOUT));
 
-	entries = malloc (n * sizeof (struct commonio_entry *));
-	if (entries == NULL) {
-		return -1;
-	}
+#ifdef HAVE_LCKPWDF
+	/*
+	 * With PER_DATABASE_LOCKING, the databases are locked separately,
+	 * see lock_shared().
+	 */
+	if (!db->setname && getdef_bool ("PER_DATABASE_LOCKING")) {
+		if ((0 == lock_count) && (lock_shared (timeout) != 0)) {
+			if (geteuid () != 0) {
+				(void) fprintf (shadow_logfd,
+				                "%s: Permission denied.\n",
+				                shadow_progname);
+			}
+			return 0;	/* failure */
+		}
 
-	n = 0;
-	for (ptr = db->head;
-#if KEEP_NIS_AT_END
-	     nis != ptr;
-#else
-	     NULL != ptr;
-#endif
-/*@ -nullderef @*/
-	     ptr = ptr->next
-/*@ +nullderef @*/
-	    ) {
-		entries[n] = ptr;
-		n++;
-	}
-	qsort (entries, n, sizeof (struct commonio_entry *), cmp);
+		if (commonio_lock_wait (db, timeout) != 0) {
+			return 1;	/* success */
+		}
 
-	/* Take care of the head and tail separately */
-	db->head = entries[0];
-	n--;
-#if KEEP_NIS_AT_END
-	if (NULL == nis)
-#endif
-	{
-		db->tail = entries[n];
+		if (0 == lock_count) {
+			unlock_shared ();
+		}
+		return 0;		/* failure */
 	}
-	db->head->prev = NULL;
-	db->head->next = entries[1];
-	entries[n]->prev = entries[n - 1];
-#if KEEP_NIS_AT_END
-	entries[n]->next = nis;
-#else
-	entries[n]->next = NULL;
-#endif
 
-	/* Now other elements have prev and next entries */
-	for (i = 1; i < n; i++) {
-		entries[i]->prev = entries[i - 1];
-		entries[i]->next = entries[i + 1];
+	/*
+	 * Only if the system libc has a real lckpwdf() - the one from
+	 * lockpw.c calls us and would cause infinite recursion!
+	 * It is also not used with the prefix option.
+	 */
+	if (!db->setname) {
+		/*
+		 * Call lckpwdf() on the first lock.
+		 * If it succeeds, the lock of the file should be free.
+		 */
+		if (0 == lock_count) {
+			if (lckpwdf () == -1) {
+				if (geteuid () != 0) {
+					(void) fprintf (shadow_logfd,
+					                "%s: Permission denied.\n",
+					                shadow_progname);
+				}
+				return 0;	/* failure */
+			}
+		}
+
+		if (commonio_lock_wait (db, timeout) != 0) {
+			return 1;	/* success */
+		}
+
+		ulckpwdf ();
+		return 0;		/* failure */
 	}
+#endif				/* !HAVE_LCKPWDF */
 
-	free (entries);
-	db->changed = true;
+	/*
+	 * lckpwdf() not used - block on the lock of the file.
+	 */
+	if (commonio_lock_wait (db, timeout) != 0) {
+		return 1;	/* success */
+	}
+	if (geteuid () != 0) {
+		(void) fprintf (shadow_logfd, "%s: Permission denied.\n",
+		                shadow_progname);
+	}
+	return 0;		/* failure */
+}
 
-	return 0;
+static void flush_dbs (int dbs)
+{
+	if ((dbs & SSSD_DB_PASSWD) != 0) {
+		nscd_flush_cache ("passwd");
+	}
+	if ((dbs & SSSD_DB_GROUP) != 0) {
+		nscd_flush_cache ("group");
+	}
+	sssd_flush_cache (dbs);
 }
 
 /*
- * Sort entries in db according to order in another.
+ * flush_caches - Invalidate the name service caches of the databases
+ *	modified since the last flush.
+ *
+ *	With ASYNC_CACHE_FLUSH, the caches are invalidated by a detached
+ *	process, and the caller does not wait for it.
  */
-int commonio_sort_wrt (struct commonio_db *shadow,
-                       const struct commonio_db *passwd)
+static void flush_caches (void)
 {
-	struct commonio_entry *head = NULL, *pw_ptr, *spw_ptr;
-	const char *name;
+	int dbs = cache_dbs;
+	struct timespec start;
+	pid_t pid;
 
-	if ((NULL == shadow) || (NULL == shadow->head)) {
-		return 0;
+	cache_dbs = 0;
+	if (0 == dbs) {
+		return;
 	}
 
-	for (pw_ptr = passwd->head; NULL != pw_ptr; pw_ptr = pw_ptr->next) {
-		if (NULL == pw_ptr->eptr) {
-			continue;
-		}
-		name = passwd->ops->getname (pw_ptr->eptr);
-		for (spw_ptr = shadow->head;
-		     NULL != spw_ptr;
-		     spw_ptr = spw_ptr->next) {
-			if (NULL == spw_ptr->eptr) {
-				continue;
-			}
-			if (strcmp (name, shadow->ops->getname (spw_ptr->eptr))
-			    == 0) {
-				break;
+	timing_start (&start);
+	metrics_add (METRICS_CACHE_FLUSHES, NULL, 1);
+
+	if (getdef_bool ("ASYNC_CACHE_FLUSH")) {
+		pid = fork ();
+		if (0 == pid) {
+			if (fork () == 0) {
+				flush_dbs (dbs);
 			}
+			_exit (0);
 		}
-		if (NULL == spw_ptr) {
-			continue;
+		if (pid > 0) {
+			(void) waitpid (pid, NULL, 0);
+			timing_stop ("cache_flush", &start);
+			return;
 		}
-		commonio_del_entry (shadow, spw_ptr);
-		spw_ptr->next = head;
-		head = spw_ptr;
+		/* Could not fork, flush the caches now */
 	}
 
-	for (spw_ptr = head; NULL != spw_ptr; spw_ptr = head) {
-		head = head->next;
+	flush_dbs (dbs);
+	timing_stop ("cache_flush", &start);
+}
 
-		if (NULL != shadow->head) {
-			shadow->head->prev = spw_ptr;
+static void dec_lock_count (void)
+{
+	if (lock_count > 0) {
+		lock_count--;
+		if (lock_count == 0) {
+			locked_changes = false;
+			/* Tell nscd when lock count goes to zero,
+			   if any of the files were changed.  */
+			flush_caches ();
+#ifdef HAVE_LCKPWDF
+			if (-1 != shared_lock_fd) {
+				unlock_shared ();
+			} else {
+				ulckpwdf ();
+			}
+#endif				/* HAVE_LCKPWDF */
+			/* Send the messages logged while locked */
+			log_release ();
 		}
-		spw_ptr->next = shadow->head;
-		shadow->head = spw_ptr;
 	}
-
-	shadow->head->prev = NULL;
-	shadow->changed = true;
-
-	return 0;
 }
 
+
 /*
- * write_all - Write the database to its file.
- *
- * It returns 0 if all the entries could be written correctly.
+ * release_lock - Release the lock of a locked database.
  */
-static int write_all (const struct commonio_db *db)
-	/*@requires notnull db->fp@*/
+static void release_lock (struct commonio_db *db)
 {
-	const struct commonio_entry *p;
-	void *eptr;
+	db->locked = false;
 
-	for (p = db->head; NULL != p; p = p->next) {
-		if (p->changed) {
-			eptr = p->eptr;
-			assert (NULL != eptr);
-			if (db->ops->put (eptr, db->fp) != 0) {
-				return -1;
-			}
-		} else if (NULL != p->line) {
-			if (db->ops->fputs (p->line, db->fp) == EOF) {
-				return -1;
-			}
-			if (putc ('\n', db->fp) == EOF) {
-				return -1;
+	/* Closing the file releases its lock */
+	(void) close (db->lock_fd);
+	timing_db_stop (db->filename, TIMING_DB_HOLD, &db->locked_at);
+	dec_lock_count ();
+}
+
+int commonio_unlock (struct commonio_db *db)
+{
+	if (db->isopen) {
+		db->readonly = true;
+		if (commonio_close (db) == 0) {
+			if (db->locked) {
+				release_lock (db);
 			}
+			return 0;
 		}
 	}
+	if (db->locked) {
+		release_lock (db);
+		return 1;
+	}
 	return 0;
 }
 
 
-int commonio_close (struct commonio_db *db)
+/* Minimal number of buckets of the indexes */
+#define INDEX_MIN_SIZE 64
+
+/*
+ * name_hash - Hash a name.
+ *
+ *	The hash stops at the first ':', so that the line of an entry
+ *	which is not parsed yet hashes like its name.
+ */
+static size_t name_hash (const char *name)
 {
-	char buf[1024];
-	int errors = 0;
-	struct stat sb;
+	size_t h = 5381;
 
-	if (!db->isopen) {
-		errno = EINVAL;
-		return 0;
+	while (('\0' != *name) && (':' != *name)) {
+		h = (h * 33) ^ (unsigned char) *name;
+		name++;
 	}
-	db->isopen = false;
+	return h;
+}
 
-	if (!db->changed || db->readonly) {
-		if (NULL != db->fp) {
-			(void) fclose (db->fp);
-			db->fp = NULL;
-		}
-		goto success;
+static size_t id_hash (unsigned long id)
+{
+	return (size_t) (id * 2654435761UL);
+}
+
+/*
+ * entry_getname - Return the name of a parsed entry.
+ * entry_getid - Return the ID of a parsed entry.
+ *
+ *	With ops->direct_fields, the field is read from the entry, so that
+ *	the loops over all the entries do not make an indirect call for
+ *	each of them.
+ */
+static inline const char *entry_getname (const struct commonio_db *db,
+                                         const void *eptr)
+{
+	if (db->ops->direct_fields) {
+		return *(const char *const *) ((const char *) eptr
+		                               + db->ops->name_offset);
 	}
+	return db->ops->getname (eptr);
+}
 
-	if ((NULL != db->ops->close_hook) && (db->ops->close_hook () == 0)) {
-		goto fail;
+static inline unsigned long entry_getid (const struct commonio_db *db,
+                                         const void *eptr)
+{
+	if (db->ops->direct_fields) {
+		return *(const uid_t *) ((const char *) eptr
+		                         + db->ops->id_offset);
 	}
+	return db->ops->getid (eptr);
+}
 
-	memzero (&sb, sizeof sb);
-	if (NULL != db->fp) {
-		if (fstat (fileno (db->fp), &sb) != 0) {
-			(void) fclose (db->fp);
-			db->fp = NULL;
-			goto fail;
-		}
+/*
+ * entry_name_hash - Hash the name of a parsed or unparsed entry.
+ */
+static size_t entry_name_hash (const struct commonio_db *db,
+                               const struct commonio_entry *p)
+{
+	return name_hash ((NULL != p->eptr) ? entry_getname (db, p->eptr)
+	                                    : p->line);
+}
 
-		/*
-		 * Create backup file.
-		 */
-		snprintf (buf, sizeof buf, "%s-", db->filename);
+/*
+ * index_insert - Insert an entry in the name and ID indexes.
+ *
+ *	The entry must be parsed, or not parsed yet.
+ */
+static void index_insert (struct commonio_db *db, struct commonio_entry *p)
+{
+	size_t h;
 
-#ifdef WITH_SELINUX
-		if (set_selinux_file_context (db->filename, S_IFREG) != 0) {
-			errors++;
-		}
-#endif
-		if (create_backup (buf, db->fp) != 0) {
-			errors++;
-		}
+	h = entry_name_hash (db, p) % db->index_size;
+	p->hnext = db->index[h];
+	db->index[h] = p;
 
-		if (fclose (db->fp) != 0) {
-			errors++;
-		}
+	if ((NULL != db->id_index) && (NULL != p->eptr)) {
+		h = id_hash (entry_getid (db, p->eptr)) % db->index_size;
+		p->idnext = db->id_index[h];
+		db->id_index[h] = p;
+	}
+	db->index_count++;
+}
 
-#ifdef WITH_SELINUX
-		if (reset_selinux_file_context () != 0) {
-			errors++;
+/*
+ * index_resize - (Re)build the indexes with the given number of buckets.
+ *
+ *	All the parsed (or not yet parsed) entries of the linked list are
+ *	indexed. In compact mode, the entries are not indexed by ID, since
+ *	that would need to parse all of them.
+ *
+ *	It returns 0 on failure (the indexes are then dropped and lookups
+ *	fall back to a linear scan), 1 on success.
+ */
+static int index_resize (struct commonio_db *db, size_t size)
+{
+	struct commonio_entry **index;
+	struct commonio_entry **id_index = NULL;
+	struct commonio_entry *p;
+
+	index = calloc (size, sizeof *index);
+	if (NULL == index) {
+		index_free (db);
+		return 0;
+	}
+	if ((NULL != db->ops->getid) && !db->compact) {
+		id_index = calloc (size, sizeof *id_index);
+		if (NULL == id_index) {
+			free (index);
+			index_free (db);
+			return 0;
 		}
-#endif
-		if (errors != 0) {
-			db->fp = NULL;
-			goto fail;
+	}
+	index_free (db);
+	db->index = index;
+	db->id_index = id_index;
+	db->index_size = size;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if ((NULL != p->eptr) || p->unparsed) {
+			index_insert (db, p);
 		}
-	} else {
-		/*
-		 * Default permissions for new [g]shadow files.
-		 */
-		sb.st_mode = db->st_mode;
-		sb.st_uid = db->st_uid;
-		sb.st_gid = db->st_gid;
 	}
+	return 1;
+}
 
-	snprintf (buf, sizeof buf, "%s+", db->filename);
+/*
+ * index_build - Build the indexes once the database is loaded.
+ */
+static int index_build (struct commonio_db *db)
+{
+	size_t size = INDEX_MIN_SIZE;
+	size_t n = 0;
+	const struct commonio_entry *p;
 
-#ifdef WITH_SELINUX
-	if (set_selinux_file_context (db->filename, S_IFREG) != 0) {
-		errors++;
+	if (NULL == db->ops->getname) {
+		return 0;
 	}
-#endif
 
-	db->fp = fopen_set_perms (buf, "w", &sb);
-	if (NULL == db->fp) {
-		goto fail;
+	for (p = db->head; NULL != p; p = p->next) {
+		n++;
+	}
+	while ((size < n) && (size < SIZE_MAX / (2 * sizeof *db->index))) {
+		size *= 2;
+	}
+	return index_resize (db, size);
+}
+
+static void index_free (struct commonio_db *db)
+{
+	free (db->index);
+	free (db->id_index);
+	db->index = NULL;
+	db->id_index = NULL;
+	db->index_size = 0;
+	db->index_count = 0;
+}
+
+/*
+ * index_add - Add an entry to the indexes.
+ *
+ *	The entry must already be linked in the list.
+ */
+static void index_add (struct commonio_db *db, struct commonio_entry *p)
+{
+	members_add (db, p);
+
+	if ((NULL == db->index) || ((NULL == p->eptr) && !p->unparsed)) {
+		return;
+	}
+
+	/* Keep the load factor below 1 */
+	if (   (db->index_count >= db->index_size)
+	    && (db->index_size < SIZE_MAX / (2 * sizeof *db->index))) {
+		/* Rebuilding the indexes also indexes p */
+		(void) index_resize (db, db->index_size * 2);
+		return;
+	}
+
+	index_insert (db, p);
+}
+
+/*
+ * index_del - Remove an entry from the indexes.
+ *
+ *	It must be called before the entry's eptr is replaced or freed.
+ */
+static void index_del (struct commonio_db *db, const struct commonio_entry *p)
+{
+	struct commonio_entry **pp;
+
+	members_del (db, p);
+
+	if ((NULL == db->index) || ((NULL == p->eptr) && !p->unparsed)) {
+		return;
+	}
+
+	pp = &db->index[entry_name_hash (db, p) % db->index_size];
+	for (; NULL != *pp; pp = &(*pp)->hnext) {
+		if (*pp == p) {
+			*pp = p->hnext;
+			db->index_count--;
+			break;
+		}
+	}
+
+	if ((NULL == db->id_index) || (NULL == p->eptr)) {
+		return;
+	}
+	pp = &db->id_index[id_hash (entry_getid (db, p->eptr))
+	                   % db->index_size];
+	for (; NULL != *pp; pp = &(*pp)->idnext) {
+		if (*pp == p) {
+			*pp = p->idnext;
+			break;
+		}
+	}
+}
+
+/*
+ * Reverse index of the member lists.
+ *
+ * Each name of the lists returned by ops->getmembers has a node, chained
+ * in the bucket of the name, which points to the entry listing it. The
+ * nodes are taken from the arena; those of the removed or replaced
+ * entries are unlinked, and released with the arena.
+ */
+struct commonio_member {
+	/*@dependent@*/const char *name;	/* in the entry's eptr */
+	/*@dependent@*/struct commonio_entry *entry;
+	/*@dependent@*/ /*@null@*/struct commonio_member *next;
+};
+
+/*
+ * members_insert - Add the members of an entry to the reverse index.
+ *
+ *	It returns 0 on failure (the index is then dropped), 1 on success.
+ */
+static int members_insert (struct commonio_db *db, struct commonio_entry *p)
+{
+	char *const *list;
+	size_t n, i;
+
+	for (n = 0; (list = db->ops->getmembers (p->eptr, n)) != NULL; n++) {
+		for (i = 0; NULL != list[i]; i++) {
+			struct commonio_member *m;
+			size_t h;
+
+			m = commonio_alloc (db, sizeof *m);
+			if (NULL == m) {
+				members_free (db);
+				return 0;
+			}
+			h = name_hash (list[i]) % db->members_size;
+			m->name = list[i];
+			m->entry = p;
+			m->next = db->members[h];
+			db->members[h] = m;
+		}
+	}
+	return 1;
+}
+
+/*
+ * members_build - Build the reverse index of the member lists, if it was
+ *                 requested with commonio_index_members().
+ */
+static void members_build (struct commonio_db *db)
+{
+	size_t size = INDEX_MIN_SIZE;
+	size_t count = 0;
+	struct commonio_entry *p;
+	char *const *list;
+	size_t n, i;
+
+	if (!db->index_members || (NULL == db->ops->getmembers)) {
+		return;
+	}
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (NULL == entry_eptr (db, p)) {
+			continue;
+		}
+		for (n = 0; (list = db->ops->getmembers (p->eptr, n)) != NULL; n++) {
+			for (i = 0; NULL != list[i]; i++) {
+				count++;
+			}
+		}
+	}
+	while ((size < count) && (size < SIZE_MAX / (2 * sizeof *db->members))) {
+		size *= 2;
+	}
+
+	db->members = calloc (size, sizeof *db->members);
+	if (NULL == db->members) {
+		return;
+	}
+	db->members_size = size;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (   (NULL != p->eptr)
+		    && (members_insert (db, p) == 0)) {
+			return;
+		}
+	}
+}
+
+static void members_free (struct commonio_db *db)
+{
+	free (db->members);
+	db->members = NULL;
+	db->members_size = 0;
+}
+
+/*
+ * members_add - Add the members of an entry to the reverse index.
+ *
+ *	The entry must already be linked in the list.
+ */
+static void members_add (struct commonio_db *db, struct commonio_entry *p)
+{
+	if ((NULL == db->members) || (NULL == p->eptr)) {
+		return;
+	}
+	(void) members_insert (db, p);
+}
+
+/*
+ * members_del - Remove the members of an entry from the reverse index.
+ *
+ *	It must be called before the entry's eptr is replaced or freed.
+ */
+static void members_del (struct commonio_db *db,
+                         const struct commonio_entry *p)
+{
+	char *const *list;
+	size_t n, i;
+
+	if ((NULL == db->members) || (NULL == p->eptr)) {
+		return;
+	}
+
+	for (n = 0; (list = db->ops->getmembers (p->eptr, n)) != NULL; n++) {
+		for (i = 0; NULL != list[i]; i++) {
+			struct commonio_member **mp;
+
+			/* Unlink all the nodes of p in this bucket */
+			mp = &db->members[name_hash (list[i]) % db->members_size];
+			while (NULL != *mp) {
+				if ((*mp)->entry == p) {
+					*mp = (*mp)->next;
+				} else {
+					mp = &(*mp)->next;
+				}
+			}
+		}
+	}
+}
+
+static bool name_is_nis (const char *name)
+{
+	return (('+' == name[0]) || ('-' == name[0]));
+}
+
+static bool entry_is_nis (const struct commonio_db *db,
+                          const struct commonio_entry *p)
+{
+	return name_is_nis ((NULL != p->eptr) ? entry_getname (db, p->eptr)
+	                                      : p->line);
+}
+
+/*
+ * Add an entry at the end.
+ *
+ * defines p->next, p->prev
+ * (unfortunately, owned special are not supported)
+ */
+static void add_one_entry (struct commonio_db *db,
+                           /*@owned@*/struct commonio_entry *p)
+{
+	/*@-mustfreeonly@*/
+	p->next = NULL;
+	p->prev = db->tail;
+	/*@=mustfreeonly@*/
+	if (NULL == db->head) {
+		db->head = p;
+	}
+	if (NULL != db->tail) {
+		db->tail->next = p;
+	}
+	db->tail = p;
+	index_add (db, p);
+
+	if (db->nis_known && (NULL == db->nis) && entry_is_nis (db, p)) {
+		db->nis = p;
+	}
+}
+
+
+/*
+ * New entries are inserted before the first NIS entry.  Order is preserved
+ * when db is written out.
+ */
+#ifndef KEEP_NIS_AT_END
+#define KEEP_NIS_AT_END 1
+#endif
+
+#if KEEP_NIS_AT_END
+static void add_one_entry_nis (struct commonio_db *db,
+                               /*@owned@*/struct commonio_entry *newp);
+
+/*
+ * Insert an entry between the regular entries, and the NIS entries.
+ *
+ * defines newp->next, newp->prev
+ * (unfortunately, owned special are not supported)
+ */
+static void add_one_entry_nis (struct commonio_db *db,
+                               /*@owned@*/struct commonio_entry *newp)
+{
+	struct commonio_entry *p;
+
+	/*
+	 * The first NIS entry is remembered, so that adding many entries
+	 * does not scan the list each time.
+	 */
+	if (!db->nis_known) {
+		for (p = db->head; NULL != p; p = p->next) {
+			if (entry_is_nis (db, p)) {
+				break;
+			}
+		}
+		db->nis = p;
+		db->nis_known = true;
+	}
+
+	p = db->nis;
+	if (NULL == p) {
+		add_one_entry (db, newp);
+		return;
+	}
+
+	/*@-mustfreeonly@*/
+	newp->next = p;
+	newp->prev = p->prev;
+	/*@=mustfreeonly@*/
+	if (NULL != p->prev) {
+		p->prev->next = newp;
+	} else {
+		db->head = newp;
+	}
+	p->prev = newp;
+	index_add (db, newp);
+
+	if (entry_is_nis (db, newp)) {
+		db->nis = newp;
+	}
+}
+#endif				/* KEEP_NIS_AT_END */
+
+/*
+ * parse_line - Parse a line of the database into a new entry.
+ *
+ *	It returns NULL with errno set to ENOMEM if the memory could not be
+ *	allocated, and NULL with errno set to EINVAL if the line is not a
+ *	valid entry.
+ */
+static /*@null@*/void *parse_line (struct commonio_db *db, const char *line)
+{
+	void *eptr;
+
+	if (NULL != db->ops->parse_arena) {
+		errno = 0;
+		eptr = db->ops->parse_arena (db, line);
+		if ((NULL == eptr) && (ENOMEM != errno)) {
+			errno = EINVAL;
+		}
+		return eptr;
+	}
+
+	eptr = db->ops->parse (line);
+	if (NULL == eptr) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (NULL != db->ops->dup_arena) {
+		eptr = db->ops->dup_arena (db, eptr);
+	} else {
+		eptr = db->ops->dup (eptr);
+	}
+	if (NULL == eptr) {
+		errno = ENOMEM;
+	}
+	return eptr;
+}
+
+/*
+ * entry_eptr - Return the parsed entry of p, parsing its line first if
+ *              it was not parsed yet (compact mode).
+ *
+ *	It returns NULL if the line is not a valid entry (or a NIS entry).
+ *	If the memory could not be allocated, it returns NULL and the line
+ *	is parsed again the next time.
+ */
+static /*@null@*/void *entry_eptr (struct commonio_db *db,
+                                   struct commonio_entry *p)
+{
+	if (!p->unparsed) {
+		return p->eptr;
+	}
+
+	p->eptr = parse_line (db, p->line);
+	if (NULL == p->eptr) {
+		if (ENOMEM == errno) {
+			return NULL;
+		}
+		/* Invalid lines are not indexed */
+		index_del (db, p);
+	}
+	p->unparsed = false;
+	return p->eptr;
+}
+
+/*
+ * parse_all - Parse all the entries which were not parsed yet.
+ *
+ *	It returns 0 if the memory could not be allocated, 1 on success.
+ */
+static int parse_all (struct commonio_db *db)
+{
+	struct commonio_entry *p;
+
+	load_deferred (db);
+	for (p = db->head; NULL != p; p = p->next) {
+		if (   p->unparsed
+		    && (NULL == entry_eptr (db, p))
+		    && p->unparsed) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*
+ * entry_has_name - Check if an entry has the given name.
+ *
+ *	An entry which was not parsed yet is only parsed if its line
+ *	starts with this name.
+ */
+static bool entry_has_name (struct commonio_db *db,
+                            struct commonio_entry *p,
+                            const char *name)
+{
+	if (p->unparsed) {
+		size_t len = strlen (name);
+
+		if (   (strncmp (p->line, name, len) != 0)
+		    || (':' != p->line[len])) {
+			return false;
+		}
+		(void) entry_eptr (db, p);
+	}
+	return    (NULL != p->eptr)
+	       && (strcmp (entry_getname (db, p->eptr), name) == 0);
+}
+
+/*
+ * add_line - Add an entry for a line of the database, and its parsed entry
+ *            (if any), at the end of the list.
+ *
+ *	The line and eptr are owned by the new entry. On failure, it returns
+ *	0 with errno set and the line is left to the caller.
+ */
+static int add_line (struct commonio_db *db, /*@owned@*/char *line,
+                     /*@null@*/ /*@owned@*/void *eptr, bool unparsed)
+{
+	struct commonio_entry *p;
+
+	if (   (NULL != db->ops->dup_arena)
+	    || (NULL != db->ops->parse_arena)) {
+		p = commonio_alloc (db, sizeof *p);
+	} else {
+		p = (struct commonio_entry *) malloc (sizeof *p);
+	}
+	if (NULL == p) {
+		if (NULL != eptr) {
+			free_eptr (db, eptr);
+		}
+		errno = ENOMEM;
+		return 0;
+	}
+
+	p->eptr = eptr;
+	p->line = line;
+	p->hnext = NULL;
+	p->idnext = NULL;
+	p->changed = false;
+	p->unparsed = unparsed;
+
+	add_one_entry (db, p);
+	return 1;
+}
+
+/*
+ * load_line - Add an entry for a line of the database at the end of the
+ *             list.
+ *
+ *	The line is owned by the new entry. On failure, it returns 0 with
+ *	errno set and the line is left to the caller.
+ *
+ *	In compact mode, the line is only parsed when the entry is used.
+ */
+static int load_line (struct commonio_db *db, /*@owned@*/char *line)
+{
+	void *eptr = NULL;
+	bool unparsed = false;
+
+	if (name_is_nis (line)) {
+		/* NIS entries are not parsed */
+	} else if (db->compact) {
+		unparsed = true;
+	} else {
+		eptr = parse_line (db, line);
+		if ((NULL == eptr) && (ENOMEM == errno)) {
+			return 0;
+		}
+	}
+
+	return add_line (db, line, eptr, unparsed);
+}
+
+/*
+ * Parsing of the large files by several threads.
+ *
+ * The lines are collected in batches, and each job of a batch parses a
+ * slice of it with ops->parse_arena, in the arena of a private database
+ * structure. The entries are then added to the list in the order of the
+ * file by the main thread, and the arenas of the jobs are moved to the
+ * database once the file is loaded.
+ */
+#define PARSE_JOBS_MAX		16
+#define PARSE_JOB_MIN_SIZE	(4 * 1024 * 1024)	/* bytes of file per job */
+#define PARSE_BATCH		16384	/* lines per job and batch */
+
+struct parse_job {
+	/*@owned@*/struct commonio_db *db;	/* ops and arena of the job */
+	/*@dependent@*/char **lines;
+	/*@dependent@*/void **eptrs;
+	size_t count;
+	bool nomem;
+	pthread_t thread;
+};
+
+struct parse_pool {
+	struct parse_job jobs[PARSE_JOBS_MAX];
+	size_t njobs;
+	/*@owned@*/char **lines;
+	/*@owned@*/void **eptrs;
+	size_t count;
+};
+
+/*
+ * parse_jobs - Return the number of jobs to parse a file of the given
+ *              size.
+ *
+ *	Only the databases with a parse_arena operation (which does not use
+ *	static storage) are parsed by several jobs.
+ */
+static size_t parse_jobs (const struct commonio_db *db, size_t size)
+{
+	long cpus;
+	size_t jobs;
+
+	if ((NULL == db->ops->parse_arena) || db->compact) {
+		return 1;
+	}
+
+	jobs = size / PARSE_JOB_MIN_SIZE;
+	if (jobs <= 1) {
+		return 1;
+	}
+	cpus = sysconf (_SC_NPROCESSORS_ONLN);
+	if ((cpus > 0) && ((size_t) cpus < jobs)) {
+		jobs = (size_t) cpus;
+	}
+	if (jobs > PARSE_JOBS_MAX) {
+		jobs = PARSE_JOBS_MAX;
+	}
+	return jobs;
+}
+
+static void *parse_job_run (void *arg)
+{
+	struct parse_job *job = arg;
+	size_t i;
+
+	for (i = 0; i < job->count; i++) {
+		job->eptrs[i] = NULL;
+		if (name_is_nis (job->lines[i])) {
+			continue;
+		}
+		job->eptrs[i] = parse_line (job->db, job->lines[i]);
+		if ((NULL == job->eptrs[i]) && (ENOMEM == errno)) {
+			job->nomem = true;
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * pool_init - Prepare njobs jobs.
+ *
+ *	It returns 0 if the memory could not be allocated.
+ */
+static int pool_init (struct parse_pool *pool, const struct commonio_db *db,
+                      size_t njobs)
+{
+	size_t i;
+
+	memzero (pool, sizeof *pool);
+	pool->lines = malloc (njobs * PARSE_BATCH * sizeof *pool->lines);
+	pool->eptrs = malloc (njobs * PARSE_BATCH * sizeof *pool->eptrs);
+	if ((NULL == pool->lines) || (NULL == pool->eptrs)) {
+		free (pool->lines);
+		free (pool->eptrs);
+		return 0;
+	}
+	for (i = 0; i < njobs; i++) {
+		pool->jobs[i].db = calloc (1, sizeof *pool->jobs[i].db);
+		if (NULL == pool->jobs[i].db) {
+			break;
+		}
+		pool->jobs[i].db->ops = db->ops;
+		pool->njobs++;
+	}
+	if (pool->njobs < 2) {
+		free (pool->jobs[0].db);
+		free (pool->lines);
+		free (pool->eptrs);
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * pool_run - Parse the lines of the batch, and add them to the list.
+ *
+ *	It returns 0 on failure (errno set).
+ */
+static int pool_run (struct commonio_db *db, struct parse_pool *pool)
+{
+	size_t slice;
+	size_t i, first = 0;
+	bool nomem = false;
+
+	slice = (pool->count + pool->njobs - 1) / pool->njobs;
+	for (i = 0; i < pool->njobs; i++) {
+		struct parse_job *job = &pool->jobs[i];
+
+		job->lines = pool->lines + first;
+		job->eptrs = pool->eptrs + first;
+		job->count = (pool->count - first < slice) ? pool->count - first
+		                                           : slice;
+		job->nomem = false;
+		first += job->count;
+		/* The first slice is parsed by this thread */
+		if (   (i > 0)
+		    && (pthread_create (&job->thread, NULL, parse_job_run,
+		                        job) != 0)) {
+			(void) parse_job_run (job);
+			job->count = 0;	/* not joined */
+		}
+	}
+	(void) parse_job_run (&pool->jobs[0]);
+	for (i = 0; i < pool->njobs; i++) {
+		struct parse_job *job = &pool->jobs[i];
+
+		if ((i > 0) && (0 != job->count)) {
+			(void) pthread_join (job->thread, NULL);
+		}
+		nomem = nomem || job->nomem;
+	}
+	if (nomem) {
+		errno = ENOMEM;
+		return 0;
+	}
+
+	for (i = 0; i < pool->count; i++) {
+		if (add_line (db, pool->lines[i], pool->eptrs[i], false) == 0) {
+			return 0;
+		}
+	}
+	pool->count = 0;
+	return 1;
+}
+
+/*
+ * pool_free - Move the arenas of the jobs to the database, and release
+ *             the jobs.
+ */
+static void pool_free (struct commonio_db *db, struct parse_pool *pool)
+{
+	size_t i;
+
+	for (i = 0; i < pool->njobs; i++) {
+		struct commonio_db *jdb = pool->jobs[i].db;
+		struct commonio_arena *a = jdb->arena;
+
+		if (NULL != a) {
+			while (NULL != a->next) {
+				a = a->next;
+			}
+			a->next = db->arena;
+			db->arena = jdb->arena;
+		}
+		free (jdb);
+	}
+	free (pool->lines);
+	free (pool->eptrs);
+}
+
+/*
+ * load_mapped - Load the entries from a private mapping of the file.
+ *
+ *	The lines are NUL terminated in place (line continuations are
+ *	joined for fgetsx), so that the entries do not need a copy of
+ *	their line. The database files are always replaced by rename(),
+ *	so the mapped file is not truncated under us by the other tools.
+ *
+ *	It returns 1 on success, 0 on failure (errno set), and -1 if the
+ *	file cannot be mapped and shall be read with ops->fgets.
+ */
+static int load_mapped (struct commonio_db *db)
+{
+	struct stat sb;
+	char *map;
+	char *cp;
+	char *end;
+	size_t size;
+	long pagesize;
+	bool fold;
+	struct parse_pool pool;
+	size_t njobs;
+	int ret = 1;
+
+	if (db->ops->fgets == fgets) {
+		fold = false;
+	} else if (db->ops->fgets == fgetsx) {
+		fold = true;
+	} else {
+		return -1;
+	}
+
+	if (   (fstat (fileno (db->fp), &sb) != 0)
+	    || !S_ISREG (sb.st_mode)
+	    || (sb.st_size <= 0)
+	    || ((uintmax_t) sb.st_size >= SIZE_MAX)) {
+		return -1;
+	}
+	size = (size_t) sb.st_size;
+
+	pagesize = sysconf (_SC_PAGESIZE);
+	map = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+	            fileno (db->fp), 0);
+	if (MAP_FAILED == map) {
+		return -1;
+	}
+	/*
+	 * Without a final newline, the last line is terminated in the
+	 * zero-filled remainder of the last page, if there is one.
+	 */
+	if (   ('\n' != map[size - 1])
+	    && ((pagesize <= 0) || (size % (size_t) pagesize == 0))) {
+		(void) munmap (map, size);
+		return -1;
+	}
+	db->map = map;
+	db->map_size = size;
+
+	njobs = parse_jobs (db, size);
+	if ((njobs > 1) && (pool_init (&pool, db, njobs) == 0)) {
+		njobs = 1;
+	}
+
+	end = map + size;
+	for (cp = map; cp < end;) {
+		char *line = cp;
+		char *w = cp;	/* end of the (joined) line */
+
+		for (;;) {
+			char *nl = memchr (cp, '\n', (size_t) (end - cp));
+			size_t len = (size_t) (((NULL != nl) ? nl : end) - cp);
+
+			if (w != cp) {
+				memmove (w, cp, len);
+			}
+			w += len;
+			cp += len;
+			if (NULL == nl) {
+				break;
+			}
+			cp++;
+			if (!fold || (0 == len) || ('\\' != w[-1])) {
+				break;
+			}
+			w--;	/* drop the continuation backslash */
+			db->map_folded = true;
+		}
+		*w = '\0';
+
+		if (is_shards_marker (line)) {
+			break;
+		}
+		if (1 == njobs) {
+			ret = load_line (db, line);
+		} else {
+			pool.lines[pool.count] = line;
+			pool.count++;
+			if (pool.count == pool.njobs * PARSE_BATCH) {
+				ret = pool_run (db, &pool);
+			}
+		}
+		if (0 == ret) {
+			break;
+		}
+	}
+
+	if (njobs > 1) {
+		if ((1 == ret) && (0 != pool.count)) {
+			ret = pool_run (db, &pool);
+		}
+		pool_free (db, &pool);
+	}
+
+	return ret;
+}
+
+/*
+ * Generation of the databases
+ *
+ * Each file written by commonio carries its generation in the
+ * GENERATION_XATTR extended attribute. The attribute is set on file+
+ * before it replaces the file, so a generation always matches the
+ * content of the file which carries it. A file which has no generation
+ * (it is new, or was written by another program) gets the current time
+ * in nanoseconds, so that its generations do not repeat the ones it had
+ * before. When extended attributes are not supported, the generation
+ * is 0.
+ */
+#define GENERATION_XATTR	"user.shadow.generation"
+#define GENERATION_LEN	24	/* with the terminating NUL */
+
+static unsigned long long parse_generation (char *buf, ssize_t len)
+{
+	if ((len <= 0) || ((size_t) len >= GENERATION_LEN)) {
+		return 0;
+	}
+	buf[len] = '\0';
+	return strtoull (buf, NULL, 10);
+}
+
+/*
+ * fd_generation - Return the generation of an open file, or 0 if it
+ *	has none.
+ */
+static unsigned long long fd_generation (int fd)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char buf[GENERATION_LEN];
+
+	return parse_generation (buf, fgetxattr (fd, GENERATION_XATTR,
+	                                         buf, sizeof buf - 1));
+#else
+	(void) fd;
+	return 0;
+#endif
+}
+
+/*
+ * set_generation - Set the next generation of the database on its new
+ *	file, db->fp.
+ *
+ *	Failing to set it is not an error: the readers then use the other
+ *	attributes of the file.
+ */
+static void set_generation (struct commonio_db *db)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char buf[GENERATION_LEN];
+	struct timespec ts;
+	int len;
+
+	if (0 != db->generation) {
+		db->generation++;
+	} else if (clock_gettime (CLOCK_REALTIME, &ts) == 0) {
+		db->generation = (unsigned long long) ts.tv_sec * 1000000000ULL
+		                 + (unsigned long long) ts.tv_nsec;
+	} else {
+		db->generation = 1;
+	}
+
+	len = snprintf (buf, sizeof buf, "%llu", db->generation);
+	if (fsetxattr (fileno (db->fp), GENERATION_XATTR, buf, len, 0) != 0) {
+		db->generation = 0;
+	}
+#else
+	(void) db;
+#endif
+}
+
+/*
+ * commonio_generation - Return the generation of the database when it
+ *	was opened, or after it was written.
+ *
+ *	Return 0 if it is unknown.
+ */
+unsigned long long commonio_generation (const struct commonio_db *db)
+{
+	return db->generation;
+}
+
+/*
+ * commonio_file_generation - Return the current generation of the
+ *	database in filename, with a single system call.
+ *
+ *	A reader which kept the generation of the file it read can tell
+ *	whether the file was written since then by the tools. Return 0 if
+ *	it is unknown: the reader must then check the file otherwise.
+ */
+unsigned long long commonio_file_generation (const char *filename)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char buf[GENERATION_LEN];
+
+	return parse_generation (buf, getxattr (filename, GENERATION_XATTR,
+	                                        buf, sizeof buf - 1));
+#else
+	(void) filename;
+	return 0;
+#endif
+}
+
+/* Initial buffer size, doubled until the line fits
+   (for reading very long lines in group files).  */
+#define BUFLEN 4096
+
+/*
+ * read_line - Read the next line of fp with db->ops->fgets in *buf, of
+ *             *buflen bytes.
+ *
+ *	The buffer is doubled as long as the line does not fit, and only
+ *	the new part of the line is scanned after each read, so that
+ *	reading a line of any length is linear. The newline is removed,
+ *	and *len is set to the length of the line.
+ *
+ *	It returns 1 on success, 0 at the end of the file, and -1 if the
+ *	memory could not be allocated (errno set).
+ */
+static int read_line (const struct commonio_db *db, FILE *fp,
+                      char **buf, size_t *buflen, /*@out@*/size_t *len)
+{
+	size_t n;
+
+	*len = 0;
+	if (db->ops->fgets (*buf, (int) *buflen, fp) != *buf) {
+		return 0;
+	}
+	n = strlen (*buf);
+	while (   ((0 == n) || ('\n' != (*buf)[n - 1]))
+	       && (feof (fp) == 0)) {
+		char *cp;
+
+		if (*buflen > INT_MAX / 2) {
+			errno = ENOMEM;
+			return -1;
+		}
+		cp = realloc (*buf, *buflen * 2);
+		if (NULL == cp) {
+			errno = ENOMEM;
+			return -1;
+		}
+		*buf = cp;
+		*buflen *= 2;
+		if (db->ops->fgets (*buf + n, (int) (*buflen - n), fp) == NULL) {
+			break;
+		}
+		n += strlen (*buf + n);
+	}
+	if ((n > 0) && ('\n' == (*buf)[n - 1])) {
+		n--;
+		(*buf)[n] = '\0';
+	}
+	*len = n;
+	return 1;
+}
+
+int commonio_open (struct commonio_db *db, int mode)
+{
+	char *buf;
+	char *line;
+	int flags = mode;
+	size_t buflen;
+	size_t len;
+	struct timespec start;
+	int fd;
+	int saved_errno;
+	int ret;
+	unsigned long long bytes;
+
+	PROBE1 (open__start, db->filename);
+	timing_start (&start);
+	mode &= ~O_CREAT;
+
+	if (   db->isopen
+	    || (   (O_RDONLY != mode)
+	        && (O_RDWR != mode))) {
+		errno = EINVAL;
+		return 0;
+	}
+	db->readonly = (mode == O_RDONLY);
+	if (!db->readonly && !db->locked) {
+		errno = EACCES;
+		return 0;
+	}
+
+	db->head = NULL;
+	db->tail = NULL;
+	db->cursor = NULL;
+	db->merge = NULL;
+	db->nis_known = false;
+	db->changed = false;
+	db->index = NULL;
+	db->id_index = NULL;
+	db->index_size = 0;
+	db->index_count = 0;
+	db->members = NULL;
+	db->members_size = 0;
+	db->map = NULL;
+	db->map_size = 0;
+	db->map_folded = false;
+	db->removed = NULL;
+	db->nremoved = 0;
+	db->generation = 0;
+	db->arena = NULL;
+	db->deferred = false;
+
+	fd = open (db->filename,
+	             (db->readonly ? O_RDONLY : O_RDWR)
+	           | O_NOCTTY | O_NONBLOCK | O_NOFOLLOW);
+	saved_errno = errno;
+	db->fp = NULL;
+	if (fd >= 0) {
+#ifdef WITH_TCB
+		if (tcb_is_suspect (fd) != 0) {
+			(void) close (fd);
+			errno = EINVAL;
+			return 0;
+		}
+#endif				/* WITH_TCB */
+		db->fp = fdopen (fd, db->readonly ? "r" : "r+");
+		saved_errno = errno;
+		if (NULL == db->fp) {
+			(void) close (fd);
+		}
+	}
+	errno = saved_errno;
+
+	/*
+	 * If O_CREAT was specified and the file didn't exist, it will be
+	 * created by commonio_close().  We have no entries to read yet.  --marekm
+	 */
+	if (NULL == db->fp) {
+		if (((flags & O_CREAT) != 0) && (ENOENT == errno)) {
+			(void) index_build (db);
+			members_build (db);
+			db->isopen = true;
+			return 1;
+		}
+		return 0;
+	}
+
+	/* Do not inherit fd in spawned processes (e.g. nscd) */
+	fcntl (fileno (db->fp), F_SETFD, FD_CLOEXEC);
+
+	db->generation = fd_generation (fileno (db->fp));
+
+	ret = load_mapped (db);
+	if (0 == ret) {
+		goto cleanup_errno;
+	}
+	if (1 == ret) {
+		goto loaded;
+	}
+
+	buflen = BUFLEN;
+	buf = (char *) malloc (buflen);
+	if (NULL == buf) {
+		goto cleanup_ENOMEM;
+	}
+
+	while ((ret = read_line (db, db->fp, &buf, &buflen, &len)) == 1) {
+		if (is_shards_marker (buf)) {
+			break;
+		}
+
+		if (buflen > BUFLEN) {
+			/*
+			 * A long line keeps the buffer, shrunk to its
+			 * size, instead of a copy.
+			 */
+			line = realloc (buf, len + 1);
+			if (NULL == line) {
+				line = buf;
+			}
+			buflen = BUFLEN;
+			buf = malloc (buflen);
+			if (NULL == buf) {
+				free (line);
+				goto cleanup_ENOMEM;
+			}
+		} else {
+			line = malloc (len + 1);
+			if (NULL == line) {
+				goto cleanup_buf;
+			}
+			memcpy (line, buf, len + 1);
+		}
+
+		if (load_line (db, line) == 0) {
+			goto cleanup_line;
+		}
+	}
+	if (-1 == ret) {
+		goto cleanup_buf;
+	}
+
+	free (buf);
+
+	if (ferror (db->fp) != 0) {
+		goto cleanup_errno;
+	}
+
+      loaded:
+	if ((NULL != db->ops->open_hook) && (db->ops->open_hook () == 0)) {
+		goto cleanup_errno;
+	}
+
+	/*
+	 * The index is built after the open hook, which may merge
+	 * entries (split groups).
+	 */
+	(void) index_build (db);
+	members_build (db);
+
+	bytes = (NULL != db->map) ? db->map_size
+	                          : (unsigned long long) ftell (db->fp);
+	timing_db_stop (db->filename, TIMING_DB_OPEN, &start);
+	timing_db_count (db->filename, db->index_count, bytes, 0);
+	PROBE3 (open__done, db->filename, db->index_count, bytes);
+
+	db->isopen = true;
+	return 1;
+
+      cleanup_line:
+	free (line);
+      cleanup_buf:
+	free (buf);
+      cleanup_ENOMEM:
+	errno = ENOMEM;
+      cleanup_errno:
+	saved_errno = errno;
+	free_linked_list (db);
+	fclose (db->fp);
+	db->fp = NULL;
+	errno = saved_errno;
+	return 0;
+}
+
+/*
+ * commonio_open_deferred - Open a database, but only read it when it is
+ *	first accessed.
+ *
+ *	The checks of commonio_open() are done right away, but the file is
+ *	only opened and parsed by the first function which needs its
+ *	entries. A database which is never accessed is then neither read
+ *	nor written when it is closed, while its lock is still held for
+ *	the consistency of the changes of the other databases.
+ *
+ *	If the file cannot be read on the first access, the database is
+ *	closed and the access fails as if it was not open. Only the
+ *	databases whose module uses the commonio functions to access the
+ *	entries can be opened this way (not group, nor subuid and subgid).
+ *
+ *	Return 1 on success, 0 on failure (errno set).
+ */
+int commonio_open_deferred (struct commonio_db *db, int mode)
+{
+	int flags = mode & ~O_CREAT;
+
+	if (   db->isopen
+	    || (   (O_RDONLY != flags)
+	        && (O_RDWR != flags))) {
+		errno = EINVAL;
+		return 0;
+	}
+	if ((O_RDWR == flags) && !db->locked) {
+		errno = EACCES;
+		return 0;
+	}
+	/* Report a missing file now, as commonio_open() */
+	if (((mode & O_CREAT) == 0) && (access (db->filename, F_OK) != 0)) {
+		return 0;
+	}
+
+	db->readonly = (O_RDONLY == flags);
+	db->changed = false;
+	db->fp = NULL;
+	db->head = NULL;
+	db->tail = NULL;
+	db->cursor = NULL;
+	db->merge = NULL;
+	db->index = NULL;
+	db->id_index = NULL;
+	db->index_size = 0;
+	db->index_count = 0;
+	db->members = NULL;
+	db->members_size = 0;
+	db->map = NULL;
+	db->map_size = 0;
+	db->removed = NULL;
+	db->nremoved = 0;
+	db->arena = NULL;
+	db->generation = commonio_file_generation (db->filename);
+	db->deferred = true;
+	db->deferred_mode = mode;
+	db->isopen = true;
+	return 1;
+}
+
+/*
+ * load_deferred - Open a database opened with commonio_open_deferred(),
+ *	on its first access.
+ *
+ *	On failure, the database is closed.
+ */
+static void load_deferred (struct commonio_db *db)
+{
+	if (!db->isopen || !db->deferred) {
+		return;
+	}
+	db->isopen = false;
+	db->deferred = false;
+	if (commonio_open (db, db->deferred_mode) == 0) {
+		int saved_errno = errno;
+
+		fprintf (shadow_logfd, _("%s: cannot open %s: %s\n"),
+		         shadow_progname, db->filename, strerror (errno));
+		errno = saved_errno;
+	}
+}
+
+/*
+ * merge_runs - Sort the n entries with a natural merge sort
+ *
+ *	The runs of entries already in order are merged pairwise, so that
+ *	a nearly sorted file is sorted in a few passes. The sort is stable.
+ *	tmp is a buffer of n entries.
+ */
+static void merge_runs (struct commonio_entry **entries,
+                        struct commonio_entry **tmp, size_t n,
+                        int (*cmp) (const void *, const void *))
+{
+	struct commonio_entry **src = entries, **dst = tmp, **swap;
+	size_t runs;
+
+	do {
+		size_t lo = 0;
+
+		runs = 0;
+		while (lo < n) {
+			size_t mid = lo + 1, hi, i, j, k;
+
+			while ((mid < n) && (cmp (&src[mid - 1], &src[mid]) <= 0)) {
+				mid++;
+			}
+			hi = mid;
+			if (hi < n) {
+				hi++;
+				while ((hi < n) && (cmp (&src[hi - 1], &src[hi]) <= 0)) {
+					hi++;
+				}
+			}
+
+			i = lo;
+			j = mid;
+			k = lo;
+			while ((i < mid) && (j < hi)) {
+				dst[k++] = (cmp (&src[j], &src[i]) < 0) ? src[j++]
+				                                        : src[i++];
+			}
+			(void) memcpy (&dst[k], &src[i], (mid - i) * sizeof *dst);
+			k += mid - i;
+			(void) memcpy (&dst[k], &src[j], (hi - j) * sizeof *dst);
+
+			runs++;
+			lo = hi;
+		}
+		swap = src;
+		src = dst;
+		dst = swap;
+	} while (runs > 1);
+
+	if (src != entries) {
+		(void) memcpy (entries, src, n * sizeof *entries);
+	}
+}
+
+/*
+ * Sort given db according to cmp function (usually compares uids)
+ *
+ *	The database is left unchanged (and will not be written) if it is
+ *	already sorted, which is checked in one pass.
+ */
+int
+commonio_sort (struct commonio_db *db, int (*cmp) (const void *, const void *))
+{
+	struct commonio_entry **entries, **tmp, *ptr;
+	size_t n = 0, i;
+	bool sorted = true;
+#if KEEP_NIS_AT_END
+	struct commonio_entry *nis = NULL;
+#endif
+
+	if (parse_all (db) == 0) {
+		return -1;
+	}
+
+	for (ptr = db->head;
+	        (NULL != ptr)
+#if KEEP_NIS_AT_END
+	     && ((NULL == ptr->line)
+	         || (('+' != ptr->line[0])
+	             && ('-' != ptr->line[0])))
+#endif
+	     ;
+	     ptr = ptr->next) {
+		n++;
+	}
+#if KEEP_NIS_AT_END
+	if (NULL != ptr) {
+		nis = ptr;
+	}
+#endif
+
+	if (n <= 1) {
+		return 0;
+	}
+
+	entries = malloc (n * sizeof (struct commonio_entry *));
+	if (entries == NULL) {
+		return -1;
+	}
+
+	n = 0;
+	for (ptr = db->head;
+#if KEEP_NIS_AT_END
+	     nis != ptr;
+#else
+	     NULL != ptr;
+#endif
+/*@ -nullderef @*/
+	     ptr = ptr->next
+/*@ +nullderef @*/
+	    ) {
+		entries[n] = ptr;
+		if ((n > 0) && (cmp (&entries[n - 1], &entries[n]) > 0)) {
+			sorted = false;
+		}
+		n++;
+	}
+	if (sorted) {
+		free (entries);
+		return 0;
+	}
+
+	tmp = malloc (n * sizeof (struct commonio_entry *));
+	if (NULL != tmp) {
+		merge_runs (entries, tmp, n, cmp);
+		free (tmp);
+	} else {
+		qsort (entries, n, sizeof (struct commonio_entry *), cmp);
+	}
+
+	/* Take care of the head and tail separately */
+	db->head = entries[0];
+	n--;
+#if KEEP_NIS_AT_END
+	if (NULL == nis)
+#endif
+	{
+		db->tail = entries[n];
+	}
+	db->head->prev = NULL;
+	db->head->next = entries[1];
+	entries[n]->prev = entries[n - 1];
+#if KEEP_NIS_AT_END
+	entries[n]->next = nis;
+#else
+	entries[n]->next = NULL;
+#endif
+
+	/* Now other elements have prev and next entries */
+	for (i = 1; i < n; i++) {
+		entries[i]->prev = entries[i - 1];
+		entries[i]->next = entries[i + 1];
+	}
+
+	free (entries);
+	db->merge = NULL;
+	db->nis_known = false;
+	db->changed = true;
+
+	return 0;
+}
+
+/*
+ * Sort entries in db according to order in another.
+ *
+ *	The entries of shadow are put in the order of the entries of
+ *	passwd with the same name. The entries without counterpart (and
+ *	the unparsed lines) keep their relative order, after the others.
+ *	The entries are matched with a hash table of the names of shadow,
+ *	so that the sort takes a linear time. shadow is left unchanged
+ *	if its entries are already in that order.
+ *
+ *	It returns 0 on success, -1 if the memory could not be allocated
+ *	(the order of shadow is then unchanged).
+ */
+int commonio_sort_wrt (struct commonio_db *shadow,
+                       const struct commonio_db *passwd)
+{
+	struct commonio_entry **entries, **sorted, *ptr;
+	const struct commonio_entry *pw_ptr;
+	size_t *buckets, *chain;
+	size_t size = INDEX_MIN_SIZE;
+	size_t n = 0, m = 0, i;
+
+	if ((NULL == shadow) || (NULL == shadow->head)) {
+		return 0;
+	}
+	if (parse_all (shadow) == 0) {
+		return -1;
+	}
+
+	for (ptr = shadow->head; NULL != ptr; ptr = ptr->next) {
+		n++;
+	}
+	while ((size < n) && (size < SIZE_MAX / (2 * sizeof *buckets))) {
+		size *= 2;
+	}
+
+	entries = malloc (n * sizeof *entries);
+	sorted = malloc (n * sizeof *sorted);
+	chain = malloc (n * sizeof *chain);
+	buckets = calloc (size, sizeof *buckets);
+	if (   (NULL == entries) || (NULL == sorted)
+	    || (NULL == chain) || (NULL == buckets)) {
+		free (entries);
+		free (sorted);
+		free (chain);
+		free (buckets);
+		return -1;
+	}
+
+	/*
+	 * The chains hold the index + 1 of the next entry with the same
+	 * hash. They are built from the end, so that the entries with the
+	 * same name are found in the order of the file.
+	 */
+	i = 0;
+	for (ptr = shadow->head; NULL != ptr; ptr = ptr->next) {
+		entries[i++] = ptr;
+	}
+	for (i = n; i > 0; i--) {
+		size_t h;
+
+		ptr = entries[i - 1];
+		if (NULL == ptr->eptr) {
+			continue;
+		}
+		h = name_hash (entry_getname (shadow, ptr->eptr)) % size;
+		chain[i - 1] = buckets[h];
+		buckets[h] = i;
+	}
+
+	for (pw_ptr = passwd->head; NULL != pw_ptr; pw_ptr = pw_ptr->next) {
+		const char *name;
+		size_t *link;
+
+		if (NULL == pw_ptr->eptr) {
+			continue;
+		}
+		name = entry_getname (passwd, pw_ptr->eptr);
+		for (link = &buckets[name_hash (name) % size];
+		     0 != *link;
+		     link = &chain[*link - 1]) {
+			i = *link - 1;
+			if (strcmp (name, entry_getname (shadow, entries[i]->eptr))
+			    == 0) {
+				/* Take it out of the chain and of the rest */
+				*link = chain[i];
+				sorted[m++] = entries[i];
+				entries[i] = NULL;
+				break;
+			}
+		}
+	}
+	free (buckets);
+	free (chain);
+
+	for (i = 0; i < n; i++) {
+		if (NULL != entries[i]) {
+			sorted[m++] = entries[i];
+		}
+	}
+	free (entries);
+
+	/* Nothing to write if the order did not change */
+	ptr = shadow->head;
+	for (i = 0; (NULL != ptr) && (ptr == sorted[i]); i++) {
+		ptr = ptr->next;
+	}
+	if (NULL == ptr) {
+		free (sorted);
+		return 0;
+	}
+
+	/* The entries stay in the database: they are kept indexed */
+	for (i = 0; i < n; i++) {
+		sorted[i]->prev = (0 == i) ? NULL : sorted[i - 1];
+		sorted[i]->next = (n - 1 == i) ? NULL : sorted[i + 1];
+	}
+	shadow->head = sorted[0];
+	shadow->tail = sorted[n - 1];
+	shadow->merge = NULL;
+	shadow->nis_known = false;
+	shadow->changed = true;
+
+	free (sorted);
+	return 0;
+}
+
+/* Size of the buffers of the new version of a file */
+#define WRITE_BUFSIZ (64 * 1024)
+
+/*
+ * unchanged_run - Find the run of unchanged entries starting at p whose
+ *                 lines follow each other in the mapping, i.e. which are
+ *                 stored as is in the previous version of the file.
+ *
+ *	It returns the size of the run in the file (0 if p's line is not in
+ *	the mapping) and sets *last to the last entry of the run.
+ */
+static size_t unchanged_run (const struct commonio_db *db,
+                             const struct commonio_entry *p,
+                             const struct commonio_entry **last)
+{
+	const char *start = p->line;
+	const char *end = NULL;
+
+	*last = p;
+	for (; NULL != p; p = p->next) {
+		const char *e;
+
+		if (   p->changed
+		    || (NULL == p->line)
+		    || (p->line < db->map)
+		    || (p->line >= db->map + db->map_size)
+		    || ((NULL != end) && (p->line != end))) {
+			break;
+		}
+		e = p->line + strlen (p->line) + 1;
+		if (e > db->map + db->map_size) {
+			/* No newline at the end of the file */
+			break;
+		}
+		end = e;
+		*last = p;
+	}
+
+	return (NULL == end) ? 0 : (size_t) (end - start);
+}
+
+/*
+ * write_run - Write a run of unchanged lines found by unchanged_run.
+ *
+ *	The lines are copied from the mapping in large blocks, with their
+ *	terminating NUL turned back into a newline: in a run, every NUL
+ *	ends a line.
+ *
+ *	It returns 0 on success.
+ */
+static int write_run (FILE *fp, const char *start, size_t len)
+{
+	char buf[WRITE_BUFSIZ];
+
+	while (len > 0) {
+		size_t n = (len < sizeof buf) ? len : sizeof buf;
+		char *cp = buf;
+
+		memcpy (buf, start, n);
+		while ((cp = memchr (cp, '\0', (size_t) (buf + n - cp))) != NULL) {
+			*cp++ = '\n';
+		}
+		if (fwrite (buf, 1, n, fp) != n) {
+			return -1;
+		}
+		start += n;
+		len -= n;
+	}
+	return 0;
+}
+
+#ifdef HAVE_COPY_FILE_RANGE
+/* Unchanged runs smaller than this are simply written again */
+#define COPY_RUN_MIN (64 * 1024)
+
+/*
+ * copy_run - Copy a part of the previous version of the file at the end
+ *            of fp, without going through user space.
+ *
+ *	On reflink capable filesystems, the data blocks can be shared.
+ *
+ *	It returns 0 on success. On failure, nothing was added to fp.
+ */
+static int copy_run (FILE *fp, int src, off_t off, size_t len)
+{
+	int dst = fileno (fp);
+	off_t pos;
+
+	if (fflush (fp) != 0) {
+		return -1;
+	}
+	pos = lseek (dst, 0, SEEK_CUR);
+	if ((off_t) -1 == pos) {
+		return -1;
+	}
+	while (len > 0) {
+		ssize_t n = copy_file_range (src, &off, dst, NULL, len, 0);
+
+		if (n <= 0) {
+			/* Cancel what was already copied */
+			if (   (ftruncate (dst, pos) != 0)
+			    || (lseek (dst, pos, SEEK_SET) != pos)) {
+				return -2;
+			}
+			return -1;
+		}
+		len -= (size_t) n;
+	}
+	/* Make the stream aware of the new position */
+	return (fseeko (fp, 0, SEEK_END) == 0) ? 0 : -2;
+}
+#endif				/* HAVE_COPY_FILE_RANGE */
+
+/*
+ * Sorted databases, see sortedfile.c
+ */
+struct sort_item {
+	struct commonio_entry *entry;
+	const char *key;
+	size_t len;
+	size_t pos;
+};
+
+static int sort_item_cmp (const void *a, const void *b)
+{
+	const struct sort_item *ia = a;
+	const struct sort_item *ib = b;
+	int ret;
+
+	ret = sorted_keycmp (ia->key, ia->len, ib->key, ib->len);
+	if (0 != ret) {
+		return ret;
+	}
+	/* Keep the order of the entries with the same key */
+	return (ia->pos < ib->pos) ? -1 : (ia->pos > ib->pos) ? 1 : 0;
+}
+
+/*
+ * keep_sorted - Sort the entries of db by their key, if SORTED_DATABASES
+ *	is set.
+ *
+ *	The databases with NIS entries or invalid lines are not sorted.
+ *	Return true if the entries are sorted: the new file can then be
+ *	marked sorted.
+ */
+static bool keep_sorted (struct commonio_db *db)
+{
+	struct sort_item *items;
+	struct commonio_entry *p;
+	size_t n = 0, i;
+	bool in_order = true;
+
+	if ((NULL == db->ops->sortkey) || !getdef_bool ("SORTED_DATABASES")) {
+		return false;
+	}
+
+	for (p = db->head; NULL != p; p = p->next) {
+		n++;
+	}
+	items = malloc ((n + 1) * sizeof *items);
+	if (NULL == items) {
+		return false;
+	}
+
+	n = 0;
+	for (p = db->head; NULL != p; p = p->next) {
+		struct sort_item *it = &items[n];
+
+		if (NULL != p->eptr) {
+			it->key = db->ops->sortkey (p->eptr);
+			it->len = strlen (it->key);
+		} else if (p->unparsed && (NULL != p->line)) {
+			it->key = p->line;
+			it->len = strcspn (p->line, ":");
+		} else {
+			free (items);
+			return false;	/* invalid line */
+		}
+		if (('+' == it->key[0]) || ('-' == it->key[0])) {
+			free (items);
+			return false;	/* NIS */
+		}
+		it->entry = p;
+		it->pos = n;
+		if (   (0 != n)
+		    && (sort_item_cmp (&items[n - 1], it) > 0)) {
+			in_order = false;
+		}
+		n++;
+	}
+
+	if (!in_order) {
+		qsort (items, n, sizeof *items, sort_item_cmp);
+		for (i = 0; i < n; i++) {
+			p = items[i].entry;
+			p->prev = (0 == i) ? NULL : items[i - 1].entry;
+			p->next = (i + 1 == n) ? NULL : items[i + 1].entry;
+		}
+		db->head = items[0].entry;
+		db->tail = items[n - 1].entry;
+	}
+
+	free (items);
+	return true;
+}
+
+/*
+ * write_all - Write the database to its file.
+ *
+ * Only the changed entries are formatted. The unchanged lines are
+ * written in blocks from the mapping of the previous version, and if
+ * src is a file descriptor on the file they were mapped from, the large
+ * runs are copied from it instead of being written again.
+ *
+ * It returns 0 if all the entries could be written correctly.
+ */
+static int write_all (const struct commonio_db *db, int src)
+	/*@requires notnull db->fp@*/
+{
+	const struct commonio_entry *p;
+	void *eptr;
+
+	for (p = db->head; NULL != p; p = p->next) {
+		if (p->changed) {
+			eptr = p->eptr;
+			assert (NULL != eptr);
+			if (db->ops->put (eptr, db->fp) != 0) {
+				return -1;
+			}
+		} else if (NULL != p->line) {
+			const struct commonio_entry *last = p;
+			size_t len;
+
+			len = unchanged_run (db, p, &last);
+#ifdef HAVE_COPY_FILE_RANGE
+			if ((src >= 0) && (len >= COPY_RUN_MIN)) {
+				int ret = copy_run (db->fp, src,
+				                    (off_t) (p->line - db->map),
+				                    len);
+				if (0 == ret) {
+					p = last;
+					continue;
+				}
+				if (-2 == ret) {
+					return -1;
+				}
+				/* Not supported here: write the lines */
+				src = -1;
+			}
+#endif				/* HAVE_COPY_FILE_RANGE */
+			if (0 != len) {
+				if (write_run (db->fp, p->line, len) != 0) {
+					return -1;
+				}
+				p = last;
+				continue;
+			}
+
+			/* A line which is not in the mapping */
+			if (db->ops->fputs (p->line, db->fp) == EOF) {
+				return -1;
+			}
+			if (putc ('\n', db->fp) == EOF) {
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+
+/*
+ * commit_write - Write the new version of a changed database to file+.
+ *
+ *	The previous version is saved in file- first. On success, db->fp
+ *	is left open on file+; commit_sync() must be called next.
+ *
+ *	Return 0 on success, -1 on failure. On failure, db->fp is closed
+ *	and file+ is removed.
+ */
+static int commit_write (struct commonio_db *db)
+{
+	char buf[1024];
+	int errors = 0;
+	int src = -1;
+	bool sorted;
+	struct stat sb;
+	struct timespec start;
+	unsigned long long bytes;
+
+	if ((NULL != db->ops->close_hook) && (db->ops->close_hook () == 0)) {
+		if (NULL != db->fp) {
+			(void) fclose (db->fp);
+			db->fp = NULL;
+		}
+		return -1;
+	}
+
+	memzero (&sb, sizeof sb);
+	if (NULL != db->fp) {
+		if (fstat (fileno (db->fp), &sb) != 0) {
+			(void) fclose (db->fp);
+			db->fp = NULL;
+			return -1;
+		}
+
+		/*
+		 * Create backup file.
+		 */
+		snprintf (buf, sizeof buf, "%s-", db->filename);
+
+#ifdef WITH_SELINUX
+		if (set_selinux_file_context (db->filename, S_IFREG) != 0) {
+			errors++;
+		}
+#endif
+		timing_start (&start);
+		if (create_backup (db->filename, buf, db->fp) != 0) {
+			errors++;
+		}
+		timing_db_stop (db->filename, TIMING_DB_BACKUP, &start);
+
+		/*
+		 * Keep the previous version of the file open, to copy the
+		 * unchanged lines from it.
+		 */
+		if ((NULL != db->map) && !db->map_folded) {
+			src = dup (fileno (db->fp));
+		}
+
+		if (fclose (db->fp) != 0) {
+			errors++;
+		}
+		db->fp = NULL;
+
+#ifdef WITH_SELINUX
+		if (reset_selinux_file_context () != 0) {
+			errors++;
+		}
+#endif
+		if (errors != 0) {
+			if (src >= 0) {
+				(void) close (src);
+			}
+			return -1;
+		}
+	} else {
+		/*
+		 * Default permissions for new [g]shadow files.
+		 */
+		sb.st_mode = db->st_mode;
+		sb.st_uid = db->st_uid;
+		sb.st_gid = db->st_gid;
+	}
+
+	snprintf (buf, sizeof buf, "%s+", db->filename);
+
+#ifdef WITH_SELINUX
+	if (set_selinux_file_context (db->filename, S_IFREG) != 0) {
+		errors++;
+	}
+#endif
+
+	sorted = keep_sorted (db);
+	db->fp = fopen_set_perms (buf, "w", &sb);
+	if (NULL == db->fp) {
+		errors++;
+	} else {
+		(void) setvbuf (db->fp, NULL, _IOFBF, WRITE_BUFSIZ);
+		set_generation (db);
+
+		timing_start (&start);
+		if (write_all (db, src) != 0) {
+			errors++;
+		}
+
+		switch (write_shards (db)) {
+		case -1:
+			errors++;
+			break;
+		case 1:
+			sorted = false;
+			break;
+		}
+
+		if (fflush (db->fp) != 0) {
+			errors++;
+		}
+		if (sorted && (0 == errors)) {
+			/* Without the mark, the file is read as unsorted */
+			(void) sorted_mark (fileno (db->fp));
+		}
+		bytes = (unsigned long long) ftell (db->fp);
+		timing_db_stop (db->filename, TIMING_DB_WRITE, &start);
+		timing_db_count (db->filename, 0, 0, bytes);
+		PROBE3 (commit__write, db->filename, db->index_count, bytes);
+	}
+
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		errors++;
+	}
+#endif
+
+	if (src >= 0) {
+		(void) close (src);
+	}
+
+	if (errors != 0) {
+		commit_abort (db);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * commit_sync - Flush file+ to disk, as required by COMMIT_SYNC, and close
+ *	it.
+ *
+ *	Return 0 on success, -1 on failure. On failure, file+ is removed.
+ */
+static int commit_sync (struct commonio_db *db)
+{
+	struct timespec start;
+	int synced;
+
+	timing_start (&start);
+	synced = sync_file (fileno (db->fp));
+	return commit_synced (db, synced, &start);
+}
+
+/*
+ * commit_synced - Account for the flush of file+, started at start, which
+ *	returned synced, and close it.
+ *
+ *	Return 0 on success, -1 on failure. On failure, file+ is removed.
+ */
+static int commit_synced (struct commonio_db *db, int synced,
+                          const struct timespec *start)
+{
+	int errors = 0;
+
+	if (synced != 0) {
+		errors++;
+	}
+	timing_db_stop (db->filename, TIMING_DB_SYNC, start);
+	if (SYNC_NONE != sync_level ()) {
+		metrics_observe (METRICS_FSYNC_TIME, db->filename, start);
+	}
+
+	if (fclose (db->fp) != 0) {
+		errors++;
+	}
+
+	db->fp = NULL;
+
+	if (errors != 0) {
+		commit_abort (db);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * journal_name - Return the name of an entry for the journals.
+ *
+ *	The entries of subuid and subgid have no name: their owner is
+ *	used.
+ */
+static const char *journal_name (const struct commonio_db *db,
+                                 const void *eptr)
+{
+	if (!db->ops->direct_fields && (NULL == db->ops->getname)) {
+		return db->ops->sortkey (eptr);
+	}
+	return entry_getname (db, eptr);
+}
+
+/*
+ * journal_record - Append a record of the journal to buf, which is
+ *	large enough for it (see JOURNAL_RECORD_MAX).
+ */
+#define JOURNAL_RECORD_MAX(name, dbname) \
+	(20 + 1 + 3 + 1 + strlen (name) + 1 + strlen (dbname) + 2)
+static char *journal_record (char *buf, unsigned long long gen,
+                             const char *op, const char *name,
+                             const char *dbname)
+{
+	/* name can be a removed line, see journal_removed() */
+	return buf + sprintf (buf, "%llu:%s:%.*s:%s\n", gen, op,
+	                      (int) strcspn (name, ":"), name, dbname);
+}
+
+/*
+ * journal_write - Append the changes of a published database to the
+ *	journal of ACCOUNT_JOURNAL.
+ *
+ *	Each record is "GENERATION:OPERATION:NAME:DATABASE", where
+ *	OPERATION is add, mod or del. The records of a commit are
+ *	appended at once, under a lock of the journal. Their generation
+ *	is the size of the journal before they were appended, so that a
+ *	consumer can read the changes after the last commit it processed
+ *	from that offset.
+ *
+ *	The journal is only an optimization for the caches of the
+ *	databases, which are flushed anyway: failing to write it is not
+ *	an error.
+ */
+static void journal_write (const struct commonio_db *db)
+{
+	const char *journal;
+	const struct commonio_entry *p;
+	unsigned long long gen;
+	struct flock lk;
+	struct stat st;
+	char *buf = NULL;
+	char *end;
+	const char *cp;
+	size_t size = 0;
+	size_t i;
+	int fd;
+
+	journal = getdef_str ("ACCOUNT_JOURNAL");
+	if ((NULL == journal) || ('/' != journal[0])) {
+		return;
+	}
+
+	for (i = 0; i < db->nremoved; i++) {
+		size += JOURNAL_RECORD_MAX (db->removed[i], db->filename);
+	}
+	for (p = db->head; NULL != p; p = p->next) {
+		if (p->changed && (NULL != p->eptr)) {
+			size += JOURNAL_RECORD_MAX (journal_name (db, p->eptr),
+			                            db->filename);
+		}
+	}
+	if (0 == size) {
+		return;
+	}
+	buf = malloc (size);
+	if (NULL == buf) {
+		fd = -1;
+		goto fail;
+	}
+
+	fd = open (journal, O_WRONLY | O_APPEND | O_CREAT | O_NOCTTY | O_CLOEXEC,
+	           0644);
+	if (fd < 0) {
+		goto fail;
+	}
+	memzero (&lk, sizeof lk);
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	if ((fcntl (fd, F_SETLKW, &lk) != 0) || (fstat (fd, &st) != 0)) {
+		goto fail;
+	}
+
+	gen = (unsigned long long) st.st_size;
+	end = buf;
+	for (i = 0; i < db->nremoved; i++) {
+		end = journal_record (end, gen, "del", db->removed[i],
+		                      db->filename);
+	}
+	for (p = db->head; NULL != p; p = p->next) {
+		if (p->changed && (NULL != p->eptr)) {
+			end = journal_record (end, gen,
+			                      (NULL == p->line) ? "add" : "mod",
+			                      journal_name (db, p->eptr),
+			                      db->filename);
+		}
+	}
+
+	for (cp = buf; cp < end;) {
+		ssize_t n = write (fd, cp, end - cp);
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			goto fail;
+		}
+		cp += n;
+	}
+	free (buf);
+	(void) close (fd);	/* releases the lock */
+	return;
+
+fail:
+	fprintf (shadow_logfd, _("%s: cannot write the journal %s: %s\n"),
+	         shadow_progname, journal, strerror (errno));
+	free (buf);
+	if (fd >= 0) {
+		(void) close (fd);
+	}
+}
+
+/*
+ * replication_records - Write the records of the changes of db to fp,
+ *	with the generation gen.
+ *
+ *	Return the number of changed lines.
+ */
+static unsigned long replication_records (const struct commonio_db *db,
+                                          FILE *fp, unsigned long long gen,
+                                          const char *dbname)
+{
+	const struct commonio_entry *p;
+	unsigned long count = 0;
+	size_t i;
+
+	for (i = 0; i < db->nremoved; i++) {
+		if (NULL != strchr (db->removed[i], ':')) {
+			(void) fprintf (fp, "%llu:del:%s:%s\n",
+			                gen, dbname, db->removed[i]);
+			count++;
+		}
+	}
+	for (p = db->head; NULL != p; p = p->next) {
+		if (!p->changed || (NULL == p->eptr)) {
+			continue;
+		}
+		if (NULL != p->line) {
+			(void) fprintf (fp, "%llu:del:%s:%s\n",
+			                gen, dbname, p->line);
+			count++;
+		}
+		(void) fprintf (fp, "%llu:add:%s:", gen, dbname);
+		(void) db->ops->put (p->eptr, fp);
+		count++;
+	}
+	(void) fprintf (fp, "%llu:end:%s:%lu\n", gen, dbname, count);
+	return count;
+}
+
+/*
+ * replication_write - Append the changes of a published database to the
+ *	journal of REPLICATION_JOURNAL.
+ *
+ *	Unlike ACCOUNT_JOURNAL, which only names the changed entries, the
+ *	records carry the lines of the file: they can be applied to the
+ *	databases of another host with pwsync(8). Each record is
+ *	"GENERATION:OPERATION:DATABASE:LINE", where DATABASE is the name
+ *	of the file and OPERATION is del for a line removed from it, or
+ *	add for a line added to it. A modified line is removed and added
+ *	again, and the two records follow each other. The records of a
+ *	commit end with "GENERATION:end:DATABASE:COUNT", COUNT being the
+ *	number of records before it, so that a commit which was only
+ *	partly copied to another host is not applied. The generation is
+ *	the size of the journal before the records of the commit were
+ *	appended, under a lock of the journal, as for ACCOUNT_JOURNAL.
+ *
+ *	The database is already published: failing to write the journal
+ *	is reported, and pwsync then refuses to apply the next commits,
+ *	since their generations do not follow the ones it applied.
+ */
+static void replication_write (const struct commonio_db *db)
+{
+	const char *journal;
+	const char *dbname;
+	unsigned long long gen;
+	struct flock lk;
+	struct stat st;
+	char *buf = NULL;
+	size_t size = 0;
+	const char *cp;
+	unsigned long count;
+	bool failed;
+	FILE *fp;
+	int fd;
+
+	journal = getdef_str ("REPLICATION_JOURNAL");
+	if ((NULL == journal) || ('/' != journal[0])) {
+		return;
+	}
+	dbname = strrchr (db->filename, '/');
+	dbname = (NULL != dbname) ? dbname + 1 : db->filename;
+
+	fd = open (journal, O_WRONLY | O_APPEND | O_CREAT | O_NOCTTY | O_CLOEXEC,
+	           0600);
+	if (fd < 0) {
+		goto fail;
+	}
+	memzero (&lk, sizeof lk);
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	if ((fcntl (fd, F_SETLKW, &lk) != 0) || (fstat (fd, &st) != 0)) {
+		goto fail;
+	}
+	gen = (unsigned long long) st.st_size;
+
+	fp = open_memstream (&buf, &size);
+	if (NULL == fp) {
+		goto fail;
+	}
+	count = replication_records (db, fp, gen, dbname);
+	failed = (ferror (fp) != 0);
+	if ((fclose (fp) != 0) || failed) {
+		goto fail;
+	}
+	if (0 == count) {
+		size = 0;
+	}
+
+	for (cp = buf; cp < buf + size;) {
+		ssize_t n = write (fd, cp, buf + size - cp);
+
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			goto fail;
+		}
+		cp += n;
+	}
+	free (buf);
+	(void) close (fd);	/* releases the lock */
+	return;
+
+fail:
+	fprintf (shadow_logfd, _("%s: cannot write the journal %s: %s\n"),
+	         shadow_progname, journal, strerror (errno));
+	free (buf);
+	if (fd >= 0) {
+		(void) close (fd);
+	}
+}
+
+/*
+ * cache_changed - Record the entries of a published database which the
+ *	cache of sssd shall invalidate.
+ *
+ *	The removed entries are recorded when they are removed.
+ */
+static void cache_changed (const struct commonio_db *db)
+{
+#ifdef USE_SSSD
+	const struct commonio_entry *p;
+
+	if (0 == db->ops->cache_dbs) {
+		return;
+	}
+	for (p = db->head; NULL != p; p = p->next) {
+		if (p->changed && (NULL != p->eptr)) {
+			sssd_entry_changed (db->ops->cache_dbs,
+			                    entry_getname (db, p->eptr));
+		}
+	}
+#endif				/* USE_SSSD */
+}
+
+/*
+ * commit_publish - Replace the database by file+.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int commit_publish (struct commonio_db *db)
+{
+	char buf[1024];
+	struct timespec start;
+
+	snprintf (buf, sizeof buf, "%s+", db->filename);
+	timing_start (&start);
+	if (lrename (buf, db->filename) != 0) {
+		return -1;
+	}
+	timing_db_stop (db->filename, TIMING_DB_RENAME, &start);
+	metrics_add (METRICS_COMMITS, db->filename, 1);
+	PROBE1 (commit__publish, db->filename);
+
+	cache_dbs |= db->ops->cache_dbs;
+	cache_changed (db);
+	changes++;
+	locked_changes = true;
+
+	/*
+	 * The lookup index is only a cache of the database: failing to
+	 * build it is not an error.
+	 */
+	if ((NULL != db->ops->getid) && getdef_bool ("LOOKUP_INDEX")) {
+		(void) dbindex_write (db->filename);
+	}
+	if (NULL != db->ops->publish_hook) {
+		db->ops->publish_hook (db);
+	}
+	journal_write (db);
+	replication_write (db);
+
+	if ((NULL != db->main_file) && (publish_shard (db) != 0)) {
+		/* The shard is written, its copy is fixed by the next write */
+		(void) fprintf (shadow_logfd, "%s: cannot copy %s to %s\n",
+		                shadow_progname, db->filename, db->main_file);
+	}
+
+	return 0;
+}
+
+/*
+ * commit_abort - Discard the file+ of a database which will not be
+ *	published.
+ */
+static void commit_abort (struct commonio_db *db)
+{
+	char buf[1024];
+
+	if (NULL != db->fp) {
+		(void) fclose (db->fp);
+		db->fp = NULL;
+	}
+
+	snprintf (buf, sizeof buf, "%s+", db->filename);
+	(void) unlink (buf);
+}
+
+/*
+ * commonio_changes - Return the number of databases written by this
+ *	process, so that the callers can tell when their cached lookups
+ *	may be stale.
+ */
+unsigned long commonio_changes (void)
+{
+	return changes;
+}
+
+int commonio_close (struct commonio_db *db)
+{
+	int errors = 0;
+	struct timespec start;
+
+	if (!db->isopen) {
+		errno = EINVAL;
+		return 0;
+	}
+	db->isopen = false;
+	db->deferred = false;
+	PROBE1 (close__start, db->filename);
+
+	if (!db->changed || db->readonly) {
+		if (NULL != db->fp) {
+			(void) fclose (db->fp);
+			db->fp = NULL;
+		}
+	} else if (!locked_changes && (deadline_check ("commit") != 0)) {
+		/*
+		 * Nothing was written under these locks yet: stop before
+		 * the first database. Once one is written, the others
+		 * locked with it are written too, so that they stay
+		 * consistent.
+		 */
+		if (NULL != db->fp) {
+			(void) fclose (db->fp);
+			db->fp = NULL;
+		}
+		errors++;
+	} else {
+		timing_start (&start);
+		if (   (commit_write (db) != 0)
+		    || (commit_sync (db) != 0)
+		    || (commit_publish (db) != 0)
+		    || (sync_dir (db->filename) != 0)) {
+			errors++;
+		}
+		metrics_observe (METRICS_COMMIT_TIME, NULL, &start);
+	}
+
+	PROBE2 (close__done, db->filename, 0 == errors);
+	free_linked_list (db);
+	return errors == 0;
+}
+
+/*
+ * commonio_txn_init - Initialize an empty transaction.
+ */
+void commonio_txn_init (struct commonio_txn *txn)
+{
+	memzero (txn, sizeof *txn);
+}
+
+/*
+ * commonio_txn_add - Add a database to a transaction.
+ *
+ *	The databases are kept sorted by file name, so that any two
+ *	transactions lock their common databases in the same order.
+ *
+ *	Return 1 on success, 0 if the transaction is full.
+ */
+int commonio_txn_add (struct commonio_txn *txn, struct commonio_db *db)
+{
+	size_t i;
+
+	if (txn->count >= COMMONIO_TXN_MAX) {
+		errno = ENOSPC;
+		return 0;
+	}
+
+	for (i = txn->count; i > 0; i--) {
+		if (strcmp (txn->dbs[i - 1]->filename, db->filename) <= 0) {
+			break;
+		}
+		txn->dbs[i] = txn->dbs[i - 1];
+	}
+	txn->dbs[i] = db;
+	txn->count++;
+
+	return 1;
+}
+
+/*
+ * commonio_txn_lock - Lock all the databases of a transaction.
+ *
+ *	Return 1 on success. On failure, the databases which were already
+ *	locked are unlocked, txn->failed is set to the database which
+ *	could not be locked, and 0 is returned.
+ */
+int commonio_txn_lock (struct commonio_txn *txn)
+{
+	size_t i;
+
+	txn->failed = NULL;
+	for (i = 0; i < txn->count; i++) {
+		if (commonio_lock (txn->dbs[i]) == 0) {
+			txn->failed = txn->dbs[i];
+			while (i > 0) {
+				i--;
+				(void) commonio_unlock (txn->dbs[i]);
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * commonio_txn_open - Open all the databases of a transaction.
+ *
+ *	Return 1 on success. On failure, the databases which were already
+ *	opened are closed without being written, txn->failed is set to the
+ *	database which could not be opened, and 0 is returned.
+ */
+int commonio_txn_open (struct commonio_txn *txn, int mode)
+{
+	size_t i;
+
+	txn->failed = NULL;
+	for (i = 0; i < txn->count; i++) {
+		if (commonio_open (txn->dbs[i], mode) == 0) {
+			txn->failed = txn->dbs[i];
+			while (i > 0) {
+				i--;
+				txn->dbs[i]->changed = false;
+				(void) commonio_close (txn->dbs[i]);
+			}
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * The new files of a transaction are flushed concurrently, one thread
+ * per file, so that a commit waits for about one flush instead of one
+ * per database. Only the flush runs in the thread: the accounting and
+ * the closing of the file are done by the committing thread, in the
+ * order of the transaction.
+ */
+struct sync_job {
+	int fd;
+	enum sync_level level;
+	int synced;
+	int err;
+	struct timespec start;
+	struct timespec end;
+	pthread_t thread;
+	bool started;
+};
+
+static void *sync_job_run (void *arg)
+{
+	struct sync_job *job = arg;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &job->start);
+	job->synced = sync_fd (job->fd, job->level);
+	job->err = errno;
+	(void) clock_gettime (CLOCK_MONOTONIC, &job->end);
+	return NULL;
+}
+
+/*
+ * sync_job_start - Return the start of a flush which would have ended
+ *	now, so that the flush of job is accounted for with its duration.
+ */
+static void sync_job_start (const struct sync_job *job,
+                            /*@out@*/struct timespec *start)
+{
+	struct timespec now;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	start->tv_sec = now.tv_sec - (job->end.tv_sec - job->start.tv_sec);
+	start->tv_nsec = now.tv_nsec - (job->end.tv_nsec - job->start.tv_nsec);
+	if (start->tv_nsec < 0) {
+		start->tv_sec--;
+		start->tv_nsec += 1000000000L;
+	} else if (start->tv_nsec >= 1000000000L) {
+		start->tv_sec++;
+		start->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * commonio_txn_commit - Write the changes of all the databases of a
+ *	transaction.
+ *
+ *	All the new files are written first, then flushed to disk
+ *	concurrently, and they are renamed in the order of the transaction
+ *	only once all of them are safely on disk. If
+ *	anything fails before the renames, none of the databases is
+ *	modified. This includes the deadline of the tool, unless a
+ *	database was already written under the same locks.
+ *
+ *	The databases are closed in all cases, and stay locked.
+ *
+ *	Return 1 on success. On failure, txn->failed is set to the database
+ *	which could not be written and 0 is returned.
+ */
+int commonio_txn_commit (struct commonio_txn *txn)
+{
+	enum { TXN_NONE, TXN_WRITTEN, TXN_SYNCED } state[COMMONIO_TXN_MAX];
+	struct sync_job jobs[COMMONIO_TXN_MAX];
+	enum sync_level level;
+	size_t nwritten = 0;
+	struct commonio_db *db;
+	struct timespec start;
+	bool written = false;
+	size_t i;
+
+	timing_start (&start);
+	txn->failed = NULL;
+	for (i = 0; i < txn->count; i++) {
+		state[i] = TXN_NONE;
+	}
+
+	for (i = 0; (i < txn->count) && (NULL == txn->failed); i++) {
+		db = txn->dbs[i];
+		if (!db->isopen) {
+			errno = EINVAL;
+			txn->failed = db;
+		} else if (db->changed && !db->readonly) {
+			written = true;
+			if (commit_write (db) != 0) {
+				txn->failed = db;
+			} else {
+				state[i] = TXN_WRITTEN;
+				nwritten++;
+			}
+		}
+	}
+
+	/*
+	 * With several new files to flush, start the flushes of all of
+	 * them, and wait for them. A flush which cannot be started in its
+	 * thread is done by this thread, after the others were started.
+	 */
+	level = sync_level ();
+	if ((NULL == txn->failed) && (SYNC_NONE != level) && (nwritten > 1)) {
+		for (i = 0; i < txn->count; i++) {
+			jobs[i].started = false;
+			if (TXN_WRITTEN != state[i]) {
+				continue;
+			}
+			jobs[i].fd = fileno (txn->dbs[i]->fp);
+			jobs[i].level = level;
+			jobs[i].started = (pthread_create (&jobs[i].thread, NULL,
+			                                   sync_job_run,
+			                                   &jobs[i]) == 0);
+		}
+		for (i = 0; i < txn->count; i++) {
+			if ((TXN_WRITTEN == state[i]) && !jobs[i].started) {
+				(void) sync_job_run (&jobs[i]);
+			}
+		}
+		for (i = 0; i < txn->count; i++) {
+			if (jobs[i].started) {
+				(void) pthread_join (jobs[i].thread, NULL);
+			}
+		}
+
+		for (i = 0; (i < txn->count) && (NULL == txn->failed); i++) {
+			struct timespec sync_start;
+
+			if (TXN_WRITTEN != state[i]) {
+				continue;
+			}
+			sync_job_start (&jobs[i], &sync_start);
+			if (commit_synced (txn->dbs[i], jobs[i].synced,
+			                   &sync_start) != 0) {
+				if (0 != jobs[i].synced) {
+					errno = jobs[i].err;
+				}
+				state[i] = TXN_NONE;
+				txn->failed = txn->dbs[i];
+			} else {
+				state[i] = TXN_SYNCED;
+			}
+		}
+	}
+
+	for (i = 0; (i < txn->count) && (NULL == txn->failed); i++) {
+		if (TXN_WRITTEN == state[i]) {
+			if (commit_sync (txn->dbs[i]) != 0) {
+				state[i] = TXN_NONE;
+				txn->failed = txn->dbs[i];
+			} else {
+				state[i] = TXN_SYNCED;
+			}
+		}
+	}
+
+	if ((NULL == txn->failed) && !locked_changes) {
+		for (i = 0; i < txn->count; i++) {
+			if (TXN_NONE != state[i]) {
+				break;
+			}
+		}
+		if ((i < txn->count) && (deadline_check ("commit") != 0)) {
+			txn->failed = txn->dbs[i];
+		}
 	}
 
-	if (write_all (db) != 0) {
-		errors++;
+	for (i = 0; i < txn->count; i++) {
+		db = txn->dbs[i];
+		if (TXN_NONE == state[i]) {
+			if (NULL != db->fp) {
+				(void) fclose (db->fp);
+				db->fp = NULL;
+			}
+		} else if (NULL != txn->failed) {
+			commit_abort (db);
+		} else if (commit_publish (db) != 0) {
+			txn->failed = db;
+		}
 	}
 
-	if (fflush (db->fp) != 0) {
-		errors++;
+	/* Flush each directory where a file was renamed once */
+	for (i = 0; (i < txn->count) && (NULL == txn->failed); i++) {
+		size_t j;
+
+		if (TXN_SYNCED != state[i]) {
+			continue;
+		}
+		for (j = 0; j < i; j++) {
+			if (   (TXN_SYNCED == state[j])
+			    && same_dir (txn->dbs[i]->filename, txn->dbs[j]->filename)) {
+				break;
+			}
+		}
+		if ((j == i) && (sync_dir (txn->dbs[i]->filename) != 0)) {
+			txn->failed = txn->dbs[i];
+		}
 	}
 
-	if (fsync (fileno (db->fp)) != 0) {
-		errors++;
+	for (i = 0; i < txn->count; i++) {
+		db = txn->dbs[i];
+		if (db->isopen) {
+			db->isopen = false;
+			free_linked_list (db);
+		}
 	}
 
-	if (fclose (db->fp) != 0) {
-		errors++;
+	if (written) {
+		metrics_observe (METRICS_COMMIT_TIME, NULL, &start);
 	}
+	return NULL == txn->failed;
+}
 
-	db->fp = NULL;
+/*
+ * commonio_txn_unlock - Unlock all the databases of a transaction.
+ *
+ *	Changes not yet committed are discarded. The name service caches
+ *	are flushed once, when the last database is unlocked.
+ *
+ *	Return 1 on success, 0 if one of the databases could not be
+ *	unlocked; txn->failed is then set to that database.
+ */
+int commonio_txn_unlock (struct commonio_txn *txn)
+{
+	size_t i;
 
-	if (errors != 0) {
-		unlink (buf);
-		goto fail;
+	txn->failed = NULL;
+	for (i = txn->count; i > 0; i--) {
+		if (commonio_unlock (txn->dbs[i - 1]) == 0) {
+			txn->failed = txn->dbs[i - 1];
+		}
 	}
 
-	if (lrename (buf, db->filename) != 0) {
-		goto fail;
+	return NULL == txn->failed;
+}
+
+static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
+	struct commonio_db *db,
+	/*@null@*/struct commonio_entry *pos,
+	const char *name)
+{
+	struct commonio_entry *p;
+
+	if (NULL == pos) {
+		return NULL;
 	}
 
-#ifdef WITH_SELINUX
-	if (reset_selinux_file_context () != 0) {
-		goto fail;
+	for (p = pos; NULL != p; p = p->next) {
+		if (entry_has_name (db, p, name)) {
+			break;
+		}
+	}
+	return p;
+}
+
+static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
+	struct commonio_db *db,
+	const char *name)
+{
+	struct commonio_entry *p;
+	struct commonio_entry *found = NULL;
+
+	if (NULL == db->index) {
+		return next_entry_by_name (db, db->head, name);
+	}
+
+	p = db->index[name_hash (name) % db->index_size];
+	for (; NULL != p; p = p->hnext) {
+		if (!entry_has_name (db, p, name)) {
+			continue;
+		}
+		if (NULL != found) {
+			/*
+			 * Several entries with this name: the chain
+			 * does not tell which one comes first.
+			 */
+			return next_entry_by_name (db, db->head, name);
+		}
+		found = p;
+	}
+	return found;
+}
+
+/*
+ * has_duplicate_name - Check if another entry than p (the first entry
+ *                      with this name) has the given name.
+ */
+static bool has_duplicate_name (struct commonio_db *db,
+                                const struct commonio_entry *p,
+                                const char *name)
+{
+	struct commonio_entry *q;
+
+	if (NULL == db->index) {
+		return (next_entry_by_name (db, p->next, name) != NULL);
+	}
+
+	q = db->index[name_hash (name) % db->index_size];
+	for (; NULL != q; q = q->hnext) {
+		if ((q != p) && entry_has_name (db, q, name)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+
+int commonio_update (struct commonio_db *db, const void *eptr)
+{
+	struct commonio_entry *p;
+	void *nentry;
+
+	load_deferred (db);
+	if (!db->isopen || db->readonly) {
+		errno = EINVAL;
+		return 0;
+	}
+	nentry = db->ops->dup (eptr);
+	if (NULL == nentry) {
+		errno = ENOMEM;
+		return 0;
+	}
+	/* The entry was usually just located */
+	p = db->cursor;
+	if ((NULL == p) || !entry_has_name (db, p, entry_getname (db, eptr))) {
+		p = find_entry_by_name (db, entry_getname (db, eptr));
+	}
+	if (NULL != p) {
+		if (has_duplicate_name (db, p, entry_getname (db, eptr))) {
+			fprintf (shadow_logfd, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), entry_getname (db, eptr), db->filename);
+			db->ops->free (nentry);
+			return 0;
+		}
+		/* The ID may have changed */
+		index_del (db, p);
+		free_eptr (db, p->eptr);
+		p->eptr = nentry;
+		index_add (db, p);
+		p->changed = true;
+		db->cursor = p;
+
+		db->changed = true;
+		return 1;
+	}
+	/* not found, new entry */
+	p = (struct commonio_entry *) malloc (sizeof *p);
+	if (NULL == p) {
+		db->ops->free (nentry);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	p->eptr = nentry;
+	p->line = NULL;
+	p->hnext = NULL;
+	p->idnext = NULL;
+	p->changed = true;
+	p->unparsed = false;
+
+#if KEEP_NIS_AT_END
+	add_one_entry_nis (db, p);
+#else				/* !KEEP_NIS_AT_END */
+	add_one_entry (db, p);
+#endif				/* !KEEP_NIS_AT_END */
+
+	db->changed = true;
+	return 1;
+}
+
+#ifdef ENABLE_SUBIDS
+int commonio_append (struct commonio_db *db, const void *eptr)
+{
+	struct commonio_entry *p;
+	void *nentry;
+
+	load_deferred (db);
+	if (!db->isopen || db->readonly) {
+		errno = EINVAL;
+		return 0;
+	}
+	nentry = db->ops->dup (eptr);
+	if (NULL == nentry) {
+		errno = ENOMEM;
+		return 0;
+	}
+	/* new entry */
+	p = (struct commonio_entry *) malloc (sizeof *p);
+	if (NULL == p) {
+		db->ops->free (nentry);
+		errno = ENOMEM;
+		return 0;
+	}
+
+	p->eptr = nentry;
+	p->line = NULL;
+	p->hnext = NULL;
+	p->idnext = NULL;
+	p->changed = true;
+	p->unparsed = false;
+	add_one_entry (db, p);
+
+	db->changed = true;
+	return 1;
+}
+#endif				/* ENABLE_SUBIDS */
+
+/*
+ * unlink_entry - Remove an entry from the linked list.
+ *
+ *	The entry is not removed from the name index.
+ */
+static void unlink_entry (struct commonio_db *db,
+                          const struct commonio_entry *p)
+{
+	if (p == db->cursor) {
+		db->cursor = p->next;
+	}
+	if (p == db->merge) {
+		db->merge = p->prev;
+	}
+	if (p == db->nis) {
+		db->nis_known = false;
+	}
+
+	if (NULL != p->prev) {
+		p->prev->next = p->next;
+	} else {
+		db->head = p->next;
+	}
+
+	if (NULL != p->next) {
+		p->next->prev = p->prev;
+	} else {
+		db->tail = p->prev;
+	}
+}
+
+/*
+ * journal_removed - Remember a removed entry for the journals of the
+ *	changes.
+ *
+ *	The line of the entry in the file is kept, which REPLICATION_JOURNAL
+ *	needs, or only its name if it was added since the database was
+ *	opened: the name is then the part of the line before the first ':'.
+ *
+ *	Failing to remember it only makes the journal incomplete: the
+ *	journal is then not written for this database.
+ */
+static void journal_removed (struct commonio_db *db,
+                             const struct commonio_entry *p)
+{
+	char **removed;
+
+	if (   (NULL == getdef_str ("ACCOUNT_JOURNAL"))
+	    && (NULL == getdef_str ("REPLICATION_JOURNAL"))) {
+		return;
+	}
+	if ((NULL == p->line) && (NULL == p->eptr)) {
+		return;
+	}
+
+	if (0 == (db->nremoved % 64)) {
+		removed = realloc (db->removed,
+		                   (db->nremoved + 64) * sizeof *removed);
+		if (NULL == removed) {
+			return;
+		}
+		db->removed = removed;
+	}
+	db->removed[db->nremoved] = strdup ((NULL != p->line)
+	                                    ? p->line
+	                                    : journal_name (db, p->eptr));
+	if (NULL != db->removed[db->nremoved]) {
+		db->nremoved++;
+	}
+}
+
+void commonio_del_entry (struct commonio_db *db, const struct commonio_entry *p)
+{
+	journal_removed (db, p);
+	if ((0 != db->ops->cache_dbs) && (NULL != p->eptr)) {
+		sssd_entry_changed (db->ops->cache_dbs,
+		                    entry_getname (db, p->eptr));
+	}
+	index_del (db, p);
+	unlink_entry (db, p);
+
+	db->changed = true;
+}
+
+/*
+ * commonio_duplicates - Return the number of other parsed entries with the
+ *                       same name as p.
+ *
+ *	It uses the name index, so that checking all the entries
+ *	of a database takes a linear time.
+ */
+size_t commonio_duplicates (struct commonio_db *db,
+                            const struct commonio_entry *p)
+{
+	struct commonio_entry *q;
+	const char *name;
+	size_t count = 0;
+
+	if (NULL == p->eptr) {
+		return 0;
+	}
+	name = entry_getname (db, p->eptr);
+
+	if (NULL == db->index) {
+		/* No index: scan the list */
+		for (q = db->head; NULL != q; q = q->next) {
+			if ((q != p) && entry_has_name (db, q, name)) {
+				count++;
+			}
+		}
+		return count;
+	}
+
+	q = db->index[name_hash (name) % db->index_size];
+	for (; NULL != q; q = q->hnext) {
+		if ((q != p) && entry_has_name (db, q, name)) {
+			count++;
+		}
+	}
+	return count;
+}
+
+/*
+ * commonio_remove - Remove the entry of the given name from the database.
+ */
+int commonio_remove (struct commonio_db *db, const char *name)
+{
+	struct commonio_entry *p;
+
+	load_deferred (db);
+	if (!db->isopen || db->readonly) {
+		errno = EINVAL;
+		return 0;
+	}
+	p = find_entry_by_name (db, name);
+	if (NULL == p) {
+		errno = ENOENT;
+		return 0;
+	}
+	if (has_duplicate_name (db, p, name)) {
+		fprintf (shadow_logfd, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), name, db->filename);
+		return 0;
+	}
+
+	commonio_del_entry (db, p);
+
+	free_line (db, p->line);
+
+	if (NULL != p->eptr) {
+		free_eptr (db, p->eptr);
+	}
+
+	return 1;
+}
+
+/*
+ * entry_is_line - Check if line is the line of the entry p, as it would
+ *	be written.
+ */
+static bool entry_is_line (const struct commonio_db *db,
+                           const struct commonio_entry *p, const char *line)
+{
+	char *buf = NULL;
+	size_t size = 0;
+	bool ret = false;
+	FILE *fp;
+
+	if (!p->changed) {
+		return (NULL != p->line) && (strcmp (p->line, line) == 0);
+	}
+	if (NULL == p->eptr) {
+		return false;
+	}
+	fp = open_memstream (&buf, &size);
+	if (NULL == fp) {
+		return false;
+	}
+	if ((db->ops->put (p->eptr, fp) == 0) && (fclose (fp) == 0)) {
+		ret =    (size > 0)
+		      && ('\n' == buf[size - 1])
+		      && (strncmp (buf, line, size - 1) == 0)
+		      && ('\0' == line[size - 1]);
+	} else {
+		(void) fclose (fp);
 	}
-#endif
-
-	nscd_need_reload = true;
-	goto success;
-      fail:
-	errors++;
-      success:
-
-	free_linked_list (db);
-	return errors == 0;
+	free (buf);
+	return ret;
 }
 
-static /*@dependent@*/ /*@null@*/struct commonio_entry *next_entry_by_name (
+/*
+ * find_entry_by_line - Find the entry whose line is line.
+ */
+static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_line (
 	struct commonio_db *db,
-	/*@null@*/struct commonio_entry *pos,
-	const char *name)
+	const char *line)
 {
 	struct commonio_entry *p;
-	void *ep;
+	char *name;
 
-	if (NULL == pos) {
-		return NULL;
+	if (!db->ops->direct_fields && (NULL == db->ops->getname)) {
+		/* No names, like subuid */
+		for (p = db->head; NULL != p; p = p->next) {
+			if (entry_is_line (db, p, line)) {
+				break;
+			}
+		}
+		return p;
 	}
 
-	for (p = pos; NULL != p; p = p->next) {
-		ep = p->eptr;
-		if (   (NULL != ep)
-		    && (strcmp (db->ops->getname (ep), name) == 0)) {
+	name = strndup (line, strcspn (line, ":"));
+	if (NULL == name) {
+		return NULL;
+	}
+	for (p = find_entry_by_name (db, name);
+	     NULL != p;
+	     p = next_entry_by_name (db, p->next, name)) {
+		if (entry_is_line (db, p, line)) {
 			break;
 		}
 	}
+	free (name);
 	return p;
 }
 
-static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_name (
-	struct commonio_db *db,
-	const char *name)
+/*
+ * commonio_has_line - Check if line is the line of an entry of the
+ *	database.
+ *
+ *	The entries changed since the database was opened are compared
+ *	with the line they will have in the file.
+ */
+bool commonio_has_line (struct commonio_db *db, const char *line)
 {
-	return next_entry_by_name (db, db->head, name);
+	load_deferred (db);
+	return (NULL != find_entry_by_line (db, line));
 }
 
-
-int commonio_update (struct commonio_db *db, const void *eptr)
+/*
+ * commonio_remove_line - Remove the entry whose line is line (see
+ *	commonio_has_line()).
+ *
+ *	Unlike commonio_remove(), it removes one of the entries of the
+ *	databases where a name can have several entries, like subuid.
+ *	Return 1 on success, 0 if there is no such entry.
+ */
+int commonio_remove_line (struct commonio_db *db, const char *line)
 {
 	struct commonio_entry *p;
-	void *nentry;
 
+	load_deferred (db);
 	if (!db->isopen || db->readonly) {
 		errno = EINVAL;
 		return 0;
 	}
-	nentry = db->ops->dup (eptr);
-	if (NULL == nentry) {
-		errno = ENOMEM;
+	p = find_entry_by_line (db, line);
+	if (NULL == p) {
+		errno = ENOENT;
 		return 0;
 	}
-	p = find_entry_by_name (db, db->ops->getname (eptr));
-	if (NULL != p) {
-		if (next_entry_by_name (db, p->next, db->ops->getname (eptr)) != NULL) {
-			fprintf (shadow_logfd, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), db->ops->getname (eptr), db->filename);
-			db->ops->free (nentry);
-			return 0;
-		}
-		db->ops->free (p->eptr);
-		p->eptr = nentry;
-		p->changed = true;
-		db->cursor = p;
 
-		db->changed = true;
-		return 1;
+	commonio_del_entry (db, p);
+
+	free_line (db, p->line);
+
+	if (NULL != p->eptr) {
+		free_eptr (db, p->eptr);
 	}
-	/* not found, new entry */
-	p = (struct commonio_entry *) malloc (sizeof *p);
-	if (NULL == p) {
-		db->ops->free (nentry);
+
+	return 1;
+}
+
+/*
+ * commonio_scan - Call fn for each entry of the file of a database,
+ *	without loading the database.
+ *
+ *	The file is read once, sequentially. Each line is parsed in the
+ *	static area of ops->parse: an entry passed to fn is only valid
+ *	until fn returns, and nothing is kept once the scan is over. The
+ *	NIS entries and the lines which cannot be parsed are skipped, and
+ *	the split groups are not merged.
+ *
+ *	The scan stops if fn returns a value other than 0, which is then
+ *	returned.
+ *
+ *	Return 0 when all the file was scanned, or -1 if it could not be
+ *	read (errno set).
+ */
+int commonio_scan (const struct commonio_db *db,
+                   int (*fn) (const void *ent, void *arg), void *arg)
+{
+	return commonio_scan_fields (db, COMMONIO_ALL_FIELDS, fn, arg);
+}
+
+/*
+ * commonio_scan_fields - Same as commonio_scan(), with only the given
+ *	fields of the entries passed to fn.
+ *
+ *	fields is a mask of 1 << n for the n-th field of the lines (see
+ *	ops->parse_fields). The other fields are not converted, nor even
+ *	checked, which saves most of the work of a scan which only needs
+ *	a few fields, like the IDs. A line is still skipped if it does
+ *	not have the expected number of fields, or if one of the given
+ *	fields is invalid.
+ */
+int commonio_scan_fields (const struct commonio_db *db, unsigned int fields,
+                          int (*fn) (const void *ent, void *arg), void *arg)
+{
+	FILE *fp;
+	char *buf;
+	size_t buflen = BUFLEN;
+	size_t len;
+	int saved_errno;
+	int ret = 0;
+
+	fp = fopen (db->filename, "re");
+	if (NULL == fp) {
+		return -1;
+	}
+	buf = malloc (buflen);
+	if (NULL == buf) {
+		(void) fclose (fp);
 		errno = ENOMEM;
-		return 0;
+		return -1;
 	}
 
-	p->eptr = nentry;
-	p->line = NULL;
-	p->changed = true;
+	while ((ret = read_line (db, fp, &buf, &buflen, &len)) == 1) {
+		const void *eptr;
 
-#if KEEP_NIS_AT_END
-	add_one_entry_nis (db, p);
-#else				/* !KEEP_NIS_AT_END */
-	add_one_entry (db, p);
-#endif				/* !KEEP_NIS_AT_END */
+		if (name_is_nis (buf)) {
+			continue;
+		}
+		if (   (NULL != db->ops->parse_fields)
+		    && (COMMONIO_ALL_FIELDS != fields)) {
+			eptr = db->ops->parse_fields (buf, len, fields);
+		} else {
+			eptr = db->ops->parse (buf);
+		}
+		if (NULL == eptr) {
+			continue;
+		}
+		ret = fn (eptr, arg);
+		if (0 != ret) {
+			goto out;
+		}
+	}
+	if (ferror (fp) != 0) {
+		ret = -1;
+	}
 
-	db->changed = true;
-	return 1;
+out:
+	saved_errno = errno;
+	free (buf);
+	(void) fclose (fp);
+	errno = saved_errno;
+	return ret;
 }
 
-#ifdef ENABLE_SUBIDS
-int commonio_append (struct commonio_db *db, const void *eptr)
+/*
+ * commonio_locate - Find the first entry with the specified name in
+ *                   the database.
+ *
+ *	If found, it returns the entry and set the cursor of the database to
+ *	that entry.
+ *
+ *	Otherwise, it returns NULL.
+ */
+/*@observer@*/ /*@null@*/const void *commonio_locate (struct commonio_db *db, const char *name)
 {
 	struct commonio_entry *p;
-	void *nentry;
+	struct timespec start;
 
-	if (!db->isopen || db->readonly) {
+	load_deferred (db);
+	if (!db->isopen) {
 		errno = EINVAL;
-		return 0;
-	}
-	nentry = db->ops->dup (eptr);
-	if (NULL == nentry) {
-		errno = ENOMEM;
-		return 0;
+		return NULL;
 	}
-	/* new entry */
-	p = (struct commonio_entry *) malloc (sizeof *p);
+	timing_start (&start);
+	p = find_entry_by_name (db, name);
+	timing_db_stop (db->filename, TIMING_DB_LOOKUP, &start);
 	if (NULL == p) {
-		db->ops->free (nentry);
-		errno = ENOMEM;
-		return 0;
+		errno = ENOENT;
+		return NULL;
 	}
-
-	p->eptr = nentry;
-	p->line = NULL;
-	p->changed = true;
-	add_one_entry (db, p);
-
-	db->changed = true;
-	return 1;
+	db->cursor = p;
+	return p->eptr;
 }
-#endif				/* ENABLE_SUBIDS */
 
-void commonio_del_entry (struct commonio_db *db, const struct commonio_entry *p)
+/*
+ * entry_key - Return the name of a parsed or unparsed entry, and set *len
+ *             to its length, or return NULL if the entry has no name.
+ */
+static /*@null@*/const char *entry_key (const struct commonio_db *db,
+                                        const struct commonio_entry *p,
+                                        size_t *len)
 {
-	if (p == db->cursor) {
-		db->cursor = p->next;
-	}
+	const char *key;
 
-	if (NULL != p->prev) {
-		p->prev->next = p->next;
-	} else {
-		db->head = p->next;
+	if (p->unparsed) {
+		*len = strcspn (p->line, ":");
+		return p->line;
 	}
-
-	if (NULL != p->next) {
-		p->next->prev = p->prev;
-	} else {
-		db->tail = p->prev;
+	if (NULL == p->eptr) {
+		return NULL;
 	}
-
-	db->changed = true;
+	key = entry_getname (db, p->eptr);
+	*len = strlen (key);
+	return key;
 }
 
 /*
- * commonio_remove - Remove the entry of the given name from the database.
+ * commonio_locate_sorted - Find the first entry with the specified name,
+ *                          for names given in ascending order.
+ *
+ *	It is commonio_locate() for a merge join of a sorted list of
+ *	names with the database: the entries are read from the entry
+ *	found for the previous name, and the search stops at the first
+ *	entry with a greater name, so that locating all the names takes a
+ *	single pass over a database sorted by name (see sorted_keycmp()).
+ *	The names must be ascending; commonio_rewind() restarts from the
+ *	first entry.
+ *
+ *	The database does not need to be sorted: when the name is not met
+ *	before a greater name, it is looked up in the index like with
+ *	commonio_locate(). The result is the same, only the search is
+ *	slower.
  */
-int commonio_remove (struct commonio_db *db, const char *name)
+/*@observer@*/ /*@null@*/const void *commonio_locate_sorted (struct commonio_db *db, const char *name)
 {
+	size_t len = strlen (name);
 	struct commonio_entry *p;
 
-	if (!db->isopen || db->readonly) {
+	load_deferred (db);
+	if (!db->isopen) {
 		errno = EINVAL;
-		return 0;
+		return NULL;
 	}
-	p = find_entry_by_name (db, name);
-	if (NULL == p) {
-		errno = ENOENT;
-		return 0;
+	if (NULL != db->merge) {
+		size_t lastlen;
+		const char *last = entry_key (db, db->merge, &lastlen);
+
+		if (   (NULL != last)
+		    && (sorted_keycmp (last, lastlen, name, len) == 0)
+		    && (NULL != entry_eptr (db, db->merge))) {
+			/* Located again */
+			db->cursor = db->merge;
+			return db->merge->eptr;
+		}
 	}
-	if (next_entry_by_name (db, p->next, name) != NULL) {
-		fprintf (shadow_logfd, _("Multiple entries named '%s' in %s. Please fix this with pwck or grpck.\n"), name, db->filename);
-		return 0;
+	for (p = (NULL != db->merge) ? db->merge->next : db->head;
+	     NULL != p;
+	     p = p->next) {
+		size_t klen;
+		const char *key = entry_key (db, p, &klen);
+		int cmp;
+
+		if (NULL == key) {
+			continue;	/* not a candidate */
+		}
+		cmp = sorted_keycmp (key, klen, name, len);
+		if (cmp > 0) {
+			break;
+		}
+		if ((0 == cmp) && (NULL != entry_eptr (db, p))) {
+			db->merge = p;
+			db->cursor = p;
+			return p->eptr;
+		}
+		db->merge = p;
 	}
 
-	commonio_del_entry (db, p);
+	return commonio_locate (db, name);
+}
 
-	free (p->line);
+/*
+ * find_entry_by_id - Find the first entry with the specified ID.
+ */
+static /*@dependent@*/ /*@null@*/struct commonio_entry *find_entry_by_id (
+	struct commonio_db *db,
+	unsigned long id)
+{
+	struct commonio_entry *p;
+	struct commonio_entry *found = NULL;
 
-	if (NULL != p->eptr) {
-		db->ops->free (p->eptr);
+	if (NULL != db->id_index) {
+		p = db->id_index[id_hash (id) % db->index_size];
+		for (; NULL != p; p = p->idnext) {
+			if (entry_getid (db, p->eptr) != id) {
+				continue;
+			}
+			if (NULL != found) {
+				/* Shared ID: look for the first one */
+				found = NULL;
+				break;
+			}
+			found = p;
+		}
+		if (NULL == p) {
+			return found;
+		}
 	}
 
-	return 1;
+	for (p = db->head; NULL != p; p = p->next) {
+		if (   (NULL != entry_eptr (db, p))
+		    && (entry_getid (db, p->eptr) == id)) {
+			return p;
+		}
+	}
+	return NULL;
 }
 
 /*
- * commonio_locate - Find the first entry with the specified name in
- *                   the database.
+ * commonio_locate_id - Find the first entry with the specified ID in
+ *                      the database.
+ *
+ *	The database operations must provide getid.
  *
  *	If found, it returns the entry and set the cursor of the database to
  *	that entry.
  *
  *	Otherwise, it returns NULL.
  */
-/*@observer@*/ /*@null@*/const void *commonio_locate (struct commonio_db *db, const char *name)
+/*@observer@*/ /*@null@*/const void *commonio_locate_id (struct commonio_db *db, unsigned long id)
 {
 	struct commonio_entry *p;
+	struct timespec start;
 
+	load_deferred (db);
 	if (!db->isopen) {
 		errno = EINVAL;
 		return NULL;
 	}
-	p = find_entry_by_name (db, name);
+	timing_start (&start);
+	p = find_entry_by_id (db, id);
+	timing_db_stop (db->filename, TIMING_DB_LOOKUP, &start);
 	if (NULL == p) {
 		errno = ENOENT;
 		return NULL;
@@ -1087,6 +4835,116 @@ int commonio_remove (struct commonio_db *db, const char *name)
 	return p->eptr;
 }
 
+/*
+ * commonio_index_members - Index the entries by member name.
+ *
+ *	The database operations must provide getmembers. The index is
+ *	built when the database is opened (or right away if it is already
+ *	open), for commonio_member_of(). It costs a pass over the member
+ *	lists, so it is only worth it for the tools which look for the
+ *	entries listing a given member.
+ */
+void commonio_index_members (struct commonio_db *db)
+{
+	db->index_members = true;
+	if (db->isopen && !db->deferred && (NULL == db->members)) {
+		members_build (db);
+	}
+}
+
+/*
+ * commonio_compact - Do not parse the entries when the database is
+ *                    opened.
+ *
+ *	The lines of the file are only parsed when their entry is used,
+ *	which saves the memory of the parsed entries (and the time to parse
+ *	them) when only a few entries are looked up or changed. The entries
+ *	are then not indexed by ID: commonio_locate_id() and the iterations
+ *	over the database parse the entries as they go.
+ *
+ *	It must be called before the database is opened.
+ */
+void commonio_compact (struct commonio_db *db)
+{
+	db->compact = true;
+}
+
+/*
+ * commonio_entries - Return the first entry of the database, for the
+ *                    callers which walk the list of entries.
+ *
+ *	All the entries are parsed first, so that the eptr of the entries
+ *	can be used as usual. It returns NULL if the memory could not be
+ *	allocated.
+ */
+/*@dependent@*/ /*@null@*/struct commonio_entry *commonio_entries (struct commonio_db *db)
+{
+	if (parse_all (db) == 0) {
+		return NULL;
+	}
+	return db->head;
+}
+
+/*
+ * commonio_member_of - Return the entries which list name as a member.
+ *
+ *	The entries are returned in a NULL terminated array, which shall be
+ *	freed by the caller. Each entry is returned once, even if it lists
+ *	name in several lists.
+ *
+ *	It returns NULL if the entries are not indexed by member name (the
+ *	caller shall then scan the database), or if the array could not be
+ *	allocated.
+ */
+/*@null@*/ /*@only@*/const void **commonio_member_of (struct commonio_db *db, const char *name)
+{
+	const struct commonio_member *m, *bucket;
+	const void **entries;
+	size_t count = 0;
+	size_t i;
+
+	load_deferred (db);
+	if (!db->isopen || (NULL == db->members)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	bucket = db->members[name_hash (name) % db->members_size];
+	for (m = bucket; NULL != m; m = m->next) {
+		count++;
+	}
+	entries = malloc ((count + 1) * sizeof *entries);
+	if (NULL == entries) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	count = 0;
+	for (m = bucket; NULL != m; m = m->next) {
+		if (strcmp (m->name, name) != 0) {
+			continue;
+		}
+		for (i = 0; i < count; i++) {
+			if (entries[i] == m->entry->eptr) {
+				break;
+			}
+		}
+		if (i == count) {
+			entries[count++] = m->entry->eptr;
+		}
+	}
+	entries[count] = NULL;
+
+	/* The nodes are chained in reverse order; return the file order */
+	for (i = 0; i < count / 2; i++) {
+		const void *tmp = entries[i];
+
+		entries[i] = entries[count - 1 - i];
+		entries[count - 1 - i] = tmp;
+	}
+	return entries;
+}
+
 /*
  * commonio_rewind - Restore the database cursor to the first entry.
  *
@@ -1094,11 +4952,13 @@ int commonio_remove (struct commonio_db *db, const char *name)
  */
 int commonio_rewind (struct commonio_db *db)
 {
+	load_deferred (db);
 	if (!db->isopen) {
 		errno = EINVAL;
 		return 0;
 	}
 	db->cursor = NULL;
+	db->merge = NULL;
 	return 1;
 }
 
@@ -1111,6 +4971,7 @@ int commonio_rewind (struct commonio_db *db)
 {
 	void *eptr;
 
+	load_deferred (db);
 	if (!db->isopen) {
 		errno = EINVAL;
 		return 0;
@@ -1122,7 +4983,7 @@ int commonio_rewind (struct commonio_db *db)
 	}
 
 	while (NULL != db->cursor) {
-		eptr = db->cursor->eptr;
+		eptr = entry_eptr (db, db->cursor);
 		if (NULL != eptr) {
 			return eptr;
 		}
@@ -11,8 +11,14 @@
 #ifndef COMMONIO_H
 #define COMMONIO_H
 
+#include <stddef.h>
+#include <time.h>
 #include "defines.h" /* bool */
 
+struct commonio_db;
+struct commonio_arena;
+struct commonio_member;
+
 /*
  * Linked list entry.
  */
@@ -21,7 +27,10 @@ struct commonio_entry {
 	/*@null@*/void *eptr;		/* struct passwd, struct spwd, ... */
 	/*@dependent@*/ /*@null@*/struct commonio_entry *prev;
 	/*@owned@*/ /*@null@*/struct commonio_entry *next;
+	/*@dependent@*/ /*@null@*/struct commonio_entry *hnext;	/* name index */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *idnext;	/* ID index */
 	bool changed:1;
+	bool unparsed:1;	/* line not parsed yet, see commonio_compact() */
 };
 
 /*
@@ -72,8 +81,105 @@ struct commonio_ops {
 	 */
 	/*@null@*/int (*open_hook) (void);
 	/*@null@*/int (*close_hook) (void);
+
+	/*
+	 * Return the numeric ID of the object (for example, pw_uid
+	 * for struct passwd).
+	 * If non NULL, the entries are also indexed by ID.
+	 */
+	/*@null@*/unsigned long (*getid) (const void *);
+
+	/*
+	 * Make a copy of the object and all strings pointed by it, in
+	 * memory obtained with commonio_alloc().
+	 * If non NULL, it is used instead of dup for the entries read
+	 * from the file. These copies (and the entries themselves) are
+	 * released all at once when the database is closed, and are
+	 * never passed to free.
+	 */
+	/*@null@*/ /*@dependent@*/void *(*dup_arena) (struct commonio_db *,
+	                                              const void *);
+
+	/*
+	 * Parse a string into memory obtained with commonio_alloc().
+	 * If non NULL, it is used instead of parse and dup (or dup_arena)
+	 * for the entries read from the file, which saves a copy of each
+	 * entry. As with dup_arena, these entries are never passed to
+	 * free. It returns NULL with errno set to ENOMEM if the memory
+	 * could not be allocated, and NULL with errno set to another value
+	 * if the string is not a valid entry.
+	 */
+	/*@null@*/ /*@dependent@*/void *(*parse_arena) (struct commonio_db *,
+	                                                const char *);
+
+	/*
+	 * Name service caches to invalidate when the database is
+	 * modified (SSSD_DB_PASSWD, SSSD_DB_GROUP).
+	 */
+	int cache_dbs;
+
+	/*
+	 * If non NULL, this function is called after the new version
+	 * of the database was published, to update the files derived
+	 * from it. Failures are ignored.
+	 */
+	/*@null@*/void (*publish_hook) (struct commonio_db *);
+
+	/*
+	 * Return the n-th list of members of the object (gr_mem for
+	 * struct group, sg_mem then sg_adm for struct sgrp), or NULL
+	 * after the last list.
+	 * If non NULL, the entries can also be indexed by member name.
+	 */
+	/*@null@*/char *const *(*getmembers) (const void *, size_t n);
+
+	/*
+	 * If direct_fields is set, the name of the object is the char *
+	 * at name_offset, and its ID (with getid) is the uid_t or gid_t
+	 * at id_offset. The loops of the engine then read these fields
+	 * instead of calling getname and getid, which are still needed.
+	 * See COMMONIO_DIRECT_FIELDS.
+	 */
+	bool direct_fields;
+	size_t name_offset;
+	size_t id_offset;
+
+	/*
+	 * Return the key of the object, the first field of its line, if
+	 * the database can be kept sorted by this key when
+	 * SORTED_DATABASES is set, or NULL.
+	 */
+	/*@null@*/const char *(*sortkey) (const void *);
+
+	/*
+	 * Parse the len bytes of line (without the newline), converting
+	 * only the fields in fields, a mask of 1 << n for the n-th field
+	 * of the line. The line is split in place. The members of the
+	 * other fields are left NULL or 0, and their content is not
+	 * checked. The object is in static storage, as with parse.
+	 * If NULL, commonio_scan_fields() uses parse.
+	 */
+	/*@null@*/void *(*parse_fields) (char *line, size_t len,
+	                                  unsigned int fields);
 };
 
+/*
+ * COMMONIO_DIRECT_FIELDS - Initialize direct_fields, name_offset and
+ *	id_offset for objects of the given type, with their name and ID in
+ *	the given members.
+ * COMMONIO_DIRECT_NAME - Same, for objects without an ID.
+ */
+#define COMMONIO_DIRECT_FIELDS(type, name, id) \
+	true, offsetof (type, name), offsetof (type, id)
+#define COMMONIO_DIRECT_NAME(type, name) \
+	true, offsetof (type, name), 0
+
+/*
+ * COMMONIO_ALL_FIELDS - The fields of commonio_scan_fields() to convert
+ *	all the fields of the entries.
+ */
+#define COMMONIO_ALL_FIELDS	(~0U)
+
 /*
  * Database structure.
  */
@@ -117,29 +223,165 @@ struct commonio_db {
 	bool locked:1;
 	bool readonly:1;
 	bool setname:1;
+	bool index_members:1;	/* see commonio_index_members() */
+	bool compact:1;		/* see commonio_compact() */
+	bool nis_known:1;
+
+	/*
+	 * Hash indexes of the parsed entries by name (chained with hnext)
+	 * and by ID (chained with idnext).
+	 * They are only available when ops->getname (resp. ops->getid) is
+	 * set. If they could not be allocated, lookups fall back to a scan
+	 * of the linked list.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_entry **index;
+	/*@owned@*/ /*@null@*/struct commonio_entry **id_index;
+	size_t index_size;
+	size_t index_count;
+
+	/*
+	 * First NIS entry (+name or -name) of the list, where new entries
+	 * are inserted. It is only valid if nis_known is set.
+	 */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *nis;
+
+	/*
+	 * Reverse index of the member lists, by member name.
+	 * It is only built if ops->getmembers is set and
+	 * commonio_index_members() was called. If it could not be
+	 * allocated, commonio_member_of() returns NULL and the callers
+	 * fall back to a scan of the database.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_member **members;
+	size_t members_size;
+
+	/*
+	 * Private mapping of the file the entries were loaded from.
+	 * The lines of the unchanged entries point into it.
+	 */
+	/*@null@*/char *map;
+	size_t map_size;
+	bool map_folded;	/* line continuations were joined */
+
+	/*
+	 * Memory of the entries read from the file, if ops->dup_arena
+	 * or ops->parse_arena is set.
+	 */
+	/*@owned@*/ /*@null@*/struct commonio_arena *arena;
+
+	/*
+	 * Lines (or names) of the entries removed since the database was
+	 * opened, for the journals of the changes (see journal_removed()).
+	 */
+	/*@owned@*/ /*@null@*/char **removed;
+	size_t nremoved;
+
+	/*
+	 * Generation of the file, see commonio_generation().
+	 */
+	unsigned long long generation;
+
+	/*
+	 * File descriptor holding the lock of the file, if locked.
+	 */
+	int lock_fd;
+
+	/*
+	 * If the database is a shard of another database, the file of
+	 * this database. See commonio_setshard().
+	 */
+	/*@owned@*/ /*@null@*/char *main_file;
+
+	/*
+	 * When the lock was taken, for the statistics of SHADOW_STATS.
+	 */
+	struct timespec locked_at;
+
+	/*
+	 * Last entry passed by commonio_locate_sorted().
+	 */
+	/*@dependent@*/ /*@null@*/struct commonio_entry *merge;
+
+	/*
+	 * Set if the database was opened with commonio_open_deferred()
+	 * and not accessed yet: the file is then opened and parsed with
+	 * deferred_mode on the first access.
+	 */
+	bool deferred;
+	int deferred_mode;
+};
+
+/*
+ * Set of databases locked, opened, and committed together.
+ */
+#define COMMONIO_TXN_MAX	8
+struct commonio_txn {
+	/*
+	 * Databases of the transaction, sorted by file name.
+	 */
+	/*@dependent@*/struct commonio_db *dbs[COMMONIO_TXN_MAX];
+	size_t count;
+
+	/*
+	 * Database which caused the last operation to fail.
+	 */
+	/*@dependent@*/ /*@null@*/struct commonio_db *failed;
 };
 
 extern int commonio_setname (struct commonio_db *, const char *);
+extern int commonio_setshard (struct commonio_db *, const char *shard);
 extern bool commonio_present (const struct commonio_db *db);
 extern int commonio_lock (struct commonio_db *);
 extern int commonio_lock_nowait (struct commonio_db *, bool log);
-extern int do_fcntl_lock (const char *file, bool log, short type);
+extern int commonio_lock_wait (struct commonio_db *, unsigned long timeout);
 extern int commonio_open (struct commonio_db *, int);
+extern int commonio_open_deferred (struct commonio_db *, int);
 extern /*@observer@*/ /*@null@*/const void *commonio_locate (struct commonio_db *, const char *);
+extern /*@observer@*/ /*@null@*/const void *commonio_locate_id (struct commonio_db *, unsigned long id);
+extern void commonio_index_members (struct commonio_db *);
+extern void commonio_compact (struct commonio_db *);
+extern /*@dependent@*/ /*@null@*/struct commonio_entry *commonio_entries (struct commonio_db *);
+extern /*@null@*/ /*@only@*/const void **commonio_member_of (struct commonio_db *, const char *name);
 extern int commonio_update (struct commonio_db *, const void *);
 #ifdef ENABLE_SUBIDS
 extern int commonio_append (struct commonio_db *, const void *);
 #endif				/* ENABLE_SUBIDS */
 extern int commonio_remove (struct commonio_db *, const char *);
+extern bool commonio_has_line (struct commonio_db *, const char *line);
+extern int commonio_remove_line (struct commonio_db *, const char *line);
 extern int commonio_rewind (struct commonio_db *);
+extern /*@observer@*/ /*@null@*/const void *commonio_locate_sorted (struct commonio_db *, const char *name);
+extern int commonio_scan (const struct commonio_db *,
+                          int (*fn) (const void *ent, void *arg), void *arg);
+extern int commonio_scan_fields (const struct commonio_db *,
+                                 unsigned int fields,
+                                 int (*fn) (const void *ent, void *arg),
+                                 void *arg);
+extern unsigned long long commonio_generation (const struct commonio_db *);
+extern unsigned long long commonio_file_generation (const char *filename);
 extern /*@observer@*/ /*@null@*/const void *commonio_next (struct commonio_db *);
 extern int commonio_close (struct commonio_db *);
+extern unsigned long commonio_changes (void);
 extern int commonio_unlock (struct commonio_db *);
 extern void commonio_del_entry (struct commonio_db *,
                                 const struct commonio_entry *);
+extern size_t commonio_duplicates (struct commonio_db *,
+                                   const struct commonio_entry *);
 extern int commonio_sort_wrt (struct commonio_db *shadow,
                               const struct commonio_db *passwd);
 extern int commonio_sort (struct commonio_db *db,
                           int (*cmp) (const void *, const void *));
+extern /*@null@*/ /*@dependent@*/void *commonio_alloc (struct commonio_db *,
+                                                       size_t size);
+extern /*@null@*/ /*@dependent@*/char *commonio_strdup (struct commonio_db *,
+                                                        const char *s);
+extern bool commonio_in_arena (const struct commonio_db *, const void *ptr);
+
+extern void commonio_txn_init (struct commonio_txn *);
+extern int commonio_txn_add (struct commonio_txn *, struct commonio_db *);
+extern int commonio_txn_lock (struct commonio_txn *);
+extern int commonio_txn_open (struct commonio_txn *, int mode);
+extern int commonio_txn_commit (struct commonio_txn *);
+extern int commonio_txn_unlock (struct commonio_txn *);
 
 #endif
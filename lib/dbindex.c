@@ -0,0 +1,912 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#ifndef DBINDEX_READER
+#include "commonio.h"
+#endif
+
+/*
+ * Lookup index of a passwd or group file.
+ *
+ * The index is stored next to the database, in file.idx. It is a
+ * snapshot of the database: it holds a copy of the lines of the entries,
+ * and maps their names and IDs, and the primary GIDs of the users of a
+ * passwd file, to these lines. It records the identity,
+ * size, modification time and generation of the database it was built
+ * from, and is ignored when they do not match the current database.
+ *
+ * A snapshot is never modified: each commit writes a new one, which
+ * replaces the previous one with rename(). The readers map it once per
+ * process, and share its pages with the other readers. They only check
+ * that it is still current before each lookup, and never read the
+ * database itself.
+ *
+ * Layout (native byte order):
+ *	struct dbindex_header
+ *	uint32_t name_buckets[nbuckets]
+ *	uint32_t id_buckets[nbuckets]
+ *	uint32_t gid_buckets[nbuckets]
+ *	uint32_t member_buckets[nbuckets]
+ *	struct dbindex_entry entries[nentries]
+ *	uint32_t ids[nentries]
+ *	struct dbindex_member members[nmembers]
+ *	char text[text_size]
+ * Buckets and chains hold an entry (or member) number plus one (0 ends
+ * a chain). The entries of a chain are in the order of the database.
+ * ids holds the IDs of the entries, sorted, to find the lowest and
+ * highest IDs of a range. text holds the lines of the entries, NUL
+ * terminated. Only the entries with a numerical fourth field (the users
+ * of a passwd file) are in the chains of gid_buckets. members lists the
+ * names of the member lists of the lines with four fields (the groups
+ * of a group file), chained by name in member_buckets.
+ *
+ * It is also read by the libnss_shadowidx module (see nss/), which is
+ * built with DBINDEX_READER: only the lookup functions are then built.
+ */
+
+#define DBINDEX_MAGIC	"shdwidx"
+#define DBINDEX_VERSION	5
+#define DBINDEX_TABLES	4	/* name, id, gid and member buckets */
+
+/* Number of snapshots kept mapped by a process */
+#define DBINDEX_MAPS	4
+
+struct dbindex_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nbuckets;
+	uint32_t nentries;
+	uint32_t nmembers;
+	uint64_t db_dev;
+	uint64_t db_ino;
+	uint64_t db_size;
+	int64_t db_mtime_sec;
+	int64_t db_mtime_nsec;
+	uint64_t db_generation;	/* see commonio_file_generation() */
+	uint64_t text_size;
+};
+
+struct dbindex_entry {
+	uint64_t offset;	/* of the line in text */
+	uint32_t length;	/* of the line, without the NUL */
+	uint32_t id;
+	uint32_t name_hash;
+	uint32_t name_next;
+	uint32_t id_next;
+	uint32_t gid;		/* fourth field, if numerical */
+	uint32_t gid_next;
+	uint32_t flags;
+};
+
+#define DBINDEX_HAS_GID	0x1	/* the entry is in the gid chains */
+
+struct dbindex_member {
+	uint32_t name_hash;
+	uint32_t entry;		/* entry number plus one */
+	uint32_t next;
+};
+
+/*
+ * A snapshot mapped by this process.
+ */
+struct dbindex_map {
+	char dbfile[1024];
+	void *base;
+	size_t size;
+	dev_t dev;	/* of the index file */
+	ino_t ino;
+	const struct dbindex_header *hdr;
+	const uint32_t *buckets;
+	const struct dbindex_entry *entries;
+	const uint32_t *ids;
+	const struct dbindex_member *members;
+	const char *text;
+};
+
+static struct dbindex_map maps[DBINDEX_MAPS];
+static size_t next_map = 0;	/* slot to reuse when all are taken */
+
+static uint32_t dbindex_hash (const char *name, size_t len)
+{
+	uint32_t h = 2166136261U;	/* FNV-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char) name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+static int dbindex_name (char *buf, size_t size, const char *dbfile)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.idx", dbfile);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+#ifndef DBINDEX_READER
+static int id_cmp (const void *p1, const void *p2)
+{
+	uint32_t id1 = *(const uint32_t *) p1;
+	uint32_t id2 = *(const uint32_t *) p2;
+
+	return (id1 < id2) ? -1 : (id1 > id2);
+}
+#endif				/* !DBINDEX_READER */
+
+static bool dbindex_matches (const struct dbindex_header *hdr,
+                             const struct stat *sb)
+{
+	return (   (hdr->db_dev == (uint64_t) sb->st_dev)
+	        && (hdr->db_ino == (uint64_t) sb->st_ino)
+	        && (hdr->db_size == (uint64_t) sb->st_size)
+	        && (hdr->db_mtime_sec == (int64_t) sb->st_mtim.tv_sec)
+	        && (hdr->db_mtime_nsec == (int64_t) sb->st_mtim.tv_nsec));
+}
+
+/*
+ * member_list - Return the start of the member list of a line, which is
+ *	its fourth and last field.
+ *
+ *	Return NULL if the line does not have four fields.
+ */
+static /*@null@*/const char *member_list (const char *line, size_t len)
+{
+	const char *end = line + len;
+	const char *p = line;
+	int i;
+
+	for (i = 0; i < 3; i++) {
+		p = memchr (p, ':', end - p);
+		if (NULL == p) {
+			return NULL;
+		}
+		p++;
+	}
+	return (NULL == memchr (p, ':', end - p)) ? p : NULL;
+}
+
+#ifndef DBINDEX_READER
+/*
+ * parse_id - Parse the numerical field of a line which starts at p.
+ *
+ *	Return a pointer to the end of the field, or NULL if it is empty
+ *	or not a number.
+ */
+static /*@null@*/const char *parse_id (const char *p, const char *end,
+                                       uint32_t *id)
+{
+	const char *start = p;
+	unsigned long long val = 0;
+
+	for (; (p < end) && (':' != *p); p++) {
+		if ((*p < '0') || (*p > '9')) {
+			return NULL;
+		}
+		val = val * 10 + (*p - '0');
+		if (val > UINT32_MAX) {
+			return NULL;
+		}
+	}
+	if (p == start) {
+		return NULL;
+	}
+
+	*id = val;
+	return p;
+}
+
+/*
+ * parse_line - Get the name, the ID (third field) and the GID (fourth
+ *	field, if numerical) of a line.
+ *
+ *	Return 0 on success, -1 if the line cannot be indexed.
+ */
+static int parse_line (const char *line, size_t len,
+                       size_t *namelen, uint32_t *id,
+                       bool *has_gid, uint32_t *gid)
+{
+	const char *end = line + len;
+	const char *p;
+
+	p = memchr (line, ':', len);
+	if ((NULL == p) || (p == line)) {
+		return -1;
+	}
+	*namelen = p - line;
+
+	p = memchr (p + 1, ':', end - (p + 1));
+	if (NULL == p) {
+		return -1;
+	}
+	p = parse_id (p + 1, end, id);
+	if ((NULL == p) || (p == end)) {
+		return -1;
+	}
+
+	p = parse_id (p + 1, end, gid);
+	*has_gid = (NULL != p) && (p < end);
+	return 0;
+}
+
+/*
+ * collect_members - Add the names of the member list of the line of entry
+ *	(an entry number plus one) to members.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int collect_members (struct dbindex_member **members,
+                            size_t *nmembers, size_t *maxmembers,
+                            const char *line, size_t len, uint32_t entry)
+{
+	const char *end = line + len;
+	const char *p = member_list (line, len);
+
+	while ((NULL != p) && (p < end)) {
+		const char *comma = memchr (p, ',', end - p);
+
+		if (NULL == comma) {
+			comma = end;
+		}
+		if (comma > p) {
+			struct dbindex_member *m;
+
+			if (*nmembers == *maxmembers) {
+				if (*maxmembers >= UINT32_MAX / 2) {
+					return -1;
+				}
+				*maxmembers = (0 == *maxmembers) ? 256 : *maxmembers * 2;
+				m = realloc (*members, *maxmembers * sizeof *m);
+				if (NULL == m) {
+					return -1;
+				}
+				*members = m;
+			}
+			m = &(*members)[(*nmembers)++];
+			m->name_hash = dbindex_hash (p, comma - p);
+			m->entry = entry;
+			m->next = 0;
+		}
+		p = comma + 1;
+	}
+	return 0;
+}
+
+/*
+ * dbindex_write - Build the lookup index of a passwd or group file.
+ *
+ *	No index is written for files which cannot be looked up line by
+ *	line: files with NIS entries, or with line continuations. A
+ *	previous index is removed in that case.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+int dbindex_write (const char *dbfile)
+{
+	char idxname[1024];
+	char tmpname[sizeof idxname + 1];
+	struct dbindex_header hdr;
+	struct dbindex_entry *entries = NULL;
+	struct dbindex_member *members = NULL;
+	size_t nmembers = 0, maxmembers = 0;
+	uint32_t *buckets = NULL;
+	uint32_t *ids = NULL;
+	const char **lines = NULL;	/* of the entries, in the database */
+	size_t nentries = 0, maxentries = 0, nbuckets, i;
+	uint64_t text_size = 0;
+	const char *map = NULL;
+	const char *line, *nl, *end;
+	struct stat sb;
+	FILE *fp = NULL;
+	int fd;
+	int ret = -1;
+
+	if (dbindex_name (idxname, sizeof idxname, dbfile) != 0) {
+		return -1;
+	}
+	(void) snprintf (tmpname, sizeof tmpname, "%s+", idxname);
+
+	fd = open (dbfile, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd) {
+		goto out;
+	}
+	if ((fstat (fd, &sb) != 0) || !S_ISREG (sb.st_mode)) {
+		goto out;
+	}
+	if (sb.st_size > 0) {
+		map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED == map) {
+			map = NULL;
+			goto out;
+		}
+	}
+
+	end = map + sb.st_size;
+	for (line = map; line < end; line = nl + 1) {
+		struct dbindex_entry *e;
+		size_t len, namelen;
+		uint32_t id, gid = 0;
+		bool has_gid;
+
+		nl = memchr (line, '\n', end - line);
+		if (NULL == nl) {
+			nl = end;
+		}
+		len = nl - line;
+		if (   (len > 0)
+		    && (('+' == line[0]) || ('-' == line[0]) || ('\\' == nl[-1]))) {
+			goto out;
+		}
+		if (   (len > UINT32_MAX)
+		    || (parse_line (line, len, &namelen, &id,
+		                    &has_gid, &gid) != 0)) {
+			continue;
+		}
+
+		if (nentries == maxentries) {
+			const char **l;
+
+			maxentries = (0 == maxentries) ? 256 : maxentries * 2;
+			e = realloc (entries, maxentries * sizeof *entries);
+			if (NULL == e) {
+				goto out;
+			}
+			entries = e;
+			l = realloc (lines, maxentries * sizeof *lines);
+			if (NULL == l) {
+				goto out;
+			}
+			lines = l;
+		}
+		lines[nentries] = line;
+		e = &entries[nentries++];
+		memzero (e, sizeof *e);
+		e->offset = text_size;
+		e->length = len;
+		text_size += len + 1;
+		e->id = id;
+		e->name_hash = dbindex_hash (line, namelen);
+		e->gid = gid;
+		if (has_gid) {
+			e->flags |= DBINDEX_HAS_GID;
+		}
+		if (collect_members (&members, &nmembers, &maxmembers,
+		                 line, len, nentries) != 0) {
+			goto out;
+		}
+	}
+
+	for (nbuckets = 64;
+	     (nbuckets < nentries) || (nbuckets < nmembers);
+	     nbuckets *= 2)
+		;
+	buckets = calloc (DBINDEX_TABLES * nbuckets, sizeof *buckets);
+	if (NULL == buckets) {
+		goto out;
+	}
+
+	/* Insert from the end, so that the chains keep the file order */
+	for (i = nentries; i > 0; i--) {
+		struct dbindex_entry *e = &entries[i - 1];
+		uint32_t *nb = &buckets[e->name_hash & (nbuckets - 1)];
+		uint32_t *ib = &buckets[nbuckets + (e->id & (nbuckets - 1))];
+
+		e->name_next = *nb;
+		*nb = i;
+		e->id_next = *ib;
+		*ib = i;
+		if ((e->flags & DBINDEX_HAS_GID) != 0) {
+			uint32_t *gb = &buckets[2 * nbuckets + (e->gid & (nbuckets - 1))];
+
+			e->gid_next = *gb;
+			*gb = i;
+		}
+	}
+	for (i = nmembers; i > 0; i--) {
+		struct dbindex_member *m = &members[i - 1];
+		uint32_t *mb = &buckets[3 * nbuckets + (m->name_hash & (nbuckets - 1))];
+
+		m->next = *mb;
+		*mb = i;
+	}
+
+	ids = malloc ((nentries + 1) * sizeof *ids);
+	if (NULL == ids) {
+		goto out;
+	}
+	for (i = 0; i < nentries; i++) {
+		ids[i] = entries[i].id;
+	}
+	qsort (ids, nentries, sizeof *ids, id_cmp);
+
+	memzero (&hdr, sizeof hdr);
+	memcpy (hdr.magic, DBINDEX_MAGIC, sizeof hdr.magic);
+	hdr.version = DBINDEX_VERSION;
+	hdr.nbuckets = nbuckets;
+	hdr.nentries = nentries;
+	hdr.nmembers = nmembers;
+	hdr.db_dev = sb.st_dev;
+	hdr.db_ino = sb.st_ino;
+	hdr.db_size = sb.st_size;
+	hdr.db_mtime_sec = sb.st_mtim.tv_sec;
+	hdr.db_mtime_nsec = sb.st_mtim.tv_nsec;
+	hdr.db_generation = commonio_file_generation (dbfile);
+	hdr.text_size = text_size;
+
+	fp = fopen (tmpname, "we");
+	if (NULL == fp) {
+		goto out;
+	}
+	if (   (fchown (fileno (fp), sb.st_uid, sb.st_gid) != 0)
+	    || (fchmod (fileno (fp), sb.st_mode & 0644) != 0)
+	    || (fwrite (&hdr, sizeof hdr, 1, fp) != 1)
+	    || (fwrite (buckets, sizeof *buckets, DBINDEX_TABLES * nbuckets, fp) != DBINDEX_TABLES * nbuckets)
+	    || (fwrite (entries, sizeof *entries, nentries, fp) != nentries)
+	    || (fwrite (ids, sizeof *ids, nentries, fp) != nentries)
+	    || (fwrite (members, sizeof *members, nmembers, fp) != nmembers)) {
+		goto out;
+	}
+	for (i = 0; i < nentries; i++) {
+		if (   (fwrite (lines[i], 1, entries[i].length, fp) != entries[i].length)
+		    || (putc ('\0', fp) == EOF)) {
+			goto out;
+		}
+	}
+	if (fclose (fp) != 0) {
+		fp = NULL;
+		goto out;
+	}
+	fp = NULL;
+	if (rename (tmpname, idxname) != 0) {
+		goto out;
+	}
+	ret = 0;
+
+      out:
+	if (NULL != fp) {
+		(void) fclose (fp);
+	}
+	if (0 != ret) {
+		(void) unlink (tmpname);
+		(void) unlink (idxname);
+	}
+	if (NULL != map) {
+		(void) munmap ((void *) map, sb.st_size);
+	}
+	if (-1 != fd) {
+		(void) close (fd);
+	}
+	free (buckets);
+	free (entries);
+	free (members);
+	free (lines);
+	free (ids);
+	return ret;
+}
+#endif				/* !DBINDEX_READER */
+
+/*
+ * map_release - Unmap a snapshot mapped by map_snapshot.
+ */
+static void map_release (struct dbindex_map *m)
+{
+	if (NULL != m->base) {
+		(void) munmap (m->base, m->size);
+	}
+	memzero (m, sizeof *m);
+}
+
+/*
+ * map_snapshot - Map the snapshot of dbfile in m.
+ *
+ *	Return 0 on success, -1 if there is no valid snapshot.
+ */
+static int map_snapshot (struct dbindex_map *m, const char *dbfile,
+                         const char *idxname)
+{
+	const struct dbindex_header *hdr;
+	struct stat isb;
+	size_t size, tables;
+	void *base;
+	int fd;
+
+	fd = open (idxname, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd) {
+		return -1;
+	}
+	if (   (fstat (fd, &isb) != 0)
+	    || ((size_t) isb.st_size < sizeof *hdr)) {
+		(void) close (fd);
+		return -1;
+	}
+	size = isb.st_size;
+	base = mmap (NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close (fd);
+	if (MAP_FAILED == base) {
+		return -1;
+	}
+
+	hdr = base;
+	tables =   sizeof *hdr
+	         + DBINDEX_TABLES * (size_t) hdr->nbuckets * sizeof (uint32_t)
+	         + (size_t) hdr->nentries * sizeof (struct dbindex_entry)
+	         + (size_t) hdr->nentries * sizeof (uint32_t)
+	         + (size_t) hdr->nmembers * sizeof (struct dbindex_member);
+	if (   (memcmp (hdr->magic, DBINDEX_MAGIC, sizeof hdr->magic) != 0)
+	    || (DBINDEX_VERSION != hdr->version)
+	    || (0 == hdr->nbuckets)
+	    || ((hdr->nbuckets & (hdr->nbuckets - 1)) != 0)
+	    || (size < tables)
+	    || (size - tables != hdr->text_size)) {
+		(void) munmap (base, size);
+		return -1;
+	}
+
+	(void) strcpy (m->dbfile, dbfile);
+	m->base = base;
+	m->size = size;
+	m->dev = isb.st_dev;
+	m->ino = isb.st_ino;
+	m->hdr = hdr;
+	m->buckets = (const uint32_t *) (hdr + 1);
+	m->entries = (const struct dbindex_entry *) (m->buckets + DBINDEX_TABLES * hdr->nbuckets);
+	m->ids = (const uint32_t *) (m->entries + hdr->nentries);
+	m->members = (const struct dbindex_member *) (m->ids + hdr->nentries);
+	m->text = (const char *) (m->members + hdr->nmembers);
+	return 0;
+}
+
+/*
+ * dbindex_get - Return the snapshot of dbfile, if it describes the
+ *	current version of dbfile.
+ *
+ *	The snapshots stay mapped, and are only mapped again when they
+ *	are replaced.
+ */
+static /*@null@*/const struct dbindex_map *dbindex_get (const char *dbfile)
+{
+	char idxname[1024];
+	struct dbindex_map *m = NULL;
+	struct stat isb, sb;
+	size_t i;
+
+	if (   (strlen (dbfile) >= sizeof m->dbfile)
+	    || (dbindex_name (idxname, sizeof idxname, dbfile) != 0)
+	    || (stat (idxname, &isb) != 0)) {
+		return NULL;
+	}
+
+	for (i = 0; i < DBINDEX_MAPS; i++) {
+		if (   (NULL != maps[i].base)
+		    && (strcmp (maps[i].dbfile, dbfile) == 0)) {
+			m = &maps[i];
+			break;
+		}
+	}
+	if (   (NULL != m)
+	    && ((m->dev != isb.st_dev) || (m->ino != isb.st_ino))) {
+		/* A new snapshot was published */
+		map_release (m);
+	}
+	if ((NULL == m) || (NULL == m->base)) {
+		if (NULL == m) {
+			for (i = 0; i < DBINDEX_MAPS; i++) {
+				if (NULL == maps[i].base) {
+					m = &maps[i];
+					break;
+				}
+			}
+		}
+		if (NULL == m) {
+			m = &maps[next_map];
+			next_map = (next_map + 1) % DBINDEX_MAPS;
+			map_release (m);
+		}
+		if (map_snapshot (m, dbfile, idxname) != 0) {
+			return NULL;
+		}
+	}
+
+	if ((stat (dbfile, &sb) != 0) || !dbindex_matches (m->hdr, &sb)) {
+		return NULL;
+	}
+	return m;
+}
+
+/*
+ * dbindex_lookup - Find the line of a passwd or group file with the
+ *	given name, or (if name is NULL) with the given ID.
+ *
+ *	Return 1 and set *line to the line (allocated, without newline) if
+ *	it was found, 0 if the database has no such entry, and -1 if there
+ *	is no up to date index: the database must then be scanned.
+ */
+int dbindex_lookup (const char *dbfile, /*@null@*/const char *name,
+                    unsigned long id, /*@out@*/char **line)
+{
+	const struct dbindex_map *m;
+	size_t namelen = 0;
+	uint32_t hash = 0, n;
+
+	*line = NULL;
+
+	m = dbindex_get (dbfile);
+	if (NULL == m) {
+		return -1;
+	}
+
+	if (NULL != name) {
+		namelen = strlen (name);
+		hash = dbindex_hash (name, namelen);
+		n = m->buckets[hash & (m->hdr->nbuckets - 1)];
+	} else {
+		n = m->buckets[m->hdr->nbuckets + (id & (m->hdr->nbuckets - 1))];
+	}
+
+	while ((0 != n) && (n <= m->hdr->nentries)) {
+		const struct dbindex_entry *e = &m->entries[n - 1];
+		const char *text;
+
+		if (NULL != name) {
+			n = e->name_next;
+			if ((e->name_hash != hash) || (e->length <= namelen)) {
+				continue;
+			}
+		} else {
+			n = e->id_next;
+			if (e->id != id) {
+				continue;
+			}
+		}
+		if (   (e->offset >= m->hdr->text_size)
+		    || (m->hdr->text_size - e->offset <= e->length)) {
+			return -1;
+		}
+		text = m->text + e->offset;
+		if (   (NULL != name)
+		    && ((strncmp (text, name, namelen) != 0) || (':' != text[namelen]))) {
+			continue;
+		}
+
+		*line = strndup (text, e->length);
+		return (NULL == *line) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * dbindex_gid_names - List the users of a passwd file whose primary
+ *	group is gid.
+ *
+ *	At most max names are listed, or all of them if max is 0.
+ *
+ *	Return the number of users and set *names to a NULL terminated
+ *	list of their names (allocated), in the order of the database, or
+ *	return -1 if there is no up to date index: the database must then
+ *	be scanned.
+ */
+int dbindex_gid_names (const char *dbfile, unsigned long gid, size_t max,
+                       /*@out@*/char ***names)
+{
+	const struct dbindex_map *m;
+	char **list = NULL;
+	size_t count = 0;
+	uint32_t n;
+
+	*names = NULL;
+
+	m = dbindex_get (dbfile);
+	if ((NULL == m) || (gid > UINT32_MAX)) {
+		return -1;
+	}
+
+	n = m->buckets[2 * m->hdr->nbuckets + (gid & (m->hdr->nbuckets - 1))];
+	while ((0 != n) && (n <= m->hdr->nentries) && ((0 == max) || (count < max))) {
+		const struct dbindex_entry *e = &m->entries[n - 1];
+		const char *text, *colon;
+
+		n = e->gid_next;
+		if (((e->flags & DBINDEX_HAS_GID) == 0) || (e->gid != gid)) {
+			continue;
+		}
+		if (   (e->offset >= m->hdr->text_size)
+		    || (m->hdr->text_size - e->offset <= e->length)) {
+			goto fail;
+		}
+		text = m->text + e->offset;
+		colon = memchr (text, ':', e->length);
+		if (NULL == colon) {
+			goto fail;
+		}
+
+		if (0 == (count % 64)) {
+			char **l = realloc (list, (count + 64 + 1) * sizeof *l);
+
+			if (NULL == l) {
+				goto fail;
+			}
+			list = l;
+		}
+		list[count] = strndup (text, colon - text);
+		if (NULL == list[count]) {
+			goto fail;
+		}
+		count++;
+	}
+
+	if (NULL == list) {
+		list = calloc (1, sizeof *list);
+		if (NULL == list) {
+			return -1;
+		}
+	}
+	list[count] = NULL;
+	*names = list;
+	return count;
+
+      fail:
+	while (count > 0) {
+		free (list[--count]);
+	}
+	free (list);
+	return -1;
+}
+
+/*
+ * dbindex_id_bounds - Find the lowest and highest IDs of the [min:max]
+ *	range used in a passwd or group file.
+ *
+ *	Return 1 and set *lowest and *highest if the range has entries, 0
+ *	if it has none, and -1 if there is no up to date index: the
+ *	database must then be scanned.
+ */
+int dbindex_id_bounds (const char *dbfile, unsigned long min,
+                       unsigned long max, /*@out@*/unsigned long *lowest,
+                       /*@out@*/unsigned long *highest)
+{
+	const struct dbindex_map *m;
+	const uint32_t *ids;
+	size_t nentries, lo, hi;
+
+	m = dbindex_get (dbfile);
+	if (NULL == m) {
+		return -1;
+	}
+	ids = m->ids;
+	nentries = m->hdr->nentries;
+
+	/* lo: first ID >= min */
+	lo = 0;
+	hi = nentries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ids[mid] < min) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	if ((lo == nentries) || (ids[lo] > max)) {
+		return 0;
+	}
+	*lowest = ids[lo];
+
+	/* hi: first ID > max */
+	hi = nentries;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (ids[mid] <= max) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*highest = ids[lo - 1];
+	return 1;
+}
+
+/*
+ * has_member - Tell if the member list of a line lists name.
+ */
+static bool has_member (const char *line, size_t len,
+                        const char *name, size_t namelen)
+{
+	const char *end = line + len;
+	const char *p = member_list (line, len);
+
+	while ((NULL != p) && (p < end)) {
+		const char *comma = memchr (p, ',', end - p);
+
+		if (NULL == comma) {
+			comma = end;
+		}
+		if (((size_t) (comma - p) == namelen) && (memcmp (p, name, namelen) == 0)) {
+			return true;
+		}
+		p = comma + 1;
+	}
+	return false;
+}
+
+/*
+ * dbindex_member_gids - List the groups of a group file which list name
+ *	as a member.
+ *
+ *	Return the number of groups and set *gids to their GIDs (allocated),
+ *	in the order of the database, or return -1 if there is no up to
+ *	date index: the database must then be scanned.
+ */
+int dbindex_member_gids (const char *dbfile, const char *name,
+                         /*@out@*/unsigned long **gids)
+{
+	const struct dbindex_map *m;
+	unsigned long *list = NULL;
+	size_t namelen = strlen (name);
+	size_t count = 0;
+	uint32_t hash, n, last = 0;
+
+	*gids = NULL;
+
+	m = dbindex_get (dbfile);
+	if (NULL == m) {
+		return -1;
+	}
+
+	hash = dbindex_hash (name, namelen);
+	n = m->buckets[3 * m->hdr->nbuckets + (hash & (m->hdr->nbuckets - 1))];
+	while ((0 != n) && (n <= m->hdr->nmembers)) {
+		const struct dbindex_member *mb = &m->members[n - 1];
+		const struct dbindex_entry *e;
+
+		n = mb->next;
+		/* A name listed twice in a group is only reported once */
+		if (   (mb->name_hash != hash)
+		    || (mb->entry == last)
+		    || (0 == mb->entry)
+		    || (mb->entry > m->hdr->nentries)) {
+			continue;
+		}
+		e = &m->entries[mb->entry - 1];
+		if (   (e->offset >= m->hdr->text_size)
+		    || (m->hdr->text_size - e->offset <= e->length)) {
+			free (list);
+			return -1;
+		}
+		if (!has_member (m->text + e->offset, e->length, name, namelen)) {
+			continue;
+		}
+		last = mb->entry;
+
+		if (0 == (count % 64)) {
+			unsigned long *l = realloc (list, (count + 64) * sizeof *l);
+
+			if (NULL == l) {
+				free (list);
+				return -1;
+			}
+			list = l;
+		}
+		list[count++] = e->id;
+	}
+
+	*gids = list;
+	return count;
+}
@@ -0,0 +1,121 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog_internal.h"
+
+/*
+ * Deadline of the operation of a tool.
+ *
+ * With --deadline, a tool is given a budget of milliseconds for the
+ * whole operation. Each phase which can block (the locks of the
+ * databases, the hooks and commands, the copy or removal of a home
+ * directory) is bounded by the time left, and the phases which are
+ * checkpoints call deadline_check() before they start.
+ *
+ * Once the budget is spent, the tool stops before it modifies the next
+ * database, so that an aborted operation leaves the databases as they
+ * were. The databases written under the same locks are never split by
+ * the deadline: see commonio_close() and commonio_txn_commit().
+ *
+ * Without --deadline, there is no deadline, and these functions change
+ * nothing.
+ */
+
+static bool deadline_set = false;
+static bool deadline_reported = false;
+static struct timespec deadline_end;
+
+/*
+ * deadline_start - Start a budget of ms milliseconds from now.
+ */
+void deadline_start (unsigned long ms)
+{
+	(void) clock_gettime (CLOCK_MONOTONIC, &deadline_end);
+	deadline_end.tv_sec += ms / 1000;
+	deadline_end.tv_nsec += (long) (ms % 1000) * 1000000L;
+	if (deadline_end.tv_nsec >= 1000000000L) {
+		deadline_end.tv_sec++;
+		deadline_end.tv_nsec -= 1000000000L;
+	}
+	deadline_set = true;
+	deadline_reported = false;
+}
+
+/*
+ * deadline_active - Check if the tool has a deadline.
+ */
+bool deadline_active (void)
+{
+	return deadline_set;
+}
+
+/*
+ * deadline_remaining - Return the milliseconds left before the deadline,
+ *	at most max.
+ *
+ *	Without a deadline, max is returned.
+ */
+unsigned long deadline_remaining (unsigned long max)
+{
+	struct timespec now;
+	long long left;
+
+	if (!deadline_set) {
+		return max;
+	}
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	left =   (long long) (deadline_end.tv_sec - now.tv_sec) * 1000
+	       + (deadline_end.tv_nsec - now.tv_nsec) / 1000000;
+	if (left <= 0) {
+		return 0;
+	}
+	if ((unsigned long long) left < max) {
+		return (unsigned long) left;
+	}
+	return max;
+}
+
+/*
+ * deadline_expired - Check if the deadline has passed.
+ */
+bool deadline_expired (void)
+{
+	return deadline_set && (deadline_remaining (1) == 0);
+}
+
+/*
+ * deadline_check - Check the deadline before or during phase.
+ *
+ *	If it has passed, the first check reports it, and errno is set to
+ *	ETIMEDOUT.
+ *
+ *	Return 0 if the phase can start, -1 if the deadline has passed.
+ */
+int deadline_check (const char *phase)
+{
+	if (!deadline_expired ()) {
+		return 0;
+	}
+
+	if (!deadline_reported) {
+		fprintf (shadow_logfd,
+		         _("%s: deadline exceeded (%s)\n"),
+		         shadow_progname, phase);
+		SYSLOG ((LOG_WARN, "deadline exceeded (%s)", phase));
+		deadline_reported = true;
+	}
+	errno = ETIMEDOUT;
+	return -1;
+}
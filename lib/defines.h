@@ -119,14 +119,14 @@ static inline void memzero(void *ptr, size_t size)
 		if (NULL != saved_locale) {				\
 			(void) setlocale (LC_ALL, "C");			\
 		}							\
-		syslog x ;						\
+		shadow_syslog x ;					\
 		if (NULL != saved_locale) {				\
 			(void) setlocale (LC_ALL, saved_locale);	\
 			free (saved_locale);				\
 		}							\
 	} while (false)
 #else				/* !ENABLE_NLS */
-#define SYSLOG(x) syslog x
+#define SYSLOG(x) shadow_syslog x
 #endif				/* !ENABLE_NLS */
 
 /* The default syslog settings can now be changed here,
@@ -198,6 +198,10 @@ static inline void memzero(void *ptr, size_t size)
 #endif
 #endif
 
+#ifndef CRYPT_COST_FILE
+#define CRYPT_COST_FILE "/etc/crypt-cost"
+#endif
+
 /*
  * string to use for the pw_passwd field in /etc/passwd when using
  * shadow passwords - most systems use "x" but there are a few
@@ -231,6 +235,10 @@ static inline void memzero(void *ptr, size_t size)
 # define format_attr(type, index, check)
 #endif
 
+/* lib/shadowlog.c, used by SYSLOG */
+extern void shadow_syslog (int priority, const char *format, ...)
+	format_attr(printf, 2, 3);
+
 /* Maximum length of usernames */
 #include <utmp.h>
 #define USER_NAME_MAX_LENGTH (sizeof (((struct utmp *)NULL)->ut_user))
@@ -11,10 +11,16 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#ifdef HAVE_CRYPT_R
+#include <pthread.h>
+#endif				/* HAVE_CRYPT_R */
 
 #include "prototypes.h"
+#include "probes.h"
 #include "defines.h"
 #include "shadowlog_internal.h"
 
@@ -23,7 +29,9 @@
 	static char cipher[128];
 	char *cp;
 
+	PROBE0 (crypt__start);
 	cp = crypt (clear, salt);
+	PROBE1 (crypt__done, NULL != cp);
 	if (NULL == cp) {
 		/*
 		 * Single Unix Spec: crypt() may return a null pointer,
@@ -77,3 +85,395 @@
 	return cipher;
 }
 
+#ifdef HAVE_CRYPT_R
+/*
+ * pw_encrypt_r - Encrypt a password like pw_encrypt, in data
+ *
+ *	This can be called by several threads at the same time, with
+ *	their own data (zeroed before its first use). Instead of exiting
+ *	if libcrypt does not support the method of the salt, NULL is
+ *	returned with errno set to EINVAL.
+ */
+/*@null@*/char *pw_encrypt_r (const char *clear, const char *salt,
+                              struct crypt_data *data)
+{
+	char *cp;
+
+	PROBE0 (crypt__start);
+#ifdef HAVE_CRYPT_RN
+	/* crypt_rn() returns NULL on failure, not a failure token */
+	cp = crypt_rn (clear, salt, data, sizeof *data);
+#else				/* !HAVE_CRYPT_RN */
+	cp = crypt_r (clear, salt, data);
+#endif				/* !HAVE_CRYPT_RN */
+	PROBE1 (crypt__done, NULL != cp);
+	if (NULL == cp) {
+		return NULL;
+	}
+
+	/* See pw_encrypt */
+	if ((NULL != salt) && (salt[0] == '$') && (strlen (cp) <= 13)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	return cp;
+}
+
+/*
+ * Batch of passwords encrypted by a pool of threads.
+ *
+ * The passwords are queued with crypt_batch_add() while the threads
+ * encrypt the ones already queued. crypt_batch_finish() waits for all
+ * of them; their hashes are then read in the order they were queued.
+ * The threads can also check the passwords before encrypting them, see
+ * crypt_batch_set_check().
+ */
+struct crypt_batch_item {
+	/*@null@*/char *clear;	/* slot of secret.c, released once encrypted */
+	/*@only@*/char *salt;
+	/*@only@*//*@null@*/char *hash;
+	int err;		/* errno if hash is NULL */
+	/*@observer@*//*@null@*/const char *rejected;	/* by the check */
+};
+
+struct crypt_batch {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/*@only@*/pthread_t *threads;
+	long nthreads;
+	/* The following are protected by mutex */
+	/*@null@*/const char *(*check) (const char *clear);
+	/*@only@*//*@null@*/struct crypt_batch_item *items;
+	size_t count;
+	size_t size;
+	size_t next;		/* next item for the threads */
+	bool finished;		/* no more items will be added */
+};
+
+static void crypt_batch_encrypt (struct crypt_batch_item *item,
+                                 /*@null@*/const char *(*check) (const char *),
+                                 /*@null@*/struct crypt_data *data)
+{
+	char *cp;
+
+	item->hash = NULL;
+	item->err = 0;
+	item->rejected = NULL;
+	if (NULL != check) {
+		item->rejected = check (item->clear);
+	}
+	if (NULL != item->rejected) {
+		secret_free (item->clear);
+		item->clear = NULL;
+		return;
+	}
+	if (NULL == data) {
+		item->err = ENOMEM;
+	} else {
+		cp = pw_encrypt_r (item->clear, item->salt, data);
+		if (NULL == cp) {
+			item->err = errno;
+		} else {
+			item->hash = strdup (cp);
+			if (NULL == item->hash) {
+				item->err = ENOMEM;
+			}
+		}
+	}
+	/* The slot is reused by the next passwords */
+	secret_free (item->clear);
+	item->clear = NULL;
+}
+
+/*@null@*/static void *crypt_batch_thread (void *arg)
+{
+	struct crypt_batch *batch = arg;
+	struct crypt_data *data;
+
+	/* struct crypt_data is large: do not put it on the stack */
+	data = calloc (1, sizeof *data);
+
+	(void) pthread_mutex_lock (&batch->mutex);
+	for (;;) {
+		struct crypt_batch_item item;
+		const char *(*check) (const char *);
+		size_t i;
+
+		while ((batch->next == batch->count) && !batch->finished) {
+			(void) pthread_cond_wait (&batch->cond, &batch->mutex);
+		}
+		if (batch->next == batch->count) {
+			break;
+		}
+		/* items may be moved by crypt_batch_add meanwhile */
+		i = batch->next++;
+		item = batch->items[i];
+		check = batch->check;
+		(void) pthread_mutex_unlock (&batch->mutex);
+
+		crypt_batch_encrypt (&item, check, data);
+
+		(void) pthread_mutex_lock (&batch->mutex);
+		batch->items[i].hash = item.hash;
+		batch->items[i].err = item.err;
+		batch->items[i].rejected = item.rejected;
+	}
+	(void) pthread_mutex_unlock (&batch->mutex);
+
+	if (NULL != data) {
+		memzero (data, sizeof *data);
+		free (data);
+	}
+	return NULL;
+}
+
+/*
+ * crypt_batch_start - Start a batch encrypted by nthreads threads
+ *
+ *	If some threads cannot be started, the others do the work, and
+ *	without threads the passwords are encrypted by
+ *	crypt_batch_finish().
+ *
+ *	Return NULL on failure.
+ */
+/*@null@*//*@only@*/struct crypt_batch *crypt_batch_start (long nthreads)
+{
+	struct crypt_batch *batch;
+	long i;
+
+	batch = calloc (1, sizeof *batch);
+	if (NULL == batch) {
+		return NULL;
+	}
+	batch->threads = calloc ((nthreads > 0) ? nthreads : 1,
+	                         sizeof *batch->threads);
+	if (   (NULL == batch->threads)
+	    || (pthread_mutex_init (&batch->mutex, NULL) != 0)) {
+		free (batch->threads);
+		free (batch);
+		return NULL;
+	}
+	if (pthread_cond_init (&batch->cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&batch->mutex);
+		free (batch->threads);
+		free (batch);
+		return NULL;
+	}
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create (&batch->threads[batch->nthreads], NULL,
+		                    crypt_batch_thread, batch) == 0) {
+			batch->nthreads++;
+		}
+	}
+	return batch;
+}
+
+/*
+ * crypt_batch_set_check - Check the passwords of a batch before they are
+ *	encrypted
+ *
+ *	check is called by the threads of the batch, possibly at the same
+ *	time, for each password queued afterwards. It returns NULL if the
+ *	password is accepted, or a static message which explains why it is
+ *	rejected. A rejected password is not encrypted, see
+ *	crypt_batch_rejected().
+ */
+void crypt_batch_set_check (struct crypt_batch *batch,
+                            /*@null@*/const char *(*check) (const char *clear))
+{
+	(void) pthread_mutex_lock (&batch->mutex);
+	batch->check = check;
+	(void) pthread_mutex_unlock (&batch->mutex);
+}
+
+/*
+ * crypt_batch_add - Queue the encryption of clear with salt
+ *
+ *	clear is copied in a slot of secret_strdup(), which fails with
+ *	ERANGE if it is longer than SECRET_SIZE - 1. salt is copied.
+ *
+ *	Return the number of the password (from 0, in the order they are
+ *	queued), or -1 on failure.
+ */
+ssize_t crypt_batch_add (struct crypt_batch *batch,
+                         const char *clear, const char *salt)
+{
+	struct crypt_batch_item item;
+	ssize_t ret = -1;
+
+	item.clear = secret_strdup (clear);
+	item.salt = strdup (salt);
+	item.hash = NULL;
+	item.err = 0;
+	item.rejected = NULL;
+	if ((NULL == item.clear) || (NULL == item.salt)) {
+		goto fail;
+	}
+
+	(void) pthread_mutex_lock (&batch->mutex);
+	if (batch->finished) {
+		(void) pthread_mutex_unlock (&batch->mutex);
+		errno = EINVAL;
+		goto fail;
+	}
+	if (batch->count == batch->size) {
+		size_t size = (0 == batch->size) ? 256 : batch->size * 2;
+		struct crypt_batch_item *items;
+
+		items = realloc (batch->items, size * sizeof *items);
+		if (NULL == items) {
+			(void) pthread_mutex_unlock (&batch->mutex);
+			goto fail;
+		}
+		batch->items = items;
+		batch->size = size;
+	}
+	ret = batch->count;
+	batch->items[batch->count++] = item;
+	(void) pthread_cond_signal (&batch->cond);
+	(void) pthread_mutex_unlock (&batch->mutex);
+	return ret;
+
+      fail:
+	secret_free (item.clear);
+	free (item.salt);
+	return -1;
+}
+
+/*
+ * crypt_batch_finish - Wait for all the passwords of the batch to be
+ *	encrypted
+ *
+ *	No password can be added afterwards.
+ */
+void crypt_batch_finish (struct crypt_batch *batch)
+{
+	struct crypt_data *data = NULL;
+	long i;
+
+	(void) pthread_mutex_lock (&batch->mutex);
+	batch->finished = true;
+	(void) pthread_cond_broadcast (&batch->cond);
+	(void) pthread_mutex_unlock (&batch->mutex);
+	for (i = 0; i < batch->nthreads; i++) {
+		(void) pthread_join (batch->threads[i], NULL);
+	}
+	batch->nthreads = 0;
+
+	/* Without threads, encrypt the passwords here */
+	for (; batch->next < batch->count; batch->next++) {
+		if (NULL == data) {
+			data = calloc (1, sizeof *data);
+		}
+		crypt_batch_encrypt (&batch->items[batch->next],
+		                     batch->check, data);
+	}
+	if (NULL != data) {
+		memzero (data, sizeof *data);
+		free (data);
+	}
+}
+
+/*
+ * crypt_batch_hash - Get the hash of the password number i of a
+ *	finished batch
+ *
+ *	Return NULL and set *err to the errno of the failure if the
+ *	password could not be encrypted. *salt is set to the salt of the
+ *	password if salt is not NULL.
+ */
+/*@null@*//*@observer@*/const char *crypt_batch_hash (const struct crypt_batch *batch,
+                                                     size_t i,
+                                                     /*@null@*/const char **salt,
+                                                     /*@out@*/int *err)
+{
+	const struct crypt_batch_item *item = &batch->items[i];
+
+	if (NULL != salt) {
+		*salt = item->salt;
+	}
+	*err = item->err;
+	return item->hash;
+}
+
+/*
+ * crypt_batch_rejected - Get the message of the check which rejected the
+ *	password number i of a finished batch
+ *
+ *	Return NULL if the password was not rejected.
+ */
+/*@null@*//*@observer@*/const char *crypt_batch_rejected (const struct crypt_batch *batch,
+                                                         size_t i)
+{
+	return batch->items[i].rejected;
+}
+
+/*
+ * crypt_batch_free - Free a batch, after crypt_batch_finish()
+ */
+void crypt_batch_free (/*@only@*/struct crypt_batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < batch->count; i++) {
+		secret_free (batch->items[i].clear);
+		free (batch->items[i].salt);
+		if (NULL != batch->items[i].hash) {
+			strzero (batch->items[i].hash);
+			free (batch->items[i].hash);
+		}
+	}
+	free (batch->items);
+	free (batch->threads);
+	(void) pthread_cond_destroy (&batch->cond);
+	(void) pthread_mutex_destroy (&batch->mutex);
+	free (batch);
+}
+
+/*
+ * pw_encrypt_many - Encrypt n passwords with nthreads threads
+ *
+ *	hash[i] is set to an allocated hash of clear[i] with salt[i], or
+ *	to NULL if it cannot be encrypted.
+ *
+ *	Return 0 if all the passwords were encrypted, -1 otherwise.
+ */
+int pw_encrypt_many (size_t n, const char *const clear[],
+                     const char *const salt[], long nthreads,
+                     /*@out@*/char *hash[])
+{
+	struct crypt_batch *batch;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < n; i++) {
+		hash[i] = NULL;
+	}
+	batch = crypt_batch_start (nthreads);
+	if (NULL == batch) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (crypt_batch_add (batch, clear[i], salt[i]) == -1) {
+			ret = -1;
+			break;
+		}
+	}
+	crypt_batch_finish (batch);
+	for (i = 0; i < batch->count; i++) {
+		int err;
+		const char *cp = crypt_batch_hash (batch, i, NULL, &err);
+
+		if (NULL != cp) {
+			hash[i] = strdup (cp);
+		}
+		if (NULL == hash[i]) {
+			ret = -1;
+		}
+	}
+	crypt_batch_free (batch);
+	return ret;
+}
+#endif				/* HAVE_CRYPT_R */
@@ -12,6 +12,7 @@
 #ident "$Id$"
 
 #include <ctype.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdio.h>
 #include "prototypes.h"
@@ -104,3 +105,142 @@ void change_field (char *buf, size_t maxsize, const char *prompt)
 	}
 }
 
+
+/*
+ * The separators of a line are searched a word at a time: a word of the
+ * line XORed with a word of separators has a zero byte where the line has
+ * a separator, and sep_bytes() sets the high bit of exactly these bytes.
+ */
+#define ONES	(~(uint64_t) 0 / 0xff)		/* 0x0101...01 */
+#define LOWS	(ONES * 0x7f)			/* 0x7f7f...7f */
+
+static inline uint64_t sep_bytes (const char *p, uint64_t seps)
+{
+	uint64_t w;
+
+	memcpy (&w, p, sizeof w);
+	w ^= seps;
+	return ~(((w & LOWS) + LOWS) | w | LOWS);
+}
+
+/*
+ * next_sep - Return the offset in its word of the first separator flagged
+ *            in *m, and clear its flag.
+ */
+static inline size_t next_sep (uint64_t *m)
+{
+	size_t i;
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	i = __builtin_ctzll (*m) / 8;
+	*m &= *m - 1;
+#else
+	for (i = 0; 0 == (*m & ((uint64_t) 0x80 << (8 * i))); i++) {
+		/* With big-endian words, the first byte is the highest */
+		;
+	}
+	*m &= ~((uint64_t) 0x80 << (8 * i));
+#endif
+	return i;
+}
+
+/*
+ * split_fields - split a line into fields
+ *
+ *	The len bytes of buf are split at each sep character, which is
+ *	replaced by a NUL byte, and fields[] is set to the start of each
+ *	field, up to max fields.
+ *
+ *	Short fields, like the members of a group, are found a word at a
+ *	time.  When two words have no separator, the field is long, and
+ *	the rest of it is searched with memchr(), which is faster on long
+ *	strings.
+ *
+ *	Return the number of fields, or max + 1 if there are more than max
+ *	fields.  In that case, the max fields are still NUL terminated,
+ *	and the rest of the line is not split.
+ */
+size_t split_fields (char *buf, size_t len, char sep,
+                     /*@out@*/char **fields, size_t max)
+{
+	const uint64_t seps = ONES * (unsigned char) sep;
+	char *end = buf + len;
+	char *cp = buf;
+	char *s;
+	size_t n = 0;
+	bool long_field = false;
+
+	if (0 == max) {
+		return 1;
+	}
+	fields[n++] = buf;
+	while ((size_t) (end - cp) >= sizeof seps) {
+		uint64_t m = sep_bytes (cp, seps);
+
+		if ((0 == m) && !long_field) {
+			long_field = true;
+			cp += sizeof seps;
+			continue;
+		}
+		if (0 == m) {
+			s = memchr (cp, sep, (size_t) (end - cp));
+			if (NULL == s) {
+				return n;
+			}
+			*s = '\0';
+			if (n == max) {
+				return max + 1;
+			}
+			fields[n++] = s + 1;
+			cp = s + 1;
+			long_field = false;
+			continue;
+		}
+		long_field = false;
+		do {
+			s = cp + next_sep (&m);
+			*s = '\0';
+			if (n == max) {
+				return max + 1;
+			}
+			fields[n++] = s + 1;
+		} while (0 != m);
+		cp += sizeof seps;
+	}
+	for (; cp < end; cp++) {
+		if (sep == *cp) {
+			*cp = '\0';
+			if (n == max) {
+				return max + 1;
+			}
+			fields[n++] = cp + 1;
+		}
+	}
+	return n;
+}
+
+/*
+ * count_fields - return the number of sep separated fields in the len
+ *                bytes of buf
+ */
+size_t count_fields (const char *buf, size_t len, char sep)
+{
+	const uint64_t seps = ONES * (unsigned char) sep;
+	const char *end = buf + len;
+	size_t n = 1;
+
+	for (; (size_t) (end - buf) >= sizeof seps; buf += sizeof seps) {
+		uint64_t m = sep_bytes (buf, seps);
+
+		while (0 != m) {
+			n++;
+			m &= m - 1;
+		}
+	}
+	for (; buf < end; buf++) {
+		if (sep == *buf) {
+			n++;
+		}
+	}
+	return n;
+}
@@ -20,6 +20,13 @@
 #include <errno.h>
 #ifdef USE_ECONF
 #include <libeconf.h>
+#else
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #endif
 #include "getdef.h"
 #include "shadowlog_internal.h"
@@ -29,6 +36,10 @@
 struct itemdef {
 	/*@null@*/const char *name;	/* name of the item                     */
 	/*@null@*/char *value;		/* value given, or NULL if no value     */
+	bool has_long;			/* value was parsed by getlong()        */
+	long long_value;
+	bool has_ulong;			/* value was parsed by getulong()       */
+	unsigned long ulong_value;
 };
 
 #define PAMDEFS					\
@@ -75,6 +86,7 @@ static struct itemdef def_table[] = {
 	{"CONSOLE", NULL},
 	{"CREATE_HOME", NULL},
 	{"DEFAULT_HOME", NULL},
+	{"DEFER_HOME_REMOVAL", NULL},
 	{"ENCRYPT_METHOD", NULL},
 	{"ENV_PATH", NULL},
 	{"ENV_SUPATH", NULL},
@@ -83,13 +95,26 @@ static struct itemdef def_table[] = {
 	{"FAKE_SHELL", NULL},
 	{"GID_MAX", NULL},
 	{"GID_MIN", NULL},
+	{"HOME_CHOWN_JOBS", NULL},
+	{"HOME_COPY_JOBS", NULL},
+	{"HOME_IO_URING", NULL},
 	{"HOME_MODE", NULL},
+	{"HOME_REMOVE_ASYNC", NULL},
+	{"HOME_REMOVE_JOBS", NULL},
+	{"HOOK_TIMEOUT", NULL},
 	{"HUSHLOGIN_FILE", NULL},
+	{"ID_BLOCK_FILE", NULL},
+	{"ID_BLOCK_SIZE", NULL},
+	{"ID_PROBE_CACHE_TTL", NULL},
+	{"ID_PROBE_ENUMERATE", NULL},
+	{"ID_PROBE_JOBS", NULL},
 	{"KILLCHAR", NULL},
 	{"LASTLOG_UID_MAX", NULL},
+	{"LOCK_TIMEOUT_MS", NULL},
 	{"LOGIN_RETRIES", NULL},
 	{"LOGIN_TIMEOUT", NULL},
 	{"LOG_OK_LOGINS", NULL},
+	{"LOG_TIMINGS", NULL},
 	{"LOG_UNKFAIL_ENAB", NULL},
 	{"MAIL_DIR", NULL},
 	{"MAIL_FILE", NULL},
@@ -113,6 +138,8 @@ static struct itemdef def_table[] = {
 	{"SUB_GID_COUNT", NULL},
 	{"SUB_GID_MAX", NULL},
 	{"SUB_GID_MIN", NULL},
+	{"SUB_ID_ALLOCATION", NULL},
+	{"SUB_ID_FROM_UID", NULL},
 	{"SUB_UID_COUNT", NULL},
 	{"SUB_UID_MAX", NULL},
 	{"SUB_UID_MIN", NULL},
@@ -130,6 +157,7 @@ static struct itemdef def_table[] = {
 	{"UMASK", NULL},
 	{"USERDEL_CMD", NULL},
 	{"USERGROUPS_ENAB", NULL},
+	{"USER_BUSY_THREADS", NULL},
 #ifndef USE_PAM
 	PAMDEFS
 #endif
@@ -140,7 +168,20 @@ static struct itemdef def_table[] = {
 	{"TCB_SYMLINKS", NULL},
 	{"USE_TCB", NULL},
 #endif
+	{"ACCOUNT_JOURNAL", NULL},
+	{"ACCOUNT_STATE_FILE", NULL},
+	{"ASYNC_CACHE_FLUSH", NULL},
+	{"COMMIT_SYNC", NULL},
 	{"FORCE_SHADOW", NULL},
+	{"LOOKUP_INDEX", NULL},
+	{"METRICS_FILE", NULL},
+	{"OPTIMISTIC_LOCKING", NULL},
+	{"PER_DATABASE_LOCKING", NULL},
+	{"REPLICATION_JOURNAL", NULL},
+	{"RESERVE_IDS", NULL},
+	{"SHARDED_DATABASES", NULL},
+	{"SORTED_DATABASES", NULL},
+	{"SSSD_INVALIDATE_MAX", NULL},
 	{"GRANT_AUX_GROUP_SUBIDS", NULL},
 	{"PREVENT_NO_AUTH", NULL},
 	{NULL, NULL}
@@ -168,12 +209,86 @@ static const char* sysconfdir = "/etc";
 #endif
 
 static const char* def_fname = LOGINDEFS;	/* login config defs file       */
+
+/*
+ * The definitions read from the configuration file are cached in a
+ * binary file next to it, with the ".cache" suffix, so that the tools
+ * only need to map the cache at startup.  The cache records the device,
+ * inode, size and modification time of the configuration file, and is
+ * ignored (and written again by root) when they changed.
+ *
+ * Layout (native byte order):
+ *	struct def_cache_header
+ *	for each definition: the name and the value, with their NUL
+ */
+
+#define DEF_CACHE_MAGIC		"shdwdef"
+#define DEF_CACHE_VERSION	1
+
+struct def_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t count;		/* number of definitions */
+	uint64_t length;	/* of the definitions */
+	uint64_t defs_dev;
+	uint64_t defs_ino;
+	uint64_t defs_size;
+	int64_t defs_mtime_sec;
+	int64_t defs_mtime_nsec;
+};
 #endif
 static bool def_loaded = false;		/* are defs already loaded?     */
 
+/*
+ * The items of def_table and knowndef_table are found in a hash table
+ * (with linear probing), built at the first lookup.  DEF_HASH_SIZE is a
+ * power of 2, larger than twice the number of items.
+ */
+#define DEF_HASH_SIZE	512
+static /*@null@*/struct itemdef *def_hash[DEF_HASH_SIZE];
+static bool def_hashed = false;
+
 /* local function prototypes */
 static /*@observer@*/ /*@null@*/struct itemdef *def_find (const char *);
 static void def_load (void);
+static void def_read (void);
+
+
+/*
+ * def_getlong - parse the value of an item with getlong()
+ *
+ * The parsed value is kept in the item, so that the value is parsed
+ * only once.  Return true if the value could be parsed.
+ */
+
+static bool def_getlong (struct itemdef *d, /*@out@*/long *val)
+{
+	if (!d->has_long) {
+		if (getlong (d->value, &d->long_value) == 0) {
+			return false;
+		}
+		d->has_long = true;
+	}
+	*val = d->long_value;
+	return true;
+}
+
+
+/*
+ * def_getulong - parse the value of an item with getulong()
+ */
+
+static bool def_getulong (struct itemdef *d, /*@out@*/unsigned long *val)
+{
+	if (!d->has_ulong) {
+		if (getulong (d->value, &d->ulong_value) == 0) {
+			return false;
+		}
+		d->has_ulong = true;
+	}
+	*val = d->ulong_value;
+	return true;
+}
 
 
 /*
@@ -241,7 +356,7 @@ int getdef_num (const char *item, int dflt)
 		return dflt;
 	}
 
-	if (   (getlong (d->value, &val) == 0)
+	if (   !def_getlong (d, &val)
 	    || (val > INT_MAX)
 	    || (val < INT_MIN)) {
 		fprintf (shadow_logfd,
@@ -276,7 +391,7 @@ unsigned int getdef_unum (const char *item, unsigned int dflt)
 		return dflt;
 	}
 
-	if (   (getlong (d->value, &val) == 0)
+	if (   !def_getlong (d, &val)
 	    || (val < 0)
 	    || (val > INT_MAX)) {
 		fprintf (shadow_logfd,
@@ -311,7 +426,7 @@ long getdef_long (const char *item, long dflt)
 		return dflt;
 	}
 
-	if (getlong (d->value, &val) == 0) {
+	if (!def_getlong (d, &val)) {
 		fprintf (shadow_logfd,
 		         _("configuration error - cannot parse %s value: '%s'"),
 		         item, d->value);
@@ -343,7 +458,7 @@ unsigned long getdef_ulong (const char *item, unsigned long dflt)
 		return dflt;
 	}
 
-	if (getulong (d->value, &val) == 0) {
+	if (!def_getulong (d, &val)) {
 		fprintf (shadow_logfd,
 		         _("configuration error - cannot parse %s value: '%s'"),
 		         item, d->value);
@@ -389,10 +504,52 @@ int putdef_str (const char *name, const char *value)
 
 	free (d->value);
 	d->value = cp;
+	d->has_long = false;
+	d->has_ulong = false;
 	return 0;
 }
 
 
+/*
+ * def_hash_name - hash the name of an item (FNV-1a)
+ */
+
+static size_t def_hash_name (const char *name)
+{
+	unsigned long h = 2166136261UL;
+
+	while ('\0' != *name) {
+		h = ((h ^ (unsigned char) *name++) * 16777619UL) & 0xffffffffUL;
+	}
+	return h & (DEF_HASH_SIZE - 1);
+}
+
+
+/*
+ * def_hash_add - add the items of table to the hash table
+ *
+ * An item already in the hash table is not added again, so that the
+ * first definition of a name is found, as in a linear search.
+ */
+
+static void def_hash_add (struct itemdef *table)
+{
+	struct itemdef *ptr;
+
+	for (ptr = table; NULL != ptr->name; ptr++) {
+		size_t h = def_hash_name (ptr->name);
+
+		while (   (NULL != def_hash[h])
+		       && (strcmp (def_hash[h]->name, ptr->name) != 0)) {
+			h = (h + 1) & (DEF_HASH_SIZE - 1);
+		}
+		if (NULL == def_hash[h]) {
+			def_hash[h] = ptr;
+		}
+	}
+}
+
+
 /*
  * def_find - locate named item in table
  *
@@ -403,26 +560,41 @@ int putdef_str (const char *name, const char *value)
 static /*@observer@*/ /*@null@*/struct itemdef *def_find (const char *name)
 {
 	struct itemdef *ptr;
+	size_t h;
+
+	if (!def_hashed) {
+		def_hash_add (def_table);
+		def_hash_add (knowndef_table);
+		def_hashed = true;
+	}
 
 	/*
 	 * Search into the table.
 	 */
 
-	for (ptr = def_table; NULL != ptr->name; ptr++) {
-		if (strcmp (ptr->name, name) == 0) {
-			return ptr;
+	for (h = def_hash_name (name);
+	     NULL != def_hash[h];
+	     h = (h + 1) & (DEF_HASH_SIZE - 1)) {
+		ptr = def_hash[h];
+		if (strcmp (ptr->name, name) != 0) {
+			continue;
+		}
+
+		/*
+		 * The items of knowndef_table are known, but not used
+		 * by the shadow tools.
+		 */
+		if (   (ptr >= knowndef_table)
+		    && (ptr < knowndef_table + NUMKNOWNDEFS)) {
+			goto out;
 		}
+		return ptr;
 	}
 
 	/*
 	 * Item was never found.
 	 */
 
-	for (ptr = knowndef_table; NULL != ptr->name; ptr++) {
-		if (strcmp (ptr->name, name) == 0) {
-			goto out;
-		}
-	}
 	fprintf (shadow_logfd,
 	         _("configuration error - unknown item '%s' (notify administrator)\n"),
 	         name);
@@ -463,13 +635,196 @@ void setdef_config_file (const char* file)
 #endif
 }
 
+#ifndef USE_ECONF
+static int def_cache_name (char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.cache", def_fname);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+static void def_cache_stamp (struct def_cache_header *hdr,
+                             const struct stat *sb)
+{
+	hdr->defs_dev = sb->st_dev;
+	hdr->defs_ino = sb->st_ino;
+	hdr->defs_size = sb->st_size;
+	hdr->defs_mtime_sec = sb->st_mtim.tv_sec;
+	hdr->defs_mtime_nsec = sb->st_mtim.tv_nsec;
+}
+
+/*
+ * def_load_cache - load the definitions from the cache of the
+ *                  configuration file sb
+ *
+ * Return true if the cache was valid and loaded.
+ */
+
+static bool def_load_cache (const struct stat *sb)
+{
+	char name[1024];
+	struct def_cache_header hdr, stamp;
+	struct stat sbc;
+	const char *map, *p, *end;
+	uint32_t i;
+	int fd;
+
+	if (def_cache_name (name, sizeof name) != 0) {
+		return false;
+	}
+	fd = open (name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	/* The cache shall be as trusted as the configuration file */
+	memzero (&stamp, sizeof stamp);
+	def_cache_stamp (&stamp, sb);
+	if (   (fstat (fd, &sbc) != 0)
+	    || (sbc.st_uid != sb->st_uid)
+	    || ((sbc.st_mode & 022) != 0)
+	    || ((size_t) sbc.st_size < sizeof hdr)) {
+		(void) close (fd);
+		return false;
+	}
+	map = mmap (NULL, sbc.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void) close (fd);
+	if (MAP_FAILED == map) {
+		return false;
+	}
+
+	memcpy (&hdr, map, sizeof hdr);
+	if (   (memcmp (hdr.magic, DEF_CACHE_MAGIC, sizeof hdr.magic) != 0)
+	    || (hdr.version != DEF_CACHE_VERSION)
+	    || (hdr.defs_dev != stamp.defs_dev)
+	    || (hdr.defs_ino != stamp.defs_ino)
+	    || (hdr.defs_size != stamp.defs_size)
+	    || (hdr.defs_mtime_sec != stamp.defs_mtime_sec)
+	    || (hdr.defs_mtime_nsec != stamp.defs_mtime_nsec)
+	    || (hdr.length != sbc.st_size - sizeof hdr)
+	    || ((0 != hdr.length) && ('\0' != map[sbc.st_size - 1]))) {
+		(void) munmap ((void *) map, sbc.st_size);
+		return false;
+	}
+
+	/*
+	 * The definitions are stored as read from the file, so that the
+	 * errors (e.g. unknown items) are still reported.
+	 */
+	p = map + sizeof hdr;
+	end = map + sbc.st_size;
+	for (i = 0; (i < hdr.count) && (p < end); i++) {
+		const char *value = p + strlen (p) + 1;
+
+		if (value >= end) {
+			break;
+		}
+		(void) putdef_str (p, value);
+		p = value + strlen (value) + 1;
+	}
+
+	(void) munmap ((void *) map, sbc.st_size);
+	return true;
+}
+
+/*
+ * def_save_cache - save the definitions read from the configuration
+ *                  file sb in its cache
+ *
+ * Errors are ignored: the configuration file will be read again.
+ */
+
+static void def_save_cache (const struct stat *sb, uint32_t count,
+                            const char *data, size_t length)
+{
+	char name[1024];
+	char tmpname[1024];
+	struct def_cache_header hdr;
+	int fd;
+
+	if (   (geteuid () != 0)
+	    || (def_cache_name (name, sizeof name) != 0)
+	    || (snprintf (tmpname, sizeof tmpname, "%s.XXXXXX", name)
+	        >= (int) sizeof tmpname)) {
+		return;
+	}
+
+	memzero (&hdr, sizeof hdr);
+	memcpy (hdr.magic, DEF_CACHE_MAGIC, sizeof hdr.magic);
+	hdr.version = DEF_CACHE_VERSION;
+	hdr.count = count;
+	hdr.length = length;
+	def_cache_stamp (&hdr, sb);
+
+	fd = mkstemp (tmpname);
+	if (fd < 0) {
+		return;
+	}
+	if (   (fchown (fd, sb->st_uid, sb->st_gid) != 0)
+	    || (fchmod (fd, 0644) != 0)
+	    || (write (fd, &hdr, sizeof hdr) != (ssize_t) sizeof hdr)
+	    || ((0 != length)
+	        && (write (fd, data, length) != (ssize_t) length))
+	    || (close (fd) != 0)
+	    || (rename (tmpname, name) != 0)) {
+		(void) close (fd);
+		(void) unlink (tmpname);
+	}
+}
+
+/*
+ * def_cache_add - add a definition to the cache data
+ *
+ * Return false if the memory could not be allocated.
+ */
+
+static bool def_cache_add (char **data, size_t *length, size_t *size,
+                           const char *name, const char *value)
+{
+	size_t namelen = strlen (name) + 1;
+	size_t valuelen = strlen (value) + 1;
+
+	if (*length + namelen + valuelen > *size) {
+		size_t newsize = (0 == *size) ? 4096 : *size;
+		char *p;
+
+		while (*length + namelen + valuelen > newsize) {
+			newsize *= 2;
+		}
+		p = realloc (*data, newsize);
+		if (NULL == p) {
+			return false;
+		}
+		*data = p;
+		*size = newsize;
+	}
+	memcpy (*data + *length, name, namelen);
+	*length += namelen;
+	memcpy (*data + *length, value, valuelen);
+	*length += valuelen;
+	return true;
+}
+#endif
+
 /*
  * def_load - load configuration table
  *
- * Loads the user-configured options from the default configuration file
+ * Loads the user-configured options from the default configuration file,
+ * and reports the time it took as the def_load phase of SHADOW_STATS.
+ * The clock is read directly: timing_start() looks up METRICS_FILE.
  */
 
 static void def_load (void)
+{
+	struct timespec start;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &start);
+	def_read ();
+	timing_stop ("def_load", &start);
+}
+
+static void def_read (void)
 {
 #ifdef USE_ECONF
 	econf_file *defs_file = NULL;
@@ -480,6 +835,11 @@ static void def_load (void)
 	int i;
 	FILE *fp;
 	char buf[1024], *name, *value, *s;
+	struct stat sb;
+	bool cache;
+	char *data = NULL;
+	size_t length = 0, size = 0;
+	uint32_t count = 0;
 #endif
 
 	/*
@@ -538,6 +898,12 @@ static void def_load (void)
 		exit (EXIT_FAILURE);
 	}
 
+	cache = (fstat (fileno (fp), &sb) == 0);
+	if (cache && def_load_cache (&sb)) {
+		(void) fclose (fp);
+		return;
+	}
+
 	/*
 	 * Go through all of the lines in the file.
 	 */
@@ -577,6 +943,12 @@ static void def_load (void)
 		 * syslog. The tools will just use their default values.
 		 */
 		(void)putdef_str (name, value);
+
+		if (cache) {
+			cache = def_cache_add (&data, &length, &size,
+			                       name, value);
+			count++;
+		}
 	}
 
 	if (ferror (fp) != 0) {
@@ -587,6 +959,11 @@ static void def_load (void)
 	}
 
 	(void) fclose (fp);
+
+	if (cache) {
+		def_save_cache (&sb, count, data, length);
+	}
+	free (data);
 #endif
 }
 
@@ -13,6 +13,7 @@
 #ident "$Id$"
 
 #include <assert.h>
+#include <errno.h>
 #include <stdio.h>
 
 #include "prototypes.h"
@@ -20,6 +21,7 @@
 #include "commonio.h"
 #include "getdef.h"
 #include "groupio.h"
+#include "sssd.h"
 
 static /*@null@*/struct commonio_entry *merge_group_entries (
 	/*@null@*/ /*@returned@*/struct commonio_entry *gr1,
@@ -34,6 +36,27 @@ static /*@null@*/ /*@only@*/void *group_dup (const void *ent)
 	return __gr_dup (gr);
 }
 
+static /*@null@*/ /*@dependent@*/void *group_parse_arena (struct commonio_db *db,
+                                                          const char *line)
+{
+	struct group *gr, *result;
+	size_t size = sgetgrent_size (line);
+
+	gr = commonio_alloc (db, sizeof *gr + size);
+	if (NULL == gr) {
+		return NULL;
+	}
+	/* The libc might define other fields. */
+	memset (gr, 0, sizeof *gr);
+	(void) sgetgrent_r (line, gr, (char *) (gr + 1), size, &result);
+	if (NULL == result) {
+		/* Released with the arena */
+		errno = EINVAL;
+	}
+
+	return result;
+}
+
 static void group_free (/*@out@*/ /*@only@*/void *ent)
 {
 	struct group *gr = ent;
@@ -53,6 +76,36 @@ static void *group_parse (const char *line)
 	return sgetgrent (line);
 }
 
+/*
+ * group_parse_fields - Convert only the given GR_FIELD_* of line
+ *
+ *	The members are only split with GR_FIELD_MEM, which parses the
+ *	whole line. See commonio_scan_fields().
+ */
+static void *group_parse_fields (char *line, size_t len, unsigned int fields)
+{
+	static struct group grent;
+	char *f[4];
+	size_t n;
+
+	if ((fields & GR_FIELD_MEM) != 0) {
+		return group_parse (line);
+	}
+	n = split_fields (line, len, ':', f, 4);
+	if ((n < 3) || (n > 4) || ('\0' == *f[2])) {
+		return NULL;
+	}
+	grent.gr_name = (fields & GR_FIELD_NAME) ? f[0] : NULL;
+	grent.gr_passwd = (fields & GR_FIELD_PASSWD) ? f[1] : NULL;
+	grent.gr_gid = 0;
+	if (   ((fields & GR_FIELD_GID) != 0)
+	    && (get_gid (f[2], &grent.gr_gid) == 0)) {
+		return NULL;
+	}
+	grent.gr_mem = NULL;
+	return &grent;
+}
+
 static int group_put (const void *ent, FILE * file)
 {
 	const struct group *gr = ent;
@@ -77,6 +130,20 @@ static int group_put (const void *ent, FILE * file)
 	return (putgrent (gr, file) == -1) ? -1 : 0;
 }
 
+static unsigned long group_getid (const void *ent)
+{
+	const struct group *gr = ent;
+
+	return gr->gr_gid;
+}
+
+static /*@null@*/char *const *group_getmembers (const void *ent, size_t n)
+{
+	const struct group *gr = ent;
+
+	return (0 == n) ? gr->gr_mem : NULL;
+}
+
 static int group_close_hook (void)
 {
 	unsigned int max_members = getdef_unum("MAX_MEMBERS_PER_GROUP", 0);
@@ -97,7 +164,16 @@ static struct commonio_ops group_ops = {
 	fgetsx,
 	fputsx,
 	group_open_hook,
-	group_close_hook
+	group_close_hook,
+	group_getid,
+	NULL,			/* dup_arena */
+	group_parse_arena,
+	SSSD_DB_GROUP,
+	NULL,			/* publish_hook */
+	group_getmembers,
+	COMMONIO_DIRECT_FIELDS (struct group, gr_name, gr_gid),
+	group_getname,		/* sortkey */
+	group_parse_fields
 };
 
 static /*@owned@*/struct commonio_db group_db = {
@@ -125,6 +201,11 @@ int gr_setdbname (const char *filename)
 	return commonio_setname (&group_db, filename);
 }
 
+int gr_setshard (const char *shard)
+{
+	return commonio_setshard (&group_db, shard);
+}
+
 /*@observer@*/const char *gr_dbname (void)
 {
 	return group_db.filename;
@@ -147,14 +228,44 @@ int gr_open (int mode)
 
 /*@observer@*/ /*@null@*/const struct group *gr_locate_gid (gid_t gid)
 {
-	const struct group *grp;
+	return commonio_locate_id (&group_db, gid);
+}
 
-	gr_rewind ();
-	while (   ((grp = gr_next ()) != NULL)
-	       && (grp->gr_gid != gid)) {
+/*
+ * gr_compact - Only parse the group entries which are used, for the tools
+ *              which look up or change a few groups.
+ *
+ *	The member lists of the other groups are then not split, and
+ *	these groups are written back as they were read. The split groups
+ *	of MAX_MEMBERS_PER_GROUP are merged when the database is opened,
+ *	which needs all the entries: they are then all parsed.
+ */
+void gr_compact (void)
+{
+	if (0 == getdef_unum ("MAX_MEMBERS_PER_GROUP", 0)) {
+		commonio_compact (&group_db);
 	}
+}
+
+/*
+ * gr_index_members - Index the groups by member name when the database is
+ *                    opened, for gr_member_of().
+ */
+void gr_index_members (void)
+{
+	commonio_index_members (&group_db);
+}
 
-	return grp;
+/*
+ * gr_member_of - Return the groups which list name as a member.
+ *
+ *	The array is NULL terminated and shall be freed by the caller.
+ *	It returns NULL if the groups were not indexed by member name; the
+ *	database shall then be scanned with gr_next().
+ */
+/*@null@*/ /*@only@*/const struct group **gr_member_of (const char *name)
+{
+	return (const struct group **) commonio_member_of (&group_db, name);
 }
 
 int gr_update (const struct group *gr)
@@ -172,6 +283,29 @@ int gr_rewind (void)
 	return commonio_rewind (&group_db);
 }
 
+/*
+ * gr_scan - Call fn for each entry of the file, without loading it
+ *
+ *	See commonio_scan().
+ */
+int gr_scan (int (*fn) (const struct group *, void *), void *arg)
+{
+	return commonio_scan (&group_db, (int (*) (const void *, void *)) fn, arg);
+}
+
+/*
+ * gr_scan_fields - Same as gr_scan(), with only the given GR_FIELD_* of
+ *                  the entries
+ *
+ *	See commonio_scan_fields().
+ */
+int gr_scan_fields (unsigned int fields,
+                    int (*fn) (const struct group *, void *), void *arg)
+{
+	return commonio_scan_fields (&group_db, fields,
+	                             (int (*) (const void *, void *)) fn, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct group *gr_next (void)
 {
 	return commonio_next (&group_db);
@@ -194,10 +328,10 @@ void __gr_set_changed (void)
 
 /*@dependent@*/ /*@null@*/struct commonio_entry *__gr_get_head (void)
 {
-	return group_db.head;
+	return commonio_entries (&group_db);
 }
 
-/*@observer@*/const struct commonio_db *__gr_get_db (void)
+struct commonio_db *__gr_get_db (void)
 {
 	return &group_db;
 }
@@ -207,6 +341,11 @@ void __gr_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&group_db, ent);
 }
 
+size_t __gr_duplicates (const struct commonio_entry *ent)
+{
+	return commonio_duplicates (&group_db, ent);
+}
+
 static int gr_cmp (const void *p1, const void *p2)
 {
 	gid_t u1, u2;
@@ -236,45 +375,147 @@ int gr_sort ()
 	return commonio_sort (&group_db, gr_cmp);
 }
 
-static int group_open_hook (void)
+/*
+ * same_group - Return true if two group entries are parts of the same
+ *              split group: they have the same name, password and GID.
+ */
+static bool same_group (const struct group *g1, const struct group *g2)
 {
-	unsigned int max_members = getdef_unum("MAX_MEMBERS_PER_GROUP", 0);
-	struct commonio_entry *gr1, *gr2;
+	return    (g1->gr_gid == g2->gr_gid)
+	       && (strcmp (g1->gr_name, g2->gr_name) == 0)
+	       && (strcmp (g1->gr_passwd, g2->gr_passwd) == 0);
+}
 
-	if (0 == max_members) {
-		return 1;
+static size_t split_hash (const struct group *gr)
+{
+	const unsigned char *cp;
+	size_t h = 5381;
+
+	for (cp = (const unsigned char *) gr->gr_name; '\0' != *cp; cp++) {
+		h = h * 33 + *cp;
+	}
+	return h ^ (gr->gr_gid * 2654435761U);
+}
+
+/*
+ * merge_split_group - Merge the members of gr2 in gr1, and remove gr2
+ *                     from the database.
+ */
+static /*@null@*/struct commonio_entry *merge_split_group (
+	/*@returned@*/struct commonio_entry *gr1,
+	struct commonio_entry *gr2)
+{
+	gr1 = merge_group_entries (gr1, gr2);
+	if (NULL == gr1) {
+		return NULL;
 	}
 
+	/* gr2 does not start with head */
+	assert (NULL != gr2->prev);
+	gr2->prev->next = gr2->next;
+	if (NULL != gr2->next) {
+		gr2->next->prev = gr2->prev;
+	} else {
+		group_db.tail = gr2->prev;
+	}
+	return gr1;
+}
+
+/*
+ * merge_scan - Merge the split groups, comparing every entry with the
+ *              ones after it.
+ *
+ *	This is only used if the hash table of merge_split_groups cannot be
+ *	allocated.
+ */
+static int merge_scan (void)
+{
+	struct commonio_entry *gr1, *gr2, *next;
+
 	for (gr1 = group_db.head; NULL != gr1; gr1 = gr1->next) {
-		for (gr2 = gr1->next; NULL != gr2; gr2 = gr2->next) {
-			struct group *g1 = gr1->eptr;
-			struct group *g2 = gr2->eptr;
-			if (NULL != g1 &&
-			    NULL != g2 &&
-			    0 == strcmp (g1->gr_name, g2->gr_name) &&
-			    0 == strcmp (g1->gr_passwd, g2->gr_passwd) &&
-			    g1->gr_gid == g2->gr_gid) {
-				/* Both group entries refer to the same
-				 * group. It is a split group. Merge the
-				 * members. */
-				gr1 = merge_group_entries (gr1, gr2);
-				if (NULL == gr1)
+		if (NULL == gr1->eptr) {
+			continue;
+		}
+		for (gr2 = gr1->next; NULL != gr2; gr2 = next) {
+			next = gr2->next;
+			if (   (NULL != gr2->eptr)
+			    && same_group (gr1->eptr, gr2->eptr)) {
+				gr1 = merge_split_group (gr1, gr2);
+				if (NULL == gr1) {
 					return 0;
-				/* Unlink gr2 */
-				if (NULL != gr2->next) {
-					gr2->next->prev = gr2->prev;
 				}
-				/* gr2 does not start with head */
-				assert (NULL != gr2->prev);
-				gr2->prev->next = gr2->next;
 			}
 		}
-		assert (NULL != gr1);
 	}
 
 	return 1;
 }
 
+/*
+ * merge_split_groups - Merge the entries of the split groups
+ *
+ *	The members of all the entries of a group are merged in its first
+ *	entry. The first entry of each group is found in a hash table, so
+ *	the database is merged in one pass.
+ *
+ * Return 0 on failure (errno set) and 1 on success.
+ */
+static int merge_split_groups (void)
+{
+	struct commonio_entry **table;
+	struct commonio_entry *gr, *next;
+	size_t count = 0;
+	size_t size = 16;
+	int ret = 1;
+
+	for (gr = group_db.head; NULL != gr; gr = gr->next) {
+		count++;
+	}
+	while (size < count * 2) {
+		size *= 2;
+	}
+	table = calloc (size, sizeof *table);
+	if (NULL == table) {
+		return merge_scan ();
+	}
+
+	for (gr = group_db.head; NULL != gr; gr = next) {
+		size_t i;
+
+		next = gr->next;
+		if (NULL == gr->eptr) {
+			continue;
+		}
+		for (i = split_hash (gr->eptr) & (size - 1);
+		     NULL != table[i];
+		     i = (i + 1) & (size - 1)) {
+			if (same_group (table[i]->eptr, gr->eptr)) {
+				break;
+			}
+		}
+		if (NULL == table[i]) {
+			table[i] = gr;
+		} else if (merge_split_group (table[i], gr) == NULL) {
+			ret = 0;
+			break;
+		}
+	}
+
+	free (table);
+	return ret;
+}
+
+static int group_open_hook (void)
+{
+	unsigned int max_members = getdef_unum("MAX_MEMBERS_PER_GROUP", 0);
+
+	if (0 == max_members) {
+		return 1;
+	}
+
+	return merge_split_groups ();
+}
+
 /*
  * Merge the list of members of the two group entries.
  *
@@ -294,9 +535,11 @@ static /*@null@*/struct commonio_entry *merge_group_entries (
 	struct group *gptr1;
 	struct group *gptr2;
 	char **new_members;
-	size_t members = 0;
+	size_t members, n1, n2;
 	char *new_line;
 	size_t new_line_len, i;
+	struct member_set *set = NULL;
+
 	if (NULL == gr2 || NULL == gr1) {
 		errno = EINVAL;
 		return NULL;
@@ -319,46 +562,59 @@ static /*@null@*/struct commonio_entry *merge_group_entries (
 	snprintf(new_line, new_line_len + 1, "%s\n%s", gr1->line, gr2->line);
 
 	/* Concatenate the 2 list of members */
-	for (i=0; NULL != gptr1->gr_mem[i]; i++);
-	members += i;
-	for (i=0; NULL != gptr2->gr_mem[i]; i++) {
-		char **pmember = gptr1->gr_mem;
-		while (NULL != *pmember) {
-			if (0 == strcmp(*pmember, gptr2->gr_mem[i])) {
-				break;
-			}
-			pmember++;
-		}
-		if (NULL == *pmember) {
-			members++;
-		}
+	for (n1 = 0; NULL != gptr1->gr_mem[n1]; n1++);
+	for (n2 = 0; NULL != gptr2->gr_mem[n2]; n2++);
+	/* The entries read from the file are in the database arena */
+	if (commonio_in_arena (&group_db, gptr1)) {
+		new_members = commonio_alloc (&group_db,
+		                              (n1 + n2 + 1) * sizeof(char*));
+	} else {
+		new_members = (char **)malloc ((n1 + n2 + 1) * sizeof(char*));
 	}
-	new_members = (char **)calloc ( (members+1), sizeof(char*) );
 	if (NULL == new_members) {
 		free (new_line);
 		errno = ENOMEM;
 		return NULL;
 	}
-	for (i=0; NULL != gptr1->gr_mem[i]; i++) {
+
+	/*
+	 * Large lists of members are searched with a hash set. If it
+	 * cannot be allocated, they are scanned.
+	 */
+	if (n1 + n2 >= MEMBER_SET_MIN) {
+		set = member_set_new (n1 + n2);
+	}
+	for (i = 0; i < n1; i++) {
 		new_members[i] = gptr1->gr_mem[i];
+		if (NULL != set) {
+			(void) member_set_add (set, new_members[i]);
+		}
 	}
-	/* NULL termination enforced by above calloc */
 
-	members = i;
-	for (i=0; NULL != gptr2->gr_mem[i]; i++) {
-		char **pmember = new_members;
-		while (NULL != *pmember) {
-			if (0 == strcmp(*pmember, gptr2->gr_mem[i])) {
-				break;
+	members = n1;
+	for (i = 0; i < n2; i++) {
+		const char *name = gptr2->gr_mem[i];
+		bool found = false;
+
+		if (NULL != set) {
+			found = !member_set_add (set, name);
+		} else {
+			size_t j;
+
+			for (j = 0; j < members; j++) {
+				if (0 == strcmp (new_members[j], name)) {
+					found = true;
+					break;
+				}
 			}
-			pmember++;
 		}
-		if (NULL == *pmember) {
+		if (!found) {
 			new_members[members] = gptr2->gr_mem[i];
 			members++;
-			new_members[members] = NULL;
 		}
 	}
+	new_members[members] = NULL;
+	member_set_free (set);
 
 	gr1->line = new_line;
 	gptr1->gr_mem = new_members;
@@ -408,11 +664,17 @@ static int split_groups (unsigned int max_members)
 		}
 		new_gptr = new->eptr;
 		new->line = NULL;
+		new->hnext = NULL;
+		new->idnext = NULL;
 		new->changed = true;
+		new->unparsed = false;
 
 		/* Enforce the maximum number of members on gptr */
 		for (i = max_members; NULL != gptr->gr_mem[i]; i++) {
-			free (gptr->gr_mem[i]);
+			/* Entries read from the file may be in the arena */
+			if (!commonio_in_arena (&group_db, gptr->gr_mem[i])) {
+				free (gptr->gr_mem[i]);
+			}
 			gptr->gr_mem[i] = NULL;
 		}
 		/* Shift all the members */
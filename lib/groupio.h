@@ -15,16 +15,30 @@
 #include <sys/types.h>
 #include <grp.h>
 
+/* The fields of gr_scan_fields() */
+#define GR_FIELD_NAME	(1U << 0)
+#define GR_FIELD_PASSWD	(1U << 1)
+#define GR_FIELD_GID	(1U << 2)
+#define GR_FIELD_MEM	(1U << 3)
+
 extern int gr_close (void);
 extern /*@observer@*/ /*@null@*/const struct group *gr_locate (const char *name);
 extern /*@observer@*/ /*@null@*/const struct group *gr_locate_gid (gid_t gid);
+extern void gr_compact (void);
+extern void gr_index_members (void);
 extern int gr_lock (void);
 extern int gr_setdbname (const char *filename);
+extern int gr_setshard (const char *shard);
 extern /*@observer@*/const char *gr_dbname (void);
+extern /*@null@*/ /*@only@*/const struct group **gr_member_of (const char *name);
 extern /*@observer@*/ /*@null@*/const struct group *gr_next (void);
 extern int gr_open (int mode);
 extern int gr_remove (const char *name);
 extern int gr_rewind (void);
+extern int gr_scan (int (*fn) (const struct group *, void *), void *arg);
+extern int gr_scan_fields (unsigned int fields,
+                           int (*fn) (const struct group *, void *),
+                           void *arg);
 extern int gr_unlock (void);
 extern int gr_update (const struct group *gr);
 extern int gr_sort (void);
@@ -58,30 +58,25 @@ static int bind_nis (void)
 
 static /*@null@*/char **build_list (char *s, char **list[], size_t * nlist)
 {
-	char **ptr = *list;
-	size_t nelem = *nlist, size;
-
-	while (s != NULL && *s != '\0') {
-		size = (nelem + 1) * sizeof (ptr);
-		ptr = realloc (*list, size);
-		if (NULL != ptr) {
-			ptr[nelem] = s;
-			nelem++;
-			*list = ptr;
-			*nlist = nelem;
-			s = strchr (s, ',');
-			if (NULL != s) {
-				*s = '\0';
-				s++;
-			}
-		}
+	char **ptr;
+	size_t len, n;
+
+	len = strlen (s);
+	n = count_fields (s, len, ',');
+
+	/* Room for the new elements and the terminating NULL */
+	ptr = realloc (*list, (*nlist + n + 1) * sizeof (ptr));
+	if (NULL == ptr) {
+		return NULL;
 	}
-	size = (nelem + 1) * sizeof (ptr);
-	ptr = realloc (*list, size);
-	if (NULL != ptr) {
-		ptr[nelem] = NULL;
-		*list = ptr;
+	*list = ptr;
+
+	n = split_fields (s, len, ',', ptr + *nlist, n);
+	if ('\0' == *ptr[*nlist + n - 1]) {
+		n--;
 	}
+	*nlist += n;
+	ptr[*nlist] = NULL;
 	return ptr;
 }
 
@@ -113,7 +108,7 @@ void endsgent (void)
 
 	char *fields[FIELDS];
 	char *cp;
-	int i;
+	size_t i;
 	size_t len = strlen (string) + 1;
 
 	if (len > sgrbuflen) {
@@ -125,11 +120,13 @@ void endsgent (void)
 		sgrbuflen = len;
 	}
 
-	strlcpy (sgrbuf, string, len);
+	memcpy (sgrbuf, string, len);
+	len--;
 
 	cp = strrchr (sgrbuf, '\n');
 	if (NULL != cp) {
 		*cp = '\0';
+		len = cp - sgrbuf;
 	}
 
 	/*
@@ -137,26 +134,23 @@ void endsgent (void)
 	 * all 4 of them and save the starting addresses in fields[].
 	 */
 
-	for (cp = sgrbuf, i = 0; (i < FIELDS) && (NULL != cp); i++) {
-		fields[i] = cp;
-		cp = strchr (cp, ':');
-		if (NULL != cp) {
-			*cp++ = '\0';
-		}
-	}
+	i = split_fields (sgrbuf, len, ':', fields, FIELDS);
 
 	/*
 	 * If there was an extra field somehow, or perhaps not enough,
 	 * the line is invalid.
 	 */
 
-	if ((NULL != cp) || (i != FIELDS)) {
+	if (i != FIELDS) {
 #ifdef	USE_NIS
 		if (!IS_NISCHAR (fields[0][0])) {
 			return 0;
 		} else {
 			nis_used = true;
 		}
+		while (i < FIELDS) {
+			fields[i++] = sgrbuf + len;
+		}
 #else
 		return 0;
 #endif
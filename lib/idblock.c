@@ -0,0 +1,306 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "getdef.h"
+#include "pwio.h"
+#include "shadowlog.h"
+#include "shadowlog_internal.h"
+
+/*
+ * Blocks of UIDs and GIDs leased by the hosts of a cluster.
+ *
+ * With ID_BLOCK_FILE, the tools only pick the new UIDs and GIDs of the
+ * users and groups (not of the system accounts) from the blocks of
+ * ID_BLOCK_SIZE IDs leased by this host, so that the hosts sharing this
+ * file (on a shared file system) never pick the same IDs. A block is
+ * leased for both the UIDs and the GIDs, since a user private group
+ * gets the UID of its user.
+ *
+ * ID_BLOCK_FILE has a line "FIRST LAST HOST" for each leased block. It
+ * is only locked and read when this host needs a new block: the current
+ * block of the host is kept next to the passwd file, in passwd.block.
+ * The blocks are never returned: the lines of the blocks of a host
+ * which left the cluster are removed by the administrator.
+ */
+
+struct id_block {
+	unsigned long first;
+	unsigned long last;
+};
+
+static int block_local_name (char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.block", pw_dbname ());
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+/*
+ * block_local - Read the current block of this host.
+ *
+ *	Return 0 on success, -1 if no block is known.
+ */
+static int block_local (/*@out@*/struct id_block *b)
+{
+	char name[1024];
+	FILE *fp;
+	int n;
+
+	if (block_local_name (name, sizeof name) != 0) {
+		return -1;
+	}
+	fp = fopen (name, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	n = fscanf (fp, "%lu %lu", &b->first, &b->last);
+	(void) fclose (fp);
+	return ((2 == n) && (b->first <= b->last)) ? 0 : -1;
+}
+
+/*
+ * block_set_local - Record b as the current block of this host.
+ *
+ *	It is only a cache of ID_BLOCK_FILE: failing to record it is not
+ *	an error.
+ */
+static void block_set_local (const struct id_block *b)
+{
+	char name[1024];
+	char tmp[1024 + 1];
+	FILE *fp;
+
+	if (block_local_name (name, sizeof name) != 0) {
+		return;
+	}
+	(void) snprintf (tmp, sizeof tmp, "%s+", name);
+	fp = fopen (tmp, "w");
+	if (NULL == fp) {
+		return;
+	}
+	(void) fprintf (fp, "%lu %lu\n", b->first, b->last);
+	if ((fclose (fp) != 0) || (rename (tmp, name) != 0)) {
+		(void) unlink (tmp);
+	}
+}
+
+static int block_cmp (const void *p1, const void *p2)
+{
+	const struct id_block *a = p1;
+	const struct id_block *b = p2;
+
+	return (a->first < b->first) ? -1 : (a->first > b->first) ? 1 : 0;
+}
+
+/*
+ * block_lease - Find a block of this host in [min:max] which is not
+ *	full, or lease a new one.
+ *
+ *	The lowest such block of this host is used. Otherwise, the new
+ *	block is the lowest range of ID_BLOCK_SIZE IDs of [min:max] which
+ *	no host leased yet. The full ranges found before it, whose IDs are
+ *	used by the accounts created before the blocks, are leased too, so
+ *	that no other host picks these IDs.
+ *
+ *	Return 0 on success, -1 on failure (reported).
+ */
+static int block_lease (unsigned long min, unsigned long max,
+                        bool (*full) (unsigned long first,
+                                      unsigned long last),
+                        /*@out@*/struct id_block *b)
+{
+	const char *path = getdef_str ("ID_BLOCK_FILE");
+	unsigned long size = getdef_ulong ("ID_BLOCK_SIZE", 1000UL);
+	struct id_block *blocks = NULL;
+	size_t count = 0, i;
+	bool found = false;
+	char host[256];
+	char line[1024];
+	struct flock lk;
+	unsigned long next;
+	FILE *fp;
+	int fd;
+	int ret = -1;
+
+	if ((0 == size) || (size - 1 > max - min)) {
+		fprintf (shadow_logfd,
+		         _("%s: Invalid configuration: ID_BLOCK_SIZE (%lu)\n"),
+		         shadow_progname, size);
+		return -1;
+	}
+	if (gethostname (host, sizeof host) != 0) {
+		(void) strcpy (host, "localhost");
+	}
+	host[sizeof host - 1] = '\0';
+
+	fd = open (path, O_RDWR | O_CREAT | O_NOCTTY | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf (shadow_logfd, _("%s: cannot open %s: %s\n"),
+		         shadow_progname, path, strerror (errno));
+		return -1;
+	}
+	memzero (&lk, sizeof lk);
+	lk.l_type = F_WRLCK;
+	lk.l_whence = SEEK_SET;
+	while (fcntl (fd, F_SETLKW, &lk) != 0) {
+		if (EINTR != errno) {
+			fprintf (shadow_logfd, _("%s: cannot lock %s: %s\n"),
+			         shadow_progname, path, strerror (errno));
+			(void) close (fd);
+			return -1;
+		}
+	}
+	fp = fdopen (fd, "r+");
+	if (NULL == fp) {
+		(void) close (fd);
+		goto fail;
+	}
+
+	while (fgets (line, sizeof line, fp) != NULL) {
+		struct id_block nb;
+		char owner[256];
+
+		if (   (sscanf (line, "%lu %lu %255s",
+		                &nb.first, &nb.last, owner) != 3)
+		    || (nb.first > nb.last)) {
+			continue;
+		}
+		if (   (strcmp (owner, host) == 0)
+		    && (nb.first >= min) && (nb.last <= max)
+		    && (!found || (nb.first < b->first))
+		    && !full (nb.first, nb.last)) {
+			*b = nb;
+			found = true;
+		}
+		if (0 == (count % 64)) {
+			struct id_block *tmp;
+
+			tmp = realloc (blocks, (count + 64) * sizeof *tmp);
+			if (NULL == tmp) {
+				goto fail;
+			}
+			blocks = tmp;
+		}
+		blocks[count++] = nb;
+	}
+	if (ferror (fp) != 0) {
+		goto fail;
+	}
+	if (found) {
+		ret = 0;
+		goto out;
+	}
+
+	/* The lowest range of size IDs which is not leased */
+	qsort (blocks, count, sizeof *blocks, block_cmp);
+	if (fseek (fp, 0, SEEK_END) != 0) {
+		goto fail;
+	}
+	next = min;
+	i = 0;
+	for (;;) {
+		unsigned long last;
+
+		while ((i < count) && (blocks[i].last < next)) {
+			i++;
+		}
+		if (size - 1 > max - next) {
+			break;
+		}
+		last = next + size - 1;
+		if ((i < count) && (blocks[i].first <= last)) {
+			/* Overlaps the block i */
+			if (blocks[i].last >= max) {
+				break;
+			}
+			next = blocks[i].last + 1;
+			continue;
+		}
+
+		if (fprintf (fp, "%lu %lu %s\n", next, last, host) < 0) {
+			goto fail;
+		}
+		SYSLOG ((LOG_INFO, "leased the IDs %lu-%lu in %s",
+		         next, last, path));
+		if (!full (next, last)) {
+			b->first = next;
+			b->last = last;
+			found = true;
+			break;
+		}
+		if (last == max) {
+			break;
+		}
+		next = last + 1;
+	}
+	if ((fflush (fp) != 0) || (fsync (fileno (fp)) != 0)) {
+		goto fail;
+	}
+	if (!found) {
+		fprintf (shadow_logfd,
+		         _("%s: no block of IDs is left in %s\n"),
+		         shadow_progname, path);
+		SYSLOG ((LOG_WARN, "no block of IDs is left in %s", path));
+		goto out;
+	}
+	ret = 0;
+	goto out;
+
+fail:
+	fprintf (shadow_logfd, _("%s: cannot update %s: %s\n"),
+	         shadow_progname, path, strerror (errno));
+out:
+	free (blocks);
+	if (NULL != fp) {
+		(void) fclose (fp);	/* releases the lock */
+	}
+	return ret;
+}
+
+/*
+ * id_block_range - Restrict the range [*min:*max] of the new UIDs or
+ *	GIDs to the block leased by this host, with ID_BLOCK_FILE.
+ *
+ *	full tells if all the IDs of a block are used: a new block is then
+ *	leased. The range is not changed without ID_BLOCK_FILE.
+ *
+ *	Return 0 on success, -1 if no block could be leased (reported).
+ */
+int id_block_range (unsigned long *min, unsigned long *max,
+                    bool (*full) (unsigned long first, unsigned long last))
+{
+	const char *path = getdef_str ("ID_BLOCK_FILE");
+	struct id_block b;
+
+	if ((NULL == path) || ('/' != path[0])) {
+		return 0;
+	}
+
+	if (   (block_local (&b) != 0)
+	    || (b.first < *min)
+	    || (b.last > *max)
+	    || full (b.first, b.last)) {
+		if (block_lease (*min, *max, full, &b) != 0) {
+			return -1;
+		}
+		block_set_local (&b);
+	}
+
+	*min = b.first;
+	*max = b.last;
+	return 0;
+}
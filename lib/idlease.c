@@ -0,0 +1,281 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Reservations of the UIDs or GIDs of a passwd or group file.
+ *
+ * A tool which picks an ID before it locks the database takes a lease
+ * on it, so that the tools running in parallel pick other IDs. The
+ * leases are stored next to the database, in file.lease, as an array
+ * of struct id_lease (native byte order). The file is protected by an
+ * OFD lock, held only while it is read or rewritten.
+ *
+ * A lease ends when it is released, when its process exits, or after
+ * ID_LEASE_TIME seconds.
+ */
+
+#define ID_LEASE_TIME	60
+
+struct id_lease {
+	uint32_t id;
+	uint32_t pid;
+	int64_t expires;
+};
+
+static int lease_name (char *buf, size_t size, const char *dbfile)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.lease", dbfile);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+/*
+ * lease_open - Open and lock the file of the leases of dbfile.
+ *
+ *	flags are the flags of open(), which can create the file.
+ *	A read lock is taken with O_RDONLY, a write lock otherwise.
+ *
+ *	Return the file descriptor, or -1 on failure (ENOENT if the file
+ *	does not exist and is not created).
+ */
+static int lease_open (const char *dbfile, int flags)
+{
+	char name[1024];
+	struct flock lck = {
+		.l_type = (O_RDONLY == flags) ? F_RDLCK : F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0,
+	};
+	int fd;
+
+	if (lease_name (name, sizeof name, dbfile) != 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open (name, flags | O_CLOEXEC, 0600);
+	if (-1 == fd) {
+		return -1;
+	}
+	while (fcntl (fd, F_OFD_SETLKW, &lck) != 0) {
+		if (EINTR != errno) {
+			(void) close (fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+static bool lease_live (const struct id_lease *lease, time_t now)
+{
+	if (lease->expires < now) {
+		return false;
+	}
+	return (kill ((pid_t) lease->pid, 0) == 0) || (EPERM == errno);
+}
+
+/*
+ * lease_read - Read the live leases of the file.
+ *
+ *	Return the number of leases, or -1 on failure.
+ */
+static ssize_t lease_read (int fd, /*@out@*/struct id_lease **leases)
+{
+	struct id_lease *l;
+	struct stat sb;
+	size_t n, i, live = 0;
+	time_t now = time (NULL);
+
+	*leases = NULL;
+	if (fstat (fd, &sb) != 0) {
+		return -1;
+	}
+	n = sb.st_size / sizeof *l;
+	l = malloc ((n + 1) * sizeof *l);
+	if (NULL == l) {
+		return -1;
+	}
+	if ((n > 0) && (pread (fd, l, n * sizeof *l, 0) != (ssize_t) (n * sizeof *l))) {
+		free (l);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		if (lease_live (&l[i], now)) {
+			l[live++] = l[i];
+		}
+	}
+	*leases = l;
+	return live;
+}
+
+static int lease_write (int fd, const struct id_lease *leases, size_t n)
+{
+	size_t size = n * sizeof *leases;
+
+	if (   ((size > 0) && (pwrite (fd, leases, size, 0) != (ssize_t) size))
+	    || (ftruncate (fd, size) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * id_lease_take - Reserve id for the current process.
+ *
+ *	Return 1 if the lease was taken (or was already held by the
+ *	current process), 0 if another process holds it, and -1 on
+ *	failure.
+ */
+int id_lease_take (const char *dbfile, unsigned long id)
+{
+	struct id_lease *leases, *l;
+	uint32_t pid = getpid ();
+	ssize_t n, i;
+	int fd;
+	int ret = -1;
+
+	fd = lease_open (dbfile, O_RDWR | O_CREAT);
+	if (-1 == fd) {
+		return -1;
+	}
+	n = lease_read (fd, &leases);
+	if (-1 == n) {
+		goto out;
+	}
+
+	for (i = 0; i < n; i++) {
+		if (leases[i].id == id) {
+			break;
+		}
+	}
+	if ((i < n) && (leases[i].pid != pid)) {
+		ret = 0;
+		goto out;
+	}
+	if (i == n) {
+		n++;
+	}
+	l = &leases[i];
+	l->id = id;
+	l->pid = pid;
+	l->expires = time (NULL) + ID_LEASE_TIME;
+	if (lease_write (fd, leases, n) == 0) {
+		ret = 1;
+	}
+
+      out:
+	free (leases);
+	(void) close (fd);
+	return ret;
+}
+
+/*
+ * id_lease_release - Release the lease of the current process on id.
+ */
+void id_lease_release (const char *dbfile, unsigned long id)
+{
+	struct id_lease *leases;
+	uint32_t pid = getpid ();
+	ssize_t n, i, kept = 0;
+	int fd;
+
+	fd = lease_open (dbfile, O_RDWR);
+	if (-1 == fd) {
+		return;
+	}
+	n = lease_read (fd, &leases);
+	for (i = 0; i < n; i++) {
+		if ((leases[i].id != id) || (leases[i].pid != pid)) {
+			leases[kept++] = leases[i];
+		}
+	}
+	if (n >= 0) {
+		(void) lease_write (fd, leases, kept);
+	}
+	free (leases);
+	(void) close (fd);
+}
+
+/*
+ * id_lease_list - Get the IDs leased by other processes.
+ *
+ *	*ids is set to an allocated array of *count IDs (NULL if there
+ *	are none).
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+int id_lease_list (const char *dbfile, /*@out@*/unsigned long **ids,
+                   /*@out@*/size_t *count)
+{
+	struct id_lease *leases;
+	uint32_t pid = getpid ();
+	ssize_t n, i;
+	int fd;
+	int ret = -1;
+
+	*ids = NULL;
+	*count = 0;
+	fd = lease_open (dbfile, O_RDONLY);
+	if (-1 == fd) {
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	n = lease_read (fd, &leases);
+	if (-1 == n) {
+		goto out;
+	}
+
+	*ids = malloc ((n + 1) * sizeof **ids);
+	if (NULL == *ids) {
+		goto out;
+	}
+	for (i = 0; i < n; i++) {
+		if (leases[i].pid != pid) {
+			(*ids)[(*count)++] = leases[i].id;
+		}
+	}
+	ret = 0;
+
+      out:
+	free (leases);
+	(void) close (fd);
+	return ret;
+}
+
+/*
+ * id_leased - Check if another process holds a lease on id.
+ */
+bool id_leased (const char *dbfile, unsigned long id)
+{
+	unsigned long *ids;
+	size_t count, i;
+	bool leased = false;
+
+	if (id_lease_list (dbfile, &ids, &count) != 0) {
+		return false;
+	}
+	for (i = 0; i < count; i++) {
+		if (ids[i] == id) {
+			leased = true;
+			break;
+		}
+	}
+	free (ids);
+	return leased;
+}
@@ -0,0 +1,436 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "getdef.h"
+#include "groupio.h"
+#include "pwio.h"
+
+/*
+ * Results of the lookups of new UIDs and GIDs through NSS.
+ *
+ * The tools which pick a new ID look each candidate up with getpwuid()
+ * or getgrgid(), which is slow with a remote directory. With
+ * ID_PROBE_CACHE_TTL, the results are kept for that many seconds next
+ * to the database, in file.probes, as an array of struct id_probe
+ * (native byte order), so that the next tools do not look the same IDs
+ * up again. The file is protected by an OFD lock, like the leases.
+ *
+ * A result is dropped when the caches of nscd or sssd are invalidated:
+ * it records the state of their files (see id_probe_stamp()), which
+ * the invalidations change. The shadow tools invalidate these caches
+ * after each change of the local databases, which the tools check
+ * anyway: their invalidations keep the results (see id_probe_restamp()).
+ */
+
+#define ID_PROBES_MAX	4096
+
+struct id_probe {
+	uint32_t id;
+	uint32_t used;
+	int64_t expires;
+	uint64_t stamp;
+};
+
+/* The files changed by the invalidations of nscd and sssd */
+static const char *stamp_files[] = {
+	"/var/lib/sss/mc/passwd",
+	"/var/lib/sss/mc/group",
+	"/var/lib/sss/mc/initgroups",
+	"/var/cache/nscd/passwd",
+	"/var/cache/nscd/group",
+	"/var/db/nscd/passwd",
+	"/var/db/nscd/group",
+	NULL
+};
+
+/* The results of a database, sorted by ID */
+struct probe_cache {
+	char dbfile[1024];
+	bool loaded;
+	/*@null@*/ /*@owned@*/struct id_probe *probes;
+	size_t count;
+};
+static struct probe_cache caches[2];
+
+static long probe_ttl (void)
+{
+	return getdef_long ("ID_PROBE_CACHE_TTL", 0);
+}
+
+static int probe_name (char *buf, size_t size, const char *dbfile)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.probes", dbfile);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+/*
+ * probe_open - Open and lock the file of the results of dbfile.
+ *
+ *	flags are the flags of open(), which can create the file.
+ *	A read lock is taken with O_RDONLY, a write lock otherwise.
+ *
+ *	Return the file descriptor, or -1 on failure (ENOENT if the file
+ *	does not exist and is not created).
+ */
+static int probe_open (const char *dbfile, int flags)
+{
+	char name[1024];
+	struct flock lck = {
+		.l_type = (O_RDONLY == flags) ? F_RDLCK : F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0,
+	};
+	int fd;
+
+	if (probe_name (name, sizeof name, dbfile) != 0) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open (name, flags | O_CLOEXEC, 0600);
+	if (-1 == fd) {
+		return -1;
+	}
+	while (fcntl (fd, F_OFD_SETLKW, &lck) != 0) {
+		if (EINTR != errno) {
+			(void) close (fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/*
+ * probe_read - Read all the results of the file.
+ *
+ *	Return the number of results, or -1 on failure.
+ */
+static ssize_t probe_read (int fd, /*@out@*/struct id_probe **probes)
+{
+	struct id_probe *p;
+	struct stat sb;
+	size_t n;
+
+	*probes = NULL;
+	if (fstat (fd, &sb) != 0) {
+		return -1;
+	}
+	n = sb.st_size / sizeof *p;
+	p = malloc ((n + 1) * sizeof *p);
+	if (NULL == p) {
+		return -1;
+	}
+	if ((n > 0) && (pread (fd, p, n * sizeof *p, 0) != (ssize_t) (n * sizeof *p))) {
+		free (p);
+		return -1;
+	}
+	*probes = p;
+	return n;
+}
+
+static int probe_write (int fd, const struct id_probe *probes, size_t n)
+{
+	size_t size = n * sizeof *probes;
+
+	if (   ((size > 0) && (pwrite (fd, probes, size, 0) != (ssize_t) size))
+	    || (ftruncate (fd, size) != 0)) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * id_probe_stamp - Return the state of the caches of nscd and sssd.
+ *
+ *	It changes when they are invalidated.
+ */
+uint64_t id_probe_stamp (void)
+{
+	uint64_t hash = 14695981039346656037ULL;	/* FNV-1a */
+	const char **f;
+
+	for (f = stamp_files; NULL != *f; f++) {
+		uint64_t v[4];
+		struct stat sb;
+		size_t i;
+
+		if (stat (*f, &sb) != 0) {
+			continue;
+		}
+		v[0] = sb.st_dev;
+		v[1] = sb.st_ino;
+		v[2] = sb.st_mtim.tv_sec;
+		v[3] = sb.st_mtim.tv_nsec;
+		for (i = 0; i < sizeof v; i++) {
+			hash ^= ((const unsigned char *) v)[i];
+			hash *= 1099511628211ULL;
+		}
+	}
+	return hash;
+}
+
+/*
+ * probe_cmp - Sort the results by ID, and the newest last.
+ */
+static int probe_cmp (const void *p1, const void *p2)
+{
+	const struct id_probe *a = p1;
+	const struct id_probe *b = p2;
+
+	if (a->id != b->id) {
+		return (a->id < b->id) ? -1 : 1;
+	}
+	if (a->expires != b->expires) {
+		return (a->expires < b->expires) ? -1 : 1;
+	}
+	return 0;
+}
+
+/*
+ * probe_load - Read the live results of cache->dbfile in the cache.
+ *
+ *	The file is compacted when most of its results have expired, or
+ *	when it holds more than ID_PROBES_MAX results.
+ */
+static void probe_load (struct probe_cache *cache)
+{
+	struct id_probe *p;
+	uint64_t stamp = id_probe_stamp ();
+	time_t now = time (NULL);
+	ssize_t n;
+	size_t i, live = 0;
+	int fd;
+
+	cache->loaded = true;
+	fd = probe_open (cache->dbfile, O_RDWR);
+	if (fd < 0) {
+		return;
+	}
+	n = probe_read (fd, &p);
+	if (n < 0) {
+		(void) close (fd);
+		return;
+	}
+	for (i = 0; i < (size_t) n; i++) {
+		if ((p[i].expires >= now) && (p[i].stamp == stamp)) {
+			p[live++] = p[i];
+		}
+	}
+	if (live > ID_PROBES_MAX) {
+		/* Keep the newest */
+		(void) memmove (p, p + live - ID_PROBES_MAX,
+		                ID_PROBES_MAX * sizeof *p);
+		live = ID_PROBES_MAX;
+	}
+	if (((size_t) n - live >= 64) || ((size_t) n >= 2 * live + 2)) {
+		(void) probe_write (fd, p, live);
+	}
+	(void) close (fd);
+
+	/* Keep the newest result of each ID */
+	qsort (p, live, sizeof *p, probe_cmp);
+	n = 0;
+	for (i = 0; i < live; i++) {
+		if ((n > 0) && (p[n - 1].id == p[i].id)) {
+			n--;
+		}
+		p[n++] = p[i];
+	}
+	cache->probes = p;
+	cache->count = n;
+}
+
+/*
+ * probe_cache - Return the cache of dbfile, or NULL if the results are
+ *               not kept.
+ */
+static /*@null@*/struct probe_cache *probe_cache (const char *dbfile)
+{
+	struct probe_cache *cache = NULL;
+	size_t i;
+
+	if (probe_ttl () <= 0) {
+		return NULL;
+	}
+	for (i = 0; i < sizeof caches / sizeof caches[0]; i++) {
+		if (!caches[i].loaded) {
+			if (strlen (dbfile) >= sizeof caches[i].dbfile) {
+				return NULL;
+			}
+			(void) strcpy (caches[i].dbfile, dbfile);
+			cache = &caches[i];
+			probe_load (cache);
+			break;
+		}
+		if (strcmp (caches[i].dbfile, dbfile) == 0) {
+			cache = &caches[i];
+			break;
+		}
+	}
+	return cache;
+}
+
+/*
+ * probe_find - Return the position of id in the cache, or where it
+ *              should be inserted.
+ */
+static size_t probe_find (const struct probe_cache *cache, unsigned long id)
+{
+	size_t lo = 0, hi = cache->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (cache->probes[mid].id < id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * id_probe_cached - Return the result of a previous lookup of the ID id
+ *                   of dbfile through NSS.
+ *
+ *	Return 1 if id was used, 0 if it was free, and -1 if it is not
+ *	known: it must be looked up.
+ */
+int id_probe_cached (const char *dbfile, unsigned long id)
+{
+	const struct probe_cache *cache = probe_cache (dbfile);
+	size_t pos;
+
+	if ((NULL == cache) || (0 == cache->count)) {
+		return -1;
+	}
+	pos = probe_find (cache, id);
+	if ((pos == cache->count) || (cache->probes[pos].id != id)) {
+		return -1;
+	}
+	if (cache->probes[pos].expires < time (NULL)) {
+		return -1;
+	}
+	return (0 != cache->probes[pos].used) ? 1 : 0;
+}
+
+/*
+ * id_probe_record - Keep the result of the lookup of the ID id of
+ *                   dbfile through NSS.
+ *
+ *	The results are only a hint: they are silently lost if they
+ *	cannot be stored.
+ */
+void id_probe_record (const char *dbfile, unsigned long id, bool used)
+{
+	struct probe_cache *cache = probe_cache (dbfile);
+	struct id_probe probe;
+	size_t pos;
+	int fd;
+
+	if (NULL == cache) {
+		return;
+	}
+	probe.id = id;
+	probe.used = used ? 1 : 0;
+	probe.expires = time (NULL) + probe_ttl ();
+	probe.stamp = id_probe_stamp ();
+
+	fd = probe_open (dbfile, O_WRONLY | O_CREAT | O_APPEND);
+	if (fd >= 0) {
+		(void) write (fd, &probe, sizeof probe);
+		(void) close (fd);
+	}
+
+	pos = probe_find (cache, id);
+	if ((pos < cache->count) && (cache->probes[pos].id == id)) {
+		cache->probes[pos] = probe;
+		return;
+	}
+	if (0 == (cache->count % 64)) {
+		struct id_probe *p;
+
+		p = realloc (cache->probes, (cache->count + 64) * sizeof *p);
+		if (NULL == p) {
+			return;
+		}
+		cache->probes = p;
+	}
+	(void) memmove (cache->probes + pos + 1, cache->probes + pos,
+	                (cache->count - pos) * sizeof *cache->probes);
+	cache->probes[pos] = probe;
+	cache->count++;
+}
+
+/*
+ * restamp - Keep the results of dbfile recorded with the state before
+ *           of the caches of nscd and sssd, with their state now.
+ */
+static void restamp (const char *dbfile, uint64_t before, uint64_t now)
+{
+	struct id_probe *p;
+	ssize_t n, i;
+	bool changed = false;
+	int fd;
+
+	fd = probe_open (dbfile, O_RDWR);
+	if (fd < 0) {
+		return;
+	}
+	n = probe_read (fd, &p);
+	if (n < 0) {
+		(void) close (fd);
+		return;
+	}
+	for (i = 0; i < n; i++) {
+		if (p[i].stamp == before) {
+			p[i].stamp = now;
+			changed = true;
+		}
+	}
+	if (changed) {
+		(void) probe_write (fd, p, n);
+	}
+	free (p);
+	(void) close (fd);
+}
+
+/*
+ * id_probe_restamp - Keep the results after the caches of nscd or sssd
+ *                    were invalidated by the current process.
+ *
+ *	before is the id_probe_stamp() before the invalidation. The
+ *	results recorded after another invalidation are still dropped.
+ */
+void id_probe_restamp (uint64_t before)
+{
+	uint64_t now;
+
+	if (probe_ttl () <= 0) {
+		return;
+	}
+	now = id_probe_stamp ();
+	if (now == before) {
+		return;
+	}
+	restamp (pw_dbname (), before, now);
+	restamp (gr_dbname (), before, now);
+}
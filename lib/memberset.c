@@ -0,0 +1,124 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Sets of group member names.
+ *
+ * They are used instead of a linear scan of the member list when many
+ * members are searched in a large list (merges of split groups, lists of
+ * new members). The set does not copy the names: they shall remain
+ * valid while the set is used.
+ *
+ * The set is sized for a maximum number of names when it is created,
+ * so that adding a name never fails.
+ */
+
+struct member_set {
+	size_t mask;		/* number of slots - 1 */
+	size_t count;
+	size_t max;
+	/*@dependent@*/const char **slots;
+};
+
+static size_t member_hash (const char *name)
+{
+	size_t h = 5381;
+
+	while ('\0' != *name) {
+		h = (h * 33) ^ (unsigned char) *name;
+		name++;
+	}
+	return h;
+}
+
+/*
+ * member_set_new - Create a set for at most max names.
+ *
+ *	Return NULL if the memory could not be allocated.
+ */
+/*@null@*/ /*@only@*/struct member_set *member_set_new (size_t max)
+{
+	struct member_set *set;
+	size_t size = 16;
+
+	/* Keep the load factor under 1/2 */
+	while (size / 2 <= max) {
+		if (size > SIZE_MAX / 4 / sizeof (char *)) {
+			return NULL;
+		}
+		size *= 2;
+	}
+
+	set = malloc (sizeof *set);
+	if (NULL == set) {
+		return NULL;
+	}
+	set->slots = calloc (size, sizeof (char *));
+	if (NULL == set->slots) {
+		free (set);
+		return NULL;
+	}
+	set->mask = size - 1;
+	set->count = 0;
+	set->max = max;
+	return set;
+}
+
+/*
+ * member_set_add - Add name to the set.
+ *
+ *	Return true if name was added, false if it was already in the set.
+ */
+bool member_set_add (struct member_set *set, const char *name)
+{
+	size_t i;
+
+	for (i = member_hash (name) & set->mask;
+	     NULL != set->slots[i];
+	     i = (i + 1) & set->mask) {
+		if (strcmp (set->slots[i], name) == 0) {
+			return false;
+		}
+	}
+	assert (set->count < set->max);
+	set->slots[i] = name;
+	set->count++;
+	return true;
+}
+
+/*
+ * member_set_contains - Check if name is in the set.
+ */
+bool member_set_contains (const struct member_set *set, const char *name)
+{
+	size_t i;
+
+	for (i = member_hash (name) & set->mask;
+	     NULL != set->slots[i];
+	     i = (i + 1) & set->mask) {
+		if (strcmp (set->slots[i], name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void member_set_free (/*@only@*/ /*@null@*/struct member_set *set)
+{
+	if (NULL != set) {
+		free (set->slots);
+		free (set);
+	}
+}
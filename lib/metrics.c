@@ -0,0 +1,485 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "defines.h"
+#include "getdef.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * Counters aggregated over all the runs of the tools.
+ *
+ * If METRICS_FILE is set, the tools count their commits, the time spent
+ * waiting for the locks, committing and flushing the databases, the UIDs
+ * and GIDs checked while searching a free one, the bytes copied by
+ * copy_tree() and the flushes of the name service caches. When the tool
+ * exits, these counters are added to the METRICS_FILE file, which is
+ * written in the Prometheus text format, so that it can be read by the
+ * textfile collector of node_exporter.
+ *
+ * The file is updated under a lock on METRICS_FILE.lock, and replaced
+ * with a rename, so that it is never read half written.
+ */
+
+struct metrics_def {
+	const char *name;
+	const char *help;
+	/*@null@*/const char *label;	/* name of the label, if any */
+	bool histogram;
+};
+
+static const struct metrics_def counter_defs[METRICS_COUNTERS] = {
+	{"shadow_commits_total", "Databases written.", "db", false},
+	{"shadow_id_search_iterations_total",
+	 "IDs checked while searching a free UID or GID.", "type", false},
+	{"shadow_copy_tree_bytes_total",
+	 "Bytes of the files copied to the home directories.", NULL, false},
+	{"shadow_cache_flushes_total",
+	 "Flushes of the name service caches.", NULL, false},
+};
+
+static const struct metrics_def histogram_defs[METRICS_HISTOGRAMS] = {
+	{"shadow_lock_wait_seconds",
+	 "Time spent waiting for the lock of a database.", "db", true},
+	{"shadow_commit_duration_seconds",
+	 "Time spent writing the changes of the databases.", NULL, true},
+	{"shadow_fsync_duration_seconds",
+	 "Time spent flushing a database to disk.", "db", true},
+};
+
+/* Upper bounds of the buckets of the histograms, in seconds */
+static const char *const bucket_names[] = {
+	"0.0001", "0.001", "0.01", "0.1", "1", "10", "+Inf"
+};
+static const double bucket_bounds[] = {
+	0.0001, 0.001, 0.01, 0.1, 1, 10
+};
+
+#define METRICS_BUCKETS	(sizeof bucket_names / sizeof bucket_names[0])
+#define METRICS_SERIES	32
+
+struct metrics_series {
+	/*@observer@*/const struct metrics_def *def;
+	/*@owned@*/ /*@null@*/char *label;
+	double value;			/* counter, or sum of a histogram */
+	unsigned long count;		/* observations of a histogram */
+	unsigned long buckets[METRICS_BUCKETS];
+};
+
+static int metrics_enabled = -1;	/* not checked yet */
+static pid_t metrics_pid;
+static struct metrics_series series[METRICS_SERIES];
+static size_t nseries = 0;
+
+static void metrics_write (void);
+
+/*
+ * metrics_on - Check once if METRICS_FILE is set.
+ */
+bool metrics_on (void)
+{
+	const char *file;
+
+	if (-1 == metrics_enabled) {
+		file = getdef_str ("METRICS_FILE");
+		metrics_enabled = (NULL != file) && ('/' == file[0]);
+		if (1 == metrics_enabled) {
+			metrics_pid = getpid ();
+			if (atexit (metrics_write) != 0) {
+				metrics_enabled = 0;
+			}
+		}
+	}
+	return 1 == metrics_enabled;
+}
+
+/*
+ * find_series - Return the series of def with the given label, or NULL if
+ *               there are already too many series.
+ */
+static /*@null@*/struct metrics_series *find_series (
+	const struct metrics_def *def, /*@null@*/const char *label)
+{
+	size_t i;
+
+	if (NULL == def->label) {
+		label = NULL;
+	}
+	for (i = 0; i < nseries; i++) {
+		if (   (series[i].def == def)
+		    && (   ((NULL == series[i].label) && (NULL == label))
+		        || (   (NULL != series[i].label) && (NULL != label)
+		            && (strcmp (series[i].label, label) == 0)))) {
+			return &series[i];
+		}
+	}
+	if (METRICS_SERIES == nseries) {
+		return NULL;
+	}
+	memzero (&series[nseries], sizeof series[nseries]);
+	series[nseries].def = def;
+	if (NULL != label) {
+		series[nseries].label = strdup (label);
+		if (NULL == series[nseries].label) {
+			return NULL;
+		}
+	}
+	nseries++;
+	return &series[nseries - 1];
+}
+
+/*
+ * metrics_add - Add n to a counter.
+ *
+ *	label is the database, or the type of ID.
+ */
+void metrics_add (enum metrics_counter counter,
+                  /*@null@*/const char *label, unsigned long long n)
+{
+	struct metrics_series *s;
+
+	if (!metrics_on ()) {
+		return;
+	}
+	s = find_series (&counter_defs[counter], label);
+	if (NULL != s) {
+		s->value += n;
+	}
+}
+
+/*
+ * metrics_observe - Add the time since timing_start() to a histogram.
+ *
+ *	label is the database.
+ */
+void metrics_observe (enum metrics_histogram histogram,
+                      /*@null@*/const char *label,
+                      const struct timespec *start)
+{
+	struct metrics_series *s;
+	struct timespec end;
+	double seconds;
+	size_t i;
+
+	if (!metrics_on ()) {
+		return;
+	}
+	s = find_series (&histogram_defs[histogram], label);
+	if (NULL == s) {
+		return;
+	}
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start->tv_sec)
+	        + (end.tv_nsec - start->tv_nsec) / 1e9;
+	for (i = 0; i < METRICS_BUCKETS - 1; i++) {
+		if (seconds <= bucket_bounds[i]) {
+			break;
+		}
+	}
+	s->buckets[i]++;
+	s->count++;
+	s->value += seconds;
+}
+
+/*
+ * The samples of the metrics file, in the order of the file.
+ */
+struct metrics_sample {
+	char *name;		/* with its labels */
+	double value;
+};
+
+struct metrics_samples {
+	struct metrics_sample *samples;
+	size_t count;
+};
+
+/*
+ * add_sample - Add value to the sample name, created if needed.
+ *
+ *	Return 0 on success, -1 if out of memory.
+ */
+static int add_sample (struct metrics_samples *file, const char *name,
+                       double value)
+{
+	struct metrics_sample *s;
+	size_t i;
+
+	for (i = 0; i < file->count; i++) {
+		if (strcmp (file->samples[i].name, name) == 0) {
+			file->samples[i].value += value;
+			return 0;
+		}
+	}
+	if (0 == (file->count % 64)) {
+		s = realloc (file->samples, (file->count + 64) * sizeof *s);
+		if (NULL == s) {
+			return -1;
+		}
+		file->samples = s;
+	}
+	file->samples[file->count].name = strdup (name);
+	if (NULL == file->samples[file->count].name) {
+		return -1;
+	}
+	file->samples[file->count].value = value;
+	file->count++;
+	return 0;
+}
+
+/*
+ * read_samples - Read the samples of the metrics file fp.
+ *
+ *	The comments and the invalid lines are skipped.
+ */
+static int read_samples (FILE *fp, struct metrics_samples *file)
+{
+	char buf[1024];
+
+	while (fgets (buf, sizeof buf, fp) == buf) {
+		char *sp, *end;
+		double value;
+
+		buf[strcspn (buf, "\n")] = '\0';
+		sp = strrchr (buf, ' ');
+		if (('#' == buf[0]) || (NULL == sp) || (sp == buf)) {
+			continue;
+		}
+		*sp = '\0';
+		errno = 0;
+		value = strtod (sp + 1, &end);
+		if ((0 != errno) || ('\0' != *end) || (end == sp + 1)) {
+			continue;
+		}
+		if (add_sample (file, buf, value) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * sample_name - Write the name of a sample of s, with its labels, in buf.
+ *
+ *	suffix is appended to the name of the metric, and le is the bucket
+ *	of a histogram, or NULL.
+ */
+static void sample_name (char *buf, size_t size,
+                         const struct metrics_series *s,
+                         const char *suffix, /*@null@*/const char *le)
+{
+	const char *tool = log_get_progname ();
+	size_t len;
+	const char *p;
+
+	len = snprintf (buf, size, "%s%s{tool=\"%s\"", s->def->name, suffix,
+	                (NULL != tool) ? tool : "unknown");
+	if ((NULL != s->def->label) && (NULL != s->label) && (len < size)) {
+		len += snprintf (buf + len, size - len, ",%s=\"", s->def->label);
+		for (p = s->label; ('\0' != *p) && (len + 2 < size); p++) {
+			if (('"' == *p) || ('\\' == *p)) {
+				buf[len++] = '\\';
+			}
+			buf[len++] = ('\n' == *p) ? ' ' : *p;
+		}
+		if (len < size) {
+			len += snprintf (buf + len, size - len, "\"");
+		}
+	}
+	if ((NULL != le) && (len < size)) {
+		len += snprintf (buf + len, size - len, ",le=\"%s\"", le);
+	}
+	if (len < size) {
+		(void) snprintf (buf + len, size - len, "}");
+	}
+}
+
+/*
+ * add_series - Add the samples of the series of this process to file.
+ */
+static int add_series (struct metrics_samples *file)
+{
+	char name[512];
+	size_t i, j;
+
+	for (i = 0; i < nseries; i++) {
+		const struct metrics_series *s = &series[i];
+		unsigned long cumulated = 0;
+
+		if (!s->def->histogram) {
+			sample_name (name, sizeof name, s, "", NULL);
+			if (add_sample (file, name, s->value) != 0) {
+				return -1;
+			}
+			continue;
+		}
+		for (j = 0; j < METRICS_BUCKETS; j++) {
+			cumulated += s->buckets[j];
+			sample_name (name, sizeof name, s, "_bucket",
+			             bucket_names[j]);
+			if (add_sample (file, name, cumulated) != 0) {
+				return -1;
+			}
+		}
+		sample_name (name, sizeof name, s, "_sum", NULL);
+		if (add_sample (file, name, s->value) != 0) {
+			return -1;
+		}
+		sample_name (name, sizeof name, s, "_count", NULL);
+		if (add_sample (file, name, s->count) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * is_sample_of - Check if the sample name belongs to the metric def.
+ */
+static bool is_sample_of (const char *name, const struct metrics_def *def)
+{
+	size_t len = strlen (def->name);
+	const char *rest = name + len;
+
+	if (strncmp (name, def->name, len) != 0) {
+		return false;
+	}
+	if (def->histogram) {
+		if (strncmp (rest, "_bucket", 7) == 0) {
+			rest += 7;
+		} else if (strncmp (rest, "_sum", 4) == 0) {
+			rest += 4;
+		} else if (strncmp (rest, "_count", 6) == 0) {
+			rest += 6;
+		} else {
+			return false;
+		}
+	}
+	return '{' == *rest;
+}
+
+static void write_metric (FILE *fp, const struct metrics_samples *file,
+                          const struct metrics_def *def)
+{
+	size_t i;
+
+	(void) fprintf (fp, "# HELP %s %s\n# TYPE %s %s\n",
+	                def->name, def->help, def->name,
+	                def->histogram ? "histogram" : "counter");
+	for (i = 0; i < file->count; i++) {
+		if (is_sample_of (file->samples[i].name, def)) {
+			(void) fprintf (fp, "%s %.15g\n", file->samples[i].name,
+			                file->samples[i].value);
+		}
+	}
+}
+
+/*
+ * update_file - Add the counters of this process to the metrics file.
+ *
+ *	It must be called with the lock of the file.
+ */
+static int update_file (const char *metrics_file)
+{
+	struct metrics_samples file = {NULL, 0};
+	char tmp[1024];
+	FILE *fp;
+	size_t i;
+	int fd, err;
+	int ret = -1;
+
+	fp = fopen (metrics_file, "re");
+	if (NULL != fp) {
+		err = read_samples (fp, &file);
+		(void) fclose (fp);
+		if (0 != err) {
+			goto out;
+		}
+	} else if (ENOENT != errno) {
+		return -1;
+	}
+	if (add_series (&file) != 0) {
+		goto out;
+	}
+
+	(void) snprintf (tmp, sizeof tmp, "%s+", metrics_file);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		goto out;
+	}
+	fp = fdopen (fd, "w");
+	if (NULL == fp) {
+		(void) close (fd);
+		(void) unlink (tmp);
+		goto out;
+	}
+	for (i = 0; i < METRICS_COUNTERS; i++) {
+		write_metric (fp, &file, &counter_defs[i]);
+	}
+	for (i = 0; i < METRICS_HISTOGRAMS; i++) {
+		write_metric (fp, &file, &histogram_defs[i]);
+	}
+	if (   (fflush (fp) != 0) || (ferror (fp) != 0)
+	    || (fclose (fp) != 0)) {
+		(void) unlink (tmp);
+		goto out;
+	}
+	if (rename (tmp, metrics_file) != 0) {
+		(void) unlink (tmp);
+		goto out;
+	}
+	ret = 0;
+
+out:
+	for (i = 0; i < file.count; i++) {
+		free (file.samples[i].name);
+	}
+	free (file.samples);
+	return ret;
+}
+
+/*
+ * metrics_write - Add the counters of the tool to the metrics file
+ *                 (atexit handler).
+ *
+ *	The children forked by the tool do not write them. A failure is
+ *	only logged: the metrics must not change the result of the tool.
+ */
+static void metrics_write (void)
+{
+	const char *metrics_file = getdef_str ("METRICS_FILE");
+	char lock[1024];
+	int fd;
+
+	if ((getpid () != metrics_pid) || (0 == nseries)
+	    || (NULL == metrics_file)) {
+		return;
+	}
+
+	(void) snprintf (lock, sizeof lock, "%s.lock", metrics_file);
+	fd = open (lock, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		return;
+	}
+	if (   (flock (fd, LOCK_EX) != 0)
+	    || (update_file (metrics_file) != 0)) {
+		SYSLOG ((LOG_WARN, "cannot update %s: %s",
+		         metrics_file, strerror (errno)));
+	}
+	(void) close (fd);
+}
@@ -4,6 +4,11 @@
 #ifdef USE_NSCD
 
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include "exitcodes.h"
@@ -14,16 +19,94 @@
 
 #define MSG_NSCD_FLUSH_CACHE_FAILED "%s: Failed to flush the nscd cache.\n"
 
+/* nscd client protocol, see nscd-client.h in glibc */
+#define NSCD_SOCKET	"/var/run/nscd/socket"
+#define NSCD_VERSION	2
+#define NSCD_INVALIDATE	10
+
 /*
- * nscd_flush_cache - flush specified service buffer in nscd cache
+ * nscd_invalidate - ask nscd to invalidate a cache through its socket
+ *
+ *	Return 0 if the cache was invalidated or nscd is not running,
+ *	-1 if nscd failed to invalidate it, and 1 if the socket could not
+ *	be used.
  */
-int nscd_flush_cache (const char *service)
+static int nscd_invalidate (const char *service)
+{
+	struct sockaddr_un addr;
+	struct {
+		int32_t version;
+		int32_t type;
+		int32_t key_len;
+	} req;
+	struct iovec iov[2];
+	int32_t resp;
+	ssize_t len;
+	int fd;
+
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return 1;
+	}
+
+	memzero (&addr, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, NSCD_SOCKET);
+	if (connect (fd, (struct sockaddr *) &addr, sizeof addr) != 0) {
+		int err = errno;
+
+		(void) close (fd);
+		if ((ENOENT == err) || (ECONNREFUSED == err)) {
+			/* nscd is not running. */
+			return 0;
+		}
+		return 1;
+	}
+
+	req.version = NSCD_VERSION;
+	req.type = NSCD_INVALIDATE;
+	req.key_len = strlen (service) + 1;
+	iov[0].iov_base = &req;
+	iov[0].iov_len = sizeof req;
+	iov[1].iov_base = (char *) service;
+	iov[1].iov_len = req.key_len;
+	len = writev (fd, iov, 2);
+	if (len != (ssize_t) (sizeof req + req.key_len)) {
+		(void) close (fd);
+		return 1;
+	}
+
+	len = read (fd, &resp, sizeof resp);
+	(void) close (fd);
+	if (len != sizeof resp) {
+		return 1;
+	}
+	if (0 != resp) {
+		(void) fprintf (shadow_logfd, _(MSG_NSCD_FLUSH_CACHE_FAILED), shadow_progname);
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * flush_service - flush specified service buffer in nscd cache
+ *
+ *	nscd is asked directly through its socket. nscd -i is only run if
+ *	the socket cannot be used.
+ */
+static int flush_service (const char *service)
 {
 	int status, code;
 	const char *cmd = "/usr/sbin/nscd";
 	const char *spawnedArgs[] = {"nscd", "-i", service, NULL};
 	const char *spawnedEnv[] = {NULL};
 
+	code = nscd_invalidate (service);
+	if (code <= 0) {
+		return code;
+	}
+
 	if (run_command (cmd, spawnedArgs, spawnedEnv, &status) != 0) {
 		/* run_command writes its own more detailed message. */
 		(void) fprintf (shadow_logfd, _(MSG_NSCD_FLUSH_CACHE_FAILED), shadow_progname);
@@ -52,7 +135,21 @@ int nscd_flush_cache (const char *service)
 
 	return 0;
 }
+
+/*
+ * nscd_flush_cache - flush specified service buffer in nscd cache
+ *
+ *	The results of the lookups of new IDs are kept (see idprobe.c).
+ */
+int nscd_flush_cache (const char *service)
+{
+	uint64_t before = id_probe_stamp ();
+	int ret;
+
+	ret = flush_service (service);
+	id_probe_restamp (before);
+	return ret;
+}
 #else				/* USE_NSCD */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* USE_NSCD */
-
@@ -6,6 +6,7 @@
 #include <strings.h>
 #include <ctype.h>
 #include <stdatomic.h>
+#include <pthread.h>
 #include "prototypes.h"
 #include "../libsubid/subid.h"
 #include "shadowlog_internal.h"
@@ -21,36 +22,41 @@
 // the subids are a pretty limited resource, and local files seem
 // bound to step on any other allocations leading to insecure
 // conditions.
-static atomic_flag nss_init_started;
+static pthread_mutex_t nss_init_lock = PTHREAD_MUTEX_INITIALIZER;
 static atomic_bool nss_init_completed;
 
-static struct subid_nss_ops *subid_nss;
+static struct subid_nss_ops *_Atomic subid_nss;
 
 bool nss_is_initialized() {
 	return atomic_load(&nss_init_completed);
 }
 
-static void nss_exit(void) {
-	if (nss_is_initialized() && subid_nss) {
-		dlclose(subid_nss->handle);
-		free(subid_nss);
-		subid_nss = NULL;
+// Modules replaced by nss_reload(), linked by ->previous
+static struct subid_nss_ops *retired_nss;
+
+static void nss_close(struct subid_nss_ops *ops) {
+	struct subid_nss_ops *previous;
+
+	for (; ops; ops = previous) {
+		previous = ops->previous;
+		dlclose(ops->handle);
+		free(ops);
 	}
 }
 
-// nsswitch_path is an argument only to support testing.
-void nss_init(const char *nsswitch_path) {
+static void nss_exit(void) {
+	nss_close(atomic_exchange(&subid_nss, NULL));
+	nss_close(retired_nss);
+	retired_nss = NULL;
+}
+
+// Load the module configured in nsswitch_path, or return NULL to use files.
+static struct subid_nss_ops *nss_load(const char *nsswitch_path) {
 	FILE *nssfp = NULL;
 	char *line = NULL, *p, *token, *saveptr;
 	size_t len = 0;
 	FILE *shadow_logfd = log_get_logfd();
-
-	if (atomic_flag_test_and_set(&nss_init_started)) {
-		// Another thread has started nss_init, wait for it to complete
-		while (!atomic_load(&nss_init_completed))
-			usleep(100);
-		return;
-	}
+	struct subid_nss_ops *ops = NULL;
 
 	if (!nsswitch_path)
 		nsswitch_path = NSSWITCH;
@@ -61,9 +67,7 @@ void nss_init(const char *nsswitch_path) {
 	if (!nssfp) {
 		if (errno != ENOENT)
 			fprintf(shadow_logfd, "Failed opening %s: %m\n", nsswitch_path);
-
-		atomic_store(&nss_init_completed, true);
-		return;
+		return NULL;
 	}
 	while ((getline(&line, &len, nssfp)) != -1) {
 		if (line[0] == '\0' || line[0] == '#')
@@ -83,13 +87,11 @@ void nss_init(const char *nsswitch_path) {
 			char libname[65];
 			void *h;
 			if (strcmp(token, "files") == 0) {
-				subid_nss = NULL;
 				goto done;
 			}
 			if (strlen(token) > 50) {
 				fprintf(shadow_logfd, "Subid NSS module name too long (longer than 50 characters): %s\n", token);
 				fprintf(shadow_logfd, "Using files\n");
-				subid_nss = NULL;
 				goto done;
 			}
 			snprintf(libname, 64,  "libsubid_%s.so", token);
@@ -97,58 +99,99 @@ void nss_init(const char *nsswitch_path) {
 			if (!h) {
 				fprintf(shadow_logfd, "Error opening %s: %s\n", libname, dlerror());
 				fprintf(shadow_logfd, "Using files\n");
-				subid_nss = NULL;
 				goto done;
 			}
-			subid_nss = malloc(sizeof(*subid_nss));
-			if (!subid_nss) {
+			ops = calloc(1, sizeof(*ops));
+			if (!ops) {
 				dlclose(h);
 				goto done;
 			}
-			subid_nss->has_range = dlsym(h, "shadow_subid_has_range");
-			if (!subid_nss->has_range) {
+			ops->has_range = dlsym(h, "shadow_subid_has_range");
+			if (!ops->has_range) {
 				fprintf(shadow_logfd, "%s did not provide @has_range@\n", libname);
 				dlclose(h);
-				free(subid_nss);
-				subid_nss = NULL;
+				free(ops);
+				ops = NULL;
 				goto done;
 			}
-			subid_nss->list_owner_ranges = dlsym(h, "shadow_subid_list_owner_ranges");
-			if (!subid_nss->list_owner_ranges) {
+			ops->list_owner_ranges = dlsym(h, "shadow_subid_list_owner_ranges");
+			if (!ops->list_owner_ranges) {
 				fprintf(shadow_logfd, "%s did not provide @list_owner_ranges@\n", libname);
 				dlclose(h);
-				free(subid_nss);
-				subid_nss = NULL;
+				free(ops);
+				ops = NULL;
 				goto done;
 			}
-			subid_nss->find_subid_owners = dlsym(h, "shadow_subid_find_subid_owners");
-			if (!subid_nss->find_subid_owners) {
+			ops->find_subid_owners = dlsym(h, "shadow_subid_find_subid_owners");
+			if (!ops->find_subid_owners) {
 				fprintf(shadow_logfd, "%s did not provide @find_subid_owners@\n", libname);
 				dlclose(h);
-				free(subid_nss);
-				subid_nss = NULL;
+				free(ops);
+				ops = NULL;
 				goto done;
 			}
-			subid_nss->handle = h;
+			// Optional entry points
+			ops->list_owner_ranges_many = dlsym(h, "shadow_subid_list_owner_ranges_many");
+			ops->has_range_many = dlsym(h, "shadow_subid_has_range_many");
+			ops->cache_token = dlsym(h, "shadow_subid_cache_token");
+			ops->list_owner_ranges_start = dlsym(h, "shadow_subid_list_owner_ranges_start");
+			ops->list_owner_ranges_finish = dlsym(h, "shadow_subid_list_owner_ranges_finish");
+			ops->handle = h;
 			goto done;
 		}
 		fprintf(shadow_logfd, "No usable subid NSS module found, using files\n");
-		// subid_nss has to be null here, but to ease reviews:
-		free(subid_nss);
-		subid_nss = NULL;
 		goto done;
 	}
 
 done:
-	atomic_store(&nss_init_completed, true);
 	free(line);
-	if (nssfp) {
+	fclose(nssfp);
+	return ops;
+}
+
+// Replace the module in use by the one configured in nsswitch_path.
+// The replaced module is only closed at exit, as other threads may
+// still be using it.
+static void nss_set(const char *nsswitch_path) {
+	static bool registered;
+	struct subid_nss_ops *ops, *old;
+
+	ops = nss_load(nsswitch_path);
+	old = atomic_exchange(&subid_nss, ops);
+	if (old) {
+		old->previous = retired_nss;
+		retired_nss = old;
+	}
+	if (ops && !registered) {
 		atexit(nss_exit);
-		fclose(nssfp);
+		registered = true;
 	}
 }
 
+// nsswitch_path is an argument only to support testing.
+void nss_init(const char *nsswitch_path) {
+	// Once initialized, there is no need to take the lock
+	if (atomic_load(&nss_init_completed))
+		return;
+
+	pthread_mutex_lock(&nss_init_lock);
+	if (!atomic_load(&nss_init_completed)) {
+		nss_set(nsswitch_path);
+		atomic_store(&nss_init_completed, true);
+	}
+	pthread_mutex_unlock(&nss_init_lock);
+}
+
+// Read nsswitch_path (or /etc/nsswitch.conf if NULL) again, for the next
+// queries.
+void nss_reload(const char *nsswitch_path) {
+	pthread_mutex_lock(&nss_init_lock);
+	nss_set(nsswitch_path);
+	atomic_store(&nss_init_completed, true);
+	pthread_mutex_unlock(&nss_init_lock);
+}
+
 struct subid_nss_ops *get_subid_nss_handle() {
 	nss_init(NULL);
-	return subid_nss;
+	return atomic_load(&subid_nss);
 }
@@ -14,12 +14,47 @@
 #include <stdio.h>
 #include <ctype.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <sys/stat.h>
 #include "defines.h"
 #include "prototypes.h"
 #include "port.h"
 
 static FILE *ports;
 
+/*
+ * The entries of the ports file are compiled once in the rules table
+ * below, with the time entries precomputed as one bit per minute of the
+ * week (0 = Sunday 00:00). The table is compiled again when the ports
+ * file changes.
+ *
+ * The rule matching a TTY and a user is remembered in a small table of
+ * lookups indexed by a hash of the TTY and user names.
+ */
+
+#define PORT_WEEK	(7 * 24 * 60)
+#define PORT_LOOKUPS	64
+
+struct port_rule {
+	char **pr_names;
+	char **pr_users;
+	bool pr_never;		/* no time entries */
+	unsigned char pr_week[PORT_WEEK / CHAR_BIT];
+};
+
+struct port_lookup {
+	/*@null@*//*@only@*/char *pl_tty;
+	/*@null@*//*@only@*/char *pl_user;
+	long pl_rule;		/* -1 if no rule matches */
+};
+
+static /*@null@*//*@only@*/struct port_rule *rules = NULL;
+static size_t nrules = 0;
+static bool rules_loaded = false;
+static struct stat rules_sb;	/* st_ino == 0 if there is no ports file */
+static struct port_lookup lookups[PORT_LOOKUPS];
+
 /*
  * portcmp - compare the name of a port to a /etc/porttime entry
  *
@@ -377,6 +412,285 @@ static struct port *getttyuser (const char *tty, const char *user)
 	return port;
 }
 
+/*
+ * lookup_hash - hash the TTY and user names of a lookup
+ */
+static size_t lookup_hash (const char *tty, const char *user)
+{
+	size_t h = 5381;
+
+	while ('\0' != *tty) {
+		h = h * 33 + (unsigned char) *tty++;
+	}
+	h = h * 33;
+	while ('\0' != *user) {
+		h = h * 33 + (unsigned char) *user++;
+	}
+	return h % PORT_LOOKUPS;
+}
+
+static void release_list (/*@null@*//*@only@*/char **list)
+{
+	char **p;
+
+	if (NULL == list) {
+		return;
+	}
+	for (p = list; NULL != *p; p++) {
+		free (*p);
+	}
+	free (list);
+}
+
+/*
+ * copy_list - copy a NULL terminated list of strings
+ */
+static /*@null@*//*@only@*/char **copy_list (char *const *list)
+{
+	size_t i, n;
+	char **dup;
+
+	for (n = 0; NULL != list[n]; n++);
+	dup = calloc (n + 1, sizeof (char *));
+	if (NULL == dup) {
+		return NULL;
+	}
+	for (i = 0; i < n; i++) {
+		dup[i] = strdup (list[i]);
+		if (NULL == dup[i]) {
+			release_list (dup);
+			return NULL;
+		}
+	}
+	return dup;
+}
+
+static void free_rules (void)
+{
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		release_list (rules[i].pr_names);
+		release_list (rules[i].pr_users);
+	}
+	free (rules);
+	rules = NULL;
+	nrules = 0;
+	for (i = 0; i < PORT_LOOKUPS; i++) {
+		free (lookups[i].pl_tty);
+		free (lookups[i].pl_user);
+		lookups[i].pl_tty = NULL;
+		lookups[i].pl_user = NULL;
+	}
+	rules_loaded = false;
+}
+
+static bool port_time_allowed (const struct port *pp, int wday, int dtime);
+
+/*
+ * add_rule - compile an entry of the ports file in the rules table
+ */
+static bool add_rule (const struct port *pp)
+{
+	struct port_rule *rule;
+	int minute;
+
+	if ((nrules % 16) == 0) {
+		rule = realloc (rules, (nrules + 16) * sizeof (*rules));
+		if (NULL == rule) {
+			return false;
+		}
+		rules = rule;
+	}
+	rule = &rules[nrules];
+	memzero (rule, sizeof (*rule));
+	rule->pr_names = copy_list (pp->pt_names);
+	rule->pr_users = copy_list (pp->pt_users);
+	if ((NULL == rule->pr_names) || (NULL == rule->pr_users)) {
+		release_list (rule->pr_names);
+		release_list (rule->pr_users);
+		return false;
+	}
+	rule->pr_never = (0 == pp->pt_times);
+	for (minute = 0; !rule->pr_never && (minute < PORT_WEEK); minute++) {
+		int dtime = (minute % (24 * 60)) / 60 * 100 + minute % 60;
+
+		if (port_time_allowed (pp, minute / (24 * 60), dtime)) {
+			rule->pr_week[minute / CHAR_BIT] |= 1 << (minute % CHAR_BIT);
+		}
+	}
+	nrules++;
+	return true;
+}
+
+/*
+ * load_rules - compile the ports file, unless it did not change since
+ *              it was last compiled
+ *
+ *	false is returned if the rules could not be compiled.
+ */
+static bool load_rules (void)
+{
+	struct stat sb;
+	struct port *pp;
+
+	if (stat (PORTS, &sb) != 0) {
+		memzero (&sb, sizeof sb);
+	}
+	if (   rules_loaded
+	    && (sb.st_dev == rules_sb.st_dev)
+	    && (sb.st_ino == rules_sb.st_ino)
+	    && (sb.st_size == rules_sb.st_size)
+	    && (sb.st_mtim.tv_sec == rules_sb.st_mtim.tv_sec)
+	    && (sb.st_mtim.tv_nsec == rules_sb.st_mtim.tv_nsec)) {
+		return true;
+	}
+
+	free_rules ();
+	setportent ();
+	while ((pp = getportent ()) != NULL) {
+		if (   (0 == pp->pt_names)
+		    || (0 == pp->pt_users)) {
+			continue;
+		}
+		if (!add_rule (pp)) {
+			endportent ();
+			free_rules ();
+			return false;
+		}
+	}
+	endportent ();
+	rules_sb = sb;
+	rules_loaded = true;
+	return true;
+}
+
+/*
+ * find_rule - get the first rule matching the TTY and user
+ *
+ *	NULL is returned if no rule matches.
+ */
+static /*@null@*/const struct port_rule *find_rule (const char *tty,
+                                                     const char *user)
+{
+	struct port_lookup *pl = &lookups[lookup_hash (tty, user)];
+	size_t r;
+	int i, j;
+
+	if (   (NULL != pl->pl_tty) && (NULL != pl->pl_user)
+	    && (strcmp (pl->pl_tty, tty) == 0)
+	    && (strcmp (pl->pl_user, user) == 0)) {
+		return (-1 == pl->pl_rule) ? NULL : &rules[pl->pl_rule];
+	}
+
+	for (r = 0; r < nrules; r++) {
+		for (i = 0; NULL != rules[r].pr_names[i]; i++) {
+			if (portcmp (rules[r].pr_names[i], tty) == 0) {
+				break;
+			}
+		}
+		if (NULL == rules[r].pr_names[i]) {
+			continue;
+		}
+
+		for (j = 0; NULL != rules[r].pr_users[j]; j++) {
+			if (   (strcmp (user, rules[r].pr_users[j]) == 0)
+			    || (strcmp (rules[r].pr_users[j], "*") == 0)) {
+				break;
+			}
+		}
+		if (NULL != rules[r].pr_users[j]) {
+			break;
+		}
+	}
+
+	free (pl->pl_tty);
+	free (pl->pl_user);
+	pl->pl_tty = strdup (tty);
+	pl->pl_user = strdup (user);
+	pl->pl_rule = (r < nrules) ? (long) r : -1;
+
+	return (r < nrules) ? &rules[r] : NULL;
+}
+
+static bool rule_allowed (const struct port_rule *rule, int minute)
+{
+	return (rule->pr_week[minute / CHAR_BIT] & (1 << (minute % CHAR_BIT))) != 0;
+}
+
+/*
+ * rule_next_denied - number of minutes from minute to the next minute
+ *                    at which rule does not allow to be logged in
+ *
+ *	-1 is returned if the rule allows the whole week.
+ */
+static int rule_next_denied (const struct port_rule *rule, int minute)
+{
+	int d;
+
+	for (d = 1; d <= PORT_WEEK; d++) {
+		int m = (minute + d) % PORT_WEEK;
+
+		/* Skip a whole byte of allowed minutes */
+		if (   ((m % CHAR_BIT) == 0)
+		    && (d + CHAR_BIT <= PORT_WEEK)
+		    && (rule->pr_week[m / CHAR_BIT] == UCHAR_MAX)) {
+			d += CHAR_BIT - 1;
+			continue;
+		}
+		if (!rule_allowed (rule, m)) {
+			return d;
+		}
+	}
+	return -1;
+}
+
+static int week_minute (const struct tm *tm)
+{
+	return (tm->tm_wday * 24 + tm->tm_hour) * 60 + tm->tm_min;
+}
+
+/*
+ * port_time_allowed - tell if the time entries of pp allow a login on the
+ *                     day of the week wday, at the time dtime (HHMM)
+ */
+static bool port_time_allowed (const struct port *pp, int wday, int dtime)
+{
+	int i;
+
+	/*
+	 * Each time entry is compared against the current
+	 * time.  For entries with the start after the end time,
+	 * the comparison is made so that the time is between
+	 * midnight and either the start or end time.
+	 */
+
+	for (i = 0; pp->pt_times[i].t_start != -1; i++) {
+		if (!(pp->pt_times[i].t_days & PORT_DAY (wday))) {
+			continue;
+		}
+
+		if (pp->pt_times[i].t_start <= pp->pt_times[i].t_end) {
+			if (   (dtime >= pp->pt_times[i].t_start)
+			    && (dtime <= pp->pt_times[i].t_end)) {
+				return true;
+			}
+		} else {
+			if (   (dtime >= pp->pt_times[i].t_start)
+			    || (dtime <= pp->pt_times[i].t_end)) {
+				return true;
+			}
+		}
+	}
+
+	/*
+	 * No matching time entry was found, user shouldn't
+	 * be let in right now.
+	 */
+
+	return false;
+}
+
 /*
  * isttytime - tell if a given user may login at a particular time
  *
@@ -386,11 +700,24 @@ static struct port *getttyuser (const char *tty, const char *user)
 
 bool isttytime (const char *id, const char *port, time_t when)
 {
-	int i;
 	int dtime;
 	struct port *pp;
 	struct tm *tm;
 
+	if (load_rules ()) {
+		const struct port_rule *rule = find_rule (port, id);
+		struct tm tmbuf;
+
+		if (NULL == rule) {
+			return true;
+		}
+		if (   rule->pr_never
+		    || (NULL == localtime_r (&when, &tmbuf))) {
+			return false;
+		}
+		return rule_allowed (rule, week_minute (&tmbuf));
+	}
+
 	/*
 	 * Try to find a matching entry for this user.  Default to
 	 * letting the user in - there are plenty of ways to have an
@@ -419,36 +746,116 @@ bool isttytime (const char *id, const char *port, time_t when)
 	tm = localtime (&when);
 	dtime = tm->tm_hour * 100 + tm->tm_min;
 
-	/*
-	 * Each time entry is compared against the current
-	 * time.  For entries with the start after the end time,
-	 * the comparison is made so that the time is between
-	 * midnight and either the start or end time.
-	 */
+	return port_time_allowed (pp, tm->tm_wday, dtime);
+}
 
-	for (i = 0; pp->pt_times[i].t_start != -1; i++) {
-		if (!(pp->pt_times[i].t_days & PORT_DAY (tm->tm_wday))) {
-			continue;
+/*
+ * ttytime_end - tell when a given user has to be logged out
+ *
+ *	ttytime_end returns the start of the first minute, at or after
+ *	when, at which the user is not allowed to be logged in on port
+ *	anymore, i.e. when if the user is not allowed now.
+ *	(time_t) -1 is returned if the user is allowed for the whole next
+ *	week.
+ *
+ *	The minutes are counted forward from the local time of when; the
+ *	local time is recomputed at each hour (or at each minute found in
+ *	the precomputed rules) to follow the changes of the UTC offset.
+ */
+
+time_t ttytime_end (const char *id, const char *port, time_t when)
+{
+	struct port *pp;
+	struct tm tm;
+	time_t t;
+	int minutes;
+
+	if (load_rules ()) {
+		const struct port_rule *rule = find_rule (port, id);
+		int minute;
+
+		if (NULL == rule) {
+			return (time_t) -1;
+		}
+		if (   rule->pr_never
+		    || (NULL == localtime_r (&when, &tm))) {
+			return when;
+		}
+		minute = week_minute (&tm);
+		if (!rule_allowed (rule, minute)) {
+			return when;
 		}
 
-		if (pp->pt_times[i].t_start <= pp->pt_times[i].t_end) {
-			if (   (dtime >= pp->pt_times[i].t_start)
-			    && (dtime <= pp->pt_times[i].t_end)) {
-				return true;
+		/* Start of the current minute */
+		t = when - tm.tm_sec;
+		while (t - when <= 7 * 24 * 60 * 60) {
+			int d = rule_next_denied (rule, minute);
+			int expected, delta;
+			time_t prev = t;
+
+			if (-1 == d) {
+				return (time_t) -1;
 			}
-		} else {
-			if (   (dtime >= pp->pt_times[i].t_start)
-			    || (dtime <= pp->pt_times[i].t_end)) {
-				return true;
+			t += (time_t) d * 60;
+			if (NULL == localtime_r (&t, &tm)) {
+				return t;
+			}
+
+			/*
+			 * If the UTC offset changed on the way, go back to
+			 * the expected local time.
+			 */
+			expected = (minute + d) % PORT_WEEK;
+			delta = week_minute (&tm) - expected;
+			if (delta > PORT_WEEK / 2) {
+				delta -= PORT_WEEK;
+			} else if (delta < -PORT_WEEK / 2) {
+				delta += PORT_WEEK;
+			}
+			if (   (0 != delta)
+			    && (t - (time_t) delta * 60 > prev)) {
+				t -= (time_t) delta * 60;
+				if (NULL == localtime_r (&t, &tm)) {
+					return t;
+				}
+			}
+
+			minute = week_minute (&tm);
+			if (!rule_allowed (rule, minute)) {
+				return t;
 			}
 		}
+		return (time_t) -1;
 	}
 
-	/*
-	 * No matching time entry was found, user shouldn't
-	 * be let in right now.
-	 */
+	pp = getttyuser (port, id);
+	if (NULL == pp) {
+		return (time_t) -1;
+	}
+	if (0 == pp->pt_times) {
+		return when;
+	}
 
-	return false;
-}
+	t = when;
+	if (NULL == localtime_r (&t, &tm)) {
+		return when;
+	}
+	for (minutes = 0; minutes <= 7 * 24 * 60; minutes++) {
+		if (!port_time_allowed (pp, tm.tm_wday,
+		                        tm.tm_hour * 100 + tm.tm_min)) {
+			return (0 == minutes) ? when : t;
+		}
+
+		/* Start of the next minute */
+		t += 60 - tm.tm_sec;
+		tm.tm_sec = 0;
+		tm.tm_min++;
+		if (60 == tm.tm_min) {
+			if (NULL == localtime_r (&t, &tm)) {
+				return t;
+			}
+		}
+	}
 
+	return (time_t) -1;
+}
@@ -0,0 +1,43 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#ifndef _PROBES_H_
+#define _PROBES_H_
+
+/*
+ * Static probes of the "shadow" provider.
+ *
+ * When <sys/sdt.h> is available, the probes are compiled in as USDT
+ * probes, which bpftrace or perf can attach to, e.g.
+ *	bpftrace -l 'usdt:/usr/sbin/useradd:shadow:*'
+ * A probe which is not attached only costs a nop, but its arguments are
+ * still evaluated: they must be cheap and without side effects.
+ * Without <sys/sdt.h>, the probes and their arguments are compiled out.
+ *
+ * The probes are:
+ *	lock__start (file)		lock__done (file, ret)
+ *	open__start (file)		open__done (file, entries, bytes)
+ *	close__start (file)		close__done (file, ok)
+ *	commit__write (file, entries, bytes)
+ *	commit__publish (file)
+ *	uid__check (uid)		gid__check (gid)
+ *	nss__lookup__start (function)	nss__lookup__done (function, found)
+ *	command__spawn (cmd, pid)	command__exit (cmd, status)
+ *	copy__file__start (path, size)	copy__file__done (path, ret)
+ *	crypt__start ()			crypt__done (ok)
+ */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define PROBE0(name)		DTRACE_PROBE (shadow, name)
+#define PROBE1(name, a)		DTRACE_PROBE1 (shadow, name, a)
+#define PROBE2(name, a, b)	DTRACE_PROBE2 (shadow, name, a, b)
+#define PROBE3(name, a, b, c)	DTRACE_PROBE3 (shadow, name, a, b, c)
+#else
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#endif
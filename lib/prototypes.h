@@ -21,6 +21,8 @@
 
 #include <config.h>
 
+#include <limits.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <utmp.h>
@@ -54,6 +56,7 @@ extern int isexpired (const struct passwd *, /*@null@*/const struct spwd *);
 #ifdef WITH_BTRFS
 extern int btrfs_create_subvolume(const char *path);
 extern int btrfs_remove_subvolume(const char *path);
+extern int btrfs_snapshot_subvolume(const char *src, const char *path);
 extern int btrfs_is_subvolume(const char *path);
 extern int is_btrfs(const char *path);
 #endif
@@ -62,6 +65,48 @@ extern int is_btrfs(const char *path);
 /* basename.c */
 extern /*@observer@*/const char *Basename (const char *str);
 
+/* batchfile.c */
+struct batch_line {
+	unsigned int line;	/* line number in the file */
+	int argc;
+	char **argv;		/* argv[0] is the name of the program */
+};
+extern int batch_read (const char *file,
+                       /*@out@*/struct batch_line **lines,
+                       /*@out@*/size_t *count);
+
+/* Progress of copy_tree() and remove_tree() */
+struct tree_progress {
+	unsigned long files;		/* entries processed */
+	unsigned long long bytes;	/* of the regular files copied */
+	/*@observer@*/const char *path;	/* last entry copied, or root removed,
+					 * valid during the callback */
+};
+typedef void (*tree_progress_cb) (const struct tree_progress *progress);
+
+/* checkstate.c */
+struct check_state {
+	/*@owned@*/ /*@null@*/unsigned long long *known;	/* sorted */
+	size_t nknown;
+	/*@owned@*/ /*@null@*/unsigned long long *checked;
+	size_t nchecked;
+};
+#define CHECK_STATE_INIT	0xcbf29ce484222325ULL
+extern unsigned long long check_state_hash (unsigned long long key,
+                                            /*@null@*/const char *s);
+extern bool check_state_load (/*@out@*/struct check_state *state,
+                              const char *file, const char *tool,
+                              unsigned long options,
+                              const char *const *files);
+extern bool check_state_known (const struct check_state *state,
+                               unsigned long long key);
+extern void check_state_add (struct check_state *state,
+                             unsigned long long key);
+extern int check_state_save (struct check_state *state, const char *file,
+                             const char *tool, unsigned long options,
+                             bool clean, const char *const *files);
+extern void check_state_free (struct check_state *state);
+
 /* chowndir.c */
 extern int chown_tree (const char *root,
                        uid_t old_uid, uid_t new_uid,
@@ -105,17 +150,105 @@ void cleanup_unlock_passwd (/*@null@*/void *unused);
 extern bool console (const char *);
 
 /* copydir.c */
+enum copy_method {
+	COPY_METHOD_AUTO,	/* the fastest one supported */
+	COPY_METHOD_CLONE,	/* FICLONE */
+	COPY_METHOD_RANGE,	/* copy_file_range() */
+	COPY_METHOD_BUFFER,	/* read() and write() */
+};
+extern void copy_tree_set_progress (/*@null@*/tree_progress_cb cb);
+extern void copy_tree_set_method (enum copy_method method);
 extern int copy_tree (const char *src_root, const char *dst_root,
                       bool copy_root,
                       bool reset_selinux,
                       uid_t old_uid, uid_t new_uid,
                       gid_t old_gid, gid_t new_gid);
+extern int copy_skel (const char *skel, const char *dst_root,
+                      bool reset_selinux, uid_t uid, gid_t gid);
+extern int sync_tree (const char *src_root, const char *dst_root,
+                      const char *link_root, bool reset_selinux,
+                      uid_t old_uid, uid_t new_uid,
+                      gid_t old_gid, gid_t new_gid,
+                      /*@null@*/const struct timespec *since,
+                      /*@out@*/unsigned long *changed);
+
+/* dirbatch.c */
+#define DIR_BATCH_SIZE	64
+struct dir_batch {
+	size_t count;
+	char name[DIR_BATCH_SIZE][NAME_MAX + 1];
+	struct stat sb[DIR_BATCH_SIZE];
+	int error[DIR_BATCH_SIZE];	/* errno of the operation, or 0 */
+};
+extern bool dir_batch_add (struct dir_batch *batch, const char *name);
+extern void dir_batch_stat (struct dir_batch *batch, int dir_fd);
+extern int dir_batch_unlink (struct dir_batch *batch, int dir_fd);
+extern unsigned long dir_pool_fds (void);
 
 /* date_to_str.c */
 extern void date_to_str (size_t size, char buf[size], long date);
 
+/* dbindex.c */
+extern int dbindex_write (const char *dbfile);
+extern int dbindex_lookup (const char *dbfile, /*@null@*/const char *name,
+                           unsigned long id, /*@out@*/char **line);
+extern int dbindex_gid_names (const char *dbfile, unsigned long gid,
+                              size_t max, /*@out@*/char ***names);
+extern int dbindex_id_bounds (const char *dbfile, unsigned long min,
+                              unsigned long max, /*@out@*/unsigned long *lowest,
+                              /*@out@*/unsigned long *highest);
+extern int dbindex_member_gids (const char *dbfile, const char *name,
+                                /*@out@*/unsigned long **gids);
+
+/* deadline.c */
+extern void deadline_start (unsigned long ms);
+extern bool deadline_active (void);
+extern unsigned long deadline_remaining (unsigned long max);
+extern bool deadline_expired (void);
+extern int deadline_check (const char *phase);
+
+/* idprobe.c */
+extern int id_probe_cached (const char *dbfile, unsigned long id);
+extern void id_probe_record (const char *dbfile, unsigned long id, bool used);
+extern uint64_t id_probe_stamp (void);
+extern void id_probe_restamp (uint64_t before);
+
+/* idblock.c */
+extern int id_block_range (unsigned long *min, unsigned long *max,
+                           bool (*full) (unsigned long first,
+                                         unsigned long last));
+
+/* idlease.c */
+extern int id_lease_take (const char *dbfile, unsigned long id);
+extern void id_lease_release (const char *dbfile, unsigned long id);
+extern int id_lease_list (const char *dbfile, /*@out@*/unsigned long **ids,
+                          /*@out@*/size_t *count);
+extern bool id_leased (const char *dbfile, unsigned long id);
+
 /* encrypt.c */
 extern /*@exposed@*//*@null@*/char *pw_encrypt (const char *, const char *);
+#ifdef HAVE_CRYPT_R
+struct crypt_data;
+extern /*@null@*/char *pw_encrypt_r (const char *clear, const char *salt,
+                                     struct crypt_data *data);
+struct crypt_batch;
+extern /*@null@*//*@only@*/struct crypt_batch *crypt_batch_start (long nthreads);
+extern void crypt_batch_set_check (struct crypt_batch *batch,
+                                   /*@null@*/const char *(*check) (const char *clear));
+extern ssize_t crypt_batch_add (struct crypt_batch *batch,
+                                const char *clear, const char *salt);
+extern void crypt_batch_finish (struct crypt_batch *batch);
+extern /*@null@*//*@observer@*/const char *crypt_batch_hash (const struct crypt_batch *batch,
+                                                            size_t i,
+                                                            /*@null@*/const char **salt,
+                                                            /*@out@*/int *err);
+extern /*@null@*//*@observer@*/const char *crypt_batch_rejected (const struct crypt_batch *batch,
+                                                                size_t i);
+extern void crypt_batch_free (/*@only@*/struct crypt_batch *batch);
+extern int pw_encrypt_many (size_t n, const char *const clear[],
+                            const char *const salt[], long nthreads,
+                            /*@out@*/char *hash[]);
+#endif				/* HAVE_CRYPT_R */
 
 /* entry.c */
 extern void pw_entry (const char *, struct passwd *);
@@ -129,23 +262,37 @@ extern void sanitize_env (void);
 /* fields.c */
 extern void change_field (char *, size_t, const char *);
 extern int valid_field (const char *, const char *);
+extern size_t split_fields (char *buf, size_t len, char sep,
+                            /*@out@*/char **fields, size_t max);
+extern size_t count_fields (const char *buf, size_t len, char sep);
 
 /* find_new_gid.c */
 extern int find_new_gid (bool sys_group,
                          gid_t *gid,
                          /*@null@*/gid_t const *preferred_gid);
+extern int reserve_new_gid (bool sys_group, gid_t *gid);
 
 /* find_new_uid.c */
 extern int find_new_uid (bool sys_user,
                          uid_t *uid,
                          /*@null@*/uid_t const *preferred_uid);
+extern int find_new_uid_gid (bool sys_user, uid_t *uid);
+extern int reserve_new_uid (bool sys_user, bool with_gids, uid_t *uid);
 
 #ifdef ENABLE_SUBIDS
 /* find_new_sub_gids.c */
-extern int find_new_sub_gids (gid_t *range_start, unsigned long *range_count);
+extern int find_new_sub_gids (uid_t owner, gid_t *range_start,
+                              unsigned long *range_count);
+extern int find_new_sub_gids_many (size_t n, const uid_t *owners,
+                                   unsigned long *range_starts,
+                                   unsigned long *range_count);
 
 /* find_new_sub_uids.c */
-extern int find_new_sub_uids (uid_t *range_start, unsigned long *range_count);
+extern int find_new_sub_uids (uid_t owner, uid_t *range_start,
+                              unsigned long *range_count);
+extern int find_new_sub_uids_many (size_t n, const uid_t *owners,
+                                   unsigned long *range_starts,
+                                   unsigned long *range_count);
 #endif				/* ENABLE_SUBIDS */
 
 
@@ -179,9 +326,14 @@ extern int getulong (const char *numstr, /*@out@*/unsigned long int *result);
 extern /*@null@*/char *fgetsx (/*@returned@*/ /*@out@*/char *, int, FILE *);
 extern int fputsx (const char *, FILE *);
 
+/* grouplist.c */
+extern int get_grouplist (const char *user, gid_t gid,
+                          /*@out@*/gid_t **groups);
+
 /* groupio.c */
 extern void __gr_del_entry (const struct commonio_entry *ent);
-extern /*@observer@*/const struct commonio_db *__gr_get_db (void);
+extern size_t __gr_duplicates (const struct commonio_entry *ent);
+extern struct commonio_db *__gr_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__gr_get_head (void);
 extern void __gr_set_changed (void);
 
@@ -193,6 +345,11 @@ extern void gr_free (/*@out@*/ /*@only@*/struct group *grent);
 /* hushed.c */
 extern bool hushed (const char *username);
 
+/* idmount.c */
+extern int idmap_mount (const char *root,
+                        uid_t old_uid, uid_t new_uid,
+                        gid_t old_gid, gid_t new_gid);
+
 /* audit_help.c */
 #ifdef WITH_AUDIT
 extern int audit_fd;
@@ -206,6 +363,9 @@ extern void audit_logger (int type, const char *pgname, const char *op,
                           const char *name, unsigned int id,
                           shadow_audit_result result);
 void audit_logger_message (const char *message, shadow_audit_result result);
+extern void audit_batch_begin (size_t max);
+extern void audit_batch_flush (void);
+extern void audit_batch_end (void);
 #endif
 
 /* limits.c */
@@ -215,6 +375,10 @@ extern void setup_limits (const struct passwd *);
 
 /* list.c */
 extern /*@only@*/ /*@out@*/char **add_list (/*@returned@*/ /*@only@*/char **, const char *);
+extern /*@only@*/ /*@out@*/char **add_members (/*@returned@*/ /*@only@*/char **,
+                                               char *const *);
+extern /*@only@*/ /*@out@*/char **replace_members (/*@returned@*/ /*@only@*/char **,
+                                                   char *const *);
 extern /*@only@*/ /*@out@*/char **del_list (/*@returned@*/ /*@only@*/char **, const char *);
 extern /*@only@*/ /*@out@*/char **dup_list (char *const *);
 extern bool is_on_list (char *const *list, const char *member);
@@ -236,6 +400,38 @@ extern void login_prompt (const char *, char *, int);
 /* mail.c */
 extern void mailcheck (void);
 
+/* memberset.c */
+/* Member lists shorter than this are scanned instead of hashed */
+#define MEMBER_SET_MIN	32
+struct member_set;
+extern /*@null@*/ /*@only@*/struct member_set *member_set_new (size_t max);
+extern bool member_set_add (struct member_set *set, const char *name);
+extern bool member_set_contains (const struct member_set *set,
+                                 const char *name);
+extern void member_set_free (/*@only@*/ /*@null@*/struct member_set *set);
+
+/* metrics.c */
+enum metrics_counter {
+	METRICS_COMMITS,
+	METRICS_ID_SEARCH,
+	METRICS_COPY_BYTES,
+	METRICS_CACHE_FLUSHES,
+	METRICS_COUNTERS
+};
+enum metrics_histogram {
+	METRICS_LOCK_WAIT,
+	METRICS_COMMIT_TIME,
+	METRICS_FSYNC_TIME,
+	METRICS_HISTOGRAMS
+};
+struct timespec;
+extern bool metrics_on (void);
+extern void metrics_add (enum metrics_counter counter,
+                         /*@null@*/const char *label, unsigned long long n);
+extern void metrics_observe (enum metrics_histogram histogram,
+                             /*@null@*/const char *label,
+                             const struct timespec *start);
+
 /* motd.c */
 extern void motd (void);
 
@@ -245,6 +441,7 @@ extern /*@null@*//*@only@*/struct passwd *get_my_pwent (void);
 /* nss.c */
 #include <libsubid/subid.h>
 extern void nss_init(const char *nsswitch_path);
+extern void nss_reload(const char *nsswitch_path);
 extern bool nss_is_initialized(void);
 
 struct subid_nss_ops {
@@ -291,8 +488,89 @@ struct subid_nss_ops {
 	 */
 	enum subid_status (*find_subid_owners)(unsigned long id, enum subid_type id_type, uid_t **uids, int *count);
 
+	/*
+	 * The following entry points are optional, and NULL if the module
+	 * does not provide them.
+	 */
+
+	/*
+	 * nss_list_owner_ranges_many: list the subid ranges delegated to
+	 * several users.
+	 *
+	 * @owners - array of @n usernames being queried
+	 * @n - number of usernames
+	 * @id_type - subuid or subgid
+	 * @ranges - array of @n pointers to an array of struct subid_range,
+	 *           set as by nss_list_owner_ranges().
+	 * @counts - array of @n integers, set as by nss_list_owner_ranges().
+	 * @status - array of @n statuses, one for each username.
+	 *
+	 * returns success if the module was able to answer the queries, even
+	 * if some of them failed, else an error status.
+	 */
+	enum subid_status (*list_owner_ranges_many)(const char *const *owners, size_t n, enum subid_type id_type, struct subid_range **ranges, int *counts, enum subid_status *status);
+
+	/*
+	 * nss_has_range_many: does a user own several subid ranges
+	 *
+	 * @owner: username
+	 * @ranges: array of @n queried ranges
+	 * @n: number of queried ranges
+	 * @idtype: subuid or subgid
+	 * @result: true if @owner has been allocated all the subid ranges.
+	 *
+	 * returns success if the module was able to determine an answer (true or false),
+	 * else an error status.
+	 */
+	enum subid_status (*has_range_many)(const char *owner, const struct subid_range *ranges, size_t n, enum subid_type idtype, bool *result);
+
+	/*
+	 * nss_cache_token: get a token which changes whenever the subid
+	 * ranges known to the module change.
+	 *
+	 * @id_type - subuid or subgid
+	 * @token - token of the current subid ranges
+	 *
+	 * Answers of the module may be cached for as long as the token does
+	 * not change.
+	 *
+	 * returns success if the module was able to determine the token,
+	 * else an error status.
+	 */
+	enum subid_status (*cache_token)(enum subid_type id_type, unsigned long *token);
+
+	/*
+	 * nss_list_owner_ranges_start: start listing the subid ranges
+	 * delegated to several users, without blocking.
+	 *
+	 * @owners, @n, @id_type - as for nss_list_owner_ranges_many().
+	 *                        @owners stays valid until
+	 *                        nss_list_owner_ranges_finish().
+	 * @fd - file descriptor, owned by the module, which becomes readable
+	 *       when the answers are ready
+	 * @request - handle of the queries
+	 *
+	 * returns success if the queries were started, else an error status.
+	 * The module must then provide nss_list_owner_ranges_finish().
+	 */
+	enum subid_status (*list_owner_ranges_start)(const char *const *owners, size_t n, enum subid_type id_type, int *fd, void **request);
+
+	/*
+	 * nss_list_owner_ranges_finish: get the answers of the queries of
+	 * @request, waiting for them if needed, and free @request.
+	 *
+	 * @ranges, @counts, @status - as for nss_list_owner_ranges_many()
+	 *
+	 * returns success if the module was able to answer the queries, even
+	 * if some of them failed, else an error status.
+	 */
+	enum subid_status (*list_owner_ranges_finish)(void *request, struct subid_range **ranges, int *counts, enum subid_status *status);
+
 	/* The dlsym handle to close */
 	void *handle;
+
+	/* Module replaced by a reload, closed at exit */
+	struct subid_nss_ops *previous;
 };
 
 extern struct subid_nss_ops *get_subid_nss_handle(void);
@@ -303,13 +581,32 @@ extern struct subid_nss_ops *get_subid_nss_handle(void);
 extern int do_pam_passwd_non_interactive (const char *pam_service,
                                            const char *username,
                                            const char* password);
+extern void pam_passwd_non_interactive_end (void);
 #endif				/* USE_PAM */
 
 /* obscure.c */
 #ifndef USE_PAM
 extern bool obscure (const char *, const char *, const struct passwd *);
+extern /*@observer@*//*@null@*/const char *obscure_check (const char *old,
+                                                          const char *new,
+                                                          /*@null@*/const struct passwd *pwdp);
+extern void obscure_preload (void);
 #endif
 
+/* output.c */
+enum output_format {
+	OUTPUT_TEXT,
+	OUTPUT_TSV,
+	OUTPUT_JSON
+};
+extern bool output_set_format (const char *name);
+extern bool output_structured (void);
+extern void output_begin (const char *const *fields);
+extern void output_str (/*@null@*/const char *value);
+extern void output_num (long long value);
+extern void output_row_end (void);
+extern void output_end (void);
+
 /* pam_pass.c */
 #ifdef USE_PAM
 extern void do_pam_passwd (const char *user, bool silent, bool change_expired);
@@ -317,22 +614,42 @@ extern void do_pam_passwd (const char *user, bool silent, bool change_expired);
 
 /* port.c */
 extern bool isttytime (const char *, const char *, time_t);
+extern time_t ttytime_end (const char *, const char *, time_t);
 
 /* prefix_flag.c */
 extern const char* process_prefix_flag (const char* short_opt, int argc, char **argv);
+extern /*@null@*/const char *process_shard_flag (int argc, char **argv);
+extern void process_deadline_flag (int argc, char **argv);
 extern struct group *prefix_getgrnam(const char *name);
 extern struct group *prefix_getgrgid(gid_t gid);
 extern struct passwd *prefix_getpwuid(uid_t uid);
+extern bool prefix_uid_used (uid_t uid);
+extern bool prefix_gid_used (gid_t gid);
+#define ID_PREFETCH_MAX	64
+extern void prefix_prefetch_ids (const unsigned long *ids, size_t n,
+                                 bool uids, bool gids);
 extern struct passwd *prefix_getpwnam(const char* name);
 extern struct spwd *prefix_getspnam(const char* name);
 extern struct group *prefix_getgr_nam_gid(const char *grname);
 extern void prefix_setpwent(void);
 extern struct passwd* prefix_getpwent(void);
 extern void prefix_endpwent(void);
+extern char **prefix_gid_users (gid_t gid, size_t max);
 extern void prefix_setgrent(void);
 extern struct group* prefix_getgrent(void);
 extern void prefix_endgrent(void);
 
+/* prevalidate.c */
+extern /*@null@*/FILE *validate_input (FILE *in,
+                                       bool (*check) (char *line, int lineno,
+                                                      char *err,
+                                                      size_t errsize));
+
+/* progress.c */
+extern void progress_start (const char *action, const char *root);
+extern void progress_report (const struct tree_progress *progress);
+extern void progress_end (void);
+
 /* pwd2spwd.c */
 #ifndef USE_PAM
 extern struct spwd *pwd_to_spwd (const struct passwd *);
@@ -348,6 +665,7 @@ extern void pwd_init (void);
 
 /* pwio.c */
 extern void __pw_del_entry (const struct commonio_entry *ent);
+extern size_t __pw_duplicates (const struct commonio_entry *ent);
 extern struct commonio_db *__pw_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__pw_get_head (void);
 
@@ -355,13 +673,24 @@ extern /*@dependent@*/ /*@null@*/struct commonio_entry *__pw_get_head (void);
 extern /*@null@*/ /*@only@*/struct passwd *__pw_dup (const struct passwd *pwent);
 extern void pw_free (/*@out@*/ /*@only@*/struct passwd *pwent);
 
+/* cryptcost.c */
+extern long crypt_cost_cached (const char *method);
+extern int crypt_cost_save (const char *method, long cost);
+
 /* csrand.c */
 unsigned long csrand (void);
+void csrand_bytes (void *buf, size_t n);
 unsigned long csrand_uniform (unsigned long n);
 unsigned long csrand_interval (unsigned long min, unsigned long max);
 
 /* remove_tree.c */
 extern int remove_tree (const char *root, bool remove_root);
+extern int remove_tree_at (int at_fd, const char *path, bool remove_root);
+extern void remove_tree_set_progress (/*@null@*/tree_progress_cb cb);
+extern int remove_tree_async (const char *root);
+extern int removal_queue_add (const char *queue, const char *user,
+                              const char *path);
+extern int removal_queue_drain (const char *queue, bool async);
 
 /* rlogin.c */
 extern int do_rlogin (const char *remote_host, char *name, size_t namelen,
@@ -373,18 +702,52 @@ extern void process_root_flag (const char* short_opt, int argc, char **argv);
 /* salt.c */
 extern /*@observer@*/const char *crypt_make_salt (/*@null@*//*@observer@*/const char *meth, /*@null@*/void *arg);
 
+/* secret.c */
+/* Size of a slot, for a password of agetpass() or a line of the bulk tools */
+#define SECRET_SIZE	(BUFSIZ + 1)
+extern /*@null@*/char *secret_alloc (void);
+extern /*@null@*/char *secret_strdup (const char *clear);
+extern void secret_free (/*@null@*/char *s);
+
+/* selection.c */
+struct user_selection {
+	bool active;	/* at least one predicate is set */
+	unsigned long uid_min;
+	unsigned long uid_max;
+	bool has_uid_min;
+	bool has_uid_max;
+	bool has_group;
+	gid_t gid;
+	/*@null@*/char **members;
+	/*@null@*/const char *shell;
+	bool has_age;
+	long age;
+};
+#define USER_SELECTION_INIT	{ false, 0, 0, false, false, false, 0, NULL, NULL, false, 0 }
+extern bool select_uids (struct user_selection *sel, const char *range);
+extern bool select_group (struct user_selection *sel, const char *group);
+extern void select_shell (struct user_selection *sel, const char *pattern);
+extern bool select_age (struct user_selection *sel, const char *days);
+extern bool select_user (const struct user_selection *sel,
+                         const struct passwd *pw,
+                         /*@null@*/const struct spwd *sp);
+
 /* selinux.c */
 #ifdef WITH_SELINUX
 extern int set_selinux_file_context (const char *dst_name, mode_t mode);
 extern void reset_selinux_handle (void);
 extern int reset_selinux_file_context (void);
 extern int check_selinux_permit (const char *perm_name);
+extern unsigned long selinux_calls_saved (void);
 #endif
 
 /* semanage.c */
 #ifdef WITH_SELINUX
 extern int set_seuser(const char *login_name, const char *seuser_name);
 extern int del_seuser(const char *login_name);
+extern int seuser_batch_begin (void);
+extern int seuser_batch_commit (void);
+extern void seuser_batch_abort (void);
 #endif
 
 /* setugid.c */
@@ -403,9 +766,14 @@ extern void setup (struct passwd *);
 extern void setup_env (struct passwd *);
 
 /* sgetgrent.c */
+extern int sgetgrent_r (const char *buf, struct group *grent,
+                        char *buffer, size_t buflen, struct group **result);
+extern size_t sgetgrent_size (const char *buf);
 extern struct group *sgetgrent (const char *buf);
 
 /* sgetpwent.c */
+extern int sgetpwent_r (const char *buf, struct passwd *pwent,
+                        char *buffer, size_t buflen, struct passwd **result);
 extern struct passwd *sgetpwent (const char *buf);
 
 /* sgetspent.c */
@@ -415,14 +783,18 @@ extern struct spwd *sgetspent (const char *string);
 
 /* sgroupio.c */
 extern void __sgr_del_entry (const struct commonio_entry *ent);
+extern size_t __sgr_duplicates (const struct commonio_entry *ent);
 extern /*@null@*/ /*@only@*/struct sgrp *__sgr_dup (const struct sgrp *sgent);
 extern void sgr_free (/*@out@*/ /*@only@*/struct sgrp *sgent);
+extern struct commonio_db *__sgr_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__sgr_get_head (void);
 extern void __sgr_set_changed (void);
 
 /* shadowio.c */
+extern struct commonio_db *__spw_get_db (void);
 extern /*@dependent@*/ /*@null@*/struct commonio_entry *__spw_get_head (void);
 extern void __spw_del_entry (const struct commonio_entry *ent);
+extern size_t __spw_duplicates (const struct commonio_entry *ent);
 
 /* shadowmem.c */
 extern /*@null@*/ /*@only@*/struct spwd *__spw_dup (const struct spwd *spent);
@@ -431,6 +803,16 @@ extern void spw_free (/*@out@*/ /*@only@*/struct spwd *spent);
 /* shell.c */
 extern int shell (const char *file, /*@null@*/const char *arg, char *const envp[]);
 
+/* shells.c */
+extern int shell_is_listed (const char *sh);
+
+/* sortedfile.c */
+extern int sorted_keycmp (const char *a, size_t alen,
+                          const char *b, size_t blen);
+extern int sorted_mark (int fd);
+extern int sorted_lookup (const char *dbfile, const char *key,
+                          /*@out@*/char ***lines);
+
 /* spawn.c */
 extern int run_command (const char *cmd, const char *argv[],
                         /*@null@*/const char *envp[], /*@out@*/int *status);
@@ -452,6 +834,29 @@ extern void sulog (const char *tty,
 /* sub.c */
 extern void subsystem (const struct passwd *);
 
+/* timings.c */
+struct timespec;
+enum timing_db_phase {
+	TIMING_DB_LOCK,
+	TIMING_DB_OPEN,
+	TIMING_DB_LOOKUP,
+	TIMING_DB_BACKUP,
+	TIMING_DB_WRITE,
+	TIMING_DB_SYNC,
+	TIMING_DB_RENAME,
+	TIMING_DB_HOLD,
+	TIMING_DB_PHASES
+};
+extern void timing_init (void);
+extern void timing_start (/*@out@*/struct timespec *start);
+extern void timing_stop (const char *phase, const struct timespec *start);
+extern void timing_db_stop (const char *name, enum timing_db_phase phase,
+                            const struct timespec *start);
+extern void timing_db_count (const char *name, unsigned long entries,
+                             unsigned long long bytes_read,
+                             unsigned long long bytes_written);
+extern void timing_report (const char *user);
+
 /* ttytype.c */
 extern void ttytype (const char *);
 
@@ -466,7 +871,12 @@ extern int set_filesize_limit (int blocks);
 /* user_busy.c */
 extern int user_busy (const char *name, uid_t uid);
 
+/* user_exists.c */
+extern bool user_exists (const char *name);
+
 /* utmp.c */
+extern unsigned long count_sessions (const char *name, unsigned long max,
+                                     bool alive);
 extern /*@null@*/struct utmp *get_current_utmp (void);
 extern struct utmp *prepare_utmp (const char *name,
                                   const char *line,
@@ -17,6 +17,7 @@
 #include <signal.h>
 #include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include "prototypes.h"
 #include "defines.h"
@@ -51,6 +52,7 @@ int pw_auth (const char *cipher,
 	char *clear = NULL;
 	const char *cp;
 	const char *encrypted;
+	struct timespec start;
 	int retval;
 
 #ifdef	SKEY
@@ -155,7 +157,9 @@ int pw_auth (const char *cipher,
 	 * the results there as well.
 	 */
 
+	timing_start (&start);
 	encrypted = pw_encrypt (input, cipher);
+	timing_stop ("crypt", &start);
 	if (NULL != encrypted) {
 		retval = strcmp (encrypted, cipher);
 	} else {
@@ -12,12 +12,14 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include "prototypes.h"
 #include "defines.h"
 #include <pwd.h>
 #include <stdio.h>
 #include "commonio.h"
 #include "pwio.h"
+#include "sssd.h"
 
 static /*@null@*/ /*@only@*/void *passwd_dup (const void *ent)
 {
@@ -26,6 +28,31 @@ static /*@null@*/ /*@only@*/void *passwd_dup (const void *ent)
 	return __pw_dup (pw);
 }
 
+static /*@null@*/ /*@dependent@*/void *passwd_parse_arena (struct commonio_db *db,
+                                                           const char *line)
+{
+	struct passwd *pw, *result;
+	size_t len = strlen (line) + 1;
+
+	if (len > PASSWD_ENTRY_MAX_LENGTH) {
+		return sgetpwent (line);	/* reports the corrupted entry */
+	}
+
+	pw = commonio_alloc (db, sizeof *pw + len);
+	if (NULL == pw) {
+		return NULL;
+	}
+	/* The libc might define other fields. */
+	memset (pw, 0, sizeof *pw);
+	(void) sgetpwent_r (line, pw, (char *) (pw + 1), len, &result);
+	if (NULL == result) {
+		/* Released with the arena */
+		errno = EINVAL;
+	}
+
+	return result;
+}
+
 static void passwd_free (/*@out@*/ /*@only@*/void *ent)
 {
 	struct passwd *pw = ent;
@@ -40,11 +67,49 @@ static const char *passwd_getname (const void *ent)
 	return pw->pw_name;
 }
 
+static unsigned long passwd_getid (const void *ent)
+{
+	const struct passwd *pw = ent;
+
+	return pw->pw_uid;
+}
+
 static void *passwd_parse (const char *line)
 {
 	return sgetpwent (line);
 }
 
+/*
+ * passwd_parse_fields - Convert only the given PW_FIELD_* of line
+ *
+ *	See commonio_scan_fields().
+ */
+static void *passwd_parse_fields (char *line, size_t len, unsigned int fields)
+{
+	static struct passwd pwent;
+	char *f[7];
+
+	if (split_fields (line, len, ':', f, 7) != 7) {
+		return NULL;
+	}
+	pwent.pw_name = (fields & PW_FIELD_NAME) ? f[0] : NULL;
+	pwent.pw_passwd = (fields & PW_FIELD_PASSWD) ? f[1] : NULL;
+	pwent.pw_uid = 0;
+	if (   ((fields & PW_FIELD_UID) != 0)
+	    && (('\0' == *f[2]) || (get_uid (f[2], &pwent.pw_uid) == 0))) {
+		return NULL;
+	}
+	pwent.pw_gid = 0;
+	if (   ((fields & PW_FIELD_GID) != 0)
+	    && (('\0' == *f[3]) || (get_gid (f[3], &pwent.pw_gid) == 0))) {
+		return NULL;
+	}
+	pwent.pw_gecos = (fields & PW_FIELD_GECOS) ? f[4] : NULL;
+	pwent.pw_dir = (fields & PW_FIELD_DIR) ? f[5] : NULL;
+	pwent.pw_shell = (fields & PW_FIELD_SHELL) ? f[6] : NULL;
+	return &pwent;
+}
+
 static int passwd_put (const void *ent, FILE * file)
 {
 	const struct passwd *pw = ent;
@@ -75,7 +140,16 @@ static struct commonio_ops passwd_ops = {
 	fgets,
 	fputs,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	NULL,			/* close_hook */
+	passwd_getid,
+	NULL,			/* dup_arena */
+	passwd_parse_arena,
+	SSSD_DB_PASSWD,
+	NULL,			/* publish_hook */
+	NULL,			/* getmembers */
+	COMMONIO_DIRECT_FIELDS (struct passwd, pw_name, pw_uid),
+	passwd_getname,		/* sortkey */
+	passwd_parse_fields
 };
 
 static struct commonio_db passwd_db = {
@@ -103,6 +177,11 @@ int pw_setdbname (const char *filename)
 	return commonio_setname (&passwd_db, filename);
 }
 
+int pw_setshard (const char *shard)
+{
+	return commonio_setshard (&passwd_db, shard);
+}
+
 /*@observer@*/const char *pw_dbname (void)
 {
 	return passwd_db.filename;
@@ -123,16 +202,20 @@ int pw_open (int mode)
 	return commonio_locate (&passwd_db, name);
 }
 
-/*@observer@*/ /*@null@*/const struct passwd *pw_locate_uid (uid_t uid)
+/*
+ * pw_locate_sorted - Same as pw_locate(), for names given in ascending
+ *                    order
+ *
+ *	See commonio_locate_sorted().
+ */
+/*@observer@*/ /*@null@*/const struct passwd *pw_locate_sorted (const char *name)
 {
-	const struct passwd *pwd;
-
-	pw_rewind ();
-	while (   ((pwd = pw_next ()) != NULL)
-	       && (pwd->pw_uid != uid)) {
-	}
+	return commonio_locate_sorted (&passwd_db, name);
+}
 
-	return pwd;
+/*@observer@*/ /*@null@*/const struct passwd *pw_locate_uid (uid_t uid)
+{
+	return commonio_locate_id (&passwd_db, uid);
 }
 
 int pw_update (const struct passwd *pw)
@@ -150,6 +233,29 @@ int pw_rewind (void)
 	return commonio_rewind (&passwd_db);
 }
 
+/*
+ * pw_scan - Call fn for each entry of the file, without loading it
+ *
+ *	See commonio_scan().
+ */
+int pw_scan (int (*fn) (const struct passwd *, void *), void *arg)
+{
+	return commonio_scan (&passwd_db, (int (*) (const void *, void *)) fn, arg);
+}
+
+/*
+ * pw_scan_fields - Same as pw_scan(), with only the given PW_FIELD_* of
+ *                  the entries
+ *
+ *	See commonio_scan_fields().
+ */
+int pw_scan_fields (unsigned int fields,
+                    int (*fn) (const struct passwd *, void *), void *arg)
+{
+	return commonio_scan_fields (&passwd_db, fields,
+	                             (int (*) (const void *, void *)) fn, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct passwd *pw_next (void)
 {
 	return commonio_next (&passwd_db);
@@ -167,7 +273,7 @@ int pw_unlock (void)
 
 /*@null@*/struct commonio_entry *__pw_get_head (void)
 {
-	return passwd_db.head;
+	return commonio_entries (&passwd_db);
 }
 
 void __pw_del_entry (const struct commonio_entry *ent)
@@ -175,6 +281,11 @@ void __pw_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&passwd_db, ent);
 }
 
+size_t __pw_duplicates (const struct commonio_entry *ent)
+{
+	return commonio_duplicates (&passwd_db, ent);
+}
+
 struct commonio_db *__pw_get_db (void)
 {
 	return &passwd_db;
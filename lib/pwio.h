@@ -15,16 +15,31 @@
 #include <sys/types.h>
 #include <pwd.h>
 
+/* The fields of pw_scan_fields() */
+#define PW_FIELD_NAME	(1U << 0)
+#define PW_FIELD_PASSWD	(1U << 1)
+#define PW_FIELD_UID	(1U << 2)
+#define PW_FIELD_GID	(1U << 3)
+#define PW_FIELD_GECOS	(1U << 4)
+#define PW_FIELD_DIR	(1U << 5)
+#define PW_FIELD_SHELL	(1U << 6)
+
 extern int pw_close (void);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_locate (const char *name);
+extern /*@observer@*/ /*@null@*/const struct passwd *pw_locate_sorted (const char *name);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_locate_uid (uid_t uid);
 extern int pw_lock (void);
 extern int pw_setdbname (const char *filename);
+extern int pw_setshard (const char *shard);
 extern /*@observer@*/const char *pw_dbname (void);
 extern /*@observer@*/ /*@null@*/const struct passwd *pw_next (void);
 extern int pw_open (int mode);
 extern int pw_remove (const char *name);
 extern int pw_rewind (void);
+extern int pw_scan (int (*fn) (const struct passwd *, void *), void *arg);
+extern int pw_scan_fields (unsigned int fields,
+                           int (*fn) (const struct passwd *, void *),
+                           void *arg);
 extern int pw_unlock (void);
 extern int pw_update (const struct passwd *pw);
 extern int pw_sort (void);
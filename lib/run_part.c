@@ -1,48 +1,305 @@
+#include <config.h>
+
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <lib/prototypes.h>
+#include "defines.h"
+#include "getdef.h"
 #include "run_part.h"
 #include "shadowlog_internal.h"
 
-int run_part (char *script_path, const char *name, const char *action)
+/*
+ * The hooks of a directory are run one after another, in alphabetical
+ * order. The hooks of a subdirectory whose name ends with ".parallel"
+ * are independent: they are all started at once, at the place of the
+ * subdirectory in that order, and waited for before the next hooks.
+ *
+ * With HOOK_TIMEOUT in login.defs, a hook which runs for longer than
+ * that many seconds is killed, and fails. So is a hook still running at
+ * the deadline of the tool (see deadline.c).
+ */
+
+#define PARALLEL_SUFFIX	".parallel"
+#define POLL_INTERVAL_MS	10
+
+struct part {
+	char *path;
+	const char *label;	/* for the messages */
+	pid_t pid;
+	int status;
+	struct timespec start;
+};
+
+static long elapsed_ms (const struct timespec *start)
+{
+	struct timespec now;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &now);
+	return   (now.tv_sec - start->tv_sec) * 1000
+	       + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+/*
+ * start_part - Start a hook.
+ *
+ *	Return the PID of the hook, or -1 if it could not be started.
+ */
+static pid_t start_part (char *script_path, const char *name,
+                         const char *action)
 {
-	int pid;
-	int wait_status;
-	int pid_status;
+	pid_t pid;
 	char *args[] = { script_path, NULL };
 
-	pid=fork();
-	if (pid==-1) {
+	pid = fork ();
+	if (-1 == pid) {
 		perror ("Could not fork");
-		return 1;
+		return -1;
 	}
-	if (pid==0) {
-		setenv ("ACTION",action,1);
-		setenv ("SUBJECT",name,1);
-		execv (script_path,args);
+	if (0 == pid) {
+		setenv ("ACTION", action, 1);
+		setenv ("SUBJECT", name, 1);
+		execv (script_path, args);
 		perror ("execv");
-		exit(1);
+		exit (1);
+	}
+	return pid;
+}
+
+/*
+ * end_part - Record the end of a hook.
+ */
+static void end_part (struct part *part, int status)
+{
+	part->status = status;
+	part->pid = -1;
+	SYSLOG ((LOG_INFO, "hook %s exited with status %d after %ld ms",
+	         part->path, status, elapsed_ms (&part->start)));
+}
+
+/*
+ * wait_parts - Wait for the hooks of parts which were started.
+ *
+ *	The hooks still running after timeout seconds (if not 0), or at
+ *	the deadline, are killed, and their status is set to 1.
+ */
+static void wait_parts (struct part *parts, size_t n, unsigned long timeout)
+{
+	struct timespec start, pause;
+	unsigned long limit;	/* ms, 0 for none */
+	size_t running = 0;
+	size_t i;
+	int status;
+	pid_t pid;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &start);
+	limit = timeout * 1000;
+	if (deadline_active ()) {
+		limit = deadline_remaining ((0 == limit) ? ULONG_MAX : limit);
+		if (0 == limit) {
+			limit = 1;	/* kill them at once */
+		}
+	}
+	for (i = 0; i < n; i++) {
+		if (-1 != parts[i].pid) {
+			running++;
+		}
+	}
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = POLL_INTERVAL_MS * 1000000L;
+	while (0 != running) {
+		for (i = 0; i < n; i++) {
+			if (-1 == parts[i].pid) {
+				continue;
+			}
+			pid = waitpid (parts[i].pid, &status,
+			               (0 == limit) ? 0 : WNOHANG);
+			if (pid == parts[i].pid) {
+				end_part (&parts[i], status);
+				running--;
+			} else if ((-1 == pid) && (EINTR != errno)) {
+				perror ("waitpid");
+				end_part (&parts[i], 1);
+				running--;
+			}
+		}
+		if ((0 == running) || (0 == limit)) {
+			continue;
+		}
+
+		if ((unsigned long) elapsed_ms (&start) < limit) {
+			(void) nanosleep (&pause, NULL);
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			if (-1 == parts[i].pid) {
+				continue;
+			}
+			if (deadline_check ("hook") == 0) {
+				fprintf (shadow_logfd,
+				         "%s: timed out after %lu seconds.\n",
+				         parts[i].label, timeout);
+			}
+			(void) kill (parts[i].pid, SIGKILL);
+			while (   (waitpid (parts[i].pid, &status, 0) == -1)
+			       && (EINTR == errno)) {
+			}
+			end_part (&parts[i], 1);
+			running--;
+		}
+	}
+}
+
+/*
+ * run_part - Run a hook, and return its wait status, or 1 if it could
+ *            not be run.
+ */
+int run_part (char *script_path, const char *name, const char *action)
+{
+	struct part part;
+
+	part.path = script_path;
+	part.label = script_path;
+	(void) clock_gettime (CLOCK_MONOTONIC, &part.start);
+	part.pid = start_part (script_path, name, action);
+	if (-1 == part.pid) {
+		return 1;
+	}
+	wait_parts (&part, 1, getdef_ulong ("HOOK_TIMEOUT", 0));
+	return part.status;
+}
+
+/*
+ * is_hook - Check if the directory entry path is a hook.
+ *
+ *	Return 1 if it is a hook, 0 if it is not, -1 if it cannot be
+ *	checked.
+ */
+static int is_hook (const char *path, /*@out@*/struct stat *sb)
+{
+	if (stat (path, sb) == -1) {
+		perror ("stat");
+		return -1;
+	}
+	return S_ISREG (sb->st_mode) ? 1 : 0;
+}
+
+static /*@null@*/char *join_path (const char *directory, const char *name)
+{
+	size_t len = strlen (directory) + strlen (name) + 2;
+	char *s;
+
+	s = malloc (len);
+	if (NULL == s) {
+		printf ("could not allocate memory\n");
+		return NULL;
+	}
+	(void) snprintf (s, len, "%s/%s", directory, name);
+	return s;
+}
+
+static void free_namelist (struct dirent **namelist, int count)
+{
+	int n;
+
+	for (n = 0; n < count; n++) {
+		free (namelist[n]);
 	}
+	free (namelist);
+}
+
+/*
+ * run_parallel - Run at once the hooks of a ".parallel" directory.
+ *
+ *	Return 0 if they all exited cleanly.
+ */
+static int run_parallel (const char *directory, const char *name,
+                         const char *action)
+{
+	struct dirent **namelist;
+	struct part *parts;
+	struct stat sb;
+	size_t nparts = 0;
+	size_t i;
+	int scanlist;
+	int n;
+	int result = 0;
 
-	pid_status = wait (&wait_status);
-	if (pid_status == pid) {
-		return (wait_status);
+	scanlist = scandir (directory, &namelist, 0, alphasort);
+	if (scanlist <= 0) {
+		return 0;
+	}
+	parts = calloc (scanlist, sizeof *parts);
+	if (NULL == parts) {
+		printf ("could not allocate memory\n");
+		free_namelist (namelist, scanlist);
+		return 1;
 	}
 
-	perror ("waitpid");
-	return (1);
+	for (n = 0; n < scanlist; n++) {
+		struct part *part = &parts[nparts];
+		int hook;
+
+		part->path = join_path (directory, namelist[n]->d_name);
+		if (NULL == part->path) {
+			result = 1;
+			break;
+		}
+		hook = is_hook (part->path, &sb);
+		if (1 != hook) {
+			free (part->path);
+			if (-1 == hook) {
+				result = 1;
+				break;
+			}
+			continue;
+		}
+		part->label = namelist[n]->d_name;
+		(void) clock_gettime (CLOCK_MONOTONIC, &part->start);
+		part->pid = start_part (part->path, name, action);
+		part->status = 1;
+		nparts++;
+	}
+
+	/* Even if a hook could not be started, wait for the others */
+	wait_parts (parts, nparts, getdef_ulong ("HOOK_TIMEOUT", 0));
+
+	for (i = 0; i < nparts; i++) {
+		if (0 != parts[i].status) {
+			fprintf (shadow_logfd, "%s: did not exit cleanly.\n",
+			         parts[i].label);
+			result = 1;
+		}
+		free (parts[i].path);
+	}
+	free (parts);
+	free_namelist (namelist, scanlist);
+	return result;
+}
+
+static bool is_parallel (const char *name)
+{
+	size_t len = strlen (name);
+
+	return    (len > strlen (PARALLEL_SUFFIX))
+	       && (strcmp (name + len - strlen (PARALLEL_SUFFIX),
+	                   PARALLEL_SUFFIX) == 0);
 }
 
 int run_parts (const char *directory, const char *name, const char *action)
 {
 	struct dirent **namelist;
+	struct timespec start;
 	int scanlist;
 	int n;
 	int execute_result = 0;
@@ -52,53 +309,51 @@ int run_parts (const char *directory, const char *name, const char *action)
 		return (0);
 	}
 
+	timing_start (&start);
 	for (n=0; n<scanlist; n++) {
-		int path_length;
 		struct stat sb;
+		char *s;
 
-		path_length=strlen(directory) + strlen(namelist[n]->d_name) + 2;
-		char *s = (char*)malloc(path_length);
-		if (!s) {
-			printf ("could not allocate memory\n");
-			for (; n<scanlist; n++) {
-				free (namelist[n]);
-			}
-			free (namelist);
-			return (1);
+		s = join_path (directory, namelist[n]->d_name);
+		if (NULL == s) {
+			execute_result = 1;
+			break;
+		}
+
+		if (deadline_check ("hook") != 0) {
+			free (s);
+			execute_result = 1;
+			break;
 		}
-		snprintf (s, path_length, "%s/%s", directory, namelist[n]->d_name);
 
 		execute_result = 0;
 		if (stat (s, &sb) == -1) {
 			perror ("stat");
 			free (s);
-			for (; n<scanlist; n++) {
-				free (namelist[n]);
-			}
-			free (namelist);
-			return (1);
+			execute_result = 1;
+			break;
 		}
 
 		if (S_ISREG (sb.st_mode) || S_ISLNK (sb.st_mode)) {
 			execute_result = run_part (s, name, action);
+			if (execute_result!=0) {
+				fprintf (shadow_logfd,
+					"%s: did not exit cleanly.\n",
+				    namelist[n]->d_name);
+			}
+		} else if (   S_ISDIR (sb.st_mode)
+		           && is_parallel (namelist[n]->d_name)) {
+			execute_result = run_parallel (s, name, action);
 		}
 
 		free (s);
 
 		if (execute_result!=0) {
-			fprintf (shadow_logfd,
-				"%s: did not exit cleanly.\n",
-			    namelist[n]->d_name);
-			for (; n<scanlist; n++) {
-				free (namelist[n]);
-			}
 			break;
 		}
-
-		free (namelist[n]);
 	}
-	free (namelist);
+	timing_stop ("hooks", &start);
+	free_namelist (namelist, scanlist);
 
 	return (execute_result);
 }
-
@@ -0,0 +1,176 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Pool of slots for the clear text passwords
+ *
+ * The slots of SECRET_SIZE bytes are taken from chunks mapped once and
+ * kept until the process exits, so that the tools which handle many
+ * passwords (the bulk tools, and their encryption threads) reuse the
+ * same slots instead of allocating memory for each password.
+ *
+ * The chunks are locked in memory, so that their content is never
+ * written to swap, and excluded from the core dumps. Locking is only
+ * done when the limit of locked memory allows it. Each chunk is
+ * surrounded by inaccessible guard pages, which stop a buffer overrun
+ * from reading or writing past the chunk. A slot is wiped when it is
+ * released.
+ */
+
+#define SECRET_SLOTS	8	/* slots per chunk */
+/* The slots are aligned on 64 bytes */
+#define SECRET_STRIDE	((SECRET_SIZE + 63) & ~(size_t) 63)
+
+struct secret_chunk {
+	/*@null@*/struct secret_chunk *next;
+	char *slots;		/* SECRET_SLOTS slots of SECRET_STRIDE bytes */
+	unsigned int used;	/* bit i is set if slot i is in use */
+};
+
+static pthread_mutex_t secret_lock = PTHREAD_MUTEX_INITIALIZER;
+/*@null@*/static struct secret_chunk *chunks = NULL;
+
+/*
+ * chunk_map - Map a new chunk, between two guard pages.
+ *
+ *	Return NULL on failure (errno set).
+ */
+static /*@null@*/struct secret_chunk *chunk_map (void)
+{
+	struct secret_chunk *c;
+	size_t page = (size_t) sysconf (_SC_PAGESIZE);
+	size_t len = (SECRET_SLOTS * SECRET_STRIDE + page - 1) & ~(page - 1);
+	char *map;
+
+	c = malloc (sizeof *c);
+	if (NULL == c) {
+		return NULL;
+	}
+	map = mmap (NULL, len + 2 * page, PROT_NONE,
+	            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (MAP_FAILED == map) {
+		free (c);
+		return NULL;
+	}
+	if (mprotect (map + page, len, PROT_READ | PROT_WRITE) != 0) {
+		int saved_errno = errno;
+
+		(void) munmap (map, len + 2 * page);
+		free (c);
+		errno = saved_errno;
+		return NULL;
+	}
+	/* Best effort: the limit of locked memory may be reached */
+	(void) mlock (map + page, len);
+#ifdef MADV_DONTDUMP
+	(void) madvise (map + page, len, MADV_DONTDUMP);
+#endif
+
+	c->slots = map + page;
+	c->used = 0;
+	c->next = chunks;
+	chunks = c;
+	return c;
+}
+
+/*
+ * secret_alloc - Take a slot of SECRET_SIZE bytes for a clear text
+ *	password.
+ *
+ *	The slot is filled with zeros. It shall be released with
+ *	secret_free().
+ *
+ *	Return NULL if no slot could be mapped (errno set).
+ */
+/*@null@*/char *secret_alloc (void)
+{
+	struct secret_chunk *c;
+	char *s = NULL;
+	unsigned int i;
+
+	(void) pthread_mutex_lock (&secret_lock);
+	for (c = chunks; NULL != c; c = c->next) {
+		if (((1U << SECRET_SLOTS) - 1) != c->used) {
+			break;
+		}
+	}
+	if (NULL == c) {
+		c = chunk_map ();
+	}
+	if (NULL != c) {
+		i = 0;
+		while (0 != (c->used & (1U << i))) {
+			i++;
+		}
+		c->used |= 1U << i;
+		s = c->slots + i * SECRET_STRIDE;
+	}
+	(void) pthread_mutex_unlock (&secret_lock);
+	return s;
+}
+
+/*
+ * secret_strdup - Copy the clear text password clear in a slot.
+ *
+ *	Return NULL if clear does not fit in a slot (with errno set to
+ *	ERANGE), or if no slot could be mapped.
+ */
+/*@null@*/char *secret_strdup (const char *clear)
+{
+	size_t len = strlen (clear);
+	char *s;
+
+	if (len >= SECRET_SIZE) {
+		errno = ERANGE;
+		return NULL;
+	}
+	s = secret_alloc ();
+	if (NULL != s) {
+		memcpy (s, clear, len + 1);
+	}
+	return s;
+}
+
+/*
+ * secret_free - Wipe a slot of secret_alloc() or secret_strdup(), and
+ *	release it.
+ *
+ *	s can be NULL.
+ */
+void secret_free (/*@null@*/char *s)
+{
+	struct secret_chunk *c;
+
+	if (NULL == s) {
+		return;
+	}
+	memzero (s, SECRET_SIZE);
+
+	(void) pthread_mutex_lock (&secret_lock);
+	for (c = chunks; NULL != c; c = c->next) {
+		if (   ((uintptr_t) s >= (uintptr_t) c->slots)
+		    && ((uintptr_t) s <  (uintptr_t) c->slots
+		                       + SECRET_SLOTS * SECRET_STRIDE)) {
+			c->used &= ~(1U << ((size_t) (s - c->slots)
+			                    / SECRET_STRIDE));
+			break;
+		}
+	}
+	(void) pthread_mutex_unlock (&secret_lock);
+}
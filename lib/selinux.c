@@ -9,6 +9,8 @@
 #ifdef WITH_SELINUX
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include "defines.h"
 
 #include <selinux/selinux.h>
@@ -21,12 +23,148 @@ static bool selinux_checked = false;
 static bool selinux_enabled;
 static /*@null@*/struct selabel_handle *selabel_hnd = NULL;
 
+/*
+ * The last file contexts looked up, and the context given to the last
+ * setfscreatecon_raw(). The same files are labelled several times in a
+ * run (e.g. a database and its backup in commonio_close), and consecutive
+ * entries of a copied tree usually share their context.
+ */
+#define LABEL_CACHE_SIZE 8
+static struct label_cache {
+	/*@null@*//*@only@*/char *path;
+	mode_t mode;
+	/*@null@*//*@only@*/char *context;	/* NULL: no context */
+} label_cache[LABEL_CACHE_SIZE];
+static size_t label_next = 0;
+static /*@null@*//*@only@*/char *fscreate_context = NULL;
+static unsigned long calls_saved = 0;
+
+static void label_cache_flush (void)
+{
+	size_t i;
+
+	for (i = 0; i < LABEL_CACHE_SIZE; i++) {
+		free (label_cache[i].path);
+		free (label_cache[i].context);
+		label_cache[i].path = NULL;
+		label_cache[i].context = NULL;
+	}
+	label_next = 0;
+}
+
 static void cleanup(void)
 {
 	if (selabel_hnd) {
 		selabel_close(selabel_hnd);
 		selabel_hnd = NULL;
 	}
+	label_cache_flush ();
+}
+
+/*
+ * label_lookup - Get the default context of a file
+ *
+ *	The context is returned in *context (NULL if the policy does not
+ *	specify any), and must not be freed by the caller.
+ *
+ *	Return 0 on success, -1 if the lookup failed.
+ */
+static int label_lookup (const char *path, mode_t mode,
+                         /*@out@*/char **context)
+{
+	struct label_cache *entry;
+	char *fcontext_raw = NULL;
+	char *dup;
+	size_t i;
+
+	mode &= S_IFMT;
+	for (i = 0; i < LABEL_CACHE_SIZE; i++) {
+		if (   (NULL != label_cache[i].path)
+		    && (label_cache[i].mode == mode)
+		    && (strcmp (label_cache[i].path, path) == 0)) {
+			calls_saved++;
+			*context = label_cache[i].context;
+			return 0;
+		}
+	}
+
+	if (selabel_lookup_raw (selabel_hnd, &fcontext_raw, path, mode) < 0) {
+		/* No context specified for the searched path */
+		if (errno != ENOENT) {
+			return -1;
+		}
+		fcontext_raw = NULL;
+	}
+
+	entry = &label_cache[label_next];
+	free (entry->path);
+	free (entry->context);
+	entry->path = NULL;
+	entry->context = NULL;
+
+	dup = NULL;
+	if (NULL != fcontext_raw) {
+		dup = strdup (fcontext_raw);
+		freecon (fcontext_raw);
+		if (NULL == dup) {
+			return -1;
+		}
+	}
+	entry->path = strdup (path);
+	if (NULL == entry->path) {
+		free (dup);
+		return -1;
+	}
+	entry->mode = mode;
+	entry->context = dup;
+	label_next = (label_next + 1) % LABEL_CACHE_SIZE;
+
+	*context = dup;
+	return 0;
+}
+
+/*
+ * fscreate_con - Set the context of the next created files
+ *
+ *	The context is only written to the kernel when it differs from the
+ *	one set by the previous call. Resetting it to the default (NULL) is
+ *	always written, since vipw sets the context on its own.
+ */
+static int fscreate_con (/*@null@*/const char *context)
+{
+	char *dup = NULL;
+
+	if (   (NULL != context)
+	    && (NULL != fscreate_context)
+	    && (strcmp (context, fscreate_context) == 0)) {
+		calls_saved++;
+		return 0;
+	}
+
+	if (NULL != context) {
+		dup = strdup (context);
+		if (NULL == dup) {
+			return -1;
+		}
+	}
+
+	free (fscreate_context);
+	fscreate_context = NULL;
+	if (setfscreatecon_raw (context) < 0) {
+		free (dup);
+		return -1;
+	}
+	fscreate_context = dup;
+	return 0;
+}
+
+/*
+ * selinux_calls_saved - Number of file context lookups and changes
+ *                       answered without calling libselinux
+ */
+unsigned long selinux_calls_saved (void)
+{
+	return calls_saved;
 }
 
 void reset_selinux_handle (void)
@@ -55,7 +193,6 @@ int set_selinux_file_context (const char *dst_name, mode_t mode)
 		/* Get the default security context for this file */
 
 		/*@null@*/char *fcontext_raw = NULL;
-		int r;
 
 		if (selabel_hnd == NULL) {
 			selabel_hnd = selabel_open(SELABEL_CTX_FILE, NULL, 0);
@@ -65,20 +202,16 @@ int set_selinux_file_context (const char *dst_name, mode_t mode)
 			(void) atexit(cleanup);
 		}
 
-		r = selabel_lookup_raw(selabel_hnd, &fcontext_raw, dst_name, mode);
-		if (r < 0) {
-			/* No context specified for the searched path */
-			if (errno == ENOENT) {
-				return 0;
-			}
-
+		if (label_lookup (dst_name, mode, &fcontext_raw) != 0) {
 			return security_getenforce () != 0;
 		}
+		if (NULL == fcontext_raw) {
+			/* No context specified for the searched path */
+			return 0;
+		}
 
 		/* Set the security context for the next created file */
-		r = setfscreatecon_raw (fcontext_raw);
-		freecon (fcontext_raw);
-		if (r < 0) {
+		if (fscreate_con (fcontext_raw) != 0) {
 			return security_getenforce () != 0;
 		}
 	}
@@ -99,7 +232,7 @@ int reset_selinux_file_context (void)
 		selinux_checked = true;
 	}
 	if (selinux_enabled) {
-		if (setfscreatecon_raw (NULL) != 0) {
+		if (fscreate_con (NULL) != 0) {
 			return security_getenforce () != 0;
 		}
 	}
@@ -106,6 +106,14 @@ fail:
 }
 
 
+/*
+ * The handle of the transaction opened by seuser_batch_begin(), if any.
+ * While it is set, set_seuser() and del_seuser() only queue their
+ * changes and seuser_batch_commit() commits them all at once.
+ */
+static semanage_handle_t *batch_handle = NULL;
+
+
 static int semanage_user_mod (semanage_handle_t *handle,
                               semanage_seuser_key_t *key,
                               const char *login_name,
@@ -228,7 +236,7 @@ int set_seuser (const char *login_name, const char *seuser_name)
 		return 0;
 	}
 
-	handle = semanage_init ();
+	handle = (NULL != batch_handle) ? batch_handle : semanage_init ();
 	if (NULL == handle) {
 		fprintf (shadow_logfd, _("Cannot init SELinux management\n"));
 		ret = 1;
@@ -267,6 +275,11 @@ int set_seuser (const char *login_name, const char *seuser_name)
 		}
 	}
 
+	if (handle == batch_handle) {
+		ret = 0;
+		goto done;
+	}
+
 	ret = semanage_commit (handle);
 	if (ret < 0) {
 		fprintf (shadow_logfd, _("Cannot commit SELinux transaction\n"));
@@ -279,7 +292,9 @@ int set_seuser (const char *login_name, const char *seuser_name)
 
 done:
 	semanage_seuser_key_free (key);
-	semanage_handle_destroy (handle);
+	if (handle != batch_handle) {
+		semanage_handle_destroy (handle);
+	}
 	return ret;
 }
 
@@ -291,7 +306,7 @@ int del_seuser (const char *login_name)
 	int ret;
 	int exists = 0;
 
-	handle = semanage_init ();
+	handle = (NULL != batch_handle) ? batch_handle : semanage_init ();
 	if (NULL == handle) {
 		fprintf (shadow_logfd, _("Cannot init SELinux management\n"));
 		ret = 1;
@@ -344,6 +359,11 @@ int del_seuser (const char *login_name)
 		goto done;
 	}
 
+	if (handle == batch_handle) {
+		ret = 0;
+		goto done;
+	}
+
 	ret = semanage_commit (handle);
 	if (ret < 0) {
 		fprintf (shadow_logfd, _("Cannot commit SELinux transaction\n"));
@@ -353,9 +373,74 @@ int del_seuser (const char *login_name)
 
 	ret = 0;
 done:
-	semanage_handle_destroy (handle);
+	semanage_seuser_key_free (key);
+	if (handle != batch_handle) {
+		semanage_handle_destroy (handle);
+	}
 	return ret;
 }
+
+
+/*
+ * seuser_batch_begin - Start queueing login mapping changes
+ *
+ *	After a successful call, set_seuser() and del_seuser() apply their
+ *	changes to a single SELinux transaction, which is only written by
+ *	seuser_batch_commit(). This avoids rebuilding the policy store once
+ *	per user when many accounts are changed.
+ */
+int seuser_batch_begin (void)
+{
+	if (NULL != batch_handle) {
+		return 0;
+	}
+
+	batch_handle = semanage_init ();
+	if (NULL == batch_handle) {
+		fprintf (shadow_logfd, _("Cannot init SELinux management\n"));
+		return 1;
+	}
+
+	return 0;
+}
+
+
+/*
+ * seuser_batch_commit - Commit the changes queued since seuser_batch_begin
+ */
+int seuser_batch_commit (void)
+{
+	int ret;
+
+	if (NULL == batch_handle) {
+		return 0;
+	}
+
+	ret = semanage_commit (batch_handle);
+	semanage_handle_destroy (batch_handle);
+	batch_handle = NULL;
+	if (ret < 0) {
+		fprintf (shadow_logfd, _("Cannot commit SELinux transaction\n"));
+		return 1;
+	}
+
+	reset_selinux_handle();
+	return 0;
+}
+
+
+/*
+ * seuser_batch_abort - Drop the changes queued since seuser_batch_begin
+ */
+void seuser_batch_abort (void)
+{
+	if (NULL == batch_handle) {
+		return;
+	}
+
+	semanage_handle_destroy (batch_handle);
+	batch_handle = NULL;
+}
 #else				/* !WITH_SELINUX */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* !WITH_SELINUX */
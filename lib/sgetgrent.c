@@ -11,6 +11,8 @@
 
 #ident "$Id$"
 
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include <grp.h>
@@ -20,110 +22,118 @@
 #define	NFIELDS	4
 
 /*
- * list - turn a comma-separated string into an array of (char *)'s
+ * sgetgrent_r - convert a string to a (struct group), without static
+ *               storage
  *
- *	list() converts the comma-separated list of member names into
- *	an array of character pointers.
+ *	The string is copied into the buflen bytes of buffer, followed by
+ *	the array of the member names, and the fields of grent point into
+ *	this copy.  sgetgrent_size() returns the size needed.
  *
- *	WARNING: I profiled this once with and without strchr() calls
- *	and found that using a register variable and an explicit loop
- *	works best.  For large /etc/group files, this is a major win.
- *
- * FINALLY added dynamic allocation.  Still need to fix sgetsgent().
- *  --marekm
+ *	On success, 0 is returned and *result is set to grent.  Otherwise,
+ *	*result is set to NULL, and ERANGE is returned if buffer is too
+ *	small, or EINVAL if the string is not a valid entry.
  */
-static char **list (char *s)
+int sgetgrent_r (const char *buf, struct group *grent,
+                 char *buffer, size_t buflen, struct group **result)
 {
-	static char **members = NULL;
-	static int size = 0;	/* max members + 1 */
-	int i;
-	char **rbuf;
-
-	i = 0;
-	for (;;) {
-		/* check if there is room for another pointer (to a group
-		   member name, or terminating NULL).  */
-		if (i >= size) {
-			size = i + 100;	/* at least: i + 1 */
-			if (members) {
-				rbuf =
-				    realloc (members, size * sizeof (char *));
-			} else {
-				/* for old (before ANSI C) implementations of
-				   realloc() that don't handle NULL properly */
-				rbuf = malloc (size * sizeof (char *));
-			}
-			if (!rbuf) {
-				free (members);
-				members = NULL;
-				size = 0;
-				return NULL;
-			}
-			members = rbuf;
-		}
-		if (!s || s[0] == '\0')
-			break;
-		members[i++] = s;
-		while (('\0' != *s) && (',' != *s)) {
-			s++;
-		}
-		if ('\0' != *s) {
-			*s++ = '\0';
-		}
+	char *grpfields[NFIELDS];
+	char **members;
+	size_t len, mlen, n;
+	uintptr_t pad;
+	char *cp;
+
+	*result = NULL;
+
+	len = strlen (buf);
+	if (len >= buflen) {
+		return ERANGE;
+	}
+	memcpy (buffer, buf, len + 1);
+
+	cp = strrchr (buffer, '\n');
+	if (NULL != cp) {
+		*cp = '\0';
+		len = cp - buffer;
 	}
-	members[i] = NULL;
-	return members;
+
+	n = split_fields (buffer, len, ':', grpfields, NFIELDS);
+	if (n < (NFIELDS - 1) || n > NFIELDS || *grpfields[2] == '\0') {
+		return EINVAL;
+	}
+	if (n == (NFIELDS - 1)) {
+		grpfields[3] = buffer + len;	/* no members */
+	}
+	grent->gr_name = grpfields[0];
+	grent->gr_passwd = grpfields[1];
+	if (get_gid (grpfields[2], &grent->gr_gid) == 0) {
+		return EINVAL;
+	}
+
+	/*
+	 * The array of the members follows the strings.  An empty last
+	 * name is ignored.
+	 */
+	mlen = (size_t) (buffer + len - grpfields[3]);
+	n = count_fields (grpfields[3], mlen, ',');
+	pad = (uintptr_t) (buffer + len + 1) % sizeof (char *);
+	if (0 != pad) {
+		pad = sizeof (char *) - pad;
+	}
+	if (   (buflen - len - 1 < pad)
+	    || ((buflen - len - 1 - pad) / sizeof (char *) < n + 1)) {
+		return ERANGE;
+	}
+	members = (char **) (buffer + len + 1 + pad);
+
+	n = split_fields (grpfields[3], mlen, ',', members, n);
+	if ('\0' == *members[n - 1]) {
+		n--;
+	}
+	members[n] = NULL;
+	grent->gr_mem = members;
+
+	*result = grent;
+	return 0;
 }
 
+/*
+ * sgetgrent_size - return the size of the buffer needed by
+ *                  sgetgrent_r() to parse buf
+ */
+size_t sgetgrent_size (const char *buf)
+{
+	size_t len = strlen (buf);
+
+	return len + 1 + (count_fields (buf, len, ',') + 2) * sizeof (char *);
+}
 
+/*
+ * sgetgrent - convert a string to a (struct group)
+ *
+ *	The structure, its strings, and its array of members are in static
+ *	storage.
+ */
 struct group *sgetgrent (const char *buf)
 {
 	static char *grpbuf = NULL;
 	static size_t size = 0;
-	static char *grpfields[NFIELDS];
 	static struct group grent;
-	int i;
-	char *cp;
+	struct group *result;
+	size_t needed;
 
-	if (strlen (buf) + 1 > size) {
+	needed = sgetgrent_size (buf);
+	if (needed > size) {
 		/* no need to use realloc() here - just free it and
 		   allocate a larger block */
 		free (grpbuf);
-		size = strlen (buf) + 1000;	/* at least: strlen(buf) + 1 */
+		size = needed + 1000;
 		grpbuf = malloc (size);
 		if (grpbuf == NULL) {
 			size = 0;
 			return NULL;
 		}
 	}
-	strcpy (grpbuf, buf);
-
-	cp = strrchr (grpbuf, '\n');
-	if (NULL != cp) {
-		*cp = '\0';
-	}
-
-	for (cp = grpbuf, i = 0; (i < NFIELDS) && (NULL != cp); i++) {
-		grpfields[i] = cp;
-		cp = strchr (cp, ':');
-		if (NULL != cp) {
-			*cp = '\0';
-			cp++;
-		}
-	}
-	if (i < (NFIELDS - 1) || *grpfields[2] == '\0' || cp != NULL) {
-		return NULL;
-	}
-	grent.gr_name = grpfields[0];
-	grent.gr_passwd = grpfields[1];
-	if (get_gid (grpfields[2], &grent.gr_gid) == 0) {
-		return NULL;
-	}
-	grent.gr_mem = list (grpfields[3]);
-	if (NULL == grent.gr_mem) {
-		return NULL;	/* out of memory */
-	}
 
-	return &grent;
+	(void) sgetgrent_r (buf, &grent, grpbuf, size, &result);
+	return result;
 }
-
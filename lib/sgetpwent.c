@@ -11,6 +11,7 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <sys/types.h>
 #include "defines.h"
 #include <stdio.h>
@@ -21,89 +22,90 @@
 #define	NFIELDS	7
 
 /*
- * sgetpwent - convert a string to a (struct passwd)
+ * sgetpwent_r - convert a string to a (struct passwd), without static
+ *               storage
  *
- * sgetpwent() parses a string into the parts required for a password
- * structure.  Strict checking is made for the UID and GID fields and
- * presence of the correct number of colons.  Any failing tests result
- * in a NULL pointer being returned.
+ * The string is copied into the buflen bytes of buffer, and the fields
+ * of pwent point into this copy.  Strict checking is made for the UID
+ * and GID fields and presence of the correct number of colons.
  *
- * NOTE: This function uses hard-coded string scanning functions for
- *	performance reasons.  I am going to come up with some conditional
- *	compilation glarp to improve on this in the future.
+ * On success, 0 is returned and *result is set to pwent.  Otherwise,
+ * *result is set to NULL, and ERANGE is returned if buffer is too
+ * small, or EINVAL if the string is not a valid entry.
  */
-struct passwd *sgetpwent (const char *buf)
+int sgetpwent_r (const char *buf, struct passwd *pwent,
+                 char *buffer, size_t buflen, struct passwd **result)
 {
-	static struct passwd pwent;
-	static char pwdbuf[PASSWD_ENTRY_MAX_LENGTH];
-	int i;
-	char *cp;
+	size_t len;
 	char *fields[NFIELDS];
 
-	/*
-	 * Copy the string to a static buffer so the pointers into
-	 * the password structure remain valid.
-	 */
+	*result = NULL;
 
-	if (strlen (buf) >= sizeof pwdbuf) {
-		fprintf (shadow_logfd,
-		         "%s: Too long passwd entry encountered, file corruption?\n",
-		         shadow_progname);
-		return 0;	/* fail if too long */
+	len = strlen (buf);
+	if (len >= buflen) {
+		return ERANGE;
 	}
-	strcpy (pwdbuf, buf);
+	memcpy (buffer, buf, len + 1);
 
 	/*
 	 * Save a pointer to the start of each colon separated
 	 * field.  The fields are converted into NUL terminated strings.
-	 */
-
-	for (cp = pwdbuf, i = 0; (i < NFIELDS) && (NULL != cp); i++) {
-		fields[i] = cp;
-		while (('\0' != *cp) && (':' != *cp)) {
-			cp++;
-		}
-
-		if ('\0' != *cp) {
-			*cp = '\0';
-			cp++;
-		} else {
-			cp = NULL;
-		}
-	}
-
-	/* something at the end, columns over shot */
-	if ( cp != NULL ) {
-		return( NULL );
-	}
-
-	/*
+	 *
 	 * There must be exactly NFIELDS colon separated fields or
 	 * the entry is invalid.  Also, the UID and GID must be non-blank.
 	 */
 
-	if (i != NFIELDS || *fields[2] == '\0' || *fields[3] == '\0')
-		return NULL;
+	if (   (split_fields (buffer, len, ':', fields, NFIELDS) != NFIELDS)
+	    || ('\0' == *fields[2])
+	    || ('\0' == *fields[3])) {
+		return EINVAL;
+	}
 
 	/*
 	 * Each of the fields is converted the appropriate data type
 	 * and the result assigned to the password structure.  If the
-	 * UID or GID does not convert to an integer value, a NULL
-	 * pointer is returned.
+	 * UID or GID does not convert to an integer value, the entry
+	 * is invalid.
 	 */
 
-	pwent.pw_name = fields[0];
-	pwent.pw_passwd = fields[1];
-	if (get_uid (fields[2], &pwent.pw_uid) == 0) {
-		return NULL;
+	pwent->pw_name = fields[0];
+	pwent->pw_passwd = fields[1];
+	if (get_uid (fields[2], &pwent->pw_uid) == 0) {
+		return EINVAL;
 	}
-	if (get_gid (fields[3], &pwent.pw_gid) == 0) {
-		return NULL;
+	if (get_gid (fields[3], &pwent->pw_gid) == 0) {
+		return EINVAL;
+	}
+	pwent->pw_gecos = fields[4];
+	pwent->pw_dir = fields[5];
+	pwent->pw_shell = fields[6];
+
+	*result = pwent;
+	return 0;
+}
+
+/*
+ * sgetpwent - convert a string to a (struct passwd)
+ *
+ * sgetpwent() parses a string into the parts required for a password
+ * structure, with sgetpwent_r().  The structure and its strings are in
+ * static storage.  Any failing tests result in a NULL pointer being
+ * returned.
+ */
+struct passwd *sgetpwent (const char *buf)
+{
+	static struct passwd pwent;
+	static char pwdbuf[PASSWD_ENTRY_MAX_LENGTH];
+	struct passwd *result;
+
+	if (strlen (buf) >= sizeof pwdbuf) {
+		fprintf (shadow_logfd,
+		         "%s: Too long passwd entry encountered, file corruption?\n",
+		         shadow_progname);
+		return 0;	/* fail if too long */
 	}
-	pwent.pw_gecos = fields[4];
-	pwent.pw_dir = fields[5];
-	pwent.pw_shell = fields[6];
 
-	return &pwent;
+	(void) sgetpwent_r (buf, &pwent, pwdbuf, sizeof pwdbuf, &result);
+	return result;
 }
 
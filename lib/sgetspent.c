@@ -28,26 +28,29 @@ struct spwd *sgetspent (const char *string)
 {
 	static char spwbuf[PASSWD_ENTRY_MAX_LENGTH];
 	static struct spwd spwd;
-	char *fields[FIELDS];
+	char *fields[FIELDS + 1];
 	char *cp;
-	int i;
+	size_t len;
+	size_t i;
 
 	/*
 	 * Copy string to local buffer.  It has to be tokenized and we
 	 * have to do that to our private copy.
 	 */
 
-	if (strlen (string) >= sizeof spwbuf) {
+	len = strlen (string);
+	if (len >= sizeof spwbuf) {
 		fprintf (shadow_logfd,
 		         "%s: Too long passwd entry encountered, file corruption?\n",
 		         shadow_progname);
 		return 0;	/* fail if too long */
 	}
-	strcpy (spwbuf, string);
+	memcpy (spwbuf, string, len + 1);
 
 	cp = strrchr (spwbuf, '\n');
 	if (NULL != cp) {
 		*cp = '\0';
+		len = cp - spwbuf;
 	}
 
 	/*
@@ -55,24 +58,20 @@ struct spwd *sgetspent (const char *string)
 	 * FIELDS different fields.
 	 */
 
-	for (cp = spwbuf, i = 0; ('\0' != *cp) && (i < FIELDS); i++) {
-		fields[i] = cp;
-		while (('\0' != *cp) && (':' != *cp)) {
-			cp++;
-		}
+	i = split_fields (spwbuf, len, ':', fields, FIELDS + 1);
 
-		if ('\0' != *cp) {
-			*cp = '\0';
-			cp++;
-		}
+	/*
+	 * An empty last field is ignored, and the last of the FIELDS
+	 * fields can be omitted.
+	 */
+	if ((i <= FIELDS + 1) && ('\0' == *fields[i - 1])) {
+		i--;
 	}
-
 	if (i == (FIELDS - 1)) {
-		fields[i++] = cp;
+		fields[i++] = spwbuf + len;
 	}
 
-	if ( ((NULL != cp) && ('\0' != *cp)) ||
-	     ((i != FIELDS) && (i != OFIELDS)) ) {
+	if ((i != FIELDS) && (i != OFIELDS)) {
 		return 0;
 	}
 
@@ -116,6 +116,56 @@ static /*@null@*/ /*@only@*/void *gshadow_dup (const void *ent)
 	return __sgr_dup (sg);
 }
 
+static /*@null@*/ /*@dependent@*/char **dup_list_arena (
+	struct commonio_db *db,
+	char *const *list)
+{
+	char **l;
+	size_t i;
+
+	for (i = 0; NULL != list[i]; i++);
+
+	l = commonio_alloc (db, (i + 1) * sizeof (char *));
+	if (NULL == l) {
+		return NULL;
+	}
+	for (i = 0; NULL != list[i]; i++) {
+		l[i] = commonio_strdup (db, list[i]);
+		if (NULL == l[i]) {
+			return NULL;
+		}
+	}
+	l[i] = NULL;
+
+	return l;
+}
+
+static /*@null@*/ /*@dependent@*/void *gshadow_dup_arena (struct commonio_db *db,
+                                                          const void *ent)
+{
+	const struct sgrp *sgent = ent;
+	struct sgrp *sg;
+
+	sg = commonio_alloc (db, sizeof *sg);
+	if (NULL == sg) {
+		return NULL;
+	}
+	memset (sg, 0, sizeof *sg);
+	sg->sg_name = commonio_strdup (db, sgent->sg_name);
+	sg->sg_passwd = commonio_strdup (db, sgent->sg_passwd);
+	sg->sg_adm = dup_list_arena (db, sgent->sg_adm);
+	sg->sg_mem = dup_list_arena (db, sgent->sg_mem);
+	if (   (NULL == sg->sg_name)
+	    || (NULL == sg->sg_passwd)
+	    || (NULL == sg->sg_adm)
+	    || (NULL == sg->sg_mem)) {
+		/* Released with the arena */
+		return NULL;
+	}
+
+	return sg;
+}
+
 static void gshadow_free (/*@out@*/ /*@only@*/void *ent)
 {
 	struct sgrp *sg = ent;
@@ -149,6 +199,20 @@ static const char *gshadow_getname (const void *ent)
 	return gr->sg_name;
 }
 
+static /*@null@*/char *const *gshadow_getmembers (const void *ent, size_t n)
+{
+	const struct sgrp *sg = ent;
+
+	switch (n) {
+	case 0:
+		return sg->sg_mem;
+	case 1:
+		return sg->sg_adm;
+	default:
+		return NULL;
+	}
+}
+
 static void *gshadow_parse (const char *line)
 {
 	return sgetsgent (line);
@@ -196,7 +260,14 @@ static struct commonio_ops gshadow_ops = {
 	fgetsx,
 	fputsx,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	NULL,			/* close_hook */
+	NULL,			/* getid */
+	gshadow_dup_arena,
+	NULL,			/* parse_arena */
+	0,			/* cache_dbs */
+	NULL,			/* publish_hook */
+	gshadow_getmembers,
+	COMMONIO_DIRECT_NAME (struct sgrp, sg_name)
 };
 
 static struct commonio_db gshadow_db = {
@@ -224,6 +295,11 @@ int sgr_setdbname (const char *filename)
 	return commonio_setname (&gshadow_db, filename);
 }
 
+int sgr_setshard (const char *shard)
+{
+	return commonio_setshard (&gshadow_db, shard);
+}
+
 /*@observer@*/const char *sgr_dbname (void)
 {
 	return gshadow_db.filename;
@@ -246,11 +322,53 @@ int sgr_open (int mode)
 	return commonio_open (&gshadow_db, mode);
 }
 
+/*
+ * sgr_open_deferred - Same as sgr_open(), but the gshadow file is only
+ *                     read when it is first accessed
+ *
+ *	See commonio_open_deferred().
+ */
+int sgr_open_deferred (int mode)
+{
+	return commonio_open_deferred (&gshadow_db, mode);
+}
+
 /*@observer@*/ /*@null@*/const struct sgrp *sgr_locate (const char *name)
 {
 	return commonio_locate (&gshadow_db, name);
 }
 
+/*
+ * sgr_compact - Only parse the shadow group entries which are used, for
+ *               the tools which look up or change a few groups.
+ */
+void sgr_compact (void)
+{
+	commonio_compact (&gshadow_db);
+}
+
+/*
+ * sgr_index_members - Index the shadow groups by member and administrator
+ *                     name when the database is opened, for sgr_member_of().
+ */
+void sgr_index_members (void)
+{
+	commonio_index_members (&gshadow_db);
+}
+
+/*
+ * sgr_member_of - Return the shadow groups which list name as a member or
+ *                 as an administrator.
+ *
+ *	The array is NULL terminated and shall be freed by the caller.
+ *	It returns NULL if the shadow groups were not indexed by member
+ *	name; the database shall then be scanned with sgr_next().
+ */
+/*@null@*/ /*@only@*/const struct sgrp **sgr_member_of (const char *name)
+{
+	return (const struct sgrp **) commonio_member_of (&gshadow_db, name);
+}
+
 int sgr_update (const struct sgrp *sg)
 {
 	return commonio_update (&gshadow_db, sg);
@@ -266,6 +384,16 @@ int sgr_rewind (void)
 	return commonio_rewind (&gshadow_db);
 }
 
+/*
+ * sgr_scan - Call fn for each entry of the file, without loading it
+ *
+ *	See commonio_scan().
+ */
+int sgr_scan (int (*fn) (const struct sgrp *, void *), void *arg)
+{
+	return commonio_scan (&gshadow_db, (int (*) (const void *, void *)) fn, arg);
+}
+
 /*@null@*/const struct sgrp *sgr_next (void)
 {
 	return commonio_next (&gshadow_db);
@@ -286,9 +414,14 @@ void __sgr_set_changed (void)
 	gshadow_db.changed = true;
 }
 
+struct commonio_db *__sgr_get_db (void)
+{
+	return &gshadow_db;
+}
+
 /*@dependent@*/ /*@null@*/struct commonio_entry *__sgr_get_head (void)
 {
-	return gshadow_db.head;
+	return commonio_entries (&gshadow_db);
 }
 
 void __sgr_del_entry (const struct commonio_entry *ent)
@@ -296,6 +429,11 @@ void __sgr_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&gshadow_db, ent);
 }
 
+size_t __sgr_duplicates (const struct commonio_entry *ent)
+{
+	return commonio_duplicates (&gshadow_db, ent);
+}
+
 /* Sort with respect to group ordering. */
 int sgr_sort ()
 {
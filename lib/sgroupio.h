@@ -15,13 +15,19 @@
 extern int sgr_close (void);
 extern bool sgr_file_present (void);
 extern /*@observer@*/ /*@null@*/const struct sgrp *sgr_locate (const char *name);
+extern void sgr_compact (void);
+extern void sgr_index_members (void);
 extern int sgr_lock (void);
 extern int sgr_setdbname (const char *filename);
+extern int sgr_setshard (const char *shard);
 extern /*@observer@*/const char *sgr_dbname (void);
+extern /*@null@*/ /*@only@*/const struct sgrp **sgr_member_of (const char *name);
 extern /*@null@*/const struct sgrp *sgr_next (void);
 extern int sgr_open (int mode);
+extern int sgr_open_deferred (int mode);
 extern int sgr_remove (const char *name);
 extern int sgr_rewind (void);
+extern int sgr_scan (int (*fn) (const struct sgrp *, void *), void *arg);
 extern int sgr_unlock (void);
 extern int sgr_update (const struct sgrp *sg);
 extern int sgr_sort (void);
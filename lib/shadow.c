@@ -105,42 +105,48 @@ static struct spwd *my_sgetspent (const char *string)
 {
 	static char spwbuf[BUFSIZ];
 	static struct spwd spwd;
-	char *fields[FIELDS];
+	char *fields[FIELDS + 1];
 	char *cp;
-	int i;
+	size_t len;
+	size_t i;
 
 	/*
 	 * Copy string to local buffer.  It has to be tokenized and we
 	 * have to do that to our private copy.
 	 */
 
-	if (strlen (string) >= sizeof spwbuf)
+	len = strlen (string);
+	if (len >= sizeof spwbuf)
 		return 0;
-	strcpy (spwbuf, string);
+	memcpy (spwbuf, string, len + 1);
 
 	cp = strrchr (spwbuf, '\n');
-	if (NULL != cp)
+	if (NULL != cp) {
 		*cp = '\0';
+		len = cp - spwbuf;
+	}
 
 	/*
 	 * Tokenize the string into colon separated fields.  Allow up to
 	 * FIELDS different fields.
 	 */
 
-	for (cp = spwbuf, i = 0; *cp && i < FIELDS; i++) {
-		fields[i] = cp;
-		while (*cp && *cp != ':')
-			cp++;
+	i = split_fields (spwbuf, len, ':', fields, FIELDS + 1);
 
-		if (*cp)
-			*cp++ = '\0';
+	/*
+	 * An empty last field is ignored, and the last of the FIELDS
+	 * fields can be omitted.
+	 */
+	if ((i <= FIELDS + 1) && ('\0' == *fields[i - 1])) {
+		i--;
+	}
+	if (i == (FIELDS - 1)) {
+		fields[i++] = spwbuf + len;
 	}
 
-	if (i == (FIELDS - 1))
-		fields[i++] = cp;
-
-	if ((cp && *cp) || (i != FIELDS && i != OFIELDS))
+	if ((i != FIELDS) && (i != OFIELDS)) {
 		return 0;
+	}
 
 	/*
 	 * Start populating the structure.  The fields are all in
@@ -31,6 +31,35 @@ static /*@null@*/ /*@only@*/void *shadow_dup (const void *ent)
 	return __spw_dup (sp);
 }
 
+static /*@null@*/ /*@dependent@*/void *shadow_dup_arena (struct commonio_db *db,
+                                                         const void *ent)
+{
+	const struct spwd *spent = ent;
+	struct spwd *sp;
+
+	sp = commonio_alloc (db, sizeof *sp);
+	if (NULL == sp) {
+		return NULL;
+	}
+	/* The libc might define other fields. They won't be copied. */
+	memset (sp, 0, sizeof *sp);
+	sp->sp_lstchg = spent->sp_lstchg;
+	sp->sp_min    = spent->sp_min;
+	sp->sp_max    = spent->sp_max;
+	sp->sp_warn   = spent->sp_warn;
+	sp->sp_inact  = spent->sp_inact;
+	sp->sp_expire = spent->sp_expire;
+	sp->sp_flag   = spent->sp_flag;
+	sp->sp_namp = commonio_strdup (db, spent->sp_namp);
+	sp->sp_pwdp = commonio_strdup (db, spent->sp_pwdp);
+	if ((NULL == sp->sp_namp) || (NULL == sp->sp_pwdp)) {
+		/* Released with the arena */
+		return NULL;
+	}
+
+	return sp;
+}
+
 static void shadow_free (/*@out@*//*@only@*/void *ent)
 {
 	struct spwd *sp = ent;
@@ -50,6 +79,75 @@ static void *shadow_parse (const char *line)
 	return sgetspent (line);
 }
 
+/*
+ * parse_days - Convert a field of days of a shadow entry, -1 if empty
+ *
+ *	Return 1 on success, 0 if the field is invalid.
+ */
+static int parse_days (const char *field, long *days)
+{
+	if ('\0' == *field) {
+		*days = -1;
+		return 1;
+	}
+	return (getlong (field, days) != 0) && (*days >= 0);
+}
+
+/*
+ * shadow_parse_fields - Convert only the given SPW_FIELD_* of line
+ *
+ *	The fields are checked as with sgetspent(). See
+ *	commonio_scan_fields().
+ */
+static void *shadow_parse_fields (char *line, size_t len, unsigned int fields)
+{
+	static struct spwd spwd;
+	long *days[] = {
+		&spwd.sp_lstchg, &spwd.sp_min, &spwd.sp_max,
+		&spwd.sp_warn, &spwd.sp_inact, &spwd.sp_expire
+	};
+	char *f[10];
+	size_t i, n;
+
+	/*
+	 * As with sgetspent(), an empty last field is ignored, the flag
+	 * can be omitted, and only the first 5 fields can be present.
+	 */
+	n = split_fields (line, len, ':', f, 10);
+	if ((n <= 10) && ('\0' == *f[n - 1])) {
+		n--;
+	}
+	if (8 == n) {
+		f[n++] = line + len;
+	}
+	if ((9 != n) && (5 != n)) {
+		return NULL;
+	}
+
+	spwd.sp_namp = (fields & SPW_FIELD_NAME) ? f[0] : NULL;
+	spwd.sp_pwdp = (fields & SPW_FIELD_PASSWD) ? f[1] : NULL;
+	for (i = 0; i < sizeof days / sizeof days[0]; i++) {
+		*days[i] = 0;
+		if ((fields & (SPW_FIELD_LSTCHG << i)) == 0) {
+			continue;
+		}
+		if (i + 2 >= n) {
+			*days[i] = -1;
+		} else if (parse_days (f[i + 2], days[i]) == 0) {
+			return NULL;
+		}
+	}
+	spwd.sp_flag = 0;
+	if ((fields & SPW_FIELD_FLAG) != 0) {
+		if ((5 == n) || ('\0' == *f[8])) {
+			spwd.sp_flag = SHADOW_SP_FLAG_UNSET;
+		} else if (getulong (f[8], &spwd.sp_flag) == 0) {
+			return NULL;
+		}
+	}
+	return &spwd;
+}
+
 static int shadow_put (const void *ent, FILE * file)
 {
 	const struct spwd *sp = ent;
@@ -74,7 +172,16 @@ static struct commonio_ops shadow_ops = {
 	fgets,
 	fputs,
 	NULL,			/* open_hook */
-	NULL			/* close_hook */
+	NULL,			/* close_hook */
+	NULL,			/* getid */
+	shadow_dup_arena,
+	NULL,			/* parse_arena */
+	0,			/* cache_dbs */
+	NULL,			/* publish_hook */
+	NULL,			/* getmembers */
+	COMMONIO_DIRECT_NAME (struct spwd, sp_namp),
+	NULL,			/* sortkey */
+	shadow_parse_fields
 };
 
 static struct commonio_db shadow_db = {
@@ -102,6 +209,11 @@ int spw_setdbname (const char *filename)
 	return commonio_setname (&shadow_db, filename);
 }
 
+int spw_setshard (const char *shard)
+{
+	return commonio_setshard (&shadow_db, shard);
+}
+
 /*@observer@*/const char *spw_dbname (void)
 {
 	return shadow_db.filename;
@@ -157,11 +269,48 @@ int spw_open (int mode)
 	return retval;
 }
 
+/*
+ * spw_open_deferred - Same as spw_open(), but the shadow file is only
+ *                     read when it is first accessed
+ *
+ *	See commonio_open_deferred().
+ */
+int spw_open_deferred (int mode)
+{
+#ifdef WITH_TCB
+	/* The tcb files are read with the privileges of their user */
+	if (getdef_bool ("USE_TCB")) {
+		return spw_open (mode);
+	}
+#endif				/* WITH_TCB */
+	return commonio_open_deferred (&shadow_db, mode);
+}
+
 /*@observer@*/ /*@null@*/const struct spwd *spw_locate (const char *name)
 {
 	return commonio_locate (&shadow_db, name);
 }
 
+/*
+ * spw_locate_sorted - Same as spw_locate(), for names given in ascending
+ *                     order
+ *
+ *	See commonio_locate_sorted().
+ */
+/*@observer@*/ /*@null@*/const struct spwd *spw_locate_sorted (const char *name)
+{
+	return commonio_locate_sorted (&shadow_db, name);
+}
+
+/*
+ * spw_compact - Only parse the shadow entries which are used, for the
+ *               tools which look up or change a few users.
+ */
+void spw_compact (void)
+{
+	commonio_compact (&shadow_db);
+}
+
 int spw_update (const struct spwd *sp)
 {
 	return commonio_update (&shadow_db, sp);
@@ -177,6 +326,29 @@ int spw_rewind (void)
 	return commonio_rewind (&shadow_db);
 }
 
+/*
+ * spw_scan - Call fn for each entry of the file, without loading it
+ *
+ *	See commonio_scan().
+ */
+int spw_scan (int (*fn) (const struct spwd *, void *), void *arg)
+{
+	return commonio_scan (&shadow_db, (int (*) (const void *, void *)) fn, arg);
+}
+
+/*
+ * spw_scan_fields - Same as spw_scan(), with only the given SPW_FIELD_*
+ *                   of the entries
+ *
+ *	See commonio_scan_fields().
+ */
+int spw_scan_fields (unsigned int fields,
+                     int (*fn) (const struct spwd *, void *), void *arg)
+{
+	return commonio_scan_fields (&shadow_db, fields,
+	                             (int (*) (const void *, void *)) fn, arg);
+}
+
 /*@observer@*/ /*@null@*/const struct spwd *spw_next (void)
 {
 	return commonio_next (&shadow_db);
@@ -225,9 +397,14 @@ int spw_unlock (void)
 #endif				/* WITH_TCB */
 }
 
+struct commonio_db *__spw_get_db (void)
+{
+	return &shadow_db;
+}
+
 struct commonio_entry *__spw_get_head (void)
 {
-	return shadow_db.head;
+	return commonio_entries (&shadow_db);
 }
 
 void __spw_del_entry (const struct commonio_entry *ent)
@@ -235,6 +412,11 @@ void __spw_del_entry (const struct commonio_entry *ent)
 	commonio_del_entry (&shadow_db, ent);
 }
 
+size_t __spw_duplicates (const struct commonio_entry *ent)
+{
+	return commonio_duplicates (&shadow_db, ent);
+}
+
 /* Sort with respect to passwd ordering. */
 int spw_sort ()
 {
@@ -13,16 +13,35 @@
 
 #include "defines.h"
 
+/* The fields of spw_scan_fields() */
+#define SPW_FIELD_NAME		(1U << 0)
+#define SPW_FIELD_PASSWD	(1U << 1)
+#define SPW_FIELD_LSTCHG	(1U << 2)
+#define SPW_FIELD_MIN		(1U << 3)
+#define SPW_FIELD_MAX		(1U << 4)
+#define SPW_FIELD_WARN		(1U << 5)
+#define SPW_FIELD_INACT		(1U << 6)
+#define SPW_FIELD_EXPIRE	(1U << 7)
+#define SPW_FIELD_FLAG		(1U << 8)
+
 extern int spw_close (void);
+extern void spw_compact (void);
 extern bool spw_file_present (void);
 extern /*@observer@*/ /*@null@*/const struct spwd *spw_locate (const char *name);
+extern /*@observer@*/ /*@null@*/const struct spwd *spw_locate_sorted (const char *name);
 extern int spw_lock (void);
 extern int spw_setdbname (const char *filename);
+extern int spw_setshard (const char *shard);
 extern /*@observer@*/const char *spw_dbname (void);
 extern /*@observer@*/ /*@null@*/const struct spwd *spw_next (void);
 extern int spw_open (int mode);
+extern int spw_open_deferred (int mode);
 extern int spw_remove (const char *name);
 extern int spw_rewind (void);
+extern int spw_scan (int (*fn) (const struct spwd *, void *), void *arg);
+extern int spw_scan_fields (unsigned int fields,
+                            int (*fn) (const struct spwd *, void *),
+                            void *arg);
 extern int spw_unlock (void);
 extern int spw_update (const struct spwd *sp);
 extern int spw_sort (void);
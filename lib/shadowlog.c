@@ -1,7 +1,35 @@
+#include <config.h>
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+
 #include "shadowlog.h"
 
 #include "lib/shadowlog_internal.h"
 
+/*
+ * While the databases are locked, the SYSLOG messages are kept in a
+ * bounded queue instead of calling syslog(), which can block when the
+ * log daemon is slow. They are sent when the last lock is released (or
+ * at exit). The messages which do not fit in the queue are dropped and
+ * counted.
+ */
+#define LOG_QUEUE_MAX	1024
+
+struct log_message {
+	int priority;
+	/*@only@*/char *text;
+};
+
+static unsigned int hold_depth = 0;
+static struct log_message queue[LOG_QUEUE_MAX];
+static size_t nqueued = 0;
+static unsigned long dropped = 0;		/* since the last flush */
+static unsigned long dropped_total = 0;
+
 const char *shadow_progname = "libshadow";
 FILE *shadow_logfd = NULL;
 
@@ -29,3 +57,90 @@ FILE *log_get_logfd(void)
 		return shadow_logfd;
 	return stderr;
 }
+
+static void log_flush (void)
+{
+	size_t i;
+
+	for (i = 0; i < nqueued; i++) {
+		syslog (queue[i].priority, "%s", queue[i].text);
+		free (queue[i].text);
+	}
+	nqueued = 0;
+
+	if (0 != dropped) {
+		syslog (LOG_WARNING, "%lu log messages were dropped", dropped);
+		dropped = 0;
+	}
+}
+
+static void log_flush_at_exit (void)
+{
+	hold_depth = 0;
+	log_flush ();
+}
+
+/*
+ * log_hold - Queue the next SYSLOG messages
+ *
+ *	The calls can be nested. The messages are sent by the matching
+ *	log_release().
+ */
+void log_hold (void)
+{
+	static bool registered = false;
+
+	if (!registered) {
+		if (atexit (log_flush_at_exit) != 0) {
+			return;
+		}
+		registered = true;
+	}
+	hold_depth++;
+}
+
+/*
+ * log_release - Send the messages queued since the first log_hold()
+ */
+void log_release (void)
+{
+	if (0 == hold_depth) {
+		return;
+	}
+	hold_depth--;
+	if (0 == hold_depth) {
+		log_flush ();
+	}
+}
+
+/*
+ * log_get_dropped - Return the number of messages which did not fit in
+ *                   the queue
+ */
+unsigned long log_get_dropped (void)
+{
+	return dropped_total;
+}
+
+/*
+ * shadow_syslog - Backend of the SYSLOG macro
+ */
+void shadow_syslog (int priority, const char *format, ...)
+{
+	va_list ap;
+	char *text;
+
+	va_start (ap, format);
+	if (0 == hold_depth) {
+		vsyslog (priority, format, ap);
+	} else if (   (nqueued == LOG_QUEUE_MAX)
+	           || (vasprintf (&text, format, ap) < 0)) {
+		dropped++;
+		dropped_total++;
+	} else {
+		queue[nqueued].priority = priority;
+		queue[nqueued].text = text;
+		nqueued++;
+	}
+	va_end (ap);
+}
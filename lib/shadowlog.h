@@ -36,5 +36,8 @@ extern void log_set_progname(const char *);
 extern const char *log_get_progname(void);
 extern void log_set_logfd(FILE *fd);
 extern FILE *log_get_logfd(void);
+extern void log_hold(void);
+extern void log_release(void);
+extern unsigned long log_get_dropped(void);
 
 #endif
@@ -0,0 +1,235 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_XATTR_H
+#include <sys/xattr.h>
+#endif
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Sorted databases
+ *
+ * When SORTED_DATABASES is set, commonio writes the passwd, group,
+ * subuid and subgid files with their lines sorted by their first field
+ * (see sorted_keycmp()). Such a file carries the SORTED_XATTR extended
+ * attribute, which records its size and modification time once it was
+ * written. A file modified by another program no longer matches them,
+ * and is then read as unsorted.
+ *
+ * The lines of a key are found with a binary search of the mapped file,
+ * which reads a few pages instead of the whole file.
+ */
+#define SORTED_XATTR	"user.shadow.sorted"
+#define SORTED_LEN	64	/* with the terminating NUL */
+
+/*
+ * sorted_keycmp - Compare the keys a and b, of length alen and blen
+ *
+ *	The keys are compared as unsigned bytes, and a key sorts after
+ *	its prefixes, as with strcmp().
+ */
+int sorted_keycmp (const char *a, size_t alen, const char *b, size_t blen)
+{
+	int ret = memcmp (a, b, (alen < blen) ? alen : blen);
+
+	if (0 != ret) {
+		return ret;
+	}
+	return (alen < blen) ? -1 : (alen > blen) ? 1 : 0;
+}
+
+#ifdef HAVE_SYS_XATTR_H
+static int sorted_stamp (const struct stat *sb, char *buf, size_t size)
+{
+	return snprintf (buf, size, "%llu %lld %ld",
+	                 (unsigned long long) sb->st_size,
+	                 (long long) sb->st_mtim.tv_sec,
+	                 (long) sb->st_mtim.tv_nsec);
+}
+#endif
+
+/*
+ * sorted_mark - Record that the file open as fd is sorted.
+ *
+ *	It must be called after the last write to the file.
+ *	Return 0 on success, -1 on failure.
+ */
+int sorted_mark (int fd)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char buf[SORTED_LEN];
+	struct stat sb;
+	int len;
+
+	if (fstat (fd, &sb) != 0) {
+		return -1;
+	}
+	len = sorted_stamp (&sb, buf, sizeof buf);
+	return fsetxattr (fd, SORTED_XATTR, buf, len, 0);
+#else
+	(void) fd;
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+/*
+ * line_key - Return the length of the key of the line at p, which ends
+ *	before end.
+ */
+static size_t line_key (const char *p, const char *end)
+{
+	const char *q = p;
+
+	while ((q < end) && (':' != *q) && ('\n' != *q)) {
+		q++;
+	}
+	return q - p;
+}
+
+/*
+ * next_line - Return the start of the line after the line at p, or end.
+ */
+static const char *next_line (const char *p, const char *end)
+{
+	const char *nl = memchr (p, '\n', end - p);
+
+	return (NULL != nl) ? nl + 1 : end;
+}
+
+/*
+ * sorted_lookup - Find the lines of a sorted database with the given
+ *	first field.
+ *
+ *	Return the number of lines and set *lines to a NULL terminated
+ *	list of them (allocated, without newlines), in the order of the
+ *	file, or return -1 if the file is not marked sorted: the database
+ *	must then be scanned.
+ */
+int sorted_lookup (const char *dbfile, const char *key,
+                   /*@out@*/char ***lines)
+{
+#ifdef HAVE_SYS_XATTR_H
+	char stamp[SORTED_LEN], buf[SORTED_LEN];
+	size_t keylen = strlen (key);
+	const char *base, *end, *p;
+	size_t lo, hi, count = 0;
+	char **list = NULL;
+	struct stat sb;
+	ssize_t len;
+	int fd;
+
+	*lines = NULL;
+
+	fd = open (dbfile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	len = fgetxattr (fd, SORTED_XATTR, buf, sizeof buf - 1);
+	if ((len <= 0) || (fstat (fd, &sb) != 0)) {
+		(void) close (fd);
+		return -1;
+	}
+	buf[len] = '\0';
+	(void) sorted_stamp (&sb, stamp, sizeof stamp);
+	if (strcmp (buf, stamp) != 0) {
+		(void) close (fd);
+		return -1;
+	}
+
+	list = malloc (64 * sizeof *list);
+	if (NULL == list) {
+		(void) close (fd);
+		return -1;
+	}
+	list[0] = NULL;
+	if (0 == sb.st_size) {
+		(void) close (fd);
+		*lines = list;
+		return 0;
+	}
+
+	base = mmap (NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	(void) close (fd);
+	if (MAP_FAILED == base) {
+		free (list);
+		return -1;
+	}
+	end = base + sb.st_size;
+
+	/* Find the first line whose key is not lower than key */
+	lo = 0;
+	hi = sb.st_size;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		while ((mid > lo) && ('\n' != base[mid - 1])) {
+			mid--;
+		}
+		p = base + mid;
+		if (sorted_keycmp (p, line_key (p, end), key, keylen) < 0) {
+			lo = next_line (p, end) - base;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* List the lines of key */
+	for (p = base + lo; p < end; p = next_line (p, end)) {
+		size_t klen = line_key (p, end);
+		const char *e = p + klen;
+		char **l;
+
+		if (sorted_keycmp (p, klen, key, keylen) != 0) {
+			break;
+		}
+		while ((e < end) && ('\n' != *e)) {
+			e++;
+		}
+		if (0 == ((count + 1) % 64)) {
+			l = realloc (list, (count + 1 + 64) * sizeof *l);
+			if (NULL == l) {
+				goto fail;
+			}
+			list = l;
+		}
+		list[count] = strndup (p, e - p);
+		if (NULL == list[count]) {
+			goto fail;
+		}
+		count++;
+		list[count] = NULL;
+	}
+
+	(void) munmap ((void *) base, sb.st_size);
+	*lines = list;
+	return count;
+
+fail:
+	(void) munmap ((void *) base, sb.st_size);
+	while (count > 0) {
+		free (list[--count]);
+	}
+	free (list);
+	return -1;
+#else
+	(void) dbfile;
+	(void) key;
+	*lines = NULL;
+	return -1;
+#endif
+}
@@ -6,21 +6,91 @@
 
 #include <config.h>
 
+#include <signal.h>
 #include <stdio.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 #include "exitcodes.h"
 #include "prototypes.h"
+#include "probes.h"
 
 #include "shadowlog_internal.h"
 
+#define POLL_INTERVAL_MS	10
+
+/*
+ * wait_deadline - Wait for the command cmd of run_command() until the
+ *	deadline, and kill it then.
+ */
+static int wait_deadline (const char *cmd, pid_t pid, /*@out@*/int *status,
+                          const struct timespec *start)
+{
+	struct timespec pause;
+	pid_t wpid;
+
+	pause.tv_sec = 0;
+	pause.tv_nsec = POLL_INTERVAL_MS * 1000000L;
+	for (;;) {
+		wpid = waitpid (pid, status, WNOHANG);
+		if (wpid == pid) {
+			break;
+		}
+		if (((pid_t)-1 == wpid) && (EINTR != errno)) {
+			timing_stop ("run_command", start);
+			fprintf (shadow_logfd, "%s: waitpid: %s\n",
+			         shadow_progname, strerror (errno));
+			return -1;
+		}
+		if (deadline_check (cmd) != 0) {
+			(void) kill (pid, SIGKILL);
+			while (   (waitpid (pid, status, 0) == -1)
+			       && (EINTR == errno)) {
+			}
+			timing_stop ("run_command", start);
+			PROBE2 (command__exit, cmd, -1);
+			errno = ETIMEDOUT;
+			return -1;
+		}
+		(void) nanosleep (&pause, NULL);
+	}
+	timing_stop ("run_command", start);
+	PROBE2 (command__exit, cmd, *status);
+	return 0;
+}
+
+/*
+ * run_command - Execute cmd with argv and envp (the environment if NULL),
+ *               and wait for it.
+ *
+ *	*status is set to the status of the command, as returned by
+ *	waitpid(). A command which cannot be found exits with
+ *	E_CMD_NOTFOUND, and a command which cannot be executed with
+ *	E_CMD_NOEXEC.
+ *
+ *	The command is started with posix_spawn(), which does not copy the
+ *	address space of the caller: its cost does not depend on the size
+ *	of the databases loaded by the caller.
+ *
+ *	A command still running at the deadline of the tool is killed,
+ *	and errno is set to ETIMEDOUT.
+ *
+ *	Return 0 if the command could be waited for, -1 otherwise.
+ */
 int run_command (const char *cmd, const char *argv[],
                  /*@null@*/const char *envp[], /*@out@*/int *status)
 {
 	pid_t pid, wpid;
+	struct timespec start;
+#ifdef HAVE_POSIX_SPAWN
+	int err;
+#endif
 
 	if (NULL == envp) {
 		envp = (const char **)environ;
@@ -29,6 +99,27 @@ int run_command (const char *cmd, const char *argv[],
 	(void) fflush (stdout);
 	(void) fflush (shadow_logfd);
 
+	timing_start (&start);
+#ifdef HAVE_POSIX_SPAWN
+	err = posix_spawn (&pid, cmd, NULL, NULL, (char * const *) argv,
+	                   (char * const *) envp);
+	if (0 != err) {
+		timing_stop ("run_command", &start);
+		/* Report the failure as the status of the command would */
+		if (ENOENT == err) {
+			*status = E_CMD_NOTFOUND << 8;
+			return 0;
+		}
+		fprintf (shadow_logfd, "%s: cannot execute %s: %s\n",
+		         shadow_progname, cmd, strerror (err));
+		if ((EAGAIN == err) || (ENOMEM == err)) {
+			/* The process could not be created */
+			return -1;
+		}
+		*status = E_CMD_NOEXEC << 8;
+		return 0;
+	}
+#else				/* !HAVE_POSIX_SPAWN */
 	pid = fork ();
 	if (0 == pid) {
 		(void) execve (cmd, (char * const *) argv,
@@ -44,6 +135,12 @@ int run_command (const char *cmd, const char *argv[],
 		         shadow_progname, cmd, strerror (errno));
 		return -1;
 	}
+#endif				/* !HAVE_POSIX_SPAWN */
+	PROBE2 (command__spawn, cmd, pid);
+
+	if (deadline_active ()) {
+		return wait_deadline (cmd, pid, status, &start);
+	}
 
 	do {
 		wpid = waitpid (pid, status, 0);
@@ -51,6 +148,8 @@ int run_command (const char *cmd, const char *argv[],
 			break;
 	} while (   ((pid_t)-1 == wpid && errno == EINTR)
 	         || ((pid_t)-1 != wpid && wpid != pid));
+	timing_stop ("run_command", &start);
+	PROBE2 (command__exit, cmd, ((pid_t)-1 == wpid) ? -1 : *status);
 
 	if ((pid_t)-1 == wpid) {
 		fprintf (shadow_logfd, "%s: waitpid (status: %d): %s\n",
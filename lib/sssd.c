@@ -4,10 +4,13 @@
 #ifdef USE_SSSD
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/wait.h>
 #include <sys/types.h>
 #include "exitcodes.h"
 #include "defines.h"
+#include "getdef.h"
 #include "prototypes.h"
 #include "sssd.h"
 
@@ -15,37 +18,94 @@
 
 #define MSG_SSSD_FLUSH_CACHE_FAILED "%s: Failed to flush the sssd cache."
 
-int sssd_flush_cache (int dbflags)
+/*
+ * The entries of passwd and group changed since the last flush. When
+ * they are known, and there are at most SSSD_INVALIDATE_MAX of them,
+ * only these entries are invalidated in the cache of sssd.
+ */
+struct sssd_changes {
+	int db;			/* SSSD_DB_PASSWD or SSSD_DB_GROUP */
+	char opt[3];		/* option of sss_cache for an entry */
+	char **names;
+	size_t count;
+	bool all;		/* too many entries, flush the whole map */
+};
+
+static struct sssd_changes changes[] = {
+	{SSSD_DB_PASSWD, "-u", NULL, 0, false},
+	{SSSD_DB_GROUP,  "-g", NULL, 0, false},
+};
+
+#define NCHANGES	(sizeof changes / sizeof changes[0])
+
+static void forget_changes (struct sssd_changes *c)
 {
-	int status, code, rv;
-	const char *cmd = "/usr/sbin/sss_cache";
-	char *sss_cache_args = NULL;
-	const char *spawnedArgs[] = {"sss_cache", NULL, NULL};
-	const char *spawnedEnv[] = {NULL};
-	int i = 0;
+	size_t i;
 
-	sss_cache_args = malloc(4);
-	if (sss_cache_args == NULL) {
-	    return -1;
+	for (i = 0; i < c->count; i++) {
+		free (c->names[i]);
 	}
+	free (c->names);
+	c->names = NULL;
+	c->count = 0;
+	c->all = false;
+}
 
-	sss_cache_args[i++] = '-';
-	if (dbflags & SSSD_DB_PASSWD) {
-		sss_cache_args[i++] = 'U';
-	}
-	if (dbflags & SSSD_DB_GROUP) {
-		sss_cache_args[i++] = 'G';
-	}
-	sss_cache_args[i++] = '\0';
-	if (i == 2) {
-		/* Neither passwd nor group, nothing to do */
-		free(sss_cache_args);
-		return 0;
+/*
+ * sssd_entry_changed - record an entry changed in the databases dbflags
+ *
+ *	The entries are invalidated by the next sssd_flush_cache().
+ */
+void sssd_entry_changed (int dbflags, const char *name)
+{
+	unsigned long max = getdef_ulong ("SSSD_INVALIDATE_MAX", 16);
+	size_t i;
+
+	for (i = 0; i < NCHANGES; i++) {
+		struct sssd_changes *c = &changes[i];
+		char **names;
+
+		if ((0 == (dbflags & c->db)) || c->all) {
+			continue;
+		}
+		if (c->count >= max) {
+			forget_changes (c);
+			c->all = true;
+			continue;
+		}
+		if (0 == (c->count % 64)) {
+			names = realloc (c->names, (c->count + 64) * sizeof *names);
+			if (NULL == names) {
+				forget_changes (c);
+				c->all = true;
+				continue;
+			}
+			c->names = names;
+		}
+		c->names[c->count] = strdup (name);
+		if (NULL == c->names[c->count]) {
+			forget_changes (c);
+			c->all = true;
+			continue;
+		}
+		c->count++;
 	}
-	spawnedArgs[1] = sss_cache_args;
+}
+
+/*
+ * run_sss_cache - run sss_cache with the arguments args
+ *
+ *	*missing is set if sss_cache is not installed.
+ *	Return 0 on success, -1 on failure.
+ */
+static int run_sss_cache (const char *args[], bool *missing)
+{
+	int status, code, rv;
+	const char *cmd = "/usr/sbin/sss_cache";
+	const char *spawnedEnv[] = {NULL};
 
-	rv = run_command (cmd, spawnedArgs, spawnedEnv, &status);
-	free(sss_cache_args);
+	*missing = false;
+	rv = run_command (cmd, args, spawnedEnv, &status);
 	if (rv != 0) {
 		/* run_command writes its own more detailed message. */
 		SYSLOG ((LOG_WARN, MSG_SSSD_FLUSH_CACHE_FAILED, shadow_progname));
@@ -60,6 +120,7 @@ int sssd_flush_cache (int dbflags)
 	} else if (code == E_CMD_NOTFOUND) {
 		/* sss_cache is not installed, or it is installed but uses an
 		   interpreter that is missing.  Probably the former. */
+		*missing = true;
 		return 0;
 	} else if (code != 0) {
 		SYSLOG ((LOG_WARN, "%s: sss_cache exited with status %d", shadow_progname, code));
@@ -69,7 +130,92 @@ int sssd_flush_cache (int dbflags)
 
 	return 0;
 }
+
+/*
+ * flush_entries - invalidate the recorded entries of the databases
+ *                 dbflags, one user and one group per sss_cache
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int flush_entries (int dbflags, bool *missing)
+{
+	const char *spawnedArgs[2 * NCHANGES + 2];
+	size_t k, i, n;
+
+	for (k = 0;; k++) {
+		n = 0;
+		spawnedArgs[n++] = "sss_cache";
+		for (i = 0; i < NCHANGES; i++) {
+			if ((0 != (dbflags & changes[i].db)) && (k < changes[i].count)) {
+				spawnedArgs[n++] = changes[i].opt;
+				spawnedArgs[n++] = changes[i].names[k];
+			}
+		}
+		spawnedArgs[n] = NULL;
+		if (1 == n) {
+			return 0;
+		}
+		if (run_sss_cache (spawnedArgs, missing) != 0) {
+			return -1;
+		}
+		if (*missing) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * sssd_flush_cache - invalidate the maps dbflags in the cache of sssd
+ *
+ *	The results of the lookups of new IDs are kept (see idprobe.c).
+ */
+int sssd_flush_cache (int dbflags)
+{
+	uint64_t before = id_probe_stamp ();
+	int entry_dbs = 0;
+	int rv = 0;
+	bool missing = false;
+	char sss_cache_args[4];
+	const char *spawnedArgs[] = {"sss_cache", NULL, NULL};
+	size_t i;
+	int n = 0;
+
+	/* The maps whose changed entries are known */
+	for (i = 0; i < NCHANGES; i++) {
+		if (   (0 != (dbflags & changes[i].db))
+		    && !changes[i].all
+		    && (0 != changes[i].count)) {
+			entry_dbs |= changes[i].db;
+		}
+	}
+	if (   (0 != entry_dbs)
+	    && (flush_entries (entry_dbs, &missing) != 0)) {
+		entry_dbs = 0;	/* flush the whole maps */
+	}
+
+	sss_cache_args[n++] = '-';
+	if (   (0 != (dbflags & SSSD_DB_PASSWD))
+	    && (0 == (entry_dbs & SSSD_DB_PASSWD))) {
+		sss_cache_args[n++] = 'U';
+	}
+	if (   (0 != (dbflags & SSSD_DB_GROUP))
+	    && (0 == (entry_dbs & SSSD_DB_GROUP))) {
+		sss_cache_args[n++] = 'G';
+	}
+	sss_cache_args[n++] = '\0';
+	if ((n != 2) && !missing) {
+		spawnedArgs[1] = sss_cache_args;
+		rv = run_sss_cache (spawnedArgs, &missing);
+	}
+
+	for (i = 0; i < NCHANGES; i++) {
+		if (0 != (dbflags & changes[i].db)) {
+			forget_changes (&changes[i]);
+		}
+	}
+	id_probe_restamp (before);
+	return rv;
+}
 #else				/* USE_SSSD */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* USE_SSSD */
-
@@ -6,11 +6,14 @@
 
 /*
  * sssd_flush_cache - flush specified service buffer in sssd cache
+ * sssd_entry_changed - record an entry to invalidate at the next flush
  */
 #ifdef	USE_SSSD
 extern int sssd_flush_cache (int dbflags);
+extern void sssd_entry_changed (int dbflags, const char *name);
 #else
 #define sssd_flush_cache(service) (0)
+#define sssd_entry_changed(dbflags, name)
 #endif
 
 #endif
@@ -15,7 +15,14 @@
 #include <sys/types.h>
 #include <pwd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "getdef.h"
 
 #define ID_SIZE 31
 
@@ -61,18 +68,29 @@ static void subordinate_free (/*@out@*/ /*@only@*/void *ent)
 }
 
 /*
- * subordinate_parse:
+ * subordinate_getowner: the owner of a subordinate_range, by which the
+ * database is sorted when SORTED_DATABASES is set
+ */
+static const char *subordinate_getowner (const void *ent)
+{
+	const struct subordinate_range *range = ent;
+
+	return range->owner;
+}
+
+/*
+ * parse_range: parse a line in @range
  *
  * @line: a line to parse
+ * @range: the range to fill in
+ * @rangebuf: buffer of @size bytes, to which ->owner points
  *
- * Returns a pointer to a subordinate_range struct representing the values
- * in @line, or NULL on failure.  Note that the returned value should not
- * be freed by the caller.
+ * Returns @range, or NULL on failure.
  */
-static void *subordinate_parse (const char *line)
+static /*@null@*/struct subordinate_range *parse_range (const char *line,
+							struct subordinate_range *range,
+							char *rangebuf, size_t size)
 {
-	static struct subordinate_range range;
-	static char rangebuf[1024];
 	int i;
 	char *cp;
 	char *fields[SUBID_NFIELDS];
@@ -81,7 +99,7 @@ static void *subordinate_parse (const char *line)
 	 * Copy the string to a temporary buffer so the substrings can
 	 * be modified to be NULL terminated.
 	 */
-	if (strlen (line) >= sizeof rangebuf)
+	if (strlen (line) >= size)
 		return NULL;	/* fail if too long */
 	strcpy (rangebuf, line);
 
@@ -110,13 +128,33 @@ static void *subordinate_parse (const char *line)
 	 */
 	if (i != SUBID_NFIELDS || *fields[0] == '\0' || *fields[1] == '\0' || *fields[2] == '\0')
 		return NULL;
-	range.owner = fields[0];
-	if (getulong (fields[1], &range.start) == 0)
+	range->owner = fields[0];
+	if (getulong (fields[1], &range->start) == 0)
 		return NULL;
-	if (getulong (fields[2], &range.count) == 0)
+	if (getulong (fields[2], &range->count) == 0)
 		return NULL;
 
-	return &range;
+	return range;
+}
+
+/*
+ * subordinate_parse:
+ *
+ * @line: a line to parse
+ *
+ * Returns a pointer to a subordinate_range struct representing the values
+ * in @line, or NULL on failure.  Note that the returned value should not
+ * be freed by the caller.
+ *
+ * It is only called by commonio_open(), which is serialized by
+ * subid_db_open() for the databases of other threads.
+ */
+static void *subordinate_parse (const char *line)
+{
+	static struct subordinate_range range;
+	static char rangebuf[1024];
+
+	return parse_range (line, &range, rangebuf, sizeof rangebuf);
 }
 
 /*
@@ -137,299 +175,1601 @@ static int subordinate_put (const void *ent, FILE * file)
 			       range->count) < 0 ? -1  : 0;
 }
 
-static struct commonio_ops subordinate_ops = {
-	subordinate_dup,	/* dup */
-	subordinate_free,	/* free */
-	NULL,			/* getname */
-	subordinate_parse,	/* parse */
-	subordinate_put,	/* put */
-	fgets,			/* fgets */
-	fputs,			/* fputs */
-	NULL,			/* open_hook */
-	NULL,			/* close_hook */
-};
-
 /*
- * range_exists: Check whether @owner owns any ranges
- *
- * @db: database to query
- * @owner: owner being queried
+ * Index of the ranges of a subordinate database.
  *
- * Returns true if @owner owns any subuid ranges, false otherwise.
+ * The ranges are indexed by start (with the highest end of the ranges
+ * before each position, to find the ranges including an ID) and by
+ * owner. The indexes are built on the first query after the database is
+ * opened, and dropped when ranges are modified.
  */
-static bool range_exists(struct commonio_db *db, const char *owner)
-{
+struct range_item {
 	const struct subordinate_range *range;
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		if (0 == strcmp(range->owner, owner))
-			return true;
-	}
-	return false;
-}
+	size_t pos;		/* position of the range in the file */
+};
 
-/*
- * find_range: find a range which @owner is authorized to use which includes
- *             subuid @val.
- *
- * @db: database to query
- * @owner: owning uid being queried
- * @val: subuid being searched for.
- *
- * Returns a range of subuids belonging to @owner and including the subuid
- * @val, or NULL if no such range exists.
- */
-static const struct subordinate_range *find_range(struct commonio_db *db,
-						  const char *owner, unsigned long val)
-{
-	const struct subordinate_range *range;
+/* IDs from start to last (included) which are not part of any range */
+struct range_hole {
+	unsigned long start;
+	unsigned long last;
+};
 
+struct range_index {
+	size_t count;
+	size_t next_pos;	/* position of the next appended range */
+	/*@null@*/ /*@only@*/struct range_item *by_start;
+	/*@null@*/ /*@only@*/unsigned long *max_last;
+	/*@null@*/ /*@only@*/struct range_item *by_owner;
 	/*
-	 * Search for exact username/group specification
-	 *
-	 * This is the original method - go fast through the db, doing only
-	 * exact username/group string comparison. Therefore we leave it as-is
-	 * for the time being, in order to keep it equally fast as it was
-	 * before.
+	 * The holes, sorted. A hole taken by a new range is emptied
+	 * (start > last) rather than removed. hole_size is a segment
+	 * tree of the size of the holes, with hole_leaves leaves.
 	 */
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		unsigned long first = range->start;
-		unsigned long last = first + range->count - 1;
-
-		if (0 != strcmp(range->owner, owner))
-			continue;
+	size_t nholes;
+	size_t hole_leaves;
+	/*@null@*/ /*@only@*/struct range_hole *holes;
+	/*@null@*/ /*@only@*/unsigned long *hole_size;
+};
 
-		if ((val >= first) && (val <= last))
-			return range;
-	}
+/*
+ * Owners of the ranges resolved to UIDs since a subordinate database was
+ * opened, sorted by name, so that each name is looked up in the name
+ * service only once per query.
+ */
+struct owner_entry {
+	/*@only@*/char *name;
+	bool found;
+	uid_t uid;
+};
 
+struct owner_cache {
+	/*@null@*/ /*@only@*/struct owner_entry *entries;
+	size_t count;
+};
 
-        /*
-         * We only do special handling for these two files
-         */
-        if ((0 != strcmp(db->filename, "/etc/subuid")) && (0 != strcmp(db->filename, "/etc/subgid")))
-                return NULL;
+/*
+ * A subordinate database, with the indexes of its ranges and the owners
+ * it resolved. Besides the databases of the process, libsubid opens
+ * private copies with subid_db_open(), which can be queried by several
+ * threads at once.
+ */
+struct subordinate_db {
+	struct commonio_db db;		/* must be first */
+	struct range_index index;
+	struct owner_cache owners;
+};
 
-        /*
-         * Search loop above did not produce any result. Let's rerun it,
-         * but this time try to match actual UIDs. The first entry that
-         * matches is considered a success.
-         * (It may be specified as literal UID or as another username which
-         * has the same UID as the username we are looking for.)
-         */
-        struct passwd *pwd;
-        uid_t          owner_uid;
-        char           owner_uid_string[33] = "";
+static struct subordinate_db subordinate_uid;
+static struct subordinate_db subordinate_gid;
 
+static unsigned long range_last (const struct subordinate_range *range)
+{
+	return range->start + range->count - 1;
+}
 
-        /* Get UID of the username we are looking for */
-        pwd = getpwnam(owner);
-        if (NULL == pwd) {
-                /* Username not defined in /etc/passwd, or error occurred during lookup */
-                return NULL;
-        }
-        owner_uid = pwd->pw_uid;
-        sprintf(owner_uid_string, "%lu", (unsigned long int)owner_uid);
+static struct range_index *db_index (const struct commonio_db *db)
+{
+	return &((struct subordinate_db *) db)->index;
+}
 
-        commonio_rewind(db);
-        while ((range = commonio_next(db)) != NULL) {
-                unsigned long first = range->start;
-                unsigned long last = first + range->count - 1;
+static struct owner_cache *db_owners (const struct commonio_db *db)
+{
+	return &((struct subordinate_db *) db)->owners;
+}
 
-                /* For performance reasons check range before using getpwnam() */
-                if ((val < first) || (val > last)) {
-                        continue;
-                }
+static void hole_index_reset (struct range_index *idx)
+{
+	free (idx->holes);
+	free (idx->hole_size);
+	idx->holes = NULL;
+	idx->hole_size = NULL;
+	idx->nholes = 0;
+	idx->hole_leaves = 0;
+}
 
-                /*
-                 * Range matches. Check if range owner is specified
-                 * as numeric UID and if it matches.
-                 */
-                if (0 == strcmp(range->owner, owner_uid_string)) {
-                        return range;
-                }
+static void range_index_reset (struct range_index *idx)
+{
+	hole_index_reset (idx);
+	free (idx->by_start);
+	free (idx->max_last);
+	free (idx->by_owner);
+	memset (idx, 0, sizeof *idx);
+}
 
-                /*
-                 * Ok, this range owner is not specified as numeric UID
-                 * we are looking for. It may be specified as another
-                 * UID or as a literal username.
-                 *
-                 * If specified as another UID, the call to getpwnam()
-                 * will return NULL.
-                 *
-                 * If specified as literal username, we will get its
-                 * UID and compare that to UID we are looking for.
-                 */
-                const struct passwd *range_owner_pwd;
+static bool all_digits(const char *str)
+{
+	int i;
 
-                range_owner_pwd = getpwnam(range->owner);
-                if (NULL == range_owner_pwd) {
-                        continue;
-                }
+	for (i = 0; str[i] != '\0'; i++)
+		if (!isdigit(str[i]))
+			return false;
+	return true;
+}
 
-                if (owner_uid == range_owner_pwd->pw_uid) {
-                        return range;
-                }
-        }
+static void owner_cache_reset (struct owner_cache *cache)
+{
+	size_t i;
 
-	return NULL;
+	for (i = 0; i < cache->count; i++)
+		free (cache->entries[i].name);
+	free (cache->entries);
+	cache->entries = NULL;
+	cache->count = 0;
 }
 
 /*
- * have_range: check whether @owner is authorized to use the range
- *             (@start .. @start+@count-1).
- * @db: database to check
- * @owner: owning uid being queried
- * @start: start of range
- * @count: number of uids in range
+ * lookup_id: get the UID of the user, or the GID of the group (if
+ *            @group is set) @name, with the reentrant functions of NSS.
  *
- * Returns true if @owner is authorized to use the range, false otherwise.
+ * Returns false if there is no such user or group.
  */
-static bool have_range(struct commonio_db *db,
-		       const char *owner, unsigned long start, unsigned long count)
+static bool lookup_id (bool group, const char *name, unsigned long *id)
 {
-	const struct subordinate_range *range;
-	unsigned long end;
+	long size = sysconf (group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+	bool found = false;
+	int err;
 
-	if (count == 0)
-		return false;
+	if (size <= 0)
+		size = 16384;
+	for (;;) {
+		char *buf = malloc (size);
 
-	end = start + count - 1;
-	range = find_range (db, owner, start);
-	while (range) {
-		unsigned long last;
+		if (NULL == buf)
+			return false;
+		if (group) {
+			struct group grent, *grp = NULL;
 
-		last = range->start + range->count - 1;
-		if (last >= (start + count - 1))
-			return true;
+			err = getgrnam_r (name, &grent, buf, size, &grp);
+			if (NULL != grp) {
+				*id = grp->gr_gid;
+				found = true;
+			}
+		} else {
+			struct passwd pwent, *pwd = NULL;
 
-		count = end - last;
-		start = last + 1;
-		range = find_range(db, owner, start);
+			err = getpwnam_r (name, &pwent, buf, size, &pwd);
+			if (NULL != pwd) {
+				*id = pwd->pw_uid;
+				found = true;
+			}
+		}
+		free (buf);
+		if ((ERANGE != err) || (size > 1048576))
+			break;
+		size *= 2;
 	}
-	return false;
+	return found;
 }
 
-static bool append_range(struct subid_range **ranges, const struct subordinate_range *new, int n)
+/*
+ * owner_uid: get the UID of the user @name, through @cache, or directly
+ *            if @cache is NULL.
+ *
+ * Returns false if there is no such user.
+ */
+static bool owner_uid (/*@null@*/struct owner_cache *cache, const char *name, uid_t *uid)
 {
-	if (!*ranges) {
-		*ranges = malloc(sizeof(struct subid_range));
-		if (!*ranges)
-			return false;
-	} else {
-		struct subid_range *alloced;
-		alloced = realloc(*ranges, (n + 1) * (sizeof(struct subid_range)));
-		if (!alloced)
-			return false;
-		*ranges = alloced;
+	struct owner_entry *entries;
+	size_t lo = 0, hi;
+	unsigned long id;
+	bool found;
+
+	if (NULL == cache) {
+		found = lookup_id (false, name, &id);
+		if (found)
+			*uid = id;
+		return found;
 	}
-	(*ranges)[n].start = new->start;
-	(*ranges)[n].count = new->count;
-	return true;
-}
 
-void free_subordinate_ranges(struct subordinate_range **ranges, int count)
-{
-	int i;
+	hi = cache->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int ret = strcmp (cache->entries[mid].name, name);
 
-	if (!ranges)
-		return;
-	for (i = 0; i < count; i++)
-		subordinate_free(ranges[i]);
-	free(ranges);
+		if (0 == ret) {
+			*uid = cache->entries[mid].uid;
+			return cache->entries[mid].found;
+		}
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	found = lookup_id (false, name, &id);
+	if (found)
+		*uid = id;
+
+	/* Failing to cache the result is not an error */
+	entries = realloc (cache->entries, (cache->count + 1) * sizeof *entries);
+	if (NULL != entries) {
+		cache->entries = entries;
+		memmove (&entries[lo + 1], &entries[lo],
+			 (cache->count - lo) * sizeof *entries);
+		entries[lo].name = strdup (name);
+		if (NULL != entries[lo].name) {
+			entries[lo].found = found;
+			entries[lo].uid = found ? *uid : 0;
+			cache->count++;
+		} else {
+			memmove (&entries[lo], &entries[lo + 1],
+				 (cache->count - lo) * sizeof *entries);
+		}
+	}
+
+	return found;
 }
 
 /*
- * subordinate_range_cmp: compare uid ranges
+ * subordinate_open_hook: drop the indexes of the ranges and the owners
+ *                        resolved for the previously opened databases.
  *
- * @p1: pointer to a commonio_entry struct to compare
- * @p2: pointer to second commonio_entry struct to compare
- *
- * Returns 0 if the entries are the same.  Otherwise return -1
- * if the range in p1 is lower than that in p2, or (if the ranges are
- * equal) if the owning uid in p1 is lower than p2's.  Return 1 if p1's
- * range or owning uid is great than p2's.
+ * The private databases of subid_db_open() are reset when they are
+ * closed instead.
  */
-static int subordinate_range_cmp (const void *p1, const void *p2)
+static int subordinate_open_hook (void)
 {
-	struct subordinate_range *range1, *range2;
+	range_index_reset (&subordinate_uid.index);
+	range_index_reset (&subordinate_gid.index);
+	owner_cache_reset (&subordinate_uid.owners);
+	owner_cache_reset (&subordinate_gid.owners);
+	return 1;
+}
 
+static int item_start_cmp (const void *p1, const void *p2)
+{
+	const struct range_item *i1 = p1;
+	const struct range_item *i2 = p2;
 
-	range1 = (*(struct commonio_entry **) p1)->eptr;
-	if (range1 == NULL)
-		return 1;
+	if (i1->range->start != i2->range->start)
+		return (i1->range->start < i2->range->start) ? -1 : 1;
+	return (i1->pos < i2->pos) ? -1 : (i1->pos > i2->pos);
+}
 
-	range2 = (*(struct commonio_entry **) p2)->eptr;
-	if (range2 == NULL)
-		return -1;
+static int item_owner_cmp (const void *p1, const void *p2)
+{
+	const struct range_item *i1 = p1;
+	const struct range_item *i2 = p2;
+	int ret;
+
+	ret = strcmp (i1->range->owner, i2->range->owner);
+	if (0 != ret)
+		return ret;
+	return item_start_cmp (p1, p2);
+}
 
-	if (range1->start < range2->start)
-		return -1;
-	else if (range1->start > range2->start)
-		return 1;
-	else if (range1->count < range2->count)
-		return -1;
-	else if (range1->count > range2->count)
-		return 1;
-	else
-		return strcmp(range1->owner, range2->owner);
+static int item_pos_cmp (const void *p1, const void *p2)
+{
+	const struct range_item *i1 = p1;
+	const struct range_item *i2 = p2;
+
+	return (i1->pos < i2->pos) ? -1 : (i1->pos > i2->pos);
 }
 
 /*
- * find_free_range: find an unused consecutive sequence of ids to allocate
- *                  to a user.
- * @db: database to search
- * @min: the first uid in the range to find
- * @max: the highest uid to find
- * @count: the number of uids needed
- *
- * Return the lowest new uid, or ULONG_MAX on failure.
+ * range_items: list the ranges of @db, in the order of the file.
  */
-static unsigned long find_free_range(struct commonio_db *db,
-				     unsigned long min, unsigned long max,
-				     unsigned long count)
+static /*@null@*/struct range_item *range_items (const struct commonio_db *db,
+						 size_t *count)
 {
-	const struct subordinate_range *range;
-	unsigned long low, high;
+	const struct commonio_entry *ent;
+	struct range_item *items;
+	size_t n = 0;
 
-	/* When given invalid parameters fail */
-	if ((count == 0) || (max < min))
-		goto fail;
+	for (ent = db->head; NULL != ent; ent = ent->next) {
+		if (NULL != ent->eptr)
+			n++;
+	}
 
-	/* Sort by range then by owner */
-	commonio_sort (db, subordinate_range_cmp);
-	commonio_rewind(db);
+	items = malloc ((n + 1) * sizeof *items);
+	if (NULL == items)
+		return NULL;
 
-	low = min;
-	while ((range = commonio_next(db)) != NULL) {
-		unsigned long first = range->start;
-		unsigned long last = first + range->count - 1;
+	n = 0;
+	for (ent = db->head; NULL != ent; ent = ent->next) {
+		if (NULL != ent->eptr) {
+			items[n].range = ent->eptr;
+			items[n].pos = n;
+			n++;
+		}
+	}
 
-		/* Find the top end of the hole before this range */
-		high = first;
+	*count = n;
+	return items;
+}
 
-		/* Don't allocate IDs after max (included) */
-		if (high > max + 1) {
-			high = max + 1;
-		}
+static void update_max_last (struct range_index *idx, size_t from)
+{
+	size_t i;
 
-		/* Is the hole before this range large enough? */
-		if ((high > low) && ((high - low) >= count))
-			return low;
+	for (i = from; i < idx->count; i++) {
+		unsigned long last = range_last (idx->by_start[i].range);
 
-		/* Compute the low end of the next hole */
-		if (low < (last + 1))
-			low = last + 1;
-		if (low > max)
-			goto fail;
+		idx->max_last[i] = last;
+		if ((i > 0) && (idx->max_last[i - 1] > last))
+			idx->max_last[i] = idx->max_last[i - 1];
 	}
+}
+
+/*
+ * index_by_start: get the index of the ranges of @db sorted by start.
+ *
+ * Returns NULL if it could not be built.
+ */
+static /*@null@*/struct range_index *index_by_start (struct commonio_db *db)
+{
+	struct range_index *idx = db_index (db);
+	size_t count;
+
+	if (!db->isopen) {
+		errno = EINVAL;
+		return NULL;
+	}
+	if (NULL != idx->by_start)
+		return idx;
+
+	idx->by_start = range_items (db, &count);
+	if (NULL == idx->by_start)
+		return NULL;
+	idx->max_last = malloc ((count + 1) * sizeof *idx->max_last);
+	if (NULL == idx->max_last) {
+		range_index_reset (idx);
+		return NULL;
+	}
+	idx->count = count;
+	idx->next_pos = count;
+	qsort (idx->by_start, count, sizeof *idx->by_start, item_start_cmp);
+	update_max_last (idx, 0);
+
+	return idx;
+}
+
+/*
+ * index_by_owner: get the index of the ranges of @db sorted by owner.
+ *
+ * Returns NULL if it could not be built.
+ */
+static /*@null@*/struct range_index *index_by_owner (struct commonio_db *db)
+{
+	struct range_index *idx;
+
+	idx = index_by_start (db);
+	if (NULL == idx)
+		return NULL;
+	if (NULL != idx->by_owner)
+		return idx;
+
+	idx->by_owner = malloc ((idx->count + 1) * sizeof *idx->by_owner);
+	if (NULL == idx->by_owner)
+		return NULL;
+	memcpy (idx->by_owner, idx->by_start, idx->count * sizeof *idx->by_owner);
+	qsort (idx->by_owner, idx->count, sizeof *idx->by_owner, item_owner_cmp);
+
+	return idx;
+}
+
+static unsigned long hole_size (const struct range_hole *hole)
+{
+	if (hole->start > hole->last)
+		return 0;
+	if ((hole->last - hole->start) == ULONG_MAX)
+		return ULONG_MAX;
+	return hole->last - hole->start + 1;
+}
+
+static void hole_update (struct range_index *idx, size_t i)
+{
+	size_t node = idx->hole_leaves + i;
+
+	idx->hole_size[node] = hole_size (&idx->holes[i]);
+	for (node /= 2; node > 0; node /= 2) {
+		unsigned long l = idx->hole_size[2 * node];
+		unsigned long r = idx->hole_size[2 * node + 1];
+
+		idx->hole_size[node] = (l > r) ? l : r;
+	}
+}
+
+static bool hole_tree_build (struct range_index *idx)
+{
+	size_t i;
+
+	free (idx->hole_size);
+	for (idx->hole_leaves = 1; idx->hole_leaves < idx->nholes; idx->hole_leaves *= 2) {
+	}
+	idx->hole_size = calloc (2 * idx->hole_leaves, sizeof *idx->hole_size);
+	if (NULL == idx->hole_size) {
+		hole_index_reset (idx);
+		return false;
+	}
+	for (i = 0; i < idx->nholes; i++)
+		idx->hole_size[idx->hole_leaves + i] = hole_size (&idx->holes[i]);
+	for (i = idx->hole_leaves - 1; i > 0; i--) {
+		unsigned long l = idx->hole_size[2 * i];
+		unsigned long r = idx->hole_size[2 * i + 1];
+
+		idx->hole_size[i] = (l > r) ? l : r;
+	}
+	return true;
+}
+
+/*
+ * index_holes: get the index of the holes between the ranges of @db.
+ *
+ * Returns NULL if it could not be built.
+ */
+static /*@null@*/struct range_index *index_holes (struct commonio_db *db)
+{
+	struct range_index *idx;
+	unsigned long low = 0;
+	size_t i;
+
+	idx = index_by_start (db);
+	if (NULL == idx)
+		return NULL;
+	if (NULL != idx->holes)
+		return idx;
+
+	/* There is at most one hole before each range, and one at the end */
+	idx->holes = malloc ((idx->count + 1) * sizeof *idx->holes);
+	if (NULL == idx->holes)
+		return NULL;
+	idx->nholes = 0;
+	for (i = 0; i < idx->count; i++) {
+		const struct subordinate_range *range = idx->by_start[i].range;
+
+		if (range->start > low) {
+			idx->holes[idx->nholes].start = low;
+			idx->holes[idx->nholes].last = range->start - 1;
+			idx->nholes++;
+		}
+		if (0 == range->count) {
+			if (low < range->start)
+				low = range->start;
+			continue;
+		}
+		if (range_last (range) == ULONG_MAX)
+			break;
+		if (low < range_last (range) + 1)
+			low = range_last (range) + 1;
+	}
+	if (i == idx->count) {
+		idx->holes[idx->nholes].start = low;
+		idx->holes[idx->nholes].last = ULONG_MAX;
+		idx->nholes++;
+	}
+
+	if (!hole_tree_build (idx))
+		return NULL;
+
+	return idx;
+}
+
+/*
+ * hole_first: position of the first hole which ends at or after @val.
+ */
+static size_t hole_first (const struct range_index *idx, unsigned long val)
+{
+	size_t lo = 0, hi = idx->nholes;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (idx->holes[mid].last < val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * hole_find: position of the first hole after @from (included) with at
+ *            least @count IDs, in the subtree of @node covering the
+ *            holes from @lo to @hi (excluded).
+ *
+ * Returns idx->nholes if there is none.
+ */
+static size_t hole_find (const struct range_index *idx, size_t node,
+			 size_t lo, size_t hi, size_t from, unsigned long count)
+{
+	size_t mid, ret;
+
+	if ((hi <= from) || (idx->hole_size[node] < count))
+		return idx->nholes;
+	if (hi - lo == 1)
+		return lo;
+
+	mid = lo + (hi - lo) / 2;
+	ret = hole_find (idx, 2 * node, lo, mid, from, count);
+	if (ret != idx->nholes)
+		return ret;
+	return hole_find (idx, 2 * node + 1, mid, hi, from, count);
+}
+
+/*
+ * holes_take: remove the IDs of @range from the holes of @idx.
+ *
+ * Returns false if the holes could not be updated.
+ */
+static bool holes_take (struct range_index *idx,
+			const struct subordinate_range *range)
+{
+	unsigned long first = range->start;
+	unsigned long last = range_last (range);
+	struct range_hole *hole;
+	size_t i;
+
+	if ((0 == range->count) || (last < first))
+		return true;
+
+	i = hole_first (idx, first);
+	if ((i == idx->nholes) || (idx->holes[i].start > last))
+		return true;
+	hole = &idx->holes[i];
+
+	/* The range is in the middle of a hole: split it */
+	if ((hole->start < first) && (hole->last > last)) {
+		struct range_hole *holes;
+
+		holes = realloc (idx->holes, (idx->nholes + 1) * sizeof *holes);
+		if (NULL == holes)
+			return false;
+		idx->holes = holes;
+		memmove (&holes[i + 1], &holes[i],
+			 (idx->nholes - i) * sizeof *holes);
+		idx->nholes++;
+		holes[i].last = first - 1;
+		holes[i + 1].start = last + 1;
+		return hole_tree_build (idx);
+	}
+
+	for (; (i < idx->nholes) && (idx->holes[i].start <= last); i++) {
+		hole = &idx->holes[i];
+		if (hole->start > hole->last)
+			continue;
+		if (hole->start < first)
+			hole->last = first - 1;
+		else if (hole->last > last)
+			hole->start = last + 1;
+		else if (hole->last == ULONG_MAX) {
+			/* The last hole is taken */
+			hole->start = 1;
+			hole->last = 0;
+			hole_update (idx, i);
+			idx->nholes = i;
+			break;
+		} else
+			hole->start = hole->last + 1;
+		hole_update (idx, i);
+	}
+	return true;
+}
+
+/*
+ * index_append: add the range appended last to @db to its indexes.
+ */
+static void index_append (struct commonio_db *db)
+{
+	struct range_index *idx = db_index (db);
+	struct range_item item, *items;
+	unsigned long *max_last;
+	size_t lo, hi;
+
+	if ((NULL == idx->by_start) || (NULL == db->tail) || (NULL == db->tail->eptr)) {
+		range_index_reset (idx);
+		return;
+	}
+
+	items = realloc (idx->by_start, (idx->count + 1) * sizeof *items);
+	if (NULL != items)
+		idx->by_start = items;
+	max_last = realloc (idx->max_last, (idx->count + 1) * sizeof *max_last);
+	if (NULL != max_last)
+		idx->max_last = max_last;
+	if ((NULL == items) || (NULL == max_last)) {
+		range_index_reset (idx);
+		return;
+	}
+
+	item.range = db->tail->eptr;
+	item.pos = idx->next_pos++;
+
+	/* The new range is the last one of its start */
+	lo = 0;
+	hi = idx->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (idx->by_start[mid].range->start <= item.range->start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	memmove (&idx->by_start[lo + 1], &idx->by_start[lo],
+		 (idx->count - lo) * sizeof *idx->by_start);
+	idx->by_start[lo] = item;
+	idx->count++;
+	update_max_last (idx, lo);
+
+	if ((NULL != idx->holes) && !holes_take (idx, item.range))
+		hole_index_reset (idx);
+
+	if (NULL != idx->by_owner) {
+		items = realloc (idx->by_owner, idx->count * sizeof *items);
+		if (NULL == items) {
+			free (idx->by_owner);
+			idx->by_owner = NULL;
+			return;
+		}
+		idx->by_owner = items;
+		lo = 0;
+		hi = idx->count - 1;
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (item_owner_cmp (&idx->by_owner[mid], &item) < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		memmove (&idx->by_owner[lo + 1], &idx->by_owner[lo],
+			 (idx->count - 1 - lo) * sizeof *idx->by_owner);
+		idx->by_owner[lo] = item;
+	}
+}
+
+/*
+ * owner_first: position of the first range of @owner in idx->by_owner.
+ */
+static size_t owner_first (const struct range_index *idx, const char *owner)
+{
+	size_t lo = 0, hi = idx->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp (idx->by_owner[mid].range->owner, owner) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * ranges_including: list the ranges of @db which include @val, in the
+ *                   order of the file.
+ *
+ * Returns the number of ranges stored in *@items (to be freed by the
+ * caller), or -1 on failure.
+ */
+static int ranges_including (struct commonio_db *db, unsigned long val,
+			     struct range_item **items)
+{
+	const struct range_index *idx;
+	size_t lo = 0, hi, i;
+	int n = 0;
+
+	*items = NULL;
+	idx = index_by_start (db);
+	if (NULL == idx)
+		return -1;
+
+	/* Ranges before hi start at or before val */
+	hi = idx->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (idx->by_start[mid].range->start <= val)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; (i > 0) && (idx->max_last[i - 1] >= val); i--) {
+		const struct range_item *item = &idx->by_start[i - 1];
+		struct range_item *tmp;
+
+		if (range_last (item->range) < val)
+			continue;
+
+		tmp = realloc (*items, (n + 1) * sizeof *tmp);
+		if (NULL == tmp) {
+			free (*items);
+			*items = NULL;
+			return -1;
+		}
+		*items = tmp;
+		(*items)[n++] = *item;
+	}
+
+	qsort (*items, n, sizeof **items, item_pos_cmp);
+	return n;
+}
+
+/*
+ * Compact map of a subordinate ID file.
+ *
+ * With LOOKUP_INDEX set in login.defs, the map is written next to the
+ * file, in file.idx, every time the file is committed. It holds the
+ * ranges as fixed width records, and their owners in a table of unique
+ * names. It records the identity, size and modification time of the file
+ * it was built from, and is ignored when they do not match the current
+ * file: the text file remains the reference.
+ *
+ * Layout (native byte order):
+ *	struct submap_header
+ *	struct submap_range ranges[nranges]	sorted by start, then position
+ *	struct submap_owner owners[nowners]	sorted by name
+ *	uint32_t by_owner[nranges]		ranges of each owner, by position
+ *	char names[names_size]			owner names, NUL terminated
+ */
+#define SUBMAP_MAGIC	"shdwsub"
+#define SUBMAP_VERSION	1
+
+struct submap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t nranges;
+	uint32_t nowners;
+	uint32_t names_size;
+	uint64_t db_dev;
+	uint64_t db_ino;
+	uint64_t db_size;
+	int64_t db_mtime_sec;
+	int64_t db_mtime_nsec;
+};
+
+struct submap_range {
+	uint64_t start;
+	uint64_t count;
+	uint64_t max_last;	/* of this range and the ones before it */
+	uint32_t owner;		/* in owners */
+	uint32_t pos;		/* position of the range in the file */
+};
+
+struct submap_owner {
+	uint32_t name;		/* offset in names */
+	uint32_t first;		/* in by_owner */
+	uint32_t nranges;
+	uint32_t reserved;
+};
+
+struct submap {
+	void *base;
+	size_t size;
+	const struct submap_header *hdr;
+	const struct submap_range *ranges;
+	const struct submap_owner *owners;
+	const uint32_t *by_owner;
+	const char *names;
+};
+
+static int submap_name (char *buf, size_t size, const char *dbfile)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.idx", dbfile);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+static int item_owner_pos_cmp (const void *p1, const void *p2)
+{
+	const struct range_item *i1 = p1;
+	const struct range_item *i2 = p2;
+	int ret;
+
+	ret = strcmp (i1->range->owner, i2->range->owner);
+	if (0 != ret)
+		return ret;
+	return item_pos_cmp (p1, p2);
+}
+
+/*
+ * submap_build: fill the records of the map of the ranges of @db.
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int submap_build (const struct commonio_db *db,
+			 struct submap_header *hdr,
+			 struct submap_range **out_ranges,
+			 struct submap_owner **out_owners,
+			 uint32_t **out_by_owner, char **out_names)
+{
+	struct range_item *by_start = NULL, *by_owner = NULL;
+	struct submap_range *ranges = NULL;
+	struct submap_owner *owners = NULL;
+	uint32_t *rank = NULL, *owner_ranges = NULL;
+	char *names = NULL;
+	size_t count, i, nowners = 0, names_size = 0;
+	int ret = -1;
+
+	by_start = range_items (db, &count);
+	if ((NULL == by_start) || (count >= UINT32_MAX))
+		goto out;
+	by_owner = malloc ((count + 1) * sizeof *by_owner);
+	ranges = malloc ((count + 1) * sizeof *ranges);
+	owners = malloc ((count + 1) * sizeof *owners);
+	rank = malloc ((count + 1) * sizeof *rank);
+	owner_ranges = malloc ((count + 1) * sizeof *owner_ranges);
+	if (   (NULL == by_owner) || (NULL == ranges) || (NULL == owners)
+	    || (NULL == rank) || (NULL == owner_ranges))
+		goto out;
+	memcpy (by_owner, by_start, count * sizeof *by_owner);
+	qsort (by_start, count, sizeof *by_start, item_start_cmp);
+	qsort (by_owner, count, sizeof *by_owner, item_owner_pos_cmp);
+
+	for (i = 0; i < count; i++) {
+		unsigned long last = range_last (by_start[i].range);
+
+		memset (&ranges[i], 0, sizeof ranges[i]);
+		ranges[i].start = by_start[i].range->start;
+		ranges[i].count = by_start[i].range->count;
+		ranges[i].max_last = last;
+		if ((i > 0) && (ranges[i - 1].max_last > last))
+			ranges[i].max_last = ranges[i - 1].max_last;
+		ranges[i].pos = by_start[i].pos;
+		rank[by_start[i].pos] = i;
+	}
+
+	for (i = 0; i < count; i++) {
+		const char *owner = by_owner[i].range->owner;
+
+		if ((0 == i) || (strcmp (owner, by_owner[i - 1].range->owner) != 0)) {
+			size_t len = strlen (owner) + 1;
+			char *tmp;
+
+			if (names_size + len >= UINT32_MAX)
+				goto out;
+			tmp = realloc (names, names_size + len);
+			if (NULL == tmp)
+				goto out;
+			names = tmp;
+			memcpy (names + names_size, owner, len);
+			memset (&owners[nowners], 0, sizeof owners[nowners]);
+			owners[nowners].name = names_size;
+			owners[nowners].first = i;
+			names_size += len;
+			nowners++;
+		}
+		owners[nowners - 1].nranges++;
+		owner_ranges[i] = rank[by_owner[i].pos];
+		ranges[owner_ranges[i]].owner = nowners - 1;
+	}
+
+	hdr->nranges = count;
+	hdr->nowners = nowners;
+	hdr->names_size = names_size;
+	*out_ranges = ranges;
+	*out_owners = owners;
+	*out_by_owner = owner_ranges;
+	*out_names = names;
+	ranges = NULL;
+	owners = NULL;
+	owner_ranges = NULL;
+	names = NULL;
+	ret = 0;
+
+      out:
+	free (by_start);
+	free (by_owner);
+	free (ranges);
+	free (owners);
+	free (rank);
+	free (owner_ranges);
+	free (names);
+	return ret;
+}
+
+/*
+ * submap_write: write the map of @db, which was just published.
+ *
+ * A previous map is removed if the new one cannot be written.
+ */
+static void submap_write (struct commonio_db *db)
+{
+	char mapname[sizeof db->filename + 8];
+	char tmpname[sizeof mapname + 1];
+	struct submap_header hdr;
+	struct submap_range *ranges = NULL;
+	struct submap_owner *owners = NULL;
+	uint32_t *by_owner = NULL;
+	char *names = NULL;
+	struct stat sb;
+	FILE *fp = NULL;
+	bool ok = false;
+
+	if (!getdef_bool ("LOOKUP_INDEX"))
+		return;
+	if (submap_name (mapname, sizeof mapname, db->filename) != 0)
+		return;
+	(void) snprintf (tmpname, sizeof tmpname, "%s+", mapname);
+
+	memset (&hdr, 0, sizeof hdr);
+	if (   (stat (db->filename, &sb) != 0)
+	    || (submap_build (db, &hdr, &ranges, &owners, &by_owner, &names) != 0))
+		goto out;
+	memcpy (hdr.magic, SUBMAP_MAGIC, sizeof hdr.magic);
+	hdr.version = SUBMAP_VERSION;
+	hdr.db_dev = sb.st_dev;
+	hdr.db_ino = sb.st_ino;
+	hdr.db_size = sb.st_size;
+	hdr.db_mtime_sec = sb.st_mtim.tv_sec;
+	hdr.db_mtime_nsec = sb.st_mtim.tv_nsec;
+
+	fp = fopen (tmpname, "w");
+	if (NULL == fp)
+		goto out;
+	if (   (fchown (fileno (fp), sb.st_uid, sb.st_gid) != 0)
+	    || (fchmod (fileno (fp), sb.st_mode & 0644) != 0)
+	    || (fwrite (&hdr, sizeof hdr, 1, fp) != 1)
+	    || (fwrite (ranges, sizeof *ranges, hdr.nranges, fp) != hdr.nranges)
+	    || (fwrite (owners, sizeof *owners, hdr.nowners, fp) != hdr.nowners)
+	    || (fwrite (by_owner, sizeof *by_owner, hdr.nranges, fp) != hdr.nranges)
+	    || (fwrite (names, 1, hdr.names_size, fp) != hdr.names_size)) {
+		goto out;
+	}
+	if (fclose (fp) != 0) {
+		fp = NULL;
+		goto out;
+	}
+	fp = NULL;
+	ok = (rename (tmpname, mapname) == 0);
+
+      out:
+	if (NULL != fp)
+		(void) fclose (fp);
+	if (!ok) {
+		(void) unlink (tmpname);
+		(void) unlink (mapname);
+	}
+	free (ranges);
+	free (owners);
+	free (by_owner);
+	free (names);
+}
+
+static void submap_close (/*@only@*/struct submap *map)
+{
+	(void) munmap (map->base, map->size);
+	free (map);
+}
+
+/*
+ * submap_open: map the map of @dbfile.
+ *
+ * Returns NULL if there is no map, or if it does not describe the
+ * current version of @dbfile.
+ */
+static /*@null@*/ /*@only@*/struct submap *submap_open (const char *dbfile)
+{
+	char mapname[1024];
+	const struct submap_header *hdr;
+	struct submap *map = NULL;
+	void *base = MAP_FAILED;
+	struct stat sb, msb;
+	size_t size = 0;
+	int fd;
+
+	if (submap_name (mapname, sizeof mapname, dbfile) != 0)
+		return NULL;
+	fd = open (mapname, O_RDONLY | O_CLOEXEC);
+	if (-1 == fd)
+		return NULL;
+	if (   (fstat (fd, &msb) != 0)
+	    || ((size_t) msb.st_size < sizeof *hdr)) {
+		goto fail;
+	}
+	size = msb.st_size;
+	base = mmap (NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (MAP_FAILED == base)
+		goto fail;
+	hdr = base;
+	if (   (memcmp (hdr->magic, SUBMAP_MAGIC, sizeof hdr->magic) != 0)
+	    || (SUBMAP_VERSION != hdr->version)
+	    || (hdr->nowners > hdr->nranges)
+	    || (size != sizeof *hdr
+	                + (size_t) hdr->nranges * sizeof (struct submap_range)
+	                + (size_t) hdr->nowners * sizeof (struct submap_owner)
+	                + (size_t) hdr->nranges * sizeof (uint32_t)
+	                + hdr->names_size)
+	    || ((0 != hdr->names_size) && ('\0' != ((const char *) base)[size - 1]))) {
+		goto fail;
+	}
+	if (   (stat (dbfile, &sb) != 0)
+	    || (hdr->db_dev != (uint64_t) sb.st_dev)
+	    || (hdr->db_ino != (uint64_t) sb.st_ino)
+	    || (hdr->db_size != (uint64_t) sb.st_size)
+	    || (hdr->db_mtime_sec != (int64_t) sb.st_mtim.tv_sec)
+	    || (hdr->db_mtime_nsec != (int64_t) sb.st_mtim.tv_nsec)) {
+		goto fail;
+	}
+
+	map = malloc (sizeof *map);
+	if (NULL == map)
+		goto fail;
+	map->base = base;
+	map->size = size;
+	map->hdr = hdr;
+	map->ranges = (const struct submap_range *) (hdr + 1);
+	map->owners = (const struct submap_owner *) (map->ranges + hdr->nranges);
+	map->by_owner = (const uint32_t *) (map->owners + hdr->nowners);
+	map->names = (const char *) (map->by_owner + hdr->nranges);
+	(void) close (fd);
+	return map;
+
+      fail:
+	if (MAP_FAILED != base)
+		(void) munmap (base, size);
+	(void) close (fd);
+	return NULL;
+}
+
+/*
+ * submap_owner: the entry of @owner in the owners of @map.
+ *
+ * Returns NULL if @owner has no ranges.
+ */
+static /*@null@*/const struct submap_owner *submap_owner (const struct submap *map,
+							  const char *owner)
+{
+	size_t lo = 0, hi = map->hdr->nowners;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		const struct submap_owner *o = &map->owners[mid];
+		int cmp;
+
+		if (   (o->name >= map->hdr->names_size)
+		    || (o->first > map->hdr->nranges)
+		    || (o->nranges > map->hdr->nranges - o->first))
+			return NULL;
+		cmp = strcmp (map->names + o->name, owner);
+		if (0 == cmp)
+			return o;
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return NULL;
+}
+
+static struct commonio_ops subordinate_ops = {
+	subordinate_dup,	/* dup */
+	subordinate_free,	/* free */
+	NULL,			/* getname */
+	subordinate_parse,	/* parse */
+	subordinate_put,	/* put */
+	fgets,			/* fgets */
+	fputs,			/* fputs */
+	subordinate_open_hook,	/* open_hook */
+	NULL,			/* close_hook */
+	NULL,			/* getid */
+	NULL,			/* dup_arena */
+	NULL,			/* parse_arena */
+	0,			/* cache_dbs */
+	submap_write,		/* publish_hook */
+	NULL,			/* getmembers */
+	false, 0, 0,		/* direct_fields, name_offset, id_offset */
+	subordinate_getowner	/* sortkey */
+};
+
+/*
+ * The private copies of subid_db_open() are only read: they are not
+ * published, and they reset their own indexes when they are closed.
+ */
+static struct commonio_ops subordinate_private_ops = {
+	subordinate_dup,	/* dup */
+	subordinate_free,	/* free */
+	NULL,			/* getname */
+	subordinate_parse,	/* parse */
+	subordinate_put,	/* put */
+	fgets,			/* fgets */
+	fputs,			/* fputs */
+	NULL,			/* open_hook */
+	NULL,			/* close_hook */
+	NULL,			/* getid */
+	NULL,			/* dup_arena */
+	NULL,			/* parse_arena */
+	0,			/* cache_dbs */
+	NULL,			/* publish_hook */
+	NULL,			/* getmembers */
+	false, 0, 0,		/* direct_fields, name_offset, id_offset */
+	subordinate_getowner	/* sortkey */
+};
+
+/*
+ * commonio_open() and commonio_close() use the state of the process (the
+ * configuration, the statistics, the buffers of subordinate_parse()):
+ * the private copies are opened and closed under this lock. They are
+ * then queried without it.
+ */
+static pthread_mutex_t subid_db_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * range_exists: Check whether @owner owns any ranges
+ *
+ * @db: database to query
+ * @owner: owner being queried
+ *
+ * Returns true if @owner owns any subuid ranges, false otherwise.
+ */
+static bool range_exists(struct commonio_db *db, const char *owner)
+{
+	const struct range_index *idx;
+	size_t i;
+
+	idx = index_by_owner (db);
+	if (NULL == idx)
+		return false;
+	i = owner_first (idx, owner);
+	return (i < idx->count) && (0 == strcmp (idx->by_owner[i].range->owner, owner));
+}
+
+/*
+ * find_range: find a range which @owner is authorized to use which includes
+ *             subuid @val.
+ *
+ * @db: database to query
+ * @owner: owning uid being queried
+ * @val: subuid being searched for.
+ *
+ * Returns a range of subuids belonging to @owner and including the subuid
+ * @val, or NULL if no such range exists.
+ */
+static const struct subordinate_range *find_range(struct commonio_db *db,
+						  const char *owner, unsigned long val)
+{
+	const struct subordinate_range *range;
+	const struct range_index *idx;
+	struct range_item *items;
+	size_t i;
+	int n;
+
+	/*
+	 * Search for exact username/group specification
+	 *
+	 * This is the original method - go fast through the ranges of
+	 * the owner, doing only exact username/group string comparison.
+	 */
+	idx = index_by_owner (db);
+	if (NULL == idx)
+		return NULL;
+	for (i = owner_first (idx, owner);
+	     (i < idx->count) && (0 == strcmp (idx->by_owner[i].range->owner, owner));
+	     i++) {
+		range = idx->by_owner[i].range;
+
+		/* The ranges of the owner are sorted by start */
+		if (range->start > val)
+			break;
+
+		if (val <= range_last (range))
+			return range;
+	}
+
+
+        /*
+         * We only do special handling for these two files
+         */
+        if ((0 != strcmp(db->filename, "/etc/subuid")) && (0 != strcmp(db->filename, "/etc/subgid")))
+                return NULL;
+
+        /*
+         * Search loop above did not produce any result. Let's rerun it,
+         * but this time try to match actual UIDs. The first entry that
+         * matches is considered a success.
+         * (It may be specified as literal UID or as another username which
+         * has the same UID as the username we are looking for.)
+         */
+        uid_t          uid;
+        char           owner_uid_string[33] = "";
+
+
+        /* Get UID of the username we are looking for */
+        if (!owner_uid (db_owners (db), owner, &uid)) {
+                /* Username not defined in /etc/passwd, or error occurred during lookup */
+                return NULL;
+        }
+        sprintf(owner_uid_string, "%lu", (unsigned long int)uid);
+
+        /* For performance reasons only the ranges including val are checked */
+        n = ranges_including (db, val, &items);
+        for (i = 0; (int) i < n; i++) {
+                range = items[i].range;
+
+                /*
+                 * Range matches. Check if range owner is specified
+                 * as numeric UID and if it matches.
+                 */
+                if (0 == strcmp(range->owner, owner_uid_string)) {
+                        free (items);
+                        return range;
+                }
+
+                /*
+                 * Ok, this range owner is not specified as numeric UID
+                 * we are looking for. It may be specified as another
+                 * UID or as a literal username.
+                 *
+                 * If specified as another UID, it does not match and
+                 * it is not looked up.
+                 *
+                 * If specified as literal username, we will get its
+                 * UID and compare that to UID we are looking for.
+                 */
+                uid_t range_owner_uid;
+
+                if (all_digits (range->owner)) {
+                        continue;
+                }
+                if (!owner_uid (db_owners (db), range->owner, &range_owner_uid)) {
+                        continue;
+                }
+
+                if (uid == range_owner_uid) {
+                        free (items);
+                        return range;
+                }
+        }
+
+	free (items);
+	return NULL;
+}
+
+/*
+ * have_range: check whether @owner is authorized to use the range
+ *             (@start .. @start+@count-1).
+ * @db: database to check
+ * @owner: owning uid being queried
+ * @start: start of range
+ * @count: number of uids in range
+ *
+ * Returns true if @owner is authorized to use the range, false otherwise.
+ */
+static bool have_range(struct commonio_db *db,
+		       const char *owner, unsigned long start, unsigned long count)
+{
+	const struct subordinate_range *range;
+	unsigned long end;
+
+	if (count == 0)
+		return false;
+
+	end = start + count - 1;
+	range = find_range (db, owner, start);
+	while (range) {
+		unsigned long last;
+
+		last = range->start + range->count - 1;
+		if (last >= (start + count - 1))
+			return true;
+
+		count = end - last;
+		start = last + 1;
+		range = find_range(db, owner, start);
+	}
+	return false;
+}
+
+static bool append_range(struct subid_range **ranges, const struct subordinate_range *new, int n)
+{
+	if (!*ranges) {
+		*ranges = malloc(sizeof(struct subid_range));
+		if (!*ranges)
+			return false;
+	} else {
+		struct subid_range *alloced;
+		alloced = realloc(*ranges, (n + 1) * (sizeof(struct subid_range)));
+		if (!alloced)
+			return false;
+		*ranges = alloced;
+	}
+	(*ranges)[n].start = new->start;
+	(*ranges)[n].count = new->count;
+	return true;
+}
+
+void free_subordinate_ranges(struct subordinate_range **ranges, int count)
+{
+	int i;
+
+	if (!ranges)
+		return;
+	for (i = 0; i < count; i++)
+		subordinate_free(ranges[i]);
+	free(ranges);
+}
+
+/*
+ * Allocation policies of the new ranges (SUB_ID_ALLOCATION):
+ * - first-fit: the lowest hole large enough,
+ * - best-fit: the smallest hole large enough (the lowest of them), which
+ *   keeps the large holes for the large ranges,
+ * - next-fit: the first hole large enough after the last range of the
+ *   file (the range added last), wrapping around to the lowest one, which
+ *   spreads the new ranges without searching the full holes again.
+ */
+enum alloc_policy {
+	ALLOC_FIRST_FIT,
+	ALLOC_BEST_FIT,
+	ALLOC_NEXT_FIT,
+};
+
+static enum alloc_policy alloc_policy (void)
+{
+	const char *policy = getdef_str ("SUB_ID_ALLOCATION");
+
+	if (NULL == policy)
+		return ALLOC_FIRST_FIT;
+	if (strcmp (policy, "best-fit") == 0)
+		return ALLOC_BEST_FIT;
+	if (strcmp (policy, "next-fit") == 0)
+		return ALLOC_NEXT_FIT;
+	return ALLOC_FIRST_FIT;
+}
+
+/*
+ * first_fit: the lowest uid of the first hole of @idx with @count uids
+ *            from @min to @max.
+ *
+ * Return ULONG_MAX if there is none.
+ */
+static unsigned long first_fit(const struct range_index *idx,
+			       unsigned long min, unsigned long max,
+			       unsigned long count)
+{
+	const struct range_hole *hole;
+	unsigned long low, high;
+	size_t i;
+
+	/* Is the hole including min large enough? */
+	i = hole_first (idx, min);
+	if (i == idx->nholes)
+		goto fail;
+	hole = &idx->holes[i];
+	low = (hole->start > min) ? hole->start : min;
+	if (low > max)
+		goto fail;
+	high = (hole->last < max) ? hole->last : max;
+	if ((low <= high) && ((high - low) >= (count - 1)))
+		return low;
+
+	/* Otherwise take the first hole which is large enough, if before max */
+	i = hole_find (idx, 1, 0, idx->hole_leaves, i + 1, count);
+	if (i == idx->nholes)
+		goto fail;
+	low = idx->holes[i].start;
+	if ((low > max) || ((max - low) < (count - 1)))
+		goto fail;
+	return low;
+fail:
+	return ULONG_MAX;
+}
+
+/*
+ * best_fit: the lowest uid of the smallest hole of @idx with @count uids
+ *           from @min to @max.
+ *
+ * Return ULONG_MAX if there is none.
+ */
+static unsigned long best_fit(const struct range_index *idx,
+			      unsigned long min, unsigned long max,
+			      unsigned long count)
+{
+	unsigned long best = ULONG_MAX, best_size = ULONG_MAX;
+	size_t i;
+
+	for (i = hole_first (idx, min); i < idx->nholes; i++) {
+		const struct range_hole *hole = &idx->holes[i];
+		unsigned long low, high;
+
+		if (hole->start > hole->last)
+			continue;
+		low = (hole->start > min) ? hole->start : min;
+		if (low > max)
+			break;
+		high = (hole->last < max) ? hole->last : max;
+		if ((high - low) < (count - 1))
+			continue;
+		if ((ULONG_MAX == best) || (high - low < best_size)) {
+			best = low;
+			best_size = high - low;
+			if (best_size == count - 1)
+				break;	/* exact fit */
+		}
+	}
+	return best;
+}
+
+/*
+ * next_fit_cursor: the uid after the last range of @db, where next-fit
+ *                  searches first.
+ */
+static unsigned long next_fit_cursor(const struct commonio_db *db)
+{
+	const struct commonio_entry *ent;
+
+	for (ent = db->tail; NULL != ent; ent = ent->prev) {
+		const struct subordinate_range *range = ent->eptr;
+
+		if ((NULL != range) && (0 != range->count)) {
+			if (range_last (range) == ULONG_MAX)
+				return 0;
+			return range_last (range) + 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * policy_fit: the lowest uid of the hole of @idx with @count uids from
+ *             @min to @max chosen by @policy, next-fit starting at
+ *             @cursor.
+ *
+ * Return ULONG_MAX if there is none.
+ */
+static unsigned long policy_fit(const struct range_index *idx,
+				enum alloc_policy policy, unsigned long cursor,
+				unsigned long min, unsigned long max,
+				unsigned long count)
+{
+	unsigned long start;
+
+	switch (policy) {
+	case ALLOC_BEST_FIT:
+		return best_fit (idx, min, max, count);
+	case ALLOC_NEXT_FIT:
+		if ((cursor > min) && (cursor <= max)) {
+			start = first_fit (idx, cursor, max, count);
+			if (ULONG_MAX != start)
+				return start;
+		}
+		break;
+	case ALLOC_FIRST_FIT:
+		break;
+	}
+	return first_fit (idx, min, max, count);
+}
 
-	/* Is the remaining unclaimed area large enough? */
-	if (((max - low) + 1) >= count)
-		return low;
-fail:
-	return ULONG_MAX;
+/*
+ * find_free_range: find an unused consecutive sequence of ids to allocate
+ *                  to a user, with the policy of SUB_ID_ALLOCATION.
+ * @db: database to search
+ * @min: the first uid in the range to find
+ * @max: the highest uid to find
+ * @count: the number of uids needed
+ *
+ * Return the lowest new uid, or ULONG_MAX on failure.
+ */
+static unsigned long find_free_range(struct commonio_db *db,
+				     unsigned long min, unsigned long max,
+				     unsigned long count)
+{
+	const struct range_index *idx;
+
+	/* When given invalid parameters fail */
+	if ((count == 0) || (max < min))
+		return ULONG_MAX;
+
+	idx = index_holes (db);
+	if (NULL == idx)
+		return ULONG_MAX;
+
+	return policy_fit (idx, alloc_policy (), next_fit_cursor (db),
+			   min, max, count);
+}
+
+/*
+ * range_free: check whether the ids @start to @start+@count-1 are not
+ *             used by any range of @db.
+ * @db: database to search
+ * @start: the first id
+ * @count: the number of ids
+ *
+ * Return true if they are unused, false if they are used (or on error).
+ */
+static bool range_free(struct commonio_db *db,
+		       unsigned long start, unsigned long count)
+{
+	const struct range_index *idx;
+	const struct range_hole *hole;
+	size_t i;
+
+	if (count == 0)
+		return false;
+
+	idx = index_holes (db);
+	if (NULL == idx)
+		return false;
+
+	/* The ids are unused if they are in a single hole */
+	for (i = hole_first (idx, start); i < idx->nholes; i++) {
+		hole = &idx->holes[i];
+		if (hole->start <= hole->last)
+			return    (hole->start <= start)
+			       && ((hole->last - start) >= (count - 1));
+	}
+	return false;
+}
+
+/*
+ * find_free_ranges: find @n unused consecutive sequences of @count ids to
+ *                   allocate to users.
+ * @db: database to search
+ * @min: the first uid in the ranges to find
+ * @max: the highest uid to find
+ * @count: the number of uids in each range
+ * @n: number of ranges needed
+ * @starts: array of @n first uids of the ranges
+ *
+ * The ranges are the ones which @n calls of find_free_range, each followed
+ * by the addition of the found range, would find.
+ *
+ * Return 0 on success, or -1 if there are not enough unused uids.
+ */
+static int find_free_ranges(struct commonio_db *db,
+			    unsigned long min, unsigned long max,
+			    unsigned long count, size_t n, unsigned long *starts)
+{
+	struct range_index *idx;
+	enum alloc_policy policy = alloc_policy ();
+	size_t i, found = 0;
+
+	/* When given invalid parameters fail */
+	if ((count == 0) || (max < min))
+		return -1;
+
+	idx = index_holes (db);
+	if (NULL == idx)
+		return -1;
+
+	if (ALLOC_FIRST_FIT != policy) {
+		unsigned long cursor = next_fit_cursor (db);
+		struct subordinate_range taken;
+		int ret = 0;
+
+		/* Take each range out of the holes before the next search */
+		taken.owner = "";
+		taken.count = count;
+		for (i = 0; i < n; i++) {
+			taken.start = policy_fit (idx, policy, cursor,
+						  min, max, count);
+			if (   (ULONG_MAX == taken.start)
+			    || !holes_take (idx, &taken)) {
+				ret = -1;
+				break;
+			}
+			starts[i] = taken.start;
+			cursor = range_last (&taken) + 1;
+		}
+		/* The holes are found again once the ranges are added */
+		range_index_reset (db_index (db));
+		return ret;
+	}
+
+	/* Carve the ranges out of the holes, from the lowest one */
+	for (i = hole_first (idx, min); (i < idx->nholes) && (found < n); i++) {
+		const struct range_hole *hole = &idx->holes[i];
+		unsigned long low, high;
+
+		if (hole->start > hole->last)
+			continue;
+		low = (hole->start > min) ? hole->start : min;
+		if (low > max)
+			break;
+		high = (hole->last < max) ? hole->last : max;
+		while ((found < n) && ((high - low) >= (count - 1))) {
+			starts[found++] = low;
+			if (high - low == count - 1)
+				break;
+			low += count;
+		}
+	}
+
+	return (found == n) ? 0 : -1;
 }
 
 /*
@@ -456,7 +1796,300 @@ static int add_range(struct commonio_db *db,
 		return 1;
 
 	/* Otherwise append the range */
-	return commonio_append(db, &range);
+	if (commonio_append(db, &range) == 0)
+		return 0;
+
+	index_append (db);
+	return 1;
+}
+
+/*
+ * add_ranges: add @n new subuid ranges of @count subuids, the one starting
+ *             at @starts[i] being owned by @owners[i].
+ *
+ * The ranges must not be in @db yet.
+ *
+ * Return 1 on success.  On error return 0 and set errno appropriately.
+ */
+static int add_ranges(struct commonio_db *db, const char *const *owners,
+		      const unsigned long *starts, size_t n, unsigned long count)
+{
+	struct subordinate_range range;
+	size_t i;
+	int ret = 1;
+
+	/* Rebuild the index once, rather than update it for each range */
+	range_index_reset (db_index (db));
+
+	range.count = count;
+	for (i = 0; i < n; i++) {
+		range.owner = owners[i];
+		range.start = starts[i];
+		if (commonio_append (db, &range) == 0) {
+			ret = 0;
+			break;
+		}
+	}
+
+	range_index_reset (db_index (db));
+	return ret;
+}
+
+static int item_import_cmp (const void *p1, const void *p2)
+{
+	const struct range_item *i1 = p1;
+	const struct range_item *i2 = p2;
+	int ret;
+
+	if (i1->range->start != i2->range->start)
+		return (i1->range->start < i2->range->start) ? -1 : 1;
+	if (i1->range->count != i2->range->count)
+		return (i1->range->count < i2->range->count) ? -1 : 1;
+	ret = strcmp (i1->range->owner, i2->range->owner);
+	if (0 != ret)
+		return ret;
+	return (i1->pos < i2->pos) ? -1 : (i1->pos > i2->pos);
+}
+
+static bool same_range (const struct subordinate_range *r1,
+			const struct subordinate_range *r2)
+{
+	return    (r1->start == r2->start)
+	       && (r1->count == r2->count)
+	       && (strcmp (r1->owner, r2->owner) == 0);
+}
+
+/*
+ * import_ranges: add the @n ranges of @ranges to @db.
+ *
+ * The ranges of @db and the new ones are sorted by start once, and a
+ * single pass checks that no new range overlaps another range. The new
+ * ranges which are already in @db, or listed twice, are skipped.
+ *
+ * Return the number of ranges added. If a new range overlaps another
+ * range, nothing is added, *@bad is set to the index of the new range,
+ * and -1 is returned with errno set to EEXIST.
+ */
+static int import_ranges (struct commonio_db *db,
+			  const struct subordinate_range *ranges, size_t n,
+			  size_t *bad)
+{
+	struct range_item *items, *all;
+	const struct range_item *reach = NULL;	/* with the highest last */
+	struct subordinate_range range;
+	bool *skip;
+	size_t nexisting, i;
+	int added = -1;
+
+	items = range_items (db, &nexisting);
+	if (NULL == items)
+		return -1;
+	all = realloc (items, (nexisting + n + 1) * sizeof *all);
+	if (NULL == all) {
+		free (items);
+		return -1;
+	}
+	skip = calloc (n + 1, sizeof *skip);
+	if (NULL == skip) {
+		free (all);
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		all[nexisting + i].range = &ranges[i];
+		all[nexisting + i].pos = nexisting + i;
+	}
+	qsort (all, nexisting + n, sizeof *all, item_import_cmp);
+
+	for (i = 0; i < nexisting + n; i++) {
+		const struct range_item *item = &all[i];
+		bool is_new = (item->pos >= nexisting);
+
+		if ((0 != i) && same_range (all[i - 1].range, item->range)) {
+			if (is_new)
+				skip[item->pos - nexisting] = true;
+			continue;
+		}
+		/* The overlaps of the ranges of db are not checked */
+		if (   (NULL != reach)
+		    && (item->range->start <= range_last (reach->range))
+		    && (is_new || (reach->pos >= nexisting))) {
+			*bad = (is_new ? item->pos : reach->pos) - nexisting;
+			errno = EEXIST;
+			goto out;
+		}
+		if (   (NULL == reach)
+		    || (range_last (item->range) > range_last (reach->range)))
+			reach = item;
+	}
+
+	/* Rebuild the index once, rather than update it for each range */
+	range_index_reset (db_index (db));
+	added = 0;
+	for (i = 0; i < n; i++) {
+		if (skip[i])
+			continue;
+		range = ranges[i];
+		if (commonio_append (db, &range) == 0) {
+			added = -1;
+			break;
+		}
+		added++;
+	}
+	range_index_reset (db_index (db));
+
+out:
+	free (skip);
+	free (all);
+	return added;
+}
+
+/*
+ * export_ranges: write the ranges of @db to @out, sorted by start, in
+ *                the format of the file.
+ *
+ * Return 0 on success, -1 on error.
+ */
+static int export_ranges (const struct commonio_db *db, FILE *out)
+{
+	struct range_item *items;
+	size_t n, i;
+	int ret = 0;
+
+	items = range_items (db, &n);
+	if (NULL == items)
+		return -1;
+	qsort (items, n, sizeof *items, item_import_cmp);
+	for (i = 0; i < n; i++) {
+		if (subordinate_put (items[i].range, out) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+	free (items);
+	return ret;
+}
+
+/*
+ * compact_ranges: merge the ranges of each owner of @db which overlap or
+ *                 follow each other, and sort the ranges by start.
+ * @min_count: the holes between the ranges with less IDs are wasted
+ * @write: change @db (otherwise, only @frag is filled)
+ * @overlap: called (if not NULL) for each range overlapping a range of
+ *           another owner, after the merge
+ *
+ * @db is only changed if its ranges are not merged and sorted yet: the
+ * merged ranges are then added, sorted, and the previous ranges are
+ * removed. The unparsed lines stay at the start of the file.
+ *
+ * Return 0 on success, -1 on error (with errno set).
+ */
+static int compact_ranges (struct commonio_db *db, unsigned long min_count,
+			   bool write, struct subid_fragmentation *frag,
+			   /*@null@*/void (*overlap) (const struct subordinate_range *,
+						      const struct subordinate_range *))
+{
+	struct range_item *items, *merged;
+	struct subordinate_range *ranges;
+	struct commonio_entry *ent, *next, *old_tail;
+	unsigned long reach = 0;	/* the highest last */
+	const struct subordinate_range *reach_range = NULL;
+	bool sorted = true;
+	size_t n, m = 0, i;
+
+	memset (frag, 0, sizeof *frag);
+	items = range_items (db, &n);
+	if (NULL == items)
+		return -1;
+	ranges = malloc ((n + 1) * sizeof *ranges);
+	merged = malloc ((n + 1) * sizeof *merged);
+	if ((NULL == ranges) || (NULL == merged)) {
+		free (ranges);
+		free (merged);
+		free (items);
+		errno = ENOMEM;
+		return -1;
+	}
+	frag->ranges = n;
+	for (i = 1; i < n; i++) {
+		if (item_import_cmp (&items[i - 1], &items[i]) > 0)
+			sorted = false;
+	}
+
+	/* Merge the ranges of each owner */
+	qsort (items, n, sizeof *items, item_owner_cmp);
+	for (i = 0; i < n; i++) {
+		const struct subordinate_range *r = items[i].range;
+
+		if (   (0 != m)
+		    && (strcmp (ranges[m - 1].owner, r->owner) == 0)
+		    && (   (r->start <= range_last (&ranges[m - 1]))
+		        || (r->start - 1 == range_last (&ranges[m - 1])))) {
+			unsigned long last = range_last (&ranges[m - 1]);
+
+			if (range_last (r) > last)
+				last = range_last (r);
+			ranges[m - 1].count = last - ranges[m - 1].start + 1;
+			frag->merged++;
+			continue;
+		}
+		ranges[m] = *r;
+		merged[m].range = &ranges[m];
+		merged[m].pos = m;
+		m++;
+	}
+
+	/* The overlaps between owners, and the holes */
+	qsort (merged, m, sizeof *merged, item_import_cmp);
+	for (i = 0; i < m; i++) {
+		const struct subordinate_range *r = merged[i].range;
+
+		if (NULL != reach_range) {
+			if (r->start <= reach) {
+				frag->overlaps++;
+				if (NULL != overlap)
+					overlap (r, reach_range);
+			} else if (r->start - 1 > reach) {
+				unsigned long size = r->start - 1 - reach;
+
+				frag->holes++;
+				if (size < min_count) {
+					frag->small_holes++;
+					frag->wasted += size;
+				}
+			}
+		}
+		if ((NULL == reach_range) || (range_last (r) > reach)) {
+			reach = range_last (r);
+			reach_range = r;
+		}
+	}
+
+	if (!write || (sorted && (0 == frag->merged)))
+		goto out;
+
+	/* The new ranges are added before the old ones, which own the names */
+	old_tail = db->tail;
+	for (i = 0; i < m; i++) {
+		if (commonio_append (db, merged[i].range) == 0) {
+			range_index_reset (db_index (db));
+			free (ranges);
+			free (merged);
+			free (items);
+			return -1;
+		}
+	}
+	for (ent = db->head; NULL != ent; ent = next) {
+		next = (old_tail == ent) ? NULL : ent->next;
+		if (NULL != ent->eptr)
+			commonio_del_entry (db, ent);
+	}
+	range_index_reset (db_index (db));
+
+out:
+	free (ranges);
+	free (merged);
+	free (items);
+	return 0;
 }
 
 /*
@@ -542,6 +2175,7 @@ static int remove_range (struct commonio_db *db,
 				tail.count = (last - tail.start) + 1;
 
 				if (commonio_append (db, &tail) == 0) {
+					range_index_reset (db_index (db));
 					return 0;
 				}
 
@@ -553,233 +2187,850 @@ static int remove_range (struct commonio_db *db,
 		}
 	}
 
-	return 1;
+	range_index_reset (db_index (db));
+	return 1;
+}
+
+static struct subordinate_db subordinate_uid = {
+	{
+		"/etc/subuid",		/* filename */
+		&subordinate_ops,	/* ops */
+		NULL,			/* fp */
+#ifdef WITH_SELINUX
+		NULL,			/* scontext */
+#endif
+		0644,                   /* st_mode */
+		0,                      /* st_uid */
+		0,                      /* st_gid */
+		NULL,			/* head */
+		NULL,			/* tail */
+		NULL,			/* cursor */
+		false,			/* changed */
+		false,			/* isopen */
+		false,			/* locked */
+		false,			/* readonly */
+		false			/* setname */
+	}
+};
+
+int sub_uid_setdbname (const char *filename)
+{
+	return commonio_setname (&subordinate_uid.db, filename);
+}
+
+/*@observer@*/const char *sub_uid_dbname (void)
+{
+	return subordinate_uid.db.filename;
+}
+
+bool sub_uid_file_present (void)
+{
+	return commonio_present (&subordinate_uid.db);
+}
+
+int sub_uid_lock (void)
+{
+	return commonio_lock (&subordinate_uid.db);
+}
+
+int sub_uid_open (int mode)
+{
+	return commonio_open (&subordinate_uid.db, mode);
+}
+
+bool local_sub_uid_assigned(const char *owner)
+{
+	return range_exists (&subordinate_uid.db, owner);
+}
+
+bool have_sub_uids(const char *owner, uid_t start, unsigned long count)
+{
+	struct subid_nss_ops *h;
+	bool found;
+	enum subid_status status;
+	h = get_subid_nss_handle();
+	if (h) {
+		status = h->has_range(owner, start, count, ID_TYPE_UID, &found);
+		if (status == SUBID_STATUS_SUCCESS && found)
+			return true;
+		return false;
+	}
+	return have_range (&subordinate_uid.db, owner, start, count);
+}
+
+int sub_uid_add (const char *owner, uid_t start, unsigned long count)
+{
+	if (get_subid_nss_handle())
+		return -EOPNOTSUPP;
+	return add_range (&subordinate_uid.db, owner, start, count);
+}
+
+int sub_uid_remove (const char *owner, uid_t start, unsigned long count)
+{
+	if (get_subid_nss_handle())
+		return -EOPNOTSUPP;
+	return remove_range (&subordinate_uid.db, owner, start, count);
+}
+
+int sub_uid_close (void)
+{
+	return commonio_close (&subordinate_uid.db);
+}
+
+struct commonio_db *__sub_uid_get_db (void)
+{
+	return &subordinate_uid.db;
+}
+
+int sub_uid_unlock (void)
+{
+	return commonio_unlock (&subordinate_uid.db);
+}
+
+uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count)
+{
+	unsigned long start;
+	start = find_free_range (&subordinate_uid.db, min, max, count);
+	return start == ULONG_MAX ? (uid_t) -1 : start;
+}
+
+int sub_uid_find_free_ranges(uid_t min, uid_t max, unsigned long count,
+			     size_t n, unsigned long *starts)
+{
+	return find_free_ranges (&subordinate_uid.db, min, max, count, n, starts);
+}
+
+bool sub_uid_range_free(uid_t start, unsigned long count)
+{
+	return range_free (&subordinate_uid.db, start, count);
+}
+
+int sub_uid_add_many (const char *const *owners, const unsigned long *starts,
+		      size_t n, unsigned long count)
+{
+	if (get_subid_nss_handle())
+		return -EOPNOTSUPP;
+	return add_ranges (&subordinate_uid.db, owners, starts, n, count);
+}
+
+int sub_uid_import (const struct subordinate_range *ranges, size_t n,
+		    size_t *bad)
+{
+	if (get_subid_nss_handle()) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return import_ranges (&subordinate_uid.db, ranges, n, bad);
+}
+
+int sub_uid_export (FILE *out)
+{
+	return export_ranges (&subordinate_uid.db, out);
+}
+
+int sub_uid_compact (unsigned long min_count, bool write,
+		     struct subid_fragmentation *frag,
+		     void (*overlap) (const struct subordinate_range *,
+				      const struct subordinate_range *))
+{
+	if (get_subid_nss_handle()) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return compact_ranges (&subordinate_uid.db, min_count, write, frag,
+			       overlap);
 }
 
-static struct commonio_db subordinate_uid_db = {
-	"/etc/subuid",		/* filename */
-	&subordinate_ops,	/* ops */
-	NULL,			/* fp */
+static struct subordinate_db subordinate_gid = {
+	{
+		"/etc/subgid",		/* filename */
+		&subordinate_ops,	/* ops */
+		NULL,			/* fp */
 #ifdef WITH_SELINUX
-	NULL,			/* scontext */
+		NULL,			/* scontext */
 #endif
-	0644,                   /* st_mode */
-	0,                      /* st_uid */
-	0,                      /* st_gid */
-	NULL,			/* head */
-	NULL,			/* tail */
-	NULL,			/* cursor */
-	false,			/* changed */
-	false,			/* isopen */
-	false,			/* locked */
-	false,			/* readonly */
-	false			/* setname */
+		0644,                   /* st_mode */
+		0,                      /* st_uid */
+		0,                      /* st_gid */
+		NULL,			/* head */
+		NULL,			/* tail */
+		NULL,			/* cursor */
+		false,			/* changed */
+		false,			/* isopen */
+		false,			/* locked */
+		false,			/* readonly */
+		false			/* setname */
+	}
 };
 
-int sub_uid_setdbname (const char *filename)
-{
-	return commonio_setname (&subordinate_uid_db, filename);
-}
-
-/*@observer@*/const char *sub_uid_dbname (void)
+int sub_gid_setdbname (const char *filename)
 {
-	return subordinate_uid_db.filename;
+	return commonio_setname (&subordinate_gid.db, filename);
 }
 
-bool sub_uid_file_present (void)
+/*@observer@*/const char *sub_gid_dbname (void)
 {
-	return commonio_present (&subordinate_uid_db);
+	return subordinate_gid.db.filename;
 }
 
-int sub_uid_lock (void)
+bool sub_gid_file_present (void)
 {
-	return commonio_lock (&subordinate_uid_db);
+	return commonio_present (&subordinate_gid.db);
 }
 
-int sub_uid_open (int mode)
+int sub_gid_lock (void)
 {
-	return commonio_open (&subordinate_uid_db, mode);
+	return commonio_lock (&subordinate_gid.db);
 }
 
-bool local_sub_uid_assigned(const char *owner)
+int sub_gid_open (int mode)
 {
-	return range_exists (&subordinate_uid_db, owner);
+	return commonio_open (&subordinate_gid.db, mode);
 }
 
-bool have_sub_uids(const char *owner, uid_t start, unsigned long count)
+bool have_sub_gids(const char *owner, gid_t start, unsigned long count)
 {
 	struct subid_nss_ops *h;
 	bool found;
 	enum subid_status status;
 	h = get_subid_nss_handle();
 	if (h) {
-		status = h->has_range(owner, start, count, ID_TYPE_UID, &found);
+		status = h->has_range(owner, start, count, ID_TYPE_GID, &found);
 		if (status == SUBID_STATUS_SUCCESS && found)
 			return true;
 		return false;
 	}
-	return have_range (&subordinate_uid_db, owner, start, count);
+	return have_range(&subordinate_gid.db, owner, start, count);
 }
 
-int sub_uid_add (const char *owner, uid_t start, unsigned long count)
+bool local_sub_gid_assigned(const char *owner)
 {
-	if (get_subid_nss_handle())
-		return -EOPNOTSUPP;
-	return add_range (&subordinate_uid_db, owner, start, count);
+	return range_exists (&subordinate_gid.db, owner);
 }
 
-int sub_uid_remove (const char *owner, uid_t start, unsigned long count)
+static int subid_range_cmp (const void *p1, const void *p2)
 {
-	if (get_subid_nss_handle())
-		return -EOPNOTSUPP;
-	return remove_range (&subordinate_uid_db, owner, start, count);
-}
+	const struct subid_range *r1 = p1;
+	const struct subid_range *r2 = p2;
 
-int sub_uid_close (void)
-{
-	return commonio_close (&subordinate_uid_db);
+	return (r1->start < r2->start) ? -1 : (r1->start > r2->start);
 }
 
-int sub_uid_unlock (void)
+/*
+ * usable_owners: list in @owners the names which own the ranges of
+ *                @dbfile which @owner can use.
+ *
+ * These are @owner, and its UID (resolved through @cache) for the
+ * /etc/subuid and /etc/subgid files, written in @uid_string. Ranges of
+ * other users with the same UID are not listed.
+ *
+ * Returns the number of names.
+ */
+static size_t usable_owners (/*@null@*/struct owner_cache *cache,
+			     const char *dbfile, const char *owner,
+			     char *uid_string, const char **owners)
 {
-	return commonio_unlock (&subordinate_uid_db);
+	size_t nowners = 1;
+	uid_t uid;
+
+	owners[0] = owner;
+	if (   (   (0 == strcmp (dbfile, "/etc/subuid"))
+	        || (0 == strcmp (dbfile, "/etc/subgid")))
+	    && owner_uid (cache, owner, &uid)) {
+		sprintf (uid_string, "%lu", (unsigned long int) uid);
+		owners[nowners++] = uid_string;
+	}
+	return nowners;
 }
 
-uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count)
+/*
+ * merge_ranges: sort the @n ranges of @ranges, and merge the ranges
+ *               which overlap or touch.
+ *
+ * Returns the number of merged ranges.
+ */
+static size_t merge_ranges (struct subid_range *ranges, size_t n)
 {
-	unsigned long start;
-	start = find_free_range (&subordinate_uid_db, min, max, count);
-	return start == ULONG_MAX ? (uid_t) -1 : start;
-}
+	size_t i, j;
 
-static struct commonio_db subordinate_gid_db = {
-	"/etc/subgid",		/* filename */
-	&subordinate_ops,	/* ops */
-	NULL,			/* fp */
-#ifdef WITH_SELINUX
-	NULL,			/* scontext */
-#endif
-	0644,                   /* st_mode */
-	0,                      /* st_uid */
-	0,                      /* st_gid */
-	NULL,			/* head */
-	NULL,			/* tail */
-	NULL,			/* cursor */
-	false,			/* changed */
-	false,			/* isopen */
-	false,			/* locked */
-	false,			/* readonly */
-	false			/* setname */
-};
+	qsort (ranges, n, sizeof *ranges, subid_range_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if (   (j > 0)
+		    && (ranges[i].start <= ranges[j - 1].start + ranges[j - 1].count)) {
+			unsigned long end = ranges[i].start + ranges[i].count;
 
-int sub_gid_setdbname (const char *filename)
-{
-	return commonio_setname (&subordinate_gid_db, filename);
+			if (end > ranges[j - 1].start + ranges[j - 1].count)
+				ranges[j - 1].count = end - ranges[j - 1].start;
+			continue;
+		}
+		ranges[j++] = ranges[i];
+	}
+	return j;
 }
 
-/*@observer@*/const char *sub_gid_dbname (void)
+/*
+ * usable_ranges: list the ranges of @db which @owner can use, sorted and
+ *                merged.
+ *
+ * Returns the number of ranges, or -1 on failure.
+ */
+static int usable_ranges (struct commonio_db *db, const char *owner,
+			  struct subid_range **in_ranges)
 {
-	return subordinate_gid_db.filename;
+	const struct range_index *idx;
+	struct subid_range *ranges;
+	char owner_uid_string[33];
+	const char *owners[2];
+	size_t i, j, n = 0, nowners;
+
+	*in_ranges = NULL;
+	idx = index_by_owner (db);
+	if (NULL == idx)
+		return -1;
+
+	nowners = usable_owners (db_owners (db), db->filename, owner,
+				 owner_uid_string, owners);
+
+	ranges = malloc ((2 * idx->count + 1) * sizeof *ranges);
+	if (NULL == ranges)
+		return -1;
+	for (j = 0; j < nowners; j++) {
+		for (i = owner_first (idx, owners[j]);
+		     (i < idx->count) && (0 == strcmp (idx->by_owner[i].range->owner, owners[j]));
+		     i++) {
+			if (0 == idx->by_owner[i].range->count)
+				continue;
+			ranges[n].start = idx->by_owner[i].range->start;
+			ranges[n].count = idx->by_owner[i].range->count;
+			n++;
+		}
+	}
+
+	*in_ranges = ranges;
+	return merge_ranges (ranges, n);
 }
 
-bool sub_gid_file_present (void)
+/*
+ * covered_ranges: check whether the @n ranges of @wanted, sorted, are
+ *                 all included in the @nusable ranges of @usable, sorted
+ *                 and merged.
+ *
+ * If @db is not NULL, the ranges which are not included may still be
+ * delegated in @db to another name of @owner.
+ */
+static bool covered_ranges (const struct subid_range *usable, size_t nusable,
+			    const struct subid_range *wanted, size_t n,
+			    /*@null@*/struct commonio_db *db, const char *owner)
 {
-	return commonio_present (&subordinate_gid_db);
+	size_t i, j = 0;
+
+	for (i = 0; i < n; i++) {
+		unsigned long last;
+
+		if (0 == wanted[i].count)
+			return false;
+		last = wanted[i].start + wanted[i].count - 1;
+		while (   (nusable > j)
+		       && (usable[j].start + usable[j].count - 1 < wanted[i].start)) {
+			j++;
+		}
+		if (   (nusable > j)
+		    && (usable[j].start <= wanted[i].start)
+		    && (usable[j].start + usable[j].count - 1 >= last)) {
+			continue;
+		}
+
+		/* It may still be delegated to another name of the owner */
+		if (   (NULL == db)
+		    || !have_range (db, owner, wanted[i].start, wanted[i].count)) {
+			return false;
+		}
+	}
+	return true;
 }
 
-int sub_gid_lock (void)
+/*
+ * have_ranges: check whether @owner is authorized to use all the @n
+ *              ranges of @ranges in @db.
+ *
+ * The requested ranges are sorted and checked against the merged ranges
+ * of the owner in one pass.
+ */
+static bool have_ranges (struct commonio_db *db, const char *owner,
+			 const struct subid_range *ranges, size_t n)
 {
-	return commonio_lock (&subordinate_gid_db);
+	struct subid_range *usable, *wanted;
+	size_t i;
+	int nusable;
+	bool ret;
+
+	nusable = usable_ranges (db, owner, &usable);
+	wanted = malloc ((n + 1) * sizeof *wanted);
+	if ((nusable < 0) || (NULL == wanted)) {
+		free (usable);
+		free (wanted);
+		for (i = 0; i < n; i++) {
+			if (!have_range (db, owner, ranges[i].start, ranges[i].count))
+				return false;
+		}
+		return true;
+	}
+	memcpy (wanted, ranges, n * sizeof *wanted);
+	qsort (wanted, n, sizeof *wanted, subid_range_cmp);
+
+	ret = covered_ranges (usable, nusable, wanted, n, db, owner);
+
+	free (usable);
+	free (wanted);
+	return ret;
 }
 
-int sub_gid_open (int mode)
+/*
+ * submap_have_ranges: check whether the @n ranges of @ranges are all
+ *                     delegated to @owner in the map of @dbfile.
+ *
+ * Returns false if they are not, or if @dbfile has no up to date map.
+ */
+static bool submap_have_ranges (const char *dbfile, const char *owner,
+				const struct subid_range *ranges, size_t n)
 {
-	return commonio_open (&subordinate_gid_db, mode);
+	struct subid_range *usable = NULL, *wanted = NULL;
+	const struct submap_owner *o;
+	struct submap *map;
+	char owner_uid_string[33];
+	const char *owners[2];
+	size_t i, j, nowners, nusable = 0;
+	bool ret = false;
+
+	map = submap_open (dbfile);
+	if (NULL == map)
+		return false;
+
+	nowners = usable_owners (NULL, dbfile, owner, owner_uid_string, owners);
+	usable = malloc ((2 * (size_t) map->hdr->nranges + 1) * sizeof *usable);
+	wanted = malloc ((n + 1) * sizeof *wanted);
+	if ((NULL == usable) || (NULL == wanted))
+		goto out;
+	for (j = 0; j < nowners; j++) {
+		o = submap_owner (map, owners[j]);
+		if (NULL == o)
+			continue;
+		for (i = 0; i < o->nranges; i++) {
+			uint32_t r = map->by_owner[o->first + i];
+
+			if (r >= map->hdr->nranges)
+				goto out;
+			if (0 == map->ranges[r].count)
+				continue;
+			usable[nusable].start = map->ranges[r].start;
+			usable[nusable].count = map->ranges[r].count;
+			nusable++;
+		}
+	}
+	nusable = merge_ranges (usable, nusable);
+	memcpy (wanted, ranges, n * sizeof *wanted);
+	qsort (wanted, n, sizeof *wanted, subid_range_cmp);
+
+	ret = covered_ranges (usable, nusable, wanted, n, NULL, owner);
+
+      out:
+	free (usable);
+	free (wanted);
+	submap_close (map);
+	return ret;
 }
 
-bool have_sub_gids(const char *owner, gid_t start, unsigned long count)
+/*
+ * have_sub_id_ranges: check whether @owner is authorized to use all the
+ *                     @n ranges of @ranges.
+ *
+ * If no subid NSS module is used and the subordinate database of @id_type
+ * is not open, the ranges are looked up in the map of the database, and
+ * false is returned if it has no up to date map.
+ */
+bool have_sub_id_ranges(const char *owner, enum subid_type id_type,
+			const struct subid_range *ranges, size_t n)
 {
 	struct subid_nss_ops *h;
+	struct commonio_db *db;
 	bool found;
 	enum subid_status status;
+	size_t i;
+
+	if (0 == n)
+		return true;
+
 	h = get_subid_nss_handle();
+	if (h && h->has_range_many) {
+		status = h->has_range_many(owner, ranges, n, id_type, &found);
+		return (status == SUBID_STATUS_SUCCESS) && found;
+	}
 	if (h) {
-		status = h->has_range(owner, start, count, ID_TYPE_GID, &found);
-		if (status == SUBID_STATUS_SUCCESS && found)
-			return true;
-		return false;
+		for (i = 0; i < n; i++) {
+			status = h->has_range(owner, ranges[i].start, ranges[i].count, id_type, &found);
+			if (status != SUBID_STATUS_SUCCESS || !found)
+				return false;
+		}
+		return true;
 	}
-	return have_range(&subordinate_gid_db, owner, start, count);
-}
 
-bool local_sub_gid_assigned(const char *owner)
-{
-	return range_exists (&subordinate_gid_db, owner);
+	db = (ID_TYPE_UID == id_type) ? &subordinate_uid.db : &subordinate_gid.db;
+	if (!db->isopen)
+		return submap_have_ranges (db->filename, owner, ranges, n);
+	return have_ranges (db, owner, ranges, n);
 }
 
 int sub_gid_add (const char *owner, gid_t start, unsigned long count)
 {
 	if (get_subid_nss_handle())
 		return -EOPNOTSUPP;
-	return add_range (&subordinate_gid_db, owner, start, count);
+	return add_range (&subordinate_gid.db, owner, start, count);
 }
 
 int sub_gid_remove (const char *owner, gid_t start, unsigned long count)
 {
 	if (get_subid_nss_handle())
 		return -EOPNOTSUPP;
-	return remove_range (&subordinate_gid_db, owner, start, count);
+	return remove_range (&subordinate_gid.db, owner, start, count);
 }
 
 int sub_gid_close (void)
 {
-	return commonio_close (&subordinate_gid_db);
+	return commonio_close (&subordinate_gid.db);
+}
+
+struct commonio_db *__sub_gid_get_db (void)
+{
+	return &subordinate_gid.db;
 }
 
 int sub_gid_unlock (void)
 {
-	return commonio_unlock (&subordinate_gid_db);
+	return commonio_unlock (&subordinate_gid.db);
 }
 
 gid_t sub_gid_find_free_range(gid_t min, gid_t max, unsigned long count)
 {
 	unsigned long start;
-	start = find_free_range (&subordinate_gid_db, min, max, count);
+	start = find_free_range (&subordinate_gid.db, min, max, count);
 	return start == ULONG_MAX ? (gid_t) -1 : start;
 }
 
-static bool get_owner_id(const char *owner, enum subid_type id_type, char *id)
+int sub_gid_find_free_ranges(gid_t min, gid_t max, unsigned long count,
+			     size_t n, unsigned long *starts)
+{
+	return find_free_ranges (&subordinate_gid.db, min, max, count, n, starts);
+}
+
+bool sub_gid_range_free(gid_t start, unsigned long count)
+{
+	return range_free (&subordinate_gid.db, start, count);
+}
+
+int sub_gid_add_many (const char *const *owners, const unsigned long *starts,
+		      size_t n, unsigned long count)
+{
+	if (get_subid_nss_handle())
+		return -EOPNOTSUPP;
+	return add_ranges (&subordinate_gid.db, owners, starts, n, count);
+}
+
+int sub_gid_import (const struct subordinate_range *ranges, size_t n,
+		    size_t *bad)
+{
+	if (get_subid_nss_handle()) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return import_ranges (&subordinate_gid.db, ranges, n, bad);
+}
+
+int sub_gid_export (FILE *out)
+{
+	return export_ranges (&subordinate_gid.db, out);
+}
+
+int sub_gid_compact (unsigned long min_count, bool write,
+		     struct subid_fragmentation *frag,
+		     void (*overlap) (const struct subordinate_range *,
+				      const struct subordinate_range *))
+{
+	if (get_subid_nss_handle()) {
+		errno = EOPNOTSUPP;
+		return -1;
+	}
+	return compact_ranges (&subordinate_gid.db, min_count, write, frag,
+			       overlap);
+}
+
+/*
+ * get_owner_id: write in @id the UID (resolved through @cache) or the GID
+ *               of @owner.
+ */
+static bool get_owner_id(/*@null@*/struct owner_cache *cache, const char *owner,
+			 enum subid_type id_type, char *id)
+{
+	uid_t uid;
+	unsigned long gid;
+	int ret = 0;
+
+	switch (id_type) {
+	case ID_TYPE_UID:
+		if (!owner_uid (cache, owner, &uid)) {
+			return false;
+		}
+		ret = snprintf(id, ID_SIZE, "%u", uid);
+		if (ret < 0 || ret >= ID_SIZE) {
+			return false;
+		}
+		break;
+	case ID_TYPE_GID:
+		if (!lookup_id (true, owner, &gid)) {
+			return false;
+		}
+		ret = snprintf(id, ID_SIZE, "%lu", gid);
+		if (ret < 0 || ret >= ID_SIZE) {
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * owner_ranges: list the ranges of @owner in @db, which must be open, as
+ *               list_owner_ranges() does.
+ */
+static int owner_ranges(struct commonio_db *db, const char *owner,
+			enum subid_type id_type, struct subid_range **in_ranges)
+{
+	// TODO - need to handle owner being either uid or username
+	struct subid_range *ranges = NULL;
+	const struct range_index *idx;
+	struct range_item *items;
+	size_t i, n;
+	int count = 0;
+	char id[ID_SIZE];
+	bool have_owner_id;
+
+	*in_ranges = NULL;
+
+	have_owner_id = get_owner_id(db_owners (db), owner, id_type, id);
+
+	idx = index_by_owner (db);
+	if (NULL == idx)
+		return -1;
+	/* Both loops may list the same ranges if owner is its own ID */
+	items = malloc ((2 * idx->count + 1) * sizeof *items);
+	if (NULL == items)
+		return -1;
+	n = 0;
+	for (i = owner_first (idx, owner);
+	     (i < idx->count) && (0 == strcmp (idx->by_owner[i].range->owner, owner));
+	     i++) {
+		items[n++] = idx->by_owner[i];
+	}
+
+	// Let's also compare with the ID
+	if (have_owner_id == true) {
+		for (i = owner_first (idx, id);
+		     (i < idx->count) && (0 == strcmp (idx->by_owner[i].range->owner, id));
+		     i++) {
+			items[n++] = idx->by_owner[i];
+		}
+	}
+
+	/* Report the ranges in the order of the file */
+	qsort (items, n, sizeof *items, item_pos_cmp);
+	for (i = 0; i < n; i++) {
+		if (!append_range(&ranges, items[i].range, count++)) {
+			free(ranges);
+			ranges = NULL;
+			count = -1;
+			break;
+		}
+	}
+	free (items);
+
+	*in_ranges = ranges;
+	return count;
+}
+
+/*
+ * submap_owner_ranges: list the ranges of @owner in @map, like
+ *                      owner_ranges.
+ */
+static int submap_owner_ranges(const struct submap *map, const char *owner,
+			       enum subid_type id_type, struct subid_range **in_ranges)
+{
+	const struct submap_owner *o[2] = { NULL, NULL };
+	struct subid_range *ranges;
+	char id[ID_SIZE];
+	size_t i[2] = { 0, 0 };
+	size_t n = 0;
+
+	*in_ranges = NULL;
+
+	o[0] = submap_owner (map, owner);
+	if (get_owner_id(NULL, owner, id_type, id))
+		o[1] = submap_owner (map, id);
+
+	ranges = malloc ((2 * (size_t) map->hdr->nranges + 1) * sizeof *ranges);
+	if (NULL == ranges)
+		return -1;
+
+	/* Merge the ranges of both names, in the order of the file */
+	for (;;) {
+		uint32_t r[2] = { UINT32_MAX, UINT32_MAX };
+		size_t k;
+
+		for (k = 0; k < 2; k++) {
+			if ((NULL == o[k]) || (i[k] >= o[k]->nranges))
+				continue;
+			r[k] = map->by_owner[o[k]->first + i[k]];
+			if (r[k] >= map->hdr->nranges) {
+				free (ranges);
+				return -1;
+			}
+		}
+		if ((UINT32_MAX == r[0]) && (UINT32_MAX == r[1]))
+			break;
+		k = (   (UINT32_MAX == r[1])
+		     || (   (UINT32_MAX != r[0])
+		         && (map->ranges[r[0]].pos <= map->ranges[r[1]].pos))) ? 0 : 1;
+		i[k]++;
+		ranges[n].start = map->ranges[r[k]].start;
+		ranges[n].count = map->ranges[r[k]].count;
+		n++;
+	}
+
+	*in_ranges = ranges;
+	return n;
+}
+
+/*
+ * sorted_owner_ranges: list the ranges of @owner in the file of @db with a
+ *                      binary search, if it is marked sorted (see
+ *                      SORTED_DATABASES).
+ *
+ * Returns the number of ranges found, or -1 if the file is not sorted.
+ */
+static int sorted_owner_ranges(const struct commonio_db *db, const char *owner,
+			       enum subid_type id_type, struct subid_range **in_ranges)
+{
+	struct subordinate_range parsed;
+	char rangebuf[1024];
+	const char *keys[2];
+	char id[ID_SIZE];
+	char **lines;
+	int count = 0;
+	int k, i, n;
+
+	*in_ranges = NULL;
+
+	/* The lines of the lower key come first in the file */
+	keys[0] = owner;
+	keys[1] = NULL;
+	if (get_owner_id(NULL, owner, id_type, id) && (0 != strcmp(id, owner))) {
+		keys[0] = (strcmp(id, owner) < 0) ? id : owner;
+		keys[1] = (keys[0] == id) ? owner : id;
+	}
+
+	for (k = 0; (k < 2) && (NULL != keys[k]); k++) {
+		n = sorted_lookup(db->filename, keys[k], &lines);
+		if (-1 == n)
+			goto fail;
+		for (i = 0; i < n; i++) {
+			const struct subordinate_range *range;
+
+			range = parse_range(lines[i], &parsed, rangebuf, sizeof rangebuf);
+			if (   (NULL != range)
+			    && !append_range(in_ranges, range, count++)) {
+				n = -1;
+			}
+			free(lines[i]);
+		}
+		free(lines);
+		if (-1 == n)
+			goto fail;
+	}
+	return count;
+
+fail:
+	free(*in_ranges);
+	*in_ranges = NULL;
+	return -1;
+}
+
+/*
+ * subid_db_open: open a private copy of the subordinate database of
+ *                @id_type, for queries.
+ *
+ * The copy is read from the file of the database of the process, and
+ * has its own indexes, so that the copies can be queried by several
+ * threads at once.  It must be closed with subid_db_close().
+ *
+ * Returns NULL on failure.
+ */
+/*@null@*/struct commonio_db *subid_db_open(enum subid_type id_type)
 {
-	struct passwd *pw;
-	struct group *gr;
-	int ret = 0;
+	const struct subordinate_db *main_db;
+	struct subordinate_db *sdb;
+	int saved_errno;
+	int ok;
 
 	switch (id_type) {
 	case ID_TYPE_UID:
-		pw = getpwnam(owner);
-		if (pw == NULL) {
-			return false;
-		}
-		ret = snprintf(id, ID_SIZE, "%u", pw->pw_uid);
-		if (ret < 0 || ret >= ID_SIZE) {
-			return false;
-		}
+		main_db = &subordinate_uid;
 		break;
 	case ID_TYPE_GID:
-		gr = getgrnam(owner);
-		if (gr == NULL) {
-			return false;
-		}
-		ret = snprintf(id, ID_SIZE, "%u", gr->gr_gid);
-		if (ret < 0 || ret >= ID_SIZE) {
-			return false;
-		}
+		main_db = &subordinate_gid;
 		break;
 	default:
-		return false;
+		errno = EINVAL;
+		return NULL;
 	}
 
-	return true;
+	sdb = calloc (1, sizeof *sdb);
+	if (NULL == sdb)
+		return NULL;
+	sdb->db.ops = &subordinate_private_ops;
+	sdb->db.lock_fd = -1;
+
+	(void) pthread_mutex_lock (&subid_db_lock);
+	strcpy (sdb->db.filename, main_db->db.filename);
+	sdb->db.st_mode = main_db->db.st_mode;
+	ok = commonio_open (&sdb->db, O_RDONLY);
+	saved_errno = errno;
+	(void) pthread_mutex_unlock (&subid_db_lock);
+
+	if (!ok) {
+		free (sdb);
+		errno = saved_errno;
+		return NULL;
+	}
+	return &sdb->db;
+}
+
+/*
+ * subid_db_close: close a copy opened with subid_db_open().
+ */
+void subid_db_close(/*@null@*/ /*@only@*/struct commonio_db *db)
+{
+	struct subordinate_db *sdb = (struct subordinate_db *) db;
+
+	if (NULL == sdb)
+		return;
+
+	(void) pthread_mutex_lock (&subid_db_lock);
+	(void) commonio_close (&sdb->db);
+	(void) pthread_mutex_unlock (&subid_db_lock);
+	range_index_reset (&sdb->index);
+	owner_cache_reset (&sdb->owners);
+	free (sdb);
 }
 
 /*
@@ -800,15 +3051,11 @@ static bool get_owner_id(const char *owner, enum subid_type id_type, char *id)
  */
 int list_owner_ranges(const char *owner, enum subid_type id_type, struct subid_range **in_ranges)
 {
-	// TODO - need to handle owner being either uid or username
-	struct subid_range *ranges = NULL;
-	const struct subordinate_range *range;
-	struct commonio_db *db;
+	struct commonio_db *db, *copy;
 	enum subid_status status;
 	int count = 0;
 	struct subid_nss_ops *h;
-	char id[ID_SIZE];
-	bool have_owner_id;
+	struct submap *map;
 
 	*in_ranges = NULL;
 
@@ -820,94 +3067,64 @@ int list_owner_ranges(const char *owner, enum subid_type id_type, struct subid_r
 		return -1;
 	}
 
-	switch (id_type) {
-	case ID_TYPE_UID:
-		if (!sub_uid_open(O_RDONLY)) {
-			return -1;
-		}
-		db = &subordinate_uid_db;
-		break;
-	case ID_TYPE_GID:
-		if (!sub_gid_open(O_RDONLY)) {
-			return -1;
-		}
-		db = &subordinate_gid_db;
-		break;
-	default:
+	if ((ID_TYPE_UID != id_type) && (ID_TYPE_GID != id_type))
 		return -1;
+	db = (ID_TYPE_UID == id_type) ? &subordinate_uid.db : &subordinate_gid.db;
+	map = submap_open (db->filename);
+	if (NULL != map) {
+		count = submap_owner_ranges(map, owner, id_type, in_ranges);
+		submap_close (map);
+		if (count >= 0)
+			return count;
 	}
+	count = sorted_owner_ranges(db, owner, id_type, in_ranges);
+	if (count >= 0)
+		return count;
 
-	have_owner_id = get_owner_id(owner, id_type, id);
-
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		if (0 == strcmp(range->owner, owner)) {
-			if (!append_range(&ranges, range, count++)) {
-				free(ranges);
-				ranges = NULL;
-				count = -1;
-				goto out;
-			}
-		}
+	/* A private copy, so that it can be called by several threads */
+	copy = subid_db_open(id_type);
+	if (NULL == copy)
+		return -1;
 
-		// Let's also compare with the ID
-		if (have_owner_id == true && 0 == strcmp(range->owner, id)) {
-			if (!append_range(&ranges, range, count++)) {
-				free(ranges);
-				ranges = NULL;
-				count = -1;
-				goto out;
-			}
-		}
-	}
+	count = owner_ranges(copy, owner, id_type, in_ranges);
 
-out:
-	if (id_type == ID_TYPE_UID)
-		sub_uid_close();
-	else
-		sub_gid_close();
+	subid_db_close(copy);
 
-	*in_ranges = ranges;
 	return count;
 }
 
-static bool all_digits(const char *str)
+/*
+ * list_open_owner_ranges: like list_owner_ranges, in a copy opened with
+ *                         subid_db_open().
+ */
+int list_open_owner_ranges(struct commonio_db *db, const char *owner, enum subid_type id_type, struct subid_range **in_ranges)
 {
-	int i;
-
-	for (i = 0; str[i] != '\0'; i++)
-		if (!isdigit(str[i]))
-			return false;
-	return true;
+	return owner_ranges(db, owner, id_type, in_ranges);
 }
 
-static int append_uids(uid_t **uids, const char *owner, int n)
+static int append_uids(struct owner_cache *cache, uid_t **uids, const char *owner, int n)
 {
-	uid_t owner_uid;
+	uid_t uid;
 	uid_t *ret;
 	int i;
 
 	if (all_digits(owner)) {
-		i = sscanf(owner, "%d", &owner_uid);
+		i = sscanf(owner, "%d", &uid);
 		if (i != 1) {
 			// should not happen
 			free(*uids);
 			*uids = NULL;
 			return -1;
 		}
-	} else {
-		struct passwd *pwd = getpwnam(owner);
-		if (NULL == pwd) {
-			/* Username not defined in /etc/passwd, or error occurred during lookup */
-			free(*uids);
-			*uids = NULL;
-			return -1;
-		}
-		owner_uid = pwd->pw_uid;
+	} else if (!owner_uid (cache, owner, &uid)) {
+		/* Username not defined in /etc/passwd, or error occurred during lookup */
+		free(*uids);
+		*uids = NULL;
+		return -1;
 	}
 
 	for (i = 0; i < n; i++) {
-		if (owner_uid == (*uids)[i])
+		if (uid == (*uids)[i])
 			return n;
 	}
 
@@ -916,17 +3133,124 @@ static int append_uids(uid_t **uids, const char *owner, int n)
 		free(*uids);
 		return -1;
 	}
-	ret[n] = owner_uid;
+	ret[n] = uid;
 	*uids = ret;
 	return n+1;
 }
 
-int find_subid_owners(unsigned long id, enum subid_type id_type, uid_t **uids)
+/*
+ * subid_owners: list the owners of the ranges of @db, which must be open,
+ *               including @id.
+ */
+static int subid_owners(struct commonio_db *db, unsigned long id, uid_t **uids)
 {
 	const struct subordinate_range *range;
+	struct range_item *items;
+	int count, i;
+	int n = 0;
+
+	*uids = NULL;
+
+	count = ranges_including (db, id, &items);
+	if (count < 0)
+		n = -1;
+	for (i = 0; i < count; i++) {
+		range = items[i].range;
+		if (id >= range->start && id < range->start + range-> count) {
+			n = append_uids(db_owners (db), uids, range->owner, n);
+			if (n < 0)
+				break;
+		}
+	}
+	free (items);
+
+	return n;
+}
+
+struct submap_hit {
+	uint32_t pos;
+	uint32_t owner;
+};
+
+static int submap_hit_cmp (const void *p1, const void *p2)
+{
+	const struct submap_hit *h1 = p1;
+	const struct submap_hit *h2 = p2;
+
+	return (h1->pos < h2->pos) ? -1 : (h1->pos > h2->pos);
+}
+
+/*
+ * submap_subid_owners: list the owners of the ranges of @map including
+ *                      @id, like subid_owners.
+ */
+static int submap_subid_owners(const struct submap *map, unsigned long id, uid_t **uids)
+{
+	struct owner_cache cache = { NULL, 0 };
+	struct submap_hit *hits = NULL;
+	size_t lo = 0, hi, i, nhits = 0;
+	int n = 0;
+
+	*uids = NULL;
+
+	/* Ranges before hi start at or before id */
+	hi = map->hdr->nranges;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (map->ranges[mid].start <= id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; (i > 0) && (map->ranges[i - 1].max_last >= id); i--) {
+		const struct submap_range *range = &map->ranges[i - 1];
+		struct submap_hit *tmp;
+
+		if ((id < range->start) || (id - range->start >= range->count))
+			continue;
+		if (range->owner >= map->hdr->nowners) {
+			free (hits);
+			return -1;
+		}
+		tmp = realloc (hits, (nhits + 1) * sizeof *tmp);
+		if (NULL == tmp) {
+			free (hits);
+			return -1;
+		}
+		hits = tmp;
+		hits[nhits].pos = range->pos;
+		hits[nhits].owner = range->owner;
+		nhits++;
+	}
+
+	qsort (hits, nhits, sizeof *hits, submap_hit_cmp);
+	for (i = 0; i < nhits; i++) {
+		const struct submap_owner *o = &map->owners[hits[i].owner];
+
+		if (o->name >= map->hdr->names_size) {
+			free (*uids);
+			*uids = NULL;
+			n = -1;
+			break;
+		}
+		n = append_uids(&cache, uids, map->names + o->name, n);
+		if (n < 0)
+			break;
+	}
+	free (hits);
+	owner_cache_reset (&cache);
+
+	return n;
+}
+
+int find_subid_owners(unsigned long id, enum subid_type id_type, uid_t **uids)
+{
 	struct subid_nss_ops *h;
 	enum subid_status status;
-	struct commonio_db *db;
+	struct commonio_db *db, *copy;
+	struct submap *map;
 	int n = 0;
 
 	h = get_subid_nss_handle();
@@ -938,79 +3262,107 @@ int find_subid_owners(unsigned long id, enum subid_type id_type, uid_t **uids)
 		return n;
 	}
 
-	switch (id_type) {
-	case ID_TYPE_UID:
-		if (!sub_uid_open(O_RDONLY)) {
-			return -1;
-		}
-		db = &subordinate_uid_db;
-		break;
-	case ID_TYPE_GID:
-		if (!sub_gid_open(O_RDONLY)) {
-			return -1;
-		}
-		db = &subordinate_gid_db;
-		break;
-	default:
+	if ((ID_TYPE_UID != id_type) && (ID_TYPE_GID != id_type))
 		return -1;
+	db = (ID_TYPE_UID == id_type) ? &subordinate_uid.db : &subordinate_gid.db;
+	map = submap_open (db->filename);
+	if (NULL != map) {
+		n = submap_subid_owners(map, id, uids);
+		submap_close (map);
+		return n;
 	}
 
-	*uids = NULL;
+	copy = subid_db_open(id_type);
+	if (NULL == copy)
+		return -1;
 
-	commonio_rewind(db);
-	while ((range = commonio_next(db)) != NULL) {
-		if (id >= range->start && id < range->start + range-> count) {
-			n = append_uids(uids, range->owner, n);
-			if (n < 0)
-				break;
-		}
-	}
+	n = subid_owners(copy, id, uids);
 
-	if (id_type == ID_TYPE_UID)
-		sub_uid_close();
-	else
-		sub_gid_close();
+	subid_db_close(copy);
 
 	return n;
 }
 
-bool new_subid_range(struct subordinate_range *range, enum subid_type id_type, bool reuse)
+/*
+ * find_open_subid_owners: like find_subid_owners, in a copy opened with
+ *                         subid_db_open().
+ */
+int find_open_subid_owners(struct commonio_db *db, unsigned long id, uid_t **uids)
 {
-	struct commonio_db *db;
-	const struct subordinate_range *r;
-	bool ret;
+	return subid_owners(db, id, uids);
+}
 
-	if (get_subid_nss_handle())
-		return false;
+/*
+ * forget_subid_owners: drop the UIDs of the owners of the ranges
+ *                      resolved by @db since it was opened.
+ */
+void forget_subid_owners(struct commonio_db *db)
+{
+	owner_cache_reset (db_owners (db));
+}
 
+/*
+ * open_subid_db: lock and open the subordinate database of @id_type for
+ *                writing.
+ */
+static /*@null@*/struct commonio_db *open_subid_db(enum subid_type id_type)
+{
 	switch (id_type) {
 	case ID_TYPE_UID:
 		if (!sub_uid_lock()) {
 			printf("Failed locking subuids (errno %d)\n", errno);
-			return false;
+			return NULL;
 		}
 		if (!sub_uid_open(O_CREAT | O_RDWR)) {
 			printf("Failed opening subuids (errno %d)\n", errno);
 			sub_uid_unlock();
-			return false;
+			return NULL;
 		}
-		db = &subordinate_uid_db;
-		break;
+		return &subordinate_uid.db;
 	case ID_TYPE_GID:
 		if (!sub_gid_lock()) {
 			printf("Failed locking subgids (errno %d)\n", errno);
-			return false;
+			return NULL;
 		}
 		if (!sub_gid_open(O_CREAT | O_RDWR)) {
 			printf("Failed opening subgids (errno %d)\n", errno);
 			sub_gid_unlock();
-			return false;
+			return NULL;
 		}
-		db = &subordinate_gid_db;
-		break;
+		return &subordinate_gid.db;
 	default:
-		return false;
+		return NULL;
+	}
+}
+
+/*
+ * opened_subid_db: the database of @id_type, if it is open.
+ */
+static /*@null@*/struct commonio_db *opened_subid_db(enum subid_type id_type)
+{
+	switch (id_type) {
+	case ID_TYPE_UID:
+		return subordinate_uid.db.isopen ? &subordinate_uid.db : NULL;
+	case ID_TYPE_GID:
+		return subordinate_gid.db.isopen ? &subordinate_gid.db : NULL;
+	default:
+		return NULL;
 	}
+}
+
+/*
+ * new_open_subid_range: like new_subid_range, on a database opened for
+ *                       writing.  The range is written when the database
+ *                       is closed.
+ */
+bool new_open_subid_range(struct subordinate_range *range, enum subid_type id_type, bool reuse)
+{
+	struct commonio_db *db;
+	const struct subordinate_range *r;
+
+	db = opened_subid_db(id_type);
+	if (NULL == db)
+		return false;
 
 	commonio_rewind(db);
 	if (reuse) {
@@ -1028,73 +3380,85 @@ bool new_subid_range(struct subordinate_range *range, enum subid_type id_type, b
 
 	range->start = find_free_range(db, range->start, ULONG_MAX, range->count);
 
-	if (range->start == ULONG_MAX) {
-		ret = false;
-		goto out;
-	}
+	if (range->start == ULONG_MAX)
+		return false;
 
-	ret = add_range(db, range->owner, range->start, range->count) == 1;
+	return add_range(db, range->owner, range->start, range->count) == 1;
+}
+
+/*
+ * release_open_subid_range: like release_subid_range, on a database
+ *                           opened for writing.
+ */
+bool release_open_subid_range(struct subordinate_range *range, enum subid_type id_type)
+{
+	struct commonio_db *db;
+
+	db = opened_subid_db(id_type);
+	if (NULL == db)
+		return false;
+
+	return remove_range(db, range->owner, range->start, range->count) == 1;
+}
+
+/*
+ * begin_subid_changes: lock and open the database of @id_type, so that
+ *                      several ranges can be granted or released with
+ *                      new_open_subid_range and release_open_subid_range
+ *                      and written at once by end_subid_changes.
+ */
+bool begin_subid_changes(enum subid_type id_type)
+{
+	if (get_subid_nss_handle())
+		return false;
+
+	return open_subid_db(id_type) != NULL;
+}
+
+/*
+ * end_subid_changes: write the changes started with begin_subid_changes
+ *                    if @commit, or discard them, and unlock the database.
+ *
+ * Returns false if the changes could not be written.
+ */
+bool end_subid_changes(enum subid_type id_type, bool commit)
+{
+	bool ret = true;
 
-out:
 	if (id_type == ID_TYPE_UID) {
-		sub_uid_close();
+		if (commit)
+			ret = sub_uid_close() != 0;
 		sub_uid_unlock();
 	} else {
-		sub_gid_close();
+		if (commit)
+			ret = sub_gid_close() != 0;
 		sub_gid_unlock();
 	}
-
 	return ret;
 }
 
-bool release_subid_range(struct subordinate_range *range, enum subid_type id_type)
+bool new_subid_range(struct subordinate_range *range, enum subid_type id_type, bool reuse)
 {
-	struct commonio_db *db;
 	bool ret;
 
-	if (get_subid_nss_handle())
+	if (!begin_subid_changes(id_type))
 		return false;
 
-	switch (id_type) {
-	case ID_TYPE_UID:
-		if (!sub_uid_lock()) {
-			printf("Failed locking subuids (errno %d)\n", errno);
-			return false;
-		}
-		if (!sub_uid_open(O_CREAT | O_RDWR)) {
-			printf("Failed opening subuids (errno %d)\n", errno);
-			sub_uid_unlock();
-			return false;
-		}
-		db = &subordinate_uid_db;
-		break;
-	case ID_TYPE_GID:
-		if (!sub_gid_lock()) {
-			printf("Failed locking subgids (errno %d)\n", errno);
-			return false;
-		}
-		if (!sub_gid_open(O_CREAT | O_RDWR)) {
-			printf("Failed opening subgids (errno %d)\n", errno);
-			sub_gid_unlock();
-			return false;
-		}
-		db = &subordinate_gid_db;
-		break;
-	default:
-		return false;
-	}
+	ret = new_open_subid_range(range, id_type, reuse);
 
-	ret = remove_range(db, range->owner, range->start, range->count) == 1;
+	return end_subid_changes(id_type, true) && ret;
+}
 
-	if (id_type == ID_TYPE_UID) {
-		sub_uid_close();
-		sub_uid_unlock();
-	} else {
-		sub_gid_close();
-		sub_gid_unlock();
-	}
+bool release_subid_range(struct subordinate_range *range, enum subid_type id_type)
+{
+	bool ret;
 
-	return ret;
+	if (!begin_subid_changes(id_type))
+		return false;
+
+	ret = release_open_subid_range(range, id_type);
+
+	return end_subid_changes(id_type, true) && ret;
 }
 
 #else				/* !ENABLE_SUBIDS */
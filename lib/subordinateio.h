@@ -12,8 +12,20 @@
 #include <sys/types.h>
 
 #include "../libsubid/subid.h"
+#include "commonio.h"
+
+/* Fragmentation of a subordinate database, see sub_uid_compact() */
+struct subid_fragmentation {
+	size_t ranges;		/* ranges before the merge */
+	size_t merged;		/* ranges merged in a range of their owner */
+	size_t overlaps;	/* ranges overlapping a range of another owner */
+	size_t holes;		/* holes between the ranges */
+	size_t small_holes;	/* holes with less IDs than a new range */
+	unsigned long wasted;	/* IDs of the small holes */
+};
 
 extern int sub_uid_close(void);
+extern struct commonio_db *__sub_uid_get_db (void);
 extern bool have_sub_uids(const char *owner, uid_t start, unsigned long count);
 extern bool sub_uid_file_present (void);
 extern bool local_sub_uid_assigned(const char *owner);
@@ -25,13 +37,30 @@ extern int sub_uid_unlock (void);
 extern int sub_uid_add (const char *owner, uid_t start, unsigned long count);
 extern int sub_uid_remove (const char *owner, uid_t start, unsigned long count);
 extern uid_t sub_uid_find_free_range(uid_t min, uid_t max, unsigned long count);
+extern int sub_uid_find_free_ranges(uid_t min, uid_t max, unsigned long count, size_t n, unsigned long *starts);
+extern bool sub_uid_range_free(uid_t start, unsigned long count);
+extern int sub_uid_add_many (const char *const *owners, const unsigned long *starts, size_t n, unsigned long count);
+extern int sub_uid_import (const struct subordinate_range *ranges, size_t n, size_t *bad);
+extern int sub_uid_export (FILE *out);
+extern int sub_uid_compact (unsigned long min_count, bool write, struct subid_fragmentation *frag, /*@null@*/void (*overlap) (const struct subordinate_range *, const struct subordinate_range *));
 extern int list_owner_ranges(const char *owner, enum subid_type id_type, struct subid_range **ranges);
 extern bool new_subid_range(struct subordinate_range *range, enum subid_type id_type, bool reuse);
 extern bool release_subid_range(struct subordinate_range *range, enum subid_type id_type);
+extern bool begin_subid_changes(enum subid_type id_type);
+extern bool new_open_subid_range(struct subordinate_range *range, enum subid_type id_type, bool reuse);
+extern bool release_open_subid_range(struct subordinate_range *range, enum subid_type id_type);
+extern bool end_subid_changes(enum subid_type id_type, bool commit);
 extern int find_subid_owners(unsigned long id, enum subid_type id_type, uid_t **uids);
+extern /*@null@*/struct commonio_db *subid_db_open(enum subid_type id_type);
+extern void subid_db_close(/*@null@*/ /*@only@*/struct commonio_db *db);
+extern int list_open_owner_ranges(struct commonio_db *db, const char *owner, enum subid_type id_type, struct subid_range **ranges);
+extern int find_open_subid_owners(struct commonio_db *db, unsigned long id, uid_t **uids);
+extern bool have_sub_id_ranges(const char *owner, enum subid_type id_type, const struct subid_range *ranges, size_t n);
+extern void forget_subid_owners(struct commonio_db *db);
 extern void free_subordinate_ranges(struct subordinate_range **ranges, int count);
 
 extern int sub_gid_close(void);
+extern struct commonio_db *__sub_gid_get_db (void);
 extern bool have_sub_gids(const char *owner, gid_t start, unsigned long count);
 extern bool sub_gid_file_present (void);
 extern bool local_sub_gid_assigned(const char *owner);
@@ -43,6 +72,12 @@ extern int sub_gid_unlock (void);
 extern int sub_gid_add (const char *owner, gid_t start, unsigned long count);
 extern int sub_gid_remove (const char *owner, gid_t start, unsigned long count);
 extern uid_t sub_gid_find_free_range(gid_t min, gid_t max, unsigned long count);
+extern int sub_gid_find_free_ranges(gid_t min, gid_t max, unsigned long count, size_t n, unsigned long *starts);
+extern bool sub_gid_range_free(gid_t start, unsigned long count);
+extern int sub_gid_add_many (const char *const *owners, const unsigned long *starts, size_t n, unsigned long count);
+extern int sub_gid_import (const struct subordinate_range *ranges, size_t n, size_t *bad);
+extern int sub_gid_export (FILE *out);
+extern int sub_gid_compact (unsigned long min_count, bool write, struct subid_fragmentation *frag, /*@null@*/void (*overlap) (const struct subordinate_range *, const struct subordinate_range *));
 #endif				/* ENABLE_SUBIDS */
 
 #endif
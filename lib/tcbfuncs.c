@@ -30,6 +30,16 @@
 
 static /*@null@*//*@only@*/char *stored_tcb_user = NULL;
 
+/*
+ * The tcb directories are reached relative to a descriptor of TCB_DIR,
+ * opened at the first use.  The last hash bucket (:NK or :NM/:NK) which
+ * was created is remembered with a descriptor, so that a series of
+ * operations on users of the same bucket only create it once.
+ */
+static int tcb_dir_fd = -1;
+static /*@null@*//*@only@*/char *tcb_bucket = NULL;
+static int tcb_bucket_fd = -1;
+
 shadowtcb_status shadowtcb_drop_priv (void)
 {
 	if (!getdef_bool ("USE_TCB")) {
@@ -63,6 +73,82 @@ shadowtcb_status shadowtcb_gain_priv (void)
 	(void) fflush (shadow_logfd); \
 } while (false)
 
+/* Returns the path of rel, relative to TCB_DIR, for the messages. */
+static const char *tcb_path (char *buf, size_t size, const char *rel)
+{
+	(void) snprintf (buf, size, TCB_DIR "/%s", rel);
+	return buf;
+}
+
+/* Reports an error on the path rel, relative to TCB_DIR. */
+static void tcb_error (const char *fmt, const char *rel, int err)
+{
+	char path[8192];
+
+	fprintf (shadow_logfd, fmt, shadow_progname,
+	         tcb_path (path, sizeof path, rel), strerror (err));
+}
+
+/* Returns a descriptor of TCB_DIR, or -1 on error. */
+static int tcb_dir (void)
+{
+	if (tcb_dir_fd < 0) {
+		tcb_dir_fd = open (TCB_DIR,
+		                   O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (tcb_dir_fd < 0) {
+			fprintf (shadow_logfd,
+			         _("%s: Cannot open %s: %s\n"),
+			         shadow_progname, TCB_DIR, strerror (errno));
+		}
+	}
+	return tcb_dir_fd;
+}
+
+/* Forgets the cached hash bucket. */
+static void tcb_bucket_forget (void)
+{
+	if (tcb_bucket_fd >= 0) {
+		(void) close (tcb_bucket_fd);
+	}
+	tcb_bucket_fd = -1;
+	free (tcb_bucket);
+	tcb_bucket = NULL;
+}
+
+/*
+ * Tells if the hash bucket rel (relative to TCB_DIR) is the cached one,
+ * and still exists.
+ */
+static bool tcb_bucket_cached (const char *rel)
+{
+	struct stat st;
+
+	if ((NULL == tcb_bucket) || (strcmp (tcb_bucket, rel) != 0)) {
+		return false;
+	}
+	if ((fstat (tcb_bucket_fd, &st) != 0) || (0 == st.st_nlink)) {
+		tcb_bucket_forget ();
+		return false;
+	}
+	return true;
+}
+
+/* Remembers the hash bucket rel (relative to TCB_DIR). */
+static void tcb_bucket_remember (int dirfd, const char *rel)
+{
+	tcb_bucket_forget ();
+	tcb_bucket = strdup (rel);
+	if (NULL == tcb_bucket) {
+		return;
+	}
+	tcb_bucket_fd = openat (dirfd, rel,
+	                        O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (tcb_bucket_fd < 0) {
+		free (tcb_bucket);
+		tcb_bucket = NULL;
+	}
+}
+
 /* Returns user's tcb directory path relative to TCB_DIR. */
 static /*@null@*/ char *shadowtcb_path_rel (const char *name, uid_t uid)
 {
@@ -93,24 +179,20 @@ static /*@null@*/ char *shadowtcb_path_rel (const char *name, uid_t uid)
 
 static /*@null@*/ char *shadowtcb_path_rel_existing (const char *name)
 {
-	char *path, *rval;
+	char *rval;
 	struct stat st;
 	char link[8192];
 	ssize_t ret;
+	int dirfd = tcb_dir ();
 
-	if (asprintf (&path, TCB_DIR "/%s", name) == -1) {
-		OUT_OF_MEMORY;
+	if (dirfd < 0) {
 		return NULL;
 	}
-	if (lstat (path, &st) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot stat %s: %s\n"),
-		         shadow_progname, path, strerror (errno));
-		free (path);
+	if (fstatat (dirfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+		tcb_error (_("%s: Cannot stat %s: %s\n"), name, errno);
 		return NULL;
 	}
 	if (S_ISDIR (st.st_mode)) {
-		free (path);
 		rval = strdup (name);
 		if (NULL == rval) {
 			OUT_OF_MEMORY;
@@ -121,19 +203,15 @@ static /*@null@*/ char *shadowtcb_path_rel_existing (const char *name)
 	if (!S_ISLNK (st.st_mode)) {
 		fprintf (shadow_logfd,
 		         _("%s: %s is neither a directory, nor a symlink.\n"),
-		         shadow_progname, path);
-		free (path);
+		         shadow_progname, tcb_path (link, sizeof link, name));
 		return NULL;
 	}
-	ret = readlink (path, link, sizeof (link) - 1);
+	ret = readlinkat (dirfd, name, link, sizeof (link) - 1);
 	if (-1 == ret) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot read symbolic link %s: %s\n"),
-		         shadow_progname, path, strerror (errno));
-		free (path);
+		tcb_error (_("%s: Cannot read symbolic link %s: %s\n"),
+		           name, errno);
 		return NULL;
 	}
-	free (path);
 	if ((size_t)ret >= sizeof(link) - 1) {
 		link[sizeof(link) - 1] = '\0';
 		fprintf (shadow_logfd,
@@ -150,50 +228,34 @@ static /*@null@*/ char *shadowtcb_path_rel_existing (const char *name)
 	return rval;
 }
 
-static /*@null@*/ char *shadowtcb_path (const char *name, uid_t uid)
-{
-	char *ret, *rel;
-
-	rel = shadowtcb_path_rel (name, uid);
-	if (NULL == rel) {
-		return NULL;
-	}
-	if (asprintf (&ret, TCB_DIR "/%s", rel) == -1) {
-		OUT_OF_MEMORY;
-		free (rel);
-		return NULL;
-	}
-	free (rel);
-	return ret;
-}
-
-static /*@null@*/ char *shadowtcb_path_existing (const char *name)
-{
-	char *ret, *rel;
-
-	rel = shadowtcb_path_rel_existing (name);
-	if (NULL == rel) {
-		return NULL;
-	}
-	if (asprintf (&ret, TCB_DIR "/%s", rel) == -1) {
-		OUT_OF_MEMORY;
-		free (rel);
-		return NULL;
-	}
-	free (rel);
-	return ret;
-}
-
 static shadowtcb_status mkdir_leading (const char *name, uid_t uid)
 {
-	char *ind, *dir, *ptr, *path = shadowtcb_path_rel (name, uid);
+	char *ind, *ptr, *path = shadowtcb_path_rel (name, uid);
 	struct stat st;
+	int dirfd;
 
 	if (NULL == path) {
 		return SHADOWTCB_FAILURE;
 	}
+	ind = strrchr (path, '/');
+	if (NULL == ind) {
+		/* not hashed */
+		free (path);
+		return SHADOWTCB_SUCCESS;
+	}
+	*ind = '\0';
+	if (tcb_bucket_cached (path)) {
+		free (path);
+		return SHADOWTCB_SUCCESS;
+	}
+	*ind = '/';
+
+	dirfd = tcb_dir ();
+	if (dirfd < 0) {
+		goto out_free_path;
+	}
 	ptr = path;
-	if (stat (TCB_DIR, &st) != 0) {
+	if (fstat (dirfd, &st) != 0) {
 		fprintf (shadow_logfd,
 		         _("%s: Cannot stat %s: %s\n"),
 		         shadow_progname, TCB_DIR, strerror (errno));
@@ -201,36 +263,28 @@ static shadowtcb_status mkdir_leading (const char *name, uid_t uid)
 	}
 	while ((ind = strchr (ptr, '/'))) {
 		*ind = '\0';
-		if (asprintf (&dir, TCB_DIR "/%s", path) == -1) {
-			OUT_OF_MEMORY;
-			return SHADOWTCB_FAILURE;
-		}
-		if ((mkdir (dir, 0700) != 0) && (errno != EEXIST)) {
-			fprintf (shadow_logfd,
-			         _("%s: Cannot create directory %s: %s\n"),
-			         shadow_progname, dir, strerror (errno));
-			goto out_free_dir;
+		if ((mkdirat (dirfd, path, 0700) != 0) && (errno != EEXIST)) {
+			tcb_error (_("%s: Cannot create directory %s: %s\n"),
+			           path, errno);
+			goto out_free_path;
 		}
-		if (chown (dir, 0, st.st_gid) != 0) {
-			fprintf (shadow_logfd,
-			         _("%s: Cannot change owner of %s: %s\n"),
-			         shadow_progname, dir, strerror (errno));
-			goto out_free_dir;
+		if (fchownat (dirfd, path, 0, st.st_gid, AT_SYMLINK_NOFOLLOW) != 0) {
+			tcb_error (_("%s: Cannot change owner of %s: %s\n"),
+			           path, errno);
+			goto out_free_path;
 		}
-		if (chmod (dir, 0711) != 0) {
-			fprintf (shadow_logfd,
-			         _("%s: Cannot change mode of %s: %s\n"),
-			         shadow_progname, dir, strerror (errno));
-			goto out_free_dir;
+		if (fchmodat (dirfd, path, 0711, 0) != 0) {
+			tcb_error (_("%s: Cannot change mode of %s: %s\n"),
+			           path, errno);
+			goto out_free_path;
 		}
-		free (dir);
 		*ind = '/';
 		ptr = ind + 1;
 	}
+	*strrchr (path, '/') = '\0';
+	tcb_bucket_remember (dirfd, path);
 	free (path);
 	return SHADOWTCB_SUCCESS;
-out_free_dir:
-	free (dir);
 out_free_path:
 	free (path);
 	return SHADOWTCB_FAILURE;
@@ -263,109 +317,95 @@ static shadowtcb_status unlink_suffs (const char *user)
 /* path should be a relative existing tcb directory */
 static shadowtcb_status rmdir_leading (char *path)
 {
-	char *ind, *dir;
-	shadowtcb_status ret = SHADOWTCB_SUCCESS;
+	char *ind;
+	int dirfd = tcb_dir ();
+
+	if (dirfd < 0) {
+		return SHADOWTCB_FAILURE;
+	}
 	while ((ind = strrchr (path, '/'))) {
 		*ind = '\0';
-		if (asprintf (&dir, TCB_DIR "/%s", path) == -1) {
-			OUT_OF_MEMORY;
-			return SHADOWTCB_FAILURE;
-		}
-		if (rmdir (dir) != 0) {
+		if (unlinkat (dirfd, path, AT_REMOVEDIR) != 0) {
 			if (errno != ENOTEMPTY) {
-				fprintf (shadow_logfd,
-				         _("%s: Cannot remove directory %s: %s\n"),
-				         shadow_progname, dir, strerror (errno));
-				ret = SHADOWTCB_FAILURE;
+				tcb_error (_("%s: Cannot remove directory %s: %s\n"),
+				           path, errno);
+				return SHADOWTCB_FAILURE;
 			}
-			free (dir);
 			break;
 		}
-		free (dir);
+		if ((NULL != tcb_bucket) && (strcmp (tcb_bucket, path) == 0)) {
+			tcb_bucket_forget ();
+		}
 	}
-	return ret;
+	return SHADOWTCB_SUCCESS;
 }
 
 static shadowtcb_status move_dir (const char *user_newname, uid_t user_newid)
 {
-	char *olddir = NULL, *newdir = NULL;
-	char *real_old_dir = NULL, *real_new_dir = NULL;
 	char *real_old_dir_rel = NULL, *real_new_dir_rel = NULL;
 	uid_t old_uid, the_newid;
 	struct stat oldmode;
 	shadowtcb_status ret = SHADOWTCB_FAILURE;
+	int dirfd;
 
 	if (NULL == stored_tcb_user) {
 		return SHADOWTCB_FAILURE;
 	}
-	if (asprintf (&olddir, TCB_DIR "/%s", stored_tcb_user) == -1) {
-		goto out_free_nomem;
+	dirfd = tcb_dir ();
+	if (dirfd < 0) {
+		return SHADOWTCB_FAILURE;
 	}
-	if (stat (olddir, &oldmode) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot stat %s: %s\n"),
-		         shadow_progname, olddir, strerror (errno));
+	if (fstatat (dirfd, stored_tcb_user, &oldmode, 0) != 0) {
+		tcb_error (_("%s: Cannot stat %s: %s\n"),
+		           stored_tcb_user, errno);
 		goto out_free;
 	}
 	old_uid = oldmode.st_uid;
 	the_newid = (user_newid == -1) ? old_uid : user_newid;
-	real_old_dir = shadowtcb_path_existing (stored_tcb_user);
-	if (NULL == real_old_dir) {
+	real_old_dir_rel = shadowtcb_path_rel_existing (stored_tcb_user);
+	if (NULL == real_old_dir_rel) {
 		goto out_free;
 	}
-	real_new_dir = shadowtcb_path (user_newname, the_newid);
-	if (NULL == real_new_dir) {
+	real_new_dir_rel = shadowtcb_path_rel (user_newname, the_newid);
+	if (NULL == real_new_dir_rel) {
 		goto out_free;
 	}
-	if (strcmp (real_old_dir, real_new_dir) == 0) {
+	if (strcmp (real_old_dir_rel, real_new_dir_rel) == 0) {
 		ret = SHADOWTCB_SUCCESS;
 		goto out_free;
 	}
-	real_old_dir_rel = shadowtcb_path_rel_existing (stored_tcb_user);
-	if (NULL == real_old_dir_rel) {
-		goto out_free;
-	}
 	if (mkdir_leading (user_newname, the_newid) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if (rename (real_old_dir, real_new_dir) != 0) {
+	if (renameat (dirfd, real_old_dir_rel, dirfd, real_new_dir_rel) != 0) {
+		char oldpath[8192], newpath[8192];
+		int err = errno;
+
 		fprintf (shadow_logfd,
 		         _("%s: Cannot rename %s to %s: %s\n"),
-		         shadow_progname, real_old_dir, real_new_dir, strerror (errno));
+		         shadow_progname,
+		         tcb_path (oldpath, sizeof oldpath, real_old_dir_rel),
+		         tcb_path (newpath, sizeof newpath, real_new_dir_rel),
+		         strerror (err));
 		goto out_free;
 	}
 	if (rmdir_leading (real_old_dir_rel) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if ((unlink (olddir) != 0) && (errno != ENOENT)) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot remove %s: %s\n"),
-		         shadow_progname, olddir, strerror (errno));
+	if ((unlinkat (dirfd, stored_tcb_user, 0) != 0) && (errno != ENOENT)) {
+		tcb_error (_("%s: Cannot remove %s: %s\n"),
+		           stored_tcb_user, errno);
 		goto out_free;
 	}
-	if (asprintf (&newdir, TCB_DIR "/%s", user_newname) == -1) {
-		goto out_free_nomem;
-	}
-	real_new_dir_rel = shadowtcb_path_rel (user_newname, the_newid);
-	if (NULL == real_new_dir_rel) {
-		goto out_free;
-	}
-	if (   (strcmp (real_new_dir, newdir) != 0)
-	    && (symlink (real_new_dir_rel, newdir) != 0)) {
+	if (   (strcmp (real_new_dir_rel, user_newname) != 0)
+	    && (symlinkat (real_new_dir_rel, dirfd, user_newname) != 0)) {
 		fprintf (shadow_logfd,
 		         _("%s: Cannot create symbolic link %s: %s\n"),
 		         shadow_progname, real_new_dir_rel, strerror (errno));
 		goto out_free;
 	}
 	ret = SHADOWTCB_SUCCESS;
-	goto out_free;
-out_free_nomem:
-	OUT_OF_MEMORY;
 out_free:
-	free (olddir);
-	free (newdir);
-	free (real_old_dir);
-	free (real_new_dir);
 	free (real_old_dir_rel);
 	free (real_new_dir_rel);
 	return ret;
@@ -401,32 +441,34 @@ shadowtcb_status shadowtcb_set_user (const char* name)
 shadowtcb_status shadowtcb_remove (const char *name)
 {
 	shadowtcb_status ret = SHADOWTCB_SUCCESS;
-	char *path = shadowtcb_path_existing (name);
-	char *rel = shadowtcb_path_rel_existing (name);
-	if ((NULL == path) || (NULL == rel) || (rmdir (path) != 0)) {
+	int dirfd = tcb_dir ();
+	char *rel;
+
+	if (dirfd < 0) {
 		return SHADOWTCB_FAILURE;
 	}
-	if (rmdir_leading (rel) == SHADOWTCB_FAILURE) {
+	rel = shadowtcb_path_rel_existing (name);
+	if ((NULL == rel) || (unlinkat (dirfd, rel, AT_REMOVEDIR) != 0)) {
+		free (rel);
 		return SHADOWTCB_FAILURE;
 	}
-	free (path);
-	free (rel);
-	if (asprintf (&path, TCB_DIR "/%s", name) == -1) {
-		OUT_OF_MEMORY;
+	if (rmdir_leading (rel) == SHADOWTCB_FAILURE) {
+		free (rel);
 		return SHADOWTCB_FAILURE;
 	}
-	if ((unlink (path) != 0) && (errno != ENOENT)) {
+	free (rel);
+	if ((unlinkat (dirfd, name, 0) != 0) && (errno != ENOENT)) {
 		ret = SHADOWTCB_FAILURE;
 	}
-	free (path);
 	return ret;
 }
 
 shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_newid)
 {
 	struct stat dirmode, filemode;
-	char *tcbdir, *shadow;
+	char *shadow;
 	shadowtcb_status ret = SHADOWTCB_FAILURE;
+	int dirfd;
 
 	if (!getdef_bool ("USE_TCB")) {
 		return SHADOWTCB_SUCCESS;
@@ -443,27 +485,27 @@ shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_
 	if (-1 == user_newid) {
 		return SHADOWTCB_SUCCESS;
 	}
-	if (   (asprintf (&tcbdir, TCB_DIR "/%s", user_newname) == -1)
-	    || (asprintf (&shadow, TCB_FMT, user_newname) == -1)) {
+	dirfd = tcb_dir ();
+	if (dirfd < 0) {
+		return SHADOWTCB_FAILURE;
+	}
+	if (asprintf (&shadow, TCB_FMT, user_newname) == -1) {
 		OUT_OF_MEMORY;
 		return SHADOWTCB_FAILURE;
 	}
-	if (stat (tcbdir, &dirmode) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot stat %s: %s\n"),
-		         shadow_progname, tcbdir, strerror (errno));
+	if (fstatat (dirfd, user_newname, &dirmode, 0) != 0) {
+		tcb_error (_("%s: Cannot stat %s: %s\n"),
+		           user_newname, errno);
 		goto out_free;
 	}
-	if (chown (tcbdir, 0, 0) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change owners of %s: %s\n"),
-		         shadow_progname, tcbdir, strerror (errno));
+	if (fchownat (dirfd, user_newname, 0, 0, 0) != 0) {
+		tcb_error (_("%s: Cannot change owners of %s: %s\n"),
+		           user_newname, errno);
 		goto out_free;
 	}
-	if (chmod (tcbdir, 0700) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change mode of %s: %s\n"),
-		         shadow_progname, tcbdir, strerror (errno));
+	if (fchmodat (dirfd, user_newname, 0700, 0) != 0) {
+		tcb_error (_("%s: Cannot change mode of %s: %s\n"),
+		           user_newname, errno);
 		goto out_free;
 	}
 	if (lstat (shadow, &filemode) != 0) {
@@ -502,38 +544,39 @@ shadowtcb_status shadowtcb_move (/*@NULL@*/const char *user_newname, uid_t user_
 	if (unlink_suffs (user_newname) == SHADOWTCB_FAILURE) {
 		goto out_free;
 	}
-	if (chown (tcbdir, user_newid, dirmode.st_gid) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change owner of %s: %s\n"),
-		         shadow_progname, tcbdir, strerror (errno));
+	if (fchownat (dirfd, user_newname, user_newid, dirmode.st_gid, 0) != 0) {
+		tcb_error (_("%s: Cannot change owner of %s: %s\n"),
+		           user_newname, errno);
 		goto out_free;
 	}
-	if (chmod (tcbdir, dirmode.st_mode & 07777) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change mode of %s: %s\n"),
-		         shadow_progname, tcbdir, strerror (errno));
+	if (fchmodat (dirfd, user_newname, dirmode.st_mode & 07777, 0) != 0) {
+		tcb_error (_("%s: Cannot change mode of %s: %s\n"),
+		           user_newname, errno);
 		goto out_free;
 	}
 	ret = SHADOWTCB_SUCCESS;
 out_free:
-	free (tcbdir);
 	free (shadow);
 	return ret;
 }
 
 shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 {
-	char *dir, *shadow;
+	char *shadow;
 	struct stat tcbdir_stat;
 	gid_t shadowgid, authgid;
 	struct group *gr;
-	int fd;
+	int fd, dirfd;
 	shadowtcb_status ret = SHADOWTCB_FAILURE;
 
 	if (!getdef_bool ("USE_TCB")) {
 		return SHADOWTCB_SUCCESS;
 	}
-	if (stat (TCB_DIR, &tcbdir_stat) != 0) {
+	dirfd = tcb_dir ();
+	if (dirfd < 0) {
+		return SHADOWTCB_FAILURE;
+	}
+	if (fstat (dirfd, &tcbdir_stat) != 0) {
 		fprintf (shadow_logfd,
 		         _("%s: Cannot stat %s: %s\n"),
 		         shadow_progname, TCB_DIR, strerror (errno));
@@ -548,15 +591,12 @@ shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 		}
 	}
 
-	if (   (asprintf (&dir, TCB_DIR "/%s", name) == -1)
-	    || (asprintf (&shadow, TCB_FMT, name) == -1)) {
+	if (asprintf (&shadow, TCB_FMT, name) == -1) {
 		OUT_OF_MEMORY;
 		return SHADOWTCB_FAILURE;
 	}
-	if (mkdir (dir, 0700) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: mkdir: %s: %s\n"),
-		         shadow_progname, dir, strerror (errno));
+	if (mkdirat (dirfd, name, 0700) != 0) {
+		tcb_error (_("%s: mkdir: %s: %s\n"), name, errno);
 		goto out_free;
 	}
 	fd = open (shadow, O_RDWR | O_CREAT | O_TRUNC, 0600);
@@ -579,16 +619,15 @@ shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 		         shadow_progname, shadow, strerror (errno));
 		goto out_free;
 	}
-	if (chown (dir, 0, authgid) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change owner of %s: %s\n"),
-		         shadow_progname, dir, strerror (errno));
+	if (fchownat (dirfd, name, 0, authgid, AT_SYMLINK_NOFOLLOW) != 0) {
+		tcb_error (_("%s: Cannot change owner of %s: %s\n"),
+		           name, errno);
 		goto out_free;
 	}
-	if (chmod (dir, (mode_t) ((authgid == shadowgid) ? 02700 : 02710)) != 0) {
-		fprintf (shadow_logfd,
-		         _("%s: Cannot change mode of %s: %s\n"),
-		         shadow_progname, dir, strerror (errno));
+	if (fchmodat (dirfd, name,
+	              (mode_t) ((authgid == shadowgid) ? 02700 : 02710), 0) != 0) {
+		tcb_error (_("%s: Cannot change mode of %s: %s\n"),
+		           name, errno);
 		goto out_free;
 	}
 	if (   (shadowtcb_set_user (name) == SHADOWTCB_FAILURE)
@@ -597,7 +636,6 @@ shadowtcb_status shadowtcb_create (const char *name, uid_t uid)
 	}
 	ret = SHADOWTCB_SUCCESS;
 out_free:
-	free (dir);
 	free (shadow);
 	return ret;
 }
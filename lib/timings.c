@@ -0,0 +1,285 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "defines.h"
+#include "getdef.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * Durations of the phases of an authentication.
+ *
+ * With LOG_TIMINGS, login and su measure each phase (NSS lookups, crypt
+ * verification, faillog, limits, utmp, environment, ...) with the
+ * monotonic clock, and log the time spent in each phase as a single
+ * "phase=milliseconds" line once the user is logged in.
+ *
+ * If the SHADOW_STATS environment variable is set, any tool also reports
+ * these phases, and for each database the number of entries, the bytes
+ * read and written, the time spent in each commonio operation and how
+ * long its lock was held ("hold"), as a single line of "name=value"
+ * fields (durations in milliseconds) on stderr when it exits. SHADOW_STATS is ignored by the setuid tools.
+ *
+ * timing_start() also starts the clock for the metrics of metrics.c.
+ * Without them, timing_start() and timing_stop() do nothing, so that they
+ * can be used in the library functions shared with other tools.
+ */
+
+#define TIMING_PHASES	16
+
+struct timing_phase {
+	const char *name;
+	unsigned long count;
+	double ms;
+};
+
+static bool timings_enabled = false;
+static struct timing_phase phases[TIMING_PHASES];
+static size_t nphases = 0;
+
+#define TIMING_DBS	12
+
+static const char *const db_phase_names[TIMING_DB_PHASES] = {
+	"lock", "open", "lookup", "backup", "write", "sync", "rename", "hold"
+};
+
+struct timing_db {
+	/*@observer@*/const char *name;
+	unsigned long entries;
+	unsigned long long bytes_read;
+	unsigned long long bytes_written;
+	double ms[TIMING_DB_PHASES];
+};
+
+static int stats_enabled = -1;	/* not checked yet */
+static pid_t stats_pid;
+static struct timing_db dbs[TIMING_DBS];
+static size_t ndbs = 0;
+
+static void stats_report (void);
+
+/*
+ * stats_on - Check once if SHADOW_STATS is set.
+ */
+static bool stats_on (void)
+{
+	const char *value;
+
+	if (-1 == stats_enabled) {
+		value = shadow_getenv ("SHADOW_STATS");
+		stats_enabled = (NULL != value) && ('\0' != *value)
+		                && (strcmp (value, "0") != 0);
+		if (1 == stats_enabled) {
+			stats_pid = getpid ();
+			if (atexit (stats_report) != 0) {
+				stats_enabled = 0;
+			}
+		}
+	}
+	return 1 == stats_enabled;
+}
+
+static double elapsed (const struct timespec *start)
+{
+	struct timespec end;
+
+	(void) clock_gettime (CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) * 1e3
+	     + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * timing_init - Enable the timings if LOG_TIMINGS is set.
+ */
+void timing_init (void)
+{
+	timings_enabled = getdef_bool ("LOG_TIMINGS");
+}
+
+/*
+ * timing_start - Start measuring a phase.
+ */
+void timing_start (/*@out@*/struct timespec *start)
+{
+	if (timings_enabled || stats_on () || metrics_on ()) {
+		(void) clock_gettime (CLOCK_MONOTONIC, start);
+	}
+}
+
+/*
+ * timing_stop - Add the time since timing_start() to phase.
+ *
+ *	A phase can be measured several times, e.g. for each login
+ *	attempt; its durations are then summed.
+ */
+void timing_stop (const char *phase, const struct timespec *start)
+{
+	size_t i;
+
+	if (!timings_enabled && !stats_on ()) {
+		return;
+	}
+
+	for (i = 0; i < nphases; i++) {
+		if (strcmp (phases[i].name, phase) == 0) {
+			break;
+		}
+	}
+	if (i == nphases) {
+		if (TIMING_PHASES == nphases) {
+			return;
+		}
+		phases[i].name = phase;
+		nphases++;
+	}
+	phases[i].count++;
+	phases[i].ms += elapsed (start);
+}
+
+/*
+ * find_db - Return the statistics of a database, or NULL if there are
+ *           already too many databases.
+ */
+static /*@null@*/struct timing_db *find_db (const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < ndbs; i++) {
+		if (strcmp (dbs[i].name, name) == 0) {
+			return &dbs[i];
+		}
+	}
+	if (TIMING_DBS == ndbs) {
+		return NULL;
+	}
+	dbs[ndbs].name = name;
+	ndbs++;
+	return &dbs[ndbs - 1];
+}
+
+/*
+ * timing_db_stop - Add the time since timing_start() to a phase of the
+ *                  statistics of the database name.
+ *
+ *	name must stay valid until the program exits.
+ */
+void timing_db_stop (const char *name, enum timing_db_phase phase,
+                     const struct timespec *start)
+{
+	struct timing_db *db;
+
+	if (!stats_on ()) {
+		return;
+	}
+	db = find_db (name);
+	if (NULL != db) {
+		db->ms[phase] += elapsed (start);
+	}
+}
+
+/*
+ * timing_db_count - Add to the counters of the database name.
+ */
+void timing_db_count (const char *name, unsigned long entries,
+                      unsigned long long bytes_read,
+                      unsigned long long bytes_written)
+{
+	struct timing_db *db;
+
+	if (!stats_on ()) {
+		return;
+	}
+	db = find_db (name);
+	if (NULL != db) {
+		db->entries += entries;
+		db->bytes_read += bytes_read;
+		db->bytes_written += bytes_written;
+	}
+}
+
+/*
+ * stats_report - Print the statistics of the tool (atexit handler).
+ *
+ *	The children forked by the tool do not report.
+ */
+static void stats_report (void)
+{
+	FILE *fp = log_get_logfd ();
+	size_t i, j;
+
+	if (getpid () != stats_pid) {
+		return;
+	}
+	if (NULL == fp) {
+		fp = stderr;
+	}
+
+	(void) fprintf (fp, "%s: stats:", log_get_progname ());
+	for (i = 0; i < nphases; i++) {
+		(void) fprintf (fp, " %s=%.3f", phases[i].name, phases[i].ms);
+		if (phases[i].count > 1) {
+			(void) fprintf (fp, "/%lu", phases[i].count);
+		}
+	}
+	for (i = 0; i < ndbs; i++) {
+		(void) fprintf (fp, " db=%s entries=%lu read=%llu written=%llu",
+		                dbs[i].name, dbs[i].entries,
+		                dbs[i].bytes_read, dbs[i].bytes_written);
+		for (j = 0; j < TIMING_DB_PHASES; j++) {
+			(void) fprintf (fp, " %s=%.3f",
+			                db_phase_names[j], dbs[i].ms[j]);
+		}
+	}
+	(void) fputc ('\n', fp);
+	(void) fflush (fp);
+}
+
+/*
+ * timing_report - Log the durations of the phases of the authentication
+ *                 of user.
+ */
+void timing_report (const char *user)
+{
+	char buf[1024];
+	size_t len = 0;
+	size_t i;
+
+	if (!timings_enabled || (0 == nphases)) {
+		return;
+	}
+
+	for (i = 0; (i < nphases) && (len < sizeof buf); i++) {
+		int n;
+
+		n = snprintf (buf + len, sizeof buf - len, " %s=%.3f",
+		              phases[i].name, phases[i].ms);
+		if ((n > 0) && (phases[i].count > 1)) {
+			len += n;
+			if (len >= sizeof buf) {
+				break;
+			}
+			n = snprintf (buf + len, sizeof buf - len, "/%lu",
+			              phases[i].count);
+		}
+		if (n < 0) {
+			break;
+		}
+		len += n;
+	}
+	if (len >= sizeof buf) {
+		len = sizeof buf - 1;
+	}
+	buf[len] = '\0';
+
+	SYSLOG ((LOG_INFO, "timings for '%s' (ms):%s", user, buf));
+}
@@ -0,0 +1,151 @@
+#include <sys/types.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#ifndef ACCOUNT_H_DEFINED
+#define ACCOUNT_H_DEFINED 1
+
+enum account_status {
+	ACCOUNT_STATUS_SUCCESS = 0,
+	ACCOUNT_STATUS_ERROR = 1,	/* system error, errno is set */
+	ACCOUNT_STATUS_BUSY = 2,	/* a transaction is open, or a database is locked */
+	ACCOUNT_STATUS_INVALID = 3,	/* invalid name or field */
+	ACCOUNT_STATUS_EXISTS = 4,	/* the name or the ID is already used */
+	ACCOUNT_STATUS_NOT_FOUND = 5,	/* no such user or group */
+	ACCOUNT_STATUS_NO_ID = 6,	/* no free UID or GID */
+	ACCOUNT_STATUS_IN_USE = 7,	/* the group is the primary group of a user */
+};
+
+/* account_user is a new entry of /etc/passwd (and /etc/shadow) */
+struct account_user {
+	const char *name;
+	uid_t uid;		/* (uid_t)-1 to allocate one */
+	gid_t gid;		/* primary group, which must exist */
+	const char *password;	/* hashed password, or NULL for a locked one */
+	const char *gecos;	/* or NULL */
+	const char *home;	/* absolute path */
+	const char *shell;	/* absolute path, or NULL for none (/bin/sh) */
+	bool system;		/* allocate between SYS_UID_MIN and SYS_UID_MAX */
+};
+
+/* account_group is a new entry of /etc/group (and /etc/gshadow) */
+struct account_group {
+	const char *name;
+	gid_t gid;		/* (gid_t)-1 to allocate one */
+	const char *password;	/* hashed password, or NULL for a locked one */
+	bool system;		/* allocate between SYS_GID_MIN and SYS_GID_MAX */
+};
+
+/* account_txn groups changes of the account databases into one write */
+struct account_txn;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * account_init: initialize libaccount
+ *
+ * @progname: Name to display as program.  If NULL, then "(libaccount)"
+ *            will be shown in error messages.
+ * @logfd:    Open file pointer to pass error messages to.  If NULL, then
+ *            /dev/null will be opened and messages will be sent there.  The
+ *            default if account_init() is not called is stderr (2).
+ *
+ * This function does not need to be called.  If not called, then the
+ * defaults will be used.
+ *
+ * Returns false if an error occurred.
+ */
+bool account_init(const char *progname, FILE *logfd);
+
+/*
+ * account_txn_begin: start a set of changes of the account databases
+ *
+ * @status: set to the reason of the failure, if NULL is returned
+ *
+ * /etc/passwd and /etc/group, and /etc/shadow and /etc/gshadow if they
+ * exist, are locked, parsed and indexed once.  The changes of the
+ * functions below are kept in memory, and written at once by
+ * account_txn_commit().  The databases are those of the process: only one
+ * set of changes can be started at a time (it fails with
+ * ACCOUNT_STATUS_BUSY otherwise), and it must not be used by two threads
+ * at once.  This is not supported with the tcb shadow files (USE_TCB).
+ *
+ * Only the databases are changed: the home directories, the mail spools,
+ * the subordinate IDs (see subid_txn_begin()) and the hooks of useradd
+ * and userdel are left to the caller.
+ *
+ * Returns NULL if an error occurred.
+ */
+struct account_txn *account_txn_begin(enum account_status *status);
+
+/*
+ * account_user_add: add a user, like useradd without options
+ *
+ * @txn:  changes started with account_txn_begin()
+ * @user: the new user
+ * @uid:  set to the UID of the user, upon success, or NULL
+ *
+ * The password aging of /etc/shadow is set from login.defs.  On failure,
+ * @txn is left unchanged, and can still be used.
+ */
+enum account_status account_user_add(struct account_txn *txn, const struct account_user *user, uid_t *uid);
+
+/*
+ * account_user_del: delete a user, like userdel without options
+ *
+ * @txn:  changes started with account_txn_begin()
+ * @name: name of the user
+ *
+ * The user is also removed from the members and the administrators of
+ * its supplementary groups.  Its primary group is kept: it can be deleted
+ * with account_group_del().
+ */
+enum account_status account_user_del(struct account_txn *txn, const char *name);
+
+/*
+ * account_group_add: add a group, like groupadd without options
+ *
+ * @txn:   changes started with account_txn_begin()
+ * @group: the new group
+ * @gid:   set to the GID of the group, upon success, or NULL
+ */
+enum account_status account_group_add(struct account_txn *txn, const struct account_group *group, gid_t *gid);
+
+/*
+ * account_group_del: delete a group, like groupdel without options
+ *
+ * @txn:  changes started with account_txn_begin()
+ * @name: name of the group
+ *
+ * It fails with ACCOUNT_STATUS_IN_USE if the group is the primary group
+ * of a user.
+ */
+enum account_status account_group_del(struct account_txn *txn, const char *name);
+
+/*
+ * account_txn_commit: write the changes of @txn and unlock the databases
+ *
+ * The databases are all written, or none of them is.  @txn is freed, even
+ * if the changes could not be written.
+ */
+enum account_status account_txn_commit(struct account_txn *txn);
+
+/*
+ * account_txn_abort: discard the changes of @txn and unlock the databases
+ *
+ * @txn: changes started with account_txn_begin(), or NULL
+ */
+void account_txn_abort(struct account_txn *txn);
+
+/*
+ * account_strerror: get a description of @status
+ */
+const char *account_strerror(enum account_status status);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,474 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "chkname.h"
+#include "commonio.h"
+#include "defines.h"
+#include "getdef.h"
+#include "groupio.h"
+#include "prototypes.h"
+#include "pwio.h"
+#include "sgroupio.h"
+#include "shadowio.h"
+#include "shadowlog.h"
+#include "account.h"
+
+/*
+ * The account databases are those of the process (see pwio.c, shadowio.c,
+ * groupio.c and sgroupio.c), so only one transaction can be open at a
+ * time. It locks and opens all of them in the order of commonio_txn_lock(),
+ * the operations change the opened databases in memory, and
+ * commonio_txn_commit() writes them together.
+ */
+struct account_txn {
+	struct commonio_txn txn;
+	bool shadow_pwd;	/* /etc/shadow is part of the transaction */
+	bool shadow_grp;	/* /etc/gshadow is part of the transaction */
+};
+
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool txn_open;
+
+/* A field of an entry cannot separate the fields or the entries */
+#define VALID(s)	(strcspn (s, ":\n") == strlen (s))
+
+bool account_init(const char *progname, FILE *logfd)
+{
+	FILE *shadow_logfd;
+	if (progname) {
+		progname = strdup(progname);
+		if (!progname)
+			return false;
+		log_set_progname(progname);
+	} else {
+		log_set_progname("(libaccount)");
+	}
+
+	if (logfd) {
+		log_set_logfd(logfd);
+		return true;
+	}
+	shadow_logfd = fopen("/dev/null", "w");
+	if (!shadow_logfd) {
+		log_set_logfd(stderr);
+		return false;
+	}
+	log_set_logfd(shadow_logfd);
+	return true;
+}
+
+static void txn_release(void)
+{
+	(void) pthread_mutex_lock(&txn_lock);
+	txn_open = false;
+	(void) pthread_mutex_unlock(&txn_lock);
+}
+
+struct account_txn *account_txn_begin(enum account_status *status)
+{
+	struct account_txn *txn;
+
+#ifdef WITH_TCB
+	if (getdef_bool("USE_TCB")) {
+		*status = ACCOUNT_STATUS_ERROR;
+		errno = ENOTSUP;
+		return NULL;
+	}
+#endif				/* WITH_TCB */
+
+	txn = calloc(1, sizeof *txn);
+	if (NULL == txn) {
+		*status = ACCOUNT_STATUS_ERROR;
+		return NULL;
+	}
+
+	(void) pthread_mutex_lock(&txn_lock);
+	if (txn_open) {
+		(void) pthread_mutex_unlock(&txn_lock);
+		free(txn);
+		*status = ACCOUNT_STATUS_BUSY;
+		return NULL;
+	}
+	txn_open = true;
+	(void) pthread_mutex_unlock(&txn_lock);
+
+	txn->shadow_pwd = spw_file_present();
+#ifdef SHADOWGRP
+	txn->shadow_grp = sgr_file_present();
+#endif				/* SHADOWGRP */
+
+	commonio_txn_init(&txn->txn);
+	(void) commonio_txn_add(&txn->txn, __pw_get_db());
+	(void) commonio_txn_add(&txn->txn, __gr_get_db());
+	if (txn->shadow_pwd)
+		(void) commonio_txn_add(&txn->txn, __spw_get_db());
+#ifdef SHADOWGRP
+	if (txn->shadow_grp)
+		(void) commonio_txn_add(&txn->txn, __sgr_get_db());
+#endif				/* SHADOWGRP */
+
+	if (commonio_txn_lock(&txn->txn) == 0) {
+		txn_release();
+		free(txn);
+		*status = ACCOUNT_STATUS_BUSY;
+		return NULL;
+	}
+	gr_index_members();
+#ifdef SHADOWGRP
+	if (txn->shadow_grp)
+		sgr_index_members();
+#endif				/* SHADOWGRP */
+	if (commonio_txn_open(&txn->txn, O_CREAT | O_RDWR) == 0) {
+		int err = errno;
+
+		(void) commonio_txn_unlock(&txn->txn);
+		txn_release();
+		free(txn);
+		errno = err;
+		*status = ACCOUNT_STATUS_ERROR;
+		return NULL;
+	}
+
+	*status = ACCOUNT_STATUS_SUCCESS;
+	return txn;
+}
+
+static long scale_age(long x)
+{
+	if (x <= 0)
+		return x;
+
+	return x * (DAY / SCALE);
+}
+
+/*
+ * check_user - check the fields of a new user
+ */
+static enum account_status check_user(const struct account_user *user)
+{
+	if (!is_valid_user_name(user->name))
+		return ACCOUNT_STATUS_INVALID;
+	if ((NULL != user->password) && !VALID(user->password))
+		return ACCOUNT_STATUS_INVALID;
+	if ((NULL != user->gecos) && !VALID(user->gecos))
+		return ACCOUNT_STATUS_INVALID;
+	if ((NULL == user->home) || ('/' != user->home[0]) || !VALID(user->home))
+		return ACCOUNT_STATUS_INVALID;
+	if (   (NULL != user->shell)
+	    && (('/' != user->shell[0]) || !VALID(user->shell)))
+		return ACCOUNT_STATUS_INVALID;
+	return ACCOUNT_STATUS_SUCCESS;
+}
+
+enum account_status account_user_add(struct account_txn *txn, const struct account_user *user, uid_t *uid)
+{
+	struct passwd pwent;
+	struct spwd spent;
+	enum account_status status;
+	const char *password;
+	uid_t new_uid;
+
+	status = check_user(user);
+	if (ACCOUNT_STATUS_SUCCESS != status)
+		return status;
+	if (NULL != pw_locate(user->name))
+		return ACCOUNT_STATUS_EXISTS;
+	if (txn->shadow_pwd && (NULL != spw_locate(user->name)))
+		return ACCOUNT_STATUS_EXISTS;
+	if (NULL == gr_locate_gid(user->gid))
+		return ACCOUNT_STATUS_NOT_FOUND;
+
+	if ((uid_t) -1 != user->uid) {
+		if (NULL != pw_locate_uid(user->uid))
+			return ACCOUNT_STATUS_EXISTS;
+		new_uid = user->uid;
+	} else if (find_new_uid(user->system, &new_uid, NULL) != 0) {
+		return ACCOUNT_STATUS_NO_ID;
+	}
+
+	password = (NULL != user->password) ? user->password : "!";
+	memzero(&pwent, sizeof pwent);
+	pwent.pw_name = (char *) user->name;
+	pwent.pw_passwd = (char *) (txn->shadow_pwd ? SHADOW_PASSWD_STRING : password);
+	pwent.pw_uid = new_uid;
+	pwent.pw_gid = user->gid;
+	pwent.pw_gecos = (char *) ((NULL != user->gecos) ? user->gecos : "");
+	pwent.pw_dir = (char *) user->home;
+	pwent.pw_shell = (char *) ((NULL != user->shell) ? user->shell : "");
+	if (pw_update(&pwent) == 0)
+		return ACCOUNT_STATUS_ERROR;
+
+	if (txn->shadow_pwd) {
+		memzero(&spent, sizeof spent);
+		spent.sp_namp = (char *) user->name;
+		spent.sp_pwdp = (char *) password;
+		spent.sp_lstchg = gettime() / SCALE;
+		if (0 == spent.sp_lstchg) {
+			/* Better disable aging than requiring a password change */
+			spent.sp_lstchg = -1;
+		}
+		spent.sp_min = scale_age(getdef_num("PASS_MIN_DAYS", -1));
+		spent.sp_max = scale_age(getdef_num("PASS_MAX_DAYS", -1));
+		spent.sp_warn = scale_age(getdef_num("PASS_WARN_AGE", -1));
+		spent.sp_inact = -1;
+		spent.sp_expire = -1;
+		spent.sp_flag = SHADOW_SP_FLAG_UNSET;
+		if (spw_update(&spent) == 0) {
+			int err = errno;
+
+			(void) pw_remove(user->name);
+			errno = err;
+			return ACCOUNT_STATUS_ERROR;
+		}
+	}
+
+	if (NULL != uid)
+		*uid = new_uid;
+	return ACCOUNT_STATUS_SUCCESS;
+}
+
+/*
+ * del_member - remove name from the members of the group grp
+ */
+static bool del_member(const struct group *grp, const char *name)
+{
+	struct group *ngrp;
+	int ret;
+
+	ngrp = __gr_dup(grp);
+	if (NULL == ngrp)
+		return false;
+	ngrp->gr_mem = del_list(ngrp->gr_mem, name);
+	ret = gr_update(ngrp);
+	gr_free(ngrp);
+	return ret != 0;
+}
+
+#ifdef SHADOWGRP
+/*
+ * del_sgr_member - remove name from the members and the administrators of
+ *                  the shadow group sgrp
+ */
+static bool del_sgr_member(const struct sgrp *sgrp, const char *name)
+{
+	struct sgrp *nsgrp;
+	int ret;
+
+	nsgrp = __sgr_dup(sgrp);
+	if (NULL == nsgrp)
+		return false;
+	nsgrp->sg_mem = del_list(nsgrp->sg_mem, name);
+	nsgrp->sg_adm = del_list(nsgrp->sg_adm, name);
+	ret = sgr_update(nsgrp);
+	sgr_free(nsgrp);
+	return ret != 0;
+}
+#endif				/* SHADOWGRP */
+
+/*
+ * del_memberships - remove name from the members of all the groups
+ *
+ *	The groups are found with the member indexes, or by scanning the
+ *	databases if they are not available.
+ */
+static bool del_memberships(const struct account_txn *txn, const char *name)
+{
+	const struct group **groups;
+	const struct group *grp;
+	bool ok = true;
+	size_t i;
+
+	groups = gr_member_of(name);
+	if (NULL != groups) {
+		for (i = 0; ok && (NULL != groups[i]); i++)
+			ok = del_member(groups[i], name);
+		free(groups);
+	} else {
+		for (gr_rewind(), grp = gr_next(); ok && (NULL != grp); grp = gr_next()) {
+			if (is_on_list(grp->gr_mem, name))
+				ok = del_member(grp, name);
+		}
+	}
+
+#ifdef SHADOWGRP
+	if (ok && txn->shadow_grp) {
+		const struct sgrp **sgroups;
+		const struct sgrp *sgrp;
+
+		sgroups = sgr_member_of(name);
+		if (NULL != sgroups) {
+			for (i = 0; ok && (NULL != sgroups[i]); i++)
+				ok = del_sgr_member(sgroups[i], name);
+			free(sgroups);
+		} else {
+			for (sgr_rewind(), sgrp = sgr_next(); ok && (NULL != sgrp); sgrp = sgr_next()) {
+				if (   is_on_list(sgrp->sg_mem, name)
+				    || is_on_list(sgrp->sg_adm, name))
+					ok = del_sgr_member(sgrp, name);
+			}
+		}
+	}
+#else
+	(void) txn;
+#endif				/* SHADOWGRP */
+
+	return ok;
+}
+
+enum account_status account_user_del(struct account_txn *txn, const char *name)
+{
+	if (NULL == pw_locate(name))
+		return ACCOUNT_STATUS_NOT_FOUND;
+
+	if (!del_memberships(txn, name))
+		return ACCOUNT_STATUS_ERROR;
+	if (pw_remove(name) == 0)
+		return ACCOUNT_STATUS_ERROR;
+	if (txn->shadow_pwd && (NULL != spw_locate(name)) && (spw_remove(name) == 0))
+		return ACCOUNT_STATUS_ERROR;
+	return ACCOUNT_STATUS_SUCCESS;
+}
+
+enum account_status account_group_add(struct account_txn *txn, const struct account_group *group, gid_t *gid)
+{
+	char *empty[] = { NULL };
+	struct group grent;
+	const char *password;
+	gid_t new_gid;
+
+	if (!is_valid_group_name(group->name))
+		return ACCOUNT_STATUS_INVALID;
+	if ((NULL != group->password) && !VALID(group->password))
+		return ACCOUNT_STATUS_INVALID;
+	if (NULL != gr_locate(group->name))
+		return ACCOUNT_STATUS_EXISTS;
+#ifdef SHADOWGRP
+	if (txn->shadow_grp && (NULL != sgr_locate(group->name)))
+		return ACCOUNT_STATUS_EXISTS;
+#endif				/* SHADOWGRP */
+
+	if ((gid_t) -1 != group->gid) {
+		if (NULL != gr_locate_gid(group->gid))
+			return ACCOUNT_STATUS_EXISTS;
+		new_gid = group->gid;
+	} else if (find_new_gid(group->system, &new_gid, NULL) != 0) {
+		return ACCOUNT_STATUS_NO_ID;
+	}
+
+	password = (NULL != group->password) ? group->password : "!";
+	memzero(&grent, sizeof grent);
+	grent.gr_name = (char *) group->name;
+	grent.gr_passwd = (char *) (txn->shadow_grp ? SHADOW_PASSWD_STRING : password);
+	grent.gr_gid = new_gid;
+	grent.gr_mem = empty;
+	if (gr_update(&grent) == 0)
+		return ACCOUNT_STATUS_ERROR;
+
+#ifdef SHADOWGRP
+	if (txn->shadow_grp) {
+		struct sgrp sgent;
+
+		memzero(&sgent, sizeof sgent);
+		sgent.sg_name = (char *) group->name;
+		sgent.sg_passwd = (char *) password;
+		sgent.sg_adm = empty;
+		sgent.sg_mem = empty;
+		if (sgr_update(&sgent) == 0) {
+			int err = errno;
+
+			(void) gr_remove(group->name);
+			errno = err;
+			return ACCOUNT_STATUS_ERROR;
+		}
+	}
+#endif				/* SHADOWGRP */
+
+	if (NULL != gid)
+		*gid = new_gid;
+	return ACCOUNT_STATUS_SUCCESS;
+}
+
+enum account_status account_group_del(struct account_txn *txn, const char *name)
+{
+	const struct group *grp;
+	const struct passwd *pwd;
+
+	grp = gr_locate(name);
+	if (NULL == grp)
+		return ACCOUNT_STATUS_NOT_FOUND;
+
+	for (pw_rewind(), pwd = pw_next(); NULL != pwd; pwd = pw_next()) {
+		if (pwd->pw_gid == grp->gr_gid)
+			return ACCOUNT_STATUS_IN_USE;
+	}
+
+	if (gr_remove(name) == 0)
+		return ACCOUNT_STATUS_ERROR;
+#ifdef SHADOWGRP
+	if (txn->shadow_grp && (NULL != sgr_locate(name)) && (sgr_remove(name) == 0))
+		return ACCOUNT_STATUS_ERROR;
+#else
+	(void) txn;
+#endif				/* SHADOWGRP */
+	return ACCOUNT_STATUS_SUCCESS;
+}
+
+enum account_status account_txn_commit(struct account_txn *txn)
+{
+	enum account_status status = ACCOUNT_STATUS_SUCCESS;
+
+	if (commonio_txn_commit(&txn->txn) == 0) {
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s",
+		         txn->txn.failed->filename));
+		status = ACCOUNT_STATUS_ERROR;
+	}
+	(void) commonio_txn_unlock(&txn->txn);
+	txn_release();
+	free(txn);
+	return status;
+}
+
+void account_txn_abort(struct account_txn *txn)
+{
+	if (NULL == txn)
+		return;
+
+	/* The changes which were not committed are discarded */
+	(void) commonio_txn_unlock(&txn->txn);
+	txn_release();
+	free(txn);
+}
+
+const char *account_strerror(enum account_status status)
+{
+	switch (status) {
+	case ACCOUNT_STATUS_SUCCESS:
+		return "success";
+	case ACCOUNT_STATUS_ERROR:
+		return strerror(errno);
+	case ACCOUNT_STATUS_BUSY:
+		return "the account databases are in use";
+	case ACCOUNT_STATUS_INVALID:
+		return "invalid name or field";
+	case ACCOUNT_STATUS_EXISTS:
+		return "the name or the ID is already used";
+	case ACCOUNT_STATUS_NOT_FOUND:
+		return "no such user or group";
+	case ACCOUNT_STATUS_NO_ID:
+		return "no free ID";
+	case ACCOUNT_STATUS_IN_USE:
+		return "the group is the primary group of a user";
+	}
+	return "unknown error";
+}
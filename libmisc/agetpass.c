@@ -22,6 +22,11 @@
 #define PASS_MAX  BUFSIZ - 1
 #endif
 
+/* The passwords are read in a slot of secret.c */
+#if PASS_MAX + 2 > SECRET_SIZE
+#error "PASS_MAX does not fit in SECRET_SIZE"
+#endif
+
 
 /*
  * SYNOPSIS
@@ -42,9 +47,10 @@
  *	This function is very similar to getpass(3).  It has several
  *	advantages compared to getpass(3):
  *
- *	- Instead of using a static buffer, agetpass() allocates memory
- *	  through malloc(3).  This makes the function thread-safe, and
- *	  also reduces the visibility of the buffer.
+ *	- Instead of using a static buffer, agetpass() takes a slot of
+ *	  the pool of secret_alloc(), which is locked in memory and
+ *	  surrounded by guard pages.  This makes the function
+ *	  thread-safe, and also reduces the visibility of the buffer.
  *
  *	- agetpass() doesn't call realloc(3) internally.  Some
  *	  implementations of getpass(3), such as glibc, do that, as a
@@ -61,8 +67,8 @@
  *
  *   erase_pass()
  *	This function first clears the password, by calling
- *	explicit_bzero(3) (or an equivalent call), and then frees the
- *	allocated memory by calling free(3).
+ *	explicit_bzero(3) (or an equivalent call), and then releases
+ *	its slot by calling secret_free().
  *
  *	NULL is a valid input pointer, and in such a case, this call is
  *	a no-op.
@@ -74,7 +80,7 @@
  *
  * ERRORS
  *   agetpass()
- *	This function may fail for any errors that malloc(3) or
+ *	This function may fail for any errors that mmap(2) or
  *	readpassphrase(3) may fail, and in addition it may fail for the
  *	following errors:
  *
@@ -101,7 +107,7 @@ agetpass(const char *prompt)
 	 * Let's add one more byte, and if the password uses it, it
 	 * means the introduced password was longer than PASS_MAX.
 	 */
-	pass = malloc(PASS_MAX + 2);
+	pass = secret_alloc();
 	if (pass == NULL)
 		return NULL;
 
@@ -117,7 +123,7 @@ agetpass(const char *prompt)
 	return pass;
 
 fail:
-	freezero(pass, PASS_MAX + 2);
+	secret_free(pass);
 	return NULL;
 }
 
@@ -125,5 +131,5 @@ fail:
 void
 erase_pass(char *pass)
 {
-	freezero(pass, PASS_MAX + 2);
+	secret_free(pass);
 }
@@ -21,10 +21,148 @@
 #include <libaudit.h>
 #include <errno.h>
 #include <stdio.h>
+#include <string.h>
 #include "prototypes.h"
 #include "shadowlog.h"
 int audit_fd;
 
+/*
+ * Events queued between audit_batch_begin() and audit_batch_end().
+ *
+ * The bulk tools log an event per updated record. With a batch, the
+ * events are kept in memory and sent in order when the changes are
+ * committed (or every batch_max events), instead of waiting for the
+ * audit socket while the databases are locked. The content of each
+ * event is unchanged.
+ */
+#define AUDIT_BATCH_MAX	256
+
+struct audit_event {
+	bool acct;		/* audit_logger(), or audit_logger_message() */
+	int type;
+	/*@only@*/char *op;	/* op, or message */
+	/*@null@*//*@only@*/char *name;
+	unsigned int id;
+	shadow_audit_result result;
+};
+
+static bool batching = false;
+static size_t batch_max = AUDIT_BATCH_MAX;
+static /*@null@*//*@only@*/struct audit_event *events = NULL;
+static size_t nevents = 0;
+
+static void send_event (const struct audit_event *ev)
+{
+	if (ev->acct) {
+		audit_log_acct_message (audit_fd, ev->type, NULL, ev->op,
+		                        ev->name, ev->id,
+		                        NULL, NULL, NULL, ev->result);
+	} else {
+		audit_log_user_message (audit_fd,
+		                        AUDIT_USYS_CONFIG,
+		                        ev->op,
+		                        NULL, /* hostname */
+		                        NULL, /* addr */
+		                        NULL, /* tty */
+		                        ev->result);
+	}
+}
+
+/*
+ * queue_event - Keep the event for the next audit_batch_flush()
+ *
+ *	If the event cannot be queued, it is sent at once, after the
+ *	previous ones.
+ */
+static void queue_event (const struct audit_event *ev)
+{
+	struct audit_event *qev;
+
+	if (NULL == events) {
+		events = malloc (batch_max * sizeof (events[0]));
+	}
+	if (NULL == events) {
+		send_event (ev);
+		return;
+	}
+
+	qev = &events[nevents];
+	*qev = *ev;
+	qev->op = strdup (ev->op);
+	qev->name = (NULL != ev->name) ? strdup (ev->name) : NULL;
+	if ((NULL == qev->op) || ((NULL != ev->name) && (NULL == qev->name))) {
+		free (qev->op);
+		free (qev->name);
+		audit_batch_flush ();
+		send_event (ev);
+		return;
+	}
+
+	nevents++;
+	if (nevents == batch_max) {
+		audit_batch_flush ();
+	}
+}
+
+static void record_event (const struct audit_event *ev)
+{
+	if (batching) {
+		queue_event (ev);
+	} else {
+		send_event (ev);
+	}
+}
+
+/*
+ * audit_batch_begin - Queue the next events
+ *
+ *	The events are sent by audit_batch_flush(), audit_batch_end(), when
+ *	max (or a default if 0) events are queued, or when the program
+ *	exits.
+ */
+void audit_batch_begin (size_t max)
+{
+	static bool registered = false;
+
+	if ((audit_fd < 0) || batching) {
+		return;
+	}
+	if (!registered) {
+		if (atexit (audit_batch_end) != 0) {
+			return;
+		}
+		registered = true;
+	}
+	if ((0 != max) && (NULL == events)) {
+		batch_max = max;
+	}
+	batching = true;
+}
+
+/*
+ * audit_batch_flush - Send the queued events
+ */
+void audit_batch_flush (void)
+{
+	size_t i;
+
+	for (i = 0; i < nevents; i++) {
+		send_event (&events[i]);
+		free (events[i].op);
+		free (events[i].name);
+	}
+	nevents = 0;
+}
+
+/*
+ * audit_batch_end - Send the queued events and stop queueing
+ */
+void audit_batch_end (void)
+{
+	audit_batch_flush ();
+	batching = false;
+}
+
 void audit_help_open (void)
 {
 	audit_fd = audit_open ();
@@ -58,27 +196,36 @@ void audit_logger (int type, unused const char *pgname, const char *op,
                    const char *name, unsigned int id,
                    shadow_audit_result result)
 {
+	struct audit_event ev;
+
 	if (audit_fd < 0) {
 		return;
-	} else {
-		audit_log_acct_message (audit_fd, type, NULL, op, name, id,
-		                        NULL, NULL, NULL, result);
 	}
+
+	ev.acct = true;
+	ev.type = type;
+	ev.op = (char *) op;
+	ev.name = (char *) name;
+	ev.id = id;
+	ev.result = result;
+	record_event (&ev);
 }
 
 void audit_logger_message (const char *message, shadow_audit_result result)
 {
+	struct audit_event ev;
+
 	if (audit_fd < 0) {
 		return;
-	} else {
-		audit_log_user_message (audit_fd,
-		                        AUDIT_USYS_CONFIG,
-		                        message,
-		                        NULL, /* hostname */
-		                        NULL, /* addr */
-		                        NULL, /* tty */
-		                        result);
 	}
+
+	ev.acct = false;
+	ev.type = AUDIT_USYS_CONFIG;
+	ev.op = (char *) message;
+	ev.name = NULL;
+	ev.id = 0;
+	ev.result = result;
+	record_event (&ev);
 }
 
 #else				/* WITH_AUDIT */
@@ -0,0 +1,169 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * The --batch files of useradd, usermod and userdel have one set of
+ * arguments of the tool per line.
+ */
+
+/*
+ * split_line - split a line of a batch file into arguments
+ *
+ *	The arguments are separated by blanks. Single or double quotes
+ *	can be used for arguments with blanks, and a backslash quotes the
+ *	next character. argv[0] is the name of the program.
+ *
+ *	Return -1 if a quote is not closed.
+ */
+static int split_line (char *line, int *argc, char ***argv)
+{
+	char **list;
+	char *p = line;
+	char *out;
+	int n = 1;
+
+	list = xmalloc ((strlen (line) / 2 + 3) * sizeof (char *));
+	list[0] = (char *) log_get_progname ();
+
+	for (;;) {
+		while ((' ' == *p) || ('\t' == *p)) {
+			p++;
+		}
+		if ('\0' == *p) {
+			break;
+		}
+
+		out = p;
+		list[n] = out;
+		n++;
+		while (('\0' != *p) && (' ' != *p) && ('\t' != *p)) {
+			if (('\'' == *p) || ('"' == *p)) {
+				char quote = *p;
+
+				for (p++; ('\0' != *p) && (quote != *p); p++) {
+					*out++ = *p;
+				}
+				if ('\0' == *p) {
+					free (list);
+					return -1;
+				}
+				p++;
+			} else if (('\\' == *p) && ('\0' != p[1])) {
+				*out++ = p[1];
+				p += 2;
+			} else {
+				*out++ = *p++;
+			}
+		}
+		if ('\0' != *p) {
+			p++;
+		}
+		*out = '\0';
+	}
+	list[n] = NULL;
+
+	*argc = n;
+	*argv = list;
+	return 0;
+}
+
+/*
+ * batch_read - read the lines of a batch file
+ *
+ *	Empty lines and lines starting with '#' are ignored. "-" is the
+ *	standard input. The other lines are split into arguments, which
+ *	stay allocated until the program exits.
+ *
+ *	Return -1 if the file cannot be read or a line is invalid.
+ */
+int batch_read (const char *file,
+                /*@out@*/struct batch_line **lines, /*@out@*/size_t *count)
+{
+	FILE *shadow_logfd = log_get_logfd ();
+	struct batch_line *list = NULL;
+	size_t n = 0;
+	char *line = NULL;
+	size_t size = 0;
+	unsigned int lineno = 0;
+	bool errors = false;
+	FILE *fp;
+
+	if (strcmp (file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (file, "r");
+		if (NULL == fp) {
+			fprintf (shadow_logfd, _("%s: cannot open %s: %s\n"),
+			         log_get_progname (), file, strerror (errno));
+			return -1;
+		}
+	}
+
+	while (getline (&line, &size, fp) != -1) {
+		struct batch_line *bl;
+		char *cp;
+
+		lineno++;
+		cp = strchr (line, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		}
+		cp = line + strspn (line, " \t");
+		if (('\0' == *cp) || ('#' == *cp)) {
+			continue;
+		}
+
+		if (0 == (n % 64)) {
+			bl = realloc (list, (n + 64) * sizeof *list);
+			if (NULL == bl) {
+				fprintf (shadow_logfd, _("%s: out of memory\n"),
+				         log_get_progname ());
+				exit (EXIT_FAILURE);
+			}
+			list = bl;
+		}
+		bl = &list[n];
+		bl->line = lineno;
+		if (split_line (line, &bl->argc, &bl->argv) != 0) {
+			fprintf (shadow_logfd,
+			         _("%s: line %u: unterminated quote\n"),
+			         log_get_progname (), lineno);
+			errors = true;
+			continue;
+		}
+		n++;
+		line = NULL;
+		size = 0;
+	}
+	free (line);
+
+	if (ferror (fp)) {
+		fprintf (shadow_logfd, _("%s: cannot read %s: %s\n"),
+		         log_get_progname (), file, strerror (errno));
+		errors = true;
+	}
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+	if (errors) {
+		free (list);
+		return -1;
+	}
+
+	*lines = list;
+	*count = n;
+	return 0;
+}
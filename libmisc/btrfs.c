@@ -1,6 +1,9 @@
+#include <linux/btrfs.h>
 #include <linux/btrfs_tree.h>
 #include <linux/magic.h>
+#include <sys/ioctl.h>
 #include <sys/statfs.h>
+#include <fcntl.h>
 #include <stdbool.h>
 
 #include "prototypes.h"
@@ -49,18 +52,130 @@ static int run_btrfs_subvolume_cmd(const char *subcmd, const char *arg1, const c
 }
 
 
+/*
+ * Open the parent directory of path, and point *name to the last component
+ * of path.
+ *
+ * returns the file descriptor of the parent directory, or -1 on error
+ * (errno is set).
+ */
+static int open_parent(const char *path, const char **name)
+{
+	const char *slash;
+	char *parent;
+	int fd;
+
+	slash = strrchr(path, '/');
+	if (slash == path)
+		parent = strdup("/");
+	else if (slash)
+		parent = strndup(path, slash - path);
+	else
+		parent = strdup(".");
+	if (!parent)
+		return -1;
+
+	*name = slash ? slash + 1 : path;
+	if ((*name)[0] == '\0' || strlen(*name) > BTRFS_SUBVOL_NAME_MAX) {
+		free(parent);
+		errno = EINVAL;
+		return -1;
+	}
+
+	fd = open(parent, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(parent);
+	return fd;
+}
+
+
+/*
+ * Run the subvolume ioctl request on the parent directory of path, with the
+ * name of path.
+ *
+ * returns:
+ *   0 - success
+ *  -1 - error (errno is set)
+ */
+static int subvolume_ioctl(unsigned long request, const char *path, bool sync)
+{
+	struct btrfs_ioctl_vol_args args;
+	const char *name;
+	int fd, ret;
+
+	fd = open_parent(path, &name);
+	if (fd < 0)
+		return -1;
+
+	memset(&args, 0, sizeof(args));
+	strcpy(args.name, name);
+	ret = ioctl(fd, request, &args);
+	/* Commit the transaction, like "btrfs subvolume delete -C" */
+	if (ret == 0 && sync)
+		ret = ioctl(fd, BTRFS_IOC_SYNC, NULL);
+
+	(void) close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+
+/*
+ * The subvolumes are created and removed with the btrfs ioctls. The btrfs
+ * command is only run if they fail, e.g. on kernels which do not allow
+ * them in this context.
+ */
 int btrfs_create_subvolume(const char *path)
 {
+	if (subvolume_ioctl(BTRFS_IOC_SUBVOL_CREATE, path, false) == 0)
+		return 0;
 	return run_btrfs_subvolume_cmd("create", path, NULL);
 }
 
 
 int btrfs_remove_subvolume(const char *path)
 {
+	if (subvolume_ioctl(BTRFS_IOC_SNAP_DESTROY, path, true) == 0)
+		return 0;
 	return run_btrfs_subvolume_cmd("delete", "-C", path);
 }
 
 
+/*
+ * Create path as a snapshot of the subvolume src, on the same filesystem.
+ *
+ * The snapshot is created with the BTRFS_IOC_SNAP_CREATE_V2 ioctl on the
+ * parent directory of path.
+ *
+ * returns:
+ *   0 - success
+ *  -1 - error (errno is set)
+ */
+int btrfs_snapshot_subvolume(const char *src, const char *path)
+{
+	struct btrfs_ioctl_vol_args_v2 args;
+	const char *name;
+	int src_fd, parent_fd;
+	int ret;
+
+	src_fd = open(src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (src_fd < 0)
+		return -1;
+	parent_fd = open_parent(path, &name);
+	if (parent_fd < 0) {
+		(void) close(src_fd);
+		return -1;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.fd = src_fd;
+	strcpy(args.name, name);
+	ret = ioctl(parent_fd, BTRFS_IOC_SNAP_CREATE_V2, &args);
+
+	(void) close(parent_fd);
+	(void) close(src_fd);
+	return ret < 0 ? -1 : 0;
+}
+
+
 /* Adapted from btrfsprogs */
 /*
  * This intentionally duplicates btrfs_util_is_subvolume_fd() instead of opening
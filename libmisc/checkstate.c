@@ -0,0 +1,264 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "commonio.h"
+#include "shadowlog.h"
+
+/*
+ * State of the incremental checks of pwck and grpck (--state).
+ *
+ * The state file has a header line with the name of the checker, its
+ * options, whether the last run found no error, and a stamp of each file
+ * it checked (generation, size and modification time). It is followed by
+ * the keys of the entries which passed all the checks, one per line, in
+ * hexadecimal and sorted.
+ *
+ * The key of an entry hashes its line with everything its checks depend
+ * on (the matching lines of the other files, the existence of the groups
+ * or users it refers to). An entry whose key is in the state is not
+ * checked again.
+ */
+
+#define CHECK_STATE_LINE	512
+
+/*
+ * check_state_hash - Add a string to a key
+ */
+unsigned long long check_state_hash (unsigned long long key,
+                                     /*@null@*/const char *s)
+{
+	const unsigned char *p;
+
+	if (NULL == s) {
+		return (key ^ 0x01) * 0x100000001b3ULL;
+	}
+	for (p = (const unsigned char *) s; '\0' != *p; p++) {
+		key = (key ^ *p) * 0x100000001b3ULL;
+	}
+	/* separator */
+	return (key ^ 0xff) * 0x100000001b3ULL;
+}
+
+/*
+ * file_stamps - Write the stamps of the files (generation, size and
+ *               modification time) to buf
+ *
+ *	files is a NULL terminated list of the checked files.
+ */
+static void file_stamps (char *buf, size_t size, const char *const *files)
+{
+	struct stat sb;
+	size_t len = 0;
+
+	buf[0] = '\0';
+	for (; NULL != *files; files++) {
+		if (stat (*files, &sb) != 0) {
+			memzero (&sb, sizeof sb);
+		}
+		len += snprintf (buf + len, size - len, " %llu.%llu.%lld.%ld",
+		                 commonio_file_generation (*files),
+		                 (unsigned long long) sb.st_size,
+		                 (long long) sb.st_mtim.tv_sec,
+		                 (long) sb.st_mtim.tv_nsec);
+		if (len >= size) {
+			len = size - 1;
+			break;
+		}
+	}
+}
+
+static int cmp_key (const void *a, const void *b)
+{
+	unsigned long long ka = *(const unsigned long long *) a;
+	unsigned long long kb = *(const unsigned long long *) b;
+
+	return (ka > kb) - (ka < kb);
+}
+
+/*
+ * add_key - Add a key to a list
+ */
+static void add_key (unsigned long long **keys, size_t *count,
+                     unsigned long long key)
+{
+	unsigned long long *list;
+
+	if (0 == (*count % 64)) {
+		list = realloc (*keys, (*count + 64) * sizeof *list);
+		if (NULL == list) {
+			fprintf (log_get_logfd (), _("%s: out of memory\n"),
+			         log_get_progname ());
+			exit (EXIT_FAILURE);
+		}
+		*keys = list;
+	}
+	(*keys)[*count] = key;
+	(*count)++;
+}
+
+/*
+ * check_state_load - Read the state of the last run of tool.
+ *
+ *	A missing state file, or the state of other options, is an empty
+ *	state: all the entries will be checked.
+ *
+ *	It returns true if the last run found no error and none of the
+ *	files changed since: there is then nothing to check.
+ */
+bool check_state_load (struct check_state *state, const char *file,
+                       const char *tool, unsigned long options,
+                       const char *const *files)
+{
+	char prefix[CHECK_STATE_LINE];
+	char stamps[CHECK_STATE_LINE];
+	char line[CHECK_STATE_LINE];
+	unsigned long long key;
+	size_t len;
+	FILE *fp;
+	char *end;
+	bool unchanged;
+
+	memzero (state, sizeof *state);
+
+	fp = fopen (file, "re");
+	if (NULL == fp) {
+		if (ENOENT != errno) {
+			fprintf (log_get_logfd (),
+			         _("%s: cannot open %s: %s\n"),
+			         log_get_progname (), file, strerror (errno));
+		}
+		return false;
+	}
+
+	(void) snprintf (prefix, sizeof prefix, "%s %lu ", tool, options);
+	len = strlen (prefix);
+	if (   (fgets (line, sizeof line, fp) == NULL)
+	    || (strncmp (line, prefix, len) != 0)) {
+		(void) fclose (fp);
+		return false;
+	}
+	file_stamps (stamps, sizeof stamps, files);
+	end = strchr (line, '\n');
+	if (NULL != end) {
+		*end = '\0';
+	}
+	unchanged =    ('1' == line[len])
+	            && (strcmp (line + len + 1, stamps) == 0);
+
+	while (fgets (line, sizeof line, fp) != NULL) {
+		errno = 0;
+		key = strtoull (line, &end, 16);
+		if ((0 != errno) || (end == line) || ('\n' != *end)) {
+			continue;
+		}
+		add_key (&state->known, &state->nknown, key);
+	}
+	(void) fclose (fp);
+
+	if (0 != state->nknown) {
+		qsort (state->known, state->nknown, sizeof *state->known,
+		       cmp_key);
+	}
+	return unchanged;
+}
+
+/*
+ * check_state_known - Check if an entry passed the checks of the last run
+ */
+bool check_state_known (const struct check_state *state,
+                        unsigned long long key)
+{
+	return    (0 != state->nknown)
+	       && (bsearch (&key, state->known, state->nknown,
+	                    sizeof *state->known, cmp_key) != NULL);
+}
+
+/*
+ * check_state_add - Remember an entry which passed the checks
+ */
+void check_state_add (struct check_state *state, unsigned long long key)
+{
+	add_key (&state->checked, &state->nchecked, key);
+}
+
+/*
+ * check_state_save - Write the state of this run of tool.
+ *
+ *	The state is written to file+, which then replaces file.
+ *
+ *	It returns -1 on failure (an error is reported).
+ */
+int check_state_save (struct check_state *state, const char *file,
+                      const char *tool, unsigned long options, bool clean,
+                      const char *const *files)
+{
+	char stamps[CHECK_STATE_LINE];
+	char tmp[1024];
+	FILE *fp;
+	size_t i;
+	int errors = 0;
+
+	if ((size_t) snprintf (tmp, sizeof tmp, "%s+", file) >= sizeof tmp) {
+		errno = ENAMETOOLONG;
+		goto err;
+	}
+
+	if (0 != state->nchecked) {
+		qsort (state->checked, state->nchecked,
+		       sizeof *state->checked, cmp_key);
+	}
+	file_stamps (stamps, sizeof stamps, files);
+
+	fp = fopen (tmp, "we");
+	if (NULL == fp) {
+		goto err;
+	}
+	if (fprintf (fp, "%s %lu %d%s\n",
+	             tool, options, clean ? 1 : 0, stamps) < 0) {
+		errors++;
+	}
+	for (i = 0; i < state->nchecked; i++) {
+		if (fprintf (fp, "%llx\n", state->checked[i]) < 0) {
+			errors++;
+			break;
+		}
+	}
+	if (fclose (fp) != 0) {
+		errors++;
+	}
+	if ((0 != errors) || (rename (tmp, file) != 0)) {
+		int saved_errno = errno;
+
+		(void) unlink (tmp);
+		errno = saved_errno;
+		goto err;
+	}
+	return 0;
+
+err:
+	fprintf (log_get_logfd (), _("%s: cannot write %s: %s\n"),
+	         log_get_progname (), file, strerror (errno));
+	return -1;
+}
+
+/*
+ * check_state_free - Release the keys of a state
+ */
+void check_state_free (struct check_state *state)
+{
+	free (state->known);
+	free (state->checked);
+	memzero (state, sizeof *state);
+}
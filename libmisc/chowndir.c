@@ -11,66 +11,150 @@
 
 #ident "$Id$"
 
+#include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include "shadowlog.h"
+
+/* Interval between two progress reports, in seconds */
+#define CHOWN_PROGRESS_INTERVAL	10
+
+/*
+ * With HOME_CHOWN_JOBS, the directories are walked by a pool of threads.
+ * Instead of recursing into a subdirectory, chown_tree_at() queues it,
+ * and the next idle thread changes the ownership of its entries.
+ *
+ * As in the walk, no path is resolved again: a task keeps the directory
+ * opened from the descriptor of its parent, so that the owner of the tree
+ * cannot replace it by a symbolic link in the meantime. The number of
+ * queued directories is bounded (see dir_pool_fds()): the next ones are
+ * walked recursively by the thread which finds them.
+ */
+
+struct chown_task {
+	int fd;		/* of the directory */
+	/*@dependent@*/ /*@null@*/struct chown_task *next;
+};
+
+struct chown_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/*@owned@*/ /*@null@*/struct chown_task *queue;
+	unsigned long active;	/* tasks being processed */
+	unsigned long open;	/* tasks with an open descriptor */
+	unsigned long max_open;
+	bool failed;		/* stop at the first error, like the walk */
+	uid_t old_uid;
+	uid_t new_uid;
+	gid_t old_gid;
+	gid_t new_gid;
+};
+static /*@null@*/struct chown_pool *pool = NULL;
+
+/*
+ * Progress of the current chown_tree(), protected by the mutex of the
+ * pool if there is one.
+ */
+struct chown_progress {
+	/*@observer@*/const char *root;
+	unsigned long checked;
+	unsigned long changed;
+	struct timespec last;	/* last report, or start */
+};
+static struct chown_progress progress;
 
 static int chown_tree_at (int at_fd,
                 const char *path,
                 uid_t old_uid,
                 uid_t new_uid,
                 gid_t old_gid,
-                gid_t new_gid)
+                gid_t new_gid);
+static int queue_chown (int dir_fd, const char *name);
+
+/*
+ * report_progress - count the entries of a directory, and report the
+ *                   progress if the walk is slow
+ *
+ *	Nothing is reported in the first CHOWN_PROGRESS_INTERVAL seconds,
+ *	so that the walk of usual home directories is silent.
+ */
+static void report_progress (unsigned long checked, unsigned long changed)
 {
-	DIR *dir;
-	const struct dirent *ent;
-	struct stat dir_sb;
-	int dir_fd, rc = 0;
+	struct timespec now;
 
-	dir_fd = openat (at_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
-	if (dir_fd < 0) {
-		return -1;
+	if (NULL != pool) {
+		(void) pthread_mutex_lock (&pool->mutex);
+	}
+	progress.checked += checked;
+	progress.changed += changed;
+	if (   (clock_gettime (CLOCK_MONOTONIC, &now) == 0)
+	    && (now.tv_sec - progress.last.tv_sec >= CHOWN_PROGRESS_INTERVAL)) {
+		progress.last = now;
+		(void) fprintf (log_get_logfd (),
+		                _("%s: %s: %lu files checked, ownership changed for %lu\n"),
+		                log_get_progname (), progress.root,
+		                progress.checked, progress.changed);
 	}
+	if (NULL != pool) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+	}
+}
 
-	dir = fdopendir (dir_fd);
-	if (!dir) {
-		(void) close (dir_fd);
+/*
+ * chown_entries - change the ownership of the entries of a batch of the
+ *                 directory dir_fd, and empty the batch
+ *
+ *	The subdirectories are walked recursively, or queued to the pool.
+ *	*checked and *changed count the entries checked and changed.
+ *
+ *	Return 0 on success, -1 at the first error.
+ */
+static int chown_entries (int dir_fd, struct dir_batch *batch,
+                          uid_t old_uid, uid_t new_uid,
+                          gid_t old_gid, gid_t new_gid,
+                          unsigned long *checked, unsigned long *changed)
+{
+	size_t i;
+	int rc = 0;
+
+	if (deadline_check ("home ownership") != 0) {
+		batch->count = 0;
 		return -1;
 	}
-
-	/*
-	 * Open the directory and read each entry.  Every entry is tested
-	 * to see if it is a directory, and if so this routine is called
-	 * recursively.  If not, it is checked to see if an ownership
-	 * shall be changed.
-	 */
-	while ((ent = readdir (dir))) {
+	dir_batch_stat (batch, dir_fd);
+	for (i = 0; i < batch->count; i++) {
+		const char *name = batch->name[i];
+		const struct stat *ent_sb = &batch->sb[i];
 		uid_t tmpuid = (uid_t) -1;
 		gid_t tmpgid = (gid_t) -1;
-		struct stat ent_sb;
-
-		/*
-		 * Skip the "." and ".." entries
-		 */
-		if (   (strcmp (ent->d_name, ".") == 0)
-		    || (strcmp (ent->d_name, "..") == 0)) {
-			continue;
-		}
 
-		rc = fstatat (dirfd(dir), ent->d_name, &ent_sb, AT_SYMLINK_NOFOLLOW);
-		if (rc < 0) {
+		if (0 != batch->error[i]) {
+			errno = batch->error[i];
+			rc = -1;
 			break;
 		}
+		(*checked)++;
 
-		if (S_ISDIR (ent_sb.st_mode)) {
-			/*
-			 * Do the entire subdirectory.
-			 */
-			rc = chown_tree_at (dirfd(dir), ent->d_name, old_uid, new_uid, old_gid, new_gid);
+		if (S_ISDIR (ent_sb->st_mode)) {
+			if ((NULL != pool) && (queue_chown (dir_fd, name) == 0)) {
+				rc = 0;
+			} else {
+				/*
+				 * Do the entire subdirectory.
+				 */
+				rc = chown_tree_at (dir_fd, name, old_uid, new_uid, old_gid, new_gid);
+			}
 			if (0 != rc) {
 				break;
 			}
@@ -85,19 +169,88 @@ static int chown_tree_at (int at_fd,
 		 * If the file is not group-owned by the group, the
 		 * group-owner is not changed.
 		 */
-		if (((uid_t) -1 == old_uid) || (ent_sb.st_uid == old_uid)) {
+		if (((uid_t) -1 == old_uid) || (ent_sb->st_uid == old_uid)) {
 			tmpuid = new_uid;
 		}
-		if (((gid_t) -1 == old_gid) || (ent_sb.st_gid == old_gid)) {
+		if (((gid_t) -1 == old_gid) || (ent_sb->st_gid == old_gid)) {
 			tmpgid = new_gid;
 		}
 		if (((uid_t) -1 != tmpuid) || ((gid_t) -1 != tmpgid)) {
-			rc = fchownat (dirfd(dir), ent->d_name, tmpuid, tmpgid, AT_SYMLINK_NOFOLLOW);
+			rc = fchownat (dir_fd, name, tmpuid, tmpgid, AT_SYMLINK_NOFOLLOW);
 			if (0 != rc) {
 				break;
 			}
+			(*changed)++;
 		}
 	}
+	batch->count = 0;
+	return rc;
+}
+
+static int chown_tree_at (int at_fd,
+                const char *path,
+                uid_t old_uid,
+                uid_t new_uid,
+                gid_t old_gid,
+                gid_t new_gid)
+{
+	DIR *dir;
+	const struct dirent *ent;
+	struct dir_batch *batch;
+	struct stat dir_sb;
+	int dir_fd, rc = 0;
+	unsigned long checked = 0;
+	unsigned long changed = 0;
+
+	dir_fd = openat (at_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return -1;
+	}
+
+	dir = fdopendir (dir_fd);
+	if (!dir) {
+		(void) close (dir_fd);
+		return -1;
+	}
+
+	batch = malloc (sizeof *batch);
+	if (NULL == batch) {
+		(void) closedir (dir);
+		return -1;
+	}
+	batch->count = 0;
+
+	/*
+	 * Open the directory and read each entry.  The entries are stated
+	 * by batches.  Every entry is tested to see if it is a directory,
+	 * and if so this routine is called recursively (or the directory
+	 * is queued to the pool).  If not, it is checked to see if an
+	 * ownership shall be changed.
+	 */
+	while ((ent = readdir (dir))) {
+		/*
+		 * Skip the "." and ".." entries
+		 */
+		if (   (strcmp (ent->d_name, ".") == 0)
+		    || (strcmp (ent->d_name, "..") == 0)) {
+			continue;
+		}
+
+		if (dir_batch_add (batch, ent->d_name)) {
+			rc = chown_entries (dirfd(dir), batch,
+			                    old_uid, new_uid, old_gid, new_gid,
+			                    &checked, &changed);
+			if (0 != rc) {
+				break;
+			}
+		}
+	}
+	if (0 == rc) {
+		rc = chown_entries (dirfd(dir), batch,
+		                    old_uid, new_uid, old_gid, new_gid,
+		                    &checked, &changed);
+	}
+	free (batch);
 
 	/*
 	 * Now do the root of the tree
@@ -120,6 +273,179 @@ static int chown_tree_at (int at_fd,
 
 	(void) closedir (dir);
 
+	report_progress (checked, changed);
+
+	return rc;
+}
+
+/*
+ * queue_chown - queue the subdirectory name of the directory dir_fd to
+ *               the pool
+ *
+ *	Return 0 on success, -1 if the task could not be allocated, too many
+ *	are queued, or the subdirectory could not be opened, so that the
+ *	caller walks it.
+ */
+static int queue_chown (int dir_fd, const char *name)
+{
+	struct chown_task *task;
+
+	assert (NULL != pool);
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	if (pool->open >= pool->max_open) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+		return -1;
+	}
+	pool->open++;
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	task = malloc (sizeof *task);
+	if (NULL != task) {
+		task->fd = openat (dir_fd, name,
+		                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (-1 == task->fd) {
+			free (task);
+			task = NULL;
+		}
+	}
+	if (NULL == task) {
+		(void) pthread_mutex_lock (&pool->mutex);
+		pool->open--;
+		(void) pthread_mutex_unlock (&pool->mutex);
+		return -1;
+	}
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	task->next = pool->queue;
+	pool->queue = task;
+	(void) pthread_cond_signal (&pool->cond);
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return 0;
+}
+
+/*
+ * chown_worker - process the queued directories until the whole tree is
+ *                done, or a directory failed
+ */
+static /*@null@*/void *chown_worker (unused void *arg)
+{
+	assert (NULL != pool);
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	for (;;) {
+		struct chown_task *task;
+		int rc;
+
+		while ((NULL == pool->queue) && (0 != pool->active)) {
+			(void) pthread_cond_wait (&pool->cond, &pool->mutex);
+		}
+		task = pool->queue;
+		if ((NULL == task) || pool->failed) {
+			/* Done, or nothing more shall be changed */
+			break;
+		}
+		pool->queue = task->next;
+		pool->active++;
+		(void) pthread_mutex_unlock (&pool->mutex);
+
+		rc = chown_tree_at (task->fd, ".",
+		                    pool->old_uid, pool->new_uid,
+		                    pool->old_gid, pool->new_gid);
+		(void) close (task->fd);
+		free (task);
+
+		(void) pthread_mutex_lock (&pool->mutex);
+		pool->open--;
+		if (0 != rc) {
+			pool->failed = true;
+		}
+		pool->active--;
+		if (   ((0 == pool->active) && (NULL == pool->queue))
+		    || pool->failed) {
+			(void) pthread_cond_broadcast (&pool->cond);
+		}
+	}
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return NULL;
+}
+
+/*
+ * chown_tree_jobs - chown_tree() with jobs threads
+ *
+ *	Return 1 if the pool could not be started, so that the tree is
+ *	walked by the caller.
+ */
+static int chown_tree_jobs (const char *root,
+                            uid_t old_uid, uid_t new_uid,
+                            gid_t old_gid, gid_t new_gid,
+                            long jobs)
+{
+	struct chown_pool cp;
+	pthread_t *threads;
+	long nthreads = 0;
+	long i;
+	int rc;
+
+	threads = calloc (jobs, sizeof *threads);
+	if (NULL == threads) {
+		return 1;
+	}
+	(void) memset (&cp, 0, sizeof cp);
+	if (pthread_mutex_init (&cp.mutex, NULL) != 0) {
+		free (threads);
+		return 1;
+	}
+	if (pthread_cond_init (&cp.cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&cp.mutex);
+		free (threads);
+		return 1;
+	}
+	cp.old_uid = old_uid;
+	cp.new_uid = new_uid;
+	cp.old_gid = old_gid;
+	cp.new_gid = new_gid;
+	cp.max_open = dir_pool_fds ();
+	pool = &cp;
+
+	/* The root is done by this thread, then the queued subdirectories */
+	rc = chown_tree_at (AT_FDCWD, root, old_uid, new_uid, old_gid, new_gid);
+	if ((0 == rc) && (NULL != cp.queue)) {
+		for (i = 1; i < jobs; i++) {
+			if (pthread_create (&threads[nthreads], NULL,
+			                    chown_worker, NULL) == 0) {
+				nthreads++;
+			}
+		}
+		/* This thread is one of the jobs */
+		(void) chown_worker (NULL);
+		for (i = 0; i < nthreads; i++) {
+			(void) pthread_join (threads[i], NULL);
+		}
+		if (cp.failed) {
+			rc = -1;
+		}
+	} else if (0 != rc) {
+		rc = -1;
+	}
+
+	pool = NULL;
+
+	/* Left in the queue after a failure */
+	while (NULL != cp.queue) {
+		struct chown_task *task = cp.queue;
+
+		cp.queue = task->next;
+		(void) close (task->fd);
+		free (task);
+	}
+
+	(void) pthread_cond_destroy (&cp.cond);
+	(void) pthread_mutex_destroy (&cp.mutex);
+	free (threads);
+
 	return rc;
 }
 
@@ -135,6 +461,10 @@ static int chown_tree_at (int at_fd,
  *
  *	new_uid and new_gid can be set to -1 to indicate that no owner or
  *	group-owner shall be changed.
+ *
+ *	With HOME_CHOWN_JOBS, the directories are processed by that many
+ *	threads. The progress is reported on the log file descriptor when
+ *	the walk takes more than CHOWN_PROGRESS_INTERVAL seconds.
  */
 int chown_tree (const char *root,
                 uid_t old_uid,
@@ -142,5 +472,23 @@ int chown_tree (const char *root,
                 gid_t old_gid,
                 gid_t new_gid)
 {
-	return chown_tree_at (AT_FDCWD, root, old_uid, new_uid, old_gid, new_gid);
+	long jobs = getdef_long ("HOME_CHOWN_JOBS", 1);
+	int rc = 1;
+
+	(void) memset (&progress, 0, sizeof progress);
+	progress.root = root;
+	(void) clock_gettime (CLOCK_MONOTONIC, &progress.last);
+
+	if (jobs > 1024) {
+		jobs = 1024;
+	}
+	if (jobs > 1) {
+		rc = chown_tree_jobs (root, old_uid, new_uid, old_gid, new_gid,
+		                      jobs);
+	}
+	if (1 == rc) {
+		rc = chown_tree_at (AT_FDCWD, root, old_uid, new_uid, old_gid, new_gid);
+	}
+
+	return rc;
 }
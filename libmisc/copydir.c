@@ -16,14 +16,23 @@
 #include <sys/types.h>
 #include <sys/time.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
+#if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_LINUX_FS_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include "prototypes.h"
+#include "probes.h"
 #include "defines.h"
+#include "getdef.h"
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
 #endif				/* WITH_SELINUX */
 #if defined(WITH_ACL) || defined(WITH_ATTR)
 #include <stdarg.h>
+#include <sys/xattr.h>
 #include <attr/error_context.h>
 #endif				/* WITH_ACL || WITH_ATTR */
 #ifdef WITH_ACL
@@ -37,6 +46,10 @@
 
 static /*@null@*/const char *src_orig;
 static /*@null@*/const char *dst_orig;
+/* Final location of the copy for its symlinks, dst_orig if NULL */
+static /*@null@*/const char *link_orig;
+/* Start of the previous pass of sync_tree(), see entry_changed() */
+static /*@null@*/const struct timespec *sync_since;
 
 struct link_name {
 	dev_t ln_dev;
@@ -45,7 +58,40 @@ struct link_name {
 	char *ln_name;
 	/*@dependent@*/struct link_name *ln_next;
 };
-static /*@exposed@*/struct link_name *links;
+
+/*
+ * The files with several links copied so far and whose other links were
+ * not found yet, hashed by device and inode.
+ */
+static /*@null@*/ /*@only@*/struct link_name **links = NULL;
+static size_t links_size = 0;	/* number of buckets */
+static size_t links_count = 0;
+
+/* Size of the buffer of the copies through user space */
+#define COPY_BUFSIZE	(128 * 1024)
+
+/*
+ * Number of files whose data were copied with each method, reported by
+ * copy_tree().
+ */
+struct copy_stats {
+	unsigned long cloned;		/* FICLONE */
+	unsigned long ranged;		/* copy_file_range */
+	unsigned long buffered;		/* read and write */
+	unsigned long sparse;		/* holes kept with SEEK_DATA */
+	unsigned long long bytes;	/* size of the files */
+};
+static struct copy_stats copy_stats;
+
+/* Method of copy_data(), set with copy_tree_set_method() */
+static enum copy_method copy_method = COPY_METHOD_AUTO;
+
+/*
+ * Progress of the current copy_tree(), reported to progress_cb after each
+ * entry.
+ */
+static /*@null@*/tree_progress_cb progress_cb = NULL;
+static struct tree_progress progress;
 
 struct path_info {
 	const char *full_path;
@@ -53,15 +99,66 @@ struct path_info {
 	const char *name;
 };
 
+/*
+ * With HOME_COPY_JOBS, the directories are copied by a pool of threads.
+ * Instead of recursing into a subdirectory once it is created, copy_dir()
+ * queues it, and the next idle thread copies its entries.
+ *
+ * As in the recursive copy, no path is resolved again: a task keeps the
+ * source and destination directories opened from the descriptors of
+ * their parents, so that none of them can be replaced by a symbolic link
+ * in the meantime (e.g. by the owner of the source during usermod -m).
+ * The number of tasks queued with their descriptors is bounded (see
+ * dir_pool_fds()): the next subdirectories are copied recursively by the
+ * thread which finds them.
+ */
+
+struct copy_task {
+	struct path_info src;
+	struct path_info dst;
+	struct timespec mt[2];
+	bool set_times;		/* set the times of dst once copied */
+	int err;		/* result of the copy of the entries */
+	/*@dependent@*/ /*@null@*/struct copy_task *next;	/* queue */
+	/*@owned@*/ /*@null@*/struct copy_task *all_next;	/* all tasks */
+};
+
+struct copy_pool {
+	pthread_mutex_t mutex;	/* queue and copy_stats */
+	pthread_cond_t cond;
+	/*@dependent@*/ /*@null@*/struct copy_task *queue;
+	/*@owned@*/ /*@null@*/struct copy_task *tasks;
+	unsigned long active;	/* tasks being copied */
+	unsigned long open;	/* tasks with open descriptors */
+	unsigned long max_open;
+	pthread_mutex_t links_mutex;	/* links */
+	bool reset_selinux;
+	uid_t old_uid;
+	uid_t new_uid;
+	gid_t old_gid;
+	gid_t new_gid;
+};
+static /*@null@*/struct copy_pool *pool = NULL;
+
 static int copy_entry (const struct path_info *src, const struct path_info *dst,
+                       /*@null@*/const struct stat *statp,
                        bool reset_selinux,
                        uid_t old_uid, uid_t new_uid,
                        gid_t old_gid, gid_t new_gid);
+static int copy_entries (const struct path_info *src,
+                         const struct path_info *dst,
+                         int src_fd, int dst_fd,
+                         struct dir_batch *batch,
+                         bool reset_selinux,
+                         uid_t old_uid, uid_t new_uid,
+                         gid_t old_gid, gid_t new_gid);
 static int copy_dir (const struct path_info *src, const struct path_info *dst,
                      bool reset_selinux,
                      const struct stat *statp, const struct timespec mt[],
                      uid_t old_uid, uid_t new_uid,
                      gid_t old_gid, gid_t new_gid);
+static int queue_dir (const struct path_info *src, const struct path_info *dst,
+                      /*@null@*/const struct timespec mt[]);
 static /*@null@*/char *readlink_malloc (const char *filename);
 static int copy_symlink (const struct path_info *src, const struct path_info *dst,
                          unused bool reset_selinux,
@@ -87,6 +184,7 @@ static int chownat_if_needed (const struct path_info *dst, const struct stat *st
 static int fchown_if_needed (int fdst, const struct stat *statp,
                              uid_t old_uid, uid_t new_uid,
                              gid_t old_gid, gid_t new_gid);
+static void count_progress (const char *path, const struct stat *statp);
 
 #if defined(WITH_ACL) || defined(WITH_ATTR)
 /*
@@ -170,36 +268,105 @@ static int attr_copy_path(const struct path_info *src,
 }
 #endif				/* WITH_ATTR */
 
+static size_t link_hash (dev_t dev, ino_t ino)
+{
+	uint64_t h = ((uint64_t) dev * 0x9E3779B97F4A7C15ULL) ^ (uint64_t) ino;
+
+	h ^= h >> 29;
+	h *= 0xBF58476D1CE4E5B9ULL;
+	h ^= h >> 32;
+	return (size_t) h;
+}
+
+/*
+ * add_link - add a link to the hash table
+ *
+ *	The table is grown to keep about one link per bucket. If it cannot
+ *	be grown, the chains just get longer.
+ */
+static void add_link (/*@only@*/struct link_name *ln)
+{
+	size_t i;
+
+	if (links_count >= links_size) {
+		size_t size = (0 == links_size) ? 64 : links_size * 2;
+		struct link_name **table;
+
+		table = calloc (size, sizeof *table);
+		if (NULL != table) {
+			for (i = 0; i < links_size; i++) {
+				while (NULL != links[i]) {
+					struct link_name *lp = links[i];
+					size_t h = link_hash (lp->ln_dev, lp->ln_ino) & (size - 1);
+
+					links[i] = lp->ln_next;
+					lp->ln_next = table[h];
+					table[h] = lp;
+				}
+			}
+			free (links);
+			links = table;
+			links_size = size;
+		} else if (0 == links_size) {
+			/* No table: the link cannot be found again */
+			free (ln->ln_name);
+			free (ln);
+			return;
+		}
+	}
+
+	i = link_hash (ln->ln_dev, ln->ln_ino) & (links_size - 1);
+	ln->ln_next = links[i];
+	links[i] = ln;
+	links_count++;
+}
+
 /*
- * remove_link - delete a link from the linked list
+ * remove_link - delete a link from the hash table
  */
 static void remove_link (/*@only@*/struct link_name *ln)
 {
-	struct link_name *lp;
+	struct link_name **pp;
 
-	if (links == ln) {
-		links = ln->ln_next;
-		free (ln->ln_name);
-		free (ln);
-		return;
-	}
-	for (lp = links; NULL !=lp; lp = lp->ln_next) {
-		if (lp->ln_next == ln) {
+	assert (NULL != links);
+
+	for (pp = &links[link_hash (ln->ln_dev, ln->ln_ino) & (links_size - 1)];
+	     NULL != *pp;
+	     pp = &(*pp)->ln_next) {
+		if (*pp == ln) {
+			*pp = ln->ln_next;
+			links_count--;
 			break;
 		}
 	}
 
-	if (NULL == lp) {
-		free (ln->ln_name);
-		free (ln);
-		return;
-	}
-
-	lp->ln_next = lp->ln_next->ln_next;
 	free (ln->ln_name);
 	free (ln);
 }
 
+/*
+ * free_links - forget the links whose other links were not in the copied
+ *              tree
+ */
+static void free_links (void)
+{
+	size_t i;
+
+	for (i = 0; i < links_size; i++) {
+		while (NULL != links[i]) {
+			struct link_name *lp = links[i];
+
+			links[i] = lp->ln_next;
+			free (lp->ln_name);
+			free (lp);
+		}
+	}
+	free (links);
+	links = NULL;
+	links_size = 0;
+	links_count = 0;
+}
+
 /*
  * check_link - see if a file is really a link
  */
@@ -216,9 +383,13 @@ static /*@exposed@*/ /*@null@*/struct link_name *check_link (const char *name, c
 	assert (NULL != src_orig);
 	assert (NULL != dst_orig);
 
-	for (lp = links; NULL != lp; lp = lp->ln_next) {
-		if ((lp->ln_dev == sb->st_dev) && (lp->ln_ino == sb->st_ino)) {
-			return lp;
+	if (NULL != links) {
+		size_t h = link_hash (sb->st_dev, sb->st_ino) & (links_size - 1);
+
+		for (lp = links[h]; NULL != lp; lp = lp->ln_next) {
+			if ((lp->ln_dev == sb->st_dev) && (lp->ln_ino == sb->st_ino)) {
+				return lp;
+			}
 		}
 	}
 
@@ -236,8 +407,7 @@ static /*@exposed@*/ /*@null@*/struct link_name *check_link (const char *name, c
 	len = name_len - src_len + dst_len + 1;
 	lp->ln_name = (char *) xmalloc (len);
 	(void) snprintf (lp->ln_name, len, "%s%s", dst_orig, name + src_len);
-	lp->ln_next = links;
-	links = lp;
+	add_link (lp);
 
 	return NULL;
 }
@@ -250,6 +420,7 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
 	int dst_fd, src_fd, err = 0;
 	bool set_orig = false;
 	const struct dirent *ent;
+	struct dir_batch *batch;
 	DIR *dir;
 
 	if (copy_root) {
@@ -271,8 +442,12 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
 			return -1;
 		}
 
-		return copy_entry (src, dst, reset_selinux,
-		                   old_uid, new_uid, old_gid, new_gid);
+		err = copy_entry (src, dst, &sb, reset_selinux,
+		                  old_uid, new_uid, old_gid, new_gid);
+		if ((0 == err) && (NULL != progress_cb)) {
+			count_progress (src->full_path, &sb);
+		}
+		return err;
 	}
 
 	/*
@@ -306,6 +481,15 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
 		return -1;
 	}
 
+	/* The entries are stated by batches */
+	batch = malloc (sizeof *batch);
+	if (NULL == batch) {
+		(void) closedir (dir);
+		(void) close (dst_fd);
+		return -1;
+	}
+	batch->count = 0;
+
 	if (src_orig == NULL) {
 		src_orig = src->full_path;
 		dst_orig = dst->full_path;
@@ -315,60 +499,31 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
 		/*
 		 * Skip the "." and ".." entries
 		 */
-		if ((strcmp (ent->d_name, ".") != 0) &&
-		    (strcmp (ent->d_name, "..") != 0)) {
-			char *src_name;
-			char *dst_name;
-			size_t src_len = strlen (ent->d_name) + 2;
-			size_t dst_len = strlen (ent->d_name) + 2;
-			src_len += strlen (src->full_path);
-			dst_len += strlen (dst->full_path);
-
-			src_name = (char *) malloc (src_len);
-			dst_name = (char *) malloc (dst_len);
-
-			if ((NULL == src_name) || (NULL == dst_name)) {
-				err = -1;
-			} else {
-				/*
-				 * Build the filename for both the source and
-				 * the destination files.
-				 */
-				struct path_info src_entry, dst_entry;
-
-				(void) snprintf (src_name, src_len, "%s/%s",
-				                 src->full_path, ent->d_name);
-				(void) snprintf (dst_name, dst_len, "%s/%s",
-				                 dst->full_path, ent->d_name);
-
-				src_entry.full_path = src_name;
-				src_entry.dirfd = dirfd(dir);
-				src_entry.name = ent->d_name;
-
-				dst_entry.full_path = dst_name;
-				dst_entry.dirfd = dst_fd;
-				dst_entry.name = ent->d_name;
-
-				err = copy_entry (&src_entry, &dst_entry,
-				                  reset_selinux,
-				                  old_uid, new_uid,
-				                  old_gid, new_gid);
-			}
-			free (src_name);
-			free (dst_name);
+		if (   (strcmp (ent->d_name, ".") != 0)
+		    && (strcmp (ent->d_name, "..") != 0)
+		    && dir_batch_add (batch, ent->d_name)) {
+			err = copy_entries (src, dst, dirfd(dir), dst_fd, batch,
+			                    reset_selinux,
+			                    old_uid, new_uid, old_gid, new_gid);
 		}
 	}
+	if (0 == err) {
+		err = copy_entries (src, dst, dirfd(dir), dst_fd, batch,
+		                    reset_selinux,
+		                    old_uid, new_uid, old_gid, new_gid);
+	}
+	free (batch);
 	(void) closedir (dir);
 	(void) close (dst_fd);
 
 	if (set_orig) {
 		src_orig = NULL;
 		dst_orig = NULL;
-		/* FIXME: clean links
+		/*
 		 * Since there can be hardlinks elsewhere on the device,
-		 * we cannot check that all the hardlinks were found:
-		assert (NULL == links);
+		 * we cannot check that all the hardlinks were found.
 		 */
+		free_links ();
 	}
 
 #ifdef WITH_SELINUX
@@ -387,10 +542,88 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
 	return err;
 }
 
+/*
+ * copy_entries - copy the entries of a batch of the directory src, opened
+ *                as src_fd, to dst, opened as dst_fd, and empty the batch
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_entries (const struct path_info *src,
+                         const struct path_info *dst,
+                         int src_fd, int dst_fd,
+                         struct dir_batch *batch,
+                         bool reset_selinux,
+                         uid_t old_uid, uid_t new_uid,
+                         gid_t old_gid, gid_t new_gid)
+{
+	size_t i;
+	int err = 0;
+
+	if (deadline_check ("home copy") != 0) {
+		batch->count = 0;
+		return -1;
+	}
+	dir_batch_stat (batch, src_fd);
+	for (i = 0; (0 == err) && (i < batch->count); i++) {
+		const char *name = batch->name[i];
+		char *src_name;
+		char *dst_name;
+		size_t src_len = strlen (name) + 2;
+		size_t dst_len = strlen (name) + 2;
+
+		if (0 != batch->error[i]) {
+			/* If we cannot stat the file, do not care. */
+			continue;
+		}
+
+		src_len += strlen (src->full_path);
+		dst_len += strlen (dst->full_path);
+
+		src_name = (char *) malloc (src_len);
+		dst_name = (char *) malloc (dst_len);
+
+		if ((NULL == src_name) || (NULL == dst_name)) {
+			err = -1;
+		} else {
+			/*
+			 * Build the filename for both the source and
+			 * the destination files.
+			 */
+			struct path_info src_entry, dst_entry;
+
+			(void) snprintf (src_name, src_len, "%s/%s",
+			                 src->full_path, name);
+			(void) snprintf (dst_name, dst_len, "%s/%s",
+			                 dst->full_path, name);
+
+			src_entry.full_path = src_name;
+			src_entry.dirfd = src_fd;
+			src_entry.name = name;
+
+			dst_entry.full_path = dst_name;
+			dst_entry.dirfd = dst_fd;
+			dst_entry.name = name;
+
+			err = copy_entry (&src_entry, &dst_entry,
+			                  &batch->sb[i], reset_selinux,
+			                  old_uid, new_uid,
+			                  old_gid, new_gid);
+			if ((0 == err) && (NULL != progress_cb)) {
+				count_progress (src_name, &batch->sb[i]);
+			}
+		}
+		free (src_name);
+		free (dst_name);
+	}
+	batch->count = 0;
+	return err;
+}
+
 /*
  * copy_entry - copy the entry of a directory
  *
- *	Copy the entry src to dst.
+ *	Copy the entry src to dst. statp is the status of src, or NULL
+ *	if it shall be stated.
  *	Depending on the type of entry, this function will forward the
  *	request to copy_dir(), copy_symlink(), copy_hardlink(),
  *	copy_special(), or copy_file().
@@ -407,6 +640,7 @@ static int copy_tree_impl (const struct path_info *src, const struct path_info *
  *	to -1.
  */
 static int copy_entry (const struct path_info *src, const struct path_info *dst,
+                       /*@null@*/const struct stat *statp,
                        bool reset_selinux,
                        uid_t old_uid, uid_t new_uid,
                        gid_t old_gid, gid_t new_gid)
@@ -416,42 +650,64 @@ static int copy_entry (const struct path_info *src, const struct path_info *dst,
 	struct link_name *lp;
 	struct timespec mt[2];
 
-	if (fstatat(src->dirfd, src->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
+	if (NULL != statp) {
+		sb = *statp;
+	} else if (fstatat(src->dirfd, src->name, &sb, AT_SYMLINK_NOFOLLOW) == -1) {
 		/* If we cannot stat the file, do not care. */
-	} else {
-		mt[0].tv_sec  = sb.st_atim.tv_sec;
-		mt[0].tv_nsec = sb.st_atim.tv_nsec;
+		return 0;
+	}
 
-		mt[1].tv_sec  = sb.st_mtim.tv_sec;
-		mt[1].tv_nsec = sb.st_mtim.tv_nsec;
+	mt[0].tv_sec  = sb.st_atim.tv_sec;
+	mt[0].tv_nsec = sb.st_atim.tv_nsec;
 
-		if (S_ISDIR (sb.st_mode)) {
-			err = copy_dir (src, dst, reset_selinux, &sb, mt,
-			                old_uid, new_uid, old_gid, new_gid);
-		}
+	mt[1].tv_sec  = sb.st_mtim.tv_sec;
+	mt[1].tv_nsec = sb.st_mtim.tv_nsec;
 
-		/*
-		 * If the destination already exists do nothing.
-		 * This is after the copy_dir above to still iterate into subdirectories.
-		 */
-		if (fstatat(dst->dirfd, dst->name, &sb, AT_SYMLINK_NOFOLLOW) != -1) {
-			return 0;
-		}
+	if (S_ISDIR (sb.st_mode)) {
+		err = copy_dir (src, dst, reset_selinux, &sb, mt,
+		                old_uid, new_uid, old_gid, new_gid);
+	}
+
+	/*
+	 * If the destination already exists do nothing.
+	 * This is after the copy_dir above to still iterate into subdirectories.
+	 */
+	if (fstatat(dst->dirfd, dst->name, &sb, AT_SYMLINK_NOFOLLOW) != -1) {
+		return 0;
+	}
+
+	/*
+	 * Copy any symbolic links
+	 */
+
+	else if (S_ISLNK (sb.st_mode)) {
+		err = copy_symlink (src, dst, reset_selinux, &sb, mt,
+		                    old_uid, new_uid, old_gid, new_gid);
+	}
 
+	else {
 		/*
-		 * Copy any symbolic links
+		 * With a pool, a file with several links is
+		 * copied with the links locked, so that its other
+		 * links are created once it exists.
 		 */
+		bool locked = (NULL != pool);
 
-		else if (S_ISLNK (sb.st_mode)) {
-			err = copy_symlink (src, dst, reset_selinux, &sb, mt,
-			                    old_uid, new_uid, old_gid, new_gid);
+		if (locked) {
+			(void) pthread_mutex_lock (&pool->links_mutex);
 		}
 
 		/*
 		 * See if this is a previously copied link
 		 */
 
-		else if ((lp = check_link (src->full_path, &sb)) != NULL) {
+		lp = check_link (src->full_path, &sb);
+		if (locked && (NULL == lp) && (sb.st_nlink == 1)) {
+			(void) pthread_mutex_unlock (&pool->links_mutex);
+			locked = false;
+		}
+
+		if (NULL != lp) {
 			err = copy_hardlink (dst, reset_selinux, lp);
 		}
 
@@ -475,6 +731,10 @@ static int copy_entry (const struct path_info *src, const struct path_info *dst,
 			err = copy_file (src, dst, reset_selinux, &sb, mt,
 			                 old_uid, new_uid, old_gid, new_gid);
 		}
+
+		if (locked) {
+			(void) pthread_mutex_unlock (&pool->links_mutex);
+		}
 	}
 
 	return err;
@@ -514,6 +774,9 @@ static int copy_dir (const struct path_info *src, const struct path_info *dst,
          * but copy into it (recursively).
         */
         if (fstatat(dst->dirfd, dst->name, &dst_sb, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(dst_sb.st_mode)) {
+            if (queue_dir (src, dst, NULL) == 0) {
+                return 0;
+            }
             return (copy_tree_impl (src, dst, false, reset_selinux,
                            old_uid, new_uid, old_gid, new_gid) != 0);
         }
@@ -538,15 +801,263 @@ static int copy_dir (const struct path_info *src, const struct path_info *dst,
 	        && (attr_copy_path (src, dst, NULL, &ctx) != 0)
 	        && (errno != 0))
 #endif				/* WITH_ATTR */
-	    || (copy_tree_impl (src, dst, false, reset_selinux,
-	                   old_uid, new_uid, old_gid, new_gid) != 0)
-	    || (utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW) != 0)) {
+	   ) {
+		err = -1;
+	} else if (queue_dir (src, dst, mt) == 0) {
+		/* The times are set once the pool copied everything */
+	} else if (   (copy_tree_impl (src, dst, false, reset_selinux,
+	                               old_uid, new_uid, old_gid, new_gid) != 0)
+	           || (utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW) != 0)) {
 		err = -1;
 	}
 
 	return err;
 }
 
+/*
+ * queue_dir - queue the copy of the entries of a directory to the pool
+ *
+ *	If mt is not NULL, the times of dst are set to mt once the whole
+ *	tree is copied.
+ *
+ *	Return 0 if the directory was queued, 1 if it shall be copied by
+ *	the caller (no pool, no memory for the task, or the directories
+ *	could not be opened, e.g. no descriptor is left).
+ */
+static int queue_dir (const struct path_info *src, const struct path_info *dst,
+                      /*@null@*/const struct timespec mt[])
+{
+	struct copy_task *task;
+	char *src_path;
+	char *dst_path;
+	int src_fd, dst_fd;
+
+	if (NULL == pool) {
+		return 1;
+	}
+	(void) pthread_mutex_lock (&pool->mutex);
+	if (pool->open >= pool->max_open) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+		return 1;
+	}
+	pool->open++;
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	task = calloc (1, sizeof *task);
+	src_path = strdup (src->full_path);
+	dst_path = strdup (dst->full_path);
+	if ((NULL == task) || (NULL == src_path) || (NULL == dst_path)) {
+		free (task);
+		free (src_path);
+		free (dst_path);
+		goto fail;
+	}
+
+	/*
+	 * The descriptors of the parents are closed by then: the
+	 * directories are opened now, relative to them.
+	 */
+	src_fd = openat (src->dirfd, src->name,
+	                 O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	dst_fd = (src_fd < 0) ? -1
+	       : openat (dst->dirfd, dst->name,
+	                 O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (dst_fd < 0) {
+		if (src_fd >= 0) {
+			(void) close (src_fd);
+		}
+		free (task);
+		free (src_path);
+		free (dst_path);
+		goto fail;
+	}
+
+	task->src.full_path = src_path;
+	task->src.dirfd = src_fd;
+	task->src.name = ".";
+	task->dst.full_path = dst_path;
+	task->dst.dirfd = dst_fd;
+	task->dst.name = ".";
+	if (NULL != mt) {
+		task->mt[0] = mt[0];
+		task->mt[1] = mt[1];
+		task->set_times = true;
+	}
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	task->all_next = pool->tasks;
+	pool->tasks = task;
+	task->next = pool->queue;
+	pool->queue = task;
+	(void) pthread_cond_signal (&pool->cond);
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return 0;
+
+fail:
+	(void) pthread_mutex_lock (&pool->mutex);
+	pool->open--;
+	(void) pthread_mutex_unlock (&pool->mutex);
+	return 1;
+}
+
+/*
+ * copy_worker - copy the queued directories until the whole tree is
+ *               copied
+ */
+static /*@null@*/void *copy_worker (unused void *arg)
+{
+	assert (NULL != pool);
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	for (;;) {
+		struct copy_task *task;
+
+		while ((NULL == pool->queue) && (0 != pool->active)) {
+			(void) pthread_cond_wait (&pool->cond, &pool->mutex);
+		}
+		task = pool->queue;
+		if (NULL == task) {
+			/* Nothing queued, and nothing left to queue more */
+			break;
+		}
+		pool->queue = task->next;
+		pool->active++;
+		(void) pthread_mutex_unlock (&pool->mutex);
+
+		task->err = copy_tree_impl (&task->src, &task->dst, false,
+		                            pool->reset_selinux,
+		                            pool->old_uid, pool->new_uid,
+		                            pool->old_gid, pool->new_gid);
+		/*
+		 * Its entries are copied: set the times of the directory,
+		 * unless the copy failed (as after the recursive copy).
+		 */
+		if (task->set_times && (0 == task->err)) {
+			(void) futimens (task->dst.dirfd, task->mt);
+		}
+		(void) close (task->src.dirfd);
+		(void) close (task->dst.dirfd);
+
+		(void) pthread_mutex_lock (&pool->mutex);
+		pool->open--;
+		pool->active--;
+		if ((0 == pool->active) && (NULL == pool->queue)) {
+			(void) pthread_cond_broadcast (&pool->cond);
+		}
+	}
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return NULL;
+}
+
+/*
+ * copy_tree_jobs - copy_tree() with jobs threads
+ *
+ *	The result is the same as the one of copy_tree_impl(): each
+ *	directory stops at its first error, which is reported like in the
+ *	recursive copy.
+ *
+ *	Return 1 if the pool could not be started, so that the tree is
+ *	copied by the caller.
+ */
+static int copy_tree_jobs (const struct path_info *src,
+                           const struct path_info *dst,
+                           bool copy_root, bool reset_selinux,
+                           uid_t old_uid, uid_t new_uid,
+                           gid_t old_gid, gid_t new_gid,
+                           long jobs)
+{
+	struct copy_pool cp;
+	struct copy_task *task;
+	pthread_t *threads;
+	long nthreads = 0;
+	long i;
+	int err;
+
+	threads = calloc (jobs, sizeof *threads);
+	if (NULL == threads) {
+		return 1;
+	}
+	(void) memset (&cp, 0, sizeof cp);
+	if (pthread_mutex_init (&cp.mutex, NULL) != 0) {
+		free (threads);
+		return 1;
+	}
+	if (pthread_mutex_init (&cp.links_mutex, NULL) != 0) {
+		(void) pthread_mutex_destroy (&cp.mutex);
+		free (threads);
+		return 1;
+	}
+	if (pthread_cond_init (&cp.cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&cp.links_mutex);
+		(void) pthread_mutex_destroy (&cp.mutex);
+		free (threads);
+		return 1;
+	}
+	cp.reset_selinux = reset_selinux;
+	cp.max_open = dir_pool_fds () / 2;	/* src and dst */
+	cp.old_uid = old_uid;
+	cp.new_uid = new_uid;
+	cp.old_gid = old_gid;
+	cp.new_gid = new_gid;
+
+	/* The threads share the origin of the hard links */
+	src_orig = src->full_path;
+	dst_orig = dst->full_path;
+	pool = &cp;
+
+	if (copy_root) {
+		/* Creates dst and queues it */
+		err = copy_tree_impl (src, dst, true, reset_selinux,
+		                      old_uid, new_uid, old_gid, new_gid);
+	} else {
+		err = queue_dir (src, dst, NULL);
+		if (0 != err) {
+			err = copy_tree_impl (src, dst, false, reset_selinux,
+			                      old_uid, new_uid, old_gid, new_gid);
+		}
+	}
+
+	if (NULL != cp.queue) {
+		for (i = 1; i < jobs; i++) {
+			if (pthread_create (&threads[nthreads], NULL,
+			                    copy_worker, NULL) == 0) {
+				nthreads++;
+			}
+		}
+		/* This thread is one of the jobs */
+		(void) copy_worker (NULL);
+		for (i = 0; i < nthreads; i++) {
+			(void) pthread_join (threads[i], NULL);
+		}
+	}
+
+	pool = NULL;
+	src_orig = NULL;
+	dst_orig = NULL;
+	free_links ();
+
+	/* A directory which failed fails the copy, as a recursive copy */
+	while (NULL != cp.tasks) {
+		task = cp.tasks;
+		cp.tasks = task->all_next;
+		if (0 != task->err) {
+			err = -1;
+		}
+		free ((char *) task->src.full_path);
+		free ((char *) task->dst.full_path);
+		free (task);
+	}
+
+	(void) pthread_cond_destroy (&cp.cond);
+	(void) pthread_mutex_destroy (&cp.links_mutex);
+	(void) pthread_mutex_destroy (&cp.mutex);
+	free (threads);
+
+	return (0 == err) ? 0 : -1;
+}
+
 /*
  * readlink_malloc - wrapper for readlink
  *
@@ -623,10 +1134,11 @@ static int copy_symlink (const struct path_info *src, const struct path_info *ds
 	 * directory.
 	 */
 	if (strncmp (oldlink, src_orig, strlen (src_orig)) == 0) {
-		size_t len = strlen (dst_orig) + strlen (oldlink) - strlen (src_orig) + 1;
+		const char *new_orig = (NULL != link_orig) ? link_orig : dst_orig;
+		size_t len = strlen (new_orig) + strlen (oldlink) - strlen (src_orig) + 1;
 		char *dummy = (char *) xmalloc (len);
 		(void) snprintf (dummy, len, "%s%s",
-		                 dst_orig,
+		                 new_orig,
 		                 oldlink + strlen (src_orig));
 		free (oldlink);
 		oldlink = dummy;
@@ -775,88 +1287,311 @@ static ssize_t full_write(int fd, const void *buf, size_t count) {
 }
 
 /*
- * copy_file - copy a file
- *
- *	Copy a file from src to dst.
+ * copy_tree_set_progress - Report the progress of the next copies to cb,
+ *                          or stop reporting it if cb is NULL.
  *
- *	statp, mt, old_uid, new_uid, old_gid, and new_gid are used to set
- *	the access and modification and the access rights.
+ *	cb is called after each entry is copied. With HOME_COPY_JOBS, it is
+ *	called by the threads of the pool, one at a time.
+ */
+void copy_tree_set_progress (/*@null@*/tree_progress_cb cb)
+{
+	progress_cb = cb;
+}
+
+/*
+ * copy_tree_set_method - Copy the data of the files of the next copies
+ *                        with method.
  *
- *	Return 0 on success, -1 on error.
+ *	With COPY_METHOD_CLONE, the copy of a file fails if its data
+ *	cannot be cloned. With COPY_METHOD_RANGE, the data are still copied through
+ *	user space where copy_file_range() is not supported. This is used
+ *	to compare the methods on a file system.
  */
-static int copy_file (const struct path_info *src, const struct path_info *dst,
-                      bool reset_selinux,
-                      const struct stat *statp, const struct timespec mt[],
-                      uid_t old_uid, uid_t new_uid,
-                      gid_t old_gid, gid_t new_gid)
+void copy_tree_set_method (enum copy_method method)
 {
-	int err = 0;
-	int ifd;
-	int ofd;
+	copy_method = method;
+}
 
-	ifd = openat (src->dirfd, src->name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
-	if (ifd < 0) {
-		return -1;
+/*
+ * count_progress - count the entry path copied, and report the progress
+ */
+static void count_progress (const char *path, const struct stat *statp)
+{
+	if (NULL != pool) {
+		(void) pthread_mutex_lock (&pool->mutex);
 	}
-#ifdef WITH_SELINUX
-	if (set_selinux_file_context (dst->full_path, S_IFREG) != 0) {
-		(void) close (ifd);
-		return -1;
+	progress.files++;
+	if (S_ISREG (statp->st_mode)) {
+		progress.bytes += statp->st_size;
 	}
-#endif				/* WITH_SELINUX */
-	ofd = openat (dst->dirfd, dst->name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
-	if (   (ofd < 0)
-	    || (fchown_if_needed (ofd, statp,
-	                          old_uid, new_uid, old_gid, new_gid) != 0)
-	    || (fchmod (ofd, statp->st_mode & 07777) != 0)
-#ifdef WITH_ACL
-	    || (   (perm_copy_fd (src->full_path, ifd, dst->full_path, ofd, &ctx) != 0)
-	        && (errno != 0))
-#endif				/* WITH_ACL */
-#ifdef WITH_ATTR
-	/*
-	 * If the third parameter is NULL, all extended attributes
-	 * except those that define Access Control Lists are copied.
-	 * ACLs are excluded by default because copying them between
-	 * file systems with and without ACL support needs some
-	 * additional logic so that no unexpected permissions result.
-	 */
-	    || (   !reset_selinux
-	        && (attr_copy_fd (src->full_path, ifd, dst->full_path, ofd, NULL, &ctx) != 0)
-	        && (errno != 0))
-#endif				/* WITH_ATTR */
-	   ) {
-		if (ofd >= 0) {
-			(void) close (ofd);
-		}
-		(void) close (ifd);
-		return -1;
+	progress.path = path;
+	progress_cb (&progress);
+	if (NULL != pool) {
+		(void) pthread_mutex_unlock (&pool->mutex);
 	}
+}
 
-	while (true) {
-		char buf[8192];
-		ssize_t cnt;
+/*
+ * count_copy - count a file of size bytes copied with a method
+ */
+static void count_copy (unsigned long *counter, off_t size)
+{
+	if (NULL != pool) {
+		(void) pthread_mutex_lock (&pool->mutex);
+	}
+	(*counter)++;
+	copy_stats.bytes += size;
+	if (NULL != pool) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+	}
+}
 
-		cnt = read (ifd, buf, sizeof buf);
-		if (cnt < 0) {
+/*
+ * copy_segment - copy data between the current offsets of two files
+ *
+ *	Copy len bytes from ifd to ofd, or up to the end of ifd if len is
+ *	-1. copy_file_range() is used as long as it is supported for this
+ *	pair of files (*ranged), then the data are copied through *buf,
+ *	which is allocated when needed.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_segment (int ifd, int ofd, off_t len,
+                         bool *ranged, char **buf)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	while (*ranged && (0 != len)) {
+		size_t count = ((len < 0) || (len > 0x40000000)) ? 0x40000000
+		                                                 : (size_t) len;
+		ssize_t n;
+
+		n = copy_file_range (ifd, NULL, ofd, NULL, count, 0);
+		if (n < 0) {
 			if (errno == EINTR) {
 				continue;
 			}
-			(void) close (ofd);
-			(void) close (ifd);
-			return -1;
-		}
-		if (cnt == 0) {
+			if (   (errno != EXDEV)
+			    && (errno != ENOSYS)
+			    && (errno != EINVAL)
+			    && (errno != EOPNOTSUPP)) {
+				return -1;
+			}
+			/* Not supported here: continue through user space */
+			*ranged = false;
 			break;
 		}
+		if (0 == n) {
+			/* End of file */
+			return 0;
+		}
+		if (len > 0) {
+			len -= n;
+		}
+	}
+#endif				/* HAVE_COPY_FILE_RANGE */
 
-		if (full_write (ofd, buf, cnt) < 0) {
-			(void) close (ofd);
-			(void) close (ifd);
+	if ((0 != len) && (NULL == *buf)) {
+		*buf = malloc (COPY_BUFSIZE);
+		if (NULL == *buf) {
+			return -1;
+		}
+	}
+	while (0 != len) {
+		size_t count = ((len < 0) || (len > COPY_BUFSIZE)) ? COPY_BUFSIZE
+		                                                   : (size_t) len;
+		ssize_t cnt;
+
+		cnt = read (ifd, *buf, count);
+		if (cnt < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (cnt == 0) {
+			break;
+		}
+
+		if (full_write (ofd, *buf, cnt) < 0) {
+			return -1;
+		}
+		if (len > 0) {
+			len -= cnt;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * copy_sparse - copy the data segments of a sparse file
+ *
+ *	The holes of ifd are not written, so that they remain holes in
+ *	ofd.
+ *
+ *	Return 0 on success, 1 if the holes cannot be found on this file
+ *	system (nothing was copied), -1 on error.
+ */
+static int copy_sparse (int ifd, int ofd, const struct stat *statp,
+                        bool *ranged, char **buf)
+{
+#if defined(SEEK_DATA) && defined(SEEK_HOLE)
+	off_t data = 0;
+	off_t hole;
+
+	for (;;) {
+		data = lseek (ifd, data, SEEK_DATA);
+		if ((off_t) -1 == data) {
+			if (errno == ENXIO) {
+				/* Only a hole up to the end of the file */
+				break;
+			}
+			if ((errno == EINVAL) && (0 == data)) {
+				return 1;
+			}
+			return -1;
+		}
+		hole = lseek (ifd, data, SEEK_HOLE);
+		if (   ((off_t) -1 == hole)
+		    || (lseek (ifd, data, SEEK_SET) != data)
+		    || (lseek (ofd, data, SEEK_SET) != data)
+		    || (copy_segment (ifd, ofd, hole - data, ranged, buf) != 0)) {
+			return -1;
+		}
+		data = hole;
+	}
+
+	/* A hole at the end of the file is not written */
+	if (ftruncate (ofd, statp->st_size) != 0) {
+		return -1;
+	}
+	count_copy (&copy_stats.sparse, statp->st_size);
+	return 0;
+#else				/* !SEEK_DATA || !SEEK_HOLE */
+	return 1;
+#endif				/* !SEEK_DATA || !SEEK_HOLE */
+}
+
+/*
+ * copy_data - copy the content of a file
+ *
+ *	The fastest method supported by the file systems is used: the data
+ *	blocks are shared when the destination file system can clone them,
+ *	otherwise they are copied by the kernel with copy_file_range(),
+ *	or through a large buffer.
+ *	Sparse files keep their holes. copy_tree_set_method() can force
+ *	one of these methods.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_data (int ifd, int ofd, const struct stat *statp)
+{
+	bool ranged = (COPY_METHOD_BUFFER != copy_method);
+	char *buf = NULL;
+	int ret;
+
+	if (   (COPY_METHOD_AUTO == copy_method)
+	    || (COPY_METHOD_CLONE == copy_method)) {
+#ifdef FICLONE
+		if (ioctl (ofd, FICLONE, ifd) == 0) {
+			count_copy (&copy_stats.cloned, statp->st_size);
+			return 0;
+		}
+#else				/* !FICLONE */
+		errno = EOPNOTSUPP;
+#endif				/* !FICLONE */
+		if (COPY_METHOD_CLONE == copy_method) {
 			return -1;
 		}
 	}
 
+	ret = 1;
+	if ((statp->st_blocks * 512) < statp->st_size) {
+		ret = copy_sparse (ifd, ofd, statp, &ranged, &buf);
+	}
+	if (1 == ret) {
+		ret = copy_segment (ifd, ofd, -1, &ranged, &buf);
+	}
+
+	if (0 == ret) {
+		if (NULL != buf) {
+			count_copy (&copy_stats.buffered, statp->st_size);
+		} else {
+			count_copy (&copy_stats.ranged, statp->st_size);
+		}
+	}
+	free (buf);
+	return ret;
+}
+
+/*
+ * copy_file - copy a file
+ *
+ *	Copy a file from src to dst.
+ *
+ *	statp, mt, old_uid, new_uid, old_gid, and new_gid are used to set
+ *	the access and modification and the access rights.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_file (const struct path_info *src, const struct path_info *dst,
+                      bool reset_selinux,
+                      const struct stat *statp, const struct timespec mt[],
+                      uid_t old_uid, uid_t new_uid,
+                      gid_t old_gid, gid_t new_gid)
+{
+	int err = 0;
+	int ifd;
+	int ofd;
+
+	ifd = openat (src->dirfd, src->name, O_RDONLY|O_NOFOLLOW|O_CLOEXEC);
+	if (ifd < 0) {
+		return -1;
+	}
+#ifdef WITH_SELINUX
+	if (set_selinux_file_context (dst->full_path, S_IFREG) != 0) {
+		(void) close (ifd);
+		return -1;
+	}
+#endif				/* WITH_SELINUX */
+	ofd = openat (dst->dirfd, dst->name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (   (ofd < 0)
+	    || (fchown_if_needed (ofd, statp,
+	                          old_uid, new_uid, old_gid, new_gid) != 0)
+	    || (fchmod (ofd, statp->st_mode & 07777) != 0)
+#ifdef WITH_ACL
+	    || (   (perm_copy_fd (src->full_path, ifd, dst->full_path, ofd, &ctx) != 0)
+	        && (errno != 0))
+#endif				/* WITH_ACL */
+#ifdef WITH_ATTR
+	/*
+	 * If the third parameter is NULL, all extended attributes
+	 * except those that define Access Control Lists are copied.
+	 * ACLs are excluded by default because copying them between
+	 * file systems with and without ACL support needs some
+	 * additional logic so that no unexpected permissions result.
+	 */
+	    || (   !reset_selinux
+	        && (attr_copy_fd (src->full_path, ifd, dst->full_path, ofd, NULL, &ctx) != 0)
+	        && (errno != 0))
+#endif				/* WITH_ATTR */
+	   ) {
+		if (ofd >= 0) {
+			(void) close (ofd);
+		}
+		(void) close (ifd);
+		return -1;
+	}
+
+	PROBE2 (copy__file__start, src->full_path, statp->st_size);
+	err = copy_data (ifd, ofd, statp);
+	PROBE2 (copy__file__done, src->full_path, err);
+	if (err != 0) {
+		(void) close (ofd);
+		(void) close (ifd);
+		return -1;
+	}
+
 	(void) close (ifd);
 	if (close (ofd) != 0) {
 		return -1;
@@ -901,31 +1636,46 @@ static int chown_function ## _if_needed (type_dst dst,                 \
 
 def_chown_if_needed (fchown, int)
 
-static int chownat_if_needed (const struct path_info *dst,
-							  const struct stat *statp,
-                              uid_t old_uid, uid_t new_uid,
-                              gid_t old_gid, gid_t new_gid)
+/*
+ * copy_owner - the owner and group of the copy of a file of status statp
+ */
+static void copy_owner (const struct stat *statp,
+                        uid_t old_uid, uid_t new_uid,
+                        gid_t old_gid, gid_t new_gid,
+                        /*@out@*/uid_t *uid, /*@out@*/gid_t *gid)
 {
-	uid_t tmpuid = (uid_t) -1;
-	gid_t tmpgid = (gid_t) -1;
+	*uid = (uid_t) -1;
+	*gid = (gid_t) -1;
 
 	/* Use new_uid if old_uid is set to -1 or if the file was
 	 * owned by the user. */
 	if (((uid_t) -1 == old_uid) || (statp->st_uid == old_uid)) {
-		tmpuid = new_uid;
+		*uid = new_uid;
 	}
 	/* Otherwise, or if new_uid was set to -1, we keep the same
 	 * owner. */
-	if ((uid_t) -1 == tmpuid) {
-		tmpuid = statp->st_uid;
+	if ((uid_t) -1 == *uid) {
+		*uid = statp->st_uid;
 	}
 
 	if (((gid_t) -1 == old_gid) || (statp->st_gid == old_gid)) {
-		tmpgid = new_gid;
+		*gid = new_gid;
 	}
-	if ((gid_t) -1 == tmpgid) {
-		tmpgid = statp->st_gid;
+	if ((gid_t) -1 == *gid) {
+		*gid = statp->st_gid;
 	}
+}
+
+static int chownat_if_needed (const struct path_info *dst,
+							  const struct stat *statp,
+                              uid_t old_uid, uid_t new_uid,
+                              gid_t old_gid, gid_t new_gid)
+{
+	uid_t tmpuid;
+	gid_t tmpgid;
+
+	copy_owner (statp, old_uid, new_uid, old_gid, new_gid,
+	            &tmpuid, &tmpgid);
 
 	return fchownat (dst->dirfd, dst->name, tmpuid, tmpgid, AT_SYMLINK_NOFOLLOW);
 }
@@ -963,6 +1713,1005 @@ int copy_tree (const char *src_root, const char *dst_root,
 		.name = dst_root
 	};
 
-	return copy_tree_impl(&src, &dst, copy_root, reset_selinux,
-						  old_uid, new_uid, old_gid, new_gid);
+	long jobs = getdef_long ("HOME_COPY_JOBS", 1);
+	int err = 1;
+	struct timespec start;
+
+	timing_start (&start);
+	(void) memset (&copy_stats, 0, sizeof copy_stats);
+	(void) memset (&progress, 0, sizeof progress);
+	if (jobs > 1024) {
+		jobs = 1024;
+	}
+	if (jobs > 1) {
+		err = copy_tree_jobs (&src, &dst, copy_root, reset_selinux,
+		                      old_uid, new_uid, old_gid, new_gid, jobs);
+	}
+	if (1 == err) {
+		err = copy_tree_impl(&src, &dst, copy_root, reset_selinux,
+							 old_uid, new_uid, old_gid, new_gid);
+	}
+
+	timing_stop ("copy_tree", &start);
+	metrics_add (METRICS_COPY_BYTES, NULL, copy_stats.bytes);
+
+	SYSLOG ((LOG_DEBUG,
+	         "copied %s to %s: %lu files cloned, %lu copied by the kernel, %lu buffered, %lu sparse",
+	         src_root, dst_root, copy_stats.cloned, copy_stats.ranged,
+	         copy_stats.buffered, copy_stats.sparse));
+
+	return err;
+}
+
+static bool ctime_since (const struct stat *sb, const struct timespec *t)
+{
+	return    (sb->st_ctim.tv_sec > t->tv_sec)
+	       || (   (sb->st_ctim.tv_sec == t->tv_sec)
+	           && (sb->st_ctim.tv_nsec >= t->tv_nsec));
+}
+
+/*
+ * entry_changed - check if the copy of an entry of status src, whose copy
+ *                 has the status dst, shall be copied again
+ *
+ *	The copies keep the modification time of their source, so an entry
+ *	changed if its type, its modification time, or the size of a
+ *	regular file differ.
+ *
+ *	The modification time can be set back by the owner, and a file
+ *	rewritten with the same size, but its ctime is always updated: an
+ *	entry also changed if its ctime is not older than the start of the
+ *	previous pass (sync_since), or, for a copy made by another process,
+ *	than the ctime of its copy.
+ */
+static bool entry_changed (const struct stat *src, const struct stat *dst)
+{
+	if ((src->st_mode & S_IFMT) != (dst->st_mode & S_IFMT)) {
+		return true;
+	}
+	if (S_ISDIR (src->st_mode)) {
+		return false;
+	}
+	if (ctime_since (src, (NULL != sync_since) ? sync_since : &dst->st_ctim)) {
+		return true;
+	}
+	return    (src->st_mtim.tv_sec != dst->st_mtim.tv_sec)
+	       || (src->st_mtim.tv_nsec != dst->st_mtim.tv_nsec)
+	       || (S_ISREG (src->st_mode) && (src->st_size != dst->st_size));
+}
+
+/*
+ * remove_entry - remove the entry dst, of status statp
+ *
+ *	The owner of the tree may still be logged in: a directory is
+ *	removed relative to the descriptor of its parent, so that a
+ *	directory replaced by a symbolic link is not followed.
+ */
+static int remove_entry (const struct path_info *dst, const struct stat *statp)
+{
+	if (S_ISDIR (statp->st_mode)) {
+		if (remove_tree_at (dst->dirfd, dst->name, false) != 0) {
+			return -1;
+		}
+		return unlinkat (dst->dirfd, dst->name, AT_REMOVEDIR);
+	}
+	return unlinkat (dst->dirfd, dst->name, 0);
+}
+
+/*
+ * sync_attrs - set the owner, the mode and the times of the copy dst of
+ *              an entry of status statp which was not copied again
+ */
+static int sync_attrs (const struct path_info *dst,
+                       const struct stat *statp, const struct stat *dst_sb,
+                       uid_t old_uid, uid_t new_uid,
+                       gid_t old_gid, gid_t new_gid)
+{
+	struct timespec mt[2];
+	uid_t uid;
+	gid_t gid;
+
+	copy_owner (statp, old_uid, new_uid, old_gid, new_gid, &uid, &gid);
+	if (   ((dst_sb->st_uid != uid) || (dst_sb->st_gid != gid))
+	    && (fchownat (dst->dirfd, dst->name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)) {
+		return -1;
+	}
+	if (S_ISLNK (statp->st_mode)) {
+		return 0;
+	}
+	if (   ((dst_sb->st_mode & 07777) != (statp->st_mode & 07777))
+	    && (fchmodat (dst->dirfd, dst->name, statp->st_mode & 07777, AT_SYMLINK_NOFOLLOW) != 0)) {
+		return -1;
+	}
+	if (S_ISDIR (statp->st_mode)) {
+		/* The updates of the directory changed its times */
+		mt[0] = statp->st_atim;
+		mt[1] = statp->st_mtim;
+		return utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW);
+	}
+	return 0;
+}
+
+/*
+ * sync_dir - bring the copy dst of the directory src up to date
+ *
+ *	*changed is increased by the number of entries copied again or
+ *	removed.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int sync_dir (const struct path_info *src, const struct path_info *dst,
+                     bool reset_selinux,
+                     uid_t old_uid, uid_t new_uid,
+                     gid_t old_gid, gid_t new_gid,
+                     unsigned long *changed)
+{
+	const struct dirent *ent;
+	DIR *dir, *dst_dir;
+	int src_fd, dst_fd;
+	int err = 0;
+
+	src_fd = openat (src->dirfd, src->name, O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (src_fd < 0) {
+		return -1;
+	}
+	dst_fd = openat (dst->dirfd, dst->name, O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (dst_fd < 0) {
+		(void) close (src_fd);
+		return -1;
+	}
+	dir = fdopendir (src_fd);
+	if (NULL == dir) {
+		(void) close (src_fd);
+		(void) close (dst_fd);
+		return -1;
+	}
+
+	/* Copy the new and the changed entries */
+	while ((0 == err) && (ent = readdir (dir)) != NULL) {
+		struct path_info src_entry, dst_entry;
+		struct stat sb, dst_sb;
+		char *src_name, *dst_name;
+		size_t src_len, dst_len;
+		bool exists;
+
+		if (   (strcmp (ent->d_name, ".") == 0)
+		    || (strcmp (ent->d_name, "..") == 0)) {
+			continue;
+		}
+		/* If we cannot stat the file, do not care. */
+		if (fstatat (src_fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		src_len = strlen (src->full_path) + strlen (ent->d_name) + 2;
+		dst_len = strlen (dst->full_path) + strlen (ent->d_name) + 2;
+		src_name = xmalloc (src_len);
+		dst_name = xmalloc (dst_len);
+		(void) snprintf (src_name, src_len, "%s/%s",
+		                 src->full_path, ent->d_name);
+		(void) snprintf (dst_name, dst_len, "%s/%s",
+		                 dst->full_path, ent->d_name);
+		src_entry.full_path = src_name;
+		src_entry.dirfd = src_fd;
+		src_entry.name = ent->d_name;
+		dst_entry.full_path = dst_name;
+		dst_entry.dirfd = dst_fd;
+		dst_entry.name = ent->d_name;
+
+		exists = (fstatat (dst_fd, ent->d_name, &dst_sb, AT_SYMLINK_NOFOLLOW) == 0);
+		if (exists && entry_changed (&sb, &dst_sb)) {
+			if (remove_entry (&dst_entry, &dst_sb) != 0) {
+				err = -1;
+			}
+			exists = false;
+		}
+		if (0 != err) {
+			/* The entry could not be removed */
+		} else if (!exists) {
+			err = copy_entry (&src_entry, &dst_entry, &sb,
+			                  reset_selinux,
+			                  old_uid, new_uid, old_gid, new_gid);
+			(*changed)++;
+		} else if (S_ISDIR (sb.st_mode)) {
+			err = sync_dir (&src_entry, &dst_entry, reset_selinux,
+			                old_uid, new_uid, old_gid, new_gid,
+			                changed);
+			if (0 == err) {
+				err = sync_attrs (&dst_entry, &sb, &dst_sb,
+				                  old_uid, new_uid, old_gid, new_gid);
+			}
+		} else {
+			err = sync_attrs (&dst_entry, &sb, &dst_sb,
+			                  old_uid, new_uid, old_gid, new_gid);
+		}
+		if ((0 == err) && (NULL != progress_cb)) {
+			count_progress (src_name, &sb);
+		}
+		free (src_name);
+		free (dst_name);
+	}
+
+	/* Remove the entries which were removed from src */
+	dst_dir = (0 == err) ? fdopendir (dst_fd) : NULL;
+	if (NULL != dst_dir) {
+		dst_fd = -1;	/* closed with dst_dir */
+	} else if (0 == err) {
+		err = -1;
+	}
+	while ((0 == err) && (ent = readdir (dst_dir)) != NULL) {
+		struct path_info dst_entry;
+		struct stat sb;
+		char *dst_name;
+		size_t dst_len;
+
+		if (   (strcmp (ent->d_name, ".") == 0)
+		    || (strcmp (ent->d_name, "..") == 0)
+		    || (fstatat (src_fd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) == 0)
+		    || (ENOENT != errno)
+		    || (fstatat (dirfd (dst_dir), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0)) {
+			continue;
+		}
+		dst_len = strlen (dst->full_path) + strlen (ent->d_name) + 2;
+		dst_name = xmalloc (dst_len);
+		(void) snprintf (dst_name, dst_len, "%s/%s",
+		                 dst->full_path, ent->d_name);
+		dst_entry.full_path = dst_name;
+		dst_entry.dirfd = dirfd (dst_dir);
+		dst_entry.name = ent->d_name;
+		if (remove_entry (&dst_entry, &sb) != 0) {
+			err = -1;
+		}
+		(*changed)++;
+		free (dst_name);
+	}
+
+	if (NULL != dst_dir) {
+		(void) closedir (dst_dir);
+	}
+	if (dst_fd >= 0) {
+		(void) close (dst_fd);
+	}
+	(void) closedir (dir);
+	return err;
+}
+
+/*
+ * sync_tree - bring a copy of a directory tree up to date
+ *
+ *	dst_root is a copy of src_root made by a previous sync_tree(),
+ *	which may have been interrupted. Only the entries which changed
+ *	since (see entry_changed()) are copied again, and the entries
+ *	which were removed from src_root are removed from dst_root. If
+ *	dst_root does not exist, the whole tree is copied.
+ *
+ *	since is the time (of CLOCK_REALTIME_COARSE, which is never after
+ *	the ctime of a later change) at which the previous sync_tree() of
+ *	dst_root started, or NULL if it was not made by this process.
+ *
+ *	The symlinks to the entries of src_root are made to point to the
+ *	same entries in link_root, the final location of the copy.
+ *
+ *	The owners are set as with copy_tree(). *changed is set to the
+ *	number of entries which were copied or removed.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+int sync_tree (const char *src_root, const char *dst_root,
+               const char *link_root, bool reset_selinux,
+               uid_t old_uid, uid_t new_uid,
+               gid_t old_gid, gid_t new_gid,
+               /*@null@*/const struct timespec *since,
+               /*@out@*/unsigned long *changed)
+{
+	const struct path_info src = {
+		.full_path = src_root,
+		.dirfd = AT_FDCWD,
+		.name = src_root
+	};
+	const struct path_info dst = {
+		.full_path = dst_root,
+		.dirfd = AT_FDCWD,
+		.name = dst_root
+	};
+	struct stat sb, dst_sb;
+	struct timespec start;
+	int err;
+
+	*changed = 0;
+	if (lstat (src_root, &sb) != 0) {
+		return -1;
+	}
+
+	timing_start (&start);
+	(void) memset (&copy_stats, 0, sizeof copy_stats);
+	(void) memset (&progress, 0, sizeof progress);
+	src_orig = src_root;
+	dst_orig = dst_root;
+	link_orig = link_root;
+	sync_since = since;
+
+	if (lstat (dst_root, &dst_sb) != 0) {
+		err = copy_tree_impl (&src, &dst, true, reset_selinux,
+		                      old_uid, new_uid, old_gid, new_gid);
+		*changed = 1;
+	} else if (!S_ISDIR (dst_sb.st_mode) || (!S_ISDIR (sb.st_mode))) {
+		errno = ENOTDIR;
+		err = -1;
+	} else {
+		err = sync_dir (&src, &dst, reset_selinux,
+		                old_uid, new_uid, old_gid, new_gid, changed);
+		if (0 == err) {
+			err = sync_attrs (&dst, &sb, &dst_sb,
+			                  old_uid, new_uid, old_gid, new_gid);
+		}
+	}
+
+	src_orig = NULL;
+	dst_orig = NULL;
+	link_orig = NULL;
+	sync_since = NULL;
+	free_links ();
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		err = -1;
+	}
+#endif				/* WITH_SELINUX */
+
+	timing_stop ("sync_tree", &start);
+
+	return err;
+}
+
+/*
+ * The skeleton directories are copied into each new home. Instead of
+ * walking them again for each home, useradd keeps a manifest of each
+ * skeleton: its entries, in the order of the walk, with their status,
+ * the targets of the symlinks, the contents of the small files, and
+ * whether they have extended attributes (and ACLs).
+ *
+ * Before a new home is created from a manifest, the entries of the
+ * skeleton are stated again. Any change of an entry changes its ctime,
+ * and the entries added or removed change the mtime of their directory,
+ * so the manifest is built again when one of them differs.
+ */
+
+#define SKEL_ROOT	SIZE_MAX
+#define SKEL_DATA_MAX	(64 * 1024)		/* per file */
+#define SKEL_CACHE_MAX	(4 * 1024 * 1024)	/* per skeleton */
+
+struct skel_entry {
+	char *name;		/* in its directory */
+	char *path;		/* relative to the skeleton */
+	size_t parent;		/* index of its directory, or SKEL_ROOT */
+	size_t link;		/* first entry with the same inode */
+	struct stat sb;
+	/*@null@*/char *target;	/* of a symlink */
+	/*@null@*/char *data;	/* of a small file, NULL if not cached */
+	bool has_xattrs;
+};
+
+struct skel_manifest {
+	char *root;
+	struct stat sb;
+	/*@owned@*/ /*@null@*/struct skel_entry *entries;
+	size_t count;
+	size_t depth;		/* of the deepest directory */
+	size_t cached;		/* bytes of data */
+	/*@owned@*/ /*@null@*/struct skel_manifest *next;
+};
+static /*@owned@*/ /*@null@*/struct skel_manifest *manifests = NULL;
+
+static void free_manifest_entries (struct skel_manifest *m)
+{
+	size_t i;
+
+	for (i = 0; i < m->count; i++) {
+		free (m->entries[i].name);
+		free (m->entries[i].path);
+		free (m->entries[i].target);
+		free (m->entries[i].data);
+	}
+	free (m->entries);
+	m->entries = NULL;
+	m->count = 0;
+	m->depth = 0;
+	m->cached = 0;
+}
+
+static bool same_status (const struct stat *a, const struct stat *b)
+{
+	return    (a->st_dev == b->st_dev)
+	       && (a->st_ino == b->st_ino)
+	       && (a->st_mode == b->st_mode)
+	       && (a->st_size == b->st_size)
+	       && (a->st_mtim.tv_sec == b->st_mtim.tv_sec)
+	       && (a->st_mtim.tv_nsec == b->st_mtim.tv_nsec)
+	       && (a->st_ctim.tv_sec == b->st_ctim.tv_sec)
+	       && (a->st_ctim.tv_nsec == b->st_ctim.tv_nsec);
+}
+
+/*
+ * read_small_file - read the data of the small file name of dirfd
+ *
+ *	Return NULL if the file cannot be read or changed.
+ */
+static /*@null@*/char *read_small_file (int dirfd, const char *name,
+                                        const struct stat *statp)
+{
+	size_t size = statp->st_size;
+	size_t len = 0;
+	char *data;
+	int fd;
+
+	fd = openat (dirfd, name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+	data = malloc (size + 1);
+	if (NULL == data) {
+		(void) close (fd);
+		return NULL;
+	}
+	while (len <= size) {
+		ssize_t n = read (fd, data + len, size + 1 - len);
+
+		if ((n < 0) && (EINTR == errno)) {
+			continue;
+		}
+		if (n <= 0) {
+			break;
+		}
+		len += n;
+	}
+	(void) close (fd);
+	if (len != size) {
+		free (data);
+		return NULL;
+	}
+	return data;
+}
+
+/*
+ * scan_skel - add the entries of the directory rel of the skeleton to
+ *             the manifest
+ *
+ *	dirfd is the directory, parent its index in the manifest, and
+ *	depth its depth.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int scan_skel (struct skel_manifest *m, int dirfd,
+                      /*@null@*/const char *rel, size_t parent, size_t depth)
+{
+	const struct dirent *ent;
+	DIR *dir;
+	int err = 0;
+
+	dir = fdopendir (dirfd);
+	if (NULL == dir) {
+		(void) close (dirfd);
+		return -1;
+	}
+	if (depth > m->depth) {
+		m->depth = depth;
+	}
+	while ((0 == err) && (ent = readdir (dir)) != NULL) {
+		struct skel_entry *e;
+		struct stat sb;
+		size_t i, len;
+
+		if (   (strcmp (ent->d_name, ".") == 0)
+		    || (strcmp (ent->d_name, "..") == 0)) {
+			continue;
+		}
+		/* If we cannot stat the file, do not care. */
+		if (fstatat (dirfd, ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+
+		if (0 == (m->count % 64)) {
+			e = realloc (m->entries, (m->count + 64) * sizeof *e);
+			if (NULL == e) {
+				err = -1;
+				break;
+			}
+			m->entries = e;
+		}
+		e = &m->entries[m->count];
+		memzero (e, sizeof *e);
+		m->count++;
+		e->name = xstrdup (ent->d_name);
+		len = strlen (m->root) + strlen (ent->d_name) + 2;
+		if (NULL != rel) {
+			len += strlen (rel) + 1;
+		}
+		e->path = xmalloc (len);
+		if (NULL != rel) {
+			(void) snprintf (e->path, len, "%s/%s", rel, ent->d_name);
+		} else {
+			(void) snprintf (e->path, len, "%s", ent->d_name);
+		}
+		e->parent = parent;
+		e->link = m->count - 1;
+		e->sb = sb;
+
+		/* The other links of a file are linked to its first copy */
+		if (!S_ISDIR (sb.st_mode) && (sb.st_nlink > 1)) {
+			for (i = 0; i < m->count - 1; i++) {
+				if (   (m->entries[i].sb.st_dev == sb.st_dev)
+				    && (m->entries[i].sb.st_ino == sb.st_ino)) {
+					e->link = i;
+					break;
+				}
+			}
+		}
+
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+		{
+			char *full = xmalloc (len);
+
+			(void) snprintf (full, len, "%s/%s", m->root, e->path);
+			e->has_xattrs = (llistxattr (full, NULL, 0) != 0);
+			free (full);
+		}
+#endif				/* WITH_ACL || WITH_ATTR */
+
+		if (S_ISLNK (sb.st_mode)) {
+			char *full = xmalloc (len);
+
+			(void) snprintf (full, len, "%s/%s", m->root, e->path);
+			e->target = readlink_malloc (full);
+			free (full);
+			if (NULL == e->target) {
+				err = -1;
+			}
+		} else if (   S_ISREG (sb.st_mode)
+		           && (e->link == m->count - 1)
+		           && (sb.st_size <= SKEL_DATA_MAX)
+		           && (m->cached + sb.st_size <= SKEL_CACHE_MAX)) {
+			e->data = read_small_file (dirfd, ent->d_name, &sb);
+			if (NULL == e->data) {
+				err = -1;
+			} else {
+				m->cached += sb.st_size;
+			}
+		} else if (S_ISDIR (sb.st_mode)) {
+			int fd = openat (dirfd, ent->d_name,
+			                 O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+
+			if (fd < 0) {
+				err = -1;
+			} else {
+				/* e moves with the entries */
+				char *path = xstrdup (e->path);
+
+				err = scan_skel (m, fd, path, m->count - 1, depth + 1);
+				free (path);
+			}
+		}
+	}
+	(void) closedir (dir);
+	return err;
+}
+
+/*
+ * skel_changed - check if the skeleton of a manifest changed
+ */
+static bool skel_changed (const struct skel_manifest *m)
+{
+	struct stat sb;
+	size_t i;
+	int fd;
+
+	if (   (stat (m->root, &sb) != 0)
+	    || !same_status (&sb, &m->sb)) {
+		return true;
+	}
+	fd = open (m->root, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return true;
+	}
+	for (i = 0; i < m->count; i++) {
+		if (   (fstatat (fd, m->entries[i].path, &sb, AT_SYMLINK_NOFOLLOW) != 0)
+		    || !same_status (&sb, &m->entries[i].sb)) {
+			break;
+		}
+	}
+	(void) close (fd);
+	return (i != m->count);
+}
+
+/*
+ * get_manifest - return the manifest of the skeleton root, built again if
+ *                the skeleton changed
+ *
+ *	Return NULL if the skeleton cannot be read.
+ */
+static /*@null@*/ /*@dependent@*/struct skel_manifest *get_manifest (const char *root)
+{
+	struct skel_manifest *m;
+	int fd;
+
+	for (m = manifests; NULL != m; m = m->next) {
+		if (strcmp (m->root, root) == 0) {
+			break;
+		}
+	}
+	if (NULL == m) {
+		m = xmalloc (sizeof *m);
+		memzero (m, sizeof *m);
+		m->root = xstrdup (root);
+		m->next = manifests;
+		manifests = m;
+	} else if ((NULL != m->entries) && !skel_changed (m)) {
+		return m;
+	}
+
+	free_manifest_entries (m);
+	fd = open (root, O_DIRECTORY | O_RDONLY | O_CLOEXEC);
+	if (   (fd < 0)
+	    || (fstat (fd, &m->sb) != 0)) {
+		if (fd >= 0) {
+			(void) close (fd);
+		}
+		return NULL;
+	}
+	if (scan_skel (m, fd, NULL, SKEL_ROOT, 0) != 0) {
+		free_manifest_entries (m);
+		return NULL;
+	}
+	return m;
+}
+
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+/*
+ * copy_skel_xattrs - copy the ACLs and extended attributes of the entry
+ *                    src_path of a skeleton to dst
+ */
+static int copy_skel_xattrs (const char *src_path, const struct path_info *dst,
+                             unused bool reset_selinux)
+{
+	const struct path_info src = {
+		.full_path = src_path,
+		.dirfd = AT_FDCWD,
+		.name = src_path
+	};
+
+#ifdef WITH_ACL
+	if (   (perm_copy_path (&src, dst, &ctx) != 0)
+	    && (errno != 0)) {
+		return -1;
+	}
+#endif				/* WITH_ACL */
+#ifdef WITH_ATTR
+	if (   !reset_selinux
+	    && (attr_copy_path (&src, dst, NULL, &ctx) != 0)
+	    && (errno != 0)) {
+		return -1;
+	}
+#endif				/* WITH_ATTR */
+	return 0;
+}
+#endif				/* WITH_ACL || WITH_ATTR */
+
+/*
+ * create_skel_entry - create the entry e of a manifest in the directory
+ *                     dst->dirfd
+ *
+ *	src_path is the path of the entry in the skeleton, and dst_root
+ *	the new home. copied maps the first link of each file to the
+ *	entry which was copied for it.
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int create_skel_entry (const struct skel_manifest *m, size_t i,
+                              const char *src_path, const struct path_info *dst,
+                              const char *dst_root, size_t *copied,
+                              unused bool reset_selinux, uid_t uid, gid_t gid)
+{
+	const struct skel_entry *e = &m->entries[i];
+	struct timespec mt[2];
+	int ofd, ifd;
+
+	mt[0] = e->sb.st_atim;
+	mt[1] = e->sb.st_mtim;
+
+	if (S_ISLNK (e->sb.st_mode)) {
+		const char *target = e->target;
+		char *dummy = NULL;
+		int err = 0;
+
+		/* Links to the skeleton itself point into the new home */
+		if (strncmp (target, m->root, strlen (m->root)) == 0) {
+			size_t len = strlen (dst_root) + strlen (target) - strlen (m->root) + 1;
+
+			dummy = xmalloc (len);
+			(void) snprintf (dummy, len, "%s%s",
+			                 dst_root, target + strlen (m->root));
+			target = dummy;
+		}
+#ifdef WITH_SELINUX
+		if (set_selinux_file_context (dst->full_path, S_IFLNK) != 0) {
+			free (dummy);
+			return -1;
+		}
+#endif				/* WITH_SELINUX */
+		if (   (symlinkat (target, dst->dirfd, dst->name) != 0)
+		    || (fchownat (dst->dirfd, dst->name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+		    || (utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW) != 0)) {
+			err = -1;
+		}
+		free (dummy);
+		return err;
+	}
+
+	if (SIZE_MAX != copied[e->link]) {
+		size_t len = strlen (dst_root) + strlen (m->entries[copied[e->link]].path) + 2;
+		char *name = xmalloc (len);
+		int err;
+
+		(void) snprintf (name, len, "%s/%s",
+		                 dst_root, m->entries[copied[e->link]].path);
+		err = linkat (AT_FDCWD, name, dst->dirfd, dst->name, 0);
+		free (name);
+		return err;
+	}
+	copied[e->link] = i;
+
+#ifdef WITH_SELINUX
+	if (set_selinux_file_context (dst->full_path, e->sb.st_mode & S_IFMT) != 0) {
+		return -1;
+	}
+#endif				/* WITH_SELINUX */
+
+	if (!S_ISREG (e->sb.st_mode)) {
+		if (   (mknodat (dst->dirfd, dst->name, e->sb.st_mode & ~07777U, e->sb.st_rdev) != 0)
+		    || (fchownat (dst->dirfd, dst->name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+		    || (fchmodat (dst->dirfd, dst->name, e->sb.st_mode & 07777, AT_SYMLINK_NOFOLLOW) != 0)
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+		    || (   e->has_xattrs
+		        && (copy_skel_xattrs (src_path, dst, reset_selinux) != 0))
+#endif				/* WITH_ACL || WITH_ATTR */
+		    || (utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW) != 0)) {
+			return -1;
+		}
+		return 0;
+	}
+
+	ofd = openat (dst->dirfd, dst->name, O_WRONLY | O_CREAT | O_EXCL | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+	if (   (ofd < 0)
+	    || (fchown (ofd, uid, gid) != 0)
+	    || (fchmod (ofd, e->sb.st_mode & 07777) != 0)
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+	    || (   e->has_xattrs
+	        && (copy_skel_xattrs (src_path, dst, reset_selinux) != 0))
+#endif				/* WITH_ACL || WITH_ATTR */
+	   ) {
+		if (ofd >= 0) {
+			(void) close (ofd);
+		}
+		return -1;
+	}
+
+	if (NULL != e->data) {
+		if (full_write (ofd, e->data, e->sb.st_size) != e->sb.st_size) {
+			(void) close (ofd);
+			return -1;
+		}
+	} else {
+		ifd = open (src_path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+		if (   (ifd < 0)
+		    || (copy_data (ifd, ofd, &e->sb) != 0)) {
+			if (ifd >= 0) {
+				(void) close (ifd);
+			}
+			(void) close (ofd);
+			return -1;
+		}
+		(void) close (ifd);
+	}
+	if (close (ofd) != 0) {
+		return -1;
+	}
+
+	return utimensat (dst->dirfd, dst->name, mt, AT_SYMLINK_NOFOLLOW);
+}
+
+struct skel_dir {
+	size_t entry;		/* index in the manifest, or SKEL_ROOT */
+	int fd;			/* -1 if its entries are not copied */
+	bool created;		/* its times are set once copied */
+};
+
+/*
+ * leave_skel_dir - close the last directory of the stack
+ */
+static int leave_skel_dir (const struct skel_manifest *m,
+                           struct skel_dir *stack, size_t *top)
+{
+	const struct skel_dir *d = &stack[*top];
+	int err = 0;
+
+	(*top)--;
+	if (d->fd >= 0) {
+		(void) close (d->fd);
+	}
+	if (d->created) {
+		const struct skel_entry *e = &m->entries[d->entry];
+		struct timespec mt[2];
+
+		mt[0] = e->sb.st_atim;
+		mt[1] = e->sb.st_mtim;
+		if (utimensat (stack[*top].fd, e->name, mt, AT_SYMLINK_NOFOLLOW) != 0) {
+			err = -1;
+		}
+	}
+	return err;
+}
+
+/*
+ * copy_manifest - copy the entries of a manifest into dst_root
+ *
+ *	The entries which already exist in dst_root are kept, as with
+ *	copy_tree().
+ *
+ *	Return 0 on success, -1 on error.
+ */
+static int copy_manifest (const struct skel_manifest *m, const char *dst_root,
+                          bool reset_selinux, uid_t uid, gid_t gid)
+{
+	struct skel_dir *stack;
+	size_t *copied;
+	size_t top = 0;
+	size_t i;
+	int err = 0;
+
+	stack = xmalloc ((m->depth + 2) * sizeof *stack);
+	copied = xmalloc ((m->count + 1) * sizeof *copied);
+	for (i = 0; i < m->count; i++) {
+		copied[i] = SIZE_MAX;
+	}
+	stack[0].entry = SKEL_ROOT;
+	stack[0].created = false;
+	stack[0].fd = open (dst_root, O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (stack[0].fd < 0) {
+		err = -1;
+	}
+
+	for (i = 0; (0 == err) && (i < m->count); i++) {
+		const struct skel_entry *e = &m->entries[i];
+		struct path_info dst;
+		struct stat sb;
+		char *src_path, *dst_path;
+		size_t src_len = strlen (m->root) + strlen (e->path) + 2;
+		size_t dst_len = strlen (dst_root) + strlen (e->path) + 2;
+		bool exists;
+
+		while (stack[top].entry != e->parent) {
+			if (leave_skel_dir (m, stack, &top) != 0) {
+				err = -1;
+			}
+		}
+		if (stack[top].fd < 0) {
+			/* The entries of a directory which was not copied */
+			if (S_ISDIR (e->sb.st_mode)) {
+				top++;
+				stack[top].entry = i;
+				stack[top].fd = -1;
+				stack[top].created = false;
+			}
+			continue;
+		}
+
+		src_path = xmalloc (src_len);
+		dst_path = xmalloc (dst_len);
+		(void) snprintf (src_path, src_len, "%s/%s", m->root, e->path);
+		(void) snprintf (dst_path, dst_len, "%s/%s", dst_root, e->path);
+		dst.full_path = dst_path;
+		dst.dirfd = stack[top].fd;
+		dst.name = e->name;
+
+		exists = (fstatat (dst.dirfd, dst.name, &sb, AT_SYMLINK_NOFOLLOW) == 0);
+		if (S_ISDIR (e->sb.st_mode)) {
+			/*
+			 * If the destination is already a directory, don't
+			 * change it but copy into it.
+			 */
+			top++;
+			stack[top].entry = i;
+			stack[top].fd = -1;
+			stack[top].created = false;
+			if (!exists) {
+#ifdef WITH_SELINUX
+				if (set_selinux_file_context (dst_path, S_IFDIR) != 0) {
+					err = -1;
+				} else
+#endif				/* WITH_SELINUX */
+				if (   (mkdirat (dst.dirfd, dst.name, 0700) != 0)
+				    || (fchownat (dst.dirfd, dst.name, uid, gid, AT_SYMLINK_NOFOLLOW) != 0)
+				    || (fchmodat (dst.dirfd, dst.name, e->sb.st_mode & 07777, AT_SYMLINK_NOFOLLOW) != 0)
+#if defined(WITH_ACL) || defined(WITH_ATTR)
+				    || (   e->has_xattrs
+				        && (copy_skel_xattrs (src_path, &dst, reset_selinux) != 0))
+#endif				/* WITH_ACL || WITH_ATTR */
+				   ) {
+					err = -1;
+				} else {
+					stack[top].created = true;
+					exists = true;
+					sb.st_mode = S_IFDIR;
+				}
+			}
+			if (exists && S_ISDIR (sb.st_mode)) {
+				stack[top].fd = openat (dst.dirfd, dst.name,
+				                        O_DIRECTORY | O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+				if (stack[top].fd < 0) {
+					err = -1;
+				}
+			}
+		} else if (!exists) {
+			/* If the destination already exists do nothing. */
+			err = create_skel_entry (m, i, src_path, &dst, dst_root,
+			                         copied, reset_selinux, uid, gid);
+		}
+		if ((0 == err) && (NULL != progress_cb)) {
+			count_progress (src_path, &e->sb);
+		}
+		free (src_path);
+		free (dst_path);
+	}
+
+	while (top > 0) {
+		if (leave_skel_dir (m, stack, &top) != 0) {
+			err = -1;
+		}
+	}
+	if (stack[0].fd >= 0) {
+		(void) close (stack[0].fd);
+	}
+	free (copied);
+	free (stack);
+
+#ifdef WITH_SELINUX
+	if (reset_selinux_file_context () != 0) {
+		err = -1;
+	}
+#endif				/* WITH_SELINUX */
+
+	return err;
+}
+
+/*
+ * copy_skel - copy a skeleton directory into a new home
+ *
+ *	This is copy_tree (skel, dst_root, false, reset_selinux, -1, uid,
+ *	-1, gid), but the skeleton is read only once per process, and the
+ *	new homes are created from its manifest while it does not change.
+ *
+ *	With HOME_COPY_JOBS, or if the manifest cannot be built, the
+ *	skeleton is copied by copy_tree().
+ */
+int copy_skel (const char *skel, const char *dst_root, bool reset_selinux,
+               uid_t uid, gid_t gid)
+{
+	const struct skel_manifest *m = NULL;
+	struct timespec start;
+	int err;
+
+	if (getdef_long ("HOME_COPY_JOBS", 1) <= 1) {
+		m = get_manifest (skel);
+	}
+	if (NULL == m) {
+		return copy_tree (skel, dst_root, false, reset_selinux,
+		                  (uid_t) -1, uid, (gid_t) -1, gid);
+	}
+
+	timing_start (&start);
+	(void) memset (&copy_stats, 0, sizeof copy_stats);
+	(void) memset (&progress, 0, sizeof progress);
+	err = copy_manifest (m, dst_root, reset_selinux, uid, gid);
+	timing_stop ("copy_skel", &start);
+
+	return err;
 }
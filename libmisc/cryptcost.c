@@ -0,0 +1,114 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * The costs calibrated by cryptcost(8) are stored in CRYPT_COST_FILE, one
+ * "METHOD COST" line per crypt method. They are used by crypt_make_salt()
+ * when the cost variables of login.defs are set to "auto".
+ */
+
+/*
+ * crypt_cost_cached - Return the cost calibrated for method, or -1 if
+ *                     method was not calibrated.
+ */
+long crypt_cost_cached (const char *method)
+{
+	FILE *fp;
+	char buf[BUFSIZ];
+	long cost = -1;
+
+	fp = fopen (CRYPT_COST_FILE, "r");
+	if (NULL == fp) {
+		return -1;
+	}
+	while (fgets (buf, sizeof buf, fp) != NULL) {
+		char name[32];
+		long value;
+
+		if (   ('#' != buf[0])
+		    && (sscanf (buf, "%31s %ld", name, &value) == 2)
+		    && (strcmp (name, method) == 0)
+		    && (value > 0)) {
+			cost = value;
+		}
+	}
+	(void) fclose (fp);
+	return cost;
+}
+
+/*
+ * crypt_cost_save - Store the cost calibrated for method, replacing the
+ *                   previous one.
+ *
+ *	The file is replaced atomically.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+int crypt_cost_save (const char *method, long cost)
+{
+	char tmpname[1024];
+	char buf[BUFSIZ];
+	FILE *old, *new;
+	int fd;
+
+	if (snprintf (tmpname, sizeof tmpname, "%s+", CRYPT_COST_FILE)
+	    >= (int) sizeof tmpname) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = open (tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (-1 == fd) {
+		return -1;
+	}
+	new = fdopen (fd, "w");
+	if (NULL == new) {
+		(void) close (fd);
+		goto fail;
+	}
+
+	/* Keep the other methods */
+	old = fopen (CRYPT_COST_FILE, "r");
+	if (NULL != old) {
+		while (fgets (buf, sizeof buf, old) != NULL) {
+			char name[32];
+
+			if (   ('#' == buf[0])
+			    || (sscanf (buf, "%31s", name) != 1)
+			    || (strcmp (name, method) != 0)) {
+				(void) fputs (buf, new);
+			}
+		}
+		(void) fclose (old);
+	}
+	(void) fprintf (new, "%s %ld\n", method, cost);
+
+	if (   (fflush (new) != 0)
+	    || (fsync (fileno (new)) != 0)) {
+		(void) fclose (new);
+		goto fail;
+	}
+	if (fclose (new) != 0) {
+		goto fail;
+	}
+	if (rename (tmpname, CRYPT_COST_FILE) != 0) {
+		goto fail;
+	}
+	return 0;
+
+      fail:
+	(void) unlink (tmpname);
+	return -1;
+}
@@ -9,9 +9,11 @@
 #ident "$Id$"
 
 #include <limits.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #if HAVE_SYS_RANDOM_H
 #include <sys/random.h>
@@ -22,35 +24,66 @@
 #include "shadowlog.h"
 
 
+/*
+ * The random bytes are read from the kernel in blocks of CSRAND_POOL_SIZE
+ * bytes, and handed out from the pool.  Each byte is erased from the pool
+ * as soon as it is handed out, and the pool is discarded in a child after
+ * fork(), so that two processes never return the same bytes.
+ */
+#define CSRAND_POOL_SIZE  512
+
+
 static uint32_t csrand_uniform32(uint32_t n);
 static unsigned long csrand_uniform_slow(unsigned long n);
 
 
+static pthread_mutex_t  pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char    pool[CSRAND_POOL_SIZE];
+static size_t           pool_avail = 0;  // unused bytes at the end of pool
+static pid_t            pool_pid = -1;
+
+
 /*
- * Return a uniformly-distributed CS random u_long value.
+ * Fill buf with n CS random bytes from the system.
  */
-unsigned long
-csrand(void)
+static void
+csrand_fill(void *buf, size_t n)
 {
 	FILE           *fp;
-	unsigned long  r;
+	unsigned char  *p = buf;
 
 #ifdef HAVE_GETENTROPY
 	/* getentropy may exist but lack kernel support.  */
-	if (getentropy(&r, sizeof(r)) == 0)
-		return r;
+	while (n > 0) {
+		size_t  len = (n > 256) ? 256 : n;
+
+		if (getentropy(p, len) != 0)
+			break;
+		p += len;
+		n -= len;
+	}
+	if (n == 0)
+		return;
 #endif
 
 #ifdef HAVE_GETRANDOM
 	/* Likewise getrandom.  */
-	if (getrandom(&r, sizeof(r), 0) == sizeof(r))
-		return r;
+	while (n > 0) {
+		ssize_t  len = getrandom(p, n, 0);
+
+		if (len <= 0)
+			break;
+		p += len;
+		n -= len;
+	}
+	if (n == 0)
+		return;
 #endif
 
 #ifdef HAVE_ARC4RANDOM_BUF
 	/* arc4random_buf can never fail.  */
-	arc4random_buf(&r, sizeof(r));
-	return r;
+	arc4random_buf(p, n);
+	return;
 #endif
 
 	/* Use /dev/urandom as a last resort.  */
@@ -59,13 +92,13 @@ csrand(void)
 		goto fail;
 	}
 
-	if (fread(&r, sizeof(r), 1, fp) != 1) {
+	if (fread(p, n, 1, fp) != 1) {
 		fclose(fp);
 		goto fail;
 	}
 
 	fclose(fp);
-	return r;
+	return;
 
 fail:
 	fprintf(log_get_logfd(), _("Unable to obtain random bytes.\n"));
@@ -73,6 +106,59 @@ fail:
 }
 
 
+/*
+ * Fill buf with n CS random bytes.
+ */
+void
+csrand_bytes(void *buf, size_t n)
+{
+	unsigned char  *p = buf;
+
+	if (n >= CSRAND_POOL_SIZE) {
+		csrand_fill(buf, n);
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (pool_pid != getpid()) {
+		memzero(pool, sizeof(pool));
+		pool_avail = 0;
+		pool_pid = getpid();
+	}
+
+	while (n > 0) {
+		size_t  len;
+
+		if (pool_avail == 0) {
+			csrand_fill(pool, sizeof(pool));
+			pool_avail = sizeof(pool);
+		}
+		len = (n > pool_avail) ? pool_avail : n;
+		pool_avail -= len;
+		memcpy(p, pool + pool_avail, len);
+		memzero(pool + pool_avail, len);
+		p += len;
+		n -= len;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+
+/*
+ * Return a uniformly-distributed CS random u_long value.
+ */
+unsigned long
+csrand(void)
+{
+	unsigned long  r;
+
+	csrand_bytes(&r, sizeof(r));
+	return r;
+}
+
+
 /*
  * Return a uniformly-distributed CS random value in the interval [0, n-1].
  */
@@ -113,7 +199,7 @@ csrand_uniform32(uint32_t n)
 	bound = -n % n;  // analogous to `2^64 % n`, since `x % y == (x-y) % y`
 
 	do {
-		r = csrand();
+		r = csrand() & UINT32_MAX;  // a 32-bit value, as in the paper
 		mult = r * n;
 		rem = mult;  // analogous to `mult % 2^64`
 	} while (rem < bound);  // p = (2^64 % n) / 2^64;  W.C.: n=2^63+1, p=0.5
@@ -0,0 +1,415 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif				/* HAVE_LINUX_IO_URING_H */
+#include "prototypes.h"
+#include "defines.h"
+#include "getdef.h"
+
+/*
+ * Batches of metadata operations on the entries of a directory.
+ *
+ * copy_tree(), chown_tree() and remove_tree() stat or unlink the entries
+ * of a directory one by one. On a network file system, each of these
+ * calls waits for a round trip to the server. The entries are collected
+ * in batches instead, and with HOME_IO_URING, the operations of a batch
+ * are submitted together to an io_uring, so that their latencies overlap.
+ *
+ * Without HOME_IO_URING, or if the kernel does not provide io_uring (too
+ * old, disabled with the kernel.io_uring_disabled sysctl, or by a seccomp
+ * filter), the operations are done one by one.
+ */
+
+enum batch_op {
+	BATCH_STAT,
+	BATCH_UNLINK,
+};
+
+static void batch_sync (enum batch_op op, int dir_fd,
+                        struct dir_batch *batch, size_t i)
+{
+	int rc;
+
+	if (BATCH_STAT == op) {
+		rc = fstatat (dir_fd, batch->name[i], &batch->sb[i],
+		              AT_SYMLINK_NOFOLLOW);
+	} else {
+		rc = unlinkat (dir_fd, batch->name[i], 0);
+	}
+	batch->error[i] = (0 == rc) ? 0 : errno;
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * The rings are only used during the run of a batch, by one thread, and
+ * kept in a free list for the next batches.
+ */
+struct uring {
+	int fd;
+	/*@dependent@*/unsigned int *sq_tail;
+	/*@dependent@*/unsigned int *sq_mask;
+	/*@dependent@*/unsigned int *sq_array;
+	/*@dependent@*/unsigned int *cq_head;
+	/*@dependent@*/unsigned int *cq_tail;
+	/*@dependent@*/unsigned int *cq_mask;
+	/*@dependent@*/struct io_uring_sqe *sqes;
+	/*@dependent@*/struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_size;
+	void *cq_ring;		/* sq_ring with IORING_FEAT_SINGLE_MMAP */
+	size_t cq_ring_size;
+	size_t sqes_size;
+	struct statx stx[DIR_BATCH_SIZE];
+	/*@null@*/struct uring *next;	/* free list */
+};
+
+static pthread_mutex_t rings_mutex = PTHREAD_MUTEX_INITIALIZER;
+static /*@null@*/struct uring *free_rings = NULL;	/* protected by rings_mutex */
+static int uring_enabled = -1;		/* -1 until HOME_IO_URING is read */
+
+static void uring_close (/*@only@*/struct uring *ring)
+{
+	if (NULL != ring->sqes) {
+		(void) munmap (ring->sqes, ring->sqes_size);
+	}
+	if ((NULL != ring->cq_ring) && (ring->cq_ring != ring->sq_ring)) {
+		(void) munmap (ring->cq_ring, ring->cq_ring_size);
+	}
+	if (NULL != ring->sq_ring) {
+		(void) munmap (ring->sq_ring, ring->sq_ring_size);
+	}
+	(void) close (ring->fd);
+	free (ring);
+}
+
+/*
+ * uring_open - Create a ring for a batch.
+ *
+ *	Return NULL if io_uring is not available.
+ */
+static /*@null@*/ /*@only@*/struct uring *uring_open (void)
+{
+	struct io_uring_params p;
+	struct uring *ring;
+	char *sq, *cq;
+
+	ring = calloc (1, sizeof *ring);
+	if (NULL == ring) {
+		return NULL;
+	}
+	memset (&p, 0, sizeof p);
+	ring->fd = syscall (__NR_io_uring_setup, DIR_BATCH_SIZE, &p);
+	if (ring->fd < 0) {
+		free (ring);
+		return NULL;
+	}
+
+	ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (0 != (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		if (ring->cq_ring_size > ring->sq_ring_size) {
+			ring->sq_ring_size = ring->cq_ring_size;
+		}
+		ring->cq_ring_size = ring->sq_ring_size;
+	}
+	ring->sq_ring = mmap (NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+	                      MAP_SHARED | MAP_POPULATE, ring->fd,
+	                      IORING_OFF_SQ_RING);
+	if (MAP_FAILED == ring->sq_ring) {
+		ring->sq_ring = NULL;
+		uring_close (ring);
+		return NULL;
+	}
+	if (0 != (p.features & IORING_FEAT_SINGLE_MMAP)) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap (NULL, ring->cq_ring_size,
+		                      PROT_READ | PROT_WRITE,
+		                      MAP_SHARED | MAP_POPULATE, ring->fd,
+		                      IORING_OFF_CQ_RING);
+		if (MAP_FAILED == ring->cq_ring) {
+			ring->cq_ring = NULL;
+			uring_close (ring);
+			return NULL;
+		}
+	}
+	ring->sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap (NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+	                   MAP_SHARED | MAP_POPULATE, ring->fd,
+	                   IORING_OFF_SQES);
+	if (MAP_FAILED == ring->sqes) {
+		ring->sqes = NULL;
+		uring_close (ring);
+		return NULL;
+	}
+
+	sq = ring->sq_ring;
+	cq = ring->cq_ring;
+	ring->sq_tail  = (unsigned int *) (sq + p.sq_off.tail);
+	ring->sq_mask  = (unsigned int *) (sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *) (sq + p.sq_off.array);
+	ring->cq_head  = (unsigned int *) (cq + p.cq_off.head);
+	ring->cq_tail  = (unsigned int *) (cq + p.cq_off.tail);
+	ring->cq_mask  = (unsigned int *) (cq + p.cq_off.ring_mask);
+	ring->cqes     = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return ring;
+}
+
+/*
+ * uring_get - Take a ring from the free list, or create one.
+ *
+ *	Return NULL if the operations shall be done one by one.
+ */
+static /*@null@*/ /*@only@*/struct uring *uring_get (void)
+{
+	struct uring *ring = NULL;
+	int enabled;
+
+	(void) pthread_mutex_lock (&rings_mutex);
+	if (-1 == uring_enabled) {
+		uring_enabled = getdef_bool ("HOME_IO_URING") ? 1 : 0;
+	}
+	if (1 == uring_enabled) {
+		ring = free_rings;
+		if (NULL != ring) {
+			free_rings = ring->next;
+		}
+	}
+	enabled = uring_enabled;
+	(void) pthread_mutex_unlock (&rings_mutex);
+
+	if ((NULL == ring) && (1 == enabled)) {
+		ring = uring_open ();
+		if (NULL == ring) {
+			/* Do not try again */
+			(void) pthread_mutex_lock (&rings_mutex);
+			uring_enabled = 0;
+			(void) pthread_mutex_unlock (&rings_mutex);
+		}
+	}
+	return ring;
+}
+
+static void uring_put (/*@only@*/struct uring *ring)
+{
+	(void) pthread_mutex_lock (&rings_mutex);
+	ring->next = free_rings;
+	free_rings = ring;
+	(void) pthread_mutex_unlock (&rings_mutex);
+}
+
+static void stat_from_statx (struct stat *sb, const struct statx *stx)
+{
+	memset (sb, 0, sizeof *sb);
+	sb->st_dev = makedev (stx->stx_dev_major, stx->stx_dev_minor);
+	sb->st_ino = stx->stx_ino;
+	sb->st_mode = stx->stx_mode;
+	sb->st_nlink = stx->stx_nlink;
+	sb->st_uid = stx->stx_uid;
+	sb->st_gid = stx->stx_gid;
+	sb->st_rdev = makedev (stx->stx_rdev_major, stx->stx_rdev_minor);
+	sb->st_size = stx->stx_size;
+	sb->st_blksize = stx->stx_blksize;
+	sb->st_blocks = stx->stx_blocks;
+	sb->st_atim.tv_sec = stx->stx_atime.tv_sec;
+	sb->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+	sb->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+	sb->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+	sb->st_ctim.tv_sec = stx->stx_ctime.tv_sec;
+	sb->st_ctim.tv_nsec = stx->stx_ctime.tv_nsec;
+}
+
+/*
+ * uring_run - Run the operations of the batch in the ring.
+ *
+ *	Return 0 on success, -1 if the ring failed before any operation was
+ *	submitted. The ring shall then be closed, and the operations done
+ *	one by one.
+ */
+static int uring_run (struct uring *ring, enum batch_op op, int dir_fd,
+                      struct dir_batch *batch)
+{
+	unsigned int tail = *ring->sq_tail;
+	unsigned int mask = *ring->sq_mask;
+	size_t pending = batch->count;
+	size_t done = 0;
+	size_t i;
+
+	for (i = 0; i < batch->count; i++) {
+		unsigned int idx = (tail + i) & mask;
+		struct io_uring_sqe *sqe = &ring->sqes[idx];
+
+		memset (sqe, 0, sizeof *sqe);
+		sqe->fd = dir_fd;
+		sqe->addr = (uintptr_t) batch->name[i];
+		sqe->user_data = i;
+		if (BATCH_STAT == op) {
+			sqe->opcode = IORING_OP_STATX;
+			sqe->len = STATX_BASIC_STATS;
+			sqe->off = (uintptr_t) &ring->stx[i];
+			sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+		} else {
+			sqe->opcode = IORING_OP_UNLINKAT;
+		}
+		ring->sq_array[idx] = idx;
+	}
+	__atomic_store_n (ring->sq_tail, tail + batch->count, __ATOMIC_RELEASE);
+
+	while (done < batch->count) {
+		unsigned int head, cq_tail;
+		long ret;
+
+		ret = syscall (__NR_io_uring_enter, ring->fd, pending, 1,
+		               IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ret < 0) {
+			if ((EINTR == errno) || (EAGAIN == errno) || (EBUSY == errno)) {
+				continue;
+			}
+			if (pending == batch->count) {
+				return -1;
+			}
+			/* Wait for the operations already submitted */
+			pending = 0;
+			continue;
+		}
+		pending -= ret;
+
+		head = *ring->cq_head;
+		cq_tail = __atomic_load_n (ring->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != cq_tail) {
+			const struct io_uring_cqe *cqe;
+
+			cqe = &ring->cqes[head & *ring->cq_mask];
+			i = cqe->user_data;
+			if (-EINVAL == cqe->res) {
+				/* The operation is not supported by an old kernel */
+				batch_sync (op, dir_fd, batch, i);
+			} else if (cqe->res < 0) {
+				batch->error[i] = -cqe->res;
+			} else {
+				batch->error[i] = 0;
+				if (BATCH_STAT == op) {
+					stat_from_statx (&batch->sb[i],
+					                 &ring->stx[i]);
+				}
+			}
+			head++;
+			done++;
+		}
+		__atomic_store_n (ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+#endif				/* HAVE_LINUX_IO_URING_H */
+
+static void batch_run (enum batch_op op, int dir_fd, struct dir_batch *batch)
+{
+	size_t i;
+#ifdef HAVE_LINUX_IO_URING_H
+	struct uring *ring;
+
+	/* A single operation gains nothing from the ring */
+	ring = (batch->count > 1) ? uring_get () : NULL;
+	if (NULL != ring) {
+		if (uring_run (ring, op, dir_fd, batch) == 0) {
+			uring_put (ring);
+			return;
+		}
+		uring_close (ring);
+	}
+#endif				/* HAVE_LINUX_IO_URING_H */
+
+	for (i = 0; i < batch->count; i++) {
+		batch_sync (op, dir_fd, batch, i);
+	}
+}
+
+/*
+ * dir_batch_add - Add the entry name to the batch.
+ *
+ *	Return true if the batch is full, and shall be run before an entry
+ *	is added.
+ */
+bool dir_batch_add (struct dir_batch *batch, const char *name)
+{
+	size_t len = strlen (name);
+
+	if (len > NAME_MAX) {
+		len = NAME_MAX;
+	}
+	memcpy (batch->name[batch->count], name, len);
+	batch->name[batch->count][len] = '\0';
+	batch->count++;
+	return (DIR_BATCH_SIZE == batch->count);
+}
+
+/*
+ * dir_batch_stat - Stat the entries of the batch in the directory dir_fd,
+ *                  without following the symbolic links.
+ *
+ *	batch->sb[i] is set for each entry for which batch->error[i] is 0.
+ */
+void dir_batch_stat (struct dir_batch *batch, int dir_fd)
+{
+	batch_run (BATCH_STAT, dir_fd, batch);
+}
+
+/*
+ * dir_batch_unlink - Unlink the entries of the batch in the directory
+ *                    dir_fd, and empty the batch.
+ *
+ *	Return 0 on success, -1 if an entry could not be unlinked, with
+ *	errno set.
+ */
+int dir_batch_unlink (struct dir_batch *batch, int dir_fd)
+{
+	size_t i;
+
+	batch_run (BATCH_UNLINK, dir_fd, batch);
+	for (i = 0; i < batch->count; i++) {
+		if (0 != batch->error[i]) {
+			errno = batch->error[i];
+			batch->count = 0;
+			return -1;
+		}
+	}
+	batch->count = 0;
+	return 0;
+}
+
+/*
+ * dir_pool_fds - Return how many descriptors the tasks queued by the pool
+ *	of threads of copy_tree(), chown_tree() or remove_tree() may keep
+ *	open: a quarter of the limit of the process, at most 256.
+ */
+unsigned long dir_pool_fds (void)
+{
+	struct rlimit rl;
+	unsigned long fds = 256;
+
+	if (   (getrlimit (RLIMIT_NOFILE, &rl) == 0)
+	    && (RLIM_INFINITY != rl.rlim_cur)
+	    && (rl.rlim_cur / 4 < fds)) {
+		fds = rl.rlim_cur / 4;
+	}
+	return fds;
+}
@@ -27,6 +27,16 @@
 size_t newenvc = 0;
 /*@null@*/char **newenvp = NULL;
 
+/*
+ * Hash of the names in newenvp, so that addenv() does not scan the whole
+ * environment to replace a variable (login -p and su -p add every
+ * inherited variable). The slots hold the index in newenvp plus one, 0
+ * for a free slot. Without an index (allocation failure), newenvp is
+ * searched linearly.
+ */
+/*@null@*//*@only@*/static size_t *env_index = NULL;
+static size_t env_index_size = 0;	/* power of two */
+
 static const char *const forbid[] = {
 	"_RLD_=",
 	"BASH_ENV=",		/* GNU creeping featurism strikes again... */
@@ -53,6 +63,84 @@ static const char *const noslash[] = {
 	NULL
 };
 
+static size_t env_hash (const char *name, size_t len)
+{
+	size_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h = (h ^ (unsigned char) name[i]) * 16777619U;
+	}
+	return h;
+}
+
+static void env_index_insert (size_t i)
+{
+	size_t n = strcspn (newenvp[i], "=");
+	size_t slot = env_hash (newenvp[i], n) & (env_index_size - 1);
+
+	while (0 != env_index[slot]) {
+		slot = (slot + 1) & (env_index_size - 1);
+	}
+	env_index[slot] = i + 1;
+}
+
+/*
+ * env_index_grow - Make room in the index for one more variable
+ *
+ *	The index is kept at most half full.
+ */
+static void env_index_grow (void)
+{
+	size_t *index;
+	size_t size;
+	size_t i;
+
+	if ((newenvc + 1) * 2 <= env_index_size) {
+		return;
+	}
+
+	size = (0 == env_index_size) ? 64 : env_index_size * 2;
+	index = calloc (size, sizeof (index[0]));
+	free (env_index);
+	env_index = index;
+	env_index_size = (NULL == index) ? 0 : size;
+	for (i = 0; (NULL != env_index) && (i < newenvc); i++) {
+		env_index_insert (i);
+	}
+}
+
+/*
+ * env_find - Return the index of the variable name (of length len) in
+ *            newenvp, or newenvc if it is not set
+ */
+static size_t env_find (const char *name, size_t len)
+{
+	size_t slot;
+	size_t i;
+
+	if (NULL == env_index) {
+		for (i = 0; i < newenvc; i++) {
+			if (   (strncmp (name, newenvp[i], len) == 0)
+			    && (('=' == newenvp[i][len]) || ('\0' == newenvp[i][len]))) {
+				return i;
+			}
+		}
+		return newenvc;
+	}
+
+	slot = env_hash (name, len) & (env_index_size - 1);
+	while (0 != env_index[slot]) {
+		i = env_index[slot] - 1;
+		if (   (strncmp (name, newenvp[i], len) == 0)
+		    && (('=' == newenvp[i][len]) || ('\0' == newenvp[i][len]))) {
+			return i;
+		}
+		slot = (slot + 1) & (env_index_size - 1);
+	}
+	return newenvc;
+}
+
 /*
  * initenv() must be called once before using addenv().
  */
@@ -95,13 +183,7 @@ void addenv (const char *string, /*@null@*/const char *value)
 	/*
 	 * If this environment variable is already set, change its value.
 	 */
-	for (i = 0; i < newenvc; i++) {
-		if (   (strncmp (newstring, newenvp[i], n) == 0)
-		    && (('=' == newenvp[i][n]) || ('\0' == newenvp[i][n]))) {
-			break;
-		}
-	}
-
+	i = env_find (newstring, n);
 	if (i < newenvc) {
 		free (newenvp[i]);
 		newenvp[i] = newstring;
@@ -111,6 +193,7 @@ void addenv (const char *string, /*@null@*/const char *value)
 	/*
 	 * Otherwise, save the new environment variable
 	 */
+	env_index_grow ();
 	newenvp[newenvc++] = newstring;
 
 	/*
@@ -151,6 +234,8 @@ void addenv (const char *string, /*@null@*/const char *value)
 			(void) fputs (_("Environment overflow\n"), log_get_logfd());
 			newenvc--;
 			free (newenvp[newenvc]);
+			newenvp[newenvc] = NULL;
+			return;
 		}
 	}
 
@@ -159,6 +244,10 @@ void addenv (const char *string, /*@null@*/const char *value)
 	 */
 
 	newenvp[newenvc] = NULL;
+
+	if (NULL != env_index) {
+		env_index_insert (newenvc - 1);
+	}
 }
 
 
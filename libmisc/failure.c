@@ -11,14 +11,184 @@
 
 #ident "$Id$"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <unistd.h>
 #include "defines.h"
+#include "acctstate.h"
 #include "faillog.h"
 #include "getdef.h"
 #include "failure.h"
 #define	YEAR	(365L*DAY)
+
+/*
+ * The faillog file is opened once, and kept open across the login
+ * attempts. The records are read and written with pread and pwrite,
+ * under a lock of the record.
+ *
+ * With ACCOUNT_STATE_FILE, the records are kept in the account state
+ * store instead, which is locked as a whole.
+ */
+static int faillog_fd = -1;
+static bool faillog_rw = false;
+
+/*
+ * faillog_open - Open the faillog file, for writing if rw is set.
+ *
+ *	The file is opened only once: it is reopened only if it was
+ *	opened read-only and rw is set.
+ *	The file is not created: failure logging is not set up if it does
+ *	not exist.
+ *
+ *	Return the file descriptor (0 for the account state store), or -1
+ *	with errno set.
+ */
+int faillog_open (bool rw)
+{
+	int fd;
+
+	if (acct_state_enabled ()) {
+		return acct_state_open (rw);
+	}
+
+	if ((faillog_fd >= 0) && (faillog_rw || !rw)) {
+		return faillog_fd;
+	}
+
+	fd = open (FAILLOG_FILE, (rw ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (faillog_fd >= 0) {
+		(void) close (faillog_fd);
+	}
+	faillog_fd = fd;
+	faillog_rw = rw;
+	return fd;
+}
+
+/*
+ * faillog_close - Close the faillog file.
+ *
+ *	Return 0, or -1 if the file could not be closed.
+ */
+int faillog_close (void)
+{
+	int fd = faillog_fd;
+
+	if (acct_state_enabled ()) {
+		return acct_state_close ();
+	}
+
+	if (fd < 0) {
+		return 0;
+	}
+	faillog_fd = -1;
+	return close (fd);
+}
+
+/*
+ * faillog_sync - Write the changes of the faillog records to disk.
+ *
+ *	Return 0, or -1 with errno set.
+ */
+int faillog_sync (void)
+{
+	if (acct_state_enabled ()) {
+		return acct_state_sync ();
+	}
+	return fsync (faillog_fd);
+}
+
+/*
+ * faillog_name - Return the name of the file of the faillog records.
+ */
+/*@observer@*/const char *faillog_name (void)
+{
+	if (acct_state_enabled ()) {
+		return acct_state_file ();
+	}
+	return FAILLOG_FILE;
+}
+
+/*
+ * faillog_lock - Lock the n records starting at uid.
+ *
+ *	type is F_RDLCK, F_WRLCK, or F_UNLCK to unlock the records.
+ *	Return 0, or -1 with errno set.
+ */
+int faillog_lock (uid_t uid, size_t n, short type)
+{
+	struct flock lk;
+
+	if (acct_state_enabled ()) {
+		return acct_state_lock (type);
+	}
+
+	memzero (&lk, sizeof lk);
+	lk.l_type = type;
+	lk.l_whence = SEEK_SET;
+	lk.l_start = (off_t) uid * sizeof (struct faillog);
+	lk.l_len = (off_t) n * sizeof (struct faillog);
+	return fcntl (faillog_fd, F_SETLKW, &lk);
+}
+
+/*
+ * faillog_read - Read the record of uid.
+ *
+ *	faillog is a sparse file, initially zero length. If there is no
+ *	record for uid, or if it cannot be read, fl is an empty record.
+ *
+ *	Return 1 if the record was read, 0 if there is no record, -1 on
+ *	errors.
+ */
+int faillog_read (uid_t uid, /*@out@*/struct faillog *fl)
+{
+	ssize_t len;
+
+	if (acct_state_enabled ()) {
+		struct acct_state st;
+		int ret;
+
+		ret = acct_state_get (uid, &st);
+		*fl = st.fl;
+		return ret;
+	}
+
+	len = pread (faillog_fd, fl, sizeof *fl,
+	             (off_t) uid * sizeof *fl);
+	if ((ssize_t) sizeof *fl == len) {
+		return 1;
+	}
+	memzero (fl, sizeof *fl);
+	return (len < 0) ? -1 : 0;
+}
+
+/*
+ * faillog_write - Write the record of uid.
+ *
+ *	Return 0, or -1 if the record could not be written.
+ */
+int faillog_write (uid_t uid, const struct faillog *fl)
+{
+	if (acct_state_enabled ()) {
+		struct acct_state st;
+
+		if (acct_state_get (uid, &st) == -1) {
+			return -1;
+		}
+		st.fl = *fl;
+		return acct_state_put (uid, &st);
+	}
+
+	if (pwrite (faillog_fd, fl, sizeof *fl, (off_t) uid * sizeof *fl)
+	    != (ssize_t) sizeof *fl) {
+		return -1;
+	}
+	return 0;
+}
+
 /*
  * failure - make failure entry
  *
@@ -27,22 +197,18 @@
  */
 void failure (uid_t uid, const char *tty, struct faillog *fl)
 {
-	int fd;
-	off_t offset_uid = (off_t) (sizeof *fl) * uid;
+	bool locked;
 
 	/*
 	 * Don't do anything if failure logging isn't set up.
 	 */
 
-	if (access (FAILLOG_FILE, F_OK) != 0) {
-		return;
-	}
-
-	fd = open (FAILLOG_FILE, O_RDWR);
-	if (fd < 0) {
-		SYSLOG ((LOG_WARN,
-		         "Can't write faillog entry for UID %lu in %s.",
-		         (unsigned long) uid, FAILLOG_FILE));
+	if (faillog_open (true) < 0) {
+		if (ENOENT != errno) {
+			SYSLOG ((LOG_WARN,
+			         "Can't write faillog entry for UID %lu in %s.",
+			         (unsigned long) uid, faillog_name ()));
+		}
 		return;
 	}
 
@@ -50,19 +216,18 @@ void failure (uid_t uid, const char *tty, struct faillog *fl)
 	 * The file is indexed by UID value meaning that shared UID's
 	 * share failure log records.  That's OK since they really
 	 * share just about everything else ...
+	 *
+	 * The record is locked, in case the same account is being
+	 * logged simultaneously.
+	 *
+	 * If there is no record, this is not necessarily a failure. The
+	 * file is initially zero length.
+	 * If read failed for any other reason, this might reset the
+	 * counter. But the new failure will be logged.
 	 */
 
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (read (fd, fl, sizeof *fl) != (ssize_t) sizeof *fl)) {
-		/* This is not necessarily a failure. The file is
-		 * initially zero length.
-		 *
-		 * If lseek() or read() failed for any other reason, this
-		 * might reset the counter. But the new failure will be
-		 * logged.
-		 */
-		memzero (fl, sizeof *fl);
-	}
+	locked = (faillog_lock (uid, 1, F_WRLCK) == 0);
+	(void) faillog_read (uid, fl);
 
 	/*
 	 * Update the record.  We increment the failure count to log the
@@ -78,20 +243,13 @@ void failure (uid_t uid, const char *tty, struct faillog *fl)
 	strncpy (fl->fail_line, tty, sizeof (fl->fail_line) - 1);
 	(void) time (&fl->fail_time);
 
-	/*
-	 * Seek back to the correct position in the file and write the
-	 * record out.  Ideally we should lock the file in case the same
-	 * account is being logged simultaneously.  But the risk doesn't
-	 * seem that great.
-	 */
-
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, fl, sizeof *fl) != (ssize_t) sizeof *fl)
-	    || (close (fd) != 0)) {
+	if (faillog_write (uid, fl) != 0) {
 		SYSLOG ((LOG_WARN,
 		         "Can't write faillog entry for UID %lu in %s.",
-		         (unsigned long) uid, FAILLOG_FILE));
-		(void) close (fd);
+		         (unsigned long) uid, faillog_name ()));
+	}
+	if (locked) {
+		(void) faillog_lock (uid, 1, F_UNLCK);
 	}
 }
 
@@ -129,24 +287,24 @@ static bool too_many_failures (const struct faillog *fl)
 
 int failcheck (uid_t uid, struct faillog *fl, bool failed)
 {
-	int fd;
 	struct faillog fail;
-	off_t offset_uid = (off_t) (sizeof *fl) * uid;
+	bool locked;
 
 	/*
 	 * Suppress the check if the log file isn't there.
+	 *
+	 * The file is opened for writing even if the login failed, so
+	 * that it does not need to be reopened by failure().
 	 */
 
-	if (access (FAILLOG_FILE, F_OK) != 0) {
-		return 1;
-	}
-
-	fd = open (FAILLOG_FILE, failed?O_RDONLY:O_RDWR);
-	if (fd < 0) {
-		SYSLOG ((LOG_WARN,
-		         "Can't open the faillog file (%s) to check UID %lu. "
-		         "User access authorized.",
-		         FAILLOG_FILE, (unsigned long) uid));
+	if (   (faillog_open (true) < 0)
+	    && (!failed || (ENOENT == errno) || (faillog_open (false) < 0))) {
+		if (ENOENT != errno) {
+			SYSLOG ((LOG_WARN,
+			         "Can't open the faillog file (%s) to check UID %lu. "
+			         "User access authorized.",
+			         faillog_name (), (unsigned long) uid));
+		}
 		return 1;
 	}
 
@@ -162,14 +320,18 @@ int failcheck (uid_t uid, struct faillog *fl, bool failed)
 	 * no need to reset the count.
 	 */
 
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (read (fd, fl, sizeof *fl) != (ssize_t) sizeof *fl)) {
-		(void) close (fd);
+	locked = (faillog_lock (uid, 1, failed ? F_RDLCK : F_WRLCK) == 0);
+	if (faillog_read (uid, fl) != 1) {
+		if (locked) {
+			(void) faillog_lock (uid, 1, F_UNLCK);
+		}
 		return 1;
 	}
 
 	if (too_many_failures (fl)) {
-		(void) close (fd);
+		if (locked) {
+			(void) faillog_lock (uid, 1, F_UNLCK);
+		}
 		return 0;
 	}
 
@@ -184,16 +346,14 @@ int failcheck (uid_t uid, struct faillog *fl, bool failed)
 		fail = *fl;
 		fail.fail_cnt = 0;
 
-		if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-		    || (write (fd, &fail, sizeof fail) != (ssize_t) sizeof fail)
-		    || (close (fd) != 0)) {
+		if (faillog_write (uid, &fail) != 0) {
 			SYSLOG ((LOG_WARN,
 			         "Can't reset faillog entry for UID %lu in %s.",
-			         (unsigned long) uid, FAILLOG_FILE));
-			(void) close (fd);
+			         (unsigned long) uid, faillog_name ()));
 		}
-	} else {
-		(void) close (fd);
+	}
+	if (locked) {
+		(void) faillog_lock (uid, 1, F_UNLCK);
 	}
 
 	return 1;
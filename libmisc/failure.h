@@ -15,6 +15,27 @@
 #include "faillog.h"
 #include <utmp.h>
 
+/*
+ * faillog_open - open the faillog file once, for writing if rw is set
+ * faillog_close - close the faillog file
+ * faillog_lock - lock (F_RDLCK, F_WRLCK) or unlock (F_UNLCK) records
+ * faillog_read - read a record, empty if there is no record
+ * faillog_write - write a record
+ * faillog_sync - write the changes of the records to disk
+ * faillog_name - name of the file of the records
+ *
+ *	The faillog file is kept open by login across the login attempts,
+ *	and is also used by the faillog tool. With ACCOUNT_STATE_FILE, the
+ *	records are those of the account state store.
+ */
+extern int faillog_open (bool rw);
+extern int faillog_close (void);
+extern int faillog_lock (uid_t uid, size_t n, short type);
+extern int faillog_read (uid_t uid, /*@out@*/struct faillog *fl);
+extern int faillog_write (uid_t uid, const struct faillog *fl);
+extern int faillog_sync (void);
+extern /*@observer@*/const char *faillog_name (void);
+
 /*
  * failure - make failure entry
  *
@@ -13,6 +13,8 @@
 #include <errno.h>
 
 #include "prototypes.h"
+#include "probes.h"
+#include "commonio.h"
 #include "groupio.h"
 #include "getdef.h"
 #include "shadowlog.h"
@@ -28,6 +30,25 @@
  * preferred_min: The special-case minimum value for a specifically-
  * requested ID, which may be lower than the standard min_id
  */
+/*
+ * gid_block_full - Check if all the GIDs of [first:last] are used in the
+ *                  local group database.
+ */
+static bool gid_block_full (unsigned long first, unsigned long last)
+{
+	unsigned long id;
+
+	for (id = first; id <= last; id++) {
+		if (gr_locate_gid ((gid_t) id) == NULL) {
+			return false;
+		}
+		if (id == last) {
+			break;
+		}
+	}
+	return true;
+}
+
 static int get_ranges (bool sys_group, gid_t *min_id, gid_t *max_id,
 		       gid_t *preferred_min)
 {
@@ -88,11 +109,264 @@ static int get_ranges (bool sys_group, gid_t *min_id, gid_t *max_id,
 					(unsigned long) *max_id);
 			return EINVAL;
 		}
+
+		/* Only the block leased by this host, with ID_BLOCK_FILE */
+		if (getdef_str ("ID_BLOCK_FILE") != NULL) {
+			unsigned long min = *min_id, max = *max_id;
+
+			if (id_block_range (&min, &max, gid_block_full) != 0) {
+				return EINVAL;
+			}
+			*min_id = min;
+			*max_id = max;
+		}
 	}
 
 	return 0;
 }
 
+/*
+ * The GIDs of the [gid_min:gid_max] range used in the local database,
+ * sorted and unique after used_gids_sort().
+ */
+struct used_gids {
+	/*@null@*/ /*@only@*/gid_t *ids;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * used_gid_add - Record that gid is used
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_gid_add (struct used_gids *used, gid_t gid)
+{
+	if (used->count == used->size) {
+		size_t size = (0 == used->size) ? 64 : used->size * 2;
+		gid_t *ids;
+
+		ids = realloc (used->ids, size * sizeof *ids);
+		if (NULL == ids) {
+			return -1;
+		}
+		used->ids = ids;
+		used->size = size;
+	}
+	used->ids[used->count++] = gid;
+	return 0;
+}
+
+static int gid_cmp (const void *p1, const void *p2)
+{
+	gid_t u1 = *(const gid_t *) p1;
+	gid_t u2 = *(const gid_t *) p2;
+
+	return (u1 < u2) ? -1 : (u1 > u2);
+}
+
+static void used_gids_sort (struct used_gids *used)
+{
+	size_t i, n = 0;
+
+	if (0 == used->count) {
+		return;
+	}
+	qsort (used->ids, used->count, sizeof used->ids[0], gid_cmp);
+	for (i = 1; i < used->count; i++) {
+		if (used->ids[i] != used->ids[n]) {
+			used->ids[++n] = used->ids[i];
+		}
+	}
+	used->count = n + 1;
+}
+
+/*
+ * used_gid_pos - Position of the first used GID greater than or equal
+ *                to gid
+ */
+static size_t used_gid_pos (const struct used_gids *used, gid_t gid)
+{
+	size_t lo = 0, hi = used->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (used->ids[mid] < gid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * free_gid_up - Skip the GIDs used in the local database, from *gid up
+ *
+ *	The runs of consecutive used GIDs are skipped at once.
+ *
+ *	Return false if no GID of [*gid:gid_max] is left.
+ */
+static bool free_gid_up (const struct used_gids *used,
+                         gid_t gid_min, gid_t gid_max, gid_t *gid)
+{
+	size_t i;
+
+	if ((*gid < gid_min) || (*gid > gid_max)) {
+		return false;
+	}
+	for (i = used_gid_pos (used, *gid);
+	     (i < used->count) && (used->ids[i] == *gid);
+	     i++) {
+		if (*gid == gid_max) {
+			return false;
+		}
+		(*gid)++;
+	}
+	return true;
+}
+
+/*
+ * free_gid_down - Skip the GIDs used in the local database, from *gid
+ *                 down
+ *
+ *	The runs of consecutive used GIDs are skipped at once.
+ *
+ *	Return false if no GID of [gid_min:*gid] is left.
+ */
+static bool free_gid_down (const struct used_gids *used,
+                           gid_t gid_min, gid_t gid_max, gid_t *gid)
+{
+	size_t i;
+
+	if ((*gid < gid_min) || (*gid > gid_max)) {
+		return false;
+	}
+	i = used_gid_pos (used, *gid);
+	if ((i == used->count) || (used->ids[i] != *gid)) {
+		return true;
+	}
+	for (;;) {
+		if (*gid == gid_min) {
+			return false;
+		}
+		(*gid)--;
+		if ((0 == i) || (used->ids[i - 1] != *gid)) {
+			return true;
+		}
+		i--;
+	}
+}
+
+/*
+ * The GIDs listed by NSS, with ID_PROBE_ENUMERATE.
+ *
+ * They are listed once per process, since a tool like newusers searches
+ * a GID for each of its lines. The GIDs added since then are in the
+ * local database, and the GID which is picked is still checked with a
+ * lookup.
+ */
+static struct used_gids nss_gids = { NULL, 0, 0 };
+static bool nss_gids_listed = false;
+
+/*
+ * list_nss_gids - List the GIDs of the group entries
+ *
+ *	With a prefix, these are the GIDs of the group file of the prefix.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int list_nss_gids (void)
+{
+	const struct group *grp;
+	int ret = 0;
+
+	prefix_setgrent ();
+	while ((grp = prefix_getgrent ()) != NULL) {
+		if (used_gid_add (&nss_gids, grp->gr_gid) != 0) {
+			ret = -1;
+			break;
+		}
+	}
+	prefix_endgrent ();
+	if (0 != ret) {
+		free (nss_gids.ids);
+		nss_gids.ids = NULL;
+		nss_gids.count = 0;
+		nss_gids.size = 0;
+		return -1;
+	}
+	used_gids_sort (&nss_gids);
+	return 0;
+}
+
+/*
+ * used_gids_add_nss - Record the GIDs of the range listed by NSS
+ *
+ *	This is only done with ID_PROBE_ENUMERATE: listing all the entries
+ *	of a remote directory can cost more than the lookups it saves.
+ *	The services which do not enumerate their entries only list some
+ *	of them, or none: the GID which is picked is still checked with a
+ *	lookup.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_gids_add_nss (struct used_gids *used,
+                            gid_t gid_min, gid_t gid_max)
+{
+	size_t i;
+
+	if (!getdef_bool ("ID_PROBE_ENUMERATE")) {
+		return 0;
+	}
+	if (!nss_gids_listed) {
+		if (list_nss_gids () != 0) {
+			return -1;
+		}
+		nss_gids_listed = true;
+	}
+	for (i = used_gid_pos (&nss_gids, gid_min);
+	     (i < nss_gids.count) && (nss_gids.ids[i] <= gid_max);
+	     i++) {
+		if (used_gid_add (used, nss_gids.ids[i]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * used_gids_add_leases - Record the IDs of the range leased by other
+ *                        processes in the leases of dbfile
+ *
+ *	The leases are only a hint: if they cannot be read, the ID is
+ *	still checked when the database is locked.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_gids_add_leases (struct used_gids *used, const char *dbfile,
+                                 gid_t gid_min, gid_t gid_max)
+{
+	unsigned long *ids;
+	size_t count, i;
+	int ret = 0;
+
+	if (id_lease_list (dbfile, &ids, &count) != 0) {
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (   (ids[i] >= gid_min)
+		    && (ids[i] <= gid_max)
+		    && (used_gid_add (used, ids[i]) != 0)) {
+			ret = -1;
+			break;
+		}
+	}
+	free (ids);
+	return ret;
+}
+
 /*
  * check_gid - See if the requested GID is available
  *
@@ -104,9 +378,11 @@ static int get_ranges (bool sys_group, gid_t *min_id, gid_t *max_id,
  */
 static int check_gid (const gid_t gid,
 		      const gid_t gid_min,
-		      const gid_t gid_max,
-		      const bool *used_gids)
+		      const gid_t gid_max)
 {
+	metrics_add (METRICS_ID_SEARCH, "gid", 1);
+	PROBE1 (gid__check, gid);
+
 	/* First test that the preferred ID is in the range */
 	if (gid < gid_min || gid > gid_max) {
 		return ERANGE;
@@ -117,16 +393,8 @@ static int check_gid (const gid_t gid,
 		return EINVAL;
 	}
 
-	/*
-	 * Check whether we already detected this GID
-	 * using the gr_next() loop
-	 */
-	if (used_gids != NULL && used_gids[gid]) {
-		return EEXIST;
-	}
 	/* Check if the GID exists according to NSS */
-	errno = 0;
-	if (prefix_getgrgid (gid) != NULL) {
+	if (prefix_gid_used (gid)) {
 		return EEXIST;
 	} else {
 		/* getgrgid() was NULL
@@ -140,6 +408,93 @@ static int check_gid (const gid_t gid,
 	return 0;
 }
 
+/*
+ * prefetch_gids - Look the next candidate GIDs up through NSS in
+ *                 parallel, with ID_PROBE_JOBS
+ *
+ *	The candidates are the free GIDs of used from id, down if down
+ *	is set.
+ */
+static void prefetch_gids (const struct used_gids *used,
+                           gid_t gid_min, gid_t gid_max, gid_t id,
+                           bool down)
+{
+	unsigned long ids[ID_PREFETCH_MAX];
+	long jobs = getdef_long ("ID_PROBE_JOBS", 1);
+	size_t n = 0;
+
+	if (jobs <= 1) {
+		return;
+	}
+	if (jobs > ID_PREFETCH_MAX) {
+		jobs = ID_PREFETCH_MAX;
+	}
+	while (   (n < (size_t) jobs)
+	       && (down ? free_gid_down (used, gid_min, gid_max, &id)
+	                : free_gid_up (used, gid_min, gid_max, &id))) {
+		ids[n++] = id;
+		if (id == (down ? gid_min : gid_max)) {
+			break;
+		}
+		if (down) {
+			id--;
+		} else {
+			id++;
+		}
+	}
+	prefix_prefetch_ids (ids, n, false, true);
+}
+
+/*
+ * gid_hint - Get the GID after the lowest (system groups) or highest
+ *            (non-system groups) of the range from the lookup index of
+ *            the group file, without walking the database.
+ *
+ * Return true and set *gid if this GID is free, false if the whole
+ * database must be searched instead.
+ */
+static bool gid_hint (bool sys_group, gid_t gid_min, gid_t gid_max,
+                      gid_t *gid)
+{
+	const struct commonio_db *db = __gr_get_db ();
+	unsigned long lowest, highest;
+	gid_t id;
+	int result;
+
+	/* The index does not know the uncommitted changes */
+	if (!db->isopen || db->changed) {
+		return false;
+	}
+
+	result = dbindex_id_bounds (gr_dbname (), gid_min, gid_max,
+	                            &lowest, &highest);
+	if (-1 == result) {
+		return false;
+	}
+	if (0 == result) {
+		id = sys_group ? gid_max : gid_min;
+	} else if (sys_group) {
+		if (lowest == gid_min) {
+			return false;
+		}
+		id = lowest - 1;
+	} else {
+		if (highest == gid_max) {
+			return false;
+		}
+		id = highest + 1;
+	}
+
+	if (   (check_gid (id, gid_min, gid_max) != 0)
+	    || (gr_locate_gid (id) != NULL)
+	    || id_leased (gr_dbname (), id)) {
+		return false;
+	}
+
+	*gid = id;
+	return true;
+}
+
 /*
  * find_new_gid - Find a new unused GID.
  *
@@ -154,7 +509,7 @@ int find_new_gid (bool sys_group,
                  gid_t *gid,
                  /*@null@*/gid_t const *preferred_gid)
 {
-	bool *used_gids;
+	struct used_gids used_gids = { NULL, 0, 0 };
 	const struct group *grp;
 	gid_t gid_min, gid_max, preferred_min;
 	gid_t id;
@@ -175,18 +530,20 @@ int find_new_gid (bool sys_group,
 
 	/* Check if the preferred GID is available */
 	if (preferred_gid) {
-		result = check_gid (*preferred_gid, preferred_min, gid_max, NULL);
+		result = check_gid (*preferred_gid, preferred_min, gid_max);
 		if (result == 0) {
 			/*
 			 * Make sure the GID isn't queued for use already
 			 */
-			if (gr_locate_gid (*preferred_gid) == NULL) {
+			if (   (gr_locate_gid (*preferred_gid) == NULL)
+			    && !id_leased (gr_dbname (), *preferred_gid)) {
 				*gid = *preferred_gid;
 				return 0;
 			}
 			/*
 			 * gr_locate_gid() found the GID in an as-yet uncommitted
-			 * entry. We'll proceed below and auto-set a GID.
+			 * entry, or another process leased it. We'll proceed
+			 * below and auto-set a GID.
 			 */
 		} else if (result == EEXIST || result == ERANGE || result == EINVAL) {
 			/*
@@ -211,6 +568,14 @@ int find_new_gid (bool sys_group,
 		}
 	}
 
+	/*
+	 * The lookup index of the group file usually tells which
+	 * value is next without a search.
+	 */
+	if (gid_hint (sys_group, gid_min, gid_max, gid)) {
+		return 0;
+	}
+
 	/*
 	 * Search the entire group file,
 	 * looking for the next unused value.
@@ -230,16 +595,6 @@ int find_new_gid (bool sys_group,
 	 *
 	 */
 
-	/* Create an array to hold all of the discovered GIDs */
-	used_gids = malloc (sizeof (bool) * (gid_max +1));
-	if (NULL == used_gids) {
-		fprintf (log_get_logfd(),
-			 _("%s: failed to allocate memory: %s\n"),
-			 log_get_progname(), strerror (errno));
-		return -1;
-	}
-	memset (used_gids, false, sizeof (bool) * (gid_max + 1));
-
 	/* First look for the lowest and highest value in the local database */
 	(void) gr_rewind ();
 	highest_found = gid_min;
@@ -265,10 +620,36 @@ int find_new_gid (bool sys_group,
 		if (grp->gr_gid >= gid_min
 			&& grp->gr_gid <= gid_max) {
 
-			used_gids[grp->gr_gid] = true;
+			if (used_gid_add (&used_gids, grp->gr_gid) != 0) {
+				fprintf (log_get_logfd(),
+					 _("%s: failed to allocate memory: %s\n"),
+					 log_get_progname(), strerror (errno));
+				free (used_gids.ids);
+				return -1;
+			}
 		}
 	}
 
+	/*
+	 * With ID_PROBE_ENUMERATE, also skip the GIDs known to NSS without
+	 * a lookup for each of them.
+	 */
+	if (used_gids_add_nss (&used_gids, gid_min, gid_max) != 0) {
+		fprintf (log_get_logfd(),
+			 _("%s: failed to allocate memory: %s\n"),
+			 log_get_progname(), strerror (errno));
+		free (used_gids.ids);
+		return -1;
+	}
+	if (used_gids_add_leases (&used_gids, gr_dbname (), gid_min, gid_max) != 0) {
+		fprintf (log_get_logfd(),
+			 _("%s: failed to allocate memory: %s\n"),
+			 log_get_progname(), strerror (errno));
+		free (used_gids.ids);
+		return -1;
+	}
+	used_gids_sort (&used_gids);
+
 	if (sys_group) {
 		/*
 		 * For system groups, we want to start from the
@@ -295,12 +676,13 @@ int find_new_gid (bool sys_group,
 		}
 
 		/* Search through all of the IDs in the range */
-		for (id = lowest_found; id >= gid_min; id--) {
-			result = check_gid (id, gid_min, gid_max, used_gids);
+		for (id = lowest_found; free_gid_down (&used_gids, gid_min, gid_max, &id) && !deadline_expired (); id--) {
+			prefetch_gids (&used_gids, gid_min, gid_max, id, true);
+			result = check_gid (id, gid_min, gid_max);
 			if (result == 0) {
 				/* This GID is available. Return it. */
 				*gid = id;
-				free (used_gids);
+				free (used_gids.ids);
 				return 0;
 			} else if (result == EEXIST || result == EINVAL) {
 				/*
@@ -341,12 +723,13 @@ int find_new_gid (bool sys_group,
 		 * network services such as LDAP.)
 		 */
 		if (lowest_found != gid_max) {
-			for (id = gid_max; id >= gid_min; id--) {
-				result = check_gid (id, gid_min, gid_max, used_gids);
+			for (id = gid_max; free_gid_down (&used_gids, gid_min, gid_max, &id) && !deadline_expired (); id--) {
+				prefetch_gids (&used_gids, gid_min, gid_max, id, true);
+				result = check_gid (id, gid_min, gid_max);
 				if (result == 0) {
 					/* This GID is available. Return it. */
 					*gid = id;
-					free (used_gids);
+					free (used_gids.ids);
 					return 0;
 				} else if (result == EEXIST || result == EINVAL) {
 					/*
@@ -404,12 +787,13 @@ int find_new_gid (bool sys_group,
 		}
 
 		/* Search through all of the IDs in the range */
-		for (id = highest_found; id <= gid_max; id++) {
-			result = check_gid (id, gid_min, gid_max, used_gids);
+		for (id = highest_found; free_gid_up (&used_gids, gid_min, gid_max, &id) && !deadline_expired (); id++) {
+			prefetch_gids (&used_gids, gid_min, gid_max, id, false);
+			result = check_gid (id, gid_min, gid_max);
 			if (result == 0) {
 				/* This GID is available. Return it. */
 				*gid = id;
-				free (used_gids);
+				free (used_gids.ids);
 				return 0;
 			} else if (result == EEXIST || result == EINVAL) {
 				/*
@@ -450,12 +834,13 @@ int find_new_gid (bool sys_group,
 		 * network services such as LDAP.)
 		 */
 		if (highest_found != gid_min) {
-			for (id = gid_min; id <= gid_max; id++) {
-				result = check_gid (id, gid_min, gid_max, used_gids);
+			for (id = gid_min; free_gid_up (&used_gids, gid_min, gid_max, &id) && !deadline_expired (); id++) {
+				prefetch_gids (&used_gids, gid_min, gid_max, id, false);
+				result = check_gid (id, gid_min, gid_max);
 				if (result == 0) {
 					/* This GID is available. Return it. */
 					*gid = id;
-					free (used_gids);
+					free (used_gids.ids);
 					return 0;
 				} else if (result == EEXIST || result == EINVAL) {
 					/*
@@ -489,12 +874,48 @@ int find_new_gid (bool sys_group,
 		}
 	}
 
+	/* The search stops at the deadline */
+	if (deadline_check ("GID search") != 0) {
+		free (used_gids.ids);
+		return -1;
+	}
+
 	/* The code reached here and found no available IDs in the range */
 	fprintf (log_get_logfd(),
 		_("%s: Can't get unique GID (no more available GIDs)\n"),
 		log_get_progname());
 	SYSLOG ((LOG_WARN, "no more available GIDs on the system"));
-	free (used_gids);
+	free (used_gids.ids);
 	return -1;
 }
 
+/*
+ * reserve_new_gid - Find a new unused GID and lease it.
+ *
+ * Like find_new_gid, but the GID is also leased in the group file, so
+ * that the tools running in parallel pick other IDs. The database does
+ * not need to be locked: the GID must still be checked once it is.
+ *
+ * Return 0 on success, -1 if no unused GIDs are available.
+ */
+int reserve_new_gid (bool sys_group, gid_t *gid)
+{
+	int tries;
+
+	for (tries = 0; tries < 16; tries++) {
+		int ret;
+
+		if (find_new_gid (sys_group, gid, NULL) != 0) {
+			return -1;
+		}
+
+		ret = id_lease_take (gr_dbname (), *gid);
+		if (0 != ret) {
+			/* Without leases (-1), the GID is still valid */
+			return 0;
+		}
+		/* Another process leased it meanwhile; pick another */
+	}
+
+	return -1;
+}
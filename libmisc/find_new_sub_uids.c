@@ -11,38 +11,107 @@
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "prototypes.h"
 #include "subordinateio.h"
 #include "getdef.h"
 #include "shadowlog.h"
 
+/*
+ * sub_uid_config - Get the range of subordinate UIDs to allocate from,
+ *                  and the number of UIDs of a range.
+ *
+ * Return 0 on success, -1 if the configuration is invalid.
+ */
+static int sub_uid_config (unsigned long *min, unsigned long *max,
+                           unsigned long *count)
+{
+	*min = getdef_ulong ("SUB_UID_MIN", 100000UL);
+	*max = getdef_ulong ("SUB_UID_MAX", 600100000UL);
+	*count = getdef_ulong ("SUB_UID_COUNT", 65536);
+
+	if (*min > *max || *count >= *max || (*min + *count - 1) > *max) {
+		(void) fprintf (log_get_logfd(),
+				_("%s: Invalid configuration: SUB_UID_MIN (%lu),"
+				  " SUB_UID_MAX (%lu), SUB_UID_COUNT (%lu)\n"),
+			log_get_progname(), *min, *max, *count);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * uid_range_start - Compute the first subordinate UID of the user uid,
+ *                   when SUB_ID_FROM_UID is set.
+ *
+ * The ranges of the users follow each other in the order of their
+ * UIDs, from SUB_UID_MIN for UID_MIN.
+ *
+ * Return 1 and set *start if the range is computed from the UID, 0 if
+ * it must be searched, -1 if the user cannot have a computed range.
+ */
+static int uid_range_start (uid_t uid, unsigned long min, unsigned long max,
+                           unsigned long count, unsigned long *start)
+{
+	unsigned long uid_min;
+
+	if (!getdef_bool ("SUB_ID_FROM_UID")) {
+		return 0;
+	}
+
+	uid_min = getdef_ulong ("UID_MIN", 1000UL);
+	if (   (uid < uid_min)
+	    || ((uid - uid_min) > (max - min - (count - 1)) / count)) {
+		(void) fprintf (log_get_logfd(),
+		                _("%s: UID %lu has no subordinate UIDs between"
+		                  " SUB_UID_MIN (%lu) and SUB_UID_MAX (%lu)\n"),
+		                log_get_progname(), (unsigned long) uid, min, max);
+		return -1;
+	}
+	*start = min + (uid - uid_min) * count;
+	return 1;
+}
+
 /*
  * find_new_sub_uids - Find a new unused range of UIDs.
  *
  * If successful, find_new_sub_uids provides a range of unused
- * user IDs in the [SUB_UID_MIN:SUB_UID_MAX] range.
+ * user IDs in the [SUB_UID_MIN:SUB_UID_MAX] range for the user of UID
+ * owner. If SUB_ID_FROM_UID is set, the range is computed from owner.
  *
  * Return 0 on success, -1 if no unused UIDs are available.
  */
-int find_new_sub_uids (uid_t *range_start, unsigned long *range_count)
+int find_new_sub_uids (uid_t owner, uid_t *range_start,
+                       unsigned long *range_count)
 {
 	unsigned long min, max;
 	unsigned long count;
+	unsigned long first;
 	uid_t start;
 
 	assert (range_start != NULL);
 	assert (range_count != NULL);
 
-	min = getdef_ulong ("SUB_UID_MIN", 100000UL);
-	max = getdef_ulong ("SUB_UID_MAX", 600100000UL);
-	count = getdef_ulong ("SUB_UID_COUNT", 65536);
+	if (sub_uid_config (&min, &max, &count) != 0) {
+		return -1;
+	}
 
-	if (min > max || count >= max || (min + count - 1) > max) {
-		(void) fprintf (log_get_logfd(),
-				_("%s: Invalid configuration: SUB_UID_MIN (%lu),"
-				  " SUB_UID_MAX (%lu), SUB_UID_COUNT (%lu)\n"),
-			log_get_progname(), min, max, count);
+	switch (uid_range_start (owner, min, max, count, &first)) {
+	case 1:
+		if (!sub_uid_range_free (first, count)) {
+			fprintf (log_get_logfd(),
+			         _("%s: The subordinate UIDs of UID %lu are already used\n"),
+			         log_get_progname(), (unsigned long) owner);
+			SYSLOG ((LOG_WARN, "subordinate UIDs of UID %lu already used",
+			         (unsigned long) owner));
+			return -1;
+		}
+		*range_start = first;
+		*range_count = count;
+		return 0;
+	case -1:
 		return -1;
 	}
 
@@ -58,6 +127,110 @@ int find_new_sub_uids (uid_t *range_start, unsigned long *range_count)
 	*range_count = count;
 	return 0;
 }
+
+static int cmp_starts (const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *) a;
+	unsigned long y = *(const unsigned long *) b;
+
+	return (x < y) ? -1 : (x > y) ? 1 : 0;
+}
+
+/*
+ * computed_uid_ranges - The ranges of the n owners, computed from their
+ *                        UIDs, when SUB_ID_FROM_UID is set.
+ *
+ * Return 0 on success, -1 if a range cannot be computed, is already
+ * used, or is the range of two owners.
+ */
+static int computed_uid_ranges (size_t n, const uid_t *owners,
+                                 unsigned long min, unsigned long max,
+                                 unsigned long count,
+                                 unsigned long *range_starts,
+                                 unsigned long *range_count)
+{
+	unsigned long *sorted;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (uid_range_start (owners[i], min, max, count,
+		                     &range_starts[i]) != 1) {
+			return -1;
+		}
+		if (!sub_uid_range_free (range_starts[i], count)) {
+			fprintf (log_get_logfd(),
+			         _("%s: The subordinate UIDs of UID %lu are already used\n"),
+			         log_get_progname(), (unsigned long) owners[i]);
+			SYSLOG ((LOG_WARN, "subordinate UIDs of UID %lu already used",
+			         (unsigned long) owners[i]));
+			return -1;
+		}
+	}
+
+	/* Two owners with the same UID would get the same range */
+	sorted = malloc ((n + 1) * sizeof *sorted);
+	if (NULL == sorted) {
+		fprintf (log_get_logfd(), _("%s: out of memory\n"),
+		         log_get_progname());
+		return -1;
+	}
+	memcpy (sorted, range_starts, n * sizeof *sorted);
+	qsort (sorted, n, sizeof *sorted, cmp_starts);
+	for (i = 1; i < n; i++) {
+		if (sorted[i] == sorted[i - 1]) {
+			fprintf (log_get_logfd(),
+			         _("%s: Several owners of subordinate UIDs have the same UID\n"),
+			         log_get_progname());
+			free (sorted);
+			return -1;
+		}
+	}
+	free (sorted);
+
+	*range_count = count;
+	return 0;
+}
+
+/*
+ * find_new_sub_uids_many - Find n new unused ranges of UIDs.
+ *
+ * If successful, find_new_sub_uids_many provides the first UID of n
+ * unused ranges in the [SUB_UID_MIN:SUB_UID_MAX] range: the ranges
+ * which n calls of find_new_sub_uids would provide if each range was
+ * added before the next call. The i-th range is for the user of UID
+ * owners[i].
+ *
+ * Return 0 on success, -1 if not enough unused UIDs are available.
+ */
+int find_new_sub_uids_many (size_t n, const uid_t *owners,
+                            unsigned long *range_starts,
+                            unsigned long *range_count)
+{
+	unsigned long min, max;
+	unsigned long count;
+
+	assert (range_starts != NULL);
+	assert (range_count != NULL);
+
+	if (sub_uid_config (&min, &max, &count) != 0) {
+		return -1;
+	}
+
+	if (getdef_bool ("SUB_ID_FROM_UID")) {
+		return computed_uid_ranges (n, owners, min, max, count,
+		                              range_starts, range_count);
+	}
+
+	if (sub_uid_find_free_ranges (min, max, count, n, range_starts) != 0) {
+		fprintf (log_get_logfd(),
+		         _("%s: Can't get unique subordinate UID range\n"),
+		         log_get_progname());
+		SYSLOG ((LOG_WARN, "no more available subordinate UIDs on the system"));
+		return -1;
+	}
+	*range_count = count;
+	return 0;
+}
 #else				/* !ENABLE_SUBIDS */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* !ENABLE_SUBIDS */
@@ -13,6 +13,9 @@
 #include <errno.h>
 
 #include "prototypes.h"
+#include "probes.h"
+#include "commonio.h"
+#include "groupio.h"
 #include "pwio.h"
 #include "getdef.h"
 #include "shadowlog.h"
@@ -28,6 +31,25 @@
  * preferred_min: The special-case minimum value for a specifically-
  * requested ID, which may be lower than the standard min_id
  */
+/*
+ * uid_block_full - Check if all the UIDs of [first:last] are used in the
+ *                  local passwd database.
+ */
+static bool uid_block_full (unsigned long first, unsigned long last)
+{
+	unsigned long id;
+
+	for (id = first; id <= last; id++) {
+		if (pw_locate_uid ((uid_t) id) == NULL) {
+			return false;
+		}
+		if (id == last) {
+			break;
+		}
+	}
+	return true;
+}
+
 static int get_ranges (bool sys_user, uid_t *min_id, uid_t *max_id,
 			uid_t *preferred_min)
 {
@@ -88,11 +110,325 @@ static int get_ranges (bool sys_user, uid_t *min_id, uid_t *max_id,
 					(unsigned long) *max_id);
 			return EINVAL;
 		}
+
+		/* Only the block leased by this host, with ID_BLOCK_FILE */
+		if (getdef_str ("ID_BLOCK_FILE") != NULL) {
+			unsigned long min = *min_id, max = *max_id;
+
+			if (id_block_range (&min, &max, uid_block_full) != 0) {
+				return EINVAL;
+			}
+			*min_id = min;
+			*max_id = max;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The UIDs of the [uid_min:uid_max] range used in the local database,
+ * sorted and unique after used_uids_sort().
+ */
+struct used_uids {
+	/*@null@*/ /*@only@*/uid_t *ids;
+	size_t count;
+	size_t size;
+};
+
+/*
+ * used_uid_add - Record that uid is used
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_uid_add (struct used_uids *used, uid_t uid)
+{
+	if (used->count == used->size) {
+		size_t size = (0 == used->size) ? 64 : used->size * 2;
+		uid_t *ids;
+
+		ids = realloc (used->ids, size * sizeof *ids);
+		if (NULL == ids) {
+			return -1;
+		}
+		used->ids = ids;
+		used->size = size;
+	}
+	used->ids[used->count++] = uid;
+	return 0;
+}
+
+static int uid_cmp (const void *p1, const void *p2)
+{
+	uid_t u1 = *(const uid_t *) p1;
+	uid_t u2 = *(const uid_t *) p2;
+
+	return (u1 < u2) ? -1 : (u1 > u2);
+}
+
+static void used_uids_sort (struct used_uids *used)
+{
+	size_t i, n = 0;
+
+	if (0 == used->count) {
+		return;
+	}
+	qsort (used->ids, used->count, sizeof used->ids[0], uid_cmp);
+	for (i = 1; i < used->count; i++) {
+		if (used->ids[i] != used->ids[n]) {
+			used->ids[++n] = used->ids[i];
+		}
+	}
+	used->count = n + 1;
+}
+
+/*
+ * used_uid_pos - Position of the first used UID greater than or equal
+ *                to uid
+ */
+static size_t used_uid_pos (const struct used_uids *used, uid_t uid)
+{
+	size_t lo = 0, hi = used->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (used->ids[mid] < uid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * free_uid_up - Skip the UIDs used in the local database, from *uid up
+ *
+ *	The runs of consecutive used UIDs are skipped at once.
+ *
+ *	Return false if no UID of [*uid:uid_max] is left.
+ */
+static bool free_uid_up (const struct used_uids *used,
+                         uid_t uid_min, uid_t uid_max, uid_t *uid)
+{
+	size_t i;
+
+	if ((*uid < uid_min) || (*uid > uid_max)) {
+		return false;
+	}
+	for (i = used_uid_pos (used, *uid);
+	     (i < used->count) && (used->ids[i] == *uid);
+	     i++) {
+		if (*uid == uid_max) {
+			return false;
+		}
+		(*uid)++;
+	}
+	return true;
+}
+
+/*
+ * free_uid_down - Skip the UIDs used in the local database, from *uid
+ *                 down
+ *
+ *	The runs of consecutive used UIDs are skipped at once.
+ *
+ *	Return false if no UID of [uid_min:*uid] is left.
+ */
+static bool free_uid_down (const struct used_uids *used,
+                           uid_t uid_min, uid_t uid_max, uid_t *uid)
+{
+	size_t i;
+
+	if ((*uid < uid_min) || (*uid > uid_max)) {
+		return false;
+	}
+	i = used_uid_pos (used, *uid);
+	if ((i == used->count) || (used->ids[i] != *uid)) {
+		return true;
+	}
+	for (;;) {
+		if (*uid == uid_min) {
+			return false;
+		}
+		(*uid)--;
+		if ((0 == i) || (used->ids[i - 1] != *uid)) {
+			return true;
+		}
+		i--;
 	}
+}
+
+/*
+ * The UIDs and GIDs listed by NSS, with ID_PROBE_ENUMERATE.
+ *
+ * They are listed once per process, since a tool like newusers searches
+ * an ID for each of its lines. The IDs added since then are in the
+ * local databases, and the ID which is picked is still checked with a
+ * lookup.
+ */
+static struct used_uids nss_uids = { NULL, 0, 0 };
+static bool nss_uids_listed = false;
+static struct used_uids nss_gids = { NULL, 0, 0 };
+static bool nss_gids_listed = false;
+
+/*
+ * list_nss_ids - List the UIDs of the passwd entries, or the GIDs of the
+ *                group entries if groups is set
+ *
+ *	With a prefix, these are the IDs of the files of the prefix.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int list_nss_ids (struct used_uids *list, bool groups)
+{
+	const struct passwd *pwd;
+	const struct group *grp;
+	int ret = 0;
 
+	if (groups) {
+		prefix_setgrent ();
+		while ((grp = prefix_getgrent ()) != NULL) {
+			if (used_uid_add (list, grp->gr_gid) != 0) {
+				ret = -1;
+				break;
+			}
+		}
+		prefix_endgrent ();
+	} else {
+		prefix_setpwent ();
+		while ((pwd = prefix_getpwent ()) != NULL) {
+			if (used_uid_add (list, pwd->pw_uid) != 0) {
+				ret = -1;
+				break;
+			}
+		}
+		prefix_endpwent ();
+	}
+	if (0 != ret) {
+		free (list->ids);
+		list->ids = NULL;
+		list->count = 0;
+		list->size = 0;
+		return -1;
+	}
+	used_uids_sort (list);
 	return 0;
 }
 
+/*
+ * used_uids_add_listed - Record the IDs of list in the [uid_min:uid_max]
+ *                        range
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_uids_add_listed (struct used_uids *used,
+                                 const struct used_uids *list,
+                                 uid_t uid_min, uid_t uid_max)
+{
+	size_t i;
+
+	for (i = used_uid_pos (list, uid_min);
+	     (i < list->count) && (list->ids[i] <= uid_max);
+	     i++) {
+		if (used_uid_add (used, list->ids[i]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * used_uids_add_nss - Record the UIDs of the range listed by NSS
+ *
+ *	This is only done with ID_PROBE_ENUMERATE: listing all the entries
+ *	of a remote directory can cost more than the lookups it saves.
+ *	The services which do not enumerate their entries only list some
+ *	of them, or none: the UID which is picked is still checked with a
+ *	lookup.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_uids_add_nss (struct used_uids *used,
+                            uid_t uid_min, uid_t uid_max)
+{
+	if (!getdef_bool ("ID_PROBE_ENUMERATE")) {
+		return 0;
+	}
+	if (!nss_uids_listed) {
+		if (list_nss_ids (&nss_uids, false) != 0) {
+			return -1;
+		}
+		nss_uids_listed = true;
+	}
+	return used_uids_add_listed (used, &nss_uids, uid_min, uid_max);
+}
+
+/*
+ * used_uids_add_gids - Record the GIDs of the UID range used in the
+ *                      local group database, or listed by NSS with
+ *                      ID_PROBE_ENUMERATE
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_uids_add_gids (struct used_uids *used,
+                               uid_t uid_min, uid_t uid_max)
+{
+	const struct group *grp;
+
+	(void) gr_rewind ();
+	while ((grp = gr_next ()) != NULL) {
+		if (   (grp->gr_gid >= uid_min)
+		    && (grp->gr_gid <= uid_max)
+		    && (used_uid_add (used, grp->gr_gid) != 0)) {
+			return -1;
+		}
+	}
+
+	if (!getdef_bool ("ID_PROBE_ENUMERATE")) {
+		return 0;
+	}
+	if (!nss_gids_listed) {
+		if (list_nss_ids (&nss_gids, true) != 0) {
+			return -1;
+		}
+		nss_gids_listed = true;
+	}
+	return used_uids_add_listed (used, &nss_gids, uid_min, uid_max);
+}
+
+/*
+ * used_uids_add_leases - Record the IDs of the range leased by other
+ *                        processes in the leases of dbfile
+ *
+ *	The leases are only a hint: if they cannot be read, the ID is
+ *	still checked when the database is locked.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int used_uids_add_leases (struct used_uids *used, const char *dbfile,
+                                 uid_t uid_min, uid_t uid_max)
+{
+	unsigned long *ids;
+	size_t count, i;
+	int ret = 0;
+
+	if (id_lease_list (dbfile, &ids, &count) != 0) {
+		return 0;
+	}
+	for (i = 0; i < count; i++) {
+		if (   (ids[i] >= uid_min)
+		    && (ids[i] <= uid_max)
+		    && (used_uid_add (used, ids[i]) != 0)) {
+			ret = -1;
+			break;
+		}
+	}
+	free (ids);
+	return ret;
+}
+
 /*
  * check_uid - See if the requested UID is available
  *
@@ -101,12 +437,17 @@ static int get_ranges (bool sys_user, uid_t *min_id, uid_t *max_id,
  * If the ID might clash with -1, return EINVAL
  * If the ID is outside the range, return ERANGE
  * In other cases, return errno from getpwuid()
+ *
+ * If with_gids is set, the ID must also be available as a GID.
  */
 static int check_uid(const uid_t uid,
 		     const uid_t uid_min,
 		     const uid_t uid_max,
-		     const bool *used_uids)
+		     bool with_gids)
 {
+	metrics_add (METRICS_ID_SEARCH, "uid", 1);
+	PROBE1 (uid__check, uid);
+
 	/* First test that the preferred ID is in the range */
 	if (uid < uid_min || uid > uid_max) {
 		return ERANGE;
@@ -117,16 +458,8 @@ static int check_uid(const uid_t uid,
 		return EINVAL;
 	}
 
-	/*
-	 * Check whether we already detected this UID
-	 * using the pw_next() loop
-	 */
-	if (used_uids != NULL && used_uids[uid]) {
-		return EEXIST;
-	}
 	/* Check if the UID exists according to NSS */
-	errno = 0;
-	if (prefix_getpwuid(uid) != NULL) {
+	if (prefix_uid_used (uid)) {
 		return EEXIST;
 	} else {
 		/* getpwuid() was NULL
@@ -135,26 +468,115 @@ static int check_uid(const uid_t uid,
 		 * would completely block user/group creation
 		 */
 	}
+	if (with_gids && prefix_gid_used (uid)) {
+		return EEXIST;
+	}
 
 	/* If we've made it here, the UID must be available */
 	return 0;
 }
 
 /*
- * find_new_uid - Find a new unused UID.
+ * prefetch_uids - Look the next candidate UIDs up through NSS in
+ *                 parallel, with ID_PROBE_JOBS
  *
- * If successful, find_new_uid provides an unused user ID in the
- * [UID_MIN:UID_MAX] range.
- * This ID should be higher than all the used UID, but if not possible,
- * the lowest unused ID in the range will be returned.
+ *	The candidates are the free UIDs of used from id, down if down
+ *	is set. They are also looked up as GIDs if with_gids is set.
+ */
+static void prefetch_uids (const struct used_uids *used,
+                           uid_t uid_min, uid_t uid_max, uid_t id,
+                           bool down, bool with_gids)
+{
+	unsigned long ids[ID_PREFETCH_MAX];
+	long jobs = getdef_long ("ID_PROBE_JOBS", 1);
+	size_t n = 0;
+
+	if (jobs <= 1) {
+		return;
+	}
+	if (jobs > ID_PREFETCH_MAX) {
+		jobs = ID_PREFETCH_MAX;
+	}
+	while (   (n < (size_t) jobs)
+	       && (down ? free_uid_down (used, uid_min, uid_max, &id)
+	                : free_uid_up (used, uid_min, uid_max, &id))) {
+		ids[n++] = id;
+		if (id == (down ? uid_min : uid_max)) {
+			break;
+		}
+		if (down) {
+			id--;
+		} else {
+			id++;
+		}
+	}
+	prefix_prefetch_ids (ids, n, true, with_gids);
+}
+
+/*
+ * uid_hint - Get the UID after the lowest (system users) or highest
+ *            (non-system users) of the range from the lookup index of
+ *            the passwd file, without walking the database.
+ *
+ * Return true and set *uid if this UID is free, false if the whole
+ * database must be searched instead.
+ */
+static bool uid_hint (bool sys_user, uid_t uid_min, uid_t uid_max,
+                      bool with_gids, uid_t *uid)
+{
+	const struct commonio_db *db = __pw_get_db ();
+	unsigned long lowest, highest;
+	uid_t id;
+	int result;
+
+	/* The index does not know the uncommitted changes */
+	if (!db->isopen || db->changed) {
+		return false;
+	}
+
+	result = dbindex_id_bounds (pw_dbname (), uid_min, uid_max,
+	                            &lowest, &highest);
+	if (-1 == result) {
+		return false;
+	}
+	if (0 == result) {
+		id = sys_user ? uid_max : uid_min;
+	} else if (sys_user) {
+		if (lowest == uid_min) {
+			return false;
+		}
+		id = lowest - 1;
+	} else {
+		if (highest == uid_max) {
+			return false;
+		}
+		id = highest + 1;
+	}
+
+	if (   (check_uid (id, uid_min, uid_max, with_gids) != 0)
+	    || (pw_locate_uid (id) != NULL)
+	    || id_leased (pw_dbname (), id)
+	    || (with_gids && (gr_locate_gid (id) != NULL))
+	    || (with_gids && id_leased (gr_dbname (), id))) {
+		return false;
+	}
+
+	*uid = id;
+	return true;
+}
+
+/*
+ * find_uid - Find a new unused UID, which is also unused as a GID if
+ *            with_gids is set.
  *
  * Return 0 on success, -1 if no unused UIDs are available.
  */
-int find_new_uid(bool sys_user,
-                 uid_t *uid,
-                 /*@null@*/uid_t const *preferred_uid)
+static int find_uid (bool sys_user,
+                     uid_t *uid,
+                     /*@null@*/uid_t const *preferred_uid,
+                     bool with_gids)
 {
-	bool *used_uids;
+	struct used_uids used_uids = { NULL, 0, 0 };
 	const struct passwd *pwd;
 	uid_t uid_min, uid_max, preferred_min;
 	uid_t id;
@@ -175,7 +597,7 @@ int find_new_uid(bool sys_user,
 
 	/* Check if the preferred UID is available */
 	if (preferred_uid) {
-		result = check_uid (*preferred_uid, preferred_min, uid_max, NULL);
+		result = check_uid (*preferred_uid, preferred_min, uid_max, false);
 		if (result == 0) {
 			/*
 			 * Make sure the UID isn't queued for use already
@@ -211,6 +633,14 @@ int find_new_uid(bool sys_user,
 		}
 	}
 
+	/*
+	 * The lookup index of the passwd file usually tells which
+	 * value is next without a search.
+	 */
+	if (uid_hint (sys_user, uid_min, uid_max, with_gids, uid)) {
+		return 0;
+	}
+
 	/*
 	 * Search the entire passwd file,
 	 * looking for the next unused value.
@@ -230,16 +660,6 @@ int find_new_uid(bool sys_user,
 	 *
 	 */
 
-	/* Create an array to hold all of the discovered UIDs */
-	used_uids = malloc (sizeof (bool) * (uid_max +1));
-	if (NULL == used_uids) {
-		fprintf (log_get_logfd(),
-			 _("%s: failed to allocate memory: %s\n"),
-			 log_get_progname(), strerror (errno));
-		return -1;
-	}
-	memset (used_uids, false, sizeof (bool) * (uid_max + 1));
-
 	/* First look for the lowest and highest value in the local database */
 	(void) pw_rewind ();
 	highest_found = uid_min;
@@ -265,10 +685,46 @@ int find_new_uid(bool sys_user,
 		if (pwd->pw_uid >= uid_min
 			&& pwd->pw_uid <= uid_max) {
 
-			used_uids[pwd->pw_uid] = true;
+			if (used_uid_add (&used_uids, pwd->pw_uid) != 0) {
+				fprintf (log_get_logfd(),
+					 _("%s: failed to allocate memory: %s\n"),
+					 log_get_progname(), strerror (errno));
+				free (used_uids.ids);
+				return -1;
+			}
 		}
 	}
 
+	/*
+	 * With ID_PROBE_ENUMERATE, also skip the UIDs known to NSS without
+	 * a lookup for each of them.
+	 */
+	if (used_uids_add_nss (&used_uids, uid_min, uid_max) != 0) {
+		fprintf (log_get_logfd(),
+			 _("%s: failed to allocate memory: %s\n"),
+			 log_get_progname(), strerror (errno));
+		free (used_uids.ids);
+		return -1;
+	}
+	if (   with_gids
+	    && (used_uids_add_gids (&used_uids, uid_min, uid_max) != 0)) {
+		fprintf (log_get_logfd(),
+			 _("%s: failed to allocate memory: %s\n"),
+			 log_get_progname(), strerror (errno));
+		free (used_uids.ids);
+		return -1;
+	}
+	if (   (used_uids_add_leases (&used_uids, pw_dbname (), uid_min, uid_max) != 0)
+	    || (   with_gids
+	        && (used_uids_add_leases (&used_uids, gr_dbname (), uid_min, uid_max) != 0))) {
+		fprintf (log_get_logfd(),
+			 _("%s: failed to allocate memory: %s\n"),
+			 log_get_progname(), strerror (errno));
+		free (used_uids.ids);
+		return -1;
+	}
+	used_uids_sort (&used_uids);
+
 	if (sys_user) {
 		/*
 		 * For system users, we want to start from the
@@ -295,12 +751,13 @@ int find_new_uid(bool sys_user,
 		}
 
 		/* Search through all of the IDs in the range */
-		for (id = lowest_found; id >= uid_min; id--) {
-			result = check_uid (id, uid_min, uid_max, used_uids);
+		for (id = lowest_found; free_uid_down (&used_uids, uid_min, uid_max, &id) && !deadline_expired (); id--) {
+			prefetch_uids (&used_uids, uid_min, uid_max, id, true, with_gids);
+			result = check_uid (id, uid_min, uid_max, with_gids);
 			if (result == 0) {
 				/* This UID is available. Return it. */
 				*uid = id;
-				free (used_uids);
+				free (used_uids.ids);
 				return 0;
 			} else if (result == EEXIST || result == EINVAL) {
 				/*
@@ -341,12 +798,13 @@ int find_new_uid(bool sys_user,
 		 * network services such as LDAP.)
 		 */
 		if (lowest_found != uid_max) {
-			for (id = uid_max; id >= uid_min; id--) {
-				result = check_uid (id, uid_min, uid_max, used_uids);
+			for (id = uid_max; free_uid_down (&used_uids, uid_min, uid_max, &id) && !deadline_expired (); id--) {
+				prefetch_uids (&used_uids, uid_min, uid_max, id, true, with_gids);
+				result = check_uid (id, uid_min, uid_max, with_gids);
 				if (result == 0) {
 					/* This UID is available. Return it. */
 					*uid = id;
-					free (used_uids);
+					free (used_uids.ids);
 					return 0;
 				} else if (result == EEXIST || result == EINVAL) {
 					/*
@@ -404,12 +862,13 @@ int find_new_uid(bool sys_user,
 		}
 
 		/* Search through all of the IDs in the range */
-		for (id = highest_found; id <= uid_max; id++) {
-			result = check_uid (id, uid_min, uid_max, used_uids);
+		for (id = highest_found; free_uid_up (&used_uids, uid_min, uid_max, &id) && !deadline_expired (); id++) {
+			prefetch_uids (&used_uids, uid_min, uid_max, id, false, with_gids);
+			result = check_uid (id, uid_min, uid_max, with_gids);
 			if (result == 0) {
 				/* This UID is available. Return it. */
 				*uid = id;
-				free (used_uids);
+				free (used_uids.ids);
 				return 0;
 			} else if (result == EEXIST || result == EINVAL) {
 				/*
@@ -450,12 +909,13 @@ int find_new_uid(bool sys_user,
 		 * network services such as LDAP.)
 		 */
 		if (highest_found != uid_min) {
-			for (id = uid_min; id <= uid_max; id++) {
-				result = check_uid (id, uid_min, uid_max, used_uids);
+			for (id = uid_min; free_uid_up (&used_uids, uid_min, uid_max, &id) && !deadline_expired (); id++) {
+				prefetch_uids (&used_uids, uid_min, uid_max, id, false, with_gids);
+				result = check_uid (id, uid_min, uid_max, with_gids);
 				if (result == 0) {
 					/* This UID is available. Return it. */
 					*uid = id;
-					free (used_uids);
+					free (used_uids.ids);
 					return 0;
 				} else if (result == EEXIST || result == EINVAL) {
 					/*
@@ -489,12 +949,97 @@ int find_new_uid(bool sys_user,
 		}
 	}
 
+	/* The search stops at the deadline */
+	if (deadline_check ("UID search") != 0) {
+		free (used_uids.ids);
+		return -1;
+	}
+
 	/* The code reached here and found no available IDs in the range */
-	fprintf (log_get_logfd(),
-		_("%s: Can't get unique UID (no more available UIDs)\n"),
-		log_get_progname());
-	SYSLOG ((LOG_WARN, "no more available UIDs on the system"));
-	free (used_uids);
+	if (!with_gids) {
+		fprintf (log_get_logfd(),
+			_("%s: Can't get unique UID (no more available UIDs)\n"),
+			log_get_progname());
+		SYSLOG ((LOG_WARN, "no more available UIDs on the system"));
+	}
+	free (used_uids.ids);
 	return -1;
 }
 
+/*
+ * find_new_uid - Find a new unused UID.
+ *
+ * If successful, find_new_uid provides an unused user ID in the
+ * [UID_MIN:UID_MAX] range.
+ * This ID should be higher than all the used UID, but if not possible,
+ * the lowest unused ID in the range will be returned.
+ *
+ * Return 0 on success, -1 if no unused UIDs are available.
+ */
+int find_new_uid(bool sys_user,
+                 uid_t *uid,
+                 /*@null@*/uid_t const *preferred_uid)
+{
+	return find_uid (sys_user, uid, preferred_uid, false);
+}
+
+/*
+ * find_new_uid_gid - Find a new unused UID for a user which gets a
+ *                    group with the same ID.
+ *
+ * Like find_new_uid, but the UID and GID databases are searched
+ * together for an ID unused in both, so that find_new_gid can then
+ * accept the UID as the preferred GID. If there is none, an UID used as
+ * a GID is returned, as find_new_uid would.
+ *
+ * The group database must be open.
+ *
+ * Return 0 on success, -1 if no unused UIDs are available.
+ */
+int find_new_uid_gid (bool sys_user, uid_t *uid)
+{
+	if (find_uid (sys_user, uid, NULL, true) == 0) {
+		return 0;
+	}
+	return find_uid (sys_user, uid, NULL, false);
+}
+
+/*
+ * reserve_new_uid - Find a new unused UID and lease it.
+ *
+ * Like find_new_uid, or find_new_uid_gid if with_gids is set, but the
+ * UID is also leased in the passwd file (and in the group file if
+ * with_gids is set), so that the tools running in parallel pick other
+ * IDs. The databases do not need to be locked: the UID must still be
+ * checked once they are.
+ *
+ * Return 0 on success, -1 if no unused UIDs are available.
+ */
+int reserve_new_uid (bool sys_user, bool with_gids, uid_t *uid)
+{
+	int tries;
+
+	for (tries = 0; tries < 16; tries++) {
+		int ret;
+
+		if ((with_gids ? find_new_uid_gid (sys_user, uid)
+		               : find_new_uid (sys_user, uid, NULL)) != 0) {
+			return -1;
+		}
+
+		ret = id_lease_take (pw_dbname (), *uid);
+		if ((1 == ret) && with_gids) {
+			ret = id_lease_take (gr_dbname (), *uid);
+			if (0 == ret) {
+				id_lease_release (pw_dbname (), *uid);
+			}
+		}
+		if (0 != ret) {
+			/* Without leases (-1), the UID is still valid */
+			return 0;
+		}
+		/* Another process leased it meanwhile; pick another */
+	}
+
+	return -1;
+}
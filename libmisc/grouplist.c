@@ -0,0 +1,47 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <grp.h>
+#include <stdlib.h>
+#include "prototypes.h"
+
+/*
+ * get_grouplist - Get the groups of a user with getgrouplist()
+ *
+ *	The list includes gid, normally the primary group of the user. NSS
+ *	backends like LDAP or sssd answer this from an index, instead of
+ *	enumerating all the groups.
+ *
+ *	*groups must be freed by the caller. It is also set on errors, when
+ *	some memory was already allocated.
+ *
+ *	Return the number of groups, or -1 on errors.
+ */
+int get_grouplist (const char *user, gid_t gid, /*@out@*/gid_t **groups)
+{
+	int ngroups = 64;
+
+	*groups = NULL;
+	for (;;) {
+		gid_t *list;
+		int n = ngroups;
+
+		list = realloc (*groups, sizeof (gid_t) * ngroups);
+		if (NULL == list) {
+			return -1;
+		}
+		*groups = list;
+		if (getgrouplist (user, gid, list, &n) != -1) {
+			return n;
+		}
+		if (n <= ngroups) {
+			return -1;
+		}
+		ngroups = n;
+	}
+}
@@ -13,11 +13,28 @@
 #ident "$Id$"
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <pwd.h>
 #include "defines.h"
 #include "prototypes.h"
 #include "getdef.h"
+
+/*
+ * hush_match - check if a line of the hushed-logins file (of length len,
+ *              without its newline) is the user's name or shell
+ */
+static bool hush_match (const char *line, size_t len, const struct passwd *pw)
+{
+	return (   (strlen (pw->pw_shell) == len)
+	        && (strncmp (line, pw->pw_shell, len) == 0))
+	    || (   (strlen (pw->pw_name) == len)
+	        && (strncmp (line, pw->pw_name, len) == 0));
+}
 /*
  * hushed - determine if a user receives login messages
  *
@@ -26,11 +43,21 @@
  */
 bool hushed (const char *username)
 {
+	/* login asks twice for the same user with PAM */
+	static /*@null@*//*@only@*/char *last_user = NULL;
+	static bool last_hushed = false;
 	struct passwd *pw;
 	const char *hushfile;
 	char buf[BUFSIZ];
 	bool found;
+	struct stat sb;
+	const char *map;
+	const char *line;
+	const char *end;
+	const char *nl;
+	size_t len;
 	FILE *fp;
+	int fd;
 
 	/*
 	 * Get the name of the file to use.  If this option is not
@@ -42,6 +69,10 @@ bool hushed (const char *username)
 		return false;
 	}
 
+	if ((NULL != last_user) && (strcmp (last_user, username) == 0)) {
+		return last_hushed;
+	}
+
 	pw = getpwnam (username);
 	if (NULL == pw) {
 		return false;
@@ -54,7 +85,8 @@ bool hushed (const char *username)
 
 	if (hushfile[0] != '/') {
 		(void) snprintf (buf, sizeof (buf), "%s/%s", pw->pw_dir, hushfile);
-		return (access (buf, F_OK) == 0);
+		found = (access (buf, F_OK) == 0);
+		goto done;
 	}
 
 	/*
@@ -62,16 +94,45 @@ bool hushed (const char *username)
 	 * and see if this user, or its shell is in there.
 	 */
 
-	fp = fopen (hushfile, "r");
+	fd = open (hushfile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	found = false;
+	if (   (fstat (fd, &sb) == 0)
+	    && S_ISREG (sb.st_mode)
+	    && (sb.st_size > 0)) {
+		len = (size_t) sb.st_size;
+		map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED != map) {
+			(void) close (fd);
+			end = map + len;
+			for (line = map; !found && (line < end); line = nl + 1) {
+				nl = memchr (line, '\n', (size_t) (end - line));
+				if (NULL == nl) {
+					nl = end;
+				}
+				found = hush_match (line, (size_t) (nl - line), pw);
+			}
+			(void) munmap ((void *) map, len);
+			goto done;
+		}
+	}
+
+	fp = fdopen (fd, "r");
 	if (NULL == fp) {
+		(void) close (fd);
 		return false;
 	}
-	for (found = false; !found && (fgets (buf, sizeof buf, fp) == buf);) {
-		buf[strcspn (buf, "\n")] = '\0';
-		found = (strcmp (buf, pw->pw_shell) == 0) ||
-		        (strcmp (buf, pw->pw_name) == 0);
+	while (!found && (fgets (buf, sizeof buf, fp) == buf)) {
+		found = hush_match (buf, strcspn (buf, "\n"), pw);
 	}
 	(void) fclose (fp);
+
+done:
+	free (last_user);
+	last_user = strdup (username);
+	last_hushed = found;
 	return found;
 }
-
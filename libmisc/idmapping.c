@@ -14,6 +14,7 @@
 #include "prototypes.h"
 #include "stpeprintf.h"
 #include "idmapping.h"
+#include "subordinateio.h"
 #if HAVE_SYS_CAPABILITY_H
 #include <sys/prctl.h>
 #include <sys/capability.h>
@@ -121,6 +122,7 @@ static inline bool maps_lower_root(int cap, int ranges, const struct map_range *
 }
 #endif
 
+#if HAVE_SYS_CAPABILITY_H
 /*
  * The ruid refers to the caller's uid and is used to reset the effective uid
  * back to the callers real uid.
@@ -136,29 +138,11 @@ static inline bool maps_lower_root(int cap, int ranges, const struct map_range *
  * when the root user calls the new{g,u}idmap binary for an unprivileged user.
  * If this is wanted: use file capabilities!
  */
-void write_mapping(int proc_dir_fd, int ranges, const struct map_range *mappings,
-	const char *map_file, uid_t ruid)
+static void drop_capabilities(__u32 effective, uid_t ruid)
 {
-	int idx;
-	const struct map_range *mapping;
-	size_t bufsize;
-	char *buf, *pos, *end;
-	int fd;
-
-#if HAVE_SYS_CAPABILITY_H
-	int cap;
 	struct __user_cap_header_struct hdr = {_LINUX_CAPABILITY_VERSION_3, 0};
 	struct __user_cap_data_struct data[2] = {{0}};
 
-	if (strcmp(map_file, "uid_map") == 0) {
-		cap = CAP_SETUID;
-	} else if (strcmp(map_file, "gid_map") == 0) {
-		cap = CAP_SETGID;
-	} else {
-		fprintf(log_get_logfd(), _("%s: Invalid map file %s specified\n"), log_get_progname(), map_file);
-		exit(EXIT_FAILURE);
-	}
-
 	/* Align setuid- and fscaps-based new{g,u}idmap behavior. */
 	if (geteuid() == 0 && geteuid() != ruid) {
 		if (prctl(PR_SET_KEEPCAPS, 1, 0, 0, 0) < 0) {
@@ -174,20 +158,24 @@ void write_mapping(int proc_dir_fd, int ranges, const struct map_range *mappings
 
 	/* Lockdown new{g,u}idmap by dropping all unneeded capabilities. */
 	memset(data, 0, sizeof(data));
-	data[0].effective = CAP_TO_MASK(cap);
-	/*
-	 * When uid 0 from the ancestor userns is supposed to be mapped into
-	 * the child userns we need to retain CAP_SETFCAP.
-	 */
-	if (maps_lower_root(cap, ranges, mappings))
-		data[0].effective |= CAP_TO_MASK(CAP_SETFCAP);
+	data[0].effective = effective;
 	data[0].permitted = data[0].effective;
 	if (capset(&hdr, data) < 0) {
 		fprintf(log_get_logfd(), _("%s: Could not set caps\n"), log_get_progname());
 		exit(EXIT_FAILURE);
 	}
+}
 #endif
 
+static void write_map_file(int proc_dir_fd, int ranges,
+	const struct map_range *mappings, const char *map_file)
+{
+	int idx;
+	const struct map_range *mapping;
+	size_t bufsize;
+	char *buf, *pos, *end;
+	int fd;
+
 	bufsize = ranges * ((ULONG_DIGITS + 1) * 3);
 	pos = buf = xmalloc(bufsize);
 	end = buf + bufsize;
@@ -221,3 +209,274 @@ void write_mapping(int proc_dir_fd, int ranges, const struct map_range *mappings
 	close(fd);
 	free(buf);
 }
+
+void write_mapping(int proc_dir_fd, int ranges, const struct map_range *mappings,
+	const char *map_file, uid_t ruid)
+{
+#if HAVE_SYS_CAPABILITY_H
+	int cap;
+	__u32 effective;
+
+	if (strcmp(map_file, "uid_map") == 0) {
+		cap = CAP_SETUID;
+	} else if (strcmp(map_file, "gid_map") == 0) {
+		cap = CAP_SETGID;
+	} else {
+		fprintf(log_get_logfd(), _("%s: Invalid map file %s specified\n"), log_get_progname(), map_file);
+		exit(EXIT_FAILURE);
+	}
+
+	effective = CAP_TO_MASK(cap);
+	/*
+	 * When uid 0 from the ancestor userns is supposed to be mapped into
+	 * the child userns we need to retain CAP_SETFCAP.
+	 */
+	if (maps_lower_root(cap, ranges, mappings))
+		effective |= CAP_TO_MASK(CAP_SETFCAP);
+	drop_capabilities(effective, ruid);
+#endif
+
+	write_map_file(proc_dir_fd, ranges, mappings, map_file);
+}
+
+/*
+ * write_mappings - Write the gid_map and the uid_map of a process at once
+ *
+ *	The capabilities are dropped once, to the ones needed by both
+ *	maps. The setgroups policy must be written before, with
+ *	write_setgroups().
+ */
+void write_mappings(int proc_dir_fd,
+	int uid_ranges, const struct map_range *uid_mappings,
+	int gid_ranges, const struct map_range *gid_mappings, uid_t ruid)
+{
+#if HAVE_SYS_CAPABILITY_H
+	__u32 effective = CAP_TO_MASK(CAP_SETUID) | CAP_TO_MASK(CAP_SETGID);
+
+	if (maps_lower_root(CAP_SETUID, uid_ranges, uid_mappings))
+		effective |= CAP_TO_MASK(CAP_SETFCAP);
+	drop_capabilities(effective, ruid);
+#endif
+
+	write_map_file(proc_dir_fd, gid_ranges, gid_mappings, "gid_map");
+	write_map_file(proc_dir_fd, uid_ranges, uid_mappings, "uid_map");
+}
+
+#ifdef ENABLE_SUBIDS
+static bool verify_uid_range(const struct passwd *pw,
+	const struct map_range *range)
+{
+	/* An empty range is invalid */
+	if (range->count == 0)
+		return false;
+
+	/* Test /etc/subuid */
+	if (have_sub_uids(pw->pw_name, range->lower, range->count))
+		return true;
+
+	/* Allow a process to map its own uid */
+	if ((range->count == 1) && (pw->pw_uid == range->lower))
+		return true;
+
+	return false;
+}
+
+/*
+ * verify_uid_ranges - Check that the caller pw is allowed to map the
+ *	outside ranges of mappings as UIDs, or exit
+ */
+void verify_uid_ranges(const struct passwd *pw, int ranges,
+	const struct map_range *mappings)
+{
+	const struct map_range *mapping;
+	struct subid_range *wanted;
+	bool allowed;
+	int idx, n = 0;
+
+	/*
+	 * Check all the mappings against /etc/subuid at once. A process can
+	 * map its own uid even if it was not delegated to it, so these are
+	 * not checked. The map of /etc/subuid is tried first, if it is up
+	 * to date, and /etc/subuid itself is only read if needed.
+	 */
+	wanted = xmalloc ((ranges + 1) * sizeof *wanted);
+	for (idx = 0; idx < ranges; idx++) {
+		if ((mappings[idx].count == 1) && (pw->pw_uid == mappings[idx].lower))
+			continue;
+		wanted[n].start = mappings[idx].lower;
+		wanted[n].count = mappings[idx].count;
+		n++;
+	}
+	allowed = have_sub_id_ranges(pw->pw_name, ID_TYPE_UID, wanted, n);
+	if (!allowed) {
+		if (!sub_uid_open(O_RDONLY))
+			exit(EXIT_FAILURE);
+		allowed = have_sub_id_ranges(pw->pw_name, ID_TYPE_UID, wanted, n);
+	}
+	free(wanted);
+	if (allowed)
+		return;
+
+	/* Find the mapping which is not allowed */
+	mapping = mappings;
+	for (idx = 0; idx < ranges; idx++, mapping++) {
+		if (!verify_uid_range(pw, mapping)) {
+			fprintf(log_get_logfd(), _( "%s: uid range [%lu-%lu) -> [%lu-%lu) not allowed\n"),
+				log_get_progname(),
+				mapping->upper,
+				mapping->upper + mapping->count,
+				mapping->lower,
+				mapping->lower + mapping->count);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static bool verify_gid_range(const struct passwd *pw,
+	const struct map_range *range, bool *allow_setgroups)
+{
+	/* An empty range is invalid */
+	if (range->count == 0)
+		return false;
+
+	/* Test /etc/subgid. If the mapping is valid then we allow setgroups. */
+	if (have_sub_gids(pw->pw_name, range->lower, range->count)) {
+		*allow_setgroups = true;
+		return true;
+	}
+
+	/* Allow a process to map its own gid. */
+	if ((range->count == 1) && (getgid() == range->lower)) {
+		/* noop -- if setgroups is enabled already we won't disable it. */
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * verify_gid_ranges - Check that the caller pw is allowed to map the
+ *	outside ranges of mappings as GIDs, or exit
+ *
+ *	*allow_setgroups is set if a range was delegated to the caller in
+ *	/etc/subgid.
+ */
+void verify_gid_ranges(const struct passwd *pw, int ranges,
+	const struct map_range *mappings, bool *allow_setgroups)
+{
+	const struct map_range *mapping;
+	struct subid_range *wanted;
+	bool allowed;
+	int idx, n = 0;
+
+	/*
+	 * Check all the mappings against /etc/subgid at once. A process can
+	 * map its own gid even if it was not delegated to it, so these are
+	 * not checked. The map of /etc/subgid is tried first, if it is up
+	 * to date, and /etc/subgid itself is only read if needed.
+	 */
+	wanted = xmalloc ((ranges + 1) * sizeof *wanted);
+	for (idx = 0; idx < ranges; idx++) {
+		if ((mappings[idx].count == 1) && (getgid() == mappings[idx].lower))
+			continue;
+		wanted[n].start = mappings[idx].lower;
+		wanted[n].count = mappings[idx].count;
+		n++;
+	}
+	allowed = (n > 0) && have_sub_id_ranges(pw->pw_name, ID_TYPE_GID, wanted, n);
+	if (!allowed) {
+		if (!sub_gid_open(O_RDONLY))
+			exit(EXIT_FAILURE);
+		allowed = (n > 0) && have_sub_id_ranges(pw->pw_name, ID_TYPE_GID, wanted, n);
+	}
+	free(wanted);
+	if (allowed) {
+		/* At least one mapping is valid: setgroups is allowed */
+		*allow_setgroups = true;
+		return;
+	}
+
+	/* Check each mapping, and find the one which is not allowed */
+	mapping = mappings;
+	for (idx = 0; idx < ranges; idx++, mapping++) {
+		if (!verify_gid_range(pw, mapping, allow_setgroups)) {
+			fprintf(log_get_logfd(), _( "%s: gid range [%lu-%lu) -> [%lu-%lu) not allowed\n"),
+				log_get_progname(),
+				mapping->upper,
+				mapping->upper + mapping->count,
+				mapping->lower,
+				mapping->lower + mapping->count);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+#endif				/* ENABLE_SUBIDS */
+
+/*
+ * write_setgroups - Deny setgroups in the process, unless allow_setgroups
+ *	is set, before its gid_map is written
+ */
+void write_setgroups(int proc_dir_fd, bool allow_setgroups)
+{
+	int setgroups_fd;
+	const char *policy;
+	char policy_buffer[4096];
+
+	/*
+	 * Default is "deny", and any "allow" will out-rank a "deny". We don't
+	 * forcefully write an "allow" here because the process we are writing
+	 * mappings for may have already set themselves to "deny" (and "allow"
+	 * is the default anyway). So allow_setgroups == true is a noop.
+	 */
+	policy = "deny\n";
+	if (allow_setgroups)
+		return;
+
+	setgroups_fd = openat(proc_dir_fd, "setgroups", O_RDWR|O_CLOEXEC);
+	if (setgroups_fd < 0) {
+		/*
+		 * If it's an ENOENT then we are on too old a kernel for the setgroups
+		 * code to exist. Emit a warning and bail on this.
+		 */
+		if (ENOENT == errno) {
+			fprintf(log_get_logfd(), _("%s: kernel doesn't support setgroups restrictions\n"), log_get_progname());
+			goto out;
+		}
+		fprintf(log_get_logfd(), _("%s: couldn't open process setgroups: %s\n"),
+			log_get_progname(),
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	/*
+	 * Check whether the policy is already what we want. /proc/self/setgroups
+	 * is write-once, so attempting to write after it's already written to will
+	 * fail.
+	 */
+	if (read(setgroups_fd, policy_buffer, sizeof(policy_buffer)) < 0) {
+		fprintf(log_get_logfd(), _("%s: failed to read setgroups: %s\n"),
+			log_get_progname(),
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (!strncmp(policy_buffer, policy, strlen(policy)))
+		goto out;
+
+	/* Write the policy. */
+	if (lseek(setgroups_fd, 0, SEEK_SET) < 0) {
+		fprintf(log_get_logfd(), _("%s: failed to seek setgroups: %s\n"),
+			log_get_progname(),
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (dprintf(setgroups_fd, "%s", policy) < 0) {
+		fprintf(log_get_logfd(), _("%s: failed to setgroups %s policy: %s\n"),
+			log_get_progname(),
+			policy,
+			strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+out:
+	close(setgroups_fd);
+}
@@ -7,6 +7,8 @@
 #ifndef _IDMAPPING_H_
 #define _IDMAPPING_H_
 
+#include <pwd.h>
+#include <stdbool.h>
 #include <sys/types.h>
 
 struct map_range {
@@ -18,6 +20,16 @@ struct map_range {
 extern struct map_range *get_map_ranges(int ranges, int argc, char **argv);
 extern void write_mapping(int proc_dir_fd, int ranges,
 	const struct map_range *mappings, const char *map_file, uid_t ruid);
+extern void write_mappings(int proc_dir_fd,
+	int uid_ranges, const struct map_range *uid_mappings,
+	int gid_ranges, const struct map_range *gid_mappings, uid_t ruid);
+extern void write_setgroups(int proc_dir_fd, bool allow_setgroups);
+#ifdef ENABLE_SUBIDS
+extern void verify_uid_ranges(const struct passwd *pw, int ranges,
+	const struct map_range *mappings);
+extern void verify_gid_ranges(const struct passwd *pw, int ranges,
+	const struct map_range *mappings, bool *allow_setgroups);
+#endif
 
 #endif /* _ID_MAPPING_H_ */
 
@@ -0,0 +1,269 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef HAVE_LINUX_MOUNT_H
+#include <linux/mount.h>
+#endif
+#include "defines.h"
+#include "idmapping.h"
+#include "prototypes.h"
+
+/*
+ * When the home directory of a user is the root of a mount, the UID and
+ * GID of its files can be changed by mounting it again with an idmapped
+ * mount, instead of changing the owner of each file. The idmapping is
+ * the mapping of a user namespace, which is created for the mount by a
+ * child process.
+ */
+
+#if defined(HAVE_LINUX_MOUNT_H) && defined(SYS_mount_setattr) \
+ && defined(SYS_open_tree) && defined(SYS_move_mount) \
+ && defined(STATX_ATTR_MOUNT_ROOT)
+
+#define ID_COUNT	4294967295UL	/* 0 to 4294967294 */
+
+/*
+ * swap_ranges - the mapping which swaps the IDs old_id and new_id
+ *
+ *	The other IDs are mapped to themselves. Return the number of
+ *	ranges of the mapping.
+ */
+static int swap_ranges (unsigned long old_id, unsigned long new_id,
+                        /*@out@*/struct map_range ranges[4])
+{
+	unsigned long a = (old_id < new_id) ? old_id : new_id;
+	unsigned long b = (old_id < new_id) ? new_id : old_id;
+	int n = 0;
+
+	if (a == b) {
+		ranges[0].upper = 0;
+		ranges[0].lower = 0;
+		ranges[0].count = ID_COUNT;
+		return 1;
+	}
+	if (a > 0) {
+		ranges[n].upper = 0;
+		ranges[n].lower = 0;
+		ranges[n].count = a;
+		n++;
+	}
+	ranges[n].upper = a;
+	ranges[n].lower = b;
+	ranges[n].count = 1;
+	n++;
+	if (b - a > 1) {
+		ranges[n].upper = a + 1;
+		ranges[n].lower = a + 1;
+		ranges[n].count = b - a - 1;
+		n++;
+	}
+	ranges[n].upper = b;
+	ranges[n].lower = a;
+	ranges[n].count = 1;
+	n++;
+	if (b + 1 < ID_COUNT) {
+		ranges[n].upper = b + 1;
+		ranges[n].lower = b + 1;
+		ranges[n].count = ID_COUNT - b - 1;
+		n++;
+	}
+	return n;
+}
+
+/*
+ * write_map - write a mapping to the map file of the process pid
+ */
+static int write_map (pid_t pid, const char *map_file,
+                      unsigned long old_id, unsigned long new_id)
+{
+	struct map_range ranges[4];
+	char path[64];
+	char buf[256];
+	size_t len = 0;
+	int i, n, fd;
+
+	n = swap_ranges (old_id, new_id, ranges);
+	for (i = 0; i < n; i++) {
+		len += snprintf (buf + len, sizeof buf - len, "%lu %lu %lu\n",
+		                 ranges[i].upper, ranges[i].lower,
+		                 ranges[i].count);
+	}
+	(void) snprintf (path, sizeof path, "/proc/%ld/%s", (long) pid, map_file);
+	fd = open (path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	if (write (fd, buf, len) != (ssize_t) len) {
+		(void) close (fd);
+		return -1;
+	}
+	return close (fd);
+}
+
+/*
+ * idmap_userns - open a user namespace whose mapping swaps old_uid and
+ *                new_uid, and old_gid and new_gid
+ *
+ *	Return its file descriptor, or -1 with errno set.
+ */
+static int idmap_userns (uid_t old_uid, uid_t new_uid,
+                         gid_t old_gid, gid_t new_gid)
+{
+	char path[64];
+	int ready[2], done[2];
+	int fd = -1;
+	int err = 0;
+	pid_t pid;
+	char c;
+
+	if (pipe (ready) != 0) {
+		return -1;
+	}
+	if (pipe (done) != 0) {
+		err = errno;
+		(void) close (ready[0]);
+		(void) close (ready[1]);
+		errno = err;
+		return -1;
+	}
+
+	pid = fork ();
+	if (0 == pid) {
+		/* The child only lives in the namespace */
+		(void) close (ready[0]);
+		(void) close (done[1]);
+		if (unshare (CLONE_NEWUSER) == 0) {
+			(void) write (ready[1], "", 1);
+			(void) read (done[0], &c, 1);
+		}
+		_exit (0);
+	}
+	(void) close (ready[1]);
+	(void) close (done[0]);
+
+	if (pid < 0) {
+		err = errno;
+	} else if (read (ready[0], &c, 1) != 1) {
+		err = EPERM;	/* unshare failed */
+	} else if (   (write_map (pid, "uid_map", old_uid, new_uid) != 0)
+	           || (write_map (pid, "gid_map", old_gid, new_gid) != 0)) {
+		err = errno;
+	} else {
+		(void) snprintf (path, sizeof path, "/proc/%ld/ns/user", (long) pid);
+		fd = open (path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			err = errno;
+		}
+	}
+
+	(void) close (done[1]);
+	(void) close (ready[0]);
+	if (pid > 0) {
+		(void) waitpid (pid, NULL, 0);
+	}
+	if (fd < 0) {
+		errno = err;
+	}
+	return fd;
+}
+
+/*
+ * idmap_mount - change the IDs of the files of a mount without changing
+ *               their owners on disk
+ *
+ *	root is mounted again over itself with an idmapped mount, in which
+ *	the files owned on disk by old_uid (resp. old_gid) belong to
+ *	new_uid (resp. new_gid), and the files of new_uid (resp. new_gid)
+ *	to old_uid (resp. old_gid). The other IDs are not changed, and an
+ *	ID is not changed if its new ID is -1.
+ *
+ *	The new mount only lasts until root is unmounted. The submounts of
+ *	root are not remapped.
+ *
+ *	Return 0 on success, or -1 with errno set (EINVAL if root is not a
+ *	mount, ENOSYS if idmapped mounts are not supported).
+ */
+int idmap_mount (const char *root,
+                 uid_t old_uid, uid_t new_uid,
+                 gid_t old_gid, gid_t new_gid)
+{
+	struct mount_attr attr;
+	struct statx stx;
+	int tree, userns;
+	int err = 0;
+
+	if ((uid_t) -1 == new_uid) {
+		new_uid = old_uid;
+	}
+	if ((gid_t) -1 == new_gid) {
+		new_gid = old_gid;
+	}
+
+	if (statx (AT_FDCWD, root, AT_SYMLINK_NOFOLLOW, STATX_TYPE, &stx) != 0) {
+		return -1;
+	}
+	if (   (0 == (stx.stx_attributes_mask & STATX_ATTR_MOUNT_ROOT))
+	    || (0 == (stx.stx_attributes & STATX_ATTR_MOUNT_ROOT))
+	    || !S_ISDIR (stx.stx_mode)) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	userns = idmap_userns (old_uid, new_uid, old_gid, new_gid);
+	if (userns < 0) {
+		return -1;
+	}
+	tree = syscall (SYS_open_tree, AT_FDCWD, root,
+	                OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC);
+	if (tree < 0) {
+		err = errno;
+		(void) close (userns);
+		errno = err;
+		return -1;
+	}
+
+	memzero (&attr, sizeof attr);
+	attr.attr_set = MOUNT_ATTR_IDMAP;
+	attr.userns_fd = userns;
+	if (   (syscall (SYS_mount_setattr, tree, "", AT_EMPTY_PATH,
+	                 &attr, sizeof attr) != 0)
+	    || (syscall (SYS_move_mount, tree, "", AT_FDCWD, root,
+	                 MOVE_MOUNT_F_EMPTY_PATH) != 0)) {
+		err = errno;
+	}
+	(void) close (tree);
+	(void) close (userns);
+	if (0 != err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+#else				/* !idmapped mounts */
+
+int idmap_mount (unused const char *root,
+                 unused uid_t old_uid, unused uid_t new_uid,
+                 unused gid_t old_gid, unused gid_t new_gid)
+{
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif				/* !idmapped mounts */
@@ -23,6 +23,11 @@
 #include <sys/stat.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <grp.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include "prototypes.h"
 #include "defines.h"
 #include <pwd.h>
@@ -32,6 +37,48 @@
 #ifndef LIMITS_FILE
 #define LIMITS_FILE "/etc/limits"
 #endif
+
+/*
+ * Compiled limits rules.
+ *
+ * The rules of the limits file are compiled into a table, where the
+ * groups of the @group rules are resolved to their GID. The table is
+ * cached next to the limits file, in LIMITS_FILE.cache. The cache
+ * records the identity, size and modification time of the limits file
+ * and of the group file; it is ignored when they changed, or after
+ * LIMITS_CACHE_TTL seconds, since groups from other services can change
+ * without notice.
+ *
+ * Layout (native byte order):
+ *	struct limits_cache_header
+ *	the rules: int64_t gid (-1 if not a group, or unknown group),
+ *	           the name, and the limits string, with their NUL
+ */
+
+#define LIMITS_CACHE_MAGIC	"shdwlim"
+#define LIMITS_CACHE_VERSION	1
+#define LIMITS_CACHE_TTL	3600
+
+struct limits_cache_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t length;	/* of the rules */
+	int64_t created;
+	uint64_t limits_dev;
+	uint64_t limits_ino;
+	uint64_t limits_size;
+	int64_t limits_mtime_sec;
+	int64_t limits_mtime_nsec;
+	int64_t group_mtime_sec;
+	int64_t group_mtime_nsec;
+};
+
+struct limits_rules {
+	/*@only@*/char *data;
+	size_t length;
+	size_t size;
+};
 #define LOGIN_ERROR_RLIMIT	1
 #define LOGIN_ERROR_LOGIN	2
 /* Set a limit on a resource */
@@ -119,7 +166,6 @@ static int set_umask (const char *value)
 /* Counts the number of user logins and check against the limit */
 static int check_logins (const char *name, const char *maxlogins)
 {
-	struct utmp *ut;
 	unsigned long limit, count;
 
 	if (getulong (maxlogins, &limit) == 0) {
@@ -131,25 +177,7 @@ static int check_logins (const char *name, const char *maxlogins)
 		return LOGIN_ERROR_LOGIN;
 	}
 
-	count = 0;
-	setutent ();
-	while ((ut = getutent ()))
-	{
-		if (USER_PROCESS != ut->ut_type) {
-			continue;
-		}
-		if ('\0' == ut->ut_user[0]) {
-			continue;
-		}
-		if (strncmp (name, ut->ut_user, sizeof (ut->ut_user)) != 0) {
-			continue;
-		}
-		count++;
-		if (count > limit) {
-			break;
-		}
-	}
-	endutent ();
+	count = count_sessions (name, limit, false);
 	/*
 	 * This is called after setutmp(), so the number of logins counted
 	 * includes the user who is currently trying to log in.
@@ -342,53 +370,52 @@ static int do_user_limits (const char *buf, const char *name)
 	return retval;
 }
 
-/* Check if user uname is in the group gname.
- * Can I be sure that gr_mem contains no UID as string?
- * Returns true when user is in the group, false when not.
- * Any error is treated as false.
+/*
+ * add_rule - Add a rule to the compiled rules.
+ *
+ *	Return 0, or -1 if the memory could not be allocated.
  */
-static bool user_in_group (const char *uname, const char *gname)
+static int add_rule (struct limits_rules *rules, int64_t gid,
+                     const char *name, const char *limits)
 {
-	struct group *groupdata;
+	size_t namelen = strlen (name) + 1;
+	size_t limitslen = strlen (limits) + 1;
+	size_t len = sizeof gid + namelen + limitslen;
 
-	if (uname == NULL || gname == NULL) {
-		return false;
-	}
+	if (rules->length + len > rules->size) {
+		size_t size = (0 == rules->size) ? 4096 : rules->size;
+		char *data;
 
-	/* We are not claiming to be re-entrant!
-	 * In case of paranoia or a multithreaded login program,
-	 * one needs to add some mess for getgrnam_r. */
-	groupdata = getgrnam (gname);
-	if (NULL == groupdata) {
-		SYSLOG ((LOG_WARN, "Nonexisting group `%s' in limits file.",
-		         gname));
-		return false;
+		while (rules->length + len > size) {
+			size *= 2;
+		}
+		data = realloc (rules->data, size);
+		if (NULL == data) {
+			return -1;
+		}
+		rules->data = data;
+		rules->size = size;
 	}
-
-	return is_on_list (groupdata->gr_mem, uname);
+	memcpy (rules->data + rules->length, &gid, sizeof gid);
+	rules->length += sizeof gid;
+	memcpy (rules->data + rules->length, name, namelen);
+	rules->length += namelen;
+	memcpy (rules->data + rules->length, limits, limitslen);
+	rules->length += limitslen;
+	return 0;
 }
 
-static int setup_user_limits (const char *uname)
+/*
+ * compile_rules - Compile the rules of the limits file fil.
+ *
+ *	Return 0, or -1 on errors.
+ */
+static int compile_rules (FILE *fil, struct limits_rules *rules)
 {
-	FILE *fil;
 	char buf[1024];
 	char name[1024];
-	char limits[1024];
-	char deflimits[1024];
 	char tempbuf[1024];
 
-	/* init things */
-	memzero (buf, sizeof (buf));
-	memzero (name, sizeof (name));
-	memzero (limits, sizeof (limits));
-	memzero (deflimits, sizeof (deflimits));
-	memzero (tempbuf, sizeof (tempbuf));
-
-	/* start the checks */
-	fil = fopen (LIMITS_FILE, "r");
-	if (fil == NULL) {
-		return 0;
-	}
 	/* The limits file have the following format:
 	 * - '#' (comment) chars only as first chars on a line;
 	 * - username must start on first column (or *, or @group)
@@ -409,44 +436,292 @@ static int setup_user_limits (const char *uname)
 		 * entry means no care anyway :-).
 		 *
 		 * A '-' as a limits strings means no limits
-		 *
-		 * The username can also be:
-		 *  '*': the default limits (only the last is taken into
-		 *       account)
-		 *  @group: the limit applies to the members of the group
-		 *
-		 * To clarify: The first entry with matching user name rules,
-		 * everything after it is ignored. If there is no user entry,
-		 * the last encountered entry for a matching group rules.
-		 * If there is no matching group entry, the default limits rule.
 		 */
 		if (sscanf (buf, "%s%[ACDFIKLMNOPRSTUacdfiklmnoprstu0-9 \t-]",
 		            name, tempbuf) == 2) {
-			if (strcmp (name, uname) == 0) {
-				strcpy (limits, tempbuf);
-				break;
-			} else if (strcmp (name, "*") == 0) {
-				strcpy (deflimits, tempbuf);
-			} else if (name[0] == '@') {
-				/* If the user is in the group, the group
-				 * limits apply unless later a line for
-				 * the specific user is found.
-				 */
-				if (user_in_group (uname, name+1)) {
-					strcpy (limits, tempbuf);
+			int64_t gid = -1;
+
+			if (name[0] == '@') {
+				/* We are not claiming to be re-entrant!
+				 * In case of paranoia or a multithreaded
+				 * login program, one needs to add some mess
+				 * for getgrnam_r. */
+				const struct group *grp = getgrnam (name + 1);
+
+				if (NULL != grp) {
+					gid = grp->gr_gid;
 				}
 			}
+			if (add_rule (rules, gid, name, tempbuf) != 0) {
+				return -1;
+			}
 		}
 	}
+	return ferror (fil) ? -1 : 0;
+}
+
+static int cache_name (char *buf, size_t size)
+{
+	int len;
+
+	len = snprintf (buf, size, "%s.cache", LIMITS_FILE);
+	return ((len < 0) || ((size_t) len >= size)) ? -1 : 0;
+}
+
+static void cache_stamp (struct limits_cache_header *hdr,
+                         const struct stat *sb, const struct stat *sbgr)
+{
+	hdr->limits_dev = sb->st_dev;
+	hdr->limits_ino = sb->st_ino;
+	hdr->limits_size = sb->st_size;
+	hdr->limits_mtime_sec = sb->st_mtim.tv_sec;
+	hdr->limits_mtime_nsec = sb->st_mtim.tv_nsec;
+	if (NULL != sbgr) {
+		hdr->group_mtime_sec = sbgr->st_mtim.tv_sec;
+		hdr->group_mtime_nsec = sbgr->st_mtim.tv_nsec;
+	}
+}
+
+/*
+ * load_cache - Load the cached rules compiled from the limits file sb.
+ *
+ *	Return 0, or -1 if there is no valid cache.
+ */
+static int load_cache (const struct stat *sb, const struct stat *sbgr,
+                       struct limits_rules *rules)
+{
+	char name[1024];
+	struct limits_cache_header hdr, stamp;
+	struct stat sbc;
+	time_t now;
+	int fd;
+
+	if (cache_name (name, sizeof name) != 0) {
+		return -1;
+	}
+	fd = open (name, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	/* The cache shall be as trusted as the limits file */
+	memzero (&stamp, sizeof stamp);
+	cache_stamp (&stamp, sb, sbgr);
+	(void) time (&now);
+	if (   (fstat (fd, &sbc) != 0)
+	    || (sbc.st_uid != sb->st_uid)
+	    || ((sbc.st_mode & 022) != 0)
+	    || (read (fd, &hdr, sizeof hdr) != (ssize_t) sizeof hdr)
+	    || (memcmp (hdr.magic, LIMITS_CACHE_MAGIC, sizeof hdr.magic) != 0)
+	    || (hdr.version != LIMITS_CACHE_VERSION)
+	    || (hdr.limits_dev != stamp.limits_dev)
+	    || (hdr.limits_ino != stamp.limits_ino)
+	    || (hdr.limits_size != stamp.limits_size)
+	    || (hdr.limits_mtime_sec != stamp.limits_mtime_sec)
+	    || (hdr.limits_mtime_nsec != stamp.limits_mtime_nsec)
+	    || (hdr.group_mtime_sec != stamp.group_mtime_sec)
+	    || (hdr.group_mtime_nsec != stamp.group_mtime_nsec)
+	    || (hdr.created > now)
+	    || (now - hdr.created >= LIMITS_CACHE_TTL)
+	    || (hdr.length != sbc.st_size - sizeof hdr)) {
+		(void) close (fd);
+		return -1;
+	}
+
+	rules->data = malloc (hdr.length + 1);
+	if (NULL == rules->data) {
+		(void) close (fd);
+		return -1;
+	}
+	rules->length = hdr.length;
+	rules->size = hdr.length + 1;
+	if (read (fd, rules->data, hdr.length) != (ssize_t) hdr.length) {
+		(void) close (fd);
+		return -1;
+	}
+	(void) close (fd);
+	return 0;
+}
+
+/*
+ * save_cache - Save the rules compiled from the limits file sb.
+ *
+ *	Errors are ignored: the rules will be compiled again at the next
+ *	login.
+ */
+static void save_cache (const struct stat *sb, const struct stat *sbgr,
+                        const struct limits_rules *rules)
+{
+	char name[1024];
+	char tmpname[1024];
+	struct limits_cache_header hdr;
+	int fd;
+
+	if (   (geteuid () != 0)
+	    || (cache_name (name, sizeof name) != 0)
+	    || (snprintf (tmpname, sizeof tmpname, "%s.XXXXXX", name)
+	        >= (int) sizeof tmpname)) {
+		return;
+	}
+
+	memzero (&hdr, sizeof hdr);
+	memcpy (hdr.magic, LIMITS_CACHE_MAGIC, sizeof hdr.magic);
+	hdr.version = LIMITS_CACHE_VERSION;
+	hdr.length = rules->length;
+	hdr.created = time (NULL);
+	cache_stamp (&hdr, sb, sbgr);
+
+	fd = mkstemp (tmpname);
+	if (fd < 0) {
+		return;
+	}
+	if (   (fchown (fd, sb->st_uid, sb->st_gid) != 0)
+	    || (fchmod (fd, 0600) != 0)
+	    || (write (fd, &hdr, sizeof hdr) != (ssize_t) sizeof hdr)
+	    || (write (fd, rules->data, rules->length) != (ssize_t) rules->length)
+	    || (close (fd) != 0)
+	    || (rename (tmpname, name) != 0)) {
+		(void) close (fd);
+		(void) unlink (tmpname);
+	}
+}
+
+/*
+ * load_rules - Get the compiled rules of the limits file.
+ *
+ *	Return 0, 1 if there is no limits file, or -1 on errors.
+ */
+static int load_rules (struct limits_rules *rules)
+{
+	FILE *fil;
+	struct stat sb, sbgr;
+	const struct stat *psbgr;
+
+	rules->data = NULL;
+	rules->length = 0;
+	rules->size = 0;
+
+	fil = fopen (LIMITS_FILE, "r");
+	if (fil == NULL) {
+		return 1;
+	}
+	if (fstat (fileno (fil), &sb) != 0) {
+		(void) fclose (fil);
+		return -1;
+	}
+	psbgr = (stat (GROUP_FILE, &sbgr) == 0) ? &sbgr : NULL;
+
+	if (load_cache (&sb, psbgr, rules) == 0) {
+		(void) fclose (fil);
+		return 0;
+	}
+
+	free (rules->data);
+	rules->data = NULL;
+	rules->length = 0;
+	rules->size = 0;
+	if (compile_rules (fil, rules) != 0) {
+		(void) fclose (fil);
+		return -1;
+	}
 	(void) fclose (fil);
-	if (limits[0] == '\0') {
-		/* no user specific limits */
-		if (deflimits[0] == '\0') {	/* no default limits */
-			return 0;
+	save_cache (&sb, psbgr, rules);
+	return 0;
+}
+
+static int setup_user_limits (const struct passwd *info)
+{
+	const char *uname = info->pw_name;
+	struct limits_rules rules;
+	const char *limits = NULL;
+	const char *deflimits = NULL;
+	const char *p, *end;
+	gid_t *groups = NULL;
+	int ngroups = -2;	/* not fetched yet */
+	int ret;
+
+	/* start the checks */
+	ret = load_rules (&rules);
+	if (0 != ret) {
+		return 0;
+	}
+
+	/*
+	 * The username can also be:
+	 *  '*': the default limits (only the last is taken into
+	 *       account)
+	 *  @group: the limit applies to the members of the group
+	 *
+	 * To clarify: The first entry with matching user name rules,
+	 * everything after it is ignored. If there is no user entry,
+	 * the last encountered entry for a matching group rules.
+	 * If there is no matching group entry, the default limits rule.
+	 */
+	p = rules.data;
+	end = rules.data + rules.length;
+	while ((NULL != p) && ((size_t) (end - p) > sizeof (int64_t))) {
+		int64_t gid;
+		const char *name, *lim;
+
+		memcpy (&gid, p, sizeof gid);
+		name = p + sizeof gid;
+		p = memchr (name, '\0', end - name);
+		if (NULL == p) {
+			break;
+		}
+		lim = p + 1;
+		p = memchr (lim, '\0', end - lim);
+		if (NULL == p) {
+			break;
 		}
-		strcpy (limits, deflimits);	/* use the default limits */
+		p++;
+
+		if (strcmp (name, uname) == 0) {
+			limits = lim;
+			break;
+		} else if (strcmp (name, "*") == 0) {
+			deflimits = lim;
+		} else if (name[0] == '@') {
+			int i;
+
+			if (-1 == gid) {
+				SYSLOG ((LOG_WARN,
+				         "Nonexisting group `%s' in limits file.",
+				         name + 1));
+				continue;
+			}
+			/*
+			 * The groups of the user are fetched once, for all
+			 * the group rules.
+			 * If the user is in the group, the group limits
+			 * apply unless later a line for the specific user
+			 * is found.
+			 */
+			if (-2 == ngroups) {
+				ngroups = get_grouplist (info->pw_name,
+				                         info->pw_gid,
+				                         &groups);
+			}
+			for (i = 0; i < ngroups; i++) {
+				if ((int64_t) groups[i] == gid) {
+					limits = lim;
+					break;
+				}
+			}
+		}
+	}
+
+	if (NULL == limits) {
+		/* no user specific limits */
+		limits = deflimits;	/* use the default limits */
+	}
+	ret = 0;
+	if (NULL != limits) {
+		ret = do_user_limits (limits, uname);
 	}
-	return do_user_limits (limits, uname);
+	free (groups);
+	free (rules.data);
+	return ret;
 }
 
 
@@ -492,7 +767,7 @@ void setup_limits (const struct passwd *info)
 
 	if (getdef_bool ("QUOTAS_ENAB")) {
 		if (info->pw_uid != 0) {
-			if ((setup_user_limits (info->pw_name) & LOGIN_ERROR_LOGIN) != 0) {
+			if ((setup_user_limits (info) & LOGIN_ERROR_LOGIN) != 0) {
 				(void) fputs (_("Too many logins.\n"), log_get_logfd());
 				(void) sleep (2); /* XXX: Should be FAIL_DELAY */
 				exit (EXIT_FAILURE);
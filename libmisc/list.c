@@ -62,6 +62,173 @@
 	return tmp;
 }
 
+/*
+ * add_members - add members to a list of group members
+ *
+ *	The names which are not already in the list, or earlier in
+ *	members, are added to a freshly allocated list of users, in the
+ *	order of members.  The original list pointer is returned if
+ *	there are no new names.
+ *
+ *	Unlike with successive calls to add_list(), the list is copied
+ *	once, and the names are searched in a hash set if there are many
+ *	of them.
+ */
+/*@only@*/ /*@out@*/char **add_members (/*@returned@*/ /*@only@*/char **list,
+                                        char *const *members)
+{
+	struct member_set *set = NULL;
+	size_t n, m, i, j;
+	char **tmp;
+
+	assert (NULL != members);
+	assert (NULL != list);
+
+	for (n = 0; NULL != list[n]; n++);
+	for (m = 0; NULL != members[m]; m++);
+	if (0 == m) {
+		return list;
+	}
+
+	tmp = (char **) xmalloc ((n + m + 1) * sizeof (char *));
+	if (n + m >= MEMBER_SET_MIN) {
+		/* Without memory for the set, the list is scanned */
+		set = member_set_new (n + m);
+	}
+
+	for (i = 0; i < n; i++) {
+		tmp[i] = list[i];
+		if (NULL != set) {
+			(void) member_set_add (set, list[i]);
+		}
+	}
+	for (j = 0; j < m; j++) {
+		bool found = false;
+
+		if (NULL != set) {
+			found = !member_set_add (set, members[j]);
+		} else {
+			size_t k;
+
+			for (k = 0; k < i; k++) {
+				if (strcmp (tmp[k], members[j]) == 0) {
+					found = true;
+					break;
+				}
+			}
+		}
+		if (!found) {
+			tmp[i] = xstrdup (members[j]);
+			i++;
+		}
+	}
+	member_set_free (set);
+
+	if (i == n) {
+		free (tmp);
+		return list;
+	}
+	tmp[i] = NULL;
+	return tmp;
+}
+
+/*
+ * has_name - Check if name is in the set, or in the n names if set is
+ *            NULL
+ */
+static bool has_name (/*@null@*/const struct member_set *set,
+                      char *const *names, size_t n, const char *name)
+{
+	size_t i;
+
+	if (NULL != set) {
+		return member_set_contains (set, name);
+	}
+	for (i = 0; i < n; i++) {
+		if (strcmp (names[i], name) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * replace_members - replace a list of group members by members
+ *
+ *	The names of the list which are in members keep their place, and
+ *	the other names of members are appended in their order, in a
+ *	freshly allocated list of users. The original list pointer is
+ *	returned if it already has the names of members, once each.
+ *
+ *	Like with add_members(), the names are searched in hash sets if
+ *	there are many of them.
+ */
+/*@only@*/ /*@out@*/char **replace_members (/*@returned@*/ /*@only@*/char **list,
+                                            char *const *members)
+{
+	struct member_set *wanted = NULL;
+	struct member_set *kept = NULL;
+	bool changed = false;
+	size_t n, m, i, k = 0;
+	char **tmp;
+
+	assert (NULL != members);
+	assert (NULL != list);
+
+	for (n = 0; NULL != list[n]; n++);
+	for (m = 0; NULL != members[m]; m++);
+
+	tmp = (char **) xmalloc ((n + m + 1) * sizeof (char *));
+	if (n + m >= MEMBER_SET_MIN) {
+		/* Without memory for the sets, the lists are scanned */
+		wanted = member_set_new (m);
+		kept = member_set_new (n + m);
+		if ((NULL == wanted) || (NULL == kept)) {
+			member_set_free (wanted);
+			member_set_free (kept);
+			wanted = NULL;
+			kept = NULL;
+		} else {
+			for (i = 0; i < m; i++) {
+				(void) member_set_add (wanted, members[i]);
+			}
+		}
+	}
+
+	/* The members which stay */
+	for (i = 0; i < n; i++) {
+		if (   has_name (wanted, members, m, list[i])
+		    && !has_name (kept, tmp, k, list[i])) {
+			tmp[k++] = list[i];
+			if (NULL != kept) {
+				(void) member_set_add (kept, list[i]);
+			}
+		} else {
+			changed = true;
+		}
+	}
+
+	/* The new members */
+	for (i = 0; i < m; i++) {
+		if (!has_name (kept, tmp, k, members[i])) {
+			tmp[k++] = xstrdup (members[i]);
+			if (NULL != kept) {
+				(void) member_set_add (kept, tmp[k - 1]);
+			}
+			changed = true;
+		}
+	}
+	member_set_free (wanted);
+	member_set_free (kept);
+
+	if (!changed) {
+		free (tmp);
+		return list;
+	}
+	tmp[k] = NULL;
+	return tmp;
+}
+
 /*
  * del_list - delete a member from a list of group members
  *
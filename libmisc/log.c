@@ -18,6 +18,61 @@
 #include "defines.h"
 #include <lastlog.h>
 #include "prototypes.h"
+#include "acctstate.h"
+
+static void set_entry (struct lastlog *newlog,
+                       /*@unique@*/const char *line,
+                       /*@unique@*/const char *host)
+{
+	time_t ll_time;
+
+	ll_time = newlog->ll_time;
+	(void) time (&ll_time);
+	newlog->ll_time = ll_time;
+	strncpy (newlog->ll_line, line, sizeof (newlog->ll_line) - 1);
+#if HAVE_LL_HOST
+	strncpy (newlog->ll_host, host, sizeof (newlog->ll_host) - 1);
+#endif
+}
+
+/*
+ * dolastlog_state - Update the lastlog entry of the account state store.
+ *
+ *	The faillog part of the record is kept.
+ */
+static void dolastlog_state (
+	struct lastlog *ll,
+	const struct passwd *pw,
+	/*@unique@*/const char *line,
+	/*@unique@*/const char *host)
+{
+	struct acct_state st;
+
+	if (   (acct_state_open (true) != 0)
+	    || (acct_state_lock (F_WRLCK) != 0)) {
+		SYSLOG ((LOG_WARN,
+		         "Can't write lastlog entry for UID %lu in %s.",
+		         (unsigned long) pw->pw_uid, acct_state_file ()));
+		return;
+	}
+	if (acct_state_get (pw->pw_uid, &st) == -1) {
+		SYSLOG ((LOG_WARN,
+		         "Can't read last lastlog entry for UID %lu in %s. Entry not updated.",
+		         (unsigned long) pw->pw_uid, acct_state_file ()));
+		(void) acct_state_lock (F_UNLCK);
+		return;
+	}
+	if (NULL != ll) {
+		*ll = st.ll;
+	}
+	set_entry (&st.ll, line, host);
+	if (acct_state_put (pw->pw_uid, &st) != 0) {
+		SYSLOG ((LOG_WARN,
+		         "Can't write lastlog entry for UID %lu in %s.",
+		         (unsigned long) pw->pw_uid, acct_state_file ()));
+	}
+	(void) acct_state_lock (F_UNLCK);
+}
 
 /*
  * dolastlog - create lastlog entry
@@ -25,6 +80,9 @@
  *	A "last login" entry is created for the user being logged in.  The
  *	UID is extracted from the global (struct passwd) entry and the
  *	TTY information is gotten from the (struct utmp).
+ *
+ *	With ACCOUNT_STATE_FILE, the entry is kept in the account state
+ *	store instead of the lastlog file.
  */
 void dolastlog (
 	struct lastlog *ll,
@@ -35,7 +93,11 @@ void dolastlog (
 	int fd;
 	off_t offset;
 	struct lastlog newlog;
-	time_t ll_time;
+
+	if (acct_state_enabled ()) {
+		dolastlog_state (ll, pw, line, host);
+		return;
+	}
 
 	/*
 	 * If the file does not exist, don't create it.
@@ -74,13 +136,7 @@ void dolastlog (
 		*ll = newlog;
 	}
 
-	ll_time = newlog.ll_time;
-	(void) time (&ll_time);
-	newlog.ll_time = ll_time;
-	strncpy (newlog.ll_line, line, sizeof (newlog.ll_line) - 1);
-#if HAVE_LL_HOST
-	strncpy (newlog.ll_host, host, sizeof (newlog.ll_host) - 1);
-#endif
+	set_entry (&newlog, line, host);
 	if (   (lseek (fd, offset, SEEK_SET) != offset)
 	    || (write (fd, &newlog, sizeof newlog) != (ssize_t) sizeof newlog)
 	    || (close (fd) != 0)) {
@@ -11,10 +11,61 @@
 
 #ident "$Id$"
 
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <unistd.h>
 #include "prototypes.h"
 #include "defines.h"
 #include "getdef.h"
+
+/*
+ * motd_file - output one of the MOTD_FILE files
+ *
+ *	Regular files are mapped and written at once, other files are
+ *	copied one character at a time.
+ */
+static void motd_file (const char *motdfile)
+{
+	struct stat sb;
+	void *map;
+	FILE *fp;
+	int fd;
+	int c;
+
+	fd = open (motdfile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	if ((fstat (fd, &sb) == 0) && S_ISREG (sb.st_mode)) {
+		if (0 == sb.st_size) {
+			(void) close (fd);
+			return;
+		}
+		map = mmap (NULL, (size_t) sb.st_size, PROT_READ, MAP_PRIVATE,
+		            fd, 0);
+		if (MAP_FAILED != map) {
+			(void) close (fd);
+			(void) fwrite (map, 1, (size_t) sb.st_size, stdout);
+			(void) munmap (map, (size_t) sb.st_size);
+			return;
+		}
+	}
+
+	fp = fdopen (fd, "r");
+	if (NULL == fp) {
+		(void) close (fd);
+		return;
+	}
+	while ((c = getc (fp)) != EOF) {
+		putchar (c);
+	}
+	(void) fclose (fp);
+}
+
 /*
  * motd -- output the /etc/motd file
  *
@@ -24,11 +75,9 @@
  */
 void motd (void)
 {
-	FILE *fp;
 	char *motdlist;
 	const char *motdfile;
 	char *mb;
-	int c;
 
 	motdfile = getdef_str ("MOTD_FILE");
 	if (NULL == motdfile) {
@@ -43,13 +92,7 @@ void motd (void)
 			break;
 		}
 
-		fp = fopen (motdfile, "r");
-		if (NULL != fp) {
-			while ((c = getc (fp)) != EOF) {
-				putchar (c);
-			}
-			fclose (fp);
-		}
+		motd_file (motdfile);
 	}
 	fflush (stdout);
 
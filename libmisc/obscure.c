@@ -20,10 +20,24 @@
  * library source code for this function to operate.
  */
 #include <ctype.h>
+#include <pthread.h>
 #include <stdio.h>
 #include "prototypes.h"
 #include "defines.h"
 #include "getdef.h"
+
+#ifdef HAVE_LIBCRACK
+/*
+ * cracklib is not reentrant: the threads of chpasswd and newusers search
+ * the dictionary one at a time.
+ */
+static pthread_mutex_t crack_mutex = PTHREAD_MUTEX_INITIALIZER;
+#ifdef HAVE_LIBCRACK_LOOK
+/* The dictionary opened by obscure_preload() */
+static /*@null@*/void *crack_dict = NULL;
+#endif
+#endif
+
 /*
  * can't be a palindrome - like `R A D A R' or `M A D A M'
  */
@@ -137,7 +151,7 @@ static char *str_lower (/*@returned@*/char *string)
 static /*@observer@*//*@null@*/const char *password_check (
 	/*@notnull@*/const char *old,
 	/*@notnull@*/const char *new,
-	/*@notnull@*/const struct passwd *pwdp)
+	/*@null@*/const struct passwd *pwdp)
 {
 	const char *msg = NULL;
 	char *oldmono, *newmono, *wrapped;
@@ -147,9 +161,11 @@ static /*@observer@*//*@null@*/const char *password_check (
 
 #ifdef HAVE_LIBCRACK_PW
 	char *FascistCheckPw ();
-#else
-	char *FascistCheck ();
 #endif
+#ifdef HAVE_LIBCRACK_LOOK
+	char *FascistLook ();
+#endif
+	char *FascistCheck ();
 #endif
 
 	if (strcmp (new, old) == 0) {
@@ -180,11 +196,21 @@ static /*@observer@*//*@null@*/const char *password_check (
 
 		dictpath = getdef_str ("CRACKLIB_DICTPATH");
 		if (NULL != dictpath) {
+			(void) pthread_mutex_lock (&crack_mutex);
+#ifdef HAVE_LIBCRACK_LOOK
+			if (NULL != crack_dict) {
+				msg = FascistLook (crack_dict, new);
+			} else
+#endif
 #ifdef HAVE_LIBCRACK_PW
-			msg = FascistCheckPw (new, dictpath, pwdp);
-#else
-			msg = FascistCheck (new, dictpath);
+			if (NULL != pwdp) {
+				msg = FascistCheckPw (new, dictpath, pwdp);
+			} else
 #endif
+			{
+				msg = FascistCheck (new, dictpath);
+			}
+			(void) pthread_mutex_unlock (&crack_mutex);
 		}
 #endif
 	}
@@ -198,10 +224,19 @@ static /*@observer@*//*@null@*/const char *password_check (
 	return msg;
 }
 
-static /*@observer@*//*@null@*/const char *obscure_msg (
+/*
+ * obscure_check - Check the quality of a password
+ *
+ *	This is the check of obscure(), without its output. pwdp can be
+ *	NULL if the entry of the user is not at hand. It can be called by
+ *	several threads at once.
+ *
+ *	Return NULL if new is accepted, or the reason why it is rejected.
+ */
+/*@observer@*//*@null@*/const char *obscure_check (
 	/*@notnull@*/const char *old,
 	/*@notnull@*/const char *new,
-	/*@notnull@*/const struct passwd *pwdp)
+	/*@null@*/const struct passwd *pwdp)
 {
 	size_t maxlen, oldlen, newlen;
 	char *new1, *old1;
@@ -290,7 +325,7 @@ static /*@observer@*//*@null@*/const char *obscure_msg (
 
 bool obscure (const char *old, const char *new, const struct passwd *pwdp)
 {
-	const char *msg = obscure_msg (old, new, pwdp);
+	const char *msg = obscure_check (old, new, pwdp);
 
 	if (NULL != msg) {
 		printf (_("Bad password: %s.  "), msg);
@@ -299,6 +334,33 @@ bool obscure (const char *old, const char *new, const struct passwd *pwdp)
 	return true;
 }
 
+/*
+ * obscure_preload - Prepare the checks of many passwords
+ *
+ *	The cracklib dictionary is opened once, instead of being opened
+ *	again by each check, and login.defs is read before obscure_check()
+ *	is called by several threads.
+ */
+void obscure_preload (void)
+{
+#ifdef HAVE_LIBCRACK_LOOK
+	void *PWOpen ();
+	const char *dictpath;
+#endif
+
+	if (!getdef_bool ("OBSCURE_CHECKS_ENAB")) {
+		return;
+	}
+#ifdef HAVE_LIBCRACK_LOOK
+	dictpath = getdef_str ("CRACKLIB_DICTPATH");
+	(void) pthread_mutex_lock (&crack_mutex);
+	if ((NULL != dictpath) && (NULL == crack_dict)) {
+		crack_dict = PWOpen (dictpath, "r");
+	}
+	(void) pthread_mutex_unlock (&crack_mutex);
+#endif
+}
+
 #else				/* !USE_PAM */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* !USE_PAM */
@@ -0,0 +1,225 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+
+/*
+ * Machine readable output of the query tools.
+ *
+ * With --format=tsv or --format=json, the tools print one row per record
+ * instead of their formatted text: a tab separated table with a header
+ * line, or a JSON array of objects. Timestamps are printed as seconds
+ * since the epoch, and stdout is fully buffered.
+ */
+
+#define OUTPUT_BUFSIZ	(64 * 1024)
+
+static enum output_format format = OUTPUT_TEXT;
+static /*@null@*//*@observer@*/const char *const *field_names = NULL;
+static size_t field = 0;	/* index of the next field in the row */
+static unsigned long rows = 0;
+
+/*
+ * output_set_format - Select the output format from the argument of
+ *                     --format
+ *
+ *	Return true if name is "text", "tsv" or "json".
+ */
+bool output_set_format (const char *name)
+{
+	if (strcmp (name, "text") == 0) {
+		format = OUTPUT_TEXT;
+	} else if (strcmp (name, "tsv") == 0) {
+		format = OUTPUT_TSV;
+	} else if (strcmp (name, "json") == 0) {
+		format = OUTPUT_JSON;
+	} else {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * output_structured - Return true if the rows must be printed with
+ *                     output_str and output_num instead of the text
+ *                     format of the tool
+ */
+bool output_structured (void)
+{
+	return OUTPUT_TEXT != format;
+}
+
+static void put_tsv (const char *s)
+{
+	const char *p;
+
+	for (p = s; '\0' != *p; p++) {
+		switch (*p) {
+		case '\\':
+			(void) fputs ("\\\\", stdout);
+			break;
+		case '\t':
+			(void) fputs ("\\t", stdout);
+			break;
+		case '\n':
+			(void) fputs ("\\n", stdout);
+			break;
+		case '\r':
+			(void) fputs ("\\r", stdout);
+			break;
+		default:
+			(void) putchar (*p);
+			break;
+		}
+	}
+}
+
+static void put_json (const char *s)
+{
+	const char *p;
+
+	(void) putchar ('"');
+	for (p = s; '\0' != *p; p++) {
+		unsigned char c = (unsigned char) *p;
+
+		if (('"' == c) || ('\\' == c)) {
+			(void) putchar ('\\');
+			(void) putchar (c);
+		} else if ('\n' == c) {
+			(void) fputs ("\\n", stdout);
+		} else if ('\t' == c) {
+			(void) fputs ("\\t", stdout);
+		} else if (c < 0x20) {
+			(void) printf ("\\u%04x", c);
+		} else {
+			(void) putchar (c);
+		}
+	}
+	(void) putchar ('"');
+}
+
+/*
+ * output_begin - Start the output of rows with the given fields
+ *
+ *	fields is a NULL terminated list of field names, which must stay
+ *	valid until output_end.
+ */
+void output_begin (const char *const *fields)
+{
+	const char *const *f;
+
+	if (OUTPUT_TEXT == format) {
+		return;
+	}
+
+	(void) setvbuf (stdout, NULL, _IOFBF, OUTPUT_BUFSIZ);
+	field_names = fields;
+	field = 0;
+	rows = 0;
+
+	if (OUTPUT_TSV == format) {
+		for (f = fields; NULL != *f; f++) {
+			if (f != fields) {
+				(void) putchar ('\t');
+			}
+			put_tsv (*f);
+		}
+		(void) putchar ('\n');
+	} else {
+		(void) putchar ('[');
+	}
+}
+
+/*
+ * next_field - Print the separator and the name of the next field
+ */
+static void next_field (void)
+{
+	if (OUTPUT_TSV == format) {
+		if (0 != field) {
+			(void) putchar ('\t');
+		}
+	} else {
+		if (0 == field) {
+			(void) fputs ((0 == rows) ? "\n{" : ",\n{", stdout);
+		} else {
+			(void) putchar (',');
+		}
+		put_json (field_names[field]);
+		(void) putchar (':');
+	}
+	field++;
+}
+
+/*
+ * output_str - Print the next field of the row as a string
+ *
+ *	A NULL value is printed as null in JSON, and as an empty field in TSV.
+ */
+void output_str (/*@null@*/const char *value)
+{
+	next_field ();
+	if (NULL == value) {
+		if (OUTPUT_JSON == format) {
+			(void) fputs ("null", stdout);
+		}
+	} else if (OUTPUT_TSV == format) {
+		put_tsv (value);
+	} else {
+		put_json (value);
+	}
+}
+
+/*
+ * output_num - Print the next field of the row as a number
+ */
+void output_num (long long value)
+{
+	char buf[24];
+	char *p = buf + sizeof buf;
+	unsigned long long v;
+
+	next_field ();
+
+	v = (value < 0) ? -(unsigned long long) value : (unsigned long long) value;
+	do {
+		*--p = '0' + (char) (v % 10);
+		v /= 10;
+	} while (0 != v);
+	if (value < 0) {
+		*--p = '-';
+	}
+	(void) fwrite (p, 1, (size_t) (buf + sizeof buf - p), stdout);
+}
+
+/*
+ * output_row_end - Finish the current row
+ */
+void output_row_end (void)
+{
+	(void) fputs ((OUTPUT_TSV == format) ? "\n" : "}", stdout);
+	field = 0;
+	rows++;
+}
+
+/*
+ * output_end - Finish the output started by output_begin
+ */
+void output_end (void)
+{
+	if (OUTPUT_TEXT == format) {
+		return;
+	}
+	if (OUTPUT_JSON == format) {
+		(void) fputs ("\n]\n", stdout);
+	}
+	(void) fflush (stdout);
+}
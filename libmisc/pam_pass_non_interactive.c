@@ -27,6 +27,12 @@ static const struct pam_conv non_interactive_pam_conv = {
 	NULL
 };
 
+/*
+ * PAM handle kept between the calls of do_pam_passwd_non_interactive for
+ * the same service, and its service.
+ */
+/*@null@*/static pam_handle_t *batch_pamh = NULL;
+/*@null@*/static const char *batch_service = NULL;
 
 
 static int ni_conv (int num_msg,
@@ -109,36 +115,78 @@ failed_conversation:
 /*
  * Change non interactively the user's password using PAM.
  *
+ * The PAM stack of the service is only started once: the next calls for
+ * the same service reuse its handle, with their user set as PAM_USER.
+ * pam_chauthtok() clears the authentication tokens of the handle when it
+ * returns. A handle whose pam_chauthtok() failed is not reused, so that
+ * a module in an unknown state does not see the next users.
+ *
+ * pam_passwd_non_interactive_end() must be called after the last user.
+ *
  * Return 0 on success, 1 on failure.
  */
 int do_pam_passwd_non_interactive (const char *pam_service,
                                     const char *username,
                                     const char* password)
 {
-	pam_handle_t *pamh = NULL;
 	int ret;
 
-	ret = pam_start (pam_service, username, &non_interactive_pam_conv, &pamh);
-	if (ret != PAM_SUCCESS) {
-		fprintf (log_get_logfd(),
-		         _("%s: (user %s) pam_start failure %d\n"),
-		         log_get_progname(), username, ret);
-		return 1;
+	if (   (NULL != batch_pamh)
+	    && (strcmp (batch_service, pam_service) != 0)) {
+		pam_passwd_non_interactive_end ();
+	}
+
+	if (NULL == batch_pamh) {
+		ret = pam_start (pam_service, username,
+		                 &non_interactive_pam_conv, &batch_pamh);
+		if (ret != PAM_SUCCESS) {
+			fprintf (log_get_logfd(),
+			         _("%s: (user %s) pam_start failure %d\n"),
+			         log_get_progname(), username, ret);
+			batch_pamh = NULL;
+			return 1;
+		}
+		batch_service = pam_service;
+	} else {
+		ret = pam_set_item (batch_pamh, PAM_USER, username);
+		if (ret != PAM_SUCCESS) {
+			fprintf (log_get_logfd(),
+			         _("%s: (user %s) pam_set_item() failed, error:\n"
+			           "%s\n"),
+			         log_get_progname(), username,
+			         pam_strerror (batch_pamh, ret));
+			pam_passwd_non_interactive_end ();
+			return 1;
+		}
 	}
 
 	non_interactive_password = password;
-	ret = pam_chauthtok (pamh, 0);
+	ret = pam_chauthtok (batch_pamh, 0);
+	non_interactive_password = NULL;
 	if (ret != PAM_SUCCESS) {
 		fprintf (log_get_logfd(),
 		         _("%s: (user %s) pam_chauthtok() failed, error:\n"
 		           "%s\n"),
-		         log_get_progname(), username, pam_strerror (pamh, ret));
+		         log_get_progname(), username,
+		         pam_strerror (batch_pamh, ret));
+		pam_passwd_non_interactive_end ();
 	}
 
-	(void) pam_end (pamh, PAM_SUCCESS);
-
 	return ((PAM_SUCCESS == ret) ? 0 : 1);
 }
+
+/*
+ * pam_passwd_non_interactive_end - Close the PAM handle kept by
+ *                                  do_pam_passwd_non_interactive.
+ */
+void pam_passwd_non_interactive_end (void)
+{
+	if (NULL != batch_pamh) {
+		(void) pam_end (batch_pamh, PAM_SUCCESS);
+		batch_pamh = NULL;
+		batch_service = NULL;
+	}
+}
 #else				/* !USE_PAM */
 extern int ISO_C_forbids_an_empty_translation_unit;
 #endif				/* !USE_PAM */
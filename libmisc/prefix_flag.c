@@ -11,8 +11,12 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "defines.h"
 #include "prototypes.h"
+#include "probes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
 #include "groupio.h"
@@ -146,12 +150,506 @@ extern const char* process_prefix_flag (const char* short_opt, int argc, char **
 	return prefix;
 }
 
+/*
+ * process_shard_flag - use the shards of the databases given with the
+ *                      --shard option
+ *
+ * The passwd, shadow, group and gshadow databases are replaced by their
+ * shards (see SHARDED_DATABASES). This shall be called after
+ * process_prefix_flag(), before the databases are locked.
+ *
+ * Return the name of the shard, or NULL if there is none.
+ */
+extern /*@null@*/const char *process_shard_flag (int argc, char **argv)
+{
+	const char *shard = NULL;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strncmp (argv[i], "--shard=", 8) == 0) {
+			shard = argv[i] + 8;
+		} else if ((strcmp (argv[i], "--shard") == 0) && (i + 1 < argc)) {
+			shard = argv[++i];
+		}
+	}
+	if (NULL == shard) {
+		return NULL;
+	}
+
+	if (!getdef_bool ("SHARDED_DATABASES")) {
+		fprintf (log_get_logfd(),
+		         _("%s: --shard requires SHARDED_DATABASES in login.defs\n"),
+		         log_get_progname());
+		exit (E_BAD_ARG);
+	}
+	if (   (pw_setshard (shard) == 0)
+	    || (spw_file_present () && (spw_setshard (shard) == 0))
+#ifdef	SHADOWGRP
+	    || (sgr_file_present () && (sgr_setshard (shard) == 0))
+#endif
+	    || (gr_setshard (shard) == 0)) {
+		fprintf (log_get_logfd(),
+		         _("%s: cannot use the shard '%s': %s\n"),
+		         log_get_progname(), shard, strerror (errno));
+		exit (E_BAD_ARG);
+	}
+	return shard;
+}
+
+/*
+ * process_deadline_flag - bound the time of the operation if given the
+ *                         --deadline option
+ *
+ * The tool has the given number of milliseconds, counted from this
+ * call, to do its work (see lib/deadline.c). This shall be called
+ * before the databases are locked.
+ */
+extern void process_deadline_flag (int argc, char **argv)
+{
+	const char *val = NULL;
+	unsigned long ms;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		if (strncmp (argv[i], "--deadline=", 11) == 0) {
+			val = argv[i] + 11;
+		} else if ((strcmp (argv[i], "--deadline") == 0) && (i + 1 < argc)) {
+			val = argv[++i];
+		}
+	}
+	if (NULL == val) {
+		return;
+	}
+
+	if ((getulong (val, &ms) == 0) || (0 == ms)) {
+		fprintf (log_get_logfd(),
+		         _("%s: invalid deadline '%s'\n"),
+		         log_get_progname(), val);
+		exit (E_BAD_ARG);
+	}
+	deadline_start (ms);
+}
+
+
+/*
+ * Cache of a database of the prefix.
+ *
+ * The first lookup of a file uses its lookup index, or scans it. The
+ * next ones load all its entries once, sorted by name and by ID. The
+ * cache is reloaded when the device, inode, size or modification time
+ * of the file change.
+ */
+struct prefix_cache_ops {
+	/*@null@*/void *(*read) (FILE *);
+	/*@null@*/ /*@only@*/void *(*dup) (const void *);
+	void (*free) (/*@only@*/void *);
+	const char *(*getname) (const void *);
+	/*@null@*/unsigned long (*getid) (const void *);
+};
+
+struct prefix_cache {
+	unsigned int lookups;
+	bool loaded;
+	struct stat sb;
+	size_t count;
+	/*@null@*/ /*@only@*/void **by_name;
+	/*@null@*/ /*@only@*/void **by_id;
+};
+
+struct cache_item {
+	void *ent;
+	size_t pos;
+};
+
+static void *pw_read (FILE *fp)
+{
+	return fgetpwent (fp);
+}
+
+static /*@only@*/void *pw_dup (const void *ent)
+{
+	return __pw_dup (ent);
+}
+
+static void pw_release (/*@only@*/void *ent)
+{
+	pw_free (ent);
+}
+
+static const char *pw_name (const void *ent)
+{
+	return ((const struct passwd *) ent)->pw_name;
+}
+
+static unsigned long pw_id (const void *ent)
+{
+	return ((const struct passwd *) ent)->pw_uid;
+}
+
+static void *gr_read (FILE *fp)
+{
+	return fgetgrent (fp);
+}
+
+static /*@only@*/void *gr_dup (const void *ent)
+{
+	return __gr_dup (ent);
+}
+
+static void gr_release (/*@only@*/void *ent)
+{
+	gr_free (ent);
+}
+
+static const char *gr_name (const void *ent)
+{
+	return ((const struct group *) ent)->gr_name;
+}
+
+static unsigned long gr_id (const void *ent)
+{
+	return ((const struct group *) ent)->gr_gid;
+}
+
+static void *spw_read (FILE *fp)
+{
+	return fgetspent (fp);
+}
+
+static /*@only@*/void *spw_dup (const void *ent)
+{
+	return __spw_dup (ent);
+}
+
+static void spw_release (/*@only@*/void *ent)
+{
+	spw_free (ent);
+}
+
+static const char *spw_name (const void *ent)
+{
+	return ((const struct spwd *) ent)->sp_namp;
+}
+
+static const struct prefix_cache_ops pw_cache_ops = {
+	pw_read, pw_dup, pw_release, pw_name, pw_id
+};
+static const struct prefix_cache_ops gr_cache_ops = {
+	gr_read, gr_dup, gr_release, gr_name, gr_id
+};
+static const struct prefix_cache_ops spw_cache_ops = {
+	spw_read, spw_dup, spw_release, spw_name, NULL
+};
+
+static struct prefix_cache pw_cache;
+static struct prefix_cache gr_cache;
+static struct prefix_cache spw_cache;
+
+/* The operations used to sort the cache being loaded */
+static const struct prefix_cache_ops *sort_ops;
+
+static int item_name_cmp (const void *p1, const void *p2)
+{
+	const struct cache_item *i1 = p1;
+	const struct cache_item *i2 = p2;
+	int ret;
+
+	ret = strcmp (sort_ops->getname (i1->ent), sort_ops->getname (i2->ent));
+	if (0 != ret) {
+		return ret;
+	}
+	return (i1->pos < i2->pos) ? -1 : (i1->pos > i2->pos);
+}
+
+static int item_id_cmp (const void *p1, const void *p2)
+{
+	const struct cache_item *i1 = p1;
+	const struct cache_item *i2 = p2;
+	unsigned long id1 = sort_ops->getid (i1->ent);
+	unsigned long id2 = sort_ops->getid (i2->ent);
+
+	if (id1 != id2) {
+		return (id1 < id2) ? -1 : 1;
+	}
+	return (i1->pos < i2->pos) ? -1 : (i1->pos > i2->pos);
+}
+
+static void cache_free (struct prefix_cache *cache,
+                        const struct prefix_cache_ops *ops)
+{
+	size_t i;
+
+	if (NULL != cache->by_name) {
+		for (i = 0; i < cache->count; i++) {
+			ops->free (cache->by_name[i]);
+		}
+	}
+	free (cache->by_name);
+	free (cache->by_id);
+	cache->by_name = NULL;
+	cache->by_id = NULL;
+	cache->count = 0;
+	cache->loaded = false;
+}
+
+/*
+ * cache_load - Read all the entries of file in the cache.
+ *
+ *	Return 0 on success, -1 on failure.
+ */
+static int cache_load (struct prefix_cache *cache,
+                       const struct prefix_cache_ops *ops, const char *file)
+{
+	struct cache_item *items = NULL, *tmp;
+	size_t count = 0, size = 0, i;
+	void *ent;
+	FILE *fp;
+	int ret = -1;
+
+	fp = fopen (file, "rt");
+	if (NULL == fp) {
+		return -1;
+	}
+	if (fstat (fileno (fp), &cache->sb) != 0) {
+		goto out;
+	}
+	while ((ent = ops->read (fp)) != NULL) {
+		if (count == size) {
+			size = (0 == size) ? 64 : size * 2;
+			tmp = realloc (items, size * sizeof *items);
+			if (NULL == tmp) {
+				goto out;
+			}
+			items = tmp;
+		}
+		items[count].ent = ops->dup (ent);
+		if (NULL == items[count].ent) {
+			goto out;
+		}
+		items[count].pos = count;
+		count++;
+	}
+
+	cache->by_name = malloc ((count + 1) * sizeof *cache->by_name);
+	if (NULL != ops->getid) {
+		cache->by_id = malloc ((count + 1) * sizeof *cache->by_id);
+	}
+	if (   (NULL == cache->by_name)
+	    || ((NULL != ops->getid) && (NULL == cache->by_id))) {
+		free (cache->by_name);
+		free (cache->by_id);
+		cache->by_name = NULL;
+		cache->by_id = NULL;
+		goto out;
+	}
+
+	sort_ops = ops;
+	if (NULL != ops->getid) {
+		qsort (items, count, sizeof *items, item_id_cmp);
+		for (i = 0; i < count; i++) {
+			cache->by_id[i] = items[i].ent;
+		}
+	}
+	qsort (items, count, sizeof *items, item_name_cmp);
+	for (i = 0; i < count; i++) {
+		cache->by_name[i] = items[i].ent;
+	}
+	cache->count = count;
+	cache->loaded = true;
+	count = 0;
+	ret = 0;
+
+      out:
+	for (i = 0; i < count; i++) {
+		ops->free (items[i].ent);
+	}
+	free (items);
+	(void) fclose (fp);
+	return ret;
+}
+
+/*
+ * cache_lookup - Look up file by name (if not NULL) or by ID with its
+ *	cache.
+ *
+ *	Return true if the cache could be used; *ent is then set to the
+ *	first entry of the file with this name or ID, or to NULL if there
+ *	is none.
+ */
+static bool cache_lookup (struct prefix_cache *cache,
+                          const struct prefix_cache_ops *ops,
+                          const char *file, /*@null@*/const char *name,
+                          unsigned long id, void **ent)
+{
+	struct stat sb;
+	size_t lo = 0, hi;
+
+	if (stat (file, &sb) != 0) {
+		cache_free (cache, ops);
+		return false;
+	}
+	if (   cache->loaded
+	    && (   (sb.st_dev != cache->sb.st_dev)
+	        || (sb.st_ino != cache->sb.st_ino)
+	        || (sb.st_size != cache->sb.st_size)
+	        || (sb.st_mtim.tv_sec != cache->sb.st_mtim.tv_sec)
+	        || (sb.st_mtim.tv_nsec != cache->sb.st_mtim.tv_nsec))) {
+		cache_free (cache, ops);
+	}
+	if (!cache->loaded) {
+		cache->lookups++;
+		if (   (cache->lookups < 2)
+		    || (cache_load (cache, ops, file) != 0)) {
+			return false;
+		}
+	}
+
+	hi = cache->count;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		bool before;
+
+		if (NULL != name) {
+			before = strcmp (ops->getname (cache->by_name[mid]), name) < 0;
+		} else {
+			before = ops->getid (cache->by_id[mid]) < id;
+		}
+		if (before) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	*ent = NULL;
+	if (lo < cache->count) {
+		if (NULL != name) {
+			if (strcmp (ops->getname (cache->by_name[lo]), name) == 0) {
+				*ent = cache->by_name[lo];
+			}
+		} else if (ops->getid (cache->by_id[lo]) == id) {
+			*ent = cache->by_id[lo];
+		}
+	}
+	return true;
+}
+
+/*
+ * index_getpw - Look up the passwd file by name (if not NULL) or by UID
+ *	with its lookup index.
+ *
+ *	Return true if the index could be used; *pwd is then set to the
+ *	entry, or to NULL if there is none.
+ */
+static bool index_getpw (/*@null@*/const char *name, uid_t uid,
+                         struct passwd **pwd)
+{
+	char *line;
+	int ret;
+
+	ret = dbindex_lookup (passwd_db_file, name, uid, &line);
+	if (-1 == ret) {
+		return false;
+	}
+
+	*pwd = NULL;
+	if (1 == ret) {
+		*pwd = sgetpwent (line);
+		free (line);
+		if (NULL == *pwd) {
+			/* Let the scan of the file decide */
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * index_getgr - Look up the group file by name (if not NULL) or by GID
+ *	with its lookup index.
+ */
+static bool index_getgr (/*@null@*/const char *name, gid_t gid,
+                         struct group **grp)
+{
+	char *line;
+	int ret;
+
+	ret = dbindex_lookup (group_db_file, name, gid, &line);
+	if (-1 == ret) {
+		return false;
+	}
+
+	*grp = NULL;
+	if (1 == ret) {
+		*grp = sgetgrent (line);
+		free (line);
+		if (NULL == *grp) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * sorted_getpw - Look up the passwd file by name with a binary search, if
+ *	it is marked sorted (see SORTED_DATABASES).
+ *
+ *	Return true if the file is sorted; *pwd is then set to the entry,
+ *	or to NULL if there is none.
+ */
+static bool sorted_getpw (const char *name, struct passwd **pwd)
+{
+	char **lines;
+	int i, n;
+
+	n = sorted_lookup (passwd_db_file, name, &lines);
+	if (-1 == n) {
+		return false;
+	}
+
+	*pwd = (n > 0) ? sgetpwent (lines[0]) : NULL;
+	for (i = 0; i < n; i++) {
+		free (lines[i]);
+	}
+	free (lines);
+	return (0 == n) || (NULL != *pwd);
+}
+
+/*
+ * sorted_getgr - Look up the group file by name with a binary search.
+ */
+static bool sorted_getgr (const char *name, struct group **grp)
+{
+	char **lines;
+	int i, n;
+
+	n = sorted_lookup (group_db_file, name, &lines);
+	if (-1 == n) {
+		return false;
+	}
+
+	*grp = (n > 0) ? sgetgrent (lines[0]) : NULL;
+	for (i = 0; i < n; i++) {
+		free (lines[i]);
+	}
+	free (lines);
+	return (0 == n) || (NULL != *grp);
+}
 
 extern struct group *prefix_getgrnam(const char *name)
 {
+	struct group * grp = NULL;
+
 	if (group_db_file) {
 		FILE* fg;
-		struct group * grp = NULL;
+
+		if (cache_lookup (&gr_cache, &gr_cache_ops, group_db_file,
+		                  name, 0, (void **) &grp))
+			return grp;
+		if (index_getgr (name, 0, &grp))
+			return grp;
+		if (sorted_getgr (name, &grp))
+			return grp;
 
 		fg = fopen(group_db_file, "rt");
 		if (!fg)
@@ -164,14 +662,24 @@ extern struct group *prefix_getgrnam(const char *name)
 		return grp;
 	}
 
-	return getgrnam(name);
+	PROBE1 (nss__lookup__start, "getgrnam");
+	grp = getgrnam (name);
+	PROBE2 (nss__lookup__done, "getgrnam", NULL != grp);
+	return grp;
 }
 
 extern struct group *prefix_getgrgid(gid_t gid)
 {
+	struct group * grp = NULL;
+
 	if (group_db_file) {
 		FILE* fg;
-		struct group * grp = NULL;
+
+		if (cache_lookup (&gr_cache, &gr_cache_ops, group_db_file,
+		                  NULL, gid, (void **) &grp))
+			return grp;
+		if (index_getgr (NULL, gid, &grp))
+			return grp;
 
 		fg = fopen(group_db_file, "rt");
 		if (!fg)
@@ -184,14 +692,24 @@ extern struct group *prefix_getgrgid(gid_t gid)
 		return grp;
 	}
 
-	return getgrgid(gid);
+	PROBE1 (nss__lookup__start, "getgrgid");
+	grp = getgrgid (gid);
+	PROBE2 (nss__lookup__done, "getgrgid", NULL != grp);
+	return grp;
 }
 
 extern struct passwd *prefix_getpwuid(uid_t uid)
 {
+	struct passwd *pwd = NULL;
+
 	if (passwd_db_file) {
 		FILE* fg;
-		struct passwd *pwd = NULL;
+
+		if (cache_lookup (&pw_cache, &pw_cache_ops, passwd_db_file,
+		                  NULL, uid, (void **) &pwd))
+			return pwd;
+		if (index_getpw (NULL, uid, &pwd))
+			return pwd;
 
 		fg = fopen(passwd_db_file, "rt");
 		if (!fg)
@@ -204,14 +722,236 @@ extern struct passwd *prefix_getpwuid(uid_t uid)
 		return pwd;
 	}
 	else {
-		return getpwuid(uid);
+		PROBE1 (nss__lookup__start, "getpwuid");
+		pwd = getpwuid (uid);
+		PROBE2 (nss__lookup__done, "getpwuid", NULL != pwd);
+		return pwd;
+	}
+}
+
+/*
+ * not_found - Return true if a lookup which returned NULL with this
+ *             errno did not fail
+ */
+static bool not_found (int err)
+{
+	return (0 == err) || (ENOENT == err) || (ESRCH == err)
+	    || (EBADF == err) || (EPERM == err);
+}
+
+/*
+ * The results of the lookups of the next candidate IDs, done in
+ * parallel by prefix_prefetch_ids().
+ */
+struct prefetch {
+	unsigned long id;
+	bool group;
+	bool used;
+	bool valid;	/* the lookup did not fail */
+	bool started;
+	pthread_t thread;
+};
+static struct prefetch prefetched[2 * ID_PREFETCH_MAX];
+static size_t nprefetched = 0;
+
+/*
+ * prefetch_one - Look the ID of a prefetch up through NSS, in a thread
+ */
+static /*@null@*/void *prefetch_one (void *arg)
+{
+	struct prefetch *p = arg;
+	long size = sysconf (p->group ? _SC_GETGR_R_SIZE_MAX : _SC_GETPW_R_SIZE_MAX);
+	int err;
+
+	if (size <= 0) {
+		size = 16384;
+	}
+	for (;;) {
+		char *buf = malloc (size);
+
+		if (NULL == buf) {
+			return NULL;
+		}
+		if (p->group) {
+			struct group grent, *grp = NULL;
+
+			err = getgrgid_r (p->id, &grent, buf, size, &grp);
+			p->used = (NULL != grp);
+		} else {
+			struct passwd pwent, *pwd = NULL;
+
+			err = getpwuid_r (p->id, &pwent, buf, size, &pwd);
+			p->used = (NULL != pwd);
+		}
+		free (buf);
+		if ((ERANGE != err) || (size > 1048576)) {
+			break;
+		}
+		size *= 2;
+	}
+	p->valid = p->used || not_found (err);
+	return NULL;
+}
+
+/*
+ * prefetched_id - Find the result of a prefetched lookup.
+ *
+ *	Return true and set *used if the ID was looked up without an
+ *	error.
+ */
+static bool prefetched_id (bool group, unsigned long id, bool *used)
+{
+	size_t i;
+
+	for (i = 0; i < nprefetched; i++) {
+		if (   (prefetched[i].group == group)
+		    && (prefetched[i].id == id)) {
+			*used = prefetched[i].used;
+			return prefetched[i].valid;
+		}
+	}
+	return false;
+}
+
+/*
+ * prefix_prefetch_ids - Look the n candidate IDs ids up through NSS in
+ *                       parallel, as UIDs if uids is set and as GIDs if
+ *                       gids is set.
+ *
+ *	prefix_uid_used() and prefix_gid_used() then return their
+ *	results without a lookup, until the next call. Nothing is done
+ *	if the first ID was already prefetched, or in the files of a
+ *	prefix. The IDs whose lookups failed are looked up again.
+ */
+extern void prefix_prefetch_ids (const unsigned long *ids, size_t n,
+                                 bool uids, bool gids)
+{
+	size_t i, k;
+	bool used;
+
+	if (n > ID_PREFETCH_MAX) {
+		n = ID_PREFETCH_MAX;
+	}
+	uids = uids && (NULL == passwd_db_file);
+	gids = gids && (NULL == group_db_file);
+	if (   (0 == n)
+	    || (uids && prefetched_id (false, ids[0], &used))
+	    || (!uids && gids && prefetched_id (true, ids[0], &used))) {
+		return;
+	}
+
+	nprefetched = 0;
+	for (k = 0; k < 2; k++) {
+		bool group = (1 == k);
+		const char *db = group ? gr_dbname () : pw_dbname ();
+
+		if (!(group ? gids : uids)) {
+			continue;
+		}
+		for (i = 0; i < n; i++) {
+			struct prefetch *p = &prefetched[nprefetched];
+
+			if (id_probe_cached (db, ids[i]) != -1) {
+				continue;
+			}
+			p->id = ids[i];
+			p->group = group;
+			p->used = false;
+			p->valid = false;
+			p->started = (pthread_create (&p->thread, NULL,
+			                              prefetch_one, p) == 0);
+			nprefetched++;
+		}
+	}
+
+	for (i = 0; i < nprefetched; i++) {
+		struct prefetch *p = &prefetched[i];
+
+		if (!p->started) {
+			continue;
+		}
+		(void) pthread_join (p->thread, NULL);
+		if (p->valid) {
+			id_probe_record (p->group ? gr_dbname () : pw_dbname (),
+			                 p->id, p->used);
+		}
 	}
 }
+
+/*
+ * prefix_uid_used - Return true if the UID uid is used.
+ *
+ *	Through NSS, the results of the previous lookups are reused with
+ *	ID_PROBE_CACHE_TTL, and the results of prefix_prefetch_ids(). A
+ *	failed lookup returns false, and is not kept.
+ */
+extern bool prefix_uid_used (uid_t uid)
+{
+	const char *db = pw_dbname ();
+	bool used;
+	int cached;
+
+	if (passwd_db_file) {
+		return prefix_getpwuid (uid) != NULL;
+	}
+
+	cached = id_probe_cached (db, uid);
+	if (-1 != cached) {
+		return 1 == cached;
+	}
+	if (prefetched_id (false, uid, &used)) {
+		return used;
+	}
+	errno = 0;
+	used = (prefix_getpwuid (uid) != NULL);
+	if (used || not_found (errno)) {
+		id_probe_record (db, uid, used);
+	}
+	return used;
+}
+
+/*
+ * prefix_gid_used - Return true if the GID gid is used, like
+ *                   prefix_uid_used()
+ */
+extern bool prefix_gid_used (gid_t gid)
+{
+	const char *db = gr_dbname ();
+	bool used;
+	int cached;
+
+	if (group_db_file) {
+		return prefix_getgrgid (gid) != NULL;
+	}
+
+	cached = id_probe_cached (db, gid);
+	if (-1 != cached) {
+		return 1 == cached;
+	}
+	if (prefetched_id (true, gid, &used)) {
+		return used;
+	}
+	errno = 0;
+	used = (prefix_getgrgid (gid) != NULL);
+	if (used || not_found (errno)) {
+		id_probe_record (db, gid, used);
+	}
+	return used;
+}
 extern struct passwd *prefix_getpwnam(const char* name)
 {
+	struct passwd *pwd = NULL;
+
 	if (passwd_db_file) {
 		FILE* fg;
-		struct passwd *pwd = NULL;
+
+		if (cache_lookup (&pw_cache, &pw_cache_ops, passwd_db_file,
+		                  name, 0, (void **) &pwd))
+			return pwd;
+		if (index_getpw (name, 0, &pwd))
+			return pwd;
+		if (sorted_getpw (name, &pwd))
+			return pwd;
 
 		fg = fopen(passwd_db_file, "rt");
 		if (!fg)
@@ -224,14 +964,22 @@ extern struct passwd *prefix_getpwnam(const char* name)
 		return pwd;
 	}
 	else {
-		return getpwnam(name);
+		PROBE1 (nss__lookup__start, "getpwnam");
+		pwd = getpwnam (name);
+		PROBE2 (nss__lookup__done, "getpwnam", NULL != pwd);
+		return pwd;
 	}
 }
 extern struct spwd *prefix_getspnam(const char* name)
 {
+	struct spwd *sp = NULL;
+
 	if (spw_db_file) {
 		FILE* fg;
-		struct spwd *sp = NULL;
+
+		if (cache_lookup (&spw_cache, &spw_cache_ops, spw_db_file,
+		                  name, 0, (void **) &sp))
+			return sp;
 
 		fg = fopen(spw_db_file, "rt");
 		if (!fg)
@@ -244,7 +992,10 @@ extern struct spwd *prefix_getspnam(const char* name)
 		return sp;
 	}
 	else {
-		return getspnam(name);
+		PROBE1 (nss__lookup__start, "getspnam");
+		sp = getspnam (name);
+		PROBE2 (nss__lookup__done, "getspnam", NULL != sp);
+		return sp;
 	}
 }
 
@@ -282,6 +1033,112 @@ extern void prefix_endpwent(void)
 	fp_pwent = NULL;
 }
 
+#ifndef NSSWITCH_FILE
+#define NSSWITCH_FILE "/etc/nsswitch.conf"
+#endif
+
+/*
+ * nss_passwd_files_only - Check if the users only come from the files
+ *	source in nsswitch.conf.
+ */
+static bool nss_passwd_files_only (void)
+{
+	char buf[BUFSIZ];
+	bool files_only = true;	/* the default of the libc */
+	FILE *fp;
+
+	fp = fopen (NSSWITCH_FILE, "re");
+	if (NULL == fp) {
+		return true;
+	}
+	while (fgets (buf, sizeof buf, fp) == buf) {
+		bool in_action = false;
+		char *cp = buf + strspn (buf, " \t");
+		char *tok;
+
+		if (strncmp (cp, "passwd", 6) != 0) {
+			continue;
+		}
+		cp += 6;
+		cp += strspn (cp, " \t");
+		if (':' != *cp) {
+			continue;
+		}
+		for (tok = strtok (cp + 1, " \t\n"); NULL != tok;
+		     tok = strtok (NULL, " \t\n")) {
+			/* Skip the actions, like [NOTFOUND=return] */
+			if ('[' == tok[0]) {
+				in_action = true;
+			}
+			if (in_action) {
+				in_action = (strchr (tok, ']') == NULL);
+				continue;
+			}
+			if (strcmp (tok, "files") != 0) {
+				files_only = false;
+			}
+		}
+		break;
+	}
+	(void) fclose (fp);
+	return files_only;
+}
+
+/*
+ * prefix_gid_users - List the users whose primary group is gid
+ *
+ *	The lookup index of the passwd file is used when it is up to date
+ *	(see LOOKUP_INDEX). Without a prefix, the users of the other
+ *	sources of nsswitch.conf are then only enumerated if passwd has
+ *	other sources than files. Without an index, the users are
+ *	enumerated.
+ *
+ *	At most max users are listed, or all of them if max is 0.
+ *	Return a NULL terminated list of their names (allocated).
+ */
+extern char **prefix_gid_users (gid_t gid, size_t max)
+{
+	struct passwd *pwd;
+	char **names;
+	size_t count = 0;
+	int ret;
+
+	ret = dbindex_gid_names (pw_dbname (), gid, max, &names);
+	if (-1 != ret) {
+		count = ret;
+		if (   (NULL != passwd_db_file)
+		    || ((0 != max) && (count >= max))
+		    || nss_passwd_files_only ()) {
+			return names;
+		}
+	} else {
+		names = xmalloc (sizeof *names);
+		names[0] = NULL;
+	}
+
+	prefix_setpwent ();
+	while (   ((0 == max) || (count < max))
+	       && ((pwd = prefix_getpwent ()) != NULL)) {
+		if ((pwd->pw_gid != gid) || is_on_list (names, pwd->pw_name)) {
+			continue;
+		}
+		if (0 == (count % 64)) {
+			char **list = realloc (names, (count + 64 + 1) * sizeof *list);
+
+			if (NULL == list) {
+				fprintf (log_get_logfd (), _("%s: out of memory\n"),
+				         log_get_progname ());
+				exit (EXIT_FAILURE);
+			}
+			names = list;
+		}
+		names[count++] = xstrdup (pwd->pw_name);
+		names[count] = NULL;
+	}
+	prefix_endpwent ();
+	return names;
+}
+
 extern void prefix_setgrent(void)
 {
 	if (!group_db_file) {
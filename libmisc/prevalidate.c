@@ -0,0 +1,207 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * The input of newusers and chpasswd can be validated before the
+ * databases are locked: the whole input is read, and its lines are
+ * checked by a few threads, each on a part of the input. The errors are
+ * reported in the order of the lines, and the tools then read the
+ * validated input from memory instead of their standard input.
+ */
+
+#define LINES_PER_THREAD	4096
+#define MAX_THREADS		16
+#define ERROR_SIZE		512
+
+struct validation {
+	bool (*check) (char *line, int lineno, char *err, size_t errsize);
+	char **lines;
+	size_t first;
+	size_t count;
+	size_t nerrors;
+	char *errors;		/* ERROR_SIZE per line */
+};
+
+static void *validate_part (void *arg)
+{
+	struct validation *v = arg;
+	size_t i;
+
+	for (i = v->first; i < v->first + v->count; i++) {
+		char *err = &v->errors[i * ERROR_SIZE];
+
+		err[0] = '\0';
+		if (!v->check (v->lines[i], i + 1, err, ERROR_SIZE)) {
+			v->nerrors++;
+		}
+	}
+	return NULL;
+}
+
+static long validation_threads (size_t nlines)
+{
+	long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	long n = nlines / LINES_PER_THREAD + 1;
+
+	if (ncpu < 1) {
+		ncpu = 1;
+	}
+	if (n > ncpu) {
+		n = ncpu;
+	}
+	return (n > MAX_THREADS) ? MAX_THREADS : n;
+}
+
+/*
+ * validate_input - Read and check the whole input before the databases
+ *                  are locked.
+ *
+ *	check is called for each line of in, without its newline, on a
+ *	copy of the line which it can modify. It is called by several
+ *	threads at once, and must not use the databases opened by the
+ *	tool. If the line is invalid, check writes its error message in
+ *	err and returns false.
+ *
+ *	All the errors are reported. Return a stream of the input, or NULL
+ *	if a line is invalid or the input cannot be read.
+ */
+/*@null@*/FILE *validate_input (FILE *in,
+                                bool (*check) (char *line, int lineno,
+                                               char *err, size_t errsize))
+{
+	static char *input = NULL;
+	struct validation parts[MAX_THREADS];
+	pthread_t threads[MAX_THREADS];
+	bool started[MAX_THREADS];
+	char *copy = NULL;
+	char **lines = NULL;
+	char *errors = NULL;
+	size_t size = 0, len = 0, nlines = 0;
+	size_t nerrors = 0;
+	size_t i, per_thread;
+	long nthreads, t;
+	FILE *out = NULL;
+	char buf[BUFSIZ];
+	size_t n;
+
+	/* Read the whole input */
+	while ((n = fread (buf, 1, sizeof buf, in)) > 0) {
+		if (len + n + 1 > size) {
+			char *p;
+
+			size = (len + n + 1) * 2;
+			p = realloc (input, size);
+			if (NULL == p) {
+				goto oom;
+			}
+			input = p;
+		}
+		memcpy (input + len, buf, n);
+		len += n;
+	}
+	if (ferror (in) != 0) {
+		fprintf (log_get_logfd (), _("%s: cannot read the input: %s\n"),
+		         log_get_progname (), strerror (errno));
+		return NULL;
+	}
+	if (0 == len) {
+		return in;	/* at its end */
+	}
+	input[len] = '\0';
+
+	/* Split a copy in lines, which the checks can modify */
+	copy = malloc (len + 1);
+	if (NULL == copy) {
+		goto oom;
+	}
+	memcpy (copy, input, len + 1);
+	for (i = 0; i < len; i++) {
+		if ((0 == i) || ('\0' == copy[i - 1])) {
+			if (0 == (nlines % 64)) {
+				char **p = realloc (lines, (nlines + 64) * sizeof *p);
+
+				if (NULL == p) {
+					goto oom;
+				}
+				lines = p;
+			}
+			lines[nlines] = &copy[i];
+			nlines++;
+		}
+		if ('\n' == copy[i]) {
+			copy[i] = '\0';
+		}
+	}
+	errors = malloc (nlines * ERROR_SIZE);
+	if (NULL == errors) {
+		goto oom;
+	}
+
+	/* Check the lines */
+	nthreads = validation_threads (nlines);
+	per_thread = (nlines + nthreads - 1) / nthreads;
+	for (t = 0; t < nthreads; t++) {
+		parts[t].check = check;
+		parts[t].lines = lines;
+		parts[t].first = t * per_thread;
+		parts[t].count = 0;
+		if (parts[t].first < nlines) {
+			parts[t].count = nlines - parts[t].first;
+			if (parts[t].count > per_thread) {
+				parts[t].count = per_thread;
+			}
+		}
+		parts[t].nerrors = 0;
+		parts[t].errors = errors;
+		/* The first part is checked by this thread */
+		started[t] =    (0 != t)
+		             && (pthread_create (&threads[t], NULL,
+		                                 validate_part, &parts[t]) == 0);
+	}
+	for (t = 0; t < nthreads; t++) {
+		if (started[t]) {
+			(void) pthread_join (threads[t], NULL);
+		} else {
+			(void) validate_part (&parts[t]);
+		}
+		nerrors += parts[t].nerrors;
+	}
+
+	/* Report the errors in the order of the lines */
+	for (i = 0; i < nlines; i++) {
+		if ('\0' != errors[i * ERROR_SIZE]) {
+			fputs (&errors[i * ERROR_SIZE], log_get_logfd ());
+		}
+	}
+	if (0 == nerrors) {
+		out = fmemopen (input, len, "r");
+		if (NULL == out) {
+			goto oom;
+		}
+	}
+
+	free (errors);
+	free (lines);
+	free (copy);
+	return out;
+
+oom:
+	fprintf (log_get_logfd (), _("%s: out of memory\n"),
+	         log_get_progname ());
+	exit (EXIT_FAILURE);
+}
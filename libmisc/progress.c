@@ -0,0 +1,173 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * Progress of the copies and deletions of the home directories.
+ *
+ * With --progress, useradd and usermod measure the tree before copying or
+ * deleting it, and report the progress reported by copy_tree() or
+ * remove_tree(), with the throughput and the estimated time left, every
+ * PROGRESS_INTERVAL seconds. The throughput of the whole operation is
+ * reported at the end.
+ */
+
+/* Interval between two progress reports, in seconds */
+#define PROGRESS_INTERVAL	1
+
+#define MIB	(1024.0 * 1024.0)
+
+static /*@observer@*/const char *progress_action;
+static /*@observer@*/const char *progress_root;
+static unsigned long total_files;
+static unsigned long long total_bytes;
+static struct tree_progress last;
+static struct timespec start;
+static struct timespec last_report;
+
+/*
+ * measure - count the entries and the bytes of the regular files below
+ *           name, in the directory at_fd
+ */
+static void measure (int at_fd, const char *name)
+{
+	DIR *dir;
+	const struct dirent *ent;
+	int fd;
+
+	fd = openat (at_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+	dir = fdopendir (fd);
+	if (NULL == dir) {
+		(void) close (fd);
+		return;
+	}
+	while ((ent = readdir (dir)) != NULL) {
+		struct stat sb;
+
+		if (   (strcmp (ent->d_name, ".") == 0)
+		    || (strcmp (ent->d_name, "..") == 0)) {
+			continue;
+		}
+		if (fstatat (dirfd (dir), ent->d_name, &sb, AT_SYMLINK_NOFOLLOW) != 0) {
+			continue;
+		}
+		total_files++;
+		if (S_ISREG (sb.st_mode)) {
+			total_bytes += sb.st_size;
+		} else if (S_ISDIR (sb.st_mode)) {
+			measure (dirfd (dir), ent->d_name);
+		}
+	}
+	(void) closedir (dir);
+}
+
+/*
+ * elapsed - Return the time between since and now, in seconds
+ */
+static double elapsed (const struct timespec *since,
+                       const struct timespec *now)
+{
+	return (now->tv_sec - since->tv_sec)
+	       + (now->tv_nsec - since->tv_nsec) / 1e9;
+}
+
+/*
+ * progress_start - Start reporting the progress of action (e.g.
+ *                  "copying") on the tree root.
+ *
+ *	The tree is measured first, to estimate the time left.
+ */
+void progress_start (const char *action, const char *root)
+{
+	progress_action = action;
+	progress_root = root;
+	total_files = 1;	/* the root */
+	total_bytes = 0;
+	(void) memset (&last, 0, sizeof last);
+	measure (AT_FDCWD, root);
+	(void) clock_gettime (CLOCK_MONOTONIC, &start);
+	last_report = start;
+}
+
+/*
+ * progress_report - Report progress, every PROGRESS_INTERVAL seconds.
+ *
+ *	It is the tree_progress_cb of copy_tree() and remove_tree(), set
+ *	with copy_tree_set_progress() and remove_tree_set_progress().
+ */
+void progress_report (const struct tree_progress *progress)
+{
+	struct timespec now;
+	double t, eta = -1;
+
+	last = *progress;
+	last.path = NULL;
+	if (   (clock_gettime (CLOCK_MONOTONIC, &now) != 0)
+	    || (elapsed (&last_report, &now) < PROGRESS_INTERVAL)) {
+		return;
+	}
+	last_report = now;
+
+	t = elapsed (&start, &now);
+
+	/* Estimate with the bytes copied, or the entries removed */
+	if ((progress->bytes > 0) && (progress->bytes <= total_bytes)) {
+		eta = t * (total_bytes - progress->bytes) / progress->bytes;
+	} else if ((progress->files > 0) && (progress->files <= total_files)) {
+		eta = t * (total_files - progress->files) / progress->files;
+	}
+
+	(void) fprintf (log_get_logfd (),
+	                _("%s: %s %s: %lu of %lu files, %.1f of %.1f MiB, %.1f MiB/s, %.0f files/s"),
+	                log_get_progname (), progress_action, progress_root,
+	                progress->files, total_files,
+	                progress->bytes / MIB, total_bytes / MIB,
+	                progress->bytes / MIB / t, progress->files / t);
+	if (eta >= 0) {
+		(void) fprintf (log_get_logfd (), _(", %lu:%02lu left"),
+		                (unsigned long) eta / 60,
+		                (unsigned long) eta % 60);
+	}
+	if (NULL != progress->path) {
+		(void) fprintf (log_get_logfd (), " (%s)", progress->path);
+	}
+	(void) fputs ("\n", log_get_logfd ());
+}
+
+/*
+ * progress_end - Report the throughput of the whole operation.
+ */
+void progress_end (void)
+{
+	struct timespec now;
+	double t;
+
+	if (clock_gettime (CLOCK_MONOTONIC, &now) != 0) {
+		return;
+	}
+	t = elapsed (&start, &now);
+	(void) fprintf (log_get_logfd (),
+	                _("%s: %s %s: %lu files, %.1f MiB in %.1f s (%.1f MiB/s, %.0f files/s)\n"),
+	                log_get_progname (), progress_action, progress_root,
+	                last.files, last.bytes / MIB, t,
+	                (t > 0) ? last.bytes / MIB / t : 0,
+	                (t > 0) ? last.files / t : 0);
+}
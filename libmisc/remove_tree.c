@@ -11,21 +11,131 @@
 
 #ident "$Id$"
 
+#include <assert.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <dirent.h>
+#include <errno.h>
+#include <time.h>
 #include <unistd.h>
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
 
-static int remove_tree_at (int at_fd, const char *path, bool remove_root)
+/*
+ * With HOME_REMOVE_JOBS, the directories are emptied by a pool of threads.
+ * Instead of recursing into a subdirectory, remove_dir_at() queues it,
+ * and the next idle thread deletes its files. The emptied directories are
+ * deleted once the whole tree is empty.
+ *
+ * As in the walk, no path is resolved again: a task keeps the directory
+ * open from the descriptor of its parent (the owner of the tree may
+ * still run processes, which could replace a directory by a symbolic
+ * link), and it is deleted relative to the descriptor of its parent.
+ * They are kept open until the end, so the number of queued directories
+ * is bounded (see dir_pool_fds()): the next ones are deleted recursively
+ * by the thread which finds them.
+ */
+
+struct remove_task {
+	int fd;			/* of the directory */
+	/*@dependent@*/ /*@null@*/const struct remove_task *parent;	/* NULL: root */
+	/*@owned@*/char *name;	/* in the parent */
+	/*@dependent@*/ /*@null@*/struct remove_task *next;	/* queue */
+	/*@owned@*/ /*@null@*/struct remove_task *all_next;	/* all tasks */
+};
+
+struct remove_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/*@dependent@*/ /*@null@*/struct remove_task *queue;
+	/*@owned@*/ /*@null@*/struct remove_task *tasks;	/* newest first */
+	unsigned long active;	/* tasks being processed */
+	bool failed;		/* stop at the first error, like the walk */
+	unsigned long open;	/* tasks, each with an open descriptor */
+	unsigned long max_open;
+	int root_fd;
+};
+static /*@null@*/struct remove_pool *pool = NULL;
+
+/*
+ * Progress of the current remove_tree(), reported to progress_cb. The
+ * path of the progress is the root of the tree.
+ */
+static /*@null@*/tree_progress_cb progress_cb = NULL;
+static struct tree_progress progress;
+
+static int queue_remove (/*@null@*/const struct remove_task *parent,
+                         int dir_fd, const char *name);
+
+/*
+ * remove_tree_set_progress - Report the progress of the next deletions to
+ *                            cb, or stop reporting it if cb is NULL.
+ *
+ *	cb is called after each batch of files and each directory is
+ *	deleted. With HOME_REMOVE_JOBS, it is called by the threads of the
+ *	pool, one at a time.
+ */
+void remove_tree_set_progress (/*@null@*/tree_progress_cb cb)
+{
+	progress_cb = cb;
+}
+
+/*
+ * count_removed - count n entries removed, and report the progress
+ */
+static void count_removed (unsigned long n)
+{
+	if (NULL == progress_cb) {
+		return;
+	}
+	if (NULL != pool) {
+		(void) pthread_mutex_lock (&pool->mutex);
+	}
+	progress.files += n;
+	progress_cb (&progress);
+	if (NULL != pool) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+	}
+}
+
+/*
+ * unlink_files - unlink the files of the batch in the directory dir_fd
+ */
+static int unlink_files (struct dir_batch *files, int dir_fd)
+{
+	unsigned long n = files->count;
+
+	if (deadline_check ("home removal") != 0) {
+		return -1;
+	}
+	if (dir_batch_unlink (files, dir_fd) != 0) {
+		return -1;
+	}
+	count_removed (n);
+	return 0;
+}
+
+/*
+ * remove_dir_at - delete the tree path of the directory at_fd
+ *
+ *	With the pool, and if queue is set, the subdirectories are queued
+ *	as the children of parent (NULL for the root of the tree) instead
+ *	of being deleted recursively.
+ */
+static int remove_dir_at (int at_fd, const char *path, bool remove_root,
+                          bool queue,
+                          /*@null@*/const struct remove_task *parent)
 {
 	DIR *dir;
 	const struct dirent *ent;
+	struct dir_batch *files;
 	int dir_fd, rc = 0;
 
 	dir_fd = openat (at_fd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
@@ -39,11 +149,18 @@ static int remove_tree_at (int at_fd, const char *path, bool remove_root)
 		return -1;
 	}
 
+	files = malloc (sizeof *files);
+	if (NULL == files) {
+		(void) closedir (dir);
+		return -1;
+	}
+	files->count = 0;
+
 	/*
 	 * Open the source directory and delete each entry.
 	 */
 	while ((ent = readdir (dir))) {
-		struct stat ent_sb;
+		bool is_dir;
 
 		/*
 		 * Skip the "." and ".." entries
@@ -53,38 +170,268 @@ static int remove_tree_at (int at_fd, const char *path, bool remove_root)
 			continue;
 		}
 
-		rc = fstatat (dirfd(dir), ent->d_name, &ent_sb, AT_SYMLINK_NOFOLLOW);
-		if (rc < 0) {
-			break;
+		/*
+		 * The type is usually given by readdir(), stat the entry
+		 * only if the file system does not provide it.
+		 */
+		if (DT_UNKNOWN != ent->d_type) {
+			is_dir = (DT_DIR == ent->d_type);
+		} else {
+			struct stat ent_sb;
+
+			rc = fstatat (dirfd(dir), ent->d_name, &ent_sb, AT_SYMLINK_NOFOLLOW);
+			if (rc < 0) {
+				break;
+			}
+			is_dir = S_ISDIR (ent_sb.st_mode);
 		}
 
-		if (S_ISDIR (ent_sb.st_mode)) {
+		if (is_dir && queue && (NULL != pool)) {
+			/*
+			 * Empty this directory in the pool.
+			 */
+			if (   (queue_remove (parent, dirfd(dir), ent->d_name) != 0)
+			    && (remove_dir_at (dirfd(dir), ent->d_name, true,
+			                        false, NULL) != 0)) {
+				/* Deleted here if it cannot be queued */
+				rc = -1;
+				break;
+			}
+		} else if (is_dir) {
 			/*
 			 * Recursively delete this directory.
 			 */
-			if (remove_tree_at (dirfd(dir), ent->d_name, true) != 0) {
+			if (remove_dir_at (dirfd(dir), ent->d_name, true,
+			                    queue, NULL) != 0) {
 				rc = -1;
 				break;
 			}
 		} else {
 			/*
-			 * Delete the file.
+			 * Delete the file, with the next files of the
+			 * batch.
 			 */
-			if (unlinkat (dirfd(dir), ent->d_name, 0) != 0) {
+			if (   dir_batch_add (files, ent->d_name)
+			    && (unlink_files (files, dirfd(dir)) != 0)) {
 				rc = -1;
 				break;
 			}
 		}
 	}
 
+	if ((0 == rc) && (unlink_files (files, dirfd(dir)) != 0)) {
+		rc = -1;
+	}
+	free (files);
 	(void) closedir (dir);
 
 	if (remove_root && (0 == rc)) {
 		if (unlinkat (at_fd, path, AT_REMOVEDIR) != 0) {
 			rc = -1;
+		} else {
+			count_removed (1);
+		}
+	}
+
+	return rc;
+}
+
+/*
+ * queue_remove - queue the subdirectory name of the directory dir_fd,
+ *                which is the directory of the task parent, to the pool
+ *
+ *	Return 0 on success, -1 if the task could not be allocated, too many
+ *	are queued, or the subdirectory could not be opened, so that the
+ *	caller deletes it.
+ */
+static int queue_remove (/*@null@*/const struct remove_task *parent,
+                         int dir_fd, const char *name)
+{
+	struct remove_task *task;
+
+	assert (NULL != pool);
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	if (pool->open >= pool->max_open) {
+		(void) pthread_mutex_unlock (&pool->mutex);
+		return -1;
+	}
+	pool->open++;
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	task = malloc (sizeof *task);
+	if (NULL == task) {
+		goto fail;
+	}
+	task->name = strdup (name);
+	if (NULL == task->name) {
+		free (task);
+		goto fail;
+	}
+	task->fd = openat (dir_fd, name,
+	                   O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == task->fd) {
+		free (task->name);
+		free (task);
+		goto fail;
+	}
+	task->parent = parent;
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	task->next = pool->queue;
+	pool->queue = task;
+	task->all_next = pool->tasks;
+	pool->tasks = task;
+	(void) pthread_cond_signal (&pool->cond);
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return 0;
+
+fail:
+	(void) pthread_mutex_lock (&pool->mutex);
+	pool->open--;
+	(void) pthread_mutex_unlock (&pool->mutex);
+	return -1;
+}
+
+/*
+ * remove_worker - empty the queued directories until the whole tree is
+ *                 empty, or a directory failed
+ */
+static /*@null@*/void *remove_worker (unused void *arg)
+{
+	assert (NULL != pool);
+
+	(void) pthread_mutex_lock (&pool->mutex);
+	for (;;) {
+		struct remove_task *task;
+		int rc;
+
+		while ((NULL == pool->queue) && (0 != pool->active)) {
+			(void) pthread_cond_wait (&pool->cond, &pool->mutex);
+		}
+		task = pool->queue;
+		if ((NULL == task) || pool->failed) {
+			/* Done, or nothing more shall be deleted */
+			break;
+		}
+		pool->queue = task->next;
+		pool->active++;
+		(void) pthread_mutex_unlock (&pool->mutex);
+
+		rc = remove_dir_at (task->fd, ".", false, true, task);
+
+		(void) pthread_mutex_lock (&pool->mutex);
+		if (0 != rc) {
+			pool->failed = true;
+		}
+		pool->active--;
+		if (   ((0 == pool->active) && (NULL == pool->queue))
+		    || pool->failed) {
+			(void) pthread_cond_broadcast (&pool->cond);
+		}
+	}
+	(void) pthread_mutex_unlock (&pool->mutex);
+
+	return NULL;
+}
+
+/*
+ * remove_tree_jobs - remove_tree() with jobs threads
+ *
+ *	Return 1 if the pool could not be started, so that the tree is
+ *	deleted by the caller.
+ */
+static int remove_tree_jobs (const char *root, bool remove_root, long jobs)
+{
+	struct remove_pool rp;
+	struct remove_task *task;
+	pthread_t *threads;
+	long nthreads = 0;
+	long i;
+	int rc;
+
+	threads = calloc (jobs, sizeof *threads);
+	if (NULL == threads) {
+		return 1;
+	}
+	(void) memset (&rp, 0, sizeof rp);
+	if (pthread_mutex_init (&rp.mutex, NULL) != 0) {
+		free (threads);
+		return 1;
+	}
+	if (pthread_cond_init (&rp.cond, NULL) != 0) {
+		(void) pthread_mutex_destroy (&rp.mutex);
+		free (threads);
+		return 1;
+	}
+	rp.root_fd = open (root, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == rp.root_fd) {
+		(void) pthread_cond_destroy (&rp.cond);
+		(void) pthread_mutex_destroy (&rp.mutex);
+		free (threads);
+		return -1;
+	}
+	rp.max_open = dir_pool_fds ();
+	pool = &rp;
+
+	/* The root is emptied by this thread, then the queued directories */
+	rc = remove_dir_at (rp.root_fd, ".", false, true, NULL);
+	if ((0 == rc) && (NULL != rp.queue)) {
+		for (i = 1; i < jobs; i++) {
+			if (pthread_create (&threads[nthreads], NULL,
+			                    remove_worker, NULL) == 0) {
+				nthreads++;
+			}
+		}
+		/* This thread is one of the jobs */
+		(void) remove_worker (NULL);
+		for (i = 0; i < nthreads; i++) {
+			(void) pthread_join (threads[i], NULL);
+		}
+		if (rp.failed) {
+			rc = -1;
 		}
+	} else if (0 != rc) {
+		rc = -1;
 	}
 
+	pool = NULL;
+
+	/*
+	 * A directory is queued after its parent: deleting them from the
+	 * newest removes the subdirectories first, while the descriptors
+	 * of their parents are still open.
+	 */
+	while (NULL != rp.tasks) {
+		int parent_fd;
+
+		task = rp.tasks;
+		rp.tasks = task->all_next;
+		parent_fd = (NULL != task->parent) ? task->parent->fd : rp.root_fd;
+		if (   (0 == rc)
+		    && (unlinkat (parent_fd, task->name, AT_REMOVEDIR) != 0)) {
+			rc = -1;
+		} else if (0 == rc) {
+			count_removed (1);
+		}
+		(void) close (task->fd);
+		free (task->name);
+		free (task);
+	}
+	(void) close (rp.root_fd);
+	if (remove_root && (0 == rc)) {
+		if (unlinkat (AT_FDCWD, root, AT_REMOVEDIR) != 0) {
+			rc = -1;
+		} else {
+			count_removed (1);
+		}
+	}
+
+	(void) pthread_cond_destroy (&rp.cond);
+	(void) pthread_mutex_destroy (&rp.mutex);
+	free (threads);
+
 	return rc;
 }
 
@@ -94,8 +441,400 @@ static int remove_tree_at (int at_fd, const char *path, bool remove_root)
  *	remove_tree() walks a directory tree and deletes all the files
  *	and directories.
  *	At the end, it deletes the root directory itself.
+ *
+ *	With HOME_REMOVE_JOBS, the directories are emptied by that many
+ *	threads.
  */
 int remove_tree (const char *root, bool remove_root)
 {
-	return remove_tree_at (AT_FDCWD, root, remove_root);
+	long jobs = getdef_long ("HOME_REMOVE_JOBS", 1);
+	int rc = 1;
+
+	(void) memset (&progress, 0, sizeof progress);
+	progress.path = root;
+	if (jobs > 1024) {
+		jobs = 1024;
+	}
+	if (jobs > 1) {
+		rc = remove_tree_jobs (root, remove_root, jobs);
+	}
+	if (1 == rc) {
+		rc = remove_dir_at (AT_FDCWD, root, remove_root, false, NULL);
+	}
+
+	return rc;
+}
+
+/*
+ * remove_tree_at - delete the tree path of the directory at_fd
+ *
+ *	As remove_tree(), but path is resolved from at_fd, and its last
+ *	component is not followed if it is a symbolic link. The walkers
+ *	of a tree which may still be changed by its owner use it with the
+ *	descriptor of the parent directory, so that no path is resolved
+ *	again.
+ */
+int remove_tree_at (int at_fd, const char *path, bool remove_root)
+{
+	(void) memset (&progress, 0, sizeof progress);
+	progress.path = path;
+
+	return remove_dir_at (at_fd, path, remove_root, false, NULL);
+}
+
+/*
+ * detach - detach the background process from the caller
+ *
+ *	The descriptors of the caller are closed, so that the locks of the
+ *	databases are not kept, and that the readers of its output do not
+ *	wait for the deletion.
+ */
+static void detach (void)
+{
+	long max = sysconf (_SC_OPEN_MAX);
+	int fd;
+
+	(void) setsid ();
+	if (max < 0) {
+		max = 1024;
+	}
+	for (fd = 3; fd < max; fd++) {
+		(void) close (fd);
+	}
+	fd = open ("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		(void) dup2 (fd, STDIN_FILENO);
+		(void) dup2 (fd, STDOUT_FILENO);
+		(void) dup2 (fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO) {
+			(void) close (fd);
+		}
+	}
+}
+
+/*
+ * fork_detached - fork a process detached from the caller
+ *
+ *	Return 0 in the detached process, a positive value in the caller,
+ *	and -1 if the process could not be created.
+ */
+static pid_t fork_detached (void)
+{
+	pid_t pid;
+	int status;
+
+	pid = fork ();
+	if (0 == pid) {
+		pid = fork ();
+		if (0 != pid) {
+			_exit ((pid > 0) ? 0 : 1);
+		}
+		detach ();
+		return 0;
+	}
+	if (   (pid > 0)
+	    && (waitpid (pid, &status, 0) == pid)
+	    && WIFEXITED (status)
+	    && (0 == WEXITSTATUS (status))) {
+		return pid;
+	}
+	return -1;
+}
+
+/*
+ * trash_name - Return a hidden name next to path, on the same file system,
+ *              where it can be renamed before its deletion.
+ *
+ *	Return NULL if the memory could not be allocated.
+ */
+static /*@null@*/ /*@only@*/char *trash_name (const char *path)
+{
+	const char *name;
+	char *trash;
+	size_t len;
+
+	name = strrchr (path, '/');
+	name = (NULL != name) ? name + 1 : path;
+	len = strlen (path) + 32;
+	trash = malloc (len);
+	if (NULL != trash) {
+		(void) snprintf (trash, len, "%.*s.%s.deleted.%lu",
+		                 (int) (name - path), path, name,
+		                 (unsigned long) getpid ());
+	}
+	return trash;
+}
+
+/*
+ * remove_tree_async - delete a directory tree in the background
+ *
+ *	The root is renamed in its parent directory, so that it disappears
+ *	atomically, and the tree is deleted by a detached process. The
+ *	caller does not wait for it: the errors of the deletion are only
+ *	logged.
+ *
+ *	If the root cannot be renamed (e.g. it is a mount point), it is
+ *	deleted before returning, as with remove_tree().
+ */
+int remove_tree_async (const char *root)
+{
+	char *trash;
+	pid_t pid;
+	int rc;
+
+	trash = trash_name (root);
+	if (NULL == trash) {
+		return remove_tree (root, true);
+	}
+	if (rename (root, trash) != 0) {
+		free (trash);
+		return remove_tree (root, true);
+	}
+
+	pid = fork_detached ();
+	if (0 == pid) {
+		if (remove_tree (trash, true) != 0) {
+			SYSLOG ((LOG_ERR, "failed to remove %s", trash));
+		}
+		_exit (0);
+	}
+	if (pid > 0) {
+		free (trash);
+		return 0;
+	}
+
+	/* Could not fork, delete the tree now */
+	rc = remove_tree (trash, true);
+	free (trash);
+	return rc;
+}
+
+/*
+ * Queue of the deferred removals.
+ *
+ * A file or directory whose removal is deferred is renamed to a hidden
+ * name next to it, so that its name can be reused at once, and recorded
+ * in the queue file as a "time user path" line. The queue is drained
+ * later, once the databases are unlocked, by the same tool or by another
+ * run. The file is protected by an OFD lock, held only while it is read
+ * or written, so the lines left in it are the pending removals.
+ */
+
+/*
+ * queue_open - Open and lock the queue file.
+ *
+ *	Return the file descriptor, or -1 on failure (ENOENT if the file
+ *	does not exist and is not created).
+ */
+static int queue_open (const char *queue, int flags)
+{
+	struct flock lck = {
+		.l_type = F_WRLCK,
+		.l_whence = SEEK_SET,
+		.l_start = 0,
+		.l_len = 0,
+	};
+	int fd;
+
+	fd = open (queue, flags | O_CLOEXEC, 0600);
+	if (-1 == fd) {
+		return -1;
+	}
+	while (fcntl (fd, F_OFD_SETLKW, &lck) != 0) {
+		if (EINTR != errno) {
+			(void) close (fd);
+			return -1;
+		}
+	}
+	return fd;
+}
+
+/*
+ * removal_queue_add - defer the removal of path, a file or directory of
+ *                     user
+ *
+ *	Return 0 on success. On failure (e.g. path is a mount point, and
+ *	cannot be renamed), nothing is changed and path shall be removed by
+ *	the caller.
+ */
+int removal_queue_add (const char *queue, const char *user, const char *path)
+{
+	char *trash;
+	char line[8192];
+	int len;
+	int fd;
+
+	trash = trash_name (path);
+	if (NULL == trash) {
+		return -1;
+	}
+	len = snprintf (line, sizeof line, "%lld %s %s\n",
+	                (long long) time (NULL), user, trash);
+	if ((len < 0) || ((size_t) len >= sizeof line)) {
+		free (trash);
+		return -1;
+	}
+
+	fd = queue_open (queue, O_WRONLY | O_CREAT | O_APPEND);
+	if (fd < 0) {
+		free (trash);
+		return -1;
+	}
+	if (rename (path, trash) != 0) {
+		(void) close (fd);
+		free (trash);
+		return -1;
+	}
+	if (write (fd, line, len) != len) {
+		(void) rename (trash, path);
+		(void) close (fd);
+		free (trash);
+		return -1;
+	}
+	(void) close (fd);
+
+	SYSLOG ((LOG_INFO, "removal of %s (user %s) deferred as %s",
+	         path, user, trash));
+	free (trash);
+	return 0;
+}
+
+/*
+ * remove_path - remove a file or a directory tree
+ */
+static int remove_path (const char *path)
+{
+	struct stat sb;
+
+	if (lstat (path, &sb) != 0) {
+		/* Already removed */
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	if (S_ISDIR (sb.st_mode)) {
+		return remove_tree (path, true);
+	}
+	return unlink (path);
+}
+
+/*
+ * drain - remove the entries taken from the queue
+ *
+ *	The entries which could not be removed are queued again.
+ *
+ *	Return 0 if all the entries were removed, -1 otherwise.
+ */
+static int drain (const char *queue, char *entries, size_t size)
+{
+	char *line = entries;
+	char *failed = entries;	/* the failed lines are moved here */
+	int rc = 0;
+	int fd;
+
+	while (line < entries + size) {
+		char *end = memchr (line, '\n', entries + size - line);
+		char *path;
+		size_t len;
+
+		if (NULL == end) {
+			end = entries + size;
+		}
+		len = end - line;
+		*end = '\0';
+
+		/* Skip the time and the user */
+		path = strchr (line, ' ');
+		if (NULL != path) {
+			path = strchr (path + 1, ' ');
+		}
+		if ((NULL != path) && ('\0' != path[1])) {
+			path++;
+			if (remove_path (path) == 0) {
+				SYSLOG ((LOG_INFO, "removed %s", path));
+			} else {
+				SYSLOG ((LOG_ERR, "failed to remove %s", path));
+				(void) memmove (failed, line, len);
+				failed[len] = '\n';
+				failed += len + 1;
+				rc = -1;
+			}
+		}
+		line = end + 1;
+	}
+
+	if (failed != entries) {
+		fd = queue_open (queue, O_WRONLY | O_CREAT | O_APPEND);
+		if (fd < 0) {
+			return -1;
+		}
+		if (write (fd, entries, failed - entries) != failed - entries) {
+			rc = -1;
+		}
+		(void) close (fd);
+	}
+	return rc;
+}
+
+/*
+ * removal_queue_drain - remove the files and directories of the queue
+ *
+ *	The entries are taken out of the queue before they are removed, so
+ *	that several tools can drain the queue at the same time, and that
+ *	the queue remains available while the trees are removed.
+ *
+ *	If async is set, the entries are removed by a detached process, and
+ *	the caller does not wait for it.
+ *
+ *	Return 0 if all the entries were removed (or if their removal was
+ *	started), -1 otherwise.
+ */
+int removal_queue_drain (const char *queue, bool async)
+{
+	struct stat sb;
+	char *entries;
+	ssize_t size;
+	pid_t pid;
+	int rc;
+	int fd;
+
+	fd = queue_open (queue, O_RDWR);
+	if (fd < 0) {
+		return (ENOENT == errno) ? 0 : -1;
+	}
+	if (fstat (fd, &sb) != 0) {
+		(void) close (fd);
+		return -1;
+	}
+	if (0 == sb.st_size) {
+		(void) close (fd);
+		return 0;
+	}
+	entries = malloc (sb.st_size);
+	if (NULL == entries) {
+		(void) close (fd);
+		return -1;
+	}
+	size = pread (fd, entries, sb.st_size, 0);
+	if ((size != sb.st_size) || (ftruncate (fd, 0) != 0)) {
+		(void) close (fd);
+		free (entries);
+		return -1;
+	}
+	(void) close (fd);
+
+	if (async) {
+		pid = fork_detached ();
+		if (0 == pid) {
+			(void) drain (queue, entries, size);
+			_exit (0);
+		}
+		if (pid > 0) {
+			free (entries);
+			return 0;
+		}
+		/* Could not fork, remove the entries now */
+	}
+
+	rc = drain (queue, entries, size);
+	free (entries);
+	return rc;
 }
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include "prototypes.h"
 #include "defines.h"
 #include "getdef.h"
@@ -85,12 +86,15 @@
 /* Maximum size of the generated salt string. */
 #define GENSALT_SETTING_SIZE 100
 
+/* Random bytes given to crypt_gensalt(). */
+#define GENSALT_RBYTES 16
+
 /* local function prototypes */
 #if !USE_XCRYPT_GENSALT
 static /*@observer@*/const char *gensalt (size_t salt_size);
 #endif /* !USE_XCRYPT_GENSALT */
 #ifdef USE_SHA_CRYPT
-static /*@observer@*/unsigned long SHA_get_salt_rounds (/*@null@*/const int *prefered_rounds);
+static /*@observer@*/unsigned long SHA_get_salt_rounds (const char *method, /*@null@*/const int *prefered_rounds);
 static /*@observer@*/void SHA_salt_rounds_to_buf (char *buf, unsigned long rounds);
 #endif /* USE_SHA_CRYPT */
 #ifdef USE_BCRYPT
@@ -101,15 +105,47 @@ static /*@observer@*/void BCRYPT_salt_rounds_to_buf (char *buf, unsigned long ro
 static /*@observer@*/unsigned long YESCRYPT_get_salt_cost (/*@null@*/const int *prefered_cost);
 static /*@observer@*/void YESCRYPT_salt_cost_to_buf (char *buf, unsigned long cost);
 #endif /* USE_YESCRYPT */
+#if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
+static bool cost_is_auto (const char *item);
+static unsigned long auto_cost (const char *method, unsigned long def);
+#endif /* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
+
+#if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
+/*
+ * Return true if the cost variable item of login.defs is set to "auto",
+ * i.e. to the cost calibrated by cryptcost.
+ */
+static bool cost_is_auto (const char *item)
+{
+	const char *value = getdef_str (item);
+
+	return (NULL != value) && (strcasecmp (value, "auto") == 0);
+}
+
+/*
+ * Return the cost calibrated for method, or def if it was not
+ * calibrated.
+ */
+static unsigned long auto_cost (const char *method, unsigned long def)
+{
+	long cost = crypt_cost_cached (method);
+
+	return (-1 == cost) ? def : (unsigned long) cost;
+}
+#endif /* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
 
 
 #ifdef USE_SHA_CRYPT
 /* Return the the rounds number for the SHA crypt methods. */
-static /*@observer@*/unsigned long SHA_get_salt_rounds (/*@null@*/const int *prefered_rounds)
+static /*@observer@*/unsigned long SHA_get_salt_rounds (const char *method, /*@null@*/const int *prefered_rounds)
 {
 	unsigned long rounds;
 
-	if (NULL == prefered_rounds) {
+	if (   (NULL == prefered_rounds)
+	    && (   cost_is_auto ("SHA_CRYPT_MIN_ROUNDS")
+	        || cost_is_auto ("SHA_CRYPT_MAX_ROUNDS"))) {
+		rounds = auto_cost (method, SHA_ROUNDS_DEFAULT);
+	} else if (NULL == prefered_rounds) {
 		long min_rounds = getdef_long ("SHA_CRYPT_MIN_ROUNDS", -1);
 		long max_rounds = getdef_long ("SHA_CRYPT_MAX_ROUNDS", -1);
 
@@ -183,7 +219,11 @@ static /*@observer@*/unsigned long BCRYPT_get_salt_rounds (/*@null@*/const int *
 {
 	unsigned long rounds;
 
-	if (NULL == prefered_rounds) {
+	if (   (NULL == prefered_rounds)
+	    && (   cost_is_auto ("BCRYPT_MIN_ROUNDS")
+	        || cost_is_auto ("BCRYPT_MAX_ROUNDS"))) {
+		rounds = auto_cost ("BCRYPT", B_ROUNDS_DEFAULT);
+	} else if (NULL == prefered_rounds) {
 		long min_rounds = getdef_long ("BCRYPT_MIN_ROUNDS", -1);
 		long max_rounds = getdef_long ("BCRYPT_MAX_ROUNDS", -1);
 
@@ -262,7 +302,10 @@ static /*@observer@*/unsigned long YESCRYPT_get_salt_cost (/*@null@*/const int *
 {
 	unsigned long cost;
 
-	if (NULL == prefered_cost) {
+	if (   (NULL == prefered_cost)
+	    && cost_is_auto ("YESCRYPT_COST_FACTOR")) {
+		cost = auto_cost ("YESCRYPT", Y_COST_DEFAULT);
+	} else if (NULL == prefered_cost) {
 		cost = getdef_num ("YESCRYPT_COST_FACTOR", Y_COST_DEFAULT);
 	} else if (0 == *prefered_cost) {
 		cost = Y_COST_DEFAULT;
@@ -317,18 +360,22 @@ static /*@observer@*/void YESCRYPT_salt_cost_to_buf (char *buf, unsigned long co
 #if !USE_XCRYPT_GENSALT
 static /*@observer@*/const char *gensalt (size_t salt_size)
 {
-	static char salt[MAX_SALT_SIZE + 6];
-
-	memset (salt, '\0', MAX_SALT_SIZE + 6);
+	static const char itoa64[] =
+		"./0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+	static char salt[MAX_SALT_SIZE + 1];
+	unsigned char rbytes[MAX_SALT_SIZE];
+	size_t i;
 
 	assert (salt_size >= MIN_SALT_SIZE &&
 	        salt_size <= MAX_SALT_SIZE);
-	strcat (salt, l64a (csrand ()));
-	do {
-		strcat (salt, l64a (csrand ()));
-	} while (strlen (salt) < salt_size);
 
+	/* One random byte per character, 6 bits of each are used */
+	csrand_bytes (rbytes, salt_size);
+	for (i = 0; i < salt_size; i++) {
+		salt[i] = itoa64[rbytes[i] & 0x3f];
+	}
 	salt[salt_size] = '\0';
+	memzero (rbytes, sizeof rbytes);
 
 	return salt;
 }
@@ -391,12 +438,12 @@ static /*@observer@*/const char *gensalt (size_t salt_size)
 	} else if (0 == strcmp (method, "SHA256")) {
 		MAGNUM(result, '5');
 		salt_len = SHA_CRYPT_SALT_SIZE;
-		rounds = SHA_get_salt_rounds (arg);
+		rounds = SHA_get_salt_rounds (method, arg);
 		SHA_salt_rounds_to_buf (result, rounds);
 	} else if (0 == strcmp (method, "SHA512")) {
 		MAGNUM(result, '6');
 		salt_len = SHA_CRYPT_SALT_SIZE;
-		rounds = SHA_get_salt_rounds (arg);
+		rounds = SHA_get_salt_rounds (method, arg);
 		SHA_salt_rounds_to_buf (result, rounds);
 #endif /* USE_SHA_CRYPT */
 	} else if (0 != strcmp (method, "DES")) {
@@ -422,7 +469,15 @@ static /*@observer@*/const char *gensalt (size_t salt_size)
 		result[salt_len] = '\0';
 	}
 
-	char *retval = crypt_gensalt (result, rounds, NULL, 0);
+	/*
+	 * Hand the random bytes to crypt_gensalt() from the csrand pool
+	 * rather than letting it read them from the kernel for every salt.
+	 * GENSALT_RBYTES is the amount it would read itself.
+	 */
+	char rbytes[GENSALT_RBYTES];
+	csrand_bytes (rbytes, sizeof rbytes);
+	char *retval = crypt_gensalt (result, rounds, rbytes, sizeof rbytes);
+	memzero (rbytes, sizeof rbytes);
 
 	/* Should not happen, but... */
 	if (NULL == retval) {
@@ -0,0 +1,149 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <fnmatch.h>
+#include <grp.h>
+#include <pwd.h>
+#include <stdio.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+/*
+ * Selection of the users of the account tools (--select-uid,
+ * --select-group, --select-shell and --select-age).
+ *
+ * A selection is a set of predicates on the entries of passwd and
+ * shadow, which the tools evaluate on the loaded databases to apply the
+ * same change to all the selected users in a single pass. A user is
+ * selected if it matches all the predicates which were set.
+ */
+
+/*
+ * select_uids - Select the users whose UID is in a range
+ *
+ *	range is a user name, a UID, or a range of UIDs as for lastlog -u
+ *	(-MAX, MIN-, MIN-MAX).
+ *
+ *	Return false if range is not valid.
+ */
+bool select_uids (struct user_selection *sel, const char *range)
+{
+	const struct passwd *pw;
+
+	/* local, no need for xgetpwnam */
+	pw = getpwnam (range);
+	if (NULL != pw) {
+		sel->uid_min = pw->pw_uid;
+		sel->has_uid_min = true;
+		sel->uid_max = pw->pw_uid;
+		sel->has_uid_max = true;
+	} else if (getrange (range,
+	                     &sel->uid_min, &sel->has_uid_min,
+	                     &sel->uid_max, &sel->has_uid_max) == 0) {
+		return false;
+	}
+	sel->active = true;
+	return true;
+}
+
+/*
+ * select_group - Select the members of a group
+ *
+ *	The members are the users whose primary group is group, and the
+ *	users listed in its members.
+ *
+ *	Return false if group does not exist.
+ */
+bool select_group (struct user_selection *sel, const char *group)
+{
+	const struct group *gr;
+	size_t n;
+
+	/* local, no need for xgetgrnam */
+	gr = getgrnam (group);
+	if (NULL == gr) {
+		return false;
+	}
+	sel->gid = gr->gr_gid;
+	for (n = 0; NULL != gr->gr_mem[n]; n++);
+	sel->members = xmalloc ((n + 1) * sizeof *sel->members);
+	for (n = 0; NULL != gr->gr_mem[n]; n++) {
+		sel->members[n] = xstrdup (gr->gr_mem[n]);
+	}
+	sel->members[n] = NULL;
+	sel->has_group = true;
+	sel->active = true;
+	return true;
+}
+
+/*
+ * select_shell - Select the users whose shell matches a pattern
+ *
+ *	pattern is a shell wildcard pattern, as for fnmatch(3).
+ */
+void select_shell (struct user_selection *sel, const char *pattern)
+{
+	sel->shell = pattern;
+	sel->active = true;
+}
+
+/*
+ * select_age - Select the users whose password was changed at least days
+ *              ago
+ *
+ *	Return false if days is not a valid number of days.
+ */
+bool select_age (struct user_selection *sel, const char *days)
+{
+	if ((getlong (days, &sel->age) == 0) || (sel->age < 0)) {
+		return false;
+	}
+	sel->has_age = true;
+	sel->active = true;
+	return true;
+}
+
+/*
+ * select_user - Check if a user is selected
+ *
+ *	sp is the shadow entry of the user, or NULL if it has none. A user
+ *	without a shadow entry is never selected by --select-age.
+ */
+bool select_user (const struct user_selection *sel,
+                  const struct passwd *pw, /*@null@*/const struct spwd *sp)
+{
+	if (   (sel->has_uid_min && (pw->pw_uid < sel->uid_min))
+	    || (sel->has_uid_max && (pw->pw_uid > sel->uid_max))) {
+		return false;
+	}
+
+	if (   sel->has_group
+	    && (pw->pw_gid != sel->gid)
+	    && !is_on_list (sel->members, pw->pw_name)) {
+		return false;
+	}
+
+	if (   (NULL != sel->shell)
+	    && (fnmatch (sel->shell, pw->pw_shell, 0) != 0)) {
+		return false;
+	}
+
+	if (sel->has_age) {
+		long today = (long) (gettime () / SCALE);
+
+		if (   (NULL == sp)
+		    || (sp->sp_lstchg < 0)
+		    || (today - sp->sp_lstchg < sel->age)) {
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -18,7 +18,11 @@
 #include <assert.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 #include <ctype.h>
 #include "prototypes.h"
 #include "defines.h"
@@ -42,46 +46,39 @@ addenv_path (const char *varname, const char *dirname, const char *filename)
 	free (buf);
 }
 
-static void read_env_file (const char *filename)
+/*
+ * read_env_line - Add the variable defined by a line of the environment
+ *                 file
+ *
+ *	The line is modified.
+ */
+static void read_env_line (char *buf)
 {
-	FILE *fp;
-	char buf[1024];
 	char *cp, *name, *val;
 
-	fp = fopen (filename, "r");
-	if (NULL == fp) {
+	cp = buf;
+	/* ignore whitespace and comments */
+	while (('\0' != *cp) && isspace (*cp)) {
+		cp++;
+	}
+	if (('\0' == *cp) || ('#' == *cp)) {
 		return;
 	}
-	while (fgets (buf, (int)(sizeof buf), fp) == buf) {
-		cp = strrchr (buf, '\n');
-		if (NULL == cp) {
-			break;
-		}
-		*cp = '\0';
-
-		cp = buf;
-		/* ignore whitespace and comments */
-		while (('\0' != *cp) && isspace (*cp)) {
-			cp++;
-		}
-		if (('\0' == *cp) || ('#' == *cp)) {
-			continue;
-		}
-		/*
-		 * ignore lines which don't follow the name=value format
-		 * (for example, the "export NAME" shell commands)
-		 */
-		name = cp;
-		while (('\0' != *cp) && !isspace (*cp) && ('=' != *cp)) {
-			cp++;
-		}
-		if ('=' != *cp) {
-			continue;
-		}
-		/* NUL-terminate the name */
-		*cp = '\0';
+	/*
+	 * ignore lines which don't follow the name=value format
+	 * (for example, the "export NAME" shell commands)
+	 */
+	name = cp;
+	while (('\0' != *cp) && !isspace (*cp) && ('=' != *cp)) {
 		cp++;
-		val = cp;
+	}
+	if ('=' != *cp) {
+		return;
+	}
+	/* NUL-terminate the name */
+	*cp = '\0';
+	cp++;
+	val = cp;
 #if 0				/* XXX untested, and needs rewrite with fewer goto's :-) */
 /*
  (state, char_type) -> (state, action)
@@ -90,79 +87,138 @@ static void read_env_file (const char *filename)
  char_type: normal, white, backslash, single, double
  action: remove_curr, remove_curr_skip_next, remove_prev, finish XXX
 */
-	      no_quote:
-		if (*cp == '\\') {
-			/* remove the backslash */
-			remove_char (cp);
-			/* skip over the next character */
-			if (*cp)
-				cp++;
-			goto no_quote;
-		} else if (*cp == '\'') {
-			/* remove the quote */
-			remove_char (cp);
-			/* now within single quotes */
-			goto s_quote;
-		} else if (*cp == '"') {
-			/* remove the quote */
-			remove_char (cp);
-			/* now within double quotes */
-			goto d_quote;
-		} else if (*cp == '\0') {
-			/* end of string */
-			goto finished;
-		} else if (isspace (*cp)) {
-			/* unescaped whitespace - end of string */
-			*cp = '\0';
-			goto finished;
-		} else {
-			cp++;
-			goto no_quote;
-		}
-	      s_quote:
-		if (*cp == '\'') {
-			/* remove the quote */
-			remove_char (cp);
-			/* unquoted again */
-			goto no_quote;
-		} else if (*cp == '\0') {
-			/* end of string */
-			goto finished;
-		} else {
-			/* preserve everything within single quotes */
+      no_quote:
+	if (*cp == '\\') {
+		/* remove the backslash */
+		remove_char (cp);
+		/* skip over the next character */
+		if (*cp)
 			cp++;
-			goto s_quote;
-		}
-	      d_quote:
-		if (*cp == '\"') {
-			/* remove the quote */
-			remove_char (cp);
-			/* unquoted again */
-			goto no_quote;
-		} else if (*cp == '\\') {
+		goto no_quote;
+	} else if (*cp == '\'') {
+		/* remove the quote */
+		remove_char (cp);
+		/* now within single quotes */
+		goto s_quote;
+	} else if (*cp == '"') {
+		/* remove the quote */
+		remove_char (cp);
+		/* now within double quotes */
+		goto d_quote;
+	} else if (*cp == '\0') {
+		/* end of string */
+		goto finished;
+	} else if (isspace (*cp)) {
+		/* unescaped whitespace - end of string */
+		*cp = '\0';
+		goto finished;
+	} else {
+		cp++;
+		goto no_quote;
+	}
+      s_quote:
+	if (*cp == '\'') {
+		/* remove the quote */
+		remove_char (cp);
+		/* unquoted again */
+		goto no_quote;
+	} else if (*cp == '\0') {
+		/* end of string */
+		goto finished;
+	} else {
+		/* preserve everything within single quotes */
+		cp++;
+		goto s_quote;
+	}
+      d_quote:
+	if (*cp == '\"') {
+		/* remove the quote */
+		remove_char (cp);
+		/* unquoted again */
+		goto no_quote;
+	} else if (*cp == '\\') {
+		cp++;
+		/* if backslash followed by double quote, remove backslash
+		   else skip over the backslash and following char */
+		if (*cp == '"')
+			remove_char (cp - 1);
+		else if (*cp)
 			cp++;
-			/* if backslash followed by double quote, remove backslash
-			   else skip over the backslash and following char */
-			if (*cp == '"')
-				remove_char (cp - 1);
-			else if (*cp)
-				cp++;
-			goto d_quote;
+		goto d_quote;
+	}
+	else if (*cp == '\0') {
+		/* end of string */
+		goto finished;
+	} else {
+		/* preserve everything within double quotes */
+		goto d_quote;
+	}
+      finished:
+#endif				/* 0 */
+	/*
+	 * XXX - should handle quotes, backslash escapes, etc.
+	 * like the shell does.
+	 */
+	addenv (name, val);
+}
+
+static void read_env_file (const char *filename)
+{
+	char buf[1024];
+	struct stat sb;
+	const char *map;
+	const char *line;
+	const char *end;
+	const char *nl;
+	size_t len;
+	FILE *fp;
+	int fd;
+
+	fd = open (filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return;
+	}
+
+	/*
+	 * Map regular files, instead of reading them line by line.
+	 * As with fgets(), the file is only processed up to the first line
+	 * without a newline or too long for buf.
+	 */
+	if (   (fstat (fd, &sb) == 0)
+	    && S_ISREG (sb.st_mode)
+	    && (sb.st_size > 0)) {
+		len = (size_t) sb.st_size;
+		map = mmap (NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (MAP_FAILED != map) {
+			(void) close (fd);
+			end = map + len;
+			for (line = map; line < end; line = nl + 1) {
+				nl = memchr (line, '\n', (size_t) (end - line));
+				if (   (NULL == nl)
+				    || ((size_t) (nl - line) > sizeof buf - 2)) {
+					break;
+				}
+				memcpy (buf, line, (size_t) (nl - line));
+				buf[nl - line] = '\0';
+				read_env_line (buf);
+			}
+			(void) munmap ((void *) map, len);
+			return;
 		}
-		else if (*cp == '\0') {
-			/* end of string */
-			goto finished;
-		} else {
-			/* preserve everything within double quotes */
-			goto d_quote;
+	}
+
+	fp = fdopen (fd, "r");
+	if (NULL == fp) {
+		(void) close (fd);
+		return;
+	}
+	while (fgets (buf, (int)(sizeof buf), fp) == buf) {
+		char *cp = strrchr (buf, '\n');
+		if (NULL == cp) {
+			break;
 		}
-	      finished:
-#endif				/* 0 */
-		/*
-		 * XXX - should handle quotes, backslash escapes, etc.
-		 * like the shell does.
-		 */
-		addenv (name, val);
+		*cp = '\0';
+		read_env_line (buf);
 	}
 	(void) fclose (fp);
 }
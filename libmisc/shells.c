@@ -0,0 +1,242 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+
+#ifdef HAVE_VENDORDIR
+#include <libeconf.h>
+#define SHELLS "shells"
+#define ETCDIR "/etc"
+#endif
+
+#ifndef SHELLS_FILE
+#define SHELLS_FILE "/etc/shells"
+#endif
+
+/*
+ * The list of the valid login shells is read once, and kept sorted for
+ * the lookups. It is read again when one of the files it comes from
+ * changes, so that a long --batch run sees the edits of /etc/shells.
+ */
+
+static const char *const shells_files[] = {
+#ifdef HAVE_VENDORDIR
+	VENDORDIR "/" SHELLS,
+	VENDORDIR "/" SHELLS ".d",
+	ETCDIR "/" SHELLS,
+	ETCDIR "/" SHELLS ".d",
+#else
+	SHELLS_FILE,
+#endif
+};
+
+#define NFILES	(sizeof shells_files / sizeof shells_files[0])
+
+struct file_stamp {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+};
+
+static bool loaded = false;
+static struct file_stamp stamps[NFILES];
+static char **shells = NULL;
+static size_t nshells = 0;
+
+static void get_stamps (struct file_stamp *list)
+{
+	struct stat sb;
+	size_t i;
+
+	for (i = 0; i < NFILES; i++) {
+		if (stat (shells_files[i], &sb) != 0) {
+			memzero (&sb, sizeof sb);
+		}
+		list[i].dev = sb.st_dev;
+		list[i].ino = sb.st_ino;
+		list[i].size = sb.st_size;
+		list[i].mtime = sb.st_mtim;
+	}
+}
+
+static bool same_stamps (const struct file_stamp *a,
+                         const struct file_stamp *b)
+{
+	size_t i;
+
+	for (i = 0; i < NFILES; i++) {
+		if (   (a[i].dev != b[i].dev)
+		    || (a[i].ino != b[i].ino)
+		    || (a[i].size != b[i].size)
+		    || (a[i].mtime.tv_sec != b[i].mtime.tv_sec)
+		    || (a[i].mtime.tv_nsec != b[i].mtime.tv_nsec)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void free_shells (void)
+{
+	size_t i;
+
+	for (i = 0; i < nshells; i++) {
+		free (shells[i]);
+	}
+	free (shells);
+	shells = NULL;
+	nshells = 0;
+}
+
+static void add_shell (const char *sh)
+{
+	char **list;
+
+	if (0 == (nshells % 64)) {
+		list = realloc (shells, (nshells + 64) * sizeof *list);
+		if (NULL == list) {
+			fprintf (log_get_logfd (), _("%s: out of memory\n"),
+			         log_get_progname ());
+			exit (EXIT_FAILURE);
+		}
+		shells = list;
+	}
+	shells[nshells] = xstrdup (sh);
+	nshells++;
+}
+
+static int cmp_shell (const void *a, const void *b)
+{
+	return strcmp (*(char *const *) a, *(char *const *) b);
+}
+
+#ifdef HAVE_VENDORDIR
+static int read_shells (void)
+{
+	size_t size = 0;
+	econf_err error;
+	char **keys;
+	econf_file *key_file;
+	size_t i;
+
+	error = econf_readDirs(&key_file,
+			       VENDORDIR,
+			       ETCDIR,
+			       SHELLS,
+			       NULL,
+			       "", /* key only */
+			       "#" /* comment */);
+	if (error) {
+		fprintf (log_get_logfd (),
+			 _("Cannot parse shell files: %s"),
+			 econf_errString(error));
+		return -1;
+	}
+
+	error = econf_getKeys(key_file, NULL, &size, &keys);
+	if (error) {
+		fprintf (log_get_logfd (),
+			 _("Cannot evaluate entries in shell files: %s"),
+			 econf_errString(error));
+		econf_free (key_file);
+		return -1;
+	}
+
+	for (i = 0; i < size; i++) {
+		add_shell (keys[i]);
+	}
+	econf_freeArray (keys);
+	econf_free (key_file);
+	return 0;
+}
+
+#else /* without HAVE_VENDORDIR */
+
+/*
+ * If getusershell() is available (Linux, *BSD, possibly others), use it
+ * instead of re-implementing it.
+ */
+static int read_shells (void)
+{
+#ifdef HAVE_GETUSERSHELL
+	const char *cp;
+
+	setusershell ();
+	while ((cp = getusershell ()) != NULL) {
+		if ('#' != *cp) {
+			add_shell (cp);
+		}
+	}
+	endusershell ();
+#else
+	char buf[BUFSIZ];
+	char *cp;
+	FILE *fp;
+
+	fp = fopen (SHELLS_FILE, "r");
+	if (NULL == fp) {
+		return 0;
+	}
+
+	while (fgets (buf, sizeof (buf), fp) == buf) {
+		cp = strrchr (buf, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		}
+
+		if (buf[0] == '#') {
+			continue;
+		}
+
+		add_shell (buf);
+	}
+	fclose (fp);
+#endif
+	return 0;
+}
+#endif /* with HAVE_VENDORDIR */
+
+/*
+ * shell_is_listed - see if a login shell is listed in /etc/shells
+ *
+ *	If /etc/shells does not exist, no shell is listed, unless
+ *	getusershell() is used: it then lists its default shells.
+ *
+ *	Return 1 if sh is listed, 0 if it is not, and -1 if the list
+ *	cannot be read (an error is reported).
+ */
+int shell_is_listed (const char *sh)
+{
+	struct file_stamp current[NFILES];
+
+	get_stamps (current);
+	if (!loaded || !same_stamps (current, stamps)) {
+		free_shells ();
+		loaded = false;
+		if (read_shells () != 0) {
+			free_shells ();
+			return -1;
+		}
+		if (0 != nshells) {
+			qsort (shells, nshells, sizeof *shells, cmp_shell);
+		}
+		memcpy (stamps, current, sizeof stamps);
+		loaded = true;
+	}
+
+	return (   (0 != nshells)
+	        && (bsearch (&sh, shells, nshells, sizeof *shells,
+	                     cmp_shell) != NULL)) ? 1 : 0;
+}
@@ -13,11 +13,13 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/types.h>
 #include <dirent.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include "defines.h"
+#include "getdef.h"
 #include "prototypes.h"
 #ifdef ENABLE_SUBIDS
 #include "subordinateio.h"
@@ -25,7 +27,9 @@
 #include "shadowlog.h"
 
 #ifdef __linux__
-static int check_status (const char *name, const char *sname, uid_t uid);
+static int check_status (int proc_fd, const char *sname, uid_t uid);
+static bool same_root (int proc_fd, const char *sname,
+                       const struct stat *sbroot);
 static int user_busy_processes (const char *name, uid_t uid);
 #else				/* !__linux__ */
 static int user_busy_utmp (const char *name);
@@ -52,34 +56,92 @@ int user_busy (const char *name, uid_t uid)
 #ifndef __linux__
 static int user_busy_utmp (const char *name)
 {
-	struct utmp *utent;
-
-	setutent ();
-	while ((utent = getutent ()) != NULL)
-	{
-		if (utent->ut_type != USER_PROCESS) {
-			continue;
-		}
-		if (strncmp (utent->ut_user, name, sizeof utent->ut_user) != 0) {
-			continue;
-		}
-		if (kill (utent->ut_pid, 0) != 0) {
-			continue;
-		}
-
-		fprintf (log_get_logfd(),
-		         _("%s: user %s is currently logged in\n"),
-		         log_get_progname(), name);
-		return 1;
+	if (count_sessions (name, 0, true) == 0) {
+		return 0;
 	}
 
-	return 0;
+	fprintf (log_get_logfd(),
+	         _("%s: user %s is currently logged in\n"),
+	         log_get_progname(), name);
+	return 1;
 }
 #endif				/* !__linux__ */
 
 #ifdef __linux__
 #ifdef ENABLE_SUBIDS
-#define in_parentuid_range(uid) ((uid) >= parentuid && (uid) < parentuid + range)
+/*
+ * The subordinate UIDs of the user, sorted and merged, so that the UIDs of
+ * each process are searched in them instead of in the subuid database.
+ */
+static struct subid_range *busy_ranges = NULL;
+static size_t busy_nranges = 0;
+
+static int cmp_start (const void *p1, const void *p2)
+{
+	const struct subid_range *r1 = p1, *r2 = p2;
+
+	return (r1->start < r2->start) ? -1 : (r1->start > r2->start);
+}
+
+/*
+ * load_busy_ranges - load the subordinate UIDs of name
+ */
+static void load_busy_ranges (const char *name)
+{
+	struct subid_range *ranges = NULL;
+	size_t i, n = 0;
+	int count;
+
+	count = list_owner_ranges (name, ID_TYPE_UID, &ranges);
+	if (count <= 0) {
+		free (ranges);
+		return;
+	}
+	qsort (ranges, count, sizeof *ranges, cmp_start);
+	for (i = 1; i < (size_t) count; i++) {
+		unsigned long end = ranges[n].start + ranges[n].count;
+
+		if (ranges[i].start <= end) {
+			if (ranges[i].start + ranges[i].count > end) {
+				ranges[n].count = ranges[i].start + ranges[i].count
+				                  - ranges[n].start;
+			}
+		} else {
+			ranges[++n] = ranges[i];
+		}
+	}
+	busy_ranges = ranges;
+	busy_nranges = n + 1;
+}
+
+static void free_busy_ranges (void)
+{
+	free (busy_ranges);
+	busy_ranges = NULL;
+	busy_nranges = 0;
+}
+
+/*
+ * in_busy_ranges - check if id is a subordinate UID of the user
+ */
+static bool in_busy_ranges (unsigned long id)
+{
+	size_t lo = 0, hi = busy_nranges;
+
+	/* Find the last range which starts at or before id */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (busy_ranges[mid].start <= id) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return    (lo > 0)
+	       && (id - busy_ranges[lo - 1].start < busy_ranges[lo - 1].count);
+}
+
 static int different_namespace (const char *sname)
 {
 	/* 41: /proc/xxxxxxxxxx/task/xxxxxxxxxx/ns/user + \0 */
@@ -103,87 +165,130 @@ static int different_namespace (const char *sname)
 #endif                          /* ENABLE_SUBIDS */
 
 
-static int check_status (const char *name, const char *sname, uid_t uid)
+/*
+ * check_status - check if the process or thread sname (relative to /proc)
+ *                runs with uid, or with a subordinate UID of the user
+ *
+ *	The status file is read with a single read: the Uid line is at its
+ *	beginning.
+ */
+static int check_status (int proc_fd, const char *sname, uid_t uid)
 {
-	/* 40: /proc/xxxxxxxxxx/task/xxxxxxxxxx/status + \0 */
+	/* 40: xxxxxxxxxx/task/xxxxxxxxxx/status + \0 */
 	char status[40];
-	char line[1024];
-	FILE *sfile;
+	char buf[4096];
+	const char *line;
+	unsigned long ruid, euid, suid;
+	ssize_t len;
+	int fd;
 
-	snprintf (status, 40, "/proc/%s/status", sname);
+	snprintf (status, 40, "%s/status", sname);
 
-	sfile = fopen (status, "r");
-	if (NULL == sfile) {
+	fd = openat (proc_fd, status, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
 		return 0;
 	}
-	while (fgets (line, sizeof (line), sfile) == line) {
-		if (strncmp (line, "Uid:\t", 5) == 0) {
-			unsigned long ruid, euid, suid;
-
-			assert (uid == (unsigned long) uid);
-			(void) fclose (sfile);
-			if (sscanf (line,
-			            "Uid:\t%lu\t%lu\t%lu\n",
-			            &ruid, &euid, &suid) == 3) {
-				if (   (ruid == (unsigned long) uid)
-				    || (euid == (unsigned long) uid)
-				    || (suid == (unsigned long) uid) ) {
-					return 1;
-				}
+	len = read (fd, buf, sizeof (buf) - 1);
+	(void) close (fd);
+	if (len <= 0) {
+		return 0;
+	}
+	buf[len] = '\0';
+
+	line = strstr (buf, "\nUid:\t");
+	if (NULL == line) {
+		return 0;
+	}
+	assert (uid == (unsigned long) uid);
+	if (sscanf (line + 1,
+	            "Uid:\t%lu\t%lu\t%lu\n",
+	            &ruid, &euid, &suid) != 3) {
+		/* Ignore errors. This is just a best effort. */
+		return 0;
+	}
+	if (   (ruid == (unsigned long) uid)
+	    || (euid == (unsigned long) uid)
+	    || (suid == (unsigned long) uid) ) {
+		return 1;
+	}
 #ifdef ENABLE_SUBIDS
-				if (    different_namespace (sname)
-				     && (   have_sub_uids(name, ruid, 1)
-				         || have_sub_uids(name, euid, 1)
-				         || have_sub_uids(name, suid, 1))
-				   ) {
-					return 1;
-				}
-#endif				/* ENABLE_SUBIDS */
-			} else {
-				/* Ignore errors. This is just a best effort. */
-			}
-			return 0;
-		}
+	if (    (0 != busy_nranges)
+	     && (   in_busy_ranges (ruid)
+	         || in_busy_ranges (euid)
+	         || in_busy_ranges (suid))
+	     && different_namespace (sname)) {
+		return 1;
 	}
-	(void) fclose (sfile);
+#endif				/* ENABLE_SUBIDS */
 	return 0;
 }
 
+/*
+ * same_root - check if the process sname (relative to /proc) is in our
+ *             chroot
+ */
+static bool same_root (int proc_fd, const char *sname,
+                       const struct stat *sbroot)
+{
+	/* 16: xxxxxxxxxx/root + \0 */
+	char root_path[16];
+	struct stat sbroot_process;
+
+	snprintf (root_path, 16, "%s/root", sname);
+	if (fstatat (proc_fd, root_path, &sbroot_process, 0) != 0) {
+		return false;
+	}
+	return (   (sbroot->st_dev == sbroot_process.st_dev)
+	        && (sbroot->st_ino == sbroot_process.st_ino));
+}
+
+/*
+ * user_busy_processes - check if a process runs with the UID of the user
+ *
+ *	The UIDs of the threads of a process are normally the UIDs of the
+ *	process: they are only checked if USER_BUSY_THREADS is set.
+ *	The root of a process is only checked for the processes which run
+ *	with the UID of the user.
+ */
 static int user_busy_processes (const char *name, uid_t uid)
 {
 	DIR *proc;
 	struct dirent *ent;
 	char *tmp_d_name;
 	pid_t pid;
-	DIR *task_dir;
-	/* 22: /proc/xxxxxxxxxx/task + \0 */
-	char task_path[22];
-	char root_path[22];
+	int proc_fd;
+	bool check_threads;
 	struct stat sbroot;
-	struct stat sbroot_process;
+
+	check_threads = getdef_bool ("USER_BUSY_THREADS");
 
 #ifdef ENABLE_SUBIDS
-	sub_uid_open (O_RDONLY);
+	load_busy_ranges (name);
 #endif				/* ENABLE_SUBIDS */
 
 	proc = opendir ("/proc");
 	if (proc == NULL) {
 		perror ("opendir /proc");
 #ifdef ENABLE_SUBIDS
-		sub_uid_close();
+		free_busy_ranges ();
 #endif
 		return 0;
 	}
+	proc_fd = dirfd (proc);
 	if (stat ("/", &sbroot) != 0) {
 		perror ("stat (\"/\")");
 		(void) closedir (proc);
 #ifdef ENABLE_SUBIDS
-		sub_uid_close();
+		free_busy_ranges ();
 #endif
 		return 0;
 	}
 
 	while ((ent = readdir (proc)) != NULL) {
+		/* 11: xxxxxxxxxx + \0 */
+		char pid_name[11];
+		bool busy;
+
 		tmp_d_name = ent->d_name;
 		/*
 		 * Ingo Molnar's patch introducing NPTL for 2.4 hides
@@ -203,62 +308,62 @@ static int user_busy_processes (const char *name, uid_t uid)
 		if (get_pid (tmp_d_name, &pid) == 0) {
 			continue;
 		}
+		snprintf (pid_name, 11, "%lu", (unsigned long) pid);
 
-		/* Check if the process is in our chroot */
-		snprintf (root_path, 22, "/proc/%lu/root", (unsigned long) pid);
-		root_path[21] = '\0';
-		if (stat (root_path, &sbroot_process) != 0) {
-			continue;
-		}
-		if (   (sbroot.st_dev != sbroot_process.st_dev)
-		    || (sbroot.st_ino != sbroot_process.st_ino)) {
-			continue;
+		busy = (check_status (proc_fd, pid_name, uid) != 0);
+
+		if (!busy && check_threads) {
+			/* 22: xxxxxxxxxx/task + \0 */
+			char task_path[22];
+			DIR *task_dir;
+			int task_fd;
+
+			snprintf (task_path, 22, "%s/task", pid_name);
+			task_fd = openat (proc_fd, task_path,
+			                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			task_dir = (task_fd < 0) ? NULL : fdopendir (task_fd);
+			if (task_dir != NULL) {
+				while (!busy && (ent = readdir (task_dir)) != NULL) {
+					/* 33: xxxxxxxxxx/task/xxxxxxxxxx + \0 */
+					char thread_name[33];
+					pid_t tid;
+
+					if (get_pid (ent->d_name, &tid) == 0) {
+						continue;
+					}
+					if (tid == pid) {
+						continue;
+					}
+					snprintf (thread_name, 33, "%s/%lu",
+					          task_path, (unsigned long) tid);
+					busy = (check_status (proc_fd, thread_name,
+					                      uid) != 0);
+				}
+				(void) closedir (task_dir);
+			} else {
+				/* Ignore errors. This is just a best effort */
+				if (task_fd >= 0) {
+					(void) close (task_fd);
+				}
+			}
 		}
 
-		if (check_status (name, tmp_d_name, uid) != 0) {
+		/* Check if the process is in our chroot */
+		if (busy && same_root (proc_fd, pid_name, &sbroot)) {
 			(void) closedir (proc);
 #ifdef ENABLE_SUBIDS
-			sub_uid_close();
+			free_busy_ranges ();
 #endif
 			fprintf (log_get_logfd(),
 			         _("%s: user %s is currently used by process %d\n"),
 			         log_get_progname(), name, pid);
 			return 1;
 		}
-
-		snprintf (task_path, 22, "/proc/%lu/task", (unsigned long) pid);
-		task_path[21] = '\0';
-		task_dir = opendir (task_path);
-		if (task_dir != NULL) {
-			while ((ent = readdir (task_dir)) != NULL) {
-				pid_t tid;
-				if (get_pid (ent->d_name, &tid) == 0) {
-					continue;
-				}
-				if (tid == pid) {
-					continue;
-				}
-				if (check_status (name, task_path+6, uid) != 0) {
-					(void) closedir (proc);
-					(void) closedir (task_dir);
-#ifdef ENABLE_SUBIDS
-					sub_uid_close();
-#endif
-					fprintf (log_get_logfd(),
-					         _("%s: user %s is currently used by process %d\n"),
-					         log_get_progname(), name, pid);
-					return 1;
-				}
-			}
-			(void) closedir (task_dir);
-		} else {
-			/* Ignore errors. This is just a best effort */
-		}
 	}
 
 	(void) closedir (proc);
 #ifdef ENABLE_SUBIDS
-	sub_uid_close();
+	free_busy_ranges ();
 #endif				/* ENABLE_SUBIDS */
 	return 0;
 }
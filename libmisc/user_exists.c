@@ -0,0 +1,68 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <pwd.h>
+#include <stdlib.h>
+#include <string.h>
+#include "defines.h"
+#include "prototypes.h"
+#include "pwio.h"
+
+/*
+ * The tools which check many member names (grpck, gpasswd -M,
+ * groupmems --sync) find the local users in the name index of the
+ * passwd database, which is loaded once. The other names are looked up
+ * with getpwnam(), once for each name: the results of the first
+ * USER_LOOKUPS_MAX lookups are kept until the tool exits, and the next
+ * names are looked up each time.
+ */
+#define USER_LOOKUPS_MAX	1024
+
+/* The names found and not found by getpwnam() */
+static /*@null@*/struct member_set *found = NULL;
+static /*@null@*/struct member_set *missing = NULL;
+static size_t lookups = 0;
+
+/*
+ * user_exists - Check if name is a user.
+ *
+ *	If the passwd database is open, it is searched first.
+ */
+bool user_exists (const char *name)
+{
+	struct member_set *set;
+	char *copy;
+	bool exists;
+
+	if (pw_locate (name) != NULL) {
+		return true;
+	}
+	if (0 == lookups) {
+		found = member_set_new (USER_LOOKUPS_MAX);
+		missing = member_set_new (USER_LOOKUPS_MAX);
+	}
+	if ((NULL != found) && member_set_contains (found, name)) {
+		return true;
+	}
+	if ((NULL != missing) && member_set_contains (missing, name)) {
+		return false;
+	}
+
+	/* local, no need for xgetpwnam */
+	exists = (getpwnam (name) != NULL);
+
+	set = exists ? found : missing;
+	if ((NULL != set) && (lookups < USER_LOOKUPS_MAX)) {
+		copy = strdup (name);
+		if (NULL != copy) {
+			(void) member_set_add (set, copy);
+		}
+	}
+	lookups++;
+	return exists;
+}
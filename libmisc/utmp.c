@@ -14,11 +14,14 @@
 
 #include <utmp.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <signal.h>
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <stdio.h>
+#include <unistd.h>
 
 #ident "$Id$"
 
@@ -54,6 +57,55 @@ static bool is_my_tty (const char *tty)
 	}
 }
 
+/* Number of utmp records read at once */
+#define UTMP_BLOCK	128
+
+/*
+ * Offset in utmp of the entry returned by get_current_utmp, so that
+ * setutmp can update it without scanning utmp again. -1 if unknown.
+ */
+static off_t current_slot = -1;
+
+/*
+ * open_utmp - open utmp and lock it
+ *
+ *	Return -1 if utmp cannot be opened.
+ */
+static int open_utmp (int flags, short type)
+{
+	struct flock lk;
+	int fd;
+
+	fd = open (_PATH_UTMP, flags | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memzero (&lk, sizeof lk);
+	lk.l_type = type;
+	lk.l_whence = SEEK_SET;
+	(void) fcntl (fd, F_SETLKW, &lk);
+	return fd;
+}
+
+/*
+ * is_current - check if an utmp entry is the one of the current session
+ */
+static bool is_current (const struct utmp *ut)
+{
+	return (   (ut->ut_pid == getpid ())
+#ifdef HAVE_STRUCT_UTMP_UT_ID
+	        && ('\0' != ut->ut_id[0])
+#endif
+#ifdef HAVE_STRUCT_UTMP_UT_TYPE
+	        && (   (LOGIN_PROCESS == ut->ut_type)
+	            || (USER_PROCESS  == ut->ut_type))
+#endif
+	        /* A process may have failed to close an entry
+	         * Check if this entry refers to the current tty */
+	        && is_my_tty (ut->ut_line));
+}
+
 /*
  * get_current_utmp - return the most probable utmp entry for the current
  *                    session
@@ -66,28 +118,57 @@ static bool is_my_tty (const char *tty)
  *	structure has a ut_id field, this field should be used to update
  *	the entry information.
  *
+ *	utmp is read by blocks of records, under a single read lock, and
+ *	the offset of the entry is kept for setutmp. If the file cannot be
+ *	read, getutent() is used.
+ *
  *	Return NULL if no entries exist in utmp for the current process.
  */
 /*@null@*/ /*@only@*/struct utmp *get_current_utmp (void)
 {
-	struct utmp *ut;
+	struct utmp block[UTMP_BLOCK];
+	struct utmp *ut = NULL;
 	struct utmp *ret = NULL;
+	off_t offset = 0;
+	ssize_t len;
+	int fd;
 
-	setutent ();
+	current_slot = -1;
+	fd = open_utmp (O_RDONLY, F_RDLCK);
+	if (fd < 0) {
+		setutent ();
 
-	/* First, try to find a valid utmp entry for this process.  */
-	while ((ut = getutent ()) != NULL) {
-		if (   (ut->ut_pid == getpid ())
-#ifdef HAVE_STRUCT_UTMP_UT_ID
-		    && ('\0' != ut->ut_id[0])
-#endif
-#ifdef HAVE_STRUCT_UTMP_UT_TYPE
-		    && (   (LOGIN_PROCESS == ut->ut_type)
-		        || (USER_PROCESS  == ut->ut_type))
-#endif
-		    /* A process may have failed to close an entry
-		     * Check if this entry refers to the current tty */
-		    && is_my_tty (ut->ut_line)) {
+		/* First, try to find a valid utmp entry for this process.  */
+		while ((ut = getutent ()) != NULL) {
+			if (is_current (ut)) {
+				break;
+			}
+		}
+
+		if (NULL != ut) {
+			ret = (struct utmp *) xmalloc (sizeof (*ret));
+			memcpy (ret, ut, sizeof (*ret));
+		}
+
+		endutent ();
+
+		return ret;
+	}
+
+	while (   (NULL == ut)
+	       && ((len = read (fd, block, sizeof block)) >= (ssize_t) sizeof block[0])) {
+		size_t i, n = len / sizeof block[0];
+
+		for (i = 0; i < n; i++) {
+			if (is_current (&block[i])) {
+				ut = &block[i];
+				current_slot = offset + i * sizeof block[0];
+				break;
+			}
+		}
+		offset += n * sizeof block[0];
+		/* Skip a partial record, as getutent() does */
+		if ((len % sizeof block[0]) != 0) {
 			break;
 		}
 	}
@@ -97,7 +178,7 @@ static bool is_my_tty (const char *tty)
 		memcpy (ret, ut, sizeof (*ret));
 	}
 
-	endutent ();
+	(void) close (fd);
 
 	return ret;
 }
@@ -258,22 +339,90 @@ static void updwtmp (const char *filename, const struct utmp *ut)
 	return utent;
 }
 
+/*
+ * same_slot - check if the utmp entry old is the slot of the entry ut,
+ *             as pututline() does
+ */
+static bool same_slot (const struct utmp *old, const struct utmp *ut)
+{
+#ifdef HAVE_STRUCT_UTMP_UT_ID
+	return (   (   (INIT_PROCESS  == old->ut_type)
+	            || (LOGIN_PROCESS == old->ut_type)
+	            || (USER_PROCESS  == old->ut_type)
+	            || (DEAD_PROCESS  == old->ut_type))
+	        && (strncmp (old->ut_id, ut->ut_id, sizeof (ut->ut_id)) == 0));
+#else
+	return (strncmp (old->ut_line, ut->ut_line, sizeof (ut->ut_line)) == 0);
+#endif
+}
+
+/*
+ * find_slot - find the offset of the slot of ut in utmp
+ *
+ *	The slot of the entry returned by get_current_utmp is checked
+ *	first. Otherwise utmp is read by blocks of records, and a new
+ *	entry is appended after the last complete record.
+ */
+static off_t find_slot (int fd, const struct utmp *ut)
+{
+	struct utmp block[UTMP_BLOCK];
+	off_t offset = 0;
+	ssize_t len;
+
+	if (   (current_slot >= 0)
+	    && (pread (fd, block, sizeof block[0], current_slot)
+	        == (ssize_t) sizeof block[0])
+	    && same_slot (&block[0], ut)) {
+		return current_slot;
+	}
+
+	while ((len = read (fd, block, sizeof block)) >= (ssize_t) sizeof block[0]) {
+		size_t i, n = len / sizeof block[0];
+
+		for (i = 0; i < n; i++) {
+			if (same_slot (&block[i], ut)) {
+				return offset + i * sizeof block[0];
+			}
+		}
+		offset += n * sizeof block[0];
+		if ((len % sizeof block[0]) != 0) {
+			break;
+		}
+	}
+	return offset;
+}
+
 /*
  * setutmp - Update an entry in utmp and log an entry in wtmp
  *
+ *	The entry is written with pwrite() in its slot, under a write
+ *	lock. If utmp cannot be opened for writing, pututline() is used.
+ *
  *	Return 1 on failure and 0 on success.
  */
 int setutmp (struct utmp *ut)
 {
 	int err = 0;
+	int fd;
 
 	assert (NULL != ut);
 
-	setutent ();
-	if (pututline (ut) == NULL) {
-		err = 1;
+	fd = open_utmp (O_RDWR, F_WRLCK);
+	if (fd >= 0) {
+		if (pwrite (fd, ut, sizeof (*ut), find_slot (fd, ut))
+		    != (ssize_t) sizeof (*ut)) {
+			err = 1;
+		}
+		if (close (fd) != 0) {
+			err = 1;
+		}
+	} else {
+		setutent ();
+		if (pututline (ut) == NULL) {
+			err = 1;
+		}
+		endutent ();
 	}
-	endutent ();
 
 #ifndef USE_PAM
 	/* This is done by pam_lastlog */
@@ -282,3 +431,69 @@ int setutmp (struct utmp *ut)
 
 	return err;
 }
+
+static bool is_session (const struct utmp *ut, const char *name, bool alive)
+{
+	/* Compare the first character before calling strncmp() */
+	if (   (USER_PROCESS != ut->ut_type)
+	    || (ut->ut_user[0] != name[0])
+	    || ('\0' == ut->ut_user[0])) {
+		return false;
+	}
+	if (strncmp (name, ut->ut_user, sizeof (ut->ut_user)) != 0) {
+		return false;
+	}
+	return !alive || (kill (ut->ut_pid, 0) == 0);
+}
+
+/*
+ * count_sessions - Count the sessions of name in utmp
+ *
+ *	If alive is set, only the sessions with a running process are
+ *	counted.
+ *	The count stops after max sessions, so that the caller can check
+ *	if there are more than max sessions.
+ *
+ *	utmp is read by blocks of records, under a single read lock,
+ *	instead of a read and a lock for each record with getutent(). If
+ *	the file cannot be read, getutent() is used.
+ */
+unsigned long count_sessions (const char *name, unsigned long max, bool alive)
+{
+	struct utmp block[UTMP_BLOCK];
+	unsigned long count = 0;
+	ssize_t len;
+	int fd;
+
+	fd = open_utmp (O_RDONLY, F_RDLCK);
+	if (fd < 0) {
+		const struct utmp *ut;
+
+		setutent ();
+		while ((count <= max) && ((ut = getutent ()) != NULL)) {
+			if (is_session (ut, name, alive)) {
+				count++;
+			}
+		}
+		endutent ();
+		return count;
+	}
+
+	while (   (count <= max)
+	       && ((len = read (fd, block, sizeof block)) >= (ssize_t) sizeof block[0])) {
+		size_t i, n = len / sizeof block[0];
+
+		for (i = 0; (i < n) && (count <= max); i++) {
+			if (is_session (&block[i], name, alive)) {
+				count++;
+			}
+		}
+		/* Skip a partial record, as getutent() does */
+		if ((len % sizeof block[0]) != 0) {
+			break;
+		}
+	}
+
+	(void) close (fd);
+	return count;
+}
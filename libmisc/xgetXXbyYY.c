@@ -24,6 +24,18 @@
  *  getpwnam(3) and syslog(3).
  *
  * This file provides wrapper to the name or name_r functions.
+ *
+ * The results are also cached for the duration of the process: the
+ * XCACHE_SIZE last lookups are remembered, until the tool writes one of
+ * the databases (see commonio_changes()).  The size of the buffer which
+ * was large enough for the last lookup is remembered as well.
+ *
+ * The wrappers define how the lookup keys are kept:
+ *  KEY_TYPE - type of the saved key
+ *  KEY_SET(key, arg) - save arg in key, false on failure
+ *  KEY_EQUAL(key, arg) - compare a saved key and an argument
+ *  KEY_FREE(key) - free a saved key
+ *  FREE_FUNCTION - free a result of DUP_FUNCTION
  */
 
 #include <unistd.h>
@@ -31,6 +43,8 @@
 #include <stdio.h>
 #include <errno.h>
 #include "prototypes.h"
+#include "commonio.h"
+#include "probes.h"
 #include "shadowlog.h"
 
 #define XFUNCTION_NAME XPREFIX (FUNCTION_NAME)
@@ -42,13 +56,38 @@
 #define STRINGIZE(name) STRINGIZE1 (name)
 #define STRINGIZE1(name) #name
 
-/*@null@*/ /*@only@*/LOOKUP_TYPE *XFUNCTION_NAME (ARG_TYPE ARG_NAME)
+#define XCACHE_SIZE	8
+
+struct xcache_entry {
+	bool used;
+	KEY_TYPE key;
+	/*@null@*/ /*@only@*/LOOKUP_TYPE *result;	/* NULL if not found */
+};
+
+static struct xcache_entry xcache[XCACHE_SIZE];
+static size_t xcache_next = 0;
+static unsigned long xcache_changes = 0;
+
+#if HAVE_FUNCTION_R
+/* we have to start with something */
+static size_t xlength = 0x100;
+#endif
+
+/*
+ * xlookup - Look up ARG_NAME, and return a copy of the result.
+ *
+ *	*found is set to false if ARG_NAME does not exist, and to true
+ *	otherwise, or on errors.
+ */
+static /*@null@*/ /*@only@*/LOOKUP_TYPE *xlookup (ARG_TYPE ARG_NAME,
+                                                   bool *found)
 {
 #if HAVE_FUNCTION_R
 	LOOKUP_TYPE *result=NULL;
 	char *buffer=NULL;
-	/* we have to start with something */
-	size_t length = 0x100;
+	size_t length = xlength;
+
+	*found = true;
 
 	result = malloc(sizeof(LOOKUP_TYPE));
 	if (NULL == result) {
@@ -74,9 +113,13 @@
 			LOOKUP_TYPE *ret_result = DUP_FUNCTION(result);
 			free(buffer);
 			free(result);
+			xlength = length;
 			return ret_result;
 		}
 
+		if ((0 == status) && (NULL == resbuf)) {
+			*found = false;
+		}
 		if (ERANGE != status) {
 			free (buffer);
 			free (result);
@@ -104,8 +147,11 @@
 	 * We should also restore the initial structure. But that would be
 	 * overkill.
 	 */
-	LOOKUP_TYPE *result = FUNCTION_NAME(ARG_NAME);
+	LOOKUP_TYPE *result;
 
+	errno = 0;
+	result = FUNCTION_NAME(ARG_NAME);
+	*found = (NULL != result) || (0 != errno);
 	if (result) {
 		result = DUP_FUNCTION(result);
 		if (NULL == result) {
@@ -119,3 +165,72 @@
 #endif
 }
 
+/*@null@*/ /*@only@*/LOOKUP_TYPE *XFUNCTION_NAME (ARG_TYPE ARG_NAME)
+{
+	struct xcache_entry *entry;
+	LOOKUP_TYPE *result;
+	bool found;
+	size_t i;
+
+	/* Forget the lookups done before the databases were written */
+	if (commonio_changes () != xcache_changes) {
+		for (i = 0; i < XCACHE_SIZE; i++) {
+			if (xcache[i].used) {
+				if (NULL != xcache[i].result) {
+					FREE_FUNCTION (xcache[i].result);
+				}
+				KEY_FREE (xcache[i].key);
+				xcache[i].used = false;
+			}
+		}
+		xcache_changes = commonio_changes ();
+	}
+
+	for (i = 0; i < XCACHE_SIZE; i++) {
+		if (!xcache[i].used || !KEY_EQUAL (xcache[i].key, ARG_NAME)) {
+			continue;
+		}
+		if (NULL == xcache[i].result) {
+			return NULL;
+		}
+		result = DUP_FUNCTION (xcache[i].result);
+		if (NULL == result) {
+			fprintf (log_get_logfd(), _("%s: out of memory\n"),
+			         "x" STRINGIZE(FUNCTION_NAME));
+			exit (13);
+		}
+		return result;
+	}
+
+	PROBE1 (nss__lookup__start, STRINGIZE (FUNCTION_NAME));
+	result = xlookup (ARG_NAME, &found);
+	PROBE2 (nss__lookup__done, STRINGIZE (FUNCTION_NAME), NULL != result);
+	if ((NULL == result) && found) {
+		/* errors are not cached */
+		return NULL;
+	}
+
+	entry = &xcache[xcache_next];
+	if (entry->used) {
+		if (NULL != entry->result) {
+			FREE_FUNCTION (entry->result);
+		}
+		KEY_FREE (entry->key);
+		entry->used = false;
+	}
+	if (!KEY_SET (entry->key, ARG_NAME)) {
+		return result;
+	}
+	entry->result = NULL;
+	if (NULL != result) {
+		entry->result = DUP_FUNCTION (result);
+		if (NULL == entry->result) {
+			KEY_FREE (entry->key);
+			return result;
+		}
+	}
+	entry->used = true;
+	xcache_next = (xcache_next + 1) % XCACHE_SIZE;
+
+	return result;
+}
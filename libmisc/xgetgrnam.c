@@ -35,6 +35,11 @@
 #define ARG_TYPE	const char *
 #define ARG_NAME	name
 #define DUP_FUNCTION	__gr_dup
+#define FREE_FUNCTION	gr_free
+#define KEY_TYPE	char *
+#define KEY_SET(key, arg)	(NULL != ((key) = strdup (arg)))
+#define KEY_EQUAL(key, arg)	(strcmp ((key), (arg)) == 0)
+#define KEY_FREE(key)	free (key)
 #define HAVE_FUNCTION_R 1
 
 #include "xgetXXbyYY.c"
@@ -35,6 +35,11 @@
 #define ARG_TYPE	uid_t
 #define ARG_NAME	uid
 #define DUP_FUNCTION	__pw_dup
+#define FREE_FUNCTION	pw_free
+#define KEY_TYPE	uid_t
+#define KEY_SET(key, arg)	((key) = (arg), true)
+#define KEY_EQUAL(key, arg)	((key) == (arg))
+#define KEY_FREE(key)	((void) 0)
 #define HAVE_FUNCTION_R 1
 
 #include "xgetXXbyYY.c"
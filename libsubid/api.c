@@ -10,13 +10,22 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "prototypes.h"
 #include "subordinateio.h"
 #include "idmapping.h"
 #include "subid.h"
 #include "shadowlog.h"
 
+void subid_reload(void)
+{
+	nss_reload(NULL);
+}
+
 bool subid_init(const char *progname, FILE * logfd)
 {
 	FILE *shadow_logfd;
@@ -106,3 +115,664 @@ bool subid_ungrant_gid_range(struct subordinate_range *range)
 {
 	return ungrant_subid_range(range, ID_TYPE_GID);
 }
+
+/* Ranges of an owner answered by the subid NSS module */
+struct nss_answer {
+	char *owner;
+	int count;
+	struct subid_range *ranges;
+};
+
+/*
+ * A context reads its own copy of the database (see subid_db_open()), so
+ * that the contexts can be queried by several threads at once.
+ */
+struct subid_ctx {
+	enum subid_type id_type;
+	struct subid_nss_ops *nss;	/* NSS module answering the queries, or NULL */
+	struct commonio_db *db;	/* copy of the database, or NULL */
+	struct stat st;		/* database file, when it was read */
+	/*
+	 * Answers of the NSS module, sorted by owner, valid as long as
+	 * the cache token of the module is token.
+	 */
+	bool have_token;
+	unsigned long token;
+	struct nss_answer *answers;
+	size_t nanswers;
+};
+
+static bool ctx_db_open(struct subid_ctx *ctx)
+{
+	ctx->db = subid_db_open(ctx->id_type);
+	if (NULL == ctx->db)
+		return false;
+
+	if (fstat(fileno(ctx->db->fp), &ctx->st) != 0) {
+		subid_db_close(ctx->db);
+		ctx->db = NULL;
+		return false;
+	}
+	return true;
+}
+
+static void ctx_db_close(struct subid_ctx *ctx)
+{
+	subid_db_close(ctx->db);
+	ctx->db = NULL;
+}
+
+/*
+ * ctx_db_check: read the database again if its file was replaced or
+ *               modified since it was read.
+ */
+static bool ctx_db_check(struct subid_ctx *ctx)
+{
+	const char *dbname;
+	struct stat st;
+
+	dbname = (ID_TYPE_UID == ctx->id_type) ? sub_uid_dbname() : sub_gid_dbname();
+	if (   (NULL != ctx->db)
+	    && (stat(dbname, &st) == 0)
+	    && (st.st_dev == ctx->st.st_dev)
+	    && (st.st_ino == ctx->st.st_ino)
+	    && (st.st_size == ctx->st.st_size)
+	    && (st.st_mtim.tv_sec == ctx->st.st_mtim.tv_sec)
+	    && (st.st_mtim.tv_nsec == ctx->st.st_mtim.tv_nsec)) {
+		return true;
+	}
+
+	if (NULL != ctx->db)
+		ctx_db_close(ctx);
+	return ctx_db_open(ctx);
+}
+
+static void nss_answers_free(struct subid_ctx *ctx)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->nanswers; i++) {
+		free(ctx->answers[i].owner);
+		free(ctx->answers[i].ranges);
+	}
+	free(ctx->answers);
+	ctx->answers = NULL;
+	ctx->nanswers = 0;
+}
+
+/*
+ * nss_answer_find: position of the answer for @owner, or where it should
+ *                  be inserted.
+ */
+static bool nss_answer_find(const struct subid_ctx *ctx, const char *owner, size_t *pos)
+{
+	size_t lo = 0, hi = ctx->nanswers;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int ret = strcmp(ctx->answers[mid].owner, owner);
+
+		if (0 == ret) {
+			*pos = mid;
+			return true;
+		}
+		if (ret < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	*pos = lo;
+	return false;
+}
+
+static int copy_ranges(const struct subid_range *ranges, int count, struct subid_range **copy)
+{
+	*copy = NULL;
+	if (0 == count)
+		return 0;
+	*copy = malloc(count * sizeof **copy);
+	if (NULL == *copy)
+		return -1;
+	memcpy(*copy, ranges, count * sizeof **copy);
+	return count;
+}
+
+/*
+ * nss_answer_add: keep the answer of the NSS module for @owner.  Failing
+ *                 to keep it is not an error.
+ */
+static void nss_answer_add(struct subid_ctx *ctx, const char *owner,
+			   const struct subid_range *ranges, int count)
+{
+	struct nss_answer *answers, answer;
+	size_t pos;
+
+	if (nss_answer_find(ctx, owner, &pos))
+		return;
+
+	answer.owner = strdup(owner);
+	if (NULL == answer.owner)
+		return;
+	answer.count = copy_ranges(ranges, count, &answer.ranges);
+	if (answer.count < 0) {
+		free(answer.owner);
+		return;
+	}
+	answers = realloc(ctx->answers, (ctx->nanswers + 1) * sizeof *answers);
+	if (NULL == answers) {
+		free(answer.owner);
+		free(answer.ranges);
+		return;
+	}
+	ctx->answers = answers;
+	memmove(&answers[pos + 1], &answers[pos], (ctx->nanswers - pos) * sizeof *answers);
+	answers[pos] = answer;
+	ctx->nanswers++;
+}
+
+/*
+ * nss_cache_check: drop the answers of the NSS module if they may be
+ *                  outdated.
+ *
+ * Returns true if the answers can be cached.
+ */
+static bool nss_cache_check(struct subid_ctx *ctx, struct subid_nss_ops *h)
+{
+	unsigned long token;
+
+	if (   (NULL == h->cache_token)
+	    || (h->cache_token(ctx->id_type, &token) != SUBID_STATUS_SUCCESS)) {
+		nss_answers_free(ctx);
+		ctx->have_token = false;
+		return false;
+	}
+
+	if (!ctx->have_token || (token != ctx->token))
+		nss_answers_free(ctx);
+	ctx->have_token = true;
+	ctx->token = token;
+	return true;
+}
+
+/*
+ * Owner queries of a batch which are sent to the subid NSS module.
+ */
+struct nss_batch {
+	size_t *pending;	/* positions of the queries */
+	size_t npending;
+	const char **owners;
+	struct subid_range **ranges;
+	int *counts;
+	enum subid_status *status;	/* NULL to query the owners one by one */
+	bool cache;		/* keep the answers */
+};
+
+/*
+ * nss_batch_begin: answer the queries through the subid NSS module @h
+ *                  which need no call of nss_list_owner_ranges() (the
+ *                  owners cached, and the IDs), and list the others in
+ *                  @batch.
+ *
+ * Returns the number of queries which failed, or -1 on failure.
+ */
+static int nss_batch_begin(struct subid_ctx *ctx, struct subid_nss_ops *h,
+			   struct subid_query *queries, size_t n,
+			   struct nss_batch *batch)
+{
+	size_t i, pos;
+	int failed = 0;
+
+	memset(batch, 0, sizeof *batch);
+	batch->cache = nss_cache_check(ctx, h);
+
+	batch->pending = malloc((n + 1) * sizeof *batch->pending);
+	if (NULL == batch->pending)
+		return -1;
+	for (i = 0; i < n; i++) {
+		struct subid_query *q = &queries[i];
+
+		q->ranges = NULL;
+		q->owners = NULL;
+		if (NULL == q->owner) {
+			q->count = find_subid_owners(q->id, ctx->id_type, &q->owners);
+		} else if (batch->cache && nss_answer_find(ctx, q->owner, &pos)) {
+			q->count = copy_ranges(ctx->answers[pos].ranges,
+					       ctx->answers[pos].count, &q->ranges);
+		} else {
+			batch->pending[batch->npending++] = i;
+			continue;
+		}
+		if (q->count < 0)
+			failed++;
+	}
+	return failed;
+}
+
+static void nss_batch_free(struct nss_batch *batch)
+{
+	free(batch->pending);
+	free(batch->owners);
+	free(batch->ranges);
+	free(batch->counts);
+	free(batch->status);
+	memset(batch, 0, sizeof *batch);
+}
+
+/*
+ * nss_batch_alloc: prepare @batch for a query of all its owners in one
+ *                  call.
+ *
+ * Returns false if it could not be allocated: the owners are then queried
+ * one by one.
+ */
+static bool nss_batch_alloc(struct nss_batch *batch, const struct subid_query *queries)
+{
+	size_t i;
+
+	batch->owners = malloc(batch->npending * sizeof *batch->owners);
+	batch->ranges = calloc(batch->npending, sizeof *batch->ranges);
+	batch->counts = calloc(batch->npending, sizeof *batch->counts);
+	batch->status = malloc(batch->npending * sizeof *batch->status);
+	if (   (NULL == batch->owners) || (NULL == batch->ranges)
+	    || (NULL == batch->counts) || (NULL == batch->status)) {
+		free(batch->status);
+		batch->status = NULL;
+		return false;
+	}
+	for (i = 0; i < batch->npending; i++)
+		batch->owners[i] = queries[batch->pending[i]].owner;
+	return true;
+}
+
+/* nss_batch_fail: the call answering all the owners of @batch failed */
+static void nss_batch_fail(struct nss_batch *batch)
+{
+	size_t i;
+
+	for (i = 0; i < batch->npending; i++)
+		batch->status[i] = SUBID_STATUS_ERROR;
+}
+
+/*
+ * nss_batch_end: set the answers of the pending queries of @batch,
+ *                querying them one by one if they were not answered in
+ *                one call, and free @batch.
+ *
+ * Returns the number of these queries which failed.
+ */
+static int nss_batch_end(struct subid_ctx *ctx, struct subid_nss_ops *h,
+			 struct subid_query *queries, struct nss_batch *batch)
+{
+	size_t i;
+	int failed = 0;
+
+	for (i = 0; i < batch->npending; i++) {
+		struct subid_query *q = &queries[batch->pending[i]];
+
+		if (NULL != batch->status) {
+			bool ok = (batch->status[i] == SUBID_STATUS_SUCCESS);
+
+			q->ranges = ok ? batch->ranges[i] : NULL;
+			q->count = ok ? batch->counts[i] : -1;
+			if (!ok)
+				free(batch->ranges[i]);
+		} else if (h->list_owner_ranges(q->owner, ctx->id_type, &q->ranges, &q->count) != SUBID_STATUS_SUCCESS) {
+			q->ranges = NULL;
+			q->count = -1;
+		}
+
+		if (q->count < 0)
+			failed++;
+		else if (batch->cache)
+			nss_answer_add(ctx, q->owner, q->ranges, q->count);
+	}
+
+	nss_batch_free(batch);
+	return failed;
+}
+
+/*
+ * nss_query_many: answer the queries through the subid NSS module @h.
+ *
+ * The ranges of the owners are cached if the module provides a cache
+ * token, and queried in one call if the module supports it.
+ */
+static int nss_query_many(struct subid_ctx *ctx, struct subid_nss_ops *h,
+			  struct subid_query *queries, size_t n)
+{
+	struct nss_batch batch;
+	int failed;
+
+	failed = nss_batch_begin(ctx, h, queries, n, &batch);
+	if (failed < 0)
+		return -1;
+
+	if (   (batch.npending > 0)
+	    && (NULL != h->list_owner_ranges_many)
+	    && nss_batch_alloc(&batch, queries)
+	    && (h->list_owner_ranges_many(batch.owners, batch.npending, ctx->id_type,
+					  batch.ranges, batch.counts,
+					  batch.status) != SUBID_STATUS_SUCCESS)) {
+		nss_batch_fail(&batch);
+	}
+
+	return failed + nss_batch_end(ctx, h, queries, &batch);
+}
+
+/*
+ * ctx_nss: the subid NSS module answering the queries of @ctx, or NULL.
+ *
+ * The module may have changed with subid_reload(): the answers of the
+ * previous one are dropped.
+ */
+static struct subid_nss_ops *ctx_nss(struct subid_ctx *ctx)
+{
+	struct subid_nss_ops *h;
+
+	h = get_subid_nss_handle();
+	if (h != ctx->nss) {
+		nss_answers_free(ctx);
+		ctx->have_token = false;
+		if (NULL != ctx->db)
+			ctx_db_close(ctx);
+		ctx->nss = h;
+	}
+	return h;
+}
+
+struct subid_ctx *subid_open(enum subid_type id_type)
+{
+	struct subid_ctx *ctx;
+
+	if ((ID_TYPE_UID != id_type) && (ID_TYPE_GID != id_type)) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	ctx = calloc(1, sizeof *ctx);
+	if (NULL == ctx)
+		return NULL;
+	ctx->id_type = id_type;
+	ctx->nss = get_subid_nss_handle();
+	if (!ctx->nss && !ctx_db_open(ctx)) {
+		free(ctx);
+		return NULL;
+	}
+
+	return ctx;
+}
+
+int subid_query_many(struct subid_ctx *ctx, struct subid_query *queries, size_t n)
+{
+	struct subid_nss_ops *h;
+	size_t i;
+	int failed = 0;
+
+	h = ctx_nss(ctx);
+	if (h)
+		return nss_query_many(ctx, h, queries, n);
+
+	if (!ctx_db_check(ctx))
+		return -1;
+
+	for (i = 0; i < n; i++) {
+		struct subid_query *q = &queries[i];
+
+		q->ranges = NULL;
+		q->owners = NULL;
+		if (NULL != q->owner)
+			q->count = list_open_owner_ranges(ctx->db, q->owner, ctx->id_type, &q->ranges);
+		else
+			q->count = find_open_subid_owners(ctx->db, q->id, &q->owners);
+		if (q->count < 0)
+			failed++;
+	}
+
+	/* Owners are resolved again by the next batch */
+	forget_subid_owners(ctx->db);
+
+	return failed;
+}
+
+void subid_close(struct subid_ctx *ctx)
+{
+	if (NULL == ctx)
+		return;
+
+	if (NULL != ctx->db)
+		ctx_db_close(ctx);
+	nss_answers_free(ctx);
+	free(ctx);
+}
+
+/*
+ * Queries answered without blocking the caller: by the asynchronous entry
+ * points of the subid NSS module if it has them, else by a worker thread.
+ */
+struct subid_async {
+	struct subid_ctx *ctx;
+	struct subid_query *queries;
+	size_t n;
+	int failed;
+	int pipe[2];		/* written when the answers are ready */
+	bool thread;		/* answered by a worker thread */
+	pthread_t tid;
+	struct subid_nss_ops *nss;	/* module answering them, or NULL */
+	int nss_fd;
+	void *request;
+	struct nss_batch batch;
+};
+
+static void *async_worker(void *arg)
+{
+	struct subid_async *async = arg;
+
+	async->failed = subid_query_many(async->ctx, async->queries, async->n);
+	(void) write(async->pipe[1], "", 1);
+	return NULL;
+}
+
+/*
+ * async_nss_start: start answering the queries of @async with the
+ *                  asynchronous entry points of the subid NSS module @h.
+ *
+ * Returns false if they cannot be answered so; no query is answered then.
+ */
+static bool async_nss_start(struct subid_async *async, struct subid_nss_ops *h)
+{
+	struct subid_query *queries = async->queries;
+	struct nss_batch *batch = &async->batch;
+	size_t i;
+	int failed;
+
+	if ((NULL == h->list_owner_ranges_start) || (NULL == h->list_owner_ranges_finish))
+		return false;
+	/* The IDs are only looked up synchronously */
+	for (i = 0; i < async->n; i++) {
+		if (NULL == queries[i].owner)
+			return false;
+	}
+
+	failed = nss_batch_begin(async->ctx, h, queries, async->n, batch);
+	if (failed < 0) {
+		nss_batch_free(batch);
+		return false;
+	}
+	if (0 == batch->npending) {
+		/* All answered from the cache */
+		nss_batch_free(batch);
+		async->failed = failed;
+		(void) write(async->pipe[1], "", 1);
+		return true;
+	}
+	if (   !nss_batch_alloc(batch, queries)
+	    || (h->list_owner_ranges_start(batch->owners, batch->npending,
+					   async->ctx->id_type, &async->nss_fd,
+					   &async->request) != SUBID_STATUS_SUCCESS)) {
+		nss_batch_free(batch);
+		for (i = 0; i < async->n; i++) {
+			free(queries[i].ranges);
+			queries[i].ranges = NULL;
+		}
+		return false;
+	}
+
+	async->failed = failed;
+	async->nss = h;
+	return true;
+}
+
+struct subid_async *subid_query_start(struct subid_ctx *ctx, struct subid_query *queries, size_t n)
+{
+	struct subid_async *async;
+	struct subid_nss_ops *h;
+
+	async = calloc(1, sizeof *async);
+	if (NULL == async)
+		return NULL;
+	async->ctx = ctx;
+	async->queries = queries;
+	async->n = n;
+	if (pipe2(async->pipe, O_CLOEXEC) != 0) {
+		free(async);
+		return NULL;
+	}
+
+	h = ctx_nss(ctx);
+	if (h && async_nss_start(async, h))
+		return async;
+
+	if (pthread_create(&async->tid, NULL, async_worker, async) != 0) {
+		(void) close(async->pipe[0]);
+		(void) close(async->pipe[1]);
+		free(async);
+		return NULL;
+	}
+	async->thread = true;
+	return async;
+}
+
+int subid_async_fd(const struct subid_async *async)
+{
+	return (NULL != async->nss) ? async->nss_fd : async->pipe[0];
+}
+
+int subid_query_finish(struct subid_async *async)
+{
+	struct nss_batch *batch = &async->batch;
+	int failed;
+
+	if (async->thread) {
+		(void) pthread_join(async->tid, NULL);
+	} else if (NULL != async->nss) {
+		if (async->nss->list_owner_ranges_finish(async->request, batch->ranges,
+							 batch->counts,
+							 batch->status) != SUBID_STATUS_SUCCESS) {
+			nss_batch_fail(batch);
+		}
+		async->failed += nss_batch_end(async->ctx, async->nss,
+					       async->queries, batch);
+	}
+
+	failed = async->failed;
+	(void) close(async->pipe[0]);
+	(void) close(async->pipe[1]);
+	free(async);
+	return failed;
+}
+
+/*
+ * The transactions change the databases of the process: only one can be
+ * open per ID type.
+ */
+struct subid_txn {
+	enum subid_type id_type;
+};
+
+static pthread_mutex_t txn_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool txn_uid_open;
+static bool txn_gid_open;
+
+static bool *txn_is_open(enum subid_type id_type)
+{
+	switch (id_type) {
+	case ID_TYPE_UID:
+		return &txn_uid_open;
+	case ID_TYPE_GID:
+		return &txn_gid_open;
+	default:
+		return NULL;
+	}
+}
+
+struct subid_txn *subid_txn_begin(enum subid_type id_type)
+{
+	struct subid_txn *txn;
+	bool *is_open;
+
+	is_open = txn_is_open(id_type);
+	if (NULL == is_open) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	txn = calloc(1, sizeof *txn);
+	if (NULL == txn)
+		return NULL;
+	txn->id_type = id_type;
+
+	(void) pthread_mutex_lock(&txn_lock);
+	if (*is_open) {
+		(void) pthread_mutex_unlock(&txn_lock);
+		free(txn);
+		errno = EBUSY;
+		return NULL;
+	}
+	*is_open = true;
+	(void) pthread_mutex_unlock(&txn_lock);
+
+	if (!begin_subid_changes(id_type)) {
+		(void) pthread_mutex_lock(&txn_lock);
+		*is_open = false;
+		(void) pthread_mutex_unlock(&txn_lock);
+		free(txn);
+		return NULL;
+	}
+
+	return txn;
+}
+
+bool subid_txn_grant(struct subid_txn *txn, struct subordinate_range *range, bool reuse)
+{
+	return new_open_subid_range(range, txn->id_type, reuse);
+}
+
+bool subid_txn_ungrant(struct subid_txn *txn, struct subordinate_range *range)
+{
+	return release_open_subid_range(range, txn->id_type);
+}
+
+static bool txn_end(struct subid_txn *txn, bool commit)
+{
+	bool ret;
+
+	ret = end_subid_changes(txn->id_type, commit);
+	(void) pthread_mutex_lock(&txn_lock);
+	*txn_is_open(txn->id_type) = false;
+	(void) pthread_mutex_unlock(&txn_lock);
+	free(txn);
+	return ret;
+}
+
+bool subid_txn_commit(struct subid_txn *txn)
+{
+	return txn_end(txn, true);
+}
+
+void subid_txn_abort(struct subid_txn *txn)
+{
+	if (NULL == txn)
+		return;
+
+	(void) txn_end(txn, false);
+}
@@ -0,0 +1,10 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+/*
+ * The lookup functions of lib/dbindex.c, without the writer, which
+ * needs libshadow.
+ */
+#define DBINDEX_READER
+#include "dbindex.c"
@@ -0,0 +1,329 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <grp.h>
+#include <nss.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include "defines.h"
+
+/*
+ * From lib/dbindex.c. prototypes.h cannot be included with <nss.h>: its
+ * nss_init() clashes with a type of glibc.
+ */
+extern int dbindex_lookup (const char *dbfile, /*@null@*/const char *name,
+                           unsigned long id, /*@out@*/char **line);
+extern int dbindex_member_gids (const char *dbfile, const char *name,
+                                /*@out@*/unsigned long **gids);
+
+/*
+ * libnss_shadowidx - NSS module of the lookup indexes of passwd and group
+ *
+ * With LOOKUP_INDEX, the tools write a lookup index of /etc/passwd and
+ * /etc/group next to them (see lib/dbindex.c). This module answers the
+ * lookups of users and groups by name or ID, and initgroups(), from
+ * these indexes, so that all the programs of the host find an entry
+ * without scanning the files:
+ *
+ *	passwd: shadowidx files
+ *	group:  shadowidx files
+ *
+ * If an index is missing or older than its file, the module is
+ * unavailable and the lookups go on with files. The enumerations
+ * (getpwent(), getgrent()) are left to files.
+ */
+
+static pthread_mutex_t index_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * lookup - Find the line with name (or, if name is NULL, with id) in the
+ *	index of file.
+ */
+static enum nss_status lookup (const char *file, /*@null@*/const char *name,
+                               unsigned long id, /*@out@*/char **line,
+                               int *errnop)
+{
+	int ret;
+
+	/* The mapped snapshots are shared by the threads */
+	(void) pthread_mutex_lock (&index_lock);
+	ret = dbindex_lookup (file, name, id, line);
+	(void) pthread_mutex_unlock (&index_lock);
+
+	if (1 == ret) {
+		return NSS_STATUS_SUCCESS;
+	}
+	*errnop = ENOENT;
+	return (0 == ret) ? NSS_STATUS_NOTFOUND : NSS_STATUS_UNAVAIL;
+}
+
+/*
+ * split - Split the line in buf in n fields, separated by colons.
+ *
+ *	Return 0 on success, -1 if the line does not have n fields.
+ */
+static int split (char *buf, char *fields[], int n)
+{
+	char *cp = buf;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		fields[i] = cp;
+		cp = strchr (cp, ':');
+		if (i == n - 1) {
+			return (NULL == cp) ? 0 : -1;
+		}
+		if (NULL == cp) {
+			return -1;
+		}
+		*cp++ = '\0';
+	}
+	return 0;
+}
+
+static int get_id (const char *field, unsigned long *id)
+{
+	char *end;
+
+	errno = 0;
+	*id = strtoul (field, &end, 10);
+	return (   ('\0' == *field) || ('\0' != *end) || (0 != errno)
+	        || (*id > UINT32_MAX)) ? -1 : 0;
+}
+
+/*
+ * copy_line - Copy the line of an entry in the buffer of the caller.
+ */
+static enum nss_status copy_line (const char *line, char *buf,
+                                  size_t buflen, size_t extra, int *errnop)
+{
+	size_t len = strlen (line);
+
+	if ((len >= buflen) || (buflen - (len + 1) < extra)) {
+		*errnop = ERANGE;
+		return NSS_STATUS_TRYAGAIN;
+	}
+	memcpy (buf, line, len + 1);
+	return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status fill_passwd (const char *line, struct passwd *pw,
+                                    char *buf, size_t buflen, int *errnop)
+{
+	char *fields[7];
+	unsigned long uid, gid;
+	enum nss_status status;
+
+	status = copy_line (line, buf, buflen, 0, errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	if (   (split (buf, fields, 7) != 0)
+	    || (get_id (fields[2], &uid) != 0)
+	    || (get_id (fields[3], &gid) != 0)) {
+		*errnop = ENOENT;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	pw->pw_name = fields[0];
+	pw->pw_passwd = fields[1];
+	pw->pw_uid = uid;
+	pw->pw_gid = gid;
+	pw->pw_gecos = fields[4];
+	pw->pw_dir = fields[5];
+	pw->pw_shell = fields[6];
+	return NSS_STATUS_SUCCESS;
+}
+
+static enum nss_status fill_group (const char *line, struct group *gr,
+                                   char *buf, size_t buflen, int *errnop)
+{
+	char *fields[4];
+	char **members;
+	unsigned long gid;
+	size_t nmembers = 1, len, pad, i;
+	const char *comma;
+	char *cp;
+	enum nss_status status;
+
+	/* The list of members follows the line, aligned for pointers */
+	for (comma = strchr (line, ',');
+	     NULL != comma;
+	     comma = strchr (comma + 1, ',')) {
+		nmembers++;
+	}
+	len = strlen (line) + 1;
+	pad = (sizeof (char *) - ((uintptr_t) (buf + len)) % sizeof (char *))
+	      % sizeof (char *);
+	status = copy_line (line, buf, buflen,
+	                    pad + (nmembers + 1) * sizeof (char *), errnop);
+	if (NSS_STATUS_SUCCESS != status) {
+		return status;
+	}
+	if (   (split (buf, fields, 4) != 0)
+	    || (get_id (fields[2], &gid) != 0)) {
+		*errnop = ENOENT;
+		return NSS_STATUS_NOTFOUND;
+	}
+
+	members = (char **) (buf + len + pad);
+	i = 0;
+	cp = fields[3];
+	while ('\0' != *cp) {
+		char *next = strchr (cp, ',');
+
+		if (NULL != next) {
+			*next++ = '\0';
+		}
+		if ('\0' != *cp) {
+			members[i++] = cp;
+		}
+		if (NULL == next) {
+			break;
+		}
+		cp = next;
+	}
+	members[i] = NULL;
+
+	gr->gr_name = fields[0];
+	gr->gr_passwd = fields[1];
+	gr->gr_gid = gid;
+	gr->gr_mem = members;
+	return NSS_STATUS_SUCCESS;
+}
+
+enum nss_status _nss_shadowidx_getpwnam_r (const char *name,
+                                           struct passwd *pw,
+                                           char *buf, size_t buflen,
+                                           int *errnop)
+{
+	enum nss_status status;
+	char *line;
+
+	status = lookup (PASSWD_FILE, name, 0, &line, errnop);
+	if (NSS_STATUS_SUCCESS == status) {
+		status = fill_passwd (line, pw, buf, buflen, errnop);
+		free (line);
+	}
+	return status;
+}
+
+enum nss_status _nss_shadowidx_getpwuid_r (uid_t uid, struct passwd *pw,
+                                           char *buf, size_t buflen,
+                                           int *errnop)
+{
+	enum nss_status status;
+	char *line;
+
+	status = lookup (PASSWD_FILE, NULL, uid, &line, errnop);
+	if (NSS_STATUS_SUCCESS == status) {
+		status = fill_passwd (line, pw, buf, buflen, errnop);
+		free (line);
+	}
+	return status;
+}
+
+enum nss_status _nss_shadowidx_getgrnam_r (const char *name,
+                                           struct group *gr,
+                                           char *buf, size_t buflen,
+                                           int *errnop)
+{
+	enum nss_status status;
+	char *line;
+
+	status = lookup (GROUP_FILE, name, 0, &line, errnop);
+	if (NSS_STATUS_SUCCESS == status) {
+		status = fill_group (line, gr, buf, buflen, errnop);
+		free (line);
+	}
+	return status;
+}
+
+enum nss_status _nss_shadowidx_getgrgid_r (gid_t gid, struct group *gr,
+                                           char *buf, size_t buflen,
+                                           int *errnop)
+{
+	enum nss_status status;
+	char *line;
+
+	status = lookup (GROUP_FILE, NULL, gid, &line, errnop);
+	if (NSS_STATUS_SUCCESS == status) {
+		status = fill_group (line, gr, buf, buflen, errnop);
+		free (line);
+	}
+	return status;
+}
+
+/*
+ * _nss_shadowidx_initgroups_dyn - Add the groups which list user as a
+ *	member to *groupsp, except group.
+ *
+ *	*groupsp holds *start groups, and has room for *size groups. It is
+ *	grown as needed, up to limit groups if limit is positive.
+ */
+enum nss_status _nss_shadowidx_initgroups_dyn (const char *user, gid_t group,
+                                               long int *start,
+                                               long int *size,
+                                               gid_t **groupsp,
+                                               long int limit,
+                                               int *errnop)
+{
+	unsigned long *gids;
+	int count, i;
+	long int j;
+
+	(void) pthread_mutex_lock (&index_lock);
+	count = dbindex_member_gids (GROUP_FILE, user, &gids);
+	(void) pthread_mutex_unlock (&index_lock);
+	if (-1 == count) {
+		*errnop = ENOENT;
+		return NSS_STATUS_UNAVAIL;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (gids[i] == group) {
+			continue;
+		}
+		for (j = 0; j < *start; j++) {
+			if ((*groupsp)[j] == gids[i]) {
+				break;
+			}
+		}
+		if (j < *start) {
+			continue;
+		}
+		if (*start == *size) {
+			long int newsize = (0 == *size) ? 16 : *size * 2;
+			gid_t *groups;
+
+			if ((limit > 0) && (*size >= limit)) {
+				break;
+			}
+			if ((limit > 0) && (newsize > limit)) {
+				newsize = limit;
+			}
+			groups = realloc (*groupsp, newsize * sizeof *groups);
+			if (NULL == groups) {
+				free (gids);
+				*errnop = ENOMEM;
+				return NSS_STATUS_TRYAGAIN;
+			}
+			*groupsp = groups;
+			*size = newsize;
+		}
+		(*groupsp)[(*start)++] = gids[i];
+	}
+
+	free (gids);
+	return NSS_STATUS_SUCCESS;
+}
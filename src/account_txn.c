@@ -0,0 +1,113 @@
+/* SPDX-License-Identifier: BSD-3-Clause */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "account.h"
+#include "prototypes.h"
+
+/* Test program for the account transactions */
+
+const char *Prog;
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-a] operation...\n", Prog);
+	fprintf(stderr, "    Apply the operations in one transaction, where an operation is\n");
+	fprintf(stderr, "    groupadd name gid, groupdel name, useradd name uid gid or\n");
+	fprintf(stderr, "    userdel name; a uid or gid of - is allocated\n");
+	fprintf(stderr, "    If -a is given, the transaction is aborted instead of committed\n");
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long id_arg(const char *arg)
+{
+	if (strcmp(arg, "-") == 0)
+		return (unsigned long) -1;
+	return strtoul(arg, NULL, 10);
+}
+
+int main(int argc, char *argv[])
+{
+	struct account_txn *txn;
+	enum account_status status;
+	bool abort_txn = false;
+	int c, i;
+
+	Prog = Basename (argv[0]);
+	(void) account_init(Prog, stderr);
+	while ((c = getopt(argc, argv, "a")) != EOF) {
+		switch(c) {
+		case 'a': abort_txn = true; break;
+		default: usage();
+		}
+	}
+	if (optind == argc)
+		usage();
+
+	txn = account_txn_begin(&status);
+	if (NULL == txn) {
+		fprintf(stderr, "%s: %s\n", Prog, account_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = optind; i < argc; ) {
+		const char *op = argv[i];
+
+		if ((strcmp(op, "groupadd") == 0) && (i + 2 < argc)) {
+			struct account_group group = { 0 };
+			gid_t gid;
+
+			group.name = argv[i + 1];
+			group.gid = (gid_t) id_arg(argv[i + 2]);
+			status = account_group_add(txn, &group, &gid);
+			if (ACCOUNT_STATUS_SUCCESS == status)
+				printf("groupadd %s %lu: ", group.name, (unsigned long) gid);
+			else
+				printf("groupadd %s: ", group.name);
+			i += 3;
+		} else if ((strcmp(op, "useradd") == 0) && (i + 3 < argc)) {
+			struct account_user user = { 0 };
+			char home[256];
+			uid_t uid;
+
+			user.name = argv[i + 1];
+			user.uid = (uid_t) id_arg(argv[i + 2]);
+			user.gid = (gid_t) id_arg(argv[i + 3]);
+			snprintf(home, sizeof home, "/home/%s", user.name);
+			user.home = home;
+			user.shell = "/bin/sh";
+			status = account_user_add(txn, &user, &uid);
+			if (ACCOUNT_STATUS_SUCCESS == status)
+				printf("useradd %s %lu: ", user.name, (unsigned long) uid);
+			else
+				printf("useradd %s: ", user.name);
+			i += 4;
+		} else if ((strcmp(op, "userdel") == 0) && (i + 1 < argc)) {
+			status = account_user_del(txn, argv[i + 1]);
+			printf("userdel %s: ", argv[i + 1]);
+			i += 2;
+		} else if ((strcmp(op, "groupdel") == 0) && (i + 1 < argc)) {
+			status = account_group_del(txn, argv[i + 1]);
+			printf("groupdel %s: ", argv[i + 1]);
+			i += 2;
+		} else {
+			account_txn_abort(txn);
+			usage();
+		}
+		printf("%s\n", account_strerror(status));
+	}
+
+	if (abort_txn) {
+		account_txn_abort(txn);
+		return 0;
+	}
+	status = account_txn_commit(txn);
+	if (ACCOUNT_STATUS_SUCCESS != status) {
+		fprintf(stderr, "%s: %s\n", Prog, account_strerror(status));
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
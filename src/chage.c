@@ -14,6 +14,7 @@
 #include <ctype.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <setjmp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,7 @@
 #include <pwd.h>
 #include "prototypes.h"
 #include "defines.h"
+#include "getdef.h"
 #include "pwio.h"
 #include "shadowio.h"
 #include "shadowlog.h"
@@ -65,17 +67,34 @@ static long warndays;
 static long inactdays;
 static long expdate;
 
+/*
+ * --batch FILE changes the aging information of the users of the records
+ * of FILE, one set of chage arguments per line, with a single lock and
+ * write of the databases. While a record is processed, record_env is
+ * set, and the errors which would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+
+/* --select-* options: change the selected users instead of LOGIN */
+static struct user_selection selection = USER_SELECTION_INIT;
+
 /* local function prototypes */
 NORETURN static void usage (int status);
 static int new_fields (void);
 static void print_date (time_t date);
 static void list_fields (void);
+static void list_fields_structured (void);
 static void process_flags (int argc, char **argv);
 static void check_flags (int argc, int opt_index);
 static void check_perms (void);
 static void open_files (bool readonly);
 static void close_files (void);
 NORETURN static void fail_exit (int code);
+static void reject_in_record (const char *option);
+static int change_record (const struct batch_line *rec);
+static int change_batch (const char *file);
+static int change_selection (void);
 
 /*
  * fail_exit - do some cleanup and exit with the given error code
@@ -84,6 +103,11 @@ NORETURN
 static void
 fail_exit (int code)
 {
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
+	}
+
 	if (spw_locked) {
 		if (spw_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, spw_dbname ());
@@ -118,11 +142,20 @@ static void
 usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s --batch FILE\n"
+	                  "       %s [options] --select-... SELECTION\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog, Prog);
+	(void) fputs (_("      --batch FILE              change the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -d, --lastday LAST_DAY        set date of last password change to LAST_DAY\n"), usageout);
 	(void) fputs (_("  -E, --expiredate EXPIRE_DATE  set account expiration date to EXPIRE_DATE\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
@@ -130,11 +163,18 @@ usage (int status)
 	(void) fputs (_("  -I, --inactive INACTIVE       set password inactive after expiration\n"
 	                "                                to INACTIVE\n"), usageout);
 	(void) fputs (_("  -l, --list                    show account aging information\n"), usageout);
+	(void) fputs (_("      --format FORMAT           show the aging information in FORMAT\n"
+	                "                                (text, tsv or json) with -l\n"), usageout);
 	(void) fputs (_("  -m, --mindays MIN_DAYS        set minimum number of days before password\n"
 	                "                                change to MIN_DAYS\n"), usageout);
 	(void) fputs (_("  -M, --maxdays MAX_DAYS        set maximum number of days before password\n"
 	                "                                change to MAX_DAYS\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("      --select-uid RANGE        change the users with a UID in RANGE\n"), usageout);
+	(void) fputs (_("      --select-group GROUP      change the members of GROUP\n"), usageout);
+	(void) fputs (_("      --select-shell PATTERN    change the users with a shell matching PATTERN\n"), usageout);
+	(void) fputs (_("      --select-age DAYS         change the users whose password is at least\n"
+	                "                                DAYS days old\n"), usageout);
 	(void) fputs (_("  -W, --warndays WARN_DAYS      set expiration warning days to WARN_DAYS\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
@@ -248,6 +288,11 @@ static void list_fields (void)
 	long changed = 0;
 	long expires;
 
+	if (output_structured ()) {
+		list_fields_structured ();
+		return;
+	}
+
 	/*
 	 * The "last change" date is either "never" or the date the password
 	 * was last modified. The date is the number of days since 1/1/1970.
@@ -327,10 +372,87 @@ static void list_fields (void)
 	        warndays);
 }
 
+/*
+ * list_fields_structured - display the expiration fields for --format
+ *
+ *	The dates are in seconds since the epoch, null (or empty) when they
+ *	are never reached, and 0 when the password must be changed.
+ */
+static void list_fields_structured (void)
+{
+	static const char *const fields[] = {
+		"user", "last_change", "password_expires", "password_inactive",
+		"account_expires", "mindays", "maxdays", "warndays", NULL
+	};
+	long changed = 0;
+	bool never;
+
+	output_begin (fields);
+	output_str (user_name);
+
+	if (lstchgdate < 0 || lstchgdate > LONG_MAX / SCALE) {
+		output_str (NULL);
+	} else {
+		changed = lstchgdate * SCALE;
+		output_num (changed);
+	}
+
+	never =    (lstchgdate < 0)
+	        || (maxdays >= (10000 * (DAY / SCALE)))
+	        || (maxdays < 0)
+	        || ((LONG_MAX - changed) / SCALE < maxdays);
+	if (lstchgdate == 0) {
+		output_num (0);
+	} else if (never) {
+		output_str (NULL);
+	} else {
+		output_num (changed + maxdays * SCALE);
+	}
+
+	if (lstchgdate == 0) {
+		output_num (0);
+	} else if (   never
+	           || (inactdays < 0)
+	           || (maxdays > LONG_MAX - inactdays)
+	           || ((LONG_MAX - changed) / SCALE < maxdays + inactdays)) {
+		output_str (NULL);
+	} else {
+		output_num (changed + (maxdays + inactdays) * SCALE);
+	}
+
+	if (expdate < 0 || LONG_MAX / SCALE < expdate) {
+		output_str (NULL);
+	} else {
+		output_num (expdate * SCALE);
+	}
+
+	output_num (mindays);
+	output_num (maxdays);
+	output_num (warndays);
+	output_row_end ();
+	output_end ();
+}
+
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
+{
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
+	}
+}
+
 /*
  * process_flags - parse the command line options
  *
  *	It will not return if an error is encountered.
+ *
+ *	With --batch, the options of the command line are only the ones
+ *	common to all the records.
  */
 static void process_flags (int argc, char **argv)
 {
@@ -338,15 +460,23 @@ static void process_flags (int argc, char **argv)
 	 * Parse the command line options.
 	 */
 	int c;
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
 	static struct option long_options[] = {
+		{"batch",      required_argument, NULL, 201},
 		{"lastday",    required_argument, NULL, 'd'},
 		{"expiredate", required_argument, NULL, 'E'},
+		{"format",     required_argument, NULL, 200},
 		{"help",       no_argument,       NULL, 'h'},
 		{"inactive",   required_argument, NULL, 'I'},
 		{"list",       no_argument,       NULL, 'l'},
 		{"mindays",    required_argument, NULL, 'm'},
 		{"maxdays",    required_argument, NULL, 'M'},
 		{"root",       required_argument, NULL, 'R'},
+		{"select-uid", required_argument, NULL, 202},
+		{"select-group", required_argument, NULL, 203},
+		{"select-shell", required_argument, NULL, 204},
+		{"select-age", required_argument, NULL, 205},
 		{"warndays",   required_argument, NULL, 'W'},
 		{"iso8601",    no_argument,       NULL, 'i'},
 		{NULL, 0, NULL, '\0'}
@@ -354,7 +484,44 @@ static void process_flags (int argc, char **argv)
 
 	while ((c = getopt_long (argc, argv, "d:E:hiI:lm:M:R:W:",
 	                         long_options, NULL)) != -1) {
+		nopts++;
 		switch (c) {
+		case 201:
+			reject_in_record ("--batch");
+			batch_file = optarg;
+			batch_opts++;
+			break;
+		case 202:
+			reject_in_record ("--select-uid");
+			if (!select_uids (&selection, optarg)) {
+				fprintf (stderr,
+				         _("%s: Unknown user or range: %s\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+		case 203:
+			reject_in_record ("--select-group");
+			if (!select_group (&selection, optarg)) {
+				fprintf (stderr,
+				         _("%s: group '%s' does not exist\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+		case 204:
+			reject_in_record ("--select-shell");
+			select_shell (&selection, optarg);
+			break;
+		case 205:
+			reject_in_record ("--select-age");
+			if (!select_age (&selection, optarg)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
 		case 'd':
 			dflg = true;
 			lstchgdate = strtoday (optarg);
@@ -375,7 +542,17 @@ static void process_flags (int argc, char **argv)
 				usage (E_USAGE);
 			}
 			break;
+		case 200:
+			reject_in_record ("--format");
+			if (!output_set_format (optarg)) {
+				fprintf (stderr,
+				         _("%s: invalid output format '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
 		case 'h':
+			reject_in_record ("-h");
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
 		case 'i':
@@ -392,6 +569,7 @@ static void process_flags (int argc, char **argv)
 			}
 			break;
 		case 'l':
+			reject_in_record ("-l");
 			lflg = true;
 			break;
 		case 'm':
@@ -415,6 +593,8 @@ static void process_flags (int argc, char **argv)
 			}
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
+			reject_in_record ("-R");
+			batch_opts++;
 			break;
 		case 'W':
 			Wflg = true;
@@ -431,6 +611,17 @@ static void process_flags (int argc, char **argv)
 		}
 	}
 
+	/*
+	 * --batch only accepts -R, the other options are given in the
+	 * records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	check_flags (argc, optind);
 }
 
@@ -443,9 +634,22 @@ static void check_flags (int argc, int opt_index)
 {
 	/*
 	 * Make certain the flags do not conflict and that there is a user
-	 * name on the command line.
+	 * name on the command line, or a selection of users to change.
 	 */
 
+	if (selection.active) {
+		if ((argc != opt_index) || (NULL != batch_file) || lflg) {
+			usage (E_USAGE);
+		}
+		if (!mflg && !Mflg && !dflg && !Wflg && !Iflg && !Eflg) {
+			fprintf (stderr,
+			         _("%s: no aging information to change for the selected users\n"),
+			         Prog);
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	if (argc != opt_index + 1) {
 		usage (E_USAGE);
 	}
@@ -570,6 +774,7 @@ static void open_files (bool readonly)
 		}
 		spw_locked = true;
 	}
+	spw_compact ();
 	if (spw_open (readonly ? O_RDONLY: O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"), Prog, spw_dbname ());
@@ -726,6 +931,179 @@ static void get_defaults (/*@null@*/const struct spwd *sp)
 	}
 }
 
+/*
+ * change_record - change the aging information of the user of a --batch
+ *                 record
+ *
+ *	Return 0 on success, or the exit status of chage for this record.
+ */
+static int change_record (const struct batch_line *rec)
+{
+	const struct passwd *pw;
+	const struct spwd *sp;
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		dflg = Eflg = Iflg = mflg = Mflg = Wflg = false;
+		user_name[0] = '\0';
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+
+		/* Same as in main(), but not interactively */
+		if (!mflg && !Mflg && !dflg && !Wflg && !Iflg && !Eflg) {
+			fprintf (stderr,
+			         _("%s: line %u: no aging information to change\n"),
+			         Prog, rec->line);
+			fail_exit (E_USAGE);
+		}
+		pw = pw_locate (rec->argv[rec->argc - 1]);
+		if (NULL == pw) {
+			fprintf (stderr, _("%s: user '%s' does not exist in %s\n"),
+			         Prog, rec->argv[rec->argc - 1], pw_dbname ());
+			fail_exit (E_NOPERM);
+		}
+		STRFCPY (user_name, pw->pw_name);
+		user_uid = pw->pw_uid;
+
+		sp = spw_locate (user_name);
+		get_defaults (sp);
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "change aging information",
+		              user_name, user_uid, 1);
+#endif
+		update_age (sp, pw);
+	} else {
+		fprintf (stderr, _("%s: line %u: cannot change user '%s'\n"),
+		         Prog, rec->line,
+		         ('\0' != user_name[0]) ? user_name
+		                                : rec->argv[rec->argc - 1]);
+	}
+	record_env = NULL;
+
+	return code;
+}
+
+/*
+ * change_batch - change the aging information of the users of the
+ *                records of file
+ *
+ *	The records are checked and applied to the databases, which are
+ *	locked and written once. A record sees the changes of the previous
+ *	ones. If a record fails, the others are still checked, but no user
+ *	is changed.
+ *
+ *	Return the exit status of chage.
+ */
+static int change_batch (const char *file)
+{
+	struct batch_line *lines;
+	char **names;
+	size_t count;
+	size_t i;
+	int status = E_SUCCESS;
+	int code;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr, _("%s: --batch cannot be used with tcb enabled\n"),
+		         Prog);
+		closelog ();
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	if (batch_read (file, &lines, &count) != 0) {
+		closelog ();
+		exit (E_USAGE);
+	}
+	names = xmalloc ((count + 1) * sizeof *names);
+
+	open_files (false);
+
+	for (i = 0; i < count; i++) {
+		code = change_record (&lines[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+		names[i] = xstrdup (user_name);
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was changed\n"), Prog);
+		user_name[0] = '\0';
+		fail_exit (status);
+	}
+
+	close_files ();
+
+	for (i = 0; i < count; i++) {
+		SYSLOG ((LOG_INFO, "changed password expiry for %s", names[i]));
+	}
+
+	closelog ();
+	return E_SUCCESS;
+}
+
+/*
+ * change_selection - change the aging information of the selected users
+ *
+ *	The databases are locked and written once.
+ *
+ *	Return the exit status of chage.
+ */
+static int change_selection (void)
+{
+	const struct passwd *pw;
+	char **names = NULL;
+	size_t count = 0;
+	size_t i;
+
+	open_files (false);
+
+	(void) pw_rewind ();
+	while ((pw = pw_next ()) != NULL) {
+		const struct spwd *sp = spw_locate (pw->pw_name);
+
+		if (!select_user (&selection, pw, sp)) {
+			continue;
+		}
+		STRFCPY (user_name, pw->pw_name);
+		user_uid = pw->pw_uid;
+		get_defaults (sp);
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "change aging information",
+		              user_name, user_uid, 1);
+#endif
+		update_age (sp, pw);
+
+		if (0 == (count % 64)) {
+			names = realloc (names, (count + 64) * sizeof *names);
+			if (NULL == names) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				fail_exit (E_NOPERM);
+			}
+		}
+		names[count] = xstrdup (user_name);
+		count++;
+	}
+
+	close_files ();
+
+	if (0 == count) {
+		fprintf (stderr, _("%s: no user was selected\n"), Prog);
+	}
+	for (i = 0; i < count; i++) {
+		SYSLOG ((LOG_INFO, "changed password expiry for %s", names[i]));
+	}
+	closelog ();
+	return E_SUCCESS;
+}
+
 /*
  * chage - change a user's password aging information
  *
@@ -795,6 +1173,22 @@ int main (int argc, char **argv)
 		exit (E_SHADOW_NOTFOUND);
 	}
 
+	if (NULL != batch_file) {
+		return change_batch (batch_file);
+	}
+	if (selection.active) {
+#ifdef WITH_TCB
+		if (getdef_bool ("USE_TCB")) {
+			fprintf (stderr,
+			         _("%s: --select-* cannot be used with tcb enabled\n"),
+			         Prog);
+			closelog ();
+			exit (E_USAGE);
+		}
+#endif				/* WITH_TCB */
+		return change_selection ();
+	}
+
 	open_files (lflg);
 	/* Drop privileges */
 	if (lflg && (   (setregid (rgid, rgid) != 0)
@@ -2,6 +2,8 @@
 // usage is "[program] owner [u|g] start count
 // Exits 0 if owner has subid range starting start, of size count
 // Exits 1 otherwise.
+// With "[program] --stdin", reads one "owner [u|g] start count" query per
+// line, and answers "yes", "no", or "error" for each line.
 
 #include <config.h>
 #include <stdio.h>
@@ -20,6 +22,46 @@
 
 const char *Prog;
 
+/*
+ * query_stdin - answer the queries read from the standard input
+ *
+ * The databases are opened once, so that each query is a lookup in their
+ * indexes. Each answer is written as soon as its line is read.
+ */
+static int query_stdin(void)
+{
+	bool uid_open = false, gid_open = false;
+	char line[BUFSIZ];
+
+	while (fgets(line, sizeof line, stdin) != NULL) {
+		char owner[BUFSIZ];
+		char type;
+		unsigned long start, count;
+		const char *answer = "error";
+
+		if (sscanf(line, "%s %c %lu %lu", owner, &type, &start, &count) == 4
+		    && (type == 'u' || type == 'g')) {
+			if (type == 'u') {
+				if (!uid_open)
+					uid_open = sub_uid_open(O_RDONLY) != 0;
+				answer = have_sub_uids(owner, start, count) ? "yes" : "no";
+			} else {
+				if (!gid_open)
+					gid_open = sub_gid_open(O_RDONLY) != 0;
+				answer = have_sub_gids(owner, start, count) ? "yes" : "no";
+			}
+		}
+		puts(answer);
+		fflush(stdout);
+	}
+
+	if (uid_open)
+		sub_uid_close();
+	if (gid_open)
+		sub_gid_close();
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	char *owner;
@@ -29,6 +71,8 @@ int main(int argc, char **argv)
 	log_set_progname(Prog);
 	log_set_logfd(stderr);
 
+	if (argc == 2 && strcmp(argv[1], "--stdin") == 0)
+		return query_stdin();
 	if (argc != 5)
 		exit(1);
 
@@ -17,10 +17,9 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <getopt.h>
+#include <setjmp.h>
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
 #ifdef USE_PAM
 #include "pam_defs.h"
 #endif
@@ -49,6 +48,15 @@ static bool hflg = false;		/* -h - set home phone number        */
 static bool oflg = false;		/* -o - set other information        */
 static bool pw_locked = false;
 
+/*
+ * --batch FILE changes the GECOS information of the users of the records
+ * of FILE, one set of chfn arguments per line, with a single lock and
+ * write of the password file. While a record is processed, record_env
+ * is set, and the errors which would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+
 /*
  * External identifiers
  */
@@ -60,15 +68,26 @@ static bool may_change_field (int);
 static void new_fields (void);
 static char *copy_field (char *, char *, char *);
 static void process_flags (int argc, char **argv);
-static void check_perms (const struct passwd *pw);
+static void check_perms (/*@null@*/const struct passwd *pw);
+static void open_passwd (void);
+static void update_entry (const char *user, char *gecos);
+static void close_passwd (void);
 static void update_gecos (const char *user, char *gecos);
 static void get_old_fields (const char *gecos);
+static void reject_in_record (const char *option);
+static int change_record (const struct batch_line *rec);
+static int change_batch (const char *file);
 
 /*
  * fail_exit - exit with an error and do some cleanup
  */
 static void fail_exit (int code)
 {
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
+	}
+
 	if (pw_locked) {
 		if (pw_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
@@ -91,11 +110,19 @@ static void
 usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] [LOGIN]\n"
+	                  "       %s --batch FILE\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog);
+	(void) fputs (_("      --batch FILE              change the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -f, --full-name FULL_NAME     change user's full name\n"), usageout);
 	(void) fputs (_("  -h, --home-phone HOME_PHONE   change user's home phone number\n"), usageout);
 	(void) fputs (_("  -o, --other OTHER_INFO        change user's other GECOS information\n"), usageout);
@@ -237,15 +264,34 @@ static char *copy_field (char *in, char *out, char *extra)
 	return cp;
 }
 
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
+{
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
+	}
+}
+
 /*
  * process_flags - parse the command line options
  *
  *	It will not return if an error is encountered.
+ *
+ *	With --batch, the options of the command line are only the ones
+ *	common to all the records.
  */
 static void process_flags (int argc, char **argv)
 {
 	int c;		/* flag currently being processed    */
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
 	static struct option long_options[] = {
+		{"batch",      required_argument, NULL, 200},
 		{"full-name",  required_argument, NULL, 'f'},
 		{"home-phone", required_argument, NULL, 'h'},
 		{"other",      required_argument, NULL, 'o'},
@@ -265,12 +311,18 @@ static void process_flags (int argc, char **argv)
 	 */
 	while ((c = getopt_long (argc, argv, "f:h:o:r:R:uw:",
 	                         long_options, NULL)) != -1) {
+		nopts++;
 		switch (c) {
+		case 200:
+			reject_in_record ("--batch");
+			batch_file = optarg;
+			batch_opts++;
+			break;
 		case 'f':
 			if (!may_change_field ('f')) {
 				fprintf (stderr,
 				         _("%s: Permission denied.\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			fflg = true;
 			STRFCPY (fullnm, optarg);
@@ -279,7 +331,7 @@ static void process_flags (int argc, char **argv)
 			if (!may_change_field ('h')) {
 				fprintf (stderr,
 				         _("%s: Permission denied.\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			hflg = true;
 			STRFCPY (homeph, optarg);
@@ -288,13 +340,13 @@ static void process_flags (int argc, char **argv)
 			if (!amroot) {
 				fprintf (stderr,
 				         _("%s: Permission denied.\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			oflg = true;
 			if (strlen (optarg) > (unsigned int) 80) {
 				fprintf (stderr,
 				         _("%s: fields too long\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			STRFCPY (slop, optarg);
 			break;
@@ -302,21 +354,24 @@ static void process_flags (int argc, char **argv)
 			if (!may_change_field ('r')) {
 				fprintf (stderr,
 				         _("%s: Permission denied.\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			rflg = true;
 			STRFCPY (roomno, optarg);
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
+			reject_in_record ("-R");
+			batch_opts++;
 			break;
 		case 'u':
+			reject_in_record ("-u");
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
 		case 'w':
 			if (!may_change_field ('w')) {
 				fprintf (stderr,
 				         _("%s: Permission denied.\n"), Prog);
-				exit (E_NOPERM);
+				fail_exit (E_NOPERM);
 			}
 			wflg = true;
 			STRFCPY (workph, optarg);
@@ -325,6 +380,16 @@ static void process_flags (int argc, char **argv)
 			usage (E_USAGE);
 		}
 	}
+
+	/*
+	 * --batch only accepts -R, the other options are given in the
+	 * records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+	}
 }
 
 /*
@@ -335,9 +400,11 @@ static void process_flags (int argc, char **argv)
  *
  *	Non-root users must be authenticated.
  *
+ *	With --batch, pw is NULL, and only root is allowed.
+ *
  *	It will not return if the user is not allowed.
  */
-static void check_perms (const struct passwd *pw)
+static void check_perms (/*@null@*/const struct passwd *pw)
 {
 #ifdef USE_PAM
 	pam_handle_t *pamh = NULL;
@@ -349,7 +416,7 @@ static void check_perms (const struct passwd *pw)
 	 * Non-privileged users are only allowed to change the gecos field
 	 * if the UID of the user matches the current real UID.
 	 */
-	if (!amroot && pw->pw_uid != getuid ()) {
+	if (!amroot && ((NULL == pw) || (pw->pw_uid != getuid ()))) {
 		fprintf (stderr, _("%s: Permission denied.\n"), Prog);
 		closelog ();
 		exit (E_NOPERM);
@@ -359,7 +426,7 @@ static void check_perms (const struct passwd *pw)
 	 * If the UID of the user does not match the current real UID,
 	 * check if the change is allowed by SELinux policy.
 	 */
-	if ((pw->pw_uid != getuid ())
+	if (((NULL == pw) || (pw->pw_uid != getuid ()))
 	    && (check_selinux_permit ("chfn") != 0)) {
 		fprintf (stderr, _("%s: Permission denied.\n"), Prog);
 		closelog ();
@@ -374,7 +441,7 @@ static void check_perms (const struct passwd *pw)
 	 * any changes can be made. Idea from util-linux chfn/chsh.
 	 * --marekm
 	 */
-	if (!amroot && getdef_bool ("CHFN_AUTH")) {
+	if (!amroot && (NULL != pw) && getdef_bool ("CHFN_AUTH")) {
 		passwd_check (pw->pw_name, pw->pw_passwd, "chfn");
 	}
 
@@ -411,15 +478,10 @@ static void check_perms (const struct passwd *pw)
 }
 
 /*
- * update_gecos - update the gecos fields in the password database
- *
- *	Commit the user's entry after changing her gecos field.
+ * open_passwd - lock and open the password database
  */
-static void update_gecos (const char *user, char *gecos)
+static void open_passwd (void)
 {
-	const struct passwd *pw;	/* The user's password file entry */
-	struct passwd pwent;		/* modified password file entry */
-
 	/*
 	 * Before going any further, raise the ulimit to prevent colliding
 	 * into a lowered ulimit, and set the real UID to root to protect
@@ -449,6 +511,15 @@ static void update_gecos (const char *user, char *gecos)
 		         _("%s: cannot open %s\n"), Prog, pw_dbname ());
 		fail_exit (E_NOPERM);
 	}
+}
+
+/*
+ * update_entry - change the gecos field of user in the password database
+ */
+static void update_entry (const char *user, char *gecos)
+{
+	const struct passwd *pw;	/* The user's password file entry */
+	struct passwd pwent;		/* modified password file entry */
 
 	/*
 	 * Get the entry to update using pw_locate() - we want the real one
@@ -481,10 +552,13 @@ static void update_gecos (const char *user, char *gecos)
 		         Prog, pw_dbname (), pwent.pw_name);
 		fail_exit (E_NOPERM);
 	}
+}
 
-	/*
-	 * Changes have all been made, so commit them and unlock the file.
-	 */
+/*
+ * close_passwd - commit the changes and unlock the password database
+ */
+static void close_passwd (void)
+{
 	if (pw_close () == 0) {
 		fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, pw_dbname ());
 		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
@@ -498,6 +572,22 @@ static void update_gecos (const char *user, char *gecos)
 	pw_locked = false;
 }
 
+/*
+ * update_gecos - update the gecos fields in the password database
+ *
+ *	Commit the user's entry after changing her gecos field.
+ */
+static void update_gecos (const char *user, char *gecos)
+{
+	open_passwd ();
+	update_entry (user, gecos);
+
+	/*
+	 * Changes have all been made, so commit them and unlock the file.
+	 */
+	close_passwd ();
+}
+
 /*
  * get_old_fields - parse the old gecos and use the old value for the fields
  *                  which are not set on the command line
@@ -592,6 +682,133 @@ static void check_fields (void)
 	}
 }
 
+/*
+ * build_gecos - build the new GECOS field from its fields
+ *
+ *	It will not return if the fields are not valid, or do not fit.
+ */
+static void build_gecos (char *new_gecos, size_t size)
+{
+	/*
+	 * Check all of the fields for valid information
+	 */
+	check_fields ();
+
+	/*
+	 * Build the new GECOS field by plastering all the pieces together,
+	 * if they will fit ...
+	 */
+	if ((strlen (fullnm) + strlen (roomno) + strlen (workph) +
+	     strlen (homeph) + strlen (slop)) > (unsigned int) 80) {
+		fprintf (stderr, _("%s: fields too long\n"), Prog);
+		fail_exit (E_NOPERM);
+	}
+	snprintf (new_gecos, size, "%s,%s,%s,%s%s%s",
+	          fullnm, roomno, workph, homeph,
+	          ('\0' != slop[0]) ? "," : "", slop);
+}
+
+/*
+ * change_record - change the GECOS information of the user of a --batch
+ *                 record
+ *
+ *	Return 0 on success, or the exit status of chfn for this record.
+ */
+static int change_record (const struct batch_line *rec)
+{
+	const struct passwd *pw;
+	char new_gecos[BUFSIZ];
+	const char *user = rec->argv[rec->argc - 1];
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		fflg = rflg = wflg = hflg = oflg = false;
+		fullnm[0] = roomno[0] = workph[0] = homeph[0] = slop[0] = '\0';
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+		if (optind != rec->argc - 1) {
+			usage (E_USAGE);
+		}
+
+		/* Same as in main(), but not interactively */
+		if (!fflg && !rflg && !wflg && !hflg && !oflg) {
+			fprintf (stderr,
+			         _("%s: line %u: no information to change\n"),
+			         Prog, rec->line);
+			fail_exit (E_USAGE);
+		}
+		pw = pw_locate (user);
+		if (NULL == pw) {
+			fprintf (stderr,
+			         _("%s: user '%s' does not exist in %s\n"),
+			         Prog, user, pw_dbname ());
+			fail_exit (E_NOPERM);
+		}
+		get_old_fields (pw->pw_gecos);
+		build_gecos (new_gecos, sizeof new_gecos);
+		update_entry (user, new_gecos);
+	} else {
+		fprintf (stderr, _("%s: line %u: cannot change user '%s'\n"),
+		         Prog, rec->line, user);
+	}
+	record_env = NULL;
+
+	return code;
+}
+
+/*
+ * change_batch - change the GECOS information of the users of the
+ *                records of file
+ *
+ *	The records are checked and applied to the password database,
+ *	which is locked and written once. A record sees the changes of the
+ *	previous ones. If a record fails, the others are still checked,
+ *	but no user is changed.
+ *
+ *	Return the exit status of chfn.
+ */
+static int change_batch (const char *file)
+{
+	struct batch_line *lines;
+	size_t count;
+	size_t i;
+	int status = E_SUCCESS;
+	int code;
+
+	check_perms (NULL);
+
+	if (batch_read (file, &lines, &count) != 0) {
+		fail_exit (E_USAGE);
+	}
+
+	open_passwd ();
+
+	for (i = 0; i < count; i++) {
+		code = change_record (&lines[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was changed\n"), Prog);
+		fail_exit (status);
+	}
+
+	close_passwd ();
+
+	for (i = 0; i < count; i++) {
+		SYSLOG ((LOG_INFO, "changed user '%s' information",
+		         lines[i].argv[lines[i].argc - 1]));
+	}
+
+	closelog ();
+	return E_SUCCESS;
+}
+
 /*
  * chfn - change a user's password file information
  *
@@ -640,6 +857,10 @@ int main (int argc, char **argv)
 	/* parse the command line options */
 	process_flags (argc, argv);
 
+	if (NULL != batch_file) {
+		return change_batch (batch_file);
+	}
+
 	/*
 	 * Get the name of the user to check. It is either the command line
 	 * name, or the name getlogin() returns.
@@ -705,32 +926,13 @@ int main (int argc, char **argv)
 		new_fields ();
 	}
 
-	/*
-	 * Check all of the fields for valid information
-	 */
-	check_fields ();
-
-	/*
-	 * Build the new GECOS field by plastering all the pieces together,
-	 * if they will fit ...
-	 */
-	if ((strlen (fullnm) + strlen (roomno) + strlen (workph) +
-	     strlen (homeph) + strlen (slop)) > (unsigned int) 80) {
-		fprintf (stderr, _("%s: fields too long\n"), Prog);
-		fail_exit (E_NOPERM);
-	}
-	snprintf (new_gecos, sizeof new_gecos, "%s,%s,%s,%s%s%s",
-	          fullnm, roomno, workph, homeph,
-	          ('\0' != slop[0]) ? "," : "", slop);
+	build_gecos (new_gecos, sizeof new_gecos);
 
 	/* Rewrite the user's gecos in the passwd file */
 	update_gecos (user, new_gecos);
 
 	SYSLOG ((LOG_INFO, "changed user '%s' information", user));
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
-
 	closelog ();
 	exit (E_SUCCESS);
 }
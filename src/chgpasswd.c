@@ -22,8 +22,6 @@
 #endif				/* USE_PAM */
 #endif				/* ACCT_TOOLS_SETUID */
 #include "defines.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "groupio.h"
 #ifdef	SHADOWGRP
@@ -61,6 +59,27 @@ static bool sgr_locked = false;
 #endif
 static bool gr_locked = false;
 
+#ifdef HAVE_CRYPT_R
+/*
+ * With -j, the passwords are encrypted by a batch of lib/encrypt.c
+ * while the next lines are read. The entries get a locked password
+ * meanwhile, and the encrypted passwords are stored in the order of the
+ * input after the last line.
+ */
+struct crypt_job {
+	int line;
+	char *name;
+	bool update_sgr;	/* encrypted password in the gshadow entry */
+	bool update_gr;		/* encrypted password in the group entry */
+};
+
+static long crypt_threads = 1;
+static /*@null@*/struct crypt_batch *crypt_batch = NULL;
+static /*@null@*/struct crypt_job *crypt_jobs = NULL;
+static size_t crypt_njobs = 0;
+static size_t crypt_jobs_size = 0;
+#endif				/* HAVE_CRYPT_R */
+
 /* local function prototypes */
 static void fail_exit (int code);
 NORETURN static void usage (int status);
@@ -122,8 +141,13 @@ usage (int status)
 	                " YESCRYPT"
 #endif
 	               );
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -e, --encrypted               supplied passwords are encrypted\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+#ifdef HAVE_CRYPT_R
+	(void) fputs (_("  -j, --jobs JOBS               encrypt the passwords in JOBS threads\n"), usageout);
+#endif				/* HAVE_CRYPT_R */
 	(void) fputs (_("  -m, --md5                     encrypt the clear text password using\n"
 	                "                                the MD5 algorithm\n"),
 	              usageout);
@@ -151,8 +175,12 @@ static void process_flags (int argc, char **argv)
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
 	static struct option long_options[] = {
 		{"crypt-method", required_argument, NULL, 'c'},
+		{"deadline",     required_argument, NULL, 200},
 		{"encrypted",    no_argument,       NULL, 'e'},
 		{"help",         no_argument,       NULL, 'h'},
+#ifdef HAVE_CRYPT_R
+		{"jobs",         required_argument, NULL, 'j'},
+#endif				/* HAVE_CRYPT_R */
 		{"md5",          no_argument,       NULL, 'm'},
 		{"root",         required_argument, NULL, 'R'},
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
@@ -162,11 +190,14 @@ static void process_flags (int argc, char **argv)
 	};
 	while ((c = getopt_long (argc, argv,
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
-	                         "c:ehmR:s:",
+	                         "c:ehmR:s:"
 #else
-	                         "c:ehmR:",
+	                         "c:ehmR:"
 #endif
-	                         long_options, NULL)) != -1) {
+#ifdef HAVE_CRYPT_R
+	                         "j:"
+#endif				/* HAVE_CRYPT_R */
+	                         , long_options, NULL)) != -1) {
 		switch (c) {
 		case 'c':
 			crypt_method = optarg;
@@ -177,11 +208,25 @@ static void process_flags (int argc, char **argv)
 		case 'h':
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
+#ifdef HAVE_CRYPT_R
+		case 'j':
+			if (   (getlong (optarg, &crypt_threads) == 0)
+			    || (crypt_threads < 1)
+			    || (crypt_threads > 1024)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+#endif				/* HAVE_CRYPT_R */
 		case 'm':
 			md5flg = true;
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
 			break;
+		case 200: /* no-op, handled in process_deadline_flag () */
+			break;
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
 		case 's':
 			sflg = true;
@@ -336,6 +381,7 @@ static void open_files (void)
 		fail_exit (1);
 	}
 	gr_locked = true;
+	gr_compact ();
 	if (gr_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"), Prog, gr_dbname ());
@@ -352,6 +398,7 @@ static void open_files (void)
 			fail_exit (1);
 		}
 		sgr_locked = true;
+		sgr_compact ();
 		if (sgr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr, _("%s: cannot open %s\n"),
 			         Prog, sgr_dbname ());
@@ -399,12 +446,127 @@ static void close_files (void)
 	gr_locked = false;
 }
 
+#ifdef HAVE_CRYPT_R
+/*
+ * queue_crypt - queue the encryption of the password of a line
+ *
+ * Return 0 if successful.
+ */
+static int queue_crypt (const char *name, const char *password,
+                        const char *salt, bool update_sgr, bool update_gr,
+                        int line)
+{
+	struct crypt_job *job;
+
+	if (crypt_njobs == crypt_jobs_size) {
+		size_t size = (0 == crypt_jobs_size) ? 256 : crypt_jobs_size * 2;
+		struct crypt_job *jobs;
+
+		jobs = realloc (crypt_jobs, size * sizeof *jobs);
+		if (NULL == jobs) {
+			goto fail;
+		}
+		crypt_jobs = jobs;
+		crypt_jobs_size = size;
+	}
+	job = &crypt_jobs[crypt_njobs];
+	job->line = line;
+	job->update_sgr = update_sgr;
+	job->update_gr = update_gr;
+	job->name = strdup (name);
+	if (NULL == job->name) {
+		goto fail;
+	}
+	if (crypt_batch_add (crypt_batch, password, salt) == -1) {
+		free (job->name);
+		goto fail;
+	}
+	crypt_njobs++;
+	return 0;
+
+      fail:
+	fprintf (stderr, _("%s: line %d: %s\n"), Prog, line, strerror (errno));
+	return -1;
+}
+
+/*
+ * apply_crypt_jobs - wait for the encrypted passwords and store them in
+ *                    the order of the input
+ *
+ * Return the number of errors.
+ */
+static int apply_crypt_jobs (void)
+{
+	int errors = 0;
+	size_t i;
+
+	crypt_batch_finish (crypt_batch);
+
+	for (i = 0; i < crypt_njobs; i++) {
+		struct crypt_job *job = &crypt_jobs[i];
+		const char *salt;
+		const char *hash;
+		int err;
+
+		hash = crypt_batch_hash (crypt_batch, i, &salt, &err);
+		if (NULL == hash) {
+			fprintf (stderr,
+			         _("%s: failed to crypt password with salt '%s': %s\n"),
+			         Prog, salt, strerror (err));
+			fail_exit (1);
+		}
+#ifdef SHADOWGRP
+		if (job->update_sgr) {
+			const struct sgrp *sg = sgr_locate (job->name);
+			struct sgrp newsg;
+
+			if (NULL != sg) {
+				newsg = *sg;
+				newsg.sg_passwd = (char *) hash;
+			}
+			if ((NULL == sg) || (sgr_update (&newsg) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+				         Prog, job->line, sgr_dbname (), job->name);
+				errors++;
+			}
+		}
+#endif
+		if (job->update_gr) {
+			const struct group *gr = gr_locate (job->name);
+			struct group newgr;
+
+			if (NULL != gr) {
+				newgr = *gr;
+				newgr.gr_passwd = (char *) hash;
+			}
+			if ((NULL == gr) || (gr_update (&newgr) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+				         Prog, job->line, gr_dbname (), job->name);
+				errors++;
+			}
+		}
+		free (job->name);
+	}
+
+	crypt_batch_free (crypt_batch);
+	crypt_batch = NULL;
+	free (crypt_jobs);
+	crypt_jobs = NULL;
+	crypt_njobs = 0;
+	crypt_jobs_size = 0;
+	return errors;
+}
+#endif				/* HAVE_CRYPT_R */
+
 int main (int argc, char **argv)
 {
-	char buf[BUFSIZ];
+	char *buf;
 	char *name;
 	char *newpwd;
 	char *cp;
+	const char *salt = NULL;
 
 #ifdef	SHADOWGRP
 	const struct sgrp *sg;
@@ -425,6 +587,7 @@ int main (int argc, char **argv)
 	(void) textdomain (PACKAGE);
 
 	process_root_flag ("-R", argc, argv);
+	process_deadline_flag (argc, argv);
 
 	process_flags (argc, argv);
 
@@ -436,14 +599,30 @@ int main (int argc, char **argv)
 	is_shadow_grp = sgr_file_present ();
 #endif
 
+	/* The lines, with their clear text passwords, are read in a slot */
+	buf = secret_alloc ();
+	if (NULL == buf) {
+		fprintf (stderr, _("%s: out of memory\n"), Prog);
+		exit (1);
+	}
+
 	open_files ();
 
+#ifdef HAVE_CRYPT_R
+	if (   (crypt_threads > 1)
+	    && (!eflg)
+	    && (   (NULL == crypt_method)
+	        || (0 != strcmp (crypt_method, "NONE")))) {
+		crypt_batch = crypt_batch_start (crypt_threads);
+	}
+#endif				/* HAVE_CRYPT_R */
+
 	/*
 	 * Read each line, separating the group name from the password. The
 	 * group entry for each group will be looked up in the appropriate
 	 * file (gshadow or group) and the password changed.
 	 */
-	while (fgets (buf, (int) sizeof buf, stdin) != NULL) {
+	while (fgets (buf, BUFSIZ, stdin) != NULL) {
 		line++;
 		cp = strrchr (buf, '\n');
 		if (NULL != cp) {
@@ -481,7 +660,6 @@ int main (int argc, char **argv)
 		    && (   (NULL == crypt_method)
 		        || (0 != strcmp (crypt_method, "NONE")))) {
 			void *arg = NULL;
-			const char *salt;
 			if (md5flg) {
 				crypt_method = "MD5";
 			}
@@ -506,6 +684,12 @@ int main (int argc, char **argv)
 			}
 #endif
 			salt = crypt_make_salt (crypt_method, arg);
+#ifdef HAVE_CRYPT_R
+			if (NULL != crypt_batch) {
+				/* Encrypted by the batch, see apply_crypt_jobs */
+				cp = "!";
+			} else
+#endif				/* HAVE_CRYPT_R */
 			cp = pw_encrypt (newpwd, salt);
 			if (NULL == cp) {
 				fprintf (stderr,
@@ -600,8 +784,31 @@ int main (int argc, char **argv)
 				continue;
 			}
 		}
+#ifdef HAVE_CRYPT_R
+		if (   (NULL != crypt_batch)
+		    && (queue_crypt (name, newpwd, salt,
+#ifdef SHADOWGRP
+		                     NULL != sg,
+		                     (NULL == sg)
+		                     || (strcmp (gr->gr_passwd, SHADOW_PASSWD_STRING) != 0),
+#else
+		                     false, true,
+#endif
+		                     line) != 0)) {
+			errors++;
+			continue;
+		}
+#endif				/* HAVE_CRYPT_R */
 	}
 
+	secret_free (buf);
+
+#ifdef HAVE_CRYPT_R
+	if (NULL != crypt_batch) {
+		errors += apply_crypt_jobs ();
+	}
+#endif				/* HAVE_CRYPT_R */
+
 	/*
 	 * Any detected errors will cause the entire set of changes to be
 	 * aborted. Unlocking the group file will cause all of the
@@ -617,9 +824,6 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 	return (0);
 }
 
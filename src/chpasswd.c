@@ -54,10 +54,40 @@ static long bcrypt_rounds = 13;
 static long yescrypt_cost = 5;
 #endif
 
+static long commit_lines = 0;	/* 0: commit when the input ends */
+static bool validate_first = false;	/* check the input before locking */
+#ifndef USE_PAM
+static bool check_quality = false;	/* reject the weak passwords */
+#endif				/* !USE_PAM */
+
+static bool sorted_input = false;	/* input sorted by user name */
+static /*@null@*/ /*@only@*/char *last_name = NULL;
+
 static bool is_shadow_pwd;
 static bool pw_locked = false;
 static bool spw_locked = false;
 
+#ifdef HAVE_CRYPT_R
+/*
+ * With -j, the passwords are encrypted by a batch of lib/encrypt.c
+ * while the next lines are read. The entries get a locked password
+ * meanwhile, and the encrypted passwords are stored in the order of the
+ * input after the last line.
+ */
+struct crypt_job {
+	int line;
+	char *name;
+	bool update_spw;	/* encrypted password in the shadow entry */
+	bool update_pw;		/* encrypted password in the passwd entry */
+};
+
+static long crypt_threads = 1;
+static /*@null@*/struct crypt_batch *crypt_batch = NULL;
+static /*@null@*/struct crypt_job *crypt_jobs = NULL;
+static size_t crypt_njobs = 0;
+static size_t crypt_jobs_size = 0;
+#endif				/* HAVE_CRYPT_R */
+
 /* local function prototypes */
 static void fail_exit (int code);
 NORETURN static void usage (int status);
@@ -117,8 +147,18 @@ usage (int status)
 	                " YESCRYPT"
 #endif
 	               );
+#ifndef USE_PAM
+	(void) fputs (_("      --check-quality           reject the passwords which obscure\n"
+	                "                                checks would reject\n"), usageout);
+#endif				/* !USE_PAM */
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -e, --encrypted               supplied passwords are encrypted\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+#ifdef HAVE_CRYPT_R
+	(void) fputs (_("  -j, --jobs JOBS               encrypt the passwords in JOBS threads\n"), usageout);
+#endif				/* HAVE_CRYPT_R */
+	(void) fputs (_("  -l, --commit-lines LINES      commit the changes every LINES lines\n"), usageout);
 	(void) fputs (_("  -m, --md5                     encrypt the clear text password using\n"
 	                "                                the MD5 algorithm\n"),
 	              usageout);
@@ -128,6 +168,9 @@ usage (int status)
 	                "                                or YESCRYPT crypt algorithms\n"),
 	              usageout);
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
+	(void) fputs (_("      --sorted-input            the lines are sorted by user name\n"), usageout);
+	(void) fputs (_("      --validate-first          check all the lines before locking the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs ("\n", usageout);
 
 	exit (status);
@@ -146,23 +189,36 @@ static void process_flags (int argc, char **argv)
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
 	static struct option long_options[] = {
 		{"crypt-method", required_argument, NULL, 'c'},
+		{"deadline",     required_argument, NULL, 203},
 		{"encrypted",    no_argument,       NULL, 'e'},
 		{"help",         no_argument,       NULL, 'h'},
+#ifdef HAVE_CRYPT_R
+		{"jobs",         required_argument, NULL, 'j'},
+#endif				/* HAVE_CRYPT_R */
+		{"commit-lines", required_argument, NULL, 'l'},
 		{"md5",          no_argument,       NULL, 'm'},
 		{"root",         required_argument, NULL, 'R'},
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
 		{"sha-rounds",   required_argument, NULL, 's'},
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
+		{"validate-first", no_argument,     NULL, 200},
+#ifndef USE_PAM
+		{"check-quality", no_argument,      NULL, 201},
+#endif				/* !USE_PAM */
+		{"sorted-input", no_argument,       NULL, 202},
 		{NULL, 0, NULL, '\0'}
 	};
 
 	while ((c = getopt_long (argc, argv,
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
-	                         "c:ehmR:s:",
+	                         "c:ehl:mR:s:"
 #else
-	                         "c:ehmR:",
+	                         "c:ehl:mR:"
 #endif
-	                         long_options, NULL)) != -1) {
+#ifdef HAVE_CRYPT_R
+	                         "j:"
+#endif				/* HAVE_CRYPT_R */
+	                         , long_options, NULL)) != -1) {
 		switch (c) {
 		case 'c':
 			crypt_method = optarg;
@@ -173,11 +229,45 @@ static void process_flags (int argc, char **argv)
 		case 'h':
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
+#ifdef HAVE_CRYPT_R
+		case 'j':
+			if (   (getlong (optarg, &crypt_threads) == 0)
+			    || (crypt_threads < 1)
+			    || (crypt_threads > 1024)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+#endif				/* HAVE_CRYPT_R */
+		case 'l':
+			if (   (getlong (optarg, &commit_lines) == 0)
+			    || (commit_lines < 1)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
 		case 'm':
 			md5flg = true;
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
 			break;
+		case 203: /* no-op, handled in process_deadline_flag () */
+			break;
+		case 200:
+			validate_first = true;
+			break;
+#ifndef USE_PAM
+		case 201:
+			check_quality = true;
+			break;
+#endif				/* !USE_PAM */
+		case 202:
+			sorted_input = true;
+			break;
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
 		case 's':
 			sflg = true;
@@ -243,6 +333,15 @@ static void check_flags (void)
 		usage (E_USAGE);
 	}
 
+#ifndef USE_PAM
+	if (check_quality && eflg) {
+		fprintf (stderr,
+		         _("%s: the %s and %s flags are exclusive\n"),
+		         Prog, "--check-quality", "-e");
+		usage (E_USAGE);
+	}
+#endif				/* !USE_PAM */
+
 	if (cflg) {
 		if ((!IS_CRYPT_METHOD("DES"))
 		    &&(!IS_CRYPT_METHOD("MD5"))
@@ -396,6 +495,269 @@ static void close_files (void)
 	pw_locked = false;
 }
 
+/*
+ * locate_pw, locate_spw - find the entry of a user of the input
+ *
+ *	With --sorted-input, the databases are read along with the input,
+ *	see commonio_locate_sorted().
+ */
+static /*@observer@*/ /*@null@*/const struct passwd *locate_pw (const char *name)
+{
+	return sorted_input ? pw_locate_sorted (name) : pw_locate (name);
+}
+
+static /*@observer@*/ /*@null@*/const struct spwd *locate_spw (const char *name)
+{
+	return sorted_input ? spw_locate_sorted (name) : spw_locate (name);
+}
+
+/*
+ * check_order - check that the user of a line comes after the user of
+ *               the previous line, with --sorted-input
+ *
+ * Return false if the input is not sorted.
+ */
+static bool check_order (const char *name, int line)
+{
+	if (!sorted_input) {
+		return true;
+	}
+	if (   (NULL != last_name)
+	    && (sorted_keycmp (last_name, strlen (last_name),
+	                       name, strlen (name)) >= 0)) {
+		fprintf (stderr,
+		         _("%s: line %d: user '%s' is not sorted after '%s'\n"),
+		         Prog, line, name, last_name);
+		return false;
+	}
+	free (last_name);
+	last_name = xstrdup (name);
+	return true;
+}
+
+#ifndef USE_PAM
+/*
+ * check_password - check the quality of a new password for
+ *                  --check-quality
+ *
+ *	The previous password is not known. This is called by the threads
+ *	of the batch.
+ */
+static /*@observer@*//*@null@*/const char *check_password (const char *clear)
+{
+	return obscure_check ("", clear, NULL);
+}
+#endif				/* !USE_PAM */
+
+#ifdef HAVE_CRYPT_R
+/*
+ * start_crypt_batch - start the batch which encrypts the passwords
+ */
+static void start_crypt_batch (void)
+{
+	crypt_batch = crypt_batch_start (crypt_threads);
+#ifndef USE_PAM
+	if ((NULL != crypt_batch) && check_quality) {
+		crypt_batch_set_check (crypt_batch, check_password);
+	}
+#endif				/* !USE_PAM */
+}
+
+/*
+ * queue_crypt - queue the encryption of the password of a line
+ *
+ * Return 0 if successful.
+ */
+static int queue_crypt (const char *name, const char *password,
+                        const char *salt, bool update_spw, bool update_pw,
+                        int line)
+{
+	struct crypt_job *job;
+
+	if (crypt_njobs == crypt_jobs_size) {
+		size_t size = (0 == crypt_jobs_size) ? 256 : crypt_jobs_size * 2;
+		struct crypt_job *jobs;
+
+		jobs = realloc (crypt_jobs, size * sizeof *jobs);
+		if (NULL == jobs) {
+			goto fail;
+		}
+		crypt_jobs = jobs;
+		crypt_jobs_size = size;
+	}
+	job = &crypt_jobs[crypt_njobs];
+	job->line = line;
+	job->update_spw = update_spw;
+	job->update_pw = update_pw;
+	job->name = strdup (name);
+	if (NULL == job->name) {
+		goto fail;
+	}
+	if (crypt_batch_add (crypt_batch, password, salt) == -1) {
+		free (job->name);
+		goto fail;
+	}
+	crypt_njobs++;
+	return 0;
+
+      fail:
+	fprintf (stderr, _("%s: line %d: %s\n"), Prog, line, strerror (errno));
+	return -1;
+}
+
+/*
+ * apply_crypt_jobs - wait for the encrypted passwords and store them in
+ *                    the order of the input
+ *
+ * Return the number of errors.
+ */
+static int apply_crypt_jobs (void)
+{
+	int errors = 0;
+	size_t i;
+
+	crypt_batch_finish (crypt_batch);
+
+	if (sorted_input) {
+		/* The jobs are in the order of the input */
+		(void) pw_rewind ();
+		(void) spw_rewind ();
+	}
+	for (i = 0; i < crypt_njobs; i++) {
+		struct crypt_job *job = &crypt_jobs[i];
+		const char *salt;
+		const char *hash;
+		const char *msg;
+		int err;
+
+		msg = crypt_batch_rejected (crypt_batch, i);
+		if (NULL != msg) {
+			fprintf (stderr,
+			         _("%s: line %d: bad password for user '%s': %s\n"),
+			         Prog, job->line, job->name, msg);
+			errors++;
+			free (job->name);
+			continue;
+		}
+		hash = crypt_batch_hash (crypt_batch, i, &salt, &err);
+		if (NULL == hash) {
+			fprintf (stderr,
+			         _("%s: failed to crypt password with salt '%s': %s\n"),
+			         Prog, salt, strerror (err));
+			fail_exit (1);
+		}
+		if (job->update_spw) {
+			const struct spwd *sp = locate_spw (job->name);
+			struct spwd newsp;
+
+			if (NULL != sp) {
+				newsp = *sp;
+				newsp.sp_pwdp = (char *) hash;
+			}
+			if ((NULL == sp) || (spw_update (&newsp) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+				         Prog, job->line, spw_dbname (), job->name);
+				errors++;
+			}
+		}
+		if (job->update_pw) {
+			const struct passwd *pw = locate_pw (job->name);
+			struct passwd newpw;
+
+			if (NULL != pw) {
+				newpw = *pw;
+				newpw.pw_passwd = (char *) hash;
+			}
+			if ((NULL == pw) || (pw_update (&newpw) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: failed to prepare the new %s entry '%s'\n"),
+				         Prog, job->line, pw_dbname (), job->name);
+				errors++;
+			}
+		}
+		free (job->name);
+	}
+
+	crypt_batch_free (crypt_batch);
+	crypt_batch = NULL;
+	free (crypt_jobs);
+	crypt_jobs = NULL;
+	crypt_njobs = 0;
+	crypt_jobs_size = 0;
+	return errors;
+}
+#endif				/* HAVE_CRYPT_R */
+
+/*
+ * commit_changes - write the changes of the lines read so far
+ *
+ *	The databases are unlocked and locked again, and the next lines
+ *	are applied to a fresh copy of the databases. This bounds the
+ *	memory used for the changes and the time the databases are kept
+ *	locked.
+ *
+ *	It will not return if an error was detected.
+ */
+static void commit_changes (int errors)
+{
+#ifdef HAVE_CRYPT_R
+	bool crypt_restart = (NULL != crypt_batch);
+
+	if (NULL != crypt_batch) {
+		errors += apply_crypt_jobs ();
+	}
+#endif				/* HAVE_CRYPT_R */
+	if (0 != errors) {
+		fprintf (stderr,
+		         _("%s: error detected, changes ignored\n"),
+		         Prog);
+		fail_exit (1);
+	}
+
+	close_files ();
+	open_files ();
+
+#ifdef HAVE_CRYPT_R
+	if (crypt_restart) {
+		start_crypt_batch ();
+	}
+#endif				/* HAVE_CRYPT_R */
+}
+
+/*
+ * check_line - check a line of the input before the databases are locked
+ *
+ *	The line must have a password, and its user must exist.
+ *
+ *	This is called by several threads, see validate_input().
+ */
+static bool check_line (char *buf, int line, char *err, size_t errsize)
+{
+	char pwbuf[BUFSIZ];
+	struct passwd pwent;
+	struct passwd *pw = NULL;
+	char *cp;
+
+	cp = strchr (buf, ':');
+	if (NULL == cp) {
+		(void) snprintf (err, errsize,
+		                 _("%s: line %d: missing new password\n"),
+		                 Prog, line);
+		return false;
+	}
+	*cp = '\0';
+
+	if (   (getpwnam_r (buf, &pwent, pwbuf, sizeof pwbuf, &pw) != 0)
+	    || (NULL == pw)) {
+		(void) snprintf (err, errsize,
+		                 _("%s: line %d: user '%s' does not exist\n"),
+		                 Prog, line, buf);
+		return false;
+	}
+	return true;
+}
+
 static const char *get_salt(void)
 {
 	void *arg = NULL;
@@ -431,7 +793,7 @@ static const char *get_salt(void)
 
 int main (int argc, char **argv)
 {
-	char buf[BUFSIZ];
+	char *buf;
 	char *name;
 	char *newpwd;
 	char *cp;
@@ -443,6 +805,7 @@ int main (int argc, char **argv)
 
 	int errors = 0;
 	int line = 0;
+	FILE *input = stdin;
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
@@ -456,6 +819,7 @@ int main (int argc, char **argv)
 
 	salt = get_salt();
 	process_root_flag ("-R", argc, argv);
+	process_deadline_flag (argc, argv);
 
 #ifdef USE_PAM
 	if (md5flg || eflg || cflg) {
@@ -467,13 +831,46 @@ int main (int argc, char **argv)
 
 	check_perms ();
 
+	/*
+	 * With --validate-first, the whole input is checked while no
+	 * database is locked, and the lines are then read from memory.
+	 */
+	if (validate_first) {
+		input = validate_input (stdin, check_line);
+		if (NULL == input) {
+			fprintf (stderr,
+			         _("%s: error detected, changes ignored\n"),
+			         Prog);
+			exit (1);
+		}
+	}
+
+	/* The lines, with their clear text passwords, are read in a slot */
+	buf = secret_alloc ();
+	if (NULL == buf) {
+		fprintf (stderr, _("%s: out of memory\n"), Prog);
+		exit (1);
+	}
+
 #ifdef USE_PAM
 	if (!use_pam)
 #endif				/* USE_PAM */
 	{
 		is_shadow_pwd = spw_file_present ();
 
+#ifndef USE_PAM
+		if (check_quality) {
+			obscure_preload ();
+		}
+#endif				/* !USE_PAM */
+
 		open_files ();
+
+#ifdef HAVE_CRYPT_R
+		if ((crypt_threads > 1) && (NULL != salt)) {
+			start_crypt_batch ();
+		}
+#endif				/* HAVE_CRYPT_R */
 	}
 
 	/*
@@ -484,28 +881,27 @@ int main (int argc, char **argv)
 	 * last change date is set in the age only if aging information is
 	 * present.
 	 */
-	while (fgets (buf, sizeof buf, stdin) != NULL) {
+	while (fgets (buf, (int) SECRET_SIZE, input) != NULL) {
+#ifdef USE_PAM
+		if (!use_pam)
+#endif				/* USE_PAM */
+		if ((0 != commit_lines) && (0 != line) && (0 == (line % commit_lines))) {
+			commit_changes (errors);
+		}
+
 		line++;
 		cp = strrchr (buf, '\n');
 		if (NULL != cp) {
 			*cp = '\0';
-		} else {
-			if (feof (stdin) == 0) {
-
-				// Drop all remaining characters on this line.
-				while (fgets (buf, sizeof buf, stdin) != NULL) {
-					cp = strchr (buf, '\n');
-					if (cp != NULL) {
-						break;
-					}
-				}
-
-				fprintf (stderr,
-				         _("%s: line %d: line too long\n"),
-				         Prog, line);
-				errors++;
-				continue;
-			}
+		} else if (feof (input) == 0) {
+			fprintf (stderr, _("%s: line %d: line too long\n"),
+			         Prog, line);
+			errors++;
+			/* Skip the rest of the line */
+			do {
+				cp = fgets (buf, (int) SECRET_SIZE, input);
+			} while ((NULL != cp) && (strchr (buf, '\n') == NULL));
+			continue;
 		}
 
 		/*
@@ -531,6 +927,11 @@ int main (int argc, char **argv)
 		}
 		newpwd = cp;
 
+		if (!check_order (name, line)) {
+			errors++;
+			continue;
+		}
+
 #ifdef USE_PAM
 		if (use_pam) {
 			if (do_pam_passwd_non_interactive ("chpasswd", name, newpwd) != 0) {
@@ -547,7 +948,32 @@ int main (int argc, char **argv)
 		const struct passwd *pw;
 		struct passwd newpw;
 
+#ifndef USE_PAM
+		if (   check_quality
+#ifdef HAVE_CRYPT_R
+		    && (NULL == crypt_batch)	/* checked by the batch */
+#endif				/* HAVE_CRYPT_R */
+		   ) {
+			const char *msg;
+
+			msg = obscure_check ("", newpwd, locate_pw (name));
+			if (NULL != msg) {
+				fprintf (stderr,
+				         _("%s: line %d: bad password for user '%s': %s\n"),
+				         Prog, line, name, msg);
+				errors++;
+				continue;
+			}
+		}
+#endif				/* !USE_PAM */
+
 		if (salt) {
+#ifdef HAVE_CRYPT_R
+			if (NULL != crypt_batch) {
+				/* Encrypted by the batch, see apply_crypt_jobs */
+				cp = "!";
+			} else
+#endif				/* HAVE_CRYPT_R */
 			cp = pw_encrypt (newpwd, salt);
 			if (NULL == cp) {
 				fprintf (stderr,
@@ -561,7 +987,7 @@ int main (int argc, char **argv)
 		 * Get the password file entry for this user. The user must
 		 * already exist.
 		 */
-		pw = pw_locate (name);
+		pw = locate_pw (name);
 		if (NULL == pw) {
 			fprintf (stderr,
 			         _("%s: line %d: user '%s' does not exist\n"), Prog,
@@ -576,7 +1002,7 @@ int main (int argc, char **argv)
 			 * a passwd and a shadow password, it's preferable
 			 * to update both.
 			 */
-			sp = spw_locate (name);
+			sp = locate_spw (name);
 
 			if (   (NULL == sp)
 			    && (strcmp (pw->pw_passwd,
@@ -646,8 +1072,29 @@ int main (int argc, char **argv)
 				continue;
 			}
 		}
+#ifdef HAVE_CRYPT_R
+		if (   (NULL != crypt_batch)
+		    && (queue_crypt (name, newpwd, salt, NULL != sp,
+		                     (NULL == sp)
+		                     || (strcmp (pw->pw_passwd, SHADOW_PASSWD_STRING) != 0),
+		                     line) != 0)) {
+			errors++;
+			continue;
 		}
+#endif				/* HAVE_CRYPT_R */
+		}
+	}
+
+#ifdef HAVE_CRYPT_R
+	if (NULL != crypt_batch) {
+		errors += apply_crypt_jobs ();
 	}
+#endif				/* HAVE_CRYPT_R */
+#ifdef USE_PAM
+	if (use_pam) {
+		pam_passwd_non_interactive_end ();
+	}
+#endif				/* USE_PAM */
 
 	/*
 	 * Any detected errors will cause the entire set of changes to be
@@ -658,6 +1105,8 @@ int main (int argc, char **argv)
 	 *
 	 * With PAM, it is not possible to delay the update of the
 	 * password database.
+	 *
+	 * With -l, only the changes since the last commit are ignored.
 	 */
 	if (0 != errors) {
 #ifdef USE_PAM
@@ -679,8 +1128,16 @@ int main (int argc, char **argv)
 		close_files ();
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
+#ifdef USE_PAM
+	/* The changes made through PAM are not seen by commonio */
+	if (use_pam) {
+		nscd_flush_cache ("passwd");
+		sssd_flush_cache (SSSD_DB_PASSWD);
+	}
+#endif				/* USE_PAM */
+
+	secret_free (buf);
+	free (last_name);
 
 	return (0);
 }
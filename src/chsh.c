@@ -14,12 +14,11 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <sys/types.h>
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -30,16 +29,6 @@
 #include "exitcodes.h"
 #include "shadowlog.h"
 
-#ifndef SHELLS_FILE
-#define SHELLS_FILE "/etc/shells"
-#endif
-
-#ifdef HAVE_VENDORDIR
-#include <libeconf.h>
-#define SHELLS "shells"
-#define ETCDIR "/etc"
-#endif
-
 /*
  * Global variables
  */
@@ -50,17 +39,32 @@ static char loginsh[BUFSIZ];	/* Name of new login shell */
 static bool sflg = false;	/* -s - set shell from command line  */
 static bool pw_locked = false;
 
+/*
+ * --batch FILE changes the login shell of the users of the records of
+ * FILE, one set of chsh arguments per line, with a single lock and write
+ * of the password file. While a record is processed, record_env is set,
+ * and the errors which would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+
 /* external identifiers */
 
 /* local function prototypes */
 NORETURN static void fail_exit (int code);
 NORETURN static void usage (int status);
 static void new_fields (void);
-static bool shell_is_listed (const char *);
 static bool is_restricted_shell (const char *);
 static void process_flags (int argc, char **argv);
-static void check_perms (const struct passwd *pw);
+static void check_perms (/*@null@*/const struct passwd *pw);
+static void open_passwd (void);
+static void update_entry (const char *user, char *newshell);
+static void close_passwd (void);
 static void update_shell (const char *user, char *loginsh);
+static void check_shell (void);
+static void reject_in_record (const char *option);
+static int change_record (const struct batch_line *rec, char **shell);
+static int change_batch (const char *file);
 
 /*
  * fail_exit - do some cleanup and exit with the given error code
@@ -69,6 +73,11 @@ NORETURN
 static void
 fail_exit (int code)
 {
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
+	}
+
 	if (pw_locked) {
 		if (pw_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
@@ -90,11 +99,19 @@ static void
 usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] [LOGIN]\n"
+	                  "       %s --batch FILE\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog);
+	(void) fputs (_("      --batch FILE              change the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -s, --shell SHELL             new login shell for the user account\n"), usageout);
@@ -125,119 +142,42 @@ static bool is_restricted_shell (const char *sh)
 	 * Changed this to avoid confusion with "rc" (the plan9 shell - not
 	 * restricted despite the name starting with 'r').  --marekm
 	 */
-	return !shell_is_listed (sh);
-}
+	int listed = shell_is_listed (sh);
 
-/*
- * shell_is_listed - see if the user's login shell is listed in /etc/shells
- *
- * The /etc/shells file is read for valid names of login shells.  If the
- * /etc/shells file does not exist the user cannot set any shell unless
- * they are root.
- *
- * If getusershell() is available (Linux, *BSD, possibly others), use it
- * instead of re-implementing it.
- */
-
-#ifdef HAVE_VENDORDIR
-static bool shell_is_listed (const char *sh)
-{
-	bool found = false;
-
-	size_t size = 0;
-	econf_err error;
-	char **keys;
-	econf_file *key_file;
-
-	error = econf_readDirs(&key_file,
-			       VENDORDIR,
-			       ETCDIR,
-			       SHELLS,
-			       NULL,
-			       "", /* key only */
-			       "#" /* comment */);
-	if (error) {
-		fprintf (stderr,
-			 _("Cannot parse shell files: %s"),
-			 econf_errString(error));
-		fail_exit (1);
-	}
-
-	error = econf_getKeys(key_file, NULL, &size, &keys);
-	if (error) {
-		fprintf (stderr,
-			 _("Cannot evaluate entries in shell files: %s"),
-			 econf_errString(error));
-		econf_free (key_file);
+	if (-1 == listed) {
 		fail_exit (1);
 	}
-
-	for (size_t i = 0; i < size; i++) {
-		if (strcmp (keys[i], sh) == 0) {
-			found = true;
-			break;
-		}
-	}
-	econf_free (key_file);
-
-	return found;
+	return (0 == listed);
 }
 
-#else /* without HAVE_VENDORDIR */
-
-static bool shell_is_listed (const char *sh)
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
 {
-	bool found = false;
-
-#ifdef HAVE_GETUSERSHELL
-	char *cp;
-	setusershell ();
-	while ((cp = getusershell ())) {
-		if (strcmp (cp, sh) == 0) {
-			found = true;
-			break;
-		}
-	}
-	endusershell ();
-#else
-	char buf[BUFSIZ];
-	FILE *fp;
-
-	fp = fopen (SHELLS_FILE, "r");
-	if (NULL == fp) {
-		return false;
-	}
-
-	while (fgets (buf, sizeof (buf), fp) == buf) {
-		cp = strrchr (buf, '\n');
-		if (NULL != cp) {
-			*cp = '\0';
-		}
-
-		if (buf[0] == '#') {
-			continue;
-		}
-
-		if (strcmp (buf, sh) == 0) {
-			found = true;
-			break;
-		}
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
 	}
-	fclose (fp);
-#endif
-	return found;
 }
-#endif /* with HAVE_VENDORDIR */
 
 /*
  * process_flags - parse the command line options
  *
  *	It will not return if an error is encountered.
+ *
+ *	With --batch, the options of the command line are only the ones
+ *	common to all the records.
  */
 static void process_flags (int argc, char **argv)
 {
 	int c;
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
 	static struct option long_options[] = {
+		{"batch", required_argument, NULL, 200},
 		{"help",  no_argument,       NULL, 'h'},
 		{"root",  required_argument, NULL, 'R'},
 		{"shell", required_argument, NULL, 's'},
@@ -246,11 +186,20 @@ static void process_flags (int argc, char **argv)
 
 	while ((c = getopt_long (argc, argv, "hR:s:",
 	                         long_options, NULL)) != -1) {
+		nopts++;
 		switch (c) {
+		case 200:
+			reject_in_record ("--batch");
+			batch_file = optarg;
+			batch_opts++;
+			break;
 		case 'h':
+			reject_in_record ("-h");
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
 		case 'R': /* no-op, handled in process_root_flag () */
+			reject_in_record ("-R");
+			batch_opts++;
 			break;
 		case 's':
 			sflg = true;
@@ -261,6 +210,17 @@ static void process_flags (int argc, char **argv)
 		}
 	}
 
+	/*
+	 * --batch only accepts -R, the other options are given in the
+	 * records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	/*
 	 * There should be only one remaining argument at most and it should
 	 * be the user's name.
@@ -278,9 +238,11 @@ static void process_flags (int argc, char **argv)
  *
  *	Non-root users must be authenticated.
  *
+ *	With --batch, pw is NULL, and only root is allowed.
+ *
  *	It will not return if the user is not allowed.
  */
-static void check_perms (const struct passwd *pw)
+static void check_perms (/*@null@*/const struct passwd *pw)
 {
 #ifdef USE_PAM
 	pam_handle_t *pamh = NULL;
@@ -288,6 +250,24 @@ static void check_perms (const struct passwd *pw)
 	struct passwd *pampw;
 #endif
 
+	if (NULL == pw) {
+		if (!amroot) {
+			fprintf (stderr, _("%s: Permission denied.\n"), Prog);
+			fail_exit (1);
+		}
+#ifdef WITH_SELINUX
+		if (check_selinux_permit ("chsh") != 0) {
+			fprintf (stderr, _("%s: Permission denied.\n"), Prog);
+			fail_exit (1);
+		}
+#endif
+#ifdef USE_PAM
+		goto pam;
+#else
+		return;
+#endif
+	}
+
 	/*
 	 * Non-privileged users are only allowed to change the shell if the
 	 * UID of the user matches the current real UID.
@@ -338,6 +318,7 @@ static void check_perms (const struct passwd *pw)
         }
 
 #else				/* !USE_PAM */
+pam:
 	pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
 	if (NULL == pampw) {
 		fprintf (stderr,
@@ -370,17 +351,10 @@ static void check_perms (const struct passwd *pw)
 }
 
 /*
- * update_shell - update the user's shell in the passwd database
- *
- *	Commit the user's entry after changing her shell field.
- *
- *	It will not return in case of error.
+ * open_passwd - lock and open the password database
  */
-static void update_shell (const char *user, char *newshell)
+static void open_passwd (void)
 {
-	const struct passwd *pw;	/* Password entry from /etc/passwd   */
-	struct passwd pwent;		/* New password entry                */
-
 	/*
 	 * Before going any further, raise the ulimit to prevent
 	 * colliding into a lowered ulimit, and set the real UID
@@ -409,6 +383,15 @@ static void update_shell (const char *user, char *newshell)
 		SYSLOG ((LOG_WARN, "cannot open %s", pw_dbname ()));
 		fail_exit (1);
 	}
+}
+
+/*
+ * update_entry - change the shell of user in the password database
+ */
+static void update_entry (const char *user, char *newshell)
+{
+	const struct passwd *pw;	/* Password entry from /etc/passwd   */
+	struct passwd pwent;		/* New password entry                */
 
 	/*
 	 * Get the entry to update using pw_locate() - we want the real
@@ -441,10 +424,13 @@ static void update_shell (const char *user, char *newshell)
 		         Prog, pw_dbname (), pwent.pw_name);
 		fail_exit (1);
 	}
+}
 
-	/*
-	 * Changes have all been made, so commit them and unlock the file.
-	 */
+/*
+ * close_passwd - commit the changes and unlock the password database
+ */
+static void close_passwd (void)
+{
 	if (pw_close () == 0) {
 		fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, pw_dbname ());
 		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
@@ -458,6 +444,148 @@ static void update_shell (const char *user, char *newshell)
 	pw_locked= false;
 }
 
+/*
+ * update_shell - update the user's shell in the passwd database
+ *
+ *	Commit the user's entry after changing her shell field.
+ *
+ *	It will not return in case of error.
+ */
+static void update_shell (const char *user, char *newshell)
+{
+	open_passwd ();
+	update_entry (user, newshell);
+
+	/*
+	 * Changes have all been made, so commit them and unlock the file.
+	 */
+	close_passwd ();
+}
+
+/*
+ * check_shell - check the new login shell
+ *
+ *	It will not return if the shell is not valid.
+ */
+static void check_shell (void)
+{
+	/*
+	 * Check all of the fields for valid information. The shell
+	 * field may not contain any illegal characters. Non-privileged
+	 * users are restricted to using the shells in /etc/shells.
+	 * The shell must be executable by the user.
+	 */
+	if (valid_field (loginsh, ":,=\n") != 0) {
+		fprintf (stderr, _("%s: Invalid entry: %s\n"), Prog, loginsh);
+		fail_exit (1);
+	}
+	if (   !amroot
+	    && (   is_restricted_shell (loginsh)
+	        || (access (loginsh, X_OK) != 0))) {
+		fprintf (stderr, _("%s: %s is an invalid shell\n"), Prog, loginsh);
+		fail_exit (1);
+	}
+
+	/* Even for root, warn if an invalid shell is specified. */
+	if (access (loginsh, F_OK) != 0) {
+		fprintf (stderr, _("%s: Warning: %s does not exist\n"), Prog, loginsh);
+	} else if (access (loginsh, X_OK) != 0) {
+		fprintf (stderr, _("%s: Warning: %s is not executable\n"), Prog, loginsh);
+	}
+}
+
+/*
+ * change_record - change the login shell of the user of a --batch record
+ *
+ *	Return 0 on success, or the exit status of chsh for this record.
+ */
+static int change_record (const struct batch_line *rec, char **shell)
+{
+	const char *user = rec->argv[rec->argc - 1];
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		sflg = false;
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+		if (optind != rec->argc - 1) {
+			usage (E_USAGE);
+		}
+
+		/* Same as in main(), but not interactively */
+		if (!sflg) {
+			fprintf (stderr,
+			         _("%s: line %u: no login shell given\n"),
+			         Prog, rec->line);
+			fail_exit (E_USAGE);
+		}
+		check_shell ();
+		update_entry (user, loginsh);
+		*shell = xstrdup (loginsh);
+	} else {
+		fprintf (stderr, _("%s: line %u: cannot change user '%s'\n"),
+		         Prog, rec->line, user);
+	}
+	record_env = NULL;
+
+	return code;
+}
+
+/*
+ * change_batch - change the login shell of the users of the records of
+ *                file
+ *
+ *	The records are checked and applied to the password database,
+ *	which is locked and written once. A record sees the changes of the
+ *	previous ones. If a record fails, the others are still checked,
+ *	but no user is changed.
+ *
+ *	Return the exit status of chsh.
+ */
+static int change_batch (const char *file)
+{
+	struct batch_line *lines;
+	char **shells;
+	size_t count;
+	size_t i;
+	int status = E_SUCCESS;
+	int code;
+
+	check_perms (NULL);
+
+	if (batch_read (file, &lines, &count) != 0) {
+		fail_exit (E_USAGE);
+	}
+	shells = xmalloc ((count + 1) * sizeof *shells);
+
+	open_passwd ();
+
+	for (i = 0; i < count; i++) {
+		code = change_record (&lines[i], &shells[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was changed\n"), Prog);
+		fail_exit (status);
+	}
+
+	close_passwd ();
+
+	for (i = 0; i < count; i++) {
+		SYSLOG ((LOG_INFO, "changed user '%s' shell to '%s'",
+		         lines[i].argv[lines[i].argc - 1], shells[i]));
+	}
+
+	closelog ();
+	return E_SUCCESS;
+}
+
 /*
  * chsh - this command controls changes to the user's shell
  *
@@ -495,6 +623,10 @@ int main (int argc, char **argv)
 	/* parse the command line options */
 	process_flags (argc, argv);
 
+	if (NULL != batch_file) {
+		return change_batch (batch_file);
+	}
+
 	/*
 	 * Get the name of the user to check. It is either the command line
 	 * name, or the name getlogin() returns.
@@ -561,37 +693,12 @@ int main (int argc, char **argv)
 		new_fields ();
 	}
 
-	/*
-	 * Check all of the fields for valid information. The shell
-	 * field may not contain any illegal characters. Non-privileged
-	 * users are restricted to using the shells in /etc/shells.
-	 * The shell must be executable by the user.
-	 */
-	if (valid_field (loginsh, ":,=\n") != 0) {
-		fprintf (stderr, _("%s: Invalid entry: %s\n"), Prog, loginsh);
-		fail_exit (1);
-	}
-	if (   !amroot
-	    && (   is_restricted_shell (loginsh)
-	        || (access (loginsh, X_OK) != 0))) {
-		fprintf (stderr, _("%s: %s is an invalid shell\n"), Prog, loginsh);
-		fail_exit (1);
-	}
-
-	/* Even for root, warn if an invalid shell is specified. */
-	if (access (loginsh, F_OK) != 0) {
-		fprintf (stderr, _("%s: Warning: %s does not exist\n"), Prog, loginsh);
-	} else if (access (loginsh, X_OK) != 0) {
-		fprintf (stderr, _("%s: Warning: %s is not executable\n"), Prog, loginsh);
-	}
+	check_shell ();
 
 	update_shell (user, loginsh);
 
 	SYSLOG ((LOG_INFO, "changed user '%s' shell to '%s'", user, loginsh));
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
-
 	closelog ();
 	exit (E_SUCCESS);
 }
@@ -0,0 +1,345 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "defines.h"
+#include "getdef.h"
+#include "prototypes.h"
+#include "shadowlog.h"
+/*@-exitarg@*/
+#include "exitcodes.h"
+
+/*
+ * cryptcost - calibrate the cost of the crypt methods
+ *
+ *	The cost of each method is set so that encrypting (and thus
+ *	verifying) a password takes about the target time on this host.
+ */
+
+/*
+ * Global variables
+ */
+const char *Prog;
+
+static bool aflg = false;
+static bool wflg = false;
+static /*@null@*//*@observer@*/const char *crypt_method = NULL;
+static long target_ms = 100;
+
+struct crypt_cost {
+	const char *method;
+	const char *min_var;	/* login.defs variables */
+	/*@null@*/const char *max_var;
+	long min;
+	long max;
+	bool linear;		/* the time is proportional to the cost,
+				 * otherwise it doubles with each step */
+};
+
+static const struct crypt_cost costs[] = {
+#ifdef USE_SHA_CRYPT
+	{"SHA256",   "SHA_CRYPT_MIN_ROUNDS", "SHA_CRYPT_MAX_ROUNDS", 1000, 999999999, true},
+	{"SHA512",   "SHA_CRYPT_MIN_ROUNDS", "SHA_CRYPT_MAX_ROUNDS", 1000, 999999999, true},
+#endif				/* USE_SHA_CRYPT */
+#ifdef USE_BCRYPT
+	{"BCRYPT",   "BCRYPT_MIN_ROUNDS",    "BCRYPT_MAX_ROUNDS",    4,    19,        false},
+#endif				/* USE_BCRYPT */
+#ifdef USE_YESCRYPT
+	{"YESCRYPT", "YESCRYPT_COST_FACTOR", NULL,                   1,    11,        false},
+#endif				/* USE_YESCRYPT */
+};
+
+/* local function prototypes */
+NORETURN static void usage (int status);
+static void process_flags (int argc, char **argv);
+static double crypt_time (const char *method, long cost);
+static long calibrate (const struct crypt_cost *cc, double *ms);
+static int calibrate_method (const struct crypt_cost *cc);
+
+/*
+ * usage - display usage message and exit
+ */
+NORETURN
+static void usage (int status)
+{
+	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+	(void) fprintf (usageout,
+	                _("Usage: %s [options]\n"
+	                  "\n"
+	                  "Options:\n"),
+	                Prog);
+	(void) fputs (_("  -a, --all                     calibrate all the crypt methods\n"), usageout);
+	(void) fprintf (usageout,
+	                _("  -c, --crypt-method METHOD     the crypt method (one of %s)\n"),
+	                ""
+#if defined(USE_SHA_CRYPT)
+	                "SHA256 SHA512 "
+#endif
+#if defined(USE_BCRYPT)
+	                "BCRYPT "
+#endif
+#if defined(USE_YESCRYPT)
+	                "YESCRYPT"
+#endif
+	               );
+	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("  -t, --target MS               target time of a password verification\n"
+	                "                                in milliseconds\n"),
+	              usageout);
+	(void) fputs (_("  -w, --write                   store the costs for the \"auto\" cost\n"
+	                "                                variables of login.defs\n"),
+	              usageout);
+	(void) fputs ("\n", usageout);
+	exit (status);
+}
+
+/*
+ * process_flags - parse the command line options
+ *
+ *	It will not return if an error is encountered.
+ */
+static void process_flags (int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"all",          no_argument,       NULL, 'a'},
+		{"crypt-method", required_argument, NULL, 'c'},
+		{"help",         no_argument,       NULL, 'h'},
+		{"root",         required_argument, NULL, 'R'},
+		{"target",       required_argument, NULL, 't'},
+		{"write",        no_argument,       NULL, 'w'},
+		{NULL, 0, NULL, '\0'}
+	};
+
+	while ((c = getopt_long (argc, argv, "ac:hR:t:w",
+	                         long_options, NULL)) != -1) {
+		switch (c) {
+		case 'a':
+			aflg = true;
+			break;
+		case 'c':
+			crypt_method = optarg;
+			break;
+		case 'h':
+			usage (E_SUCCESS);
+			/*@notreached@*/break;
+		case 'R': /* no-op, handled in process_root_flag () */
+			break;
+		case 't':
+			if (   (getlong (optarg, &target_ms) == 0)
+			    || (target_ms < 1)
+			    || (target_ms > 60000)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
+		case 'w':
+			wflg = true;
+			break;
+		default:
+			usage (E_USAGE);
+		}
+	}
+
+	if (optind != argc) {
+		usage (E_USAGE);
+	}
+
+	if (aflg && (NULL != crypt_method)) {
+		fprintf (stderr,
+		         _("%s: %s and %s are mutually exclusive\n"),
+		         Prog, "-a", "-c");
+		usage (E_USAGE);
+	}
+}
+
+/*
+ * crypt_time - Return the time, in milliseconds, to encrypt a password
+ *              with method and cost.
+ *
+ *	The best of two runs is used, to skip the first run's cache misses.
+ *	Return -1 if the password could not be encrypted.
+ */
+static double crypt_time (const char *method, long cost)
+{
+	double best = -1;
+	int arg = cost;
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		struct timespec start, end;
+		const char *salt = crypt_make_salt (method, &arg);
+		double ms;
+
+		(void) clock_gettime (CLOCK_MONOTONIC, &start);
+		if (crypt ("calibration", salt) == NULL) {
+			return -1;
+		}
+		(void) clock_gettime (CLOCK_MONOTONIC, &end);
+
+		ms = (end.tv_sec - start.tv_sec) * 1e3
+		   + (end.tv_nsec - start.tv_nsec) / 1e6;
+		if ((best < 0) || (ms < best)) {
+			best = ms;
+		}
+	}
+	return best;
+}
+
+/*
+ * calibrate - Return the cost of cc which takes about target_ms.
+ *
+ *	*ms is set to the time measured with this cost.
+ *	Return -1 if the method is not supported by libcrypt.
+ */
+static long calibrate (const struct crypt_cost *cc, double *ms)
+{
+	long cost;
+	double t;
+	int i;
+
+	if (cc->linear) {
+		/* Measure a cost which takes a few milliseconds, and scale */
+		cost = 10000;
+		for (;;) {
+			t = crypt_time (cc->method, cost);
+			if (t < 0) {
+				return -1;
+			}
+			if ((t >= 5) || (cost >= cc->max / 10)) {
+				break;
+			}
+			cost *= 10;
+		}
+		/* Scale twice, the second time from a measure near the target */
+		for (i = 0; i < 2; i++) {
+			cost = cost * (target_ms / (t > 0 ? t : 0.001));
+			if (cost < cc->min) {
+				cost = cc->min;
+			} else if (cost > cc->max) {
+				cost = cc->max;
+			}
+			t = crypt_time (cc->method, cost);
+		}
+		*ms = t;
+		return cost;
+	}
+
+	/*
+	 * The time doubles with each step: stop at the first cost which
+	 * exceeds the target, and keep it or the previous one, whichever is
+	 * closer.
+	 */
+	*ms = -1;
+	for (cost = cc->min; cost <= cc->max; cost++) {
+		double prev = *ms;
+
+		t = crypt_time (cc->method, cost);
+		if (t < 0) {
+			return (cost == cc->min) ? -1 : cost - 1;
+		}
+		*ms = t;
+		if (t >= target_ms) {
+			if ((cost > cc->min) && (target_ms / prev < t / target_ms)) {
+				*ms = prev;
+				cost--;
+			}
+			break;
+		}
+	}
+	if (cost > cc->max) {
+		cost = cc->max;
+	}
+	return cost;
+}
+
+/*
+ * calibrate_method - calibrate cc, print the login.defs settings, and
+ *                    store the cost with -w
+ *
+ * Return 0 on success.
+ */
+static int calibrate_method (const struct crypt_cost *cc)
+{
+	double ms;
+	long cost;
+
+	cost = calibrate (cc, &ms);
+	if (-1 == cost) {
+		fprintf (stderr,
+		         _("%s: crypt method not supported by libcrypt: %s\n"),
+		         Prog, cc->method);
+		return -1;
+	}
+
+	(void) printf ("# %s: %.0f ms\n", cc->method, ms);
+	(void) printf ("%s %ld\n", cc->min_var, cost);
+	if (NULL != cc->max_var) {
+		(void) printf ("%s %ld\n", cc->max_var, cost);
+	}
+
+	if (wflg && (crypt_cost_save (cc->method, cost) != 0)) {
+		fprintf (stderr,
+		         _("%s: cannot update %s: %s\n"),
+		         Prog, CRYPT_COST_FILE, strerror (errno));
+		return -1;
+	}
+	return 0;
+}
+
+int main (int argc, char **argv)
+{
+	const char *method;
+	size_t i;
+	int errors = 0;
+	bool found = false;
+
+	Prog = Basename (argv[0]);
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", argc, argv);
+
+	process_flags (argc, argv);
+
+	method = crypt_method;
+	if (NULL == method) {
+		method = getdef_str ("ENCRYPT_METHOD");
+	}
+
+	for (i = 0; i < sizeof costs / sizeof costs[0]; i++) {
+		if (   aflg
+		    || ((NULL != method) && (strcmp (method, costs[i].method) == 0))) {
+			found = true;
+			if (calibrate_method (&costs[i]) != 0) {
+				errors++;
+			}
+		}
+	}
+
+	if (!found) {
+		fprintf (stderr,
+		         _("%s: no cost to calibrate for the crypt method %s\n"),
+		         Prog, (NULL != method) ? method : "DES");
+		exit (E_BAD_ARG);
+	}
+
+	return (0 == errors) ? E_SUCCESS : EXIT_FAILURE;
+}
@@ -11,15 +11,18 @@
 
 #ident "$Id$"
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
-#include <assert.h>
+#include <unistd.h>
 #include "defines.h"
+#include "acctstate.h"
 #include "faillog.h"
+#include "failure.h"
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
@@ -27,20 +30,27 @@
 
 /* local function prototypes */
 NORETURN static void usage (int status);
+static void print_record (const struct passwd *pw,
+                          const struct faillog *fl, bool force);
 static void print_one (/*@null@*/const struct passwd *pw, bool force);
+static void print_failures (void);
+static bool read_records (uid_t uid, size_t n, /*@out@*/struct faillog *fl);
+static bool update_range (uid_t first, uid_t last,
+                          bool (*update_fl) (struct faillog *, long),
+                          long value, bool skip_holes,
+                          const char *failmsg);
 static void set_locktime (long locktime);
-static bool set_locktime_one (uid_t uid, long locktime);
 static void setmax (short max);
-static bool setmax_one (uid_t uid, short max);
 static void print (void);
-static bool reset_one (uid_t uid);
 static void reset (void);
+static void load_store (void);
+static void transfer (bool import);
 
 /*
  * Global variables
  */
 const char *Prog;		/* Program name */
-static FILE *fail;		/* failure file stream */
+static int fail = -1;		/* failure file descriptor */
 static time_t seconds;		/* that number of days in seconds */
 static unsigned long umin;	/* if uflg and has_umin, only display users with uid >= umin */
 static bool has_umin = false;
@@ -54,11 +64,29 @@ static bool tflg = false;	/* print is restricted to most recent days */
 static bool lflg = false;	/* set the locktime */
 static bool mflg = false;	/* set maximum failed login counters */
 static bool rflg = false;	/* reset the counters of login failures */
+static bool Iflg = false;	/* import the records of the faillog file */
+static bool Eflg = false;	/* export the records to the faillog file */
 
 static struct stat statbuf;	/* fstat buffer for file size */
 
 #define	NOW	time(NULL)
 
+/*
+ * Number of records read or written at once when a range of UIDs is
+ * listed or updated.
+ */
+#define FAILLOG_CHUNK	1024
+
+/*
+ * With ACCOUNT_STATE_FILE, the records are read from the account state
+ * store. The sorted UIDs which have a record take the place of the data
+ * extents of the faillog file, and statbuf.st_size is the size the
+ * faillog file would have.
+ */
+static bool use_store = false;
+static /*@null@*/ /*@only@*/uid_t *store_uids = NULL;
+static size_t store_nuids = 0;
+
 NORETURN
 static void
 usage (int status)
@@ -70,7 +98,10 @@ usage (int status)
 	                  "Options:\n"),
 	                Prog);
 	(void) fputs (_("  -a, --all                     display faillog records for all users\n"), usageout);
+	(void) fputs (_("      --format FORMAT           print the records in FORMAT (text, tsv or json)\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("      --export                  write the records of ACCOUNT_STATE_FILE to the faillog file\n"), usageout);
+	(void) fputs (_("      --import                  copy the records of the faillog file to ACCOUNT_STATE_FILE\n"), usageout);
 	(void) fputs (_("  -l, --lock-secs SEC           after failed login lock account for SEC seconds\n"), usageout);
 	(void) fputs (_("  -m, --maximum MAX             set maximum failed login counters to MAX\n"), usageout);
 	(void) fputs (_("  -r, --reset                   reset the counters of login failures\n"), usageout);
@@ -85,51 +116,66 @@ usage (int status)
 
 static void print_one (/*@null@*/const struct passwd *pw, bool force)
 {
-	static bool once = false;
-	struct tm *tm;
-	off_t offset;
 	struct faillog fl;
-	time_t now;
-	char *cp;
-	char ptime[80];
 
 	if (NULL == pw) {
 		return;
 	}
 
-	offset = (off_t) pw->pw_uid * sizeof (fl);
-	if (offset + sizeof (fl) <= statbuf.st_size) {
-		/* fseeko errors are not really relevant for us. */
-		int err = fseeko (fail, offset, SEEK_SET);
-		assert (0 == err);
-		/* faillog is a sparse file. Even if no entries were
-		 * entered for this user, which should be able to get the
-		 * empty entry in this case.
-		 */
-		if (fread (&fl, sizeof (fl), 1, fail) != 1) {
-			fprintf (stderr,
-			         _("%s: Failed to get the entry for UID %lu\n"),
-			         Prog, (unsigned long int)pw->pw_uid);
-			return;
-		}
-	} else {
-		/* Outsize of the faillog file.
-		 * Behave as if there were a missing entry (same behavior
-		 * as if we were reading an non existing entry in the
-		 * sparse faillog file).
-		 */
-		memzero (&fl, sizeof (fl));
+	/* faillog is a sparse file. Even if no entries were entered for
+	 * this user, which should be able to get the empty entry in this
+	 * case.
+	 */
+	if (faillog_read (pw->pw_uid, &fl) < 0) {
+		fprintf (stderr,
+		         _("%s: Failed to get the entry for UID %lu\n"),
+		         Prog, (unsigned long int)pw->pw_uid);
+		return;
 	}
 
+	print_record (pw, &fl, force);
+}
+
+/*
+ * print_record - Print the record fl of the user pw.
+ */
+static void print_record (const struct passwd *pw,
+                          const struct faillog *fl, bool force)
+{
+	static bool once = false;
+	struct tm *tm;
+	time_t now;
+	char *cp;
+	char ptime[80];
+
 	/* Nothing to report */
-	if (!force && (0 == fl.fail_time)) {
+	if (!force && (0 == fl->fail_time)) {
 		return;
 	}
 
 	(void) time(&now);
 
 	/* Filter out entries that do not match with the -t option */
-	if (tflg && ((now - fl.fail_time) > seconds)) {
+	if (tflg && ((now - fl->fail_time) > seconds)) {
+		return;
+	}
+
+	if (output_structured ()) {
+		char line[sizeof (fl->fail_line) + 1];
+
+		STRFCPY (line, fl->fail_line);
+		output_str (pw->pw_name);
+		output_num (pw->pw_uid);
+		output_num (fl->fail_cnt);
+		output_num (fl->fail_max);
+		if (0 == fl->fail_time) {
+			output_str (NULL);
+		} else {
+			output_num (fl->fail_time);
+		}
+		output_str (line);
+		output_num (fl->fail_locktime);
+		output_row_end ();
 		return;
 	}
 
@@ -139,7 +185,7 @@ static void print_one (/*@null@*/const struct passwd *pw, bool force)
 		once = true;
 	}
 
-	tm = localtime (&fl.fail_time);
+	tm = localtime (&fl->fail_time);
 	if (!tm) {
 		fprintf (stderr, "Cannot read time from faillog.\n");
 		return;
@@ -148,25 +194,236 @@ static void print_one (/*@null@*/const struct passwd *pw, bool force)
 	cp = ptime;
 
 	printf ("%-9s   %5d    %5d   ",
-	        pw->pw_name, fl.fail_cnt, fl.fail_max);
-	printf ("%s  %s", cp, fl.fail_line);
-	if (0 != fl.fail_locktime) {
-		if (   ((fl.fail_time + fl.fail_locktime) > now)
-		    && (0 != fl.fail_cnt)) {
+	        pw->pw_name, fl->fail_cnt, fl->fail_max);
+	printf ("%s  %s", cp, fl->fail_line);
+	if (0 != fl->fail_locktime) {
+		if (   ((fl->fail_time + fl->fail_locktime) > now)
+		    && (0 != fl->fail_cnt)) {
 			printf (_(" [%lus left]"),
-			        (unsigned long) fl.fail_time + fl.fail_locktime - now);
+			        (unsigned long) fl->fail_time + fl->fail_locktime - now);
 		} else {
 			printf (_(" [%lds lock]"),
-			        fl.fail_locktime);
+			        fl->fail_locktime);
 		}
 	}
 	putchar ('\n');
 }
 
+static int uid_cmp (const void *p1, const void *p2)
+{
+	uid_t u1 = *(const uid_t *) p1;
+	uid_t u2 = *(const uid_t *) p2;
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+/*
+ * load_store - Collect the UIDs which have a faillog record in the account
+ *              state store.
+ */
+static void load_store (void)
+{
+	struct acct_state st;
+	uint64_t pos = 0;
+	size_t size = 0;
+	uid_t uid;
+	int r;
+
+	while ((r = acct_state_next (&pos, &uid, &st)) == 1) {
+		static const struct faillog empty;
+
+		if (memcmp (&st.fl, &empty, sizeof empty) == 0) {
+			continue;
+		}
+		if (store_nuids == size) {
+			size_t new_size = (0 == size) ? 256 : 2 * size;
+			uid_t *new_uids;
+
+			new_uids = realloc (store_uids, new_size * sizeof *new_uids);
+			if (NULL == new_uids) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				exit (EXIT_FAILURE);
+			}
+			store_uids = new_uids;
+			size = new_size;
+		}
+		store_uids[store_nuids] = uid;
+		store_nuids++;
+	}
+	if (-1 == r) {
+		fprintf (stderr,
+		         _("%s: Cannot read %s: %s\n"),
+		         Prog, faillog_name (), strerror (errno));
+		exit (E_NOPERM);
+	}
+
+	memzero (&statbuf, sizeof statbuf);
+	if (0 != store_nuids) {
+		qsort (store_uids, store_nuids, sizeof *store_uids, uid_cmp);
+		statbuf.st_size = ((off_t) store_uids[store_nuids - 1] + 1)
+		                  * sizeof (struct faillog);
+	}
+}
+
+/*
+ * store_lower_bound - Return the index of the first UID of store_uids
+ *                     which is not lower than uid.
+ */
+static size_t store_lower_bound (unsigned long uid)
+{
+	size_t lo = 0, hi = store_nuids;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (store_uids[mid] < uid) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+/*
+ * read_records - Read the n records starting at uid.
+ *
+ *	The records past the end of the file are empty.
+ *
+ * This returns false if the records could not be read.
+ */
+static bool read_records (uid_t uid, size_t n, /*@out@*/struct faillog *fl)
+{
+	off_t offset = (off_t) uid * sizeof (*fl);
+	size_t len = 0;
+
+	if (use_store) {
+		size_t i;
+
+		memzero (fl, n * sizeof (*fl));
+		for (i = store_lower_bound (uid);
+		     (i < store_nuids) && (store_uids[i] < uid + n);
+		     i++) {
+			if (faillog_read (store_uids[i],
+			                  &fl[store_uids[i] - uid]) < 0) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	if (offset < statbuf.st_size) {
+		off_t avail = statbuf.st_size - offset;
+
+		len = n * sizeof (*fl);
+		if ((off_t) len > avail) {
+			len = avail - avail % sizeof (*fl);
+		}
+		if (pread (fail, fl, len, offset) != (ssize_t) len) {
+			return false;
+		}
+	}
+	memzero ((char *) fl + len, n * sizeof (*fl) - len);
+	return true;
+}
+
+/*
+ * next_data - Return the first UID at or after uid which record may be
+ *             set, i.e. is not in a hole of the sparse faillog file.
+ *
+ *	If no records are set after uid, the UID after the end of the file
+ *	is returned.
+ */
+static unsigned long next_data (unsigned long uid)
+{
+	off_t offset = (off_t) uid * sizeof (struct faillog);
+	off_t data;
+
+	if (offset >= statbuf.st_size) {
+		return uid;
+	}
+	if (use_store) {
+		size_t i = store_lower_bound (uid);
+
+		return (i < store_nuids) ? store_uids[i]
+		                         : statbuf.st_size / sizeof (struct faillog);
+	}
+	data = lseek (fail, offset, SEEK_DATA);
+	if (-1 == data) {
+		if (ENXIO == errno) {
+			return (statbuf.st_size + sizeof (struct faillog) - 1)
+			       / sizeof (struct faillog);
+		}
+		/* Holes cannot be found, read everything */
+		return uid;
+	}
+	return data / sizeof (struct faillog);
+}
+
+/*
+ * print_failures - Print the records of the users with failures.
+ *
+ *	Only the UIDs with a record in the faillog file are looked up in
+ *	the user database. The holes of the sparse file are skipped.
+ */
+static void print_failures (void)
+{
+	struct faillog fl[FAILLOG_CHUNK];
+	unsigned long uid = 0;
+	unsigned long last = statbuf.st_size / sizeof (struct faillog);
+
+	if (0 == last) {
+		return;
+	}
+	last--;
+	if (uflg && has_umin) {
+		uid = umin;
+	}
+	if (uflg && has_umax && (umax < last)) {
+		last = umax;
+	}
+
+	while (uid <= last) {
+		size_t n, i;
+
+		uid = next_data (uid);
+		if (uid > last) {
+			break;
+		}
+		n = ((last - uid) < FAILLOG_CHUNK) ? (last - uid + 1)
+		                                   : FAILLOG_CHUNK;
+		if (!read_records (uid, n, fl)) {
+			fprintf (stderr,
+			         _("%s: Failed to get the entry for UID %lu\n"),
+			         Prog, uid);
+			return;
+		}
+		for (i = 0; i < n; i++) {
+			if (0 != fl[i].fail_time) {
+				const struct passwd *pw = getpwuid (uid + i);
+
+				/* We only print records for existing users. */
+				if (NULL != pw) {
+					print_record (pw, &fl[i], false);
+				}
+			}
+		}
+		uid += n;
+	}
+}
+
 static void print (void)
 {
+	static const char *const fields[] = {
+		"user", "uid", "failures", "maximum", "time", "line",
+		"locktime", NULL
+	};
+
+	output_begin (fields);
 	if (uflg && has_umin && has_umax && (umin==umax)) {
 		print_one (getpwuid (umin), true);
+	} else if (!aflg) {
+		print_failures ();
 	} else {
 		/* We only print records for existing users.
 		 * Loop based on the user database instead of reading the
@@ -187,68 +444,135 @@ static void print (void)
 		}
 		endpwent ();
 	}
+	output_end ();
 }
 
 /*
- * reset_one - Reset the fail count for one user
+ * write_store - Write the n records of fl, starting at uid, to the account
+ *               state store.
+ */
+static int write_store (unsigned long uid, const struct faillog *fl,
+                        size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		if (faillog_write (uid + i, &fl[i]) != 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * update_range - Update the records of the UIDs from first to last with
+ *                update_fl.
+ *
+ *	update_fl returns true if it changed the record. The changed
+ *	records are written by runs of contiguous records.
+ *	If skip_holes is set, update_fl does not change empty records:
+ *	the holes of the sparse faillog file are then skipped.
  *
  * This returns a boolean indicating if an error occurred.
  */
-static bool reset_one (uid_t uid)
+static bool update_range (uid_t first, uid_t last,
+                          bool (*update_fl) (struct faillog *, long),
+                          long value, bool skip_holes,
+                          const char *failmsg)
 {
-	off_t offset;
-	struct faillog fl;
-
-	offset = (off_t) uid * sizeof (fl);
-	if (offset + sizeof (fl) <= statbuf.st_size) {
-		/* fseeko errors are not really relevant for us. */
-		int err = fseeko (fail, offset, SEEK_SET);
-		assert (0 == err);
-		/* faillog is a sparse file. Even if no entries were
-		 * entered for this user, which should be able to get the
-		 * empty entry in this case.
-		 */
-		if (fread (&fl, sizeof (fl), 1, fail) != 1) {
+	struct faillog fl[FAILLOG_CHUNK];
+	unsigned long uid = first;
+	bool err = false;
+	bool locked;
+
+	while (uid <= last) {
+		size_t n, i;
+
+		if (skip_holes) {
+			uid = next_data (uid);
+			if (   (uid > last)
+			    || ((off_t) uid * sizeof (*fl) >= statbuf.st_size)) {
+				break;
+			}
+		}
+		n = ((last - uid) < FAILLOG_CHUNK) ? (last - uid + 1)
+		                                   : FAILLOG_CHUNK;
+		/* Do not update the records concurrently with login */
+		locked = (faillog_lock (uid, n, F_WRLCK) == 0);
+		if (!read_records (uid, n, fl)) {
 			fprintf (stderr,
 			         _("%s: Failed to get the entry for UID %lu\n"),
-			         Prog, (unsigned long int)uid);
+			         Prog, uid);
+			if (locked) {
+				(void) faillog_lock (uid, n, F_UNLCK);
+			}
 			return true;
 		}
-	} else {
-		/* Outsize of the faillog file.
-		 * Behave as if there were a missing entry (same behavior
-		 * as if we were reading an non existing entry in the
-		 * sparse faillog file).
-		 */
-		memzero (&fl, sizeof (fl));
+
+		for (i = 0; i < n;) {
+			size_t j;
+			off_t offset;
+			size_t len;
+
+			if (!update_fl (&fl[i], value)) {
+				i++;
+				continue;
+			}
+			for (j = i + 1; (j < n) && update_fl (&fl[j], value); j++) {
+			}
+
+			offset = (off_t) (uid + i) * sizeof (*fl);
+			len = (j - i) * sizeof (*fl);
+			if (   use_store
+			    ? (write_store (uid + i, &fl[i], j - i) != 0)
+			    : (pwrite (fail, &fl[i], len, offset) != (ssize_t) len)) {
+				fprintf (stderr, failmsg, Prog, uid + i);
+				err = true;
+			} else if (offset + (off_t) len > statbuf.st_size) {
+				statbuf.st_size = offset + len;
+			}
+			i = j;
+		}
+		if (locked) {
+			(void) faillog_lock (uid, n, F_UNLCK);
+		}
+		uid += n;
 	}
+	return err;
+}
 
-	if (0 == fl.fail_cnt) {
-		/* If the count is already null, do not write in the file.
-		 * This avoids writing 0 when no entries were present for
-		 * the user.
-		 */
+static bool reset_fl (struct faillog *fl, unused long value)
+{
+	if (0 == fl->fail_cnt) {
 		return false;
 	}
+	fl->fail_cnt = 0;
+	return true;
+}
 
-	fl.fail_cnt = 0;
-
-	if (   (fseeko (fail, offset, SEEK_SET) == 0)
-	    && (fwrite (&fl, sizeof (fl), 1, fail) == 1)) {
-		(void) fflush (fail);
+static bool setmax_fl (struct faillog *fl, long max)
+{
+	if (max == fl->fail_max) {
 		return false;
 	}
+	fl->fail_max = max;
+	return true;
+}
 
-	fprintf (stderr,
-	         _("%s: Failed to reset fail count for UID %lu\n"),
-	         Prog, (unsigned long int)uid);
+static bool set_locktime_fl (struct faillog *fl, long locktime)
+{
+	if (locktime == fl->fail_locktime) {
+		return false;
+	}
+	fl->fail_locktime = locktime;
 	return true;
 }
 
 static void reset (void)
 {
 	if (uflg && has_umin && has_umax && (umin==umax)) {
-		if (reset_one (umin)) {
+		if (update_range (umin, umin, reset_fl, 0, true,
+		                  _("%s: Failed to reset fail count for UID %lu\n"))) {
 			errors = true;
 		}
 	} else {
@@ -276,11 +600,9 @@ static void reset (void)
 				uid = umin;
 			}
 
-			while (uid <= uidmax) {
-				if (reset_one (uid)) {
-					errors = true;
-				}
-				uid++;
+			if (update_range (uid, uidmax, reset_fl, 0, true,
+			                  _("%s: Failed to reset fail count for UID %lu\n"))) {
+				errors = true;
 			}
 		} else {
 			/* Only reset records for existing users.
@@ -294,7 +616,9 @@ static void reset (void)
 				        || (pwent->pw_uid > (uid_t)uidmax))) {
 					continue;
 				}
-				if (reset_one (pwent->pw_uid)) {
+				if (update_range (pwent->pw_uid, pwent->pw_uid,
+				                  reset_fl, 0, true,
+				                  _("%s: Failed to reset fail count for UID %lu\n"))) {
 					errors = true;
 				}
 			}
@@ -303,67 +627,11 @@ static void reset (void)
 	}
 }
 
-/*
- * setmax_one - Set the maximum failed login counter for one user
- *
- * This returns a boolean indicating if an error occurred.
- */
-static bool setmax_one (uid_t uid, short max)
-{
-	off_t offset;
-	struct faillog fl;
-
-	offset = (off_t) uid * sizeof (fl);
-	if (offset + sizeof (fl) <= statbuf.st_size) {
-		/* fseeko errors are not really relevant for us. */
-		int err = fseeko (fail, offset, SEEK_SET);
-		assert (0 == err);
-		/* faillog is a sparse file. Even if no entries were
-		 * entered for this user, which should be able to get the
-		 * empty entry in this case.
-		 */
-		if (fread (&fl, sizeof (fl), 1, fail) != 1) {
-			fprintf (stderr,
-			         _("%s: Failed to get the entry for UID %lu\n"),
-			         Prog, (unsigned long int)uid);
-			return true;
-		}
-	} else {
-		/* Outsize of the faillog file.
-		 * Behave as if there were a missing entry (same behavior
-		 * as if we were reading an non existing entry in the
-		 * sparse faillog file).
-		 */
-		memzero (&fl, sizeof (fl));
-	}
-
-	if (max == fl.fail_max) {
-		/* If the max is already set to the right value, do not
-		 * write in the file.
-		 * This avoids writing 0 when no entries were present for
-		 * the user and the max argument is 0.
-		 */
-		return false;
-	}
-
-	fl.fail_max = max;
-
-	if (   (fseeko (fail, offset, SEEK_SET) == 0)
-	    && (fwrite (&fl, sizeof (fl), 1, fail) == 1)) {
-		(void) fflush (fail);
-		return false;
-	}
-
-	fprintf (stderr,
-	         _("%s: Failed to set max for UID %lu\n"),
-	         Prog, (unsigned long int)uid);
-	return true;
-}
-
 static void setmax (short max)
 {
 	if (uflg && has_umin && has_umax && (umin==umax)) {
-		if (setmax_one (umin, max)) {
+		if (update_range (umin, umin, setmax_fl, max, (0 == max),
+		                  _("%s: Failed to set max for UID %lu\n"))) {
 			errors = true;
 		}
 	} else {
@@ -393,11 +661,9 @@ static void setmax (short max)
 				uidmax = umax;
 			}
 
-			while (uid <= uidmax) {
-				if (setmax_one (uid, max)) {
-					errors = true;
-				}
-				uid++;
+			if (update_range (uid, uidmax, setmax_fl, max, (0 == max),
+			                  _("%s: Failed to set max for UID %lu\n"))) {
+				errors = true;
 			}
 		} else {
 			/* Only change records for existing users.
@@ -411,7 +677,9 @@ static void setmax (short max)
 				        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
 					continue;
 				}
-				if (setmax_one (pwent->pw_uid, max)) {
+				if (update_range (pwent->pw_uid, pwent->pw_uid,
+				                  setmax_fl, max, (0 == max),
+				                  _("%s: Failed to set max for UID %lu\n"))) {
 					errors = true;
 				}
 			}
@@ -420,67 +688,12 @@ static void setmax (short max)
 	}
 }
 
-/*
- * set_locktime_one - Set the locktime for one user
- *
- * This returns a boolean indicating if an error occurred.
- */
-static bool set_locktime_one (uid_t uid, long locktime)
-{
-	off_t offset;
-	struct faillog fl;
-
-	offset = (off_t) uid * sizeof (fl);
-	if (offset + sizeof (fl) <= statbuf.st_size) {
-		/* fseeko errors are not really relevant for us. */
-		int err = fseeko (fail, offset, SEEK_SET);
-		assert (0 == err);
-		/* faillog is a sparse file. Even if no entries were
-		 * entered for this user, which should be able to get the
-		 * empty entry in this case.
-		 */
-		if (fread (&fl, sizeof (fl), 1, fail) != 1) {
-			fprintf (stderr,
-			         _("%s: Failed to get the entry for UID %lu\n"),
-			         Prog, (unsigned long int)uid);
-			return true;
-		}
-	} else {
-		/* Outsize of the faillog file.
-		 * Behave as if there were a missing entry (same behavior
-		 * as if we were reading an non existing entry in the
-		 * sparse faillog file).
-		 */
-		memzero (&fl, sizeof (fl));
-	}
-
-	if (locktime == fl.fail_locktime) {
-		/* If the locktime is already set to the right value, do not
-		 * write in the file.
-		 * This avoids writing 0 when no entries were present for
-		 * the user and the locktime argument is 0.
-		 */
-		return false;
-	}
-
-	fl.fail_locktime = locktime;
-
-	if (   (fseeko (fail, offset, SEEK_SET) == 0)
-	    && (fwrite (&fl, sizeof (fl), 1, fail) == 1)) {
-		(void) fflush (fail);
-		return false;
-	}
-
-	fprintf (stderr,
-	         _("%s: Failed to set locktime for UID %lu\n"),
-	         Prog, (unsigned long int)uid);
-	return true;
-}
-
 static void set_locktime (long locktime)
 {
 	if (uflg && has_umin && has_umax && (umin==umax)) {
-		if (set_locktime_one (umin, locktime)) {
+		if (update_range (umin, umin, set_locktime_fl, locktime,
+		                  (0 == locktime),
+		                  _("%s: Failed to set locktime for UID %lu\n"))) {
 			errors = true;
 		}
 	} else {
@@ -510,11 +723,10 @@ static void set_locktime (long locktime)
 				uidmax = umax;
 			}
 
-			while (uid <= uidmax) {
-				if (set_locktime_one (uid, locktime)) {
-					errors = true;
-				}
-				uid++;
+			if (update_range (uid, uidmax, set_locktime_fl, locktime,
+			                  (0 == locktime),
+			                  _("%s: Failed to set locktime for UID %lu\n"))) {
+				errors = true;
 			}
 		} else {
 			/* Only change records for existing users.
@@ -528,7 +740,10 @@ static void set_locktime (long locktime)
 				        || (has_umax && (pwent->pw_uid > (uid_t)umax)))) {
 					continue;
 				}
-				if (set_locktime_one (pwent->pw_uid, locktime)) {
+				if (update_range (pwent->pw_uid, pwent->pw_uid,
+				                  set_locktime_fl, locktime,
+				                  (0 == locktime),
+				                  _("%s: Failed to set locktime for UID %lu\n"))) {
 					errors = true;
 				}
 			}
@@ -537,6 +752,43 @@ static void set_locktime (long locktime)
 	}
 }
 
+/*
+ * transfer - Copy the records of the faillog file to the account state
+ *            store (import), or of the store to the faillog file.
+ */
+NORETURN static void transfer (bool import)
+{
+	unsigned long count;
+	int fd;
+
+	fd = open (FAILLOG_FILE,
+	           (import ? O_RDONLY : (O_RDWR | O_CREAT)) | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		fprintf (stderr,
+		         _("%s: Cannot open %s: %s\n"),
+		         Prog, FAILLOG_FILE, strerror (errno));
+		exit (E_NOPERM);
+	}
+	if (   (acct_state_open (import) != 0)
+	    || (  import
+	        ? acct_state_import (fd, ACCT_FAILLOG, &count)
+	        : acct_state_export (fd, ACCT_FAILLOG, &count)) != 0) {
+		fprintf (stderr,
+		         _("%s: Failed to write %s: %s\n"),
+		         Prog, import ? acct_state_file () : FAILLOG_FILE,
+		         strerror (errno));
+		exit (E_NOPERM);
+	}
+	(void) close (fd);
+	(void) acct_state_close ();
+	if (import) {
+		printf (_("%lu records imported from %s\n"), count, FAILLOG_FILE);
+	} else {
+		printf (_("%lu records exported to %s\n"), count, FAILLOG_FILE);
+	}
+	exit (E_SUCCESS);
+}
+
 int main (int argc, char **argv)
 {
 	long fail_locktime = 0;
@@ -561,7 +813,10 @@ int main (int argc, char **argv)
 		int c;
 		static struct option long_options[] = {
 			{"all",       no_argument,       NULL, 'a'},
+			{"format",    required_argument, NULL, 200},
+			{"export",    no_argument,       NULL, 202},
 			{"help",      no_argument,       NULL, 'h'},
+			{"import",    no_argument,       NULL, 201},
 			{"lock-secs", required_argument, NULL, 'l'},
 			{"maximum",   required_argument, NULL, 'm'},
 			{"reset",     no_argument,       NULL, 'r'},
@@ -576,6 +831,20 @@ int main (int argc, char **argv)
 			case 'a':
 				aflg = true;
 				break;
+			case 200:
+				if (!output_set_format (optarg)) {
+					fprintf (stderr,
+					         _("%s: invalid output format '%s'\n"),
+					         Prog, optarg);
+					usage (E_USAGE);
+				}
+				break;
+			case 201:
+				Iflg = true;
+				break;
+			case 202:
+				Eflg = true;
+				break;
 			case 'h':
 				usage (E_SUCCESS);
 				/*@notreached@*/break;
@@ -664,25 +933,43 @@ int main (int argc, char **argv)
 	if (tflg && (lflg || mflg || rflg)) {
 		usage (E_USAGE);
 	}
+	if (   (Iflg || Eflg)
+	    && (   (Iflg && Eflg)
+	        || aflg || tflg || uflg || lflg || mflg || rflg)) {
+		fprintf (stderr,
+		         _("%s: --import and --export cannot be used with other options\n"),
+		         Prog);
+		usage (E_USAGE);
+	}
 
-	/* Open the faillog database */
-	if (lflg || mflg || rflg) {
-		fail = fopen (FAILLOG_FILE, "r+");
-	} else {
-		fail = fopen (FAILLOG_FILE, "r");
+	use_store = acct_state_enabled ();
+	if (Iflg || Eflg) {
+		if (!use_store) {
+			fprintf (stderr,
+			         _("%s: ACCOUNT_STATE_FILE is not set\n"),
+			         Prog);
+			exit (E_BAD_ARG);
+		}
+		transfer (Iflg);
+		/* NOTREACHED */
 	}
-	if (NULL == fail) {
+
+	/* Open the faillog database */
+	fail = faillog_open (lflg || mflg || rflg);
+	if (fail < 0) {
 		fprintf (stderr,
 		         _("%s: Cannot open %s: %s\n"),
-		         Prog, FAILLOG_FILE, strerror (errno));
+		         Prog, faillog_name (), strerror (errno));
 		exit (E_NOPERM);
 	}
 
 	/* Get the size of the faillog */
-	if (fstat (fileno (fail), &statbuf) != 0) {
+	if (use_store) {
+		load_store ();
+	} else if (fstat (fail, &statbuf) != 0) {
 		fprintf (stderr,
 		         _("%s: Cannot get the size of %s: %s\n"),
-		         Prog, FAILLOG_FILE, strerror (errno));
+		         Prog, faillog_name (), strerror (errno));
 		exit (E_NOPERM);
 	}
 
@@ -703,18 +990,16 @@ int main (int argc, char **argv)
 	}
 
 	if (lflg || mflg || rflg) {
-		if (   (ferror (fail) != 0)
-		    || (fflush (fail) != 0)
-		    || (fsync  (fileno (fail)) != 0)
-		    || (fclose (fail) != 0)) {
+		if (   (faillog_sync () != 0)
+		    || (faillog_close () != 0)) {
 			fprintf (stderr,
 			         _("%s: Failed to write %s: %s\n"),
-			         Prog, FAILLOG_FILE, strerror (errno));
-			(void) fclose (fail);
+			         Prog, faillog_name (), strerror (errno));
+			(void) faillog_close ();
 			errors = true;
 		}
 	} else {
-		(void) fclose (fail);
+		(void) faillog_close ();
 	}
 
 	exit (errors ? E_NOPERM : E_SUCCESS);
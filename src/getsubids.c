@@ -1,33 +1,401 @@
 /* SPDX-License-Identifier: BSD-3-Clause */
 
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include "subid.h"
+#include "getdef.h"
 #include "prototypes.h"
 #include "shadowlog.h"
+#include "subordinateio.h"
 
 const char *Prog;
 
 static void usage(void)
 {
-	fprintf(stderr, "Usage: %s [-g] user\n", Prog);
+	fprintf(stderr, "Usage: %s [--format=FORMAT] [-g] user\n", Prog);
+	fprintf(stderr, "       %s [--format=FORMAT] --stdin\n", Prog);
+	fprintf(stderr, "       %s [-g] --export\n", Prog);
+	fprintf(stderr, "       %s [-g] --import FILE\n", Prog);
+	fprintf(stderr, "       %s [-g] --compact|--fragmentation\n", Prog);
 	fprintf(stderr, "    list subuid ranges for user\n");
 	fprintf(stderr, "    pass -g to list subgid ranges\n");
+	fprintf(stderr, "    pass --format=tsv or --format=json for machine readable output\n");
+	fprintf(stderr, "    pass --stdin to read one [-g] user query per line\n");
+	fprintf(stderr, "    pass --export to list all the subuid (or subgid) ranges\n");
+	fprintf(stderr, "    pass --import to add all the ranges of FILE (- for stdin)\n");
+	fprintf(stderr, "    pass --compact to merge the adjacent ranges of each owner\n");
+	fprintf(stderr, "    pass --fragmentation to only report what --compact would do\n");
 	exit(EXIT_FAILURE);
 }
 
+static const char *const fields[] = {
+	"index", "owner", "start", "count", NULL
+};
+
+static void print_ranges(const char *owner, const struct subid_range *ranges,
+	int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (output_structured()) {
+			output_num(i);
+			output_str(owner);
+			output_num(ranges[i].start);
+			output_num(ranges[i].count);
+			output_row_end();
+			continue;
+		}
+		printf("%d: %s %lu %lu\n", i, owner,
+			ranges[i].start, ranges[i].count);
+	}
+}
+
+/*
+ * query_stdin - answer the queries read from the standard input
+ *
+ * Each line is a user, optionally preceded by -g, as on the command line.
+ * The databases are only loaded once, and the answer of each line is
+ * written as soon as the line is read. Without --format, an empty line
+ * ends the ranges of each query.
+ *
+ * Returns the exit status: 1 if a query failed.
+ */
+static int query_stdin(void)
+{
+	struct subid_ctx *uid_ctx = NULL, *gid_ctx = NULL;
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	int status = 0;
+
+	output_begin(fields);
+	while ((len = getline(&line, &size, stdin)) != -1) {
+		struct subid_ctx **ctx = &uid_ctx;
+		enum subid_type id_type = ID_TYPE_UID;
+		struct subid_query q;
+		char *owner = line;
+
+		if ((len > 0) && (line[len - 1] == '\n'))
+			line[len - 1] = '\0';
+		if (strncmp(owner, "-g ", 3) == 0) {
+			ctx = &gid_ctx;
+			id_type = ID_TYPE_GID;
+			owner += 3;
+		}
+		owner += strspn(owner, " \t");
+
+		memset(&q, 0, sizeof q);
+		q.owner = owner;
+		q.count = -1;
+		if ('\0' != *owner) {
+			if (NULL == *ctx)
+				*ctx = subid_open(id_type);
+			if (NULL != *ctx)
+				(void) subid_query_many(*ctx, &q, 1);
+		}
+		if (q.count < 0) {
+			fprintf(stderr, "Error fetching ranges for '%s'\n", owner);
+			status = 1;
+		} else {
+			print_ranges(owner, q.ranges, q.count);
+		}
+		free(q.ranges);
+		if (!output_structured())
+			putchar('\n');
+		fflush(stdout);
+	}
+	output_end();
+
+	free(line);
+	subid_close(uid_ctx);
+	subid_close(gid_ctx);
+	return status;
+}
+
+/*
+ * export_all - write all the ranges of the local database
+ *
+ * The ranges are sorted by start, in the format of /etc/subuid.
+ */
+static int export_all(enum subid_type id_type)
+{
+	bool gid = (ID_TYPE_GID == id_type);
+	const char *dbname = gid ? sub_gid_dbname() : sub_uid_dbname();
+	int ret;
+
+	if ((gid ? sub_gid_open(O_RDONLY) : sub_uid_open(O_RDONLY)) == 0) {
+		fprintf(stderr, "%s: cannot open %s\n", Prog, dbname);
+		return 1;
+	}
+	ret = gid ? sub_gid_export(stdout) : sub_uid_export(stdout);
+	(void) (gid ? sub_gid_close() : sub_uid_close());
+	if ((0 != ret) || (fflush(stdout) != 0)) {
+		fprintf(stderr, "%s: cannot export %s: %s\n",
+			Prog, dbname, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * read_ranges - read the owner:start:count lines of an export
+ *
+ * Empty lines and lines starting with # are skipped. The line of each
+ * range is stored in lines.
+ *
+ * Returns the number of ranges, or -1 if a line is invalid.
+ */
+static ssize_t read_ranges(FILE *in, struct subordinate_range **ranges,
+	int **lines)
+{
+	char *line = NULL;
+	size_t size = 0;
+	ssize_t len;
+	size_t n = 0;
+	int lineno = 0;
+	bool bad = false;
+
+	*ranges = NULL;
+	*lines = NULL;
+	while ((len = getline(&line, &size, in)) != -1) {
+		struct subordinate_range range;
+		char *start, *count;
+
+		lineno++;
+		if ((len > 0) && (line[len - 1] == '\n'))
+			line[len - 1] = '\0';
+		if (('\0' == line[0]) || ('#' == line[0]))
+			continue;
+
+		start = strchr(line, ':');
+		count = (NULL != start) ? strchr(start + 1, ':') : NULL;
+		if ((NULL == count) || (start == line)) {
+			fprintf(stderr, "%s: line %d: invalid range\n",
+				Prog, lineno);
+			bad = true;
+			continue;
+		}
+		*start++ = '\0';
+		*count++ = '\0';
+		if (   (getulong(start, &range.start) == 0)
+		    || (getulong(count, &range.count) == 0)
+		    || (0 == range.count)
+		    || (range.start + range.count - 1 < range.start)) {
+			fprintf(stderr, "%s: line %d: invalid range\n",
+				Prog, lineno);
+			bad = true;
+			continue;
+		}
+		range.owner = xstrdup(line);
+
+		if (0 == (n % 64)) {
+			struct subordinate_range *r;
+			int *l;
+
+			r = realloc(*ranges, (n + 64) * sizeof *r);
+			if (NULL != r)
+				*ranges = r;
+			l = realloc(*lines, (n + 64) * sizeof *l);
+			if (NULL != l)
+				*lines = l;
+			if ((NULL == r) || (NULL == l)) {
+				fprintf(stderr, "%s: out of memory\n", Prog);
+				exit(EXIT_FAILURE);
+			}
+		}
+		(*ranges)[n] = range;
+		(*lines)[n] = lineno;
+		n++;
+	}
+	free(line);
+	if (ferror(in)) {
+		fprintf(stderr, "%s: cannot read the ranges: %s\n",
+			Prog, strerror(errno));
+		bad = true;
+	}
+	return bad ? -1 : (ssize_t) n;
+}
+
+/*
+ * import_all - add all the ranges of an export to the local database
+ *
+ * The ranges are checked against each other and the database in a
+ * single pass, and written in a single commit. Nothing is written if a
+ * range is invalid or overlaps another one. The ranges already in the
+ * database are skipped.
+ */
+static int import_all(enum subid_type id_type, const char *file)
+{
+	bool gid = (ID_TYPE_GID == id_type);
+	const char *dbname = gid ? sub_gid_dbname() : sub_uid_dbname();
+	struct subordinate_range *ranges;
+	int *lines;
+	FILE *in = stdin;
+	ssize_t n;
+	size_t bad;
+	int added;
+
+	if (strcmp(file, "-") != 0) {
+		in = fopen(file, "r");
+		if (NULL == in) {
+			fprintf(stderr, "%s: cannot open %s: %s\n",
+				Prog, file, strerror(errno));
+			return 1;
+		}
+	}
+	n = read_ranges(in, &ranges, &lines);
+	if (stdin != in)
+		(void) fclose(in);
+	if (n < 0)
+		return 1;
+
+	if ((gid ? sub_gid_lock() : sub_uid_lock()) == 0) {
+		fprintf(stderr, "%s: cannot lock %s; try again later.\n",
+			Prog, dbname);
+		return 1;
+	}
+	if ((gid ? sub_gid_open(O_CREAT | O_RDWR)
+	         : sub_uid_open(O_CREAT | O_RDWR)) == 0) {
+		fprintf(stderr, "%s: cannot open %s\n", Prog, dbname);
+		goto fail;
+	}
+	added = gid ? sub_gid_import(ranges, n, &bad)
+	            : sub_uid_import(ranges, n, &bad);
+	if (added < 0) {
+		if (EEXIST == errno) {
+			fprintf(stderr,
+				"%s: line %d: range %s:%lu:%lu overlaps another range\n",
+				Prog, lines[bad], ranges[bad].owner,
+				ranges[bad].start, ranges[bad].count);
+		} else {
+			fprintf(stderr, "%s: cannot import the ranges in %s: %s\n",
+				Prog, dbname, strerror(errno));
+		}
+		goto fail;
+	}
+	if ((gid ? sub_gid_close() : sub_uid_close()) == 0) {
+		fprintf(stderr, "%s: failure while writing changes to %s\n",
+			Prog, dbname);
+		goto fail;
+	}
+	(void) (gid ? sub_gid_unlock() : sub_uid_unlock());
+	return 0;
+
+fail:
+	(void) (gid ? sub_gid_unlock() : sub_uid_unlock());
+	return 1;
+}
+
+static void print_overlap(const struct subordinate_range *range,
+	const struct subordinate_range *other)
+{
+	printf("overlap: %s:%lu:%lu %s:%lu:%lu\n",
+		range->owner, range->start, range->count,
+		other->owner, other->start, other->count);
+}
+
+/*
+ * compact_all - merge the ranges of each owner in the local database
+ *
+ * The ranges of an owner which overlap or follow each other are merged,
+ * and the database is rewritten sorted by start, unless check is set.
+ * The fragmentation of the ranges is reported in both cases.
+ */
+static int compact_all(enum subid_type id_type, bool check)
+{
+	bool gid = (ID_TYPE_GID == id_type);
+	const char *dbname = gid ? sub_gid_dbname() : sub_uid_dbname();
+	unsigned long min_count;
+	struct subid_fragmentation frag;
+	int ret;
+
+	min_count = getdef_ulong(gid ? "SUB_GID_COUNT" : "SUB_UID_COUNT",
+				 65536);
+	if (!check && ((gid ? sub_gid_lock() : sub_uid_lock()) == 0)) {
+		fprintf(stderr, "%s: cannot lock %s; try again later.\n",
+			Prog, dbname);
+		return 1;
+	}
+	if ((gid ? sub_gid_open(check ? O_RDONLY : O_RDWR)
+	         : sub_uid_open(check ? O_RDONLY : O_RDWR)) == 0) {
+		fprintf(stderr, "%s: cannot open %s\n", Prog, dbname);
+		goto fail;
+	}
+	ret = gid ? sub_gid_compact(min_count, !check, &frag, print_overlap)
+	          : sub_uid_compact(min_count, !check, &frag, print_overlap);
+	if (0 != ret) {
+		fprintf(stderr, "%s: cannot compact %s: %s\n",
+			Prog, dbname, strerror(errno));
+		(void) (gid ? sub_gid_close() : sub_uid_close());
+		goto fail;
+	}
+	if ((gid ? sub_gid_close() : sub_uid_close()) == 0) {
+		fprintf(stderr, "%s: failure while writing changes to %s\n",
+			Prog, dbname);
+		goto fail;
+	}
+	if (!check)
+		(void) (gid ? sub_gid_unlock() : sub_uid_unlock());
+
+	printf("ranges: %zu\n", frag.ranges);
+	printf("merged: %zu\n", frag.merged);
+	printf("overlaps: %zu\n", frag.overlaps);
+	printf("holes: %zu\n", frag.holes);
+	printf("holes smaller than %lu: %zu (%lu IDs)\n",
+		min_count, frag.small_holes, frag.wasted);
+	return 0;
+
+fail:
+	if (!check)
+		(void) (gid ? sub_gid_unlock() : sub_uid_unlock());
+	return 1;
+}
+
 int main(int argc, char *argv[])
 {
-	int i, count=0;
+	int count=0;
 	struct subid_range *ranges;
 	const char *owner;
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
 	log_set_logfd(stderr);
+	if (argc > 1 && strncmp(argv[1], "--format=", 9) == 0) {
+		if (!output_set_format(&argv[1][9]))
+			usage();
+		argv++;
+		argc--;
+	}
 	if (argc < 2)
 		usage();
+	if (argc == 2 && strcmp(argv[1], "--stdin") == 0)
+		return query_stdin();
+	if (argc == 2 && strcmp(argv[1], "--export") == 0)
+		return export_all(ID_TYPE_UID);
+	if (argc == 3 && strcmp(argv[1], "-g") == 0
+	    && strcmp(argv[2], "--export") == 0)
+		return export_all(ID_TYPE_GID);
+	if (argc == 3 && strcmp(argv[1], "--import") == 0)
+		return import_all(ID_TYPE_UID, argv[2]);
+	if (argc == 4 && strcmp(argv[1], "-g") == 0
+	    && strcmp(argv[2], "--import") == 0)
+		return import_all(ID_TYPE_GID, argv[3]);
+	if (argc == 2 && strcmp(argv[1], "--compact") == 0)
+		return compact_all(ID_TYPE_UID, false);
+	if (argc == 2 && strcmp(argv[1], "--fragmentation") == 0)
+		return compact_all(ID_TYPE_UID, true);
+	if (argc == 3 && strcmp(argv[1], "-g") == 0
+	    && strcmp(argv[2], "--compact") == 0)
+		return compact_all(ID_TYPE_GID, false);
+	if (argc == 3 && strcmp(argv[1], "-g") == 0
+	    && strcmp(argv[2], "--fragmentation") == 0)
+		return compact_all(ID_TYPE_GID, true);
 	owner = argv[1];
 	if (argc == 3 && strcmp(argv[1], "-g") == 0) {
 		owner = argv[2];
@@ -41,9 +409,8 @@ int main(int argc, char *argv[])
 		fprintf(stderr, "Error fetching ranges\n");
 		exit(1);
 	}
-	for (i = 0; i < count; i++) {
-		printf("%d: %s %lu %lu\n", i, owner,
-			ranges[i].start, ranges[i].count);
-	}
+	output_begin(fields);
+	print_ranges(owner, ranges, count);
+	output_end();
 	return 0;
 }
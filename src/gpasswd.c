@@ -21,9 +21,8 @@
 #include <sys/types.h>
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
+#include "pwio.h"
 #ifdef SHADOWGRP
 #include "sgroupio.h"
 #endif
@@ -41,6 +40,8 @@ const char *Prog;
 /* Indicate if shadow groups are enabled on the system
  * (/etc/gshadow present) */
 static bool is_shadowgrp;
+/* Indicate if the gshadow entry of the group is new */
+static bool sgent_created = false;
 #endif
 
 /* Flags set by options */
@@ -166,8 +167,22 @@ static bool is_valid_user_list (const char *users)
 	const char *username;
 	char *end;
 	bool is_valid = true;
+	bool opened = false;
+	size_t count = 1;
 	/*@owned@*/char *tmpusers = xstrdup (users);
 
+	/*
+	 * For a long list, the passwd file is read once, instead of a
+	 * name service lookup for each user.
+	 */
+	for (username = users; NULL != (username = strchr (username, ','));
+	     username++) {
+		count++;
+	}
+	if (count >= MEMBER_SET_MIN) {
+		opened = (pw_open (O_RDONLY) != 0);
+	}
+
 	for (username = tmpusers;
 	     (NULL != username) && ('\0' != *username);
 	     username = end) {
@@ -181,14 +196,16 @@ static bool is_valid_user_list (const char *users)
 		 * This user must exist.
 		 */
 
-		/* local, no need for xgetpwnam */
-		if (getpwnam (username) == NULL) {
+		if (!user_exists (username)) {
 			fprintf (stderr, _("%s: user '%s' does not exist\n"),
 			         Prog, username);
 			is_valid = false;
 		}
 	}
 
+	if (opened) {
+		(void) pw_close ();
+	}
 	free (tmpusers);
 
 	return is_valid;
@@ -348,6 +365,7 @@ static void open_files (void)
 
 	add_cleanup (log_gpasswd_failure_system, NULL);
 
+	gr_compact ();
 	if (gr_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"),
@@ -358,6 +376,7 @@ static void open_files (void)
 
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
+		sgr_compact ();
 		if (sgr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -781,6 +800,7 @@ static void get_group (struct group *gr)
 	struct sgrp const*tmpsg = NULL;
 #endif
 
+	gr_compact ();
 	if (gr_open (O_RDONLY) == 0) {
 		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
 		SYSLOG ((LOG_WARN, "cannot open %s", gr_dbname ()));
@@ -812,6 +832,7 @@ static void get_group (struct group *gr)
 
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
+		sgr_compact ();
 		if (sgr_open (O_RDONLY) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -828,6 +849,7 @@ static void get_group (struct group *gr)
 			sg->sg_mem = dup_list (tmpsg->sg_mem);
 			sg->sg_adm = dup_list (tmpsg->sg_adm);
 		} else {
+			sgent_created = true;
 			sg->sg_name = xstrdup (group);
 			sg->sg_passwd = gr->gr_passwd;
 			gr->gr_passwd = SHADOW_PASSWD_STRING;	/* XXX warning: const */
@@ -1117,15 +1139,29 @@ int main (int argc, char **argv)
 #endif				/* SHADOWGRP */
 
 	/*
-	 * Replacing the entire list of members is simple. Check the list to
-	 * make sure everyone is a real user. Then slap the new list in
-	 * place.
+	 * Replacing the entire list of members only changes the members
+	 * which are added or removed: the others keep their place. The
+	 * files are not written if the group already has these members.
 	 */
 	if (Mflg) {
+		char **listed = comma_to_list (members);
+		char **mem;
+		bool changed;
+
+		mem = replace_members (grent.gr_mem, listed);
+		changed = (mem != grent.gr_mem);
+		grent.gr_mem = mem;
 #ifdef SHADOWGRP
-		sgent.sg_mem = comma_to_list (members);
+		if (is_shadowgrp) {
+			mem = replace_members (sgent.sg_mem, listed);
+			changed = changed || (mem != sgent.sg_mem) || sgent_created;
+			sgent.sg_mem = mem;
+		}
+		changed = changed || Aflg;
 #endif
-		grent.gr_mem = comma_to_list (members);
+		if (!changed) {
+			exit (E_SUCCESS);
+		}
 		goto output;
 	}
 
@@ -1179,9 +1215,6 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
 		free(sgent.sg_adm);
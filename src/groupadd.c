@@ -27,8 +27,6 @@
 #include "defines.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -65,6 +63,10 @@ static bool fflg = false;	/* if group already exists, do nothing and exit(0) */
 static bool rflg = false;	/* create a system account */
 static bool pflg = false;	/* new encrypted password */
 
+/* GID leased before the database was locked (RESERVE_IDS) */
+static bool gid_reserved = false;
+static gid_t reserved_gid;
+
 #ifdef SHADOWGRP
 static bool is_shadow_grp;
 #endif
@@ -80,6 +82,7 @@ static void grp_update (void);
 static void check_new_name (void);
 static void close_files (void);
 static void open_files (void);
+static void reserve_group_id (void);
 static void process_flags (int argc, char **argv);
 static void check_flags (void);
 static void check_perms (void);
@@ -97,6 +100,8 @@ usage (int status)
 	                  "\n"
 	                  "Options:\n"),
 	                Prog);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -f, --force                   exit successfully if the group already exists,\n"
 	                "                                and cancel -g if the GID is already used\n"), usageout);
 	(void) fputs (_("  -g, --gid GID                 use GID for the new group\n"), usageout);
@@ -108,6 +113,8 @@ usage (int status)
 	(void) fputs (_("  -r, --system                  create a system account\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DI        directory prefix\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs (_("  -U, --users USERS             list of user members of this group\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
@@ -190,16 +197,21 @@ static void grp_update (void)
 #endif				/* SHADOWGRP */
 
 	if (user_list) {
-		char *token;
-		token = strtok(user_list, ",");
-		while (token) {
-			if (prefix_getpwnam (token) == NULL) {
-				fprintf (stderr, _("Invalid member username %s\n"), token);
+		char **members;
+		size_t i, n;
+		members = comma_to_list (user_list);
+		for (i = 0, n = 0; NULL != members[i]; i++) {
+			if ('\0' == members[i][0]) {
+				continue;
+			}
+			if (prefix_getpwnam (members[i]) == NULL) {
+				fprintf (stderr, _("Invalid member username %s\n"), members[i]);
 				exit (E_GRP_UPDATE);
 			}
-			grp.gr_mem = add_list(grp.gr_mem, token);
-			token = strtok(NULL, ",");
+			members[n++] = members[i];
 		}
+		members[n] = NULL;
+		grp.gr_mem = add_members (grp.gr_mem, members);
 	}
 
 	/*
@@ -365,6 +377,26 @@ static void open_files (void)
  *
  *	It will not return if an error is encountered.
  */
+/*
+ * reserve_group_id - pick and lease the GID of the group before the
+ *	database is locked
+ *
+ *	The database is only opened for reading, so that the groupadd
+ *	running in parallel only wait for each other to commit. The GID
+ *	is checked again once the database is locked.
+ */
+static void reserve_group_id (void)
+{
+	if (gr_open (O_RDONLY) == 0) {
+		return;
+	}
+	if (reserve_new_gid (rflg, &reserved_gid) < 0) {
+		exit (E_GID_IN_USE);
+	}
+	gid_reserved = true;
+	(void) gr_close ();
+}
+
 static void process_flags (int argc, char **argv)
 {
 	/*
@@ -373,6 +405,7 @@ static void process_flags (int argc, char **argv)
 	char *cp;
 	int c;
 	static struct option long_options[] = {
+		{"deadline",   required_argument, NULL, 201},
 		{"force",      no_argument,       NULL, 'f'},
 		{"gid",        required_argument, NULL, 'g'},
 		{"help",       no_argument,       NULL, 'h'},
@@ -382,6 +415,7 @@ static void process_flags (int argc, char **argv)
 		{"system",     no_argument,       NULL, 'r'},
 		{"root",       required_argument, NULL, 'R'},
 		{"prefix",     required_argument, NULL, 'P'},
+		{"shard",      required_argument, NULL, 200},
 		{"users",      required_argument, NULL, 'U'},
 		{NULL, 0, NULL, '\0'}
 	};
@@ -445,6 +479,10 @@ static void process_flags (int argc, char **argv)
 			break;
 		case 'P': /* no-op, handled in process_prefix_flag () */
 			break;
+		case 200: /* no-op, handled in process_shard_flag () */
+			break;
+		case 201: /* no-op, handled in process_deadline_flag () */
+			break;
 		case 'U':
 			user_list = optarg;
 			break;
@@ -583,6 +621,8 @@ int main (int argc, char **argv)
 
 	process_root_flag ("-R", argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
 
 	OPENLOG ("groupadd");
 #ifdef WITH_AUDIT
@@ -611,9 +651,17 @@ int main (int argc, char **argv)
 	 * Do the hard stuff - open the files, create the group entries,
 	 * then close and update the files.
 	 */
+	if (!gflg && getdef_bool ("RESERVE_IDS")) {
+		reserve_group_id ();
+	}
 	open_files ();
 
-	if (!gflg) {
+	if (   !gflg
+	    && gid_reserved
+	    && (gr_locate_gid (reserved_gid) == NULL)) {
+		/* The leased GID was not used meanwhile */
+		group_id = reserved_gid;
+	} else if (!gflg) {
 		if (find_new_gid (rflg, &group_id, NULL) < 0) {
 			exit (E_GID_IN_USE);
 		}
@@ -622,8 +670,9 @@ int main (int argc, char **argv)
 	grp_update ();
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
+	if (gid_reserved) {
+		id_lease_release (gr_dbname (), reserved_gid);
+	}
 
 	return E_SUCCESS;
 }
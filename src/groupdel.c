@@ -25,8 +25,6 @@
 #include <getopt.h>
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -78,9 +76,13 @@ usage (int status)
 	                  "\n"
 	                  "Options:\n"),
 	                Prog);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs (_("  -f, --force                   delete group even if it is the primary group of a user\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
@@ -228,6 +230,7 @@ static void open_files (void)
 	add_cleanup (cleanup_report_del_group, group_name);
 
 	/* An now open the databases */
+	gr_compact ();
 	if (gr_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"),
@@ -237,6 +240,7 @@ static void open_files (void)
 	}
 #ifdef	SHADOWGRP
 	if (is_shadow_grp) {
+		sgr_compact ();
 		if (sgr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -257,23 +261,15 @@ static void open_files (void)
  */
 static void group_busy (gid_t gid)
 {
-	struct passwd *pwd;
+	char **users;
 
 	/*
-	 * Nice slow linear search.
+	 * The lookup index of the passwd file knows the users of a
+	 * primary group, otherwise this is a linear search.
 	 */
-
-	prefix_setpwent ();
-
-	while ( ((pwd = prefix_getpwent ()) != NULL) && (pwd->pw_gid != gid) );
-
-	prefix_endpwent ();
-
-	/*
-	 * If pwd isn't NULL, it stopped because the gid's matched.
-	 */
-
-	if (pwd == NULL) {
+	users = prefix_gid_users (gid, 1);
+	if (NULL == users[0]) {
+		free (users);
 		return;
 	}
 
@@ -282,7 +278,7 @@ static void group_busy (gid_t gid)
 	 */
 	fprintf (stderr,
 	         _("%s: cannot remove the primary group of user '%s'\n"),
-	         Prog, pwd->pw_name);
+	         Prog, users[0]);
 	exit (E_GROUP_BUSY);
 }
 
@@ -300,8 +296,10 @@ static void process_flags (int argc, char **argv)
 	static struct option long_options[] = {
 		{"help", no_argument,       NULL, 'h'},
 		{"force", no_argument,      NULL, 'f'},
+		{"deadline", required_argument, NULL, 201},
 		{"root", required_argument, NULL, 'R'},
 		{"prefix", required_argument, NULL, 'P'},
+		{"shard",  required_argument, NULL, 200},
 		{NULL, 0, NULL, '\0'}
 	};
 
@@ -315,6 +313,10 @@ static void process_flags (int argc, char **argv)
 			break;
 		case 'P': /* no-op, handled in process_prefix_flag () */
 			break;
+		case 200: /* no-op, handled in process_shard_flag () */
+			break;
+		case 201: /* no-op, handled in process_deadline_flag () */
+			break;
 		case 'f':
 			check_group_busy = false;
 			break;
@@ -361,6 +363,8 @@ int main (int argc, char **argv)
 
 	process_root_flag ("-R", argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
 
 	OPENLOG ("groupdel");
 #ifdef WITH_AUDIT
@@ -471,9 +475,6 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 	return E_SUCCESS;
 }
 
@@ -9,6 +9,8 @@
 
 #include <config.h>
 
+#include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <grp.h>
@@ -18,9 +20,11 @@
 #include "pam_defs.h"
 #endif				/* USE_PAM */
 #include <pwd.h>
+#include "chkname.h"
 #include "defines.h"
 #include "prototypes.h"
 #include "groupio.h"
+#include "pwio.h"
 #ifdef SHADOWGRP
 #include "sgroupio.h"
 #endif
@@ -49,6 +53,8 @@ static char *deluser = NULL;
 static char *thisgroup = NULL;
 static bool purge = false;
 static bool list = false;
+/* --sync: file with the desired members of the groups */
+static /*@null@*/const char *sync_file = NULL;
 static int exclusive = 0;
 static bool gr_locked = false;
 #ifdef SHADOWGRP
@@ -70,6 +76,12 @@ NORETURN static void usage (int status);
 static void process_flags (int argc, char **argv);
 static void check_perms (void);
 static void fail_exit (int code);
+static /*@only@*/char **sorted_list (char *const *members, size_t *count);
+static void set_members (const struct group *grp, char **members,
+                         char *const *removed);
+static void new_group (const char *name, char **members);
+static int sync_group (char *line, unsigned int lineno);
+static void sync_groups (const char *file);
 #define isroot()		(getuid () == 0)
 
 static char *whoami (void)
@@ -95,6 +107,7 @@ static void add_user (const char *user,
                       const struct group *grp)
 {
 	struct group *newgrp;
+	struct group grent;
 
 	/* Make sure the user is not already part of the group */
 	if (is_on_list (grp->gr_mem, user)) {
@@ -104,21 +117,21 @@ static void add_user (const char *user,
 		fail_exit (EXIT_MEMBER_EXISTS);
 	}
 
-	newgrp = __gr_dup(grp);
-	if (NULL == newgrp) {
-		fprintf (stderr,
-		         _("%s: Out of memory. Cannot update %s.\n"),
-		         Prog, gr_dbname ());
-		fail_exit (13);
-	}
+	/*
+	 * Only the list of members is copied: gr_update() copies the
+	 * entry before it replaces grp.
+	 */
+	grent = *grp;
+	newgrp = &grent;
 
 	/* Add the user to the /etc/group group */
-	newgrp->gr_mem = add_list (newgrp->gr_mem, user);
+	newgrp->gr_mem = add_list (grp->gr_mem, user);
 
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
 		const struct sgrp *sg = sgr_locate (newgrp->gr_name);
 		struct sgrp *newsg;
+		struct sgrp sgent;
 
 		if (NULL == sg) {
 			/* Create a shadow group based on this group */
@@ -142,15 +155,10 @@ static void add_user (const char *user,
 
 			newsg = &sgrent;
 		} else {
-			newsg = __sgr_dup (sg);
-			if (NULL == newsg) {
-				fprintf (stderr,
-				         _("%s: Out of memory. Cannot update %s.\n"),
-				         Prog, sgr_dbname ());
-				fail_exit (13);
-			}
+			sgent = *sg;
+			newsg = &sgent;
 			/* Add the user to the members */
-			newsg->sg_mem = add_list (newsg->sg_mem, user);
+			newsg->sg_mem = add_list (sg->sg_mem, user);
 			/* Do not touch the administrators */
 		}
 
@@ -178,6 +186,7 @@ static void remove_user (const char *user,
                          const struct group *grp)
 {
 	struct group *newgrp;
+	struct group grent;
 
 	/* Check if the user is a member of the specified group */
 	if (!is_on_list (grp->gr_mem, user)) {
@@ -187,21 +196,21 @@ static void remove_user (const char *user,
 		fail_exit (EXIT_NOT_MEMBER);
 	}
 
-	newgrp = __gr_dup (grp);
-	if (NULL == newgrp) {
-		fprintf (stderr,
-		         _("%s: Out of memory. Cannot update %s.\n"),
-		         Prog, gr_dbname ());
-		fail_exit (13);
-	}
+	/*
+	 * Only the list of members is copied: gr_update() copies the
+	 * entry before it replaces grp.
+	 */
+	grent = *grp;
+	newgrp = &grent;
 
 	/* Remove the user from the /etc/group group */
-	newgrp->gr_mem = del_list (newgrp->gr_mem, user);
+	newgrp->gr_mem = del_list (grp->gr_mem, user);
 
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
 		const struct sgrp *sg = sgr_locate (newgrp->gr_name);
 		struct sgrp *newsg;
+		struct sgrp sgent;
 
 		if (NULL == sg) {
 			/* Create a shadow group based on this group */
@@ -225,17 +234,12 @@ static void remove_user (const char *user,
 
 			newsg = &sgrent;
 		} else {
-			newsg = __sgr_dup (sg);
-			if (NULL == newsg) {
-				fprintf (stderr,
-				         _("%s: Out of memory. Cannot update %s.\n"),
-				         Prog, sgr_dbname ());
-				fail_exit (13);
-			}
+			sgent = *sg;
+			newsg = &sgent;
 			/* Remove the user from the members */
-			newsg->sg_mem = del_list (newsg->sg_mem, user);
+			newsg->sg_mem = del_list (sg->sg_mem, user);
 			/* Remove the user from the administrators */
-			newsg->sg_adm = del_list (newsg->sg_adm, user);
+			newsg->sg_adm = del_list (sg->sg_adm, user);
 		}
 
 		if (sgr_update (newsg) == 0) {
@@ -359,6 +363,8 @@ usage (int status)
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -p, --purge                   purge all members from the group\n"), usageout);
 	(void) fputs (_("  -l, --list                    list the members of the group\n"), usageout);
+	(void) fputs (_("      --sync FILE               set the members of the groups listed in FILE\n"
+	                "                                (root only)\n"), usageout);
 	exit (status);
 }
 
@@ -376,6 +382,7 @@ static void process_flags (int argc, char **argv)
 		{"list",   no_argument,       NULL, 'l'},
 		{"purge",  no_argument,       NULL, 'p'},
 		{"root",   required_argument, NULL, 'R'},
+		{"sync",   required_argument, NULL, 200},
 		{NULL, 0, NULL, '\0'}
 	};
 
@@ -406,6 +413,10 @@ static void process_flags (int argc, char **argv)
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
 			break;
+		case 200:
+			sync_file = optarg;
+			++exclusive;
+			break;
 		default:
 			usage (EXIT_USAGE);
 		}
@@ -415,6 +426,11 @@ static void process_flags (int argc, char **argv)
 		usage (EXIT_USAGE);
 	}
 
+	/* --sync lists the groups */
+	if ((NULL != sync_file) && (NULL != thisgroup)) {
+		usage (EXIT_USAGE);
+	}
+
 	/* local, no need for xgetpwnam */
 	if (   (NULL != adduser)
 	    && (getpwnam (adduser) == NULL)) {
@@ -516,6 +532,7 @@ static void open_files (void)
 #endif
 	}
 
+	gr_compact ();
 	if (gr_open (list ? O_RDONLY : O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
 		fail_exit (EXIT_GROUP_FILE);
@@ -523,6 +540,7 @@ static void open_files (void)
 
 #ifdef SHADOWGRP
 	if (is_shadowgrp) {
+		sgr_compact ();
 		if (sgr_open (list ? O_RDONLY : O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr, _("%s: cannot open %s\n"), Prog, sgr_dbname ());
 			fail_exit (EXIT_GROUP_FILE);
@@ -566,6 +584,364 @@ static void close_files (void)
 #endif
 }
 
+static int cmp_names (const void *p1, const void *p2)
+{
+	return strcmp (*(char *const *) p1, *(char *const *) p2);
+}
+
+/*
+ * sorted_list - return a sorted copy of a list of names, without the
+ *               duplicates
+ */
+static /*@only@*/char **sorted_list (char *const *members, size_t *count)
+{
+	char **sorted;
+	size_t n, i, j;
+
+	for (n = 0; NULL != members[n]; n++);
+	sorted = xmalloc ((n + 1) * sizeof *sorted);
+	memcpy (sorted, members, n * sizeof *sorted);
+	qsort (sorted, n, sizeof *sorted, cmp_names);
+	for (i = 0, j = 0; i < n; i++) {
+		if ((0 == j) || (strcmp (sorted[j - 1], sorted[i]) != 0)) {
+			sorted[j++] = sorted[i];
+		}
+	}
+	sorted[j] = NULL;
+
+	*count = j;
+	return sorted;
+}
+
+/*
+ * set_members - Replace the members of a group
+ *
+ *	The members which are removed are also removed from the
+ *	administrators of the shadow group.
+ */
+static void set_members (const struct group *grp, char **members,
+                         char *const *removed)
+{
+	struct group *newgrp;
+
+	newgrp = __gr_dup (grp);
+	if (NULL == newgrp) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, gr_dbname ());
+		fail_exit (13);
+	}
+	newgrp->gr_mem = members;
+
+#ifdef SHADOWGRP
+	if (is_shadowgrp) {
+		const struct sgrp *sg = sgr_locate (newgrp->gr_name);
+		struct sgrp *newsg;
+		size_t i;
+
+		if (NULL == sg) {
+			/* Create a shadow group based on this group */
+			static struct sgrp sgrent;
+			sgrent.sg_name = xstrdup (newgrp->gr_name);
+			sgrent.sg_mem = dup_list (members);
+			sgrent.sg_adm = (char **) xmalloc (sizeof (char *));
+#ifdef FIRST_MEMBER_IS_ADMIN
+			if (sgrent.sg_mem[0]) {
+				sgrent.sg_adm[0] = xstrdup (sgrent.sg_mem[0]);
+				sgrent.sg_adm[1] = NULL;
+			} else
+#endif
+			{
+				sgrent.sg_adm[0] = NULL;
+			}
+
+			/* Move any password to gshadow */
+			sgrent.sg_passwd = newgrp->gr_passwd;
+			newgrp->gr_passwd = SHADOW_PASSWD_STRING;
+
+			newsg = &sgrent;
+		} else {
+			newsg = __sgr_dup (sg);
+			if (NULL == newsg) {
+				fprintf (stderr,
+				         _("%s: Out of memory. Cannot update %s.\n"),
+				         Prog, sgr_dbname ());
+				fail_exit (13);
+			}
+			newsg->sg_mem = dup_list (members);
+			for (i = 0; NULL != removed[i]; i++) {
+				newsg->sg_adm = del_list (newsg->sg_adm, removed[i]);
+			}
+		}
+
+		if (sgr_update (newsg) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, sgr_dbname (), newsg->sg_name);
+			fail_exit (13);
+		}
+	}
+#endif
+
+	if (gr_update (newgrp) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, gr_dbname (), newgrp->gr_name);
+		fail_exit (13);
+	}
+}
+
+/*
+ * new_group - Create a group of --sync with the next free GID
+ */
+static void new_group (const char *name, char **members)
+{
+	static char *empty_list = NULL;
+	struct group grent;
+	gid_t gid;
+
+	if (find_new_gid (false, &gid, NULL) < 0) {
+		fail_exit (EXIT_GROUP_FILE);
+	}
+
+	memzero (&grent, sizeof grent);
+	grent.gr_name = xstrdup (name);
+	grent.gr_passwd = SHADOW_PASSWD_STRING;	/* XXX warning: const */
+	grent.gr_gid = gid;
+	grent.gr_mem = members;
+	if (gr_update (&grent) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, gr_dbname (), grent.gr_name);
+		fail_exit (13);
+	}
+
+#ifdef SHADOWGRP
+	if (is_shadowgrp) {
+		struct sgrp sgent;
+
+		memzero (&sgent, sizeof sgent);
+		sgent.sg_name = grent.gr_name;
+		sgent.sg_passwd = "!";	/* XXX warning: const */
+		sgent.sg_adm = &empty_list;
+		sgent.sg_mem = members;
+		if (sgr_update (&sgent) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, sgr_dbname (), sgent.sg_name);
+			fail_exit (13);
+		}
+	}
+#endif
+
+	SYSLOG ((LOG_INFO, "new group: name=%s, GID=%u",
+	         name, (unsigned int) gid));
+}
+
+/*
+ * sync_group - Apply a line of --sync
+ *
+ *	The line is "GROUP:MEMBER,...": the members of GROUP are set to the
+ *	listed users. The members which stay keep their order, the new
+ *	ones follow in the order of the line. A group which does not exist
+ *	is created, and a group already in this state is not rewritten.
+ *
+ *	Return 0 on success, or the exit status of groupmems.
+ */
+static int sync_group (char *line, unsigned int lineno)
+{
+	const struct group *grp;
+	char *name = line;
+	char *cp;
+	char **listed;		/* the members of the line */
+	char **wanted;		/* the same, sorted */
+	size_t nwanted;
+	bool *seen;
+	char **members;
+	char **removed;
+	size_t ncurrent = 0;
+	size_t n = 0;
+	unsigned long added = 0;
+	unsigned long nremoved = 0;
+	bool changed = false;
+	int code = 0;
+	size_t i;
+
+	cp = strchr (line, ':');
+	if (NULL == cp) {
+		fprintf (stderr, _("%s: line %u: missing ':'\n"), Prog, lineno);
+		return EXIT_USAGE;
+	}
+	*cp = '\0';
+	cp++;
+	if (!is_valid_group_name (name)) {
+		fprintf (stderr, _("%s: line %u: invalid group name '%s'\n"),
+		         Prog, lineno, name);
+		return EXIT_USAGE;
+	}
+
+	listed = comma_to_list (cp);
+	wanted = sorted_list (listed, &nwanted);
+	seen = xmalloc ((nwanted + 1) * sizeof *seen);
+	memzero (seen, (nwanted + 1) * sizeof *seen);
+
+	grp = gr_locate (name);
+	if (NULL != grp) {
+		for (; NULL != grp->gr_mem[ncurrent]; ncurrent++);
+	}
+	members = xmalloc ((ncurrent + nwanted + 1) * sizeof *members);
+	removed = xmalloc ((ncurrent + 1) * sizeof *removed);
+
+	/* The current members which stay */
+	for (i = 0; i < ncurrent; i++) {
+		char **w = bsearch (&grp->gr_mem[i], wanted, nwanted,
+		                    sizeof *wanted, cmp_names);
+
+		if (NULL == w) {
+			removed[nremoved++] = grp->gr_mem[i];
+		} else if (!seen[w - wanted]) {
+			seen[w - wanted] = true;
+			members[n++] = grp->gr_mem[i];
+		} else {
+			/* A member listed twice in the group */
+			changed = true;
+		}
+	}
+
+	/* The new members */
+	for (i = 0; NULL != listed[i]; i++) {
+		char **w = bsearch (&listed[i], wanted, nwanted,
+		                    sizeof *wanted, cmp_names);
+
+		assert (NULL != w);
+		if (seen[w - wanted]) {
+			continue;
+		}
+		seen[w - wanted] = true;
+		if (!user_exists (listed[i])) {
+			fprintf (stderr,
+			         _("%s: line %u: user '%s' does not exist\n"),
+			         Prog, lineno, listed[i]);
+			code = EXIT_INVALID_USER;
+			continue;
+		}
+		members[n++] = listed[i];
+		added++;
+	}
+	members[n] = NULL;
+	removed[nremoved] = NULL;
+	free (wanted);
+	free (seen);
+
+	if (0 != code) {
+		return code;
+	}
+
+	if (NULL == grp) {
+		new_group (name, members);
+	} else if ((0 != added) || (0 != nremoved) || changed) {
+		set_members (grp, members, removed);
+		SYSLOG ((LOG_INFO,
+		         "members of group '%s' set: %lu added, %lu removed",
+		         name, added, nremoved));
+	}
+	return 0;
+}
+
+/*
+ * sync_groups - Set the members of the groups listed in file
+ *
+ *	Empty lines and lines starting with '#' are ignored. "-" is the
+ *	standard input. The changes of all the lines are written at once:
+ *	if a line fails, the other lines are still checked, but no group
+ *	is changed.
+ */
+static void sync_groups (const char *file)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t size = 0;
+	unsigned int lineno = 0;
+	char **names = NULL;	/* the groups of the lines */
+	size_t nnames = 0;
+	int status = EXIT_SUCCESS;
+	int code;
+	size_t i;
+
+	if (strcmp (file, "-") == 0) {
+		fp = stdin;
+	} else {
+		fp = fopen (file, "r");
+		if (NULL == fp) {
+			fprintf (stderr, _("%s: cannot open %s: %s\n"),
+			         Prog, file, strerror (errno));
+			fail_exit (EXIT_USAGE);
+		}
+	}
+
+	/* For user_exists() */
+	(void) pw_open (O_RDONLY);
+
+	while (getline (&line, &size, fp) != -1) {
+		char *cp;
+
+		lineno++;
+		cp = strchr (line, '\n');
+		if (NULL != cp) {
+			*cp = '\0';
+		}
+		if (('\0' == line[0]) || ('#' == line[0])) {
+			continue;
+		}
+
+		code = sync_group (line, lineno);
+		if (0 != code) {
+			if (EXIT_SUCCESS == status) {
+				status = code;
+			}
+			continue;
+		}
+
+		if (0 == (nnames % 64)) {
+			char **tmp = realloc (names, (nnames + 64) * sizeof *names);
+			if (NULL == tmp) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				fail_exit (EXIT_GROUP_FILE);
+			}
+			names = tmp;
+		}
+		/* sync_group() kept only the group name in line */
+		names[nnames++] = xstrdup (line);
+	}
+	free (line);
+
+	if (ferror (fp)) {
+		fprintf (stderr, _("%s: cannot read %s: %s\n"),
+		         Prog, file, strerror (errno));
+		status = EXIT_USAGE;
+	}
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+	(void) pw_close ();
+
+	if (0 != nnames) {
+		qsort (names, nnames, sizeof *names, cmp_names);
+	}
+	for (i = 1; i < nnames; i++) {
+		if (strcmp (names[i - 1], names[i]) == 0) {
+			fprintf (stderr, _("%s: group '%s' is listed more than once\n"),
+			         Prog, names[i]);
+			status = EXIT_USAGE;
+		}
+	}
+
+	if (EXIT_SUCCESS != status) {
+		fprintf (stderr, _("%s: no group was changed\n"), Prog);
+		fail_exit (status);
+	}
+}
+
 int main (int argc, char **argv)
 {
 	char *name;
@@ -592,6 +968,18 @@ int main (int argc, char **argv)
 
 	process_flags (argc, argv);
 
+	if (NULL != sync_file) {
+		if (!isroot ()) {
+			fprintf (stderr, _("%s: only root can use the --sync option\n"), Prog);
+			fail_exit (EXIT_NOT_ROOT);
+		}
+		check_perms ();
+		open_files ();
+		sync_groups (sync_file);
+		close_files ();
+		exit (EXIT_SUCCESS);
+	}
+
 	if (NULL == thisgroup) {
 		name = whoami ();
 		if (!list && (NULL == name)) {
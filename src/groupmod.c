@@ -28,8 +28,6 @@
 #include "defines.h"
 #include "groupio.h"
 #include "pwio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #ifdef	SHADOWGRP
 #include "sgroupio.h"
@@ -115,6 +113,8 @@ static void usage (int status)
 	                Prog);
 	(void) fputs (_("  -a, --append                  append the users mentioned by -U option to the group \n"
 	                "                                without removing existing user members\n"), usageout);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -g, --gid GID                 change the group ID to GID\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
 	(void) fputs (_("  -n, --new-name NEW_GROUP      change the name to NEW_GROUP\n"), usageout);
@@ -123,6 +123,8 @@ static void usage (int status)
 	                "                                PASSWORD\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs (_("  -U, --users USERS             list of user members of this group\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
@@ -243,7 +245,8 @@ static void grp_update (void)
 	}
 
 	if (user_list) {
-		char *token;
+		char **members;
+		size_t i, n;
 
 		if (!aflg) {
 			// requested to replace the existing groups
@@ -257,15 +260,19 @@ static void grp_update (void)
 				grp.gr_mem = dup_list (grp.gr_mem);
 		}
 
-		token = strtok(user_list, ",");
-		while (token) {
-			if (prefix_getpwnam (token) == NULL) {
-				fprintf (stderr, _("Invalid member username %s\n"), token);
+		members = comma_to_list (user_list);
+		for (i = 0, n = 0; NULL != members[i]; i++) {
+			if ('\0' == members[i][0]) {
+				continue;
+			}
+			if (prefix_getpwnam (members[i]) == NULL) {
+				fprintf (stderr, _("Invalid member username %s\n"), members[i]);
 				exit (E_GRP_UPDATE);
 			}
-			grp.gr_mem = add_list(grp.gr_mem, token);
-			token = strtok(NULL, ",");
+			members[n++] = members[i];
 		}
+		members[n] = NULL;
+		grp.gr_mem = add_members (grp.gr_mem, members);
 	}
 
 	/*
@@ -393,6 +400,7 @@ static void process_flags (int argc, char **argv)
 	int c;
 	static struct option long_options[] = {
 		{"append",     no_argument,       NULL, 'a'},
+		{"deadline",   required_argument, NULL, 201},
 		{"gid",        required_argument, NULL, 'g'},
 		{"help",       no_argument,       NULL, 'h'},
 		{"new-name",   required_argument, NULL, 'n'},
@@ -400,6 +408,7 @@ static void process_flags (int argc, char **argv)
 		{"password",   required_argument, NULL, 'p'},
 		{"root",       required_argument, NULL, 'R'},
 		{"prefix",     required_argument, NULL, 'P'},
+		{"shard",      required_argument, NULL, 200},
 		{"users",      required_argument, NULL, 'U'},
 		{NULL, 0, NULL, '\0'}
 	};
@@ -437,6 +446,10 @@ static void process_flags (int argc, char **argv)
 			break;
 		case 'P': /* no-op, handled in process_prefix_flag () */
 			break;
+		case 200: /* no-op, handled in process_shard_flag () */
+			break;
+		case 201: /* no-op, handled in process_deadline_flag () */
+			break;
 		case 'U':
 			user_list = optarg;
 			break;
@@ -675,6 +688,7 @@ static void lock_files (void)
  */
 static void open_files (void)
 {
+	gr_compact ();
 	if (gr_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
 		SYSLOG ((LOG_WARN, "cannot open %s", gr_dbname ()));
@@ -684,6 +698,7 @@ static void open_files (void)
 #ifdef	SHADOWGRP
 	if (   is_shadow_grp
 	    && (pflg || nflg)) {
+		sgr_compact ();
 		if (sgr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -707,32 +722,32 @@ static void open_files (void)
 
 void update_primary_groups (gid_t ogid, gid_t ngid)
 {
-	struct passwd *pwd;
-
-	prefix_setpwent ();
-	while ((pwd = prefix_getpwent ()) != NULL) {
-		if (pwd->pw_gid == ogid) {
-			const struct passwd *lpwd;
-			struct passwd npwd;
-			lpwd = pw_locate (pwd->pw_name);
-			if (NULL == lpwd) {
-				fprintf (stderr,
-				         _("%s: user '%s' does not exist in %s\n"),
-				         Prog, pwd->pw_name, pw_dbname ());
-				exit (E_GRP_UPDATE);
-			} else {
-				npwd = *lpwd;
-				npwd.pw_gid = ngid;
-				if (pw_update (&npwd) == 0) {
-					fprintf (stderr,
-					         _("%s: failed to prepare the new %s entry '%s'\n"),
-					         Prog, pw_dbname (), npwd.pw_name);
-					exit (E_GRP_UPDATE);
-				}
-			}
+	char **users;
+	size_t i;
+
+	users = prefix_gid_users (ogid, 0);
+	for (i = 0; NULL != users[i]; i++) {
+		const struct passwd *lpwd;
+		struct passwd npwd;
+
+		lpwd = pw_locate (users[i]);
+		if (NULL == lpwd) {
+			fprintf (stderr,
+			         _("%s: user '%s' does not exist in %s\n"),
+			         Prog, users[i], pw_dbname ());
+			exit (E_GRP_UPDATE);
 		}
+		npwd = *lpwd;
+		npwd.pw_gid = ngid;
+		if (pw_update (&npwd) == 0) {
+			fprintf (stderr,
+			         _("%s: failed to prepare the new %s entry '%s'\n"),
+			         Prog, pw_dbname (), npwd.pw_name);
+			exit (E_GRP_UPDATE);
+		}
+		free (users[i]);
 	}
-	prefix_endpwent ();
+	free (users);
 }
 
 /*
@@ -761,6 +776,8 @@ int main (int argc, char **argv)
 
 	process_root_flag ("-R", argc, argv);
 	prefix = process_prefix_flag ("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
 
 	OPENLOG ("groupmod");
 #ifdef WITH_AUDIT
@@ -879,9 +896,6 @@ int main (int argc, char **argv)
 
 	close_files ();
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 	return E_SUCCESS;
 }
 
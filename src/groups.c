@@ -22,38 +22,61 @@
  */
 const char *Prog;
 
+static const char *const fields[] = { "user", "group", "gid", NULL };
+
 /* local function prototypes */
+static void print_group (/*@null@*/const char *member,
+                         /*@null@*/const struct group *gr, gid_t gid,
+                         int *count);
+static void scan_groups (const char *member, const struct passwd *pwd,
+                         int *count);
 static void print_groups (const char *member);
 
 /*
- * print_groups - print the groups which the named user is a member of
+ * print_group - print one group of the list
  *
- *	print_groups() scans the groups file for the list of groups which
- *	the user is listed as being a member of.
+ *	Unknown groups are printed as their decimal group ID.
  */
-static void print_groups (const char *member)
+static void print_group (/*@null@*/const char *member,
+                         /*@null@*/const struct group *gr, gid_t gid,
+                         int *count)
 {
-	int groups = 0;
-	struct group *grp;
-	struct passwd *pwd;
-	bool flag = false;
+	if (output_structured ()) {
+		output_str (member);
+		output_str ((NULL != gr) ? gr->gr_name : NULL);
+		output_num (gid);
+		output_row_end ();
+		return;
+	}
 
-	pwd = getpwnam (member); /* local, no need for xgetpwnam */
-	if (NULL == pwd) {
-		(void) fprintf (stderr, _("%s: unknown user %s\n"),
-		                Prog, member);
-		exit (EXIT_FAILURE);
+	if (0 != *count) {
+		(void) putchar (' ');
 	}
+	(*count)++;
+
+	if (NULL != gr) {
+		(void) printf ("%s", gr->gr_name);
+	} else {
+		(void) printf ("%lu", (unsigned long) gid);
+	}
+}
+
+/*
+ * scan_groups - print the groups which list the named user as a member
+ *
+ *	scan_groups() enumerates the whole group database. It is only used
+ *	when getgrouplist() fails.
+ */
+static void scan_groups (const char *member, const struct passwd *pwd,
+                         int *count)
+{
+	struct group *grp;
+	bool flag = false;
 
 	setgrent ();
 	while ((grp = getgrent ()) != NULL) {
 		if (is_on_list (grp->gr_mem, member)) {
-			if (0 != groups) {
-				(void) putchar (' ');
-			}
-			groups++;
-
-			(void) printf ("%s", grp->gr_name);
+			print_group (member, grp, grp->gr_gid, count);
 			if (grp->gr_gid == pwd->pw_gid) {
 				flag = true;
 			}
@@ -65,16 +88,45 @@ static void print_groups (const char *member)
 	if (!flag) {
 		grp = getgrgid (pwd->pw_gid); /* local, no need for xgetgrgid */
 		if (NULL != grp) {
-			if (0 != groups) {
-				(void) putchar (' ');
-			}
-			groups++;
-
-			(void) printf ("%s", grp->gr_name);
+			print_group (member, grp, grp->gr_gid, count);
 		}
 	}
+}
 
-	if (0 != groups) {
+/*
+ * print_groups - print the groups which the named user is a member of
+ *
+ *	print_groups() asks getgrouplist() for the groups of the user, so
+ *	that the NSS backends do not have to enumerate all the groups. The
+ *	primary group is part of the list.
+ */
+static void print_groups (const char *member)
+{
+	int groups = 0;
+	struct passwd *pwd;
+	gid_t *list;
+	int ngroups;
+	int i;
+
+	pwd = getpwnam (member); /* local, no need for xgetpwnam */
+	if (NULL == pwd) {
+		(void) fprintf (stderr, _("%s: unknown user %s\n"),
+		                Prog, member);
+		exit (EXIT_FAILURE);
+	}
+
+	output_begin (fields);
+	ngroups = get_grouplist (member, pwd->pw_gid, &list);
+	if (ngroups < 0) {
+		scan_groups (member, pwd, &groups);
+	}
+	for (i = 0; i < ngroups; i++) {
+		/* local, no need for xgetgrgid */
+		print_group (member, getgrgid (list[i]), list[i], &groups);
+	}
+	free (list);
+
+	if ((0 != groups) && !output_structured ()) {
 		(void) putchar ('\n');
 	}
 }
@@ -86,6 +138,7 @@ int main (int argc, char **argv)
 {
 	long sys_ngroups;
 	GETGROUPS_T *groups;
+	int argn = 1;
 
 	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
 	groups = (GETGROUPS_T *) malloc (sizeof (GETGROUPS_T) * sys_ngroups);
@@ -101,7 +154,29 @@ int main (int argc, char **argv)
 	log_set_progname(Prog);
 	log_set_logfd(stderr);
 
-	if (argc == 1) {
+	/*
+	 * --format=FORMAT (or --format FORMAT) selects a machine readable
+	 * output.
+	 */
+	if ((argc > argn) && (strncmp (argv[argn], "--format", 8) == 0)) {
+		const char *format = NULL;
+
+		if ('=' == argv[argn][8]) {
+			format = &argv[argn][9];
+		} else if (('\0' == argv[argn][8]) && (argc > argn + 1)) {
+			argn++;
+			format = argv[argn];
+		}
+		if ((NULL == format) || !output_set_format (format)) {
+			(void) fprintf (stderr,
+			                _("%s: invalid output format '%s'\n"),
+			                Prog, (NULL != format) ? format : "");
+			exit (EXIT_FAILURE);
+		}
+		argn++;
+	}
+
+	if (argc == argn) {
 
 		/*
 		 * Called with no arguments - give the group set for the
@@ -109,6 +184,7 @@ int main (int argc, char **argv)
 		 */
 
 		int i;
+		int count = 0;
 		int pri_grp; /* TODO: should be GETGROUPS_T */
 		/*
 		 * This system supports concurrent group sets, so I can ask
@@ -124,6 +200,7 @@ int main (int argc, char **argv)
 		/*
 		 * The groupset includes the primary group as well.
 		 */
+		output_begin (fields);
 		pri_grp = getegid ();
 		for (i = 0; i < ngroups; i++) {
 			if (pri_grp == (int) groups[i]) {
@@ -141,39 +218,26 @@ int main (int argc, char **argv)
 		 * values.
 		 */
 		if (-1 != pri_grp) {
-			struct group *gr;
 			/* local, no need for xgetgrgid */
-			gr = getgrgid (pri_grp);
-			if (NULL != gr) {
-				(void) printf ("%s", gr->gr_name);
-			} else {
-				(void) printf ("%d", pri_grp);
-			}
+			print_group (NULL, getgrgid (pri_grp), pri_grp, &count);
 		}
 
 		for (i = 0; i < ngroups; i++) {
-			struct group *gr;
-			if ((0 != i) || (-1 != pri_grp)) {
-				(void) putchar (' ');
-			}
-
 			/* local, no need for xgetgrgid */
-			gr = getgrgid (groups[i]);
-			if (NULL != gr) {
-				(void) printf ("%s", gr->gr_name);
-			} else {
-				(void) printf ("%ld", (long) groups[i]);
-			}
+			print_group (NULL, getgrgid (groups[i]), groups[i], &count);
+		}
+		if (!output_structured ()) {
+			(void) putchar ('\n');
 		}
-		(void) putchar ('\n');
 	} else {
 
 		/*
 		 * The invoker wanted to know about some other user. Use
 		 * that name to look up the groups instead.
 		 */
-		print_groups (argv[1]);
+		print_groups (argv[argn]);
 	}
+	output_end ();
 	return EXIT_SUCCESS;
 }
 
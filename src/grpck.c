@@ -19,9 +19,8 @@
 #include "commonio.h"
 #include "defines.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
+#include "pwio.h"
 #include "shadowlog.h"
 
 #ifdef SHADOWGRP
@@ -55,10 +54,15 @@ static bool is_shadow = false;
 static bool sgr_locked = false;
 #endif
 static bool gr_locked = false;
+static bool pw_opened = false;
 /* Options */
 static bool read_only = false;
 static bool sort_mode = false;
 static bool silence_warnings = false;
+static /*@null@*/const char *state_file = NULL;
+
+/* Entries which passed the checks of the last run, with --state */
+static struct check_state state;
 
 /* local function prototypes */
 static void fail_exit (int status);
@@ -73,6 +77,11 @@ static int check_members (const char *groupname,
                           const char *fmt_prompt,
                           const char *fmt_syslog,
                           int *errors);
+static unsigned long state_options (void);
+static void state_files (const char *files[4]);
+static unsigned long long members_key (unsigned long long key,
+                                       char *const *members);
+static unsigned long long gr_key (const struct commonio_entry *gre);
 static void check_grp_file (int *errors, bool *changed);
 #ifdef SHADOWGRP
 static void compare_members_lists (const char *groupname,
@@ -80,6 +89,7 @@ static void compare_members_lists (const char *groupname,
                                    char **other_members,
                                    const char *file,
                                    const char *other_file);
+static unsigned long long sgr_key (const struct commonio_entry *sge);
 static void check_sgr_file (int *errors, bool *changed);
 #endif
 
@@ -138,6 +148,8 @@ usage (int status)
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -s, --sort                    sort entries by UID\n"), usageout);
 	(void) fputs (_("  -S, --silence-warnings        silence controversial/paranoid warnings\n"), usageout);
+	(void) fputs (_("      --state FILE              only check the entries changed since\n"
+	                "                                the last run with this FILE (with -r)\n"), usageout);
 	(void) fputs ("\n", usageout);
 	exit (status);
 }
@@ -179,6 +191,7 @@ static void process_flags (int argc, char **argv)
 		{"root",             required_argument, NULL, 'R'},
 		{"silence-warnings", no_argument,       NULL, 'S'},
 		{"sort",             no_argument,       NULL, 's'},
+		{"state",            required_argument, NULL, 200},
 		{NULL, 0, NULL, '\0'}
 	};
 
@@ -205,6 +218,9 @@ static void process_flags (int argc, char **argv)
 		case 'S':
 			silence_warnings = true;
 			break;
+		case 200:
+			state_file = optarg;
+			break;
 		default:
 			usage (E_USAGE);
 		}
@@ -214,6 +230,10 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr, _("%s: -s and -r are incompatible\n"), Prog);
 		exit (E_USAGE);
 	}
+	if ((NULL != state_file) && !read_only) {
+		fprintf (stderr, _("%s: --state requires -r\n"), Prog);
+		exit (E_USAGE);
+	}
 
 	/*
 	 * Make certain we have the right number of arguments
@@ -302,6 +322,13 @@ static void open_files (void)
 		fail_exit (E_CANT_OPEN);
 	}
 #endif
+
+	/*
+	 * The passwd file is only read, so that the members are found
+	 * with its name index instead of a name service lookup for each
+	 * member.
+	 */
+	pw_opened = (pw_open (O_RDONLY) != 0);
 }
 
 /*
@@ -332,6 +359,11 @@ static void close_files (bool changed)
 #endif
 	}
 
+	if (pw_opened) {
+		(void) pw_close ();
+		pw_opened = false;
+	}
+
 	/*
 	 * Don't be anti-social - unlock the files when you're done.
 	 */
@@ -388,8 +420,7 @@ static int check_members (const char *groupname,
 	 * Make sure each member exists
 	 */
 	for (i = 0; NULL != members[i]; i++) {
-		/* local, no need for xgetpwnam */
-		if (getpwnam (members[i]) != NULL) {
+		if (user_exists (members[i])) {
 			continue;
 		}
 		/*
@@ -449,13 +480,90 @@ static void compare_members_lists (const char *groupname,
 }
 #endif				/* SHADOWGRP */
 
+/*
+ * state_options - Return the options which change the checks, for the
+ *                 state of the last run
+ */
+static unsigned long state_options (void)
+{
+	unsigned long options = silence_warnings ? 0x1UL : 0;
+
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		options |= 0x2UL;
+	}
+#endif
+	return options;
+}
+
+/*
+ * state_files - Return the files the checks depend on
+ */
+static void state_files (const char *files[4])
+{
+	size_t n = 0;
+
+	files[n++] = gr_dbname ();
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		files[n++] = sgr_dbname ();
+	}
+#endif
+	files[n++] = pw_dbname ();
+	files[n] = NULL;
+}
+
+/*
+ * members_key - Add a list of members, and whether they exist, to a key
+ */
+static unsigned long long members_key (unsigned long long key,
+                                       char *const *members)
+{
+	for (; NULL != *members; members++) {
+		key = check_state_hash (key, *members);
+		key = check_state_hash (key, (NULL != pw_locate (*members)) ? "passwd" : NULL);
+	}
+	return check_state_hash (key, NULL);
+}
+
+/*
+ * gr_key - Return the key of a parsed group entry for --state
+ *
+ *	Besides the line, the checks of the entry depend on the existence
+ *	of its members and on its gshadow entry.
+ */
+static unsigned long long gr_key (const struct commonio_entry *gre)
+{
+	const struct group *grp = gre->eptr;
+	unsigned long long key;
+#ifdef	SHADOWGRP
+	const struct sgrp *sgr;
+#endif
+
+	key = check_state_hash (CHECK_STATE_INIT, gre->line);
+	key = members_key (key, grp->gr_mem);
+#ifdef	SHADOWGRP
+	if (is_shadow) {
+		sgr = sgr_locate (grp->gr_name);
+		key = check_state_hash (key, (NULL != sgr) ? "gshadow" : NULL);
+		if (NULL != sgr) {
+			key = members_key (key, sgr->sg_mem);
+		}
+	}
+#endif
+	return key;
+}
+
 /*
  * check_grp_file - check the content of the group file
  */
 static void check_grp_file (int *errors, bool *changed)
 {
-	struct commonio_entry *gre, *tgre;
+	struct commonio_entry *gre;
+	size_t dups;
 	struct group *grp;
+	unsigned long long key = 0;
+	int entry_errors;
 #ifdef SHADOWGRP
 	const struct sgrp *sgr;
 #endif
@@ -517,28 +625,7 @@ static void check_grp_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tgre = __gr_get_head (); NULL != tgre; tgre = tgre->next) {
-
-			const struct group *ent = tgre->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tgre == gre) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (grp->gr_name, ent->gr_name) != 0) {
-				continue;
-			}
-
+		for (dups = __gr_duplicates (gre); dups > 0; dups--) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -555,6 +642,20 @@ static void check_grp_file (int *errors, bool *changed)
 			}
 		}
 
+		/*
+		 * With --state, the entries which passed the checks of the
+		 * last run, and whose members and gshadow entry did not
+		 * change, are not checked again.
+		 */
+		if (NULL != state_file) {
+			key = gr_key (gre);
+			if (check_state_known (&state, key)) {
+				check_state_add (&state, key);
+				continue;
+			}
+		}
+		entry_errors = *errors;
+
 		/*
 		 * Check for invalid group names.  --marekm
 		 */
@@ -656,18 +757,44 @@ static void check_grp_file (int *errors, bool *changed)
 		}
 #endif
 
+		if ((NULL != state_file) && (*errors == entry_errors)) {
+			check_state_add (&state, key);
+		}
 	}
 }
 
 #ifdef SHADOWGRP
+/*
+ * sgr_key - Return the key of a parsed gshadow entry for --state
+ */
+static unsigned long long sgr_key (const struct commonio_entry *sge)
+{
+	const struct sgrp *sgr = sge->eptr;
+	const struct group *grp;
+	unsigned long long key;
+
+	key = check_state_hash (CHECK_STATE_INIT, sge->line);
+	key = members_key (key, sgr->sg_adm);
+	key = members_key (key, sgr->sg_mem);
+	grp = gr_locate (sgr->sg_name);
+	key = check_state_hash (key, (NULL != grp) ? "group" : NULL);
+	if (NULL != grp) {
+		key = members_key (key, grp->gr_mem);
+	}
+	return key;
+}
+
 /*
  * check_sgr_file - check the content of the shadowed group file (gshadow)
  */
 static void check_sgr_file (int *errors, bool *changed)
 {
 	const struct group *grp;
-	struct commonio_entry *sge, *tsge;
+	struct commonio_entry *sge;
+	size_t dups;
 	struct sgrp *sgr;
+	unsigned long long key = 0;
+	int entry_errors;
 
 	/*
 	 * Loop through the entire shadow group file.
@@ -719,28 +846,7 @@ static void check_sgr_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tsge = __sgr_get_head (); NULL != tsge; tsge = tsge->next) {
-
-			const struct sgrp *ent = tsge->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tsge == sge) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (sgr->sg_name, ent->sg_name) != 0) {
-				continue;
-			}
-
+		for (dups = __sgr_duplicates (sge); dups > 0; dups--) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -757,6 +863,15 @@ static void check_sgr_file (int *errors, bool *changed)
 			}
 		}
 
+		if (NULL != state_file) {
+			key = sgr_key (sge);
+			if (check_state_known (&state, key)) {
+				check_state_add (&state, key);
+				continue;
+			}
+		}
+		entry_errors = *errors;
+
 		/*
 		 * Make sure this entry exists in the /etc/group file.
 		 */
@@ -804,6 +919,10 @@ static void check_sgr_file (int *errors, bool *changed)
 			sge->changed = true;
 			__sgr_set_changed ();
 		}
+
+		if ((NULL != state_file) && (*errors == entry_errors)) {
+			check_state_add (&state, key);
+		}
 	}
 }
 #endif				/* SHADOWGRP */
@@ -834,6 +953,18 @@ int main (int argc, char **argv)
 	/* Parse the command line arguments */
 	process_flags (argc, argv);
 
+	if (NULL != state_file) {
+		const char *files[4];
+
+		state_files (files);
+		if (check_state_load (&state, state_file, "grpck",
+		                      state_options (), files)) {
+			/* No error last time, and nothing changed since */
+			check_state_free (&state);
+			return E_OKAY;
+		}
+	}
+
 	open_files ();
 
 	if (sort_mode) {
@@ -856,9 +987,13 @@ int main (int argc, char **argv)
 	/* Commit the change in the database if needed */
 	close_files (changed);
 
-	if (!read_only) {
-		nscd_flush_cache ("group");
-		sssd_flush_cache (SSSD_DB_GROUP);
+	if (NULL != state_file) {
+		const char *files[4];
+
+		state_files (files);
+		(void) check_state_save (&state, state_file, "grpck",
+		                         state_options (), 0 == errors, files);
+		check_state_free (&state);
 	}
 
 	/*
@@ -24,8 +24,6 @@
 #include <time.h>
 #include <unistd.h>
 #include <getopt.h>
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
@@ -122,6 +120,9 @@ int main (int argc, char **argv)
 	struct group grent;
 	const struct sgrp *sg;
 	struct sgrp sgent;
+	const char **stale = NULL;
+	size_t nstale = 0;
+	size_t i;
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
@@ -163,6 +164,8 @@ int main (int argc, char **argv)
 
 	/*
 	 * Remove /etc/gshadow entries for groups not in /etc/group.
+	 * The names are collected first, so that the database does not
+	 * have to be rescanned after each removal.
 	 */
 	(void) sgr_rewind ();
 	while ((sg = sgr_next ()) != NULL) {
@@ -170,17 +173,31 @@ int main (int argc, char **argv)
 			continue;
 		}
 
-		if (sgr_remove (sg->sg_name) == 0) {
+		if (0 == (nstale % 64)) {
+			const char **list;
+
+			list = realloc (stale, (nstale + 64) * sizeof *stale);
+			if (NULL == list) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				fail_exit (3);
+			}
+			stale = list;
+		}
+		stale[nstale] = sg->sg_name;
+		nstale++;
+	}
+	for (i = 0; i < nstale; i++) {
+		if (sgr_remove (stale[i]) == 0) {
 			/*
 			 * This shouldn't happen (the entry exists) but...
 			 */
 			fprintf (stderr,
 			         _("%s: cannot remove entry '%s' from %s\n"),
-			         Prog, sg->sg_name, sgr_dbname ());
+			         Prog, stale[i], sgr_dbname ());
 			fail_exit (3);
 		}
-		(void) sgr_rewind ();
 	}
+	free (stale);
 
 	/*
 	 * Update shadow group passwords if non-shadow password is not "x".
@@ -253,9 +270,6 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 	return 0;
 }
 #else				/* !SHADOWGRP */
@@ -24,8 +24,6 @@
 #include <unistd.h>
 #include <grp.h>
 #include <getopt.h>
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 /*@-exitarg@*/
 #include "exitcodes.h"
@@ -216,9 +214,6 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_GROUP);
-
 	return 0;
 }
 #else				/* !SHADOWGRP */
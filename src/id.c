@@ -24,15 +24,72 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include "defines.h"
+#include "prototypes.h"
 /* local function prototypes */
 static void usage (void);
+static void print_structured (uid_t ruid, uid_t euid, gid_t rgid, gid_t egid,
+                              /*@null@*/const GETGROUPS_T *groups,
+                              int ngroups);
 
 static void usage (void)
 {
-	(void) fputs (_("Usage: id [-a]\n"), stderr);
+	(void) fputs (_("Usage: id [-a] [--format=FORMAT]\n"), stderr);
 	exit (EXIT_FAILURE);
 }
 
+/*
+ * print_structured - print the IDs of the process for --format
+ *
+ *	The concurrent group set is a comma separated list of group IDs,
+ *	null if -a was not given.
+ */
+static void print_structured (uid_t ruid, uid_t euid, gid_t rgid, gid_t egid,
+                              /*@null@*/const GETGROUPS_T *groups,
+                              int ngroups)
+{
+	static const char *const fields[] = {
+		"uid", "user", "gid", "group", "euid", "euser", "egid",
+		"egroup", "groups", NULL
+	};
+	const struct passwd *pw;
+	const struct group *gr;
+	char *list = NULL;
+
+	output_begin (fields);
+
+	output_num (ruid);
+	pw = getpwuid (ruid); /* local, no need for xgetpwuid */
+	output_str ((NULL != pw) ? pw->pw_name : NULL);
+	output_num (rgid);
+	gr = getgrgid (rgid); /* local, no need for xgetgrgid */
+	output_str ((NULL != gr) ? gr->gr_name : NULL);
+	output_num (euid);
+	pw = getpwuid (euid); /* local, no need for xgetpwuid */
+	output_str ((NULL != pw) ? pw->pw_name : NULL);
+	output_num (egid);
+	gr = getgrgid (egid); /* local, no need for xgetgrgid */
+	output_str ((NULL != gr) ? gr->gr_name : NULL);
+
+	if (NULL != groups) {
+		/* Up to 20 digits and a comma for each group */
+		char *cp;
+		int i;
+
+		list = xmalloc ((size_t) ngroups * 21 + 1);
+		cp = list;
+		*cp = '\0';
+		for (i = 0; i < ngroups; i++) {
+			cp += sprintf (cp, "%s%lu", (0 != i) ? "," : "",
+			               (unsigned long) groups[i]);
+		}
+	}
+	output_str (list);
+	free (list);
+
+	output_row_end ();
+	output_end ();
+}
+
  /*ARGSUSED*/ int main (int argc, char **argv)
 {
 	uid_t ruid, euid;
@@ -48,6 +105,7 @@ static void usage (void)
  */
 	GETGROUPS_T *groups;
 	int ngroups;
+	int i;
 	bool aflg = 0;
 	struct passwd *pw;
 	struct group *gr;
@@ -70,11 +128,21 @@ static void usage (void)
 	 * group set.
 	 */
 
-	if (argc > 1) {
-		if ((argc > 2) || (strcmp (argv[1], "-a") != 0)) {
-			usage ();
-		} else {
+	for (i = 1; i < argc; i++) {
+		if (strcmp (argv[i], "-a") == 0) {
 			aflg = true;
+		} else if (strncmp (argv[i], "--format=", 9) == 0) {
+			if (!output_set_format (&argv[i][9])) {
+				usage ();
+			}
+		} else if (   (strcmp (argv[i], "--format") == 0)
+		           && (i + 1 < argc)) {
+			i++;
+			if (!output_set_format (argv[i])) {
+				usage ();
+			}
+		} else {
+			usage ();
 		}
 	}
 
@@ -83,6 +151,18 @@ static void usage (void)
 	rgid = getgid ();
 	egid = getegid ();
 
+	if (output_structured ()) {
+		ngroups = 0;
+		if (aflg) {
+			ngroups = getgroups (sys_ngroups, groups);
+		}
+		print_structured (ruid, euid, rgid, egid,
+		                  (aflg && (-1 != ngroups)) ? groups : NULL,
+		                  ngroups);
+		free (groups);
+		return EXIT_SUCCESS;
+	}
+
 	/*
 	 * Print out the real user ID and group ID. If the user or group
 	 * does not exist, just give the numerical value.
@@ -133,7 +213,6 @@ static void usage (void)
 	 * The group numbers will be printed followed by their names.
 	 */
 	if (aflg && (ngroups = getgroups (sys_ngroups, groups)) != -1) {
-		int i;
 
 		/*
 		 * Start off the group message. It will be of the format
@@ -11,10 +11,13 @@
 
 #ident "$Id$"
 
+#include <fcntl.h>
 #include <getopt.h>
 #include <lastlog.h>
 #include <pwd.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
@@ -23,6 +26,7 @@
 #include <net/if.h>
 #endif
 #include "defines.h"
+#include "acctstate.h"
 #include "prototypes.h"
 #include "getdef.h"
 /*@-exitarg@*/
@@ -55,9 +59,30 @@ static bool tflg = false;	/* print is restricted to most recent days */
 static bool bflg = false;	/* print excludes most recent days */
 static bool Cflg = false;	/* clear record for user */
 static bool Sflg = false;	/* set record for user */
+static bool Iflg = false;	/* import the records of the lastlog file */
+static bool Eflg = false;	/* export the records to the lastlog file */
+/* The records are those of ACCOUNT_STATE_FILE instead of the lastlog file */
+static bool use_store = false;
 
 #define	NOW	time(NULL)
 
+/*
+ * When all the users are printed, the records of the sparse lastlog file
+ * are read from its data extents only, if they are smaller than
+ * LASTLOG_EXTENTS_MAX bytes, and kept sorted by UID. The users are then
+ * looked up in memory, instead of reading the file for each user.
+ */
+#define LASTLOG_EXTENTS_MAX	(64 * 1024 * 1024)
+
+struct ll_record {
+	uid_t uid;
+	struct lastlog ll;
+};
+
+static /*@null@*/ /*@only@*/struct ll_record *records = NULL;
+static size_t nrecords = 0;
+static bool records_loaded = false;
+
 NORETURN
 static void
 usage (int status)
@@ -70,7 +95,10 @@ usage (int status)
 	                Prog);
 	(void) fputs (_("  -b, --before DAYS             print only lastlog records older than DAYS\n"), usageout);
 	(void) fputs (_("  -C, --clear                   clear lastlog record of a user (usable only with -u)\n"), usageout);
+	(void) fputs (_("      --format FORMAT           print the records in FORMAT (text, tsv or json)\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("      --export                  write the records of ACCOUNT_STATE_FILE to the lastlog file\n"), usageout);
+	(void) fputs (_("      --import                  copy the records of the lastlog file to ACCOUNT_STATE_FILE\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -S, --set                     set lastlog record to current time (usable only with -u)\n"), usageout);
 	(void) fputs (_("  -t, --time DAYS               print only lastlog records more recent than DAYS\n"), usageout);
@@ -79,13 +107,239 @@ usage (int status)
 	exit (status);
 }
 
+/*
+ * add_record - Keep the record ll of uid, if it is set and selected.
+ */
+static bool add_record (uid_t uid, const struct lastlog *ll,
+                        unsigned long lastlog_uid_max, size_t *size)
+{
+	static const struct lastlog empty;
+
+	if (memcmp (ll, &empty, sizeof empty) == 0) {
+		return true;
+	}
+	if (   uflg
+	    && (   (has_umin && (uid < (uid_t) umin))
+	        || (has_umax && (uid > (uid_t) umax)))) {
+		return true;
+	} else if (!uflg && (uid > (uid_t) lastlog_uid_max)) {
+		return true;
+	}
+
+	if (nrecords == *size) {
+		size_t new_size = (0 == *size) ? 64 : 2 * *size;
+		struct ll_record *new_records;
+
+		new_records = realloc (records, new_size * sizeof *records);
+		if (NULL == new_records) {
+			return false;
+		}
+		records = new_records;
+		*size = new_size;
+	}
+	records[nrecords].uid = uid;
+	records[nrecords].ll = *ll;
+	nrecords++;
+	return true;
+}
+
+static int record_cmp (const void *p1, const void *p2)
+{
+	uid_t u1 = ((const struct ll_record *) p1)->uid;
+	uid_t u2 = ((const struct ll_record *) p2)->uid;
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+/*
+ * load_store_records - Read the records of the account state store.
+ */
+static void load_store_records (unsigned long lastlog_uid_max)
+{
+	struct acct_state st;
+	uint64_t pos = 0;
+	size_t size = 0;
+	uid_t uid;
+	int r;
+
+	while ((r = acct_state_next (&pos, &uid, &st)) == 1) {
+		if (!add_record (uid, &st.ll, lastlog_uid_max, &size)) {
+			break;
+		}
+	}
+	if (0 != r) {
+		/* Read the store for each user */
+		free (records);
+		records = NULL;
+		nrecords = 0;
+		return;
+	}
+	if (0 != nrecords) {
+		qsort (records, nrecords, sizeof *records, record_cmp);
+	}
+	records_loaded = true;
+}
+
+/*
+ * load_records - Read the records of the data extents of the lastlog
+ *                file.
+ *
+ *	Nothing is loaded, and the file is read for each user, if the
+ *	extents cannot be found or are too large (e.g. on a file system
+ *	which does not report the holes of sparse files).
+ */
+static void load_records (unsigned long lastlog_uid_max)
+{
+	int fd;
+	off_t data, hole, total = 0;
+	off_t next = 0;		/* offset of the next record to read */
+	size_t size = 0;
+	struct lastlog buf[256];
+
+	if (use_store) {
+		load_store_records (lastlog_uid_max);
+		return;
+	}
+	fd = fileno (lastlogfile);
+
+	/* Measure the extents first */
+	for (data = 0; data < statbuf.st_size; data = hole) {
+		data = lseek (fd, data, SEEK_DATA);
+		if (-1 == data) {
+			if (ENXIO != errno) {
+				return;
+			}
+			break;
+		}
+		hole = lseek (fd, data, SEEK_HOLE);
+		if (-1 == hole) {
+			return;
+		}
+		total += hole - data;
+		if (total > LASTLOG_EXTENTS_MAX) {
+			return;
+		}
+	}
+
+	for (data = 0; data < statbuf.st_size; data = hole) {
+		off_t end;
+
+		data = lseek (fd, data, SEEK_DATA);
+		if (-1 == data) {
+			break;
+		}
+		hole = lseek (fd, data, SEEK_HOLE);
+		if (-1 == hole) {
+			goto fail;
+		}
+
+		/* Read the whole records which overlap the extent */
+		if (next < data - data % (off_t) sizeof (struct lastlog)) {
+			next = data - data % (off_t) sizeof (struct lastlog);
+		}
+		end = (hole < statbuf.st_size) ? hole : statbuf.st_size;
+		while (next < end) {
+			ssize_t len;
+			size_t i;
+
+			len = pread (fd, buf, sizeof buf, next);
+			if (len < (ssize_t) sizeof (struct lastlog)) {
+				goto fail;
+			}
+			for (i = 0; i < (size_t) len / sizeof (struct lastlog); i++) {
+				uid_t uid = next / sizeof (struct lastlog) + i;
+
+				if (!add_record (uid, &buf[i], lastlog_uid_max, &size)) {
+					goto fail;
+				}
+			}
+			next += i * sizeof (struct lastlog);
+		}
+	}
+
+	records_loaded = true;
+	return;
+
+fail:
+	free (records);
+	records = NULL;
+	nrecords = 0;
+}
+
+/*
+ * read_entry - Get the lastlog record of uid.
+ *
+ *	lastlog is a sparse file: a user without a record gets an empty
+ *	record.
+ */
+static void read_entry (uid_t uid, /*@out@*/struct lastlog *ll)
+{
+	off_t offset;
+
+	if (records_loaded) {
+		size_t lo = 0, hi = nrecords;
+
+		while (lo < hi) {
+			size_t mid = lo + (hi - lo) / 2;
+
+			if (records[mid].uid < uid) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if ((lo < nrecords) && (records[lo].uid == uid)) {
+			*ll = records[lo].ll;
+		} else {
+			memzero (ll, sizeof (*ll));
+		}
+		return;
+	}
+
+	if (use_store) {
+		struct acct_state st;
+
+		if (acct_state_get (uid, &st) == -1) {
+			fprintf (stderr,
+			         _("%s: Failed to get the entry for UID %lu\n"),
+			         Prog, (unsigned long int) uid);
+			exit (EXIT_FAILURE);
+		}
+		*ll = st.ll;
+		return;
+	}
+
+	offset = (off_t) uid * sizeof (*ll);
+	if (offset + sizeof (*ll) <= statbuf.st_size) {
+		/* fseeko errors are not really relevant for us. */
+		int err = fseeko (lastlogfile, offset, SEEK_SET);
+		assert (0 == err);
+		/* lastlog is a sparse file. Even if no entries were
+		 * entered for this user, which should be able to get the
+		 * empty entry in this case.
+		 */
+		if (fread (ll, sizeof (*ll), 1, lastlogfile) != 1) {
+			fprintf (stderr,
+			         _("%s: Failed to get the entry for UID %lu\n"),
+			         Prog, (unsigned long int) uid);
+			exit (EXIT_FAILURE);
+		}
+	} else {
+		/* Outsize of the lastlog file.
+		 * Behave as if there were a missing entry (same behavior
+		 * as if we were reading an non existing entry in the
+		 * sparse lastlog file).
+		 */
+		memzero (ll, sizeof (*ll));
+	}
+}
+
 static void print_one (/*@null@*/const struct passwd *pw)
 {
 	static bool once = false;
 	char *cp;
 	struct tm *tm;
 	time_t ll_time;
-	off_t offset;
 	struct lastlog ll;
 	char ptime[80];
 
@@ -107,29 +361,7 @@ static void print_one (/*@null@*/const struct passwd *pw)
 	}
 
 
-	offset = (off_t) pw->pw_uid * sizeof (ll);
-	if (offset + sizeof (ll) <= statbuf.st_size) {
-		/* fseeko errors are not really relevant for us. */
-		int err = fseeko (lastlogfile, offset, SEEK_SET);
-		assert (0 == err);
-		/* lastlog is a sparse file. Even if no entries were
-		 * entered for this user, which should be able to get the
-		 * empty entry in this case.
-		 */
-		if (fread (&ll, sizeof (ll), 1, lastlogfile) != 1) {
-			fprintf (stderr,
-			         _("%s: Failed to get the entry for UID %lu\n"),
-			         Prog, (unsigned long int)pw->pw_uid);
-			exit (EXIT_FAILURE);
-		}
-	} else {
-		/* Outsize of the lastlog file.
-		 * Behave as if there were a missing entry (same behavior
-		 * as if we were reading an non existing entry in the
-		 * sparse lastlog file).
-		 */
-		memzero (&ll, sizeof (ll));
-	}
+	read_entry (pw->pw_uid, &ll);
 
 	/* Filter out entries that do not match with the -t or -b options */
 	if (tflg && ((NOW - ll.ll_time) > seconds)) {
@@ -140,6 +372,29 @@ static void print_one (/*@null@*/const struct passwd *pw)
 		return;
 	}
 
+	if (output_structured ()) {
+		char line[sizeof (ll.ll_line) + 1];
+#ifdef HAVE_LL_HOST
+		char host[sizeof (ll.ll_host) + 1];
+#endif
+
+		STRFCPY (line, ll.ll_line);
+		output_str (pw->pw_name);
+		output_num (pw->pw_uid);
+		output_str (line);
+#ifdef HAVE_LL_HOST
+		STRFCPY (host, ll.ll_host);
+		output_str (host);
+#endif
+		if (0 == ll.ll_time) {
+			output_str (NULL);
+		} else {
+			output_num (ll.ll_time);
+		}
+		output_row_end ();
+		return;
+	}
+
 	/* Print the header only once */
 	if (!once) {
 #ifdef HAVE_LL_HOST
@@ -173,6 +428,13 @@ static void print_one (/*@null@*/const struct passwd *pw)
 
 static void print (void)
 {
+	static const char *const fields[] = {
+		"user", "uid", "line",
+#ifdef HAVE_LL_HOST
+		"host",
+#endif
+		"time", NULL
+	};
 	const struct passwd *pwent;
 	unsigned long lastlog_uid_max;
 
@@ -183,9 +445,11 @@ static void print (void)
 				   "\tthe output might be incorrect.\n"), Prog, lastlog_uid_max);
 	}
 
+	output_begin (fields);
 	if (uflg && has_umin && has_umax && (umin == umax)) {
 		print_one (getpwuid (umin));
 	} else {
+		load_records (lastlog_uid_max);
 		setpwent ();
 		while ( (pwent = getpwent ()) != NULL ) {
 			if (   uflg
@@ -198,51 +462,150 @@ static void print (void)
 			print_one (pwent);
 		}
 		endpwent ();
+		free (records);
 	}
+	output_end ();
 }
 
-static void update_one (/*@null@*/const struct passwd *pw)
-{
-	off_t offset;
-	struct lastlog ll;
-	int err;
-
-	if (NULL == pw) {
-		return;
-	}
-
-	offset = (off_t) pw->pw_uid * sizeof (ll);
-	/* fseeko errors are not really relevant for us. */
-	err = fseeko (lastlogfile, offset, SEEK_SET);
-	assert (0 == err);
-
-	memzero (&ll, sizeof (ll));
+/*
+ * Records written at once by write_records(): the selected users with
+ * contiguous UIDs are updated by large writes.
+ */
+#define LASTLOG_WRITE_RECORDS	1024
 
-	if (Sflg) {
-		ll.ll_time = NOW;
-#ifdef HAVE_LL_HOST
-		strcpy (ll.ll_host, "localhost");
-#endif
-		strcpy (ll.ll_line, "lastlog");
+/*
+ * audit_update - Log the update of the record of pw.
+ */
+static void audit_update (const struct passwd *pw)
+{
 #ifdef WITH_AUDIT
+	if (Sflg) {
 		audit_logger (AUDIT_ACCT_UNLOCK, Prog,
 			"clearing-lastlog",
 			pw->pw_name, pw->pw_uid, SHADOW_AUDIT_SUCCESS);
-#endif
-	}
-#ifdef WITH_AUDIT
-	else {
+	} else {
 		audit_logger (AUDIT_ACCT_UNLOCK, Prog,
 			"refreshing-lastlog",
 			pw->pw_name, pw->pw_uid, SHADOW_AUDIT_SUCCESS);
 	}
+#else
+	(void) pw;
+#endif
+}
+
+/*
+ * write_records - Update the records of the count UIDs starting at first.
+ *
+ *	With -C, the records are cleared by punching a hole in the sparse
+ *	lastlog file, if the file system supports it. Otherwise, empty
+ *	records are written.
+ *	In the account state store, only the lastlog part of the records
+ *	is changed.
+ */
+static void write_records (uid_t first, size_t count)
+{
+	static struct lastlog buf[LASTLOG_WRITE_RECORDS];
+	static bool buf_ready = false;
+	int fd = use_store ? -1 : fileno (lastlogfile);
+	off_t offset = (off_t) first * sizeof (struct lastlog);
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if (Cflg && !use_store) {
+		off_t len = (off_t) count * sizeof (struct lastlog);
+
+		/* The records past the end of the file are already empty */
+		if (offset >= statbuf.st_size) {
+			return;
+		}
+		if (offset + len > statbuf.st_size) {
+			len = statbuf.st_size - offset;
+		}
+		if (fallocate (fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+		               offset, len) == 0) {
+			return;
+		}
+	}
+#endif
+
+	if (!buf_ready) {
+		size_t i;
+
+		memzero (buf, sizeof (buf));
+		if (Sflg) {
+			for (i = 0; i < LASTLOG_WRITE_RECORDS; i++) {
+				buf[i].ll_time = NOW;
+#ifdef HAVE_LL_HOST
+				strcpy (buf[i].ll_host, "localhost");
 #endif
+				strcpy (buf[i].ll_line, "lastlog");
+			}
+		}
+		buf_ready = true;
+	}
+
+	if (use_store) {
+		struct acct_state st;
+		size_t i;
 
-	if (fwrite (&ll, sizeof(ll), 1, lastlogfile) != 1) {
+		for (i = 0; i < count; i++) {
+			int r = acct_state_get (first + i, &st);
+
+			if (Cflg && (0 == r)) {
+				continue;	/* no record to clear */
+			}
+			st.ll = buf[0];
+			if ((-1 == r) || (acct_state_put (first + i, &st) != 0)) {
+				fprintf (stderr,
+				         _("%s: Failed to update the entry for UID %lu\n"),
+				         Prog, (unsigned long int) (first + i));
+				exit (EXIT_FAILURE);
+			}
+		}
+		return;
+	}
+
+	while (count > 0) {
+		size_t n = (count < LASTLOG_WRITE_RECORDS) ? count
+		                                           : LASTLOG_WRITE_RECORDS;
+		size_t len = n * sizeof (struct lastlog);
+
+		if (pwrite (fd, buf, len, offset) != (ssize_t) len) {
 			fprintf (stderr,
 			         _("%s: Failed to update the entry for UID %lu\n"),
-			         Prog, (unsigned long int)pw->pw_uid);
+			         Prog, (unsigned long int) (offset / sizeof (struct lastlog)));
 			exit (EXIT_FAILURE);
+		}
+		offset += len;
+		count -= n;
+	}
+}
+
+static int uid_cmp (const void *p1, const void *p2)
+{
+	uid_t u1 = *(const uid_t *) p1;
+	uid_t u2 = *(const uid_t *) p2;
+
+	return (u1 > u2) - (u1 < u2);
+}
+
+/*
+ * update_uids - Update the records of the n sorted UIDs of uids.
+ *
+ *	The runs of contiguous UIDs are written together.
+ */
+static void update_uids (uid_t *uids, size_t n)
+{
+	size_t i = 0;
+
+	while (i < n) {
+		size_t j = i + 1;
+
+		while ((j < n) && (uids[j] <= uids[j - 1] + 1)) {
+			j++;
+		}
+		/* Duplicated UIDs are written once */
+		write_records (uids[i], uids[j - 1] - uids[i] + 1);
+		i = j;
 	}
 }
 
@@ -250,6 +613,8 @@ static void update (void)
 {
 	const struct passwd *pwent;
 	unsigned long lastlog_uid_max;
+	uid_t *uids = NULL;
+	size_t nuids = 0, size = 0;
 
 	if (!uflg) /* safety measure */
 		return;
@@ -263,25 +628,90 @@ static void update (void)
 	}
 
 	if (has_umin && has_umax && (umin == umax)) {
-		update_one (getpwuid (umin));
+		pwent = getpwuid (umin);
+		if (NULL != pwent) {
+			audit_update (pwent);
+			write_records (pwent->pw_uid, 1);
+		}
 	} else {
+		/*
+		 * Only the existing users are updated: collect their UIDs,
+		 * and write the records in the order of the file.
+		 */
+#ifdef WITH_AUDIT
+		audit_batch_begin (0);
+#endif
 		setpwent ();
 		while ( (pwent = getpwent ()) != NULL ) {
 			if ((has_umin && (pwent->pw_uid < (uid_t)umin))
 				|| (has_umax && (pwent->pw_uid > (uid_t)umax))) {
 				continue;
 			}
-			update_one (pwent);
+			if (nuids == size) {
+				size_t new_size = (0 == size) ? 256 : 2 * size;
+				uid_t *new_uids;
+
+				new_uids = realloc (uids, new_size * sizeof *uids);
+				if (NULL == new_uids) {
+					fprintf (stderr, _("%s: out of memory\n"), Prog);
+					exit (EXIT_FAILURE);
+				}
+				uids = new_uids;
+				size = new_size;
+			}
+			uids[nuids] = pwent->pw_uid;
+			nuids++;
+			audit_update (pwent);
 		}
 		endpwent ();
+
+		qsort (uids, nuids, sizeof *uids, uid_cmp);
+		update_uids (uids, nuids);
+		free (uids);
 	}
 
-	if (fflush (lastlogfile) != 0 || fsync (fileno (lastlogfile)) != 0) {
+	if (use_store ? (acct_state_sync () != 0)
+	              : (fsync (fileno (lastlogfile)) != 0)) {
 			fprintf (stderr,
 			         _("%s: Failed to update the lastlog file\n"),
 			         Prog);
 			exit (EXIT_FAILURE);
 	}
+#ifdef WITH_AUDIT
+	audit_batch_end ();
+#endif
+}
+
+/*
+ * transfer - Copy the records of the lastlog file to the account state
+ *            store (import), or of the store to the lastlog file.
+ */
+NORETURN static void transfer (bool import)
+{
+	unsigned long count;
+	int fd;
+
+	fd = open (LASTLOG_FILE,
+	           (import ? O_RDONLY : (O_RDWR | O_CREAT)) | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		perror (LASTLOG_FILE);
+		exit (EXIT_FAILURE);
+	}
+	if (   (acct_state_open (import) != 0)
+	    || (  import
+	        ? acct_state_import (fd, ACCT_LASTLOG, &count)
+	        : acct_state_export (fd, ACCT_LASTLOG, &count)) != 0) {
+		perror (import ? acct_state_file () : LASTLOG_FILE);
+		exit (EXIT_FAILURE);
+	}
+	(void) close (fd);
+	(void) acct_state_close ();
+	if (import) {
+		printf (_("%lu records imported from %s\n"), count, LASTLOG_FILE);
+	} else {
+		printf (_("%lu records exported to %s\n"), count, LASTLOG_FILE);
+	}
+	exit (EXIT_SUCCESS);
 }
 
 int main (int argc, char **argv)
@@ -309,7 +739,10 @@ int main (int argc, char **argv)
 		static struct option const longopts[] = {
 			{"before", required_argument, NULL, 'b'},
 			{"clear",  no_argument,       NULL, 'C'},
+			{"format", required_argument, NULL, 200},
+			{"export", no_argument,       NULL, 202},
 			{"help",   no_argument,       NULL, 'h'},
+			{"import", no_argument,       NULL, 201},
 			{"root",   required_argument, NULL, 'R'},
 			{"set",    no_argument,       NULL, 'S'},
 			{"time",   required_argument, NULL, 't'},
@@ -338,6 +771,20 @@ int main (int argc, char **argv)
 				Cflg = true;
 				break;
 			}
+			case 200:
+				if (!output_set_format (optarg)) {
+					fprintf (stderr,
+					         _("%s: invalid output format '%s'\n"),
+					         Prog, optarg);
+					usage (EXIT_FAILURE);
+				}
+				break;
+			case 201:
+				Iflg = true;
+				break;
+			case 202:
+				Eflg = true;
+				break;
 			case 'h':
 				usage (EXIT_SUCCESS);
 				/*@notreached@*/break;
@@ -416,6 +863,44 @@ int main (int argc, char **argv)
 		}
 	}
 
+	use_store = acct_state_enabled ();
+	if (Iflg || Eflg) {
+		if (   (Iflg && Eflg)
+		    || uflg || tflg || bflg || Cflg || Sflg) {
+			fprintf (stderr,
+			         _("%s: --import and --export cannot be used with other options\n"),
+			         Prog);
+			usage (EXIT_FAILURE);
+		}
+		if (!use_store) {
+			fprintf (stderr,
+			         _("%s: ACCOUNT_STATE_FILE is not set\n"),
+			         Prog);
+			exit (EXIT_FAILURE);
+		}
+		transfer (Iflg);
+	}
+
+	if (use_store) {
+		if (acct_state_open (Cflg || Sflg) != 0) {
+			perror (acct_state_file ());
+			exit (EXIT_FAILURE);
+		}
+		if (Cflg || Sflg) {
+			/* Do not update the records concurrently with login */
+			if (acct_state_lock (F_WRLCK) != 0) {
+				perror (acct_state_file ());
+				exit (EXIT_FAILURE);
+			}
+			update ();
+			(void) acct_state_lock (F_UNLCK);
+		} else {
+			print ();
+		}
+		(void) acct_state_close ();
+		return EXIT_SUCCESS;
+	}
+
 	lastlogfile = fopen (LASTLOG_FILE, (Cflg || Sflg)?"r+":"r");
 	if (NULL == lastlogfile) {
 		perror (LASTLOG_FILE);
@@ -513,6 +513,7 @@ int main (int argc, char **argv)
 	char **envp = environ;
 	const char *failent_user;
 	/*@null@*/struct utmp *utent;
+	struct timespec start;
 
 #ifdef USE_PAM
 	int retcode;
@@ -601,6 +602,7 @@ int main (int argc, char **argv)
 #endif				/* RLOGIN */
 
 	OPENLOG ("login");
+	timing_init ();
 
 	setup_tty ();
 
@@ -834,7 +836,9 @@ int main (int argc, char **argv)
 	}
 
 	/* Check the account validity */
+	timing_start (&start);
 	retcode = pam_acct_mgmt (pamh, 0);
+	timing_stop ("pam_account", &start);
 	if (retcode == PAM_NEW_AUTHTOK_REQD) {
 		retcode = pam_chauthtok (pamh, PAM_CHANGE_EXPIRED_AUTHTOK);
 	}
@@ -842,7 +846,9 @@ int main (int argc, char **argv)
 
 	/* Open the PAM session */
 	get_pam_user (&pam_user);
+	timing_start (&start);
 	retcode = pam_open_session (pamh, hushed (pam_user) ? PAM_SILENT : 0);
+	timing_stop ("pam_session", &start);
 	PAM_FAIL_CHECK;
 
 	/* Grab the user information out of the password file for future usage
@@ -856,7 +862,9 @@ int main (int argc, char **argv)
 	username = xstrdup (pam_user);
 	failent_user = get_failent_user (username);
 
+	timing_start (&start);
 	pwd = xgetpwnam (username);
+	timing_stop ("nss", &start);
 	if (NULL == pwd) {
 		SYSLOG ((LOG_ERR, "cannot find user %s", failent_user));
 		fprintf (stderr,
@@ -873,7 +881,9 @@ int main (int argc, char **argv)
 		exit (1);
 	}
 
+	timing_start (&start);
 	retcode = pam_setcred (pamh, PAM_ESTABLISH_CRED);
+	timing_stop ("pam_setcred", &start);
 	PAM_FAIL_CHECK;
 	/* NOTE: If pam_setcred changes PAM_USER, this will not be taken
 	 * into account.
@@ -920,7 +930,9 @@ int main (int argc, char **argv)
 		/* Get the username to be used to log failures */
 		failent_user = get_failent_user (username);
 
+		timing_start (&start);
 		pwd = xgetpwnam (username);
+		timing_stop ("nss", &start);
 		if (NULL == pwd) {
 			preauth_flag = false;
 			failed = true;
@@ -953,7 +965,9 @@ int main (int argc, char **argv)
 		}
 
 		if (strcmp (user_passwd, SHADOW_PASSWD_STRING) == 0) {
+			timing_start (&start);
 			spwd = xgetspnam (username);
+			timing_stop ("nss", &start);
 			if (NULL != spwd) {
 				user_passwd = spwd->sp_pwdp;
 			} else {
@@ -1002,6 +1016,7 @@ int main (int argc, char **argv)
 			         username, fromhost));
 			failed = true;
 		}
+		timing_start (&start);
 		if (   (NULL != pwd)
 		    && getdef_bool ("FAILLOG_ENAB")
 		    && !failcheck (pwd->pw_uid, &faillog, failed)) {
@@ -1010,11 +1025,13 @@ int main (int argc, char **argv)
 			         username, fromhost));
 			failed = true;
 		}
+		timing_stop ("faillog", &start);
 		if (!failed) {
 			break;
 		}
 
 		/* don't log non-existent users */
+		timing_start (&start);
 		if ((NULL != pwd) && getdef_bool ("FAILLOG_ENAB")) {
 			failure (pwd->pw_uid, tty, &faillog);
 		}
@@ -1027,6 +1044,7 @@ int main (int argc, char **argv)
 			failtmp (failent_user, failent);
 			free (failent);
 		}
+		timing_stop ("faillog", &start);
 
 		retries--;
 		if (retries <= 0) {
@@ -1069,6 +1087,7 @@ int main (int argc, char **argv)
 			exit (1);
 		}
 	}			/* while (true) */
+	(void) faillog_close ();
 #endif				/* ! USE_PAM */
 	assert (NULL != username);
 	assert (NULL != pwd);
@@ -1129,7 +1148,9 @@ int main (int argc, char **argv)
 	if (   getdef_bool ("LASTLOG_ENAB")
 	    && pwd->pw_uid <= (uid_t) getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL)) {
 		/* give last login and log this one */
+		timing_start (&start);
 		dolastlog (&ll, pwd, tty, hostname);
+		timing_stop ("lastlog", &start);
 	}
 #endif
 
@@ -1158,7 +1179,9 @@ int main (int argc, char **argv)
 			spwd = xgetspnam (username);
 		}
 	}
+	timing_start (&start);
 	setup_limits (pwd);	/* nice, ulimit etc. */
+	timing_stop ("limits", &start);
 #endif				/* ! USE_PAM */
 	chown_tty (pwd);
 
@@ -1199,7 +1222,9 @@ int main (int argc, char **argv)
 	 * The utmp entry needs to be updated to indicate the new status
 	 * of the session, the new PID and SID.
 	 */
+	timing_start (&start);
 	update_utmp (username, tty, hostname, utent);
+	timing_stop ("utmp", &start);
 
 	/* The pwd and spwd entries for the user have been copied.
 	 *
@@ -1225,7 +1250,9 @@ int main (int argc, char **argv)
 		exit (1);
 	}
 
+	timing_start (&start);
 	setup_env (pwd);	/* set env vars, cd to the home dir */
+	timing_stop ("env", &start);
 
 #ifdef USE_PAM
 	{
@@ -1251,7 +1278,9 @@ int main (int argc, char **argv)
 		 * this
 		 */
 #ifndef USE_PAM
+		timing_start (&start);
 		motd ();	/* print the message of the day */
+		timing_stop ("motd", &start);
 		if (   getdef_bool ("FAILLOG_ENAB")
 		    && (0 != faillog.fail_cnt)) {
 			failprint (&faillog);
@@ -1284,7 +1313,9 @@ int main (int argc, char **argv)
 		}
 		agecheck (spwd);
 
+		timing_start (&start);
 		mailcheck ();	/* report on the status of mail */
+		timing_stop ("mail", &start);
 #endif				/* !USE_PAM */
 	} else {
 		addenv ("HUSHLOGIN=TRUE", NULL);
@@ -1303,6 +1334,7 @@ int main (int argc, char **argv)
 	} else if (getdef_bool ("LOG_OK_LOGINS")) {
 		SYSLOG ((LOG_INFO, "'%s' logged in %s", username, fromhost));
 	}
+	timing_report (username);
 	closelog ();
 	tmp = getdef_str ("FAKE_SHELL");
 	if (NULL != tmp) {
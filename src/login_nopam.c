@@ -70,83 +70,300 @@
 static char fs[] = ":";		/* field separator */
 static char sep[] = ", \t";	/* list-element separator */
 
-static bool list_match (char *list, const char *item, bool (*match_fn) (const char *, const char *));
-static bool user_match (const char *tok, const char *string);
-static bool from_match (const char *tok, const char *string);
-static bool string_match (const char *tok, const char *string);
+/*
+ * The table is compiled once per process, and compiled again only if it
+ * is replaced: its tokens are split and typed, so that matching a login
+ * does not parse the table again. The results of the name service
+ * lookups (client address, netgroups, groups) are cached for the life of
+ * the process, so that the same lookup is not repeated for each line of
+ * the table, or for each login attempt.
+ */
+enum token_type {
+	TOK_ALL,	/* ALL */
+	TOK_EXCEPT,	/* EXCEPT */
+	TOK_NAME,	/* user, group, host or tty name */
+	TOK_NETGROUP,	/* @netgroup */
+	TOK_USER_HOST,	/* user@host */
+	TOK_DOMAIN,	/* .domain */
+	TOK_LOCAL,	/* LOCAL */
+	TOK_NETWORK,	/* network number, ending with a dot */
+};
+
+struct token {
+	enum token_type type;
+	char *text;
+	/*@null@*/struct token *user;	/* for TOK_USER_HOST */
+	/*@null@*/struct token *host;	/* for TOK_USER_HOST */
+};
+
+struct token_list {
+	struct token *tokens;
+	size_t count;
+};
+
+struct access_rule {
+	bool allow;
+	struct token_list users;
+	struct token_list froms;
+};
+
+static struct access_rule *rules = NULL;
+static size_t nrules = 0;
+static bool table_loaded = false;
+static struct stat table_sb;
+
+/* Cached results of the lookups for a pair of strings */
+#define LOOKUP_CACHE_SIZE	64
+struct lookup {
+	char kind;	/* 'g'roup, 'h'ost or 'u'ser netgroup */
+	char *key;
+	char *value;
+	bool result;
+};
+static struct lookup lookups[LOOKUP_CACHE_SIZE];
+static size_t nlookups = 0;
+
+static bool list_match (const struct token_list *list, size_t first, const char *item,
+                        bool (*match_fn) (const struct token *, const char *));
+static bool user_match (const struct token *tok, const char *string);
+static bool from_match (const struct token *tok, const char *string);
+static bool string_match (const struct token *tok, const char *string);
 static const char *resolve_hostname (const char *string);
+static void type_from (struct token *tok, char *text);
 
-/* login_access - match username/group and host/tty with access control file */
-int login_access (const char *user, const char *from)
+/* type_user - type a token of the list of users */
+static void type_user (struct token *tok, char *text)
+{
+	char *at;
+
+	memzero (tok, sizeof *tok);
+	tok->text = text;
+	at = strchr (text + 1, '@');
+	if (NULL != at) {	/* split user@host pattern */
+		*at = '\0';
+		tok->type = TOK_USER_HOST;
+		tok->user = xmalloc (sizeof *tok->user);
+		tok->host = xmalloc (sizeof *tok->host);
+		type_user (tok->user, text);
+		type_from (tok->host, at + 1);
+	} else if (text[0] == '@') {
+		tok->type = TOK_NETGROUP;
+	} else if (strcasecmp (text, "ALL") == 0) {
+		tok->type = TOK_ALL;
+	} else if (strcasecmp (text, "EXCEPT") == 0) {
+		tok->type = TOK_EXCEPT;
+	} else {
+		tok->type = TOK_NAME;
+	}
+}
+
+/* type_from - type a token of the list of hosts or ttys */
+static void type_from (struct token *tok, char *text)
+{
+	size_t len = strlen (text);
+
+	memzero (tok, sizeof *tok);
+	tok->text = text;
+	if (text[0] == '@') {
+		tok->type = TOK_NETGROUP;
+	} else if (strcasecmp (text, "ALL") == 0) {
+		tok->type = TOK_ALL;
+	} else if (strcasecmp (text, "EXCEPT") == 0) {
+		tok->type = TOK_EXCEPT;
+	} else if (text[0] == '.') {
+		tok->type = TOK_DOMAIN;
+	} else if (strcasecmp (text, "LOCAL") == 0) {
+		tok->type = TOK_LOCAL;
+	} else if ((len > 0) && (text[len - 1] == '.')) {
+		tok->type = TOK_NETWORK;
+	} else {
+		tok->type = TOK_NAME;
+	}
+}
+
+/* grow - make room for step more elements in a list of count elements */
+static void *grow (/*@only@*//*@null@*/void *list, size_t count, size_t step,
+                   size_t size)
+{
+	void *p;
+
+	p = xmalloc ((count + step) * size);
+	if (0 != count) {
+		memcpy (p, list, count * size);
+	}
+	free (list);
+	return p;
+}
+
+/* compile_list - split and type the tokens of a list */
+static void compile_list (struct token_list *list, char *text,
+                          void (*type_fn) (struct token *, char *))
+{
+	char *tok;
+
+	list->tokens = NULL;
+	list->count = 0;
+	for (tok = strtok (text, sep); tok != NULL; tok = strtok (NULL, sep)) {
+		if ((list->count % 8) == 0) {
+			list->tokens = grow (list->tokens, list->count, 8,
+			                     sizeof *list->tokens);
+		}
+		type_fn (&list->tokens[list->count], xstrdup (tok));
+		list->count++;
+	}
+}
+
+static void free_token (struct token *tok)
+{
+	/* the parts of user@host point into its text */
+	free (tok->user);
+	free (tok->host);
+	free (tok->text);
+}
+
+static void free_list (struct token_list *list)
+{
+	size_t i;
+
+	for (i = 0; i < list->count; i++) {
+		free_token (&list->tokens[i]);
+	}
+	free (list->tokens);
+}
+
+static void free_rules (void)
+{
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		free_list (&rules[i].users);
+		free_list (&rules[i].froms);
+	}
+	free (rules);
+	rules = NULL;
+	nrules = 0;
+}
+
+/*
+ * load_table - compile the access control file, unless the compiled
+ * table is still current
+ *
+ * A non-existing table means no access control: no rules.
+ */
+static void load_table (void)
 {
 	FILE *fp;
 	char line[BUFSIZ];
 	char *perm;		/* becomes permission field */
 	char *users;		/* becomes list of login names */
 	char *froms;		/* becomes list of terminals or hosts */
-	bool match = false;
+	struct stat sb;
+	int lineno = 0;	/* for diagnostics */
+
+	fp = fopen (TABLE, "r");
+	if (NULL == fp) {
+		if (errno != ENOENT) {
+			int err = errno;
+			SYSLOG ((LOG_ERR, "cannot open %s: %s", TABLE, strerror (err)));
+		}
+		free_rules ();
+		table_loaded = false;
+		return;
+	}
+	if (fstat (fileno (fp), &sb) != 0) {
+		memzero (&sb, sizeof sb);
+	} else if (   table_loaded
+	           && (sb.st_dev == table_sb.st_dev)
+	           && (sb.st_ino == table_sb.st_ino)
+	           && (sb.st_size == table_sb.st_size)
+	           && (sb.st_mtime == table_sb.st_mtime)) {
+		(void) fclose (fp);
+		return;
+	}
+	free_rules ();
 
 	/*
-	 * Process the table one line at a time and stop at the first match.
+	 * Process the table one line at a time.
 	 * Blank lines and lines that begin with a '#' character are ignored.
 	 * Non-comment lines are broken at the ':' character. All fields are
-	 * mandatory. The first field should be a "+" or "-" character. A
-	 * non-existing table means no access control.
+	 * mandatory. The first field should be a "+" or "-" character.
 	 */
-	fp = fopen (TABLE, "r");
-	if (NULL != fp) {
-		int lineno = 0;	/* for diagnostics */
-		while (   !match
-		       && (fgets (line, sizeof (line), fp) == line)) {
-			ptrdiff_t  end;
-			lineno++;
-			end = strlen (line) - 1;
-			if (line[0] == '\0' || line[end] != '\n') {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: missing newline or line too long",
-					 TABLE, lineno));
-				continue;
-			}
-			if (line[0] == '#') {
-				continue;	/* comment line */
-			}
-			while (end > 0 && isspace (line[end - 1])) {
-				end--;
-			}
-			line[end] = '\0';	/* strip trailing whitespace */
-			if (line[0] == '\0') {	/* skip blank lines */
-				continue;
-			}
-			if (   ((perm = strtok (line, fs)) == NULL)
-			    || ((users = strtok (NULL, fs)) == NULL)
-			    || ((froms = strtok (NULL, fs)) == NULL)
-			    || (strtok (NULL, fs) != NULL)) {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: bad field count",
-					 TABLE, lineno));
-				continue;
-			}
-			if (perm[0] != '+' && perm[0] != '-') {
-				SYSLOG ((LOG_ERR,
-					 "%s: line %d: bad first field",
-					 TABLE, lineno));
-				continue;
-			}
-			match = (   list_match (froms, from, from_match)
-			         && list_match (users, user, user_match));
+	while (fgets (line, sizeof (line), fp) == line) {
+		struct access_rule *rule;
+		ptrdiff_t  end;
+		lineno++;
+		end = strlen (line) - 1;
+		if (line[0] == '\0' || line[end] != '\n') {
+			SYSLOG ((LOG_ERR,
+				 "%s: line %d: missing newline or line too long",
+				 TABLE, lineno));
+			continue;
 		}
-		(void) fclose (fp);
-	} else if (errno != ENOENT) {
-		int err = errno;
-		SYSLOG ((LOG_ERR, "cannot open %s: %s", TABLE, strerror (err)));
+		if (line[0] == '#') {
+			continue;	/* comment line */
+		}
+		while (end > 0 && isspace (line[end - 1])) {
+			end--;
+		}
+		line[end] = '\0';	/* strip trailing whitespace */
+		if (line[0] == '\0') {	/* skip blank lines */
+			continue;
+		}
+		if (   ((perm = strtok (line, fs)) == NULL)
+		    || ((users = strtok (NULL, fs)) == NULL)
+		    || ((froms = strtok (NULL, fs)) == NULL)
+		    || (strtok (NULL, fs) != NULL)) {
+			SYSLOG ((LOG_ERR,
+				 "%s: line %d: bad field count",
+				 TABLE, lineno));
+			continue;
+		}
+		if (perm[0] != '+' && perm[0] != '-') {
+			SYSLOG ((LOG_ERR,
+				 "%s: line %d: bad first field",
+				 TABLE, lineno));
+			continue;
+		}
+
+		if ((nrules % 16) == 0) {
+			rules = grow (rules, nrules, 16, sizeof *rules);
+		}
+		rule = &rules[nrules];
+		rule->allow = (perm[0] == '+');
+		compile_list (&rule->users, users, type_user);
+		compile_list (&rule->froms, froms, type_from);
+		nrules++;
 	}
-	return (!match || (line[0] == '+'))?1:0;
+	(void) fclose (fp);
+
+	table_sb = sb;
+	table_loaded = true;
+}
+
+/* login_access - match username/group and host/tty with access control file */
+int login_access (const char *user, const char *from)
+{
+	size_t i;
+
+	/*
+	 * Match the rules in the order of the table and stop at the first
+	 * match.
+	 */
+	load_table ();
+	for (i = 0; i < nrules; i++) {
+		if (   list_match (&rules[i].froms, 0, from, from_match)
+		    && list_match (&rules[i].users, 0, user, user_match)) {
+			return rules[i].allow ? 1 : 0;
+		}
+	}
+	return 1;
 }
 
 /* list_match - match an item against a list of tokens with exceptions */
-static bool list_match (char *list, const char *item, bool (*match_fn) (const char *, const char*))
+static bool list_match (const struct token_list *list, size_t first, const char *item,
+                        bool (*match_fn) (const struct token *, const char *))
 {
-	char *tok;
+	size_t i;
 	bool match = false;
 
 	/*
@@ -155,11 +372,11 @@ static bool list_match (char *list, const char *item, bool (*match_fn) (const ch
 	 * a match, look for an "EXCEPT" list and recurse to determine whether
 	 * the match is affected by any exceptions.
 	 */
-	for (tok = strtok (list, sep); tok != NULL; tok = strtok (NULL, sep)) {
-		if (strcasecmp (tok, "EXCEPT") == 0) {	/* EXCEPT: give up */
+	for (i = first; i < list->count; i++) {
+		if (list->tokens[i].type == TOK_EXCEPT) {	/* EXCEPT: give up */
 			break;
 		}
-		match = (*match_fn) (tok, item);
+		match = (*match_fn) (&list->tokens[i], item);
 		if (match) {
 			break;
 		}
@@ -167,10 +384,12 @@ static bool list_match (char *list, const char *item, bool (*match_fn) (const ch
 
 	/* Process exceptions to matches. */
 	if (match) {
-		while (   ((tok = strtok (NULL, sep)) != NULL)
-		       && (strcasecmp (tok, "EXCEPT") != 0))
-			/* VOID */ ;
-		if (tok == 0 || !list_match (NULL, item, match_fn)) {
+		for (i++; i < list->count; i++) {
+			if (list->tokens[i].type == TOK_EXCEPT) {
+				break;
+			}
+		}
+		if (i >= list->count || !list_match (list, i + 1, item, match_fn)) {
 			return (match);
 		}
 	}
@@ -189,12 +408,52 @@ static char *myhostname (void)
 	return (name);
 }
 
+/*
+ * cached_lookup - find the cached result of a lookup
+ *
+ * Return a pointer to the result, or NULL if it is not cached.
+ */
+static /*@null@*/const bool *cached_lookup (char kind, const char *key, const char *value)
+{
+	size_t i;
+
+	for (i = 0; i < nlookups; i++) {
+		if (   (lookups[i].kind == kind)
+		    && (strcmp (lookups[i].key, key) == 0)
+		    && (strcmp (lookups[i].value, value) == 0)) {
+			return &lookups[i].result;
+		}
+	}
+	return NULL;
+}
+
+/* cache_lookup - remember the result of a lookup, if there is room */
+static bool cache_lookup (char kind, const char *key, const char *value, bool result)
+{
+	if (nlookups < LOOKUP_CACHE_SIZE) {
+		lookups[nlookups].kind = kind;
+		lookups[nlookups].key = xstrdup (key);
+		lookups[nlookups].value = xstrdup (value);
+		lookups[nlookups].result = result;
+		nlookups++;
+	}
+	return result;
+}
+
 #if HAVE_INNETGR
 /* netgroup_match - match group against machine or user */
 static bool
 netgroup_match (const char *group, const char *machine, const char *user)
 {
 	static char *mydomain = NULL;
+	char kind = (NULL != machine) ? 'h' : 'u';
+	const char *value = (NULL != machine) ? machine : user;
+	const bool *cached;
+
+	cached = cached_lookup (kind, group, value);
+	if (NULL != cached) {
+		return *cached;
+	}
 
 	if (mydomain == NULL) {
 		static char domain[MAXHOSTNAMELEN + 1];
@@ -203,65 +462,93 @@ netgroup_match (const char *group, const char *machine, const char *user)
 		mydomain = domain;
 	}
 
-	return (innetgr (group, machine, user, mydomain) != 0);
+	return cache_lookup (kind, group, value,
+	                     innetgr (group, machine, user, mydomain) != 0);
 }
 #endif
 
-/* user_match - match a username against one token */
-static bool user_match (const char *tok, const char *string)
+/* group_match - match a username against the members of a group */
+static bool group_match (const char *name, const char *string)
 {
 	struct group *group;
-
 #ifdef PRIMARY_GROUP_MATCH
 	struct passwd *userinf;
 #endif
-	char *at;
+	const bool *cached;
+	int i;
+
+	cached = cached_lookup ('g', name, string);
+	if (NULL != cached) {
+		return *cached;
+	}
+
+	/* local, no need for xgetgrnam */
+	group = getgrnam (name);
+	if (NULL == group) {	/* try group membership */
+		return cache_lookup ('g', name, string, false);
+	}
+	for (i = 0; NULL != group->gr_mem[i]; i++) {
+		if (strcasecmp (string, group->gr_mem[i]) == 0) {
+			return cache_lookup ('g', name, string, true);
+		}
+	}
+#ifdef PRIMARY_GROUP_MATCH
+	/*
+	 * If the string is a user whose initial GID matches the token,
+	 * accept it. May avoid excessively long lines in /etc/group.
+	 * Radu-Adrian Feurdean <raf@licj.soroscj.ro>
+	 *
+	 * XXX - disabled by default for now.  Need to verify that
+	 * getpwnam() doesn't have some nasty side effects.  --marekm
+	 */
+	{
+		gid_t gid = group->gr_gid;
 
+		/* local, no need for xgetpwnam */
+		userinf = getpwnam (string);
+		if ((NULL != userinf) && (userinf->pw_gid == gid)) {
+			return cache_lookup ('g', name, string, true);
+		}
+	}
+#endif
+	return cache_lookup ('g', name, string, false);
+}
+
+/* user_match - match a username against one token */
+static bool user_match (const struct token *tok, const char *string)
+{
 	/*
 	 * If a token has the magic value "ALL" the match always succeeds.
 	 * Otherwise, return true if the token fully matches the username, or if
 	 * the token is a group that contains the username.
 	 */
-	at = strchr (tok + 1, '@');
-	if (NULL != at) {	/* split user@host pattern */
-		*at = '\0';
-		return (   user_match (tok, string)
-		        && from_match (at + 1, myhostname ()));
+	switch (tok->type) {
+	case TOK_USER_HOST:	/* user@host pattern */
+		return (   user_match (tok->user, string)
+		        && from_match (tok->host, myhostname ()));
+	case TOK_NETGROUP:
 #if HAVE_INNETGR
-	} else if (tok[0] == '@') {	/* netgroup */
-		return (netgroup_match (tok + 1, NULL, string));
+		return (netgroup_match (tok->text + 1, NULL, string));
+#else
+		break;
 #endif
-	} else if (string_match (tok, string)) {	/* ALL or exact match */
+	case TOK_EXCEPT:
+		return false;
+	default:
+		break;
+	}
+	if (string_match (tok, string)) {	/* ALL or exact match */
 		return true;
-	/* local, no need for xgetgrnam */
-	} else if ((group = getgrnam (tok)) != NULL) {	/* try group membership */
-		int i;
-		for (i = 0; NULL != group->gr_mem[i]; i++) {
-			if (strcasecmp (string, group->gr_mem[i]) == 0) {
-				return true;
-			}
-		}
-#ifdef PRIMARY_GROUP_MATCH
-		/*
-		 * If the string is a user whose initial GID matches the token,
-		 * accept it. May avoid excessively long lines in /etc/group.
-		 * Radu-Adrian Feurdean <raf@licj.soroscj.ro>
-		 *
-		 * XXX - disabled by default for now.  Need to verify that
-		 * getpwnam() doesn't have some nasty side effects.  --marekm
-		 */
-		/* local, no need for xgetpwnam */
-		userinf = getpwnam (string);
-		if (NULL != userinf) {
-			if (userinf->pw_gid == group->gr_gid) {
-				return true;
-			}
-		}
-#endif
 	}
-	return false;
+	return group_match (tok->text, string);
 }
 
+/*
+ * resolve_hostname - return the numeric address of a host
+ *
+ * The last client is cached, with the result of its lookup; the string
+ * itself is returned if it cannot be resolved.
+ */
 static const char *resolve_hostname (const char *string)
 {
 	int              gai_err;
@@ -269,6 +556,15 @@ static const char *resolve_hostname (const char *string)
 	struct addrinfo  *addrs;
 
 	static char      host[MAXHOSTNAMELEN];
+	static char      *resolved = NULL;
+	static bool      resolved_ok = false;
+
+	if ((NULL != resolved) && (strcmp (resolved, string) == 0)) {
+		return resolved_ok ? host : string;
+	}
+	free (resolved);
+	resolved = xstrdup (string);
+	resolved_ok = false;
 
 	gai_err = getaddrinfo(string, NULL, NULL, &addrs);
 	if (gai_err != 0) {
@@ -281,7 +577,9 @@ static const char *resolve_hostname (const char *string)
 	                      host, NITEMS(host), NULL, 0, NI_NUMERICHOST);
 	if (gai_err != 0) {
 		SYSLOG ((LOG_ERR, "getnameinfo(%s): %s", string, gai_strerror(gai_err)));
-		addr_str = string;
+		addr_str = (char *) string;
+	} else {
+		resolved_ok = true;
 	}
 
 	freeaddrinfo(addrs);
@@ -290,7 +588,7 @@ static const char *resolve_hostname (const char *string)
 
 /* from_match - match a host or tty against a list of tokens */
 
-static bool from_match (const char *tok, const char *string)
+static bool from_match (const struct token *tok, const char *string)
 {
 	size_t tok_len;
 
@@ -302,43 +600,51 @@ static bool from_match (const char *tok, const char *string)
 	 * contain a "." character. If the token is a network number, return true
 	 * if it matches the head of the string.
 	 */
+	switch (tok->type) {
+	case TOK_NETGROUP:
 #if HAVE_INNETGR
-	if (tok[0] == '@') {	/* netgroup */
-		return (netgroup_match (tok + 1, string, NULL));
-	} else
+		return (netgroup_match (tok->text + 1, string, NULL));
+#else
+		break;
 #endif
+	case TOK_EXCEPT:
+		return false;
+	default:
+		break;
+	}
 	if (string_match (tok, string)) {	/* ALL or exact match */
 		return true;
-	} else if (tok[0] == '.') {	/* domain: match last fields */
+	} else if (tok->type == TOK_DOMAIN) {	/* domain: match last fields */
 		size_t str_len;
 		str_len = strlen (string);
-		tok_len = strlen (tok);
+		tok_len = strlen (tok->text);
 		if (   (str_len > tok_len)
-		    && (strcasecmp (tok, string + str_len - tok_len) == 0)) {
+		    && (strcasecmp (tok->text, string + str_len - tok_len) == 0)) {
 			return true;
 		}
-	} else if (strcasecmp (tok, "LOCAL") == 0) {	/* local: no dots */
+	} else if (tok->type == TOK_LOCAL) {	/* local: no dots */
 		if (strchr (string, '.') == NULL) {
 			return true;
 		}
-	} else if (   (tok[0] != '\0' && tok[(tok_len = strlen (tok)) - 1] == '.') /* network */
-		   && (strncmp (tok, resolve_hostname (string), tok_len) == 0)) {
+	} else if (   (tok->type == TOK_NETWORK)	/* network */
+		   && (strncmp (tok->text, resolve_hostname (string),
+		                strlen (tok->text)) == 0)) {
 		return true;
 	}
 	return false;
 }
 
 /* string_match - match a string against one token */
-static bool string_match (const char *tok, const char *string)
+static bool string_match (const struct token *tok, const char *string)
 {
 
 	/*
 	 * If the token has the magic value "ALL" the match always succeeds.
 	 * Otherwise, return true if the token fully matches the string.
 	 */
-	if (strcasecmp (tok, "ALL") == 0) {	/* all: always matches */
+	if (tok->type == TOK_ALL) {	/* all: always matches */
 		return true;
-	} else if (strcasecmp (tok, string) == 0) {	/* try exact match */
+	} else if (strcasecmp (tok->text, string) == 0) {	/* try exact match */
 		return true;
 	}
 	return false;
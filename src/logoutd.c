@@ -11,11 +11,18 @@
 #ident "$Id$"
 
 #include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#include <sys/inotify.h>
+#endif
+#include <unistd.h>
 #include "defines.h"
+#include "port.h"
 #include "prototypes.h"
 #include "shadowlog.h"
 /*
@@ -31,17 +38,55 @@ const char *Prog;
 #define HUP_MESG_FILE "/etc/logoutd.mesg"
 #endif
 
+/*
+ * Delay between the message sent to the terminal, SIGHUP, and SIGKILL,
+ * in seconds.
+ */
+#define LOGOUT_DELAY	10
+
+/*
+ * Maximum time between two scans of utmp, in seconds. utmp and
+ * /etc/porttime are watched for changes with inotify; without inotify,
+ * utmp is scanned once per minute.
+ */
+#ifdef HAVE_SYS_INOTIFY_H
+#define MAX_SLEEP	3600
+#else
+#define MAX_SLEEP	60
+#endif
+
+/*
+ * Sessions being logged off. Each of them is driven through its steps by
+ * the main loop, without a process per session.
+ */
+struct logout {
+	pid_t pid;
+	int step;		/* next step: message, SIGHUP, SIGKILL */
+	time_t when;		/* time of the next step */
+	char user[UT_NAMESIZE + 1];
+	char tty_name[UT_LINESIZE + 6];	/* /dev/ + NUL */
+};
+
+static /*@null@*/ /*@only@*/struct logout *logouts = NULL;
+static size_t nlogouts = 0;
+static size_t logouts_size = 0;
+
 /* local function prototypes */
-static int check_login (const struct utmp *ut);
+static time_t session_end (const struct utmp *ut, time_t now);
 static void send_mesg_to_tty (int tty_fd);
+static void add_logout (const struct utmp *ut, time_t now);
+static time_t scan_utmp (time_t now);
+static time_t run_logouts (time_t now);
 
 /*
- * check_login - check if user (struct utmp) allowed to stay logged in
+ * session_end - tell when user (struct utmp) has to be logged out
+ *
+ *	Return now if the user is not allowed to stay logged in, or
+ *	(time_t) -1 if there is no limit in the next week.
  */
-static int check_login (const struct utmp *ut)
+static time_t session_end (const struct utmp *ut, time_t now)
 {
 	char user[sizeof (ut->ut_user) + 1];
-	time_t now;
 
 	/*
 	 * ut_user may not have the terminating NUL.
@@ -49,15 +94,7 @@ static int check_login (const struct utmp *ut)
 	strncpy (user, ut->ut_user, sizeof (ut->ut_user));
 	user[sizeof (ut->ut_user)] = '\0';
 
-	(void) time (&now);
-
-	/*
-	 * Check if they are allowed to be logged in right now.
-	 */
-	if (!isttytime (user, ut->ut_line, now)) {
-		return 0;
-	}
-	return 1;
+	return ttytime_end (user, ut->ut_line, now);
 }
 
 
@@ -103,6 +140,170 @@ static void send_mesg_to_tty (int tty_fd)
 }
 
 
+/*
+ * add_logout - start logging off the session ut
+ */
+static void add_logout (const struct utmp *ut, time_t now)
+{
+	struct logout *lo;
+	size_t i;
+
+	/* The session may already be logged off */
+	for (i = 0; i < nlogouts; i++) {
+		if (   (logouts[i].pid == ut->ut_pid)
+		    && (strncmp (logouts[i].user, ut->ut_user,
+		                 sizeof (ut->ut_user)) == 0)) {
+			return;
+		}
+	}
+
+	if (nlogouts == logouts_size) {
+		size_t size = (0 == logouts_size) ? 16 : logouts_size * 2;
+		struct logout *new_logouts;
+
+		new_logouts = realloc (logouts, size * sizeof *logouts);
+		if (NULL == new_logouts) {
+			/* give up until the next scan */
+			return;
+		}
+		logouts = new_logouts;
+		logouts_size = size;
+	}
+
+	lo = &logouts[nlogouts];
+	nlogouts++;
+	lo->pid = ut->ut_pid;
+	lo->step = 0;
+	lo->when = now;
+	strncpy (lo->user, ut->ut_user, sizeof (lo->user) - 1);
+	lo->user[sizeof (lo->user) - 1] = '\0';
+
+	if (strncmp (ut->ut_line, "/dev/", 5) != 0) {
+		strcpy (lo->tty_name, "/dev/");
+	} else {
+		lo->tty_name[0] = '\0';
+	}
+	strncat (lo->tty_name, ut->ut_line, UT_LINESIZE);
+}
+
+/*
+ * scan_utmp - find the sessions which are not allowed anymore
+ *
+ *	Return the time at which the next session has to be logged off,
+ *	or (time_t) -1 if no sessions have to be logged off in the next
+ *	week.
+ */
+static time_t scan_utmp (time_t now)
+{
+	const struct utmp *ut;
+	time_t next = (time_t) -1;
+
+	/*
+	 * Attempt to re-open the utmp file. The file is only
+	 * open while it is being used.
+	 */
+	setutent ();
+
+	/*
+	 * Read all of the entries in the utmp file. The entries
+	 * for login sessions will be checked to see if the user
+	 * is permitted to be signed on at this time.
+	 */
+	while ((ut = getutent ()) != NULL) {
+		time_t end;
+
+		if (ut->ut_type != USER_PROCESS) {
+			continue;
+		}
+		if (ut->ut_user[0] == '\0') {
+			continue;
+		}
+		/* Stale entry of a session which is gone */
+		if (   (ut->ut_pid > 1)
+		    && (kill (ut->ut_pid, 0) != 0)
+		    && (ESRCH == errno)) {
+			continue;
+		}
+		end = session_end (ut, now);
+		if ((time_t) -1 == end) {
+			continue;
+		}
+		if (end > now) {
+			if (((time_t) -1 == next) || (end < next)) {
+				next = end;
+			}
+			continue;
+		}
+		add_logout (ut, now);
+	}
+
+	endutent ();
+
+	return next;
+}
+
+/*
+ * run_logouts - run the steps of the logoffs which are due
+ *
+ *	The user gets a message on the terminal, then the session gets
+ *	SIGHUP and finally SIGKILL, LOGOUT_DELAY seconds apart.
+ *
+ *	Return the time of the next step, or (time_t) -1 if all the
+ *	sessions are logged off.
+ */
+static time_t run_logouts (time_t now)
+{
+	time_t next = (time_t) -1;
+	size_t i, j;
+
+	for (i = 0, j = 0; i < nlogouts; i++) {
+		struct logout *lo = &logouts[i];
+		int tty_fd;
+
+		while ((lo->step < 3) && (lo->when <= now)) {
+			switch (lo->step) {
+			case 0:
+#ifndef O_NOCTTY
+#define O_NOCTTY 0
+#endif
+				tty_fd = open (lo->tty_name,
+				               O_WRONLY | O_NDELAY | O_NOCTTY);
+				if (tty_fd != -1) {
+					send_mesg_to_tty (tty_fd);
+					lo->when = now + LOGOUT_DELAY;
+				}
+				break;
+			case 1:
+				if (lo->pid > 1) {
+					kill (-lo->pid, SIGHUP);
+					lo->when = now + LOGOUT_DELAY;
+				}
+				break;
+			default:
+				if (lo->pid > 1) {
+					kill (-lo->pid, SIGKILL);
+				}
+				SYSLOG ((LOG_NOTICE,
+					 "logged off user '%s' on '%s'",
+					 lo->user, lo->tty_name));
+				break;
+			}
+			lo->step++;
+		}
+
+		if (lo->step < 3) {
+			if (((time_t) -1 == next) || (lo->when < next)) {
+				next = lo->when;
+			}
+			logouts[j] = *lo;
+			j++;
+		}
+	}
+	nlogouts = j;
+
+	return next;
+}
+
 /*
  * logoutd - logout daemon to enforce /etc/porttime file policy
  *
@@ -114,13 +315,8 @@ static void send_mesg_to_tty (int tty_fd)
 int main (int argc, char **argv)
 {
 	int i;
-	int status;
 	pid_t pid;
-
-	struct utmp *ut;
-	char user[sizeof (ut->ut_user) + 1];	/* terminating NUL */
-	char tty_name[sizeof (ut->ut_line) + 6];	/* /dev/ + NUL */
-	int tty_fd;
+	int ino_fd = -1;
 
 	if (1 != argc) {
 		(void) fputs (_("Usage: logoutd\n"), stderr);
@@ -158,97 +354,61 @@ int main (int argc, char **argv)
 
 	OPENLOG ("logoutd");
 
+#ifdef HAVE_SYS_INOTIFY_H
+	ino_fd = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+#endif
+
 	/*
-	 * Scan the utmp file once per minute looking for users that
-	 * are not supposed to still be logged in.
+	 * Scan the utmp file when it changes, and when the next session
+	 * has to be logged off, looking for users that are not supposed
+	 * to still be logged in.
 	 */
 	while (true) {
+		time_t now, next, step;
+		long timeout;
 
+#ifdef HAVE_SYS_INOTIFY_H
 		/*
-		 * Attempt to re-open the utmp file. The file is only
-		 * open while it is being used.
+		 * The files may have been replaced: the watches are added
+		 * again before each scan.
 		 */
-		setutent ();
-
-		/*
-		 * Read all of the entries in the utmp file. The entries
-		 * for login sessions will be checked to see if the user
-		 * is permitted to be signed on at this time.
-		 */
-		while ((ut = getutent ()) != NULL) {
-			if (ut->ut_type != USER_PROCESS) {
-				continue;
-			}
-			if (ut->ut_user[0] == '\0') {
-				continue;
-			}
-			if (check_login (ut)) {
-				continue;
-			}
-
-			/*
-			 * Put the rest of this in a child process. This
-			 * keeps the scan from waiting on other ports to die.
-			 */
-
-			pid = fork ();
-			if (pid > 0) {
-				/* parent */
-				continue;
-			} else if (pid < 0) {
-				/* failed - give up until the next scan */
-				break;
-			}
-			/* child */
-
-			if (strncmp (ut->ut_line, "/dev/", 5) != 0) {
-				strcpy (tty_name, "/dev/");
-			} else {
-				tty_name[0] = '\0';
-			}
-
-			strncat (tty_name, ut->ut_line, UT_LINESIZE);
-#ifndef O_NOCTTY
-#define O_NOCTTY 0
+		if (ino_fd >= 0) {
+			(void) inotify_add_watch (ino_fd, _PATH_UTMP,
+			                          IN_MODIFY | IN_CLOSE_WRITE
+			                          | IN_ATTRIB | IN_DELETE_SELF);
+			(void) inotify_add_watch (ino_fd, PORTS,
+			                          IN_MODIFY | IN_CLOSE_WRITE
+			                          | IN_ATTRIB | IN_DELETE_SELF);
+		}
 #endif
-			tty_fd =
-			    open (tty_name, O_WRONLY | O_NDELAY | O_NOCTTY);
-			if (tty_fd != -1) {
-				send_mesg_to_tty (tty_fd);
-				close (tty_fd);
-				sleep (10);
-			}
-
-			if (ut->ut_pid > 1) {
-				kill (-ut->ut_pid, SIGHUP);
-				sleep (10);
-				kill (-ut->ut_pid, SIGKILL);
-			}
 
-			strncpy (user, ut->ut_user, sizeof (user) - 1);
-			user[sizeof (user) - 1] = '\0';
-
-			SYSLOG ((LOG_NOTICE,
-				 "logged off user '%s' on '%s'", user,
-				 tty_name));
+		(void) time (&now);
+		next = scan_utmp (now);
+		step = run_logouts (now);
+		if (((time_t) -1 == next) || (((time_t) -1 != step) && (step < next))) {
+			next = step;
+		}
 
-			/*
-			 * This child has done all it can, drop dead.
-			 */
-			exit (EXIT_SUCCESS);
+		timeout = MAX_SLEEP;
+		if (((time_t) -1 != next) && (next - now < MAX_SLEEP)) {
+			timeout = (next > now) ? (long) (next - now) : 0;
 		}
 
-		endutent ();
+		if (ino_fd >= 0) {
+			struct pollfd pfd;
+			char events[4096];
 
-#ifndef DEBUG
-		sleep (60);
-#endif
-		/*
-		 * Reap any dead babies ...
-		 */
-		while (wait (&status) != -1);
+			pfd.fd = ino_fd;
+			pfd.events = POLLIN;
+			if (poll (&pfd, 1, timeout * 1000) > 0) {
+				/* The events are not needed, only the wake up */
+				while (read (ino_fd, events, sizeof events) > 0) {
+				}
+			}
+		} else {
+			(void) sleep (timeout);
+		}
 	}
 
 	return EXIT_FAILURE;
 }
-
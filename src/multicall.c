@@ -0,0 +1,137 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/auxv.h>
+#include <unistd.h>
+#include "defines.h"
+#include "prototypes.h"
+/*@-exitarg@*/
+#include "exitcodes.h"
+
+/*
+ * shadow - multi-call binary of the tools
+ *
+ * The tools which are not installed setuid are linked in a single
+ * binary, so that their code is loaded and relocated once. The tool is
+ * selected by the name the binary is run as (for example a link named
+ * useradd), or by the first argument ("shadow useradd ...").
+ *
+ * The tools installed setuid are not included: they run with their own
+ * binary. The binary refuses to run with the privileges of a setuid or
+ * setgid bit, or of file capabilities, so that installing it with
+ * privileges cannot give them to all its tools.
+ */
+
+/* The tools, as in multicall_tools of src/Makefile.am */
+#define TOOLS \
+	TOOL (chgpasswd) \
+	TOOL (chpasswd) \
+	TOOL (cryptcost) \
+	TOOL (faillog) \
+	TOOL (groupadd) \
+	TOOL (groupdel) \
+	TOOL (groupmems) \
+	TOOL (groupmod) \
+	TOOL (groups) \
+	TOOL (grpck) \
+	TOOL (grpconv) \
+	TOOL (grpunconv) \
+	TOOL (lastlog) \
+	TOOL (logoutd) \
+	TOOL (newusers) \
+	TOOL (pwck) \
+	TOOL (pwconv) \
+	TOOL (pwsync) \
+	TOOL (pwunconv) \
+	TOOL (useradd) \
+	TOOL (userdel) \
+	TOOL (usermod) \
+	TOOL (vipw)
+
+#define TOOL(name) extern int name##_main (int argc, char **argv);
+TOOLS
+#undef TOOL
+
+static const struct tool {
+	const char *name;
+	int (*main) (int argc, char **argv);
+} tools[] = {
+#define TOOL(name) { #name, name##_main },
+	TOOLS
+#undef TOOL
+	{ "vigr", vipw_main },	/* vipw checks the name it is run as */
+	{ NULL, NULL }
+};
+
+static const char *Prog;
+
+static void usage (int status)
+{
+	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+	const struct tool *t;
+
+	(void) fprintf (usageout,
+	                _("Usage: %s TOOL [options]\n"
+	                  "\n"
+	                  "Tools:\n"),
+	                Prog);
+	for (t = tools; NULL != t->name; t++) {
+		(void) fprintf (usageout, "  %s\n", t->name);
+	}
+	exit (status);
+}
+
+static /*@null@*/const struct tool *find_tool (const char *name)
+{
+	const struct tool *t;
+
+	for (t = tools; NULL != t->name; t++) {
+		if (strcmp (t->name, name) == 0) {
+			return t;
+		}
+	}
+	return NULL;
+}
+
+int main (int argc, char **argv)
+{
+	const struct tool *t;
+
+	Prog = Basename (argv[0]);
+
+	if (   (getauxval (AT_SECURE) != 0)
+	    || (getuid () != geteuid ())
+	    || (getgid () != getegid ())) {
+		(void) fprintf (stderr,
+		                _("%s: cannot be run with setuid, setgid or file capabilities\n"),
+		                Prog);
+		exit (E_NOPERM);
+	}
+
+	t = find_tool (Prog);
+	if (NULL == t) {
+		if (   (argc < 2)
+		    || (strcmp (argv[1], "-h") == 0)
+		    || (strcmp (argv[1], "--help") == 0)) {
+			usage ((argc < 2) ? E_USAGE : E_SUCCESS);
+		}
+		t = find_tool (argv[1]);
+		if (NULL == t) {
+			(void) fprintf (stderr, _("%s: unknown tool '%s'\n"),
+			                Prog, argv[1]);
+			usage (E_USAGE);
+		}
+		/* The tool sees its own name in argv[0] */
+		argc--;
+		argv++;
+	}
+
+	return t->main (argc, argv);
+}
@@ -76,14 +76,37 @@ static bool ingroup(const char *name, struct group *gr)
  * find_matching_group - search all groups of a gr's group id for
  *                       membership of a given username
  *                       but check gr itself first
+ *
+ *	getgrouplist() is asked first whether the user is a member of a
+ *	group with this group id, so that all the groups are only
+ *	enumerated for users who are.
  */
-static /*@null@*/struct group *find_matching_group (const char *name, struct group *gr)
+static /*@null@*/struct group *find_matching_group (const char *name,
+                                                    gid_t primary_gid,
+                                                    struct group *gr)
 {
 	gid_t gid = gr->gr_gid;
+	gid_t *list;
+	int ngroups;
+	int i;
 
 	if (ingroup(name, gr))
 		return gr;
 
+	if (gid != primary_gid) {
+		ngroups = get_grouplist (name, primary_gid, &list);
+		for (i = 0; i < ngroups; i++) {
+			if (list[i] == gid) {
+				break;
+			}
+		}
+		free (list);
+		if ((ngroups >= 0) && (i == ngroups)) {
+			/* Not a member of any group with this GID */
+			return NULL;
+		}
+	}
+
 	setgrent ();
 	while ((gr = getgrent ()) != NULL) {
 		if (gr->gr_gid != gid) {
@@ -621,7 +644,7 @@ int main (int argc, char **argv)
 	 * membership of the current user.
 	 */
 	if (!is_member) {
-		grp = find_matching_group (name, grp);
+		grp = find_matching_group (name, pwd->pw_gid, grp);
 		if (NULL == grp) {
 			/*
 			 * No matching group found. As we already know that
@@ -25,51 +25,17 @@
  */
 const char *Prog;
 
-static bool verify_range(struct passwd *pw, struct map_range *range)
-{
-	/* An empty range is invalid */
-	if (range->count == 0)
-		return false;
-
-	/* Test /etc/subuid */
-	if (have_sub_uids(pw->pw_name, range->lower, range->count))
-		return true;
-
-	/* Allow a process to map its own uid */
-	if ((range->count == 1) && (pw->pw_uid == range->lower))
-		return true;
-
-	return false;
-}
-
-static void verify_ranges(struct passwd *pw, int ranges,
-	struct map_range *mappings)
-{
-	struct map_range *mapping;
-	int idx;
-
-	mapping = mappings;
-	for (idx = 0; idx < ranges; idx++, mapping++) {
-		if (!verify_range(pw, mapping)) {
-			fprintf(stderr, _( "%s: uid range [%lu-%lu) -> [%lu-%lu) not allowed\n"),
-				Prog,
-				mapping->upper,
-				mapping->upper + mapping->count,
-				mapping->lower,
-				mapping->lower + mapping->count);
-			exit(EXIT_FAILURE);
-		}
-	}
-}
-
 static void usage(void)
 {
-	fprintf(stderr, _("usage: %s <pid> <uid> <loweruid> <count> [ <uid> <loweruid> <count> ] ... \n"), Prog);
+	fprintf(stderr, _("usage: %s <pid> <uid> <loweruid> <count> [ <uid> <loweruid> <count> ] ... [ --gid-map <gid> <lowergid> <count> ... ]\n"), Prog);
 	exit(EXIT_FAILURE);
 }
 
 /*
  * newuidmap - Set the uid_map for the specified process
+ *
+ *	With --gid-map, the gid_map and the setgroups policy of the
+ *	process are set as well, as newgidmap would, in the same execution.
  */
 int main(int argc, char **argv)
 {
@@ -79,9 +45,15 @@ int main(int argc, char **argv)
 	int proc_dir_fd;
 	int ranges;
 	struct map_range *mappings;
+	bool gid_map = false;
+	int gid_argc = 0;
+	int gid_ranges = 0;
+	struct map_range *gid_mappings = NULL;
+	bool allow_setgroups = false;
 	struct stat st;
 	struct passwd *pw;
 	int written;
+	int idx;
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
@@ -149,8 +121,14 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	}
 
-	if (!sub_uid_open(O_RDONLY)) {
-		return EXIT_FAILURE;
+	/* The gid mappings follow --gid-map */
+	for (idx = 2; idx < argc; idx++) {
+		if (strcmp(argv[idx], "--gid-map") == 0) {
+			gid_map = true;
+			gid_argc = argc - (idx + 1);
+			argc = idx;
+			break;
+		}
 	}
 
 	ranges = ((argc - 2) + 2) / 3;
@@ -158,9 +136,25 @@ int main(int argc, char **argv)
 	if (!mappings)
 		usage();
 
-	verify_ranges(pw, ranges, mappings);
+	if (gid_map) {
+		if (gid_argc < 3)
+			usage();
+		gid_ranges = (gid_argc + 2) / 3;
+		gid_mappings = get_map_ranges(gid_ranges, gid_argc, argv + argc + 1);
+		if (!gid_mappings)
+			usage();
+	}
 
-	write_mapping(proc_dir_fd, ranges, mappings, "uid_map", pw->pw_uid);
+	verify_uid_ranges(pw, ranges, mappings);
+	if (NULL != gid_mappings) {
+		verify_gid_ranges(pw, gid_ranges, gid_mappings, &allow_setgroups);
+		write_setgroups(proc_dir_fd, allow_setgroups);
+		write_mappings(proc_dir_fd, ranges, mappings,
+		               gid_ranges, gid_mappings, pw->pw_uid);
+		sub_gid_close();
+	} else {
+		write_mapping(proc_dir_fd, ranges, mappings, "uid_map", pw->pw_uid);
+	}
 	sub_uid_close();
 
 	return EXIT_SUCCESS;
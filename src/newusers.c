@@ -29,6 +29,9 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#ifdef WITH_SELINUX
+#include <selinux/selinux.h>
+#endif				/* WITH_SELINUX */
 #ifdef ACCT_TOOLS_SETUID
 #ifdef USE_PAM
 #include "pam_defs.h"
@@ -38,8 +41,6 @@
 #include "defines.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "pwio.h"
 #include "sgroupio.h"
 #include "shadowio.h"
@@ -85,18 +86,59 @@ static bool is_sub_uid = false;
 static bool is_sub_gid = false;
 static bool sub_uid_locked = false;
 static bool sub_gid_locked = false;
+/* Users which need subordinate IDs, in the order of the input */
+static char **sub_uid_owners = NULL;
+static size_t sub_uid_nowners = 0;
+static char **sub_gid_owners = NULL;
+static size_t sub_gid_nowners = 0;
 #endif				/* ENABLE_SUBIDS */
 
+static long commit_every = 0;	/* 0: commit when the input ends */
+static bool validate_first = false;	/* check the input before locking */
+static bool sorted_input = false;	/* input sorted by user name */
+static /*@null@*/ /*@only@*/char *last_name = NULL;
+#ifndef USE_PAM
+static bool check_quality = false;	/* reject the weak passwords */
+#endif				/* !USE_PAM */
+
+#ifdef WITH_SELINUX
+static /*@null@*/const char *user_selinux = NULL;
+#define Zflg (NULL != user_selinux)
+/* Users whose SELinux login mapping is set after the next commit */
+static char **seuser_names = NULL;
+static size_t seuser_nnames = 0;
+#endif				/* WITH_SELINUX */
+
+#if defined(HAVE_CRYPT_R) && !defined(USE_PAM)
+/*
+ * With -j, the passwords are encrypted by a batch of lib/encrypt.c
+ * while the main thread goes on with the next lines. The entries get a
+ * locked password meanwhile, and the encrypted passwords are stored in
+ * the order of the input after the last line.
+ */
+struct crypt_job {
+	int line;
+	bool in_shadow;		/* encrypted password in sp_pwdp */
+	char *name;
+};
+
+static long crypt_threads = 1;
+static /*@null@*/struct crypt_batch *crypt_batch = NULL;
+static /*@null@*/struct crypt_job *crypt_jobs = NULL;
+static size_t crypt_njobs = 0;
+static size_t crypt_jobs_size = 0;
+#endif				/* HAVE_CRYPT_R && !USE_PAM */
+
 /* local function prototypes */
 static void usage (int status);
 static void fail_exit (int);
 static int add_group (const char *, const char *, gid_t *, gid_t);
-static int get_user_id (const char *, uid_t *);
+static int get_user_id (const char *, bool, uid_t *);
 static int add_user (const char *, uid_t, gid_t);
 #ifndef USE_PAM
-static int update_passwd (struct passwd *, const char *);
+static int update_passwd (struct passwd *, const char *, int);
 #endif				/* !USE_PAM */
-static int add_passwd (struct passwd *, const char *);
+static int add_passwd (struct passwd *, const char *, int);
 static void process_flags (int argc, char **argv);
 static void check_flags (void);
 static void check_perms (void);
@@ -117,7 +159,10 @@ static void usage (int status)
 	                  "Options:\n"),
 	                Prog);
 	(void) fputs (_("  -b, --badname                 allow bad names\n"), usageout);
+	(void) fputs (_("  -C, --commit-every LINES      commit the changes every LINES lines\n"), usageout);
 #ifndef USE_PAM
+	(void) fputs (_("      --check-quality           reject the passwords which obscure\n"
+	                "                                checks would reject\n"), usageout);
 	(void) fprintf (usageout,
 	                _("  -c, --crypt-method METHOD     the crypt method (one of %s)\n"),
                         "NONE DES MD5"
@@ -132,7 +177,12 @@ static void usage (int status)
 #endif
 	               );
 #endif				/* !USE_PAM */
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+#if !defined(USE_PAM) && defined(HAVE_CRYPT_R)
+	(void) fputs (_("  -j, --jobs JOBS               encrypt the passwords in JOBS threads\n"), usageout);
+#endif				/* !USE_PAM && HAVE_CRYPT_R */
 	(void) fputs (_("  -r, --system                  create system accounts\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 #ifndef USE_PAM
@@ -142,6 +192,12 @@ static void usage (int status)
 	              usageout);
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
 #endif				/* !USE_PAM */
+	(void) fputs (_("      --sorted-input            the lines are sorted by user name\n"), usageout);
+	(void) fputs (_("      --validate-first          check all the lines before locking the\n"
+	                "                                databases\n"), usageout);
+#ifdef WITH_SELINUX
+	(void) fputs (_("  -Z, --selinux-user SEUSER     use a specific SEUSER for the SELinux user mapping\n"), usageout);
+#endif				/* WITH_SELINUX */
 	(void) fputs ("\n", usageout);
 
 	exit (status);
@@ -202,6 +258,46 @@ static void fail_exit (int code)
 	exit (code);
 }
 
+/*
+ * locate_pw, locate_spw - find the entry of a user of the input
+ *
+ *	With --sorted-input, the databases are read along with the input,
+ *	see commonio_locate_sorted().
+ */
+static /*@observer@*/ /*@null@*/const struct passwd *locate_pw (const char *name)
+{
+	return sorted_input ? pw_locate_sorted (name) : pw_locate (name);
+}
+
+static /*@observer@*/ /*@null@*/const struct spwd *locate_spw (const char *name)
+{
+	return sorted_input ? spw_locate_sorted (name) : spw_locate (name);
+}
+
+/*
+ * check_order - check that the user of a line comes after the user of
+ *               the previous line, with --sorted-input
+ *
+ * Return false if the input is not sorted.
+ */
+static bool check_order (const char *name, int line)
+{
+	if (!sorted_input) {
+		return true;
+	}
+	if (   (NULL != last_name)
+	    && (sorted_keycmp (last_name, strlen (last_name),
+	                       name, strlen (name)) >= 0)) {
+		fprintf (stderr,
+		         _("%s: line %d: user '%s' is not sorted after '%s'\n"),
+		         Prog, line, name, last_name);
+		return false;
+	}
+	free (last_name);
+	last_name = xstrdup (name);
+	return true;
+}
+
 /*
  * add_group - create a new group or add a user to an existing group
  */
@@ -332,11 +428,25 @@ static int add_group (const char *name, const char *gid, gid_t *ngid, uid_t uid)
 	return 0;
 }
 
-static int get_user_id (const char *uid, uid_t *nuid) {
+/*
+ * new_group - Check whether add_group will create a group with a new
+ *             GID for the group field gid.
+ */
+static bool new_group (const char *gid)
+{
+	if (isdigit (gid[0])) {
+		return false;
+	}
+	return (getgrnam (gid) == NULL) && (gr_locate (gid) == NULL);
+}
+
+static int get_user_id (const char *uid, bool user_group, uid_t *nuid) {
 
 	/*
 	 * The first guess for the UID is either the numerical UID that the
-	 * caller provided, or the next available UID.
+	 * caller provided, or the next available UID. If a group will be
+	 * created for the user, the next UID which is also available as a
+	 * GID is preferred.
 	 */
 	if (isdigit (uid[0])) {
 		if ((get_uid (uid, nuid) == 0) || (*nuid == (uid_t)-1)) {
@@ -362,6 +472,10 @@ static int get_user_id (const char *uid, uid_t *nuid) {
 				         Prog, uid);
 				return -1;
 			}
+		} else if (user_group) {
+			if (find_new_uid_gid (rflg, nuid) < 0) {
+				return -1;
+			}
 		} else {
 			if (find_new_uid (rflg, nuid, NULL) < 0) {
 				return -1;
@@ -404,12 +518,172 @@ static int add_user (const char *name, uid_t uid, gid_t gid)
 }
 
 #ifndef USE_PAM
+#ifdef HAVE_CRYPT_R
+/*
+ * queue_crypt - queue the encryption of the password of a line
+ *
+ * Return 0 if successful.
+ */
+static int queue_crypt (const char *name, const char *password,
+                        const char *salt, bool in_shadow, int line)
+{
+	struct crypt_job *job;
+
+	if (crypt_njobs == crypt_jobs_size) {
+		size_t size = (0 == crypt_jobs_size) ? 256 : crypt_jobs_size * 2;
+		struct crypt_job *jobs;
+
+		jobs = realloc (crypt_jobs, size * sizeof *jobs);
+		if (NULL == jobs) {
+			goto fail;
+		}
+		crypt_jobs = jobs;
+		crypt_jobs_size = size;
+	}
+	job = &crypt_jobs[crypt_njobs];
+	job->line = line;
+	job->in_shadow = in_shadow;
+	job->name = strdup (name);
+	if (NULL == job->name) {
+		goto fail;
+	}
+	if (crypt_batch_add (crypt_batch, password, salt) == -1) {
+		free (job->name);
+		goto fail;
+	}
+	crypt_njobs++;
+	return 0;
+
+      fail:
+	fprintf (stderr, _("%s: line %d: %s\n"), Prog, line, strerror (errno));
+	return -1;
+}
+
+/*
+ * apply_crypt_jobs - wait for the encrypted passwords and store them in
+ *                    the order of the input
+ *
+ * Return the number of errors.
+ */
+static int apply_crypt_jobs (void)
+{
+	int errors = 0;
+	size_t i;
+
+	crypt_batch_finish (crypt_batch);
+
+	if (sorted_input) {
+		/* The jobs are in the order of the input */
+		(void) pw_rewind ();
+		(void) spw_rewind ();
+	}
+	for (i = 0; i < crypt_njobs; i++) {
+		struct crypt_job *job = &crypt_jobs[i];
+		const char *salt;
+		const char *hash;
+		const char *msg;
+		int err;
+
+		msg = crypt_batch_rejected (crypt_batch, i);
+		hash = crypt_batch_hash (crypt_batch, i, &salt, &err);
+		if (NULL != msg) {
+			fprintf (stderr,
+			         _("%s: line %d: bad password for user '%s': %s\n"),
+			         Prog, job->line, job->name, msg);
+			errors++;
+		} else if (NULL == hash) {
+			fprintf (stderr,
+			         _("%s: failed to crypt password with salt '%s': %s\n"),
+			         Prog, salt, strerror (err));
+			fprintf (stderr,
+			         _("%s: line %d: can't update password\n"),
+			         Prog, job->line);
+			errors++;
+		} else if (job->in_shadow) {
+			const struct spwd *sp = locate_spw (job->name);
+			struct spwd spent;
+
+			if (NULL != sp) {
+				spent = *sp;
+				spent.sp_pwdp = (char *) hash;
+			}
+			if ((NULL == sp) || (spw_update (&spent) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: can't update password\n"),
+				         Prog, job->line);
+				errors++;
+			}
+		} else {
+			const struct passwd *pw = locate_pw (job->name);
+			struct passwd newpw;
+
+			if (NULL != pw) {
+				newpw = *pw;
+				newpw.pw_passwd = (char *) hash;
+			}
+			if ((NULL == pw) || (pw_update (&newpw) == 0)) {
+				fprintf (stderr,
+				         _("%s: line %d: can't update password\n"),
+				         Prog, job->line);
+				errors++;
+			}
+		}
+		free (job->name);
+	}
+
+	crypt_batch_free (crypt_batch);
+	crypt_batch = NULL;
+	free (crypt_jobs);
+	crypt_jobs = NULL;
+	crypt_njobs = 0;
+	crypt_jobs_size = 0;
+	return errors;
+}
+#endif				/* HAVE_CRYPT_R */
+
+/*
+ * encrypt_password - encrypt the password of a line
+ *
+ *	With -j, the encryption is queued and a locked password is
+ *	returned, see apply_crypt_jobs().
+ *
+ * Return NULL if the password could not be encrypted.
+ */
+static /*@null@*/char *encrypt_password (const char *name,
+                                         const char *password,
+                                         const char *salt, bool in_shadow,
+                                         int line)
+{
+	char *cp;
+
+#ifdef HAVE_CRYPT_R
+	if (NULL != crypt_batch) {
+		if (queue_crypt (name, password, salt, in_shadow, line) != 0) {
+			return NULL;
+		}
+		return "!";
+	}
+#else				/* !HAVE_CRYPT_R */
+	(void) name;
+	(void) in_shadow;
+	(void) line;
+#endif				/* !HAVE_CRYPT_R */
+
+	cp = pw_encrypt (password, salt);
+	if (NULL == cp) {
+		fprintf (stderr,
+		         _("%s: failed to crypt password with salt '%s': %s\n"),
+		         Prog, salt, strerror (errno));
+	}
+	return cp;
+}
+
 /*
  * update_passwd - update the password in the passwd entry
  *
  * Return 0 if successful.
  */
-static int update_passwd (struct passwd *pwd, const char *password)
+static int update_passwd (struct passwd *pwd, const char *password, int line)
 {
 	void *crypt_arg = NULL;
 	char *cp;
@@ -442,11 +716,9 @@ static int update_passwd (struct passwd *pwd, const char *password)
 		pwd->pw_passwd = (char *)password;
 	} else {
 		const char *salt = crypt_make_salt (crypt_method, crypt_arg);
-		cp = pw_encrypt (password, salt);
+		cp = encrypt_password (pwd->pw_name, password, salt, false,
+		                       line);
 		if (NULL == cp) {
-			fprintf (stderr,
-			         _("%s: failed to crypt password with salt '%s': %s\n"),
-			         Prog, salt, strerror (errno));
 			return 1;
 		}
 		pwd->pw_passwd = cp;
@@ -459,7 +731,7 @@ static int update_passwd (struct passwd *pwd, const char *password)
 /*
  * add_passwd - add or update the encrypted password
  */
-static int add_passwd (struct passwd *pwd, const char *password)
+static int add_passwd (struct passwd *pwd, const char *password, int line)
 {
 	const struct spwd *sp;
 	struct spwd spent;
@@ -500,7 +772,7 @@ static int add_passwd (struct passwd *pwd, const char *password)
 	 * harder since there are zillions of things to do ...
 	 */
 	if (!is_shadow) {
-		return update_passwd (pwd, password);
+		return update_passwd (pwd, password, line);
 	}
 #endif				/* USE_PAM */
 
@@ -508,7 +780,7 @@ static int add_passwd (struct passwd *pwd, const char *password)
 	 * Do the first and easiest shadow file case. The user already
 	 * exists in the shadow password file.
 	 */
-	sp = spw_locate (pwd->pw_name);
+	sp = locate_spw (pwd->pw_name);
 #ifndef USE_PAM
 	if (NULL != sp) {
 		spent = *sp;
@@ -518,11 +790,9 @@ static int add_passwd (struct passwd *pwd, const char *password)
 		} else {
 			const char *salt = crypt_make_salt (crypt_method,
 			                                    crypt_arg);
-			cp = pw_encrypt (password, salt);
+			cp = encrypt_password (pwd->pw_name, password, salt,
+			                       true, line);
 			if (NULL == cp) {
-				fprintf (stderr,
-				         _("%s: failed to crypt password with salt '%s': %s\n"),
-				         Prog, salt, strerror (errno));
 				return 1;
 			}
 			spent.sp_pwdp = cp;
@@ -543,7 +813,7 @@ static int add_passwd (struct passwd *pwd, const char *password)
 	 * the password set someplace else.
 	 */
 	if (strcmp (pwd->pw_passwd, "x") != 0) {
-		return update_passwd (pwd, password);
+		return update_passwd (pwd, password, line);
 	}
 #else				/* USE_PAM */
 	/*
@@ -568,11 +838,9 @@ static int add_passwd (struct passwd *pwd, const char *password)
 		spent.sp_pwdp = (char *)password;
 	} else {
 		const char *salt = crypt_make_salt (crypt_method, crypt_arg);
-		cp = pw_encrypt (password, salt);
+		cp = encrypt_password (pwd->pw_name, password, salt, true,
+		                       line);
 		if (NULL == cp) {
-			fprintf (stderr,
-			         _("%s: failed to crypt password with salt '%s': %s\n"),
-			         Prog, salt, strerror (errno));
 			return 1;
 		}
 		spent.sp_pwdp = cp;
@@ -615,9 +883,11 @@ static void process_flags (int argc, char **argv)
 #endif 				/* !USE_PAM */
 	static struct option long_options[] = {
 		{"badname",      no_argument,       NULL, 'b'},
+		{"commit-every", required_argument, NULL, 'C'},
 #ifndef USE_PAM
 		{"crypt-method", required_argument, NULL, 'c'},
 #endif				/* !USE_PAM */
+		{"deadline",     required_argument, NULL, 203},
 		{"help",         no_argument,       NULL, 'h'},
 		{"system",       no_argument,       NULL, 'r'},
 		{"root",         required_argument, NULL, 'R'},
@@ -625,25 +895,50 @@ static void process_flags (int argc, char **argv)
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
 		{"sha-rounds",   required_argument, NULL, 's'},
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
+#ifdef HAVE_CRYPT_R
+		{"jobs",         required_argument, NULL, 'j'},
+#endif				/* HAVE_CRYPT_R */
+		{"check-quality", no_argument,      NULL, 201},
 #endif				/* !USE_PAM */
+		{"validate-first", no_argument,     NULL, 200},
+		{"sorted-input", no_argument,       NULL, 202},
+#ifdef WITH_SELINUX
+		{"selinux-user", required_argument, NULL, 'Z'},
+#endif				/* WITH_SELINUX */
 		{NULL, 0, NULL, '\0'}
 	};
 
 	while ((c = getopt_long (argc, argv,
+	                         "C:R:"
+#ifdef WITH_SELINUX
+	                         "Z:"
+#endif				/* WITH_SELINUX */
 #ifndef USE_PAM
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
-	                         "c:bhrs:",
+	                         "c:bhrs:"
 #else				/* !USE_SHA_CRYPT && !USE_BCRYPT && !USE_YESCRYPT */
-	                         "c:bhr",
+	                         "c:bhr"
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
+#ifdef HAVE_CRYPT_R
+	                         "j:"
+#endif				/* HAVE_CRYPT_R */
 #else				/* USE_PAM */
-	                         "bhr",
+	                         "bhr"
 #endif
-	                         long_options, NULL)) != -1) {
+	                         , long_options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
 			allow_bad_names = true;
 			break;
+		case 'C':
+			if (   (getlong (optarg, &commit_every) == 0)
+			    || (commit_every < 1)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (EXIT_FAILURE);
+			}
+			break;
 #ifndef USE_PAM
 		case 'c':
 			crypt_method = optarg;
@@ -652,12 +947,35 @@ static void process_flags (int argc, char **argv)
 		case 'h':
 			usage (EXIT_SUCCESS);
 			break;
+#if !defined(USE_PAM) && defined(HAVE_CRYPT_R)
+		case 'j':
+			if (   (getlong (optarg, &crypt_threads) == 0)
+			    || (crypt_threads < 1)
+			    || (crypt_threads > 1024)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (EXIT_FAILURE);
+			}
+			break;
+#endif				/* !USE_PAM && HAVE_CRYPT_R */
 		case 'r':
 			rflg = true;
 			break;
 		case 'R': /* no-op, handled in process_root_flag () */
 			break;
+		case 203: /* no-op, handled in process_deadline_flag () */
+			break;
+		case 200:
+			validate_first = true;
+			break;
+		case 202:
+			sorted_input = true;
+			break;
 #ifndef USE_PAM
+		case 201:
+			check_quality = true;
+			break;
 #if defined(USE_SHA_CRYPT) || defined(USE_BCRYPT) || defined(USE_YESCRYPT)
 		case 's':
 			sflg = true;
@@ -689,6 +1007,18 @@ static void process_flags (int argc, char **argv)
 			break;
 #endif				/* USE_SHA_CRYPT || USE_BCRYPT || USE_YESCRYPT */
 #endif				/* !USE_PAM */
+#ifdef WITH_SELINUX
+		case 'Z':
+			if (is_selinux_enabled () > 0) {
+				user_selinux = optarg;
+			} else {
+				fprintf (stderr,
+				         _("%s: -Z requires SELinux enabled kernel\n"),
+				         Prog);
+				usage (EXIT_FAILURE);
+			}
+			break;
+#endif				/* WITH_SELINUX */
 		default:
 			usage (EXIT_FAILURE);
 			break;
@@ -1013,6 +1343,159 @@ static void close_files (void)
 #endif				/* ENABLE_SUBIDS */
 }
 
+#ifdef ENABLE_SUBIDS
+/*
+ * add_sub_id_owner - Record that user name needs subordinate IDs.
+ */
+static int add_sub_id_owner (char ***owners, size_t *nowners, const char *name)
+{
+	char **tmp;
+
+	tmp = realloc (*owners, sizeof ((*owners)[0]) * (*nowners + 1));
+	if (NULL == tmp) {
+		return -1;
+	}
+	*owners = tmp;
+	(*owners)[*nowners] = strdup (name);
+	if (NULL == (*owners)[*nowners]) {
+		return -1;
+	}
+	(*nowners)++;
+	return 0;
+}
+
+static int owner_cmp (const void *p1, const void *p2)
+{
+	const char *const *o1 = *(const char *const *const *) p1;
+	const char *const *o2 = *(const char *const *const *) p2;
+	int ret;
+
+	ret = strcmp (*o1, *o2);
+	if (0 != ret) {
+		return ret;
+	}
+	return (o1 < o2) ? -1 : (o1 > o2);
+}
+
+/*
+ * unique_owners - Remove the users listed more than once in owners,
+ *                 keeping their first occurrence.
+ *
+ * Return the new number of users.
+ */
+static size_t unique_owners (char **owners, size_t nowners)
+{
+	char ***sorted;
+	size_t i, n;
+
+	sorted = xmalloc (sizeof (sorted[0]) * (nowners + 1));
+	for (i = 0; i < nowners; i++) {
+		sorted[i] = &owners[i];
+	}
+	qsort (sorted, nowners, sizeof (sorted[0]), owner_cmp);
+	for (i = 1; i < nowners; i++) {
+		if (strcmp (*sorted[i], *sorted[i - 1]) == 0) {
+			free (*sorted[i]);
+			*sorted[i] = NULL;
+		}
+	}
+	free (sorted);
+
+	for (i = 0, n = 0; i < nowners; i++) {
+		if (NULL != owners[i]) {
+			owners[n++] = owners[i];
+		}
+	}
+	return n;
+}
+
+/*
+ * add_sub_uids - Allocate the subordinate UIDs of all the new users at
+ *                once.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int add_sub_uids (void)
+{
+	unsigned long *starts;
+	unsigned long count;
+	uid_t *uids;
+	size_t i;
+	int ret = 0;
+
+	if (0 == sub_uid_nowners) {
+		return 0;
+	}
+
+	sub_uid_nowners = unique_owners (sub_uid_owners, sub_uid_nowners);
+	starts = xmalloc (sizeof (starts[0]) * sub_uid_nowners);
+	uids = xmalloc (sizeof (uids[0]) * sub_uid_nowners);
+	for (i = 0; i < sub_uid_nowners; i++) {
+		const struct passwd *pw = pw_locate (sub_uid_owners[i]);
+
+		uids[i] = (NULL != pw) ? pw->pw_uid : (uid_t) -1;
+	}
+	if (find_new_sub_uids_many (sub_uid_nowners, uids, starts, &count) != 0) {
+		fprintf (stderr,
+			_("%s: can't find subordinate user range\n"),
+			Prog);
+		ret = -1;
+	} else if (sub_uid_add_many ((const char *const *) sub_uid_owners,
+	                             starts, sub_uid_nowners, count) != 1) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_uid_dbname ());
+		ret = -1;
+	}
+	free (uids);
+	free (starts);
+	return ret;
+}
+
+/*
+ * add_sub_gids - Allocate the subordinate GIDs of all the new users at
+ *                once.
+ *
+ * Return 0 on success, -1 on failure.
+ */
+static int add_sub_gids (void)
+{
+	unsigned long *starts;
+	unsigned long count;
+	uid_t *uids;
+	size_t i;
+	int ret = 0;
+
+	if (0 == sub_gid_nowners) {
+		return 0;
+	}
+
+	sub_gid_nowners = unique_owners (sub_gid_owners, sub_gid_nowners);
+	starts = xmalloc (sizeof (starts[0]) * sub_gid_nowners);
+	uids = xmalloc (sizeof (uids[0]) * sub_gid_nowners);
+	for (i = 0; i < sub_gid_nowners; i++) {
+		const struct passwd *pw = pw_locate (sub_gid_owners[i]);
+
+		uids[i] = (NULL != pw) ? pw->pw_uid : (uid_t) -1;
+	}
+	if (find_new_sub_gids_many (sub_gid_nowners, uids, starts, &count) != 0) {
+		fprintf (stderr,
+			_("%s: can't find subordinate group range\n"),
+			Prog);
+		ret = -1;
+	} else if (sub_gid_add_many ((const char *const *) sub_gid_owners,
+	                             starts, sub_gid_nowners, count) != 1) {
+		fprintf (stderr,
+			_("%s: failed to prepare new %s entry\n"),
+			Prog, sub_gid_dbname ());
+		ret = -1;
+	}
+	free (uids);
+	free (starts);
+	return ret;
+}
+#endif				/* ENABLE_SUBIDS */
+
 static bool want_subuids(void)
 {
 	if (get_subid_nss_handle() != NULL)
@@ -1031,9 +1514,250 @@ static bool want_subgids(void)
 	return true;
 }
 
+#ifndef USE_PAM
+/*
+ * check_password - check the quality of a new password for
+ *                  --check-quality
+ *
+ *	This is called by the threads of the batch.
+ */
+static /*@observer@*//*@null@*/const char *check_password (const char *clear)
+{
+	return obscure_check ("", clear, NULL);
+}
+#endif				/* !USE_PAM */
+
+#if defined(HAVE_CRYPT_R) && !defined(USE_PAM)
+static void start_crypt_batch (void)
+{
+	if (   (crypt_threads > 1)
+	    && ((NULL == crypt_method) || (0 != strcmp (crypt_method, "NONE")))) {
+		crypt_batch = crypt_batch_start (crypt_threads);
+		if ((NULL != crypt_batch) && check_quality) {
+			crypt_batch_set_check (crypt_batch, check_password);
+		}
+	}
+}
+#endif				/* HAVE_CRYPT_R && !USE_PAM */
+
+/*
+ * check_line - check a line of the input before the databases are locked
+ *
+ *	The checks which do not depend on the previous lines are done:
+ *	the number of fields, the name of a new user, the numerical IDs,
+ *	and the home directory. The user and group names referenced by
+ *	the ID fields may be created by previous lines, so they are not
+ *	looked up.
+ *
+ *	This is called by several threads, see validate_input().
+ */
+static bool check_line (char *buf, int line, char *err, size_t errsize)
+{
+	char pwbuf[BUFSIZ];
+	char *fields[7];
+	struct passwd pwent;
+	struct passwd *pw = NULL;
+	int nfields;
+	char *cp;
+	uid_t uid;
+	gid_t gid;
+
+	if (strlen (buf) >= BUFSIZ - 1) {
+		(void) snprintf (err, errsize, _("%s: line %d: line too long\n"),
+		                 Prog, line);
+		return false;
+	}
+
+	for (cp = buf, nfields = 0; nfields < 7; nfields++) {
+		fields[nfields] = cp;
+		cp = strchr (cp, ':');
+		if (NULL != cp) {
+			*cp = '\0';
+			cp++;
+		} else {
+			break;
+		}
+	}
+	if (nfields != 6) {
+		(void) snprintf (err, errsize, _("%s: line %d: invalid line\n"),
+		                 Prog, line);
+		return false;
+	}
+
+	/* The names of the existing users are not checked by add_user */
+	if (   (getpwnam_r (fields[0], &pwent, pwbuf, sizeof pwbuf, &pw) != 0)
+	    || (NULL == pw)) {
+		if (!is_valid_user_name (fields[0])) {
+			(void) snprintf (err, errsize,
+			                 _("%s: invalid user name '%s': use --badname to ignore\n"),
+			                 Prog, fields[0]);
+			return false;
+		}
+		if (   isdigit (fields[2][0])
+		    && ((get_uid (fields[2], &uid) == 0) || (uid == (uid_t)-1))) {
+			(void) snprintf (err, errsize,
+			                 _("%s: invalid user ID '%s'\n"),
+			                 Prog, fields[2]);
+			return false;
+		}
+		if (   isdigit (fields[3][0])
+		    && ((get_gid (fields[3], &gid) == 0) || (gid == (gid_t)-1))) {
+			(void) snprintf (err, errsize,
+			                 _("%s: invalid group ID '%s'\n"),
+			                 Prog, fields[3]);
+			return false;
+		}
+	}
+
+	if (   ('\0' != fields[5][0])
+	    && ('/' != fields[5][0])
+	    && (access (fields[5], F_OK) != 0)) {
+		(void) snprintf (err, errsize,
+		                 _("%s: line %d: homedir must be an absolute path\n"),
+		                 Prog, line);
+		return false;
+	}
+
+	return true;
+}
+
+/*
+ * commit_changes - write the changes of the lines read so far and
+ *                  unlock the databases
+ *
+ *	With --commit-every, the last line committed is reported, so that
+ *	an interrupted import can be resumed from the next line.
+ *
+ *	It will not return if an error was detected.
+ */
+static void commit_changes (int errors, int line)
+{
+#ifdef ENABLE_SUBIDS
+	size_t i;
+#endif				/* ENABLE_SUBIDS */
+
+#if defined(HAVE_CRYPT_R) && !defined(USE_PAM)
+	if (NULL != crypt_batch) {
+		errors += apply_crypt_jobs ();
+	}
+#endif				/* HAVE_CRYPT_R && !USE_PAM */
+
+#ifdef ENABLE_SUBIDS
+	if ((0 == errors) && (add_sub_uids () != 0)) {
+		errors++;
+	}
+	if ((0 == errors) && (add_sub_gids () != 0)) {
+		errors++;
+	}
+#endif				/* ENABLE_SUBIDS */
+
+	/*
+	 * Any detected errors will cause the entire set of changes to be
+	 * aborted. Unlocking the password file will cause all of the
+	 * changes to be ignored. Otherwise the file is closed, causing the
+	 * changes to be written out all at once, and then unlocked
+	 * afterwards.
+	 */
+	if (0 != errors) {
+		fprintf (stderr,
+		         _("%s: error detected, changes ignored\n"), Prog);
+		fail_exit (EXIT_FAILURE);
+	}
+
+	close_files ();
+
+#ifdef ENABLE_SUBIDS
+	for (i = 0; i < sub_uid_nowners; i++) {
+		free (sub_uid_owners[i]);
+	}
+	sub_uid_nowners = 0;
+	for (i = 0; i < sub_gid_nowners; i++) {
+		free (sub_gid_owners[i]);
+	}
+	sub_gid_nowners = 0;
+#endif				/* ENABLE_SUBIDS */
+
+	if (0 != commit_every) {
+		fprintf (stderr, _("%s: line %d: changes committed\n"),
+		         Prog, line);
+		SYSLOG ((LOG_INFO, "changes committed up to line %d", line));
+	}
+}
+
+#ifdef WITH_SELINUX
+/*
+ * update_seusers - set the SELinux login mapping of the committed users
+ *
+ *	The mappings are changed in a single SELinux transaction, so that
+ *	the policy store is only rebuilt once per commit.
+ *
+ * Return the number of errors.
+ */
+static int update_seusers (void)
+{
+	int errors = 0;
+	size_t i;
+
+	if (0 == seuser_nnames) {
+		return 0;
+	}
+
+	if (seuser_batch_begin () != 0) {
+		errors++;
+	}
+
+	for (i = 0; i < seuser_nnames; i++) {
+		if ((0 == errors) && (set_seuser (seuser_names[i], user_selinux) != 0)) {
+			fprintf (stderr,
+			         _("%s: warning: the user name %s to %s SELinux user mapping failed.\n"),
+			         Prog, seuser_names[i], user_selinux);
+			errors++;
+		}
+		free (seuser_names[i]);
+	}
+	seuser_nnames = 0;
+
+	if (0 != errors) {
+		seuser_batch_abort ();
+	} else if (seuser_batch_commit () != 0) {
+		errors++;
+	}
+
+	return errors;
+}
+#endif				/* WITH_SELINUX */
+
+#ifdef USE_PAM
+/*
+ * update_pam_passwords - update the passwords of the committed users
+ *                        with PAM
+ *
+ * Return the number of errors.
+ */
+static int update_pam_passwords (const int *lines, char **usernames,
+                                 char **passwords, unsigned int nusers)
+{
+	int errors = 0;
+	unsigned int i;
+
+	for (i = 0; i < nusers; i++) {
+		if (do_pam_passwd_non_interactive ("newusers", usernames[i], passwords[i]) != 0) {
+			fprintf (stderr,
+			         _("%s: (line %d, user %s) password not changed\n"),
+			         Prog, lines[i], usernames[i]);
+			errors++;
+		}
+		free (usernames[i]);
+		secret_free (passwords[i]);
+	}
+	pam_passwd_non_interactive_end ();
+	return errors;
+}
+#endif				/* USE_PAM */
+
 int main (int argc, char **argv)
 {
-	char buf[BUFSIZ];
+	char *buf;
 	char *fields[8];
 	int nfields;
 	char *cp;
@@ -1043,12 +1767,17 @@ int main (int argc, char **argv)
 	int line = 0;
 	uid_t uid;
 	gid_t gid;
+	FILE *input = stdin;
 #ifdef USE_PAM
 	int *lines = NULL;
 	char **usernames = NULL;
 	char **passwords = NULL;
 	unsigned int nusers = 0;
+	int pam_errors = 0;
 #endif				/* USE_PAM */
+#ifdef WITH_SELINUX
+	int seuser_errors = 0;
+#endif				/* WITH_SELINUX */
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
@@ -1060,6 +1789,7 @@ int main (int argc, char **argv)
 
 	/* FIXME: will not work with an input file */
 	process_root_flag ("-R", argc, argv);
+	process_deadline_flag (argc, argv);
 
 	OPENLOG ("newusers");
 
@@ -1067,6 +1797,26 @@ int main (int argc, char **argv)
 
 	check_perms ();
 
+	/*
+	 * With --validate-first, the whole input is checked while no
+	 * database is locked, and the lines are then read from memory.
+	 */
+	if (validate_first) {
+		input = validate_input (stdin, check_line);
+		if (NULL == input) {
+			fprintf (stderr,
+			         _("%s: error detected, changes ignored\n"), Prog);
+			fail_exit (EXIT_FAILURE);
+		}
+	}
+
+	/* The lines, with their clear text passwords, are read in a slot */
+	buf = secret_alloc ();
+	if (NULL == buf) {
+		fprintf (stderr, _("%s: out of memory\n"), Prog);
+		fail_exit (EXIT_FAILURE);
+	}
+
 	is_shadow = spw_file_present ();
 
 #ifdef SHADOWGRP
@@ -1077,8 +1827,18 @@ int main (int argc, char **argv)
 	is_sub_gid = sub_gid_file_present () && !rflg;
 #endif				/* ENABLE_SUBIDS */
 
+#ifndef USE_PAM
+	if (check_quality) {
+		obscure_preload ();
+	}
+#endif				/* !USE_PAM */
+
 	open_files ();
 
+#if defined(HAVE_CRYPT_R) && !defined(USE_PAM)
+	start_crypt_batch ();
+#endif				/* HAVE_CRYPT_R && !USE_PAM */
+
 	/*
 	 * Read each line. The line has the same format as a password file
 	 * entry, except that certain fields are not constrained to be
@@ -1088,13 +1848,33 @@ int main (int argc, char **argv)
 	 * over 100 is allocated. The pw_gid field will be updated with that
 	 * value.
 	 */
-	while (fgets (buf, sizeof buf, stdin) != NULL) {
+	while (fgets (buf, BUFSIZ, input) != NULL) {
+		/*
+		 * With --commit-every, commit the previous lines and start
+		 * again from the current databases.
+		 */
+		if ((0 != commit_every) && (0 != line) && (0 == (line % commit_every))) {
+			commit_changes (errors, line);
+#ifdef WITH_SELINUX
+			seuser_errors += update_seusers ();
+#endif				/* WITH_SELINUX */
+#ifdef USE_PAM
+			pam_errors += update_pam_passwords (lines, usernames,
+			                                    passwords, nusers);
+			nusers = 0;
+#endif				/* USE_PAM */
+			open_files ();
+#if defined(HAVE_CRYPT_R) && !defined(USE_PAM)
+			start_crypt_batch ();
+#endif				/* HAVE_CRYPT_R && !USE_PAM */
+		}
+
 		line++;
 		cp = strrchr (buf, '\n');
 		if (NULL != cp) {
 			*cp = '\0';
 		} else {
-			if (feof (stdin) == 0) {
+			if (feof (input) == 0) {
 				fprintf (stderr,
 				         _("%s: line %d: line too long\n"),
 				         Prog, line);
@@ -1125,10 +1905,15 @@ int main (int argc, char **argv)
 			continue;
 		}
 
+		if (!check_order (fields[0], line)) {
+			errors++;
+			continue;
+		}
+
 		/*
 		 * First check if we have to create or update a user
 		 */
-		pw = pw_locate (fields[0]);
+		pw = locate_pw (fields[0]);
 		/* local, no need for xgetpwnam */
 		if (   (NULL == pw)
 		    && (getpwnam (fields[0]) != NULL)) {
@@ -1138,7 +1923,7 @@ int main (int argc, char **argv)
 		}
 
 		if (   (NULL == pw)
-		    && (get_user_id (fields[2], &uid) != 0)) {
+		    && (get_user_id (fields[2], new_group (fields[3]), &uid) != 0)) {
 			fprintf (stderr,
 			         _("%s: line %d: can't create user\n"),
 			         Prog, line);
@@ -1187,7 +1972,7 @@ int main (int argc, char **argv)
 		 * The password, gecos field, directory, and shell fields
 		 * all come next.
 		 */
-		pw = pw_locate (fields[0]);
+		pw = locate_pw (fields[0]);
 		if (NULL == pw) {
 			fprintf (stderr,
 			         _("%s: line %d: user '%s' does not exist in %s\n"),
@@ -1212,9 +1997,26 @@ int main (int argc, char **argv)
 		}
 		lines[nusers-1]     = line;
 		usernames[nusers-1] = strdup (fields[0]);
-		passwords[nusers-1] = strdup (fields[1]);
-#endif				/* USE_PAM */
-		if (add_passwd (&newpw, fields[1]) != 0) {
+		passwords[nusers-1] = secret_strdup (fields[1]);
+#else				/* !USE_PAM */
+		if (   check_quality
+#ifdef HAVE_CRYPT_R
+		    && (NULL == crypt_batch)	/* checked by the batch */
+#endif				/* HAVE_CRYPT_R */
+		   ) {
+			const char *msg;
+
+			msg = obscure_check ("", fields[1], &newpw);
+			if (NULL != msg) {
+				fprintf (stderr,
+				         _("%s: line %d: bad password for user '%s': %s\n"),
+				         Prog, line, fields[0], msg);
+				errors++;
+				continue;
+			}
+		}
+#endif				/* !USE_PAM */
+		if (add_passwd (&newpw, fields[1], line) != 0) {
 			fprintf (stderr,
 			         _("%s: line %d: can't update password\n"),
 			         Prog, line);
@@ -1273,79 +2075,65 @@ int main (int argc, char **argv)
 
 #ifdef ENABLE_SUBIDS
 		/*
-		 * Add subordinate uids if the user does not have them.
+		 * Add subordinate uids and gids if the user does not have
+		 * them. They are allocated for all the users at once, after
+		 * the last line.
 		 */
 		if (is_sub_uid && want_subuids() && !local_sub_uid_assigned(fields[0])) {
-			uid_t sub_uid_start = 0;
-			unsigned long sub_uid_count = 0;
-			if (find_new_sub_uids(&sub_uid_start, &sub_uid_count) == 0) {
-				if (sub_uid_add(fields[0], sub_uid_start, sub_uid_count) == 0) {
-					fprintf (stderr,
-						_("%s: failed to prepare new %s entry\n"),
-						Prog, sub_uid_dbname ());
-				}
-			} else {
+			if (add_sub_id_owner (&sub_uid_owners, &sub_uid_nowners, fields[0]) != 0) {
 				fprintf (stderr,
-					_("%s: can't find subordinate user range\n"),
-					Prog);
+				         _("%s: line %d: %s\n"),
+				         Prog, line, strerror(errno));
 				errors++;
 			}
 		}
-
-		/*
-		 * Add subordinate gids if the user does not have them.
-		 */
 		if (is_sub_gid && want_subgids() && !local_sub_gid_assigned(fields[0])) {
-			gid_t sub_gid_start = 0;
-			unsigned long sub_gid_count = 0;
-			if (find_new_sub_gids(&sub_gid_start, &sub_gid_count) == 0) {
-				if (sub_gid_add(fields[0], sub_gid_start, sub_gid_count) == 0) {
-					fprintf (stderr,
-						_("%s: failed to prepare new %s entry\n"),
-						Prog, sub_uid_dbname ());
-				}
-			} else {
+			if (add_sub_id_owner (&sub_gid_owners, &sub_gid_nowners, fields[0]) != 0) {
 				fprintf (stderr,
-					_("%s: can't find subordinate group range\n"),
-					Prog);
+				         _("%s: line %d: %s\n"),
+				         Prog, line, strerror(errno));
 				errors++;
 			}
 		}
 #endif				/* ENABLE_SUBIDS */
-	}
 
-	/*
-	 * Any detected errors will cause the entire set of changes to be
-	 * aborted. Unlocking the password file will cause all of the
-	 * changes to be ignored. Otherwise the file is closed, causing the
-	 * changes to be written out all at once, and then unlocked
-	 * afterwards.
-	 */
-	if (0 != errors) {
-		fprintf (stderr,
-		         _("%s: error detected, changes ignored\n"), Prog);
-		fail_exit (EXIT_FAILURE);
-	}
+#ifdef WITH_SELINUX
+		if (Zflg) {
+			char **names;
 
-	close_files ();
+			names = realloc (seuser_names,
+			                 sizeof (seuser_names[0]) * (seuser_nnames + 1));
+			if (NULL != names) {
+				seuser_names = names;
+				names[seuser_nnames] = strdup (fields[0]);
+			}
+			if ((NULL == names) || (NULL == names[seuser_nnames])) {
+				fprintf (stderr,
+				         _("%s: line %d: %s\n"),
+				         Prog, line, strerror(errno));
+				errors++;
+			} else {
+				seuser_nnames++;
+			}
+		}
+#endif				/* WITH_SELINUX */
+	}
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+	commit_changes (errors, line);
+#ifdef WITH_SELINUX
+	errors += seuser_errors;
+	errors += update_seusers ();
+#endif				/* WITH_SELINUX */
 
 #ifdef USE_PAM
-	unsigned int i;
 	/* Now update the passwords using PAM */
-	for (i = 0; i < nusers; i++) {
-		if (do_pam_passwd_non_interactive ("newusers", usernames[i], passwords[i]) != 0) {
-			fprintf (stderr,
-			         _("%s: (line %d, user %s) password not changed\n"),
-			         Prog, lines[i], usernames[i]);
-			errors++;
-		}
-	}
+	errors += pam_errors;
+	errors += update_pam_passwords (lines, usernames, passwords, nusers);
 #endif				/* USE_PAM */
 
+	secret_free (buf);
+	free (last_name);
+
 	return ((0 == errors) ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
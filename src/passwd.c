@@ -21,8 +21,6 @@
 #include <time.h>
 #include "defines.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -81,6 +79,9 @@ static bool do_update_age = false;
 static bool pw_locked = false;
 static bool spw_locked = false;
 
+/* --select-* options: change the selected users instead of LOGIN */
+static struct user_selection selection = USER_SELECTION_INIT;
+
 #ifndef USE_PAM
 /*
  * Size of the biggest passwd:
@@ -114,12 +115,22 @@ static void check_password (const struct passwd *, const struct spwd *);
 #endif				/* !USE_PAM */
 static /*@observer@*/const char *pw_status (const char *);
 static void print_status (const struct passwd *);
+static void print_status_all (void);
+static void show_status (const struct passwd *pw,
+                         /*@null@*/const struct spwd *sp);
 NORETURN static void fail_exit (int);
 NORETURN static void oom (void);
 static char *update_crypt_pw (char *);
+static void open_pw (void);
+static void open_spw (void);
+static void close_pw (void);
+static void close_spw (void);
+static void update_pwent (const struct passwd *pw);
+static void update_spent (const struct spwd *sp);
 static void update_noshadow (void);
 
 static void update_shadow (void);
+static size_t update_selection (void);
 
 /*
  * usage - print command usage and exit
@@ -131,9 +142,10 @@ usage (int status)
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] [LOGIN]\n"
+	                  "       %s [options] --select-... SELECTION\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog);
 	(void) fputs (_("  -a, --all                     report password status on all accounts\n"), usageout);
 	(void) fputs (_("  -d, --delete                  delete the password for the named account\n"), usageout);
 	(void) fputs (_("  -e, --expire                  force expire the password for the named account\n"), usageout);
@@ -148,6 +160,11 @@ usage (int status)
 	(void) fputs (_("  -r, --repository REPOSITORY   change password in REPOSITORY repository\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -S, --status                  report password status on the named account\n"), usageout);
+	(void) fputs (_("      --select-uid RANGE        change the users with a UID in RANGE\n"), usageout);
+	(void) fputs (_("      --select-group GROUP      change the members of GROUP\n"), usageout);
+	(void) fputs (_("      --select-shell PATTERN    change the users with a shell matching PATTERN\n"), usageout);
+	(void) fputs (_("      --select-age DAYS         change the users whose password is at least\n"
+	                "                                DAYS days old\n"), usageout);
 	(void) fputs (_("  -u, --unlock                  unlock the password of the named account\n"), usageout);
 	(void) fputs (_("  -w, --warndays WARN_DAYS      set expiration warning days to WARN_DAYS\n"), usageout);
 	(void) fputs (_("  -x, --maxdays MAX_DAYS        set maximum number of days before password\n"
@@ -443,11 +460,60 @@ static /*@observer@*/const char *pw_status (const char *pass)
  * print_status - print current password status
  */
 static void print_status (const struct passwd *pw)
+{
+	/* local, no need for xgetspnam */
+	show_status (pw, getspnam (pw->pw_name));
+}
+
+/*
+ * print_status_all - print the password status of all the users
+ *
+ *	The shadow file is loaded once, and the entry of each user is found
+ *	in its index instead of calling getspnam(), which rescans the file.
+ *	getspnam() is only used for the users which are not in the local
+ *	shadow file.
+ *
+ *	With --select-*, only the status of the selected users is printed.
+ */
+static void print_status_all (void)
+{
+	const struct passwd *pw;
+	const struct spwd *sp;
+	bool shadow;
+
+	shadow = spw_file_present () && (spw_open (O_RDONLY) != 0);
+
+	setpwent ();
+	while ((pw = getpwent ()) != NULL) {
+		sp = NULL;
+		if (shadow) {
+			sp = spw_locate (pw->pw_name);
+		}
+		if (NULL == sp) {
+			/* local, no need for xgetspnam */
+			sp = getspnam (pw->pw_name);
+		}
+		if (selection.active && !select_user (&selection, pw, sp)) {
+			continue;
+		}
+		show_status (pw, sp);
+	}
+	endpwent ();
+
+	if (shadow) {
+		(void) spw_close ();
+	}
+}
+
+/*
+ * show_status - print the password status from the passwd and shadow
+ *               entries of a user
+ */
+static void show_status (const struct passwd *pw,
+                         /*@null@*/const struct spwd *sp)
 {
 	char         date[80];
-	struct spwd *sp;
 
-	sp = getspnam (pw->pw_name); /* local, no need for xgetspnam */
 	if (NULL != sp) {
 		date_to_str (sizeof(date), date, sp->sp_lstchg * SCALE),
 		(void) printf ("%s %s %s %lld %lld %lld %lld\n",
@@ -539,11 +605,11 @@ static char *update_crypt_pw (char *cp)
 }
 
 
-static void update_noshadow (void)
+/*
+ * open_pw, open_spw - lock and open the passwd and shadow databases
+ */
+static void open_pw (void)
 {
-	const struct passwd *pw;
-	struct passwd *npw;
-
 	if (pw_lock () == 0) {
 		(void) fprintf (stderr,
 		                _("%s: cannot lock %s; try again later.\n"),
@@ -558,24 +624,32 @@ static void update_noshadow (void)
 		SYSLOG ((LOG_WARN, "cannot open %s", pw_dbname ()));
 		fail_exit (E_MISSING);
 	}
-	pw = pw_locate (name);
-	if (NULL == pw) {
+}
+
+static void open_spw (void)
+{
+	if (spw_lock () == 0) {
 		(void) fprintf (stderr,
-		                _("%s: user '%s' does not exist in %s\n"),
-		                Prog, name, pw_dbname ());
-		fail_exit (E_NOPERM);
-	}
-	npw = __pw_dup (pw);
-	if (NULL == npw) {
-		oom ();
+		                _("%s: cannot lock %s; try again later.\n"),
+		                Prog, spw_dbname ());
+		exit (E_PWDBUSY);
 	}
-	npw->pw_passwd = update_crypt_pw (npw->pw_passwd);
-	if (pw_update (npw) == 0) {
+	spw_locked = true;
+	spw_compact ();
+	if (spw_open (O_CREAT | O_RDWR) == 0) {
 		(void) fprintf (stderr,
-		                _("%s: failed to prepare the new %s entry '%s'\n"),
-		                Prog, pw_dbname (), npw->pw_name);
+		                _("%s: cannot open %s\n"),
+		                Prog, spw_dbname ());
+		SYSLOG ((LOG_WARN, "cannot open %s", spw_dbname ()));
 		fail_exit (E_FAILURE);
 	}
+}
+
+/*
+ * close_pw, close_spw - write and unlock the passwd and shadow databases
+ */
+static void close_pw (void)
+{
 	if (pw_close () == 0) {
 		(void) fprintf (stderr,
 		                _("%s: failure while writing changes to %s\n"),
@@ -593,40 +667,52 @@ static void update_noshadow (void)
 	pw_locked = false;
 }
 
-static void update_shadow (void)
+static void close_spw (void)
 {
-	const struct spwd *sp;
-	struct spwd *nsp;
-
-	if (spw_lock () == 0) {
+	if (spw_close () == 0) {
 		(void) fprintf (stderr,
-		                _("%s: cannot lock %s; try again later.\n"),
+		                _("%s: failure while writing changes to %s\n"),
 		                Prog, spw_dbname ());
-		exit (E_PWDBUSY);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
+		fail_exit (E_FAILURE);
 	}
-	spw_locked = true;
-	if (spw_open (O_CREAT | O_RDWR) == 0) {
+	if (spw_unlock () == 0) {
 		(void) fprintf (stderr,
-		                _("%s: cannot open %s\n"),
+		                _("%s: failed to unlock %s\n"),
 		                Prog, spw_dbname ());
-		SYSLOG ((LOG_WARN, "cannot open %s", spw_dbname ()));
-		fail_exit (E_FAILURE);
+		SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
+		/* continue */
 	}
-	sp = spw_locate (name);
-	if (NULL == sp) {
-		/* Try to update the password in /etc/passwd instead. */
-		(void) spw_close ();
-		update_noshadow ();
-		if (spw_unlock () == 0) {
-			(void) fprintf (stderr,
-			                _("%s: failed to unlock %s\n"),
-			                Prog, spw_dbname ());
-			SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
-			/* continue */
-		}
-		spw_locked = false;
-		return;
+	spw_locked = false;
+}
+
+/*
+ * update_pwent - change the password of a passwd entry
+ */
+static void update_pwent (const struct passwd *pw)
+{
+	struct passwd *npw;
+
+	npw = __pw_dup (pw);
+	if (NULL == npw) {
+		oom ();
 	}
+	npw->pw_passwd = update_crypt_pw (npw->pw_passwd);
+	if (pw_update (npw) == 0) {
+		(void) fprintf (stderr,
+		                _("%s: failed to prepare the new %s entry '%s'\n"),
+		                Prog, pw_dbname (), npw->pw_name);
+		fail_exit (E_FAILURE);
+	}
+}
+
+/*
+ * update_spent - change the password and aging of a shadow entry
+ */
+static void update_spent (const struct spwd *sp)
+{
+	struct spwd *nsp;
+
 	nsp = __spw_dup (sp);
 	if (NULL == nsp) {
 		oom ();
@@ -670,21 +756,106 @@ static void update_shadow (void)
 		                Prog, spw_dbname (), nsp->sp_namp);
 		fail_exit (E_FAILURE);
 	}
-	if (spw_close () == 0) {
+}
+
+static void update_noshadow (void)
+{
+	const struct passwd *pw;
+
+	open_pw ();
+	pw = pw_locate (name);
+	if (NULL == pw) {
 		(void) fprintf (stderr,
-		                _("%s: failure while writing changes to %s\n"),
-		                Prog, spw_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
-		fail_exit (E_FAILURE);
+		                _("%s: user '%s' does not exist in %s\n"),
+		                Prog, name, pw_dbname ());
+		fail_exit (E_NOPERM);
 	}
-	if (spw_unlock () == 0) {
-		(void) fprintf (stderr,
-		                _("%s: failed to unlock %s\n"),
-		                Prog, spw_dbname ());
-		SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
-		/* continue */
+	update_pwent (pw);
+	close_pw ();
+}
+
+static void update_shadow (void)
+{
+	const struct spwd *sp;
+
+	open_spw ();
+	sp = spw_locate (name);
+	if (NULL == sp) {
+		/* Try to update the password in /etc/passwd instead. */
+		(void) spw_close ();
+		update_noshadow ();
+		if (spw_unlock () == 0) {
+			(void) fprintf (stderr,
+			                _("%s: failed to unlock %s\n"),
+			                Prog, spw_dbname ());
+			SYSLOG ((LOG_ERR, "failed to unlock %s", spw_dbname ()));
+			/* continue */
+		}
+		spw_locked = false;
+		return;
 	}
-	spw_locked = false;
+	update_spent (sp);
+	close_spw ();
+}
+
+/*
+ * update_selection - change the password of the selected users
+ *
+ *	The databases are locked and written once. As for a single user,
+ *	the shadow entry is changed, or the passwd entry of the users
+ *	without a shadow entry.
+ *
+ *	Return the number of selected users.
+ */
+static size_t update_selection (void)
+{
+	const struct passwd *pw;
+	bool shadow = spw_file_present ();
+	char **names = NULL;
+	size_t count = 0;
+	size_t i;
+
+	open_pw ();
+	if (shadow) {
+		open_spw ();
+	}
+
+	(void) pw_rewind ();
+	while ((pw = pw_next ()) != NULL) {
+		const struct spwd *sp = shadow ? spw_locate (pw->pw_name) : NULL;
+
+		if (!select_user (&selection, pw, sp)) {
+			continue;
+		}
+		if (NULL != sp) {
+			update_spent (sp);
+		} else {
+			update_pwent (pw);
+		}
+
+		if (0 == (count % 64)) {
+			names = realloc (names, (count + 64) * sizeof *names);
+			if (NULL == names) {
+				oom ();
+			}
+		}
+		names[count] = xstrdup (pw->pw_name);
+		count++;
+	}
+
+	if (shadow) {
+		close_spw ();
+	}
+	close_pw ();
+
+	if (0 == count) {
+		(void) fprintf (stderr, _("%s: no user was selected\n"), Prog);
+	}
+	for (i = 0; i < count; i++) {
+		SYSLOG ((LOG_INFO, "password for '%s' changed by '%s'",
+		         names[i], myname));
+	}
+	return count;
 }
 
 /*
@@ -767,6 +938,10 @@ int main (int argc, char **argv)
 			{"quiet",       no_argument,       NULL, 'q'},
 			{"repository",  required_argument, NULL, 'r'},
 			{"root",        required_argument, NULL, 'R'},
+			{"select-uid",  required_argument, NULL, 200},
+			{"select-group", required_argument, NULL, 201},
+			{"select-shell", required_argument, NULL, 202},
+			{"select-age",  required_argument, NULL, 203},
 			{"status",      no_argument,       NULL, 'S'},
 			{"unlock",      no_argument,       NULL, 'u'},
 			{"warndays",    required_argument, NULL, 'w'},
@@ -777,6 +952,33 @@ int main (int argc, char **argv)
 		while ((c = getopt_long (argc, argv, "adehi:kln:qr:R:Suw:x:",
 		                         long_options, NULL)) != -1) {
 			switch (c) {
+			case 200:
+				if (!select_uids (&selection, optarg)) {
+					fprintf (stderr,
+					         _("%s: Unknown user or range: %s\n"),
+					         Prog, optarg);
+					usage (E_BAD_ARG);
+				}
+				break;
+			case 201:
+				if (!select_group (&selection, optarg)) {
+					fprintf (stderr,
+					         _("%s: group '%s' does not exist\n"),
+					         Prog, optarg);
+					usage (E_BAD_ARG);
+				}
+				break;
+			case 202:
+				select_shell (&selection, optarg);
+				break;
+			case 203:
+				if (!select_age (&selection, optarg)) {
+					fprintf (stderr,
+					         _("%s: invalid numeric argument '%s'\n"),
+					         Prog, optarg);
+					usage (E_BAD_ARG);
+				}
+				break;
 			case 'a':
 				aflg = true;
 				break;
@@ -899,6 +1101,43 @@ int main (int argc, char **argv)
 		usage (E_USAGE);
 	}
 
+	/*
+	 * The --select-* options require -S or flags changing the password
+	 * or its aging, no username, and you must be root. With -S, they
+	 * are like -a for the selected users.
+	 */
+	if (selection.active) {
+		size_t count;
+
+		if (   (optind < argc)
+		    || (Sflg == anyflag)
+		    || kflg) {
+			usage (E_USAGE);
+		}
+		if (!amroot) {
+			(void) fprintf (stderr,
+			                _("%s: Permission denied.\n"),
+			                Prog);
+			exit (E_NOPERM);
+		}
+		aflg = Sflg;
+		if (anyflag) {
+			pwd_init ();
+			if (setuid (0) != 0) {
+				(void) fputs (_("Cannot change ID to root.\n"), stderr);
+				SYSLOG ((LOG_ERR, "can't setuid(0)"));
+				closelog ();
+				exit (E_NOPERM);
+			}
+			count = update_selection ();
+			closelog ();
+			if (!qflg && (0 != count)) {
+				(void) printf (_("%s: password changed.\n"), Prog);
+			}
+			return E_SUCCESS;
+		}
+	}
+
 	/*
 	 * The -a flag requires -S, no other flags, no username, and
 	 * you must be root.  --marekm
@@ -913,11 +1152,7 @@ int main (int argc, char **argv)
 			                Prog);
 			exit (E_NOPERM);
 		}
-		setpwent ();
-		while ( (pw = getpwent ()) != NULL ) {
-			print_status (pw);
-		}
-		endpwent ();
+		print_status_all ();
 		exit (E_SUCCESS);
 	}
 #if 0
@@ -1070,10 +1305,6 @@ int main (int argc, char **argv)
 		update_noshadow ();
 	}
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
-
 	SYSLOG ((LOG_INFO, "password for '%s' changed by '%s'", name, myname));
 	closelog ();
 	if (!qflg) {
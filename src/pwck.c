@@ -14,18 +14,18 @@
 
 #include <fcntl.h>
 #include <grp.h>
+#include <pthread.h>
 #include <pwd.h>
 #include <stdio.h>
 #include <getopt.h>
 #include "chkname.h"
 #include "commonio.h"
 #include "defines.h"
+#include "groupio.h"
 #include "prototypes.h"
 #include "pwio.h"
 #include "shadowio.h"
 #include "getdef.h"
-#include "nscd.h"
-#include "sssd.h"
 #ifdef WITH_TCB
 #include "tcbfuncs.h"
 #endif				/* WITH_TCB */
@@ -56,6 +56,10 @@ static bool is_shadow = false;
 
 static bool spw_opened = false;
 
+/* Sorted IDs of the groups of the group file */
+static /*@null@*/gid_t *group_ids = NULL;
+static size_t ngroup_ids = 0;
+
 static bool pw_locked  = false;
 static bool spw_locked = false;
 
@@ -63,6 +67,32 @@ static bool spw_locked = false;
 static bool read_only = false;
 static bool sort_mode = false;
 static bool quiet = false;		/* don't report warnings, only errors */
+static long jobs = 1;
+static /*@null@*/const char *state_file = NULL;
+
+/* Entries which passed the checks of the last run, with --state */
+static struct check_state state;
+
+/*
+ * Results of the filesystem checks of the passwd entries, done in advance
+ * by a pool of threads with -j. They are indexed by the position of the
+ * entry in the database.
+ */
+struct fs_check {
+	/*@dependent@*/ /*@null@*/const char *dir;	/* NULL if not checked */
+	/*@dependent@*/ /*@null@*/const char *shell;
+	bool dir_found;
+	bool shell_found;
+};
+
+struct fs_pool {
+	pthread_mutex_t mutex;
+	/*@dependent@*/struct fs_check *checks;
+	size_t count;
+	size_t next;		/* protected by mutex */
+};
+
+static /*@null@*/ /*@only@*/struct fs_check *fs_checks = NULL;
 
 /* local function prototypes */
 static void fail_exit (int code);
@@ -70,6 +100,14 @@ NORETURN static void usage (int status);
 static void process_flags (int argc, char **argv);
 static void open_files (void);
 static void close_files (bool changed);
+static /*@null@*/void *fs_check_thread (void *arg);
+static void fs_checks_run (void);
+static bool home_exists (size_t n, const struct passwd *pwd);
+static bool shell_exists (size_t n, const struct passwd *pwd);
+static unsigned long state_options (void);
+static void state_files (const char *files[4]);
+static unsigned long long pw_key (const struct commonio_entry *pfe);
+static unsigned long long spw_key (const struct commonio_entry *spe);
 static void check_pw_file (int *errors, bool *changed);
 static void check_spw_file (int *errors, bool *changed);
 
@@ -132,10 +170,14 @@ usage (int status)
 	}
 	(void) fputs (_("  -b, --badname                 allow bad names\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -j, --jobs JOBS               check the home directories and shells\n"
+	                "                                in JOBS threads\n"), usageout);
 	(void) fputs (_("  -q, --quiet                   report errors only\n"), usageout);
 	(void) fputs (_("  -r, --read-only               display errors and warnings\n"
 	                "                                but do not change files\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("      --state FILE              only check the entries changed since\n"
+	                "                                the last run with this FILE (with -r)\n"), usageout);
 #ifdef WITH_TCB
 	if (!getdef_bool ("USE_TCB"))
 #endif				/* !WITH_TCB */
@@ -157,17 +199,19 @@ static void process_flags (int argc, char **argv)
 	static struct option long_options[] = {
 		{"badname",   no_argument,       NULL, 'b'},
 		{"help",      no_argument,       NULL, 'h'},
+		{"jobs",      required_argument, NULL, 'j'},
 		{"quiet",     no_argument,       NULL, 'q'},
 		{"read-only", no_argument,       NULL, 'r'},
 		{"root",      required_argument, NULL, 'R'},
 		{"sort",      no_argument,       NULL, 's'},
+		{"state",     required_argument, NULL, 200},
 		{NULL, 0, NULL, '\0'}
 	};
 
 	/*
 	 * Parse the command line arguments
 	 */
-	while ((c = getopt_long (argc, argv, "behqrR:s",
+	while ((c = getopt_long (argc, argv, "behj:qrR:s",
 	                         long_options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
@@ -176,6 +220,16 @@ static void process_flags (int argc, char **argv)
 		case 'h':
 			usage (E_SUCCESS);
 			/*@notreached@*/break;
+		case 'j':
+			if (   (getlong (optarg, &jobs) == 0)
+			    || (jobs < 1)
+			    || (jobs > 1024)) {
+				fprintf (stderr,
+				         _("%s: invalid numeric argument '%s'\n"),
+				         Prog, optarg);
+				usage (E_USAGE);
+			}
+			break;
 		case 'e':	/* added for Debian shadow-961025-2 compatibility */
 		case 'q':
 			quiet = true;
@@ -188,6 +242,9 @@ static void process_flags (int argc, char **argv)
 		case 's':
 			sort_mode = true;
 			break;
+		case 200:
+			state_file = optarg;
+			break;
 		default:
 			usage (E_USAGE);
 		}
@@ -197,6 +254,18 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr, _("%s: -s and -r are incompatible\n"), Prog);
 		exit (E_USAGE);
 	}
+	if ((NULL != state_file) && !read_only) {
+		fprintf (stderr, _("%s: --state requires -r\n"), Prog);
+		exit (E_USAGE);
+	}
+#ifdef WITH_TCB
+	if ((NULL != state_file) && getdef_bool ("USE_TCB")) {
+		fprintf (stderr,
+		         _("%s: --state is not supported with USE_TCB\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
 
 	/*
 	 * Make certain we have the right number of arguments
@@ -230,6 +299,68 @@ static void process_flags (int argc, char **argv)
 	}
 }
 
+/*
+ * add_group_id - Add the ID of a group to group_ids (gr_scan_fields callback)
+ */
+static int add_group_id (const struct group *grp, void *arg)
+{
+	unsigned long *size = arg;
+
+	if (ngroup_ids == *size) {
+		gid_t *ids;
+
+		ids = realloc (group_ids, (*size + 64) * sizeof *ids);
+		if (NULL == ids) {
+			fprintf (stderr, _("%s: out of memory\n"), Prog);
+			fail_exit (E_CANTOPEN);
+		}
+		group_ids = ids;
+		*size += 64;
+	}
+	group_ids[ngroup_ids] = grp->gr_gid;
+	ngroup_ids++;
+	return 0;
+}
+
+static int cmp_gid (const void *a, const void *b)
+{
+	gid_t ga = *(const gid_t *) a;
+	gid_t gb = *(const gid_t *) b;
+
+	return (ga > gb) - (ga < gb);
+}
+
+/*
+ * load_group_ids - Read the sorted IDs of the group file
+ *
+ *	If the group file cannot be read, group_ids stays empty and the
+ *	primary groups are looked up with getgrgid.
+ */
+static void load_group_ids (void)
+{
+	unsigned long size = 0;
+
+	if (gr_scan_fields (GR_FIELD_GID, add_group_id, &size) != 0) {
+		free (group_ids);
+		group_ids = NULL;
+		ngroup_ids = 0;
+		return;
+	}
+	if (NULL != group_ids) {
+		qsort (group_ids, ngroup_ids, sizeof *group_ids, cmp_gid);
+	}
+}
+
+/*
+ * known_gid - Return true if gid is the ID of a group of the group file
+ */
+static bool known_gid (gid_t gid)
+{
+	return (NULL != group_ids)
+	    && (NULL != bsearch (&gid, group_ids, ngroup_ids,
+	                         sizeof *group_ids, cmp_gid));
+}
+
 /*
  * open_files - open the shadow database
  *
@@ -289,6 +420,13 @@ static void open_files (void)
 		}
 		spw_opened = true;
 	}
+
+	/*
+	 * Only the IDs of the group file are needed, so that the primary
+	 * groups are found without a name service lookup for each user.
+	 * The file is scanned instead of being loaded.
+	 */
+	load_group_ids ();
 }
 
 /*
@@ -346,6 +484,9 @@ static void close_files (bool changed)
 		}
 	}
 	spw_locked = false;
+	free (group_ids);
+	group_ids = NULL;
+	ngroup_ids = 0;
 	if (pw_locked) {
 		if (pw_unlock () == 0) {
 			fprintf (stderr,
@@ -361,21 +502,214 @@ static void close_files (bool changed)
 	pw_locked = false;
 }
 
+/*
+ * state_options - Return the options which change the checks, for the
+ *                 state of the last run
+ */
+static unsigned long state_options (void)
+{
+	return   (quiet ? 0x1UL : 0)
+	       | (allow_bad_names ? 0x2UL : 0)
+	       | (is_shadow ? 0x4UL : 0);
+}
+
+/*
+ * state_files - Return the files the checks depend on
+ */
+static void state_files (const char *files[4])
+{
+	size_t n = 0;
+
+	files[n++] = pw_dbname ();
+	if (is_shadow) {
+		files[n++] = spw_dbname ();
+	}
+	files[n++] = gr_dbname ();
+	files[n] = NULL;
+}
+
+/*
+ * pw_key - Return the key of a parsed passwd entry for --state
+ *
+ *	Besides the line, the checks of the entry depend on the existence
+ *	of its shadow entry and of its primary group.
+ */
+static unsigned long long pw_key (const struct commonio_entry *pfe)
+{
+	const struct passwd *pwd = pfe->eptr;
+	unsigned long long key;
+
+	key = check_state_hash (CHECK_STATE_INIT, pfe->line);
+	key = check_state_hash (key, (is_shadow && (NULL != spw_locate (pwd->pw_name))) ? "shadow" : NULL);
+	return check_state_hash (key, known_gid (pwd->pw_gid) ? "group" : NULL);
+}
+
+/*
+ * spw_key - Return the key of a parsed shadow entry for --state
+ */
+static unsigned long long spw_key (const struct commonio_entry *spe)
+{
+	const struct spwd *spw = spe->eptr;
+	unsigned long long key;
+
+	key = check_state_hash (CHECK_STATE_INIT, spe->line);
+	return check_state_hash (key, (NULL != pw_locate (spw->sp_namp)) ? "passwd" : NULL);
+}
+
+/*
+ * fs_check_thread - Check the paths of the entries of the pool until all
+ *                   of them are checked.
+ */
+static /*@null@*/void *fs_check_thread (void *arg)
+{
+	struct fs_pool *pool = arg;
+
+	for (;;) {
+		struct fs_check *check;
+		size_t i;
+
+		(void) pthread_mutex_lock (&pool->mutex);
+		i = pool->next;
+		if (i < pool->count) {
+			pool->next++;
+		}
+		(void) pthread_mutex_unlock (&pool->mutex);
+		if (i == pool->count) {
+			break;
+		}
+
+		check = &pool->checks[i];
+		if (NULL != check->dir) {
+			check->dir_found = (access (check->dir, F_OK) == 0);
+		}
+		if (NULL != check->shell) {
+			check->shell_found = (access (check->shell, F_OK) == 0);
+		}
+	}
+	return NULL;
+}
+
+/*
+ * fs_checks_run - Check the home directories and login shells of all the
+ *                 passwd entries in jobs threads.
+ *
+ *	Slow filesystems (e.g. homes on NFS) are then waited for
+ *	concurrently. The results are used by check_pw_file(), which
+ *	reports them in the order of the entries.
+ *	If the results cannot be allocated, the paths are checked by
+ *	check_pw_file().
+ */
+static void fs_checks_run (void)
+{
+	uid_t min_sys_id = getdef_ulong ("SYS_UID_MIN", 101UL);
+	uid_t max_sys_id = getdef_ulong ("SYS_UID_MAX", 999UL);
+	const struct commonio_entry *pfe;
+	struct fs_pool pool;
+	pthread_t *threads;
+	long nthreads = 0;
+	long i;
+	size_t n = 0;
+
+	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next) {
+		n++;
+	}
+	fs_checks = calloc ((n > 0) ? n : 1, sizeof *fs_checks);
+	threads = calloc (jobs, sizeof *threads);
+	if (   (NULL == fs_checks)
+	    || (NULL == threads)
+	    || (pthread_mutex_init (&pool.mutex, NULL) != 0)) {
+		free (fs_checks);
+		fs_checks = NULL;
+		free (threads);
+		return;
+	}
+
+	/* Same conditions as in check_pw_file() */
+	n = 0;
+	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next, n++) {
+		const struct passwd *pwd = pfe->eptr;
+
+		if (   (NULL == pwd)
+		    || ((NULL != state_file)
+		        && check_state_known (&state, pw_key (pfe)))) {
+			continue;
+		}
+		if (   !((pwd->pw_uid >= min_sys_id) && (pwd->pw_uid <= max_sys_id))
+		    && (NULL != pwd->pw_dir)
+		    && ('\0' != pwd->pw_dir[0])) {
+			fs_checks[n].dir = pwd->pw_dir;
+		}
+		if ('\0' != pwd->pw_shell[0]) {
+			fs_checks[n].shell = pwd->pw_shell;
+		}
+	}
+
+	pool.checks = fs_checks;
+	pool.count = n;
+	pool.next = 0;
+	for (i = 1; i < jobs; i++) {
+		if (pthread_create (&threads[nthreads], NULL,
+		                    fs_check_thread, &pool) == 0) {
+			nthreads++;
+		}
+	}
+	/* This thread is one of the jobs */
+	(void) fs_check_thread (&pool);
+	for (i = 0; i < nthreads; i++) {
+		(void) pthread_join (threads[i], NULL);
+	}
+
+	(void) pthread_mutex_destroy (&pool.mutex);
+	free (threads);
+}
+
+/*
+ * home_exists - Check if the home directory of the n-th entry exists
+ */
+static bool home_exists (size_t n, const struct passwd *pwd)
+{
+	if (NULL != fs_checks) {
+		return fs_checks[n].dir_found;
+	}
+	return (access (pwd->pw_dir, F_OK) == 0);
+}
+
+/*
+ * shell_exists - Check if the login shell of the n-th entry exists
+ */
+static bool shell_exists (size_t n, const struct passwd *pwd)
+{
+	if (NULL != fs_checks) {
+		return fs_checks[n].shell_found;
+	}
+	return (access (pwd->pw_shell, F_OK) == 0);
+}
+
 /*
  * check_pw_file - check the content of the passwd file
  */
 static void check_pw_file (int *errors, bool *changed)
 {
-	struct commonio_entry *pfe, *tpfe;
+	struct commonio_entry *pfe;
+	size_t dups;
+	size_t n;
 	struct passwd *pwd;
 	const struct spwd *spw;
+	unsigned long long key = 0;
+	int entry_errors;
 	uid_t min_sys_id = getdef_ulong ("SYS_UID_MIN", 101UL);
 	uid_t max_sys_id = getdef_ulong ("SYS_UID_MAX", 999UL);
 
+	if ((jobs > 1) && !quiet) {
+		fs_checks_run ();
+	}
+
 	/*
 	 * Loop through the entire password file.
 	 */
-	for (pfe = __pw_get_head (); NULL != pfe; pfe = pfe->next) {
+	for (pfe = __pw_get_head (), n = 0;
+	     NULL != pfe;
+	     pfe = pfe->next, n++) {
 		/*
 		 * If this is a NIS line, skip it. You can't "know" what NIS
 		 * is going to do without directly asking NIS ...
@@ -430,27 +764,7 @@ static void check_pw_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tpfe = __pw_get_head (); NULL != tpfe; tpfe = tpfe->next) {
-			const struct passwd *ent = tpfe->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tpfe == pfe) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (pwd->pw_name, ent->pw_name) != 0) {
-				continue;
-			}
-
+		for (dups = __pw_duplicates (pfe); dups > 0; dups--) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -467,6 +781,20 @@ static void check_pw_file (int *errors, bool *changed)
 			}
 		}
 
+		/*
+		 * With --state, the entries which passed the checks of the
+		 * last run, and whose shadow entry and primary group did
+		 * not change, are not checked again.
+		 */
+		if (NULL != state_file) {
+			key = pw_key (pfe);
+			if (check_state_known (&state, key)) {
+				check_state_add (&state, key);
+				continue;
+			}
+		}
+		entry_errors = *errors;
+
 		/*
 		 * Check for invalid usernames.  --marekm
 		 */
@@ -489,7 +817,9 @@ static void check_pw_file (int *errors, bool *changed)
 		 * Make sure the primary group exists
 		 */
 		/* local, no need for xgetgrgid */
-		if (!quiet && (NULL == getgrgid (pwd->pw_gid))) {
+		if (   !quiet
+		    && !known_gid (pwd->pw_gid)
+		    && (NULL == getgrgid (pwd->pw_gid))) {
 
 			/*
 			 * No primary group, just give a warning
@@ -507,7 +837,7 @@ static void check_pw_file (int *errors, bool *changed)
 			/*
 			 * Make sure the home directory exists
 			 */
-			if (!quiet && (access (pwd->pw_dir, F_OK) != 0)) {
+			if (!quiet && !home_exists (n, pwd)) {
 				const char *nonexistent = getdef_str("NONEXISTENT");
 
 				/*
@@ -526,7 +856,7 @@ static void check_pw_file (int *errors, bool *changed)
 		 */
 		if (   !quiet
 		    && ('\0' != pwd->pw_shell[0])
-		    && (access (pwd->pw_shell, F_OK) != 0)) {
+		    && !shell_exists (n, pwd)) {
 
 			/*
 			 * Login shell doesn't exist, give a warning
@@ -674,7 +1004,14 @@ static void check_pw_file (int *errors, bool *changed)
 			}
 		}
 #endif				/* WITH_TCB */
+
+		if ((NULL != state_file) && (*errors == entry_errors)) {
+			check_state_add (&state, key);
+		}
 	}
+
+	free (fs_checks);
+	fs_checks = NULL;
 }
 
 /*
@@ -682,8 +1019,11 @@ static void check_pw_file (int *errors, bool *changed)
  */
 static void check_spw_file (int *errors, bool *changed)
 {
-	struct commonio_entry *spe, *tspe;
+	struct commonio_entry *spe;
+	size_t dups;
 	struct spwd *spw;
+	unsigned long long key = 0;
+	int entry_errors;
 
 	/*
 	 * Loop through the entire shadow password file.
@@ -751,27 +1091,7 @@ static void check_spw_file (int *errors, bool *changed)
 		/*
 		 * Make sure this entry has a unique name.
 		 */
-		for (tspe = __spw_get_head (); NULL != tspe; tspe = tspe->next) {
-			const struct spwd *ent = tspe->eptr;
-
-			/*
-			 * Don't check this entry
-			 */
-			if (tspe == spe) {
-				continue;
-			}
-
-			/*
-			 * Don't check invalid entries.
-			 */
-			if (NULL == ent) {
-				continue;
-			}
-
-			if (strcmp (spw->sp_namp, ent->sp_namp) != 0) {
-				continue;
-			}
-
+		for (dups = __spw_duplicates (spe); dups > 0; dups--) {
 			/*
 			 * Tell the user this entry is a duplicate of
 			 * another and ask them to delete it.
@@ -788,6 +1108,15 @@ static void check_spw_file (int *errors, bool *changed)
 			}
 		}
 
+		if (NULL != state_file) {
+			key = spw_key (spe);
+			if (check_state_known (&state, key)) {
+				check_state_add (&state, key);
+				continue;
+			}
+		}
+		entry_errors = *errors;
+
 		/*
 		 * Make sure this entry exists in the /etc/passwd
 		 * file.
@@ -822,6 +1151,10 @@ static void check_spw_file (int *errors, bool *changed)
 				*errors += 1;
 			}
 		}
+
+		if ((NULL != state_file) && (*errors == entry_errors)) {
+			check_state_add (&state, key);
+		}
 	}
 }
 
@@ -851,6 +1184,19 @@ int main (int argc, char **argv)
 	/* Parse the command line arguments */
 	process_flags (argc, argv);
 
+	if (NULL != state_file) {
+		const char *files[4];
+
+		state_files (files);
+		if (check_state_load (&state, state_file, "pwck",
+		                      state_options (), files)) {
+			/* No error last time, and nothing changed since */
+			check_state_free (&state);
+			closelog ();
+			return E_OKAY;
+		}
+	}
+
 	open_files ();
 
 	if (sort_mode) {
@@ -879,9 +1225,13 @@ int main (int argc, char **argv)
 
 	close_files (changed);
 
-	if (!read_only) {
-		nscd_flush_cache ("passwd");
-		sssd_flush_cache (SSSD_DB_PASSWD);
+	if (NULL != state_file) {
+		const char *files[4];
+
+		state_files (files);
+		(void) check_state_save (&state, state_file, "pwck",
+		                         state_options (), 0 == errors, files);
+		check_state_free (&state);
 	}
 
 	/*
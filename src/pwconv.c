@@ -48,8 +48,6 @@
 #include "prototypes.h"
 #include "pwio.h"
 #include "shadowio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "shadowlog.h"
 
 /*
@@ -152,6 +150,9 @@ int main (int argc, char **argv)
 	struct passwd pwent;
 	const struct spwd *sp;
 	struct spwd spent;
+	const char **stale = NULL;
+	size_t nstale = 0;
+	size_t i;
 
 	Prog = Basename (argv[0]);
 	log_set_progname(Prog);
@@ -202,6 +203,8 @@ int main (int argc, char **argv)
 
 	/*
 	 * Remove /etc/shadow entries for users not in /etc/passwd.
+	 * The names are collected first, so that the database does not
+	 * have to be rescanned after each removal.
 	 */
 	(void) spw_rewind ();
 	while ((sp = spw_next ()) != NULL) {
@@ -209,17 +212,31 @@ int main (int argc, char **argv)
 			continue;
 		}
 
-		if (spw_remove (sp->sp_namp) == 0) {
+		if (0 == (nstale % 64)) {
+			const char **list;
+
+			list = realloc (stale, (nstale + 64) * sizeof *stale);
+			if (NULL == list) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				fail_exit (E_FAILURE);
+			}
+			stale = list;
+		}
+		stale[nstale] = sp->sp_namp;
+		nstale++;
+	}
+	for (i = 0; i < nstale; i++) {
+		if (spw_remove (stale[i]) == 0) {
 			/*
 			 * This shouldn't happen (the entry exists) but...
 			 */
 			fprintf (stderr,
 			         _("%s: cannot remove entry '%s' from %s\n"),
-			         Prog, sp->sp_namp, spw_dbname ());
+			         Prog, stale[i], spw_dbname ());
 			fail_exit (E_FAILURE);
 		}
-		(void) spw_rewind();
 	}
+	free (stale);
 
 	/*
 	 * Update shadow entries which don't have "x" as pw_passwd. Add any
@@ -308,9 +325,6 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
-
 	return E_SUCCESS;
 }
 
@@ -0,0 +1,1073 @@
+/*
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+
+#include <config.h>
+
+#ident "$Id$"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "commonio.h"
+#include "defines.h"
+#include "prototypes.h"
+#ifdef ENABLE_SUBIDS
+#include "subordinateio.h"
+#endif				/* ENABLE_SUBIDS */
+#include "shadowlog.h"
+/*@-exitarg@*/
+#include "exitcodes.h"
+
+/*
+ * pwsync - apply the changes of the account databases of another host
+ *
+ *	The changes are read from a copy of the journal of
+ *	REPLICATION_JOURNAL of that host. They are applied in their order,
+ *	and all together, in a transaction over the local databases. Each
+ *	removed or modified line must be found unchanged in the local
+ *	database, and an added name must not be there yet: otherwise the
+ *	hosts have diverged, and nothing is applied.
+ *
+ *	The generation following the last change applied is kept in the
+ *	state file, so that the next changes must follow it.
+ *
+ *	With --listen, pwsync stays running and applies the changes sent
+ *	by the processes of root to a Unix socket instead. The requests
+ *	received while the previous ones are written are applied in a
+ *	single transaction: a request which does not match the databases
+ *	is rejected alone, and the others are applied without it.
+ */
+
+#define PWSYNC_STATE_FILE	"/var/lib/shadow/pwsync.state"
+
+/* Limits of --listen */
+#define PWSYNC_MAX_CLIENTS	64
+#define PWSYNC_MAX_REQUEST	(1024 * 1024)
+
+/*
+ * Global variables
+ */
+const char *Prog;
+
+static bool gflg = false;
+static const char *state_file = PWSYNC_STATE_FILE;
+static /*@null@*/const char *journal_file = NULL;
+static /*@null@*/const char *listen_path = NULL;
+
+struct sync_db {
+	const char *name;	/* name of the file in the records */
+	struct commonio_db *(*get_db) (void);
+	bool ranges;		/* a name can have several entries */
+	bool used;
+};
+
+static struct sync_db sync_dbs[] = {
+	{"passwd",  __pw_get_db,      false, false},
+	{"shadow",  __spw_get_db,     false, false},
+	{"group",   __gr_get_db,      false, false},
+#ifdef SHADOWGRP
+	{"gshadow", __sgr_get_db,     false, false},
+#endif				/* SHADOWGRP */
+#ifdef ENABLE_SUBIDS
+	{"subuid",  __sub_uid_get_db, true,  false},
+	{"subgid",  __sub_gid_get_db, true,  false},
+#endif				/* ENABLE_SUBIDS */
+};
+
+enum record_op { REC_ADD, REC_DEL, REC_END };
+
+struct record {
+	unsigned long lineno;	/* in the journal */
+	unsigned long long gen;
+	enum record_op op;
+	struct sync_db *db;
+	/*@dependent@*/char *line;	/* in buf */
+	/*@owned@*/char *buf;
+	size_t owner;		/* client which sent it, with --listen */
+};
+
+/* The records of the complete commits to apply */
+static /*@null@*/ /*@owned@*/struct record *records = NULL;
+static size_t nrecords = 0;
+/* The record being applied, or which did not match the databases */
+static size_t applied = 0;
+
+/*
+ * A connection to the socket of --listen. The records of its request
+ * are in recs until the request is complete and applied.
+ */
+struct client {
+	int fd;
+	/*@owned@*/char *buf;		/* input not split in lines yet */
+	size_t len;
+	unsigned long lineno;
+	/*@null@*/ /*@owned@*/struct record *recs;
+	size_t nrecs;
+	bool complete;			/* the empty line was read */
+	bool failed;
+};
+
+static struct client clients[PWSYNC_MAX_CLIENTS];
+static size_t nclients = 0;
+static volatile sig_atomic_t stop = 0;
+
+/* local function prototypes */
+NORETURN static void usage (int status);
+static void process_flags (int argc, char **argv);
+static bool read_state (/*@out@*/unsigned long long *gen);
+static int write_state (unsigned long long gen);
+static int parse_change (char *buf, unsigned long lineno, struct record *r);
+static int parse_record (char *buf, unsigned long lineno, struct record *r);
+static void add_record (struct record **recs, size_t *count,
+                        const struct record *r);
+static void read_journal (FILE *fp, bool *known, unsigned long long *next);
+static bool add_line (const struct record *r, bool replace);
+static bool apply_records (void);
+static int apply_journal (void);
+static void catch_signals (int sig);
+static int listen_socket (void);
+static void accept_client (int lfd);
+static bool read_client (struct client *c);
+static void drop_client (size_t i);
+static void commit_requests (void);
+NORETURN static void serve (void);
+
+/*
+ * usage - display usage message and exit
+ */
+NORETURN
+static void usage (int status)
+{
+	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+	(void) fprintf (usageout,
+	                _("Usage: %s [options] [JOURNAL]\n"
+	                  "\n"
+	                  "Options:\n"),
+	                Prog);
+	(void) fputs (_("  -g, --generation              display the generation of the next change\n"
+	                "                                and exit\n"),
+	              usageout);
+	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("  -l, --listen SOCKET           apply the changes sent to SOCKET\n"), usageout);
+	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("  -s, --state FILE              file of the generation of the next change\n"), usageout);
+	(void) fputs ("\n", usageout);
+	exit (status);
+}
+
+/*
+ * process_flags - parse the command line options
+ *
+ *	It will not return if an error is encountered.
+ */
+static void process_flags (int argc, char **argv)
+{
+	int c;
+	static struct option long_options[] = {
+		{"generation", no_argument,       NULL, 'g'},
+		{"help",       no_argument,       NULL, 'h'},
+		{"listen",     required_argument, NULL, 'l'},
+		{"root",       required_argument, NULL, 'R'},
+		{"state",      required_argument, NULL, 's'},
+		{NULL, 0, NULL, '\0'}
+	};
+
+	while ((c = getopt_long (argc, argv, "ghl:R:s:",
+	                         long_options, NULL)) != -1) {
+		switch (c) {
+		case 'g':
+			gflg = true;
+			break;
+		case 'h':
+			usage (E_SUCCESS);
+			/*@notreached@*/break;
+		case 'l':
+			listen_path = optarg;
+			break;
+		case 'R': /* no-op, handled in process_root_flag () */
+			break;
+		case 's':
+			state_file = optarg;
+			break;
+		default:
+			usage (E_USAGE);
+		}
+	}
+
+	if (optind < argc) {
+		journal_file = argv[optind++];
+	}
+	if (   (optind != argc)
+	    || (gflg && (NULL != journal_file))
+	    || ((NULL != listen_path) && (gflg || (NULL != journal_file)))) {
+		usage (E_USAGE);
+	}
+}
+
+/*
+ * read_state - Read the generation of the next change to apply.
+ *
+ *	Return false if no change was applied yet: the first generation
+ *	of the journal is then accepted.
+ */
+static bool read_state (/*@out@*/unsigned long long *gen)
+{
+	char buf[32];
+	char *end;
+	FILE *fp;
+
+	*gen = 0;
+	fp = fopen (state_file, "r");
+	if (NULL == fp) {
+		if (ENOENT == errno) {
+			return false;
+		}
+		fprintf (stderr, _("%s: cannot open %s: %s\n"),
+		         Prog, state_file, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	if (fgets (buf, sizeof buf, fp) == NULL) {
+		buf[0] = '\0';
+	}
+	(void) fclose (fp);
+
+	errno = 0;
+	*gen = strtoull (buf, &end, 10);
+	if (   !isdigit ((unsigned char) buf[0])
+	    || (0 != errno)
+	    || (('\n' != *end) && ('\0' != *end))) {
+		fprintf (stderr, _("%s: invalid generation in %s\n"),
+		         Prog, state_file);
+		exit (EXIT_FAILURE);
+	}
+	return true;
+}
+
+/*
+ * write_state - Record gen as the generation of the next change.
+ *
+ *	The state file is replaced, so that it is never found partly
+ *	written. Return 0 on success, -1 on failure.
+ */
+static int write_state (unsigned long long gen)
+{
+	char tmp[1024];
+	char buf[32];
+	int len;
+	int fd;
+
+	if (snprintf (tmp, sizeof tmp, "%s+", state_file) >= (int) sizeof tmp) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	len = snprintf (buf, sizeof buf, "%llu\n", gen);
+	fd = open (tmp, O_WRONLY | O_CREAT | O_TRUNC | O_NOCTTY | O_CLOEXEC,
+	           0600);
+	if (fd < 0) {
+		return -1;
+	}
+	if (   (write (fd, buf, len) != len)
+	    || (fsync (fd) != 0)) {
+		(void) close (fd);
+		(void) unlink (tmp);
+		return -1;
+	}
+	if ((close (fd) != 0) || (rename (tmp, state_file) != 0)) {
+		(void) unlink (tmp);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * parse_change - Split the change "OPERATION:DATABASE:LINE" in buf.
+ *
+ *	Return 0 on success, -1 if the change is invalid, and -2 if the
+ *	database is unknown, which is reported.
+ */
+static int parse_change (char *buf, unsigned long lineno, struct record *r)
+{
+	char *op = buf, *dbname, *line;
+	size_t i;
+
+	dbname = strchr (op, ':');
+	if (NULL == dbname) {
+		return -1;
+	}
+	*dbname++ = '\0';
+	line = strchr (dbname, ':');
+	if (NULL == line) {
+		return -1;
+	}
+	*line++ = '\0';
+	r->line = line;
+
+	if (strcmp (op, "add") == 0) {
+		r->op = REC_ADD;
+	} else if (strcmp (op, "del") == 0) {
+		r->op = REC_DEL;
+	} else if (strcmp (op, "end") == 0) {
+		r->op = REC_END;
+	} else {
+		return -1;
+	}
+	if ((REC_END != r->op) && (NULL == strchr (line, ':'))) {
+		return -1;
+	}
+
+	for (i = 0; i < sizeof sync_dbs / sizeof sync_dbs[0]; i++) {
+		if (strcmp (dbname, sync_dbs[i].name) == 0) {
+			r->db = &sync_dbs[i];
+			return 0;
+		}
+	}
+	fprintf (stderr, _("%s: line %lu: unknown database %s\n"),
+	         Prog, lineno, dbname);
+	return -2;
+}
+
+/*
+ * parse_record - Split the record "GENERATION:OPERATION:DATABASE:LINE"
+ *	in buf, without its newline.
+ *
+ *	It will not return if the database is unknown.
+ *
+ *	Return 0 on success, -1 if the record is invalid.
+ */
+static int parse_record (char *buf, unsigned long lineno, struct record *r)
+{
+	char *op;
+	int ret;
+
+	r->lineno = lineno;
+	r->buf = buf;
+	r->owner = 0;
+
+	errno = 0;
+	r->gen = strtoull (buf, &op, 10);
+	if (!isdigit ((unsigned char) buf[0]) || (0 != errno) || (':' != *op)) {
+		return -1;
+	}
+	ret = parse_change (op + 1, lineno, r);
+	if (-2 == ret) {
+		exit (E_BAD_ARG);
+	}
+	return ret;
+}
+
+/*
+ * add_record - Append r to the count records of *recs.
+ *
+ *	It will not return if the memory cannot be allocated.
+ */
+static void add_record (struct record **recs, size_t *count,
+                        const struct record *r)
+{
+	if (0 == (*count % 64)) {
+		struct record *tmp;
+
+		tmp = realloc (*recs, (*count + 64) * sizeof *tmp);
+		if (NULL == tmp) {
+			fprintf (stderr,
+			         _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+		*recs = tmp;
+	}
+	(*recs)[(*count)++] = *r;
+}
+
+/*
+ * read_journal - Read the records of the commits to apply.
+ *
+ *	*next is the generation of the next commit, if *known. The commits
+ *	before it were already applied, and are skipped. A commit which is
+ *	not complete at the end of the journal is not applied either: it
+ *	was not entirely copied yet. *next is set to the generation after
+ *	the last commit read, and *known once a commit was read.
+ *
+ *	It will not return if the journal is invalid, or does not follow
+ *	the changes already applied.
+ */
+static void read_journal (FILE *fp, bool *known, unsigned long long *next)
+{
+	unsigned long lineno = 0;
+	unsigned long long bytes = 0;	/* of the current commit */
+	size_t start = 0;		/* first record of the commit */
+	char *buf = NULL;
+	size_t size = 0;
+	ssize_t len;
+
+	while ((len = getline (&buf, &size, fp)) > 0) {
+		struct record r;
+		unsigned long count;
+		char *end;
+
+		lineno++;
+		if ('\n' != buf[len - 1]) {
+			break;	/* copied while it was written */
+		}
+		buf[len - 1] = '\0';
+		if (parse_record (buf, lineno, &r) != 0) {
+			fprintf (stderr, _("%s: line %lu: invalid record\n"),
+			         Prog, lineno);
+			exit (E_BAD_ARG);
+		}
+		buf = NULL;
+		size = 0;
+
+		if (   (nrecords > start)
+		    && (   (records[start].gen != r.gen)
+		        || (records[start].db != r.db))) {
+			fprintf (stderr,
+			         _("%s: line %lu: the commit of line %lu is not complete\n"),
+			         Prog, lineno, records[start].lineno);
+			exit (E_BAD_ARG);
+		}
+		bytes += len;
+
+		if (REC_END != r.op) {
+			add_record (&records, &nrecords, &r);
+			continue;
+		}
+
+		/* The commit is complete */
+		errno = 0;
+		count = strtoul (r.line, &end, 10);
+		if (   !isdigit ((unsigned char) r.line[0])
+		    || (0 != errno)
+		    || ('\0' != *end)
+		    || (count != nrecords - start)) {
+			fprintf (stderr, _("%s: line %lu: invalid record\n"),
+			         Prog, lineno);
+			exit (E_BAD_ARG);
+		}
+		free (r.buf);
+
+		if (*known && (r.gen + bytes <= *next)) {
+			/* Already applied */
+			while (nrecords > start) {
+				free (records[--nrecords].buf);
+			}
+		} else if (*known && (r.gen != *next)) {
+			fprintf (stderr,
+			         _("%s: line %lu: generation %llu does not follow generation %llu\n"),
+			         Prog, lineno, r.gen, *next);
+			exit (EXIT_FAILURE);
+		} else {
+			*next = r.gen + bytes;
+			*known = true;
+			start = nrecords;
+		}
+		bytes = 0;
+	}
+	free (buf);
+	if (ferror (fp) != 0) {
+		fprintf (stderr, _("%s: cannot read %s: %s\n"),
+		         Prog, (NULL != journal_file) ? journal_file : "stdin",
+		         strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+
+	/* Drop the last commit if it is not complete */
+	while (nrecords > start) {
+		free (records[--nrecords].buf);
+	}
+}
+
+/*
+ * add_line - Add the line of the record r to its database.
+ *
+ *	With replace, the line replaces the entry of the same name, which
+ *	must exist. Otherwise, there must be no such entry, unless a name
+ *	can have several entries in the database.
+ *
+ *	Return false on failure.
+ */
+static bool add_line (const struct record *r, bool replace)
+{
+	struct commonio_db *db = r->db->get_db ();
+	const void *eptr;
+	int ret;
+
+	if (!r->db->ranges) {
+		char *name;
+		bool exists;
+
+		name = strndup (r->line, strcspn (r->line, ":"));
+		if (NULL == name) {
+			fprintf (stderr,
+			         _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			return false;
+		}
+		exists = (commonio_locate (db, name) != NULL);
+		free (name);
+		if (exists != replace) {
+			fprintf (stderr,
+			         _("%s: line %lu: %s does not match the journal\n"),
+			         Prog, r->lineno, db->filename);
+			return false;
+		}
+	}
+
+	eptr = db->ops->parse (r->line);
+	if (NULL == eptr) {
+		fprintf (stderr, _("%s: line %lu: invalid record\n"),
+		         Prog, r->lineno);
+		return false;
+	}
+#ifdef ENABLE_SUBIDS
+	if (r->db->ranges) {
+		ret = commonio_append (db, eptr);
+	} else
+#endif				/* ENABLE_SUBIDS */
+	{
+		ret = commonio_update (db, eptr);
+	}
+	if (0 == ret) {
+		fprintf (stderr, _("%s: failure while writing changes to %s\n"),
+		         Prog, db->filename);
+		return false;
+	}
+	return true;
+}
+
+/*
+ * apply_records - Apply the records to the open databases.
+ *
+ *	A line removed and added again with the same name is a modified
+ *	entry: it is replaced in place.
+ *
+ *	Return false if the databases do not match the journal. applied
+ *	is then the record which does not match.
+ */
+static bool apply_records (void)
+{
+	size_t i;
+
+	for (i = 0; i < nrecords; i++) {
+		const struct record *r = &records[i];
+		const struct record *next = (i + 1 < nrecords)
+		                            ? &records[i + 1] : NULL;
+		struct commonio_db *db = r->db->get_db ();
+		size_t len;
+
+		applied = i;
+		if (REC_ADD == r->op) {
+			if (!add_line (r, false)) {
+				return false;
+			}
+			continue;
+		}
+
+		len = strcspn (r->line, ":");
+		if (   !r->db->ranges
+		    && (NULL != next)
+		    && (REC_ADD == next->op)
+		    && (next->db == r->db)
+		    && (strncmp (r->line, next->line, len + 1) == 0)) {
+			if (!commonio_has_line (db, r->line)) {
+				fprintf (stderr,
+				         _("%s: line %lu: %s does not match the journal\n"),
+				         Prog, r->lineno, db->filename);
+				return false;
+			}
+			if (!add_line (next, true)) {
+				return false;
+			}
+			i++;
+			continue;
+		}
+
+		if (commonio_remove_line (db, r->line) == 0) {
+			fprintf (stderr,
+			         _("%s: line %lu: %s does not match the journal\n"),
+			         Prog, r->lineno, db->filename);
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * apply_journal - Apply the records in a transaction over their
+ *	databases.
+ *
+ *	If the records cannot be applied, no database is modified.
+ *
+ *	Return 0 on success, 1 if the databases do not match the records,
+ *	and -1 if they could not be updated.
+ */
+static int apply_journal (void)
+{
+	struct commonio_txn txn;
+	size_t i;
+
+	commonio_txn_init (&txn);
+	for (i = 0; i < sizeof sync_dbs / sizeof sync_dbs[0]; i++) {
+		sync_dbs[i].used = false;
+	}
+	for (i = 0; i < nrecords; i++) {
+		records[i].db->used = true;
+	}
+	for (i = 0; i < sizeof sync_dbs / sizeof sync_dbs[0]; i++) {
+		if (sync_dbs[i].used) {
+			(void) commonio_txn_add (&txn, sync_dbs[i].get_db ());
+		}
+	}
+
+	if (commonio_txn_lock (&txn) == 0) {
+		fprintf (stderr,
+		         _("%s: cannot lock %s; try again later.\n"),
+		         Prog, txn.failed->filename);
+		return -1;
+	}
+	if (commonio_txn_open (&txn, O_CREAT | O_RDWR) == 0) {
+		fprintf (stderr, _("%s: cannot open %s\n"),
+		         Prog, txn.failed->filename);
+		(void) commonio_txn_unlock (&txn);
+		return -1;
+	}
+
+	if (!apply_records ()) {
+		for (i = 0; i < txn.count; i++) {
+			txn.dbs[i]->changed = false;
+			(void) commonio_close (txn.dbs[i]);
+		}
+		(void) commonio_txn_unlock (&txn);
+		return 1;
+	}
+
+	if (commonio_txn_commit (&txn) == 0) {
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"),
+		         Prog, txn.failed->filename);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s",
+		         txn.failed->filename));
+		(void) commonio_txn_unlock (&txn);
+		return -1;
+	}
+	(void) commonio_txn_unlock (&txn);
+	return 0;
+}
+
+/*
+ * catch_signals - Stop serving the requests of --listen.
+ */
+static void catch_signals (unused int sig)
+{
+	stop = 1;
+}
+
+/*
+ * listen_socket - Create the socket of --listen.
+ *
+ *	Only root can connect to it.
+ *
+ *	Return the socket, or -1 on failure.
+ */
+static int listen_socket (void)
+{
+	struct sockaddr_un addr;
+	mode_t old_umask;
+	int fd;
+
+	if (strlen (listen_path) >= sizeof addr.sun_path) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		return -1;
+	}
+
+	memzero (&addr, sizeof addr);
+	addr.sun_family = AF_UNIX;
+	strcpy (addr.sun_path, listen_path);
+	(void) unlink (listen_path);
+	old_umask = umask (0177);
+	if (   (bind (fd, (struct sockaddr *) &addr, sizeof addr) != 0)
+	    || (listen (fd, SOMAXCONN) != 0)) {
+		int err = errno;
+
+		(void) umask (old_umask);
+		(void) close (fd);
+		errno = err;
+		return -1;
+	}
+	(void) umask (old_umask);
+	return fd;
+}
+
+/*
+ * accept_client - Accept a connection to the socket lfd.
+ *
+ *	The connections of the processes of other users than root are
+ *	closed.
+ */
+static void accept_client (int lfd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof cred;
+	struct client *c;
+	int fd;
+
+	fd = accept4 (lfd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) {
+		return;
+	}
+	if (getsockopt (fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+		(void) close (fd);
+		return;
+	}
+	if (0 != cred.uid) {
+		SYSLOG ((LOG_WARN, "rejected a connection of UID %lu",
+		         (unsigned long) cred.uid));
+		(void) close (fd);
+		return;
+	}
+	if (PWSYNC_MAX_CLIENTS == nclients) {
+		SYSLOG ((LOG_WARN, "too many connections"));
+		(void) close (fd);
+		return;
+	}
+
+	c = &clients[nclients++];
+	memzero (c, sizeof *c);
+	c->fd = fd;
+}
+
+/*
+ * read_client - Read the request of c.
+ *
+ *	A request is a list of changes "OPERATION:DATABASE:LINE", as in
+ *	the journal, ended by an empty line. An invalid change fails the
+ *	whole request.
+ *
+ *	Return false if the connection is closed before the request is
+ *	complete.
+ */
+static bool read_client (struct client *c)
+{
+	char chunk[4096];
+	ssize_t n;
+	char *nl;
+
+	for (;;) {
+		char *tmp;
+
+		n = read (c->fd, chunk, sizeof chunk);
+		if (0 == n) {
+			return false;
+		}
+		if (n < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return (EAGAIN == errno) || (EWOULDBLOCK == errno);
+		}
+		if (c->len + n > PWSYNC_MAX_REQUEST) {
+			fprintf (stderr, _("%s: request too large\n"), Prog);
+			c->failed = true;
+			c->complete = true;
+			return true;
+		}
+		tmp = realloc (c->buf, c->len + n);
+		if (NULL == tmp) {
+			fprintf (stderr, _("%s: failed to allocate memory: %s\n"),
+			         Prog, strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+		c->buf = tmp;
+		memcpy (c->buf + c->len, chunk, n);
+		c->len += n;
+
+		while (   !c->complete
+		       && ((nl = memchr (c->buf, '\n', c->len)) != NULL)) {
+			size_t len = nl - c->buf;
+			struct record r;
+
+			c->lineno++;
+			if (0 == len) {
+				c->complete = true;
+				break;
+			}
+			memzero (&r, sizeof r);
+			r.lineno = c->lineno;
+			r.buf = strndup (c->buf, len);
+			if (NULL == r.buf) {
+				fprintf (stderr,
+				         _("%s: failed to allocate memory: %s\n"),
+				         Prog, strerror (errno));
+				exit (EXIT_FAILURE);
+			}
+			memmove (c->buf, nl + 1, c->len - len - 1);
+			c->len -= len + 1;
+
+			if (   (parse_change (r.buf, r.lineno, &r) != 0)
+			    || (REC_END == r.op)) {
+				fprintf (stderr,
+				         _("%s: line %lu: invalid record\n"),
+				         Prog, r.lineno);
+				free (r.buf);
+				c->failed = true;
+				continue;
+			}
+			add_record (&c->recs, &c->nrecs, &r);
+		}
+		if (c->complete) {
+			return true;
+		}
+	}
+}
+
+/*
+ * drop_client - Close the connection of clients[i], and forget it.
+ */
+static void drop_client (size_t i)
+{
+	struct client *c = &clients[i];
+	size_t j;
+
+	(void) close (c->fd);
+	for (j = 0; j < c->nrecs; j++) {
+		free (c->recs[j].buf);
+	}
+	free (c->recs);
+	free (c->buf);
+	clients[i] = clients[--nclients];
+}
+
+/*
+ * commit_requests - Apply the complete requests together, and reply to
+ *	their clients.
+ *
+ *	The requests are applied in the order of their connections. When
+ *	one of them does not match the databases, it is rejected, and the
+ *	others are applied again without it. Each client is sent "ok" or
+ *	"error" on a line, and its connection is closed.
+ */
+static void commit_requests (void)
+{
+	unsigned long count = 0;
+	size_t i, j;
+	int ret;
+
+	for (;;) {
+		nrecords = 0;
+		count = 0;
+		for (i = 0; i < nclients; i++) {
+			struct client *c = &clients[i];
+
+			if (!c->complete || c->failed) {
+				continue;
+			}
+			for (j = 0; j < c->nrecs; j++) {
+				c->recs[j].owner = i;
+				add_record (&records, &nrecords, &c->recs[j]);
+			}
+			count++;
+		}
+		if (0 == nrecords) {
+			break;
+		}
+
+		ret = apply_journal ();
+		if (1 == ret) {
+			clients[records[applied].owner].failed = true;
+			continue;
+		}
+		if (0 == ret) {
+			SYSLOG ((LOG_INFO, "applied %lu changes of %lu requests",
+			         (unsigned long) nrecords, count));
+		} else {
+			for (i = 0; i < nclients; i++) {
+				if (clients[i].complete) {
+					clients[i].failed = true;
+				}
+			}
+		}
+		break;
+	}
+	/* The records belong to the clients */
+	nrecords = 0;
+
+	i = nclients;
+	while (i > 0) {
+		const char *reply;
+
+		i--;
+		if (!clients[i].complete) {
+			continue;
+		}
+		reply = clients[i].failed ? "error\n" : "ok\n";
+		(void) write (clients[i].fd, reply, strlen (reply));
+		drop_client (i);
+	}
+}
+
+/*
+ * serve - Apply the requests sent to the socket of --listen, until
+ *	pwsync is stopped.
+ *
+ *	The requests which are complete after each wait are applied
+ *	together: the more requests arrive while the databases are
+ *	written, the fewer times these are written.
+ */
+NORETURN static void serve (void)
+{
+	struct pollfd pfds[PWSYNC_MAX_CLIENTS + 1];
+	size_t idx[PWSYNC_MAX_CLIENTS + 1];
+	int lfd;
+
+	lfd = listen_socket ();
+	if (lfd < 0) {
+		fprintf (stderr, _("%s: cannot listen on %s: %s\n"),
+		         Prog, listen_path, strerror (errno));
+		exit (EXIT_FAILURE);
+	}
+	(void) signal (SIGHUP, catch_signals);
+	(void) signal (SIGINT, catch_signals);
+	(void) signal (SIGTERM, catch_signals);
+	(void) signal (SIGPIPE, SIG_IGN);
+	SYSLOG ((LOG_INFO, "listening on %s", listen_path));
+
+	while (0 == stop) {
+		bool complete = false;
+		nfds_t n = 1;
+		size_t i, k;
+
+		pfds[0].fd = lfd;
+		pfds[0].events = POLLIN;
+		for (i = 0; i < nclients; i++) {
+			pfds[n].fd = clients[i].fd;
+			pfds[n].events = POLLIN;
+			idx[n++] = i;
+		}
+		if (poll (pfds, n, -1) < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			fprintf (stderr, _("%s: cannot wait for the requests: %s\n"),
+			         Prog, strerror (errno));
+			break;
+		}
+
+		/* Backwards: drop_client() moves the last client */
+		for (k = n - 1; k > 0; k--) {
+			if (0 == pfds[k].revents) {
+				continue;
+			}
+			if (!read_client (&clients[idx[k]])) {
+				drop_client (idx[k]);
+			}
+		}
+		if (0 != pfds[0].revents) {
+			accept_client (lfd);
+		}
+
+		for (i = 0; i < nclients; i++) {
+			complete = complete || clients[i].complete;
+		}
+		if (complete) {
+			commit_requests ();
+		}
+	}
+
+	while (nclients > 0) {
+		drop_client (nclients - 1);
+	}
+	(void) close (lfd);
+	(void) unlink (listen_path);
+	SYSLOG ((LOG_INFO, "stopped listening on %s", listen_path));
+	exit ((0 != stop) ? E_SUCCESS : EXIT_FAILURE);
+}
+
+int main (int argc, char **argv)
+{
+	unsigned long long gen, next;
+	bool known, read;
+	FILE *fp = stdin;
+	size_t i;
+
+	Prog = Basename (argv[0]);
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", argc, argv);
+
+	process_flags (argc, argv);
+
+	OPENLOG ("pwsync");
+
+	if (NULL != listen_path) {
+		serve ();
+	}
+
+	known = read_state (&gen);
+	if (gflg) {
+		if (!known) {
+			fprintf (stderr, _("%s: no change was applied yet\n"),
+			         Prog);
+			exit (EXIT_FAILURE);
+		}
+		(void) printf ("%llu\n", gen);
+		exit (E_SUCCESS);
+	}
+
+	if (NULL != journal_file) {
+		fp = fopen (journal_file, "r");
+		if (NULL == fp) {
+			fprintf (stderr, _("%s: cannot open %s: %s\n"),
+			         Prog, journal_file, strerror (errno));
+			exit (EXIT_FAILURE);
+		}
+	}
+	next = gen;
+	read = known;
+	read_journal (fp, &read, &next);
+	if (stdin != fp) {
+		(void) fclose (fp);
+	}
+
+	if (nrecords > 0) {
+		if (apply_journal () != 0) {
+			exit (EXIT_FAILURE);
+		}
+		SYSLOG ((LOG_INFO, "applied %lu changes up to generation %llu",
+		         (unsigned long) nrecords, next));
+	}
+	if (   (read && (!known || (next != gen)))
+	    && (write_state (next) != 0)) {
+		fprintf (stderr,
+		         _("%s: cannot record the generation %llu in %s: %s\n"),
+		         Prog, next, state_file, strerror (errno));
+		SYSLOG ((LOG_ERR, "cannot record the generation %llu in %s",
+		         next, state_file));
+		exit (EXIT_FAILURE);
+	}
+
+	for (i = 0; i < nrecords; i++) {
+		free (records[i].buf);
+	}
+	free (records);
+
+	return E_SUCCESS;
+}
@@ -18,8 +18,6 @@
 #include <unistd.h>
 #include <getopt.h>
 #include "defines.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwio.h"
 #include "shadowio.h"
@@ -230,9 +228,6 @@ int main (int argc, char **argv)
 		/* continue */
 	}
 
-	nscd_flush_cache ("passwd");
-	sssd_flush_cache (SSSD_DB_PASSWD);
-
 	return 0;
 }
 
@@ -169,20 +169,14 @@ static void kill_child (int unused(s))
 }
 #endif				/* USE_PAM */
 
-/* borrowed from GNU sh-utils' "su.c" */
+/*
+ * restricted_shell - return true if the shell is not listed in /etc/shells
+ *
+ *	If the list cannot be read, the shell is restricted.
+ */
 static bool restricted_shell (const char *shellname)
 {
-	/*@observer@*/const char *line;
-
-	setusershell ();
-	while ((line = getusershell ()) != NULL) {
-		if (('#' != *line) && (strcmp (line, shellname) == 0)) {
-			endusershell ();
-			return false;
-		}
-	}
-	endusershell ();
-	return true;
+	return (shell_is_listed (shellname) != 1);
 }
 
 NORETURN
@@ -451,6 +445,7 @@ static void usage (int status)
 #ifdef USE_PAM
 static void check_perms_pam (const struct passwd *pw)
 {
+	struct timespec start;
 	int ret;
 	ret = pam_authenticate (pamh, 0);
 	if (PAM_SUCCESS != ret) {
@@ -461,7 +456,9 @@ static void check_perms_pam (const struct passwd *pw)
 		su_failure (caller_tty, 0 == pw->pw_uid);
 	}
 
+	timing_start (&start);
 	ret = pam_acct_mgmt (pamh, 0);
+	timing_stop ("pam_account", &start);
 	if (PAM_SUCCESS != ret) {
 		if (caller_is_root) {
 			fprintf (stderr,
@@ -625,11 +622,16 @@ static /*@only@*/struct passwd * check_perms (void)
 	const void *tmp_name;
 	int ret;
 #endif				/* !USE_PAM */
+	struct passwd *pw;
+	struct timespec start;
+
 	/*
 	 * The password file entries for the user is gotten and the account
 	 * validated.
 	 */
-	struct passwd *pw = xgetpwnam (name);
+	timing_start (&start);
+	pw = xgetpwnam (name);
+	timing_stop ("nss", &start);
 	if (NULL == pw) {
 		(void) fprintf (stderr,
 		                _("No passwd entry for user '%s'\n"), name);
@@ -975,6 +977,7 @@ int main (int argc, char **argv)
 {
 	const char *cp;
 	struct passwd *pw = NULL;
+	struct timespec start;
 
 #ifdef USE_PAM
 	int ret;
@@ -987,6 +990,7 @@ int main (int argc, char **argv)
 	save_caller_context (argv);
 
 	OPENLOG ("su");
+	timing_init ();
 
 	process_flags (argc, argv);
 
@@ -1067,7 +1071,9 @@ int main (int argc, char **argv)
 	 * pam_setcred() may do things like resource limits, console groups,
 	 * and much more, depending on the configured modules
 	 */
+	timing_start (&start);
 	ret = pam_setcred (pamh, PAM_ESTABLISH_CRED);
+	timing_stop ("pam_setcred", &start);
 	if (PAM_SUCCESS != ret) {
 		SYSLOG ((LOG_ERR, "pam_setcred: %s", pam_strerror (pamh, ret)));
 		fprintf (stderr, _("%s: %s\n"), Prog, pam_strerror (pamh, ret));
@@ -1075,7 +1081,9 @@ int main (int argc, char **argv)
 		exit (1);
 	}
 
+	timing_start (&start);
 	ret = pam_open_session (pamh, 0);
+	timing_stop ("pam_session", &start);
 	if (PAM_SUCCESS != ret) {
 		SYSLOG ((LOG_ERR, "pam_open_session: %s",
 		         pam_strerror (pamh, ret)));
@@ -1094,7 +1102,9 @@ int main (int argc, char **argv)
 #else				/* !USE_PAM */
 	/* no limits if su from root (unless su must fake login's behavior) */
 	if (!caller_is_root || fakelogin) {
+		timing_start (&start);
 		setup_limits (pw);
+		timing_stop ("limits", &start);
 	}
 
 	if (setup_uid_gid (pw, caller_on_console) != 0) {
@@ -1117,7 +1127,11 @@ int main (int argc, char **argv)
 	close (audit_fd);
 #endif				/* WITH_AUDIT */
 
+	timing_start (&start);
 	set_environment (pw);
+	timing_stop ("env", &start);
+
+	timing_report (name);
 
 	if (!doshell) {
 		/* There is no need for a controlling terminal.
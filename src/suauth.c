@@ -30,16 +30,132 @@
 /* Really, I could do with a few const char's here defining all the
  * strings output to the user or the syslog. -- chris
  */
-static int applies (const char *, char *);
 
-static int isgrp (const char *, const char *);
+/*
+ * The file is read once into a table of rules, with the lists of users
+ * split into words. The groups of the two users are asked once to
+ * getgrouplist(), and the group of a GROUP word is looked up once, so
+ * that the rules are matched without enumerating the members of the
+ * groups.
+ */
+struct su_word {
+	char *text;
+	bool resolved;	/* for group names: gid was looked up */
+	bool found;
+	gid_t gid;
+};
+
+struct su_list {
+	struct su_word *words;
+	size_t count;
+};
+
+struct su_rule {
+	int line;
+	struct su_list to_users;
+	struct su_list from_users;
+	char *action;
+};
+
+/* The groups of a user, as returned by getgrouplist() */
+struct su_member {
+	/*@null@*/const char *name;
+	gid_t *gids;
+	int ngids;
+};
+
+static struct su_rule *rules = NULL;
+static size_t nrules = 0;
+static struct su_member members[2];
 
-static int lines = 0;
+static int load_rules (void);
+static int applies (const char *, struct su_list *, int);
+
+static bool isgrp (const char *, struct su_word *);
 
 
 int check_su_auth (const char *actual_id,
                    const char *wanted_id,
                    bool su_to_root)
+{
+	size_t i;
+
+	if (load_rules () != 0) {
+		return DENY;
+	}
+
+	for (i = 0; i < nrules; i++) {
+		struct su_rule *rule = &rules[i];
+		const char *action = rule->action;
+
+		if (!applies (wanted_id, &rule->to_users, rule->line))
+			continue;
+		if (!applies (actual_id, &rule->from_users, rule->line))
+			continue;
+		if (!strcmp (action, "DENY")) {
+			SYSLOG ((su_to_root ? LOG_WARN : LOG_NOTICE,
+				 "DENIED su from '%s' to '%s' (%s)\n",
+				 actual_id, wanted_id, SUAUTHFILE));
+			fputs (_("Access to su to that account DENIED.\n"),
+			       stderr);
+			return DENY;
+		} else if (!strcmp (action, "NOPASS")) {
+			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
+				 "NO password asked for su from '%s' to '%s' (%s)\n",
+				 actual_id, wanted_id, SUAUTHFILE));
+			fputs (_("Password authentication bypassed.\n"),stderr);
+			return NOPWORD;
+		} else if (!strcmp (action, "OWNPASS")) {
+			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
+				 "su from '%s' to '%s': asking for user's own password (%s)\n",
+				 actual_id, wanted_id, SUAUTHFILE));
+			fputs (_("Please enter your OWN password as authentication.\n"),
+			       stderr);
+			return OWNPWORD;
+		} else {
+			SYSLOG ((LOG_ERR,
+				 "%s, line %d: unrecognized action!\n",
+				 SUAUTHFILE, rule->line));
+		}
+	}
+	return NOACTION;
+}
+
+/*
+ * split_list - split a list of users of a rule into words
+ */
+static void split_list (struct su_list *list, char *text)
+{
+	const char split[] = ", ";
+	char *tok;
+
+	list->words = NULL;
+	list->count = 0;
+	for (tok = strtok (text, split); tok != NULL;
+	     tok = strtok (NULL, split)) {
+		if (0 == (list->count % 64)) {
+			struct su_word *words;
+
+			words = realloc (list->words,
+			                 (list->count + 64) * sizeof *words);
+			if (NULL == words) {
+				fputs (_("Out of memory.\n"), stderr);
+				exit (EXIT_FAILURE);
+			}
+			list->words = words;
+		}
+		memzero (&list->words[list->count], sizeof *list->words);
+		list->words[list->count].text = tok;
+		list->count++;
+	}
+}
+
+/*
+ * load_rules - read the rules of the file
+ *
+ *	Return -1 if the file exists but cannot be read.
+ */
+static int load_rules (void)
 {
 	int posn, endline;
 	const char field[] = ":";
@@ -48,6 +164,7 @@ int check_su_auth (const char *actual_id,
 	char *to_users;
 	char *from_users;
 	char *action;
+	int lines = 0;
 
 	if (!(authfile_fd = fopen (SUAUTHFILE, "r"))) {
 		int err = errno;
@@ -58,15 +175,18 @@ int check_su_auth (const char *actual_id,
 		 * file descriptors limit etc., so deny access.  --marekm
 		 */
 		if (ENOENT == err) {
-			return NOACTION;
+			return 0;
 		}
 		SYSLOG ((LOG_ERR,
 		         "could not open/read config file '%s': %s\n",
 		         SUAUTHFILE, strerror (err)));
-		return DENY;
+		return -1;
 	}
 
 	while (fgets (temp, sizeof (temp), authfile_fd) != NULL) {
+		struct su_rule *rule;
+		char *copy;
+
 		lines++;
 		endline = strlen(temp) - 1;
 
@@ -91,68 +211,53 @@ int check_su_auth (const char *actual_id,
 		    || temp[posn] == '\0') {
 			continue;
 		}
-		if (!(to_users = strtok (temp + posn, field))
+		copy = xstrdup (temp + posn);
+		if (!(to_users = strtok (copy, field))
 		    || !(from_users = strtok (NULL, field))
 		    || !(action = strtok (NULL, field))
 		    || strtok (NULL, field)) {
 			SYSLOG ((LOG_ERR,
 				 "%s, line %d. Bad number of fields.\n",
 				 SUAUTHFILE, lines));
+			free (copy);
 			continue;
 		}
 
-		if (!applies (wanted_id, to_users))
-			continue;
-		if (!applies (actual_id, from_users))
-			continue;
-		if (!strcmp (action, "DENY")) {
-			SYSLOG ((su_to_root ? LOG_WARN : LOG_NOTICE,
-				 "DENIED su from '%s' to '%s' (%s)\n",
-				 actual_id, wanted_id, SUAUTHFILE));
-			fputs (_("Access to su to that account DENIED.\n"),
-			       stderr);
-			fclose (authfile_fd);
-			return DENY;
-		} else if (!strcmp (action, "NOPASS")) {
-			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
-				 "NO password asked for su from '%s' to '%s' (%s)\n",
-				 actual_id, wanted_id, SUAUTHFILE));
-			fputs (_("Password authentication bypassed.\n"),stderr);
-			fclose (authfile_fd);
-			return NOPWORD;
-		} else if (!strcmp (action, "OWNPASS")) {
-			SYSLOG ((su_to_root ? LOG_NOTICE : LOG_INFO,
-				 "su from '%s' to '%s': asking for user's own password (%s)\n",
-				 actual_id, wanted_id, SUAUTHFILE));
-			fputs (_("Please enter your OWN password as authentication.\n"),
-			       stderr);
-			fclose (authfile_fd);
-			return OWNPWORD;
-		} else {
-			SYSLOG ((LOG_ERR,
-				 "%s, line %d: unrecognized action!\n",
-				 SUAUTHFILE, lines));
+		if (0 == (nrules % 64)) {
+			rule = realloc (rules, (nrules + 64) * sizeof *rules);
+			if (NULL == rule) {
+				fputs (_("Out of memory.\n"), stderr);
+				exit (EXIT_FAILURE);
+			}
+			rules = rule;
 		}
+		rule = &rules[nrules];
+		rule->line = lines;
+		rule->action = action;
+		/* The fields are already terminated: split them in turn */
+		split_list (&rule->to_users, to_users);
+		split_list (&rule->from_users, from_users);
+		nrules++;
 	}
 	fclose (authfile_fd);
-	return NOACTION;
+	return 0;
 }
 
-static int applies (const char *single, char *list)
+static int applies (const char *single, struct su_list *list, int line)
 {
-	const char split[] = ", ";
-	char *tok;
+	size_t i;
 
 	int state = 0;
 
-	for (tok = strtok (list, split); tok != NULL;
-	     tok = strtok (NULL, split)) {
+	for (i = 0; i < list->count; i++) {
+		struct su_word *word = &list->words[i];
+		const char *tok = word->text;
 
 		if (!strcmp (tok, "ALL")) {
 			if (state != 0) {
 				SYSLOG ((LOG_ERR,
 					 "%s, line %d: ALL in bad place\n",
-					 SUAUTHFILE, lines));
+					 SUAUTHFILE, line));
 				return 0;
 			}
 			state = 1;
@@ -160,7 +265,7 @@ static int applies (const char *single, char *list)
 			if (state != 1) {
 				SYSLOG ((LOG_ERR,
 					 "%s, line %d: EXCEPT in bas place\n",
-					 SUAUTHFILE, lines));
+					 SUAUTHFILE, line));
 				return 0;
 			}
 			state = 2;
@@ -168,7 +273,7 @@ static int applies (const char *single, char *list)
 			if ((state != 0) && (state != 2)) {
 				SYSLOG ((LOG_ERR,
 					 "%s, line %d: GROUP in bad place\n",
-					 SUAUTHFILE, lines));
+					 SUAUTHFILE, line));
 				return 0;
 			}
 			state = (state == 0) ? 3 : 4;
@@ -181,18 +286,18 @@ static int applies (const char *single, char *list)
 			case 1:	/* An all */
 				SYSLOG ((LOG_ERR,
 					 "%s, line %d: expect another token after ALL\n",
-					 SUAUTHFILE, lines));
+					 SUAUTHFILE, line));
 				return 0;
 			case 2:	/* All except */
 				if (!strcmp (tok, single))
 					return 0;
 				break;
 			case 3:	/* Group */
-				if (isgrp (single, tok))
+				if (isgrp (single, word))
 					return 1;
 				break;
 			case 4:	/* All except group */
-				if (isgrp (single, tok))
+				if (isgrp (single, word))
 					return 0;
 				/* FALL THRU */
 			}
@@ -203,15 +308,66 @@ static int applies (const char *single, char *list)
 	return 0;
 }
 
-static int isgrp (const char *name, const char *group)
+/*
+ * get_member - Get the groups of a user
+ *
+ *	The groups are asked once for each of the two users.
+ */
+static /*@null@*/struct su_member *get_member (const char *name)
 {
+	size_t i;
+
+	for (i = 0; i < NITEMS (members); i++) {
+		if (NULL == members[i].name) {
+			/*
+			 * Ask for (gid_t) -1 instead of the primary group:
+			 * only the groups listing the user as a member
+			 * match, as with the members of getgrnam().
+			 */
+			members[i].name = name;
+			members[i].ngids = get_grouplist (name, (gid_t) -1,
+			                                  &members[i].gids);
+			return &members[i];
+		}
+		if (strcmp (members[i].name, name) == 0) {
+			return &members[i];
+		}
+	}
+	return NULL;
+}
+
+static bool isgrp (const char *name, struct su_word *group)
+{
+	struct su_member *member;
 	struct group *grp;
+	int i;
 
-	grp = getgrnam (group); /* local, no need for xgetgrnam */
+	if (!group->resolved) {
+		grp = getgrnam (group->text); /* local, no need for xgetgrnam */
+		group->resolved = true;
+		group->found = (NULL != grp);
+		if (group->found) {
+			group->gid = grp->gr_gid;
+		}
+	}
+	if (!group->found)
+		return false;
 
-	if (!grp || !grp->gr_mem)
-		return 0;
+	member = get_member (name);
+	if ((NULL == member) || (member->ngids < 0)) {
+		/* fall back to the members of the group */
+		grp = getgrnam (group->text);
+		if (!grp || !grp->gr_mem)
+			return false;
+		return is_on_list (grp->gr_mem, name);
+	}
 
-	return is_on_list (grp->gr_mem, name);
+	for (i = 0; i < member->ngids; i++) {
+		if (   (member->gids[i] == group->gid)
+		    && (member->gids[i] != (gid_t) -1)) {
+			return true;
+		}
+	}
+	return false;
 }
 #endif				/* SU_ACCESS */
@@ -20,6 +20,7 @@
 #include <lastlog.h>
 #include <libgen.h>
 #include <pwd.h>
+#include <setjmp.h>
 #ifdef ACCT_TOOLS_SETUID
 #ifdef USE_PAM
 #include "pam_defs.h"
@@ -30,15 +31,16 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <stdint.h>
 #include <time.h>
 #include <unistd.h>
+#include "acctstate.h"
 #include "chkname.h"
+#include "commonio.h"
 #include "defines.h"
 #include "faillog.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -74,6 +76,12 @@
 #ifndef LASTLOG_FILE
 #define LASTLOG_FILE "/var/log/lastlog"
 #endif
+#ifndef TALLYLOG_FILE
+#define TALLYLOG_FILE "/var/log/tallylog"
+#endif
+#ifndef FAILLOCK_DIR
+#define FAILLOCK_DIR "/var/run/faillock"
+#endif
 /*
  * Global variables
  */
@@ -131,6 +139,17 @@ static gid_t sub_gid_start;	/* New subordinate gid range */
 static bool pw_locked = false;
 static bool gr_locked = false;
 static bool spw_locked = false;
+
+/* UID leased before the databases were locked (RESERVE_IDS) */
+static bool uid_reserved = false;
+static uid_t reserved_uid;
+/* IDs picked before the databases were locked (OPTIMISTIC_LOCKING) */
+static bool uid_planned = false;
+static bool gid_planned = false;
+static uid_t planned_uid;
+static gid_t planned_gid;
+static unsigned long long planned_pw_generation;
+static unsigned long long planned_gr_generation;
 static char **user_groups;	/* NULL-terminated list */
 static long sys_ngroups;
 static bool do_grp_update = false;	/* group files need to be updated */
@@ -158,6 +177,7 @@ static bool
     rflg = false,		/* create a system account */
     sflg = false,		/* shell program for new account */
     subvolflg = false,		/* create subvolume home on BTRFS */
+    progressflg = false,	/* report the progress of the copy of the skeleton */
     uflg = false,		/* specify user ID for new account */
     Uflg = false;		/* create a group having the same name as the user */
 
@@ -166,6 +186,86 @@ static bool
 #endif				/* WITH_SELINUX */
 
 static bool home_added = false;
+static bool home_snapshot = false;	/* the home is a snapshot of the skeleton */
+
+/*
+ * --batch FILE adds the users of the records of FILE, one set of useradd
+ * arguments per line, with a single lock and write of the databases.
+ * While a record is processed, record_env is set, and the errors which
+ * would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+
+/*
+ * --async-setup returns once the databases are written: the homes and
+ * mail spools are created, and the useradd-post.d scripts run, by a
+ * background process. It reports the setup of each user in its status
+ * file, in ASYNC_STATUS_DIR: "running PID", the error messages, and
+ * "exit STATUS" at the end.
+ */
+#define ASYNC_STATUS_DIR "/var/lib/shadow/useradd"
+static bool asyncflg = false;
+
+struct batch_record {
+	unsigned int line;
+	int argc;
+	char **argv;
+	bool added;
+
+	/* Values needed once the databases are written */
+	const char *name;
+	const char *home;
+	const char *prefix_home;
+	const char *template;
+	const char *mail_spool;
+	uid_t uid;
+	gid_t gid;
+	bool lflg;
+	bool mflg;
+	bool rflg;
+	bool subvolflg;
+	bool progressflg;
+#ifdef WITH_SELINUX
+	const char *selinux;
+#endif				/* WITH_SELINUX */
+};
+
+/*
+ * The faillog, lastlog and tallylog files, and the faillock directory,
+ * are opened when the entries of the first new user are reset, and kept
+ * open for the other users of --batch. The entries are written with
+ * pwrite(), and the files are synced once, by close_log_files().
+ */
+struct log_file {
+	const char *path;
+	int fd;		/* -1 if not opened */
+	bool failed;	/* the file could not be opened */
+};
+
+/* The entries of pam_tally2, indexed by UID */
+struct tallylog {
+	char fail_line[52];
+	uint16_t reserved;
+	uint16_t fail_cnt;
+	uint64_t fail_time;
+};
+
+static struct log_file faillog_file = { FAILLOG_FILE, -1, false };
+static struct log_file lastlog_file = { LASTLOG_FILE, -1, false };
+static struct log_file tallylog_file = { TALLYLOG_FILE, -1, false };
+static struct log_file faillock_dir = { FAILLOCK_DIR, -1, false };
+
+/* Defaults restored before each record */
+static struct {
+	const char *home;
+	const char *shell;
+	const char *template;
+	long inactive;
+	int bad_names;
+	char **groups;
+	bool grp_update;
+} record_defaults;
 
 /*
  * exit status values
@@ -219,13 +319,44 @@ static void unlock_group_files (void);
 static void open_files (void);
 static void open_group_files (void);
 static void open_shadow (void);
+static void reserve_user_id (void);
+static void plan_user_ids (void);
+static bool check_plan (void);
+static void release_files (void);
+static void lock_planned_files (void);
+static int log_file_fd (struct log_file *lf, off_t offset);
+static void close_log_files (void);
 static void faillog_reset (uid_t);
 static void lastlog_reset (uid_t);
-static void tallylog_reset (const char *);
+static void tallylog_reset (uid_t, const char *);
+static void faillock_reset (const char *);
 static void usr_update (unsigned long subuid_count, unsigned long subgid_count);
 static void create_home (void);
 static void create_mail (void);
 static void check_uid_range(int rflg, uid_t user_id);
+static void flag_exit (int code);
+static void reject_in_record (const char *option);
+#ifdef ENABLE_SUBIDS
+static bool want_subids (void);
+#endif				/* ENABLE_SUBIDS */
+static void check_new_user (void);
+static void add_new_user (unsigned long subuid_count,
+                          unsigned long subgid_count);
+static void setup_new_user (void);
+static /*@null@*/struct batch_record *read_batch (const char *file,
+                                                  size_t *count);
+static void save_record_defaults (void);
+static void reset_record (void);
+static int add_record (struct batch_record *rec,
+                       unsigned long subuid_count,
+                       unsigned long subgid_count);
+static int setup_record (struct batch_record *rec);
+static int add_batch (const char *file,
+                      unsigned long subuid_count,
+                      unsigned long subgid_count);
+static int setup_user (void);
+static bool setup_async (/*@null@*/struct batch_record *records,
+                         size_t count);
 
 /*
  * fail_exit - undo as much as possible
@@ -239,6 +370,12 @@ static void fail_exit (int code)
 			         Prog, prefix_user_home);
 			SYSLOG ((LOG_ERR, "failed to remove %s", prefix_user_home));
 		}
+		home_added = false;
+	}
+
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
 	}
 
 	if (spw_locked) {
@@ -810,15 +947,19 @@ static int get_groups (char *list)
 	struct group *grp;
 	int errors = 0;
 	int ngroups = 0;
+	bool opened = false;
 
 	if ('\0' == *list) {
 		return 0;
 	}
 
 	/*
-	 * Open the group files
+	 * Open the group files, unless --batch already did
 	 */
-	open_group_files ();
+	if (!gr_locked) {
+		open_group_files ();
+		opened = true;
+	}
 
 	/*
 	 * So long as there is some data to be converted, strip off
@@ -885,14 +1026,19 @@ static int get_groups (char *list)
 		}
 
 		/*
-		 * Add the group name to the user's list of groups.
+		 * Add the group name to the user's list of groups, once.
 		 */
-		user_groups[ngroups++] = xstrdup (grp->gr_name);
+		user_groups[ngroups] = NULL;
+		if (!is_on_list (user_groups, grp->gr_name)) {
+			user_groups[ngroups++] = xstrdup (grp->gr_name);
+		}
 		gr_free (grp);
 	} while (NULL != list);
 
-	close_group_files ();
-	unlock_group_files ();
+	if (opened) {
+		close_group_files ();
+		unlock_group_files ();
+	}
 
 	user_groups[ngroups] = NULL;
 
@@ -950,20 +1096,32 @@ static struct group * get_local_group(char * grp_name)
 static void usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
 	                  "       %s -D\n"
 	                  "       %s -D [options]\n"
+	                  "       %s --batch FILE\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog, Prog, Prog);
+	                Prog, Prog, Prog, Prog);
+	(void) fputs (_("      --async-setup             create the home directory and mail spool in\n"
+	                "                                the background\n"), usageout);
 	(void) fputs (_("      --badname                 do not check for bad names\n"), usageout);
+	(void) fputs (_("      --batch FILE              add the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -b, --base-dir BASE_DIR       base directory for the home directory of the\n"
 	                "                                new account\n"), usageout);
 #ifdef WITH_BTRFS
 	(void) fputs (_("      --btrfs-subvolume-home    use BTRFS subvolume for home directory\n"), usageout);
 #endif
 	(void) fputs (_("  -c, --comment COMMENT         GECOS field of the new account\n"), usageout);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -d, --home-dir HOME_DIR       home directory of the new account\n"), usageout);
 	(void) fputs (_("  -D, --defaults                print or change default useradd configuration\n"), usageout);
 	(void) fputs (_("  -e, --expiredate EXPIRE_DATE  expiration date of the new account\n"), usageout);
@@ -990,6 +1148,10 @@ static void usage (int status)
 	(void) fputs (_("  -r, --system                  create a system account\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --progress                report the progress of the copy of the\n"
+	                "                                skeleton directory\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs (_("  -s, --shell SHELL             login shell of the new account\n"), usageout);
 	(void) fputs (_("  -u, --uid UID                 user ID of the new account\n"), usageout);
 	(void) fputs (_("  -U, --user-group              create a group with the same name as the user\n"), usageout);
@@ -1079,6 +1241,7 @@ static void grp_update (void)
 {
 	const struct group *grp;
 	struct group *ngrp;
+	size_t i;
 
 #ifdef	SHADOWGRP
 	const struct sgrp *sgrp;
@@ -1086,18 +1249,14 @@ static void grp_update (void)
 #endif
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * Find the groups the user is a member of with the index of the
+	 * group file. user_groups lists each group once.
 	 * FIXME: we currently do not check that all groups of user_groups
 	 *        were completed with the new user.
 	 */
-	for (gr_rewind (), grp = gr_next (); NULL != grp; grp = gr_next ()) {
-
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		if (!is_on_list (user_groups, grp->gr_name)) {
+	for (i = 0; NULL != user_groups[i]; i++) {
+		grp = gr_locate (user_groups[i]);
+		if (NULL == grp) {
 			continue;
 		}
 
@@ -1154,25 +1313,15 @@ static void grp_update (void)
 		return;
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of. The administrative list isn't
-	 * modified.
+	 * Same for the shadow groups of the groups the user is a member
+	 * of. The administrative list isn't modified.
 	 */
-	for (sgr_rewind (), sgrp = sgr_next (); NULL != sgrp; sgrp = sgr_next ()) {
-
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 * FIXME: is it really needed?
-		 *        This would be important only if the group is in
-		 *        user_groups. All these groups should be checked
-		 *        for existence with gr_locate already.
-		 */
-		if (gr_locate (sgrp->sg_name) == NULL) {
+	for (i = 0; NULL != user_groups[i]; i++) {
+		if (gr_locate (user_groups[i]) == NULL) {
 			continue;
 		}
-
-		if (!is_on_list (user_groups, sgrp->sg_name)) {
+		sgrp = sgr_locate (user_groups[i]);
+		if (NULL == sgrp) {
 			continue;
 		}
 
@@ -1226,6 +1375,32 @@ static void grp_update (void)
 #endif				/* SHADOWGRP */
 }
 
+/*
+ * flag_exit - exit on an invalid argument
+ *
+ *	For a record of --batch, only the record fails.
+ */
+static void flag_exit (int code)
+{
+	if (NULL != record_env) {
+		longjmp (*record_env, code);
+	}
+	exit (code);
+}
+
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
+{
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
+	}
+}
+
 /*
  * process_flags - perform command line argument setting
  *
@@ -1237,6 +1412,8 @@ static void process_flags (int argc, char **argv)
 {
 	const struct group *grp;
 	bool anyflag = false;
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
 	char *cp;
 	struct stat st;
 
@@ -1248,10 +1425,13 @@ static void process_flags (int argc, char **argv)
 		static struct option long_options[] = {
 			{"base-dir",       required_argument, NULL, 'b'},
 #ifdef WITH_BTRFS
+			{"async-setup",    no_argument,       NULL, 205},
 			{"btrfs-subvolume-home", no_argument, NULL, 200},
 #endif
 			{"badname",        no_argument,       NULL, 201},
+			{"batch",          required_argument, NULL, 203},
 			{"comment",        required_argument, NULL, 'c'},
+			{"deadline",       required_argument, NULL, 206},
 			{"home-dir",       required_argument, NULL, 'd'},
 			{"defaults",       no_argument,       NULL, 'D'},
 			{"expiredate",     required_argument, NULL, 'e'},
@@ -1273,6 +1453,8 @@ static void process_flags (int argc, char **argv)
 			{"system",         no_argument,       NULL, 'r'},
 			{"root",           required_argument, NULL, 'R'},
 			{"prefix",         required_argument, NULL, 'P'},
+			{"progress",       no_argument,       NULL, 202},
+			{"shard",          required_argument, NULL, 204},
 			{"shell",          required_argument, NULL, 's'},
 			{"uid",            required_argument, NULL, 'u'},
 			{"user-group",     no_argument,       NULL, 'U'},
@@ -1298,7 +1480,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid base directory '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				def_home = optarg;
 				bflg = true;
@@ -1308,13 +1490,35 @@ static void process_flags (int argc, char **argv)
 				break;
 			case 201:
 				allow_bad_names = true;
+				batch_opts++;
+				break;
+			case 202:
+				progressflg = true;
+				break;
+			case 203:
+				reject_in_record ("--batch");
+				batch_file = optarg;
+				batch_opts++;
+				break;
+			case 204: /* no-op, handled in process_shard_flag () */
+				reject_in_record ("--shard");
+				batch_opts++;
+				break;
+			case 206: /* no-op, handled in process_deadline_flag () */
+				reject_in_record ("--deadline");
+				batch_opts++;
+				break;
+			case 205:
+				reject_in_record ("--async-setup");
+				asyncflg = true;
+				batch_opts++;
 				break;
 			case 'c':
 				if (!VALID (optarg)) {
 					fprintf (stderr,
 					         _("%s: invalid comment '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				user_comment = optarg;
 				cflg = true;
@@ -1325,12 +1529,13 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid home directory '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				user_home = optarg;
 				dflg = true;
 				break;
 			case 'D':
+				reject_in_record ("-D");
 				if (anyflag) {
 					usage (E_USAGE);
 				}
@@ -1343,7 +1548,7 @@ static void process_flags (int argc, char **argv)
 						fprintf (stderr,
 						         _("%s: invalid date '%s'\n"),
 						         Prog, optarg);
-						exit (E_BAD_ARG);
+						flag_exit (E_BAD_ARG);
 					}
 				} else {
 					user_expire = -1;
@@ -1357,7 +1562,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: shadow passwords required for -e\n"),
 					         Prog);
-					exit (E_USAGE);
+					flag_exit (E_USAGE);
 				}
 				if (Dflg) {
 					def_expire = optarg;
@@ -1370,7 +1575,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid numeric argument '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				/*
 				 * -f -1 is allowed
@@ -1380,7 +1585,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: shadow passwords required for -f\n"),
 					         Prog);
-					exit (E_USAGE);
+					flag_exit (E_USAGE);
 				}
 				fflg = true;
 				break;
@@ -1395,7 +1600,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: group '%s' does not exist\n"),
 					         Prog, optarg);
-					exit (E_NOTFOUND);
+					flag_exit (E_NOTFOUND);
 				}
 				if (Dflg) {
 					def_group = grp->gr_gid;
@@ -1407,7 +1612,7 @@ static void process_flags (int argc, char **argv)
 				break;
 			case 'G':
 				if (get_groups (optarg) != 0) {
-					exit (E_NOTFOUND);
+					flag_exit (E_NOTFOUND);
 				}
 				if (NULL != user_groups[0]) {
 					do_grp_update = true;
@@ -1415,6 +1620,7 @@ static void process_flags (int argc, char **argv)
 				Gflg = true;
 				break;
 			case 'h':
+				reject_in_record ("-h");
 				usage (E_SUCCESS);
 				break;
 			case 'k':
@@ -1427,18 +1633,19 @@ static void process_flags (int argc, char **argv)
 				 * example: -K UID_MIN=100 -K UID_MAX=499
 				 * note: -K UID_MIN=10,UID_MAX=499 doesn't work yet
 				 */
+				reject_in_record ("-K");
 				cp = strchr (optarg, '=');
 				if (NULL == cp) {
 					fprintf (stderr,
 					         _("%s: -K requires KEY=VALUE\n"),
 					         Prog);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				/* terminate name, point to value */
 				*cp = '\0';
 				cp++;
 				if (putdef_str (optarg, cp) < 0) {
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				break;
 			case 'l':
@@ -1461,7 +1668,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid field '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				user_pass = optarg;
 				break;
@@ -1469,8 +1676,12 @@ static void process_flags (int argc, char **argv)
 				rflg = true;
 				break;
 			case 'R': /* no-op, handled in process_root_flag () */
+				reject_in_record ("-R");
+				batch_opts++;
 				break;
 			case 'P': /* no-op, handled in process_prefix_flag () */
+				reject_in_record ("-P");
+				batch_opts++;
 				break;
 			case 's':
 				if (   ( !VALID (optarg) )
@@ -1480,7 +1691,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid shell '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				if (    '\0' != optarg[0]
 				     && '*'  != optarg[0]
@@ -1502,7 +1713,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid user ID '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				uflg = true;
 				break;
@@ -1515,7 +1726,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: -Z cannot be used with --prefix\n"),
 					         Prog);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				if (is_selinux_enabled () > 0) {
 					user_selinux = optarg;
@@ -1524,7 +1735,7 @@ static void process_flags (int argc, char **argv)
 					         _("%s: -Z requires SELinux enabled kernel\n"),
 					         Prog);
 
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				break;
 #endif				/* WITH_SELINUX */
@@ -1532,9 +1743,21 @@ static void process_flags (int argc, char **argv)
 				usage (E_USAGE);
 			}
 			anyflag = true;
+			nopts++;
 		}
 	}
 
+	/*
+	 * --batch only accepts -R, -P and --badname, the other options are
+	 * given in the records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	if (!gflg && !Nflg && !Uflg) {
 		/* Get the settings from login.defs */
 		Uflg = getdef_bool ("USERGROUPS_ENAB");
@@ -1603,7 +1826,7 @@ static void process_flags (int argc, char **argv)
 			              user_name, AUDIT_NO_ID,
 			              SHADOW_AUDIT_FAILURE);
 #endif
-			exit (E_BAD_ARG);
+			flag_exit (E_BAD_ARG);
 		}
 		if (!dflg) {
 			char *uh;
@@ -1674,34 +1897,82 @@ static void process_flags (int argc, char **argv)
  */
 static void close_files (void)
 {
-	if (pw_close () == 0) {
-		fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, pw_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", pw_dbname ()));
-		fail_exit (E_PW_UPDATE);
-	}
-	if (is_shadow_pwd && (spw_close () == 0)) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"), Prog, spw_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
-		fail_exit (E_PW_UPDATE);
-	}
+	struct commonio_txn txn;
+	const struct commonio_db *failed;
+	const char *dbname;
+	int code;
+	bool tcb_shadow = false;
 
-	close_group_files ();
+#ifdef WITH_TCB
+	/*
+	 * With tcb, the shadow file of the user must be written with the
+	 * privileges spw_close() switches to, so it is not part of the
+	 * transaction. It is written first: a failure then leaves the
+	 * other databases unmodified.
+	 */
+	if (is_shadow_pwd && getdef_bool ("USE_TCB")) {
+		tcb_shadow = true;
+		if (spw_close () == 0) {
+			fprintf (stderr,
+			         _("%s: failure while writing changes to %s\n"), Prog, spw_dbname ());
+			SYSLOG ((LOG_ERR, "failure while writing changes to %s", spw_dbname ()));
+			fail_exit (E_PW_UPDATE);
+		}
+	}
+#endif				/* WITH_TCB */
 
+	/*
+	 * Write all the databases together, so that a failure leaves
+	 * none of them modified.
+	 */
+	commonio_txn_init (&txn);
+	(void) commonio_txn_add (&txn, __pw_get_db ());
+	if (is_shadow_pwd && !tcb_shadow) {
+		(void) commonio_txn_add (&txn, __spw_get_db ());
+	}
+	if (do_grp_update) {
+		(void) commonio_txn_add (&txn, __gr_get_db ());
+#ifdef	SHADOWGRP
+		if (is_shadow_grp) {
+			(void) commonio_txn_add (&txn, __sgr_get_db ());
+		}
+#endif /* SHADOWGRP */
+	}
 #ifdef ENABLE_SUBIDS
-	if (is_sub_uid  && (sub_uid_close () == 0)) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"), Prog, sub_uid_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_uid_dbname ()));
-		fail_exit (E_SUB_UID_UPDATE);
+	if (is_sub_uid) {
+		(void) commonio_txn_add (&txn, __sub_uid_get_db ());
 	}
-	if (is_sub_gid  && (sub_gid_close () == 0)) {
-		fprintf (stderr,
-		         _("%s: failure while writing changes to %s\n"), Prog, sub_gid_dbname ());
-		SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_gid_dbname ()));
-		fail_exit (E_SUB_GID_UPDATE);
+	if (is_sub_gid) {
+		(void) commonio_txn_add (&txn, __sub_gid_get_db ());
 	}
 #endif				/* ENABLE_SUBIDS */
+
+	if (commonio_txn_commit (&txn) == 0) {
+		failed = txn.failed;
+		if (failed == __pw_get_db ()) {
+			dbname = pw_dbname ();
+			code = E_PW_UPDATE;
+		} else if (failed == __spw_get_db ()) {
+			dbname = spw_dbname ();
+			code = E_PW_UPDATE;
+#ifdef ENABLE_SUBIDS
+		} else if (failed == __sub_uid_get_db ()) {
+			dbname = sub_uid_dbname ();
+			code = E_SUB_UID_UPDATE;
+		} else if (failed == __sub_gid_get_db ()) {
+			dbname = sub_gid_dbname ();
+			code = E_SUB_GID_UPDATE;
+#endif				/* ENABLE_SUBIDS */
+		} else {
+			dbname = failed->filename;
+			code = E_GRP_UPDATE;
+		}
+		fprintf (stderr,
+		         _("%s: failure while writing changes to %s\n"), Prog, dbname);
+		SYSLOG ((LOG_ERR, "failure while writing changes to %s", dbname));
+		fail_exit (code);
+	}
+
 	if (is_shadow_pwd) {
 		if (spw_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, spw_dbname ());
@@ -1885,6 +2156,192 @@ static void open_files (void)
 #endif				/* ENABLE_SUBIDS */
 }
 
+/*
+ * reserve_user_id - pick and lease the UID of the user before the
+ *	databases are locked
+ *
+ *	The databases are only opened for reading, so that the useradd
+ *	running in parallel only wait for each other to commit. The UID
+ *	is checked again once the databases are locked.
+ */
+static void reserve_user_id (void)
+{
+	if (pw_open (O_RDONLY) == 0) {
+		return;
+	}
+	if (Uflg && (gr_open (O_RDONLY) == 0)) {
+		(void) pw_close ();
+		return;
+	}
+
+	if (reserve_new_uid (rflg, Uflg, &reserved_uid) < 0) {
+		fprintf (stderr, _("%s: can't create user\n"), Prog);
+		fail_exit (E_UID_IN_USE);
+	}
+	uid_reserved = true;
+
+	if (Uflg) {
+		(void) gr_close ();
+	}
+	(void) pw_close ();
+}
+
+/*
+ * plan_user_ids - pick the UID and the GID of the user before the
+ *	databases are locked
+ *
+ *	The databases are only opened for reading, and the generations
+ *	read are kept: once the databases are locked, the IDs only need to
+ *	be checked again if a database was written meanwhile (see
+ *	check_plan).
+ */
+static void plan_user_ids (void)
+{
+	uid_planned = false;
+	gid_planned = false;
+
+	planned_pw_generation = commonio_file_generation (pw_dbname ());
+	planned_gr_generation = commonio_file_generation (gr_dbname ());
+	if (pw_open (O_RDONLY) == 0) {
+		return;
+	}
+	if (gr_open (O_RDONLY) == 0) {
+		(void) pw_close ();
+		return;
+	}
+
+	if (uflg) {
+		planned_uid = user_id;
+	} else {
+		int ret;
+
+		if (getdef_bool ("RESERVE_IDS")) {
+			ret = reserve_new_uid (rflg, Uflg, &planned_uid);
+			if (ret >= 0) {
+				uid_reserved = true;
+				reserved_uid = planned_uid;
+			}
+		} else if (Uflg) {
+			ret = find_new_uid_gid (rflg, &planned_uid);
+		} else {
+			ret = find_new_uid (rflg, &planned_uid, NULL);
+		}
+		if (ret < 0) {
+			fprintf (stderr, _("%s: can't create user\n"), Prog);
+			fail_exit (E_UID_IN_USE);
+		}
+		uid_planned = true;
+	}
+
+	if (Uflg) {
+		if (find_new_gid (rflg, &planned_gid, &planned_uid) < 0) {
+			fprintf (stderr,
+			         _("%s: can't create group\n"),
+			         Prog);
+			fail_exit (4);
+		}
+		gid_planned = true;
+	}
+
+	(void) gr_close ();
+	(void) pw_close ();
+}
+
+/*
+ * check_plan - check the IDs picked by plan_user_ids once the databases
+ *	are locked
+ *
+ *	If passwd and group were not written since the IDs were picked,
+ *	they are used as they are. Otherwise, only the name of the user and
+ *	the IDs picked are looked up again.
+ *
+ *	Return false if another process took one of the IDs.
+ */
+static bool check_plan (void)
+{
+	if (!uid_planned && !gid_planned) {
+		return true;
+	}
+
+	if (   (0 != planned_pw_generation)
+	    && (0 != planned_gr_generation)
+	    && (commonio_file_generation (pw_dbname ()) == planned_pw_generation)
+	    && (commonio_file_generation (gr_dbname ()) == planned_gr_generation)) {
+		return true;
+	}
+
+	check_new_user ();
+	if (   uid_planned
+	    && (   (pw_locate_uid (planned_uid) != NULL)
+	        || (Uflg && (gr_locate_gid (planned_uid) != NULL)))) {
+		return false;
+	}
+	if (gid_planned && (gr_locate_gid (planned_gid) != NULL)) {
+		return false;
+	}
+	return true;
+}
+
+/*
+ * release_files - unlock the databases without writing them, and end
+ *	the lease of the UID picked, after a conflict with the plan
+ */
+static void release_files (void)
+{
+	if (uid_reserved) {
+		id_lease_release (pw_dbname (), reserved_uid);
+		if (Uflg) {
+			id_lease_release (gr_dbname (), reserved_uid);
+		}
+		uid_reserved = false;
+	}
+
+#ifdef ENABLE_SUBIDS
+	if (sub_gid_locked) {
+		(void) sub_gid_unlock ();
+		sub_gid_locked = false;
+	}
+	if (sub_uid_locked) {
+		(void) sub_uid_unlock ();
+		sub_uid_locked = false;
+	}
+#endif				/* ENABLE_SUBIDS */
+	unlock_group_files ();
+	if (pw_unlock () == 0) {
+		fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
+		SYSLOG ((LOG_ERR, "failed to unlock %s", pw_dbname ()));
+		/* continue */
+	}
+	pw_locked = false;
+}
+
+/*
+ * lock_planned_files - pick the IDs of the user, then lock and open the
+ *	databases (OPTIMISTIC_LOCKING)
+ *
+ *	When another process took the IDs picked meanwhile, they are picked
+ *	again, and after PLAN_ATTEMPTS conflicts, they are picked with the
+ *	databases locked, by add_new_user.
+ */
+#define PLAN_ATTEMPTS	3
+static void lock_planned_files (void)
+{
+	int attempt;
+
+	for (attempt = 0; attempt < PLAN_ATTEMPTS; attempt++) {
+		plan_user_ids ();
+		open_files ();
+		if (check_plan ()) {
+			return;
+		}
+		release_files ();
+	}
+
+	uid_planned = false;
+	gid_planned = false;
+	open_files ();
+}
+
 static void open_group_files (void)
 {
 	if (gr_lock () == 0) {
@@ -1920,7 +2377,8 @@ static void open_group_files (void)
 
 static void open_shadow (void)
 {
-	if (!is_shadow_pwd) {
+	/* --batch opens it before the records */
+	if (!is_shadow_pwd || spw_locked) {
 		return;
 	}
 	if (spw_lock () == 0) {
@@ -1930,6 +2388,7 @@ static void open_shadow (void)
 		fail_exit (E_PW_UPDATE);
 	}
 	spw_locked = true;
+	spw_compact ();
 	if (spw_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"),
@@ -2046,41 +2505,132 @@ static void grp_add (void)
 	do_grp_update = true;
 }
 
+/*
+ * log_file_fd - get the descriptor of a log file for the entry at offset
+ *
+ *	Return -1 if the file does not exist or has no entry at offset (it
+ *	has then nothing to reset), or if it could not be opened before.
+ *	Return -2 if it cannot be opened (errno is set).
+ */
+static int log_file_fd (struct log_file *lf, off_t offset)
+{
+	struct stat st;
+
+	if (-1 == lf->fd) {
+		if (   lf->failed
+		    || (stat (lf->path, &st) != 0)
+		    || (st.st_size <= offset)) {
+			return -1;
+		}
+		lf->fd = open (lf->path, O_RDWR | O_CLOEXEC);
+		if (-1 == lf->fd) {
+			lf->failed = true;
+			return -2;
+		}
+	} else if ((fstat (lf->fd, &st) != 0) || (st.st_size <= offset)) {
+		return -1;
+	}
+	return lf->fd;
+}
+
+/*
+ * close_log_files - sync and close the log files of the new users
+ */
+static void close_log_files (void)
+{
+	struct log_file *files[] = { &faillog_file, &lastlog_file,
+	                             &tallylog_file };
+	size_t i;
+
+	for (i = 0; i < sizeof files / sizeof files[0]; i++) {
+		if (-1 == files[i]->fd) {
+			continue;
+		}
+		if ((fsync (files[i]->fd) != 0) || (close (files[i]->fd) != 0)) {
+			fprintf (stderr, _("%s: failed to close %s: %s\n"),
+			         Prog, files[i]->path, strerror (errno));
+			SYSLOG ((LOG_WARN, "failed to close %s", files[i]->path));
+			/* continue */
+		}
+		files[i]->fd = -1;
+	}
+	if (-1 != faillock_dir.fd) {
+		(void) close (faillock_dir.fd);
+		faillock_dir.fd = -1;
+	}
+	if (acct_state_enabled ()) {
+		if ((acct_state_sync () != 0) || (acct_state_close () != 0)) {
+			fprintf (stderr, _("%s: failed to close %s: %s\n"),
+			         Prog, acct_state_file (), strerror (errno));
+			SYSLOG ((LOG_WARN, "failed to close %s",
+			         acct_state_file ()));
+		}
+	}
+}
+
+/*
+ * state_reset - clear a part of the record of uid in the account state
+ *               store
+ *
+ *	Return 0, or -1 with errno set.
+ */
+static int state_reset (uid_t uid, enum acct_part part)
+{
+	struct acct_state st;
+	int ret;
+
+	if (   (acct_state_open (true) != 0)
+	    || (acct_state_lock (F_WRLCK) != 0)) {
+		return -1;
+	}
+	ret = acct_state_get (uid, &st);
+	if (1 == ret) {
+		if (ACCT_LASTLOG == part) {
+			memzero (&st.ll, sizeof st.ll);
+		} else {
+			memzero (&st.fl, sizeof st.fl);
+		}
+		ret = acct_state_put (uid, &st);
+	}
+	(void) acct_state_lock (F_UNLCK);
+	return (-1 == ret) ? -1 : 0;
+}
+
 static void faillog_reset (uid_t uid)
 {
 	struct faillog fl;
 	int fd;
 	off_t offset_uid = (off_t) (sizeof fl) * uid;
-	struct stat st;
 
-	if (stat (FAILLOG_FILE, &st) != 0 || st.st_size <= offset_uid) {
+	if (acct_state_enabled ()) {
+		if (state_reset (uid, ACCT_FAILLOG) != 0) {
+			fprintf (stderr,
+			         _("%s: failed to reset the faillog entry of UID %lu: %s\n"),
+			         Prog, (unsigned long) uid, strerror (errno));
+			SYSLOG ((LOG_WARN, "failed to reset the faillog entry of UID %lu", (unsigned long) uid));
+		}
 		return;
 	}
 
-	memzero (&fl, sizeof (fl));
-
-	fd = open (FAILLOG_FILE, O_RDWR);
-	if (-1 == fd) {
+	fd = log_file_fd (&faillog_file, offset_uid);
+	if (-2 == fd) {
 		fprintf (stderr,
 		         _("%s: failed to open the faillog file for UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
 		SYSLOG ((LOG_WARN, "failed to open the faillog file for UID %lu", (unsigned long) uid));
 		return;
 	}
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, &fl, sizeof (fl)) != (ssize_t) sizeof (fl))
-	    || (fsync (fd) != 0)) {
+	if (fd < 0) {
+		return;
+	}
+
+	memzero (&fl, sizeof (fl));
+	if (pwrite (fd, &fl, sizeof (fl), offset_uid) != (ssize_t) sizeof (fl)) {
 		fprintf (stderr,
 		         _("%s: failed to reset the faillog entry of UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
 		SYSLOG ((LOG_WARN, "failed to reset the faillog entry of UID %lu", (unsigned long) uid));
 	}
-	if (close (fd) != 0) {
-		fprintf (stderr,
-		         _("%s: failed to close the faillog file for UID %lu: %s\n"),
-		         Prog, (unsigned long) uid, strerror (errno));
-		SYSLOG ((LOG_WARN, "failed to close the faillog file for UID %lu", (unsigned long) uid));
-	}
 }
 
 static void lastlog_reset (uid_t uid)
@@ -2089,11 +2639,6 @@ static void lastlog_reset (uid_t uid)
 	int fd;
 	off_t offset_uid = (off_t) (sizeof ll) * uid;
 	uid_t max_uid;
-	struct stat st;
-
-	if (stat (LASTLOG_FILE, &st) != 0 || st.st_size <= offset_uid) {
-		return;
-	}
 
 	max_uid = getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
 	if (uid > max_uid) {
@@ -2101,35 +2646,44 @@ static void lastlog_reset (uid_t uid)
 		return;
 	}
 
-	memzero (&ll, sizeof (ll));
+	if (acct_state_enabled ()) {
+		if (state_reset (uid, ACCT_LASTLOG) != 0) {
+			fprintf (stderr,
+			         _("%s: failed to reset the lastlog entry of UID %lu: %s\n"),
+			         Prog, (unsigned long) uid, strerror (errno));
+			SYSLOG ((LOG_WARN, "failed to reset the lastlog entry of UID %lu", (unsigned long) uid));
+		}
+		return;
+	}
 
-	fd = open (LASTLOG_FILE, O_RDWR);
-	if (-1 == fd) {
+	fd = log_file_fd (&lastlog_file, offset_uid);
+	if (-2 == fd) {
 		fprintf (stderr,
 		         _("%s: failed to open the lastlog file for UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
 		SYSLOG ((LOG_WARN, "failed to open the lastlog file for UID %lu", (unsigned long) uid));
 		return;
 	}
-	if (   (lseek (fd, offset_uid, SEEK_SET) != offset_uid)
-	    || (write (fd, &ll, sizeof (ll)) != (ssize_t) sizeof (ll))
-	    || (fsync (fd) != 0)) {
+	if (fd < 0) {
+		return;
+	}
+
+	memzero (&ll, sizeof (ll));
+	if (pwrite (fd, &ll, sizeof (ll), offset_uid) != (ssize_t) sizeof (ll)) {
 		fprintf (stderr,
 		         _("%s: failed to reset the lastlog entry of UID %lu: %s\n"),
 		         Prog, (unsigned long) uid, strerror (errno));
 		SYSLOG ((LOG_WARN, "failed to reset the lastlog entry of UID %lu", (unsigned long) uid));
 		/* continue */
 	}
-	if (close (fd) != 0) {
-		fprintf (stderr,
-		         _("%s: failed to close the lastlog file for UID %lu: %s\n"),
-		         Prog, (unsigned long) uid, strerror (errno));
-		SYSLOG ((LOG_WARN, "failed to close the lastlog file for UID %lu", (unsigned long) uid));
-		/* continue */
-	}
 }
 
-static void tallylog_reset (const char *user_name)
+/*
+ * run_pam_tally2 - reset the tallylog entry of a user with pam_tally2
+ *
+ *	Return -1 if pam_tally2 is not installed or failed.
+ */
+static int run_pam_tally2 (const char *user_name)
 {
 	const char pam_tally2[] = "/sbin/pam_tally2";
 	const char *pname;
@@ -2138,7 +2692,7 @@ static void tallylog_reset (const char *user_name)
 	int status;
 
 	if (access(pam_tally2, X_OK) == -1)
-		return;
+		return -1;
 
 	failed = 0;
 	switch (childpid = fork())
@@ -2164,15 +2718,72 @@ static void tallylog_reset (const char *user_name)
 		break;
 	}
 
-	if (failed)
-	{
+	return failed ? -1 : 0;
+}
+
+/*
+ * tallylog_reset - reset the pam_tally2 entry of a user
+ *
+ *	The entry is written in the tallylog file. pam_tally2 is only run
+ *	if the file cannot be opened.
+ */
+static void tallylog_reset (uid_t uid, const char *user_name)
+{
+	struct tallylog tl;
+	int fd;
+	off_t offset_uid = (off_t) (sizeof tl) * uid;
+
+	fd = log_file_fd (&tallylog_file, offset_uid);
+	if (-1 == fd) {
+		return;
+	}
+
+	memzero (&tl, sizeof (tl));
+	if (   ((-2 == fd) && (run_pam_tally2 (user_name) != 0))
+	    || (   (fd >= 0)
+	        && (pwrite (fd, &tl, sizeof (tl), offset_uid) != (ssize_t) sizeof (tl)))) {
 		fprintf (stderr,
 		         _("%s: failed to reset the tallylog entry of user \"%s\"\n"),
 		         Prog, user_name);
 		SYSLOG ((LOG_WARN, "failed to reset the tallylog entry of user \"%s\"", user_name));
 	}
+}
+
+/*
+ * faillock_reset - reset the pam_faillock records of a user
+ *
+ *	The file of the user in the faillock directory is truncated, as
+ *	faillock --reset does.
+ */
+static void faillock_reset (const char *user_name)
+{
+	int fd;
+
+	if (-1 == faillock_dir.fd) {
+		if (faillock_dir.failed) {
+			return;
+		}
+		faillock_dir.fd = open (faillock_dir.path,
+		                        O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (-1 == faillock_dir.fd) {
+			/* Without the directory, there is nothing to reset */
+			faillock_dir.failed = true;
+			return;
+		}
+	}
 
-	return;
+	fd = openat (faillock_dir.fd, user_name,
+	             O_WRONLY | O_TRUNC | O_NOFOLLOW | O_CLOEXEC);
+	if (-1 == fd) {
+		if (ENOENT != errno) {
+			fprintf (stderr,
+			         _("%s: failed to reset the faillock records of user \"%s\"\n"),
+			         Prog, user_name);
+			SYSLOG ((LOG_WARN, "failed to reset the faillock records of user \"%s\"", user_name));
+		}
+		return;
+	}
+	(void) close (fd);
 }
 
 /*
@@ -2342,8 +2953,22 @@ static void create_home (void)
 						         Prog, path);
 						fail_exit (E_HOMEDIR);
 					}
+					/*
+					 * If the skeleton is a subvolume, the home
+					 * is a snapshot of it, and only the
+					 * ownership of the files must be changed
+					 * (not with SELinux, as the files would
+					 * keep the context of the skeleton).
+					 */
+					if (   (btrfs_is_subvolume (def_template) > 0)
+#ifdef WITH_SELINUX
+					    && (is_selinux_enabled () <= 0)
+#endif
+					    && (btrfs_snapshot_subvolume (def_template, path) == 0)) {
+						home_snapshot = true;
+					}
 					// make subvolume to mount for user instead of directory
-					if (btrfs_create_subvolume(path)) {
+					else if (btrfs_create_subvolume(path)) {
 						fprintf (stderr,
 						         _("%s: failed to create BTRFS subvolume: %s\n"),
 						         Prog, path);
@@ -2499,133 +3124,31 @@ static void check_uid_range(int rflg, uid_t user_id)
 	}
 
 }
+#ifdef ENABLE_SUBIDS
 /*
- * main - useradd command
+ * want_subids - check if the new user gets subordinate IDs
  */
-int main (int argc, char **argv)
+static bool want_subids (void)
 {
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	pam_handle_t *pamh = NULL;
-	int retval;
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-#ifdef ENABLE_SUBIDS
-	uid_t uid_min;
-	uid_t uid_max;
-#endif
-	unsigned long subuid_count = 0;
-	unsigned long subgid_count = 0;
-
-	/*
-	 * Get my name so that I can use it to report errors.
-	 */
-	Prog = Basename (argv[0]);
-	log_set_progname(Prog);
-	log_set_logfd(stderr);
-
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
-
-	process_root_flag ("-R", argc, argv);
-
-	prefix = process_prefix_flag("-P", argc, argv);
-
-	OPENLOG ("useradd");
-#ifdef WITH_AUDIT
-	audit_help_open ();
-#endif
-
-	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
-	user_groups = (char **) xmalloc ((1 + sys_ngroups) * sizeof (char *));
-	/*
-	 * Initialize the list to be empty
-	 */
-	user_groups[0] = NULL;
-
-
-	is_shadow_pwd = spw_file_present ();
-#ifdef SHADOWGRP
-	is_shadow_grp = sgr_file_present ();
-#endif
-
-	get_defaults ();
-
-	process_flags (argc, argv);
+	uid_t uid_min = getdef_ulong ("UID_MIN", 1000UL);
+	uid_t uid_max = getdef_ulong ("UID_MAX", 60000UL);
 
-#ifdef ENABLE_SUBIDS
-	uid_min = getdef_ulong ("UID_MIN", 1000UL);
-	uid_max = getdef_ulong ("UID_MAX", 60000UL);
-	subuid_count = getdef_ulong ("SUB_UID_COUNT", 65536);
-	subgid_count = getdef_ulong ("SUB_GID_COUNT", 65536);
-	is_sub_uid = subuid_count > 0 && sub_uid_file_present () &&
-	    (!rflg || Fflg) &&
-	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
-	is_sub_gid = subgid_count > 0 && sub_gid_file_present () &&
-	    (!rflg || Fflg) &&
-	    (!user_id || (user_id <= uid_max && user_id >= uid_min));
+	return    (!rflg || Fflg)
+	       && (!user_id || (user_id <= uid_max && user_id >= uid_min));
+}
 #endif				/* ENABLE_SUBIDS */
 
-	if (run_parts ("/etc/shadow-maint/useradd-pre.d", user_name,
-			"useradd")) {
-		exit(1);
-	}
-
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	{
-		struct passwd *pampw;
-		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
-		if (pampw == NULL && getuid ()) {
-			fprintf (stderr,
-			         _("%s: Cannot determine your user name.\n"),
-			         Prog);
-			fail_exit (1);
-		}
-
-		retval = pam_start ("useradd", pampw?pampw->pw_name:"root", &conv, &pamh);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_authenticate (pamh, 0);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_acct_mgmt (pamh, 0);
-	}
-
-	if (PAM_SUCCESS != retval) {
-		fprintf (stderr, _("%s: PAM: %s\n"),
-		         Prog, pam_strerror (pamh, retval));
-		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
-		if (NULL != pamh) {
-			(void) pam_end (pamh, retval);
-		}
-		fail_exit (1);
-	}
-	(void) pam_end (pamh, retval);
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-	/*
-	 * See if we are messing with the defaults file, or creating
-	 * a new user.
-	 */
-	if (Dflg) {
-		if (gflg || bflg || fflg || eflg || sflg) {
-			exit ((set_defaults () != 0) ? 1 : 0);
-		}
-
-		show_defaults ();
-		exit (E_SUCCESS);
-	}
-
+/*
+ * check_new_user - check that the user does not exist yet
+ */
+static void check_new_user (void)
+{
 	/*
 	 * Start with a quick check to see if the user exists.
 	 */
-	if (prefix_getpwnam (user_name) != NULL) { /* local, no need for xgetpwnam */
+	/* local, no need for xgetpwnam */
+	if (   (prefix_getpwnam (user_name) != NULL)
+	    || (pw_locked && (pw_locate (user_name) != NULL))) {
 		fprintf (stderr, _("%s: user '%s' already exists\n"), Prog, user_name);
 #ifdef WITH_AUDIT
 		audit_logger (AUDIT_ADD_USER, Prog,
@@ -2644,7 +3167,8 @@ int main (int argc, char **argv)
 	 */
 	if (Uflg) {
 		/* local, no need for xgetgrnam */
-		if (prefix_getgrnam (user_name) != NULL) {
+		if (   (prefix_getgrnam (user_name) != NULL)
+		    || (gr_locked && (gr_locate (user_name) != NULL))) {
 			fprintf (stderr,
 			         _("%s: group %s exists - if you want to add this user to that group, use -g.\n"),
 			         Prog, user_name);
@@ -2657,29 +3181,37 @@ int main (int argc, char **argv)
 			fail_exit (E_NAME_IN_USE);
 		}
 	}
+}
 
-	/*
-	 * Do the hard stuff:
-	 * - open the files,
-	 * - create the user entries,
-	 * - create the home directory,
-	 * - create user mail spool,
-	 * - flush nscd caches for passwd and group services,
-	 * - then close and update the files.
-	 */
-	open_files ();
-
+/*
+ * add_new_user - add the entries of the new user to the open databases
+ */
+static void add_new_user (unsigned long subuid_count,
+                          unsigned long subgid_count)
+{
 	if (!oflg) {
 		/* first, seek for a valid uid to use for this user.
 		 * We do this because later we can use the uid we found as
 		 * gid too ... --gafton */
-		if (!uflg) {
-			if (find_new_uid (rflg, &user_id, NULL) < 0) {
+		if (uid_planned) {
+			/* Checked by check_plan */
+			user_id = planned_uid;
+		} else if (   !uflg
+		           && uid_reserved
+		           && (pw_locate_uid (reserved_uid) == NULL)
+		           && (!Uflg || (gr_locate_gid (reserved_uid) == NULL))) {
+			/* The leased UID was not used meanwhile */
+			user_id = reserved_uid;
+		} else if (!uflg) {
+			/* With a user group, look for an ID free as a GID too */
+			if ((Uflg ? find_new_uid_gid (rflg, &user_id)
+			          : find_new_uid (rflg, &user_id, NULL)) < 0) {
 				fprintf (stderr, _("%s: can't create user\n"), Prog);
 				fail_exit (E_UID_IN_USE);
 			}
 		} else {
-			if (prefix_getpwuid (user_id) != NULL) {
+			if (   (prefix_getpwuid (user_id) != NULL)
+			    || (pw_locate_uid (user_id) != NULL)) {
 				fprintf (stderr,
 				         _("%s: UID %lu is not unique\n"),
 				         Prog, (unsigned long) user_id);
@@ -2711,7 +3243,9 @@ int main (int argc, char **argv)
 	/* do we have to add a group for that user? This is why we need to
 	 * open the group files in the open_files() function  --gafton */
 	if (Uflg) {
-		if (find_new_gid (rflg, &user_gid, &user_id) < 0) {
+		if (gid_planned) {
+			user_gid = planned_gid;
+		} else if (find_new_gid (rflg, &user_gid, &user_id) < 0) {
 			fprintf (stderr,
 			         _("%s: can't create group\n"),
 			         Prog);
@@ -2722,7 +3256,7 @@ int main (int argc, char **argv)
 
 #ifdef ENABLE_SUBIDS
 	if (is_sub_uid && subuid_count != 0) {
-		if (find_new_sub_uids(&sub_uid_start, &subuid_count) < 0) {
+		if (find_new_sub_uids(user_id, &sub_uid_start, &subuid_count) < 0) {
 			fprintf (stderr,
 			         _("%s: can't create subordinate user IDs\n"),
 			         Prog);
@@ -2730,7 +3264,7 @@ int main (int argc, char **argv)
 		}
 	}
 	if (is_sub_gid && subgid_count != 0) {
-		if (find_new_sub_gids(&sub_gid_start, &subgid_count) < 0) {
+		if (find_new_sub_gids(user_id, &sub_gid_start, &subgid_count) < 0) {
 			fprintf (stderr,
 			         _("%s: can't create subordinate group IDs\n"),
 			         Prog);
@@ -2740,20 +3274,23 @@ int main (int argc, char **argv)
 #endif				/* ENABLE_SUBIDS */
 
 	usr_update (subuid_count, subgid_count);
+}
 
-	close_files ();
-
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
-
+/*
+ * setup_new_user - create the home and mail spool of the new user
+ *
+ *	It is called once its entries are written.
+ */
+static void setup_new_user (void)
+{
 	/*
-	 * tallylog_reset needs to be able to lookup
-	 * a valid existing user name,
-	 * so we cannot call it before close_files()
+	 * pam_tally2, when tallylog_reset needs it, has to be able to
+	 * lookup a valid existing user name, so we cannot call it before
+	 * close_files()
 	 */
 	if (!lflg && getpwuid (user_id) != NULL) {
-		tallylog_reset (user_name);
+		tallylog_reset (user_id, user_name);
+		faillock_reset (user_name);
 	}
 
 #ifdef WITH_SELINUX
@@ -2775,10 +3312,26 @@ int main (int argc, char **argv)
 	if (mflg) {
 		create_home ();
 		if (home_added) {
-			copy_tree (def_template, prefix_user_home, false, true,
-			           (uid_t)-1, user_id, (gid_t)-1, user_gid);
-			copy_tree (def_usrtemplate, prefix_user_home, false, false,
-			           (uid_t)-1, user_id, (gid_t)-1, user_gid);
+			if (!home_snapshot) {
+				if (progressflg) {
+					progress_start (_("copying"), def_template);
+					copy_tree_set_progress (progress_report);
+				}
+				copy_skel (def_template, prefix_user_home, true,
+				           user_id, user_gid);
+				if (progressflg) {
+					copy_tree_set_progress (NULL);
+					progress_end ();
+				}
+			} else if (chown_tree (prefix_user_home,
+			                       (uid_t)-1, user_id,
+			                       (gid_t)-1, user_gid) != 0) {
+				fprintf (stderr,
+				         _("%s: warning: failed to change the ownership of the files in %s\n"),
+				         Prog, user_home);
+			}
+			copy_skel (def_usrtemplate, prefix_user_home, false,
+			           user_id, user_gid);
 		} else {
 			fprintf (stderr,
 			         _("%s: warning: the home directory %s already exists.\n"
@@ -2792,6 +3345,618 @@ int main (int argc, char **argv)
 	if (!rflg) {
 		create_mail ();
 	}
+}
+
+/*
+ * read_batch - read the records of a --batch file
+ *
+ *	Return NULL if the file cannot be read or a record is invalid.
+ */
+static /*@null@*/struct batch_record *read_batch (const char *file,
+                                                  size_t *count)
+{
+	struct batch_line *lines;
+	struct batch_record *records;
+	size_t i;
+
+	if (batch_read (file, &lines, count) != 0) {
+		return NULL;
+	}
+
+	records = xmalloc ((*count + 1) * sizeof *records);
+	memzero (records, (*count + 1) * sizeof *records);
+	for (i = 0; i < *count; i++) {
+		records[i].line = lines[i].line;
+		records[i].argc = lines[i].argc;
+		records[i].argv = lines[i].argv;
+	}
+	free (lines);
+	return records;
+}
+
+/*
+ * save_record_defaults - remember the values of the defaults file, to
+ *                        restore them before each record
+ */
+static void save_record_defaults (void)
+{
+	record_defaults.home = def_home;
+	record_defaults.shell = def_shell;
+	record_defaults.template = def_template;
+	record_defaults.inactive = def_inactive;
+	record_defaults.bad_names = allow_bad_names;
+	record_defaults.groups = xmalloc ((1 + sys_ngroups) * sizeof (char *));
+	memcpy (record_defaults.groups, user_groups,
+	        (1 + sys_ngroups) * sizeof (char *));
+	record_defaults.grp_update = do_grp_update;
+}
+
+/*
+ * reset_record - reset the values of the previous record
+ */
+static void reset_record (void)
+{
+	def_home = record_defaults.home;
+	def_shell = record_defaults.shell;
+	def_template = record_defaults.template;
+	def_inactive = record_defaults.inactive;
+	allow_bad_names = record_defaults.bad_names;
+	memcpy (user_groups, record_defaults.groups,
+	        (1 + sys_ngroups) * sizeof (char *));
+	do_grp_update = record_defaults.grp_update;
+
+	user_name = "";
+	user_pass = "!";
+	user_id = 0;
+	user_gid = 0;
+	user_comment = "";
+	user_home = "";
+	user_shell = "";
+	prefix_user_home = NULL;
+#ifdef WITH_SELINUX
+	user_selinux = "";
+#endif				/* WITH_SELINUX */
+	user_expire = -1;
+
+	bflg = false;
+	cflg = false;
+	dflg = false;
+	Dflg = false;
+	eflg = false;
+	fflg = false;
+#ifdef ENABLE_SUBIDS
+	Fflg = false;
+#endif				/* ENABLE_SUBIDS */
+	gflg = false;
+	Gflg = false;
+	kflg = false;
+	lflg = false;
+	mflg = false;
+	Mflg = false;
+	Nflg = false;
+	oflg = false;
+	rflg = false;
+	sflg = false;
+	subvolflg = false;
+	progressflg = false;
+	uflg = false;
+	Uflg = false;
+
+	home_added = false;
+	home_snapshot = false;
+}
+
+/*
+ * add_record - add the entries of the user of a --batch record
+ *
+ *	Return 0 on success, or the exit status of useradd for this record.
+ */
+static int add_record (struct batch_record *rec,
+                       unsigned long subuid_count,
+                       unsigned long subgid_count)
+{
+	jmp_buf env;
+	int code;
+#ifdef ENABLE_SUBIDS
+	bool sub_uid = is_sub_uid;
+	bool sub_gid = is_sub_gid;
+#endif				/* ENABLE_SUBIDS */
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		reset_record ();
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+#ifdef ENABLE_SUBIDS
+		is_sub_uid = sub_uid && want_subids ();
+		is_sub_gid = sub_gid && want_subids ();
+#endif				/* ENABLE_SUBIDS */
+		check_new_user ();
+		add_new_user (subuid_count, subgid_count);
+
+		rec->added = true;
+		rec->name = user_name;
+		rec->home = user_home;
+		rec->prefix_home = prefix_user_home;
+		rec->template = def_template;
+		rec->mail_spool = create_mail_spool;
+		rec->uid = user_id;
+		rec->gid = user_gid;
+		rec->lflg = lflg;
+		rec->mflg = mflg;
+		rec->rflg = rflg;
+		rec->subvolflg = subvolflg;
+		rec->progressflg = progressflg;
+#ifdef WITH_SELINUX
+		rec->selinux = user_selinux;
+#endif				/* WITH_SELINUX */
+	} else {
+		const char *name = user_name;
+
+		if (('\0' == *name) && (rec->argc > 1)) {
+			/* The options were not parsed */
+			name = rec->argv[rec->argc - 1];
+		}
+		fprintf (stderr, _("%s: line %u: cannot add user '%s'\n"),
+		         Prog, rec->line, name);
+		SYSLOG ((LOG_INFO, "failed adding user '%s', exit code: %d",
+		         name, code));
+	}
+	record_env = NULL;
+
+#ifdef ENABLE_SUBIDS
+	is_sub_uid = sub_uid;
+	is_sub_gid = sub_gid;
+#endif				/* ENABLE_SUBIDS */
+	return rec->added ? 0 : code;
+}
+
+/*
+ * setup_record - create the home and mail spool of the user of a --batch
+ *                record
+ *
+ *	Return 0 on success, or the exit status of useradd for this record.
+ */
+static int setup_record (struct batch_record *rec)
+{
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		reset_record ();
+		user_name = rec->name;
+		user_home = rec->home;
+		prefix_user_home = rec->prefix_home;
+		def_template = rec->template;
+		create_mail_spool = rec->mail_spool;
+		user_id = rec->uid;
+		user_gid = rec->gid;
+		lflg = rec->lflg;
+		mflg = rec->mflg;
+		rflg = rec->rflg;
+		subvolflg = rec->subvolflg;
+		progressflg = rec->progressflg;
+#ifdef WITH_SELINUX
+		user_selinux = rec->selinux;
+#endif				/* WITH_SELINUX */
+		setup_new_user ();
+
+		if (run_parts ("/etc/shadow-maint/useradd-post.d", user_name,
+		               "useradd")) {
+			code = 1;
+		}
+	}
+	record_env = NULL;
+
+	if (0 != code) {
+		fprintf (stderr, _("%s: line %u: cannot set up user '%s'\n"),
+		         Prog, rec->line, rec->name);
+	}
+	return code;
+}
+
+/*
+ * add_batch - add the users of the records of file
+ *
+ *	The records are checked and added to the databases, which are
+ *	locked and written once. If a record fails, the others are still
+ *	checked, but no user is added. The homes and mail spools are
+ *	created once the databases are written.
+ *
+ *	Return the exit status of useradd.
+ */
+static int add_batch (const char *file,
+                      unsigned long subuid_count,
+                      unsigned long subgid_count)
+{
+	struct batch_record *records;
+	size_t count = 0;
+	size_t i;
+	bool grp_update;
+	int status = E_SUCCESS;
+	int code;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr, _("%s: --batch cannot be used with tcb enabled\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	records = read_batch (file, &count);
+	if (NULL == records) {
+		exit (E_BAD_ARG);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (   (records[i].argc > 1)
+		    && run_parts ("/etc/shadow-maint/useradd-pre.d",
+		                  records[i].argv[records[i].argc - 1],
+		                  "useradd")) {
+			exit (1);
+		}
+	}
+
+	save_record_defaults ();
+	grp_update = do_grp_update;
+#ifdef ENABLE_SUBIDS
+	/* The files are opened if any record may need them */
+	is_sub_uid = (subuid_count > 0) && sub_uid_file_present ();
+	is_sub_gid = (subgid_count > 0) && sub_gid_file_present ();
+#endif				/* ENABLE_SUBIDS */
+	open_files ();
+	open_shadow ();
+
+	for (i = 0; i < count; i++) {
+		code = add_record (&records[i], subuid_count, subgid_count);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+		if (do_grp_update) {
+			grp_update = true;
+		}
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was added\n"), Prog);
+		user_name = "";
+		fail_exit (status);
+	}
+
+	do_grp_update = grp_update;
+	close_files ();
+
+	if (asyncflg && setup_async (records, count)) {
+		return status;
+	}
+
+	for (i = 0; i < count; i++) {
+		code = setup_record (&records[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+	close_log_files ();
+
+	return status;
+}
+
+/*
+ * setup_user - create the home and mail spool of the new user, and run
+ *              the useradd-post.d scripts, with --async-setup
+ *
+ *	Return 0 on success, or the exit status of useradd.
+ */
+static int setup_user (void)
+{
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		setup_new_user ();
+		close_log_files ();
+
+		if (run_parts ("/etc/shadow-maint/useradd-post.d", user_name,
+		               "useradd")) {
+			code = 1;
+		}
+	}
+	record_env = NULL;
+	return code;
+}
+
+/*
+ * async_status_open - create the status file of the setup of user name
+ *
+ *	Return its file descriptor, or -1 on failure (reported).
+ */
+static int async_status_open (const char *name)
+{
+	char dir[1024];
+	char path[2048];
+	int fd;
+
+	(void) snprintf (dir, sizeof dir, "%s/var/lib/shadow", prefix);
+	(void) mkdir (dir, 0755);
+	(void) snprintf (dir, sizeof dir, "%s" ASYNC_STATUS_DIR, prefix);
+	if ((mkdir (dir, 0700) != 0) && (EEXIST != errno)) {
+		fprintf (stderr, _("%s: cannot create directory %s: %s\n"),
+		         Prog, dir, strerror (errno));
+		return -1;
+	}
+	(void) snprintf (path, sizeof path, "%s/%s", dir, name);
+	fd = open (path, O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+	           0600);
+	if (fd < 0) {
+		fprintf (stderr, _("%s: cannot create %s: %s\n"),
+		         Prog, path, strerror (errno));
+	}
+	return fd;
+}
+
+/*
+ * setup_async - set up the users of records, or the new user if records
+ *               is NULL, in a background process, with --async-setup
+ *
+ *	The background process is detached from the terminal, and its
+ *	standard error is the status file of the user it sets up. It exits
+ *	with the exit status useradd would have had.
+ *
+ *	Return true in useradd once the background process is started, or
+ *	false if it could not be started (reported): the users are then
+ *	set up in the foreground.
+ */
+static bool setup_async (/*@null@*/struct batch_record *records,
+                         size_t count)
+{
+	size_t n = (NULL != records) ? count : 1;
+	int status = E_SUCCESS;
+	int *fds;
+	size_t i;
+	pid_t pid;
+	int fd;
+
+	fds = xmalloc ((n + 1) * sizeof *fds);
+	for (i = 0; i < n; i++) {
+		fds[i] = async_status_open ((NULL != records) ? records[i].name
+		                                              : user_name);
+		if (fds[i] < 0) {
+			break;
+		}
+	}
+	pid = -1;
+	if (i == n) {
+		(void) fflush (NULL);
+		pid = fork ();
+		if (pid < 0) {
+			fprintf (stderr, _("%s: cannot fork: %s\n"),
+			         Prog, strerror (errno));
+		}
+	}
+	if (0 != pid) {
+		while (i > 0) {
+			(void) close (fds[--i]);
+		}
+		free (fds);
+		if (pid < 0) {
+			fprintf (stderr,
+			         _("%s: setting up the users in the foreground\n"),
+			         Prog);
+			return false;
+		}
+		return true;
+	}
+
+	/* The background process */
+	(void) setsid ();
+	fd = open ("/dev/null", O_RDWR);
+	if (fd >= 0) {
+		(void) dup2 (fd, STDIN_FILENO);
+		(void) dup2 (fd, STDOUT_FILENO);
+		(void) dup2 (fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO) {
+			(void) close (fd);
+		}
+	}
+	for (i = 0; i < n; i++) {
+		(void) dprintf (fds[i], "running %ld\n", (long) getpid ());
+	}
+	for (i = 0; i < n; i++) {
+		const char *name;
+		int code;
+
+		(void) dup2 (fds[i], STDERR_FILENO);
+		if (NULL != records) {
+			name = records[i].name;
+			code = setup_record (&records[i]);
+		} else {
+			name = user_name;
+			code = setup_user ();
+		}
+		(void) fflush (stderr);
+		(void) dprintf (fds[i], "exit %d\n", code);
+		(void) close (fds[i]);
+		if (0 != code) {
+			SYSLOG ((LOG_WARN,
+			         "cannot set up user '%s', exit status: %d",
+			         name, code));
+			if (E_SUCCESS == status) {
+				status = code;
+			}
+		}
+	}
+	if (NULL != records) {
+		close_log_files ();
+	}
+	exit (status);
+}
+
+/*
+ * main - useradd command
+ */
+int main (int argc, char **argv)
+{
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	pam_handle_t *pamh = NULL;
+	int retval;
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	unsigned long subuid_count = 0;
+	unsigned long subgid_count = 0;
+
+	/*
+	 * Get my name so that I can use it to report errors.
+	 */
+	Prog = Basename (argv[0]);
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", argc, argv);
+
+	prefix = process_prefix_flag("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
+
+	OPENLOG ("useradd");
+#ifdef WITH_AUDIT
+	audit_help_open ();
+#endif
+
+	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
+	user_groups = (char **) xmalloc ((1 + sys_ngroups) * sizeof (char *));
+	/*
+	 * Initialize the list to be empty
+	 */
+	user_groups[0] = NULL;
+
+
+	is_shadow_pwd = spw_file_present ();
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif
+
+	get_defaults ();
+
+	process_flags (argc, argv);
+
+#ifdef ENABLE_SUBIDS
+	subuid_count = getdef_ulong ("SUB_UID_COUNT", 65536);
+	subgid_count = getdef_ulong ("SUB_GID_COUNT", 65536);
+	is_sub_uid = subuid_count > 0 && sub_uid_file_present () &&
+	    want_subids ();
+	is_sub_gid = subgid_count > 0 && sub_gid_file_present () &&
+	    want_subids ();
+#endif				/* ENABLE_SUBIDS */
+
+	/* The hooks of --batch are run for each record */
+	if (   (NULL == batch_file)
+	    && run_parts ("/etc/shadow-maint/useradd-pre.d", user_name,
+	                  "useradd")) {
+		exit(1);
+	}
+
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	{
+		struct passwd *pampw;
+		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
+		if (pampw == NULL && getuid ()) {
+			fprintf (stderr,
+			         _("%s: Cannot determine your user name.\n"),
+			         Prog);
+			fail_exit (1);
+		}
+
+		retval = pam_start ("useradd", pampw?pampw->pw_name:"root", &conv, &pamh);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_authenticate (pamh, 0);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_acct_mgmt (pamh, 0);
+	}
+
+	if (PAM_SUCCESS != retval) {
+		fprintf (stderr, _("%s: PAM: %s\n"),
+		         Prog, pam_strerror (pamh, retval));
+		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
+		if (NULL != pamh) {
+			(void) pam_end (pamh, retval);
+		}
+		fail_exit (1);
+	}
+	(void) pam_end (pamh, retval);
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	/*
+	 * See if we are messing with the defaults file, or creating
+	 * a new user.
+	 */
+	if (Dflg) {
+		if (gflg || bflg || fflg || eflg || sflg) {
+			exit ((set_defaults () != 0) ? 1 : 0);
+		}
+
+		show_defaults ();
+		exit (E_SUCCESS);
+	}
+
+	if (NULL != batch_file) {
+		return add_batch (batch_file, subuid_count, subgid_count);
+	}
+
+	check_new_user ();
+
+	/*
+	 * Do the hard stuff:
+	 * - open the files,
+	 * - create the user entries,
+	 * - create the home directory,
+	 * - create user mail spool,
+	 * - flush nscd caches for passwd and group services,
+	 * - then close and update the files.
+	 */
+	if (!oflg && getdef_bool ("OPTIMISTIC_LOCKING")) {
+		lock_planned_files ();
+	} else {
+		if (!oflg && !uflg && getdef_bool ("RESERVE_IDS")) {
+			reserve_user_id ();
+		}
+		open_files ();
+	}
+
+	add_new_user (subuid_count, subgid_count);
+
+	close_files ();
+
+	if (uid_reserved) {
+		id_lease_release (pw_dbname (), reserved_uid);
+		if (Uflg) {
+			id_lease_release (gr_dbname (), reserved_uid);
+		}
+	}
+
+	if (asyncflg && setup_async (NULL, 0)) {
+		return E_SUCCESS;
+	}
+
+	setup_new_user ();
+	close_log_files ();
 
 	if (run_parts ("/etc/shadow-maint/useradd-post.d", user_name,
 			"useradd")) {
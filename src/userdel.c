@@ -15,6 +15,7 @@
 #include <getopt.h>
 #include <grp.h>
 #include <pwd.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -27,8 +28,6 @@
 #include "defines.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -74,6 +73,8 @@ static char *user_name;
 static uid_t user_id;
 static gid_t user_gid;
 static char *user_home;
+/* Queue of the deferred removals, with DEFER_HOME_REMOVAL */
+static /*@null@*/char *removal_queue = NULL;
 
 static bool fflg = false;
 static bool rflg = false;
@@ -81,6 +82,7 @@ static bool rflg = false;
 static bool Zflg = false;
 #endif
 static bool Rflg = false;
+static bool drain_flg = false;
 
 static bool is_shadow_pwd;
 
@@ -100,8 +102,52 @@ static bool sub_gid_locked = false;
 
 static const char* prefix = "";
 
+/*
+ * --batch FILE deletes the users of the records of FILE, one set of
+ * userdel arguments per line, with a single lock and write of the
+ * databases. While a record is processed, record_env is set, and the
+ * errors which would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+
+struct batch_record {
+	unsigned int line;
+	int argc;
+	char **argv;
+	bool deleted;
+
+	/* Values needed once the databases are written */
+	char *name;
+	uid_t uid;
+	char *home;
+	bool fflg;
+	bool rflg;
+#ifdef WITH_SELINUX
+	bool Zflg;
+#endif				/* WITH_SELINUX */
+};
+
+/*
+ * With --batch, the number of users of each primary group, to check if
+ * a usergroup can be removed without a pass over passwd per record.
+ */
+struct primary_group {
+	gid_t gid;
+	unsigned long users;
+};
+static /*@null@*/struct primary_group *primary_groups = NULL;
+static size_t primary_groups_count = 0;
+
 /* local function prototypes */
 static void usage (int status);
+static void flag_exit (int code);
+static void reject_in_record (const char *option);
+static void process_flags (int argc, char **argv);
+static void update_group (const struct group *grp);
+#ifdef SHADOWGRP
+static void update_gshadow (const struct sgrp *sgrp);
+#endif
 static void update_groups (void);
 static void remove_usergroup (void);
 static void close_files (void);
@@ -114,10 +160,22 @@ static void user_cancel (const char *);
 static bool path_prefix (const char *, const char *);
 #endif				/* EXTRA_CHECK_HOME_DIR */
 static int is_owner (uid_t, const char *);
+static int remove_dir (const char *path);
+static int remove_file (const char *path);
 static int remove_mailbox (void);
+static int remove_home (void);
+static /*@only@*/char *removal_queue_name (void);
 #ifdef WITH_TCB
 static int remove_tcbdir (const char *user_name, uid_t user_id);
 #endif				/* WITH_TCB */
+static void check_user (void);
+static int remove_user_files (void);
+static void primary_groups_build (void);
+static /*@null@*/struct primary_group *primary_group_find (gid_t gid);
+static void reset_record (void);
+static int del_record (struct batch_record *rec);
+static int remove_record (struct batch_record *rec);
+static int del_batch (const char *file);
 
 /*
  * usage - display usage message and exit
@@ -125,11 +183,23 @@ static int remove_tcbdir (const char *user_name, uid_t user_id);
 static void usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s --batch FILE\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog);
+	(void) fputs (_("      --batch FILE              delete the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
+	(void) fputs (_("      --drain-removals          remove the home directories and mail spools\n"
+	                "                                whose removal was deferred, and exit\n"),
+	              usageout);
 	(void) fputs (_("  -f, --force                   force some actions that would fail otherwise\n"
 	                "                                e.g. removal of user still logged in\n"
 	                "                                or files, even if not owned by the user\n"),
@@ -138,6 +208,8 @@ static void usage (int status)
 	(void) fputs (_("  -r, --remove                  remove home directory and mail spool\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 #ifdef WITH_SELINUX
 	(void) fputs (_("  -Z, --selinux-user            remove any SELinux user mapping for the user\n"), usageout);
 #endif				/* WITH_SELINUX */
@@ -145,6 +217,106 @@ static void usage (int status)
 	exit (status);
 }
 
+/*
+ * flag_exit - exit on an invalid argument or user
+ *
+ *	For a record of --batch, only the record fails.
+ */
+static void flag_exit (int code)
+{
+	if (NULL != record_env) {
+		longjmp (*record_env, code);
+	}
+	exit (code);
+}
+
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
+{
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
+	}
+}
+
+/*
+ * update_group - delete the user from the members of a group
+ */
+static void update_group (const struct group *grp)
+{
+	struct group *ngrp;
+
+	/*
+	 * Delete the username from the list of group members and
+	 * update the group entry to reflect the change.
+	 */
+	ngrp = __gr_dup (grp);
+	if (NULL == ngrp) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, gr_dbname ());
+		exit (13);	/* XXX */
+	}
+	ngrp->gr_mem = del_list (ngrp->gr_mem, user_name);
+	if (gr_update (ngrp) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, gr_dbname (), ngrp->gr_name);
+		exit (E_GRP_UPDATE);
+	}
+
+	/*
+	 * Update the DBM group file with the new entry as well.
+	 */
+#ifdef WITH_AUDIT
+	audit_logger (AUDIT_DEL_USER, Prog,
+	              "deleting user from group",
+	              user_name, user_id, SHADOW_AUDIT_SUCCESS);
+#endif				/* WITH_AUDIT */
+	SYSLOG ((LOG_INFO, "delete '%s' from group '%s'\n",
+		 user_name, ngrp->gr_name));
+}
+
+#ifdef	SHADOWGRP
+/*
+ * update_gshadow - delete the user from the members and administrators
+ *                  of a shadow group
+ */
+static void update_gshadow (const struct sgrp *sgrp)
+{
+	struct sgrp *nsgrp;
+
+	nsgrp = __sgr_dup (sgrp);
+	if (NULL == nsgrp) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, sgr_dbname ());
+		exit (13);	/* XXX */
+	}
+
+	nsgrp->sg_mem = del_list (nsgrp->sg_mem, user_name);
+	nsgrp->sg_adm = del_list (nsgrp->sg_adm, user_name);
+
+	if (sgr_update (nsgrp) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, sgr_dbname (), nsgrp->sg_name);
+		exit (E_GRP_UPDATE);
+	}
+#ifdef WITH_AUDIT
+	audit_logger (AUDIT_DEL_USER, Prog,
+	              "deleting user from shadow group",
+	              user_name, user_id, SHADOW_AUDIT_SUCCESS);
+#endif				/* WITH_AUDIT */
+	SYSLOG ((LOG_INFO, "delete '%s' from shadow group '%s'\n",
+	         user_name, nsgrp->sg_name));
+}
+#endif				/* SHADOWGRP */
+
 /*
  * update_groups - delete user from secondary group set
  *
@@ -157,57 +329,32 @@ static void usage (int status)
  */
 static void update_groups (void)
 {
+	const struct group **groups;
 	const struct group *grp;
-	struct group *ngrp;
+	size_t i;
 
 #ifdef	SHADOWGRP
+	const struct sgrp **sgroups;
 	const struct sgrp *sgrp;
-	struct sgrp *nsgrp;
 #endif				/* SHADOWGRP */
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * Update the groups the user is a member of. They are found with
+	 * the member index of the group file, or by scanning through the
+	 * entire file if it is not available.
 	 */
-	for (gr_rewind (), grp = gr_next (); NULL != grp; grp = gr_next ()) {
-
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		if (!is_on_list (grp->gr_mem, user_name)) {
-			continue;
-		}
-
-		/*
-		 * Delete the username from the list of group members and
-		 * update the group entry to reflect the change.
-		 */
-		ngrp = __gr_dup (grp);
-		if (NULL == ngrp) {
-			fprintf (stderr,
-			         _("%s: Out of memory. Cannot update %s.\n"),
-			         Prog, gr_dbname ());
-			exit (13);	/* XXX */
+	groups = gr_member_of (user_name);
+	if (NULL != groups) {
+		for (i = 0; NULL != groups[i]; i++) {
+			update_group (groups[i]);
 		}
-		ngrp->gr_mem = del_list (ngrp->gr_mem, user_name);
-		if (gr_update (ngrp) == 0) {
-			fprintf (stderr,
-			         _("%s: failed to prepare the new %s entry '%s'\n"),
-			         Prog, gr_dbname (), ngrp->gr_name);
-			exit (E_GRP_UPDATE);
+		free (groups);
+	} else {
+		for (gr_rewind (), grp = gr_next (); NULL != grp; grp = gr_next ()) {
+			if (is_on_list (grp->gr_mem, user_name)) {
+				update_group (grp);
+			}
 		}
-
-		/*
-		 * Update the DBM group file with the new entry as well.
-		 */
-#ifdef WITH_AUDIT
-		audit_logger (AUDIT_DEL_USER, Prog,
-		              "deleting user from group",
-		              user_name, user_id, SHADOW_AUDIT_SUCCESS);
-#endif				/* WITH_AUDIT */
-		SYSLOG ((LOG_INFO, "delete '%s' from group '%s'\n",
-			 user_name, ngrp->gr_name));
 	}
 
 	if (getdef_bool ("USERGROUPS_ENAB")) {
@@ -220,55 +367,24 @@ static void update_groups (void)
 	}
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of. Both the administrative list and
-	 * the ordinary membership list is checked.
+	 * Both the administrative list and the ordinary membership list
+	 * are checked.
 	 */
-	for (sgr_rewind (), sgrp = sgr_next ();
-	     NULL != sgrp;
-	     sgrp = sgr_next ()) {
-		bool was_member, was_admin;
-
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		was_member = is_on_list (sgrp->sg_mem, user_name);
-		was_admin = is_on_list (sgrp->sg_adm, user_name);
-
-		if (!was_member && !was_admin) {
-			continue;
-		}
-
-		nsgrp = __sgr_dup (sgrp);
-		if (NULL == nsgrp) {
-			fprintf (stderr,
-			         _("%s: Out of memory. Cannot update %s.\n"),
-			         Prog, sgr_dbname ());
-			exit (13);	/* XXX */
+	sgroups = sgr_member_of (user_name);
+	if (NULL != sgroups) {
+		for (i = 0; NULL != sgroups[i]; i++) {
+			update_gshadow (sgroups[i]);
 		}
-
-		if (was_member) {
-			nsgrp->sg_mem = del_list (nsgrp->sg_mem, user_name);
-		}
-
-		if (was_admin) {
-			nsgrp->sg_adm = del_list (nsgrp->sg_adm, user_name);
-		}
-
-		if (sgr_update (nsgrp) == 0) {
-			fprintf (stderr,
-			         _("%s: failed to prepare the new %s entry '%s'\n"),
-			         Prog, sgr_dbname (), nsgrp->sg_name);
-			exit (E_GRP_UPDATE);
+		free (sgroups);
+	} else {
+		for (sgr_rewind (), sgrp = sgr_next ();
+		     NULL != sgrp;
+		     sgrp = sgr_next ()) {
+			if (   is_on_list (sgrp->sg_mem, user_name)
+			    || is_on_list (sgrp->sg_adm, user_name)) {
+				update_gshadow (sgrp);
+			}
 		}
-#ifdef WITH_AUDIT
-		audit_logger (AUDIT_DEL_USER, Prog,
-		              "deleting user from shadow group",
-		              user_name, user_id, SHADOW_AUDIT_SUCCESS);
-#endif				/* WITH_AUDIT */
-		SYSLOG ((LOG_INFO, "delete '%s' from shadow group '%s'\n",
-		         user_name, nsgrp->sg_name));
 	}
 #endif				/* SHADOWGRP */
 }
@@ -285,7 +401,8 @@ static void update_groups (void)
 static void remove_usergroup (void)
 {
 	const struct group *grp;
-	const struct passwd *pwd = NULL;
+	const struct passwd *pwd;
+	bool in_use = false;
 
 	grp = gr_locate (user_name);
 	if (NULL == grp) {
@@ -310,25 +427,34 @@ static void remove_usergroup (void)
 
 	if (!fflg) {
 		/*
-		 * Scan the passwd file to check if this group is still
-		 * used as a primary group.
+		 * Check if this group is still used as a primary group,
+		 * with the table of --batch or with a scan of the passwd
+		 * file.
 		 */
-		prefix_setpwent ();
-		while ((pwd = prefix_getpwent ()) != NULL) {
-			if (strcmp (pwd->pw_name, user_name) == 0) {
-				continue;
-			}
-			if (pwd->pw_gid == grp->gr_gid) {
-				fprintf (stderr,
-				         _("%s: group %s is the primary group of another user and is not removed.\n"),
-				         Prog, grp->gr_name);
-				break;
+		if (NULL != primary_groups) {
+			const struct primary_group *pg;
+
+			pg = primary_group_find (grp->gr_gid);
+			in_use = (NULL != pg) && (pg->users > 0);
+		} else {
+			prefix_setpwent ();
+			while ((pwd = prefix_getpwent ()) != NULL) {
+				if (   (pwd->pw_gid == grp->gr_gid)
+				    && (strcmp (pwd->pw_name, user_name) != 0)) {
+					in_use = true;
+					break;
+				}
 			}
+			prefix_endpwent ();
+		}
+		if (in_use) {
+			fprintf (stderr,
+			         _("%s: group %s is the primary group of another user and is not removed.\n"),
+			         Prog, grp->gr_name);
 		}
-		prefix_endpwent ();
 	}
 
-	if (NULL == pwd) {
+	if (!in_use) {
 		/*
 		 * We can remove this group, it is not the primary
 		 * group of any remaining user.
@@ -474,6 +600,11 @@ static void close_files (void)
  */
 static void fail_exit (int code)
 {
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
+	}
+
 	if (pw_locked) {
 		if (pw_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, pw_dbname ());
@@ -573,6 +704,7 @@ static void open_files (void)
 			fail_exit (E_PW_UPDATE);
 		}
 		spw_locked = true;
+		spw_compact ();
 		if (spw_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -597,6 +729,7 @@ static void open_files (void)
 		fail_exit (E_GRP_UPDATE);
 	}
 	gr_locked = true;
+	gr_index_members ();
 	if (gr_open (O_CREAT | O_RDWR) == 0) {
 		fprintf (stderr, _("%s: cannot open %s\n"), Prog, gr_dbname ());
 #ifdef WITH_AUDIT
@@ -620,6 +753,7 @@ static void open_files (void)
 			fail_exit (E_GRP_UPDATE);
 		}
 		sgr_locked= true;
+		sgr_index_members ();
 		if (sgr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr, _("%s: cannot open %s\n"),
 			         Prog, sgr_dbname ());
@@ -784,6 +918,68 @@ static int is_owner (uid_t uid, const char *path)
 	return (st.st_uid == uid) ? 1 : 0;
 }
 
+/*
+ * removal_queue_name - Return the name of the queue of the deferred
+ *                      removals, next to the passwd file.
+ */
+static /*@only@*/char *removal_queue_name (void)
+{
+	const char *db = pw_dbname ();
+	size_t len = strlen (db) + sizeof ".removals";
+	char *queue = xmalloc (len);
+
+	(void) snprintf (queue, len, "%s.removals", db);
+	return queue;
+}
+
+/*
+ * remove_dir - remove the directory tree path, or queue its removal with
+ *              DEFER_HOME_REMOVAL
+ *
+ *	The tree is deleted by remove_tree(), with HOME_REMOVE_JOBS and
+ *	HOME_REMOVE_ASYNC.
+ */
+static int remove_dir (const char *path)
+{
+	if (   (NULL != removal_queue)
+	    && (removal_queue_add (removal_queue, user_name, path) == 0)) {
+		return 0;
+	}
+	if (getdef_bool ("HOME_REMOVE_ASYNC")) {
+		return remove_tree_async (path);
+	}
+	return remove_tree (path, true);
+}
+
+/*
+ * remove_file - remove path, or queue its removal with DEFER_HOME_REMOVAL
+ *
+ *	A directory, such as a maildir spool, is removed like the home
+ *	directory.
+ */
+static int remove_file (const char *path)
+{
+	struct stat sb;
+
+	if ((lstat (path, &sb) == 0) && S_ISDIR (sb.st_mode)) {
+		return remove_dir (path);
+	}
+	if (   (NULL != removal_queue)
+	    && (removal_queue_add (removal_queue, user_name, path) == 0)) {
+		return 0;
+	}
+	return unlink (path);
+}
+
+/*
+ * remove_home - remove the home directory, or queue its removal with
+ *               DEFER_HOME_REMOVAL
+ */
+static int remove_home (void)
+{
+	return remove_dir (user_home);
+}
+
 static int remove_mailbox (void)
 {
 	const char *maildir;
@@ -838,7 +1034,7 @@ static int remove_mailbox (void)
 	}
 
 	if (fflg) {
-		if (unlink (mailfile) != 0) {
+		if (remove_file (mailfile) != 0) {
 			fprintf (stderr,
 			         _("%s: warning: can't remove %s: %s\n"),
 			         Prog, mailfile, strerror (errno));
@@ -881,7 +1077,7 @@ static int remove_mailbox (void)
 		free(mailfile);
 		return 0;		/* mailbox doesn't exist */
 	}
-	if (unlink (mailfile) != 0) {
+	if (remove_file (mailfile) != 0) {
 		fprintf (stderr,
 		         _("%s: warning: can't remove %s: %s\n"),
 		         Prog, mailfile, strerror (errno));
@@ -954,190 +1150,169 @@ static int remove_tcbdir (const char *user_name, uid_t user_id)
 #endif				/* WITH_TCB */
 
 /*
- * main - userdel command
+ * process_flags - parse the command line options
+ *
+ *	With --batch, the options of the command line are only the ones
+ *	common to all the records.
  */
-int main (int argc, char **argv)
+static void process_flags (int argc, char **argv)
 {
-	int errors = 0; /* Error in the removal of the home directory */
-
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	pam_handle_t *pamh = NULL;
-	int retval;
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-	/*
-	 * Get my name so that I can use it to report errors.
-	 */
-	Prog = Basename (argv[0]);
-	log_set_progname(Prog);
-	log_set_logfd(stderr);
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
-
-	process_root_flag ("-R", argc, argv);
-	prefix = process_prefix_flag ("-P", argc, argv);
-
-	OPENLOG ("userdel");
-#ifdef WITH_AUDIT
-	audit_help_open ();
-#endif				/* WITH_AUDIT */
-
-	{
-		/*
-		 * Parse the command line options.
-		 */
-		int c;
-		static struct option long_options[] = {
-			{"force",        no_argument,       NULL, 'f'},
-			{"help",         no_argument,       NULL, 'h'},
-			{"remove",       no_argument,       NULL, 'r'},
-			{"root",         required_argument, NULL, 'R'},
-			{"prefix",       required_argument, NULL, 'P'},
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
+	int c;
+	static struct option long_options[] = {
+		{"batch",        required_argument, NULL, 201},
+		{"deadline",     required_argument, NULL, 203},
+		{"drain-removals", no_argument,     NULL, 200},
+		{"force",        no_argument,       NULL, 'f'},
+		{"help",         no_argument,       NULL, 'h'},
+		{"remove",       no_argument,       NULL, 'r'},
+		{"root",         required_argument, NULL, 'R'},
+		{"prefix",       required_argument, NULL, 'P'},
+		{"shard",        required_argument, NULL, 202},
 #ifdef WITH_SELINUX
-			{"selinux-user", no_argument,       NULL, 'Z'},
+		{"selinux-user", no_argument,       NULL, 'Z'},
 #endif				/* WITH_SELINUX */
-			{NULL, 0, NULL, '\0'}
-		};
-		while ((c = getopt_long (argc, argv,
+		{NULL, 0, NULL, '\0'}
+	};
+
+	while ((c = getopt_long (argc, argv,
 #ifdef WITH_SELINUX
-		                         "fhrR:P:Z",
+	                         "fhrR:P:Z",
 #else				/* !WITH_SELINUX */
-		                         "fhrR:P:",
+	                         "fhrR:P:",
 #endif				/* !WITH_SELINUX */
-		                         long_options, NULL)) != -1) {
-			switch (c) {
-			case 'f':	/* force remove even if not owned by user */
-				fflg = true;
-				break;
-			case 'h':
-				usage (E_SUCCESS);
-				break;
-			case 'r':	/* remove home dir and mailbox */
-				rflg = true;
-				break;
-			case 'R': /* no-op, handled in process_root_flag () */
-				Rflg = true;
-				break;
-			case 'P': /* no-op, handled in process_prefix_flag () */
-				break;
+	                         long_options, NULL)) != -1) {
+		nopts++;
+		switch (c) {
+		case 200:
+			reject_in_record ("--drain-removals");
+			drain_flg = true;
+			break;
+		case 201:
+			reject_in_record ("--batch");
+			batch_file = optarg;
+			batch_opts++;
+			break;
+		case 'f':	/* force remove even if not owned by user */
+			fflg = true;
+			break;
+		case 'h':
+			reject_in_record ("-h");
+			usage (E_SUCCESS);
+			break;
+		case 'r':	/* remove home dir and mailbox */
+			rflg = true;
+			break;
+		case 'R': /* no-op, handled in process_root_flag () */
+			reject_in_record ("-R");
+			Rflg = true;
+			batch_opts++;
+			break;
+		case 'P': /* no-op, handled in process_prefix_flag () */
+			reject_in_record ("-P");
+			batch_opts++;
+			break;
+		case 202: /* no-op, handled in process_shard_flag () */
+			reject_in_record ("--shard");
+			batch_opts++;
+			break;
+		case 203: /* no-op, handled in process_deadline_flag () */
+			reject_in_record ("--deadline");
+			batch_opts++;
+			break;
 #ifdef WITH_SELINUX
-			case 'Z':
-				if (prefix[0]) {
-					fprintf (stderr,
-					         _("%s: -Z cannot be used with --prefix\n"),
-					         Prog);
-					exit (E_BAD_ARG);
-				}
-				if (is_selinux_enabled () > 0) {
-					Zflg = true;
-				} else {
-					fprintf (stderr,
-					         _("%s: -Z requires SELinux enabled kernel\n"),
-					         Prog);
-
-					exit (E_BAD_ARG);
-				}
-				break;
-#endif				/* WITH_SELINUX */
-			default:
-				usage (E_USAGE);
+		case 'Z':
+			if (prefix[0]) {
+				fprintf (stderr,
+				         _("%s: -Z cannot be used with --prefix\n"),
+				         Prog);
+				flag_exit (E_BAD_ARG);
 			}
+			if (is_selinux_enabled () > 0) {
+				Zflg = true;
+			} else {
+				fprintf (stderr,
+				         _("%s: -Z requires SELinux enabled kernel\n"),
+				         Prog);
+
+				flag_exit (E_BAD_ARG);
+			}
+			break;
+#endif				/* WITH_SELINUX */
+		default:
+			usage (E_USAGE);
 		}
 	}
 
-	if ((optind + 1) != argc) {
-		usage (E_USAGE);
+	/*
+	 * --batch only accepts -R and -P, the other options are given in
+	 * the records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+		return;
 	}
 
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	{
-		struct passwd *pampw;
-		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
-		if (pampw == NULL) {
-			fprintf (stderr,
-			         _("%s: Cannot determine your user name.\n"),
-			         Prog);
-			exit (E_PW_UPDATE);
+	if (drain_flg) {
+		if (optind != argc) {
+			usage (E_USAGE);
 		}
-
-		retval = pam_start ("userdel", pampw->pw_name, &conv, &pamh);
+		return;
 	}
 
-	if (PAM_SUCCESS == retval) {
-		retval = pam_authenticate (pamh, 0);
+	if ((optind + 1) != argc) {
+		usage (E_USAGE);
 	}
+	user_name = argv[argc - 1];
+}
 
-	if (PAM_SUCCESS == retval) {
-		retval = pam_acct_mgmt (pamh, 0);
-	}
+/*
+ * check_user - check that the user can be deleted, and get its entry
+ */
+static void check_user (void)
+{
+	const struct passwd *pwd;
 
-	if (PAM_SUCCESS != retval) {
-		fprintf (stderr, _("%s: PAM: %s\n"),
-		         Prog, pam_strerror (pamh, retval));
-		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
-		if (NULL != pamh) {
-			(void) pam_end (pamh, retval);
-		}
-		exit (E_PW_UPDATE);
+	/* --batch already opened the passwd file */
+	if (!pw_locked) {
+		pw_open (O_RDONLY);
 	}
-	(void) pam_end (pamh, retval);
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-	is_shadow_pwd = spw_file_present ();
-#ifdef SHADOWGRP
-	is_shadow_grp = sgr_file_present ();
-#endif				/* SHADOWGRP */
-#ifdef ENABLE_SUBIDS
-	is_sub_uid = sub_uid_file_present ();
-	is_sub_gid = sub_gid_file_present ();
-#endif				/* ENABLE_SUBIDS */
-
-	/*
-	 * Start with a quick check to see if the user exists.
-	 */
-	user_name = argv[argc - 1];
-	{
-		const struct passwd *pwd;
-
-		if (run_parts ("/etc/shadow-maint/userdel-pre.d", user_name,
-				"userdel")) {
-			exit(1);
+	pwd = pw_locate (user_name); /* we care only about local users */
+	if (NULL == pwd) {
+		if (!pw_locked) {
+			pw_close ();
 		}
-		pw_open(O_RDONLY);
-		pwd = pw_locate (user_name); /* we care only about local users */
-		if (NULL == pwd) {
-			pw_close();
-			fprintf (stderr, _("%s: user '%s' does not exist\n"),
-				 Prog, user_name);
+		fprintf (stderr, _("%s: user '%s' does not exist\n"),
+		         Prog, user_name);
 #ifdef WITH_AUDIT
-			audit_logger (AUDIT_DEL_USER, Prog,
-			              "deleting user not found",
-			              user_name, AUDIT_NO_ID,
-			              SHADOW_AUDIT_FAILURE);
+		audit_logger (AUDIT_DEL_USER, Prog,
+		              "deleting user not found",
+		              user_name, AUDIT_NO_ID,
+		              SHADOW_AUDIT_FAILURE);
 #endif				/* WITH_AUDIT */
-			exit (E_NOTFOUND);
-		}
-		user_id = pwd->pw_uid;
-		user_gid = pwd->pw_gid;
+		flag_exit (E_NOTFOUND);
+	}
+	user_id = pwd->pw_uid;
+	user_gid = pwd->pw_gid;
 
-		if (prefix[0]) {
+	if (prefix[0]) {
 
-			size_t len = strlen(prefix) + strlen(pwd->pw_dir) + 2;
-			int wlen;
-			user_home = xmalloc(len);
-			wlen = snprintf(user_home, len, "%s/%s", prefix, pwd->pw_dir);
-			assert (wlen == (int) len -1);
-		}
-		else {
-			user_home = xstrdup (pwd->pw_dir);
-		}
-		pw_close();
+		size_t len = strlen(prefix) + strlen(pwd->pw_dir) + 2;
+		int wlen;
+		user_home = xmalloc(len);
+		wlen = snprintf(user_home, len, "%s/%s", prefix, pwd->pw_dir);
+		assert (wlen == (int) len -1);
 	}
+	else {
+		user_home = xstrdup (pwd->pw_dir);
+	}
+	if (!pw_locked) {
+		pw_close ();
+	}
+
 #ifdef WITH_TCB
 	if (shadowtcb_set_user (user_name) == SHADOWTCB_FAILURE) {
 		exit (E_NOTFOUND);
@@ -1160,7 +1335,7 @@ int main (int argc, char **argv)
 			         _("%s: %s is the NIS master\n"),
 			         Prog, nis_master);
 		}
-		exit (E_NOTFOUND);
+		flag_exit (E_NOTFOUND);
 	}
 #endif				/* USE_NIS */
 	/*
@@ -1176,18 +1351,26 @@ int main (int argc, char **argv)
 			              user_name, AUDIT_NO_ID,
 			              SHADOW_AUDIT_FAILURE);
 #endif				/* WITH_AUDIT */
-			exit (E_USER_BUSY);
+			flag_exit (E_USER_BUSY);
 		}
 	}
+}
 
-	/*
-	 * Do the hard stuff - open the files, create the user entries,
-	 * create the home directory, then close and update the files.
-	 */
-	open_files ();
-	update_user ();
-	update_groups ();
+/*
+ * remove_user_files - remove the mail spool, the home directory and the
+ *                     SELinux user mapping of the user, with -r and -Z
+ *
+ *	Return the number of errors.
+ */
+static int remove_user_files (void)
+{
+	int errors = 0;
 
+	if (   rflg
+	    && (NULL == removal_queue)
+	    && getdef_bool ("DEFER_HOME_REMOVAL")) {
+		removal_queue = removal_queue_name ();
+	}
 	if (rflg) {
 		errors += remove_mailbox ();
 	}
@@ -1256,7 +1439,7 @@ int main (int argc, char **argv)
 		}
 		else
 #endif
-		if (remove_tree (user_home, true) != 0) {
+		if (remove_home () != 0) {
 			fprintf (stderr,
 			         _("%s: error removing directory %s\n"),
 			         Prog, user_home);
@@ -1297,6 +1480,411 @@ int main (int argc, char **argv)
 	}
 #endif				/* WITH_SELINUX */
 
+	return errors;
+}
+
+static int primary_group_cmp (const void *p1, const void *p2)
+{
+	const struct primary_group *g1 = p1;
+	const struct primary_group *g2 = p2;
+
+	if (g1->gid == g2->gid) {
+		return 0;
+	}
+	return (g1->gid < g2->gid) ? -1 : 1;
+}
+
+/*
+ * primary_groups_build - count the users of each primary group, with a
+ *                        single scan of the passwd file
+ */
+static void primary_groups_build (void)
+{
+	const struct passwd *pwd;
+	struct primary_group *list = NULL;
+	size_t n = 0;
+	size_t i, j;
+
+	prefix_setpwent ();
+	while ((pwd = prefix_getpwent ()) != NULL) {
+		if (0 == (n % 64)) {
+			struct primary_group *tmp;
+
+			tmp = realloc (list, (n + 64) * sizeof *list);
+			if (NULL == tmp) {
+				fprintf (stderr, _("%s: out of memory\n"), Prog);
+				fail_exit (E_GRP_UPDATE);
+			}
+			list = tmp;
+		}
+		list[n].gid = pwd->pw_gid;
+		list[n].users = 1;
+		n++;
+	}
+	prefix_endpwent ();
+
+	if (0 == n) {
+		/* An empty table still replaces the scans */
+		list = xmalloc (sizeof *list);
+	}
+	qsort (list, n, sizeof *list, primary_group_cmp);
+	for (i = 0, j = 0; i < n; i++) {
+		if ((j > 0) && (list[j - 1].gid == list[i].gid)) {
+			list[j - 1].users++;
+		} else {
+			list[j++] = list[i];
+		}
+	}
+
+	primary_groups = list;
+	primary_groups_count = j;
+}
+
+/*
+ * primary_group_find - return the entry of gid in the table of --batch
+ */
+static /*@null@*/struct primary_group *primary_group_find (gid_t gid)
+{
+	struct primary_group key;
+
+	key.gid = gid;
+	return bsearch (&key, primary_groups, primary_groups_count,
+	                sizeof *primary_groups, primary_group_cmp);
+}
+
+/*
+ * reset_record - reset the values of the previous record
+ */
+static void reset_record (void)
+{
+	user_name = NULL;
+	user_id = 0;
+	user_gid = 0;
+	user_home = NULL;
+
+	fflg = false;
+	rflg = false;
+#ifdef WITH_SELINUX
+	Zflg = false;
+#endif				/* WITH_SELINUX */
+}
+
+/*
+ * del_record - delete the entries of the user of a --batch record
+ *
+ *	Return 0 on success, or the exit status of userdel for this record.
+ */
+static int del_record (struct batch_record *rec)
+{
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		reset_record ();
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+		check_user ();
+		update_user ();
+		if (NULL != primary_groups) {
+			struct primary_group *pg;
+
+			/* Not the primary group of this user anymore */
+			pg = primary_group_find (user_gid);
+			if ((NULL != pg) && (pg->users > 0)) {
+				pg->users--;
+			}
+		}
+		update_groups ();
+
+		rec->deleted = true;
+		rec->name = user_name;
+		rec->uid = user_id;
+		rec->home = user_home;
+		rec->fflg = fflg;
+		rec->rflg = rflg;
+#ifdef WITH_SELINUX
+		rec->Zflg = Zflg;
+#endif				/* WITH_SELINUX */
+	} else {
+		const char *name = user_name;
+
+		if ((NULL == name) && (rec->argc > 1)) {
+			/* The options were not parsed */
+			name = rec->argv[rec->argc - 1];
+		}
+		fprintf (stderr, _("%s: line %u: cannot delete user '%s'\n"),
+		         Prog, rec->line, (NULL != name) ? name : "");
+		SYSLOG ((LOG_INFO, "failed deleting user '%s', exit code: %d",
+		         (NULL != name) ? name : "", code));
+	}
+	record_env = NULL;
+
+	return rec->deleted ? 0 : code;
+}
+
+/*
+ * remove_record - remove the files of the user of a --batch record
+ *
+ *	Return the number of errors, or -1 if the record failed.
+ */
+static int remove_record (struct batch_record *rec)
+{
+	jmp_buf env;
+	int errors = -1;
+
+	if (setjmp (env) == 0) {
+		record_env = &env;
+		reset_record ();
+		user_name = rec->name;
+		user_id = rec->uid;
+		user_home = rec->home;
+		fflg = rec->fflg;
+		rflg = rec->rflg;
+#ifdef WITH_SELINUX
+		Zflg = rec->Zflg;
+#endif				/* WITH_SELINUX */
+		errors = remove_user_files ();
+	}
+	record_env = NULL;
+
+	return errors;
+}
+
+/*
+ * del_batch - delete the users of the records of file
+ *
+ *	The records are checked and deleted from the databases, which are
+ *	locked and written once. If a record fails, the others are still
+ *	checked, but no user is deleted. The home directories and mail
+ *	spools are removed once the databases are written.
+ *
+ *	Return the exit status of userdel.
+ */
+static int del_batch (const char *file)
+{
+	struct batch_line *lines;
+	struct batch_record *records;
+	size_t count;
+	size_t i;
+	int status = E_SUCCESS;
+	int errors = 0;
+	int code;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr, _("%s: --batch cannot be used with tcb enabled\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	if (batch_read (file, &lines, &count) != 0) {
+		exit (E_BAD_ARG);
+	}
+	records = xmalloc ((count + 1) * sizeof *records);
+	memzero (records, (count + 1) * sizeof *records);
+	for (i = 0; i < count; i++) {
+		records[i].line = lines[i].line;
+		records[i].argc = lines[i].argc;
+		records[i].argv = lines[i].argv;
+		if (   (records[i].argc > 1)
+		    && run_parts ("/etc/shadow-maint/userdel-pre.d",
+		                  records[i].argv[records[i].argc - 1],
+		                  "userdel")) {
+			exit (1);
+		}
+	}
+	free (lines);
+
+	open_files ();
+#ifdef WITH_AUDIT
+	audit_batch_begin (0);
+#endif				/* WITH_AUDIT */
+	if (getdef_bool ("USERGROUPS_ENAB")) {
+		primary_groups_build ();
+	}
+
+	for (i = 0; i < count; i++) {
+		code = del_record (&records[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was deleted\n"), Prog);
+		user_name = "";
+		fail_exit (status);
+	}
+
+	/* Before the entries are removed from /etc/passwd */
+	if (prefix[0] == '\0') {
+		for (i = 0; i < count; i++) {
+			user_cancel (records[i].name);
+		}
+	}
+	close_files ();
+#ifdef WITH_AUDIT
+	audit_batch_end ();
+#endif				/* WITH_AUDIT */
+
+	for (i = 0; i < count; i++) {
+		code = remove_record (&records[i]);
+		if (code < 0) {
+			fprintf (stderr,
+			         _("%s: line %u: cannot remove the files of user '%s'\n"),
+			         Prog, records[i].line, records[i].name);
+			if (E_SUCCESS == status) {
+				status = E_SE_UPDATE;
+			}
+		} else {
+			errors += code;
+		}
+	}
+
+	if (   (NULL != removal_queue)
+	    && (removal_queue_drain (removal_queue,
+	                             getdef_bool ("HOME_REMOVE_ASYNC")) != 0)) {
+		fprintf (stderr,
+		         _("%s: some files could not be removed, they remain in %s\n"),
+		         Prog, removal_queue);
+		errors++;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (run_parts ("/etc/shadow-maint/userdel-post.d",
+		               records[i].name, "userdel")) {
+			exit (1);
+		}
+	}
+
+	if ((E_SUCCESS == status) && (0 != errors)) {
+		status = E_HOMEDIR;
+	}
+	return status;
+}
+
+/*
+ * main - userdel command
+ */
+int main (int argc, char **argv)
+{
+	int errors = 0; /* Error in the removal of the home directory */
+
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	pam_handle_t *pamh = NULL;
+	int retval;
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	/*
+	 * Get my name so that I can use it to report errors.
+	 */
+	Prog = Basename (argv[0]);
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", argc, argv);
+	prefix = process_prefix_flag ("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
+
+	OPENLOG ("userdel");
+#ifdef WITH_AUDIT
+	audit_help_open ();
+#endif				/* WITH_AUDIT */
+
+	process_flags (argc, argv);
+
+	if (drain_flg) {
+		removal_queue = removal_queue_name ();
+		if (removal_queue_drain (removal_queue, false) != 0) {
+			fprintf (stderr,
+			         _("%s: some files could not be removed, they remain in %s\n"),
+			         Prog, removal_queue);
+			exit (E_HOMEDIR);
+		}
+		exit (E_SUCCESS);
+	}
+
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	{
+		struct passwd *pampw;
+		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
+		if (pampw == NULL) {
+			fprintf (stderr,
+			         _("%s: Cannot determine your user name.\n"),
+			         Prog);
+			exit (E_PW_UPDATE);
+		}
+
+		retval = pam_start ("userdel", pampw->pw_name, &conv, &pamh);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_authenticate (pamh, 0);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_acct_mgmt (pamh, 0);
+	}
+
+	if (PAM_SUCCESS != retval) {
+		fprintf (stderr, _("%s: PAM: %s\n"),
+		         Prog, pam_strerror (pamh, retval));
+		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
+		if (NULL != pamh) {
+			(void) pam_end (pamh, retval);
+		}
+		exit (E_PW_UPDATE);
+	}
+	(void) pam_end (pamh, retval);
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	is_shadow_pwd = spw_file_present ();
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif				/* SHADOWGRP */
+#ifdef ENABLE_SUBIDS
+	is_sub_uid = sub_uid_file_present ();
+	is_sub_gid = sub_gid_file_present ();
+#endif				/* ENABLE_SUBIDS */
+
+	if (NULL != batch_file) {
+		return del_batch (batch_file);
+	}
+
+	/*
+	 * Start with a quick check to see if the user exists.
+	 */
+	if (run_parts ("/etc/shadow-maint/userdel-pre.d", user_name,
+			"userdel")) {
+		exit(1);
+	}
+	check_user ();
+
+	/*
+	 * Do the hard stuff - open the files, create the user entries,
+	 * create the home directory, then close and update the files.
+	 */
+	open_files ();
+#ifdef WITH_AUDIT
+	/* One event per group: send them after the commit */
+	audit_batch_begin (0);
+#endif				/* WITH_AUDIT */
+	update_user ();
+	update_groups ();
+
+	errors += remove_user_files ();
+
 	/*
 	 * Cancel any crontabs or at jobs. Have to do this before we remove
 	 * the entry from /etc/passwd.
@@ -1304,6 +1892,22 @@ int main (int argc, char **argv)
 	if (prefix[0] == '\0')
 		user_cancel (user_name);
 	close_files ();
+#ifdef WITH_AUDIT
+	audit_batch_end ();
+#endif				/* WITH_AUDIT */
+
+	/*
+	 * The databases are unlocked, now remove the deferred home directory
+	 * and mail spool (and those left by the previous runs).
+	 */
+	if (   (NULL != removal_queue)
+	    && (removal_queue_drain (removal_queue,
+	                             getdef_bool ("HOME_REMOVE_ASYNC")) != 0)) {
+		fprintf (stderr,
+		         _("%s: some files could not be removed, they remain in %s\n"),
+		         Prog, removal_queue);
+		errors++;
+	}
 
 	if (run_parts ("/etc/shadow-maint/userdel-post.d", user_name, "userdel")) {
 		exit(1);
@@ -1313,10 +1917,5 @@ int main (int argc, char **argv)
 	errors += remove_tcbdir (user_name, user_id);
 #endif				/* WITH_TCB */
 
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
-
 	return ((0 != errors) ? E_HOMEDIR : E_SUCCESS);
 }
-
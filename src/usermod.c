@@ -18,23 +18,24 @@
 #include <getopt.h>
 #include <grp.h>
 #include <lastlog.h>
+#include <limits.h>
 #include <pwd.h>
 #ifdef ACCT_TOOLS_SETUID
 #ifdef USE_PAM
 #include "pam_defs.h"
 #endif				/* USE_PAM */
 #endif				/* ACCT_TOOLS_SETUID */
+#include <setjmp.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
+#include "acctstate.h"
 #include "chkname.h"
 #include "defines.h"
 #include "faillog.h"
 #include "getdef.h"
 #include "groupio.h"
-#include "nscd.h"
-#include "sssd.h"
 #include "prototypes.h"
 #include "pwauth.h"
 #include "pwio.h"
@@ -110,6 +111,8 @@ static char **user_groups;	/* NULL-terminated list */
 static const char* prefix = "";
 static char* prefix_user_home = NULL;
 static char* prefix_user_newhome = NULL;
+/* Copy of the home made by --stage-home, renamed by move_home() */
+static /*@null@*/char *stage_home_path = NULL;
 
 static bool
     aflg = false,		/* append to existing secondary group set */
@@ -119,13 +122,16 @@ static bool
     fflg = false,		/* days until account with expired password is locked */
     gflg = false,		/* new primary group ID */
     Gflg = false,		/* new secondary group set */
+    idmapflg = false,		/* remap the IDs of a mounted home */
     Lflg = false,		/* lock the password */
     lflg = false,		/* new user name */
     mflg = false,		/* create user's home directory if it doesn't exist */
     oflg = false,		/* permit non-unique user ID to be specified with -u */
     pflg = false,		/* new encrypted password */
+    progressflg = false,	/* report the progress of the copy of the home */
     rflg = false,		/* remove a user from a single group */
     sflg = false,		/* new shell program */
+    stageflg = false,		/* copy the home before the account is changed */
 #ifdef WITH_SELINUX
     Zflg = false,		/* new selinux user */
 #endif
@@ -160,16 +166,60 @@ static bool sub_uid_locked = false;
 static bool sub_gid_locked = false;
 #endif				/* ENABLE_SUBIDS */
 
+/*
+ * --batch FILE modifies the users of the records of FILE, one set of
+ * usermod arguments per line, with a single lock and write of the
+ * databases. While a record is processed, record_env is set, and the
+ * errors which would exit only fail this record.
+ */
+static /*@null@*/const char *batch_file = NULL;
+static /*@null@*/jmp_buf *record_env = NULL;
+static bool record_unchanged = false;	/* "no changes" for the record */
+static int record_bad_names;	/* --badname of the command line */
+
+struct batch_record {
+	unsigned int line;
+	int argc;
+	char **argv;
+	bool modified;
+	bool unchanged;
+
+	/* Values needed once the databases are written */
+	char *name;
+	char *newname;
+	uid_t id;
+	uid_t newid;
+	gid_t gid;
+	gid_t newgid;
+	char *home;
+	char *newhome;
+	char *prefix_home;
+	char *prefix_newhome;
+#ifdef WITH_SELINUX
+	const char *selinux;
+	bool Zflg;
+#endif				/* WITH_SELINUX */
+	bool dflg;
+	bool gflg;
+	bool idmapflg;
+	bool lflg;
+	bool mflg;
+	bool progressflg;
+	bool uflg;
+};
 
 /* local function prototypes */
+static /*@null@*/struct group *get_local_group (const char *grname);
 static int get_groups (char *);
 NORETURN static void usage (int status);
 static void new_pwent (struct passwd *);
 static void new_spent (struct spwd *);
 NORETURN static void fail_exit (int);
+static void update_group_entry (const struct group *grp);
 static void update_group (void);
 
 #ifdef SHADOWGRP
+static void update_gshadow_entry (const struct sgrp *sgrp);
 static void update_gshadow (void);
 #endif
 static void grp_update (void);
@@ -178,6 +228,7 @@ static void process_flags (int, char **);
 static void close_files (void);
 static void open_files (void);
 static void usr_update (void);
+static void stage_home (void);
 static void move_home (void);
 static void update_lastlog (void);
 static void update_faillog (void);
@@ -185,9 +236,58 @@ static void update_faillog (void);
 #ifndef NO_MOVE_MAILBOX
 static void move_mailbox (void);
 #endif
+static void flag_exit (int code);
+static void reject_in_record (const char *option);
+static /*@observer@*/ /*@null@*/const struct passwd *locate_user (const char *name);
+static /*@observer@*/ /*@null@*/const struct passwd *locate_uid (uid_t uid);
+static /*@observer@*/ /*@null@*/const struct spwd *locate_shadow (const char *name);
+static void mod_user (void);
+static void update_files (void);
+static void reset_record (void);
+static int mod_record (struct batch_record *rec);
+static int update_record (struct batch_record *rec);
+static int mod_batch (const char *file);
 
 extern int allow_bad_names;
 
+/*
+ * get_local_group - find a group in the opened group file
+ *
+ *	Names made of digits are GID values. A copy of the group is
+ *	returned, or NULL if the group file is not opened or does not have
+ *	the group.
+ */
+static /*@null@*/struct group *get_local_group (const char *grname)
+{
+	const struct group *grp;
+	struct group *result;
+	long long int gid;
+	char *endptr;
+
+	errno = 0;
+	gid = strtoll (grname, &endptr, 10);
+	if (   ('\0' != *grname)
+	    && ('\0' == *endptr)
+	    && (ERANGE != errno)
+	    && (gid == (gid_t)gid)) {
+		grp = gr_locate_gid (gid);
+	} else {
+		grp = gr_locate (grname);
+	}
+	if (NULL == grp) {
+		return NULL;
+	}
+
+	result = __gr_dup (grp);
+	if (NULL == result) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot find group '%s'.\n"),
+		         Prog, grname);
+		fail_exit (E_GRP_UPDATE);
+	}
+	return result;
+}
+
 /*
  * get_groups - convert a list of group names to an array of group IDs
  *
@@ -201,6 +301,7 @@ static int get_groups (char *list)
 	struct group *grp;
 	int errors = 0;
 	int ngroups = 0;
+	bool opened = false;
 
 	/*
 	 * Initialize the list to be empty
@@ -211,6 +312,15 @@ static int get_groups (char *list)
 		return 0;
 	}
 
+	/*
+	 * Load the group file once to resolve all the groups with its
+	 * index, unless --batch already opened it. The groups which are
+	 * not in the local file are still looked up one by one.
+	 */
+	if (!gr_locked && (gr_open (O_RDONLY) != 0)) {
+		opened = true;
+	}
+
 	/*
 	 * So long as there is some data to be converted, strip off each
 	 * name and look it up. A mix of numerical and string values for
@@ -230,7 +340,10 @@ static int get_groups (char *list)
 		 * Names starting with digits are treated as numerical GID
 		 * values, otherwise the string is looked up as is.
 		 */
-		grp = prefix_getgr_nam_gid (list);
+		grp = get_local_group (list);
+		if (NULL == grp) {
+			grp = prefix_getgr_nam_gid (list);
+		}
 
 		/*
 		 * There must be a match, either by GID value or by
@@ -280,6 +393,10 @@ static int get_groups (char *list)
 		gr_free (grp);
 	} while (NULL != list);
 
+	if (opened) {
+		(void) gr_close ();
+	}
+
 	user_groups[ngroups] = NULL;
 
 	/*
@@ -364,16 +481,26 @@ static void
 usage (int status)
 {
 	FILE *usageout = (E_SUCCESS != status) ? stderr : stdout;
+
+	if (NULL != record_env) {
+		longjmp (*record_env, status);
+	}
+
 	(void) fprintf (usageout,
 	                _("Usage: %s [options] LOGIN\n"
+	                  "       %s --batch FILE\n"
 	                  "\n"
 	                  "Options:\n"),
-	                Prog);
+	                Prog, Prog);
 	(void) fputs (_("  -a, --append                  append the user to the supplemental GROUPS\n"
 	                "                                mentioned by the -G option without removing\n"
 	                "                                the user from other groups\n"), usageout);
 	(void) fputs (_("  -b, --badname                 allow bad names\n"), usageout);
+	(void) fputs (_("      --batch FILE              modify the users of FILE, one set of options\n"
+	                "                                and LOGIN per line\n"), usageout);
 	(void) fputs (_("  -c, --comment COMMENT         new value of the GECOS field\n"), usageout);
+	(void) fputs (_("      --deadline MS             abort the operation if it takes more than MS\n"
+	                "                                milliseconds\n"), usageout);
 	(void) fputs (_("  -d, --home HOME_DIR           new home directory for the user account\n"), usageout);
 	(void) fputs (_("  -e, --expiredate EXPIRE_DATE  set account expiration date to EXPIRE_DATE\n"), usageout);
 	(void) fputs (_("  -f, --inactive INACTIVE       set password inactive after expiration\n"
@@ -381,6 +508,9 @@ usage (int status)
 	(void) fputs (_("  -g, --gid GROUP               force use GROUP as new primary group\n"), usageout);
 	(void) fputs (_("  -G, --groups GROUPS           new list of supplementary GROUPS\n"), usageout);
 	(void) fputs (_("  -h, --help                    display this help message and exit\n"), usageout);
+	(void) fputs (_("      --idmap-home              with -u or -g, remap the IDs of a mounted\n"
+	                "                                home directory instead of changing the\n"
+	                "                                owner of its files\n"), usageout);
 	(void) fputs (_("  -l, --login NEW_LOGIN         new value of the login name\n"), usageout);
 	(void) fputs (_("  -L, --lock                    lock the user account\n"), usageout);
 	(void) fputs (_("  -m, --move-home               move contents of the home directory to the\n"
@@ -388,11 +518,17 @@ usage (int status)
 	(void) fputs (_("  -o, --non-unique              allow using duplicate (non-unique) UID\n"), usageout);
 	(void) fputs (_("  -p, --password PASSWORD       use encrypted password for the new password\n"), usageout);
 	(void) fputs (_("  -P, --prefix PREFIX_DIR       prefix directory where are located the /etc/* files\n"), usageout);
+	(void) fputs (_("      --progress                report the progress of the home directory\n"
+	                "                                move across file systems\n"), usageout);
 	(void) fputs (_("  -r, --remove                  remove the user from only the supplemental GROUPS\n"
 	                "                                mentioned by the -G option without removing\n"
 	                "                                the user from other groups\n"), usageout);
 	(void) fputs (_("  -R, --root CHROOT_DIR         directory to chroot into\n"), usageout);
+	(void) fputs (_("      --shard SHARD             change the entries of the shard SHARD of the\n"
+	                "                                databases\n"), usageout);
 	(void) fputs (_("  -s, --shell SHELL             new login shell for the user account\n"), usageout);
+	(void) fputs (_("      --stage-home              copy the home directory to another file\n"
+	                "                                system before the account is changed\n"), usageout);
 	(void) fputs (_("  -u, --uid UID                 new UID for the user account\n"), usageout);
 	(void) fputs (_("  -U, --unlock                  unlock the user account\n"), usageout);
 #ifdef ENABLE_SUBIDS
@@ -627,6 +763,11 @@ NORETURN
 static void
 fail_exit (int code)
 {
+	if (NULL != record_env) {
+		/* Only the current record of --batch fails */
+		longjmp (*record_env, code);
+	}
+
 	if (gr_locked) {
 		if (gr_unlock () == 0) {
 			fprintf (stderr, _("%s: failed to unlock %s\n"), Prog, gr_dbname ());
@@ -683,260 +824,334 @@ fail_exit (int code)
 }
 
 
-static void update_group (void)
+/*
+ * update_group_entry - update the membership of the user in a group
+ */
+static void update_group_entry (const struct group *grp)
 {
 	bool is_member;
 	bool was_member;
 	bool changed;
-	const struct group *grp;
 	struct group *ngrp;
 
 	changed = false;
 
 	/*
-	 * Scan through the entire group file looking for the groups that
-	 * the user is a member of.
+	 * See if the user specified this group as one of their
+	 * concurrent groups.
 	 */
-	while ((grp = gr_next ()) != NULL) {
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		was_member = is_on_list (grp->gr_mem, user_name);
-		is_member = Gflg && (   (was_member && aflg)
-		                     || is_on_list (user_groups, grp->gr_name));
+	was_member = is_on_list (grp->gr_mem, user_name);
+	is_member = Gflg && (   (was_member && aflg)
+	                     || is_on_list (user_groups, grp->gr_name));
 
-		if (!was_member && !is_member) {
-			continue;
-		}
+	if (!was_member && !is_member) {
+		return;
+	}
 
-		/*
-		* If rflg+Gflg  is passed in AKA -rG invert is_member flag, which removes
-		* mentioned groups while leaving the others.
-		*/
-		if (Gflg && rflg) {
-			is_member = !is_member;
-		}
+	/*
+	* If rflg+Gflg  is passed in AKA -rG invert is_member flag, which removes
+	* mentioned groups while leaving the others.
+	*/
+	if (Gflg && rflg) {
+		is_member = !is_member;
+	}
 
-		ngrp = __gr_dup (grp);
-		if (NULL == ngrp) {
-			fprintf (stderr,
-			         _("%s: Out of memory. Cannot update %s.\n"),
-			         Prog, gr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
+	ngrp = __gr_dup (grp);
+	if (NULL == ngrp) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, gr_dbname ());
+		fail_exit (E_GRP_UPDATE);
+	}
 
-		if (was_member) {
-			if ((!Gflg) || is_member) {
-				/* User was a member and is still a member
-				 * of this group.
-				 * But the user might have been renamed.
-				 */
-				if (lflg) {
-					ngrp->gr_mem = del_list (ngrp->gr_mem,
-					                         user_name);
-					ngrp->gr_mem = add_list (ngrp->gr_mem,
-					                         user_newname);
-					changed = true;
-#ifdef WITH_AUDIT
-					audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-					              "changing group member",
-					              user_newname, AUDIT_NO_ID, 1);
-#endif
-					SYSLOG ((LOG_INFO,
-					         "change '%s' to '%s' in group '%s'",
-					         user_name, user_newname,
-					         ngrp->gr_name));
-				}
-			} else {
-				/* User was a member but is no more a
-				 * member of this group.
-				 */
-				ngrp->gr_mem = del_list (ngrp->gr_mem, user_name);
+	if (was_member) {
+		if ((!Gflg) || is_member) {
+			/* User was a member and is still a member
+			 * of this group.
+			 * But the user might have been renamed.
+			 */
+			if (lflg) {
+				ngrp->gr_mem = del_list (ngrp->gr_mem,
+				                         user_name);
+				ngrp->gr_mem = add_list (ngrp->gr_mem,
+				                         user_newname);
 				changed = true;
 #ifdef WITH_AUDIT
 				audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-				              "removing group member",
-				              user_name, AUDIT_NO_ID, 1);
+				              "changing group member",
+				              user_newname, AUDIT_NO_ID, 1);
 #endif
 				SYSLOG ((LOG_INFO,
-				         "delete '%s' from group '%s'",
-				         user_name, ngrp->gr_name));
+				         "change '%s' to '%s' in group '%s'",
+				         user_name, user_newname,
+				         ngrp->gr_name));
 			}
-		} else if (is_member) {
-			/* User was not a member but is now a member this
-			 * group.
+		} else {
+			/* User was a member but is no more a
+			 * member of this group.
 			 */
-			ngrp->gr_mem = add_list (ngrp->gr_mem, user_newname);
+			ngrp->gr_mem = del_list (ngrp->gr_mem, user_name);
 			changed = true;
 #ifdef WITH_AUDIT
 			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-			              "adding user to group",
+			              "removing group member",
 			              user_name, AUDIT_NO_ID, 1);
 #endif
-			SYSLOG ((LOG_INFO, "add '%s' to group '%s'",
-			         user_newname, ngrp->gr_name));
+			SYSLOG ((LOG_INFO,
+			         "delete '%s' from group '%s'",
+			         user_name, ngrp->gr_name));
 		}
-		if (!changed) {
-			continue;
+	} else if (is_member) {
+		/* User was not a member but is now a member this
+		 * group.
+		 */
+		ngrp->gr_mem = add_list (ngrp->gr_mem, user_newname);
+		changed = true;
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "adding user to group",
+		              user_name, AUDIT_NO_ID, 1);
+#endif
+		SYSLOG ((LOG_INFO, "add '%s' to group '%s'",
+		         user_newname, ngrp->gr_name));
+	}
+	if (!changed) {
+		gr_free (ngrp);
+		return;
+	}
+
+	if (gr_update (ngrp) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, gr_dbname (), ngrp->gr_name);
+		SYSLOG ((LOG_WARN, "failed to prepare the new %s entry '%s'", gr_dbname (), ngrp->gr_name));
+		fail_exit (E_GRP_UPDATE);
+	}
+
+	gr_free(ngrp);
+}
+
+static void update_group (void)
+{
+	const struct group **groups;
+	const struct group *grp;
+	size_t i, j;
+
+	/*
+	 * Find the groups the user is a member of with the member index
+	 * of the group file. Without it, scan through the entire file.
+	 */
+	groups = gr_member_of (user_name);
+	if (NULL == groups) {
+		while ((grp = gr_next ()) != NULL) {
+			update_group_entry (grp);
 		}
+		return;
+	}
 
-		changed = false;
-		if (gr_update (ngrp) == 0) {
-			fprintf (stderr,
-			         _("%s: failed to prepare the new %s entry '%s'\n"),
-			         Prog, gr_dbname (), ngrp->gr_name);
-			SYSLOG ((LOG_WARN, "failed to prepare the new %s entry '%s'", gr_dbname (), ngrp->gr_name));
-			fail_exit (E_GRP_UPDATE);
+	/*
+	 * The groups specified with -G which do not list the user yet.
+	 * They are checked before any update, so that they cannot be
+	 * mistaken for the groups the user is renamed in.
+	 */
+	for (i = 0; Gflg && (NULL != user_groups[i]); i++) {
+		for (j = 0; j < i; j++) {
+			if (strcmp (user_groups[i], user_groups[j]) == 0) {
+				break;
+			}
 		}
+		grp = gr_locate (user_groups[i]);
+		if (   (j == i)
+		    && (NULL != grp)
+		    && !is_on_list (grp->gr_mem, user_name)) {
+			update_group_entry (grp);
+		}
+	}
 
-		gr_free(ngrp);
+	for (i = 0; NULL != groups[i]; i++) {
+		update_group_entry (groups[i]);
 	}
+	free (groups);
 }
 
 #ifdef SHADOWGRP
-static void update_gshadow (void)
+/*
+ * update_gshadow_entry - update the membership of the user in a shadow group
+ */
+static void update_gshadow_entry (const struct sgrp *sgrp)
 {
 	bool is_member;
 	bool was_member;
 	bool was_admin;
 	bool changed;
-	const struct sgrp *sgrp;
 	struct sgrp *nsgrp;
 
 	changed = false;
 
 	/*
-	 * Scan through the entire shadow group file looking for the groups
-	 * that the user is a member of.
+	 * See if the user was a member of this group
 	 */
-	while ((sgrp = sgr_next ()) != NULL) {
+	was_member = is_on_list (sgrp->sg_mem, user_name);
 
-		/*
-		 * See if the user was a member of this group
-		 */
-		was_member = is_on_list (sgrp->sg_mem, user_name);
-
-		/*
-		 * See if the user was an administrator of this group
-		 */
-		was_admin = is_on_list (sgrp->sg_adm, user_name);
+	/*
+	 * See if the user was an administrator of this group
+	 */
+	was_admin = is_on_list (sgrp->sg_adm, user_name);
 
-		/*
-		 * See if the user specified this group as one of their
-		 * concurrent groups.
-		 */
-		is_member = Gflg && (   (was_member && aflg)
-		                     || is_on_list (user_groups, sgrp->sg_name));
+	/*
+	 * See if the user specified this group as one of their
+	 * concurrent groups.
+	 */
+	is_member = Gflg && (   (was_member && aflg)
+	                     || is_on_list (user_groups, sgrp->sg_name));
 
-		if (!was_member && !was_admin && !is_member) {
-			continue;
-		}
+	if (!was_member && !was_admin && !is_member) {
+		return;
+	}
 
-		/*
-		* If rflg+Gflg  is passed in AKA -rG invert is_member, to remove targeted
-		* groups while leaving the user apart of groups not mentioned
-		*/
-		if (Gflg && rflg) {
-			is_member = !is_member;
-		}
+	/*
+	* If rflg+Gflg  is passed in AKA -rG invert is_member, to remove targeted
+	* groups while leaving the user apart of groups not mentioned
+	*/
+	if (Gflg && rflg) {
+		is_member = !is_member;
+	}
 
-		nsgrp = __sgr_dup (sgrp);
-		if (NULL == nsgrp) {
-			fprintf (stderr,
-			         _("%s: Out of memory. Cannot update %s.\n"),
-			         Prog, sgr_dbname ());
-			fail_exit (E_GRP_UPDATE);
-		}
+	nsgrp = __sgr_dup (sgrp);
+	if (NULL == nsgrp) {
+		fprintf (stderr,
+		         _("%s: Out of memory. Cannot update %s.\n"),
+		         Prog, sgr_dbname ());
+		fail_exit (E_GRP_UPDATE);
+	}
 
-		if (was_admin && lflg) {
-			/* User was an admin of this group but the user
-			 * has been renamed.
-			 */
-			nsgrp->sg_adm = del_list (nsgrp->sg_adm, user_name);
-			nsgrp->sg_adm = add_list (nsgrp->sg_adm, user_newname);
-			changed = true;
-#ifdef WITH_AUDIT
-			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-			              "changing admin name in shadow group",
-			              user_name, AUDIT_NO_ID, 1);
-#endif
-			SYSLOG ((LOG_INFO,
-			         "change admin '%s' to '%s' in shadow group '%s'",
-			         user_name, user_newname, nsgrp->sg_name));
-		}
-
-		if (was_member) {
-			if ((!Gflg) || is_member) {
-				/* User was a member and is still a member
-				 * of this group.
-				 * But the user might have been renamed.
-				 */
-				if (lflg) {
-					nsgrp->sg_mem = del_list (nsgrp->sg_mem,
-					                          user_name);
-					nsgrp->sg_mem = add_list (nsgrp->sg_mem,
-					                          user_newname);
-					changed = true;
+	if (was_admin && lflg) {
+		/* User was an admin of this group but the user
+		 * has been renamed.
+		 */
+		nsgrp->sg_adm = del_list (nsgrp->sg_adm, user_name);
+		nsgrp->sg_adm = add_list (nsgrp->sg_adm, user_newname);
+		changed = true;
 #ifdef WITH_AUDIT
-					audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-					              "changing member in shadow group",
-					              user_name, AUDIT_NO_ID, 1);
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "changing admin name in shadow group",
+		              user_name, AUDIT_NO_ID, 1);
 #endif
-					SYSLOG ((LOG_INFO,
-					         "change '%s' to '%s' in shadow group '%s'",
-					         user_name, user_newname,
-					         nsgrp->sg_name));
-				}
-			} else {
-				/* User was a member but is no more a
-				 * member of this group.
-				 */
-				nsgrp->sg_mem = del_list (nsgrp->sg_mem, user_name);
+		SYSLOG ((LOG_INFO,
+		         "change admin '%s' to '%s' in shadow group '%s'",
+		         user_name, user_newname, nsgrp->sg_name));
+	}
+
+	if (was_member) {
+		if ((!Gflg) || is_member) {
+			/* User was a member and is still a member
+			 * of this group.
+			 * But the user might have been renamed.
+			 */
+			if (lflg) {
+				nsgrp->sg_mem = del_list (nsgrp->sg_mem,
+				                          user_name);
+				nsgrp->sg_mem = add_list (nsgrp->sg_mem,
+				                          user_newname);
 				changed = true;
 #ifdef WITH_AUDIT
 				audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-				              "removing user from shadow group",
+				              "changing member in shadow group",
 				              user_name, AUDIT_NO_ID, 1);
 #endif
 				SYSLOG ((LOG_INFO,
-				         "delete '%s' from shadow group '%s'",
-				         user_name, nsgrp->sg_name));
+				         "change '%s' to '%s' in shadow group '%s'",
+				         user_name, user_newname,
+				         nsgrp->sg_name));
 			}
-		} else if (is_member) {
-			/* User was not a member but is now a member this
-			 * group.
+		} else {
+			/* User was a member but is no more a
+			 * member of this group.
 			 */
-			nsgrp->sg_mem = add_list (nsgrp->sg_mem, user_newname);
+			nsgrp->sg_mem = del_list (nsgrp->sg_mem, user_name);
 			changed = true;
 #ifdef WITH_AUDIT
 			audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
-			              "adding user to shadow group",
-			              user_newname, AUDIT_NO_ID, 1);
+			              "removing user from shadow group",
+			              user_name, AUDIT_NO_ID, 1);
 #endif
-			SYSLOG ((LOG_INFO, "add '%s' to shadow group '%s'",
-			         user_newname, nsgrp->sg_name));
-		}
-		if (!changed) {
-			continue;
+			SYSLOG ((LOG_INFO,
+			         "delete '%s' from shadow group '%s'",
+			         user_name, nsgrp->sg_name));
 		}
+	} else if (is_member) {
+		/* User was not a member but is now a member this
+		 * group.
+		 */
+		nsgrp->sg_mem = add_list (nsgrp->sg_mem, user_newname);
+		changed = true;
+#ifdef WITH_AUDIT
+		audit_logger (AUDIT_USER_CHAUTHTOK, Prog,
+		              "adding user to shadow group",
+		              user_newname, AUDIT_NO_ID, 1);
+#endif
+		SYSLOG ((LOG_INFO, "add '%s' to shadow group '%s'",
+		         user_newname, nsgrp->sg_name));
+	}
+	if (!changed) {
+		sgr_free (nsgrp);
+		return;
+	}
 
-		changed = false;
+	/*
+	 * Update the group entry to reflect the changes.
+	 */
+	if (sgr_update (nsgrp) == 0) {
+		fprintf (stderr,
+		         _("%s: failed to prepare the new %s entry '%s'\n"),
+		         Prog, sgr_dbname (), nsgrp->sg_name);
+		SYSLOG ((LOG_WARN, "failed to prepare the new %s entry '%s'",
+		         sgr_dbname (), nsgrp->sg_name));
+		fail_exit (E_GRP_UPDATE);
+	}
 
-		/*
-		 * Update the group entry to reflect the changes.
-		 */
-		if (sgr_update (nsgrp) == 0) {
-			fprintf (stderr,
-			         _("%s: failed to prepare the new %s entry '%s'\n"),
-			         Prog, sgr_dbname (), nsgrp->sg_name);
-			SYSLOG ((LOG_WARN, "failed to prepare the new %s entry '%s'",
-			         sgr_dbname (), nsgrp->sg_name));
-			fail_exit (E_GRP_UPDATE);
+	free (nsgrp);
+}
+
+static void update_gshadow (void)
+{
+	const struct sgrp **sgroups;
+	const struct sgrp *sgrp;
+	size_t i, j;
+
+	/*
+	 * Find the shadow groups the user is a member or an administrator
+	 * of with the member index of the shadow group file. Without it,
+	 * scan through the entire file.
+	 */
+	sgroups = sgr_member_of (user_name);
+	if (NULL == sgroups) {
+		while ((sgrp = sgr_next ()) != NULL) {
+			update_gshadow_entry (sgrp);
+		}
+		return;
+	}
+
+	/* Same as in update_group() */
+	for (i = 0; Gflg && (NULL != user_groups[i]); i++) {
+		for (j = 0; j < i; j++) {
+			if (strcmp (user_groups[i], user_groups[j]) == 0) {
+				break;
+			}
 		}
+		sgrp = sgr_locate (user_groups[i]);
+		if (   (j == i)
+		    && (NULL != sgrp)
+		    && !is_on_list (sgrp->sg_mem, user_name)
+		    && !is_on_list (sgrp->sg_adm, user_name)) {
+			update_gshadow_entry (sgrp);
+		}
+	}
 
-		free (nsgrp);
+	for (i = 0; NULL != sgroups[i]; i++) {
+		update_gshadow_entry (sgroups[i]);
 	}
+	free (sgroups);
 }
 #endif				/* SHADOWGRP */
 
@@ -956,18 +1171,82 @@ static void grp_update (void)
 #endif
 }
 
+/*
+ * flag_exit - exit on an invalid argument
+ *
+ *	For a record of --batch, only the record fails.
+ */
+static void flag_exit (int code)
+{
+	if (NULL != record_env) {
+		longjmp (*record_env, code);
+	}
+	exit (code);
+}
+
+/*
+ * reject_in_record - fail the record of --batch which uses option
+ */
+static void reject_in_record (const char *option)
+{
+	if (NULL != record_env) {
+		fprintf (stderr,
+		         _("%s: %s cannot be used in a --batch record\n"),
+		         Prog, option);
+		longjmp (*record_env, E_USAGE);
+	}
+}
+
+/*
+ * locate_user, locate_uid, locate_shadow - find a local user
+ *
+ *	With --batch, the databases are already locked, and include the
+ *	changes of the previous records.
+ */
+static /*@observer@*/ /*@null@*/const struct passwd *locate_user (const char *name)
+{
+	if (pw_locked) {
+		return pw_locate (name);
+	}
+	/* local, no need for xgetpwnam */
+	return prefix_getpwnam (name);
+}
+
+static /*@observer@*/ /*@null@*/const struct passwd *locate_uid (uid_t uid)
+{
+	if (pw_locked) {
+		return pw_locate_uid (uid);
+	}
+	/* local, no need for xgetpwuid */
+	return prefix_getpwuid (uid);
+}
+
+static /*@observer@*/ /*@null@*/const struct spwd *locate_shadow (const char *name)
+{
+	if (pw_locked) {
+		return spw_locate (name);
+	}
+	/* local, no need for xgetspnam */
+	return prefix_getspnam (name);
+}
+
 /*
  * process_flags - perform command line argument setting
  *
  *	process_flags() interprets the command line arguments and sets the
  *	values that the user will be created with accordingly. The values
  *	are checked for sanity.
+ *
+ *	With --batch, the options of the command line are only the ones
+ *	common to all the records.
  */
 static void process_flags (int argc, char **argv)
 {
 	const struct group *grp;
 	struct stat st;
 	bool anyflag = false;
+	int nopts = 0;
+	int batch_opts = 0;	/* options allowed with --batch */
 
 	{
 		/*
@@ -977,13 +1256,16 @@ static void process_flags (int argc, char **argv)
 		static struct option long_options[] = {
 			{"append",       no_argument,       NULL, 'a'},
 			{"badnames",     no_argument,       NULL, 'b'},
+			{"batch",        required_argument, NULL, 201},
 			{"comment",      required_argument, NULL, 'c'},
+			{"deadline",     required_argument, NULL, 205},
 			{"home",         required_argument, NULL, 'd'},
 			{"expiredate",   required_argument, NULL, 'e'},
 			{"inactive",     required_argument, NULL, 'f'},
 			{"gid",          required_argument, NULL, 'g'},
 			{"groups",       required_argument, NULL, 'G'},
 			{"help",         no_argument,       NULL, 'h'},
+			{"idmap-home",   no_argument,       NULL, 203},
 			{"login",        required_argument, NULL, 'l'},
 			{"lock",         no_argument,       NULL, 'L'},
 			{"move-home",    no_argument,       NULL, 'm'},
@@ -992,7 +1274,10 @@ static void process_flags (int argc, char **argv)
 			{"remove",       no_argument,       NULL, 'r'},
 			{"root",         required_argument, NULL, 'R'},
 			{"prefix",       required_argument, NULL, 'P'},
+			{"progress",     no_argument,       NULL, 200},
+			{"shard",        required_argument, NULL, 204},
 			{"shell",        required_argument, NULL, 's'},
+			{"stage-home",   no_argument,       NULL, 202},
 			{"uid",          required_argument, NULL, 'u'},
 			{"unlock",       no_argument,       NULL, 'U'},
 #ifdef ENABLE_SUBIDS
@@ -1015,19 +1300,36 @@ static void process_flags (int argc, char **argv)
 			                 "Z:"
 #endif				/* WITH_SELINUX */
 			                 , long_options, NULL)) != -1) {
+			nopts++;
 			switch (c) {
+			case 200:
+				progressflg = true;
+				break;
+			case 201:
+				reject_in_record ("--batch");
+				batch_file = optarg;
+				batch_opts++;
+				break;
+			case 202:
+				reject_in_record ("--stage-home");
+				stageflg = true;
+				break;
+			case 203:
+				idmapflg = true;
+				break;
 			case 'a':
 				aflg = true;
 				break;
 			case 'b':
 				allow_bad_names = true;
+				batch_opts++;
 				break;
 			case 'c':
 				if (!VALID (optarg)) {
 					fprintf (stderr,
 					         _("%s: invalid field '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				user_newcomment = optarg;
 				cflg = true;
@@ -1037,7 +1339,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid field '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				dflg = true;
 				user_newhome = optarg;
@@ -1045,7 +1347,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: homedir must be an absolute path\n"),
 					         Prog);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				break;
 			case 'e':
@@ -1054,7 +1356,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 						 _("%s: invalid date '%s'\n"),
 						 Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				user_newexpire *= DAY / SCALE;
 				eflg = true;
@@ -1065,7 +1367,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid numeric argument '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				fflg = true;
 				break;
@@ -1075,7 +1377,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: group '%s' does not exist\n"),
 					         Prog, optarg);
-					exit (E_NOTFOUND);
+					flag_exit (E_NOTFOUND);
 				}
 				user_newgid = grp->gr_gid;
 				gflg = true;
@@ -1083,11 +1385,12 @@ static void process_flags (int argc, char **argv)
 				break;
 			case 'G':
 				if (get_groups (optarg) != 0) {
-					exit (E_NOTFOUND);
+					flag_exit (E_NOTFOUND);
 				}
 				Gflg = true;
 				break;
 			case 'h':
+				reject_in_record ("-h");
 				usage (E_SUCCESS);
 				/*@notreached@*/break;
 			case 'l':
@@ -1095,7 +1398,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid user name '%s': use --badname to ignore\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				lflg = true;
 				user_newname = optarg;
@@ -1117,8 +1420,20 @@ static void process_flags (int argc, char **argv)
 				rflg = true;
 				break;
 			case 'R': /* no-op, handled in process_root_flag () */
+				reject_in_record ("-R");
+				batch_opts++;
 				break;
 			case 'P': /* no-op, handled in process_prefix_flag () */
+				reject_in_record ("-P");
+				batch_opts++;
+				break;
+			case 204: /* no-op, handled in process_shard_flag () */
+				reject_in_record ("--shard");
+				batch_opts++;
+				break;
+			case 205: /* no-op, handled in process_deadline_flag () */
+				reject_in_record ("--deadline");
+				batch_opts++;
 				break;
 			case 's':
 				if (   ( !VALID (optarg) )
@@ -1128,7 +1443,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid shell '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				if (    '\0' != optarg[0]
 				     && '*'  != optarg[0]
@@ -1149,7 +1464,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: invalid user ID '%s'\n"),
 					         Prog, optarg);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				uflg = true;
 				break;
@@ -1162,7 +1477,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 						_("%s: invalid subordinate uid range '%s'\n"),
 						Prog, optarg);
-					exit(E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				vflg = true;
 				break;
@@ -1171,7 +1486,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 						_("%s: invalid subordinate uid range '%s'\n"),
 						Prog, optarg);
-					exit(E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				Vflg = true;
 				break;
@@ -1180,7 +1495,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 						_("%s: invalid subordinate gid range '%s'\n"),
 						Prog, optarg);
-					exit(E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				wflg = true;
                 break;
@@ -1189,7 +1504,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 						_("%s: invalid subordinate gid range '%s'\n"),
 						Prog, optarg);
-					exit(E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				Wflg = true;
 				break;
@@ -1200,7 +1515,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: -Z cannot be used with --prefix\n"),
 					         Prog);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				if (is_selinux_enabled () > 0) {
 					user_selinux = optarg;
@@ -1209,7 +1524,7 @@ static void process_flags (int argc, char **argv)
 					fprintf (stderr,
 					         _("%s: -Z requires SELinux enabled kernel\n"),
 					         Prog);
-					exit (E_BAD_ARG);
+					flag_exit (E_BAD_ARG);
 				}
 				break;
 #endif				/* WITH_SELINUX */
@@ -1220,6 +1535,17 @@ static void process_flags (int argc, char **argv)
 		}
 	}
 
+	/*
+	 * --batch only accepts -R, -P and --badname, the other options are
+	 * given in the records.
+	 */
+	if ((NULL != batch_file) && (NULL == record_env)) {
+		if ((optind != argc) || (nopts != batch_opts)) {
+			usage (E_USAGE);
+		}
+		return;
+	}
+
 	if (optind != argc - 1) {
 		usage (E_USAGE);
 	}
@@ -1228,13 +1554,13 @@ static void process_flags (int argc, char **argv)
 
 	{
 		const struct passwd *pwd;
-		/* local, no need for xgetpwnam */
-		pwd = prefix_getpwnam (user_name);
+
+		pwd = locate_user (user_name);
 		if (NULL == pwd) {
 			fprintf (stderr,
 			         _("%s: user '%s' does not exist\n"),
 			         Prog, user_name);
-			exit (E_NOTFOUND);
+			flag_exit (E_NOTFOUND);
 		}
 
 		user_id = pwd->pw_uid;
@@ -1292,14 +1618,17 @@ static void process_flags (int argc, char **argv)
 			         _("%s: %s is the NIS master\n"),
 			         Prog, nis_master);
 		}
-		exit (E_NOTFOUND);
+		flag_exit (E_NOTFOUND);
 	}
 #endif
 
 	{
 		const struct spwd *spwd = NULL;
-		/* local, no need for xgetspnam */
-		if (is_shadow_pwd && ((spwd = prefix_getspnam (user_name)) != NULL)) {
+
+		/* Only -e and -f compare with the shadow entry */
+		if (   is_shadow_pwd
+		    && (eflg || fflg)
+		    && ((spwd = locate_shadow (user_name)) != NULL)) {
 			user_expire = spwd->sp_expire;
 			user_inactive = spwd->sp_inact;
 		}
@@ -1352,6 +1681,13 @@ static void process_flags (int argc, char **argv)
 		usage (E_USAGE);
 	}
 
+	if (stageflg && !mflg) {
+		fprintf (stderr,
+		         _("%s: %s flag is only allowed with the %s flag\n"),
+		         Prog, "--stage-home", "-m");
+		usage (E_USAGE);
+	}
+
 	if (user_newid == user_id) {
 		uflg = false;
 		oflg = false;
@@ -1392,6 +1728,11 @@ static void process_flags (int argc, char **argv)
 #endif				/* WITH_SELINUX */
 	)) {
 		fprintf (stdout, _("%s: no changes\n"), Prog);
+		if (NULL != record_env) {
+			/* The other records are still applied */
+			record_unchanged = true;
+			return;
+		}
 		exit (E_SUCCESS);
 	}
 
@@ -1399,23 +1740,21 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr,
 		         _("%s: shadow passwords required for -e and -f\n"),
 		         Prog);
-		exit (E_USAGE);
+		flag_exit (E_USAGE);
 	}
 
-	/* local, no need for xgetpwnam */
-	if (lflg && (prefix_getpwnam (user_newname) != NULL)) {
+	if (lflg && (locate_user (user_newname) != NULL)) {
 		fprintf (stderr,
 		         _("%s: user '%s' already exists\n"),
 		         Prog, user_newname);
-		exit (E_NAME_IN_USE);
+		flag_exit (E_NAME_IN_USE);
 	}
 
-	/* local, no need for xgetpwuid */
-	if (uflg && !oflg && (prefix_getpwuid (user_newid) != NULL)) {
+	if (uflg && !oflg && (locate_uid (user_newid) != NULL)) {
 		fprintf (stderr,
 		         _("%s: UID '%lu' already exists\n"),
 		         Prog, (unsigned long) user_newid);
-		exit (E_UID_IN_USE);
+		flag_exit (E_UID_IN_USE);
 	}
 
 #ifdef ENABLE_SUBIDS
@@ -1424,7 +1763,7 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr,
 		         _("%s: %s does not exist, you cannot use the flags %s or %s\n"),
 		         Prog, sub_uid_dbname (), "-v", "-V");
-		exit (E_USAGE);
+		flag_exit (E_USAGE);
 	}
 
 	if (   (wflg || Wflg)
@@ -1432,7 +1771,7 @@ static void process_flags (int argc, char **argv)
 		fprintf (stderr,
 		         _("%s: %s does not exist, you cannot use the flags %s or %s\n"),
 		         Prog, sub_gid_dbname (), "-w", "-W");
-		exit (E_USAGE);
+		flag_exit (E_USAGE);
 	}
 #endif				/* ENABLE_SUBIDS */
 }
@@ -1462,7 +1801,7 @@ static void close_files (void)
 		fail_exit (E_PW_UPDATE);
 	}
 
-	if (Gflg || lflg) {
+	if (gr_locked) {
 		if (gr_close () == 0) {
 			fprintf (stderr,
 			         _("%s: failure while writing changes to %s\n"),
@@ -1536,7 +1875,7 @@ static void close_files (void)
 #endif
 
 #ifdef ENABLE_SUBIDS
-	if (vflg || Vflg) {
+	if (sub_uid_locked) {
 		if (sub_uid_close () == 0) {
 			fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, sub_uid_dbname ());
 			SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_uid_dbname ()));
@@ -1549,7 +1888,7 @@ static void close_files (void)
 		}
 		sub_uid_locked = false;
 	}
-	if (wflg || Wflg) {
+	if (sub_gid_locked) {
 		if (sub_gid_close () == 0) {
 			fprintf (stderr, _("%s: failure while writing changes to %s\n"), Prog, sub_gid_dbname ());
 			SYSLOG ((LOG_ERR, "failure while writing changes to %s", sub_gid_dbname ()));
@@ -1602,14 +1941,16 @@ static void open_files (void)
 		fail_exit (E_PW_UPDATE);
 	}
 	spw_locked = true;
-	if (is_shadow_pwd && (spw_open (O_CREAT | O_RDWR) == 0)) {
+	spw_compact ();
+	/* The shadow file is only read if a shadow field is changed */
+	if (is_shadow_pwd && (spw_open_deferred (O_CREAT | O_RDWR) == 0)) {
 		fprintf (stderr,
 		         _("%s: cannot open %s\n"),
 		         Prog, spw_dbname ());
 		fail_exit (E_PW_UPDATE);
 	}
 
-	if (Gflg || lflg) {
+	if (Gflg || lflg || (NULL != batch_file)) {
 		/*
 		 * Lock and open the group file. This will load all of the
 		 * group entries.
@@ -1621,6 +1962,7 @@ static void open_files (void)
 			fail_exit (E_GRP_UPDATE);
 		}
 		gr_locked = true;
+		gr_index_members ();
 		if (gr_open (O_CREAT | O_RDWR) == 0) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
@@ -1635,7 +1977,9 @@ static void open_files (void)
 			fail_exit (E_GRP_UPDATE);
 		}
 		sgr_locked = true;
-		if (is_shadow_grp && (sgr_open (O_CREAT | O_RDWR) == 0)) {
+		sgr_index_members ();
+		if (   is_shadow_grp
+		    && (sgr_open_deferred (O_CREAT | O_RDWR) == 0)) {
 			fprintf (stderr,
 			         _("%s: cannot open %s\n"),
 			         Prog, sgr_dbname ());
@@ -1644,7 +1988,7 @@ static void open_files (void)
 #endif
 	}
 #ifdef ENABLE_SUBIDS
-	if (vflg || Vflg) {
+	if (vflg || Vflg || ((NULL != batch_file) && is_sub_uid)) {
 		if (sub_uid_lock () == 0) {
 			fprintf (stderr,
 			         _("%s: cannot lock %s; try again later.\n"),
@@ -1659,7 +2003,7 @@ static void open_files (void)
 			fail_exit (E_SUB_UID_UPDATE);
 		}
 	}
-	if (wflg || Wflg) {
+	if (wflg || Wflg || ((NULL != batch_file) && is_sub_gid)) {
 		if (sub_gid_lock () == 0) {
 			fprintf (stderr,
 			         _("%s: cannot lock %s; try again later.\n"),
@@ -1706,7 +2050,7 @@ static void usr_update (void)
 
 
 	/* If the shadow file does not exist, it won't be created */
-	if (is_shadow_pwd) {
+	if (is_shadow_pwd && (lflg || eflg || fflg || pflg || Lflg || Uflg)) {
 		spwd = spw_locate (user_name);
 		if (NULL != spwd) {
 			/* Update the shadow entry if it exists */
@@ -1779,24 +2123,134 @@ static void usr_update (void)
 }
 
 /*
- * move_home - move the user's home directory
+ * sync_home - bring the copy of the home in stage_home_path up to date
  *
- *	move_home() moves the user's home directory to a new location. The
- *	files will be copied if the directory cannot simply be renamed.
+ *	The entries changed since the start of the previous pass are
+ *	copied again (see sync_tree()).
+ *
+ *	Return the number of entries copied again, or -1 on error.
  */
-static void move_home (void)
+static long sync_home (void)
 {
-	struct stat sb;
+	static struct timespec since;
+	static bool synced = false;
+	struct timespec start;
+	unsigned long changed;
+	int err;
+
+#ifdef CLOCK_REALTIME_COARSE
+	(void) clock_gettime (CLOCK_REALTIME_COARSE, &start);
+#else
+	(void) clock_gettime (CLOCK_REALTIME, &start);
+	start.tv_sec--;		/* the ctimes may lag behind */
+#endif
 
-	if (access (prefix_user_newhome, F_OK) == 0) {
-		/*
-		 * If the new home directory already exist, the user
-		 * should not use -m.
-		 */
-		fprintf (stderr,
-		         _("%s: directory %s exists\n"),
-		         Prog, user_newhome);
-		fail_exit (E_HOMEDIR);
+	if (progressflg) {
+		progress_start (_("copying"), prefix_user_home);
+		copy_tree_set_progress (progress_report);
+	}
+	err = sync_tree (prefix_user_home, stage_home_path,
+	                 prefix_user_newhome, true,
+	                 user_id,
+	                 uflg ? user_newid : (uid_t)-1,
+	                 user_gid,
+	                 gflg ? user_newgid : (gid_t)-1,
+	                 synced ? &since : NULL,
+	                 &changed);
+	if (progressflg) {
+		copy_tree_set_progress (NULL);
+		progress_end ();
+	}
+	if (0 != err) {
+		return -1;
+	}
+	since = start;
+	synced = true;
+	return (changed > LONG_MAX) ? LONG_MAX : (long) changed;
+}
+
+/*
+ * stage_home - copy the home directory before the account is changed
+ *
+ *	With --stage-home, if the new home directory is on another file
+ *	system, the home is copied next to it while the account still
+ *	uses the old home. The copy is then brought up to date until a
+ *	pass finds no changes, at most STAGE_PASSES times, and move_home()
+ *	only has to copy the last changes before it renames the copy.
+ *
+ *	If usermod is interrupted, the copy is kept, and the next
+ *	usermod --stage-home to the same home only copies the changes.
+ */
+#define STAGE_PASSES	3
+static void stage_home (void)
+{
+	struct stat sb, parent_sb;
+	char *parent, *cp;
+	size_t len;
+	int pass;
+
+	if (   !stageflg
+	    || !mflg
+	    || (stat (prefix_user_home, &sb) != 0)
+	    || !S_ISDIR (sb.st_mode)
+	    || (access (prefix_user_newhome, F_OK) == 0)) {
+		/* move_home() reports the errors */
+		return;
+	}
+
+	parent = xstrdup (prefix_user_newhome);
+	cp = strrchr (parent, '/');
+	if ((NULL != cp) && (cp != parent)) {
+		*cp = '\0';
+	} else {
+		(void) strcpy (parent, (NULL != cp) ? "/" : ".");
+	}
+	if (   (stat (parent, &parent_sb) != 0)
+	    || (parent_sb.st_dev == sb.st_dev)) {
+		/* The home is simply renamed */
+		free (parent);
+		return;
+	}
+	free (parent);
+
+	len = strlen (prefix_user_newhome) + sizeof ".stage";
+	stage_home_path = xmalloc (len);
+	(void) snprintf (stage_home_path, len, "%s.stage", prefix_user_newhome);
+
+	for (pass = 0; pass < STAGE_PASSES; pass++) {
+		long changed = sync_home ();
+
+		if (changed < 0) {
+			fprintf (stderr,
+			         _("%s: cannot copy the home directory %s to %s\n"),
+			         Prog, prefix_user_home, stage_home_path);
+			fail_exit (E_HOMEDIR);
+		}
+		if (0 == changed) {
+			break;
+		}
+	}
+}
+
+/*
+ * move_home - move the user's home directory
+ *
+ *	move_home() moves the user's home directory to a new location. The
+ *	files will be copied if the directory cannot simply be renamed.
+ */
+static void move_home (void)
+{
+	struct stat sb;
+
+	if (access (prefix_user_newhome, F_OK) == 0) {
+		/*
+		 * If the new home directory already exist, the user
+		 * should not use -m.
+		 */
+		fprintf (stderr,
+		         _("%s: directory %s exists\n"),
+		         Prog, user_newhome);
+		fail_exit (E_HOMEDIR);
 	}
 
 	if (stat (prefix_user_home, &sb) == 0) {
@@ -1841,6 +2295,9 @@ static void move_home (void)
 			return;
 		} else {
 			if (EXDEV == errno) {
+				bool async = getdef_bool ("HOME_REMOVE_ASYNC");
+				int err;
+
 #ifdef WITH_BTRFS
 				if (btrfs_is_subvolume (prefix_user_home) > 0) {
 					fprintf (stderr,
@@ -1850,17 +2307,45 @@ static void move_home (void)
 				}
 #endif
 
-				if (copy_tree (prefix_user_home, prefix_user_newhome, true,
-				               true,
-				               user_id,
-				               uflg ? user_newid : (uid_t)-1,
-				               user_gid,
-				               gflg ? user_newgid : (gid_t)-1) == 0) {
-					if (remove_tree (prefix_user_home, true) != 0) {
+				if (NULL != stage_home_path) {
+					/* Copy the last changes of the staged home */
+					err = -1;
+					if (   (sync_home () >= 0)
+					    && (rename (stage_home_path, prefix_user_newhome) == 0)) {
+						err = 0;
+					}
+				} else {
+					if (progressflg) {
+						progress_start (_("copying"), prefix_user_home);
+						copy_tree_set_progress (progress_report);
+					}
+					err = copy_tree (prefix_user_home, prefix_user_newhome, true,
+					                 true,
+					                 user_id,
+					                 uflg ? user_newid : (uid_t)-1,
+					                 user_gid,
+					                 gflg ? user_newgid : (gid_t)-1);
+					if (progressflg) {
+						copy_tree_set_progress (NULL);
+						progress_end ();
+					}
+				}
+				if (0 == err) {
+					if (progressflg && !async) {
+						progress_start (_("removing"), prefix_user_home);
+						remove_tree_set_progress (progress_report);
+					}
+					if ((async
+					     ? remove_tree_async (prefix_user_home)
+					     : remove_tree (prefix_user_home, true)) != 0) {
 						fprintf (stderr,
 						         _("%s: warning: failed to completely remove old home directory %s"),
 						         Prog, prefix_user_home);
 					}
+					if (progressflg && !async) {
+						remove_tree_set_progress (NULL);
+						progress_end ();
+					}
 #ifdef WITH_AUDIT
 					audit_logger (AUDIT_USER_CHAUTHTOK,
 					              Prog,
@@ -1872,7 +2357,10 @@ static void move_home (void)
 					return;
 				}
 
-				(void) remove_tree (prefix_user_newhome, true);
+				/* A staged copy is kept for the next usermod */
+				if (NULL == stage_home_path) {
+					(void) remove_tree (prefix_user_newhome, true);
+				}
 			}
 			fprintf (stderr,
 			         _("%s: cannot rename directory %s to %s\n"),
@@ -1887,6 +2375,47 @@ static void move_home (void)
 	}
 }
 
+/*
+ * update_state - relocate a part of the record of the user in the account
+ *                state store
+ *
+ *	As with the legacy files, the old record is left alone, and the
+ *	new UID gets an empty part if the old UID has no record.
+ */
+static void update_state (enum acct_part part)
+{
+	struct acct_state old, st;
+	int ret = -1;
+
+	if (   (acct_state_open (true) != 0)
+	    || (acct_state_lock (F_WRLCK) != 0)) {
+		goto err;
+	}
+	if (   (acct_state_get (user_id, &old) != -1)
+	    && (acct_state_get (user_newid, &st) != -1)) {
+		if (ACCT_LASTLOG == part) {
+			st.ll = old.ll;
+		} else {
+			st.fl = old.fl;
+		}
+		ret = acct_state_put (user_newid, &st);
+		if (0 == ret) {
+			ret = acct_state_sync ();
+		}
+	}
+	(void) acct_state_lock (F_UNLCK);
+
+err:
+	if (0 != ret) {
+		fprintf (stderr,
+		         (ACCT_LASTLOG == part)
+		         ? _("%s: failed to copy the lastlog entry of user %lu to user %lu: %s\n")
+		         : _("%s: failed to copy the faillog entry of user %lu to user %lu: %s\n"),
+		         Prog, (unsigned long) user_id, (unsigned long) user_newid, strerror (errno));
+	}
+	(void) acct_state_close ();
+}
+
 /*
  * update_lastlog - update the lastlog file
  *
@@ -1902,16 +2431,21 @@ static void update_lastlog (void)
 	off_t off_newuid = (off_t) user_newid * sizeof ll;
 	uid_t max_uid;
 
-	if (access (LASTLOG_FILE, F_OK) != 0) {
-		return;
-	}
-
 	max_uid = getdef_ulong ("LASTLOG_UID_MAX", 0xFFFFFFFFUL);
 	if (user_newid > max_uid) {
 		/* do not touch lastlog for large uids */
 		return;
 	}
 
+	if (acct_state_enabled ()) {
+		update_state (ACCT_LASTLOG);
+		return;
+	}
+
+	if (access (LASTLOG_FILE, F_OK) != 0) {
+		return;
+	}
+
 	fd = open (LASTLOG_FILE, O_RDWR);
 
 	if (-1 == fd) {
@@ -1967,6 +2501,11 @@ static void update_faillog (void)
 	off_t off_uid = (off_t) user_id * sizeof fl;
 	off_t off_newuid = (off_t) user_newid * sizeof fl;
 
+	if (acct_state_enabled ()) {
+		update_state (ACCT_FAILLOG);
+		return;
+	}
+
 	if (access (FAILLOG_FILE, F_OK) != 0) {
 		return;
 	}
@@ -2119,112 +2658,10 @@ static void move_mailbox (void)
 #endif
 
 /*
- * main - usermod command
+ * mod_user - change the entries of the user in the databases
  */
-int main (int argc, char **argv)
+static void mod_user (void)
 {
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	pam_handle_t *pamh = NULL;
-	int retval;
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-	/*
-	 * Get my name so that I can use it to report errors.
-	 */
-	Prog = Basename (argv[0]);
-	log_set_progname(Prog);
-	log_set_logfd(stderr);
-
-	(void) setlocale (LC_ALL, "");
-	(void) bindtextdomain (PACKAGE, LOCALEDIR);
-	(void) textdomain (PACKAGE);
-
-	process_root_flag ("-R", argc, argv);
-	prefix = process_prefix_flag ("-P", argc, argv);
-
-	OPENLOG ("usermod");
-#ifdef WITH_AUDIT
-	audit_help_open ();
-#endif
-
-	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
-	user_groups = (char **) malloc (sizeof (char *) * (1 + sys_ngroups));
-	user_groups[0] = NULL;
-
-	is_shadow_pwd = spw_file_present ();
-#ifdef SHADOWGRP
-	is_shadow_grp = sgr_file_present ();
-#endif
-#ifdef ENABLE_SUBIDS
-	is_sub_uid = sub_uid_file_present ();
-	is_sub_gid = sub_gid_file_present ();
-#endif				/* ENABLE_SUBIDS */
-
-	process_flags (argc, argv);
-
-	/*
-	 * The home directory, the username and the user's UID should not
-	 * be changed while the user is logged in.
-	 * Note: no need to check if a prefix is specified...
-	 */
-	if ( (prefix[0] == '\0') &&  (uflg || lflg || dflg
-#ifdef ENABLE_SUBIDS
-	        || Vflg || Wflg
-#endif				/* ENABLE_SUBIDS */
-	       )
-	    && (user_busy (user_name, user_id) != 0)) {
-		exit (E_USER_BUSY);
-	}
-
-#ifdef ACCT_TOOLS_SETUID
-#ifdef USE_PAM
-	{
-		struct passwd *pampw;
-		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
-		if (pampw == NULL) {
-			fprintf (stderr,
-			         _("%s: Cannot determine your user name.\n"),
-			         Prog);
-			exit (1);
-		}
-
-		retval = pam_start ("usermod", pampw->pw_name, &conv, &pamh);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_authenticate (pamh, 0);
-	}
-
-	if (PAM_SUCCESS == retval) {
-		retval = pam_acct_mgmt (pamh, 0);
-	}
-
-	if (PAM_SUCCESS != retval) {
-		fprintf (stderr, _("%s: PAM: %s\n"),
-		         Prog, pam_strerror (pamh, retval));
-		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
-		if (NULL != pamh) {
-			(void) pam_end (pamh, retval);
-		}
-		exit (1);
-	}
-	(void) pam_end (pamh, retval);
-#endif				/* USE_PAM */
-#endif				/* ACCT_TOOLS_SETUID */
-
-#ifdef WITH_TCB
-	if (shadowtcb_set_user (user_name) == SHADOWTCB_FAILURE) {
-		exit (E_PW_UPDATE);
-	}
-#endif
-
-	/*
-	 * Do the hard stuff - open the files, change the user entries,
-	 * change the home directory, then close and update the files.
-	 */
-	open_files ();
 	if (   cflg || dflg || eflg || fflg || gflg || Lflg || lflg || pflg
 	    || sflg || uflg || Uflg) {
 		usr_update ();
@@ -2286,19 +2723,16 @@ int main (int argc, char **argv)
 		}
 	}
 #endif				/* ENABLE_SUBIDS */
-	close_files ();
-
-#ifdef WITH_TCB
-	if (   (lflg || uflg)
-	    && (shadowtcb_move (user_newname, user_newid) == SHADOWTCB_FAILURE) ) {
-		exit (E_PW_UPDATE);
-	}
-#endif
-
-	nscd_flush_cache ("passwd");
-	nscd_flush_cache ("group");
-	sssd_flush_cache (SSSD_DB_PASSWD | SSSD_DB_GROUP);
+}
 
+/*
+ * update_files - update the SELinux user mapping, the home directory,
+ *                the mail spool, lastlog and faillog of the user
+ *
+ *	It is called once the databases are written.
+ */
+static void update_files (void)
+{
 #ifdef WITH_SELINUX
 	if (Zflg) {
 		if ('\0' != *user_selinux) {
@@ -2347,9 +2781,10 @@ int main (int argc, char **argv)
 	}
 
 	if (!mflg && (uflg || gflg)) {
+		const char *home = dflg ? prefix_user_newhome : prefix_user_home;
 		struct stat sb;
 
-		if (stat (dflg ? prefix_user_newhome : prefix_user_home, &sb) == 0 &&
+		if (stat (home, &sb) == 0 &&
 			((uflg && sb.st_uid == user_newid) || sb.st_uid == user_id)) {
 			/*
 			 * Change the UID on all of the files owned by
@@ -2367,7 +2802,25 @@ int main (int argc, char **argv)
 					      user_newname, user_newid, 1);
 			}
 #endif
-			if (chown_tree (dflg ? prefix_user_newhome : prefix_user_home,
+			if (   idmapflg
+			    && (idmap_mount (home,
+			                     user_id,
+			                     uflg ? user_newid  : (uid_t)-1,
+			                     user_gid,
+			                     gflg ? user_newgid : (gid_t)-1) == 0)) {
+				/* The files keep their IDs on disk */
+				SYSLOG ((LOG_INFO,
+				         "remapped the IDs of the home directory %s of '%s' with an idmapped mount",
+				         home, user_newname));
+				return;
+			}
+			if (idmapflg) {
+				fprintf (stderr,
+				         _("%s: warning: cannot remap the IDs of the home directory %s: %s\n"
+				           "%s: changing the ownership of its files\n"),
+				         Prog, home, strerror (errno), Prog);
+			}
+			if (chown_tree (home,
 			                user_id,
 			                uflg ? user_newid  : (uid_t)-1,
 			                user_gid,
@@ -2379,6 +2832,390 @@ int main (int argc, char **argv)
 			}
 		}
 	}
+}
+
+/*
+ * reset_record - reset the values of the previous record
+ */
+static void reset_record (void)
+{
+	user_name = NULL;
+	user_newname = NULL;
+	user_pass = NULL;
+	user_id = 0;
+	user_newid = 0;
+	user_gid = 0;
+	user_newgid = 0;
+	user_comment = NULL;
+	user_newcomment = NULL;
+	user_home = NULL;
+	user_newhome = NULL;
+	user_shell = NULL;
+	user_newshell = NULL;
+#ifdef WITH_SELINUX
+	user_selinux = "";
+#endif				/* WITH_SELINUX */
+	user_expire = 0;
+	user_newexpire = 0;
+	user_inactive = 0;
+	user_newinactive = 0;
+	user_groups[0] = NULL;
+	prefix_user_home = NULL;
+	prefix_user_newhome = NULL;
+#ifdef ENABLE_SUBIDS
+	add_sub_uids = NULL;
+	del_sub_uids = NULL;
+	add_sub_gids = NULL;
+	del_sub_gids = NULL;
+#endif				/* ENABLE_SUBIDS */
+	allow_bad_names = record_bad_names;
+
+	aflg = false;
+	cflg = false;
+	dflg = false;
+	eflg = false;
+	fflg = false;
+	gflg = false;
+	Gflg = false;
+	idmapflg = false;
+	Lflg = false;
+	lflg = false;
+	mflg = false;
+	oflg = false;
+	pflg = false;
+	progressflg = false;
+	rflg = false;
+	sflg = false;
+#ifdef WITH_SELINUX
+	Zflg = false;
+#endif				/* WITH_SELINUX */
+#ifdef ENABLE_SUBIDS
+	vflg = false;
+	Vflg = false;
+	wflg = false;
+	Wflg = false;
+#endif				/* ENABLE_SUBIDS */
+	uflg = false;
+	Uflg = false;
+
+	record_unchanged = false;
+}
+
+/*
+ * mod_record - change the entries of the user of a --batch record
+ *
+ *	Return 0 on success, or the exit status of usermod for this record.
+ */
+static int mod_record (struct batch_record *rec)
+{
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		reset_record ();
+		optind = 0;
+		process_flags (rec->argc, rec->argv);
+		if (record_unchanged) {
+			rec->unchanged = true;
+		} else {
+			/* Same as in main() */
+			if (   (prefix[0] == '\0') &&  (uflg || lflg || dflg
+#ifdef ENABLE_SUBIDS
+			        || Vflg || Wflg
+#endif				/* ENABLE_SUBIDS */
+			       )
+			    && (user_busy (user_name, user_id) != 0)) {
+				flag_exit (E_USER_BUSY);
+			}
+			mod_user ();
+		}
+
+		rec->modified = true;
+		rec->name = user_name;
+		rec->newname = user_newname;
+		rec->id = user_id;
+		rec->newid = user_newid;
+		rec->gid = user_gid;
+		rec->newgid = user_newgid;
+		rec->home = user_home;
+		rec->newhome = user_newhome;
+		rec->prefix_home = prefix_user_home;
+		rec->prefix_newhome = prefix_user_newhome;
+#ifdef WITH_SELINUX
+		rec->selinux = user_selinux;
+		rec->Zflg = Zflg;
+#endif				/* WITH_SELINUX */
+		rec->dflg = dflg;
+		rec->gflg = gflg;
+		rec->lflg = lflg;
+		rec->mflg = mflg;
+		rec->progressflg = progressflg;
+		rec->idmapflg = idmapflg;
+		rec->uflg = uflg;
+	} else {
+		const char *name = user_name;
+
+		if ((NULL == name) && (rec->argc > 1)) {
+			/* The options were not parsed */
+			name = rec->argv[rec->argc - 1];
+		}
+		fprintf (stderr, _("%s: line %u: cannot modify user '%s'\n"),
+		         Prog, rec->line, (NULL != name) ? name : "");
+		SYSLOG ((LOG_INFO, "failed modifying user '%s', exit code: %d",
+		         (NULL != name) ? name : "", code));
+	}
+	record_env = NULL;
+
+	return rec->modified ? 0 : code;
+}
+
+/*
+ * update_record - update the files of the user of a --batch record
+ *
+ *	Return 0 on success, or the exit status of usermod for this record.
+ */
+static int update_record (struct batch_record *rec)
+{
+	jmp_buf env;
+	int code;
+
+	code = setjmp (env);
+	if (0 == code) {
+		record_env = &env;
+		reset_record ();
+		user_name = rec->name;
+		user_newname = rec->newname;
+		user_id = rec->id;
+		user_newid = rec->newid;
+		user_gid = rec->gid;
+		user_newgid = rec->newgid;
+		user_home = rec->home;
+		user_newhome = rec->newhome;
+		prefix_user_home = rec->prefix_home;
+		prefix_user_newhome = rec->prefix_newhome;
+#ifdef WITH_SELINUX
+		user_selinux = rec->selinux;
+		Zflg = rec->Zflg;
+#endif				/* WITH_SELINUX */
+		dflg = rec->dflg;
+		gflg = rec->gflg;
+		lflg = rec->lflg;
+		mflg = rec->mflg;
+		progressflg = rec->progressflg;
+		idmapflg = rec->idmapflg;
+		uflg = rec->uflg;
+		update_files ();
+	}
+	record_env = NULL;
+
+	if (0 != code) {
+		fprintf (stderr, _("%s: line %u: cannot update the files of user '%s'\n"),
+		         Prog, rec->line, rec->newname);
+	}
+	return code;
+}
+
+/*
+ * mod_batch - modify the users of the records of file
+ *
+ *	The records are checked and applied to the databases, which are
+ *	locked and written once. A record sees the changes of the previous
+ *	ones. If a record fails, the others are still checked, but no user
+ *	is modified. The home directories and mail spools are updated once
+ *	the databases are written.
+ *
+ *	Return the exit status of usermod.
+ */
+static int mod_batch (const char *file)
+{
+	struct batch_line *lines;
+	struct batch_record *records;
+	size_t count;
+	size_t i;
+	int status = E_SUCCESS;
+	int code;
+
+#ifdef WITH_TCB
+	if (getdef_bool ("USE_TCB")) {
+		fprintf (stderr, _("%s: --batch cannot be used with tcb enabled\n"),
+		         Prog);
+		exit (E_USAGE);
+	}
+#endif				/* WITH_TCB */
+
+	if (batch_read (file, &lines, &count) != 0) {
+		exit (E_BAD_ARG);
+	}
+	records = xmalloc ((count + 1) * sizeof *records);
+	memzero (records, (count + 1) * sizeof *records);
+	for (i = 0; i < count; i++) {
+		records[i].line = lines[i].line;
+		records[i].argc = lines[i].argc;
+		records[i].argv = lines[i].argv;
+	}
+	free (lines);
+
+	record_bad_names = allow_bad_names;
+	open_files ();
+
+	for (i = 0; i < count; i++) {
+		code = mod_record (&records[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+
+	if (E_SUCCESS != status) {
+		fprintf (stderr, _("%s: no user was modified\n"), Prog);
+		user_name = "";
+		fail_exit (status);
+	}
+
+	close_files ();
+
+	for (i = 0; i < count; i++) {
+		if (records[i].unchanged) {
+			continue;
+		}
+		code = update_record (&records[i]);
+		if ((0 != code) && (E_SUCCESS == status)) {
+			status = code;
+		}
+	}
+
+	return status;
+}
+
+/*
+ * main - usermod command
+ */
+int main (int argc, char **argv)
+{
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	pam_handle_t *pamh = NULL;
+	int retval;
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	/*
+	 * Get my name so that I can use it to report errors.
+	 */
+	Prog = Basename (argv[0]);
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	(void) setlocale (LC_ALL, "");
+	(void) bindtextdomain (PACKAGE, LOCALEDIR);
+	(void) textdomain (PACKAGE);
+
+	process_root_flag ("-R", argc, argv);
+	prefix = process_prefix_flag ("-P", argc, argv);
+	(void) process_shard_flag (argc, argv);
+	process_deadline_flag (argc, argv);
+
+	OPENLOG ("usermod");
+#ifdef WITH_AUDIT
+	audit_help_open ();
+#endif
+
+	sys_ngroups = sysconf (_SC_NGROUPS_MAX);
+	user_groups = (char **) malloc (sizeof (char *) * (1 + sys_ngroups));
+	user_groups[0] = NULL;
+
+	is_shadow_pwd = spw_file_present ();
+#ifdef SHADOWGRP
+	is_shadow_grp = sgr_file_present ();
+#endif
+#ifdef ENABLE_SUBIDS
+	is_sub_uid = sub_uid_file_present ();
+	is_sub_gid = sub_gid_file_present ();
+#endif				/* ENABLE_SUBIDS */
+
+	process_flags (argc, argv);
+
+	/*
+	 * The home directory, the username and the user's UID should not
+	 * be changed while the user is logged in.
+	 * Note: no need to check if a prefix is specified...
+	 */
+	if (   (NULL == batch_file)
+	    && (prefix[0] == '\0') &&  (uflg || lflg || dflg
+#ifdef ENABLE_SUBIDS
+	        || Vflg || Wflg
+#endif				/* ENABLE_SUBIDS */
+	       )
+	    && (user_busy (user_name, user_id) != 0)) {
+		exit (E_USER_BUSY);
+	}
+
+#ifdef ACCT_TOOLS_SETUID
+#ifdef USE_PAM
+	{
+		struct passwd *pampw;
+		pampw = getpwuid (getuid ()); /* local, no need for xgetpwuid */
+		if (pampw == NULL) {
+			fprintf (stderr,
+			         _("%s: Cannot determine your user name.\n"),
+			         Prog);
+			exit (1);
+		}
+
+		retval = pam_start ("usermod", pampw->pw_name, &conv, &pamh);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_authenticate (pamh, 0);
+	}
+
+	if (PAM_SUCCESS == retval) {
+		retval = pam_acct_mgmt (pamh, 0);
+	}
+
+	if (PAM_SUCCESS != retval) {
+		fprintf (stderr, _("%s: PAM: %s\n"),
+		         Prog, pam_strerror (pamh, retval));
+		SYSLOG((LOG_ERR, "%s", pam_strerror (pamh, retval)));
+		if (NULL != pamh) {
+			(void) pam_end (pamh, retval);
+		}
+		exit (1);
+	}
+	(void) pam_end (pamh, retval);
+#endif				/* USE_PAM */
+#endif				/* ACCT_TOOLS_SETUID */
+
+	if (NULL != batch_file) {
+		return mod_batch (batch_file);
+	}
+
+#ifdef WITH_TCB
+	if (shadowtcb_set_user (user_name) == SHADOWTCB_FAILURE) {
+		exit (E_PW_UPDATE);
+	}
+#endif
+
+	/* The account can still be used while --stage-home copies the home */
+	stage_home ();
+
+	/*
+	 * Do the hard stuff - open the files, change the user entries,
+	 * change the home directory, then close and update the files.
+	 */
+	open_files ();
+	mod_user ();
+	close_files ();
+
+#ifdef WITH_TCB
+	if (   (lflg || uflg)
+	    && (shadowtcb_move (user_newname, user_newid) == SHADOWTCB_FAILURE) ) {
+		exit (E_PW_UPDATE);
+	}
+#endif
+
+	update_files ();
 
 	return E_SUCCESS;
 }
@@ -15,6 +15,7 @@
 #ident "$Id$"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
@@ -22,8 +23,13 @@
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#if defined(HAVE_SYS_IOCTL_H) && defined(HAVE_LINUX_FS_H)
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
 #include <unistd.h>
 #include <utime.h>
 #include "defines.h"
@@ -34,6 +40,9 @@
 #include "pwio.h"
 #include "sgroupio.h"
 #include "shadowio.h"
+#ifdef SHADOWGRP
+#include "gshadow_.h"
+#endif				/* SHADOWGRP */
 /*@-exitarg@*/
 #include "exitcodes.h"
 #ifdef WITH_TCB
@@ -65,9 +74,13 @@ static bool tcb_mode = false;
 
 /* local function prototypes */
 static void usage (int status);
+static int clone_file (int src, int dst, off_t size);
 static int create_backup_file (FILE *, const char *, struct stat *);
+static unsigned long check_changes (const char *file, const char *edited,
+                                    bool (*check_line) (const char *));
 static void vipwexit (const char *msg, int syserr, int ret);
-static void vipwedit (const char *, int (*)(void), int (*)(void));
+static void vipwedit (const char *, int (*)(void), int (*)(void),
+                      bool (*)(const char *));
 
 /*
  * usage - display usage message and exit
@@ -93,6 +106,43 @@ static void usage (int status)
 	exit (status);
 }
 
+/*
+ * clone_file - Copy the size bytes of src to the empty file dst in the
+ *              kernel.
+ *
+ *	The blocks are shared on the filesystems supporting reflinks, and
+ *	copied with copy_file_range() otherwise.
+ *
+ *	Return 1 if the file was copied, 0 if it must be copied by the
+ *	caller (dst is then still empty), or -1 on failure.
+ */
+static int clone_file (int src, int dst, off_t size)
+{
+#ifdef HAVE_COPY_FILE_RANGE
+	off_t off = 0;
+#endif				/* HAVE_COPY_FILE_RANGE */
+
+#ifdef FICLONE
+	if (ioctl (dst, FICLONE, src) == 0) {
+		return 1;
+	}
+#endif				/* FICLONE */
+#ifdef HAVE_COPY_FILE_RANGE
+	while (off < size) {
+		if (copy_file_range (src, &off, dst, NULL, size - off, 0) <= 0) {
+			break;
+		}
+	}
+	if (off >= size) {
+		return 1;
+	}
+	if ((ftruncate (dst, 0) != 0) || (lseek (dst, 0, SEEK_SET) != 0)) {
+		return -1;
+	}
+#endif				/* HAVE_COPY_FILE_RANGE */
+	return 0;
+}
+
 /*
  *
  */
@@ -100,8 +150,10 @@ static int create_backup_file (FILE * fp, const char *backup, struct stat *sb)
 {
 	struct utimbuf ub;
 	FILE *bkfp;
-	int c;
+	char buf[8192];
+	size_t len = 0;
 	mode_t mask;
+	int ret;
 
 	mask = umask (077);
 	bkfp = fopen (backup, "w");
@@ -110,14 +162,19 @@ static int create_backup_file (FILE * fp, const char *backup, struct stat *sb)
 		return -1;
 	}
 
-	c = 0;
-	if (fseeko (fp, 0, SEEK_SET) == 0)
-		while ((c = getc (fp)) != EOF) {
-			if (putc (c, bkfp) == EOF) {
-				break;
+	ret = clone_file (fileno (fp), fileno (bkfp), sb->st_size);
+	if (0 == ret) {
+		if (fseeko (fp, 0, SEEK_SET) != 0) {
+			ret = -1;
+		}
+		while (   (0 == ret)
+		       && ((len = fread (buf, 1, sizeof buf, fp)) != 0)) {
+			if (fwrite (buf, 1, len, bkfp) != len) {
+				ret = -1;
 			}
 		}
-	if ((EOF != c) || (ferror (fp) != 0) || (fflush (bkfp) != 0)) {
+	}
+	if ((-1 == ret) || (ferror (fp) != 0) || (fflush (bkfp) != 0)) {
 		fclose (bkfp);
 		unlink (backup);
 		return -1;
@@ -143,6 +200,147 @@ static int create_backup_file (FILE * fp, const char *backup, struct stat *sb)
 	return 0;
 }
 
+static bool pw_line_ok (const char *line)
+{
+	return NULL != sgetpwent (line);
+}
+
+static bool spw_line_ok (const char *line)
+{
+	return NULL != sgetspent (line);
+}
+
+static bool gr_line_ok (const char *line)
+{
+	return NULL != sgetgrent (line);
+}
+
+#ifdef SHADOWGRP
+static bool sgr_line_ok (const char *line)
+{
+	return NULL != sgetsgent (line);
+}
+#endif				/* SHADOWGRP */
+
+/*
+ * map_file - Map the file name, of *size bytes, for reading.
+ *
+ *	Return the mapping (NULL for an empty file), or MAP_FAILED.
+ */
+static const char *map_file (const char *name, size_t *size)
+{
+	struct stat sb;
+	void *addr;
+	int fd;
+
+	fd = open (name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return MAP_FAILED;
+	}
+	if (fstat (fd, &sb) != 0) {
+		(void) close (fd);
+		return MAP_FAILED;
+	}
+	*size = sb.st_size;
+	addr = NULL;
+	if (0 != *size) {
+		addr = mmap (NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+	}
+	(void) close (fd);
+	return addr;
+}
+
+/*
+ * check_changes - Check the entries of edited which are not in file.
+ *
+ *	The lines between the common beginning and the common end of the
+ *	files are the only ones which can have been changed: they are
+ *	parsed with check_line, and an error is reported for each line
+ *	which cannot be parsed. The NIS lines are not checked.
+ *
+ *	Return the number of invalid lines.
+ */
+static unsigned long check_changes (const char *file, const char *edited,
+                                    bool (*check_line) (const char *))
+{
+	const char *orig, *new, *p, *end, *nl;
+	size_t olen = 0, nlen = 0, head = 0, tail = 0, max;
+	unsigned long lineno = 1, errors = 0;
+
+	orig = map_file (file, &olen);
+	if (MAP_FAILED == orig) {
+		return 0;	/* nothing to compare with */
+	}
+	new = map_file (edited, &nlen);
+	if (MAP_FAILED == new) {
+		if (NULL != orig) {
+			(void) munmap ((void *) orig, olen);
+		}
+		return 0;
+	}
+
+	/* The common beginning, up to the start of a line */
+	max = (olen < nlen) ? olen : nlen;
+	while (   (head + 4096 <= max)
+	       && (memcmp (orig + head, new + head, 4096) == 0)) {
+		head += 4096;
+	}
+	while ((head < max) && (orig[head] == new[head])) {
+		head++;
+	}
+	while ((head > 0) && ('\n' != new[head - 1])) {
+		head--;
+	}
+
+	/* The common end, from the start of a line */
+	while (   (tail < max - head)
+	       && (orig[olen - tail - 1] == new[nlen - tail - 1])) {
+		tail++;
+	}
+	while (   (tail > 0) && (tail < nlen)
+	       && ('\n' != new[nlen - tail - 1])) {
+		tail--;
+	}
+
+	for (p = new; p < new + head; p++) {
+		p = memchr (p, '\n', new + head - p);
+		if (NULL == p) {
+			break;
+		}
+		lineno++;
+	}
+	end = new + nlen - tail;
+	for (p = new + head; p < end; p = nl + 1, lineno++) {
+		char *line;
+
+		nl = memchr (p, '\n', end - p);
+		if (NULL == nl) {
+			nl = end;
+		}
+		if (('+' == *p) || ('-' == *p)) {
+			continue;
+		}
+		line = strndup (p, nl - p);
+		if (NULL == line) {
+			break;
+		}
+		if (!check_line (line)) {
+			fprintf (stderr, _("%s: %s:%lu: invalid entry\n"),
+			         Prog, edited, lineno);
+			errors++;
+		}
+		free (line);
+	}
+
+	if (NULL != orig) {
+		(void) munmap ((void *) orig, olen);
+	}
+	if (NULL != new) {
+		(void) munmap ((void *) new, nlen);
+	}
+	return errors;
+}
+
 /*
  *
  */
@@ -188,7 +386,8 @@ static void vipwexit (const char *msg, int syserr, int ret)
  *
  */
 static void
-vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void))
+vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void),
+          bool (*check_line) (const char *))
 {
 	const char *editor;
 	pid_t pid;
@@ -398,10 +597,19 @@ vipwedit (const char *file, int (*file_lock) (void), int (*file_unlock) (void))
 #endif				/* WITH_SELINUX */
 
 	/*
-	 * XXX - here we should check fileedit for errors; if there are any,
-	 * ask the user what to do (edit again, save changes anyway, or quit
-	 * without saving). Use pwck or grpck to do the check.  --marekm
+	 * Only the changed lines are checked. If there are errors, the
+	 * user can keep the file unchanged (the changes are kept in
+	 * fileedit), or save the changes anyway.
 	 */
+	if (check_changes (file, fileedit, check_line) != 0) {
+		printf (_("%s: save the changes anyway? [y/N] "), Prog);
+		if (!yes_or_no (false)) {
+			createedit = false;
+			fprintf (stderr, _("%s: your changes are in %s\n"),
+			         Prog, fileedit);
+			vipwexit (NULL, 0, 1);
+		}
+	}
 	createedit = false;
 #ifdef WITH_TCB
 	if (tcb_mode) {
@@ -554,13 +762,13 @@ int main (int argc, char **argv)
 				tcb_mode = true;
 			}
 #endif				/* WITH_TCB */
-			vipwedit (spw_dbname (), spw_lock, spw_unlock);
+			vipwedit (spw_dbname (), spw_lock, spw_unlock, spw_line_ok);
 			printf (MSG_WARN_EDIT_OTHER_FILE,
 			        spw_dbname (),
 			        pw_dbname (),
 			        "vipw");
 		} else {
-			vipwedit (pw_dbname (), pw_lock, pw_unlock);
+			vipwedit (pw_dbname (), pw_lock, pw_unlock, pw_line_ok);
 			if (spw_file_present ()) {
 				printf (MSG_WARN_EDIT_OTHER_FILE,
 				        pw_dbname (),
@@ -571,14 +779,14 @@ int main (int argc, char **argv)
 	} else {
 #ifdef SHADOWGRP
 		if (editshadow) {
-			vipwedit (sgr_dbname (), sgr_lock, sgr_unlock);
+			vipwedit (sgr_dbname (), sgr_lock, sgr_unlock, sgr_line_ok);
 			printf (MSG_WARN_EDIT_OTHER_FILE,
 			        sgr_dbname (),
 			        gr_dbname (),
 			        "vigr");
 		} else {
 #endif				/* SHADOWGRP */
-			vipwedit (gr_dbname (), gr_lock, gr_unlock);
+			vipwedit (gr_dbname (), gr_lock, gr_unlock, gr_line_ok);
 #ifdef SHADOWGRP
 			if (sgr_file_present ()) {
 				printf (MSG_WARN_EDIT_OTHER_FILE,
@@ -0,0 +1,77 @@
+/*
+ * Helpers shared by the benchmarks of tests/<module>/bench.
+ *
+ * Each benchmark is a single program built by ../../common/bench.mk,
+ * which puts this directory in the include path.
+ */
+
+#ifndef _BENCH_H_
+#define _BENCH_H_
+
+#include <ftw.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <sys/stat.h>
+
+/* Time of CLOCK_MONOTONIC, in nanoseconds */
+static inline long long bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* Time of CLOCK_MONOTONIC, in seconds */
+static inline double bench_now(void)
+{
+	return bench_now_ns() / 1e9;
+}
+
+/* Comparison function of qsort() for an array of doubles */
+static inline int bench_double_cmp(const void *p1, const void *p2)
+{
+	double d1 = *(const double *)p1, d2 = *(const double *)p2;
+
+	return (d1 < d2) ? -1 : (d1 > d2);
+}
+
+/* Median of the n samples of v, which are sorted */
+static inline double bench_median(double *v, int n)
+{
+	qsort(v, n, sizeof *v, bench_double_cmp);
+	return v[n / 2];
+}
+
+/* Create the file name of the directory dir, or exit */
+static inline FILE *bench_create(const char *dir, const char *name)
+{
+	char path[512];
+	FILE *fp;
+
+	snprintf(path, sizeof path, "%s/%s", dir, name);
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	return fp;
+}
+
+static inline int bench_remove_one(const char *path, const struct stat *sb,
+                                   int flag, struct FTW *ftw)
+{
+	(void) sb;
+	(void) flag;
+	(void) ftw;
+	return remove(path);
+}
+
+/* Remove the fixture in dir, and dir itself */
+static inline void bench_remove_tree(const char *dir)
+{
+	nftw(dir, bench_remove_one, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+#endif				/* _BENCH_H_ */
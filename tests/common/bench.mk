@@ -0,0 +1,25 @@
+# Rules shared by the Makefiles of tests/<module>/bench.
+#
+# A benchmark Makefile sets BENCH (its program, built from $(BENCH).c),
+# and if needed LDADD (the libraries it is linked with), BENCH_EXTRA
+# (other targets of all) and BENCH_CLEAN (other files to remove), then
+# includes this file and adds its run target.
+
+CC ?= gcc
+CFLAGS ?= -O2
+
+TOP = ../../..
+BENCH_CPPFLAGS = -I$(TOP)/lib/ -I$(TOP) -I$(TOP)/libmisc -I../../common
+SHADOW_LIBS = $(TOP)/libmisc/.libs/libmisc.a $(TOP)/lib/.libs/libshadow.a
+# Counts the allocations of the benchmarked operations
+WRAP = -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc
+
+all: $(BENCH) $(BENCH_EXTRA)
+
+$(BENCH): $(BENCH).c ../../common/bench.h
+	$(CC) $(CFLAGS) $(CPPFLAGS) $(BENCH_CPPFLAGS) -o $@ $(BENCH).c $(LDFLAGS) $(LDADD) $(LIBS)
+
+clean:
+	rm -f $(BENCH) $(BENCH_EXTRA) $(BENCH_CLEAN)
+
+.PHONY: all run clean
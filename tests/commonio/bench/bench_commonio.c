@@ -0,0 +1,365 @@
+/*
+ * Benchmark of the commonio databases.
+ *
+ * Generates passwd, shadow, group and gshadow files of several sizes,
+ * with realistic field sizes and a skewed distribution of the group
+ * members, in a temporary directory. For each database, it times open,
+ * locate, update, remove, sort (or sort_wrt for shadow and gshadow) and
+ * close, and reports the throughput and the number of allocations of
+ * each operation, and the peak RSS of the run.
+ *
+ * Each database of each size is benchmarked in its own process, so that
+ * the peak RSS is the one of that run.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <prototypes.h>
+#include "commonio.h"
+#include "groupio.h"
+#include "pwio.h"
+#include "sgroupio.h"
+#include "shadowio.h"
+#include "shadowlog.h"
+#include "bench.h"
+
+#define LOCATES		100000UL
+#define UPDATES		10000UL
+#define REMOVES		1000UL
+
+const char *Prog = "bench_commonio";
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+static char dir[] = "/tmp/bench_commonio.XXXXXX";
+static char passwd_path[64], shadow_path[64], group_path[64], gshadow_path[64];
+
+/*
+ * Number of members of group n: most groups have none, some have a few,
+ * and a few have many, as on hosts with directory-backed accounts.
+ */
+static unsigned long nmembers(unsigned long n, unsigned long nusers)
+{
+	unsigned long r = (n * 2654435761UL) % 1000;
+	unsigned long count;
+
+	if (r < 800)
+		count = 0;
+	else if (r < 950)
+		count = 1 + r % 5;
+	else if (r < 990)
+		count = 10 + r % 40;
+	else
+		count = 100 + (r % 10) * 100;
+	return count < nusers ? count : nusers;
+}
+
+static void print_members(FILE *fp, unsigned long n, unsigned long nusers)
+{
+	unsigned long count = nmembers(n, nusers);
+	unsigned long i;
+
+	for (i = 0; i < count; i++)
+		fprintf(fp, "%suser%lu", i ? "," : "",
+			(n * 7919 + i * 104729) % nusers);
+}
+
+static void generate(unsigned long nusers)
+{
+	unsigned long ngroups = nusers / 2 + 1;
+	FILE *pw, *sp, *gr, *sg;
+	unsigned long i;
+
+	pw = bench_create(dir, "passwd");
+	sp = bench_create(dir, "shadow");
+	for (i = 0; i < nusers; i++) {
+		fprintf(pw, "user%lu:x:%lu:%lu:Firstname Lastname %lu,Room %lu,+1 555 0100,:/home/user%lu:/bin/bash\n",
+			i, 1000 + i, 1000 + i % ngroups, i, i % 500, i);
+		fprintf(sp, "user%lu:$6$%016lx$%086lu:%lu:0:99999:7:::\n",
+			i, i * 2654435761UL, i, 19000 + i % 1000);
+	}
+	fclose(pw);
+	fclose(sp);
+
+	gr = bench_create(dir, "group");
+	sg = bench_create(dir, "gshadow");
+	for (i = 0; i < ngroups; i++) {
+		fprintf(gr, "group%lu:x:%lu:", i, 1000 + i);
+		print_members(gr, i, nusers);
+		fputc('\n', gr);
+		fprintf(sg, "group%lu:!:%s:", i, (i % 10 == 0) ? "user0" : "");
+		print_members(sg, i, nusers);
+		fputc('\n', sg);
+	}
+	fclose(gr);
+	fclose(sg);
+}
+
+/* Operations of a database */
+struct bench_db {
+	const char *name;
+	const char *prefix;	/* of the names of the entries */
+	unsigned long (*count)(unsigned long nusers);
+	int (*lock)(void);
+	int (*open)(int mode);
+	int (*close)(void);
+	int (*unlock)(void);
+	const void *(*locate)(const char *name);
+	int (*update)(const void *ent);
+	int (*remove)(const char *name);
+	int (*sort)(void);
+	const char *sort_name;
+	/* database sorted against, opened before the benchmark */
+	int (*wrt_open)(int mode);
+	int (*wrt_close)(void);
+};
+
+static unsigned long users(unsigned long nusers)
+{
+	return nusers;
+}
+
+static unsigned long groups(unsigned long nusers)
+{
+	return nusers / 2 + 1;
+}
+
+static const void *pw_locate_any(const char *name)
+{
+	return pw_locate(name);
+}
+
+static int pw_update_any(const void *ent)
+{
+	struct passwd pw = *(const struct passwd *)ent;
+
+	pw.pw_gecos = "Updated Name,Room 1,+1 555 0199,";
+	return pw_update(&pw);
+}
+
+static const void *spw_locate_any(const char *name)
+{
+	return spw_locate(name);
+}
+
+static int spw_update_any(const void *ent)
+{
+	struct spwd sp = *(const struct spwd *)ent;
+
+	sp.sp_lstchg++;
+	return spw_update(&sp);
+}
+
+static const void *gr_locate_any(const char *name)
+{
+	return gr_locate(name);
+}
+
+static int gr_update_any(const void *ent)
+{
+	struct group gr = *(const struct group *)ent;
+
+	gr.gr_passwd = "!";
+	return gr_update(&gr);
+}
+
+static const void *sgr_locate_any(const char *name)
+{
+	return sgr_locate(name);
+}
+
+static int sgr_update_any(const void *ent)
+{
+	struct sgrp sg = *(const struct sgrp *)ent;
+
+	sg.sg_passwd = "!!";
+	return sgr_update(&sg);
+}
+
+static const struct bench_db dbs[] = {
+	{ "passwd", "user", users, pw_lock, pw_open, pw_close, pw_unlock,
+	  pw_locate_any, pw_update_any, pw_remove, pw_sort, "sort",
+	  NULL, NULL },
+	{ "shadow", "user", users, spw_lock, spw_open, spw_close, spw_unlock,
+	  spw_locate_any, spw_update_any, spw_remove, spw_sort, "sort_wrt",
+	  pw_open, pw_close },
+	{ "group", "group", groups, gr_lock, gr_open, gr_close, gr_unlock,
+	  gr_locate_any, gr_update_any, gr_remove, gr_sort, "sort",
+	  NULL, NULL },
+	{ "gshadow", "group", groups, sgr_lock, sgr_open, sgr_close, sgr_unlock,
+	  sgr_locate_any, sgr_update_any, sgr_remove, sgr_sort, "sort_wrt",
+	  gr_open, gr_close },
+};
+
+static void report(const char *op, const struct bench_db *db,
+		   unsigned long entries, unsigned long ops, double ms,
+		   unsigned long allocs)
+{
+	printf("%-9s %-8s %9lu %9lu %11.2f %12.0f %10.2f\n", op, db->name,
+	       entries, ops, ms, ms > 0 ? ops * 1e3 / ms : 0.0,
+	       (double)allocs / ops);
+}
+
+#define BENCH(op, ops, stmt) do {					\
+	unsigned long allocs = allocations;				\
+	double start = bench_now();					\
+	stmt;								\
+	report(op, db, entries, ops, (bench_now() - start) * 1e3,	\
+	       allocations - allocs);					\
+} while (0)
+
+static void fail(const struct bench_db *db, const char *op)
+{
+	fprintf(stderr, "%s: %s %s failed\n", Prog, db->name, op);
+	_exit(1);
+}
+
+static void bench(const struct bench_db *db, unsigned long nusers)
+{
+	unsigned long entries = db->count(nusers);
+	unsigned long locates = LOCATES, updates = UPDATES, removes = REMOVES;
+	unsigned long i;
+	struct rusage ru;
+	char name[32];
+
+	if (updates > entries)
+		updates = entries;
+	if (removes > entries / 2)
+		removes = entries / 2;
+
+	if (db->wrt_open && !db->wrt_open(O_RDONLY))
+		fail(db, "open");
+	if (!db->lock())
+		fail(db, "lock");
+	BENCH("open", entries, if (!db->open(O_RDWR)) fail(db, "open"));
+
+	BENCH("locate", locates, {
+		for (i = 0; i < locates; i++) {
+			snprintf(name, sizeof name, "%s%lu", db->prefix,
+				 (unsigned long)random() % entries);
+			if (!db->locate(name))
+				fail(db, "locate");
+		}
+	});
+
+	BENCH("update", updates, {
+		for (i = 0; i < updates; i++) {
+			const void *ent;
+
+			snprintf(name, sizeof name, "%s%lu", db->prefix,
+				 (unsigned long)random() % entries);
+			ent = db->locate(name);
+			if (!ent || !db->update(ent))
+				fail(db, "update");
+		}
+	});
+
+	/* Remove distinct entries, spread over the file */
+	BENCH("remove", removes, {
+		for (i = 0; i < removes; i++) {
+			snprintf(name, sizeof name, "%s%lu", db->prefix,
+				 i * (entries / removes));
+			if (!db->remove(name))
+				fail(db, "remove");
+		}
+	});
+
+	BENCH(db->sort_name, entries, if (db->sort() != 0) fail(db, "sort"));
+
+	BENCH("close", entries - removes,
+	      if (!db->close()) fail(db, "close"));
+	db->unlock();
+	if (db->wrt_close)
+		db->wrt_close();
+
+	getrusage(RUSAGE_SELF, &ru);
+	printf("%-9s %-8s %9lu %9s %11s %12s %10s %8ld KiB\n", "peak_rss",
+	       db->name, entries, "", "", "", "", ru.ru_maxrss);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = { 1000, 10000, 100000, 1000000 };
+	unsigned long *list = sizes;
+	int n = sizeof sizes / sizeof sizes[0];
+	size_t d;
+	int i;
+
+	if (argc > 1) {
+		n = argc - 1;
+		list = calloc(n, sizeof *list);
+		for (i = 0; i < n; i++)
+			list[i] = strtoul(argv[i + 1], NULL, 10);
+	}
+
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	printf("%-9s %-8s %9s %9s %11s %12s %10s\n", "operation", "database",
+	       "entries", "ops", "time (ms)", "ops/s", "allocs/op");
+	for (i = 0; i < n; i++) {
+		if (!mkdtemp(strcpy(dir, "/tmp/bench_commonio.XXXXXX"))) {
+			perror(dir);
+			exit(1);
+		}
+		snprintf(passwd_path, sizeof passwd_path, "%s/passwd", dir);
+		snprintf(shadow_path, sizeof shadow_path, "%s/shadow", dir);
+		snprintf(group_path, sizeof group_path, "%s/group", dir);
+		snprintf(gshadow_path, sizeof gshadow_path, "%s/gshadow", dir);
+		pw_setdbname(passwd_path);
+		spw_setdbname(shadow_path);
+		gr_setdbname(group_path);
+		sgr_setdbname(gshadow_path);
+
+		for (d = 0; d < sizeof dbs / sizeof dbs[0]; d++) {
+			pid_t pid;
+			int status;
+
+			/* Each run starts from the generated files */
+			generate(list[i]);
+			fflush(stdout);
+			pid = fork();
+			if (pid == 0) {
+				srandom(1);
+				bench(&dbs[d], list[i]);
+				_exit(0);
+			}
+			waitpid(pid, &status, 0);
+			if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+				bench_remove_tree(dir);
+				exit(1);
+			}
+		}
+		bench_remove_tree(dir);
+	}
+	return 0;
+}
@@ -0,0 +1,140 @@
+/*
+ * Benchmark of the conversion tools.
+ *
+ * Generates passwd, shadow, group and gshadow files of several sizes in a
+ * temporary directory, and reports the time taken by pwconv, pwunconv,
+ * grpconv and grpunconv (run with -R on this directory) to convert them.
+ * Half of the users and groups have a shadow entry, and the shadow files
+ * also contain entries which must be removed, while the NIS entries stay
+ * at the end of the files.
+ *
+ * It needs to run as root, for the chroot() of -R.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#ifndef TOOLS_DIR
+#define TOOLS_DIR	"../../../src"
+#endif
+
+static const char *Prog = "bench_conv";
+
+static char dir[] = "/tmp/bench_conv.XXXXXX";
+
+static const char *const tools[] = {
+	"pwconv", "pwunconv", "grpconv", "grpunconv",
+};
+
+static void generate(unsigned long n)
+{
+	char path[512];
+	unsigned long i;
+	FILE *fp;
+
+	snprintf(path, sizeof path, "%s/etc", dir);
+	mkdir(path, 0755);
+
+	fp = bench_create(dir, "etc/passwd");
+	fprintf(fp, "root:x:0:0:root:/root:/bin/sh\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "user%lu:$6$salt%lu$hash:%lu:%lu::/home/user%lu:/bin/sh\n",
+		        i, i, 1000 + i, 1000 + i, i);
+	fprintf(fp, "+@netusers::::::\n+\n");
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/shadow");
+	fprintf(fp, "root:*:19000:0:99999:7:::\n");
+	for (i = 0; i < n; i += 2)
+		fprintf(fp, "user%lu:!:19000:0:99999:7:::\n", i);
+	for (i = 0; i < n / 10; i++)
+		fprintf(fp, "gone%lu:!:19000:0:99999:7:::\n", i);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/group");
+	fprintf(fp, "root:x:0:\n");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "group%lu:$6$salt%lu$hash:%lu:user%lu\n",
+		        i, i, 1000 + i, i);
+	fprintf(fp, "+\n");
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/gshadow");
+	fprintf(fp, "root:*::\n");
+	for (i = 0; i < n; i += 2)
+		fprintf(fp, "group%lu:!::user%lu\n", i, i);
+	for (i = 0; i < n / 10; i++)
+		fprintf(fp, "gone%lu:!::\n", i);
+	fclose(fp);
+}
+
+/* Run a tool on the fixture and return the elapsed time in seconds */
+static double run(const char *tool)
+{
+	char path[512];
+	double start;
+	pid_t pid;
+	int status;
+
+	snprintf(path, sizeof path, "%s/%s", TOOLS_DIR, tool);
+	start = bench_now();
+	pid = fork();
+	if (pid == 0) {
+		execl(path, tool, "-R", dir, (char *) NULL);
+		perror(path);
+		_exit(127);
+	}
+	waitpid(pid, &status, 0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "%s: %s failed\n", Prog, tool);
+		exit(1);
+	}
+	return bench_now() - start;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = { 1000, 10000, 100000, 1000000 };
+	unsigned long *list = sizes;
+	int n = sizeof sizes / sizeof sizes[0];
+	size_t t;
+	int i;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: must be run as root\n", Prog);
+		exit(77);
+	}
+	if (argc > 1) {
+		n = argc - 1;
+		list = calloc(n, sizeof *list);
+		for (i = 0; i < n; i++)
+			list[i] = strtoul(argv[i + 1], NULL, 10);
+	}
+
+	printf("%-10s %8s %10s %12s\n", "tool", "entries", "time (s)",
+	       "per entry (us)");
+	for (i = 0; i < n; i++) {
+		if (!mkdtemp(strcpy(dir, "/tmp/bench_conv.XXXXXX"))) {
+			perror(dir);
+			exit(1);
+		}
+		generate(list[i]);
+		for (t = 0; t < sizeof tools / sizeof tools[0]; t++) {
+			double elapsed = run(tools[t]);
+
+			printf("%-10s %8lu %10.3f %12.3f\n", tools[t], list[i],
+			       elapsed, elapsed * 1e6 / list[i]);
+			fflush(stdout);
+		}
+		bench_remove_tree(dir);
+	}
+	return 0;
+}
@@ -0,0 +1,434 @@
+/*
+ * Benchmark of copy_tree, chown_tree and remove_tree.
+ *
+ * Generates a skeleton tree in a directory of the file system to test
+ * (-d, /tmp by default), with FILES regular files (-n) in directories of
+ * 32 entries, whose sizes are spread log-uniformly up to SIZE bytes (-s),
+ * and a percentage of hard links (-l), symbolic links (-y), files with an
+ * ACL (-a) and files with an extended attribute (-x). The tree is then
+ * copied to a home directory, whose ownership is changed, which is then
+ * removed, with each method:
+ *
+ *	read-write	 the data are copied through user space
+ *	copy_file_range	 the data are copied by the kernel
+ *	reflink		 the data blocks are shared (FICLONE)
+ *	parallel	 the fastest method, with JOBS threads (-j) for
+ *			 HOME_COPY_JOBS, HOME_CHOWN_JOBS and HOME_REMOVE_JOBS
+ *
+ * The methods which the file system does not support are reported as
+ * n/a. For each method and operation, it reports the median of the
+ * entries (files, links and directories) per second and of the MB of
+ * the regular files per second of REPEAT runs. With -c, the page cache
+ * is dropped before each operation.
+ *
+ * It needs to run as root, for chown_tree.
+ */
+
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/statfs.h>
+#include <sys/xattr.h>
+#include <prototypes.h>
+#include "getdef.h"
+#include "shadowlog.h"
+#include "bench.h"
+
+#define REPEAT		3
+#define FANOUT		32	/* entries per directory */
+#define OWNER		60001	/* of the copies */
+#define NEW_OWNER	60002	/* after chown_tree */
+
+const char *Prog = "bench_copydir";
+
+static char tmp[480], src[512], dst[512];
+static unsigned long entries;
+static unsigned long long bytes;
+static bool drop_caches = false;
+
+enum { COPY, CHOWN, REMOVE, OPS };
+
+static const char *const ops[OPS] = { "copy", "chown", "remove" };
+
+static const struct method {
+	const char *name;
+	enum copy_method method;
+	bool parallel;
+} methods[] = {
+	{ "read-write",		COPY_METHOD_BUFFER,	false },
+	{ "copy_file_range",	COPY_METHOD_RANGE,	false },
+	{ "reflink",		COPY_METHOD_CLONE,	false },
+	{ "parallel",		COPY_METHOD_AUTO,	true },
+	{ NULL },
+};
+
+static const struct {
+	unsigned long magic;
+	const char *name;
+} fs_types[] = {
+	{ 0xEF53, "ext4" },
+	{ 0x58465342, "xfs" },
+	{ 0x9123683E, "btrfs" },
+	{ 0x6969, "nfs" },
+	{ 0x794C7630, "overlayfs" },
+	{ 0x01021994, "tmpfs" },
+	{ 0x2FC12FC1, "zfs" },
+	{ 0 },
+};
+
+static uint64_t rng = 0x9E3779B97F4A7C15ULL;
+
+static uint64_t next_random(void)
+{
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+static bool chance(unsigned int percent)
+{
+	return next_random() % 100 < percent;
+}
+
+static void fail(const char *what)
+{
+	perror(what);
+	exit(1);
+}
+
+/* A minimal access ACL: owner rw, user OWNER r, group r, mask r, other r */
+static void set_acl(const char *path)
+{
+	/* The format of the system.posix_acl_access attribute */
+	static const struct {
+		uint32_t version;
+		struct {
+			uint16_t tag;
+			uint16_t perm;
+			uint32_t id;
+		} entries[5];
+	} acl = {
+		2, {
+			{ 0x01, 06, -1 },	/* ACL_USER_OBJ */
+			{ 0x02, 04, OWNER },	/* ACL_USER */
+			{ 0x04, 04, -1 },	/* ACL_GROUP_OBJ */
+			{ 0x10, 04, -1 },	/* ACL_MASK */
+			{ 0x20, 04, -1 },	/* ACL_OTHER */
+		}
+	};
+	static bool warned = false;
+
+	if (setxattr(path, "system.posix_acl_access", &acl, sizeof acl, 0) != 0
+	    && !warned) {
+		fprintf(stderr, "%s: cannot set an ACL: %s\n",
+		        Prog, strerror(errno));
+		warned = true;
+	}
+}
+
+static void set_xattr(const char *path)
+{
+	static bool warned = false;
+
+	if (setxattr(path, "user.bench_copydir", "value", 5, 0) != 0
+	    && !warned) {
+		fprintf(stderr, "%s: cannot set an extended attribute: %s\n",
+		        Prog, strerror(errno));
+		warned = true;
+	}
+}
+
+static void generate(unsigned long files, unsigned long max_size,
+                     unsigned int links, unsigned int symlinks,
+                     unsigned int acls, unsigned int xattrs)
+{
+	static char buf[64 * 1024];
+	char path[1024], dir[768], target[1024];
+	unsigned long i, j;
+	size_t k;
+
+	for (k = 0; k < sizeof buf; k += 8) {
+		uint64_t r = next_random();
+
+		memcpy(buf + k, &r, 8);
+	}
+
+	if (mkdir(src, 0755) != 0)
+		fail(src);
+	for (i = 0; i < files; i++) {
+		unsigned long long size;
+		int fd;
+
+		/* Two levels of directories of FANOUT entries */
+		snprintf(dir, sizeof dir, "%s/d%lu", src,
+		         i / (FANOUT * FANOUT));
+		if (i % (FANOUT * FANOUT) == 0) {
+			if (mkdir(dir, 0755) != 0)
+				fail(dir);
+			entries++;
+		}
+		snprintf(dir + strlen(dir), sizeof dir - strlen(dir), "/d%lu",
+		         i / FANOUT % FANOUT);
+		if (i % FANOUT == 0) {
+			if (mkdir(dir, 0755) != 0)
+				fail(dir);
+			entries++;
+		}
+		snprintf(path, sizeof path, "%s/f%lu", dir, i);
+
+		if (i % FANOUT != 0 && chance(links)) {
+			snprintf(target, sizeof target, "%s/f%lu", dir,
+			         i - 1 - next_random() % (i % FANOUT));
+			if (link(target, path) == 0) {
+				entries++;
+				continue;
+			}
+		}
+		if (i % FANOUT != 0 && chance(symlinks)) {
+			snprintf(target, sizeof target, "f%lu", i - 1);
+			if (symlink(target, path) != 0)
+				fail(path);
+			entries++;
+			continue;
+		}
+
+		size = (unsigned long long)
+		       (exp((next_random() % 10000) / 10000.0
+		            * log(max_size + 1.0)) - 1);
+		fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0)
+			fail(path);
+		for (j = 0; j < size; j += sizeof buf) {
+			size_t len = (size - j < sizeof buf) ? size - j
+			                                     : sizeof buf;
+
+			if (write(fd, buf, len) != (ssize_t) len)
+				fail(path);
+		}
+		close(fd);
+		if (chance(acls))
+			set_acl(path);
+		if (chance(xattrs))
+			set_xattr(path);
+		entries++;
+		bytes += size;
+	}
+	sync();
+}
+
+static void drop(void)
+{
+	int fd;
+
+	sync();
+	if (!drop_caches)
+		return;
+	fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+	if (fd < 0 || write(fd, "3", 1) != 1)
+		fail("/proc/sys/vm/drop_caches");
+	close(fd);
+}
+
+static void set_jobs(long jobs)
+{
+	char value[32];
+
+	snprintf(value, sizeof value, "%ld", jobs);
+	putdef_str("HOME_COPY_JOBS", value);
+	putdef_str("HOME_CHOWN_JOBS", value);
+	putdef_str("HOME_REMOVE_JOBS", value);
+}
+
+/*
+ * Check if the file system supports method m: copy_tree() does not report
+ * the files it fails to copy in the subdirectories.
+ */
+static bool supported(const struct method *m)
+{
+	char in_path[512], out_path[512];
+	bool ret = true;
+	int in, out;
+
+	if (COPY_METHOD_CLONE != m->method && COPY_METHOD_RANGE != m->method)
+		return true;
+	snprintf(in_path, sizeof in_path, "%s/probe.in", tmp);
+	snprintf(out_path, sizeof out_path, "%s/probe.out", tmp);
+	in = open(in_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	out = open(out_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (in < 0 || out < 0 || write(in, "probe", 5) != 5)
+		fail(tmp);
+	if (COPY_METHOD_CLONE == m->method)
+		ret = ioctl(out, FICLONE, in) == 0;
+	else
+		ret = copy_file_range(in, &(off_t) { 0 }, out, NULL, 5, 0) == 5;
+	close(in);
+	close(out);
+	unlink(in_path);
+	unlink(out_path);
+	return ret;
+}
+
+/*
+ * Copy, chown and remove the tree once with method m, and fill the time
+ * of each operation.
+ *
+ * Return false if the copy failed.
+ */
+static bool run(const struct method *m, long jobs, double t[OPS])
+{
+	double start;
+	int err;
+
+	copy_tree_set_method(m->method);
+	set_jobs(m->parallel ? jobs : 1);
+
+	drop();
+	start = bench_now();
+	err = copy_tree(src, dst, true, false, -1, OWNER, -1, OWNER);
+	t[COPY] = bench_now() - start;
+	if (0 != err) {
+		remove_tree(dst, true);
+		return false;
+	}
+
+	drop();
+	start = bench_now();
+	if (chown_tree(dst, OWNER, NEW_OWNER, OWNER, NEW_OWNER) != 0)
+		fail("chown_tree");
+	t[CHOWN] = bench_now() - start;
+
+	drop();
+	start = bench_now();
+	if (remove_tree(dst, true) != 0)
+		fail("remove_tree");
+	t[REMOVE] = bench_now() - start;
+	return true;
+}
+
+static const char *fs_name(const char *path)
+{
+	static char magic[32];
+	struct statfs sfs;
+	int i;
+
+	if (statfs(path, &sfs) != 0)
+		fail(path);
+	for (i = 0; fs_types[i].name; i++)
+		if ((unsigned long) sfs.f_type == fs_types[i].magic)
+			return fs_types[i].name;
+	snprintf(magic, sizeof magic, "0x%lx", (unsigned long) sfs.f_type);
+	return magic;
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-c] [-d DIR] [-n FILES] [-s SIZE] "
+	        "[-l PCT] [-y PCT] [-a PCT] [-x PCT] [-j JOBS]\n", Prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *base = "/tmp";
+	unsigned long files = 10000, max_size = 1024 * 1024;
+	unsigned int links = 5, symlinks = 5, acls = 0, xattrs = 0;
+	long jobs = sysconf(_SC_NPROCESSORS_ONLN);
+	double t[OPS][REPEAT], one[OPS];
+	const struct method *m;
+	int c, k, op;
+
+	while ((c = getopt(argc, argv, "cd:n:s:l:y:a:x:j:")) != -1) {
+		switch (c) {
+		case 'c':
+			drop_caches = true;
+			break;
+		case 'd':
+			base = optarg;
+			break;
+		case 'n':
+			files = strtoul(optarg, NULL, 10);
+			break;
+		case 's':
+			max_size = strtoul(optarg, NULL, 10);
+			break;
+		case 'l':
+			links = strtoul(optarg, NULL, 10);
+			break;
+		case 'y':
+			symlinks = strtoul(optarg, NULL, 10);
+			break;
+		case 'a':
+			acls = strtoul(optarg, NULL, 10);
+			break;
+		case 'x':
+			xattrs = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			jobs = strtol(optarg, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind != argc || 0 == files || jobs < 1)
+		usage();
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: must be run as root\n", Prog);
+		exit(77);
+	}
+
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	snprintf(tmp, sizeof tmp, "%s/bench_copydir.XXXXXX", base);
+	if (!mkdtemp(tmp))
+		fail(tmp);
+	snprintf(src, sizeof src, "%s/skel", tmp);
+	snprintf(dst, sizeof dst, "%s/home", tmp);
+	fprintf(stderr, "%s: generating %lu files in %s\n", Prog, files, tmp);
+	generate(files, max_size, links, symlinks, acls, xattrs);
+
+	printf("# %s (%s): %lu entries, %.1f MB, %ld jobs\n", base,
+	       fs_name(tmp), entries, bytes / 1e6, jobs);
+	printf("# %-16s", "method");
+	for (op = 0; op < OPS; op++)
+		printf(" %8s/s %9s", ops[op], "MB/s");
+	printf("\n");
+
+	for (m = methods; m->name; m++) {
+		k = supported(m) ? 0 : REPEAT + 1;
+		for (; k < REPEAT; k++) {
+			if (!run(m, jobs, one))
+				break;
+			for (op = 0; op < OPS; op++)
+				t[op][k] = one[op];
+		}
+		printf("  %-16s", m->name);
+		if (k != REPEAT) {
+			printf(" n/a\n");
+			continue;
+		}
+		for (op = 0; op < OPS; op++) {
+			double s = bench_median(t[op], REPEAT);
+
+			printf(" %10.0f %9.1f", entries / s, bytes / 1e6 / s);
+		}
+		printf("\n");
+		fflush(stdout);
+	}
+
+	bench_remove_tree(tmp);
+	return 0;
+}
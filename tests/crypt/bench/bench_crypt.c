@@ -0,0 +1,308 @@
+/*
+ * Benchmark of the encryption of the passwords by the bulk tools.
+ *
+ * For each method and cost (METHOD[:COST] arguments, or the methods built
+ * in with two costs by default) and each number of threads (-t, 1, 2, 4,
+ * ... up to the number of CPUs by default), it encrypts passwords as
+ * chpasswd and newusers do: a salt of crypt_make_salt() for each password,
+ * queued in a crypt_batch of that many threads. It reports:
+ *
+ *	hashes/s	the throughput of the batch
+ *	p50, p90, p99	the latency of one hash (ms) when that many threads
+ *			encrypt at the same time with pw_encrypt_r()
+ *	eff		the throughput of the batch divided by the one of
+ *			these threads: the efficiency of the batch engine
+ *	salt		the time of crypt_make_salt() (us), mostly reading
+ *			the CSPRNG, and the share of the time of the
+ *			queuing thread it takes at that throughput
+ *
+ * Each measure encrypts about a second of passwords, at least 4 per
+ * thread and at most HASHES (-n, 1000 by default). The exit status is 2
+ * if the efficiency of the batch is under MIN_EFFICIENCY for a method
+ * whose hashes take more than MIN_TIME.
+ */
+
+#include <config.h>
+#include <crypt.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <prototypes.h>
+#include "shadowlog.h"
+#include "bench.h"
+
+#ifndef HAVE_CRYPT_R
+#error "The batches of passwords need crypt_r()"
+#endif
+
+#define HASHES		1000
+#define MAX_THREADS	64
+#define SALTS		10000
+#define MIN_EFFICIENCY	0.75
+#define MIN_TIME	1e-3	/* s, the hashes below are not checked */
+
+const char *Prog = "bench_crypt";
+
+struct config {
+	const char *method;
+	int cost;		/* 0 for the methods without cost */
+};
+
+static const struct config defaults[] = {
+	{ "DES", 0 },
+	{ "MD5", 0 },
+#ifdef USE_SHA_CRYPT
+	{ "SHA256", 5000 },
+	{ "SHA512", 5000 },
+	{ "SHA512", 50000 },
+#endif
+#ifdef USE_BCRYPT
+	{ "BCRYPT", 8 },
+	{ "BCRYPT", 11 },
+#endif
+#ifdef USE_YESCRYPT
+	{ "YESCRYPT", 3 },
+	{ "YESCRYPT", 5 },
+#endif
+};
+
+static const char *make_salt(const struct config *c)
+{
+	int cost = c->cost;
+
+	return crypt_make_salt(c->method, (0 != cost) ? &cost : NULL);
+}
+
+/* The time of crypt_make_salt(), in s */
+static double salt_time(const struct config *c)
+{
+	double start = bench_now();
+	int i;
+
+	for (i = 0; i < SALTS; i++)
+		make_salt(c);
+	return (bench_now() - start) / SALTS;
+}
+
+/* The throughput of a batch of n passwords with nthreads threads */
+static double batch_rate(const struct config *c, long nthreads, size_t n)
+{
+	struct crypt_batch *batch;
+	char clear[32];
+	double start;
+	size_t i;
+	int err;
+
+	start = bench_now();
+	batch = crypt_batch_start(nthreads);
+	if (!batch) {
+		perror("crypt_batch_start");
+		exit(1);
+	}
+	for (i = 0; i < n; i++) {
+		snprintf(clear, sizeof clear, "password%zu", i);
+		if (crypt_batch_add(batch, clear, make_salt(c)) == -1) {
+			perror("crypt_batch_add");
+			exit(1);
+		}
+	}
+	crypt_batch_finish(batch);
+	start = bench_now() - start;
+	for (i = 0; i < n; i++)
+		if (!crypt_batch_hash(batch, i, NULL, &err)) {
+			fprintf(stderr, "%s: cannot encrypt with %s: %s\n",
+			        Prog, c->method, strerror(err));
+			exit(1);
+		}
+	crypt_batch_free(batch);
+	return n / start;
+}
+
+struct worker {
+	pthread_t thread;
+	char salt[128];
+	size_t n;
+	double *latency;	/* of each of the n hashes, in s */
+};
+
+static void *worker_run(void *arg)
+{
+	struct worker *w = arg;
+	struct crypt_data *data = calloc(1, sizeof *data);
+	char clear[32];
+	size_t i;
+
+	if (!data)
+		return NULL;
+	for (i = 0; i < w->n; i++) {
+		double start = bench_now();
+
+		snprintf(clear, sizeof clear, "password%zu", i);
+		if (!pw_encrypt_r(clear, w->salt, data))
+			break;
+		w->latency[i] = bench_now() - start;
+	}
+	free(data);
+	return NULL;
+}
+
+/*
+ * Encrypt n passwords with nthreads threads calling pw_encrypt_r()
+ * directly, and fill the latency of each hash.
+ *
+ * Return the throughput.
+ */
+static double direct_rate(const struct config *c, long nthreads, size_t n,
+                          double *latency)
+{
+	static struct worker workers[MAX_THREADS];
+	double start;
+	size_t done = 0;
+	long t;
+
+	start = bench_now();
+	for (t = 0; t < nthreads; t++) {
+		struct worker *w = &workers[t];
+
+		/* The salts are made before, as in the batch */
+		snprintf(w->salt, sizeof w->salt, "%s", make_salt(c));
+		w->n = n / nthreads + ((size_t) t < n % nthreads);
+		w->latency = latency + done;
+		done += w->n;
+		if (pthread_create(&w->thread, NULL, worker_run, w) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (t = 0; t < nthreads; t++)
+		pthread_join(workers[t].thread, NULL);
+	return n / (bench_now() - start);
+}
+
+static void bench(const struct config *c, const long *threads, int nthreads,
+                  size_t max, int *ret)
+{
+	double salt = salt_time(c);
+	double one, *latency;
+	char cost[16];
+	size_t n;
+	int i;
+
+	/* One hash, to size the runs */
+	one = 1 / direct_rate(c, 1, 1, &(double) { 0 });
+	latency = calloc(max, sizeof *latency);
+	if (!latency) {
+		perror(Prog);
+		exit(1);
+	}
+	if (0 != c->cost)
+		snprintf(cost, sizeof cost, "%d", c->cost);
+	else
+		strcpy(cost, "-");
+
+	for (i = 0; i < nthreads; i++) {
+		double batch, direct;
+
+		n = threads[i] / one;
+		if (n < 4 * (size_t) threads[i])
+			n = 4 * threads[i];
+		if (n > max)
+			n = max;
+		direct = direct_rate(c, threads[i], n, latency);
+		qsort(latency, n, sizeof *latency, bench_double_cmp);
+		batch = batch_rate(c, threads[i], n);
+		printf("  %-8s %6s %7ld %10.1f %8.3f %8.3f %8.3f %5.2f %9.2f %6.2f%%\n",
+		       c->method, cost, threads[i], batch,
+		       latency[n / 2] * 1e3, latency[n * 9 / 10] * 1e3,
+		       latency[n * 99 / 100] * 1e3, batch / direct,
+		       salt * 1e6, salt * batch * 100);
+		fflush(stdout);
+		if (batch / direct < MIN_EFFICIENCY && one > MIN_TIME) {
+			fprintf(stderr, "%s: the batch of %ld threads runs "
+			        "%s at %.0f%% of the threads\n", Prog,
+			        threads[i], c->method, batch / direct * 100);
+			*ret = 2;
+		}
+	}
+	free(latency);
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [-n HASHES] [-t THREADS[,THREADS...]] "
+	        "[METHOD[:COST]...]\n", Prog);
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	long threads[MAX_THREADS];
+	int nthreads = 0;
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t max = HASHES;
+	struct config *configs;
+	int nconfigs, c, i, ret = 0;
+	char *p;
+
+	while ((c = getopt(argc, argv, "n:t:")) != -1) {
+		switch (c) {
+		case 'n':
+			max = strtoul(optarg, NULL, 10);
+			if (max < 1)
+				usage();
+			break;
+		case 't':
+			for (p = strtok(optarg, ","); p && nthreads < MAX_THREADS;
+			     p = strtok(NULL, ","))
+				threads[nthreads++] = strtol(p, NULL, 10);
+			break;
+		default:
+			usage();
+		}
+	}
+	for (i = 0; i < nthreads; i++)
+		if (threads[i] < 1 || threads[i] > MAX_THREADS)
+			usage();
+	if (0 == nthreads) {
+		long t;
+
+		for (t = 1; t < ncpus && t < MAX_THREADS; t *= 2)
+			threads[nthreads++] = t;
+		threads[nthreads++] = (ncpus < MAX_THREADS) ? ncpus
+		                                            : MAX_THREADS;
+	}
+	if (max < 4 * (size_t) threads[nthreads - 1])
+		max = 4 * threads[nthreads - 1];
+
+	nconfigs = argc - optind;
+	if (0 == nconfigs) {
+		nconfigs = sizeof defaults / sizeof defaults[0];
+		configs = (struct config *) defaults;
+	} else {
+		configs = calloc(nconfigs, sizeof *configs);
+		if (!configs)
+			usage();
+		for (i = 0; i < nconfigs; i++) {
+			p = strchr(argv[optind + i], ':');
+			if (p) {
+				*p++ = '\0';
+				configs[i].cost = strtol(p, NULL, 10);
+			}
+			configs[i].method = argv[optind + i];
+		}
+	}
+
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+
+	printf("# %-8s %6s %7s %10s %8s %8s %8s %5s %9s %7s\n", "method",
+	       "cost", "threads", "hashes/s", "p50 (ms)", "p90 (ms)",
+	       "p99 (ms)", "eff", "salt (us)", "salt");
+	for (i = 0; i < nconfigs; i++)
+		bench(&configs[i], threads, nthreads, max, &ret);
+	return ret;
+}
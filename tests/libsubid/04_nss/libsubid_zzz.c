@@ -4,6 +4,7 @@
 #include <stdbool.h>
 #include <subid.h>
 #include <string.h>
+#include <unistd.h>
 
 enum subid_status shadow_subid_has_any_range(const char *owner, enum subid_type t, bool *result)
 {
@@ -137,3 +138,80 @@ enum subid_status shadow_subid_list_owner_ranges(const char *owner, enum subid_t
 
 	return SUBID_STATUS_SUCCESS;
 }
+
+enum subid_status shadow_subid_list_owner_ranges_many(const char *const *owners, size_t n, enum subid_type id_type, struct subid_range **ranges, int *counts, enum subid_status *status)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		status[i] = shadow_subid_list_owner_ranges(owners[i], id_type, &ranges[i], &counts[i]);
+
+	return SUBID_STATUS_SUCCESS;
+}
+
+enum subid_status shadow_subid_has_range_many(const char *owner, const struct subid_range *ranges, size_t n, enum subid_type t, bool *result)
+{
+	enum subid_status status;
+	size_t i;
+
+	*result = true;
+	for (i = 0; i < n && *result; i++) {
+		status = shadow_subid_has_range(owner, ranges[i].start, ranges[i].count, t, result);
+		if (status != SUBID_STATUS_SUCCESS)
+			return status;
+	}
+
+	return SUBID_STATUS_SUCCESS;
+}
+
+// The ranges above never change
+enum subid_status shadow_subid_cache_token(enum subid_type id_type, unsigned long *token)
+{
+	*token = 1;
+	return SUBID_STATUS_SUCCESS;
+}
+
+// The answers are computed by the finish call: the fd is readable at once
+struct zzz_request {
+	int fds[2];
+	const char *const *owners;
+	size_t n;
+	enum subid_type id_type;
+};
+
+enum subid_status shadow_subid_list_owner_ranges_start(const char *const *owners, size_t n, enum subid_type id_type, int *fd, void **request)
+{
+	struct zzz_request *req;
+
+	req = malloc(sizeof(*req));
+	if (!req)
+		return SUBID_STATUS_ERROR;
+	if (pipe(req->fds) != 0) {
+		free(req);
+		return SUBID_STATUS_ERROR;
+	}
+	if (write(req->fds[1], "", 1) != 1) {
+		close(req->fds[0]);
+		close(req->fds[1]);
+		free(req);
+		return SUBID_STATUS_ERROR;
+	}
+	req->owners = owners;
+	req->n = n;
+	req->id_type = id_type;
+	*fd = req->fds[0];
+	*request = req;
+	return SUBID_STATUS_SUCCESS;
+}
+
+enum subid_status shadow_subid_list_owner_ranges_finish(void *request, struct subid_range **ranges, int *counts, enum subid_status *status)
+{
+	struct zzz_request *req = request;
+	enum subid_status ret;
+
+	ret = shadow_subid_list_owner_ranges_many(req->owners, req->n, req->id_type, ranges, counts, status);
+	close(req->fds[0]);
+	close(req->fds[1]);
+	free(req);
+	return ret;
+}
@@ -4,6 +4,7 @@
 #include <prototypes.h>
 #include <stdbool.h>
 #include <dlfcn.h>
+#include <poll.h>
 
 extern bool nss_is_initialized();
 extern struct subid_nss_ops *get_subid_nss_handle();
@@ -48,6 +49,76 @@ void test3() {
 		exit(1);
 }
 
+// The optional entry points of the 'test' module
+void test4() {
+	const char *owners[] = { "user1", "ubuntu", "user2", "unknown" };
+	struct subid_range ranges[] = { { 100000, 1000 }, { 120000, 1000 } };
+	struct subid_range bad_ranges[] = { { 100000, 1000 }, { 50000, 1000 } };
+	struct subid_range *found[4];
+	int counts[4];
+	enum subid_status status[4];
+	struct subid_nss_ops *h;
+	unsigned long token;
+	struct pollfd pfd;
+	void *request;
+	bool result;
+	int i;
+
+	printf("test the batch and cache entry points\n");
+	nss_init("./nsswitch3.conf");
+	h = get_subid_nss_handle();
+	if (!h || !h->list_owner_ranges_many || !h->has_range_many ||
+	    !h->cache_token || !h->list_owner_ranges_start ||
+	    !h->list_owner_ranges_finish)
+		exit(1);
+
+	if (h->list_owner_ranges_many(owners, 4, ID_TYPE_UID, found, counts, status) != SUBID_STATUS_SUCCESS)
+		exit(1);
+	if (status[0] != SUBID_STATUS_SUCCESS || counts[0] != 1 ||
+	    found[0][0].start != 100000 || found[0][0].count != 65536)
+		exit(1);
+	if (status[1] != SUBID_STATUS_SUCCESS || counts[1] != 1 ||
+	    found[1][0].start != 200000 || found[1][0].count != 100000)
+		exit(1);
+	if (status[2] != SUBID_STATUS_SUCCESS || counts[2] != 0)
+		exit(1);
+	if (status[3] != SUBID_STATUS_UNKNOWN_USER)
+		exit(1);
+	free(found[0]);
+	free(found[1]);
+
+	if (h->has_range_many("user1", ranges, 2, ID_TYPE_UID, &result) != SUBID_STATUS_SUCCESS || !result)
+		exit(1);
+	if (h->has_range_many("user1", bad_ranges, 2, ID_TYPE_UID, &result) != SUBID_STATUS_SUCCESS || result)
+		exit(1);
+	if (h->has_range_many("error", ranges, 2, ID_TYPE_UID, &result) != SUBID_STATUS_ERROR)
+		exit(1);
+
+	if (h->cache_token(ID_TYPE_UID, &token) != SUBID_STATUS_SUCCESS || token != 1)
+		exit(1);
+
+	printf("test the asynchronous entry points\n");
+	if (h->list_owner_ranges_start(owners, 4, ID_TYPE_UID, &pfd.fd, &request) != SUBID_STATUS_SUCCESS)
+		exit(1);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1 || !(pfd.revents & POLLIN))
+		exit(1);
+	for (i = 0; i < 4; i++)
+		counts[i] = -1;
+	if (h->list_owner_ranges_finish(request, found, counts, status) != SUBID_STATUS_SUCCESS)
+		exit(1);
+	if (status[0] != SUBID_STATUS_SUCCESS || counts[0] != 1 ||
+	    found[0][0].start != 100000 || found[0][0].count != 65536)
+		exit(1);
+	if (status[1] != SUBID_STATUS_SUCCESS || counts[1] != 1 ||
+	    found[1][0].start != 200000)
+		exit(1);
+	if (status[3] != SUBID_STATUS_UNKNOWN_USER)
+		exit(1);
+	free(found[0]);
+	free(found[1]);
+}
+
 const char *Prog;
 
 int main(int argc, char *argv[])
@@ -64,6 +135,7 @@ int main(int argc, char *argv[])
 	case 1: test1(); break;
 	case 2: test2(); break;
 	case 3: test3(); break;
+	case 4: test4(); break;
 	default: exit(1);
 	}
 
@@ -0,0 +1,85 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <pwd.h>
+#include <subid.h>
+
+// Queries of the public libsubid API, answered by the 'zzz' module
+static struct subid_query queries[5];
+
+static void set_queries(void) {
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		queries[i].owner = NULL;
+		queries[i].id = 0;
+	}
+	queries[0].owner = "user1";
+	queries[1].owner = "ubuntu";
+	queries[2].owner = "user2";
+	queries[3].id = 100500;
+	queries[4].id = 50000;
+}
+
+static void check_queries(int failed) {
+	struct passwd *pw;
+	uid_t user1;
+	int i;
+
+	pw = getpwnam("user1");
+	user1 = pw ? pw->pw_uid : 1001;
+
+	if (failed != 0)
+		exit(1);
+	if (queries[0].count != 1 || queries[0].ranges[0].start != 100000 ||
+	    queries[0].ranges[0].count != 65536)
+		exit(1);
+	if (queries[1].count != 1 || queries[1].ranges[0].start != 200000 ||
+	    queries[1].ranges[0].count != 100000)
+		exit(1);
+	if (queries[2].count != 0)
+		exit(1);
+	if (queries[3].count != 1 || queries[3].owners[0] != user1)
+		exit(1);
+	if (queries[4].count != 0)
+		exit(1);
+
+	for (i = 0; i < 5; i++) {
+		free(queries[i].ranges);
+		free(queries[i].owners);
+	}
+}
+
+int main(void)
+{
+	struct subid_ctx *ctx;
+	struct subid_async *async;
+	struct pollfd pfd;
+
+	ctx = subid_open(ID_TYPE_UID);
+	if (!ctx)
+		exit(1);
+
+	printf("test subid_query_many\n");
+	set_queries();
+	check_queries(subid_query_many(ctx, queries, 5));
+	// the second batch is answered from the cache of the context
+	printf("test subid_query_many, second run\n");
+	set_queries();
+	check_queries(subid_query_many(ctx, queries, 5));
+
+	printf("test subid_query_start and subid_query_finish\n");
+	set_queries();
+	async = subid_query_start(ctx, queries, 5);
+	if (!async)
+		exit(1);
+	pfd.fd = subid_async_fd(async);
+	pfd.events = POLLIN;
+	if (poll(&pfd, 1, 5000) != 1 || !(pfd.revents & POLLIN))
+		exit(1);
+	check_queries(subid_query_finish(async));
+
+	subid_close(ctx);
+	printf("subid query tests done\n");
+	exit(0);
+}
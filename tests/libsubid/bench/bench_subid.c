@@ -0,0 +1,183 @@
+/*
+ * Benchmark of the subordinate ID lookups.
+ *
+ * Generates subuid files of several sizes, with ranges owned by user
+ * names and by numeric UIDs, in a temporary directory, and reports the
+ * latency percentiles and the number of allocations of each operation.
+ */
+
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <prototypes.h>
+#include "subordinateio.h"
+#include "subid.h"
+#include "bench.h"
+
+#define RANGE_COUNT	65536UL
+#define FIRST_ID	100000UL
+
+const char *Prog = "bench_subid";
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+static char dir[] = "/tmp/bench_subid.XXXXXX";
+static char path[64];
+
+/* Range n is owned by user<n> for even n, by UID <n> otherwise */
+static const char *owner(unsigned long n, char *buf, size_t size)
+{
+	snprintf(buf, size, (n % 2) ? "%lu" : "user%lu", n + 1000);
+	return buf;
+}
+
+static void generate(unsigned long nranges)
+{
+	char buf[32];
+	unsigned long i;
+	FILE *fp;
+
+	fp = fopen(path, "w");
+	if (!fp) {
+		perror(path);
+		exit(1);
+	}
+	/* Leave a hole every 10 ranges, in a file not sorted by range */
+	for (i = 0; i < nranges; i++) {
+		unsigned long n = (i * 7919) % nranges;
+
+		if (n % 10 == 9)
+			continue;
+		fprintf(fp, "%s:%lu:%lu\n", owner(n, buf, sizeof buf),
+			FIRST_ID + n * RANGE_COUNT, RANGE_COUNT);
+	}
+	fclose(fp);
+}
+
+static void report(const char *op, unsigned long nranges, double *lat,
+		   int iterations, unsigned long allocs)
+{
+	qsort(lat, iterations, sizeof *lat, bench_double_cmp);
+	printf("%-22s %8lu %10.1f %10.1f %10.1f %10.1f %8.1f\n", op, nranges,
+	       lat[iterations / 2], lat[iterations * 9 / 10],
+	       lat[iterations * 99 / 100], lat[iterations - 1],
+	       (double)allocs / iterations);
+}
+
+#define BENCH(op, nranges, iterations, stmt) do {			\
+	unsigned long allocs = allocations;				\
+	int it;								\
+	for (it = 0; it < (iterations); it++) {				\
+		double start = bench_now();				\
+		stmt;							\
+		lat[it] = (bench_now() - start) * 1e6;			\
+	}								\
+	report(op, nranges, lat, iterations, allocations - allocs);	\
+} while (0)
+
+static void bench(unsigned long nranges)
+{
+	/* Operations which read the whole file are repeated less */
+	int fast = 10000, slow = nranges >= 100000 ? 10 : 100;
+	struct subid_query query;
+	struct subid_range *ranges;
+	struct subid_ctx *ctx;
+	double lat[10000];
+	char buf[32];
+	uid_t *uids;
+	int ret;
+
+	generate(nranges);
+
+	BENCH("sub_uid_open", nranges, slow,
+	      { sub_uid_open(O_RDONLY); sub_uid_close(); });
+
+	sub_uid_open(O_RDONLY);
+	/* The first query builds the index */
+	BENCH("have_sub_uids", nranges, fast, {
+		unsigned long n = random() % nranges;
+		ret = have_sub_uids(owner(n, buf, sizeof buf),
+				    FIRST_ID + n * RANGE_COUNT, RANGE_COUNT);
+	});
+	BENCH("sub_uid_find_free", nranges, fast,
+	      ret = sub_uid_find_free_range(FIRST_ID + (random() % nranges) * RANGE_COUNT,
+					    (uid_t) -2, RANGE_COUNT));
+	sub_uid_close();
+
+	BENCH("list_owner_ranges", nranges, slow, {
+		ret = list_owner_ranges(owner(random() % nranges, buf, sizeof buf),
+					ID_TYPE_UID, &ranges);
+		free(ranges);
+	});
+	BENCH("find_subid_owners", nranges, slow, {
+		ret = find_subid_owners(FIRST_ID + (random() % nranges) * RANGE_COUNT,
+					ID_TYPE_UID, &uids);
+		free(uids);
+	});
+
+	ctx = subid_open(ID_TYPE_UID);
+	if (!ctx) {
+		fprintf(stderr, "%s: subid_open failed\n", Prog);
+		exit(1);
+	}
+	BENCH("subid_query_many", nranges, fast, {
+		query.owner = owner(random() % nranges, buf, sizeof buf);
+		ret = subid_query_many(ctx, &query, 1);
+		free(query.ranges);
+	});
+	subid_close(ctx);
+	(void) ret;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = { 1000, 10000, 100000, 1000000 };
+	int i;
+
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		exit(1);
+	}
+	snprintf(path, sizeof path, "%s/subuid", dir);
+	subid_init(Prog, stderr);
+	sub_uid_setdbname(path);
+
+	printf("%-22s %8s %10s %10s %10s %10s %8s\n", "operation", "ranges",
+	       "p50 (us)", "p90 (us)", "p99 (us)", "max (us)", "allocs");
+	if (argc > 1) {
+		for (i = 1; i < argc; i++)
+			bench(strtoul(argv[i], NULL, 10));
+	} else {
+		for (i = 0; i < (int)(sizeof sizes / sizeof sizes[0]); i++)
+			bench(sizes[i]);
+	}
+
+	unlink(path);
+	rmdir(dir);
+	return 0;
+}
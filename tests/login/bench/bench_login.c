@@ -0,0 +1,247 @@
+/*
+ * Benchmark of the login path.
+ *
+ * Generates a chroot fixture with synthetic databases of several sizes
+ * (users, groups, faillog records, utmp sessions, limits and porttime
+ * rules) in a temporary directory, and reports the latency percentiles
+ * of the helpers called by login and su for each authentication.
+ *
+ * It needs to run as root, for chroot() and the limits.
+ */
+
+#define _XOPEN_SOURCE 700
+#include <config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <time.h>
+#include <utmp.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <prototypes.h>
+#include "faillog.h"
+#include "failure.h"
+#include "shadowlog.h"
+#include "bench.h"
+
+#define ITERATIONS	1000
+
+const char *Prog = "bench_login";
+
+static char dir[] = "/tmp/bench_login.XXXXXX";
+
+static void generate(unsigned long nusers)
+{
+	struct faillog fl;
+	struct utmp ut;
+	unsigned long i, j;
+	FILE *fp;
+
+	static const char *dirs[] = {
+		"etc", "home", "var", "var/log", "var/run", "var/mail",
+	};
+	char path[256];
+
+	for (i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+		snprintf(path, sizeof path, "%s/%s", dir, dirs[i]);
+		mkdir(path, 0755);
+	}
+
+	fp = bench_create(dir, "etc/login.defs");
+	fputs("QUOTAS_ENAB yes\nFAILLOG_ENAB yes\nMAIL_CHECK_ENAB yes\n"
+	      "MAIL_DIR /var/mail\nMOTD_FILE /etc/motd\n"
+	      "ENV_PATH PATH=/bin:/usr/bin\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/motd");
+	fputs("Message of the day.\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/passwd");
+	fputs("root:x:0:0:root:/root:/bin/sh\n", fp);
+	for (i = 0; i < nusers; i++)
+		fprintf(fp, "user%lu:x:%lu:%lu::/home:/bin/sh\n",
+			i, 1000 + i, 1000 + i % 100);
+	fclose(fp);
+
+	/* 100 groups, each user is also in another 2 groups */
+	fp = bench_create(dir, "etc/group");
+	fputs("root:x:0:\n", fp);
+	for (i = 0; i < 100; i++) {
+		fprintf(fp, "group%lu:x:%lu:", i, 1000 + i);
+		for (j = (i + 1) % 100; j < nusers; j += 50)
+			fprintf(fp, "%suser%lu", j < 100 ? "" : ",", j);
+		fputs("\n", fp);
+	}
+	fclose(fp);
+
+	/* One rule every 100 users, a few groups, and the default */
+	fp = bench_create(dir, "etc/limits");
+	for (i = 0; i < nusers; i += 100)
+		fprintf(fp, "user%lu N1024 L100\n", i);
+	for (i = 0; i < 100; i += 10)
+		fprintf(fp, "@group%lu N2048 L100\n", i);
+	fputs("* N4096 L100\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/porttime");
+	for (i = 0; i < nusers; i += 100)
+		fprintf(fp, "tty1,tty2:user%lu:Wk0800-1800\n", i);
+	fputs("*:*:Al0000-2400\n", fp);
+	fclose(fp);
+
+	/* A faillog record every 3 users */
+	fp = bench_create(dir, "var/log/faillog");
+	memset(&fl, 0, sizeof fl);
+	fl.fail_max = 10;
+	fl.fail_time = time(NULL);
+	for (i = 0; i < nusers; i += 3) {
+		fl.fail_cnt = i % 5;
+		fseeko(fp, (off_t) (1000 + i) * sizeof fl, SEEK_SET);
+		fwrite(&fl, sizeof fl, 1, fp);
+	}
+	fclose(fp);
+
+	/* A session every 10 users */
+	fp = bench_create(dir, "var/run/utmp");
+	for (i = 0; i < nusers; i += 10) {
+		memset(&ut, 0, sizeof ut);
+		ut.ut_type = USER_PROCESS;
+		ut.ut_pid = getpid();
+		snprintf(ut.ut_line, sizeof ut.ut_line, "pts/%lu", i);
+		snprintf(ut.ut_user, sizeof ut.ut_user, "user%lu", i);
+		fwrite(&ut, sizeof ut, 1, fp);
+	}
+	fclose(fp);
+
+	for (i = 0; i < nusers; i += 10) {
+		snprintf(path, sizeof path, "var/mail/user%lu", i);
+		fp = bench_create(dir, path);
+		fputs("From: root\n\nHello.\n", fp);
+		fclose(fp);
+	}
+}
+
+static void report(const char *phase, unsigned long nusers, double *lat,
+		   int iterations)
+{
+	qsort(lat, iterations, sizeof *lat, bench_double_cmp);
+	printf("%-16s %8lu %10.1f %10.1f %10.1f %10.1f\n", phase, nusers,
+	       lat[iterations / 2], lat[iterations * 9 / 10],
+	       lat[iterations * 99 / 100], lat[iterations - 1]);
+}
+
+enum { GETPWNAM, FAILCHECK, ISTTYTIME, SETUP_LIMITS, COUNT_SESSIONS,
+       MOTD, MAILCHECK, SETUP_ENV, PHASES };
+
+static const char *phase_names[PHASES] = {
+	"xgetpwnam", "failcheck", "isttytime", "setup_limits",
+	"count_sessions", "motd", "mailcheck", "setup_env",
+};
+
+#define PHASE(phase, stmt) do {						\
+	double start = bench_now();					\
+	stmt;								\
+	lat[phase][it] = (bench_now() - start) * 1e6;			\
+} while (0)
+
+/* Run the phases of ITERATIONS logins of random users, in the fixture */
+static void bench(unsigned long nusers)
+{
+	static double lat[PHASES][ITERATIONS];
+	struct faillog fl;
+	struct passwd *pw;
+	char name[32];
+	int out, null;
+	int it, p;
+
+	if (chroot(dir) != 0 || chdir("/") != 0) {
+		perror("chroot");
+		exit(1);
+	}
+
+	/* The messages of motd and mailcheck are not shown */
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	null = open("/dev/null", O_WRONLY);
+	if (null < 0)
+		null = open("/etc/motd.out", O_WRONLY | O_CREAT, 0600);
+	dup2(null, STDOUT_FILENO);
+
+	for (it = 0; it < ITERATIONS; it++) {
+		snprintf(name, sizeof name, "user%lu", random() % nusers);
+
+		PHASE(GETPWNAM, pw = xgetpwnam(name));
+		if (!pw) {
+			fprintf(stderr, "%s: no user %s\n", Prog, name);
+			exit(1);
+		}
+		PHASE(FAILCHECK, failcheck(pw->pw_uid, &fl, false));
+		PHASE(ISTTYTIME, isttytime(name, "tty1", time(NULL)));
+		PHASE(SETUP_LIMITS, setup_limits(pw));
+		PHASE(COUNT_SESSIONS, count_sessions(name, 0, false));
+		PHASE(MOTD, motd());
+		PHASE(MAILCHECK, mailcheck());
+		PHASE(SETUP_ENV, setup_env(pw));
+		fflush(stdout);
+		pw_free(pw);
+	}
+	faillog_close();
+
+	dup2(out, STDOUT_FILENO);
+	for (p = 0; p < PHASES; p++)
+		report(phase_names[p], nusers, lat[p], ITERATIONS);
+	fflush(stdout);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = { 1000, 10000, 100000 };
+	unsigned long *list = sizes;
+	int n = sizeof sizes / sizeof sizes[0];
+	int i;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: must be run as root\n", Prog);
+		exit(77);
+	}
+	if (argc > 1) {
+		n = argc - 1;
+		list = calloc(n, sizeof *list);
+		for (i = 0; i < n; i++)
+			list[i] = strtoul(argv[i + 1], NULL, 10);
+	}
+
+	log_set_progname(Prog);
+	log_set_logfd(stderr);
+	initenv();
+	/* Load the NSS modules before entering the fixture */
+	(void) getpwnam("root");
+
+	printf("%-16s %8s %10s %10s %10s %10s\n", "phase", "users",
+	       "p50 (us)", "p90 (us)", "p99 (us)", "max (us)");
+	for (i = 0; i < n; i++) {
+		pid_t pid;
+		int status;
+
+		if (!mkdtemp(strcpy(dir, "/tmp/bench_login.XXXXXX"))) {
+			perror(dir);
+			exit(1);
+		}
+		generate(list[i]);
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			bench(list[i]);
+			_exit(0);
+		}
+		waitpid(pid, &status, 0);
+		bench_remove_tree(dir);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			exit(1);
+	}
+	return 0;
+}
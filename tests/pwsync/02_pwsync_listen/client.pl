@@ -0,0 +1,28 @@
+#!/usr/bin/perl
+
+# Send the requests of the files given after the socket to
+# pwsync --listen, from connections opened at the same time, and print
+# the replies.
+
+use IO::Socket::UNIX;
+
+my $path = shift;
+my @socks;
+
+foreach my $file (@ARGV) {
+	my $sock = IO::Socket::UNIX->new (Type => SOCK_STREAM (),
+	                                  Peer => $path)
+		or die "Cannot connect to '$path': $!";
+	push @socks, $sock;
+}
+for (my $i = 0; $i <= $#ARGV; $i++) {
+	open (REQUEST, $ARGV[$i]) or die "Cannot open '".$ARGV[$i]."': $!";
+	my $request = join "", <REQUEST>;
+	close (REQUEST);
+	print {$socks[$i]} $request;
+	$socks[$i]->flush;
+}
+for (my $i = 0; $i <= $#ARGV; $i++) {
+	my $reply = readline ($socks[$i]);
+	print $ARGV[$i].": ".$reply;
+}
@@ -0,0 +1,411 @@
+/*
+ * Benchmark of the startup of the tools.
+ *
+ * Generates a small fixture (a few users and groups, with their shadow
+ * entries and subordinate IDs) in a temporary directory, bind-mounts it
+ * on /etc in a private mount namespace, and runs each tool of TOOLS_DIR
+ * RUNS times (1000 by default) on a trivial operation: a lookup for the
+ * tools which have one (chage -l, groups, id, getsubids, ...), the
+ * printing of their usage for the others.
+ *
+ * For each tool it reports the median time from execv() to the reaping
+ * of the process, and its breakdown:
+ *
+ *	load	  execv() and the dynamic loading, until the constructors
+ *	locale	  setlocale(), bindtextdomain() and textdomain()
+ *	def_load  the reading of login.defs (def_load of SHADOW_STATS)
+ *	open	  the opening of the databases (open of SHADOW_STATS)
+ *	main	  the rest of the run, until exit()
+ *	teardown  the exit handlers, and the exit of the process
+ *
+ * load, locale and teardown are measured by startup_probe.so, preloaded in
+ * the tools. The phases a tool does not go through are 0.
+ *
+ * Usage: bench_startup [-n RUNS] [-d TOOLS_DIR] [TOOL...]
+ *
+ * Two builds (e.g. with and without --enable-lazy-audit or
+ * --enable-multicall) are compared by running it with the -d of each.
+ * The locales are the ones of the environment. In the build tree, the
+ * tools linked with libsubid (getsubids) are libtool wrapper scripts: the
+ * installed tools give their real load time.
+ *
+ * It needs to run as root, for the mount namespace.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#ifndef TOOLS_DIR
+#define TOOLS_DIR	"../../../src"
+#endif
+
+#define RUNS		1000
+#define USERS		8
+/* As in startup_probe.c */
+#define PROBE_FD	100
+
+static const char *Prog = "bench_startup";
+
+static char dir[] = "/tmp/bench_startup.XXXXXX";
+static char probe[512];
+
+/* The operation of each tool; the tools which fail to run are skipped */
+static const struct tool {
+	const char *name;
+	const char *args[4];
+} tools[] = {
+	{ "chage",	{ "-l", "user1" } },
+	{ "chfn",	{ "--help" } },
+	{ "chgpasswd",	{ "-h" } },
+	{ "chpasswd",	{ "-h" } },
+	{ "chsh",	{ "-h" } },
+	{ "cryptcost",	{ "-h" } },
+	{ "expiry",	{ "-c" } },
+	{ "faillog",	{ "-u", "user1" } },
+	{ "getsubids",	{ "user1" } },
+	{ "gpasswd",	{ "-h" } },
+	{ "groupadd",	{ "-h" } },
+	{ "groupdel",	{ "-h" } },
+	{ "groupmems",	{ "-h" } },
+	{ "groupmod",	{ "-h" } },
+	{ "groups",	{ "user1" } },
+	{ "grpck",	{ "-r" } },
+	{ "grpconv",	{ "-h" } },
+	{ "grpunconv",	{ "-h" } },
+	{ "id",		{ NULL } },
+	{ "lastlog",	{ "-u", "user1" } },
+	{ "logoutd",	{ "-h" } },
+	{ "newgidmap",	{ NULL } },
+	{ "newgrp",	{ "-h" } },
+	{ "newuidmap",	{ NULL } },
+	{ "newusers",	{ "-h" } },
+	{ "nologin",	{ NULL } },
+	{ "passwd",	{ "-S", "user1" } },
+	{ "pwck",	{ "-r" } },
+	{ "pwconv",	{ "-h" } },
+	{ "pwsync",	{ "-h" } },
+	{ "pwunconv",	{ "-h" } },
+	{ "su",		{ "-h" } },
+	{ "useradd",	{ "-D" } },
+	{ "userdel",	{ "-h" } },
+	{ "usermod",	{ "-h" } },
+	{ "vipw",	{ "-h" } },
+	{ NULL },
+};
+
+enum { LOAD, LOCALE, DEF_LOAD, OPEN, MAIN, TEARDOWN, TOTAL, PHASES };
+
+static const char *const phases[PHASES] = {
+	"load", "locale", "def_load", "open", "main", "teardown", "total",
+};
+
+/* Copy the file of the host /etc, if it exists */
+static void copy_etc(const char *name)
+{
+	char path[512], buf[8192];
+	size_t len;
+	FILE *in, *out;
+
+	snprintf(path, sizeof path, "/etc/%s", name);
+	in = fopen(path, "r");
+	if (!in)
+		return;
+	snprintf(path, sizeof path, "etc/%s", name);
+	out = bench_create(dir, path);
+	while ((len = fread(buf, 1, sizeof buf, in)) > 0)
+		fwrite(buf, 1, len, out);
+	fclose(in);
+	fclose(out);
+}
+
+static void generate(void)
+{
+	unsigned long i;
+	char path[512];
+	FILE *fp;
+
+	snprintf(path, sizeof path, "%s/etc", dir);
+	mkdir(path, 0755);
+	snprintf(path, sizeof path, "%s/etc/default", dir);
+	mkdir(path, 0755);
+
+	/* The dynamic loader and the dates of the host */
+	copy_etc("ld.so.cache");
+	copy_etc("localtime");
+
+	fp = bench_create(dir, "etc/login.defs");
+	fputs("UID_MIN 1000\nUID_MAX 60000\nGID_MIN 1000\nGID_MAX 60000\n"
+	      "ENCRYPT_METHOD SHA512\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/default/useradd");
+	fputs("SHELL=/bin/sh\nCREATE_MAIL_SPOOL=no\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/nsswitch.conf");
+	fputs("passwd: files\ngroup: files\nshadow: files\n", fp);
+	fclose(fp);
+
+	/* The home directories exist, so that pwck finds no error */
+	fp = bench_create(dir, "etc/passwd");
+	fputs("root:x:0:0:root:/root:/bin/sh\n", fp);
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "user%lu:x:%lu:%lu::/:/bin/sh\n",
+		        i, 1000 + i, 1000 + i);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/shadow");
+	fputs("root:*:19000:0:99999:7:::\n", fp);
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "user%lu:$6$salt%lu$hash:19000:0:99999:7:::\n",
+		        i, i);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/group");
+	fputs("root:x:0:\n", fp);
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "group%lu:x:%lu:user%lu\n",
+		        i, 1000 + i, (i + 1) % USERS);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/gshadow");
+	fputs("root:*::\n", fp);
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "group%lu:!::user%lu\n", i, (i + 1) % USERS);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/subuid");
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "user%lu:%lu:65536\n", i, 100000 + i * 65536);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/subgid");
+	for (i = 0; i < USERS; i++)
+		fprintf(fp, "user%lu:%lu:65536\n", i, 100000 + i * 65536);
+	fclose(fp);
+}
+
+static void child(const char *path, char *args[])
+{
+	char file[512], exec_time[32];
+	int fd;
+
+	fd = open("/dev/null", O_RDWR);
+	if (fd < 0 || dup2(fd, STDIN_FILENO) < 0
+	    || dup2(fd, STDOUT_FILENO) < 0)
+		_exit(127);
+	snprintf(file, sizeof file, "%s/stats", dir);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || dup2(fd, STDERR_FILENO) < 0)
+		_exit(127);
+	snprintf(file, sizeof file, "%s/probe", dir);
+	fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || dup2(fd, PROBE_FD) < 0)
+		_exit(127);
+	setenv("SHADOW_STATS", "1", 1);
+	setenv("LD_PRELOAD", probe, 1);
+	snprintf(exec_time, sizeof exec_time, "%lld", bench_now_ns());
+	setenv("BENCH_EXEC_TIME", exec_time, 1);
+	execv(path, args);
+	_exit(127);
+}
+
+/* The sum of the values of field in the SHADOW_STATS line, in ns */
+static double stats_field(const char *field)
+{
+	char path[512], line[8192], key[64];
+	double sum = 0, ms;
+	const char *p;
+	FILE *fp;
+
+	snprintf(path, sizeof path, "%s/stats", dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	snprintf(key, sizeof key, " %s=", field);
+	while (fgets(line, sizeof line, fp)) {
+		if (!strstr(line, ": stats:"))
+			continue;
+		for (p = strstr(line, key); p; p = strstr(p + 1, key))
+			if (sscanf(p + strlen(key), "%lf", &ms) == 1)
+				sum += ms * 1e6;
+	}
+	fclose(fp);
+	return sum;
+}
+
+/*
+ * Run tool once, and fill the duration of each phase, in ns.
+ *
+ * Return false if the tool could not be run.
+ */
+static bool run(const char *path, const struct tool *t,
+                double phase[PHASES])
+{
+	long long exec_ns = 0, loaded_ns = 0, locale_ns = 0, exit_ns = 0;
+	long long start, end;
+	char *args[6];
+	char file[512];
+	int status, i;
+	pid_t pid;
+	FILE *fp;
+
+	args[0] = (char *) t->name;
+	for (i = 0; i < 4 && t->args[i]; i++)
+		args[i + 1] = (char *) t->args[i];
+	args[i + 1] = NULL;
+
+	start = bench_now_ns();
+	pid = fork();
+	if (pid == 0)
+		child(path, args);
+	if (pid < 0 || waitpid(pid, &status, 0) != pid)
+		return false;
+	end = bench_now_ns();
+	/* An exit status of 127 is a failure of execv() */
+	if (!WIFEXITED(status) || WEXITSTATUS(status) == 127)
+		return false;
+
+	snprintf(file, sizeof file, "%s/probe", dir);
+	fp = fopen(file, "r");
+	if (!fp)
+		return false;
+	if (fscanf(fp, "%lld %lld %lld %lld", &exec_ns, &loaded_ns,
+	           &locale_ns, &exit_ns) != 4) {
+		/* The tool called _exit(): only the total is known */
+		exec_ns = start;
+		loaded_ns = locale_ns = 0;
+		exit_ns = end;
+	}
+	fclose(fp);
+
+	phase[TOTAL] = end - exec_ns;
+	phase[LOAD] = loaded_ns ? loaded_ns - exec_ns : 0;
+	phase[LOCALE] = locale_ns;
+	phase[DEF_LOAD] = stats_field("def_load");
+	phase[OPEN] = stats_field("open");
+	phase[TEARDOWN] = end - exit_ns;
+	phase[MAIN] = phase[TOTAL] - phase[LOAD] - phase[LOCALE]
+	              - phase[DEF_LOAD] - phase[OPEN] - phase[TEARDOWN];
+	if (phase[MAIN] < 0)
+		phase[MAIN] = 0;
+	return true;
+}
+
+static bool selected(const char *name, int argc, char *argv[])
+{
+	int i;
+
+	if (optind == argc)
+		return true;
+	for (i = optind; i < argc; i++)
+		if (strcmp(argv[i], name) == 0)
+			return true;
+	return false;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *tools_dir = TOOLS_DIR;
+	double *samples[PHASES], one[PHASES];
+	char path[512], etc[512];
+	const struct tool *t;
+	long runs = RUNS;
+	int c, k, p;
+
+	while ((c = getopt(argc, argv, "d:n:")) != -1) {
+		switch (c) {
+		case 'd':
+			tools_dir = optarg;
+			break;
+		case 'n':
+			runs = strtol(optarg, NULL, 10);
+			if (runs < 1) {
+				fprintf(stderr, "%s: at least 1 run\n", Prog);
+				exit(1);
+			}
+			break;
+		default:
+			fprintf(stderr, "Usage: %s [-n RUNS] [-d TOOLS_DIR] "
+			        "[TOOL...]\n", Prog);
+			exit(1);
+		}
+	}
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: must be run as root\n", Prog);
+		exit(77);
+	}
+	for (p = 0; p < PHASES; p++) {
+		samples[p] = calloc(runs, sizeof *samples[p]);
+		if (!samples[p]) {
+			perror(Prog);
+			exit(1);
+		}
+	}
+	if (!realpath("startup_probe.so", probe)) {
+		perror("startup_probe.so");
+		exit(1);
+	}
+	if (!mkdtemp(dir)) {
+		perror(dir);
+		exit(1);
+	}
+	generate();
+
+	/* The fixture is only seen by the tools */
+	snprintf(etc, sizeof etc, "%s/etc", dir);
+	if (unshare(CLONE_NEWNS) != 0
+	    || mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0
+	    || mount(etc, "/etc", NULL, MS_BIND, NULL) != 0) {
+		fprintf(stderr, "%s: cannot mount the fixture: %s\n",
+		        Prog, strerror(errno));
+		bench_remove_tree(dir);
+		exit(1);
+	}
+
+	printf("# %ld runs, median times (us)\n# %-10s", runs, "tool");
+	for (p = 0; p < PHASES; p++)
+		printf(" %9s", phases[p]);
+	printf("\n");
+
+	for (t = tools; t->name; t++) {
+		if (!selected(t->name, argc, argv))
+			continue;
+		snprintf(path, sizeof path, "%s/%s", tools_dir, t->name);
+		if (access(path, X_OK) != 0)
+			continue;
+		for (k = 0; k < runs; k++) {
+			if (!run(path, t, one))
+				break;
+			for (p = 0; p < PHASES; p++)
+				samples[p][k] = one[p];
+		}
+		if (k < runs) {
+			fprintf(stderr, "%s: cannot run %s\n", Prog, t->name);
+			continue;
+		}
+		printf("  %-10s", t->name);
+		for (p = 0; p < PHASES; p++)
+			printf(" %9.1f", bench_median(samples[p], runs) / 1e3);
+		printf("\n");
+		fflush(stdout);
+	}
+
+	umount("/etc");
+	bench_remove_tree(dir);
+	return 0;
+}
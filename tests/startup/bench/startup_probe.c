@@ -0,0 +1,106 @@
+/*
+ * Probe of the startup of the tools, preloaded by bench_startup.
+ *
+ * Its constructor runs once the dynamic loader has loaded and relocated
+ * the tool and its libraries, just before the constructors of the tool
+ * and main(). It measures the time spent in setlocale(), bindtextdomain()
+ * and textdomain(), and notes when exit() is called. Its destructor, which
+ * runs after the exit handlers of the tool, writes these times (with the
+ * time of the execv() given by bench_startup in BENCH_EXEC_TIME) on the
+ * file descriptor PROBE_FD:
+ *
+ *	exec loaded locale exit
+ *
+ * in nanoseconds of CLOCK_MONOTONIC. If the tool returns from main(),
+ * exit() is called by libc, not through the probe: the time of the
+ * destructor is then used.
+ */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "bench.h"
+
+/* As in bench_startup.c */
+#define PROBE_FD	100
+
+static long long exec_ns, loaded_ns, locale_ns, exit_ns;
+static pid_t pid;
+
+static char *(*next_setlocale)(int, const char *);
+static char *(*next_bindtextdomain)(const char *, const char *);
+static char *(*next_textdomain)(const char *);
+static void (*next_exit)(int);
+
+__attribute__((constructor))
+static void probe_init(void)
+{
+	const char *exec_time = getenv("BENCH_EXEC_TIME");
+
+	loaded_ns = bench_now_ns();
+	pid = getpid();
+	if (exec_time)
+		exec_ns = strtoll(exec_time, NULL, 10);
+	/* Resolved here, so that the lookups are not measured */
+	next_setlocale = dlsym(RTLD_NEXT, "setlocale");
+	next_bindtextdomain = dlsym(RTLD_NEXT, "bindtextdomain");
+	next_textdomain = dlsym(RTLD_NEXT, "textdomain");
+	next_exit = dlsym(RTLD_NEXT, "exit");
+}
+
+__attribute__((destructor))
+static void probe_report(void)
+{
+	char line[128];
+	int len;
+
+	/* Neither the children of the tool, nor the tools it runs */
+	if (getpid() != pid || fcntl(PROBE_FD, F_GETFD) == -1)
+		return;
+	if (0 == exit_ns)
+		exit_ns = bench_now_ns();
+	len = snprintf(line, sizeof line, "%lld %lld %lld %lld\n",
+	               exec_ns, loaded_ns, locale_ns, exit_ns);
+	if (write(PROBE_FD, line, len) != len)
+		return;
+}
+
+char *setlocale(int category, const char *locale)
+{
+	long long start = bench_now_ns();
+	char *ret = next_setlocale(category, locale);
+
+	locale_ns += bench_now_ns() - start;
+	return ret;
+}
+
+char *bindtextdomain(const char *domainname, const char *dirname)
+{
+	long long start = bench_now_ns();
+	char *ret = next_bindtextdomain(domainname, dirname);
+
+	locale_ns += bench_now_ns() - start;
+	return ret;
+}
+
+char *textdomain(const char *domainname)
+{
+	long long start = bench_now_ns();
+	char *ret = next_textdomain(domainname);
+
+	locale_ns += bench_now_ns() - start;
+	return ret;
+}
+
+__attribute__((noreturn))
+void exit(int status)
+{
+	if (0 == exit_ns)
+		exit_ns = bench_now_ns();
+	next_exit(status);
+	_exit(status);
+}
@@ -0,0 +1,435 @@
+/*
+ * Benchmark of the account lifecycle tools.
+ *
+ * Generates a chroot fixture with N users and N/2 groups (passwd, shadow,
+ * group, gshadow, subuid and subgid) in a temporary directory, and runs
+ * useradd -m, usermod -a -G, gpasswd -a, groupadd, chpasswd, newusers and
+ * userdel -r on it with -R (-Q for gpasswd), for each size N. For each tool it reports the
+ * median wall time of the runs, the number of system calls (counted with
+ * ptrace in an extra run), the bytes written, the peak RSS and the longest
+ * time a database lock was held (from SHADOW_STATS), and the growth of the
+ * time with N.
+ *
+ * The results are printed as one gnuplot data block per tool, which
+ * plot.gp draws against N. The exit status is 2 if the time of a tool
+ * grows faster than N^1.5.
+ *
+ * It needs to run as root, for the chroot() of -R.
+ */
+
+#define _GNU_SOURCE
+#include <config.h>
+#include <math.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ptrace.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+#ifndef TOOLS_DIR
+#define TOOLS_DIR	"../../../src"
+#endif
+
+#define REPEAT		5
+#define MAX_SIZES	16
+#define MAX_GROWTH	1.5
+#define MIN_TIME	10.0	/* ms, below which the growth is noise */
+
+static const char *Prog = "bench_tools";
+
+static char dir[] = "/tmp/bench_tools.XXXXXX";
+
+enum { USERADD, USERMOD, GPASSWD, GROUPADD, CHPASSWD, NEWUSERS, USERDEL,
+       TOOLS };
+
+static const char *const tools[TOOLS] = {
+	"useradd", "usermod", "gpasswd", "groupadd", "chpasswd", "newusers",
+	"userdel",
+};
+
+struct result {
+	double ms;
+	unsigned long syscalls;
+	unsigned long long written;
+	long rss;		/* kB */
+	double hold;		/* ms */
+};
+
+static struct result results[MAX_SIZES][TOOLS];
+
+static void generate(unsigned long n)
+{
+	static const char *dirs[] = {
+		"etc", "etc/default", "etc/skel", "home", "var", "var/log",
+		"var/mail", "tmp",
+	};
+	unsigned long m = n / 2 + 1;
+	char path[512];
+	unsigned long i;
+	FILE *fp;
+
+	for (i = 0; i < sizeof dirs / sizeof dirs[0]; i++) {
+		snprintf(path, sizeof path, "%s/%s", dir, dirs[i]);
+		mkdir(path, 0755);
+	}
+
+	fp = bench_create(dir, "etc/login.defs");
+	fputs("UID_MIN 1000\nUID_MAX 60000000\nGID_MIN 1000\n"
+	      "GID_MAX 60000000\nSUB_UID_MIN 100000\nSUB_UID_MAX 4000000000\n"
+	      "SUB_UID_COUNT 256\nSUB_GID_MIN 100000\n"
+	      "SUB_GID_MAX 4000000000\nSUB_GID_COUNT 256\n"
+	      "MAIL_DIR /var/mail\nENCRYPT_METHOD SHA512\n"
+	      "SHA_CRYPT_MIN_ROUNDS 1000\nSHA_CRYPT_MAX_ROUNDS 1000\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/default/useradd");
+	fputs("SHELL=/bin/sh\nCREATE_MAIL_SPOOL=no\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/nsswitch.conf");
+	fputs("passwd: files\ngroup: files\nshadow: files\n", fp);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/passwd");
+	fputs("root:x:0:0:root:/root:/bin/sh\n", fp);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "user%lu:x:%lu:%lu::/home/user%lu:/bin/sh\n",
+		        i, 1000 + i, 1000 + i / 2, i);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/shadow");
+	fputs("root:*:19000:0:99999:7:::\n", fp);
+	for (i = 0; i < n; i++)
+		fprintf(fp, "user%lu:$6$salt%lu$hash:19000:0:99999:7:::\n",
+		        i, i);
+	fclose(fp);
+
+	/* Two users in each group, which is also their primary group */
+	fp = bench_create(dir, "etc/group");
+	fputs("root:x:0:\n", fp);
+	for (i = 0; i < m; i++)
+		fprintf(fp, "group%lu:x:%lu:user%lu,user%lu\n",
+		        i, 1000 + i, 2 * i % n, (2 * i + 1) % n);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/gshadow");
+	fputs("root:*::\n", fp);
+	for (i = 0; i < m; i++)
+		fprintf(fp, "group%lu:!::user%lu,user%lu\n",
+		        i, 2 * i % n, (2 * i + 1) % n);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/subuid");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "user%lu:%lu:256\n", i, 100000 + i * 256);
+	fclose(fp);
+
+	fp = bench_create(dir, "etc/subgid");
+	for (i = 0; i < n; i++)
+		fprintf(fp, "user%lu:%lu:256\n", i, 100000 + i * 256);
+	fclose(fp);
+}
+
+/* Write the standard input of the run k of tool in tmp/stdin */
+static void make_input(int tool, unsigned long n, int k)
+{
+	FILE *fp = bench_create(dir, "tmp/stdin");
+	int j;
+
+	if (CHPASSWD == tool)
+		fprintf(fp, "user%lu:password%d\n", (k * 7919UL) % n, k);
+	if (NEWUSERS == tool)
+		for (j = 0; j < 4; j++)
+			fprintf(fp, "bench_nu%d_%d:password:::"
+			        "new user:/home/bench_nu%d_%d:/bin/sh\n",
+			        k, j, k, j);
+	fclose(fp);
+}
+
+/* The arguments of the run k of tool, in a fixture of n users */
+static void make_args(int tool, unsigned long n, int k, char *args[],
+                      char buf[][64])
+{
+	unsigned long m = n / 2 + 1;
+	unsigned long u = (k * 7919UL) % n;
+	int i = 0;
+
+	args[i++] = (char *) tools[tool];
+	/* The -R of gpasswd restricts the access to the group */
+	args[i++] = (GPASSWD == tool) ? "-Q" : "-R";
+	args[i++] = dir;
+	switch (tool) {
+	case USERADD:
+		args[i++] = "-m";
+		snprintf(buf[0], 64, "bench_new%d", k);
+		args[i++] = buf[0];
+		break;
+	case USERMOD:
+		args[i++] = "-a";
+		args[i++] = "-G";
+		snprintf(buf[0], 64, "group%lu,group%lu",
+		         (u + 1) % m, (u + 2) % m);
+		args[i++] = buf[0];
+		snprintf(buf[1], 64, "user%lu", u);
+		args[i++] = buf[1];
+		break;
+	case GPASSWD:
+		args[i++] = "-a";
+		snprintf(buf[0], 64, "user%lu", u);
+		args[i++] = buf[0];
+		snprintf(buf[1], 64, "group%lu", (u + 3) % m);
+		args[i++] = buf[1];
+		break;
+	case GROUPADD:
+		snprintf(buf[0], 64, "bench_grp%d", k);
+		args[i++] = buf[0];
+		break;
+	case USERDEL:
+		args[i++] = "-r";
+		snprintf(buf[0], 64, "bench_new%d", k);
+		args[i++] = buf[0];
+		break;
+	}
+	args[i] = NULL;
+}
+
+static void child(const char *path, char *args[], bool traced)
+{
+	char stats[512];
+	int fd;
+
+	snprintf(stats, sizeof stats, "%s/tmp/stdin", dir);
+	fd = open(stats, O_RDONLY);
+	if (fd < 0 || dup2(fd, STDIN_FILENO) < 0)
+		_exit(127);
+	snprintf(stats, sizeof stats, "%s/tmp/stats", dir);
+	fd = open(stats, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0 || dup2(fd, STDERR_FILENO) < 0)
+		_exit(127);
+	/* The messages of gpasswd are not shown */
+	fd = open("/dev/null", O_WRONLY);
+	if (fd < 0 || dup2(fd, STDOUT_FILENO) < 0)
+		_exit(127);
+	if (traced && ptrace(PTRACE_TRACEME, 0, NULL, NULL) != 0)
+		_exit(127);
+	setenv("SHADOW_STATS", "1", 1);
+	execv(path, args);
+	_exit(127);
+}
+
+/* Count the system calls of the tracee pid until it exits */
+static unsigned long count_syscalls(pid_t pid, int *status)
+{
+	unsigned long stops = 0;
+	int sig = 0;
+
+	/* The SIGTRAP of execv() */
+	if (waitpid(pid, status, 0) != pid || !WIFSTOPPED(*status))
+		return 0;
+	ptrace(PTRACE_SETOPTIONS, pid, NULL,
+	       (void *) (PTRACE_O_TRACESYSGOOD | PTRACE_O_EXITKILL));
+	for (;;) {
+		if (ptrace(PTRACE_SYSCALL, pid, NULL,
+		           (void *) (long) sig) != 0)
+			break;
+		if (waitpid(pid, status, 0) != pid || !WIFSTOPPED(*status))
+			break;
+		sig = 0;
+		if ((SIGTRAP | 0x80) == WSTOPSIG(*status))
+			stops++;
+		else
+			sig = WSTOPSIG(*status);
+	}
+	/* A stop at the entry and one at the exit of each call */
+	return (stops + 1) / 2;
+}
+
+static unsigned long long written_bytes(pid_t pid)
+{
+	unsigned long long wchar = 0;
+	char path[64], line[128];
+	FILE *fp;
+
+	snprintf(path, sizeof path, "/proc/%ld/io", (long) pid);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof line, fp))
+		if (sscanf(line, "wchar: %llu", &wchar) == 1)
+			break;
+	fclose(fp);
+	return wchar;
+}
+
+/* The longest lock hold time of the SHADOW_STATS line of the last run */
+static double hold_time(void)
+{
+	char path[512], line[8192];
+	double hold = 0, ms;
+	const char *p;
+	FILE *fp;
+
+	snprintf(path, sizeof path, "%s/tmp/stats", dir);
+	fp = fopen(path, "r");
+	if (!fp)
+		return 0;
+	while (fgets(line, sizeof line, fp)) {
+		if (!strstr(line, ": stats:"))
+			continue;
+		for (p = strstr(line, " hold="); p; p = strstr(p + 1, " hold="))
+			if (sscanf(p, " hold=%lf", &ms) == 1 && ms > hold)
+				hold = ms;
+	}
+	fclose(fp);
+	return hold;
+}
+
+static void failed(const char *tool)
+{
+	char path[512], line[512];
+	FILE *fp;
+
+	fprintf(stderr, "%s: %s failed\n", Prog, tool);
+	snprintf(path, sizeof path, "%s/tmp/stats", dir);
+	fp = fopen(path, "r");
+	while (fp && fgets(line, sizeof line, fp))
+		fputs(line, stderr);
+	exit(1);
+}
+
+/* Run the run k of tool on the fixture of n users */
+static void run(int tool, unsigned long n, int k, bool traced,
+                struct result *r)
+{
+	char buf[2][64];
+	char *args[16];
+	char path[512];
+	struct rusage ru;
+	siginfo_t info;
+	double start;
+	int status;
+	pid_t pid;
+
+	make_input(tool, n, k);
+	make_args(tool, n, k, args, buf);
+	snprintf(path, sizeof path, "%s/%s", TOOLS_DIR, tools[tool]);
+
+	start = bench_now();
+	pid = fork();
+	if (pid == 0)
+		child(path, args, traced);
+	if (traced) {
+		r->syscalls = count_syscalls(pid, &status);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+			failed(tools[tool]);
+		return;
+	}
+	/* Read its I/O counters before it is reaped */
+	waitid(P_PID, pid, &info, WEXITED | WNOWAIT);
+	r->ms = (bench_now() - start) * 1e3;
+	r->written = written_bytes(pid);
+	wait4(pid, &status, 0, &ru);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		failed(tools[tool]);
+	r->rss = ru.ru_maxrss;
+	r->hold = hold_time();
+}
+
+static void bench(unsigned long n, struct result r[TOOLS])
+{
+	static double ms[TOOLS][REPEAT], hold[TOOLS][REPEAT];
+	static double written[TOOLS][REPEAT], rss[TOOLS][REPEAT];
+	struct result one;
+	int k, t;
+
+	/* Run 0 is traced, the next REPEAT runs are timed */
+	for (k = 0; k <= REPEAT; k++) {
+		for (t = 0; t < TOOLS; t++) {
+			run(t, n, k, 0 == k, &one);
+			if (0 == k) {
+				r[t].syscalls = one.syscalls;
+				continue;
+			}
+			ms[t][k - 1] = one.ms;
+			written[t][k - 1] = one.written;
+			rss[t][k - 1] = one.rss;
+			hold[t][k - 1] = one.hold;
+		}
+	}
+	for (t = 0; t < TOOLS; t++) {
+		r[t].ms = bench_median(ms[t], REPEAT);
+		r[t].written = bench_median(written[t], REPEAT);
+		r[t].rss = bench_median(rss[t], REPEAT);
+		r[t].hold = bench_median(hold[t], REPEAT);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long sizes[] = { 1000, 10000, 100000 };
+	unsigned long *list = sizes;
+	int n = sizeof sizes / sizeof sizes[0];
+	int ret = 0;
+	int i, t;
+
+	if (geteuid() != 0) {
+		fprintf(stderr, "%s: must be run as root\n", Prog);
+		exit(77);
+	}
+	if (argc > 1) {
+		n = argc - 1;
+		if (n > MAX_SIZES)
+			n = MAX_SIZES;
+		list = calloc(n, sizeof *list);
+		for (i = 0; i < n; i++)
+			list[i] = strtoul(argv[i + 1], NULL, 10);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (list[i] < 2) {
+			fprintf(stderr, "%s: at least 2 users\n", Prog);
+			exit(1);
+		}
+		if (!mkdtemp(strcpy(dir, "/tmp/bench_tools.XXXXXX"))) {
+			perror(dir);
+			exit(1);
+		}
+		fprintf(stderr, "%s: %lu users\n", Prog, list[i]);
+		generate(list[i]);
+		bench(list[i], results[i]);
+		bench_remove_tree(dir);
+	}
+
+	for (t = 0; t < TOOLS; t++) {
+		printf("# %s\n# %8s %10s %10s %12s %10s %10s %8s\n", tools[t],
+		       "users", "time (ms)", "syscalls", "written (B)",
+		       "rss (kB)", "hold (ms)", "growth");
+		for (i = 0; i < n; i++) {
+			struct result *r = &results[i][t];
+			double growth = 0;
+
+			if (i > 0 && results[i - 1][t].ms > 0)
+				growth = log(r->ms / results[i - 1][t].ms)
+				         / log((double) list[i] / list[i - 1]);
+			printf("  %8lu %10.3f %10lu %12llu %10ld %10.3f %8.2f\n",
+			       list[i], r->ms, r->syscalls, r->written,
+			       r->rss, r->hold, growth);
+			if (growth > MAX_GROWTH && r->ms > MIN_TIME) {
+				fprintf(stderr, "%s: %s grows as N^%.2f\n",
+				        Prog, tools[t], growth);
+				ret = 2;
+			}
+		}
+		/* Two blank lines separate the gnuplot data blocks */
+		printf("\n\n");
+	}
+	return ret;
+}
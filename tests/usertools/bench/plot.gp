@@ -0,0 +1,24 @@
+# Plots the results of bench_tools against the number of users:
+#	./bench_tools > bench_tools.dat && gnuplot plot.gp
+
+tools = "useradd usermod gpasswd groupadd chpasswd newusers userdel"
+
+set terminal pngcairo size 1200,900
+set output "bench_tools.png"
+set logscale xy
+set xlabel "users"
+set key left top
+set multiplot layout 2,3
+
+set title "wall time (ms)"
+plot for [i=0:6] "bench_tools.dat" index i using 1:2 with linespoints title word(tools, i + 1)
+set title "system calls"
+plot for [i=0:6] "bench_tools.dat" index i using 1:3 with linespoints title word(tools, i + 1)
+set title "bytes written"
+plot for [i=0:6] "bench_tools.dat" index i using 1:4 with linespoints title word(tools, i + 1)
+set title "peak RSS (kB)"
+plot for [i=0:6] "bench_tools.dat" index i using 1:5 with linespoints title word(tools, i + 1)
+set title "lock hold time (ms)"
+plot for [i=0:6] "bench_tools.dat" index i using 1:6 with linespoints title word(tools, i + 1)
+
+unset multiplot